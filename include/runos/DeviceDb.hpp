@@ -21,11 +21,14 @@
 #include <runos/core/exception.hpp>
 #include <runos/core/ptr.hpp>
 
-#include <any>
 #include <array>
+#include <cstdint>
+#include <optional>
 #include <string>
 #include <type_traits>
 #include <string_view>
+#include <variant>
+#include <vector>
 
 namespace runos {
 
@@ -34,7 +37,41 @@ class QueryBuilder;
 
 namespace devicedb {
 
-using ResultSet = std::vector<std::pair<std::string_view, std::any>>;
+// Property name interned into a small integer. Ids are process-wide and
+// dense, so property owners keep values in flat arrays indexed by them.
+// Intern frequently used names once and keep the key around.
+class PropertyKey final
+{
+public:
+    static PropertyKey intern(std::string_view name);
+    // Doesn't intern unknown names
+    static std::optional<PropertyKey> find(std::string_view name);
+
+    uint32_t id() const noexcept { return m_id; }
+    std::string_view name() const;
+
+    friend bool operator==(PropertyKey lhs, PropertyKey rhs) noexcept
+    { return lhs.m_id == rhs.m_id; }
+    friend bool operator!=(PropertyKey lhs, PropertyKey rhs) noexcept
+    { return lhs.m_id != rhs.m_id; }
+
+private:
+    explicit PropertyKey(uint32_t id) noexcept
+        : m_id(id)
+    { }
+
+    uint32_t m_id;
+};
+
+// Same alternatives as property_sheet::Value
+using Value = std::variant<std::string_view, int64_t, bool>;
+
+struct Property {
+    PropertyKey key;
+    Value value;
+};
+
+using ResultSet = std::vector<Property>;
 
 class QueryBuilder final
 {
@@ -89,6 +126,11 @@ public:
     DeviceDb( Rc<ResourceLocator> locator = ResourceLocator::get() );
     ~DeviceDb( );
 
+    // Props files are compiled into `path` when first loaded and
+    // mapped from there while their content stays the same, so their
+    // preprocessing runs once. One file is kept, empty disables it.
+    void cache_compiled(std::string path);
+
     size_t add_default();
     size_t add_props_file(std::string_view filename);
     size_t add_json_file(std::string_view filepath);
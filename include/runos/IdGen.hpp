@@ -19,8 +19,11 @@
 #include <runos/core/exception.hpp>
 #include <json.hpp>
 
+#include <atomic>
 #include <cstdint>
+#include <memory>
 #include <mutex>
+#include <unordered_map>
 #include <vector>
 
 namespace runos {
@@ -28,6 +31,10 @@ using json = nlohmann::json;
 
 /*! Builds a pool of identifiers over a continuous range of integers
  *  and provides safe concurent access to contents of this pool
+ *
+ *  Free identifiers are kept in a 64-ary tree of bitmaps, so acquire
+ *  and release are O(log64 capacity). Bitmap pages are allocated on
+ *  first use, memory is proportional to the identifiers handed out.
  */
 class IdGen {
 public:
@@ -48,6 +55,9 @@ public:
 
     //! get an unused identifier from the pool
     uint64_t acquire();
+
+    //! get @n unused identifiers at once, all or nothing
+    std::vector<uint64_t> acquire_n(uint64_t n);
     
     //! recovery generator's configuration
     void recovery(const std::vector<uint64_t> &booked_ids);
@@ -71,14 +81,32 @@ private:
     /// leave backdoor for unit testing
     friend class IdGenTester;
 
-    struct segment {
-        segment(uint64_t first, uint64_t last) :
-            first(first), last(last) {}
-        uint64_t first, last;
+    // One level of the tree: bit is set when the identifier (or the
+    // whole word below it) is free. Missing pages are entirely free.
+    class level {
+    public:
+        explicit level(uint64_t bits) : bits(bits) {}
+        uint64_t word(uint64_t index) const;
+        uint64_t& word_ref(uint64_t index);
+        template<class F> void for_each_page(F&& f) const;
+        void clear() { pages.clear(); }
+
+        const uint64_t bits;
+        static constexpr uint64_t page_words = 512;
+    private:
+        uint64_t full_word(uint64_t index) const;
+        std::unordered_map<uint64_t, std::unique_ptr<uint64_t[]>> pages;
     };
 
+    uint64_t find_free() const;
+    bool is_free(uint64_t offset) const;
+    void take(uint64_t offset);
+    void put(uint64_t offset);
+    void reset();
+
     acquire_order order;
-    std::vector<segment> pool;
+    std::vector<level> levels; // leaves first, single word at the top
+    std::atomic<uint64_t> unused_;
     mutable std::mutex mut;
 };
 
@@ -18,6 +18,7 @@
 #include <runos/core/throw.hpp>
 #include <json11.hpp>
 
+#include <memory>
 #include <regex>
 #include <vector>
 #include <variant>
@@ -156,6 +157,8 @@ namespace property_sheet {
 
         std::regex re;
         CheckerList smatch;
+        // Literal text every match starts with, if the regex is anchored
+        std::optional<std::string> prefix;
     };
 
     template<>
@@ -164,6 +167,10 @@ namespace property_sheet {
         FuzzyMatch operator()(Json const& jobj) const;
     };
 
+    // Version checks of submatch groups, checked against the regex
+    using VersionChecks = std::vector< std::pair<size_t, VersionChecker> >;
+    FuzzyMatch make_fuzzy(std::string const& re, VersionChecks checks);
+
     template<>
     struct DoMatch<FuzzyMatch> {
         static constexpr size_t score = 2;
@@ -252,9 +259,9 @@ public:
     using Score = std::vector<size_t>;
     using PropSet = std::vector<Property>;
 
-    explicit PropertySheet(size_t columns)
-        : columns(columns)
-    { }
+    explicit PropertySheet(size_t columns);
+    PropertySheet(PropertySheet&&) noexcept;
+    ~PropertySheet();
 
     void append(Entry e);
     void append(std::vector<Match> selector,
@@ -279,9 +286,17 @@ public:
                           const std::string_view* begin,
                           const std::string_view* end) const;
 
+    // Memoize query results by the values of `key_columns`.
+    // Only entries matching anything on the other columns are cached,
+    // the rest are still matched on every query.
+    void memoize(std::vector<size_t> key_columns);
+
 private:
+    struct Index;
+
     size_t columns;
     std::vector<Entry> entries;
+    std::unique_ptr<Index> index;
 };
 
 } // runos
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <runos/core/logging.hpp>
+#include <runos/core/nothrow_format.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace runos {
+namespace async_log {
+
+/**
+ * Asynchronous logging for hot paths.
+ *
+ * ALOG(severity, format, args...) copies the arguments into a ring owned
+ * by the calling thread and returns. Formatting with fmt and writing to
+ * glog (and syslog, like LOG) happen later on a background thread, so
+ * the caller never takes glog's mutex. A full ring drops the record;
+ * the number of dropped records is reported by the flusher.
+ *
+ * Records keep their original timestamps for ordering, but glog stamps
+ * them with the time they are flushed. FATAL is not supported, use LOG.
+ *
+ * C strings are copied at the call site, all other arguments are stored
+ * by value and must stay valid to format after the caller returns.
+ */
+
+struct Record {
+    static constexpr size_t args_capacity = 192;
+
+    // Formats the stored arguments and destroys them
+    std::string (*format)(void* args);
+    const char* file;
+    int line;
+    int severity;
+    int64_t ts_ns;
+    alignas(std::max_align_t) unsigned char args[args_capacity];
+};
+
+// Returns a slot to fill or nullptr if the ring of this thread is full
+Record* reserve();
+// Publishes the slot returned by the last reserve()
+void commit();
+
+// Writes out everything recorded so far, blocks the caller
+void flush();
+
+uint64_t dropped();
+
+namespace detail {
+
+template<class T>
+struct stored { using type = std::decay_t<T>; };
+template<>
+struct stored<const char*> { using type = std::string; };
+template<>
+struct stored<char*> { using type = std::string; };
+template<class T>
+using stored_t = typename stored<std::decay_t<T>>::type;
+
+template<class Tuple, size_t... I>
+std::string format_tuple(Tuple& t, std::index_sequence<I...>)
+{
+    return nothrow_format(std::get<0>(t), std::get<I + 1>(t)...);
+}
+
+template<class Tuple>
+std::string format_stored(void* p)
+{
+    auto& t = *static_cast<Tuple*>(p);
+    constexpr auto n = std::tuple_size<Tuple>::value - 1;
+    std::string ret = format_tuple(t, std::make_index_sequence<n>());
+    t.~Tuple();
+    return ret;
+}
+
+inline std::string stored_string(void* p)
+{
+    auto& s = *static_cast<std::string*>(p);
+    std::string ret = std::move(s);
+    s.~basic_string();
+    return ret;
+}
+
+inline int64_t now_ns()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(
+                system_clock::now().time_since_epoch()).count();
+}
+
+// Counts messages of one call site per switch. Two switches hashed to
+// the same slot share the counter, which only makes logging sparser.
+class every_n_per_dpid {
+public:
+    // Returns true on the 1st, (n+1)th, ... call for the dpid and sets
+    // `suppressed` to the number of calls skipped since the previous one
+    bool operator()(uint64_t dpid, uint64_t n, uint64_t& suppressed)
+    {
+        auto& counter = counters_[(dpid * 0x9e3779b97f4a7c15ull) >> 56];
+        uint64_t count = counter.fetch_add(1, std::memory_order_relaxed);
+        if (n == 0 || count % n != 0)
+            return false;
+        suppressed = count == 0 ? 0 : n - 1;
+        return true;
+    }
+
+private:
+    std::atomic<uint64_t> counters_[256] {};
+};
+
+} // namespace detail
+
+template<class... Args>
+void write(int severity, const char* file, int line,
+           const char* format, Args&&... args)
+{
+    Record* r = reserve();
+    if (not r)
+        return;
+
+    r->file = file;
+    r->line = line;
+    r->severity = severity;
+    r->ts_ns = detail::now_ns();
+
+    using Tuple = std::tuple<const char*, detail::stored_t<Args>...>;
+    if (sizeof(Tuple) <= Record::args_capacity &&
+        alignof(Tuple) <= alignof(std::max_align_t))
+    {
+        new (r->args) Tuple(format, std::forward<Args>(args)...);
+        r->format = &detail::format_stored<Tuple>;
+    } else {
+        new (r->args) std::string(nothrow_format(format, args...));
+        r->format = &detail::stored_string;
+    }
+    commit();
+}
+
+} // namespace async_log
+} // namespace runos
+
+#define ALOG(severity, ...) \
+    ::runos::async_log::write(::google::GLOG_##severity, \
+                              __FILE__, __LINE__, __VA_ARGS__)
+
+#define AVLOG(verboselevel, ...) \
+    (VLOG_IS_ON(verboselevel) ? ALOG(INFO, __VA_ARGS__) : (void) 0)
+
+// Logs the first and then every n-th message of this call site for each
+// switch, telling how many were skipped in between.
+#define LOG_EVERY_N_PER_DPID(severity, n, dpid, format, ...) \
+    do { \
+        static ::runos::async_log::detail::every_n_per_dpid every_n_; \
+        uint64_t suppressed_; \
+        if (every_n_((dpid), (n), suppressed_)) { \
+            if (suppressed_) \
+                ALOG(severity, format " ({} similar suppressed)", \
+                     ##__VA_ARGS__, suppressed_); \
+            else \
+                ALOG(severity, format, ##__VA_ARGS__); \
+        } \
+    } while (false)
@@ -21,6 +21,8 @@ namespace crash_reporter {
 
 void setup(const char* dump_path);
 void snapshot();
+// Runs in snapshot() before the minidump, must be async-signal-safe
+void on_snapshot(void (*hook)());
 
 } // crash_reporter
 } // runos
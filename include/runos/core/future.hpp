@@ -22,6 +22,7 @@
 #include <boost/thread/future.hpp>
 #include <boost/thread/futures/wait_for_all.hpp>
 #include <boost/thread/futures/wait_for_any.hpp>
+#include <boost/pool/pool_alloc.hpp>
 
 namespace runos {
 
@@ -30,4 +31,25 @@ using boost::when_all;
 using boost::when_any;
 using boost::make_ready_future;
 
+/**
+ * Promise which takes its shared state from a pool.
+ *
+ * Shared states of one type are all the same size, so a high-rate
+ * request path can reuse freed ones instead of going to the heap.
+ * Behaves exactly like promise<T> otherwise.
+ */
+template<class T>
+class pooled_promise : public promise<T> {
+public:
+#if defined BOOST_THREAD_PROVIDES_FUTURE_CTOR_ALLOCATORS
+    pooled_promise()
+        : promise<T>(boost::allocator_arg, boost::fast_pool_allocator<char>())
+    { }
+#else
+    pooled_promise() = default;
+#endif
+    pooled_promise(pooled_promise&&) = default;
+    pooled_promise& operator=(pooled_promise&&) = default;
+};
+
 } // namespace
@@ -0,0 +1,983 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Switch emulator driving a running controller, in the spirit of cbench.
+// Connect storms measure the handshake, traffic phase measures PacketIn
+// to PacketOut/FlowMod latency and throughput, multipart requests are
+// answered with configurable bodies.
+
+#include "replay.hpp"
+#include "rest_load.hpp"
+#include "switch_emulator.hpp"
+
+#include <cxxopts.hpp>
+#include <json.hpp>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <csignal>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using namespace runos::bench;
+using json = nlohmann::json;
+
+namespace {
+
+std::atomic_bool interrupted {false};
+
+struct worker {
+    std::vector<std::unique_ptr<switch_emulator>> switches;
+    std::vector<const replay_script*> scripts; // by switch, replay only
+    counters stats;
+    std::thread thread;
+};
+
+// Level-triggered epoll over the switches of one worker
+class event_loop {
+public:
+    explicit event_loop(worker& w)
+        : w_(w)
+        , epfd_(::epoll_create1(0))
+        , armed_(w.switches.size(), false)
+        , retry_at_(w.switches.size())
+    { }
+
+    ~event_loop() { ::close(epfd_); }
+
+    void connect(size_t i, clock::time_point now)
+    {
+        int fd = w_.switches[i]->connect(now);
+        if (fd < 0) {
+            retry_at_[i] = now + std::chrono::milliseconds(100);
+            return;
+        }
+        epoll_event ev {};
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.u64 = i;
+        ::epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+        armed_[i] = true;
+    }
+
+    void connect_all(clock::time_point now)
+    {
+        for (size_t i = 0; i < w_.switches.size(); ++i)
+            connect(i, now);
+    }
+
+    void close_all()
+    {
+        for (auto& sw : w_.switches)
+            sw->close();
+    }
+
+    // Handles events for up to `timeout`, reconnects dropped switches
+    // if `reconnect` is set
+    void poll(std::chrono::milliseconds timeout, bool reconnect)
+    {
+        epoll_event events[256];
+        int n = ::epoll_wait(epfd_, events, 256, int(timeout.count()));
+        auto now = clock::now();
+
+        for (int k = 0; k < n; ++k) {
+            size_t i = events[k].data.u64;
+            auto& sw = *w_.switches[i];
+            if (sw.fd() < 0)
+                continue;
+            bool ok = true;
+            if (events[k].events & (EPOLLERR | EPOLLHUP))
+                ok = false;
+            if (ok && (events[k].events & EPOLLOUT))
+                ok = sw.on_writable(now);
+            if (ok && (events[k].events & EPOLLIN))
+                ok = sw.on_readable(now);
+            if (not ok)
+                drop(i, now);
+        }
+
+        for (size_t i = 0; i < w_.switches.size(); ++i) {
+            auto& sw = *w_.switches[i];
+            if (sw.fd() < 0) {
+                if (reconnect && now >= retry_at_[i])
+                    connect(i, now);
+                continue;
+            }
+            update(i);
+        }
+    }
+
+    void drop(size_t i, clock::time_point now)
+    {
+        w_.switches[i]->close();
+        w_.stats.add(w_.stats.disconnects);
+        retry_at_[i] = now + std::chrono::milliseconds(100);
+    }
+
+    void update(size_t i)
+    {
+        auto& sw = *w_.switches[i];
+        bool want = sw.wants_write() || not sw.ready();
+        if (want == armed_[i])
+            return;
+        epoll_event ev {};
+        ev.events = EPOLLIN | (want ? uint32_t(EPOLLOUT) : 0u);
+        ev.data.u64 = i;
+        ::epoll_ctl(epfd_, EPOLL_CTL_MOD, sw.fd(), &ev);
+        armed_[i] = want;
+    }
+
+private:
+    worker& w_;
+    int epfd_;
+    std::vector<bool> armed_;
+    std::vector<clock::time_point> retry_at_;
+};
+
+// Connects all switches of the worker and waits until each got a FlowMod
+void storm(worker& w, clock::time_point deadline)
+{
+    event_loop loop(w);
+    loop.connect_all(clock::now());
+    while (not interrupted && clock::now() < deadline) {
+        loop.poll(std::chrono::milliseconds(1), false);
+        bool done = std::all_of(w.switches.begin(), w.switches.end(),
+                                [](auto& sw) { return sw->set_up(); });
+        if (done)
+            break;
+    }
+    loop.close_all();
+}
+
+void traffic(worker& w, const settings& s, double rate,
+             clock::time_point measure_from, const std::atomic_bool& stop)
+{
+    event_loop loop(w);
+    loop.connect_all(clock::now());
+
+    const bool unlimited = rate <= 0;
+    const unsigned chunk = s.window > 0 ? s.window : 64;
+    double tokens = 0;
+    bool measuring = false;
+    auto last = clock::now();
+    auto next_expire = last;
+
+    while (not stop && not interrupted) {
+        loop.poll(std::chrono::milliseconds(1), true);
+        auto now = clock::now();
+
+        if (not measuring && now >= measure_from) {
+            // warm-up latencies don't count
+            w.stats.latency = histogram();
+            measuring = true;
+        }
+
+        unsigned budget = UINT32_MAX;
+        if (not unlimited) {
+            double dt = std::chrono::duration<double>(now - last).count();
+            tokens = std::min(tokens + rate * dt, std::max(1.0, rate * 0.01));
+            budget = unsigned(tokens);
+        }
+        last = now;
+
+        unsigned sent = 0;
+        bool progress = true;
+        while (budget > sent && progress) {
+            progress = false;
+            for (auto& sw : w.switches) {
+                if (budget == sent)
+                    break;
+                if (sw->fd() < 0 || sw->wants_write())
+                    continue;
+                unsigned n = unlimited ? chunk
+                                       : std::max(1u, (budget - sent) /
+                                                      unsigned(w.switches.size()));
+                n = sw->send_packet_ins(std::min(n, budget - sent), now);
+                sent += n;
+                progress = progress || n > 0;
+            }
+            if (unlimited)
+                break;
+        }
+        tokens -= sent;
+
+        if (now >= next_expire) {
+            for (auto& sw : w.switches)
+                sw->expire(now);
+            next_expire = now + std::chrono::milliseconds(50);
+        }
+    }
+    loop.close_all();
+}
+
+struct totals {
+    uint64_t packet_ins = 0;
+    uint64_t responses = 0;
+    uint64_t answered = 0;
+    uint64_t timed_out = 0;
+    uint64_t multipart = 0;
+    uint64_t multipart_bytes = 0;
+    uint64_t barriers = 0;
+    uint64_t handshakes = 0;
+    uint64_t disconnects = 0;
+
+    totals operator-(const totals& o) const
+    {
+        totals r;
+        r.packet_ins = packet_ins - o.packet_ins;
+        r.responses = responses - o.responses;
+        r.answered = answered - o.answered;
+        r.timed_out = timed_out - o.timed_out;
+        r.multipart = multipart - o.multipart;
+        r.multipart_bytes = multipart_bytes - o.multipart_bytes;
+        r.barriers = barriers - o.barriers;
+        r.handshakes = handshakes - o.handshakes;
+        r.disconnects = disconnects - o.disconnects;
+        return r;
+    }
+};
+
+totals sum(const std::vector<std::unique_ptr<worker>>& workers)
+{
+    totals t;
+    for (auto& w : workers) {
+        auto get = [](const std::atomic<uint64_t>& c) {
+            return c.load(std::memory_order_relaxed);
+        };
+        t.packet_ins += get(w->stats.packet_ins);
+        t.responses += get(w->stats.packet_outs) + get(w->stats.flow_mods);
+        t.answered += get(w->stats.answered);
+        t.timed_out += get(w->stats.timed_out);
+        t.multipart += get(w->stats.multipart);
+        t.multipart_bytes += get(w->stats.multipart_bytes);
+        t.barriers += get(w->stats.barriers);
+        t.handshakes += get(w->stats.handshakes);
+        t.disconnects += get(w->stats.disconnects);
+    }
+    return t;
+}
+
+json latency_json(const histogram& h)
+{
+    auto us = [](histogram::nanoseconds d) { return d.count() / 1000.0; };
+    return {
+        {"count", h.count()},
+        {"min_us", us(h.min())},
+        {"mean_us", us(h.mean())},
+        {"p50_us", us(h.percentile(50))},
+        {"p90_us", us(h.percentile(90))},
+        {"p99_us", us(h.percentile(99))},
+        {"p999_us", us(h.percentile(99.9))},
+        {"max_us", us(h.max())},
+    };
+}
+
+void print_latency(const char* name, const histogram& h)
+{
+    auto us = [](histogram::nanoseconds d) { return d.count() / 1000.0; };
+    std::cout << std::fixed << std::setprecision(1)
+              << name << " us (" << h.count() << " samples):"
+              << " min " << us(h.min())
+              << " p50 " << us(h.percentile(50))
+              << " p90 " << us(h.percentile(90))
+              << " p99 " << us(h.percentile(99))
+              << " p99.9 " << us(h.percentile(99.9))
+              << " max " << us(h.max())
+              << " mean " << us(h.mean()) << "\n";
+}
+
+struct phase {
+    json report;
+    histogram latency;
+    histogram loop_lag;                 // only with a REST address
+    std::vector<rest_counters> rest;    // only under REST load
+};
+
+// Largest current lag of the controller event loops, from /event-loop/
+bool sample_loop_lag(rest_client& client, histogram& lag)
+{
+    std::string body;
+    if (client.get("/event-loop/", body) != 200)
+        return false;
+    auto doc = json::parse(body, nullptr, false);
+    if (doc.is_discarded() || doc.count("threads") == 0)
+        return false;
+    int64_t max_us = 0;
+    for (const auto& t : doc["threads"]) {
+        max_us = std::max<int64_t>(max_us, t.value("lag_us", int64_t(0)));
+    }
+    lag.record(std::chrono::microseconds(max_us));
+    return true;
+}
+
+// PacketIn traffic for warmup + duration. With `rest` the controller
+// event loops are sampled every second, with `load` as well the REST
+// mix runs alongside.
+phase traffic_phase(std::vector<std::unique_ptr<worker>>& workers,
+                    const settings& s, std::chrono::seconds warmup,
+                    std::chrono::seconds duration,
+                    const rest_settings* rest, bool load,
+                    const char* name, bool as_json)
+{
+    phase ret;
+    std::atomic_bool stop {false};
+    auto start = clock::now();
+    auto measure_from = start + warmup;
+    auto until = measure_from + duration;
+
+    for (auto& w : workers) {
+        w->stats.latency = histogram();
+        double share = s.rate * double(w->switches.size()) / s.switches;
+        w->thread = std::thread(traffic, std::ref(*w), std::cref(s),
+                                share, measure_from, std::cref(stop));
+    }
+
+    std::vector<std::vector<rest_counters>> rest_stats;
+    std::vector<std::thread> rest_threads;
+    if (load) {
+        rest_stats.assign(rest->threads,
+                          std::vector<rest_counters>(rest->mix.size()));
+        for (unsigned t = 0; t < rest->threads; ++t) {
+            rest_threads.emplace_back(rest_load, std::cref(*rest),
+                                      rest->rate / rest->threads,
+                                      size_t(t), std::ref(rest_stats[t]),
+                                      measure_from, std::cref(stop));
+        }
+    }
+    std::unique_ptr<rest_client> monitor;
+    if (rest) {
+        monitor = std::make_unique<rest_client>(*rest);
+    }
+
+    totals base;
+    auto tick = start;
+    const auto initial = sum(workers);
+    auto prev = initial;
+    bool measuring = false;
+    while (not interrupted) {
+        tick += std::chrono::seconds(1);
+        if (not measuring && tick > measure_from)
+            tick = measure_from;
+        std::this_thread::sleep_until(std::min(tick, until));
+        auto now = sum(workers);
+        if (not measuring && clock::now() >= measure_from) {
+            base = now;
+            measuring = true;
+        }
+        if (clock::now() >= until)
+            break;
+        if (measuring && monitor) {
+            sample_loop_lag(*monitor, ret.loop_lag);
+        }
+        auto d = now - prev;
+        auto since_start = now - initial;
+        prev = now;
+        std::cerr << (measuring ? "" : "warmup ")
+                  << "packet_in/s " << d.packet_ins
+                  << " responses/s " << d.responses
+                  << " answered/s " << d.answered
+                  << " timed out " << d.timed_out
+                  << " multipart/s " << d.multipart
+                  << " connected "
+                  << since_start.handshakes - since_start.disconnects
+                  << "\n";
+    }
+    auto elapsed = std::chrono::duration<double>(
+                       std::min(clock::now(), until) - measure_from).count();
+    auto total = sum(workers) - base;
+    stop = true;
+    for (auto& w : workers) {
+        w->thread.join();
+    }
+    for (auto& t : rest_threads) {
+        t.join();
+    }
+
+    for (auto& w : workers) {
+        ret.latency.merge(w->stats.latency);
+    }
+    if (load) {
+        ret.rest.resize(rest->mix.size());
+        for (const auto& per_thread : rest_stats) {
+            for (size_t i = 0; i < per_thread.size(); ++i)
+                ret.rest[i].merge(per_thread[i]);
+        }
+    }
+
+    elapsed = std::max(elapsed, 1e-3);
+    auto per_sec = [elapsed](uint64_t n) { return n / elapsed; };
+    ret.report = {
+        {"seconds", elapsed},
+        {"packet_in_per_sec", per_sec(total.packet_ins)},
+        {"responses_per_sec", per_sec(total.responses)},
+        {"answered_per_sec", per_sec(total.answered)},
+        {"timed_out", total.timed_out},
+        {"multipart_per_sec", per_sec(total.multipart)},
+        {"multipart_bytes_per_sec", per_sec(total.multipart_bytes)},
+        {"barriers_per_sec", per_sec(total.barriers)},
+        {"disconnects", total.disconnects},
+        {"latency", latency_json(ret.latency)},
+    };
+    if (rest) {
+        ret.report["event_loop_lag"] = latency_json(ret.loop_lag);
+    }
+    if (load) {
+        json endpoints = json::array();
+        for (size_t i = 0; i < ret.rest.size(); ++i) {
+            const auto& c = ret.rest[i];
+            endpoints.push_back({
+                {"path", rest->mix[i].path},
+                {"requests_per_sec", per_sec(c.requests)},
+                {"errors", c.errors},
+                {"bytes_per_sec", per_sec(c.bytes)},
+                {"latency", latency_json(c.latency)},
+            });
+        }
+        ret.report["rest"] = std::move(endpoints);
+    }
+
+    if (not as_json) {
+        std::cout << std::fixed << std::setprecision(1)
+                  << name << ": " << elapsed << " s, "
+                  << s.switches << " switches, window " << s.window
+                  << ", rate " << (s.rate > 0 ? std::to_string(s.rate)
+                                              : std::string("unlimited"))
+                  << "\n  packet_in/s " << per_sec(total.packet_ins)
+                  << ", responses/s " << per_sec(total.responses)
+                  << ", answered/s " << per_sec(total.answered)
+                  << ", timed out " << total.timed_out
+                  << ", disconnects " << total.disconnects << "\n"
+                  << "  multipart/s " << per_sec(total.multipart)
+                  << " (" << per_sec(total.multipart_bytes) / 1024
+                  << " KiB/s), barriers/s " << per_sec(total.barriers)
+                  << "\n";
+        print_latency("  PacketIn -> response", ret.latency);
+        if (rest) {
+            print_latency("  event loop lag", ret.loop_lag);
+        }
+        for (size_t i = 0; i < ret.rest.size(); ++i) {
+            const auto& c = ret.rest[i];
+            std::cout << "  GET " << rest->mix[i].path << ": "
+                      << per_sec(c.requests) << " req/s, "
+                      << c.errors << " errors, "
+                      << per_sec(c.bytes) / 1024 << " KiB/s\n";
+            print_latency("    latency", c.latency);
+        }
+    }
+    return ret;
+}
+
+// Plays the scripts of the worker's switches back, `speed` times faster
+// than recorded or as fast as they take it with 0, then keeps them
+// connected for the responses until `stop`
+void replay(worker& w, double speed, clock::time_point start,
+            std::atomic<unsigned>& left, const std::atomic_bool& stop)
+{
+    using std::chrono::nanoseconds;
+    auto at = [speed, start](uint64_t offset_ns) {
+        if (speed <= 0)
+            return start;
+        return start + std::chrono::duration_cast<clock::duration>(
+                           nanoseconds(uint64_t(double(offset_ns) / speed)));
+    };
+
+    event_loop loop(w);
+    std::vector<size_t> next(w.switches.size(), 0);
+    std::vector<clock::time_point> retry(w.switches.size(), start);
+    auto next_expire = start;
+
+    while (not stop && not interrupted) {
+        loop.poll(std::chrono::milliseconds(1), false);
+        auto now = clock::now();
+
+        for (size_t i = 0; i < w.switches.size(); ++i) {
+            auto& sw = *w.switches[i];
+            const auto& script = *w.scripts[i];
+            if (sw.fd() < 0) {
+                if (now >= retry[i] && now >= at(script.first_ns)) {
+                    loop.connect(i, now);
+                    retry[i] = now + std::chrono::milliseconds(100);
+                }
+                continue;
+            }
+            if (not sw.ready() || next[i] == script.async.size())
+                continue;
+            while (next[i] < script.async.size()) {
+                const auto* msg = script.async[next[i]];
+                if (at(msg->ts_ns) > now)
+                    break;
+                sw.replay(msg->data, now);
+                if (++next[i] == script.async.size())
+                    --left;
+            }
+            loop.update(i);
+        }
+
+        if (now >= next_expire) {
+            for (auto& sw : w.switches)
+                sw->expire(now);
+            next_expire = now + std::chrono::milliseconds(50);
+        }
+    }
+    loop.close_all();
+}
+
+// Percent change of `key` of the replay report against the baseline
+double change(const json& now, const json& base, const char* section,
+              const char* key)
+{
+    auto get = [&](const json& j) {
+        const json& sub = section ? j.at(section) : j;
+        return sub.at(key).get<double>();
+    };
+    double b = get(base);
+    return b != 0 ? (get(now) - b) / b * 100.0 : 0.0;
+}
+
+int run_replay(settings s, const std::string& path, double speed,
+               std::chrono::seconds drain, std::chrono::seconds setup_timeout,
+               const std::string& baseline_path, double tolerance,
+               bool as_json)
+{
+    capture recorded;
+    try {
+        recorded = read_capture(path);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+    auto scripts = make_scripts(recorded);
+    if (scripts.empty()) {
+        std::cerr << "No OpenFlow messages in " << path << std::endl;
+        return 2;
+    }
+    // timestamps relative to the capture start, as first_ns
+    const uint64_t capture_start = recorded.messages.front().ts_ns;
+    for (auto& msg : recorded.messages)
+        msg.ts_ns -= capture_start;
+    const uint64_t last_ns = recorded.messages.back().ts_ns;
+
+    s.switches = unsigned(scripts.size());
+    s.threads = std::max(1u, std::min(s.threads, s.switches));
+    s.window = 0;
+    s.track_flow_mods = true;
+
+    std::vector<std::unique_ptr<worker>> workers;
+    for (unsigned t = 0; t < s.threads; ++t)
+        workers.push_back(std::make_unique<worker>());
+    uint64_t recorded_async = 0, recorded_flow_mods = 0;
+    unsigned with_async = 0, k = 0;
+    std::unordered_map<uint64_t, uint64_t> recorded_kinds;
+    for (const auto& it : scripts) {
+        auto& w = *workers[k++ % s.threads];
+        const auto& script = it.second;
+        w.switches.push_back(std::make_unique<switch_emulator>(
+            s, script.dpid, w.stats));
+        w.switches.back()->set_script(&script);
+        w.scripts.push_back(&script);
+        recorded_async += script.async.size();
+        recorded_flow_mods += script.flow_mods;
+        for (const auto& kind : script.flow_mod_kinds)
+            recorded_kinds[kind.first] += kind.second;
+        with_async += script.async.empty() ? 0 : 1;
+    }
+
+    std::atomic_bool stop {false};
+    std::atomic<unsigned> left {with_async};
+    auto start = clock::now();
+    for (auto& w : workers) {
+        w->thread = std::thread(replay, std::ref(*w), speed, start,
+                                std::ref(left), std::cref(stop));
+    }
+
+    // until everything is sent and answered, or it takes far too long
+    auto played = speed > 0
+        ? std::chrono::duration_cast<clock::duration>(
+              std::chrono::nanoseconds(uint64_t(double(last_ns) / speed)))
+        : clock::duration::zero();
+    auto deadline = start + played + setup_timeout + drain;
+    clock::time_point sent_at {};
+    auto prev = sum(workers);
+    auto tick = start;
+    while (not interrupted) {
+        tick += std::chrono::seconds(1);
+        auto now = clock::now();
+        if (left == 0 && sent_at == clock::time_point())
+            sent_at = now;
+        if (sent_at != clock::time_point() && now >= sent_at + drain)
+            break;
+        if (now >= deadline)
+            break;
+        std::this_thread::sleep_until(std::min(tick, deadline));
+        auto cur = sum(workers);
+        auto d = cur - prev;
+        prev = cur;
+        std::cerr << "packet_in/s " << d.packet_ins
+                  << " responses/s " << d.responses
+                  << " answered/s " << d.answered
+                  << " multipart/s " << d.multipart
+                  << " connected " << cur.handshakes - cur.disconnects
+                  << " switches left " << left << "\n";
+    }
+    auto elapsed = std::max(std::chrono::duration<double>(
+                                clock::now() - start).count(), 1e-3);
+    stop = true;
+    for (auto& w : workers) {
+        w->thread.join();
+    }
+
+    auto total = sum(workers);
+    histogram latency;
+    uint64_t replayed = 0, emitted = 0;
+    std::unordered_map<uint64_t, uint64_t> kinds;
+    for (auto& w : workers) {
+        latency.merge(w->stats.latency);
+        replayed += w->stats.replayed;
+        emitted += w->stats.flow_mods;
+        for (const auto& kind : w->stats.flow_mod_kinds)
+            kinds[kind.first] += kind.second;
+    }
+    uint64_t matched = 0, tracked = 0;
+    for (const auto& kind : kinds) {
+        tracked += kind.second;
+        auto it = recorded_kinds.find(kind.first);
+        if (it != recorded_kinds.end())
+            matched += std::min(it->second, kind.second);
+    }
+    uint64_t recorded_tracked = 0;
+    for (const auto& kind : recorded_kinds)
+        recorded_tracked += kind.second;
+
+    auto per_sec = [elapsed](uint64_t n) { return n / elapsed; };
+    json result = {
+        {"capture", path},
+        {"speed", speed},
+        {"switches", s.switches},
+        {"truncated", recorded.truncated},
+        {"replay", {
+            {"seconds", elapsed},
+            {"recorded", recorded_async},
+            {"replayed", replayed},
+            {"complete", left == 0},
+            {"packet_in_per_sec", per_sec(total.packet_ins)},
+            {"responses_per_sec", per_sec(total.responses)},
+            {"answered", total.answered},
+            {"timed_out", total.timed_out},
+            {"multipart_per_sec", per_sec(total.multipart)},
+            {"disconnects", total.disconnects},
+            {"latency", latency_json(latency)},
+            {"flow_mods", {
+                {"recorded", recorded_flow_mods},
+                {"emitted", emitted},
+                {"matched", matched},
+                {"missing", recorded_tracked - std::min(recorded_tracked,
+                                                        matched)},
+                {"extra", tracked - matched},
+            }},
+        }},
+    };
+
+    if (not as_json) {
+        std::cout << std::fixed << std::setprecision(1)
+                  << "replay of " << path << ": " << elapsed << " s, "
+                  << s.switches << " switches, speed "
+                  << (speed > 0 ? std::to_string(speed)
+                                : std::string("unlimited"))
+                  << "\n  replayed " << replayed << "/" << recorded_async
+                  << " messages" << (left == 0 ? "" : " (incomplete)")
+                  << ", packet_in/s " << per_sec(total.packet_ins)
+                  << ", responses/s " << per_sec(total.responses)
+                  << ", timed out " << total.timed_out
+                  << ", disconnects " << total.disconnects << "\n"
+                  << "  FlowMods: recorded " << recorded_flow_mods
+                  << ", emitted " << emitted << ", matched " << matched
+                  << ", missing " << recorded_tracked -
+                                     std::min(recorded_tracked, matched)
+                  << ", extra " << tracked - matched << "\n";
+        print_latency("  PacketIn -> response", latency);
+    }
+
+    int ret = interrupted ? 1 : 0;
+    if (not baseline_path.empty()) {
+        std::ifstream in(baseline_path);
+        auto base = json::parse(in, nullptr, false);
+        if (base.is_discarded() || base.count("replay") == 0) {
+            std::cerr << "Bad baseline " << baseline_path << std::endl;
+            return 2;
+        }
+        const auto& now = result["replay"];
+        const auto& then = base["replay"];
+        json diff = {
+            {"p50_pct", change(now, then, "latency", "p50_us")},
+            {"p99_pct", change(now, then, "latency", "p99_us")},
+            {"responses_pct", change(now, then, nullptr,
+                                     "responses_per_sec")},
+            {"flow_mods_pct", change(now.at("flow_mods"),
+                                     then.at("flow_mods"), nullptr,
+                                     "emitted")},
+        };
+        bool regressed =
+            diff["p50_pct"].get<double>() > tolerance ||
+            diff["p99_pct"].get<double>() > tolerance ||
+            diff["responses_pct"].get<double>() < -tolerance ||
+            std::abs(diff["flow_mods_pct"].get<double>()) > tolerance;
+        diff["regressed"] = regressed;
+        result["baseline"] = diff;
+        if (not as_json) {
+            std::cout << std::fixed << std::setprecision(1)
+                      << "against " << baseline_path << ": p50 "
+                      << diff["p50_pct"].get<double>() << "%, p99 "
+                      << diff["p99_pct"].get<double>() << "%, responses/s "
+                      << diff["responses_pct"].get<double>()
+                      << "%, FlowMods "
+                      << diff["flow_mods_pct"].get<double>() << "%"
+                      << (regressed ? " - REGRESSION" : "")
+                      << "\n";
+        }
+        if (regressed && ret == 0)
+            ret = 3;
+    }
+
+    if (as_json) {
+        std::cout << result.dump(2) << std::endl;
+    }
+    return ret;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    cxxopts::Options options(argv[0], " - OpenFlow switch emulator for "
+                                      "controller benchmarks");
+    options.add_options()
+        ("a,address", "Controller address",
+            cxxopts::value<std::string>()->default_value("127.0.0.1"))
+        ("p,port", "Controller port",
+            cxxopts::value<int>()->default_value("6653"))
+        ("s,switches", "Number of emulated switches",
+            cxxopts::value<unsigned>()->default_value("16"))
+        ("t,threads", "Worker threads",
+            cxxopts::value<unsigned>()->default_value("1"))
+        ("first-dpid", "Datapath id of the first switch",
+            cxxopts::value<uint64_t>()->default_value("1"))
+        ("ports", "Ports per switch",
+            cxxopts::value<unsigned>()->default_value("4"))
+        ("hosts", "Distinct MAC addresses per switch",
+            cxxopts::value<unsigned>()->default_value("1000"))
+        ("flows", "Entries in every flow stats reply",
+            cxxopts::value<unsigned>()->default_value("0"))
+        ("r,rate", "PacketIn/s over all switches, 0 - no limit",
+            cxxopts::value<double>()->default_value("0"))
+        ("w,window", "PacketIns in flight per switch, 0 - no limit",
+            cxxopts::value<unsigned>()->default_value("1"))
+        ("d,duration", "Measured traffic seconds, 0 - storms only",
+            cxxopts::value<unsigned>()->default_value("10"))
+        ("warmup", "Traffic seconds before measuring",
+            cxxopts::value<unsigned>()->default_value("2"))
+        ("timeout", "Milliseconds to wait for a PacketIn response",
+            cxxopts::value<unsigned>()->default_value("1000"))
+        ("storms", "Connect storms before the traffic",
+            cxxopts::value<unsigned>()->default_value("0"))
+        ("setup-timeout", "Seconds to wait for a storm to set up",
+            cxxopts::value<unsigned>()->default_value("10"))
+        ("rest", "REST mix to replay during a second traffic phase, "
+                 "path[:weight],...",
+            cxxopts::value<std::string>()->default_value(""))
+        ("rest-address", "REST address, the controller address by default",
+            cxxopts::value<std::string>()->default_value(""))
+        ("rest-port", "REST port",
+            cxxopts::value<int>()->default_value("8000"))
+        ("rest-threads", "Concurrent REST clients",
+            cxxopts::value<unsigned>()->default_value("4"))
+        ("rest-rate", "REST requests/s over all clients, 0 - no limit",
+            cxxopts::value<double>()->default_value("0"))
+        ("replay", "Play a capture of oflog back instead of the phases",
+            cxxopts::value<std::string>()->default_value(""))
+        ("speed", "Replay speed, 1 - as recorded, 0 - no pauses",
+            cxxopts::value<double>()->default_value("1"))
+        ("drain", "Seconds to wait for responses after the replay",
+            cxxopts::value<unsigned>()->default_value("2"))
+        ("baseline", "JSON of an earlier replay to compare with",
+            cxxopts::value<std::string>()->default_value(""))
+        ("tolerance", "Percent of a change against the baseline that "
+                      "fails the run",
+            cxxopts::value<double>()->default_value("10"))
+        ("json", "Print the results as JSON")
+        ("help", "Print this")
+    ;
+    options.parse(argc, argv);
+    if (options.count("help")) {
+        std::cout << options.help({""}) << std::endl;
+        return 0;
+    }
+
+    settings s;
+    s.address = options["address"].as<std::string>();
+    s.port = uint16_t(options["port"].as<int>());
+    s.switches = std::max(1u, options["switches"].as<unsigned>());
+    s.threads = std::max(1u, std::min(options["threads"].as<unsigned>(),
+                                      s.switches));
+    s.first_dpid = options["first-dpid"].as<uint64_t>();
+    s.ports = std::max(1u, options["ports"].as<unsigned>());
+    s.hosts = std::max(2u, options["hosts"].as<unsigned>());
+    s.flows = options["flows"].as<unsigned>();
+    s.rate = options["rate"].as<double>();
+    s.window = options["window"].as<unsigned>();
+    s.packet_timeout =
+        std::chrono::milliseconds(options["timeout"].as<unsigned>());
+    const auto duration = std::chrono::seconds(options["duration"].as<unsigned>());
+    const auto warmup = std::chrono::seconds(options["warmup"].as<unsigned>());
+    const unsigned storms = options["storms"].as<unsigned>();
+    const auto setup_timeout =
+        std::chrono::seconds(options["setup-timeout"].as<unsigned>());
+    const bool as_json = options.count("json") > 0;
+
+    rest_settings rest;
+    rest.address = options["rest-address"].as<std::string>();
+    if (rest.address.empty())
+        rest.address = s.address;
+    rest.port = uint16_t(options["rest-port"].as<int>());
+    rest.threads = std::max(1u, options["rest-threads"].as<unsigned>());
+    rest.rate = options["rest-rate"].as<double>();
+    const auto rest_mix = options["rest"].as<std::string>();
+    if (not rest_mix.empty()) {
+        rest.mix = parse_rest_mix(rest_mix);
+        if (rest.mix.empty()) {
+            std::cerr << "Bad --rest list: " << rest_mix << std::endl;
+            return 2;
+        }
+    }
+
+    std::signal(SIGINT, [](int) { interrupted = true; });
+    std::signal(SIGPIPE, SIG_IGN);
+
+    const auto replay_path = options["replay"].as<std::string>();
+    if (not replay_path.empty()) {
+        return run_replay(s, replay_path, options["speed"].as<double>(),
+                          std::chrono::seconds(options["drain"].as<unsigned>()),
+                          setup_timeout, options["baseline"].as<std::string>(),
+                          options["tolerance"].as<double>(), as_json);
+    }
+
+    std::vector<std::unique_ptr<worker>> workers;
+    for (unsigned t = 0; t < s.threads; ++t)
+        workers.push_back(std::make_unique<worker>());
+    for (unsigned i = 0; i < s.switches; ++i) {
+        auto& w = *workers[i % s.threads];
+        w.switches.push_back(std::make_unique<switch_emulator>(
+            s, s.first_dpid + i, w.stats));
+    }
+
+    json result = {
+        {"switches", s.switches},
+        {"threads", s.threads},
+        {"window", s.window},
+        {"rate", s.rate},
+    };
+
+    // Connect storms
+    histogram features, setup;
+    std::vector<double> storm_ms;
+    uint64_t storm_handshakes = 0;
+    for (unsigned k = 0; k < storms && not interrupted; ++k) {
+        auto start = clock::now();
+        auto before = sum(workers);
+        for (auto& w : workers) {
+            w->thread = std::thread(storm, std::ref(*w), start + setup_timeout);
+        }
+        for (auto& w : workers) {
+            w->thread.join();
+        }
+        storm_ms.push_back(std::chrono::duration<double, std::milli>(
+                               clock::now() - start).count());
+        storm_handshakes += (sum(workers) - before).handshakes;
+        // let the controller see the connections go
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+    for (auto& w : workers) {
+        features.merge(w->stats.features);
+        setup.merge(w->stats.setup);
+        w->stats.features = histogram();
+        w->stats.setup = histogram();
+    }
+
+    if (storms > 0) {
+        result["storms"] = {
+            {"count", storm_ms.size()},
+            {"handshakes", storm_handshakes},
+            {"wall_ms", storm_ms},
+            {"features", latency_json(features)},
+            {"setup", latency_json(setup)},
+        };
+        if (not as_json) {
+            std::cout << "connect storms: " << storm_ms.size() << " x "
+                      << s.switches << " switches, "
+                      << storm_handshakes << " handshakes, wall ms:";
+            for (auto ms : storm_ms)
+                std::cout << " " << std::fixed << std::setprecision(1) << ms;
+            std::cout << "\n";
+            print_latency("  connect -> FeaturesRequest", features);
+            print_latency("  connect -> first FlowMod", setup);
+        }
+    }
+
+    // Traffic, once more under REST load to see what it costs
+    if (duration.count() > 0 && not interrupted) {
+        const rest_settings* monitor = rest.mix.empty() ? nullptr : &rest;
+        auto idle = traffic_phase(workers, s, warmup, duration, monitor,
+                                  false, "traffic", as_json);
+        result["traffic"] = idle.report;
+
+        if (monitor && not interrupted) {
+            auto loaded = traffic_phase(workers, s, warmup, duration,
+                                        monitor, true,
+                                        "traffic under REST load", as_json);
+            result["rest_traffic"] = loaded.report;
+
+            auto us = [](histogram::nanoseconds d) {
+                return d.count() / 1000.0;
+            };
+            auto delay = [&](double p) {
+                return us(loaded.latency.percentile(p)) -
+                       us(idle.latency.percentile(p));
+            };
+            result["rest_delay"] = {
+                {"p50_us", delay(50)},
+                {"p99_us", delay(99)},
+                {"p999_us", delay(99.9)},
+            };
+            if (not as_json) {
+                std::cout << std::fixed << std::setprecision(1)
+                          << "PacketIn latency added by REST load us: p50 "
+                          << delay(50) << " p99 " << delay(99)
+                          << " p99.9 " << delay(99.9) << "\n";
+            }
+        }
+    }
+
+    if (as_json) {
+        std::cout << result.dump(2) << std::endl;
+    }
+    return interrupted ? 1 : 0;
+}
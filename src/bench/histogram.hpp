@@ -0,0 +1,109 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace runos {
+namespace bench {
+
+/**
+ * Log-linear histogram of durations: 16 buckets per power of two,
+ * so any percentile is within ~6% of the real value. Not thread safe,
+ * every worker keeps its own and they are merged for the report.
+ */
+class histogram {
+public:
+    using nanoseconds = std::chrono::nanoseconds;
+
+    void record(nanoseconds d)
+    {
+        uint64_t v = d.count() > 0 ? uint64_t(d.count()) : 0;
+        ++buckets_[index(v)];
+        ++count_;
+        sum_ += v;
+        min_ = std::min(min_, v);
+        max_ = std::max(max_, v);
+    }
+
+    void merge(const histogram& other)
+    {
+        for (size_t i = 0; i < buckets_.size(); ++i)
+            buckets_[i] += other.buckets_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t count() const { return count_; }
+    nanoseconds min() const { return nanoseconds(count_ ? min_ : 0); }
+    nanoseconds max() const { return nanoseconds(max_); }
+    nanoseconds mean() const
+    { return nanoseconds(count_ ? sum_ / count_ : 0); }
+
+    // Upper bound of the bucket holding the p-th percentile, p in [0, 100]
+    nanoseconds percentile(double p) const
+    {
+        if (count_ == 0)
+            return nanoseconds(0);
+        auto rank = uint64_t(p / 100.0 * double(count_) + 0.5);
+        rank = std::max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets_.size(); ++i) {
+            seen += buckets_[i];
+            if (seen >= rank)
+                return nanoseconds(std::min(upper(i), max_));
+        }
+        return nanoseconds(max_);
+    }
+
+private:
+    static constexpr unsigned sub_bits = 4;
+    static constexpr uint64_t sub_count = 1u << sub_bits;
+
+    static size_t index(uint64_t v)
+    {
+        if (v < sub_count)
+            return v;
+        unsigned msb = 63 - __builtin_clzll(v);
+        unsigned e = msb - sub_bits + 1;
+        return e * sub_count + ((v >> (e - 1)) - sub_count);
+    }
+
+    static uint64_t upper(size_t i)
+    {
+        if (i < sub_count)
+            return i;
+        unsigned e = i / sub_count;
+        uint64_t m = i % sub_count + sub_count;
+        return ((m + 1) << (e - 1)) - 1;
+    }
+
+    std::array<uint64_t, (64 - sub_bits + 1) * sub_count> buckets_ {};
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t min_ = UINT64_MAX;
+    uint64_t max_ = 0;
+};
+
+} // namespace bench
+} // namespace runos
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "api/DoubleDispatcher.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <vector>
+
+namespace runos {
+
+struct bench_message { virtual ~bench_message() = default; };
+struct flow_removed : bench_message { };
+struct packet_in : bench_message { };
+struct port_status : bench_message { };
+
+using BenchDispatch = DoubleDispatcher<
+    struct bench_dispatch_tag, bench_message, bool, int>;
+
+// A handler of a few message types, like the applications have
+struct bench_handler final
+    : BenchDispatch::Handler<flow_removed>
+    , BenchDispatch::Handler<packet_in>
+    , BenchDispatch::Handler<bench_message>
+{
+    bool process(flow_removed&, int x) override { return x & 1; }
+    bool process(packet_in&, int x) override { return x & 2; }
+    bool process(bench_message&, int x) override { return x & 4; }
+};
+
+// Handler chain of the consumer, as walked for every PacketIn
+static void BM_DispatchChain(benchmark::State& state)
+{
+    std::vector<std::unique_ptr<BenchDispatch::HandlerBase>> chain;
+    for (int64_t i = 0; i < state.range(0); ++i)
+        chain.emplace_back(new bench_handler);
+
+    packet_in pi;
+    int arg = 0;
+    for (auto _ : state) {
+        for (auto& handler : chain) {
+            auto ret = handler->dispatch(pi, ++arg);
+            benchmark::DoNotOptimize(ret);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DispatchChain)->Arg(1)->Arg(8)->Arg(32);
+
+// Falls back to the handler of the base message type
+static void BM_DispatchFallback(benchmark::State& state)
+{
+    std::unique_ptr<BenchDispatch::HandlerBase> handler(new bench_handler);
+    port_status ps;
+    int arg = 0;
+    for (auto _ : state) {
+        auto ret = handler->dispatch(ps, ++arg);
+        benchmark::DoNotOptimize(ret);
+    }
+}
+BENCHMARK(BM_DispatchFallback);
+
+} // namespace runos
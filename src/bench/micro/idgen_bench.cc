@@ -0,0 +1,75 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <runos/IdGen.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace runos {
+
+static constexpr uint64_t pool_capacity = 1 << 20;
+
+// Pool filled to state.range(0) percent before measuring
+static void fill(IdGen& gen, int64_t percent)
+{
+    uint64_t n = pool_capacity * percent / 100;
+    if (n > 0)
+        gen.acquire_n(n);
+}
+
+static void BM_IdGenAcquireRelease(benchmark::State& state)
+{
+    IdGen gen(1, pool_capacity);
+    fill(gen, state.range(0));
+    for (auto _ : state) {
+        auto id = gen.acquire();
+        benchmark::DoNotOptimize(id);
+        gen.release(id);
+    }
+}
+BENCHMARK(BM_IdGenAcquireRelease)->Arg(0)->Arg(50)->Arg(99);
+
+static void BM_IdGenAcquireForward(benchmark::State& state)
+{
+    IdGen gen(1, pool_capacity, IdGen::acquire_order::forward);
+    fill(gen, state.range(0));
+    for (auto _ : state) {
+        auto id = gen.acquire();
+        benchmark::DoNotOptimize(id);
+        gen.release(id);
+    }
+}
+BENCHMARK(BM_IdGenAcquireForward)->Arg(0)->Arg(50)->Arg(99);
+
+static void BM_IdGenAcquireN(benchmark::State& state)
+{
+    IdGen gen(1, pool_capacity);
+    uint64_t n = state.range(0);
+    for (auto _ : state) {
+        auto ids = gen.acquire_n(n);
+        benchmark::DoNotOptimize(ids.data());
+        for (auto id : ids)
+            gen.release(id);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_IdGenAcquireN)->RangeMultiplier(8)->Range(8, 4096);
+
+} // namespace runos
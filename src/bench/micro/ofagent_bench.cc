@@ -0,0 +1,111 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "OFAgentImpl.hpp"
+
+#include <fluid/of13msg.hh>
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace runos {
+
+namespace {
+
+// Connection that swallows everything, requests stay outstanding
+class NullConnection final : public OFConnection {
+public:
+    uint64_t dpid() const override { return 1; }
+    bool alive() const override { return true; }
+    uint8_t protocol_version() const override { return of13::OFP_VERSION; }
+    std::string peer_address() const override { return "bench"; }
+    OFAgentPtr agent() const override { return nullptr; }
+
+    void set_start_time() override { }
+    void reset_stats() override { }
+    std::chrono::system_clock::time_point get_start_time() const override
+    { return {}; }
+    uint64_t get_rx_packets() const override { return 0; }
+    uint64_t get_tx_packets() const override { return 0; }
+    uint64_t get_pkt_in_packets() const override { return 0; }
+    void packet_in_counter() override { }
+
+    void send(message const&) override { }
+    void send(void*, size_t) override { }
+    void send(OFMessageTemplate const&, uint32_t) override { }
+    void close() override { }
+
+    void send_hook(SendHookHandlerPtr) override { }
+    void receive(ReceiveHandlerPtr) override { }
+    void receive_view(ViewHandlerPtr) override { }
+};
+
+} // namespace
+
+class OFAgentBench {
+public:
+    static bool find_task(OFAgentImpl& agent, uint32_t xid)
+    {
+        return agent.find_task(xid) != agent.tasks_.end();
+    }
+};
+
+// Reply lookup with state.range(0) requests waiting for the switch
+static void BM_OFAgentFindTask(benchmark::State& state)
+{
+    NullConnection conn;
+    OFAgentImpl agent(&conn);
+    uint32_t n = state.range(0);
+    std::vector<future<ofp::switch_config>> pending;
+    pending.reserve(n);
+    for (uint32_t i = 0; i < n; i++)
+        pending.push_back(agent.request_config());
+
+    uint32_t first = OFAgentImpl::get_minimal_xid();
+    uint32_t i = 0;
+    for (auto _ : state) {
+        // stride over the xids so the lookups don't walk the list in order
+        i = (i + 7919) % n;
+        benchmark::DoNotOptimize(OFAgentBench::find_task(agent, first + i));
+    }
+    state.SetComplexityN(n);
+}
+BENCHMARK(BM_OFAgentFindTask)
+    ->RangeMultiplier(16)->Range(1, 1 << 16)->Complexity();
+
+// Unsolicited or late replies
+static void BM_OFAgentFindTaskMiss(benchmark::State& state)
+{
+    NullConnection conn;
+    OFAgentImpl agent(&conn);
+    uint32_t n = state.range(0);
+    std::vector<future<ofp::switch_config>> pending;
+    pending.reserve(n);
+    for (uint32_t i = 0; i < n; i++)
+        pending.push_back(agent.request_config());
+
+    uint32_t xid = OFAgentImpl::get_minimal_xid() + n;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(OFAgentBench::find_task(agent, xid));
+    }
+    state.SetComplexityN(n);
+}
+BENCHMARK(BM_OFAgentFindTaskMiss)
+    ->RangeMultiplier(16)->Range(1, 1 << 16)->Complexity();
+
+} // namespace runos
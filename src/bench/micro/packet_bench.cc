@@ -0,0 +1,181 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "PacketParser.hpp"
+#include "oxm/field_set.hh"
+#include "oxm/openflow_basic.hh"
+
+#include <fluid/of13msg.hh>
+#include <benchmark/benchmark.h>
+
+#include <array>
+#include <cstdint>
+
+namespace runos {
+
+namespace of13 = fluid_msg::of13;
+
+static constexpr uint32_t no_buffer = 0xffffffff;
+static constexpr auto ofb_in_port = oxm::in_port();
+static constexpr auto ofb_eth_type = oxm::eth_type();
+static constexpr auto ofb_ip_proto = oxm::ip_proto();
+static constexpr auto ofb_ipv4_dst = oxm::ipv4_dst();
+static constexpr auto ofb_tcp_dst = oxm::tcp_dst();
+
+// 10.0.0.1:40000 -> 10.0.0.2:80 TCP SYN, 64 bytes on the wire
+static std::array<uint8_t, 64> tcp_frame()
+{
+    std::array<uint8_t, 64> f {};
+    const uint8_t header[] = {
+        // ethernet
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x02,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+        0x08, 0x00,
+        // ipv4
+        0x45, 0x00, 0x00, 0x28, 0x00, 0x01, 0x40, 0x00,
+        0x40, 0x06, 0x00, 0x00,
+        0x0a, 0x00, 0x00, 0x01,
+        0x0a, 0x00, 0x00, 0x02,
+        // tcp
+        0x9c, 0x40, 0x00, 0x50,
+        0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+        0x50, 0x02, 0x72, 0x10, 0x00, 0x00, 0x00, 0x00
+    };
+    std::copy(std::begin(header), std::end(header), f.begin());
+    return f;
+}
+
+// filled in place, fluid messages own raw buffers and shouldn't be copied
+static void fill_packet_in(of13::PacketIn& pi)
+{
+    static auto frame = tcp_frame();
+    pi.buffer_id(no_buffer);
+    pi.total_len(frame.size());
+    pi.reason(of13::OFPR_NO_MATCH);
+    of13::Match match;
+    auto in_port = of13::InPort(1);
+    match.add_oxm_field(in_port);
+    pi.match(match);
+    pi.data(frame.data(), frame.size());
+}
+
+static void BM_PacketParserConstruct(benchmark::State& state)
+{
+    of13::PacketIn pi;
+    fill_packet_in(pi);
+    for (auto _ : state) {
+        PacketParser pp(pi);
+        benchmark::DoNotOptimize(pp);
+    }
+}
+BENCHMARK(BM_PacketParserConstruct);
+
+// first load parses the headers up to the requested layer
+static void BM_PacketParserLoad(benchmark::State& state)
+{
+    of13::PacketIn pi;
+    fill_packet_in(pi);
+    for (auto _ : state) {
+        PacketParser pp(pi);
+        benchmark::DoNotOptimize(pp.load(ofb_eth_type));
+        benchmark::DoNotOptimize(pp.load(ofb_ipv4_dst));
+        benchmark::DoNotOptimize(pp.load(ofb_tcp_dst));
+    }
+}
+BENCHMARK(BM_PacketParserLoad);
+
+static void BM_PacketParserLoadParsed(benchmark::State& state)
+{
+    of13::PacketIn pi;
+    fill_packet_in(pi);
+    PacketParser pp(pi);
+    pp.load(ofb_tcp_dst);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(pp.load(ofb_eth_type));
+        benchmark::DoNotOptimize(pp.load(ofb_ipv4_dst));
+        benchmark::DoNotOptimize(pp.load(ofb_tcp_dst));
+    }
+}
+BENCHMARK(BM_PacketParserLoadParsed);
+
+// the same fields through the compile-time accessor
+static void BM_PacketParserGetParsed(benchmark::State& state)
+{
+    of13::PacketIn pi;
+    fill_packet_in(pi);
+    PacketParser pp(pi);
+    pp.get<oxm::tcp_dst>();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(pp.get<oxm::eth_type>());
+        benchmark::DoNotOptimize(pp.get<oxm::ipv4_dst>());
+        benchmark::DoNotOptimize(pp.get<oxm::tcp_dst>());
+    }
+}
+BENCHMARK(BM_PacketParserGetParsed);
+
+static void BM_FieldSetMatch(benchmark::State& state)
+{
+    of13::PacketIn pi;
+    fill_packet_in(pi);
+    PacketParser pp(pi);
+    oxm::field_set match {
+        ofb_in_port == 1,
+        ofb_eth_type == 0x0800,
+        ofb_ip_proto == 6,
+        ofb_tcp_dst == 80
+    };
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(match & pp);
+    }
+}
+BENCHMARK(BM_FieldSetMatch);
+
+// mismatch on the last field checked costs most, on the first least;
+// unordered_set order decides which one it is
+static void BM_FieldSetMatchMiss(benchmark::State& state)
+{
+    of13::PacketIn pi;
+    fill_packet_in(pi);
+    PacketParser pp(pi);
+    oxm::field_set match {
+        ofb_in_port == 1,
+        ofb_eth_type == 0x0800,
+        ofb_ip_proto == 6,
+        ofb_tcp_dst == 443
+    };
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(match & pp);
+    }
+}
+BENCHMARK(BM_FieldSetMatchMiss);
+
+static void BM_FieldSetLoad(benchmark::State& state)
+{
+    oxm::field_set fs {
+        ofb_in_port == 1,
+        ofb_eth_type == 0x0800,
+        ofb_ip_proto == 6,
+        ofb_tcp_dst == 80
+    };
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(fs.load(ofb_tcp_dst));
+        benchmark::DoNotOptimize(fs.load(ofb_ipv4_dst));
+    }
+}
+BENCHMARK(BM_FieldSetLoad);
+
+} // namespace runos
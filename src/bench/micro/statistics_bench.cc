@@ -0,0 +1,108 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "StatisticsStore.hpp"
+#include "lib/port_stats_table.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <chrono>
+#include <cstdint>
+
+namespace runos {
+
+// One port stats reply folded into the store, as PortImpl does per poll
+static void BM_StatisticsStoreAppend(benchmark::State& state)
+{
+    StatisticsStore<PortMeasurement> store;
+    PortMeasurement<uint64_t> counters;
+    counters.fill(0);
+    std::chrono::milliseconds now {0};
+    for (auto _ : state) {
+        now += std::chrono::seconds(1);
+        for (auto& c : counters)
+            c += 1500;
+        store.append(now, counters);
+    }
+    benchmark::DoNotOptimize(store.get());
+}
+BENCHMARK(BM_StatisticsStoreAppend);
+
+static void BM_StatisticsStoreGet(benchmark::State& state)
+{
+    StatisticsStore<PortMeasurement> store;
+    PortMeasurement<uint64_t> counters;
+    counters.fill(0);
+    for (int i = 1; i <= 2; i++) {
+        for (auto& c : counters)
+            c += 1500;
+        store.append(std::chrono::seconds(i), counters);
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(store.get());
+    }
+}
+BENCHMARK(BM_StatisticsStoreGet);
+
+// Same poll folded into one row of the switch table
+static void BM_PortStatsTableAppend(benchmark::State& state)
+{
+    port_stats_table table(PortMeasurement<uint64_t>().size());
+    auto slot = table.acquire(1);
+    PortMeasurement<uint64_t> counters;
+    PortMeasurement<double> speed;
+    counters.fill(0);
+    double now = 0;
+    for (auto _ : state) {
+        now += 1;
+        for (auto& c : counters)
+            c += 1500;
+        table.append(slot, now, counters.data(), speed.data());
+    }
+    benchmark::DoNotOptimize(speed);
+}
+BENCHMARK(BM_PortStatsTableAppend);
+
+// tx bytes speed of every port, as Topology::reloadStats reads it
+static void BM_PortStatsTableScan(benchmark::State& state)
+{
+    port_stats_table table(PortMeasurement<uint64_t>().size());
+    PortMeasurement<uint64_t> counters;
+    PortMeasurement<double> speed;
+    uint32_t ports = state.range(0);
+    for (uint32_t port = 0; port < ports; ++port) {
+        auto slot = table.acquire(port);
+        for (int i = 1; i <= 2; i++) {
+            counters.fill(i * 1500);
+            table.append(slot, i, counters.data(), speed.data());
+        }
+    }
+    for (auto _ : state) {
+        double sum = table.read([](const port_stats_table::columns& c) {
+            const float* tx = c.speed(PortMeasurement<double>::tx_bytes_field);
+            double sum = 0;
+            for (uint32_t slot = 0; slot < c.size(); ++slot)
+                sum += tx[slot];
+            return sum;
+        });
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * ports);
+}
+BENCHMARK(BM_PortStatsTableScan)->Arg(1000)->Arg(100000);
+
+} // namespace runos
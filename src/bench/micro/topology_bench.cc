@@ -0,0 +1,248 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "TopologyGraph.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace runos {
+
+namespace {
+
+void link(TopologyGraph& g, vertex_descriptor u, vertex_descriptor v,
+          uint32_t port)
+{
+    // port speed metric varies so that PortSpeed paths differ from Hop ones
+    uint64_t ps = 1 + (u * 31 + v * 17) % 100;
+    link_property prop { {u + 1, port}, {v + 1, port}, 1, ps, ps };
+    boost::add_edge(u, v, prop, g);
+}
+
+// k-ary fat-tree: (k/2)^2 core, k pods of k/2 aggregation
+// and k/2 edge switches, 5k^2/4 switches in total
+TopologyGraph fat_tree(int64_t k)
+{
+    int64_t half = k / 2;
+    int64_t cores = half * half;
+    TopologyGraph g(cores + k * k);
+
+    auto agg = [&](int64_t pod, int64_t i) { return cores + pod * k + i; };
+    auto edge = [&](int64_t pod, int64_t i) { return cores + pod * k + half + i; };
+
+    for (int64_t pod = 0; pod < k; pod++) {
+        for (int64_t a = 0; a < half; a++) {
+            for (int64_t c = 0; c < half; c++)
+                link(g, agg(pod, a), a * half + c, half + c + 1);
+            for (int64_t e = 0; e < half; e++)
+                link(g, agg(pod, a), edge(pod, e), e + 1);
+        }
+    }
+    return g;
+}
+
+// connected random graph: a spanning chain plus random links,
+// average degree around four
+TopologyGraph random_graph(int64_t n)
+{
+    std::mt19937_64 rng(n);
+    std::uniform_int_distribution<int64_t> pick(0, n - 1);
+    TopologyGraph g(n);
+    uint32_t port = 1;
+    for (int64_t v = 1; v < n; v++)
+        link(g, pick(rng) % v, v, port++);
+    for (int64_t i = 0; i < n; i++) {
+        auto u = pick(rng), v = pick(rng);
+        if (u != v)
+            link(g, u, v, port++);
+    }
+    return g;
+}
+
+using generator = TopologyGraph (*)(int64_t);
+
+void fat_tree_sizes(benchmark::internal::Benchmark* b)
+{
+    // 80, 320, 1280 and 3920 switches
+    for (int64_t k : {8, 16, 32, 56})
+        b->Arg(k);
+}
+
+void random_sizes(benchmark::internal::Benchmark* b)
+{
+    for (int64_t n : {100, 500, 1000, 5000})
+        b->Arg(n);
+}
+
+} // namespace
+
+static void BM_CsrGraphBuild(benchmark::State& state, generator gen)
+{
+    auto g = gen(state.range(0));
+    for (auto _ : state) {
+        CsrGraph csr(g);
+        benchmark::DoNotOptimize(csr.targets.data());
+    }
+    state.counters["switches"] = num_vertices(g);
+}
+
+static void BM_CsrPredecessors(benchmark::State& state, generator gen,
+                               MetricsFlag mf)
+{
+    auto g = gen(state.range(0));
+    CsrGraph csr(g);
+    GraphOverlay ov(g);
+    size_t n = csr.size();
+    vertex_descriptor root = 0;
+    for (auto _ : state) {
+        root = (root + 7919) % n;
+        benchmark::DoNotOptimize(csr.predecessors(root, mf, ov));
+    }
+    state.counters["switches"] = n;
+}
+
+// route avoiding a few broken links, as findPath does for triggers
+static void BM_CsrPredecessorsMasked(benchmark::State& state, generator gen)
+{
+    auto g = gen(state.range(0));
+    CsrGraph csr(g);
+    GraphOverlay ov(g);
+    auto edges = boost::edges(g);
+    size_t i = 0;
+    for (auto it = edges.first; it != edges.second; ++it, ++i) {
+        if (i % 10 == 0)
+            ov.mask(*it);
+        else if (i % 10 == 1)
+            ov.penalize(*it, 10000);
+    }
+    size_t n = csr.size();
+    vertex_descriptor root = 0;
+    for (auto _ : state) {
+        root = (root + 7919) % n;
+        benchmark::DoNotOptimize(
+            csr.predecessors(root, MetricsFlag::Hop, ov));
+    }
+    state.counters["switches"] = n;
+}
+
+// one-off path as computePath() searches it for masked or
+// PortLoading requests, compare with BM_CsrPredecessors
+static void BM_CsrRoute(benchmark::State& state, generator gen,
+                        MetricsFlag mf)
+{
+    auto g = gen(state.range(0));
+    CsrGraph csr(g);
+    GraphOverlay ov(g);
+    size_t n = csr.size();
+    vertex_descriptor from = 0, to = n / 2;
+    for (auto _ : state) {
+        from = (from + 7919) % n;
+        to = (to + 104729) % n;
+        benchmark::DoNotOptimize(csr.route(from, to, mf, ov));
+    }
+    state.counters["switches"] = n;
+}
+
+static void BM_SptCacheGet(benchmark::State& state, generator gen)
+{
+    auto g = gen(state.range(0));
+    SptCache cache;
+    cache.get(0, MetricsFlag::Hop, g);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(cache.get(0, MetricsFlag::Hop, g));
+    }
+    state.counters["switches"] = num_vertices(g);
+}
+
+// link flap repaired in the cached trees instead of recomputing them
+static void BM_SptCacheLinkFlap(benchmark::State& state, generator gen)
+{
+    auto g = gen(state.range(0));
+    SptCache cache;
+    size_t n = num_vertices(g);
+    for (vertex_descriptor root = 0; root < n; root += n / 8 + 1)
+        cache.get(root, MetricsFlag::PortSpeed, g);
+
+    auto e = *boost::edges(g).first;
+    auto u = source(e, g), v = target(e, g);
+    auto prop = g[e];
+    for (auto _ : state) {
+        boost::remove_edge(u, v, g);
+        cache.edgeRemoved(u, v, g);
+        boost::add_edge(u, v, prop, g);
+        cache.edgeAdded(u, v, g);
+    }
+    state.counters["switches"] = n;
+}
+
+static void BM_HopMatrixBfs(benchmark::State& state, generator gen)
+{
+    auto g = gen(state.range(0));
+    size_t n = num_vertices(g);
+    HopMatrix m(HopMatrix{}, n);
+    vertex_descriptor src = 0;
+    for (auto _ : state) {
+        src = (src + 7919) % n;
+        m.bfs(src, g);
+    }
+    benchmark::DoNotOptimize(m.dist.data());
+    state.counters["switches"] = n;
+}
+
+BENCHMARK_CAPTURE(BM_CsrGraphBuild, fat_tree, fat_tree)
+    ->Apply(fat_tree_sizes);
+BENCHMARK_CAPTURE(BM_CsrGraphBuild, random, random_graph)
+    ->Apply(random_sizes);
+
+BENCHMARK_CAPTURE(BM_CsrPredecessors, fat_tree_hop, fat_tree,
+                  MetricsFlag::Hop)->Apply(fat_tree_sizes);
+BENCHMARK_CAPTURE(BM_CsrPredecessors, random_hop, random_graph,
+                  MetricsFlag::Hop)->Apply(random_sizes);
+BENCHMARK_CAPTURE(BM_CsrPredecessors, random_port_speed, random_graph,
+                  MetricsFlag::PortSpeed)->Apply(random_sizes);
+
+BENCHMARK_CAPTURE(BM_CsrPredecessorsMasked, fat_tree, fat_tree)
+    ->Apply(fat_tree_sizes);
+BENCHMARK_CAPTURE(BM_CsrPredecessorsMasked, random, random_graph)
+    ->Apply(random_sizes);
+
+BENCHMARK_CAPTURE(BM_CsrRoute, fat_tree_hop, fat_tree,
+                  MetricsFlag::Hop)->Apply(fat_tree_sizes);
+BENCHMARK_CAPTURE(BM_CsrRoute, random_hop, random_graph,
+                  MetricsFlag::Hop)->Apply(random_sizes);
+BENCHMARK_CAPTURE(BM_CsrRoute, random_port_speed, random_graph,
+                  MetricsFlag::PortSpeed)->Apply(random_sizes);
+
+BENCHMARK_CAPTURE(BM_SptCacheGet, fat_tree, fat_tree)
+    ->Apply(fat_tree_sizes);
+BENCHMARK_CAPTURE(BM_SptCacheGet, random, random_graph)
+    ->Apply(random_sizes);
+
+BENCHMARK_CAPTURE(BM_SptCacheLinkFlap, fat_tree, fat_tree)
+    ->Apply(fat_tree_sizes);
+BENCHMARK_CAPTURE(BM_SptCacheLinkFlap, random, random_graph)
+    ->Apply(random_sizes);
+
+BENCHMARK_CAPTURE(BM_HopMatrixBfs, fat_tree, fat_tree)
+    ->Apply(fat_tree_sizes);
+BENCHMARK_CAPTURE(BM_HopMatrixBfs, random, random_graph)
+    ->Apply(random_sizes);
+
+} // namespace runos
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "replay.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+namespace runos {
+namespace bench {
+
+namespace {
+
+constexpr uint32_t PCAP_MAGIC_US = 0xa1b2c3d4;
+constexpr uint32_t PCAP_MAGIC_NS = 0xa1b23c4d;
+constexpr size_t FRAME_HEADER = 54; // Ethernet, IPv4, TCP without options
+constexpr size_t OF_HEADER = 8;
+constexpr size_t MULTIPART_HEADER = 8;
+
+enum type : uint8_t {
+    PACKET_IN = 10,
+    FLOW_REMOVED = 11,
+    PORT_STATUS = 12,
+    FLOW_MOD = 14,
+    MULTIPART_REPLY = 19,
+};
+
+uint16_t get16(const uint8_t* p) { return uint16_t(p[0] << 8 | p[1]); }
+
+uint32_t get32(const uint8_t* p)
+{
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 |
+           uint32_t(p[2]) << 8 | p[3];
+}
+
+uint64_t get_mac(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 6; ++i)
+        v = v << 8 | p[i];
+    return v;
+}
+
+struct file_closer {
+    void operator()(FILE* f) const { std::fclose(f); }
+};
+
+} // namespace
+
+capture read_capture(const std::string& path)
+{
+    std::unique_ptr<FILE, file_closer> file(std::fopen(path.c_str(), "rb"));
+    if (not file)
+        throw std::runtime_error("Can't open " + path);
+
+    struct {
+        uint32_t magic;
+        uint16_t version_major, version_minor;
+        int32_t thiszone;
+        uint32_t sigfigs, snaplen, linktype;
+    } header;
+    if (std::fread(&header, sizeof(header), 1, file.get()) != 1)
+        throw std::runtime_error(path + " is not a pcap file");
+    if (header.magic != PCAP_MAGIC_US && header.magic != PCAP_MAGIC_NS)
+        throw std::runtime_error(path + " is not a pcap file of this host");
+    if (header.linktype != 1)
+        throw std::runtime_error(path + " doesn't hold Ethernet frames");
+    const uint64_t frac = header.magic == PCAP_MAGIC_NS ? 1 : 1000;
+
+    capture ret;
+    std::vector<uint8_t> frame;
+    struct { uint32_t sec, frac, incl_len, orig_len; } rec;
+    while (std::fread(&rec, sizeof(rec), 1, file.get()) == 1) {
+        frame.resize(rec.incl_len);
+        if (std::fread(frame.data(), 1, frame.size(), file.get()) !=
+                frame.size())
+            break;
+        if (frame.size() < FRAME_HEADER + OF_HEADER)
+            continue;
+        if (rec.incl_len < rec.orig_len) {
+            ++ret.truncated;
+            continue;
+        }
+
+        // the switch end of the frame is the TCP port other than 6653
+        const uint8_t* tcp = frame.data() + 34;
+        bool outgoing = get16(tcp) == 6653;
+        uint64_t mac = get_mac(frame.data() + (outgoing ? 0 : 6));
+
+        const uint8_t* of = frame.data() + FRAME_HEADER;
+        size_t len = frame.size() - FRAME_HEADER;
+        capture_message msg;
+        msg.ts_ns = uint64_t(rec.sec) * 1000000000u + rec.frac * frac;
+        msg.dpid = mac & 0xffffffffffull;
+        msg.outgoing = outgoing;
+        // a segment holds one message, but don't trust it blindly
+        size_t msg_len = std::min<size_t>(get16(of + 2), len);
+        msg.data.assign(of, of + msg_len);
+        ret.messages.push_back(std::move(msg));
+    }
+
+    // threads of the recording controller are ordered only by time
+    std::stable_sort(ret.messages.begin(), ret.messages.end(),
+                     [](const capture_message& a, const capture_message& b) {
+                         return a.ts_ns < b.ts_ns;
+                     });
+    return ret;
+}
+
+uint64_t flow_mod_kind(uint64_t dpid, const uint8_t* msg, size_t len)
+{
+    // ofp_flow_mod: table_id at 24, command 25, priority 30, match 48
+    if (len < 56)
+        return 0;
+    size_t match_len = get16(msg + 50);
+    size_t end = std::min(len, 48 + match_len);
+
+    uint64_t h = 14695981039346656037ull; // FNV-1a
+    auto mix = [&h](uint8_t b) { h = (h ^ b) * 1099511628211ull; };
+    for (int i = 0; i < 8; ++i)
+        mix(uint8_t(dpid >> (8 * i)));
+    mix(msg[24]);
+    mix(msg[25]);
+    mix(msg[30]);
+    mix(msg[31]);
+    for (size_t i = 48; i < end; ++i)
+        mix(msg[i]);
+    return h;
+}
+
+std::map<uint64_t, replay_script> make_scripts(const capture& c)
+{
+    std::map<uint64_t, replay_script> ret;
+    if (c.messages.empty())
+        return ret;
+    const uint64_t start = c.messages.front().ts_ns;
+
+    // segments of a multipart reply in progress, by dpid and xid
+    std::map<std::pair<uint64_t, uint32_t>,
+             std::vector<const capture_message*>> segments;
+
+    for (const auto& msg : c.messages) {
+        auto it = ret.try_emplace(msg.dpid);
+        auto& script = it.first->second;
+        if (it.second) {
+            script.dpid = msg.dpid;
+            script.first_ns = msg.ts_ns - start;
+        }
+
+        const uint8_t* p = msg.data.data();
+        const size_t len = msg.data.size();
+        const uint8_t type = p[1];
+
+        if (msg.outgoing) {
+            if (type == FLOW_MOD) {
+                ++script.flow_mods;
+                if (auto kind = flow_mod_kind(msg.dpid, p, len))
+                    ++script.flow_mod_kinds[kind];
+            }
+            continue;
+        }
+
+        switch (type) {
+        case PACKET_IN:
+        case PORT_STATUS:
+        case FLOW_REMOVED:
+            script.async.push_back(&msg);
+            break;
+        case MULTIPART_REPLY: {
+            if (len < OF_HEADER + MULTIPART_HEADER)
+                break;
+            auto key = std::make_pair(msg.dpid, get32(p + 4));
+            auto& parts = segments[key];
+            parts.push_back(&msg);
+            bool more = get16(p + 10) & 1; // OFPMPF_REPLY_MORE
+            if (not more) {
+                script.replies[get16(p + 8)].push_back(std::move(parts));
+                segments.erase(key);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    return ret;
+}
+
+} // namespace bench
+} // namespace runos
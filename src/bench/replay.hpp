@@ -0,0 +1,69 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace runos {
+namespace bench {
+
+// One OpenFlow message of a capture written by oflog in "capture" mode
+struct capture_message {
+    uint64_t ts_ns;
+    uint64_t dpid;      // lower 40 bits, as kept in the switch MAC
+    bool outgoing;      // controller -> switch
+    std::vector<uint8_t> data;
+};
+
+struct capture {
+    std::vector<capture_message> messages; // by timestamp
+    uint64_t truncated = 0; // cut by the snaplen, skipped
+};
+
+// Throws std::runtime_error if the file is not a pcap of Ethernet frames
+capture read_capture(const std::string& path);
+
+/**
+ * What one recorded switch plays back: its messages to the controller
+ * that aren't replies (PacketIn, PortStatus, FlowRemoved), the replies
+ * to multipart requests by type, to answer the controller under test
+ * with, and what the recorded controller sent it.
+ */
+struct replay_script {
+    uint64_t dpid = 0;
+    uint64_t first_ns = 0;  // connect, from the start of the capture
+    std::vector<const capture_message*> async;
+    // multipart type -> recorded answers, every one all its segments
+    std::unordered_map<uint16_t,
+                       std::vector<std::vector<const capture_message*>>>
+        replies;
+    uint64_t flow_mods = 0;
+    std::unordered_map<uint64_t, uint64_t> flow_mod_kinds;
+};
+
+std::map<uint64_t, replay_script> make_scripts(const capture& c);
+
+// Table, command, priority and match of a FlowMod, 0 if too short
+uint64_t flow_mod_kind(uint64_t dpid, const uint8_t* msg, size_t len);
+
+} // namespace bench
+} // namespace runos
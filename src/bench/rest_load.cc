@@ -0,0 +1,232 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "rest_load.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+namespace runos {
+namespace bench {
+
+std::vector<rest_endpoint> parse_rest_mix(const std::string& spec)
+{
+    std::vector<rest_endpoint> ret;
+    std::istringstream in(spec);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if (item.empty())
+            continue;
+        rest_endpoint e;
+        auto colon = item.rfind(':');
+        e.path = item.substr(0, colon);
+        if (colon != std::string::npos) {
+            char* end = nullptr;
+            e.weight = unsigned(std::strtoul(item.c_str() + colon + 1,
+                                             &end, 10));
+            if (*end != '\0' || e.weight == 0)
+                return {};
+        }
+        if (e.path.empty() || e.path[0] != '/')
+            return {};
+        ret.push_back(std::move(e));
+    }
+    return ret;
+}
+
+rest_client::rest_client(const rest_settings& s)
+    : s_(s)
+{ }
+
+rest_client::~rest_client()
+{
+    close();
+}
+
+bool rest_client::connect()
+{
+    fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_ < 0)
+        return false;
+
+    timeval tv {};
+    tv.tv_sec = s_.timeout.count() / 1000;
+    tv.tv_usec = (s_.timeout.count() % 1000) * 1000;
+    ::setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ::setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int one = 1;
+    ::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(s_.port);
+    ::inet_pton(AF_INET, s_.address.c_str(), &addr.sin_addr);
+    if (::connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void rest_client::close()
+{
+    if (fd_ >= 0)
+        ::close(fd_);
+    fd_ = -1;
+    in_.clear();
+}
+
+bool rest_client::read_more()
+{
+    char buf[16384];
+    ssize_t n;
+    do {
+        n = ::recv(fd_, buf, sizeof(buf), 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return false;
+    in_.append(buf, size_t(n));
+    return true;
+}
+
+int rest_client::get(const std::string& path, std::string& body)
+{
+    // a kept connection may have been closed by the server meanwhile
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        bool reused = fd_ >= 0;
+        if (not reused && not connect())
+            return 0;
+
+        std::string req = "GET " + path + " HTTP/1.1\r\nHost: " +
+                          s_.address + "\r\nConnection: keep-alive\r\n\r\n";
+        if (::send(fd_, req.data(), req.size(), MSG_NOSIGNAL) !=
+                ssize_t(req.size())) {
+            close();
+            if (reused)
+                continue;
+            return 0;
+        }
+
+        size_t head_end;
+        while ((head_end = in_.find("\r\n\r\n")) == std::string::npos) {
+            if (not read_more()) {
+                bool nothing = in_.empty();
+                close();
+                if (reused && nothing)
+                    break;
+                return 0;
+            }
+        }
+        if (fd_ < 0)
+            continue;
+
+        std::string head = in_.substr(0, head_end);
+        in_.erase(0, head_end + 4);
+        int status = 0;
+        std::sscanf(head.c_str(), "HTTP/%*d.%*d %d", &status);
+
+        std::string lower(head);
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        bool keep = lower.find("connection: close") == std::string::npos &&
+                    lower.compare(0, 8, "http/1.0") != 0;
+        auto cl = lower.find("content-length:");
+        if (cl != std::string::npos) {
+            size_t length = std::strtoul(lower.c_str() + cl + 15, nullptr, 10);
+            while (in_.size() < length) {
+                if (not read_more()) {
+                    close();
+                    return 0;
+                }
+            }
+            body = in_.substr(0, length);
+            in_.erase(0, length);
+        } else {
+            // no length, the body ends with the connection
+            while (read_more()) { }
+            body = std::move(in_);
+            keep = false;
+        }
+        if (not keep)
+            close();
+        return status;
+    }
+    return 0;
+}
+
+void rest_load(const rest_settings& s, double rate, size_t offset,
+               std::vector<rest_counters>& stats,
+               std::chrono::steady_clock::time_point measure_from,
+               const std::atomic_bool& stop)
+{
+    using clock = std::chrono::steady_clock;
+
+    // endpoint indices repeated by weight, walked round-robin
+    std::vector<size_t> schedule;
+    for (size_t i = 0; i < s.mix.size(); ++i)
+        schedule.insert(schedule.end(), s.mix[i].weight, i);
+    if (schedule.empty())
+        return;
+
+    rest_client client(s);
+    std::string body;
+    bool measuring = false;
+    auto next = clock::now();
+    const auto gap = rate > 0
+        ? std::chrono::duration_cast<clock::duration>(
+              std::chrono::duration<double>(1.0 / rate))
+        : clock::duration::zero();
+
+    for (size_t k = offset; not stop; ++k) {
+        if (rate > 0) {
+            std::this_thread::sleep_until(next);
+            next += gap;
+        }
+        auto start = clock::now();
+        if (not measuring && start >= measure_from) {
+            std::fill(stats.begin(), stats.end(), rest_counters());
+            measuring = true;
+        }
+
+        size_t i = schedule[k % schedule.size()];
+        int status = client.get(s.mix[i].path, body);
+        auto& c = stats[i];
+        ++c.requests;
+        if (status < 200 || status >= 300) {
+            ++c.errors;
+            // don't spin on a controller that is gone
+            if (status == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        c.bytes += body.size();
+        c.latency.record(clock::now() - start);
+    }
+}
+
+} // namespace bench
+} // namespace runos
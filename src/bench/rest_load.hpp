@@ -0,0 +1,100 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "histogram.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace runos {
+namespace bench {
+
+struct rest_endpoint {
+    std::string path;
+    unsigned weight = 1;
+};
+
+struct rest_settings {
+    std::string address = "127.0.0.1";
+    uint16_t port = 8000;
+    unsigned threads = 4;
+    double rate = 0;            // requests/s over all threads, 0 - no limit
+    std::chrono::milliseconds timeout {5000};
+    std::vector<rest_endpoint> mix;
+};
+
+// "path[:weight],...", empty on a malformed list
+std::vector<rest_endpoint> parse_rest_mix(const std::string& spec);
+
+// Per endpoint of the mix, owned by one thread
+struct rest_counters {
+    uint64_t requests = 0;
+    uint64_t errors = 0;        // no reply or a status other than 2xx
+    uint64_t bytes = 0;
+    histogram latency;          // request written -> reply read
+
+    void merge(const rest_counters& o)
+    {
+        requests += o.requests;
+        errors += o.errors;
+        bytes += o.bytes;
+        latency.merge(o.latency);
+    }
+};
+
+/**
+ * Blocking HTTP/1.1 GET client over one keep-alive connection,
+ * reconnecting when the server closes it.
+ */
+class rest_client {
+public:
+    explicit rest_client(const rest_settings& s);
+    ~rest_client();
+
+    rest_client(const rest_client&) = delete;
+    rest_client& operator=(const rest_client&) = delete;
+
+    // HTTP status, 0 if the request failed; the body goes to `body`
+    int get(const std::string& path, std::string& body);
+
+private:
+    const rest_settings& s_;
+    int fd_ = -1;
+    std::string in_;
+
+    bool connect();
+    void close();
+    bool read_more();
+};
+
+/**
+ * One thread of REST load: walks the weighted mix from `offset` until
+ * `stop`, at `rate` requests/s (0 - back to back). Counters get reset
+ * once `measure_from` has passed, `stats` has one entry per endpoint.
+ */
+void rest_load(const rest_settings& s, double rate, size_t offset,
+               std::vector<rest_counters>& stats,
+               std::chrono::steady_clock::time_point measure_from,
+               const std::atomic_bool& stop);
+
+} // namespace bench
+} // namespace runos
@@ -0,0 +1,751 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "switch_emulator.hpp"
+#include "replay.hpp"
+
+#include "openflow/common.hh"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+namespace runos {
+namespace bench {
+
+namespace {
+
+using namespace boost::endian;
+
+constexpr uint8_t OFP_VERSION = 0x04;
+constexpr uint32_t OFP_NO_BUFFER = 0xffffffff;
+constexpr size_t MAX_MESSAGE = 0xffff;
+
+enum type : uint8_t {
+    HELLO = 0,
+    ECHO_REQUEST = 2,
+    ECHO_REPLY = 3,
+    FEATURES_REQUEST = 5,
+    FEATURES_REPLY = 6,
+    GET_CONFIG_REQUEST = 7,
+    GET_CONFIG_REPLY = 8,
+    PACKET_IN = 10,
+    PACKET_OUT = 13,
+    FLOW_MOD = 14,
+    MULTIPART_REQUEST = 18,
+    MULTIPART_REPLY = 19,
+    BARRIER_REQUEST = 20,
+    BARRIER_REPLY = 21,
+    QUEUE_GET_CONFIG_REQUEST = 22,
+    QUEUE_GET_CONFIG_REPLY = 23,
+    ROLE_REQUEST = 24,
+    ROLE_REPLY = 25,
+    GET_ASYNC_REQUEST = 26,
+    GET_ASYNC_REPLY = 27,
+};
+
+enum multipart_type : uint16_t {
+    MP_DESC = 0,
+    MP_FLOW = 1,
+    MP_AGGREGATE = 2,
+    MP_TABLE = 3,
+    MP_PORT_STATS = 4,
+    MP_GROUP_FEATURES = 8,
+    MP_METER_FEATURES = 11,
+    MP_PORT_DESC = 13,
+};
+
+constexpr uint32_t ROLE_NOCHANGE = 0;
+constexpr uint32_t ROLE_MASTER = 2;
+constexpr uint32_t ROLE_SLAVE = 3;
+
+struct features_reply {
+    big_uint64_t datapath_id;
+    big_uint32_t n_buffers;
+    big_uint8_t n_tables;
+    big_uint8_t auxiliary_id;
+    uint8_t pad[2];
+    big_uint32_t capabilities;
+    big_uint32_t reserved;
+};
+static_assert(sizeof(features_reply) == 24, "");
+
+struct role_body {
+    big_uint32_t role;
+    uint8_t pad[4];
+    big_uint64_t generation_id;
+};
+static_assert(sizeof(role_body) == 16, "");
+
+struct multipart_header {
+    big_uint16_t type;
+    big_uint16_t flags;
+    uint8_t pad[4];
+};
+static_assert(sizeof(multipart_header) == 8, "");
+
+struct port {
+    big_uint32_t port_no;
+    uint8_t pad[4];
+    uint8_t hw_addr[6];
+    uint8_t pad2[2];
+    char name[16];
+    big_uint32_t config;
+    big_uint32_t state;
+    big_uint32_t curr;
+    big_uint32_t advertised;
+    big_uint32_t supported;
+    big_uint32_t peer;
+    big_uint32_t curr_speed;
+    big_uint32_t max_speed;
+};
+static_assert(sizeof(port) == 64, "");
+
+struct port_stats {
+    big_uint32_t port_no;
+    uint8_t pad[4];
+    big_uint64_t counters[12];
+    big_uint32_t duration_sec;
+    big_uint32_t duration_nsec;
+};
+static_assert(sizeof(port_stats) == 112, "");
+
+// Flow stats entry with an empty match and no instructions
+struct flow_stats {
+    big_uint16_t length;
+    big_uint8_t table_id;
+    uint8_t pad;
+    big_uint32_t duration_sec;
+    big_uint32_t duration_nsec;
+    big_uint16_t priority;
+    big_uint16_t idle_timeout;
+    big_uint16_t hard_timeout;
+    big_uint16_t flags;
+    uint8_t pad2[4];
+    big_uint64_t cookie;
+    big_uint64_t packet_count;
+    big_uint64_t byte_count;
+    big_uint16_t match_type;
+    big_uint16_t match_length;
+    uint8_t match_pad[4];
+};
+static_assert(sizeof(flow_stats) == 56, "");
+
+struct table_stats {
+    big_uint8_t table_id;
+    uint8_t pad[3];
+    big_uint32_t active_count;
+    big_uint64_t lookup_count;
+    big_uint64_t matched_count;
+};
+static_assert(sizeof(table_stats) == 24, "");
+
+struct aggregate_stats {
+    big_uint64_t packet_count;
+    big_uint64_t byte_count;
+    big_uint32_t flow_count;
+    uint8_t pad[4];
+};
+static_assert(sizeof(aggregate_stats) == 24, "");
+
+struct group_features {
+    big_uint32_t types;
+    big_uint32_t capabilities;
+    big_uint32_t max_groups[4];
+    big_uint32_t actions[4];
+};
+static_assert(sizeof(group_features) == 40, "");
+
+struct meter_features {
+    big_uint32_t max_meter;
+    big_uint32_t band_types;
+    big_uint32_t capabilities;
+    big_uint8_t max_bands;
+    big_uint8_t max_color;
+    uint8_t pad[2];
+};
+static_assert(sizeof(meter_features) == 16, "");
+
+// PacketIn up to the data, with an in_port only match
+struct packet_in {
+    of::header header;
+    big_uint32_t buffer_id;
+    big_uint16_t total_len;
+    big_uint8_t reason;
+    big_uint8_t table_id;
+    big_uint64_t cookie;
+    big_uint16_t match_type;
+    big_uint16_t match_length;
+    big_uint32_t oxm_in_port;
+    big_uint32_t in_port;
+    uint8_t match_pad[4];
+    uint8_t pad[2];
+};
+static_assert(sizeof(packet_in) == 42, "");
+
+struct packet_out {
+    of::header header;
+    big_uint32_t buffer_id;
+    big_uint32_t in_port;
+    big_uint16_t actions_len;
+    uint8_t pad[6];
+};
+static_assert(sizeof(packet_out) == 24, "");
+
+// Offset of buffer_id in ofp_flow_mod
+constexpr size_t FLOW_MOD_BUFFER_ID = 36;
+
+// Ethernet + IPv4 + UDP with the buffer id in the payload
+struct frame {
+    uint8_t eth_dst[6];
+    uint8_t eth_src[6];
+    big_uint16_t eth_type;
+    big_uint8_t ip_vhl;
+    big_uint8_t ip_tos;
+    big_uint16_t ip_len;
+    big_uint16_t ip_id;
+    big_uint16_t ip_off;
+    big_uint8_t ip_ttl;
+    big_uint8_t ip_proto;
+    big_uint16_t ip_sum;
+    big_uint32_t ip_src;
+    big_uint32_t ip_dst;
+    big_uint16_t udp_src;
+    big_uint16_t udp_dst;
+    big_uint16_t udp_len;
+    big_uint16_t udp_sum;
+    big_uint32_t magic;
+    big_uint32_t buffer_id;
+    uint8_t pad[10];
+};
+static_assert(sizeof(frame) == 60, "");
+
+constexpr uint32_t FRAME_MAGIC = 0x524e4243; // "RNBC"
+
+void host_mac(uint8_t* mac, uint64_t dpid, uint32_t host)
+{
+    mac[0] = 0x02;
+    mac[1] = uint8_t(dpid >> 8);
+    mac[2] = uint8_t(dpid);
+    mac[3] = uint8_t(host >> 8);
+    mac[4] = uint8_t(host);
+    mac[5] = 0x01;
+}
+
+} // namespace
+
+switch_emulator::switch_emulator(const settings& s, uint64_t dpid,
+                                 counters& stats)
+    : s_(s), dpid_(dpid), stats_(stats)
+{ }
+
+switch_emulator::~switch_emulator()
+{
+    close();
+}
+
+int switch_emulator::connect(clock::time_point now)
+{
+    close();
+
+    fd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd_ < 0)
+        return -1;
+    int one = 1;
+    ::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(s_.port);
+    ::inet_pton(AF_INET, s_.address.c_str(), &addr.sin_addr);
+
+    if (::connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+            && errno != EINPROGRESS) {
+        close();
+        return -1;
+    }
+
+    connecting_ = true;
+    connect_start_ = now;
+    reply(HELLO, next_xid_++, nullptr, 0);
+    return fd_;
+}
+
+void switch_emulator::close()
+{
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    connecting_ = ready_ = set_up_ = false;
+    in_.clear();
+    out_.clear();
+    out_pos_ = 0;
+    order_.clear();
+    pending_.clear();
+    role_ = 0;
+}
+
+bool switch_emulator::on_writable(clock::time_point)
+{
+    if (connecting_) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        ::getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0)
+            return false;
+        connecting_ = false;
+    }
+    return flush();
+}
+
+bool switch_emulator::on_readable(clock::time_point now)
+{
+    for (;;) {
+        size_t old = in_.size();
+        in_.resize(old + 65536);
+        auto n = ::recv(fd_, in_.data() + old, 65536, 0);
+        if (n <= 0) {
+            in_.resize(old);
+            if (n == 0)
+                return false;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        in_.resize(old + n);
+    }
+
+    size_t off = 0;
+    while (in_.size() - off >= sizeof(of::header)) {
+        auto hdr = reinterpret_cast<const of::header*>(in_.data() + off);
+        size_t len = hdr->length;
+        if (len < sizeof(of::header))
+            return false;
+        if (in_.size() - off < len)
+            break;
+        handle(in_.data() + off, len, now);
+        off += len;
+    }
+    in_.erase(in_.begin(), in_.begin() + off);
+
+    return flush();
+}
+
+void switch_emulator::handle(const uint8_t* msg, size_t len,
+                             clock::time_point now)
+{
+    auto hdr = reinterpret_cast<const of::header*>(msg);
+    const uint32_t xid = hdr->xid;
+    const uint8_t* body = msg + sizeof(of::header);
+    const size_t body_len = len - sizeof(of::header);
+
+    switch (hdr->type) {
+    case ECHO_REQUEST:
+        reply(ECHO_REPLY, xid, body, body_len);
+        break;
+    case FEATURES_REQUEST: {
+        features_reply fr {};
+        fr.datapath_id = dpid_;
+        fr.n_buffers = 256;
+        fr.n_tables = 254;
+        fr.capabilities = 0x4f; // flow, table, port, group stats, ip reasm
+        reply(FEATURES_REPLY, xid, &fr, sizeof(fr));
+        if (not ready_) {
+            ready_ = true;
+            stats_.features.record(now - connect_start_);
+            stats_.add(stats_.handshakes);
+        }
+        break;
+    }
+    case GET_CONFIG_REQUEST: {
+        big_uint16_t config[2] = { 0, 0xffff };
+        reply(GET_CONFIG_REPLY, xid, config, sizeof(config));
+        break;
+    }
+    case BARRIER_REQUEST:
+        reply(BARRIER_REPLY, xid, nullptr, 0);
+        stats_.add(stats_.barriers);
+        break;
+    case ROLE_REQUEST: {
+        if (body_len < sizeof(role_body))
+            break;
+        auto req = reinterpret_cast<const role_body*>(body);
+        if (req->role != ROLE_NOCHANGE) {
+            role_ = req->role;
+            if (role_ == ROLE_MASTER || role_ == ROLE_SLAVE)
+                generation_id_ = req->generation_id;
+        }
+        role_body rep {};
+        rep.role = role_;
+        rep.generation_id = generation_id_;
+        reply(ROLE_REPLY, xid, &rep, sizeof(rep));
+        break;
+    }
+    case GET_ASYNC_REQUEST: {
+        big_uint32_t masks[6];
+        for (auto& mask : masks)
+            mask = 0xffffffff;
+        reply(GET_ASYNC_REPLY, xid, masks, sizeof(masks));
+        break;
+    }
+    case QUEUE_GET_CONFIG_REQUEST: {
+        uint8_t rep[8] = {};
+        std::memcpy(rep, body, std::min<size_t>(body_len, 4));
+        reply(QUEUE_GET_CONFIG_REPLY, xid, rep, sizeof(rep));
+        break;
+    }
+    case MULTIPART_REQUEST:
+        handle_multipart(msg, len);
+        break;
+    case PACKET_OUT: {
+        stats_.add(stats_.packet_outs);
+        if (len < sizeof(packet_out))
+            break;
+        auto po = reinterpret_cast<const packet_out*>(msg);
+        if (po->buffer_id != OFP_NO_BUFFER) {
+            answered(po->buffer_id, now);
+            break;
+        }
+        size_t data = sizeof(packet_out) + po->actions_len;
+        if (len < data + offsetof(frame, pad))
+            break;
+        auto f = reinterpret_cast<const frame*>(msg + data);
+        if (f->eth_type == 0x0800 && f->magic == FRAME_MAGIC)
+            answered(f->buffer_id, now);
+        break;
+    }
+    case FLOW_MOD: {
+        stats_.add(stats_.flow_mods);
+        if (not set_up_) {
+            set_up_ = true;
+            stats_.setup.record(now - connect_start_);
+        }
+        if (s_.track_flow_mods) {
+            if (auto kind = flow_mod_kind(dpid_, msg, len))
+                ++stats_.flow_mod_kinds[kind];
+        }
+        if (len < FLOW_MOD_BUFFER_ID + 4)
+            break;
+        big_uint32_t buffer_id;
+        std::memcpy(&buffer_id, msg + FLOW_MOD_BUFFER_ID, sizeof(buffer_id));
+        if (buffer_id != OFP_NO_BUFFER)
+            answered(buffer_id, now);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void switch_emulator::handle_multipart(const uint8_t* msg, size_t len)
+{
+    if (len < sizeof(of::header) + sizeof(multipart_header))
+        return;
+    auto hdr = reinterpret_cast<const of::header*>(msg);
+    auto req = reinterpret_cast<const multipart_header*>(
+                   msg + sizeof(of::header));
+    const uint32_t xid = hdr->xid;
+    const uint16_t mp_type = req->type;
+    stats_.add(stats_.multipart);
+    if (replay_multipart(mp_type, xid))
+        return;
+
+    // Splits `count` records of type Record into replies below 64K
+    auto records = [&](auto record, size_t count, auto&& fill) {
+        using Record = decltype(record);
+        const size_t per_message =
+            (MAX_MESSAGE - sizeof(of::header) - sizeof(multipart_header))
+                / sizeof(Record);
+        size_t i = 0;
+        do {
+            size_t n = std::min(count - i, per_message);
+            size_t size = sizeof(of::header) + sizeof(multipart_header)
+                        + n * sizeof(Record);
+            auto p = reserve(size);
+            auto out_hdr = reinterpret_cast<of::header*>(p);
+            out_hdr->version = OFP_VERSION;
+            out_hdr->type = MULTIPART_REPLY;
+            out_hdr->length = size;
+            out_hdr->xid = xid;
+            auto mp = reinterpret_cast<multipart_header*>(
+                          p + sizeof(of::header));
+            mp->type = mp_type;
+            mp->flags = (i + n < count) ? 1 : 0; // OFPMPF_REPLY_MORE
+            auto out = reinterpret_cast<Record*>(
+                           p + sizeof(of::header) + sizeof(multipart_header));
+            for (size_t j = 0; j < n; ++j, ++i) {
+                fill(out[j], i);
+            }
+            stats_.add(stats_.multipart_bytes, size);
+        } while (i < count);
+    };
+
+    switch (mp_type) {
+    case MP_DESC: {
+        struct desc {
+            char mfr[256], hw[256], sw[256], serial[32], dp[256];
+        };
+        records(desc {}, 1, [this](desc& d, size_t) {
+            std::snprintf(d.mfr, sizeof(d.mfr), "RUNOS");
+            std::snprintf(d.hw, sizeof(d.hw), "runos-bench");
+            std::snprintf(d.sw, sizeof(d.sw), "switch emulator");
+            std::snprintf(d.serial, sizeof(d.serial), "%llu",
+                          (unsigned long long) dpid_);
+            std::snprintf(d.dp, sizeof(d.dp), "bench switch %llu",
+                          (unsigned long long) dpid_);
+        });
+        break;
+    }
+    case MP_PORT_DESC:
+        records(port {}, s_.ports, [this](port& p, size_t i) {
+            p.port_no = i + 1;
+            host_mac(p.hw_addr, dpid_, 0xff00 | uint32_t(i));
+            std::snprintf(p.name, sizeof(p.name), "eth%zu", i + 1);
+            p.curr = p.advertised = p.supported = 0x820; // 10GB_FD, copper
+            p.curr_speed = p.max_speed = 10000000;
+        });
+        break;
+    case MP_PORT_STATS:
+        records(port_stats {}, s_.ports, [](port_stats& ps, size_t i) {
+            ps.port_no = i + 1;
+        });
+        break;
+    case MP_FLOW:
+        records(flow_stats {}, s_.flows, [](flow_stats& fs, size_t i) {
+            fs.length = sizeof(flow_stats);
+            fs.priority = 1;
+            fs.cookie = i;
+            fs.match_type = 1; // OFPMT_OXM
+            fs.match_length = 4;
+        });
+        break;
+    case MP_AGGREGATE:
+        records(aggregate_stats {}, 1, [this](aggregate_stats& as, size_t) {
+            as.flow_count = s_.flows;
+        });
+        break;
+    case MP_TABLE:
+        records(table_stats {}, 1, [](table_stats&, size_t) { });
+        break;
+    case MP_GROUP_FEATURES:
+        records(group_features {}, 1, [](group_features& gf, size_t) {
+            gf.types = 0xf;
+            for (auto& max : gf.max_groups)
+                max = 1024;
+        });
+        break;
+    case MP_METER_FEATURES:
+        records(meter_features {}, 1, [](meter_features& mf, size_t) {
+            mf.max_meter = 1024;
+            mf.band_types = 0x3;
+            mf.max_bands = 1;
+        });
+        break;
+    default: {
+        // Everything else is answered as empty
+        struct none { };
+        records(none {}, 0, [](none&, size_t) { });
+        break;
+    }
+    }
+}
+
+bool switch_emulator::replay_multipart(uint16_t mp_type, uint32_t xid)
+{
+    if (not script_)
+        return false;
+    auto it = script_->replies.find(mp_type);
+    if (it == script_->replies.end() || it->second.empty())
+        return false;
+
+    // recorded answers in turn, each with all its segments
+    auto& next = next_reply_[mp_type];
+    const auto& answer = it->second[next++ % it->second.size()];
+    for (const auto* segment : answer) {
+        auto p = reserve(segment->data.size());
+        std::memcpy(p, segment->data.data(), segment->data.size());
+        reinterpret_cast<of::header*>(p)->xid = xid;
+        stats_.add(stats_.multipart_bytes, segment->data.size());
+    }
+    return true;
+}
+
+void switch_emulator::replay(const std::vector<uint8_t>& msg,
+                             clock::time_point now)
+{
+    if (msg.size() < sizeof(of::header))
+        return;
+    auto p = reserve(msg.size());
+    std::memcpy(p, msg.data(), msg.size());
+    auto hdr = reinterpret_cast<of::header*>(p);
+    hdr->xid = next_xid_++;
+    stats_.add(stats_.replayed);
+
+    if (hdr->type == PACKET_IN && msg.size() >= sizeof(packet_in)) {
+        auto pi = reinterpret_cast<packet_in*>(p);
+        stats_.add(stats_.packet_ins);
+        if (pi->buffer_id != OFP_NO_BUFFER) {
+            if (next_buffer_id_ == OFP_NO_BUFFER)
+                next_buffer_id_ = 0;
+            const uint32_t buffer_id = next_buffer_id_++;
+            pi->buffer_id = buffer_id;
+            pending_.emplace(buffer_id, now);
+            order_.push_back(in_flight {buffer_id, now});
+        }
+    }
+    flush();
+}
+
+unsigned switch_emulator::send_packet_ins(unsigned n, clock::time_point now)
+{
+    if (not ready_)
+        return 0;
+    if (s_.window > 0) {
+        if (pending_.size() >= s_.window)
+            return 0;
+        n = std::min<unsigned>(n, s_.window - pending_.size());
+    }
+
+    for (unsigned k = 0; k < n; ++k) {
+        if (next_buffer_id_ == OFP_NO_BUFFER)
+            next_buffer_id_ = 0;
+        const uint32_t buffer_id = next_buffer_id_++;
+        const uint32_t src = host_ % s_.hosts;
+        const uint32_t dst = (host_ + 1) % s_.hosts;
+        ++host_;
+
+        auto p = reserve(sizeof(packet_in) + sizeof(frame));
+        std::memset(p, 0, sizeof(packet_in) + sizeof(frame));
+        auto pi = reinterpret_cast<packet_in*>(p);
+        pi->header.version = OFP_VERSION;
+        pi->header.type = PACKET_IN;
+        pi->header.length = sizeof(packet_in) + sizeof(frame);
+        pi->header.xid = next_xid_++;
+        pi->buffer_id = buffer_id;
+        pi->total_len = sizeof(frame);
+        pi->match_type = 1; // OFPMT_OXM
+        pi->match_length = 12;
+        pi->oxm_in_port = 0x80000004; // OPENFLOW_BASIC, IN_PORT, 4 bytes
+        pi->in_port = 1 + src % s_.ports;
+
+        auto f = reinterpret_cast<frame*>(p + sizeof(packet_in));
+        host_mac(f->eth_dst, dpid_, dst);
+        host_mac(f->eth_src, dpid_, src);
+        f->eth_type = 0x0800;
+        f->ip_vhl = 0x45;
+        f->ip_len = sizeof(frame) - offsetof(frame, ip_vhl);
+        f->ip_ttl = 64;
+        f->ip_proto = 17;
+        f->ip_src = 0x0a000000 | ((dpid_ & 0xff) << 16) | src;
+        f->ip_dst = 0x0a000000 | ((dpid_ & 0xff) << 16) | dst;
+        f->udp_src = 9;
+        f->udp_dst = 9;
+        f->udp_len = sizeof(frame) - offsetof(frame, udp_src);
+        f->magic = FRAME_MAGIC;
+        f->buffer_id = buffer_id;
+
+        pending_.emplace(buffer_id, now);
+        order_.push_back(in_flight {buffer_id, now});
+    }
+    stats_.add(stats_.packet_ins, n);
+    flush();
+    return n;
+}
+
+void switch_emulator::expire(clock::time_point now)
+{
+    while (not order_.empty() && now - order_.front().sent > s_.packet_timeout) {
+        auto it = pending_.find(order_.front().buffer_id);
+        if (it != pending_.end() && it->second == order_.front().sent) {
+            pending_.erase(it);
+            stats_.add(stats_.timed_out);
+        }
+        order_.pop_front();
+    }
+}
+
+void switch_emulator::answered(uint32_t buffer_id, clock::time_point now)
+{
+    auto it = pending_.find(buffer_id);
+    if (it == pending_.end())
+        return;
+    stats_.latency.record(now - it->second);
+    stats_.add(stats_.answered);
+    pending_.erase(it);
+}
+
+bool switch_emulator::flush()
+{
+    if (fd_ < 0)
+        return false;
+    if (connecting_)
+        return true;
+
+    while (out_pos_ < out_.size()) {
+        auto n = ::send(fd_, out_.data() + out_pos_, out_.size() - out_pos_,
+                        MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        out_pos_ += n;
+    }
+
+    if (out_pos_ == out_.size()) {
+        out_.clear();
+        out_pos_ = 0;
+    } else if (out_pos_ > (1u << 20)) {
+        out_.erase(out_.begin(), out_.begin() + out_pos_);
+        out_pos_ = 0;
+    }
+    return true;
+}
+
+uint8_t* switch_emulator::reserve(size_t len)
+{
+    size_t old = out_.size();
+    out_.resize(old + len);
+    return out_.data() + old;
+}
+
+void switch_emulator::reply(uint8_t type, uint32_t xid,
+                            const void* body, size_t len)
+{
+    auto p = reserve(sizeof(of::header) + len);
+    auto hdr = reinterpret_cast<of::header*>(p);
+    hdr->version = OFP_VERSION;
+    hdr->type = type;
+    hdr->length = sizeof(of::header) + len;
+    hdr->xid = xid;
+    if (len > 0)
+        std::memcpy(p + sizeof(of::header), body, len);
+}
+
+} // namespace bench
+} // namespace runos
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "histogram.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace runos {
+namespace bench {
+
+using clock = std::chrono::steady_clock;
+
+struct settings {
+    std::string address = "127.0.0.1";
+    uint16_t port = 6653;
+    unsigned switches = 16;
+    unsigned threads = 1;
+    uint64_t first_dpid = 1;
+    unsigned ports = 4;
+    unsigned hosts = 1000;      // distinct MAC addresses per switch
+    unsigned flows = 0;         // entries in every flow stats reply
+    double rate = 0;            // PacketIn/s over all switches, 0 - no limit
+    unsigned window = 1;        // PacketIns in flight per switch, 0 - no limit
+    std::chrono::milliseconds packet_timeout {1000};
+    bool track_flow_mods = false; // count FlowMods by flow_mod_kind()
+};
+
+struct replay_script;
+
+// Filled by one worker. Plain counters are read by the reporter
+// while running, histograms only after the workers have finished.
+struct counters {
+    std::atomic<uint64_t> packet_ins {0};
+    std::atomic<uint64_t> packet_outs {0};
+    std::atomic<uint64_t> flow_mods {0};
+    std::atomic<uint64_t> answered {0};     // PacketIns a response matched
+    std::atomic<uint64_t> timed_out {0};
+    std::atomic<uint64_t> multipart {0};
+    std::atomic<uint64_t> multipart_bytes {0};
+    std::atomic<uint64_t> barriers {0};
+    std::atomic<uint64_t> handshakes {0};
+    std::atomic<uint64_t> disconnects {0};
+    std::atomic<uint64_t> replayed {0};     // recorded messages sent
+
+    histogram latency;   // PacketIn -> PacketOut or FlowMod
+    histogram features;  // connect -> FeaturesRequest
+    histogram setup;     // connect -> first FlowMod
+    std::unordered_map<uint64_t, uint64_t> flow_mod_kinds;
+
+    void add(std::atomic<uint64_t>& c, uint64_t n = 1)
+    { c.store(c.load(std::memory_order_relaxed) + n,
+              std::memory_order_relaxed); }
+};
+
+/**
+ * One emulated OpenFlow 1.3 switch on a non-blocking socket.
+ *
+ * Answers the handshake, echo, barrier, role and multipart requests
+ * and sends PacketIns on demand. Every PacketIn carries its own buffer
+ * id and the same id in the UDP payload, so a FlowMod or PacketOut
+ * referring to it by buffer id or by data is matched and timed.
+ */
+class switch_emulator {
+public:
+    switch_emulator(const settings& s, uint64_t dpid, counters& stats);
+    ~switch_emulator();
+
+    switch_emulator(const switch_emulator&) = delete;
+    switch_emulator& operator=(const switch_emulator&) = delete;
+
+    uint64_t dpid() const { return dpid_; }
+    int fd() const { return fd_; }
+    // FeaturesRequest answered
+    bool ready() const { return ready_; }
+    // First FlowMod received since connect
+    bool set_up() const { return set_up_; }
+    bool wants_write() const { return out_pos_ < out_.size(); }
+
+    // Starts a non-blocking connect, returns the socket
+    int connect(clock::time_point now);
+    void close();
+
+    // False if the connection is gone
+    bool on_readable(clock::time_point now);
+    bool on_writable(clock::time_point now);
+
+    // Sends up to `n` PacketIns within the window, returns how many
+    unsigned send_packet_ins(unsigned n, clock::time_point now);
+    // Forgets PacketIns not answered within the timeout
+    void expire(clock::time_point now);
+
+    // Multipart requests get the recorded replies of the script first
+    void set_script(const replay_script* script) { script_ = script; }
+    // Sends a recorded message, a buffered PacketIn is timed as ours
+    void replay(const std::vector<uint8_t>& msg, clock::time_point now);
+
+private:
+    const settings& s_;
+    const uint64_t dpid_;
+    counters& stats_;
+
+    int fd_ = -1;
+    bool connecting_ = false;
+    bool ready_ = false;
+    bool set_up_ = false;
+    clock::time_point connect_start_;
+
+    std::vector<uint8_t> in_;
+    std::vector<uint8_t> out_;
+    size_t out_pos_ = 0;
+
+    uint32_t role_ = 0; // OFPCR_ROLE_EQUAL
+    uint64_t generation_id_ = 0;
+    uint32_t next_buffer_id_ = 0;
+    uint32_t next_xid_ = 1;
+    uint64_t host_ = 0;
+
+    const replay_script* script_ = nullptr;
+    std::unordered_map<uint16_t, size_t> next_reply_;
+
+    struct in_flight {
+        uint32_t buffer_id;
+        clock::time_point sent;
+    };
+    std::deque<in_flight> order_;
+    std::unordered_map<uint32_t, clock::time_point> pending_;
+
+    void handle(const uint8_t* msg, size_t len, clock::time_point now);
+    void handle_multipart(const uint8_t* msg, size_t len);
+    bool replay_multipart(uint16_t mp_type, uint32_t xid);
+    void answered(uint32_t buffer_id, clock::time_point now);
+    bool flush();
+
+    uint8_t* reserve(size_t len);
+    void reply(uint8_t type, uint32_t xid, const void* body, size_t len);
+};
+
+} // namespace bench
+} // namespace runos
@@ -15,6 +15,7 @@
  */
 
 #include "Application.hpp"
+#include "lib/qt_executor.hpp"
 
 namespace runos {
 
@@ -32,5 +33,10 @@ Application::Application()
 Application::~Application()
 { }
 
+void Application::post(std::function<void()> task)
+{
+    qt_executor(this).submit(std::move(task));
+}
+
 
 }
@@ -17,6 +17,7 @@
 /** @file */
 #pragma once
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -70,6 +71,15 @@ public:
     */
     virtual void startUp(class Loader*) { }
 
+    /**
+    * Runs `task` on the thread of this application, after the tasks and
+    * queued signals posted to it before. Other applications may live on
+    * their own loader threads (see `isolate` and `groups` of the loader
+    * settings), so calls into an application which touch its state
+    * should go through here rather than be made directly.
+    */
+    void post(std::function<void()> task);
+
     /**
     * Application constructor. Typically your application lives as a
     * static object, so this constructor will be called before main().
@@ -24,6 +24,8 @@
 
 #include <QCoreApplication>
 #include <histedit.h>
+#include <poll.h>
+#include <unistd.h>
 
 #include "Config.hpp"
 
@@ -94,6 +96,26 @@ void CommandLine::register_command(cli_pattern&& spec, cli_command&& fn)
     impl->commands.emplace_back(std::move(spec), std::move(fn));
 }
 
+void CommandLine::watch(std::chrono::milliseconds interval,
+                        const std::function<void()>& frame)
+{
+    std::cout << "Refreshing every " << interval.count()
+              << " ms, press Enter to stop" << std::endl;
+
+    // editline only takes the terminal over inside el_gets(), so here
+    // input is line-buffered and the first readable byte is an Enter
+    pollfd in { STDIN_FILENO, POLLIN, 0 };
+    while (::poll(&in, 1, int(interval.count())) == 0) {
+        std::cout << "\033[H\033[2J";
+        frame();
+        std::cout << "(Enter to stop)" << std::endl;
+    }
+
+    char buf[256];
+    if (in.revents & POLLIN)
+        (void) ::read(STDIN_FILENO, buf, sizeof(buf));
+}
+
 void CommandLine::error_impl(std::string && msg)
 {
     throw command_error(msg);
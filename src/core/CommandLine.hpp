@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <chrono>
 #include <memory>
 #include <functional> // function
 #include <regex>
@@ -48,6 +49,14 @@ public:
 
     void register_command(cli_pattern&& spec, cli_command&& fn);
 
+    /**
+     * Redraws a view from a command: clears the screen and calls
+     * `frame` every `interval`, the first time after one interval,
+     * until the user presses Enter. `frame` prints with print().
+     */
+    void watch(std::chrono::milliseconds interval,
+               const std::function<void()>& frame);
+
     /**
      * Prints formatted message to the user and inserts newline.
      */
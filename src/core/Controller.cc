@@ -18,15 +18,27 @@
 
 #include "OFServer.hpp"
 #include "OFMessage.hpp"
+#include "PacketParser.hpp"
+#include "lib/metrics.hpp"
+#include "lib/pending_flows.hpp"
 #include "lib/qt_executor.hpp"
+#include "lib/worker_pool.hpp"
 
+#include <runos/core/catch_all.hpp>
+#include <runos/core/demangle.hpp>
 #include <runos/core/logging.hpp>
 #include <runos/core/future.hpp>
 
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/lock_guard.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 namespace runos {
 
@@ -35,8 +47,108 @@ REGISTER_APPLICATION(Controller, {"of-server", ""})
 struct ReceiveHandler;
 using ReceiveHandlerPtr = std::shared_ptr<ReceiveHandler>;
 
+namespace of13 = fluid_msg::of13;
+
+// Handlers accepting one concrete message type, in priority order
+struct HandlerChain {
+    using Thunk = LinearDispatch::result_type (*)(LinearDispatch::HandlerBase&,
+                                                  fluid_msg::OFMsg&,
+                                                  OFConnectionPtr);
+    using Unpack = std::unique_ptr<fluid_msg::OFMsg> (*)(uint8_t* packed);
+    Thunk dispatch;
+    std::vector<OFMessageHandlerPtr> handlers;
+    // PacketInBatchHandler interfaces of `handlers`, null if they lack it
+    std::vector<PacketInBatchHandler*> batch;
+    // Time spent in each of `handlers`
+    std::vector<metrics::Histogram*> timers;
+
+    // Observers get the message packed and unpack it on their worker
+    Unpack unpack;
+    std::vector<OFMessageHandlerPtr> observers;
+    std::vector<metrics::Histogram*> observer_timers;
+};
+
+static metrics::Histogram& handler_histogram(LinearDispatch::HandlerBase& h)
+{
+    return metrics::Registry::global().histogram(
+        "runos_controller_handler_seconds",
+        "Time spent in an OpenFlow message handler",
+        {{"handler", demangle(typeid(h).name())}});
+}
+
+// key is (message type << 16 | multipart type)
+using HandlerChainMap = std::unordered_map<uint32_t, HandlerChain>;
+
+template<class Message>
+struct BuildHandlerChain {
+    HandlerChain operator()(std::vector<OFMessageHandlerPtr> const& sorted,
+                            std::vector<OFMessageHandlerPtr> const& observers) const
+    {
+        HandlerChain ret;
+        ret.dispatch = [](LinearDispatch::HandlerBase& handler,
+                          fluid_msg::OFMsg& msg,
+                          OFConnectionPtr conn) {
+            return handler.dispatch(static_cast<Message&>(msg), conn);
+        };
+        ret.unpack = [](uint8_t* packed) -> std::unique_ptr<fluid_msg::OFMsg> {
+            auto msg = std::make_unique<Message>();
+            if (msg->unpack(packed) != 0)
+                return nullptr;
+            return msg;
+        };
+        for (auto& handler : sorted) {
+            if (handler->template accepts<Message>()) {
+                ret.handlers.push_back(handler);
+                ret.batch.push_back(
+                    dynamic_cast<PacketInBatchHandler*>(handler.get()));
+                ret.timers.push_back(&handler_histogram(*handler));
+            }
+        }
+        for (auto& handler : observers) {
+            if (handler->template accepts<Message>()) {
+                ret.observers.push_back(handler);
+                ret.observer_timers.push_back(&handler_histogram(*handler));
+            }
+        }
+        return ret;
+    }
+};
+
+static uint32_t chain_key(uint8_t type, uint16_t mpart = 0xffff)
+{
+    return (uint32_t(type) << 16) | mpart;
+}
+
+static uint32_t chain_key(fluid_msg::OFMsg& msg)
+{
+    switch (msg.type()) {
+    case of13::OFPT_MULTIPART_REPLY:
+        return chain_key(msg.type(),
+                static_cast<of13::MultipartReply&>(msg).mpart_type());
+    case of13::OFPT_MULTIPART_REQUEST:
+        return chain_key(msg.type(),
+                static_cast<of13::MultipartRequest&>(msg).mpart_type());
+    default:
+        return chain_key(msg.type());
+    }
+}
+
+// OFPMP_DESC .. OFPMP_PORT_DESC
+static constexpr uint16_t max_mpart_type = of13::OFPMP_PORT_DESC;
+
+// Barriers confirming flow setup, the low bits carry their sequence
+static constexpr uint32_t pending_barrier_xid = 0xfe000000;
+static constexpr uint32_t pending_barrier_mask = 0xff000000;
+static_assert(pending_flows::seq_bits == 24, "sequence fits in the xid");
+
+static const OFMessageTemplate& barrier_template()
+{
+    static const OFMessageTemplate ret{ of13::BarrierRequest() };
+    return ret;
+}
+
 struct Controller::implementation {
-    OFServer* of_server;
+    OFServer* of_server {nullptr};
     qt_executor executor;
     boost::inline_executor inline_executor;
 
@@ -45,26 +157,214 @@ struct Controller::implementation {
     { }
 
     std::multimap<int, OFMessageHandlerWeakPtr> handlers;
+    std::multimap<int, OFMessageHandlerWeakPtr> observers;
     std::map<uint64_t, ReceiveHandlerPtr> recv_handler;
+
+    size_t observer_queue_limit {1024};
+    std::atomic<size_t> observer_queued {0};
+    metrics::Counter& observer_dropped = metrics::Registry::global().counter(
+        "runos_controller_observer_dropped_total",
+        "Messages not passed to observers as their queue was full");
+
+    // PacketIns of flows whose setup is in progress, null if disabled
+    std::unique_ptr<pending_flows> pending;
+    metrics::Counter& pending_suppressed = metrics::Registry::global().counter(
+        "runos_controller_duplicate_packet_ins_total",
+        "Table-miss PacketIns of flows with setup in progress, not dispatched");
+
+    // Returns false if the PacketIn is a duplicate
+    bool admit(fluid_msg::OFMsg& msg, const OFConnectionPtr& conn);
+    void send_barrier(uint64_t seq, const OFConnectionPtr& conn);
+
+    // Async messages asked from switches, see Controller::async_config()
+    bool filter_async {true};
+    mutable std::mutex async_mutex;
+    ofp::async_config required; // by require_async()
+    ofp::async_config applied;  // last sent to connected switches
+
+    ofp::async_config compute_async() const;
+    void refresh_async();
+
+    bool tune_packet_in_len {false};
+    std::atomic<uint16_t> packet_in_bytes {0}; // 0 if not declared
+
+    // Observers of one switch run on the same worker, in message order.
+    // Declared last: its tasks use the members above until it's joined.
+    std::unique_ptr<WorkerPool> observer_pool;
+
+    void observe(std::shared_ptr<const HandlerChainMap> chains,
+                 uint32_t key, fluid_msg::OFMsg& msg, OFConnectionPtr conn);
+
+    // Rebuilt on every register_handler, read lock-free by dispatch
+    std::shared_ptr<const HandlerChainMap> chains
+        = std::make_shared<HandlerChainMap>();
+
+    void rebuild_chains();
 };
 
+bool Controller::implementation::admit(fluid_msg::OFMsg& msg,
+                                       const OFConnectionPtr& conn)
+{
+    auto& pi = static_cast<of13::PacketIn&>(msg);
+    if (pi.reason() != of13::OFPR_NO_MATCH)
+        return true; // sent by rules on purpose
+    PacketParser pp {pi};
+    if (pending->admit(conn->dpid(), pp.flow_hash()))
+        return true;
+    pending_suppressed.add();
+    return false;
+}
+
+void Controller::implementation::send_barrier(uint64_t seq,
+                                              const OFConnectionPtr& conn)
+{
+    uint32_t xid = pending_barrier_xid | (seq & ~pending_barrier_mask);
+    // templates skip send hooks, OFAgent doesn't wait for the reply
+    conn->send(barrier_template(), xid);
+}
+
+ofp::async_config Controller::implementation::compute_async() const
+{
+    constexpr uint32_t all_packet_in = 1 << of13::OFPR_NO_MATCH |
+                                       1 << of13::OFPR_ACTION |
+                                       1 << of13::OFPR_INVALID_TTL;
+    constexpr uint32_t all_port_status = 1 << of13::OFPPR_ADD |
+                                         1 << of13::OFPPR_DELETE |
+                                         1 << of13::OFPPR_MODIFY;
+    constexpr uint32_t all_flow_removed = 1 << of13::OFPRR_IDLE_TIMEOUT |
+                                          1 << of13::OFPRR_HARD_TIMEOUT |
+                                          1 << of13::OFPRR_DELETE |
+                                          1 << of13::OFPRR_GROUP_DELETE;
+
+    auto current = std::atomic_load(&chains);
+    auto taken = [&current](uint8_t type) {
+        return current->count(chain_key(type)) > 0;
+    };
+
+    ofp::async_config ret = required;
+    if (taken(of13::OFPT_PACKET_IN) ||
+            (of_server && of_server->has_packet_in_filters())) {
+        ret.packet_in_mask[0] |= all_packet_in;
+    }
+    // ports are tracked in slave role as well, to take over at once
+    if (taken(of13::OFPT_PORT_STATUS)) {
+        ret.port_status_mask[0] |= all_port_status;
+        ret.port_status_mask[1] |= all_port_status;
+    }
+    if (taken(of13::OFPT_FLOW_REMOVED)) {
+        ret.flow_removed_mask[0] |= all_flow_removed;
+    }
+    return ret;
+}
+
+void Controller::implementation::refresh_async()
+{
+    if (not filter_async || not of_server)
+        return;
+
+    ofp::async_config mask;
+    {
+        std::lock_guard<std::mutex> lock(async_mutex);
+        mask = compute_async();
+        if (std::memcmp(&mask, &applied, sizeof mask) == 0)
+            return;
+        applied = mask;
+    }
+    for (auto& conn : of_server->connections()) {
+        if (conn->alive())
+            conn->agent()->set_async(mask);
+    }
+}
+
+void Controller::implementation::rebuild_chains()
+{
+    auto lock_all = [](const std::multimap<int, OFMessageHandlerWeakPtr>& map) {
+        std::vector<OFMessageHandlerPtr> ret;
+        for (auto& map_pair : map) {
+            if (auto handler = map_pair.second.lock())
+                ret.push_back(std::move(handler));
+        }
+        return ret;
+    };
+    auto sorted = lock_all(handlers);
+    auto sorted_observers = lock_all(observers);
+
+    auto ret = std::make_shared<HandlerChainMap>();
+    auto add = [&](uint32_t key, HandlerChain chain) {
+        if (not chain.handlers.empty() || not chain.observers.empty())
+            ret->emplace(key, std::move(chain));
+    };
+
+    for (unsigned type = 0; type <= 0xff; ++type) {
+        switch (type) {
+        case of13::OFPT_MULTIPART_REPLY:
+            for (uint16_t mpart = 0; mpart <= max_mpart_type; ++mpart) {
+                add(chain_key(type, mpart),
+                    of::dispatch_multipart_reply<BuildHandlerChain,
+                                                 HandlerChain>(mpart, sorted,
+                                                 sorted_observers));
+            }
+            break;
+        case of13::OFPT_MULTIPART_REQUEST:
+            for (uint16_t mpart = 0; mpart <= max_mpart_type; ++mpart) {
+                add(chain_key(type, mpart),
+                    of::dispatch_multipart_request<BuildHandlerChain,
+                                                   HandlerChain>(mpart, sorted,
+                                                 sorted_observers));
+            }
+            break;
+        default:
+            try {
+                add(chain_key(type),
+                    of::dispatch_message<BuildHandlerChain,
+                                         HandlerChain>(type, sorted,
+                                         sorted_observers));
+            } catch (of::dispatch_error&) {
+                // not a message type we know about
+            }
+        }
+    }
+
+    std::atomic_store(&chains, std::shared_ptr<const HandlerChainMap>(ret));
+}
+
 Controller::Controller()
     : impl(new implementation(this))
 { }
 
 Controller::~Controller() = default;
 
-void Controller::init(Loader* loader, const Config& /*rootConfig*/)
+void Controller::init(Loader* loader, const Config& rootConfig)
 {
-    //const Config& config = config_cd(rootConfig, "controller");
+    const Config& config = config_cd(rootConfig, "controller");
+    impl->observer_pool = std::make_unique<WorkerPool>(
+        std::max(config_get(config, "observer-threads", 1), 1));
+    impl->observer_queue_limit = config_get(config, "observer-queue", 1024);
+    int pending_ttl = config_get(config, "pending-flow-ttl-ms", 0);
+    if (pending_ttl > 0) {
+        impl->pending = std::make_unique<pending_flows>(
+            std::chrono::milliseconds(pending_ttl));
+    }
+
+    impl->filter_async = config_get(config, "filter-async", true);
+    impl->tune_packet_in_len = config_get(config, "tune-packet-in-len", false);
+    if (impl->pending) {
+        // flow_hash() reads up to the TCP header
+        require_packet_in_bytes(18 + 20 + 20);
+    }
+
     impl->of_server = OFServer::get(loader);
     QObject::connect(impl->of_server, &OFServer::switchDiscovered,
                      this, &Controller::onSwitchDiscovered,
                      Qt::DirectConnection);
+    QObject::connect(impl->of_server, &OFServer::connectionUp,
+                     this, &Controller::onConnectionUp,
+                     Qt::DirectConnection);
 }
 
 struct ReceiveHandler
     : OFConnection::ReceiveHandler<fluid_msg::OFMsg>
+    , OFConnection::ReceiveBatchHandler
 {
     Controller* self;
     OFConnectionPtr conn;
@@ -81,11 +381,17 @@ struct ReceiveHandler
             //    << " hasn't been dispatched";
         }
     }
+
+    void process_batch(span<of13::PacketIn*> batch) override {
+        self->dispatch_batch(batch, conn);
+    }
 };
 
 void Controller::onSwitchDiscovered(OFConnectionPtr conn)
 {
     auto dpid = conn->dpid();
+    if (impl->pending)
+        impl->pending->reset(dpid);
     auto recv_handler = std::make_shared<ReceiveHandler>(this, conn);
     conn->receive(recv_handler);
 
@@ -97,26 +403,207 @@ void Controller::onSwitchDiscovered(OFConnectionPtr conn)
     }
 }
 
-void Controller::register_handler(OFMessageHandlerPtr handler, int priority)
+void Controller::onConnectionUp(OFConnectionPtr conn)
+{
+    // a new connection starts with the switch's default masks
+    if (not impl->filter_async)
+        return;
+    ofp::async_config mask;
+    {
+        std::lock_guard<std::mutex> lock(impl->async_mutex);
+        mask = impl->compute_async();
+    }
+    conn->agent()->set_async(mask);
+}
+
+void Controller::register_handler(OFMessageHandlerPtr handler, int priority,
+                                  HandlerRole role)
+{
+    if (role == HandlerRole::observer)
+        impl->observers.emplace(priority, handler);
+    else
+        impl->handlers.emplace(priority, handler);
+    impl->rebuild_chains();
+    impl->refresh_async();
+}
+
+void Controller::require_async(const ofp::async_config& needs)
+{
+    {
+        std::lock_guard<std::mutex> lock(impl->async_mutex);
+        for (int role : {0, 1}) {
+            impl->required.packet_in_mask[role] |= needs.packet_in_mask[role];
+            impl->required.port_status_mask[role] |= needs.port_status_mask[role];
+            impl->required.flow_removed_mask[role] |= needs.flow_removed_mask[role];
+        }
+    }
+    impl->refresh_async();
+}
+
+ofp::async_config Controller::async_config() const
 {
-    impl->handlers.emplace(priority, handler);
+    std::lock_guard<std::mutex> lock(impl->async_mutex);
+    return impl->compute_async();
+}
+
+void Controller::require_packet_in_bytes(uint16_t bytes)
+{
+    auto current = impl->packet_in_bytes.load();
+    while (current < bytes &&
+           not impl->packet_in_bytes.compare_exchange_weak(current, bytes))
+    { }
+}
+
+std::optional<uint16_t> Controller::packet_in_bytes() const
+{
+    auto bytes = impl->packet_in_bytes.load();
+    if (not impl->tune_packet_in_len || bytes == 0)
+        return std::nullopt;
+    return bytes;
+}
+
+void Controller::implementation::observe(
+        std::shared_ptr<const HandlerChainMap> chains, uint32_t key,
+        fluid_msg::OFMsg& msg, OFConnectionPtr conn)
+{
+    // lossy: a slow observer must not grow the queue without bound
+    if (not observer_pool ||
+            observer_queued.fetch_add(1) >= observer_queue_limit) {
+        observer_queued.fetch_sub(1);
+        observer_dropped.add();
+        return;
+    }
+
+    std::shared_ptr<uint8_t> packed {msg.pack(), &fluid_msg::OFMsg::free_buffer};
+    uint64_t dpid = conn ? conn->dpid() : 0;
+
+    observer_pool->submit(dpid, [this, chains, key, packed, conn]() {
+        auto& chain = chains->at(key);
+        if (auto copy = chain.unpack(packed.get())) {
+            for (size_t i = 0; i < chain.observers.size(); ++i) {
+                metrics::ScopedTimer timer(*chain.observer_timers[i]);
+                catch_all_and_log([&]() {
+                    chain.dispatch(*chain.observers[i], *copy, conn);
+                });
+            }
+        }
+        observer_queued.fetch_sub(1);
+    });
 }
 
 bool Controller::dispatch(fluid_msg::OFMsg& msg, OFConnectionPtr conn)
 {
     bool dispatched = false;
 
-    for (auto& map_pair : impl->handlers) {
-        if (auto handler = map_pair.second.lock()) {
-            auto dispatchable
-                = make_dispatchable<LinearDispatch>(msg);
-            if (auto do_break = dispatchable->dispatch(*handler, conn)) {
-                dispatched  = true;
-                if (*do_break) break;
-            }
+    bool admitted = false;
+    if (impl->pending && conn) {
+        if (msg.type() == of13::OFPT_PACKET_IN) {
+            if (not impl->admit(msg, conn))
+                return true;
+            admitted = true;
+        } else if (msg.type() == of13::OFPT_BARRIER_REPLY &&
+                   (msg.xid() & pending_barrier_mask) == pending_barrier_xid) {
+            if (auto next = impl->pending->confirm(conn->dpid(), msg.xid()))
+                impl->send_barrier(*next, conn);
+            return true;
         }
     }
 
+    auto chains = std::atomic_load(&impl->chains);
+    auto it = chains->find(chain_key(msg));
+    if (it == chains->end())
+        return false;
+
+    auto& chain = it->second;
+    // before deciders, which may rewrite the message
+    if (not chain.observers.empty())
+        impl->observe(chains, it->first, msg, conn);
+
+    for (size_t i = 0; i < chain.handlers.size(); ++i) {
+        auto& handler = chain.handlers[i];
+        LinearDispatch::result_type do_break;
+        {
+            metrics::ScopedTimer timer(*chain.timers[i]);
+            do_break = chain.dispatch(*handler, msg, conn);
+        }
+        if (do_break) {
+            dispatched  = true;
+            if (*do_break) break;
+        }
+    }
+
+    // after the handlers, so it follows the FlowMods they sent
+    if (admitted) {
+        if (auto seq = impl->pending->barrier(conn->dpid()))
+            impl->send_barrier(*seq, conn);
+    }
+
+    return dispatched;
+}
+
+bool Controller::dispatch_batch(span<of13::PacketIn*> batch,
+                                OFConnectionPtr conn)
+{
+    bool dispatched = false;
+
+    // PacketIns not consumed yet
+    std::vector<of13::PacketIn*> live;
+    live.reserve(batch.size());
+    bool admitted = false;
+    for (auto pi : batch) {
+        if (impl->pending && conn) {
+            if (not impl->admit(*pi, conn))
+                continue;
+            admitted = true;
+        }
+        live.push_back(pi);
+    }
+
+    auto chains = std::atomic_load(&impl->chains);
+    auto it = chains->find(chain_key(of13::OFPT_PACKET_IN));
+    if (it == chains->end())
+        return false;
+
+    auto& chain = it->second;
+    if (not chain.observers.empty()) {
+        for (auto pi : live)
+            impl->observe(chains, it->first, *pi, conn);
+    }
+
+    for (size_t i = 0; i < chain.handlers.size() && not live.empty(); ++i) {
+        metrics::ScopedTimer timer(*chain.timers[i]);
+        if (auto handler = chain.batch[i]) {
+            // a throwing batch handler loses the rest of the batch
+            catch_all_and_log([&]() {
+                handler->process_batch(live, conn);
+            });
+            dispatched = true;
+            live.erase(std::remove(live.begin(), live.end(), nullptr),
+                       live.end());
+            continue;
+        }
+
+        auto out = live.begin();
+        for (auto pi : live) {
+            bool consumed = true; // also if the handler throws
+            catch_all_and_log([&]() {
+                auto do_break = chain.dispatch(*chain.handlers[i], *pi, conn);
+                if (do_break)
+                    dispatched = true;
+                consumed = do_break && *do_break;
+            });
+            if (not consumed)
+                *out++ = pi;
+        }
+        live.erase(out, live.end());
+    }
+
+    // one barrier after the FlowMods of the whole batch
+    if (admitted) {
+        if (auto seq = impl->pending->barrier(conn->dpid()))
+            impl->send_barrier(*seq, conn);
+    }
+
     return dispatched;
 }
 
@@ -16,7 +16,9 @@
 
 #pragma once
 
+#include <cstdint>
 #include <memory>
+#include <optional>
 #include <type_traits>
 
 #include <fluid/of13msg.hh>
@@ -27,10 +29,12 @@
 #include <runos/core/future-decl.hpp>
 #include "api/FunctionalTraits.hpp"
 #include "api/DoubleDispatcher.hpp"
+#include "api/OFAgent.hpp"
 #include "api/OFConnection.hpp"
 
 #include "Application.hpp"
 #include "Loader.hpp"
+#include "lib/span.hpp"
 
 namespace runos {
 
@@ -46,6 +50,26 @@ using OFMessageHandler = LinearDispatch::Handler<Message>;
 using OFMessageHandlerPtr = std::shared_ptr<LinearDispatch::HandlerBase>;
 using OFMessageHandlerWeakPtr = std::weak_ptr<LinearDispatch::HandlerBase>;
 
+// Deciders run on the receive path in priority order, the first one
+// returning true stops the chain. Observers (loggers, sniffers) get a
+// copy of every message as it was received, later, on a worker pool.
+// Their result is ignored and messages are dropped for them when the
+// pool falls behind, so they never delay deciders.
+enum class HandlerRole { decider, observer };
+
+// Optional second base of an OFMessageHandler<of13::PacketIn> decider:
+// gets the PacketIns decoded from one read of a connection in one call,
+// to share lookups, locks and sends across the burst. Entries set to
+// nullptr are consumed, as if process() returned true for them, and
+// don't reach the handlers after this one. PacketIns received one at a
+// time (libfluid transport, of-server.packet-in-batch below 2) still
+// go through process().
+struct PacketInBatchHandler {
+    virtual void process_batch(span<fluid_msg::of13::PacketIn*> batch,
+                               OFConnectionPtr conn) = 0;
+    virtual ~PacketInBatchHandler() = default;
+};
+
 class Controller : public Application
 {
     Q_OBJECT
@@ -59,14 +83,16 @@ public:
     /**
      * Register your application as a handler for a specific OF message type
      */
-    void register_handler(OFMessageHandlerPtr handler, int priority = 0);
+    void register_handler(OFMessageHandlerPtr handler, int priority = 0,
+                          HandlerRole role = HandlerRole::decider);
 
     template<class Callable,
              class = typename std::enable_if<
                         not std::is_convertible<Callable, OFMessageHandlerPtr>
                                ::value
                      >::type>
-    OFMessageHandlerPtr register_handler(Callable&& callable, int priority= 0)
+    OFMessageHandlerPtr register_handler(Callable&& callable, int priority= 0,
+                                         HandlerRole role = HandlerRole::decider)
     {
         using Arg0 = typename traits::function_traits<Callable>
                                     ::template argument<1>;
@@ -85,14 +111,40 @@ public:
         };
 
         auto ret = std::make_shared<HandlerImpl>(std::move(callable));
-        register_handler(ret, priority);
+        register_handler(ret, priority, role);
         return ret;
     }
     
     bool dispatch(fluid_msg::OFMsg& msg, OFConnectionPtr conn);
+    // PacketIns of one read, in order
+    bool dispatch_batch(span<fluid_msg::of13::PacketIn*> batch,
+                        OFConnectionPtr conn);
+
+    /**
+     * Async messages switches send to this controller. PacketIns,
+     * PortStatus and FlowRemoved are asked for when some handler (or a
+     * PacketIn filter of OFServer) takes them, in master and equal
+     * roles; PortStatus in slave role too. Consumers outside the
+     * handler chains declare what they need with require_async().
+     */
+    void require_async(const ofp::async_config& needs);
+    ofp::async_config async_config() const;
+
+    /**
+     * Bytes of each packet PacketIn consumers read, from the start of
+     * the frame (of13::OFPCML_NO_BUFFER for whole packets). With
+     * controller.tune-packet-in-len switches are asked for the largest
+     * declared: miss_send_len is set when they come up, and rules
+     * outputting to the controller use packet_in_bytes() as max_len.
+     * Consumers replying with the packet must then use its buffer_id.
+     */
+    void require_packet_in_bytes(uint16_t bytes);
+    // nullopt if tuning is off or nothing was declared
+    std::optional<uint16_t> packet_in_bytes() const;
 
 protected slots:
     void onSwitchDiscovered(OFConnectionPtr conn);
+    void onConnectionUp(OFConnectionPtr conn);
 
 private:
     struct implementation;
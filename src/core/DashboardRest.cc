@@ -0,0 +1,174 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "RestListener.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace runos {
+
+// GET bodies of several resources in one document. It is rebuilt at
+// most once per interval, however many web UIs poll it: a request in
+// between gets the last snapshot, and concurrent ones wait for the
+// first to rebuild it rather than rebuilding it each.
+class Dashboard {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct snapshot {
+        uint64_t number = 0;
+        std::shared_ptr<const std::string> text;
+    };
+
+    // Sections are (member name, mounted path)
+    Dashboard(RestListener* rest, std::chrono::milliseconds interval,
+              std::vector<std::pair<std::string, std::string>> sections)
+        : rest_(rest)
+        , interval_(interval)
+        , sections_(std::move(sections))
+    { }
+
+    snapshot current()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = clock::now();
+        if (not current_.text || now - taken_ >= interval_) {
+            current_.text = std::make_shared<const std::string>(build());
+            ++current_.number;
+            taken_ = now;
+        }
+        return current_;
+    }
+
+private:
+    RestListener* rest_;
+    std::chrono::milliseconds interval_;
+    std::vector<std::pair<std::string, std::string>> sections_;
+
+    std::mutex mutex_;
+    clock::time_point taken_;
+    snapshot current_;
+
+    // Same shape as the error replies of RestListener
+    static void error(json_writer& doc, const std::string& name,
+                      unsigned code)
+    {
+        doc.key(name).begin_object()
+           .key("error").begin_object()
+           .put("type", "http_error")
+           .put("code", code)
+           .end_object()
+           .end_object();
+    }
+
+    std::string build()
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::milliseconds;
+
+        json_writer doc;
+        doc.begin_object();
+        for (const auto& section : sections_) {
+            // A missing or failing section doesn't take the others down
+            json_writer body;
+            try {
+                rest_->render(section.second, body);
+                doc.key(section.first).value(std::move(body));
+            } catch (const rest::http_error& e) {
+                error(doc, section.first, e.code());
+            } catch (const std::exception& e) {
+                LOG(WARNING) << "[dashboard] Section " << section.first
+                             << " failed: " << e.what();
+                error(doc, section.first, 500);
+            }
+        }
+        auto since_epoch = std::chrono::system_clock::now().time_since_epoch();
+        doc.put("taken", duration_cast<milliseconds>(since_epoch).count())
+           .put("interval-ms", interval_.count())
+           .end_object();
+
+        std::string text;
+        for (auto& chunk : doc.release())
+            text += chunk;
+        return text;
+    }
+};
+
+// Versioned by snapshot, so RestListener caches the reply once per
+// interval and unchanged UIs get 304 through the ETag
+struct DashboardResource : rest::resource
+{
+    Dashboard* board;
+
+    explicit DashboardResource(Dashboard* board)
+        : board(board)
+    { }
+
+    uint64_t Generation() const override
+    { return board->current().number; }
+
+    void Stream(json_writer& out) const override
+    { out.json(*board->current().text); }
+};
+
+class DashboardRest : public Application
+{
+    SIMPLE_APPLICATION(DashboardRest, "dashboard-rest")
+public:
+    void init(Loader* loader, const Config& rootConfig) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto config = config_cd(rootConfig, "dashboard-rest");
+        auto interval = std::chrono::milliseconds(
+            std::max(config_get(config, "interval-ms", 1000), 0));
+
+        std::vector<std::pair<std::string, std::string>> sections;
+        auto it = config.find("sections");
+        if (it != config.end()) {
+            for (auto& section : it->second.object_items())
+                sections.emplace_back(section.first,
+                                      section.second.string_value());
+        }
+
+        auto rest_ = RestListener::get(loader);
+        board_ = std::make_unique<Dashboard>(rest_, interval,
+                                             std::move(sections));
+
+        rest_->mount(path_spec("/dashboard/"), [=](const path_match&)
+        {
+            return DashboardResource {board_.get()};
+        });
+    }
+
+private:
+    std::unique_ptr<Dashboard> board_;
+};
+
+REGISTER_APPLICATION(DashboardRest, {"rest-listener", ""})
+
+} // namespace runos
@@ -17,71 +17,678 @@
 #include "DatabaseConnector.hpp"
 
 #include "redisdb/redisdatabase.hpp"
+#include "redisdb/asyncredisclient.hpp"
 #include "Config.hpp"
 
+#include <runos/core/logging.hpp>
+
+#include <boost/thread/executors/inline_executor.hpp>
+
+#include <algorithm>
+#include <sstream>
+
 namespace runos {
 
 REGISTER_APPLICATION(DatabaseConnector, {""})
 
+using lock_t = std::lock_guard<std::mutex>;
+
+static boost::inline_executor flush_executor;
+
 void DatabaseConnector::init(Loader* loader, const Config& root_config)
 {
     auto& config = config_cd(root_config, "database-connector");
-    rdb_ = std::make_unique<RedisDatabase>();
+    // Connections to the store, each thread sticks to one of them
+    rdb_ = std::make_unique<RedisDatabase>(
+        std::max(1, config_get(config, "pool-size", 4)));
     db_address_ = config_get(config, "db-address", "127.0.0.1");
     db_port_ = config_get(config, "db-port", 6379);
 
+    // "host:port,..." sharing the keys with db-address
+    std::vector<RedisDatabase::Endpoint> nodes;
+    std::istringstream nodes_list(config_get(config, "db-nodes", ""));
+    std::string node;
+    while (std::getline(nodes_list, node, ',')) {
+        if (node.empty())
+            continue;
+        auto colon = node.rfind(':');
+        if (colon == std::string::npos) {
+            nodes.push_back({ node, 6379 });
+        } else {
+            nodes.push_back({ node.substr(0, colon),
+                              std::stoi(node.substr(colon + 1)) });
+        }
+    }
+    const bool cluster = config_get(config, "db-cluster", false);
+    sharded_ = cluster || not nodes.empty();
+
     if (rdb_->connectToStore(db_address_.c_str(), db_port_) >= 0) {
-        rdb_->setupMasterRole();
+        if (sharded_) {
+            rdb_->addNodes(nodes, cluster);
+        } else {
+            rdb_->setupMasterRole();
+        }
+    }
+
+    // Coalesces rewrites of the same key, 0 writes through
+    write_behind_ = std::chrono::milliseconds(
+        config_get(config, "write-behind-ms", 100));
+    if (write_behind_.count() > 0) {
+        startTimer(write_behind_.count());
+    }
+
+    hydrate_ttl_ = std::chrono::milliseconds(
+        config_get(config, "hydrate-ttl-ms", 5000));
+}
+
+void DatabaseConnector::timerEvent(QTimerEvent*)
+{
+    flush();
+}
+
+void DatabaseConnector::write(const std::string& prefix,
+                              const std::string& key,
+                              boost::optional<std::string> value) const
+{
+    { // lock
+        lock_t lock(pending_mutex_);
+        pending_[{prefix, key}] = std::move(value);
+        forget(prefix);
+    } // unlock
+
+    if (write_behind_.count() <= 0) {
+        flush();
+    }
+}
+
+static bool nested(const std::string& prefix, const std::string& of)
+{
+    return of.empty() || prefix == of ||
+           (prefix.size() > of.size() && prefix[of.size()] == ':' &&
+            prefix.compare(0, of.size(), of) == 0);
+}
+
+void DatabaseConnector::forget(const std::string& prefix) const
+{
+    if (hydrating_) {
+        hydrate_dirty_.push_back(prefix);
+    }
+    for (auto it = hydrated_.begin(); it != hydrated_.end(); ) {
+        it = nested(it->first, prefix) ? hydrated_.erase(it) : ++it;
+    }
+}
+
+bool DatabaseConnector::hydrated(const std::string& prefix,
+                                 std::map<std::string, std::string>& values) const
+{
+    if (hydrated_.empty())
+        return false;
+    if (std::chrono::steady_clock::now() >= hydrated_until_) {
+        hydrated_.clear();
+        return false;
+    }
+
+    auto it = hydrated_.find(prefix);
+    if (it == hydrated_.end())
+        return false;
+    values = std::move(it->second);
+    hydrated_.erase(it);
+    return true;
+}
+
+void DatabaseConnector::declarePrefixes(
+        const std::vector<std::string>& prefixes) const
+{
+    lock_t lock(pending_mutex_);
+    for (auto& prefix : prefixes) {
+        if (std::find(declared_.begin(), declared_.end(), prefix) ==
+                declared_.end()) {
+            declared_.push_back(prefix);
+        }
+    }
+}
+
+void DatabaseConnector::hydrate() const
+{
+    std::vector<std::string> prefixes;
+    { // lock
+        lock_t lock(pending_mutex_);
+        prefixes = declared_;
+        hydrated_.clear();
+        hydrate_dirty_.clear();
+        hydrating_ = true;
+    } // unlock
+
+    // A replica already serves all reads locally
+    auto values = prefixes.empty() || hasReplica()
+        ? std::vector<std::map<std::string, std::string>>()
+        : rdb_->getHashesValues(prefixes);
+
+    lock_t lock(pending_mutex_);
+    hydrating_ = false;
+    for (size_t i = 0; i < values.size(); ++i) {
+        auto dirty = std::any_of(hydrate_dirty_.begin(), hydrate_dirty_.end(),
+            [&](const std::string& p) { return nested(prefixes[i], p); });
+        if (not dirty) {
+            hydrated_.emplace(prefixes[i], std::move(values[i]));
+        }
+    }
+    hydrate_dirty_.clear();
+    hydrated_until_ = std::chrono::steady_clock::now() + hydrate_ttl_;
+
+    VLOG(3) << "[DatabaseConnector] Hydrated " << hydrated_.size()
+            << " of " << prefixes.size() << " declared prefixes";
+}
+
+void DatabaseConnector::overlay(const std::string& prefix,
+                                std::map<std::string, std::string>& values) const
+{
+    auto apply = [&values](const std::string& key,
+                           const boost::optional<std::string>& value) {
+        if (value) {
+            values[key] = *value;
+        } else {
+            values.erase(key);
+        }
+    };
+
+    lock_t lock(pending_mutex_);
+    for (auto it = inflight_.lower_bound({prefix, ""});
+         it != inflight_.end() && it->first.first == prefix; ++it) {
+        apply(it->first.second, it->second.second);
+    }
+    for (auto it = pending_.lower_bound({prefix, ""});
+         it != pending_.end() && it->first.first == prefix; ++it) {
+        apply(it->first.second, it->second);
+    }
+}
+
+void DatabaseConnector::settle(uint64_t flush,
+                               const std::vector<PendingKey>& keys) const
+{
+    lock_t lock(pending_mutex_);
+    for (auto& key : keys) {
+        auto it = inflight_.find(key);
+        // unless flushed again since
+        if (it != inflight_.end() && it->second.first == flush) {
+            inflight_.erase(it);
+        }
+    }
+}
+
+void DatabaseConnector::flush(bool wait) const
+{
+    decltype(pending_) pending;
+    uint64_t flush_id;
+    { // lock
+        lock_t lock(pending_mutex_);
+        pending.swap(pending_);
+        if (pending.empty())
+            return;
+
+        flush_id = ++flushes_;
+        for (auto& item : pending) {
+            inflight_[item.first] = { flush_id, item.second };
+        }
+    } // unlock
+
+    SValues values;
+    std::vector<PendingKey> put_keys, deleted_keys;
+    for (auto& item : pending) {
+        const auto& prefix = item.first.first;
+        const auto& key = item.first.second;
+        if (item.second) {
+            put_keys.push_back(item.first);
+            values.push_back({ prefix, key, std::move(*item.second) });
+        } else {
+            deleted_keys.push_back(item.first);
+            record(Change::Op::Delete, prefix, key);
+            rdb_->delHashValue(prefix, key);
+            // Flat key written before prefixes became hashes
+            rdb_->delValue(std::string{prefix + ":" + key}.c_str());
+        }
+    }
+    settle(flush_id, deleted_keys);
+
+    if (values.empty())
+        return;
+
+    VLOG(30) << "[DatabaseConnector] Flushing " << values.size()
+             << " coalesced values";
+
+    auto done = putSValues(std::move(values)).then(flush_executor,
+        [this, flush_id, put_keys = std::move(put_keys)](future<void> f) {
+            try {
+                f.get();
+            } catch (redis_error& e) {
+                LOG(ERROR) << "[DatabaseConnector] Write-behind flush failed: "
+                           << e.what();
+            }
+            settle(flush_id, put_keys);
+        });
+
+    if (wait) {
+        done.wait();
     }
 }
 
 Json DatabaseConnector::getJson(const std::string& prefix,
                                 const std::string& key) const
 {
-    return rdb_->getDoc(std::string{prefix + ":" + key}.c_str());
+    Json doc = nullptr;
+    std::string str = getSValue(prefix, key);
+    if (str.empty()) {
+        LOG(ERROR) << "[DatabaseConnector] get json("
+                   << prefix << ":" << key << ") fail.";
+    } else {
+        std::string err;
+        doc = Json::parse(str, err);
+    }
+    return doc;
 }
 
 void DatabaseConnector::delJson(const std::string& prefix,
                                 const std::string& key) const
 {
-    rdb_->delValue(std::string{prefix + ":" + key}.c_str());
+    write(prefix, key, boost::none);
 }
 
 void DatabaseConnector::putSValue(const std::string &prefix,
                                   const std::string &key,
                                   const std::string &str) const
 {
-    rdb_->putValue(std::string{prefix + ":" + key}, str);
+    write(prefix, key, str);
+}
+
+future<void> DatabaseConnector::putSValues(SValues values) const
+{
+    std::vector<RedisDatabase::HashValue> hvalues;
+    hvalues.reserve(values.size());
+    { // lock
+        lock_t lock(pending_mutex_);
+        for (auto& v : values) {
+            forget(v.prefix);
+        }
+    } // unlock
+    for (auto& v : values) {
+        record(Change::Op::Put, v.prefix, v.key, v.value);
+        hvalues.push_back({ std::move(v.prefix), std::move(v.key),
+                            std::move(v.value) });
+    }
+    return rdb_->putHashValues(std::move(hvalues));
 }
 
 std::string DatabaseConnector::getSValue(const std::string& prefix,
                                          const std::string& key) const
 {
-    return rdb_->getValue(std::string{prefix + ":" + key});
+    { // lock
+        lock_t lock(pending_mutex_);
+        auto it = pending_.find({prefix, key});
+        if (it != pending_.end()) {
+            return it->second.value_or(std::string());
+        }
+        auto flushed = inflight_.find({prefix, key});
+        if (flushed != inflight_.end()) {
+            return flushed->second.second.value_or(std::string());
+        }
+        // Served once, a missing key may still be a legacy flat one
+        auto copy = hydrated_.find(prefix);
+        if (copy != hydrated_.end() &&
+                std::chrono::steady_clock::now() < hydrated_until_) {
+            auto value = copy->second.find(key);
+            if (value != copy->second.end()) {
+                auto ret = std::move(value->second);
+                copy->second.erase(value);
+                return ret;
+            }
+        }
+    } // unlock
+
+    { // lock
+        lock_t lock(replica_mutex_);
+        if (replica_) {
+            auto value = replica_->find(prefix, key);
+            return value ? *value : std::string();
+        }
+    } // unlock
+
+    auto ret = rdb_->getHashValue(prefix, key);
+    if (ret.empty()) {
+        // Flat key written before prefixes became hashes
+        ret = rdb_->getValue(std::string{prefix + ":" + key});
+    }
+    return ret;
+}
+
+json_document DatabaseConnector::getDocument(const std::string& prefix,
+                                            const std::string& key) const
+{
+    return json_document(getSValue(prefix, key));
+}
+
+std::map<std::string, std::string>
+DatabaseConnector::getSValues(const std::string& prefix) const
+{
+    std::map<std::string, std::string> ret;
+    bool from_replica = false;
+    { // lock
+        lock_t lock(replica_mutex_);
+        if (replica_) {
+            ret = replica_->values(prefix);
+            from_replica = true;
+        }
+    } // unlock
+
+    bool from_copy = false;
+    if (not from_replica) {
+        lock_t lock(pending_mutex_);
+        from_copy = hydrated(prefix, ret);
+    }
+    if (not from_replica && not from_copy) {
+        ret = rdb_->getHashValues(prefix);
+    }
+    overlay(prefix, ret);
+    return ret;
+}
+
+std::map<std::string, std::map<std::string, std::string>>
+DatabaseConnector::loadPrefixes(const std::vector<std::string>& prefixes) const
+{
+    std::map<std::string, std::map<std::string, std::string>> ret;
+    std::vector<std::string> fetch;
+    { // lock
+        lock_t lock(replica_mutex_);
+        for (auto& prefix : prefixes) {
+            if (replica_) {
+                ret[prefix] = replica_->values(prefix);
+            } else {
+                fetch.push_back(prefix);
+            }
+        }
+    } // unlock
+
+    { // lock
+        lock_t lock(pending_mutex_);
+        fetch.erase(std::remove_if(fetch.begin(), fetch.end(),
+            [&](const std::string& prefix) {
+                return hydrated(prefix, ret[prefix]);
+            }), fetch.end());
+    } // unlock
+
+    auto values = rdb_->getHashesValues(fetch);
+    for (size_t i = 0; i < fetch.size(); ++i) {
+        ret[fetch[i]] = std::move(values[i]);
+    }
+    for (auto& pair : ret) {
+        overlay(pair.first, pair.second);
+    }
+    return ret;
+}
+
+std::string DatabaseConnector::switchPrefix(const std::string& prefix,
+                                           const std::string& dpid) const
+{
+    return sharded_ ? prefix + ":{" + dpid + "}" : prefix + ":" + dpid;
 }
 
 std::vector<std::string>
 DatabaseConnector::getKeys(const std::string& prefix) const
 {
-    auto dotted_prefix = prefix + ":";
-    std::vector<std::string> ret = rdb_->getKeys(dotted_prefix);
-    for(auto& key : ret) {
-        key.erase(0, dotted_prefix.length());
+    std::vector<std::string> ret;
+    for (auto& kv : getSValues(prefix)) {
+        ret.push_back(kv.first);
     }
     return ret;
 }
 
+void DatabaseConnector::armStamp(const std::string& prefix,
+                                 const std::string& key,
+                                 std::vector<std::string> watched) const
+{
+    lock_t lock(stamp_mutex_);
+    stamp_key_ = {prefix, key};
+    stamp_watched_ = std::move(watched);
+    stamp_armed_ = true;
+}
+
+bool DatabaseConnector::stampArmed() const
+{
+    lock_t lock(stamp_mutex_);
+    return stamp_armed_;
+}
+
+bool DatabaseConnector::watched(const std::string& prefix) const
+{
+    for (const auto& w : stamp_watched_) {
+        if (prefix.compare(0, w.size(), w) == 0 &&
+            (prefix.size() == w.size() || prefix[w.size()] == ':'))
+            return true;
+    }
+    return false;
+}
+
+bool DatabaseConnector::putStamp(const std::string& value) const
+{
+    lock_t lock(stamp_mutex_);
+    if (not stamp_armed_)
+        return false;
+
+    try {
+        rdb_->putHashValues({{ stamp_key_.first, stamp_key_.second, value }})
+            .get();
+    } catch (redis_error& e) {
+        LOG(ERROR) << "[DatabaseConnector] Can't put snapshot stamp: "
+                   << e.what();
+        return false;
+    }
+    return true;
+}
+
 void DatabaseConnector::deleteAllKeys() const
 {
+    { // lock
+        lock_t lock(pending_mutex_);
+        pending_.clear();
+        inflight_.clear();
+        forget(std::string());
+    } // unlock
+    record(Change::Op::Clear, std::string());
     rdb_->clearDB();
 }
 
 void DatabaseConnector::delPrefix(const std::string& prefix) const
 {
-    std::vector<std::string> ret = getKeys(prefix);
-    for(auto &key : ret) {
-        delJson(prefix, key);
+    // Pending writes must not resurrect deleted keys
+    flush(true);
+
+    { // lock
+        lock_t lock(pending_mutex_);
+        forget(prefix);
+    } // unlock
+    record(Change::Op::DeletePrefix, prefix);
+
+    // The hash itself, nested prefixes and legacy flat keys
+    std::vector<std::string> keys = rdb_->getKeys(prefix + ":");
+    keys.push_back(prefix);
+    rdb_->delKeys(keys);
+}
+
+void DatabaseConnector::record(Change::Op op, const std::string& prefix,
+                               const std::string& key,
+                               const std::string& value) const
+{
+    { // lock
+        lock_t lock(stamp_mutex_);
+        if (stamp_armed_ && (op == Change::Op::Clear || watched(prefix))) {
+            stamp_armed_ = false;
+            // Sent ahead of the change, on the connection of this thread
+            rdb_->putHashValues({{ stamp_key_.first, stamp_key_.second,
+                                   std::string() }})
+                .then(flush_executor, [](future<void> f) {
+                    try {
+                        f.get();
+                    } catch (redis_error& e) {
+                        LOG(ERROR) << "[DatabaseConnector] Can't clear "
+                                   << "snapshot stamp: " << e.what();
+                    }
+                });
+        }
+    } // unlock
+
+    auto seq = change_log_.append(op, prefix, key, value);
+
+    lock_t lock(replica_mutex_);
+    if (replica_ || digest_tracked_) {
+        Change change { seq, op, prefix, key, value };
+        if (replica_) {
+            replica_->apply(change);
+        }
+        if (digest_tracked_) {
+            digest_.apply(change);
+        }
+    }
+}
+
+std::vector<Change> DatabaseConnector::snapshot(uint64_t& seq) const
+{
+    // Changes after seq are sent afterwards, applying them twice is safe
+    seq = change_log_.seq();
+    flush(true);
+
+    std::vector<Change> ret;
+    for (auto& prefix : rdb_->getHashKeys(std::string())) {
+        for (auto& kv : rdb_->getHashValues(prefix)) {
+            ret.push_back({ 0, Change::Op::Put, prefix,
+                            kv.first, std::move(kv.second) });
+        }
+    }
+    return ret;
+}
+
+void DatabaseConnector::setReplica(StateImage image) const
+{
+    { // lock
+        lock_t lock(pending_mutex_);
+        forget(std::string());
+    } // unlock
+    lock_t lock(replica_mutex_);
+    replica_ = std::make_unique<StateImage>(std::move(image));
+    if (digest_tracked_) {
+        digest_replica();
+    }
+}
+
+void DatabaseConnector::applyReplica(const std::vector<Change>& changes) const
+{
+    lock_t lock(replica_mutex_);
+    if (not replica_)
+        return;
+    for (auto& change : changes) {
+        replica_->apply(change);
+        if (digest_tracked_) {
+            digest_.apply(change);
+        }
+    }
+}
+
+bool DatabaseConnector::hasReplica() const
+{
+    lock_t lock(replica_mutex_);
+    return bool(replica_);
+}
+
+void DatabaseConnector::digest_replica() const
+{
+    digest_.clear();
+    auto since = digest_.generation();
+    for (auto& prefix : replica_->prefixes()) {
+        digest_.assign(prefix, replica_->values(prefix), since);
+    }
+}
+
+size_t DatabaseConnector::read_partitions(std::vector<std::string> prefixes) const
+{
+    size_t ret = 0;
+    for (int round = 0; round < 3 && not prefixes.empty(); ++round) {
+        if (round > 0) {
+            // Writes of the changed partitions reach the store first
+            flush(true);
+        }
+        auto since = digest_.generation();
+        auto values = rdb_->getHashesValues(prefixes);
+        ret += prefixes.size();
+
+        std::vector<std::string> changed;
+        lock_t lock(replica_mutex_);
+        for (size_t i = 0; i < prefixes.size(); ++i) {
+            if (not digest_.assign(prefixes[i], values[i], since)) {
+                changed.push_back(std::move(prefixes[i]));
+            } else if (replica_) {
+                replica_->assign(prefixes[i], std::move(values[i]));
+            }
+        }
+        prefixes = std::move(changed);
+    }
+
+    if (not prefixes.empty()) {
+        LOG(WARNING) << "[DatabaseConnector] " << prefixes.size()
+                     << " partitions kept changing while read for the digest";
+    }
+    return ret;
+}
+
+void DatabaseConnector::trackDigest() const
+{
+    { // lock
+        lock_t lock(replica_mutex_);
+        if (digest_tracked_.exchange(true))
+            return;
+        if (replica_) {
+            digest_replica();
+            return;
+        }
+    } // unlock
+
+    // Changes from now on are followed, pending ones are read back
+    flush(true);
+    auto n = read_partitions(rdb_->getHashKeys(std::string()));
+    VLOG(3) << "[DatabaseConnector] Digest seeded from " << n
+            << " stored partitions";
+}
+
+size_t DatabaseConnector::resync(const std::vector<size_t>& buckets) const
+{
+    auto stored = rdb_->getHashKeys(std::string());
+
+    if (not hasReplica()) {
+        auto values = rdb_->getHashesValues(stored);
+        StateImage image;
+        for (size_t i = 0; i < stored.size(); ++i) {
+            image.assign(stored[i], std::move(values[i]));
+        }
+        digest_tracked_ = true;
+        setReplica(std::move(image));
+        return stored.size();
+    }
+    trackDigest();
+
+    // Partitions of the buckets in the store, and those only held here
+    std::vector<std::string> prefixes;
+    for (auto& prefix : stored) {
+        if (std::find(buckets.begin(), buckets.end(),
+                      StateDigest::bucket(prefix)) != buckets.end()) {
+            prefixes.push_back(std::move(prefix));
+        }
+    }
+    for (auto b : buckets) {
+        for (auto& prefix : digest_.partitions(b)) {
+            if (std::find(prefixes.begin(), prefixes.end(), prefix) ==
+                    prefixes.end()) {
+                prefixes.push_back(std::move(prefix));
+            }
+        }
     }
+    return read_partitions(std::move(prefixes));
 }
 
 bool DatabaseConnector::hasConnection() const
@@ -91,11 +698,23 @@ bool DatabaseConnector::hasConnection() const
 
 void DatabaseConnector::setupMasterRole() const
 {
-    rdb_->setupMasterRole();
+    // Sharded nodes are replicated by their own configuration
+    if (not sharded_) {
+        rdb_->setupMasterRole();
+    }
+    // Recovery reads the store right after the role change
+    flush(true);
 }
 
 void DatabaseConnector::setupSlaveOf(const char* address, int port) const
 {
+    // Writes still pending would be lost on a replica
+    flush(true);
+    if (sharded_) {
+        LOG(WARNING) << "[DatabaseConnector] The store is sharded, "
+                        "not replicating " << address << ":" << port;
+        return;
+    }
     rdb_->setupSlaveOf(address, port);
 }
 
@@ -20,6 +20,15 @@
 #include "Loader.hpp"
 #include "redisdb/redisdatabase.hpp"
 #include "json.hpp"
+#include "lib/change_log.hpp"
+#include "lib/json_reader.hpp"
+#include "lib/state_digest.hpp"
+
+#include <boost/optional.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
 
 namespace runos {
 using json = nlohmann::json;
@@ -31,6 +40,7 @@ class DatabaseConnector final : public Application {
 public:
     void init(Loader* loader, const Config& config) override;
 
+    // Every prefix is stored as one redis hash, keys are its fields.
     // T must have a method std::string T::dump();
     // So it can be used with hlohmann::json and Json from json11
     template<typename T>
@@ -38,7 +48,7 @@ public:
                  const std::string& key,
                  const T& json) const
     {
-        rdb_->putValue(std::string{prefix + ":" + key}, json.dump());
+        putSValue(prefix, key, json.dump());
     }
 
     Json getJson(const std::string& prefix, const std::string& key) const;
@@ -48,10 +58,51 @@ public:
                    const std::string& str) const;
     std::string getSValue(const std::string& prefix,
                           const std::string& key) const;
+    // Value parsed on demand, see json_reader. Suits bulk documents
+    // that are read once, missing root if there is no value.
+    json_document getDocument(const std::string& prefix,
+                              const std::string& key) const;
+
+    // Stores all values in one transaction and one round trip
+    struct SValue {
+        std::string prefix;
+        std::string key;
+        std::string value;
+    };
+    using SValues = std::vector<SValue>;
+    future<void> putSValues(SValues values) const;
+
+    // Loads the whole prefix with cursor iteration
+    std::map<std::string, std::string> getSValues(const std::string& prefix) const;
+    // Loads many prefixes at once, their reads are pipelined
+    std::map<std::string, std::map<std::string, std::string>>
+    loadPrefixes(const std::vector<std::string>& prefixes) const;
     std::vector<std::string> getKeys(const std::string& prefix) const;
+    // Prefix of per-switch data. With a sharded store the dpid is a
+    // hash tag, so all prefixes of a switch live on one node.
+    std::string switchPrefix(const std::string& prefix,
+                             const std::string& dpid) const;
     void deleteAllKeys() const;
     void delPrefix(const std::string& prefix) const;
 
+    // Freshness stamp of a local copy of the stored state, see
+    // StateSnapshot. armStamp() starts a copy of the `watched` prefixes
+    // (with their nested ones); putStamp() stores its stamp unless one
+    // of them has been written since, and the first such write after
+    // that clears the stamp before reaching the store.
+    void armStamp(const std::string& prefix, const std::string& key,
+                  std::vector<std::string> watched) const;
+    bool putStamp(const std::string& value) const;
+    // False once a watched prefix has been written
+    bool stampArmed() const;
+
+    // Startup and takeover loading. Apps declare the prefixes they load
+    // in init(), hydrate() fetches all of them at once before the apps
+    // are told to load. Within hydrate-ttl-ms every hydrated value is
+    // served once from that copy, writes to a prefix drop its copy.
+    void declarePrefixes(const std::vector<std::string>& prefixes) const;
+    void hydrate() const;
+
     bool hasConnection() const;
     void setupMasterRole() const;
     void setupSlaveOf(const char* address, int port) const;
@@ -59,10 +110,93 @@ public:
     std::string getDatabaseAddress() const;
     uint32_t getDatabasePort() const;
 
+    // Writes pending in the write-behind cache. With wait = true
+    // returns when the store has accepted them.
+    void flush(bool wait = false) const;
+
+    // Replication, see StateReplicator.
+    // Every mutation written to the store is appended to the log.
+    ChangeLog& changeLog() const { return change_log_; }
+    // The whole stored state as Put changes, current as of seq
+    std::vector<Change> snapshot(uint64_t& seq) const;
+    // Once set, the image serves all reads and follows all writes
+    void setReplica(StateImage image) const;
+    void applyReplica(const std::vector<Change>& changes) const;
+    bool hasReplica() const;
+
+    // Digest of the state as this node holds it. Once tracked it follows
+    // every change made or replicated here; trackDigest() seeds it from
+    // the replica, or from the store without one.
+    void trackDigest() const;
+    bool digestTracked() const { return digest_tracked_; }
+    StateDigest::Summary digest() const { return digest_.summary(); }
+    // Reads the partitions of `buckets` from the store into the replica.
+    // Without a replica yet reads the whole store and makes it one.
+    // Returns the number of partitions read.
+    size_t resync(const std::vector<size_t>& buckets) const;
+
+protected:
+    void timerEvent(QTimerEvent*) override;
+
 private:
     std::unique_ptr<RedisDatabase> rdb_;
     std::string db_address_;
     uint32_t db_port_;
+    bool sharded_ {false};
+
+    // Write-behind cache: the last value (or none for deletion) per
+    // prefix and key, written to the store once per window.
+    using PendingKey = std::pair<std::string, std::string>;
+    mutable std::map<PendingKey, boost::optional<std::string>> pending_;
+    // Flushed values until the store confirms them, tagged with their
+    // flush: another thread reads on another connection of the pool
+    mutable std::map<PendingKey,
+                     std::pair<uint64_t, boost::optional<std::string>>>
+        inflight_;
+    mutable uint64_t flushes_ {0};
+    // Prefixes fetched by hydrate(), until hydrated_until_
+    mutable std::vector<std::string> declared_;
+    mutable std::map<std::string, std::map<std::string, std::string>>
+        hydrated_;
+    mutable std::chrono::steady_clock::time_point hydrated_until_;
+    // Written while hydrate() fetches, their copies are stale
+    mutable bool hydrating_ {false};
+    mutable std::vector<std::string> hydrate_dirty_;
+    std::chrono::milliseconds hydrate_ttl_ {5000};
+    mutable std::mutex pending_mutex_; // and inflight_, hydration
+    std::chrono::milliseconds write_behind_ {0};
+
+    mutable PendingKey stamp_key_;
+    mutable std::vector<std::string> stamp_watched_;
+    mutable bool stamp_armed_ {false};
+    mutable std::mutex stamp_mutex_;
+
+    mutable ChangeLog change_log_;
+    mutable std::unique_ptr<StateImage> replica_;
+    mutable std::mutex replica_mutex_; // and changes of digest_
+    mutable StateDigest digest_;
+    mutable std::atomic<bool> digest_tracked_ {false};
+
+    void write(const std::string& prefix, const std::string& key,
+               boost::optional<std::string> value) const;
+    void settle(uint64_t flush, const std::vector<PendingKey>& keys) const;
+    bool watched(const std::string& prefix) const; // under stamp_mutex_
+    void record(Change::Op op, const std::string& prefix,
+                const std::string& key = std::string(),
+                const std::string& value = std::string()) const;
+    // Drops hydrated copies of the prefix and nested ones, all of them
+    // for an empty prefix; under pending_mutex_
+    void forget(const std::string& prefix) const;
+    // Takes the hydrated copy of the prefix; under pending_mutex_
+    bool hydrated(const std::string& prefix,
+                  std::map<std::string, std::string>& values) const;
+    void overlay(const std::string& prefix,
+                 std::map<std::string, std::string>& values) const;
+    // Digest from the replica, under replica_mutex_
+    void digest_replica() const;
+    // Reads the partitions into the digest and the replica, again
+    // those written meanwhile; returns the number of reads
+    size_t read_partitions(std::vector<std::string> prefixes) const;
 };
 
 }
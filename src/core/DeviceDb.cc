@@ -19,15 +19,21 @@
 #include <runos/PropertySheet.hpp>
 #include <runos/Utility.hpp>
 
+#include "lib/state_snapshot.hpp"
+
 #include <runos/core/throw.hpp>
 #include <runos/core/logging.hpp>
 
 #include <json11.hpp>
 #include <boost/filesystem/fstream.hpp>
 
-#include <any>
+#include <cerrno>
+#include <cstring>
+#include <deque>
 #include <map>
+#include <shared_mutex>
 #include <sstream>
+#include <unordered_map>
 
 namespace fs = boost::filesystem;
 
@@ -35,6 +41,56 @@ namespace runos {
 
 namespace devicedb {
 
+namespace {
+
+struct KeyTable {
+    std::shared_mutex mutex;
+    std::deque<std::string> names; // owns the string_views in `ids`
+    std::unordered_map<std::string_view, uint32_t> ids;
+};
+
+KeyTable& key_table()
+{
+    static KeyTable table;
+    return table;
+}
+
+} // anonymous
+
+PropertyKey PropertyKey::intern(std::string_view name)
+{
+    if (auto key = find(name))
+        return *key;
+
+    auto& table = key_table();
+    std::unique_lock<std::shared_mutex> lock(table.mutex);
+    auto it = table.ids.find(name);
+    if (it != table.ids.end())
+        return PropertyKey(it->second);
+
+    auto id = static_cast<uint32_t>(table.names.size());
+    table.names.emplace_back(name);
+    table.ids.emplace(table.names.back(), id);
+    return PropertyKey(id);
+}
+
+std::optional<PropertyKey> PropertyKey::find(std::string_view name)
+{
+    auto& table = key_table();
+    std::shared_lock<std::shared_mutex> lock(table.mutex);
+    auto it = table.ids.find(name);
+    if (it == table.ids.end())
+        return std::nullopt;
+    return PropertyKey(it->second);
+}
+
+std::string_view PropertyKey::name() const
+{
+    auto& table = key_table();
+    std::shared_lock<std::shared_mutex> lock(table.mutex);
+    return table.names[m_id];
+}
+
 constexpr const char* QueryBuilder::columns[];
 
 QueryBuilder& QueryBuilder::dpid(uint64_t u)
@@ -78,6 +134,257 @@ ResultSet QueryBuilder::execute()
 using namespace property_sheet;
 using TEntry = PropertySheet::Entry;
 
+namespace {
+
+/*
+ * Compiled props file: a SnapshotFile stamped with the hash of the file
+ * name and content, with sections
+ *   "strings"  every distinct string once, the key is its id
+ *   "entries"  an entry per record as 32-bit words: the match of every
+ *              column, then the properties, strings by id
+ * Strings are used in place. Regexes are compiled again on load, the
+ * preprocessing and the json are skipped.
+ */
+enum MatchKind : uint32_t { ANY_MATCH, EXACT_MATCH, FUZZY_MATCH };
+enum ValueKind : uint32_t { STR_VALUE, NUM_VALUE, BOOL_VALUE };
+
+uint64_t content_hash(std::string_view name, std::string_view content)
+{
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    auto mix = [&h](std::string_view s) {
+        for (unsigned char c : s)
+            h = (h ^ c) * 0x100000001b3ULL;
+    };
+    mix("devicedb-compiled-1");
+    mix(name);
+    mix(std::string_view("\0", 1));
+    mix(content);
+    return h;
+}
+
+class Compiler {
+public:
+    explicit Compiler(uint64_t stamp)
+        : writer_(stamp)
+    { }
+
+    // Entry already loaded once, so of a known shape
+    void add(Json const& jentry)
+    {
+        std::vector<uint32_t> words;
+        auto& selector = jentry["selector"].object_items();
+        for (auto column : devicedb::QueryBuilder::columns) {
+            auto it = selector.find(column);
+            std::string type = it != selector.end()
+                ? it->second["type"].string_value() : std::string();
+            if (type == FromJson<ExactMatch>::json_type) {
+                words.push_back(EXACT_MATCH);
+                words.push_back(intern(it->second["value"].string_value()));
+            } else if (type == FromJson<FuzzyMatch>::json_type) {
+                auto& smatch = it->second["smatch"].object_items();
+                words.push_back(FUZZY_MATCH);
+                words.push_back(intern(it->second["regex"].string_value()));
+                words.push_back(smatch.size());
+                for (auto& p : smatch) {
+                    auto check = FromJson<VersionChecker>{}(p.second);
+                    words.push_back(std::stoul(p.first));
+                    version(check.low, words);
+                    words.push_back(check.low && check.low_strict);
+                    version(check.high, words);
+                    words.push_back(check.high && check.high_strict);
+                }
+            } else {
+                words.push_back(ANY_MATCH);
+            }
+        }
+
+        auto& props = jentry["props"].object_items();
+        words.push_back(props.size());
+        for (auto& p : props) {
+            words.push_back(intern(p.first));
+            auto& value = p.second;
+            if (value.is_string()) {
+                words.push_back(STR_VALUE);
+                words.push_back(intern(value.string_value()));
+            } else if (value.is_number()) {
+                auto num = static_cast<uint64_t>((Num) value.number_value());
+                words.push_back(NUM_VALUE);
+                words.push_back(uint32_t(num));
+                words.push_back(uint32_t(num >> 32));
+            } else {
+                words.push_back(BOOL_VALUE);
+                words.push_back(value.bool_value());
+            }
+        }
+        entries_.push_back(std::move(words));
+    }
+
+    bool commit(std::string const& path)
+    {
+        writer_.section("strings");
+        for (size_t i = 0; i < strings_.size(); ++i)
+            writer_.add(i, std::string_view(strings_[i]));
+        writer_.section("entries");
+        for (size_t i = 0; i < entries_.size(); ++i)
+            writer_.add(i, entries_[i].data(),
+                        entries_[i].size() * sizeof(uint32_t));
+        return writer_.commit(path);
+    }
+
+private:
+    SnapshotWriter writer_;
+    std::vector<std::vector<uint32_t>> entries_;
+    std::deque<std::string> strings_;
+    std::unordered_map<std::string_view, uint32_t> ids_;
+
+    uint32_t intern(std::string const& s)
+    {
+        auto it = ids_.find(s);
+        if (it != ids_.end())
+            return it->second;
+        auto id = static_cast<uint32_t>(strings_.size());
+        strings_.push_back(s);
+        ids_.emplace(strings_.back(), id);
+        return id;
+    }
+
+    static void version(Version const& v, std::vector<uint32_t>& words)
+    {
+        words.push_back(v.parts.size());
+        for (auto part : v.parts) {
+            words.push_back(uint32_t(part));
+            words.push_back(uint32_t(uint64_t(part) >> 32));
+        }
+    }
+};
+
+// Reads words of a record, `ok` is cleared past its end
+struct WordReader {
+    std::vector<std::string_view> const& strings;
+    const uint8_t* pos;
+    const uint8_t* end;
+    bool ok {true};
+
+    uint32_t word()
+    {
+        uint32_t ret = 0;
+        if (end - pos < ptrdiff_t(sizeof(ret))) {
+            ok = false;
+            return ret;
+        }
+        std::memcpy(&ret, pos, sizeof(ret));
+        pos += sizeof(ret);
+        return ret;
+    }
+
+    uint64_t dword()
+    {
+        uint64_t lo = word();
+        return lo | uint64_t(word()) << 32;
+    }
+
+    std::string_view string()
+    {
+        auto id = word();
+        if (id >= strings.size()) {
+            ok = false;
+            return {};
+        }
+        return strings[id];
+    }
+
+    Version version()
+    {
+        Version ret;
+        auto n = word();
+        for (uint32_t i = 0; ok && i < n; ++i)
+            ret.parts.push_back(static_cast<long long>(dword()));
+        return ret;
+    }
+};
+
+// Entries of a compiled file, none if it is malformed
+std::optional<std::vector<TEntry>> decompile(SnapshotFile const& file)
+{
+    auto strings_section = file.section("strings");
+    auto entries_section = file.section("entries");
+    if (not strings_section || not entries_section)
+        return std::nullopt;
+
+    std::vector<std::string_view> strings;
+    for (auto record : *strings_section) {
+        if (record.key != strings.size())
+            return std::nullopt;
+        strings.push_back(record.text());
+    }
+
+    std::vector<TEntry> ret;
+    try {
+        for (auto record : *entries_section) {
+            WordReader in{ strings, record.data, record.data + record.size };
+            TEntry entry;
+            for (size_t i = 0; i < devicedb::QueryBuilder::ncolumns; ++i) {
+                switch (in.word()) {
+                case ANY_MATCH:
+                    entry.selector.emplace_back(AnyMatch{});
+                    break;
+                case EXACT_MATCH:
+                    entry.selector.emplace_back(ExactMatch{ in.string() });
+                    break;
+                case FUZZY_MATCH: {
+                    std::string re{ in.string() };
+                    VersionChecks checks;
+                    auto n = in.word();
+                    for (uint32_t j = 0; in.ok && j < n; ++j) {
+                        size_t grp = in.word();
+                        VersionChecker check;
+                        check.low = in.version();
+                        check.low_strict = in.word();
+                        check.high = in.version();
+                        check.high_strict = in.word();
+                        checks.emplace_back(grp, std::move(check));
+                    }
+                    if (not in.ok)
+                        return std::nullopt;
+                    entry.selector.emplace_back(
+                        make_fuzzy(re, std::move(checks)));
+                    break;
+                }
+                default:
+                    return std::nullopt;
+                }
+            }
+
+            auto nprops = in.word();
+            for (uint32_t j = 0; in.ok && j < nprops; ++j) {
+                auto name = in.string();
+                switch (in.word()) {
+                case STR_VALUE:
+                    entry.props.push_back({ name, in.string() });
+                    break;
+                case NUM_VALUE:
+                    entry.props.push_back({ name, Num(in.dword()) });
+                    break;
+                case BOOL_VALUE:
+                    entry.props.push_back({ name, Bool(in.word() != 0) });
+                    break;
+                default:
+                    return std::nullopt;
+                }
+            }
+            if (not in.ok || in.pos != in.end)
+                return std::nullopt;
+            ret.push_back(std::move(entry));
+        }
+    } catch (JsonLoadError const&) {
+        return std::nullopt;
+    }
+    return ret;
+}
+
+} // anonymous
+
 struct DeviceDb::impl
 {
     Rc<ResourceLocator> locator;
@@ -86,6 +393,54 @@ struct DeviceDb::impl
     std::multimap<std::string, Json> files;
     FromJson<TEntry> load{ devicedb::QueryBuilder::columns };
     PropertySheet sheet{ devicedb::QueryBuilder::ncolumns };
+
+    std::string cache_path;
+    // Own strings of the entries loaded from them
+    std::vector<std::unique_ptr<SnapshotFile>> compiled;
+
+    std::optional<size_t> add_compiled(uint64_t stamp)
+    {
+        std::string error;
+        auto file = SnapshotFile::open(cache_path, error);
+        if (not file) {
+            VLOG(3) << "[DeviceDb] No compiled props in " << cache_path
+                    << ": " << error;
+            return std::nullopt;
+        }
+        if (file->stamp() != stamp) {
+            VLOG(3) << "[DeviceDb] " << cache_path
+                    << " is compiled from another props file";
+            return std::nullopt;
+        }
+        auto entries = decompile(*file);
+        if (not entries) {
+            LOG(WARNING) << "[DeviceDb] Malformed compiled props in "
+                         << cache_path;
+            return std::nullopt;
+        }
+
+        for (auto& e : *entries) {
+            for (auto& prop : e.props)
+                devicedb::PropertyKey::intern(prop.name);
+        }
+        compiled.push_back(std::move(file));
+        for (auto& e : *entries)
+            sheet.append(std::move(e));
+        return entries->size();
+    }
+
+    void compile(uint64_t stamp, std::string const& json_str)
+    {
+        std::string err;
+        Json json = Json::parse(json_str, err);
+        Compiler compiler{ stamp };
+        for (auto& e : json.array_items())
+            compiler.add(e);
+        if (not compiler.commit(cache_path)) {
+            LOG(WARNING) << "[DeviceDb] Can't write compiled props to "
+                         << cache_path << ": " << std::strerror(errno);
+        }
+    }
 };
 
 DeviceDb::DeviceDb( Rc<ResourceLocator> locator )
@@ -94,15 +449,37 @@ DeviceDb::DeviceDb( Rc<ResourceLocator> locator )
     m->locator = std::move(locator);
     m->props2json.setExecutable("python3")
                  .bindArgument(m->locator->find_directory("$tooldir/props2json"));
+    // Switches of one model usually differ only by dpid and serial number
+    m->sheet.memoize({1, 2, 3}); // manufacturer, hwVersion, swVersion
 }
 
 DeviceDb::~DeviceDb() = default;
 
+void DeviceDb::cache_compiled(std::string path)
+{
+    m->cache_path = std::move(path);
+}
+
 size_t DeviceDb::add_props_file(std::string_view filename)
 try {
     fs::path path = m->locator->find_file(filename);
+
+    uint64_t stamp = 0;
+    if (not m->cache_path.empty()) {
+        fs::ifstream fin(path, std::ios::in | std::ios::binary);
+        std::stringstream ss;
+        ss << fin.rdbuf();
+        stamp = content_hash(filename, ss.str());
+        if (auto n = m->add_compiled(stamp))
+            return *n;
+    }
+
     std::string json_str = m->props2json(path.string()).get();
-    return add_json(std::string(filename), json_str);
+    size_t ret = add_json(std::string(filename), json_str);
+    if (not m->cache_path.empty()) {
+        m->compile(stamp, json_str);
+    }
+    return ret;
 } catch (ResourceNotFoundError const& e) {
     THROW_WITH_NESTED(devicedb::LoadError(), "Resource not found");
 } catch (UtilityError const& e) {
@@ -155,8 +532,12 @@ size_t DeviceDb::add_json(std::string name, std::string const& json_str)
         std::vector<TEntry> entries;
         entries.reserve(n);
 
-        for (auto& e : json.array_items())
+        for (auto& e : json.array_items()) {
             entries.push_back(m->load(e));
+            // Assign ids now, queries only look them up
+            for (auto& prop : entries.back().props)
+                devicedb::PropertyKey::intern(prop.name);
+        }
 
         // Take ownership for inner string_views
         m->files.emplace(std::move(name), std::move(json)); 
@@ -170,13 +551,6 @@ size_t DeviceDb::add_json(std::string name, std::string const& json_str)
     }
 }
 
-template<class... Types>
-std::any to_any(std::variant<Types...> v) {
-    return std::visit([](auto&& x) -> std::any {
-        return std::move(x);
-    }, v);
-}
-
 devicedb::QueryBuilder
 DeviceDb::query() const
 {
@@ -192,7 +566,7 @@ DeviceDb::query(std::string_view* begin, std::string_view* end) const
     ret.reserve(res.size());
 
     for (auto& p : res) {
-        ret.emplace_back(p.name, to_any(p.val));
+        ret.push_back({ devicedb::PropertyKey::intern(p.name), p.val });
     }
 
     return ret;
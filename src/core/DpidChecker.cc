@@ -69,28 +69,30 @@ void DpidChecker::init(Loader *loader, const Config& rootConfig)
 
     scan_switches(SwitchRole::DR);
     scan_switches(SwitchRole::AR);
+
+    lock_t l(switch_list_map_mutex_);
+    publish_index();
 }
 
 bool DpidChecker::isRegistered(uint64_t dpid, SwitchRole role) const
 {
-    auto find_lambda = [this, dpid](const SwitchList& list)
-    {
-        lock_t l(switch_list_map_mutex_);
-        return std::find(list.begin(), list.end(), dpid) != list.end();
-    };
-
-    if (+SwitchRole::UNDEFINED == role) {
-        return find_lambda(switch_list_ref(SwitchRole::AR)) or
-               find_lambda(switch_list_ref(SwitchRole::DR));
+    auto index = std::atomic_load(&index_);
+    switch (role) {
+    case SwitchRole::AR:
+        return index->ar.count(dpid) > 0;
+    case SwitchRole::DR:
+        return index->dr.count(dpid) > 0;
+    default:
+        return index->ar.count(dpid) > 0 or index->dr.count(dpid) > 0;
     }
-    return find_lambda(switch_list_ref(role));
 }
 
 SwitchRole DpidChecker::role(uint64_t dpid) const
 {
-    if (this->isRegistered(dpid, SwitchRole::AR)) {
+    auto index = std::atomic_load(&index_);
+    if (index->ar.count(dpid)) {
         return SwitchRole::AR;
-    } else if (this->isRegistered(dpid, SwitchRole::DR)) {
+    } else if (index->dr.count(dpid)) {
         return SwitchRole::DR;
     } else {
         return SwitchRole::UNDEFINED;
@@ -111,6 +113,7 @@ void DpidChecker::addSwitch(uint64_t dpid, SwitchRole role)
     lock_t l(switch_list_map_mutex_);
     auto& list = switch_list_ref(role);
     list.push_back(dpid);
+    publish_index();
     VLOG(30) << "[DpidChecker] Dpid=" << dpid
              << " was successfully added to " << role._to_string()
              << " list. Size=" << list.size();
@@ -129,6 +132,7 @@ void DpidChecker::removeSwitch(uint64_t dpid, SwitchRole role)
     auto it = std::find(list.begin(), list.end(), dpid);
     if (list.end() != it) {
         list.erase(it);
+        publish_index();
     } else {
         return;
     }
@@ -177,6 +181,7 @@ void DpidChecker::syncSwitchList(const json& switch_list, SwitchRole role)
     { // lock
     lock_t l(switch_list_map_mutex_);
     removed_switches = sync_switch_list_impl(new_list, role);
+    publish_index();
     } // unlock
 
     emit switchListChanged(role);
@@ -199,6 +204,7 @@ void DpidChecker::syncSwitchLists(const json& ar_json, const json& dr_json)
     lock_t l(switch_list_map_mutex_);
     removed_ar = sync_switch_list_impl(ar_list, SwitchRole::AR);
     removed_dr = sync_switch_list_impl(dr_list, SwitchRole::DR);
+    publish_index();
     } // unlock
 
     emit switchListChanged(SwitchRole::AR);
@@ -246,10 +252,10 @@ SwitchList DpidChecker::sync_switch_list_impl(SwitchList switches,
                                               SwitchRole role)
 {
     SwitchList removed_switches;
+    SwitchSet new_set(switches.begin(), switches.end());
     auto& current_list = switch_list_ref(role);
     for (auto& sw : current_list) {
-        auto sw_iter = std::find(switches.begin(), switches.end(), sw);
-        if (switches.end() == sw_iter) {
+        if (new_set.count(sw) == 0) {
             // new list doesn't have an old dpid - disconnect from this
             removed_switches.push_back(sw);
         }
@@ -258,6 +264,17 @@ SwitchList DpidChecker::sync_switch_list_impl(SwitchList switches,
     return removed_switches;
 }
 
+void DpidChecker::publish_index()
+{
+    // called with switch_list_map_mutex_ held
+    const auto& ar = switch_list_ref(SwitchRole::AR);
+    const auto& dr = switch_list_ref(SwitchRole::DR);
+    auto index = std::make_shared<SwitchIndex>();
+    index->ar.insert(ar.begin(), ar.end());
+    index->dr.insert(dr.begin(), dr.end());
+    std::atomic_store(&index_, SwitchIndexPtr(std::move(index)));
+}
+
 void DpidChecker::unregister(const SwitchList& switches, SwitchRole role)
 {
     for (auto& dpid : switches) {
@@ -24,8 +24,10 @@
 #include "lib/better_enum.hpp"
 
 #include <list>
+#include <memory>
 #include <mutex>
 #include <unordered_map>
+#include <unordered_set>
 #include <functional>
 
 namespace runos {
@@ -36,6 +38,7 @@ BETTER_ENUM(SwitchRole, int, UNDEFINED,
 
 using SwitchList = std::list<uint64_t>;
 using SwitchListMap = std::unordered_map<int, SwitchList>;
+using SwitchSet = std::unordered_set<uint64_t>;
 using json = nlohmann::json;
 
 class DpidChecker : public Application {
@@ -78,8 +81,20 @@ signals:
     void switchUnregistered(uint64_t dpid);
 
 private:
+    // Read-only copy of the lists for lookups on the I/O threads.
+    struct SwitchIndex {
+        SwitchSet ar;
+        SwitchSet dr;
+    };
+    using SwitchIndexPtr = std::shared_ptr<const SwitchIndex>;
+
+    // Writers change switches_ under the mutex and publish a new index;
+    // readers only std::atomic_load the index.
     mutable std::mutex switch_list_map_mutex_;
     SwitchListMap switches_;
+    SwitchIndexPtr index_ {std::make_shared<SwitchIndex>()};
+
+    void publish_index();
 
     const SwitchList& switch_list_ref(SwitchRole role) const;
     SwitchList& switch_list_ref(SwitchRole role);
@@ -0,0 +1,211 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "EventLoopWatchdog.hpp"
+
+#include "lib/metrics.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <QCoreApplication>
+#include <QThread>
+#include <QTimer>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <sstream>
+
+namespace runos {
+
+REGISTER_APPLICATION(EventLoopWatchdog, {""})
+
+using clock = std::chrono::steady_clock;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+
+struct EventLoopWatchdog::probe {
+    std::string name;
+    std::vector<std::string> apps;
+    QTimer* timer {nullptr};
+    metrics::Histogram* lag {nullptr};
+
+    std::atomic<EventLoopMonitor::site*> running {nullptr};
+    std::atomic<clock::rep> armed {0};
+    std::atomic<clock::rep> stall_reported {0}; // arming already reported
+    std::atomic<int64_t> last_lag_ns {0};
+    std::atomic<int64_t> max_lag_ns {0};
+    std::atomic<uint64_t> probes {0};
+
+    // Past due time of the armed probe, negative if not due yet
+    nanoseconds overdue(clock::time_point now, milliseconds interval) const
+    {
+        auto since = now - clock::time_point(
+            clock::duration(armed.load(std::memory_order_relaxed)));
+        return duration_cast<nanoseconds>(since - interval);
+    }
+
+    std::string describe() const
+    {
+        std::ostringstream out;
+        out << name;
+        if (not apps.empty()) {
+            out << " (";
+            for (size_t i = 0; i < apps.size(); ++i)
+                out << (i ? ", " : "") << apps[i];
+            out << ")";
+        }
+        return out.str();
+    }
+};
+
+void EventLoopWatchdog::init(Loader* loader, const Config& rootConfig)
+{
+    auto config = config_cd(rootConfig, "event-loop-watchdog");
+    loader_ = loader;
+    interval_ = milliseconds(config_get(config, "probe-interval-ms", 100));
+    stall_ = milliseconds(config_get(config, "stall-ms", 1000));
+    CHECK(interval_.count() > 0) << "probe-interval-ms must be positive";
+    CHECK(stall_ > interval_) << "stall-ms must exceed probe-interval-ms";
+
+    EventLoopMonitor::enable(
+        milliseconds(config_get(config, "long-task-ms", 50)));
+}
+
+void EventLoopWatchdog::startUp(Loader*)
+{
+    // Every application is bound to its thread by now
+    std::map<QThread*, std::shared_ptr<probe>> by_thread;
+    auto main_thread = QCoreApplication::instance()->thread();
+    by_thread[main_thread] = std::make_shared<probe>();
+    by_thread[main_thread]->name = "main";
+
+    for (const auto& timing : loader_->startupTimeline()) {
+        auto app = loader_->app(timing.app);
+        if (not app)
+            continue;
+        auto& p = by_thread[app->thread()];
+        if (not p) {
+            p = std::make_shared<probe>();
+            p->name = std::to_string(timing.thread);
+        }
+        p->apps.push_back(timing.app);
+    }
+
+    std::lock_guard<std::mutex> lock(probes_mutex_);
+    for (auto& pair : by_thread) {
+        auto p = pair.second;
+        p->lag = &metrics::Registry::global().histogram(
+            "runos_event_loop_lag_seconds",
+            "Delay of the watchdog probe timer on an event loop",
+            {{"thread", p->name}});
+
+        p->timer = new QTimer;
+        p->timer->setSingleShot(true);
+        p->timer->setTimerType(Qt::PreciseTimer);
+        p->timer->setInterval(interval_.count());
+        p->timer->moveToThread(pair.first);
+
+        auto interval = interval_;
+        QObject::connect(p->timer, &QTimer::timeout, p->timer, [p, interval]() {
+            auto now = clock::now();
+            auto lag = std::max(p->overdue(now, interval), nanoseconds(0));
+            p->lag->record(lag);
+            p->last_lag_ns.store(lag.count(), std::memory_order_relaxed);
+            if (lag.count() > p->max_lag_ns.load(std::memory_order_relaxed))
+                p->max_lag_ns.store(lag.count(), std::memory_order_relaxed);
+            p->probes.fetch_add(1, std::memory_order_relaxed);
+
+            EventLoopMonitor::watch_thread(&p->running);
+            p->armed.store(now.time_since_epoch().count(),
+                           std::memory_order_relaxed);
+            p->timer->start();
+        });
+
+        p->armed.store(clock::now().time_since_epoch().count(),
+                       std::memory_order_relaxed);
+        QMetaObject::invokeMethod(p->timer, "start", Qt::QueuedConnection);
+        probes_.push_back(std::move(p));
+    }
+
+    auto& timers = TimerService::global();
+    checker_ = timers.add("event-loop-watchdog", interval_,
+                          [this]() { check_stalls(); },
+                          TimerService::priority::high);
+    timers.start(checker_);
+
+    LOG(INFO) << "[EventLoopWatchdog] Watching " << probes_.size()
+              << " event loops every " << interval_.count() << " ms";
+}
+
+EventLoopWatchdog::~EventLoopWatchdog()
+{
+    if (checker_)
+        TimerService::global().remove(checker_);
+    for (auto& p : probes_) {
+        p->timer->deleteLater();
+    }
+}
+
+void EventLoopWatchdog::check_stalls()
+{
+    auto now = clock::now();
+    std::lock_guard<std::mutex> lock(probes_mutex_);
+    for (auto& p : probes_) {
+        auto overdue = p->overdue(now, interval_);
+        auto armed = p->armed.load(std::memory_order_relaxed);
+        if (overdue < stall_ ||
+            p->stall_reported.exchange(armed) == armed)
+            continue;
+
+        auto running = p->running.load(std::memory_order_relaxed);
+        LOG(WARNING) << "[EventLoopWatchdog] Event loop of thread "
+                     << p->describe() << " stalled for "
+                     << duration_cast<milliseconds>(overdue).count()
+                     << " ms, running "
+                     << (running ? EventLoopMonitor::name(running)
+                                 : std::string("no qt_executor task"));
+    }
+}
+
+std::vector<EventLoopWatchdog::ThreadInfo> EventLoopWatchdog::threads() const
+{
+    std::vector<ThreadInfo> ret;
+    auto now = clock::now();
+    std::lock_guard<std::mutex> lock(probes_mutex_);
+    for (const auto& p : probes_) {
+        auto overdue = p->overdue(now, interval_);
+        auto running = p->running.load(std::memory_order_relaxed);
+        ret.push_back(ThreadInfo{
+            p->name, p->apps,
+            duration_cast<microseconds>(nanoseconds(
+                p->last_lag_ns.load(std::memory_order_relaxed))),
+            duration_cast<microseconds>(nanoseconds(
+                p->max_lag_ns.load(std::memory_order_relaxed))),
+            duration_cast<microseconds>(nanoseconds(p->lag->quantile(0.99))),
+            p->probes.load(std::memory_order_relaxed),
+            overdue >= stall_ ? duration_cast<milliseconds>(overdue)
+                              : milliseconds(0),
+            running ? EventLoopMonitor::name(running) : std::string()
+        });
+    }
+    return ret;
+}
+
+} // namespace runos
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "lib/event_loop_monitor.hpp"
+#include "lib/timer_service.hpp"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Watches event loops of the application threads (and of the main
+ * thread) for lag.
+ *
+ * A probe timer on every loop is armed for `probe-interval-ms`; the time
+ * it fires past that is the lag of the loop, exported as a histogram per
+ * thread. A loop which missed its probe for `stall-ms` is reported while
+ * still stalled, with the qt_executor closure running there. Closures
+ * themselves are accounted by EventLoopMonitor, which this application
+ * enables.
+ */
+class EventLoopWatchdog final : public Application {
+    Q_OBJECT
+    SIMPLE_APPLICATION(EventLoopWatchdog, "event-loop-watchdog")
+
+public:
+    struct ThreadInfo {
+        std::string name; // loader thread index or "main"
+        std::vector<std::string> apps;
+        std::chrono::microseconds last_lag;
+        std::chrono::microseconds max_lag;
+        std::chrono::microseconds p99_lag;
+        uint64_t probes;
+        std::chrono::milliseconds stalled; // 0 unless stalled now
+        std::string running; // closure running at the last stall check
+    };
+
+    void init(Loader* loader, const Config& config) override;
+    void startUp(Loader* loader) override;
+    ~EventLoopWatchdog();
+
+    std::vector<ThreadInfo> threads() const;
+
+private:
+    struct probe;
+
+    Loader* loader_ {nullptr};
+    std::chrono::milliseconds interval_ {100};
+    std::chrono::milliseconds stall_ {1000};
+    mutable std::mutex probes_mutex_;
+    std::vector<std::shared_ptr<probe>> probes_;
+    TimerService::handle checker_;
+
+    void check_stalls();
+};
+
+} // namespace runos
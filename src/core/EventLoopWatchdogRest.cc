@@ -0,0 +1,106 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "EventLoopWatchdog.hpp"
+#include "RestListener.hpp"
+
+#include <algorithm>
+
+namespace runos {
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+
+struct EventLoopResource : rest::resource
+{
+    EventLoopWatchdog* app;
+
+    explicit EventLoopResource(EventLoopWatchdog* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override
+    {
+        rest::ptree root;
+
+        rest::ptree threads;
+        for (const auto& info : app->threads()) {
+            rest::ptree tpt;
+            tpt.put("thread", info.name);
+            rest::ptree apps;
+            for (const auto& name : info.apps) {
+                rest::ptree apt;
+                apt.put("", name);
+                apps.push_back(std::make_pair("", std::move(apt)));
+            }
+            tpt.add_child("apps", apps);
+            tpt.put("lag_us", info.last_lag.count());
+            tpt.put("max_lag_us", info.max_lag.count());
+            tpt.put("p99_lag_us", info.p99_lag.count());
+            tpt.put("probes", info.probes);
+            tpt.put("stalled_ms", info.stalled.count());
+            tpt.put("running", info.running);
+            threads.push_back(std::make_pair("", std::move(tpt)));
+        }
+        root.add_child("threads", threads);
+
+        // call sites by time they kept the loops busy
+        auto sites = EventLoopMonitor::sites();
+        std::sort(sites.begin(), sites.end(), [](const auto& a, const auto& b) {
+            return a.total > b.total;
+        });
+        rest::ptree tasks;
+        for (const auto& site : sites) {
+            rest::ptree spt;
+            spt.put("site", site.name);
+            spt.put("count", site.count);
+            spt.put("total_us", duration_cast<microseconds>(site.total).count());
+            spt.put("max_us", duration_cast<microseconds>(site.max).count());
+            spt.put("long_tasks", site.long_tasks);
+            tasks.push_back(std::make_pair("", std::move(spt)));
+        }
+        root.add_child("array", tasks);
+        root.put("_size", sites.size());
+        return root;
+    }
+};
+
+class EventLoopWatchdogRest : public Application
+{
+    SIMPLE_APPLICATION(EventLoopWatchdogRest, "event-loop-watchdog-rest")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto rest_ = RestListener::get(loader);
+        auto app = EventLoopWatchdog::get(loader);
+
+        rest_->mount(path_spec("/event-loop/"), [=](const path_match&)
+        {
+            return EventLoopResource { app };
+        });
+    }
+};
+
+REGISTER_APPLICATION(EventLoopWatchdogRest,
+                     {"rest-listener", "event-loop-watchdog", ""})
+
+} // namespace runos
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "RestListener.hpp"
+#include "lib/event_trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <vector>
+
+namespace runos {
+
+// Recent traces, newest first, with stage times from the first record
+struct TracesResource : rest::resource
+{
+    rest::ptree Get() const override
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::microseconds;
+        using std::chrono::milliseconds;
+
+        std::map<trace::id, std::vector<trace::record>> traces;
+        for (const auto& r : trace::recent()) {
+            traces[r.trace].push_back(r);
+        }
+
+        auto now = trace::clock::now();
+        rest::ptree root;
+        rest::ptree array;
+        for (auto it = traces.rbegin(); it != traces.rend(); ++it) {
+            const auto& records = it->second;
+            auto begin = records.front().time;
+
+            rest::ptree tpt;
+            tpt.put("id", it->first);
+            tpt.put("age_ms",
+                    duration_cast<milliseconds>(now - begin).count());
+            tpt.put("duration_us",
+                    duration_cast<microseconds>(records.back().time - begin)
+                        .count());
+            rest::ptree stages;
+            for (const auto& r : records) {
+                rest::ptree spt;
+                spt.put("stage", r.stage);
+                spt.put("arg", r.arg);
+                spt.put("at_us",
+                        duration_cast<microseconds>(r.time - begin).count());
+                stages.push_back(std::make_pair("", std::move(spt)));
+            }
+            tpt.add_child("stages", stages);
+            array.push_back(std::make_pair("", std::move(tpt)));
+        }
+        root.add_child("array", array);
+        root.put("_size", traces.size());
+        root.put("enabled", trace::enabled());
+        return root;
+    }
+};
+
+class EventTraceRest : public Application
+{
+    SIMPLE_APPLICATION(EventTraceRest, "event-trace-rest")
+public:
+    void init(Loader* loader, const Config& rootConfig) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto config = config_cd(rootConfig, "event-trace");
+        trace::settings settings;
+        settings.enabled = config_get(config, "enabled", true);
+        settings.capacity = std::max(config_get(config, "capacity", 4096), 0);
+        settings.linger = std::chrono::milliseconds(
+            config_get(config, "linger-ms", 2000));
+        trace::configure(settings);
+
+        auto rest_ = RestListener::get(loader);
+
+        rest_->mount(path_spec("/traces/"), [=](const path_match&)
+        {
+            return TracesResource {};
+        });
+    }
+};
+
+REGISTER_APPLICATION(EventTraceRest, {"rest-listener", ""})
+
+} // namespace runos
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "RestListener.hpp"
+#include "lib/flight_recorder.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+namespace runos {
+
+// Events of every thread, oldest first, aged from now
+struct FlightRecorderResource : rest::resource
+{
+    // Streamed, all rings together are too big for a ptree
+    void Stream(json_writer& out) const override
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::microseconds;
+
+        auto now = flight::clock::now();
+        auto threads = flight::recent();
+
+        out.begin_object();
+        out.put("enabled", flight::enabled());
+        out.key("threads").begin_array();
+        for (const auto& t : threads) {
+            out.begin_object();
+            out.put("tid", t.tid);
+            out.put("name", t.name);
+            out.put("alive", t.alive);
+            out.put("recorded", t.recorded);
+            out.key("events").begin_array();
+            for (const auto& e : t.events) {
+                out.begin_object();
+                out.put("age_us",
+                        duration_cast<microseconds>(now - e.time).count());
+                out.put("kind", flight::kind_name(e.what));
+                switch (e.what) {
+                case flight::kind::message_received:
+                case flight::kind::message_dispatched:
+                    out.put("type", e.code);
+                    out.put("dpid", e.subject);
+                    break;
+                default:
+                    out.put("site", flight::name(e.code));
+                    out.put("subject", e.subject);
+                    break;
+                }
+                out.put("arg", e.arg);
+                out.end_object();
+            }
+            out.end_array();
+            out.end_object();
+        }
+        out.end_array();
+        out.put("_size", threads.size());
+        out.end_object();
+    }
+};
+
+// POST writes the rings to the dump file, as a crash would
+struct FlightRecorderDumpResource : rest::resource
+{
+    rest::ptree Post(const rest::ptree&) override
+    {
+        rest::ptree ret;
+        ret.put("dumped", flight::dump());
+        return ret;
+    }
+};
+
+class FlightRecorderRest : public Application
+{
+    SIMPLE_APPLICATION(FlightRecorderRest, "flight-recorder-rest")
+public:
+    void init(Loader* loader, const Config& rootConfig) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto config = config_cd(rootConfig, "flight-recorder");
+        flight::settings settings;
+        settings.enabled = config_get(config, "enabled", true);
+        settings.capacity = std::max(config_get(config, "capacity", 4096), 1);
+        settings.lock_wait = std::chrono::microseconds(
+            std::max(config_get(config, "lock-wait-us", 1000), 0));
+        settings.dump_path = config_get(config, "dump-path",
+                                        "flight-recorder.txt");
+        flight::configure(settings);
+
+        auto rest_ = RestListener::get(loader);
+
+        rest_->mount(path_spec("/flight-recorder/"), [=](const path_match&)
+        {
+            return FlightRecorderResource {};
+        });
+        rest_->mount(path_spec("/flight-recorder/dump/"),
+                     [=](const path_match&)
+        {
+            return FlightRecorderDumpResource {};
+        });
+    }
+};
+
+REGISTER_APPLICATION(FlightRecorderRest, {"rest-listener", ""})
+
+} // namespace runos
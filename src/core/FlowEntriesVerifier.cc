@@ -19,25 +19,43 @@
 #include "SwitchManager.hpp"
 #include "Recovery.hpp"
 #include "DatabaseConnector.hpp"
+#include "StateSnapshot.hpp"
 #include "Controller.hpp"
 #include "Logger.hpp"
 #include "api/Switch.hpp"
 #include "api/OFAgent.hpp"
+#include "lib/blob_pool.hpp"
+#include "lib/poll_backoff.hpp"
+#include "lib/record_codec.hpp"
+#include "lib/worker_pool.hpp"
+
+#include <runos/core/catch_all.hpp>
 
 #include <of13/of13match.hh>
 
 #include <boost/functional/hash.hpp>
 
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <unordered_map>
 #include <unordered_set>
 #include <functional>
 #include <vector>
 #include <mutex>
+#include <map>
 
 namespace runos {
 
 REGISTER_APPLICATION(FlowEntriesVerifier, {"controller", "switch-ordering",
                                            "switch-manager", "recovery-manager",
-                                           "database-connector", ""})
+                                           "database-connector",
+                                           "state-snapshot", ""})
 
 using lock_t = std::lock_guard<std::mutex>;
 using shared_lock_t = boost::shared_lock<boost::shared_mutex>;
@@ -50,6 +68,7 @@ using FlowStatsSequence = std::vector<of13::FlowStats>;
 static constexpr size_t OXM_FIELD_VALUE_SIZE = 2 * sizeof(uint32_t);
 static constexpr size_t OXM_FIELD_SIZE =
     of13::OFP_OXM_HEADER_LEN + OXM_FIELD_VALUE_SIZE;
+static constexpr size_t MATCH_HEADER_SIZE = 4; // ofp_match type and length
 
 namespace hash {
     static size_t hashValue(of13::Match&& m)
@@ -75,6 +94,70 @@ namespace hash {
 
         return hash;
     }
+
+    // Identifies the exact flow entry: match, priority, cookie and
+    // instructions, so equal digests mean nothing to re-send
+    template<class T>
+    static uint64_t flowDigest(T& msg)
+    {
+        size_t hash = flowHashValue(msg);
+        boost::hash_combine(hash, msg.cookie());
+
+        auto&& instructions = msg.instructions();
+        std::vector<uint8_t> buf(instructions.length());
+        instructions.pack(buf.data());
+        boost::hash_combine(hash, boost::hash_range(buf.begin(), buf.end()));
+        return hash;
+    }
+
+    // Flow-Removed carries no instructions, only looked up by match
+    static uint64_t flowDigest(of13::FlowRemoved&) { return 0; }
+
+    // One hash per OXM field of a packed match (see packMatch()), over
+    // its header, value and mask, so equal fields hash equally
+    static std::vector<size_t> fieldHashes(const std::string& match)
+    {
+        std::vector<size_t> ret;
+        size_t pos = MATCH_HEADER_SIZE;
+        while (pos + of13::OFP_OXM_HEADER_LEN <= match.size()) {
+            size_t len = of13::OFP_OXM_HEADER_LEN + uint8_t(match[pos + 3]);
+            ret.push_back(boost::hash_range(match.begin() + pos,
+                                            match.begin() + pos + len));
+            pos += len;
+        }
+        return ret;
+    }
+}
+
+// ofp_match without padding, its OXM fields ordered by field id: equal
+// matches pack to equal bytes whatever order their fields were set in
+static std::string packMatch(of13::Match&& m)
+{
+    std::string ret(MATCH_HEADER_SIZE, '\0');
+    for (uint8_t field = 0; field < OXM_NUM; ++field) {
+        of13::OXMTLV* tlv = m.oxm_field(field);
+        if (tlv == nullptr)
+            continue;
+
+        std::array<uint8_t, 64> buf{};
+        tlv->pack(buf.data());
+        ret.append(reinterpret_cast<const char*>(buf.data()),
+                   of13::OFP_OXM_HEADER_LEN + buf[3]);
+    }
+
+    uint16_t type = htons(of13::OFPMT_OXM);
+    uint16_t length = htons(ret.size());
+    std::memcpy(&ret[0], &type, sizeof(type));
+    std::memcpy(&ret[2], &length, sizeof(length));
+    return ret;
+}
+
+// Matches and instruction sets of expected flows repeat across tables
+// and switches, every distinct one is stored once
+static BlobPool& blobs()
+{
+    static BlobPool pool;
+    return pool;
 }
 
 class PatternData {
@@ -96,12 +179,11 @@ public:
 
     bool toBeDeletedBase(FlowModPtr &fmp) const
     {
-        bool table_id = is_table_id_all() ||
-                        (!is_table_id_all() || fmp->table_id() == table_id_);
+        bool table_id = is_table_id_all() || fmp->table_id() == table_id_;
         bool out_port = !is_out_port_any() || fmp->out_port() == out_port_;
         bool out_group = !is_out_group_any() || fmp->out_group() == out_group_;
 
-        return toBeModifiedBase(fmp) && table_id && out_port && out_group;
+        return table_id && cookie_filter(fmp) && out_port && out_group;
     }
 
     bool nonStrictMatch(FlowModPtr &fmp) const
@@ -126,6 +208,18 @@ public:
                fmp->match() == match_;
     }
 
+    uint8_t table_id() const { return table_id_; }
+    std::vector<size_t> fieldHashes() const
+    { return hash::fieldHashes(packMatch(of13::Match(match_))); }
+
+    // Set when only flows with this very cookie can match
+    std::optional<uint64_t> exactCookie() const
+    {
+        if (cookie_mask_ != ~uint64_t(0))
+            return std::nullopt;
+        return cookie_;
+    }
+
 private:
     uint8_t table_id_;
     uint16_t priority_;
@@ -168,6 +262,14 @@ public:
         }
     }
 
+    bool strict() const
+    {
+        return command_ == of13::OFPFC_MODIFY_STRICT ||
+               command_ == of13::OFPFC_DELETE_STRICT;
+    }
+
+    const PatternData& data() const { return pattern_data_; }
+
 private:
     PatternData pattern_data_;
     uint8_t command_;
@@ -197,61 +299,133 @@ private:
     }
 };
 
+// Flow-Mod kept as its fixed ofp_flow_mod part plus interned match and
+// instructions, unpacked on demand
 class FlowMessage {
 public:
+    using Blob = BlobPool::Blob;
+
+    // Only the match of Flow-Stats and Flow-Removed is looked at
     template<class T>
     explicit FlowMessage(T& msg)
-        : fmp_(std::make_unique<of13::FlowMod>())
-    { }
+    {
+        of13::FlowMod fm;
+        fm.match(msg.match());
+        assign(fm);
+    }
 
-    explicit FlowMessage(of13::FlowMod& fm)
-        : fmp_(copy(fm))
-    { }
+    explicit FlowMessage(of13::FlowMod& fm) { assign(fm); }
 
-    explicit FlowMessage(const json& flow_json)
-        : fmp_(parse(flow_json))
-    { }
+    explicit FlowMessage(const json& flow_json) { assign(*parse(flow_json)); }
 
-    FlowMessage(const FlowMessage& rhs)
-        : fmp_(copy(*rhs.fmp_))
-    { }
+    explicit FlowMessage(std::vector<uint8_t>& raw)
+    {
+        of13::FlowMod fm;
+        fm.unpack(raw.data());
+        assign(fm);
+    }
 
+    FlowMessage(const FlowMessage& rhs) = default;
     ~FlowMessage() noexcept = default;
 
-    FlowModPtr ptr() const { return copy(*fmp_); }
-    of13::InstructionSet instructions() const { return fmp_->instructions(); }
+    FlowModPtr ptr() const
+    {
+        auto raw = pack();
+        auto fmp = std::make_unique<of13::FlowMod>();
+        fmp->unpack(raw.data());
+        return fmp;
+    }
+
+    of13::InstructionSet instructions() const { return ptr()->instructions(); }
     json toJson() const { return dump(); }
 
+    // Interned, equal matches are the same blob
+    const Blob& match() const { return match_; }
+
+    // Packed ofp_flow_mod wire bytes
+    void write(RecordWriter& writer) const
+    {
+        auto raw = pack();
+        writer.add(raw.data(), raw.size());
+    }
+
+    void write(SnapshotWriter& writer, uint64_t key) const
+    {
+        auto raw = pack();
+        writer.add(key, raw.data(), raw.size());
+    }
+
     void changeInstructions(const of13::InstructionSet& is)
     {
-        fmp_->instructions(is);
+        auto fmp = ptr();
+        fmp->instructions(is);
+        assign(*fmp);
     }
 
-    bool matches(const Pattern& pv) const { return pv.matches(fmp_); }
+    bool matches(const Pattern& pv) const
+    {
+        auto fmp = ptr();
+        return pv.matches(fmp);
+    }
 
 private:
-    mutable FlowModPtr fmp_;
+    // ofp_flow_mod up to its ofp_match
+    static constexpr size_t head_size = 48;
+
+    std::array<uint8_t, head_size> head_;
+    Blob match_;
+    Blob instructions_;
 
     using raw_t = std::unique_ptr<uint8_t>;
     using raw_vector_t = std::vector<uint8_t>;
 
+    static size_t padded(size_t len) { return (len + 7) / 8 * 8; }
+
+    void assign(of13::FlowMod& fm)
+    {
+        raw_t packed{ fm.pack() };
+        auto raw = packed.get();
+        std::copy_n(raw, head_size, head_.begin());
+
+        uint16_t match_len;
+        std::memcpy(&match_len, raw + head_size + 2, sizeof(match_len));
+        size_t offset = head_size + padded(ntohs(match_len));
+
+        match_ = blobs().intern(packMatch(fm.match()));
+        instructions_ = blobs().intern(raw + offset, fm.length() - offset);
+    }
+
+    raw_vector_t pack() const
+    {
+        size_t offset = head_size + padded(match_->size());
+        raw_vector_t raw(offset + instructions_->size());
+
+        std::copy(head_.begin(), head_.end(), raw.begin());
+        std::copy(match_->begin(), match_->end(), raw.begin() + head_size);
+        std::copy(instructions_->begin(), instructions_->end(),
+                  raw.begin() + offset);
+
+        uint16_t length = htons(raw.size());
+        std::memcpy(&raw[2], &length, sizeof(length));
+        return raw;
+    }
+
     json dump() const
     {
         auto dump = json::array();
-        raw_t packed{ fmp_->pack() };
-        auto dump_size = fmp_->length();
+        auto raw = pack();
 
-        for (auto i = 0; i < dump_size; ++i) {
-            uchar value = *(packed.get() + i);
+        for (uchar value: raw) {
             dump.push_back(value);
         }
 
+        auto fmp = ptr();
         VLOG(17) << "[FlowEntriesVerifier] Dumped Flow-Mod message is of type="
-                    << static_cast<unsigned>(fmp_->type())
-                 << ", of size=" << fmp_->length()
+                    << static_cast<unsigned>(fmp->type())
+                 << ", of size=" << fmp->length()
                  << " and refers to the table="
-                    << static_cast<unsigned>(fmp_->table_id())
-                 << " with priority=" << fmp_->priority();
+                    << static_cast<unsigned>(fmp->table_id())
+                 << " with priority=" << fmp->priority();
 
         return dump;
     }
@@ -275,14 +449,6 @@ private:
 
         return fmp;
     }
-
-    static FlowModPtr copy(of13::FlowMod& fm)
-    {
-        auto copy = std::make_unique<of13::FlowMod>();
-        raw_t packed{ fm.pack() };
-        copy->unpack(packed.get());
-        return copy;
-    }
 };
 
 class Flow {
@@ -292,24 +458,29 @@ public:
         : msg_(msg)
         , table_id_(msg.table_id())
         , priority_(msg.priority())
-        , match_(msg.match())
-        , hash_(hash::flowHashValue(msg))
-    { }
+        , digest_(hash::flowDigest(msg))
+        , cookie_(msg.cookie())
+    {
+        init_hash();
+    }
 
     explicit Flow(const json& flow_message_json)
         : msg_(flow_message_json)
     {
-        auto fmp = msg_.ptr();
-        table_id_ = fmp->table_id();
-        priority_ = fmp->priority();
-        match_ = fmp->match();
-        hash_ = hash::flowHashValue(*fmp);
+        init_from_message();
+    }
+
+    explicit Flow(std::vector<uint8_t>& raw)
+        : msg_(raw)
+    {
+        init_from_message();
     }
 
     explicit Flow(const Flow& flow, const of13::InstructionSet& is)
         : Flow(flow)
     {
         msg_.changeInstructions(is);
+        digest_ = hash::flowDigest(*msg_.ptr());
     }
 
     Flow(const Flow& rhs) = default;
@@ -319,15 +490,26 @@ public:
     {
         return table_id_ == rhs.table_id_ &&
                priority_ == rhs.priority_ &&
-               match_ == rhs.match_;
+               msg_.match() == rhs.msg_.match();
     }
 
+    uint8_t table_id() const { return table_id_; }
+    uint64_t digest() const { return digest_; }
+    uint64_t cookie() const { return cookie_; }
     FlowMessage message() const { return msg_; }
     of13::InstructionSet instructions() const { return msg_.instructions(); }
     json toJson() const { return msg_.toJson(); }
+    void write(RecordWriter& writer) const { msg_.write(writer); }
+    void write(SnapshotWriter& writer, uint64_t key) const
+    { msg_.write(writer, key); }
 
     bool matches(const Pattern& pv) const { return msg_.matches(pv); }
 
+    std::vector<size_t> fieldHashes() const
+    {
+        return hash::fieldHashes(*msg_.match());
+    }
+
     struct Hasher {
         size_t operator()(const Flow& flow) const { return flow.hash_; }
     };
@@ -336,12 +518,210 @@ private:
     FlowMessage msg_;
     uint8_t table_id_;
     uint16_t priority_;
-    of13::Match match_;
     size_t hash_;
+    uint64_t digest_;
+    uint64_t cookie_;
+
+    void init_hash()
+    {
+        auto& match = *msg_.match();
+        hash_ = boost::hash_range(match.begin(), match.end());
+        boost::hash_combine(hash_, table_id_);
+        boost::hash_combine(hash_, priority_);
+    }
+
+    void init_from_message()
+    {
+        auto fmp = msg_.ptr();
+        table_id_ = fmp->table_id();
+        priority_ = fmp->priority();
+        digest_ = hash::flowDigest(*fmp);
+        cookie_ = fmp->cookie();
+        init_hash();
+    }
 };
 
 using FlowSet = std::unordered_set<Flow, Flow::Hasher>;
 
+// FlowSet with per-table flow count and order-independent checksum
+// (sum of flow digests) kept up to date on every insert and erase.
+// Flows are also indexed per table by their match fields and cookie,
+// so non-strict Flow-Mods only check the flows they can match.
+class FlowEntries {
+public:
+    using iterator = FlowSet::iterator;
+    using const_iterator = FlowSet::const_iterator;
+
+    struct TableSummary {
+        uint32_t flows {0};
+        uint64_t checksum {0};
+    };
+    using TableSummaryMap = std::map<uint8_t, TableSummary>;
+
+    iterator begin() { return flows_.begin(); }
+    iterator end() { return flows_.end(); }
+    const_iterator begin() const { return flows_.begin(); }
+    const_iterator end() const { return flows_.end(); }
+
+    iterator find(const Flow& flow) { return flows_.find(flow); }
+
+    void insert(const Flow& flow)
+    {
+        auto ins = flows_.insert(flow);
+        if (ins.second) {
+            auto& table = tables_[flow.table_id()];
+            table.flows++;
+            table.checksum += flow.digest();
+            index(*ins.first);
+        }
+    }
+
+    template<class It>
+    void insert(It first, It last)
+    {
+        for (; first != last; ++first) {
+            insert(*first);
+        }
+    }
+
+    iterator erase(iterator it)
+    {
+        auto table = tables_.find(it->table_id());
+        table->second.checksum -= it->digest();
+        if (--table->second.flows == 0) {
+            tables_.erase(table);
+        }
+        unindex(*it);
+        return flows_.erase(it);
+    }
+
+    void clear()
+    {
+        flows_.clear();
+        tables_.clear();
+        index_.clear();
+    }
+
+    // Flows the pattern may match, a superset to be checked with
+    // Flow::matches(). Strict patterns are looked up by their flow.
+    std::vector<const Flow*> candidates(const Pattern& pattern,
+                                        const Flow& flow) const
+    {
+        std::vector<const Flow*> ret;
+        auto&& data = pattern.data();
+
+        if (pattern.strict() && data.table_id() != of13::OFPTT_ALL) {
+            auto it = flows_.find(flow);
+            if (it != flows_.end())
+                ret.push_back(&*it);
+            return ret;
+        }
+
+        auto fields = data.fieldHashes();
+        auto cookie = data.exactCookie();
+        auto collect = [&](const TableIndex& table) {
+            const FlowPtrSet* best = &table.flows;
+            for (size_t field : fields) {
+                auto it = table.fields.find(field);
+                if (it == table.fields.end())
+                    return;
+                if (it->second.size() < best->size())
+                    best = &it->second;
+            }
+            if (cookie) {
+                auto it = table.cookies.find(*cookie);
+                if (it == table.cookies.end())
+                    return;
+                if (it->second.size() < best->size())
+                    best = &it->second;
+            }
+            ret.insert(ret.end(), best->begin(), best->end());
+        };
+
+        if (data.table_id() == of13::OFPTT_ALL) {
+            for (const auto& pair : index_) {
+                collect(pair.second);
+            }
+        } else {
+            auto it = index_.find(data.table_id());
+            if (it != index_.end())
+                collect(it->second);
+        }
+        return ret;
+    }
+
+    const TableSummaryMap& tables() const { return tables_; }
+
+    memory::Usage memory_usage() const
+    {
+        // matches and instructions are in the shared blob pool
+        auto ret = memory::footprint(flows_);
+        ret.bytes += memory::footprint(tables_).bytes;
+        for (const auto& pair : index_) {
+            auto& table = pair.second;
+            ret.bytes += memory::footprint(table.flows).bytes;
+            for (const auto& field : table.fields) {
+                ret.bytes += memory::footprint(field.second).bytes;
+            }
+            for (const auto& cookie : table.cookies) {
+                ret.bytes += memory::footprint(cookie.second).bytes;
+            }
+            ret.bytes += memory::footprint(table.fields).bytes
+                       + memory::footprint(table.cookies).bytes;
+        }
+        ret.bytes += memory::footprint(index_).bytes;
+        return ret;
+    }
+
+private:
+    // FlowSet nodes are stable, so the index refers to them directly
+    using FlowPtrSet = std::unordered_set<const Flow*>;
+
+    struct TableIndex {
+        FlowPtrSet flows;
+        std::unordered_map<size_t, FlowPtrSet> fields;
+        std::unordered_map<uint64_t, FlowPtrSet> cookies;
+    };
+
+    FlowSet flows_;
+    TableSummaryMap tables_;
+    std::map<uint8_t, TableIndex> index_;
+
+    void index(const Flow& flow)
+    {
+        auto& table = index_[flow.table_id()];
+        table.flows.insert(&flow);
+        for (size_t field : flow.fieldHashes()) {
+            table.fields[field].insert(&flow);
+        }
+        table.cookies[flow.cookie()].insert(&flow);
+    }
+
+    void unindex(const Flow& flow)
+    {
+        auto table = index_.find(flow.table_id());
+        if (table == index_.end())
+            return;
+
+        auto drop = [&flow](auto& map, auto key) {
+            auto it = map.find(key);
+            if (it != map.end() && it->second.erase(&flow) &&
+                it->second.empty()) {
+                map.erase(it);
+            }
+        };
+        for (size_t field : flow.fieldHashes()) {
+            drop(table->second.fields, field);
+        }
+        drop(table->second.cookies, flow.cookie());
+
+        table->second.flows.erase(&flow);
+        if (table->second.flows.empty()) {
+            index_.erase(table);
+        }
+    }
+};
+
 class FlowModHandler {
 public:
     explicit FlowModHandler(of13::FlowMod& fm)
@@ -350,7 +730,7 @@ public:
         , command_(fm.command())
     { }
 
-    void applyToFlowSet(FlowSet& flow_entries) const
+    void applyToFlowSet(FlowEntries& flow_entries) const
     {
         switch (command_) {
             case of13::OFPFC_ADD:
@@ -374,33 +754,36 @@ private:
     Pattern pattern_;
     uint8_t command_;
 
-    void add_to_flow_set(FlowSet& flows) const { flows.insert(flow_); }
+    void add_to_flow_set(FlowEntries& flows) const { flows.insert(flow_); }
 
-    void modify_flow_set(FlowSet& flows) const
+    std::vector<const Flow*> matching(const FlowEntries& flows) const
     {
-        FlowSet modified_entries;
+        auto ret = flows.candidates(pattern_, flow_);
+        ret.erase(std::remove_if(ret.begin(), ret.end(),
+                                 [this](const Flow* flow) {
+                                     return !flow->matches(pattern_);
+                                 }),
+                  ret.end());
+        return ret;
+    }
 
-        for (auto it = flows.begin(); it != flows.end(); ++it) {
-            if (!it->matches(pattern_)) {
-                continue;
-            }
+    void modify_flow_set(FlowEntries& flows) const
+    {
+        FlowSet modified_entries;
+        auto instr = flow_.instructions();
 
-            auto instr = flow_.instructions();
-            modified_entries.emplace(*it, instr);
-            it = flows.erase(it);
+        for (const Flow* flow : matching(flows)) {
+            modified_entries.emplace(*flow, instr);
+            flows.erase(flows.find(*flow));
         }
 
         flows.insert(modified_entries.begin(), modified_entries.end());
     }
 
-    void delete_from_flow_set(FlowSet& flows) const
+    void delete_from_flow_set(FlowEntries& flows) const
     {
-        for (auto it = flows.begin(); it != flows.end(); ) {
-            if (it->matches(pattern_)) {
-                it = flows.erase(it);
-            } else {
-                ++it;
-            }
+        for (const Flow* flow : matching(flows)) {
+            flows.erase(flows.find(*flow));
         }
     }
 };
@@ -409,6 +792,7 @@ class SwitchState {
 public:
     SwitchState() noexcept = default;
     explicit SwitchState(const json& state_json) { fromJson(state_json); }
+    explicit SwitchState(RecordReader& reader) { fromBinary(reader); }
 
     void process(of13::FlowMod& fm)
     {
@@ -435,23 +819,124 @@ public:
         return nullptr;
     }
 
-    FlowModPtrSequence process(FlowStatsSequence& fs_seq) const
+    struct TableState {
+        uint32_t flows;
+        bool verified; // unchanged since the last dump matched
+    };
+    using TableStateMap = std::map<uint8_t, TableState>;
+
+    TableStateMap tables() const
     {
-        auto&& flow_set = to_flow_set(fs_seq);
+        TableStateMap ret;
+
+        lock_t lock(entries_mut_);
+        for (const auto& pair: flow_entries_.tables()) {
+            auto it = verified_.find(pair.first);
+            bool verified = it != verified_.end() &&
+                            it->second == pair.second.checksum;
+            ret.emplace(pair.first, TableState{ pair.second.flows, verified });
+        }
+        return ret;
+    }
+
+    // Returns expected flows of the table (and cookie slice, if
+    // cookie_mask is set) missing in the dump of that same slice
+    FlowModPtrSequence process(uint8_t table_id, FlowStatsSequence& fs_seq,
+                               uint64_t cookie = 0, uint64_t cookie_mask = 0)
+    {
+        std::unordered_set<uint64_t> digests;
+        for (auto& fs: fs_seq) {
+            digests.insert(hash::flowDigest(fs));
+        }
+
         FlowModPtrSequence fmp_sequence;
+        std::vector<const Flow*> mismatched;
 
         lock_t lock(entries_mut_);
         for (auto& flow: flow_entries_) {
-            auto it = flow_set.find(flow);
-            if (it == flow_set.end()) {
-                auto&& msg = flow.message();
-                fmp_sequence.push_back(msg.ptr());
+            if (flow.table_id() == table_id &&
+                (flow.cookie() & cookie_mask) == (cookie & cookie_mask) &&
+                digests.count(flow.digest()) == 0) {
+                mismatched.push_back(&flow);
             }
         }
 
+        // Slow path: switch may encode the same entry differently,
+        // so only flows missing by match and priority are re-sent
+        if (not mismatched.empty()) {
+            auto&& flow_set = to_flow_set(fs_seq);
+            for (auto flow: mismatched) {
+                if (flow_set.find(*flow) == flow_set.end()) {
+                    auto&& msg = flow->message();
+                    fmp_sequence.push_back(msg.ptr());
+                }
+            }
+        }
+
+        // a cookie slice says nothing about the rest of the table
+        auto table = flow_entries_.tables().find(table_id);
+        if (not fmp_sequence.empty()) {
+            verified_.erase(table_id);
+        } else if (cookie_mask == 0 && table != flow_entries_.tables().end()) {
+            verified_[table_id] = table->second.checksum;
+        }
+
         return fmp_sequence;
     }
 
+    // Entries of a table dump which nobody expects, as DELETE_STRICT.
+    // Only cookies of expected entries of the table are looked at: other
+    // cookies belong to rules not sent through the verifier.
+    FlowModPtrSequence unexpected(uint8_t table_id, FlowStatsSequence& fs_seq)
+    {
+        FlowModPtrSequence ret;
+
+        lock_t lock(entries_mut_);
+        std::unordered_set<uint64_t> cookies;
+        for (const auto& flow: flow_entries_) {
+            if (flow.table_id() == table_id) {
+                cookies.insert(flow.cookie());
+            }
+        }
+
+        for (auto& fs: fs_seq) {
+            if (cookies.count(fs.cookie()) == 0 ||
+                flow_entries_.find(Flow(fs)) != flow_entries_.end()) {
+                continue;
+            }
+
+            FlowModPtr fmp(new of13::FlowMod);
+            fmp->command(of13::OFPFC_DELETE_STRICT);
+            fmp->table_id(table_id);
+            fmp->priority(fs.priority());
+            fmp->cookie(fs.cookie());
+            fmp->cookie_mask(0xFFFFFFFFFFFFFFFFULL);
+            fmp->out_port(of13::OFPP_ANY);
+            fmp->out_group(of13::OFPG_ANY);
+            fmp->match(fs.match());
+            ret.push_back(std::move(fmp));
+        }
+        return ret;
+    }
+
+    // Same entry with the same instructions and cookie is expected
+    bool expects(of13::FlowMod& fm)
+    {
+        Flow flow(fm);
+
+        lock_t lock(entries_mut_);
+        auto it = flow_entries_.find(flow);
+        return it != flow_entries_.end() && it->digest() == flow.digest();
+    }
+
+    memory::Usage memory_usage() const
+    {
+        lock_t lock(entries_mut_);
+        auto ret = flow_entries_.memory_usage();
+        ret.bytes += memory::footprint(verified_).bytes;
+        return ret;
+    }
+
     json toJson() const
     {
         lock_t lock(entries_mut_);
@@ -468,13 +953,63 @@ public:
         lock_t lock(entries_mut_);
 
         flow_entries_.clear();
+        verified_.clear();
         for (const auto& flow_json: state_json) {
-            flow_entries_.emplace(flow_json);
+            flow_entries_.insert(Flow(flow_json));
         }
     }
 
+    std::string toBinary() const
+    {
+        RecordWriter writer;
+
+        lock_t lock(entries_mut_);
+        for (const auto& flow: flow_entries_) {
+            flow.write(writer);
+        }
+        return writer.finish();
+    }
+
+    // Flows are unpacked straight from the record stream
+    void fromBinary(RecordReader& reader)
+    {
+        lock_t lock(entries_mut_);
+
+        flow_entries_.clear();
+        verified_.clear();
+
+        std::vector<uint8_t> raw;
+        while (reader.next(raw)) {
+            flow_entries_.insert(Flow(raw));
+        }
+        if (reader.error()) {
+            LOG(ERROR) << "[FlowEntriesVerifier] Malformed binary state, "
+                       << "loaded only its intact prefix";
+        }
+    }
+
+    // An empty record for the switch, then a packed Flow-Mod per record
+    void write(SnapshotWriter& writer, uint64_t dpid) const
+    {
+        writer.add(dpid, nullptr, 0);
+
+        lock_t lock(entries_mut_);
+        for (const auto& flow: flow_entries_) {
+            flow.write(writer, dpid);
+        }
+    }
+
+    void insert(const SnapshotRecord& record)
+    {
+        std::vector<uint8_t> raw(record.data, record.data + record.size);
+
+        lock_t lock(entries_mut_);
+        flow_entries_.insert(Flow(raw));
+    }
+
 private:
-    FlowSet flow_entries_;
+    FlowEntries flow_entries_;
+    std::map<uint8_t, uint64_t> verified_; // table -> verified checksum
     mutable std::mutex entries_mut_;
 
     static FlowSet to_flow_set(FlowStatsSequence& fs_sequence)
@@ -518,64 +1053,207 @@ public:
         }
     }
 
-    FlowStatsSequence flowStatsRequest(uint64_t dpid) const
+    bool flowStatsRequest(uint64_t dpid, FlowStatsSequence& ret,
+                          uint8_t table_id = of13::OFPTT_ALL,
+                          uint64_t cookie = 0,
+                          uint64_t cookie_mask = 0) const
     {
         UnsafeSwitchPtr sw = sw_mgr_->switch_(dpid);
         auto agent = sw->connection()->agent();
         ofp::flow_stats_request req;
+        req.table_id = table_id;
+        req.cookie = cookie;
+        req.cookie_mask = cookie_mask;
 
         try {
             auto f = agent->request_flow_stats(req);
             auto status = f.wait_for(boost::chrono::seconds(5));
             if (status == boost::future_status::timeout) {
-                return FlowStatsSequence();
+                return false;
+            }
+            ret = f.get();
+            return true;
+        }
+        catch (OFAgent::request_error const& e) {
+            return false;
+        }
+    }
+
+    // Flow count per table from aggregate stats, tables without
+    // a reply in time are left out
+    std::map<uint8_t, uint32_t>
+    flowCounts(uint64_t dpid, const SwitchState::TableStateMap& tables) const
+    {
+        std::map<uint8_t, uint32_t> ret;
+        UnsafeSwitchPtr sw = sw_mgr_->switch_(dpid);
+        auto agent = sw->connection()->agent();
+
+        std::vector<std::pair<uint8_t, future<ofp::aggregate_stats>>> replies;
+        try {
+            for (const auto& pair: tables) {
+                ofp::flow_stats_request req;
+                req.table_id = pair.first;
+                replies.emplace_back(pair.first, agent->request_aggregate(req));
             }
-            return f.get();
         }
         catch (OFAgent::request_error const& e) {
-            return FlowStatsSequence();
+            return ret;
+        }
+
+        auto deadline = boost::chrono::steady_clock::now()
+                      + boost::chrono::seconds(5);
+        for (auto& reply: replies) {
+            auto status = reply.second.wait_until(deadline);
+            if (status == boost::future_status::timeout) {
+                continue;
+            }
+            try {
+                ret[reply.first] = reply.second.get().flows;
+            }
+            catch (OFAgent::request_error const& e) { }
+        }
+        return ret;
+    }
+
+    // Device profile of the switch, defaults if it's gone
+    drivers::CapabilitiesPtr capabilities(uint64_t dpid) const
+    {
+        try {
+            return sw_mgr_->switch_(dpid)->capabilities();
+        } catch (const bad_pointer_access&) {
+            return std::make_shared<const drivers::Capabilities>();
+        }
+    }
+
+    // True if this poll of the switch should be skipped because it
+    // answers slower than usual, see OFAgent::slowdown(), or was
+    // verified sooner than its device profile allows
+    bool backoff(uint64_t dpid) const
+    {
+        double slowdown = 1.0;
+        std::chrono::milliseconds min_interval {0};
+        try {
+            UnsafeSwitchPtr sw = sw_mgr_->switch_(dpid);
+            min_interval = sw->capabilities()->verify_interval;
+            auto conn = sw->connection();
+            if (conn && conn->alive()) {
+                if (not conn->writable()) {
+                    VLOG(6) << "[FlowEntriesVerifier] Switch dpid=" << dpid
+                            << " has a send backlog, skip verification";
+                    return true;
+                }
+                slowdown = conn->agent()->slowdown();
+            }
+        } catch (const bad_pointer_access&) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(backoff_mutex_);
+        auto now = std::chrono::steady_clock::now();
+        auto& last = verified_at_[dpid];
+        if (min_interval.count() > 0 && now - last < min_interval) {
+            VLOG(6) << "[FlowEntriesVerifier] Switch dpid=" << dpid
+                    << " was verified less than " << min_interval.count()
+                    << "ms ago, skip verification";
+            return true;
         }
+
+        bool ret = backoff_[dpid].skip(slowdown);
+        if (ret) {
+            VLOG(6) << "[FlowEntriesVerifier] Switch dpid=" << dpid
+                    << " is " << slowdown << " times slower than usual,"
+                    << " skip verification";
+        } else {
+            last = now;
+        }
+        return ret;
     }
 
 private:
     SwitchManager* sw_mgr_;
+    mutable std::mutex backoff_mutex_;
+    mutable std::unordered_map<uint64_t, poll_backoff> backoff_;
+    mutable std::unordered_map<uint64_t,
+                               std::chrono::steady_clock::time_point> verified_at_;
 };
 
 class Recovery {
 public:
     using dump_json = VerifierDatabase::dump_json;
+    using dump_binary = VerifierDatabase::dump_binary;
 
     explicit Recovery(DatabaseConnector* db_mgr, RecoveryManager* rc_mgr)
         : db_mgr_(db_mgr)
         , rc_mgr_(rc_mgr)
-    { }
+    {
+        db_mgr_->declarePrefixes({ settings_prefix });
+    }
 
     void save(const dump_json& db_dump) const
     {
+        SValues values;
+
         json states_list;
         for (const auto& state_pair: db_dump) {
             states_list.push_back(state_pair.first);
         }
-        save_states_list(states_list);
+        save_states_list(states_list, values);
 
         for (const auto& state_pair: db_dump) {
-            save_state(state_pair.first, state_pair.second);
+            save_state(state_pair.first, state_pair.second, values);
         }
+        commit(std::move(values));
     }
 
-    dump_json load() const
+    // One value per switch instead of one key per flow
+    void save(const dump_binary& db_dump) const
     {
-        dump_json db_dump;
+        SValues values;
+
+        json states_list;
+        for (const auto& state_pair: db_dump) {
+            states_list.push_back(state_pair.first);
+        }
+        save_states_list(states_list, values);
 
+        for (const auto& state_pair: db_dump) {
+            values.push_back({ state_prefix(state_pair.first), binary_key,
+                               state_pair.second });
+        }
+        commit(std::move(values));
+    }
+
+    // Binary values as stored, legacy per-flow JSON states as JSON text
+    dump_binary load() const
+    {
+        dump_binary db_dump;
+
+        // All switches in one pipelined read instead of one after another
+        std::vector<std::string> dpids, prefixes;
         auto&& states_list = get_states_list();
-        for (const std::string& dpid_str: states_list) {
-            db_dump[dpid_str] = get_state(dpid_str);
+        for (const auto& dpid: states_list) {
+            dpids.push_back(dpid.get_string());
+            prefixes.push_back(state_prefix(dpids.back()));
+        }
+        auto&& states = db_mgr_->loadPrefixes(prefixes);
+
+        for (size_t i = 0; i < dpids.size(); ++i) {
+            auto& values = states[prefixes[i]];
+            auto binary = values.find(binary_key);
+            if (binary != values.end() &&
+                    RecordReader::recognizes(binary->second)) {
+                db_dump[dpids[i]] = std::move(binary->second);
+            } else {
+                db_dump[dpids[i]] = to_state(dpids[i], values).dump();
+            }
         }
 
         return db_dump;
     }
 
     bool isPrimary() const { return rc_mgr_->isPrimary(); }
+    bool isSharded() const { return rc_mgr_->isSharded(); }
+    bool isMaster(uint64_t dpid) const { return rc_mgr_->isMaster(dpid); }
 
 private:
     DatabaseConnector* db_mgr_;
@@ -584,62 +1262,66 @@ private:
     static constexpr auto states_prefix = "flow-entries-verifier:state";
     static constexpr auto settings_prefix = "flow-entries-verifier";
     static constexpr auto states_list_key = "states_list";
+    static constexpr auto binary_key = "binary";
+
+    using SValues = DatabaseConnector::SValues;
+
+    std::string state_prefix(const std::string& dpid_str) const
+    {
+        return db_mgr_->switchPrefix(states_prefix, dpid_str);
+    }
 
-    static std::string state_prefix(const std::string& dpid_str)
+    // All values go in one transaction: one round trip per save
+    void commit(SValues values) const
     {
-        return std::string(states_prefix) + ":" + dpid_str;
+        try {
+            db_mgr_->putSValues(std::move(values)).get();
+        } catch (redis_error& e) {
+            LOG(ERROR) << "[FlowEntriesVerifier] Can't save states: "
+                       << e.what();
+        }
     }
 
-    void save_states_list(const json& list) const
+    void save_states_list(const json& list, SValues& values) const
     {
-        db_mgr_->putSValue(settings_prefix, states_list_key, list.dump());
-        VLOG(30) << "[FlowEntriesVerifier] Saved states list to db: "
+        values.push_back({ settings_prefix, states_list_key, list.dump() });
+        VLOG(30) << "[FlowEntriesVerifier] Saving states list to db: "
                  << list.dump();
     }
 
-    void save_state(const std::string& dpid_str, const json& state) const
+    void save_state(const std::string& dpid_str, const json& state,
+                    SValues& values) const
     {
         VLOG(17) << "[FlowEntriesVerifier] Saving state #"
                  << dpid_str << ": " << state;
 
         for (size_t i = 1; i < state.size() + 1; ++i) {
             const auto& flow = state[i - 1];
-            db_mgr_->putSValue(state_prefix(dpid_str),
-                               std::to_string(i),
-                               flow.dump());
+            values.push_back({ state_prefix(dpid_str), std::to_string(i),
+                               flow.dump() });
         }
     }
 
-    json get_states_list() const
+    json_document get_states_list() const
     {
-        auto&& list_dump = db_mgr_->getSValue(settings_prefix, states_list_key);
+        auto&& list = db_mgr_->getDocument(settings_prefix, states_list_key);
 
         VLOG(30) << "[FlowEntriesVerifier] Got states list from db: "
-                 << list_dump;
+                 << list.root().raw();
 
-        if (list_dump.empty()) {
-            return json::array();
-        }
-
-        return json::parse(list_dump);
+        return list;
     }
 
-    json get_state(const std::string dpid_str) const
+    json to_state(const std::string& dpid_str,
+                  const std::map<std::string, std::string>& state_values) const
     {
-        auto&& state_keys = db_mgr_->getKeys(state_prefix(dpid_str));
-
-        if (state_keys.empty()) {
-            return json::array();
-        }
-
-        json state;
-        for (const auto& key: state_keys) {
-            auto&& flow = db_mgr_->getSValue(state_prefix(dpid_str), key);
-            if (flow.empty()) {
+        json state = json::array();
+        for (const auto& kv: state_values) {
+            if (kv.first == binary_key || kv.second.empty()) {
                 continue;
             }
 
-            state.push_back(json::parse(flow));
+            state.push_back(json::parse(kv.second));
         }
         VLOG(17) << "[FlowEntriesVerifier] Got state #"
                  << dpid_str << " from db: " << state;
@@ -650,6 +1332,72 @@ private:
 
 /*  VERIFIER DATABASE  */
 
+static void resend(const MessageSender* sender, uint64_t dpid,
+                   FlowModPtrSequence& fmp_sequence)
+{
+    if (fmp_sequence.empty()) {
+        return;
+    }
+
+    LOG(WARNING) << "[FlowEntriesVerifier] No "
+                 << fmp_sequence.size() << " required flow entries "
+                 << "on switch dpid=" << dpid;
+
+    sender->send(dpid, fmp_sequence);
+
+    VLOG(7) << "[FlowEntriesVerifier] " << fmp_sequence.size()
+            << " Flow-Mod re-sent to switch dpid=" << dpid;
+}
+
+bool VerifierDatabase::hasState(uint64_t dpid) const
+{
+    return find_state(dpid) != nullptr;
+}
+
+bool VerifierDatabase::expects(uint64_t dpid, of13::FlowMod& fm) const
+{
+    auto state_ptr = find_state(dpid);
+    return state_ptr && state_ptr->expects(fm);
+}
+
+void VerifierDatabase::reconcile(const MessageSender* sender,
+                                 uint64_t dpid) const
+{
+    auto state_ptr = find_state(dpid);
+    if (!state_ptr) {
+        return;
+    }
+
+    FlowStatsSequence flow_stats;
+    if (!sender->flowStatsRequest(dpid, flow_stats)) {
+        LOG(WARNING) << "[FlowEntriesVerifier] Can't read flow tables of "
+                     << "switch dpid=" << dpid << ", reconciled by polling";
+        return;
+    }
+
+    std::map<uint8_t, FlowStatsSequence> by_table;
+    for (auto& fs: flow_stats) {
+        by_table[fs.table_id()].push_back(std::move(fs));
+    }
+
+    // Stale entries go first: a missing one may take their place
+    FlowModPtrSequence deletes, adds;
+    for (const auto& table: state_ptr->tables()) {
+        auto& dump = by_table[table.first];
+        auto&& extra = state_ptr->unexpected(table.first, dump);
+        auto&& missing = state_ptr->process(table.first, dump);
+        std::move(extra.begin(), extra.end(), std::back_inserter(deletes));
+        std::move(missing.begin(), missing.end(), std::back_inserter(adds));
+    }
+
+    LOG(INFO) << "[FlowEntriesVerifier] Switch dpid=" << dpid
+              << " reconciled: " << adds.size() << " flow entries added, "
+              << deletes.size() << " deleted, "
+              << flow_stats.size() - deletes.size() << " kept";
+    sender->send(dpid, deletes);
+    sender->send(dpid, adds);
+}
+
 void VerifierDatabase::removeState(uint64_t dpid)
 {
     upgrade_lock_t lock(states_mut_);
@@ -704,6 +1452,102 @@ void VerifierDatabase::fromJson(VerifierDatabase::dump_json& db_dump)
     }
 }
 
+void VerifierDatabase::fromBinary(VerifierDatabase::dump_binary& db_dump,
+                                  WorkerPool* workers)
+{
+    clear();
+    auto parse = [](const std::string& state) {
+        if (RecordReader::recognizes(state)) {
+            RecordReader reader(state);
+            return std::make_shared<SwitchState>(reader);
+        }
+        return std::make_shared<SwitchState>(json::parse(state));
+    };
+
+    if (!workers) {
+        for (const auto& state_pair: db_dump) {
+            auto dpid = std::stoull(state_pair.first);
+            auto state_ptr = parse(state_pair.second);
+            add_state_impl(dpid, state_ptr);
+        }
+        return;
+    }
+
+    // Every switch is parsed by one worker, then all are added at once
+    std::vector<std::pair<uint64_t, SwitchStatePtr>> parsed;
+    for (const auto& state_pair: db_dump) {
+        parsed.emplace_back(std::stoull(state_pair.first), nullptr);
+    }
+
+    std::mutex done_mut;
+    std::condition_variable done_cv;
+    size_t left = parsed.size();
+
+    auto state_it = db_dump.cbegin();
+    for (auto& pair: parsed) {
+        auto state = &(state_it++)->second;
+        workers->submit(pair.first, [&, state, slot = &pair.second]() {
+            catch_all_and_log([&]() {
+                *slot = parse(*state);
+            });
+            std::lock_guard<std::mutex> lock(done_mut);
+            if (--left == 0)
+                done_cv.notify_one();
+        });
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(done_mut);
+        done_cv.wait(lock, [&]() { return left == 0; });
+    }
+
+    for (auto& pair: parsed) {
+        if (pair.second) {
+            add_state_impl(pair.first, pair.second);
+        }
+    }
+}
+
+VerifierDatabase::dump_binary VerifierDatabase::toBinary() const
+{
+    dump_binary db_dump;
+
+    shared_lock_t lock(states_mut_);
+    for (const auto& state: states_) {
+        std::string dpid_str = std::to_string(state.first);
+        db_dump[dpid_str] = state.second->toBinary();
+    }
+    return db_dump;
+}
+
+void VerifierDatabase::fromSnapshot(const SnapshotSection& section)
+{
+    clear();
+
+    std::unordered_map<uint64_t, SwitchStatePtr> loaded;
+    for (auto record: section) {
+        auto& state = loaded[record.key];
+        if (!state) {
+            state = std::make_shared<SwitchState>();
+        }
+        if (record.size > 0) {
+            state->insert(record);
+        }
+    }
+
+    for (auto& state_pair: loaded) {
+        add_state_impl(state_pair.first, state_pair.second);
+    }
+}
+
+void VerifierDatabase::toSnapshot(SnapshotWriter& writer) const
+{
+    shared_lock_t lock(states_mut_);
+    for (const auto& state: states_) {
+        state.second->write(writer, state.first);
+    }
+}
+
 VerifierDatabase::dump_json VerifierDatabase::toJson() const
 {
     dump_json db_dump;
@@ -716,31 +1560,161 @@ VerifierDatabase::dump_json VerifierDatabase::toJson() const
     return db_dump;
 }
 
-void VerifierDatabase::restoreStates(const MessageSender* sender) const
+void VerifierDatabase::restoreStates(const MessageSender* sender,
+                                     bool full, WorkerPool* workers) const
 {
-    shared_lock_t lock(states_mut_);
+    // States are shared with the workers, switches may go down meanwhile
+    std::vector<std::pair<uint64_t, SwitchStatePtr>> states;
+    {
+        shared_lock_t lock(states_mut_);
+        states.assign(states_.begin(), states_.end());
+    }
 
-    for (const auto& pair: states_) {
-        auto dpid = pair.first;
-        auto& state_ptr = pair.second;
-
-        auto&& flow_stats = sender->flowStatsRequest(dpid);
-        if (!flow_stats.empty()) {
-            auto&& fmp_sequence = state_ptr->process(flow_stats);
-            if (!fmp_sequence.empty()) {
-                LOG(WARNING) << "[FlowEntriesVerifier] No "
-                             << fmp_sequence.size() << "required flow entries "
-                             << "on switch dpid=" << dpid;
+    if (!workers) {
+        for (const auto& pair: states) {
+            restore_state(sender, pair.first, *pair.second, full);
+        }
+        return;
+    }
+
+    // A switch is owned by one worker, so the poll takes as long as
+    // the slowest switch rather than all of them together
+    std::mutex done_mut;
+    std::condition_variable done_cv;
+    size_t left = states.size();
+
+    for (const auto& pair: states) {
+        workers->submit(pair.first, [&, pair]() {
+            catch_all_and_log([&]() {
+                restore_state(sender, pair.first, *pair.second, full);
+            });
+            std::lock_guard<std::mutex> lock(done_mut);
+            if (--left == 0)
+                done_cv.notify_one();
+        });
+    }
+
+    std::unique_lock<std::mutex> lock(done_mut);
+    done_cv.wait(lock, [&]() { return left == 0; });
+}
+
+void VerifierDatabase::restore_state(const MessageSender* sender,
+                                     uint64_t dpid, SwitchState& state,
+                                     bool full) const
+{
+    auto&& tables = state.tables();
+    if (tables.empty() || sender->backoff(dpid)) {
+        return;
+    }
+
+    FlowModPtrSequence fmp_sequence;
+    auto restore = [&](uint8_t table_id, FlowStatsSequence& flow_stats) {
+        auto&& missing = state.process(table_id, flow_stats);
+        std::move(missing.begin(), missing.end(),
+                  std::back_inserter(fmp_sequence));
+    };
+
+    // Rough size of a flow stats entry with its match and instructions
+    static constexpr uint64_t flow_stats_bytes = 128;
+    uint64_t flows = 0;
+    for (const auto& table: tables) {
+        flows += table.second.flows;
+    }
+    auto max_reply = sender->capabilities(dpid)->max_multipart_bytes;
+
+    if (full && max_reply > 0 && flows * flow_stats_bytes > max_reply) {
+        // The device stalls on a dump of all its tables at once
+        for (const auto& table: tables) {
+            FlowStatsSequence flow_stats;
+            if (sender->flowStatsRequest(dpid, flow_stats, table.first)) {
+                restore(table.first, flow_stats);
             }
+        }
+    } else if (full) {
+        FlowStatsSequence flow_stats;
+        if (!sender->flowStatsRequest(dpid, flow_stats)) {
+            return;
+        }
 
-            sender->send(dpid, fmp_sequence);
+        std::map<uint8_t, FlowStatsSequence> by_table;
+        for (auto& fs: flow_stats) {
+            by_table[fs.table_id()].push_back(std::move(fs));
+        }
+        for (const auto& table: tables) {
+            restore(table.first, by_table[table.first]);
+        }
+    } else {
+        // Dump only tables changed on either side since last check
+        auto&& counts = sender->flowCounts(dpid, tables);
+        for (const auto& table: tables) {
+            auto it = counts.find(table.first);
+            if (it == counts.end())
+                continue;
+            if (table.second.verified && it->second == table.second.flows)
+                continue;
 
-            if (!fmp_sequence.empty()) {
-                VLOG(7) << "[FlowEntriesVerifier] " << fmp_sequence.size()
-                        << "Flow-Mod re-sent to switch dpid=" << dpid;
+            FlowStatsSequence flow_stats;
+            if (sender->flowStatsRequest(dpid, flow_stats, table.first)) {
+                restore(table.first, flow_stats);
             }
         }
     }
+
+    resend(sender, dpid, fmp_sequence);
+}
+
+VerifierDatabase::TableList VerifierDatabase::tables() const
+{
+    TableList ret;
+
+    shared_lock_t lock(states_mut_);
+    for (const auto& pair: states_) {
+        auto& tables = ret[pair.first];
+        for (const auto& table: pair.second->tables()) {
+            tables.push_back(table.first);
+        }
+    }
+    return ret;
+}
+
+void VerifierDatabase::memoryUsage(memory::Sheet& sheet) const
+{
+    shared_lock_t lock(states_mut_);
+    for (const auto& pair: states_) {
+        sheet.add("expected-flows", pair.second->memory_usage(), pair.first);
+    }
+    sheet.add("states", memory::footprint(states_));
+
+    // every blob: its string, the shared_ptr control block holding the
+    // deleter and the pool's hash node
+    auto& pool = blobs();
+    uint64_t count = pool.size();
+    uint64_t per_blob = sizeof(std::string) + 6 * sizeof(void*)
+                      + sizeof(std::string_view) + 4 * sizeof(void*)
+                      + 3 * memory::node_overhead;
+    sheet.add("interned-blobs", { pool.bytes() + count * per_blob, count });
+}
+
+size_t VerifierDatabase::restoreSlice(const MessageSender* sender,
+                                      uint64_t dpid, uint8_t table_id,
+                                      uint64_t cookie,
+                                      uint64_t cookie_mask) const
+{
+    auto state_ptr = find_state(dpid);
+    if (!state_ptr) {
+        return 0;
+    }
+
+    FlowStatsSequence flow_stats;
+    if (!sender->flowStatsRequest(dpid, flow_stats, table_id,
+                                  cookie, cookie_mask)) {
+        return 0;
+    }
+
+    auto&& fmp_sequence = state_ptr->process(table_id, flow_stats,
+                                             cookie, cookie_mask);
+    resend(sender, dpid, fmp_sequence);
+    return fmp_sequence.size();
 }
 
 void VerifierDatabase::add_state_impl(uint64_t dpid, SwitchStatePtr& state_ptr)
@@ -775,18 +1749,150 @@ VerifierDatabase::SwitchStatePtr VerifierDatabase::find_state(uint64_t dpid) con
     return it->second;
 }
 
+/*   SWEEP SCHEDULER   */
+
+// Splits verification into (switch, table, cookie partition) slices and
+// checks a bounded number of them per tick, so one sweep over every
+// switch is spread across many polls. Cookies are partitioned by their
+// low bits, where the applications keep their distinct values.
+class SweepScheduler {
+public:
+    using SweepProgress = FlowEntriesVerifier::SweepProgress;
+
+    SweepScheduler(unsigned cookie_bits, unsigned slices_per_tick)
+        : cookie_partitions_(uint64_t(1) << cookie_bits)
+        , slices_per_tick_(std::max(1u, slices_per_tick))
+    { }
+
+    bool beginning() const
+    {
+        lock_t lock(mutex_);
+        return cursor_ == slices_.size();
+    }
+
+    void tick(const VerifierDatabase* data, const MessageSender* sender)
+    {
+        std::vector<Slice> batch;
+
+        { //lock
+            lock_t lock(mutex_);
+            if (cursor_ == slices_.size()) {
+                start(data, sender);
+            }
+            while (batch.size() < slices_per_tick_ && cursor_ < slices_.size()) {
+                batch.push_back(slices_[cursor_++]);
+            }
+        } //unlock
+
+        uint64_t mask = cookie_partitions_ - 1;
+        for (const auto& slice: batch) {
+            auto missing = data->restoreSlice(sender, slice.dpid, slice.table,
+                                              slice.cookie, mask);
+            VLOG(8) << "[FlowEntriesVerifier] Verified slice dpid="
+                    << slice.dpid << " table=" << unsigned(slice.table)
+                    << " cookie=" << slice.cookie << "/" << mask;
+
+            lock_t lock(mutex_);
+            missing_ += missing;
+            last_ = slice;
+            ++verified_;
+        }
+    }
+
+    SweepProgress progress() const
+    {
+        lock_t lock(mutex_);
+
+        SweepProgress ret;
+        ret.enabled = true;
+        ret.sweeps = sweeps_;
+        ret.position = verified_;
+        ret.total = slices_.size();
+        ret.dpid = last_.dpid;
+        ret.table = last_.table;
+        ret.cookie = last_.cookie;
+        ret.cookie_mask = cookie_partitions_ - 1;
+        ret.missing = missing_;
+        ret.last_sweep = last_sweep_;
+        return ret;
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct Slice {
+        uint64_t dpid {0};
+        uint8_t table {0};
+        uint64_t cookie {0};
+    };
+
+    const uint64_t cookie_partitions_;
+    const size_t slices_per_tick_;
+
+    mutable std::mutex mutex_;
+    std::vector<Slice> slices_;
+    size_t cursor_ {0};
+    size_t verified_ {0};
+    Slice last_;
+    uint64_t sweeps_ {0};
+    uint64_t missing_ {0};
+    clock::time_point started_;
+    std::chrono::milliseconds last_sweep_ {0};
+
+    // Warning: requires mutex_ to be held
+    void start(const VerifierDatabase* data, const MessageSender* sender)
+    {
+        auto now = clock::now();
+        if (not slices_.empty()) {
+            ++sweeps_;
+            last_sweep_ = std::chrono::duration_cast<
+                std::chrono::milliseconds>(now - started_);
+        }
+
+        slices_.clear();
+        for (const auto& pair: data->tables()) {
+            // slow switches sit out some sweeps as a whole
+            if (sender->backoff(pair.first)) {
+                continue;
+            }
+            for (auto table: pair.second) {
+                for (uint64_t c = 0; c < cookie_partitions_; ++c) {
+                    slices_.push_back(Slice{ pair.first, table, c });
+                }
+            }
+        }
+
+        cursor_ = 0;
+        verified_ = 0;
+        missing_ = 0;
+        started_ = now;
+    }
+};
+
 /*   IMPLEMENTATION   */
 
 struct FlowEntriesVerifier::implementation final
     : OFMessageHandler<of13::FlowRemoved>
 {
     VerifierDatabase* data_ptr;
+    SwitchManager* sw_mgr;
     MessageSender sender;
     Recovery recovery;
 
+    bool binary_state {true};
+    bool incremental {false};
+    bool warm_restart {false};
+    Poller* poller {nullptr};
+    StateSnapshot* snapshot {nullptr};
+    unsigned full_verify_every {10};
+    mutable unsigned polls {0};
+    std::unique_ptr<SweepScheduler> sweep;
+    std::unique_ptr<WorkerPool> workers; // none: switches one by one
+
     explicit implementation(VerifierDatabase* data, SwitchManager* sw_mgr,
                             DatabaseConnector* db_mgr, RecoveryManager* rc_mgr)
         : data_ptr(data)
+        , sw_mgr(sw_mgr)
         , sender(sw_mgr)
         , recovery(db_mgr, rc_mgr)
     { }
@@ -796,23 +1902,48 @@ struct FlowEntriesVerifier::implementation final
     void send(uint64_t dpid, of13::FlowMod* fmp)
     {
         fmp->flags(fmp->flags() | of13::OFPFF_SEND_FLOW_REM);
+        // Rules re-sent by applications after a warm restart are
+        // already there or will be restored by reconcile()
+        if (warm_restart && fmp->command() == of13::OFPFC_ADD &&
+            data_ptr->expects(dpid, *fmp)) {
+            VLOG(8) << "[FlowEntriesVerifier] Flow-Mod to switch dpid="
+                    << dpid << " is expected there, not sent";
+            return;
+        }
         send(dpid, *fmp);
+        // The owner of the shard verifies the switch
+        if (isSharded() && !isMaster(dpid)) {
+            return;
+        }
         process(*fmp, dpid);
     }
 
     void polling() const
     {
-        if (!isPrimary()) {
+        if (!isPrimary() && !isSharded()) {
             return;
         }
 
-        saveToDatabase();
+        // Each shard keeps its expected state in memory, the stored
+        // one covers all switches and would have a writer per node
+        const bool save = !isSharded();
+        if (sweep) {
+            if (save && sweep->beginning()) {
+                saveToDatabase();
+            }
+            sweep->tick(data_ptr, &sender);
+            return;
+        }
+
+        if (save) {
+            saveToDatabase();
+        }
         restoreStates();
     }
 
     void switchDown(uint64_t dpid)
     {
-        if (!isPrimary()) {
+        if (!isPrimary() && !isSharded()) {
             return;
         }
 
@@ -821,7 +1952,16 @@ struct FlowEntriesVerifier::implementation final
 
     void switchUp(uint64_t dpid)
     {
-        if (!isPrimary()) {
+        if (!isMaster(dpid)) {
+            return;
+        }
+
+        // Warm restart keeps the expected state and sends the switch
+        // only the difference with its tables, read once off the Qt thread
+        if (warm_restart && poller && data_ptr->hasState(dpid)) {
+            poller->apply([this, dpid]() {
+                data_ptr->reconcile(&sender, dpid);
+            });
             return;
         }
 
@@ -830,11 +1970,11 @@ struct FlowEntriesVerifier::implementation final
 
     bool process(of13::FlowRemoved& fr, OFConnectionPtr conn) override
     {
-        if (!isPrimary()) {
+        auto dpid = conn->dpid();
+        if (!isMaster(dpid)) {
             return false;
         }
 
-        auto dpid = conn->dpid();
         auto&& fmp = data_ptr->process(dpid, fr);
         if (fmp) {
             VLOG(7) << "[FlowEntriesVerifier] Unexpected flow removal "
@@ -851,32 +1991,68 @@ struct FlowEntriesVerifier::implementation final
 
     void process(of13::FlowMod& fm, uint64_t dpid)
     {
-        CHECK(isPrimary());
+        CHECK(isMaster(dpid));
         data_ptr->process(dpid, fm);
     }
 
+    // Sharded mode: drops the states of the switches handed over and
+    // starts empty ones for the switches taken, their rules are known
+    // to the previous owner only
+    void reshard()
+    {
+        for (const auto& state : data_ptr->tables()) {
+            if (!isMaster(state.first)) {
+                data_ptr->removeState(state.first);
+            }
+        }
+        auto registry = sw_mgr->registry();
+        for (const auto& sw : registry->switches()) {
+            if (isMaster(sw->dpid()) && !data_ptr->hasState(sw->dpid())) {
+                data_ptr->addState(sw->dpid());
+            }
+        }
+    }
+
     void loadFromDatabase()
     {
+        if (auto file = snapshot->current()) {
+            if (auto section = file->section("flow-entries-verifier")) {
+                data_ptr->fromSnapshot(*section);
+                VLOG(6) << "[FlowEntriesVerifier] States were loaded from "
+                        << "local snapshot";
+                return;
+            }
+        }
+
         auto&& db_dump = recovery.load();
-        data_ptr->fromJson(db_dump);
+        data_ptr->fromBinary(db_dump, workers.get());
     }
 
     void saveToDatabase() const
     {
-        auto&& db_dump = data_ptr->toJson();
-        recovery.save(db_dump);
+        if (binary_state) {
+            recovery.save(data_ptr->toBinary());
+        } else {
+            recovery.save(data_ptr->toJson());
+        }
 
         VLOG(6) << "[FlowEntriesVerifier] States were saved to database";
     }
 
     void restoreStates() const
     {
-        data_ptr->restoreStates(&sender);
+        // Incremental polls trust aggregate counts, so every Nth poll
+        // still dumps whole switches
+        bool full = !incremental || full_verify_every <= 1 ||
+                    polls++ % full_verify_every == 0;
+        data_ptr->restoreStates(&sender, full, workers.get());
 
         VLOG(6) << "[FlowEntriesVerifier] States were verified";
     }
 
     bool isPrimary() const { return recovery.isPrimary(); }
+    bool isSharded() const { return recovery.isSharded(); }
+    bool isMaster(uint64_t dpid) const { return recovery.isMaster(dpid); }
 };
 
 /*     APPLICATION    */
@@ -890,10 +2066,45 @@ void FlowEntriesVerifier::init(Loader* loader, const Config& rootConfig)
     RecoveryManager* rc_mgr = RecoveryManager::get(loader);
     DatabaseConnector* db_mgr = DatabaseConnector::get(loader);
     impl_.reset(new implementation(&data_, sw_mgr, db_mgr, rc_mgr));
+    impl_->binary_state = config_get(config, "binary-state", true);
+    impl_->incremental = config_get(config, "incremental", false);
+    impl_->full_verify_every = config_get(config, "full-verify-every", 10);
+    impl_->warm_restart = config_get(config, "warm-restart", false);
+    impl_->snapshot = StateSnapshot::get(loader);
+
+    // Switches verified at once, each dump waits on its switch
+    int verify_threads = config_get(config, "verify-threads", 4);
+    if (verify_threads > 1) {
+        impl_->workers.reset(new WorkerPool(verify_threads));
+    }
 
     if (is_active_) {
+        impl_->snapshot->provide("flow-entries-verifier",
+            [this](SnapshotWriter& writer) { data_.toSnapshot(writer); });
+
         uint16_t poll_interval = config_get(config, "poll-interval", 30000);
+
+        // In sweep mode the poller ticks faster and verifies only
+        // a few slices each time
+        if (config_get(config, "sweep", false)) {
+            unsigned cookie_bits = config_get(config, "sweep-cookie-bits", 2);
+            CHECK(cookie_bits <= 16);
+            impl_->sweep.reset(new SweepScheduler(
+                cookie_bits, config_get(config, "sweep-slices-per-tick", 1)));
+            poll_interval = config_get(config, "sweep-tick", 1000);
+        }
         poller_.reset(new Poller(this, poll_interval));
+        impl_->poller = poller_.get();
+        poll_tuning_ = PollTuning::global().add(
+            "flow-entries-verifier.poll-interval",
+            std::chrono::milliseconds(poll_interval),
+            [poller = poller_.get()](std::chrono::milliseconds interval) {
+                poller->set_interval(interval);
+            });
+
+        memory_probe_ = memory::Registry::global().probe(
+            "flow-entries-verifier",
+            [this](memory::Sheet& sheet) { data_.memoryUsage(sheet); });
 
         Controller::get(loader)->register_handler(impl_, -92);
         SwitchOrderingManager::get(loader)->registerHandler(this, 17);
@@ -903,16 +2114,28 @@ void FlowEntriesVerifier::init(Loader* loader, const Config& rootConfig)
             LOG(INFO) << "[FlowEntriesVerifier] FlowEntriesVerifier recovered";
         });
 
-        connect(rc_mgr, &RecoveryManager::signalSetupBackupMode,
-                this, [this]() { data_.clear(); });
-        connect(rc_mgr, &RecoveryManager::signalSetupPrimaryMode,
-                this, [this]() { impl_->loadFromDatabase(); });
+        if (rc_mgr->isSharded()) {
+            connect(rc_mgr, &RecoveryManager::shardsChanged,
+                    this, [this]() { impl_->reshard(); });
+        } else {
+            connect(rc_mgr, &RecoveryManager::signalSetupBackupMode,
+                    this, [this]() { data_.clear(); });
+            connect(rc_mgr, &RecoveryManager::signalSetupPrimaryMode,
+                    this, [this]() { impl_->loadFromDatabase(); });
+        }
     }
 }
 
 void FlowEntriesVerifier::startUp(Loader *loader)
 {
     if (is_active_) {
+        // Intended state of a warm restart, before switches connect
+        if (impl_->warm_restart && impl_->isPrimary()) {
+            impl_->loadFromDatabase();
+            LOG(INFO) << "[FlowEntriesVerifier] Warm restart, expected "
+                      << "flow entries loaded for " << data_.tables().size()
+                      << " switches";
+        }
         poller_->run();
     }
 }
@@ -927,6 +2150,19 @@ void FlowEntriesVerifier::send(uint64_t dpid, fluid_msg::OFMsg& msg)
     }
 }
 
+bool FlowEntriesVerifier::installed(uint64_t dpid,
+                                    fluid_msg::OFMsg& msg) const
+{
+    if (!is_active_ || msg.type() != of13::OFPT_FLOW_MOD) {
+        return false;
+    }
+
+    auto fmp = dynamic_cast<of13::FlowMod*>(&msg);
+    return fmp && fmp->command() == of13::OFPFC_ADD &&
+           fmp->idle_timeout() == 0 && fmp->hard_timeout() == 0 &&
+           impl_->isMaster(dpid) && data_.expects(dpid, *fmp);
+}
+
 void FlowEntriesVerifier::polling()
 {
     if (is_active_) {
@@ -934,6 +2170,14 @@ void FlowEntriesVerifier::polling()
     }
 }
 
+FlowEntriesVerifier::SweepProgress FlowEntriesVerifier::sweepProgress() const
+{
+    if (impl_ && impl_->sweep) {
+        return impl_->sweep->progress();
+    }
+    return SweepProgress();
+}
+
 void FlowEntriesVerifier::switchUp(SwitchPtr sw)
 {
     impl_->switchUp(sw->dpid());
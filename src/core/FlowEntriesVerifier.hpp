@@ -18,6 +18,8 @@
 
 #include "Application.hpp"
 #include "SwitchOrdering.hpp"
+#include "lib/memory_accounting.hpp"
+#include "lib/poll_tuning.hpp"
 #include "lib/poller.hpp"
 
 #include <fluid/ofcommon/msg.hh>
@@ -26,9 +28,11 @@
 
 #include <boost/thread/shared_mutex.hpp>
 
+#include <chrono>
 #include <memory>
 #include <map>
 #include <unordered_map>
+#include <vector>
 
 namespace runos {
 
@@ -43,6 +47,8 @@ public:
     using SwitchStatePtrMap = std::unordered_map<uint64_t, SwitchStatePtr>;
 
     using dump_json = std::map<std::string, json>;
+    using dump_binary = std::map<std::string, std::string>;
+    using TableList = std::map<uint64_t, std::vector<uint8_t>>;
 
     template<class... Args>
     void addState(uint64_t dpid, Args&&... args)
@@ -53,22 +59,62 @@ public:
         add_state_impl(dpid, new_state_ptr);
     }
 
+    bool hasState(uint64_t dpid) const;
     void removeState(uint64_t dpid);
     void clear();
 
+    // An ADD sending the same entry as one expected on the switch
+    bool expects(uint64_t dpid, of13::FlowMod& fm) const;
+    // Warm restart: reads all tables of the switch once, deletes entries
+    // nobody expects and re-sends missing expected ones. Blocks.
+    void reconcile(const class MessageSender* sender, uint64_t dpid) const;
+
     void process(uint64_t dpid, of13::FlowMod& fm);
     FlowModPtr process(uint64_t dpid, of13::FlowRemoved& fr);
 
     void fromJson(dump_json& db_dump);
     dump_json toJson() const;
 
-    void restoreStates(const class MessageSender* sender) const;
+    // Compact RecordWriter encoding of packed Flow-Mods; fromBinary
+    // also accepts JSON text of states saved by older versions. With
+    // `workers` switches are parsed in parallel; blocks until all of
+    // them are loaded.
+    void fromBinary(dump_binary& db_dump,
+                    class WorkerPool* workers = nullptr);
+    dump_binary toBinary() const;
+
+    // Packed Flow-Mods keyed by dpid, read from the mapped file
+    void fromSnapshot(const class SnapshotSection& section);
+    void toSnapshot(class SnapshotWriter& writer) const;
+
+    // Re-sends expected flow entries missing on switches. When `full` is
+    // false only tables whose flow count or expected state changed since
+    // their last successful check are dumped. With `workers` switches are
+    // verified in parallel, each one by a single worker; blocks until
+    // all of them are done.
+    void restoreStates(const class MessageSender* sender,
+                       bool full = true,
+                       class WorkerPool* workers = nullptr) const;
+
+    // Tables holding expected flows, per switch
+    TableList tables() const;
+
+    // Expected flow entries, per switch
+    void memoryUsage(memory::Sheet& sheet) const;
+
+    // Verifies one table and cookie slice of a switch and re-sends
+    // missing flow entries, returns their number
+    size_t restoreSlice(const class MessageSender* sender,
+                        uint64_t dpid, uint8_t table_id,
+                        uint64_t cookie, uint64_t cookie_mask) const;
 
 private:
     SwitchStatePtrMap states_;
     mutable boost::shared_mutex states_mut_;
 
     void add_state_impl(uint64_t dpid, SwitchStatePtr& new_state_ptr);
+    void restore_state(const class MessageSender* sender, uint64_t dpid,
+                       SwitchState& state, bool full) const;
     SwitchStatePtr find_state(uint64_t dpid) const;
 };
 
@@ -78,11 +124,32 @@ class FlowEntriesVerifier : public Application
     Q_OBJECT
     SIMPLE_APPLICATION(FlowEntriesVerifier, "flow-entries-verifier");
 public:
+    struct SweepProgress {
+        bool enabled {false};
+        uint64_t sweeps {0}; // completed sweeps
+        size_t position {0}; // slices verified in the current sweep
+        size_t total {0}; // slices in the current sweep
+        // last verified slice
+        uint64_t dpid {0};
+        uint8_t table {0};
+        uint64_t cookie {0};
+        uint64_t cookie_mask {0};
+        uint64_t missing {0}; // entries re-sent in the current sweep
+        std::chrono::milliseconds last_sweep {0}; // previous sweep duration
+    };
+
     void init(Loader* loader, const Config& config) override;
     void startUp(Loader *loader) override;
 
     void send(uint64_t dpid, fluid_msg::OFMsg& msg);
 
+    // Permanent ADD of an entry expected on the switch with the same
+    // cookie and instructions. Entries with timeouts are never reported:
+    // sending them again restarts their timers.
+    bool installed(uint64_t dpid, fluid_msg::OFMsg& msg) const;
+
+    SweepProgress sweepProgress() const;
+
 protected slots:
     void polling();
 
@@ -92,7 +159,9 @@ private:
     std::shared_ptr<implementation> impl_;
     VerifierDatabase data_;
     std::unique_ptr<class Poller> poller_;
+    PollTuning::handle poll_tuning_; // released before poller_
     bool is_active_;
+    memory::Registry::Handle memory_probe_;
 
     void switchUp(SwitchPtr sw) override;
     void switchDown(SwitchPtr sw) override;
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "RestListener.hpp"
+#include "FlowEntriesVerifier.hpp"
+
+namespace runos {
+
+struct VerifierSweepResource : rest::resource {
+    FlowEntriesVerifier* app;
+
+    explicit VerifierSweepResource(FlowEntriesVerifier* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override {
+        auto progress = app->sweepProgress();
+
+        rest::ptree ret;
+        ret.put("enabled", progress.enabled);
+        ret.put("sweeps", progress.sweeps);
+        ret.put("position", progress.position);
+        ret.put("total", progress.total);
+        ret.put("last-slice.dpid", progress.dpid);
+        ret.put("last-slice.table", unsigned(progress.table));
+        ret.put("last-slice.cookie", progress.cookie);
+        ret.put("cookie-mask", progress.cookie_mask);
+        ret.put("missing", progress.missing);
+        ret.put("last-sweep-ms", progress.last_sweep.count());
+        return ret;
+    }
+};
+
+class FlowEntriesVerifierRest : public Application
+{
+    SIMPLE_APPLICATION(FlowEntriesVerifierRest, "flow-entries-verifier-rest")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto app = FlowEntriesVerifier::get(loader);
+        auto rest_ = RestListener::get(loader);
+
+        rest_->mount(path_spec("/flow-entries-verifier/sweep/"),
+                     [=](const path_match&) {
+            return VerifierSweepResource { app };
+        });
+    }
+};
+
+REGISTER_APPLICATION(FlowEntriesVerifierRest, {"rest-listener",
+                                               "flow-entries-verifier", ""})
+}
@@ -0,0 +1,293 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "SwitchManager.hpp"
+#include "SwitchImpl.hpp"
+#include "StatsBucket.hpp"
+#include "lib/flow_sampling.hpp"
+#include "lib/metrics.hpp"
+#include "lib/switch_and_port.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Collector of sFlow and IPFIX sent by the switches.
+ *
+ * Interface counters become port stats and sampled packets estimates
+ * of the flow buckets (StatsBucketManager::sampled()); while they keep
+ * coming OpenFlow polling of both backs off. Switches are told apart by
+ * the OpenFlow port records of sFlow counter samples (dpid and port of
+ * an ifIndex), otherwise by the agent address being the switch's
+ * aux_address, with ifIndex as the port number.
+ */
+class FlowSampling : public Application
+{
+    SIMPLE_APPLICATION(FlowSampling, "flow-sampling")
+public:
+    void init(Loader* loader, const Config& rootConfig) override
+    {
+        switch_manager_ = SwitchManager::get(loader);
+        buckets_ = StatsBucketManager::get(loader);
+
+        auto config = config_cd(rootConfig, "flow-sampling");
+        sflow_port_ = config_get(config, "sflow-port", 0);
+        ipfix_port_ = config_get(config, "ipfix-port", 0);
+        ipfix_ = ipfix_decoder(uint32_t(std::max(
+            config_get(config, "ipfix-sampling-rate", 1), 1)));
+        flush_ = std::chrono::milliseconds(std::max(
+            config_get(config, "flush-ms", 1000), 10));
+        sample_ttl_ = std::max(std::chrono::milliseconds(
+            config_get(config, "sample-ttl-ms", 5000)), 2 * flush_);
+        counter_ttl_ = std::chrono::milliseconds(
+            config_get(config, "counter-ttl-ms", 30000));
+    }
+
+    void startUp(Loader*) override
+    {
+        if (sflow_port_ > 0)
+            sflow_fd_ = open_socket(sflow_port_);
+        if (ipfix_port_ > 0)
+            ipfix_fd_ = open_socket(ipfix_port_);
+        if (sflow_fd_ < 0 && ipfix_fd_ < 0) {
+            VLOG(1) << "[flow-sampling] No ports, collector is off";
+            return;
+        }
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    ~FlowSampling()
+    {
+        stop_ = true;
+        if (thread_.joinable())
+            thread_.join();
+        if (sflow_fd_ >= 0)
+            ::close(sflow_fd_);
+        if (ipfix_fd_ >= 0)
+            ::close(ipfix_fd_);
+    }
+
+private:
+    SwitchManager* switch_manager_;
+    StatsBucketManager* buckets_;
+    int sflow_port_ {0};
+    int ipfix_port_ {0};
+    int sflow_fd_ {-1};
+    int ipfix_fd_ {-1};
+    std::chrono::milliseconds flush_ {1000};
+    std::chrono::milliseconds sample_ttl_ {5000};
+    std::chrono::milliseconds counter_ttl_ {30000};
+    std::thread thread_;
+    std::atomic<bool> stop_ {false};
+
+    // Collector thread only
+    ipfix_decoder ipfix_;
+    std::map<std::pair<uint32_t, uint32_t>, switch_and_port> interfaces_;
+    std::unordered_map<uint32_t, uint64_t> agents_; // from aux_address
+
+    // sFlow packet counters are 32-bit, port stats 64-bit
+    struct widened {
+        std::array<uint32_t, 6> raw {};
+        std::array<uint64_t, 6> value {};
+    };
+    std::unordered_map<switch_and_port, widened> counters_;
+
+    static int open_socket(int port)
+    {
+        int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            LOG(ERROR) << "[flow-sampling] Can't create socket for port " << port;
+            return -1;
+        }
+        int size = 4 << 20; // bursts of samples
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+        sockaddr_in addr {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(uint16_t(port));
+        if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            LOG(ERROR) << "[flow-sampling] Can't bind UDP port " << port;
+            ::close(fd);
+            return -1;
+        }
+        LOG(INFO) << "[flow-sampling] Listening on UDP port " << port;
+        return fd;
+    }
+
+    void run()
+    {
+        auto& datagrams = metrics::Registry::global().counter(
+            "runos_flow_sampling_datagrams_total",
+            "Datagrams received by the flow sampling collector");
+        auto& malformed = metrics::Registry::global().counter(
+            "runos_flow_sampling_malformed_total",
+            "Datagrams the flow sampling collector couldn't decode");
+
+        std::vector<pollfd> fds;
+        if (sflow_fd_ >= 0)
+            fds.push_back(pollfd{sflow_fd_, POLLIN, 0});
+        if (ipfix_fd_ >= 0)
+            fds.push_back(pollfd{ipfix_fd_, POLLIN, 0});
+
+        std::vector<uint8_t> buffer(65536);
+        auto next_flush = std::chrono::steady_clock::now() + flush_;
+        refresh_agents();
+
+        while (not stop_) {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= next_flush) {
+                buckets_->flushSamples(sample_ttl_);
+                refresh_agents();
+                next_flush = now + flush_;
+            }
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                next_flush - now);
+            if (::poll(fds.data(), fds.size(),
+                       int(std::min<int64_t>(wait.count(), 200))) <= 0)
+                continue;
+
+            for (auto& p : fds) {
+                if (not (p.revents & POLLIN))
+                    continue;
+                sockaddr_in from {};
+                socklen_t from_len = sizeof(from);
+                ssize_t n = ::recvfrom(p.fd, buffer.data(), buffer.size(),
+                                       MSG_DONTWAIT,
+                                       reinterpret_cast<sockaddr*>(&from),
+                                       &from_len);
+                if (n <= 0)
+                    continue;
+                datagrams.add();
+
+                sampled_datagram datagram;
+                bool ok = p.fd == sflow_fd_
+                    ? decode_sflow(buffer.data(), size_t(n), datagram)
+                    : ipfix_.decode(from.sin_addr.s_addr, buffer.data(),
+                                    size_t(n), datagram);
+                if (not ok)
+                    malformed.add();
+                // the IP header source when the agent is behind NAT or IPv6
+                if (datagram.agent == 0)
+                    datagram.agent = from.sin_addr.s_addr;
+                process(datagram);
+            }
+        }
+    }
+
+    void refresh_agents()
+    {
+        agents_.clear();
+        for (auto& sw : switch_manager_->switches()) {
+            in_addr addr;
+            if (::inet_pton(AF_INET, sw->aux_address().c_str(), &addr) == 1)
+                agents_[addr.s_addr] = sw->dpid();
+        }
+    }
+
+    bool locate(uint32_t agent, uint32_t if_index, switch_and_port& out) const
+    {
+        auto it = interfaces_.find({agent, if_index});
+        if (it != interfaces_.end()) {
+            out = it->second;
+            return true;
+        }
+        auto sw = agents_.find(agent);
+        if (sw == agents_.end() || if_index == 0)
+            return false;
+        out = switch_and_port(sw->second, if_index);
+        return true;
+    }
+
+    void process(const sampled_datagram& datagram)
+    {
+        auto now = std::chrono::steady_clock::now();
+
+        for (auto& c : datagram.counters) {
+            if (c.openflow)
+                interfaces_[{datagram.agent, c.if_index}] =
+                    switch_and_port(c.dpid, c.port_no);
+            switch_and_port where;
+            if (counter_ttl_.count() <= 0 ||
+                not locate(datagram.agent, c.if_index, where))
+                continue;
+            auto sw = std::static_pointer_cast<SwitchImpl>(
+                switch_manager_->switch_(where.dpid));
+            if (not sw)
+                continue;
+
+            auto& w = counters_[where];
+            const uint32_t raw[6] = { c.in_packets, c.out_packets,
+                                      c.in_discards, c.out_discards,
+                                      c.in_errors, c.out_errors };
+            for (size_t i = 0; i < w.raw.size(); ++i) {
+                w.value[i] += uint32_t(raw[i] - w.raw[i]);
+                w.raw[i] = raw[i];
+            }
+
+            PortMeasurement<uint64_t> m;
+            m.rx_packets() = w.value[0];
+            m.tx_packets() = w.value[1];
+            m.rx_bytes() = c.in_octets;
+            m.tx_bytes() = c.out_octets;
+            m.rx_dropped() = w.value[2];
+            m.tx_dropped() = w.value[3];
+            m.rx_errors() = w.value[4];
+            m.tx_errors() = w.value[5];
+            sw->push_counters(where.port, m, now + counter_ttl_);
+        }
+
+        for (auto& sample : datagram.flows) {
+            switch_and_port where;
+            uint64_t dpid;
+            packet_fields fields = sample.fields;
+            if (locate(datagram.agent, sample.input, where)) {
+                dpid = where.dpid;
+                fields.set(packet_fields::in_port, where.port);
+            } else {
+                auto sw = agents_.find(datagram.agent);
+                if (sw == agents_.end())
+                    continue; // not one of ours
+                dpid = sw->second;
+            }
+            buckets_->sampled(dpid, fields,
+                              sample.packets * sample.sampling_rate,
+                              sample.bytes * sample.sampling_rate);
+        }
+    }
+};
+
+REGISTER_APPLICATION(FlowSampling, {"switch-manager", "stats-bucket-manager", ""})
+
+}
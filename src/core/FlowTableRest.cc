@@ -26,6 +26,16 @@
 #include <boost/thread/future.hpp>
 #include <boost/chrono.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/functional/hash.hpp>
+
+#include <atomic>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <tuple>
+#include <vector>
 
 namespace runos {
 
@@ -90,107 +100,214 @@ struct FlowTableCollection : rest::resource {
             pt.put("match.arp_tha", match.arp_tha()->value().to_string());
     }
 
-    rest::ptree Get() const override {
-        rest::ptree ret;
-        rest::ptree flows;
+    static rest::ptree parsingFlow(of13::FlowStats& fs,
+                                   bool match = true,
+                                   bool instructions = true) {
+        rest::ptree fpt;
+        fpt.put("table_id", fs.table_id());
+        fpt.put("duration_sec", fs.duration_sec());
+        fpt.put("priority", fs.priority());
+        fpt.put("idle_timeout", fs.idle_timeout());
+        fpt.put("hard_timeout", fs.hard_timeout());
+        fpt.put("cookie", fs.cookie());
+        fpt.put("packet_count", fs.packet_count());
+        fpt.put("byte_count", fs.byte_count());
+
+        if (match)
+            parsingMatch(fs.match(), fpt);
+        if (not instructions)
+            return fpt;
+
+        auto instrcts = fs.instructions();
+        auto instr_set = instrcts.instruction_set();
+        for (auto it = instr_set.begin(); it != instr_set.end(); it++) {
+            of13::Instruction* instr = *it;
+            fluid_msg::ActionList lst;
+            fluid_msg::ActionSet acts;
+            std::list<fluid_msg::Action*> alist;
+            std::set<fluid_msg::Action*, fluid_msg::comp_action_set_order> aset;
+            rest::ptree output_collector, group_collector;
+            rest::ptree woutput_collector, wgroup_collector;
+
+            switch (instr->type()) {
+            case (of13::OFPIT_GOTO_TABLE):
+                fpt.put("instructions.goto_table.table_id",
+                        ((of13::GoToTable*)instr)->table_id());
+                break;
+            case (of13::OFPIT_WRITE_METADATA):
+                fpt.put("instructions.write_metadata.metadata",
+                        ((of13::WriteMetadata*)instr)->metadata());
+                fpt.put("instructions.write_metadata.metadata_mask",
+                        ((of13::WriteMetadata*)instr)->metadata_mask());
+                break;
+            case (of13::OFPIT_WRITE_ACTIONS):
+                acts = ((of13::WriteActions*)instr)->actions();
+                aset = acts.action_set();
+                for (auto it = aset.begin(); it != aset.end(); it++) {
+                    rest::parsingAction(*it, "instructions.write_actions",
+                                 fpt, woutput_collector, wgroup_collector);
+                }
+                if (woutput_collector.size()) {
+                    fpt.add_child("instructions.write_actions.output",
+                                                        woutput_collector);
+                }
+                if (wgroup_collector.size()) {
+                    fpt.add_child("instructions.write_actions.group",
+                                                         wgroup_collector);
+                }
+                break;
+            case (of13::OFPIT_APPLY_ACTIONS):
+                lst = ((of13::ApplyActions*)instr)->actions();
+                alist = lst.action_list();
+                for (auto it = alist.begin(); it != alist.end(); it++) {
+                    rest::parsingAction(*it, "instructions.apply_actions",
+                                   fpt, output_collector, group_collector);
+                }
+                if (output_collector.size()) {
+                    fpt.add_child("instructions.apply_actions.output",
+                                                         output_collector);
+                }
+                if (group_collector.size()) {
+                    fpt.add_child("instructions.apply_actions.group",
+                                                          group_collector);
+                }
+                break;
+            case (of13::OFPIT_CLEAR_ACTIONS):
+                fpt.put("instructions.clear_actions", "");
+                break;
+            case (of13::OFPIT_METER):
+                fpt.put("instructions.meter.meter_id",
+                        ((of13::Meter*)instr)->meter_id());
+                break;
+            default:
+                LOG(ERROR) << "Unhandled instruction type: "
+                           << instr->type();
+                break;
+            }
+        }
+
+        return fpt;
+    }
+
+    // Position of a flow in a paged dump: table and cookie, then
+    // priority and the packed match to tell equal cookies apart
+    using flow_key = std::tuple<unsigned, uint64_t, unsigned, uint64_t>;
+
+    static flow_key key(of13::FlowStats& fs) {
+        // pack() pads the structure to 8 bytes
+        auto match = fs.match();
+        std::vector<uint8_t> buf((match.length() + 7) / 8 * 8);
+        match.pack(buf.data());
+        return flow_key(fs.table_id(), fs.cookie(), fs.priority(),
+                        boost::hash_range(buf.begin(), buf.end()));
+    }
+
+    static std::string cursor(const flow_key& k) {
+        return std::to_string(std::get<0>(k)) + ':' +
+               std::to_string(std::get<1>(k)) + ':' +
+               std::to_string(std::get<2>(k)) + ':' +
+               std::to_string(std::get<3>(k));
+    }
+
+    static flow_key parse_cursor(const std::string& cursor) {
+        flow_key k;
+        char sep[3] = {};
+        std::istringstream is(cursor);
+        is >> std::get<0>(k) >> sep[0] >> std::get<1>(k) >> sep[1]
+           >> std::get<2>(k) >> sep[2] >> std::get<3>(k);
+        THROW_IF(is.fail() || is.peek() != EOF ||
+                 sep[0] != ':' || sep[1] != ':' || sep[2] != ':',
+                 rest::http_error(400), "Bad cursor: {}", cursor);
+        return k;
+    }
+
+    void Stream(json_writer& out) const override {
+        Page(out, {});
+    }
+
+    // Unpaged dumps keep the switch order, pages are sorted by flow_key
+    // and only `limit` flows past the cursor are held at a time
+    void Page(json_writer& out, const rest::page& page) const override {
+        // segments are written out as they arrive, so the whole table
+        // is never held as fluid objects or a ptree;
+        // state outlives a timed out request
+        struct collector {
+            std::atomic_bool cancelled {false};
+            std::optional<json_writer::projection> fields;
+            json_writer flows;
+            size_t size = 0;
+            std::map<flow_key, rest::ptree> page;
+            bool more = false;
+        };
+        auto state = std::make_shared<collector>();
+        if (out.projected()) {
+            state->fields = *out.projected();
+            state->flows.project(&*state->fields);
+        }
+        state->flows.begin_array();
+
+        bool paged = not page.empty();
+        std::optional<flow_key> after;
+        if (not page.cursor.empty())
+            after = parse_cursor(page.cursor);
+        size_t limit = page.limit;
 
         auto agent = sw->connection()->agent();
         ofp::flow_stats_request req;
         try {
-            auto f = agent->request_flow_stats(req);
-            auto status = f.wait_for(boost::chrono::seconds(5));
-            THROW_IF(status == boost::future_status::timeout,
-                        rest::http_error(504), "Flow table reply timeout!" );
-
-            for (auto fs : f.get()) {
-                rest::ptree fpt;
-                fpt.put("table_id", fs.table_id());
-                fpt.put("duration_sec", fs.duration_sec());
-                fpt.put("priority", fs.priority());
-                fpt.put("idle_timeout", fs.idle_timeout());
-                fpt.put("hard_timeout", fs.hard_timeout());
-                fpt.put("cookie", fs.cookie());
-                fpt.put("packet_count", fs.packet_count());
-                fpt.put("byte_count", fs.byte_count());
-
-                parsingMatch(fs.match(), fpt);
-
-                auto instrcts = fs.instructions();
-                auto instr_set = instrcts.instruction_set();
-                for (auto it = instr_set.begin(); it != instr_set.end(); it++) {
-                    of13::Instruction* instr = *it;
-                    fluid_msg::ActionList lst;
-                    fluid_msg::ActionSet acts;
-                    std::list<fluid_msg::Action*> alist;
-                    std::set<fluid_msg::Action*, fluid_msg::comp_action_set_order> aset;
-                    rest::ptree output_collector, group_collector;
-                    rest::ptree woutput_collector, wgroup_collector;
-
-                    switch (instr->type()) {
-                    case (of13::OFPIT_GOTO_TABLE):
-                        fpt.put("instructions.goto_table.table_id",
-                                ((of13::GoToTable*)instr)->table_id());
-                        break;
-                    case (of13::OFPIT_WRITE_METADATA):
-                        fpt.put("instructions.write_metadata.metadata",
-                                ((of13::WriteMetadata*)instr)->metadata());
-                        fpt.put("instructions.write_metadata.metadata_mask",
-                                ((of13::WriteMetadata*)instr)->metadata_mask());
-                        break;
-                    case (of13::OFPIT_WRITE_ACTIONS):
-                        acts = ((of13::WriteActions*)instr)->actions();
-                        aset = acts.action_set();
-                        for (auto it = aset.begin(); it != aset.end(); it++) {
-                            rest::parsingAction(*it, "instructions.write_actions",
-                                         fpt, woutput_collector, wgroup_collector);
-                        }
-                        if (woutput_collector.size()) {
-                            fpt.add_child("instructions.write_actions.output",
-                                                                woutput_collector);
+            auto f = agent->stream_flow_stats(req,
+                [state, paged, after, limit]
+                (OFAgent::sequence<of13::FlowStats>&& segment) {
+                    if (state->cancelled)
+                        return false;
+                    // unrequested parts are not even parsed
+                    auto& fields = state->fields;
+                    bool match = not fields || fields->wants("match");
+                    bool instructions =
+                        not fields || fields->wants("instructions");
+                    for (auto& fs : segment) {
+                        if (not paged) {
+                            state->flows.value(
+                                parsingFlow(fs, match, instructions));
+                            ++state->size;
+                            continue;
                         }
-                        if (wgroup_collector.size()) {
-                            fpt.add_child("instructions.write_actions.group",
-                                                                 wgroup_collector);
-                        }
-                        break;
-                    case (of13::OFPIT_APPLY_ACTIONS):
-                        lst = ((of13::ApplyActions*)instr)->actions();
-                        alist = lst.action_list();
-                        for (auto it = alist.begin(); it != alist.end(); it++) {
-                            rest::parsingAction(*it, "instructions.apply_actions",
-                                           fpt, output_collector, group_collector);
-                        }
-                        if (output_collector.size()) {
-                            fpt.add_child("instructions.apply_actions.output",
-                                                                 output_collector);
-                        }
-                        if (group_collector.size()) {
-                            fpt.add_child("instructions.apply_actions.group",
-                                                                  group_collector);
+
+                        auto k = key(fs);
+                        if (after && k <= *after)
+                            continue;
+                        auto& held = state->page;
+                        if (limit && held.size() == limit) {
+                            state->more = true;
+                            if (k > held.rbegin()->first)
+                                continue;
+                            held.erase(std::prev(held.end()));
                         }
-                        break;
-                    case (of13::OFPIT_CLEAR_ACTIONS):
-                        fpt.put("instructions.clear_actions", "");
-                        break;
-                    case (of13::OFPIT_METER):
-                        fpt.put("instructions.meter.meter_id",
-                                ((of13::Meter*)instr)->meter_id());
-                        break;
-                    default:
-                        LOG(ERROR) << "Unhandled instruction type: "
-                                   << instr->type();
-                        break;
+                        held.emplace(k, parsingFlow(fs, match, instructions));
                     }
-                }
-
-                flows.push_back(std::make_pair("", std::move(fpt)));
+                    return true;
+                });
+            auto status = f.wait_for(boost::chrono::seconds(5));
+            if (status == boost::future_status::timeout) {
+                state->cancelled = true;
+                THROW(rest::http_error(504), "Flow table reply timeout!");
             }
+            f.get();
         } catch (const OFAgent::request_error& e) {
             LOG(ERROR) << "[FlowTableCollection] - " << e.what();
         }
-        ret.add_child("array", flows);
-        ret.put("_size", flows.size());
-        return ret;
+        for (auto& flow : state->page) {
+            state->flows.value(flow.second);
+            ++state->size;
+        }
+        state->flows.end_array();
+
+        out.begin_object()
+           .key("array").value(std::move(state->flows))
+           .put("_size", state->size);
+        if (state->more)
+            out.put("next", cursor(state->page.rbegin()->first));
+        out.end_object();
     }
 };
 
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "GroupMeterSync.hpp"
+
+#include <runos/core/future.hpp>
+
+#include <boost/thread/executors/inline_executor.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+
+namespace runos {
+
+static boost::inline_executor sync_executor;
+
+namespace {
+
+enum class op { add, modify, remove };
+
+template<class Entry>
+std::vector<uint8_t> packed(Entry& entry)
+{
+    std::vector<uint8_t> ret(entry.length());
+    entry.pack(ret.data());
+    return ret;
+}
+
+// Entries are the same if their wire encodings are
+template<class Mod, class Entry, class Id, class MakeMod>
+std::vector<Mod> diff_by_id(std::vector<Entry>& current,
+                            std::vector<Entry>& desired,
+                            GroupMeterSync::result& stats,
+                            Id id, MakeMod make)
+{
+    std::unordered_map<uint32_t, Entry*> existing;
+    for (auto& entry : current) {
+        existing.emplace(id(entry), &entry);
+    }
+
+    std::vector<Mod> ret;
+    for (auto& entry : desired) {
+        auto it = existing.find(id(entry));
+        if (it == existing.end()) {
+            ret.push_back(make(op::add, entry));
+            ++stats.added;
+            continue;
+        }
+        if (packed(*it->second) != packed(entry)) {
+            ret.push_back(make(op::modify, entry));
+            ++stats.modified;
+        }
+        existing.erase(it);
+    }
+
+    for (auto it = current.rbegin(); it != current.rend(); ++it) {
+        if (existing.count(id(*it))) {
+            ret.push_back(make(op::remove, *it));
+            ++stats.deleted;
+        }
+    }
+    return ret;
+}
+
+template<class Mod, class Entry>
+future<GroupMeterSync::result> sync(OFAgentPtr agent,
+                                    future<std::vector<Entry>> table,
+                                    std::vector<Entry> desired)
+{
+    auto done = std::make_shared<promise<GroupMeterSync::result>>();
+    auto ret = done->get_future();
+
+    table.then(sync_executor,
+        [agent, done, desired = std::move(desired)]
+        (future<std::vector<Entry>> f) mutable {
+            try {
+                auto current = f.get();
+                GroupMeterSync::result stats;
+                std::vector<Mod> mods = GroupMeterSync::diff(current, desired, stats);
+                if (mods.empty()) {
+                    done->set_value(stats);
+                    return;
+                }
+
+                std::vector<fluid_msg::OFMsg*> msgs;
+                for (auto& mod : mods) {
+                    msgs.push_back(&mod);
+                }
+                agent->mods(msgs).then(sync_executor,
+                    [done, stats](future<void> f) {
+                        try {
+                            f.get();
+                            done->set_value(stats);
+                        } catch (...) {
+                            done->set_exception(boost::current_exception());
+                        }
+                    });
+            } catch (...) {
+                done->set_exception(boost::current_exception());
+            }
+        });
+
+    return ret;
+}
+
+} // namespace
+
+std::vector<of13::GroupMod>
+GroupMeterSync::diff(std::vector<of13::GroupDesc>& current,
+                     std::vector<of13::GroupDesc>& desired, result& stats)
+{
+    return diff_by_id<of13::GroupMod>(current, desired, stats,
+        [](of13::GroupDesc& g) { return g.group_id(); },
+        [](op o, of13::GroupDesc& g) {
+            switch (o) {
+            case op::add:
+                return of13::GroupMod(0, of13::OFPGC_ADD, g.type(),
+                                      g.group_id(), g.buckets());
+            case op::modify:
+                return of13::GroupMod(0, of13::OFPGC_MODIFY, g.type(),
+                                      g.group_id(), g.buckets());
+            case op::remove:
+            default:
+                return of13::GroupMod(0, of13::OFPGC_DELETE, g.type(),
+                                      g.group_id());
+            }
+        });
+}
+
+std::vector<of13::MeterMod>
+GroupMeterSync::diff(std::vector<of13::MeterConfig>& current,
+                     std::vector<of13::MeterConfig>& desired, result& stats)
+{
+    return diff_by_id<of13::MeterMod>(current, desired, stats,
+        [](of13::MeterConfig& m) { return m.meter_id(); },
+        [](op o, of13::MeterConfig& m) {
+            switch (o) {
+            case op::add:
+                return of13::MeterMod(0, of13::OFPMC_ADD, m.flags(),
+                                      m.meter_id(), m.bands());
+            case op::modify:
+                return of13::MeterMod(0, of13::OFPMC_MODIFY, m.flags(),
+                                      m.meter_id(), m.bands());
+            case op::remove:
+            default:
+                return of13::MeterMod(0, of13::OFPMC_DELETE, 0, m.meter_id());
+            }
+        });
+}
+
+auto GroupMeterSync::groups(OFAgentPtr agent,
+                            std::vector<of13::GroupDesc> desired)
+    -> future<result>
+{
+    return sync<of13::GroupMod>(agent, agent->request_group_desc(),
+                                std::move(desired));
+}
+
+auto GroupMeterSync::meters(OFAgentPtr agent,
+                            std::vector<of13::MeterConfig> desired)
+    -> future<result>
+{
+    return sync<of13::MeterMod>(agent, agent->request_meter_config(),
+                                std::move(desired));
+}
+
+auto GroupMeterSync::meter(OFAgentPtr agent, of13::MeterConfig desired)
+    -> future<result>
+{
+    uint32_t id = desired.meter_id();
+    auto current = agent->request_meter_config().then(sync_executor,
+        [id](future<std::vector<of13::MeterConfig>> f) {
+            auto meters = f.get();
+            meters.erase(std::remove_if(meters.begin(), meters.end(),
+                [id](of13::MeterConfig& m) { return m.meter_id() != id; }),
+                meters.end());
+            return meters;
+        });
+    return sync<of13::MeterMod>(agent, std::move(current), {std::move(desired)});
+}
+
+} // namespace runos
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "api/OFAgent.hpp"
+#include <runos/core/future-decl.hpp>
+
+#include <fluid/of13msg.hh>
+
+#include <cstddef>
+#include <vector>
+
+namespace runos {
+
+namespace of13 = fluid_msg::of13;
+
+/**
+ * Brings group or meter table of a switch to the desired state.
+ *
+ * The table is read once, compared with the desired entries by id and
+ * only the difference is sent: adds and modifies first, then deletes,
+ * everything in one OFAgent::mods() batch closed by a single barrier.
+ * Future fails with OFAgent::bulk_error if the switch rejected some of
+ * the mods; the table is left partially synced then.
+ *
+ * Groups referring to other groups must be given after them.
+ */
+class GroupMeterSync {
+public:
+    struct result {
+        size_t added {0};
+        size_t modified {0};
+        size_t deleted {0};
+    };
+
+    static future<result> groups(OFAgentPtr agent,
+                                 std::vector<of13::GroupDesc> desired);
+    static future<result> meters(OFAgentPtr agent,
+                                 std::vector<of13::MeterConfig> desired);
+    // Adds or modifies the one meter, leaving the others alone
+    static future<result> meter(OFAgentPtr agent, of13::MeterConfig desired);
+
+    // The mods turning `current` into `desired`
+    static std::vector<of13::GroupMod>
+    diff(std::vector<of13::GroupDesc>& current,
+         std::vector<of13::GroupDesc>& desired, result& stats);
+    static std::vector<of13::MeterMod>
+    diff(std::vector<of13::MeterConfig>& current,
+         std::vector<of13::MeterConfig>& desired, result& stats);
+};
+
+} // namespace runos
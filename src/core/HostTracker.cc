@@ -0,0 +1,282 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "HostTracker.hpp"
+
+#include "Controller.hpp"
+#include "ILinkDiscovery.hpp"
+#include "OFServer.hpp"
+#include "Recovery.hpp"
+#include "SwitchManager.hpp"
+#include "api/PacketInView.hpp"
+#include "api/PacketOutBuilder.hpp"
+#include "lib/ethaddr.hpp"
+#include "lib/ipv4addr.hpp"
+#include "lib/metrics.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <fluid/of13msg.hh>
+#include <boost/endian/arithmetic.hpp>
+#include <boost/endian/conversion.hpp>
+
+#include <algorithm>
+#include <vector>
+
+namespace runos {
+
+REGISTER_APPLICATION(HostTracker, {"controller", "of-server", "switch-manager",
+                                   "switch-ordering", "recovery-manager",
+                                   "link-discovery", ""})
+
+namespace of13 = fluid_msg::of13;
+using namespace boost::endian;
+
+namespace {
+
+constexpr uint16_t arp_eth_type = 0x0806;
+constexpr uint16_t ipv4_eth_type = 0x0800;
+
+struct eth_hdr {
+    big_uint48_t dst;
+    big_uint48_t src;
+};
+
+// Follows the ethernet header and the VLAN tag, if any
+struct arp_body {
+    big_uint16_t htype;
+    big_uint16_t ptype;
+    big_uint8_t hlen;
+    big_uint8_t plen;
+    big_uint16_t oper;
+    big_uint48_t sha;
+    big_uint32_t spa;
+    big_uint48_t tha;
+    big_uint32_t tpa;
+};
+
+struct ipv4_hdr {
+    big_uint8_t version_ihl;
+    big_uint8_t tos;
+    big_uint16_t total_len;
+    big_uint16_t id;
+    big_uint16_t frag;
+    big_uint8_t ttl;
+    big_uint8_t proto;
+    big_uint16_t checksum;
+    big_uint32_t src;
+    big_uint32_t dst;
+};
+
+static_assert(sizeof(eth_hdr) == 12, "packed ethernet addresses");
+static_assert(sizeof(arp_body) == 28, "packed ARP");
+static_assert(sizeof(ipv4_hdr) == 20, "packed IPv4");
+
+bool unicast(uint64_t mac)
+{
+    return mac != 0 && not (mac >> 40 & 1);
+}
+
+size_t l3_offset(const PacketInView& pi)
+{
+    return pi.vlan_tagged() ? 18 : 14;
+}
+
+metrics::Counter& arp_replies = metrics::Registry::global().counter(
+    "runos_host_tracker_arp_replies_total",
+    "ARP requests answered by the controller on behalf of hosts");
+metrics::Counter& host_moves = metrics::Registry::global().counter(
+    "runos_host_tracker_moves_total",
+    "Hosts learned for the first time or on another port");
+
+} // namespace
+
+void HostTracker::init(Loader* loader, const Config& rootConfig)
+{
+    link_discovery_ = dynamic_cast<ILinkDiscovery*>(ILinkDiscovery::get(loader));
+    recovery_ = RecoveryManager::get(loader);
+
+    const Config& config = config_cd(rootConfig, "host-tracker");
+    arp_proxy_ = config_get(config, "arp-proxy", true);
+    learn_ipv4_ = config_get(config, "learn-ipv4", true);
+    timeout_ = std::chrono::seconds(config_get(config, "host-timeout-sec", 300));
+    CHECK(timeout_.count() >= 0) << "host-timeout-sec must not be negative";
+
+    // tagged ethernet and ARP or IPv4 headers
+    Controller::get(loader)->require_packet_in_bytes(
+        18 + std::max(sizeof(arp_body), sizeof(ipv4_hdr)));
+
+    auto of_server = OFServer::get(loader);
+    of_server->register_packet_in_filter(arp_eth_type,
+        [this](OFConnectionPtr conn, const PacketInView& pi) {
+            return onArp(conn, pi);
+        });
+    if (learn_ipv4_) {
+        of_server->register_packet_in_filter(ipv4_eth_type,
+            [this](OFConnectionPtr conn, const PacketInView& pi) {
+                onIpv4(conn, pi);
+                return false;
+            });
+    }
+
+    connect(SwitchManager::get(loader), &SwitchManager::portDeleted, this,
+            [this](PortPtr port) {
+                hosts_.forget(switch_and_port{port->switch_()->dpid(),
+                                              port->number()});
+            });
+
+    // hosts seen on a port before the link behind it was discovered
+    // were learned from flooded packets
+    QObject* ld = ILinkDiscovery::get(loader);
+    connect(ld, SIGNAL(linkDiscovered(switch_and_port, switch_and_port)),
+            this, SLOT(linkDiscovered(switch_and_port, switch_and_port)));
+
+    if (timeout_.count() > 0) {
+        auto period = std::max(timeout_ / 4, std::chrono::seconds(1));
+        timer_ = TimerService::global().add(
+            "host-tracker",
+            std::chrono::duration_cast<std::chrono::milliseconds>(period),
+            [this]() {
+                size_t n = hosts_.expire(host_table::clock::now() - timeout_);
+                if (n > 0) {
+                    VLOG(5) << "[HostTracker] Expired " << n << " hosts";
+                }
+            },
+            TimerService::priority::low);
+    }
+
+    SwitchOrderingManager::get(loader)->registerHandler(this, 40);
+}
+
+void HostTracker::startUp(Loader*)
+{
+    if (timer_) {
+        TimerService::global().start(timer_);
+    }
+}
+
+HostTracker::~HostTracker()
+{
+    if (timer_) {
+        TimerService::global().remove(timer_);
+    }
+}
+
+void HostTracker::switchDown(SwitchPtr sw)
+{
+    hosts_.forget(sw->dpid());
+}
+
+void HostTracker::linkDown(PortPtr port)
+{
+    hosts_.forget(switch_and_port{port->switch_()->dpid(), port->number()});
+}
+
+void HostTracker::linkDiscovered(switch_and_port from, switch_and_port to)
+{
+    hosts_.forget(from);
+    hosts_.forget(to);
+}
+
+bool HostTracker::edge(uint64_t dpid, uint32_t port) const
+{
+    return port <= of13::OFPP_MAX &&
+           link_discovery_->other(switch_and_port{dpid, port}).dpid == 0;
+}
+
+void HostTracker::learn(uint64_t mac, uint32_t ipv4, switch_and_port where)
+{
+    if (hosts_.learn(mac, ipv4, where)) {
+        host_moves.add(1);
+        VLOG(10) << "[HostTracker] " << ethaddr(mac) << " is at "
+                 << where.dpid << ":" << where.port;
+    }
+}
+
+bool HostTracker::onArp(const OFConnectionPtr& conn, const PacketInView& pi)
+{
+    size_t l3 = l3_offset(pi);
+    if (pi.data_len() < l3 + sizeof(arp_body))
+        return false;
+    uint64_t dpid = conn->dpid();
+    if (not recovery_->isMaster(dpid) || not edge(dpid, pi.in_port()))
+        return false;
+
+    auto arp = reinterpret_cast<const arp_body*>(pi.data() + l3);
+    if (arp->htype != 1 || arp->ptype != ipv4_eth_type ||
+            arp->hlen != 6 || arp->plen != 4)
+        return false;
+
+    uint64_t sha = arp->sha;
+    uint32_t spa = arp->spa;
+    uint32_t tpa = arp->tpa;
+    if (not unicast(sha))
+        return false;
+    // spa of 0 is an address probe, its sender has no address yet
+    learn(sha, spa, switch_and_port{dpid, pi.in_port()});
+
+    if (not arp_proxy_ || arp->oper != 1 || tpa == 0 || tpa == spa)
+        return false;
+    auto target = hosts_.by_ipv4(tpa);
+    if (not target || target->mac == sha)
+        return false;
+    if (target->location == switch_and_port{dpid, pi.in_port()})
+        return false; // the target hears the request itself
+
+    // The reply keeps the ethernet header of the request, VLAN tag
+    // included, with addresses swapped
+    std::vector<uint8_t> reply(pi.data(), pi.data() + l3 + sizeof(arp_body));
+    auto eth = reinterpret_cast<eth_hdr*>(reply.data());
+    eth->dst = sha;
+    eth->src = target->mac;
+    auto rarp = reinterpret_cast<arp_body*>(reply.data() + l3);
+    rarp->oper = 2;
+    rarp->sha = target->mac;
+    rarp->spa = tpa;
+    rarp->tha = sha;
+    rarp->tpa = spa;
+
+    PacketOutBuilder po;
+    po.data(reply.data(), reply.size());
+    po.in_port(of13::OFPP_CONTROLLER);
+    po.output(pi.in_port());
+    conn->send(po);
+    arp_replies.add(1);
+
+    VLOG(10) << "[HostTracker] Answered who-has " << ipv4addr(native_to_big(tpa))
+             << " from " << ethaddr(sha) << " on " << dpid << ":" << pi.in_port();
+    return true;
+}
+
+void HostTracker::onIpv4(const OFConnectionPtr& conn, const PacketInView& pi)
+{
+    size_t l3 = l3_offset(pi);
+    if (pi.data_len() < l3 + sizeof(ipv4_hdr))
+        return;
+    uint64_t dpid = conn->dpid();
+    if (not recovery_->isMaster(dpid) || not edge(dpid, pi.in_port()))
+        return;
+
+    auto eth = reinterpret_cast<const eth_hdr*>(pi.data());
+    auto ip = reinterpret_cast<const ipv4_hdr*>(pi.data() + l3);
+    uint64_t mac = eth->src;
+    if (not unicast(mac))
+        return;
+    learn(mac, ip->src, switch_and_port{dpid, pi.in_port()});
+}
+
+} // namespace runos
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "ILinkDiscovery.hpp"
+#include "SwitchOrdering.hpp"
+#include "api/OFConnection.hpp"
+#include "lib/host_table.hpp"
+#include "lib/timer_service.hpp"
+
+#include <chrono>
+#include <cstdint>
+
+namespace runos {
+
+class PacketInView;
+class RecoveryManager;
+
+/**
+ * Where hosts are attached, learned from ARP and IPv4 PacketIns.
+ *
+ * Only packets coming in on edge ports (no discovered link behind them)
+ * are learned. The packets are looked at by raw PacketIn filters, on
+ * the receiving threads, before they are unpacked; the table is sharded
+ * so the threads don't serialize on it. Hosts are forgotten when their
+ * port goes down or is deleted, when a link is discovered on it, when
+ * the switch leaves and after host-timeout-sec of silence.
+ *
+ * With arp-proxy the tracker answers ARP requests for known addresses
+ * itself with a PacketOut to the ingress port, and the request is not
+ * flooded any further.
+ */
+class HostTracker final : public Application
+                        , public SwitchEventHandler
+{
+    Q_OBJECT
+    SIMPLE_APPLICATION(HostTracker, "host-tracker")
+
+public:
+    void init(Loader* loader, const Config& config) override;
+    void startUp(Loader* loader) override;
+    ~HostTracker();
+
+    const host_table& hosts() const { return hosts_; }
+
+protected:
+    void switchDown(SwitchPtr sw) override;
+    void linkDown(PortPtr port) override;
+
+private slots:
+    void linkDiscovered(switch_and_port from, switch_and_port to);
+
+private:
+    host_table hosts_;
+    ILinkDiscovery* link_discovery_ {nullptr};
+    RecoveryManager* recovery_ {nullptr};
+    bool arp_proxy_ {true};
+    bool learn_ipv4_ {true};
+    std::chrono::seconds timeout_ {300}; // 0 disables expiry
+    TimerService::handle timer_;
+
+    bool edge(uint64_t dpid, uint32_t port) const;
+    void learn(uint64_t mac, uint32_t ipv4, switch_and_port where);
+    bool onArp(const OFConnectionPtr& conn, const PacketInView& pi);
+    void onIpv4(const OFConnectionPtr& conn, const PacketInView& pi);
+};
+
+} // namespace runos
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "HostTracker.hpp"
+#include "RestListener.hpp"
+#include "lib/ethaddr.hpp"
+#include "lib/ipv4addr.hpp"
+
+#include <boost/endian/conversion.hpp>
+#include <boost/lexical_cast.hpp>
+
+namespace runos {
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+
+struct HostsResource : rest::resource
+{
+    HostTracker* app;
+
+    explicit HostsResource(HostTracker* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override
+    {
+        rest::ptree root;
+        auto now = host_table::clock::now();
+        auto hosts = app->hosts().hosts();
+
+        rest::ptree array;
+        for (const auto& h : hosts) {
+            rest::ptree hpt;
+            hpt.put("mac", boost::lexical_cast<std::string>(ethaddr(h.mac)));
+            if (h.ipv4 != 0) {
+                hpt.put("ipv4", boost::lexical_cast<std::string>(
+                    ipv4addr(boost::endian::native_to_big(h.ipv4))));
+            }
+            hpt.put("dpid", h.location.dpid);
+            hpt.put("port", h.location.port);
+            hpt.put("age_ms", duration_cast<milliseconds>(now - h.seen).count());
+            array.push_back(std::make_pair("", std::move(hpt)));
+        }
+        root.add_child("array", array);
+        root.put("_size", hosts.size());
+        return root;
+    }
+};
+
+class HostTrackerRest : public Application
+{
+    SIMPLE_APPLICATION(HostTrackerRest, "host-tracker-rest")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto rest_ = RestListener::get(loader);
+        auto app = HostTracker::get(loader);
+
+        rest_->mount(path_spec("/hosts/"), [=](const path_match&)
+        {
+            return HostsResource { app };
+        });
+    }
+};
+
+REGISTER_APPLICATION(HostTrackerRest, {"rest-listener", "host-tracker", ""})
+
+} // namespace runos
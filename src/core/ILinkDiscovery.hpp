@@ -74,6 +74,8 @@ signals:
 
     // return by value because we don't want to use mutex (faster for REST calls?)
     virtual const std::set<DiscoveredLink> links() const = 0;
+    // Changes whenever the set of links does, 0 if not tracked
+    virtual uint64_t linksGeneration() const { return 0; }
     virtual switch_and_port other(switch_and_port) const = 0;
 };
 
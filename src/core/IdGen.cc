@@ -18,60 +18,135 @@
 
 #include <runos/core/throw.hpp>
 
+#include <algorithm>
+
 namespace runos {
 
+static constexpr uint64_t word_bits = 64;
+
+uint64_t IdGen::level::full_word(uint64_t index) const {
+    uint64_t valid = bits - index * word_bits;
+    return valid >= word_bits ? ~uint64_t(0) : (uint64_t(1) << valid) - 1;
+}
+
+uint64_t IdGen::level::word(uint64_t index) const {
+    auto it = pages.find(index / page_words);
+    if (it == pages.end())
+        return full_word(index);
+    return it->second[index % page_words];
+}
+
+uint64_t& IdGen::level::word_ref(uint64_t index) {
+    auto& page = pages[index / page_words];
+    if (not page) {
+        page.reset(new uint64_t[page_words]);
+        uint64_t base = index - index % page_words;
+        uint64_t words = (bits + word_bits - 1) / word_bits;
+        for (uint64_t i = 0; i < page_words; ++i)
+            page[i] = base + i < words ? full_word(base + i) : 0;
+    }
+    return page[index % page_words];
+}
+
+template<class F>
+void IdGen::level::for_each_page(F&& f) const {
+    std::vector<uint64_t> keys;
+    keys.reserve(pages.size());
+    for (auto& page : pages)
+        keys.push_back(page.first);
+    std::sort(keys.begin(), keys.end());
+    for (auto key : keys)
+        f(key * page_words, pages.at(key).get());
+}
+
 IdGen::IdGen(uint64_t first, uint64_t capacity, acquire_order order) :
-    first(first), capacity(capacity), order(order), pool{{first, first + capacity}} {
+    first(first), capacity(capacity), order(order), unused_(capacity) {
     THROW_IF(!capacity || first + capacity < first, invalid_argument(), "invalid id range");
+
+    uint64_t bits = capacity;
+    levels.emplace_back(bits);
+    while (bits > word_bits) {
+        bits = (bits + word_bits - 1) / word_bits;
+        levels.emplace_back(bits);
+    }
+}
+
+// Lowest (forward) or highest (backward) free offset, pool must not be empty
+uint64_t IdGen::find_free() const {
+    uint64_t index = 0;
+    for (auto it = levels.rbegin(); it != levels.rend(); ++it) {
+        uint64_t word = it->word(index);
+        unsigned bit = order == acquire_order::forward
+                     ? __builtin_ctzll(word)
+                     : word_bits - 1 - __builtin_clzll(word);
+        index = index * word_bits + bit;
+    }
+    return index;
+}
+
+bool IdGen::is_free(uint64_t offset) const {
+    return (levels.front().word(offset / word_bits) >> (offset % word_bits)) & 1;
+}
+
+void IdGen::take(uint64_t offset) {
+    for (auto& l : levels) {
+        uint64_t& word = l.word_ref(offset / word_bits);
+        word &= ~(uint64_t(1) << (offset % word_bits));
+        if (word != 0) break;
+        offset /= word_bits;
+    }
+    --unused_;
+}
+
+void IdGen::put(uint64_t offset) {
+    for (auto& l : levels) {
+        uint64_t& word = l.word_ref(offset / word_bits);
+        bool was_empty = word == 0;
+        word |= uint64_t(1) << (offset % word_bits);
+        if (not was_empty) break;
+        offset /= word_bits;
+    }
+    ++unused_;
+}
+
+void IdGen::reset() {
+    for (auto& l : levels)
+        l.clear();
+    unused_ = capacity;
 }
 
 uint64_t IdGen::acquire() {
     std::lock_guard<std::mutex> lock(mut);
-    THROW_IF(pool.empty(), PoolIsEmpty(), "no unused ids left");
-
-    uint64_t id = 0;
-    if (order == acquire_order::backward) {
-        // get the element from the back
-        auto &back = pool.back();
-        id = --back.last;
-        if (back.first == back.last)
-            pool.pop_back();
-    } else if (order == acquire_order::forward) {
-        auto &front = pool.front();
-        id = front.first++;
-        if (front.first == front.last)
-            pool.erase(pool.begin());
+    THROW_IF(unused_ == 0, PoolIsEmpty(), "no unused ids left");
+
+    uint64_t offset = find_free();
+    take(offset);
+    return first + offset;
+}
+
+std::vector<uint64_t> IdGen::acquire_n(uint64_t n) {
+    std::lock_guard<std::mutex> lock(mut);
+    THROW_IF(unused_ < n, PoolIsEmpty(), "only {} unused ids left", unused_.load());
+
+    std::vector<uint64_t> ret;
+    ret.reserve(n);
+    while (n--) {
+        uint64_t offset = find_free();
+        take(offset);
+        ret.push_back(first + offset);
     }
-    return id;
+    return ret;
 }
 
 void IdGen::recovery(const std::vector<uint64_t> &booked_ids) {
     THROW_IF(booked_ids.size() > capacity, Error(),
              "generator's size smaller rerovering id's number");
     std::lock_guard<std::mutex> lock(mut);
-    pool = {{first, first + capacity}};
+    reset();
     for (auto id: booked_ids) {
         THROW_IF(id < first || id >= first + capacity, invalid_argument(), "id is out of range");
-        // find the upper-bound segment
-        auto iter = pool.begin(), iter_end = pool.end();
-        for (; iter != iter_end; ++iter) {
-            if (iter->first <= id && iter->last > id) break;
-        }
-        THROW_IF(iter == iter_end, Error(), "id is already used");
-    
-        if (iter->first + 1 == iter->last) {
-            pool.erase(iter);
-            continue;
-        }
-
-        uint64_t segment_border = iter->last;
-        iter->last = id;
-        if (id + 1 != segment_border) {
-            if (iter + 1 == iter_end)
-                pool.push_back(segment(id + 1, segment_border));
-            else
-                pool.insert( iter + 1, segment( id + 1, segment_border));
-        }
+        THROW_IF(not is_free(id - first), Error(), "id is already used");
+        take(id - first);
     }
 }
 
@@ -79,44 +154,12 @@ void IdGen::release(uint64_t id) {
     THROW_IF(id < first || id >= first + capacity, invalid_argument(), "id is out of range");
 
     std::lock_guard<std::mutex> lock(mut);
-    if (pool.empty()) {
-        pool.emplace_back(id, id + 1);
-        return;
-    }
-
-    // find the upper-bound segment
-    auto iter = pool.begin(), iter_end = pool.end();
-    for(; iter != iter_end; ++iter) if (iter->first > id) break;
-    if (iter != pool.begin() && std::prev(iter)->last > id) {
-        THROW(DoubleRelease(), "id is already in pool");
-    }
-
-    uint64_t prev_last(-1), next_first(0);
-    if (iter != pool.begin()) prev_last = std::prev(iter)->last;
-    if (iter != iter_end) next_first = iter->first;
-
-    if (prev_last == next_first - 1) {
-        // id joins two neighbor segments into a signle one
-        std::prev(iter)->last = iter->last;
-        pool.erase(iter);
-    } else if (prev_last == id) {
-        // id adjoins to previos segment
-        ++std::prev(iter)->last;
-    } else if (id == next_first - 1) {
-        // id adjoins to next segment
-        --iter->first;
-    } else {
-        // id is isolated
-        pool.emplace(iter, id, id + 1);
-    }
+    THROW_IF(is_free(id - first), DoubleRelease(), "id is already in pool");
+    put(id - first);
 }
 
 uint64_t IdGen::unused() const {
-    std::lock_guard<std::mutex> lock(mut);
-    uint64_t unused = 0;
-    for(auto &item : pool)
-      unused += (item.last - item.first);
-    return unused;
+    return unused_;
 }
 
 json IdGen::to_json() const {
@@ -126,9 +169,26 @@ json IdGen::to_json() const {
         { "pool", json::array() }
     };
 
-    for (const auto& s : pool) {
-        ret["pool"].push_back({ s.first, s.last });
-    }
+    // Free segments are the gaps between used ids, which can only
+    // live in allocated leaf pages
+    std::lock_guard<std::mutex> lock(mut);
+    auto& leaves = levels.front();
+    uint64_t begin = first;
+    leaves.for_each_page([&](uint64_t base, const uint64_t* page) {
+        for (uint64_t i = 0; i < level::page_words; ++i) {
+            uint64_t used = ~page[i];
+            while (used) {
+                uint64_t offset = (base + i) * word_bits + __builtin_ctzll(used);
+                used &= used - 1;
+                if (offset >= capacity) break;
+                if (begin != first + offset)
+                    ret["pool"].push_back({ begin, first + offset });
+                begin = first + offset + 1;
+            }
+        }
+    });
+    if (begin != first + capacity)
+        ret["pool"].push_back({ begin, first + capacity });
 
     return ret;
 }
@@ -139,10 +199,21 @@ void IdGen::from_json(const json& obj) {
     THROW_IF(first != j_first || capacity != j_capacity,
             invalid_argument(), "incorrect values in json");
 
-    pool.clear();
+    std::lock_guard<std::mutex> lock(mut);
+    reset();
+    uint64_t used_from = first;
+    auto take_until = [&](uint64_t id) {
+        for (; used_from < id; ++used_from)
+            take(used_from - first);
+    };
     for (const json& s : obj["pool"]) {
-        pool.emplace_back(s.at(0), s.at(1));
+        uint64_t s_first = s.at(0), s_last = s.at(1);
+        THROW_IF(s_first < used_from || s_last < s_first || s_last > first + capacity,
+                 invalid_argument(), "incorrect pool segment");
+        take_until(s_first);
+        used_from = s_last;
     }
+    take_until(first + capacity);
 }
 
 } // runos
@@ -23,6 +23,9 @@
 #include "Recovery.hpp"
 #include "SwitchManager.hpp"
 #include "DatabaseConnector.hpp"
+#include "OFServer.hpp"
+#include "StateSnapshot.hpp"
+#include "lib/event_trace.hpp"
 #include "lib/poller.hpp"
 #include <runos/core/logging.hpp>
 
@@ -30,15 +33,26 @@
 
 #include <algorithm>
 #include <chrono>
+#include <unordered_set>
 
 namespace runos {
 
 //using namespace boost::endian;
 namespace of13 = fluid_msg::of13;
 
-REGISTER_APPLICATION(LinkDiscovery, {"controller", "recovery-manager",
+// Link record of the state snapshot, read in place
+struct snapshot_link {
+    uint64_t source_dpid;
+    uint64_t target_dpid;
+    uint32_t source_port;
+    uint32_t target_port;
+};
+
+REGISTER_APPLICATION(LinkDiscovery, {"controller", "of-server",
+                                     "recovery-manager",
                                      "switch-manager", "switch-ordering",
-                                     "database-connector", ""})
+                                     "database-connector", "state-snapshot",
+                                     ""})
 
 void LinkDiscovery::init(Loader *loader, const Config &rootConfig)
 {
@@ -47,13 +61,39 @@ void LinkDiscovery::init(Loader *loader, const Config &rootConfig)
     /* Read configuration */
     auto config = config_cd(rootConfig, "link-discovery");
     c_poll_interval = config_get(config, "poll-interval", 5);
+    int stable_interval = config_get(config, "stable-poll-interval",
+                                     int(c_poll_interval) * 3);
+    c_stable_ratio = std::max(1, stable_interval / int(c_poll_interval));
+    c_watched_stretch = std::max(1, config_get(config, "watched-stretch", 4));
+    c_fast_probes = config_get(config, "fast-probes", 3);
+    c_probe_tick_ms = std::max(1, config_get(config, "probe-tick-ms", 100));
+    c_group_probes = config_get(config, "group-probes", false);
+    c_probe_group_id = config_get(config, "probe-group-id", 0x7f000000);
     queue_id = config_get(config, "queue", -1);
 
     /* Get dependencies */
     recovery = RecoveryManager::get(loader);
     m_switch_manager = SwitchManager::get(loader);
     db_connector_ = DatabaseConnector::get(loader);
-    poller = new Poller(this, c_poll_interval * 1000);
+    db_connector_->declarePrefixes({ "link-discovery" });
+    snapshot_ = StateSnapshot::get(loader);
+    snapshot_->provide("link-discovery", [this](SnapshotWriter& writer) {
+        std::lock_guard<std::mutex> lock(links_mutex);
+        for (const auto& l : m_links) {
+            writer.add(0, snapshot_link{l.source.dpid, l.target.dpid,
+                                        l.source.port, l.target.port});
+        }
+    });
+    probe_wheel = time_wheel<switch_and_port>(
+        c_poll_interval * 1000 / c_probe_tick_ms);
+    poller = new Poller(this, c_probe_tick_ms);
+    // Link timeouts follow the interval, so it is never stretched
+    poll_tuning = PollTuning::global().add(
+        "link-discovery.poll-interval",
+        std::chrono::seconds(c_poll_interval.load()),
+        [this](std::chrono::milliseconds interval) {
+            set_poll_interval(interval);
+        }, true);
 
     /* Do logging and save to DB */
     connect(this, &LinkDiscovery::linkDiscovered,
@@ -73,18 +113,18 @@ void LinkDiscovery::init(Loader *loader, const Config &rootConfig)
     connect(recovery, &RecoveryManager::signalRecovery,
             this, &LinkDiscovery::load_from_database);
 
-    handler = Controller::get(loader)->register_handler(
-        [this](of13::PacketIn& pi, OFConnectionPtr connection) {
-            if (not recovery->isPrimary()) return false;
+    Controller::get(loader)->require_packet_in_bytes(
+        std::max(sizeof(tagged_lldp_packet), sizeof(lldp_packet)));
+
+    // LLDP is picked up before the PacketIn is unpacked and never
+    // reaches the Controller handler chain
+    OFServer::get(loader)->register_packet_in_filter(LLDP_ETH_TYPE,
+        [this](OFConnectionPtr connection, const PacketInView& pi) {
+            if (not recovery->isMaster(connection->dpid())) return false;
 
             if (pi.cookie() == ~((uint64_t)0)) {
                 VLOG(15) << "LinkDiscovery: Receive PacketIn with cookie = -1";
-                if (sizeof(lldp_packet) > pi.data_len()) {
-                    return false;
-                }
-                // Look into packet to check if it is LLDP
-                auto lldp(static_cast<lldp_packet*>(pi.data()));
-                if (lldp->eth_type != 0x88cc) {
+                if (pi.vlan_tagged()) {
                     VLOG(15) << "LinkDiscovery: PacketIn is not lldp packet";
                     return false;
                 }
@@ -96,37 +136,49 @@ void LinkDiscovery::init(Loader *loader, const Config &rootConfig)
             VLOG(15) << "LLDP packet received on " << connection->dpid();
 
             switch_and_port source;
-            auto lldp(static_cast<lldp_packet*>(pi.data()));
-            if (lldp->eth_type == 0x8100) { // tagged lldp
-                auto tagged_lldp(static_cast<tagged_lldp_packet*>(pi.data()));
+            if (pi.vlan_tagged()) {
+                auto tagged_lldp(
+                    reinterpret_cast<const tagged_lldp_packet*>(pi.data()));
                 if (sizeof(tagged_lldp_packet) > pi.data_len()
                         or tagged_lldp->dpid_oui != 0x0026e1) {
                     VLOG(15) << "[LinkDiscovery] LLDP error - "
                              <<"Recieved incorrect LLDP on "
                              << connection->dpid()
-                             << ":" << pi.match().in_port()->value();
+                             << ":" << pi.in_port();
                     return false;
                 }
 
                 source.dpid = tagged_lldp->dpid_data;
                 source.port = tagged_lldp->port_id_sub_component;
+                if (source.port == lldp_group_port) {
+                    source = group_source(source.dpid, tagged_lldp->src_mac);
+                }
             }
             else { // untagged lldp
+                auto lldp(reinterpret_cast<const lldp_packet*>(pi.data()));
                 if (sizeof(lldp_packet) > pi.data_len()
                         or lldp->dpid_oui != 0x0026e1) {
                     VLOG(15) << "[LinkDiscovery] LLDP error - "
                              <<"Recieved incorrect LLDP on "
                              << connection->dpid()
-                             << ":" << pi.match().in_port()->value();
+                             << ":" << pi.in_port();
                     return false;
                 }
 
                 source.dpid = lldp->dpid_data;
                 source.port = lldp->port_id_sub_component;
+                if (source.port == lldp_group_port) {
+                    source = group_source(source.dpid, lldp->src_mac);
+                }
+            }
+
+            if (source.port == lldp_group_port) {
+                VLOG(15) << "[LinkDiscovery] LLDP from an unknown bucket of "
+                         << source.dpid << " probe group";
+                return true;
             }
 
-            switch_and_port target { connection->dpid(),
-                                     pi.match().in_port()->value() };
+            switch_and_port target { connection->dpid(), pi.in_port() };
 
             VLOG(15) << "LLDP packet received on " << target;
 
@@ -134,9 +186,30 @@ void LinkDiscovery::init(Loader *loader, const Config &rootConfig)
             handleBeacon(source, target);
 
             return true;
-        }, -10);
+        });
 
     SwitchOrderingManager::get(loader)->registerHandler(this, 50);
+
+    // Ports of links are in the fast stats polling tier
+    connect(this, &LinkDiscovery::linkDiscovered,
+            [this](switch_and_port from, switch_and_port to) {
+                mark_core(from);
+                mark_core(to);
+            });
+    connect(this, &LinkDiscovery::linkBroken,
+            [this](switch_and_port from, switch_and_port to) {
+                mark_core(from);
+                mark_core(to);
+            });
+}
+
+void LinkDiscovery::mark_core(switch_and_port sp)
+{
+    auto sw = m_switch_manager->switch_(sp.dpid);
+    if (sw == nullptr)
+        return;
+    if (auto port = sw->port(sp.port))
+        port->set_core(other(sp).dpid != 0);
 }
 
 void LinkDiscovery::startUp(Loader *)
@@ -162,10 +235,6 @@ switch_and_port LinkDiscovery::other(switch_and_port sp) const
     else
         target = edge_it->source;
 
-    DiscoveredLink link(*edge_it);
-    auto link_it = find_link(m_links, link);
-    CHECK(link_it != m_links.end());
-
     return target;
 }
 
@@ -179,8 +248,7 @@ void LinkDiscovery::handleBeacon(switch_and_port from, switch_and_port to)
     }
 
     DiscoveredLink link{ from, to,
-                         std::chrono::steady_clock::now() +
-                         std::chrono::seconds(c_poll_interval * 2) };
+                         std::chrono::steady_clock::now() + link_ttl(from) };
     DiscoveredLink reversed{ to, from, link.valid_through };
     bool emit_on_add { false };
     std::vector<std::optional<link_pair>> emit_on_remove;
@@ -219,6 +287,39 @@ void LinkDiscovery::handleBeacon(switch_and_port from, switch_and_port to)
     }
 }
 
+void LinkDiscovery::injectLink(switch_and_port from, switch_and_port to)
+{
+    DiscoveredLink link{ from, to, DiscoveredLink::valid_through_t::max() };
+    bool emit_on_add;
+
+    { // lock
+    std::lock_guard<std::mutex> lock(links_mutex);
+    emit_on_add = add_link(link);
+    } // unlock
+
+    if (emit_on_add) {
+        emit linkDiscovered(link.source, link.target);
+    }
+}
+
+void LinkDiscovery::withdrawLink(switch_and_port from, switch_and_port to)
+{
+    std::optional<link_pair> to_remove;
+
+    { // lock
+    std::lock_guard<std::mutex> lock(links_mutex);
+    auto out_edge = m_out_edges.find(from);
+    if (out_edge != m_out_edges.end() &&
+            (out_edge->second->source == to || out_edge->second->target == to)) {
+        to_remove = remove_broken_link(from);
+    }
+    } // unlock
+
+    if (to_remove) {
+        emit linkBroken(to_remove->first, to_remove->second);
+    }
+}
+
 void LinkDiscovery::clearLinkAt(PortPtr port)
 {
     switch_and_port source{port->switch_()->dpid(), port->number()};
@@ -237,9 +338,14 @@ void LinkDiscovery::clearLinkAt(PortPtr port)
 
 void LinkDiscovery::polling()
 {
-    // Backup controller
-    if (not recovery->isPrimary()) {
-        load_from_database();
+    bool new_cycle = probe_wheel.cursor() == 0;
+
+    // Backup controller, sharded nodes probe their own switches
+    if (not recovery->isPrimary() && not recovery->isSharded()) {
+        probe_wheel.advance();
+        if (new_cycle) {
+            load_from_database();
+        }
         return;
     }
 
@@ -251,7 +357,7 @@ void LinkDiscovery::polling()
     {//lock
         std::lock_guard<std::mutex> lock(links_mutex);
 
-        // Remove all expired links
+        // Remove all expired links, they are ordered by deadline
         while (!m_links.empty() && m_links.begin()->valid_through < now) {
             auto top = m_links.begin();
             links_to_delete.push_back(std::make_pair(top->source, top->target));
@@ -260,6 +366,8 @@ void LinkDiscovery::polling()
             CHECK(top != m_links.end());
             m_links.erase(top);
         }
+        if (not links_to_delete.empty())
+            m_links_generation.bump();
 
         // Remove expired links from waiting list
         while (!m_waiting_links.empty() &&
@@ -272,20 +380,191 @@ void LinkDiscovery::polling()
 
     // emit all signals
     for (auto& link: links_to_delete) {
+        probe_fast(link.first);
+        probe_fast(link.second);
         emit linkBroken(link.first, link.second);
     }
 
-    // Send LLDP packets to all known ports
-    for (SwitchPtr sw : m_switch_manager->switches()) {
-        sendLLDP s(*this, sw);
-        s.sendLLDPtoPorts();
+    if (new_cycle) {
+        sync_probes();
     }
+    send_probes();
+}
+
+void LinkDiscovery::sync_probes()
+{
+    decltype(lldp_bursts) bursts;
+    decltype(lldp_groups) groups;
+    decltype(m_group_ports) group_ports;
+    std::unordered_set<switch_and_port> live, grouped, watched;
+
+    auto registry = m_switch_manager->registry();
+    for (const SwitchPtr& sw : registry->switches()) {
+        if (not recovery->isMaster(sw->dpid()))
+            continue;
+        auto& burst = bursts[sw->dpid()];
+        burst = std::move(lldp_bursts[sw->dpid()]);
+        if (not burst) {
+            burst.reset(new LLDPBurst);
+        }
+        burst->update(*this, sw);
+
+        if (c_group_probes) {
+            auto& group = groups[sw->dpid()];
+            group = std::move(lldp_groups[sw->dpid()]);
+            if (not group) {
+                group.reset(new LLDPGroup);
+            }
+            if (group->update(*this, sw)) {
+                sw->handle(installLLDPGroup(sw, *group));
+            }
+            for (const auto& it : group->ports()) {
+                grouped.insert(switch_and_port{sw->dpid(), it.second});
+            }
+            if (not group->ports().empty()) {
+                group_ports[sw->dpid()] = group->ports();
+                live.insert(switch_and_port{sw->dpid(), of13::OFPP_ALL});
+            }
+        }
+
+        auto ports = sw->ports_snapshot();
+        for (auto& port : *ports) {
+            switch_and_port sp {sw->dpid(), port->number()};
+            if (sendLLDP::eligible(sw, port) && not grouped.count(sp)) {
+                live.insert(sp);
+                if (port->watched())
+                    watched.insert(sp);
+            }
+        }
+    }
+    // switches gone since the last cycle are dropped
+    lldp_bursts = std::move(bursts);
+    lldp_groups = std::move(groups);
+
+    std::vector<switch_and_port> gone;
+    probe_wheel.for_each([&](const switch_and_port& sp) {
+        if (not live.count(sp))
+            gone.push_back(sp);
+    });
+
+    std::lock_guard<std::mutex> lock(probes_mutex);
+    m_grouped = std::move(grouped);
+    m_group_ports = std::move(group_ports);
+    for (const auto& sp : gone) {
+        probe_wheel.erase(sp);
+        m_probes.erase(sp);
+    }
+    for (const auto& sp : live) {
+        if (not probe_wheel.contains(sp)) {
+            probe_wheel.insert(sp);
+            m_probes.emplace(sp, probe_state{c_fast_probes, 0, false});
+        }
+        m_probes[sp].watched = watched.count(sp);
+    }
+}
+
+void LinkDiscovery::send_probes()
+{
+    std::unordered_map<uint64_t, std::vector<uint32_t>> due;
+    std::vector<uint64_t> due_groups;
+
+    { // lock
+    std::lock_guard<std::mutex> lock(probes_mutex);
+    for (const auto& sp : probe_wheel.advance()) {
+        auto& state = m_probes[sp];
+        if (state.skip > 0) {
+            --state.skip;
+            continue;
+        }
+        if (state.fast_left > 0) {
+            --state.fast_left;
+        }
+        unsigned ratio = c_stable_ratio * (state.watched ? c_watched_stretch : 1);
+        state.skip = state.fast_left > 0 ? 0 : ratio - 1;
+        if (sp.port == of13::OFPP_ALL)
+            due_groups.push_back(sp.dpid);
+        else
+            due[sp.dpid].push_back(sp.port);
+    }
+    } // unlock
+
+    // One PacketOut per switch probes all ports of its group
+    for (auto dpid : due_groups) {
+        auto group = lldp_groups.find(dpid);
+        auto sw = m_switch_manager->switch_(dpid);
+        if (group == lldp_groups.end() || not sw)
+            continue;
+        sw->handle(sendLLDPGroup(sw, *group->second));
+    }
+
+    // Send LLDP packets to the ports of this slot, one write per switch
+    for (const auto& ports : due) {
+        auto burst = lldp_bursts.find(ports.first);
+        auto sw = m_switch_manager->switch_(ports.first);
+        if (burst == lldp_bursts.end() || not sw)
+            continue;
+        sw->handle(sendLLDPBurst(*this, sw, *burst->second, ports.second));
+    }
+}
+
+void LinkDiscovery::probe_fast(switch_and_port port)
+{
+    std::lock_guard<std::mutex> lock(probes_mutex);
+    auto& state = m_probes[probe_key(port)];
+    state.fast_left = c_fast_probes;
+    state.skip = 0;
+}
+
+switch_and_port LinkDiscovery::probe_key(switch_and_port sp) const
+{
+    return m_grouped.count(sp) ? switch_and_port{sp.dpid, of13::OFPP_ALL} : sp;
+}
+
+switch_and_port LinkDiscovery::group_source(uint64_t dpid, uint64_t hw_addr) const
+{
+    std::lock_guard<std::mutex> lock(probes_mutex);
+    auto sw = m_group_ports.find(dpid);
+    if (sw == m_group_ports.end())
+        return switch_and_port{dpid, lldp_group_port};
+    auto it = sw->second.find(hw_addr);
+    return switch_and_port{dpid, it != sw->second.end() ? it->second
+                                                        : lldp_group_port};
+}
+
+// The wheel keeps its tick, a cycle gets more or less slots
+void LinkDiscovery::set_poll_interval(std::chrono::milliseconds interval)
+{
+    unsigned seconds = std::max<unsigned>(1, (interval.count() + 500) / 1000);
+    poller->apply([this, seconds]() {
+        if (seconds == c_poll_interval)
+            return;
+        std::lock_guard<std::mutex> lock(probes_mutex);
+        c_poll_interval = seconds;
+        probe_wheel.resize(seconds * 1000 / c_probe_tick_ms);
+        LOG(INFO) << "[LinkDiscovery] Poll interval is now "
+                  << seconds << " sec";
+    });
+}
+
+// Time until the next probe from the port, allowing one of them to be lost
+std::chrono::steady_clock::duration
+LinkDiscovery::link_ttl(switch_and_port from) const
+{
+    unsigned cycles = 1;
+    { // lock
+    std::lock_guard<std::mutex> lock(probes_mutex);
+    auto it = m_probes.find(probe_key(from));
+    if (it != m_probes.end()) {
+        cycles = it->second.skip + 1;
+    }
+    } // unlock
+    return std::chrono::seconds(c_poll_interval * 2 * cycles);
 }
 
 LinkDiscovery::links_set_iterator
 LinkDiscovery::find_link(const links_set& set, const DiscoveredLink& link) const
 {
-    return std::find_if(set.begin(), set.end(), [&](DiscoveredLink l){
+    return std::find_if(set.begin(), set.end(), [&](const DiscoveredLink& l){
         return std::tie(link.source, link.target) == std::tie(l.source, l.target);
     });
 }
@@ -306,6 +585,8 @@ bool LinkDiscovery::add_link(DiscoveredLink& link)
     auto it = m_links.insert(m_links.end(), link);
     m_out_edges[link.source] = it;
     m_out_edges[link.target] = it;
+    if (isNew)
+        m_links_generation.bump();
 
     return isNew;
 }
@@ -324,6 +605,7 @@ LinkDiscovery::remove_link(switch_and_port from, switch_and_port to)
     m_links.erase(link_it);
     CHECK(m_out_edges.erase(from) == 1);
     CHECK(m_out_edges.erase(to) == 1);
+    m_links_generation.bump();
 
     return { from, to };
 }
@@ -368,29 +650,45 @@ void LinkDiscovery::remove_waiting_link(switch_and_port from, switch_and_port to
 
 void LinkDiscovery::switchUp(SwitchPtr sw)
 {
-    if (recovery->isPrimary()) {
+    if (recovery->isMaster(sw->dpid())) {
         sw->handle(onSwitchUp(sw));
-    } else {
+        if (c_group_probes) {
+            // groups are lost on reconnect, installed on the next cycle
+            uint64_t dpid = sw->dpid();
+            poller->apply([this, dpid]() { lldp_groups.erase(dpid); });
+        }
+    } else if (not recovery->isSharded()) {
         load_from_database();
     }
 }
 
 void LinkDiscovery::linkUp(PortPtr port)
 {
-    if (recovery->isPrimary()) {
+    if (recovery->isMaster(port->switch_()->dpid())) {
+        probe_fast(switch_and_port{port->switch_()->dpid(), port->number()});
         (port->switch_())->handle(sendLLDP(*this,port));
     }
 }
 
 void LinkDiscovery::linkDown(PortPtr port)
 {
-    if (recovery->isPrimary()) {
+    // the queued signal lost the trace of the PortStatus
+    trace::scope traced(trace::mark_subject("link-discovery",
+        trace::port_subject(port->switch_()->dpid(), port->number())));
+    if (recovery->isMaster(port->switch_()->dpid())) {
+        probe_fast(switch_and_port{port->switch_()->dpid(), port->number()});
         clearLinkAt(port);
     }
 }
 
 void LinkDiscovery::save_to_database()
 {
+    // Sharded nodes know only the links into their switches, the
+    // leader keeps writing the stored set
+    if (recovery->isSharded() && not recovery->isPrimary()) {
+        return;
+    }
+
     auto jdump = nlohmann::json::array();
     for (const auto& l : links()) {
         jdump.push_back(l.to_json());
@@ -401,6 +699,7 @@ void LinkDiscovery::save_to_database()
 void LinkDiscovery::load_from_database()
 {
     std::lock_guard<std::mutex> lock(links_mutex);
+    generation_counter::scope changed(m_links_generation);
 
     m_links.clear();
     m_waiting_links.clear();
@@ -408,30 +707,43 @@ void LinkDiscovery::load_from_database()
 
     auto time = std::chrono::steady_clock::now() + 
                 std::chrono::seconds(c_poll_interval * 2); 
-    auto links = db_connector_->getSValue("link-discovery", "links");
-    if (links.empty()) {
-        return;
-    }
-
-    auto links_json = nlohmann::json::parse(links);
-    for (const auto& l_json : links_json) {
-        if (not m_switch_manager->switch_(l_json["source_dpid"]) ||
-            not m_switch_manager->switch_(l_json["target_dpid"])) {
-            continue; // skip unknown switch
+    auto load_link = [this, time](switch_and_port from, switch_and_port to) {
+        if (not m_switch_manager->switch_(from.dpid) ||
+            not m_switch_manager->switch_(to.dpid)) {
+            return; // skip unknown switch
         }
 
-        switch_and_port from {l_json["source_dpid"], l_json["source_port"]};
-        switch_and_port to   {l_json["target_dpid"], l_json["target_port"]};
         DiscoveredLink link {std::move(from), std::move(to), time};
 
         add_link(link);
         add_waiting_link(link);
+    };
+
+    if (auto snapshot = snapshot_->current()) {
+        if (auto section = snapshot->section("link-discovery")) {
+            for (auto record : *section) {
+                if (auto l = record.as<snapshot_link>()) {
+                    load_link({l->source_dpid, l->source_port},
+                              {l->target_dpid, l->target_port});
+                }
+            }
+            return;
+        }
+    }
+
+    auto links = db_connector_->getDocument("link-discovery", "links");
+    for (const auto& l : links) {
+        load_link({l["source_dpid"].get<uint64_t>(),
+                   l["source_port"].get<uint32_t>()},
+                  {l["target_dpid"].get<uint64_t>(),
+                   l["target_port"].get<uint32_t>()});
     }
 }
 
 
 LinkDiscovery::~LinkDiscovery()
 {
+    poll_tuning.reset();
     delete poller;
 }
 
@@ -20,12 +20,19 @@
 #include "SwitchOrdering.hpp"
 #include "Loader.hpp"
 #include "ILinkDiscovery.hpp"
-#include "Controller.hpp" // OFMessageHandlerPtr
-
+#include "Controller.hpp"
+#include "lib/generation.hpp"
+#include "lib/poll_tuning.hpp"
+#include "lib/time_wheel.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <set>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility> // std::pair
 
 namespace runos {
@@ -51,10 +58,21 @@ public:
         return m_links;
     }
 
+    uint64_t linksGeneration() const override
+    {
+        return m_links_generation.get();
+    }
+
     switch_and_port other(switch_and_port sp) const override;
 
     unsigned int pollInterval(void) const { return c_poll_interval; }
     int outputQueueId(void) const { return queue_id; }
+    uint32_t probeGroupId(void) const { return c_probe_group_id; }
+
+    // Links without LLDP behind them, e.g. from topology-simulator.
+    // They never expire and are announced like discovered ones.
+    void injectLink(switch_and_port from, switch_and_port to);
+    void withdrawLink(switch_and_port from, switch_and_port to);
 
 signals:
     void linkDiscovered(switch_and_port from, switch_and_port to) override;
@@ -65,12 +83,18 @@ private slots:
     void polling();
 
 private:
-    unsigned c_poll_interval;
+    std::atomic<unsigned> c_poll_interval; // seconds, tunable at runtime
+    unsigned c_probe_tick_ms;
+    unsigned c_stable_ratio; // stable links are probed every N cycles
+    unsigned c_watched_stretch; // ... and N times rarer on watched ports
+    unsigned c_fast_probes;
+    bool c_group_probes; // a PacketOut per switch through a probe group
+    uint32_t c_probe_group_id;
     int queue_id;
     class RecoveryManager* recovery;
     class SwitchManager* m_switch_manager;
     class DatabaseConnector* db_connector_;
-    OFMessageHandlerPtr handler;
+    class StateSnapshot* snapshot_;
 
     using links_set = std::set<DiscoveredLink>;
     using links_set_iterator = links_set::iterator;
@@ -81,8 +105,47 @@ private:
     std::unordered_map<switch_and_port, links_set_iterator >
             m_out_edges;
     mutable std::mutex links_mutex; //protect link containers
+    generation_counter m_links_generation;
 
     class Poller* poller; //run sending lldp timer from separate threads
+    PollTuning::handle poll_tuning;
+    // prebuilt LLDP PacketOuts by dpid, used from the poller thread only
+    std::unordered_map<uint64_t, std::unique_ptr<class LLDPBurst>>
+            lldp_bursts;
+    std::unordered_map<uint64_t, std::unique_ptr<class LLDPGroup>>
+            lldp_groups;
+
+    // Every port is probed from one slot of the wheel, a wheel cycle
+    // takes poll-interval. Ports are probed on every cycle for the first
+    // few cycles after they come up, then every c_stable_ratio cycles.
+    // Ports in probe groups share one slot, {dpid, OFPP_ALL}.
+    // Watched ports lose their links with OFPPS_LIVE, LLDP only has to
+    // find them, so they are probed c_watched_stretch times rarer.
+    struct probe_state {
+        unsigned fast_left;
+        unsigned skip; // cycles until the next probe
+        bool watched;
+    };
+    time_wheel<switch_and_port> probe_wheel; // poller thread only
+    std::unordered_map<switch_and_port, probe_state> m_probes;
+    std::unordered_set<switch_and_port> m_grouped;
+    // dpid -> hw address -> port, of probe group buckets
+    std::unordered_map<uint64_t, std::unordered_map<uint64_t, uint32_t>>
+            m_group_ports;
+    mutable std::mutex probes_mutex; // protect m_probes and groups
+
+    // wheel slot probing the port, lock probes_mutex before calling
+    switch_and_port probe_key(switch_and_port sp) const;
+    // origin of LLDP sent through a probe group, port 0 if unknown
+    switch_and_port group_source(uint64_t dpid, uint64_t hw_addr) const;
+
+    void sync_probes();
+    void send_probes();
+    void probe_fast(switch_and_port port);
+    // Port::core follows whether the port has a link
+    void mark_core(switch_and_port sp);
+    void set_poll_interval(std::chrono::milliseconds interval);
+    std::chrono::steady_clock::duration link_ttl(switch_and_port from) const;
 
     void handleBeacon(switch_and_port from, switch_and_port to);
 
@@ -17,9 +17,17 @@
 #include "LinkDiscoveryDriver.hpp"
 
 #include <runos/core/logging.hpp>
+
+#include <fluid/of13msg.hh>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
  
 namespace runos {
 
+static const auto local_port_key = devicedb::PropertyKey::intern("local_port");
+
 void onSwitchUp::handle(drivers::DefaultDriver& driver) const { 
     of13::FlowMod fm;
     fm.table_id(sw->tables.admission);
@@ -51,27 +59,37 @@ lldp_packet sendLLDP::cookPacket() const {
     return lldp;
 }
 
-void sendLLDP::handle(drivers::DefaultDriver& driver) const { 
-
-    if (sw->property("local_port", of13::OFPP_LOCAL) == port->number() ||
-        port->link_down() || port->number() > of13::OFPP_MAX) {
-        return;
-    }
+bool sendLLDP::eligible(SwitchPtr sw, PortPtr port)
+{
+    return sw->property(local_port_key, of13::OFPP_LOCAL) != port->number() &&
+           not port->link_down() && port->number() <= of13::OFPP_MAX;
+}
 
-    of13::OutputAction ofoutput(port->number(), of13::OFPCML_NO_BUFFER);
-    of13::PacketOut po;
+PacketOutBuilder sendLLDP::cookPacketOut(const lldp_packet& lldp) const
+{
+    PacketOutBuilder po;
 
-    lldp_packet lldp = cookPacket();
     po.data(&lldp, sizeof lldp);
 
     po.xid(xid);
     po.in_port(of13::OFPP_CONTROLLER);
 
     if (app.outputQueueId() >= 0) {
-        of13::SetQueueAction queue(app.outputQueueId());
-        po.add_action(queue);
+        po.set_queue(app.outputQueueId());
     }
-    po.add_action(ofoutput);
+    po.output(port->number(), of13::OFPCML_NO_BUFFER);
+
+    return po;
+}
+
+void sendLLDP::handle(drivers::DefaultDriver& driver) const { 
+
+    if (not eligible(sw, port)) {
+        return;
+    }
+
+    lldp_packet lldp = cookPacket();
+    PacketOutBuilder po = cookPacketOut(lldp);
 
     VLOG(5) << "Sending LLDP packet to " << port->name();
     // Send packet 3 times to prevent drops
@@ -81,7 +99,8 @@ void sendLLDP::handle(drivers::DefaultDriver& driver) const {
 }
 
 void sendLLDP::sendLLDPtoPorts() {
-    for (auto &pr: sw->ports()) {
+    auto ports = sw->ports_snapshot();
+    for (auto &pr: *ports) {
         if (pr->link_down()) {
             continue;
         }
@@ -91,6 +110,189 @@ void sendLLDP::sendLLDPtoPorts() {
     }
 }
 
+// Every PacketOut is sent 3 times to prevent drops
+static constexpr size_t lldp_copies = 3;
+
+void LLDPBurst::update(const LinkDiscovery& app, SwitchPtr sw)
+{
+    std::vector<PortPtr> ports;
+    auto all_ports = sw->ports_snapshot();
+    for (auto& port : *all_ports) {
+        if (sendLLDP::eligible(sw, port))
+            ports.push_back(port);
+    }
+
+    bool same_ports = ports.size() == entries.size() &&
+        std::equal(ports.begin(), ports.end(), entries.begin(),
+                   [](const PortPtr& port, const entry& e) {
+                       return port->number() == e.port;
+                   });
+    if (not same_ports || ttl != app.pollInterval() ||
+            queue_id != app.outputQueueId()) {
+        rebuild(app, sw, ports);
+        return;
+    }
+
+    // src_mac follows dst_mac at the start of the frame,
+    // the frame is at the end of the PacketOut
+    size_t src_mac_at = msg_len - sizeof(lldp_packet) + sizeof(big_uint48_t);
+    for (size_t i = 0; i < ports.size(); ++i) {
+        uint64_t hw_addr = ports[i]->hw_addr().to_number();
+        if (entries[i].hw_addr == hw_addr)
+            continue;
+
+        big_uint48_t src_mac = hw_addr;
+        for (size_t copy = 0; copy < lldp_copies; ++copy) {
+            std::memcpy(&buffer[entries[i].offset + copy * msg_len + src_mac_at],
+                        &src_mac, sizeof src_mac);
+        }
+        entries[i].hw_addr = hw_addr;
+    }
+}
+
+void LLDPBurst::rebuild(const LinkDiscovery& app, SwitchPtr sw,
+                        const std::vector<PortPtr>& ports)
+{
+    entries.clear();
+    index.clear();
+    buffer.clear();
+    ttl = app.pollInterval();
+    queue_id = app.outputQueueId();
+
+    sendLLDP s(app, sw);
+    for (auto& port : ports) {
+        s.port = port;
+        lldp_packet lldp = s.cookPacket();
+        PacketOutBuilder po = s.cookPacketOut(lldp);
+        msg_len = po.size();
+
+        index[port->number()] = entries.size();
+        entries.push_back(entry{port->number(),
+                                port->hw_addr().to_number(),
+                                buffer.size()});
+        buffer.resize(buffer.size() + lldp_copies * msg_len);
+        for (size_t copy = 0; copy < lldp_copies; ++copy) {
+            po.write_to(&buffer[entries.back().offset + copy * msg_len]);
+        }
+    }
+}
+
+void LLDPBurst::send(SwitchPtr sw, const std::vector<uint32_t>& ports) const
+{
+    std::vector<uint8_t> out;
+    out.reserve(ports.size() * lldp_copies * msg_len);
+    for (uint32_t port : ports) {
+        auto it = index.find(port);
+        if (it == index.end())
+            continue;
+        auto begin = buffer.begin() + entries[it->second].offset;
+        out.insert(out.end(), begin, begin + lldp_copies * msg_len);
+    }
+    if (out.empty())
+        return;
+
+    VLOG(5) << "Sending LLDP packets to " << out.size() / lldp_copies / msg_len
+            << " ports of " << sw->dpid();
+    sw->connection()->send(out.data(), out.size());
+}
+
+void sendLLDPBurst::handle(drivers::DefaultDriver& driver) const
+{
+    burst.send(sw, ports);
+}
+
+bool LLDPGroup::update(const LinkDiscovery& app, SwitchPtr sw)
+{
+    std::vector<std::pair<uint32_t, uint64_t>> next;
+    std::unordered_map<uint64_t, unsigned> owners;
+    auto all_ports = sw->ports_snapshot();
+    for (auto& port : *all_ports) {
+        if (not sendLLDP::eligible(sw, port))
+            continue;
+        uint64_t hw_addr = port->hw_addr().to_number();
+        next.emplace_back(port->number(), hw_addr);
+        ++owners[hw_addr];
+    }
+    next.erase(std::remove_if(next.begin(), next.end(), [&](const auto& m) {
+        return m.second == 0 || owners[m.second] > 1;
+    }), next.end());
+    std::sort(next.begin(), next.end());
+
+    bool changed = next != members || group_id != app.probeGroupId() ||
+                   queue_id != app.outputQueueId();
+    if (not changed && ttl == app.pollInterval())
+        return false;
 
+    members = std::move(next);
+    by_mac.clear();
+    for (const auto& m : members)
+        by_mac[m.second] = m.first;
+    group_id = app.probeGroupId();
+    queue_id = app.outputQueueId();
+    ttl = app.pollInterval();
+
+    lldp_packet lldp;
+    // buckets set the port's address
+    lldp.src_mac = sw->dpid();
+    lldp.chassis_id_sub_mac = sw->dpid();
+    lldp.port_id_sub_component = lldp_group_port;
+    lldp.ttl_seconds = ttl;
+    lldp.dpid_data = sw->dpid();
+
+    PacketOutBuilder po;
+    po.data(&lldp, sizeof lldp);
+    po.xid(xid);
+    po.in_port(of13::OFPP_CONTROLLER);
+    po.group(group_id);
+
+    buffer.resize(lldp_copies * po.size());
+    for (size_t copy = 0; copy < lldp_copies; ++copy) {
+        po.write_to(&buffer[copy * po.size()]);
+    }
+    return changed;
+}
+
+void LLDPGroup::install(SwitchPtr sw) const
+{
+    std::vector<of13::Bucket> buckets;
+    for (const auto& m : members) {
+        of13::Bucket bucket(0, of13::OFPP_ANY, of13::OFPG_ANY);
+        auto octets = ethaddr(m.second).to_octets();
+        bucket.add_action(new of13::SetFieldAction(
+            new of13::EthSrc(fluid_msg::EthAddress(octets.data()))));
+        if (queue_id >= 0) {
+            bucket.add_action(new of13::SetQueueAction(queue_id));
+        }
+        bucket.add_action(new of13::OutputAction(m.first, of13::OFPCML_NO_BUFFER));
+        buckets.push_back(std::move(bucket));
+    }
+
+    // ADD fails if the group survived a reconnect, MODIFY doesn't
+    of13::GroupMod add(xid, of13::OFPGC_ADD, of13::OFPGT_ALL, group_id, buckets);
+    of13::GroupMod modify(xid, of13::OFPGC_MODIFY, of13::OFPGT_ALL, group_id, buckets);
+    sw->connection()->send(add);
+    sw->connection()->send(modify);
+}
+
+void LLDPGroup::send(SwitchPtr sw) const
+{
+    if (members.empty() || buffer.empty())
+        return;
+
+    VLOG(5) << "Sending LLDP packets to " << members.size()
+            << " ports of " << sw->dpid() << " through group " << group_id;
+    std::vector<uint8_t> out(buffer);
+    sw->connection()->send(out.data(), out.size());
+}
+
+void installLLDPGroup::handle(drivers::DefaultDriver& driver) const
+{
+    group.install(sw);
+}
+
+void sendLLDPGroup::handle(drivers::DefaultDriver& driver) const
+{
+    group.send(sw);
+}
 
 } //runos
@@ -25,12 +25,19 @@
 #include <boost/endian/arithmetic.hpp>
 #include <boost/endian/conversion.hpp>
 
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
 namespace runos {
 
 using namespace boost::endian;
 namespace of13 = fluid_msg::of13;
 static const uint16_t fm_prio = 50000;
 static constexpr uint32_t xid = 24500;
+// Port ID of LLDP sent through the probe group, the port is told by
+// the source MAC set by its bucket
+static constexpr uint32_t lldp_group_port = 0;
 
 struct tagged_lldp_packet {
     big_uint16_t lldp_tlv_header(big_uint16_t type, big_uint16_t length) {
@@ -122,6 +129,100 @@ public:
     void handle(drivers::DefaultDriver& driver) const;
 
     void sendLLDPtoPorts();
+
+    // Whether LLDP should be sent out of the port
+    static bool eligible(SwitchPtr sw, PortPtr port);
+    // References `lldp`, which must outlive the builder
+    PacketOutBuilder cookPacketOut(const lldp_packet& lldp) const;
+};
+
+// Packed LLDP PacketOuts for all ports of a switch. They are built once
+// and only patched when a port's hw address changes; any change in the
+// set of ports rebuilds the whole burst.
+class LLDPBurst {
+public:
+    void update(const LinkDiscovery& app, SwitchPtr sw);
+    // Sends to the given ports in one write, skipping ones not in the burst
+    void send(SwitchPtr sw, const std::vector<uint32_t>& ports) const;
+
+private:
+    struct entry {
+        uint32_t port;
+        uint64_t hw_addr;
+        size_t offset; // of the first copy of the PacketOut
+    };
+
+    std::vector<entry> entries;
+    std::unordered_map<uint32_t, size_t> index; // port -> entry
+    std::vector<uint8_t> buffer;
+    size_t msg_len = 0;
+    unsigned ttl = 0;
+    int queue_id = -1;
+
+    void rebuild(const LinkDiscovery& app, SwitchPtr sw,
+                 const std::vector<PortPtr>& ports);
+};
+
+// OFDPv2-style probes: an ALL group with a bucket per port setting the
+// source MAC to the port's hw address, so one PacketOut probes every
+// port of the switch. Ports without a hw address of their own on the
+// switch can't be told apart and are left to per-port probes.
+class LLDPGroup {
+public:
+    // Returns true if the group has to be installed again
+    bool update(const LinkDiscovery& app, SwitchPtr sw);
+    void install(SwitchPtr sw) const;
+    void send(SwitchPtr sw) const;
+
+    // hw address -> port of the buckets
+    const std::unordered_map<uint64_t, uint32_t>& ports() const { return by_mac; }
+
+private:
+    std::vector<std::pair<uint32_t, uint64_t>> members; // port, hw address
+    std::unordered_map<uint64_t, uint32_t> by_mac;
+    uint32_t group_id = 0;
+    int queue_id = -1;
+    unsigned ttl = 0;
+    std::vector<uint8_t> buffer; // prebuilt PacketOuts
+};
+
+class installLLDPGroup : public drivers::Handler {
+public:
+    SwitchPtr sw;
+    const LLDPGroup& group;
+
+    installLLDPGroup(SwitchPtr _sw, const LLDPGroup& _group)
+        : sw(_sw), group(_group)
+    { }
+
+    void handle(drivers::DefaultDriver& driver) const;
+};
+
+class sendLLDPGroup : public drivers::Handler {
+public:
+    SwitchPtr sw;
+    const LLDPGroup& group;
+
+    sendLLDPGroup(SwitchPtr _sw, const LLDPGroup& _group)
+        : sw(_sw), group(_group)
+    { }
+
+    void handle(drivers::DefaultDriver& driver) const;
+};
+
+class sendLLDPBurst : public drivers::Handler {
+public:
+    const LinkDiscovery& app;
+    SwitchPtr sw;
+    const LLDPBurst& burst;
+    const std::vector<uint32_t>& ports;
+
+    sendLLDPBurst(const LinkDiscovery& _app, SwitchPtr _sw,
+                  const LLDPBurst& _burst, const std::vector<uint32_t>& _ports)
+        : app(_app), sw(_sw), burst(_burst), ports(_ports)
+    { }
+
+    void handle(drivers::DefaultDriver& driver) const;
 };
 
 }//runos
@@ -33,6 +33,10 @@ struct LinkCollection : rest::resource {
     explicit LinkCollection(QObject* _app)
     { app = dynamic_cast<ILinkDiscovery*>(_app);  }
 
+    uint64_t Generation() const override {
+        return app->linksGeneration();
+    }
+
     rest::ptree Get() const override {
         rest::ptree root;
         rest::ptree links;
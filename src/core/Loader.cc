@@ -18,8 +18,14 @@
 
 #include "Application.hpp"
 #include "Config.hpp"
+#include "lib/qt_executor.hpp"
+#include "lib/thread_placement.hpp"
 #include <runos/core/logging.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <vector>
 #include <unordered_map>
 #include <mutex>
@@ -97,6 +103,8 @@ public:
 };
 
 struct LoaderImpl {
+    typedef std::chrono::steady_clock clock;
+
     Loader* this_;
     const Config& config;
 
@@ -104,28 +112,95 @@ struct LoaderImpl {
     std::unordered_map<std::string, AppInfo>
         apps;
 
+    // The shared pool of `threads` first, then threads of isolated
+    // applications and application groups
     std::vector<AppThread*> thread;
+    std::vector<std::string> thread_name;
+    size_t shared_threads;
+    std::unordered_map<std::string, size_t> dedicated;
     size_t last_thread;
+    bool parallel;
+
+    // Guards application states and timings,
+    // which are updated concurrently in parallel mode
+    mutable std::mutex mutex;
+    clock::time_point epoch;
+    std::unordered_map<std::string, Loader::Timing> timing;
 
     // Recursive initialization
     AppInfo* initialize(std::string service);
 
+    // Dependency-driven initialization: every application is handed
+    // to its thread as soon as all its dependencies are done
+    bool collect(const std::string& serviceId,
+                 std::unordered_map<std::string, int>& mark,
+                 std::vector<std::string>& order);
+    void schedule(const std::vector<std::string>& order, bool start);
+
+    size_t add_thread(const std::string& name);
+    void dedicate(const std::string& app, size_t index);
+    AppThread* assign_thread(Application* app);
+    void set_state(AppInfo& info, ApplicationState new_state);
+    std::chrono::microseconds since_epoch() const;
+    void init_app(AppInfo& info);
+    void start_app(AppInfo& info);
+    void report() const;
+
     LoaderImpl(Loader* loader, const Config& config_)
         : this_(loader),
           config(config_),
           state(INITIALIZING),
           last_thread(0)
     {
-        size_t nthreads = config_get(config_cd(config, "loader"),
-                                     "threads", 1);
-        thread.resize(nthreads);
-        for (size_t i = 0; i < nthreads; ++i) {
-            thread[i] = new AppThread(config);
-            thread[i]->start();
+        auto loader_config = config_cd(config, "loader");
+        parallel = config_get(loader_config, "parallel-init", false);
+        shared_threads = std::max(config_get(loader_config, "threads", 1), 1);
+        for (size_t i = 0; i < shared_threads; ++i) {
+            add_thread("loader-" + std::to_string(i));
+        }
+
+        auto isolate = loader_config.find("isolate");
+        if (isolate != loader_config.end()) {
+            for (auto& app : isolate->second.array_items()) {
+                dedicate(app.string_value(), add_thread(app.string_value()));
+            }
+        }
+        auto groups = loader_config.find("groups");
+        if (groups != loader_config.end()) {
+            for (auto& group : groups->second.object_items()) {
+                size_t index = add_thread(group.first);
+                for (auto& app : group.second.array_items()) {
+                    dedicate(app.string_value(), index);
+                }
+            }
         }
     }
 };
 
+size_t LoaderImpl::add_thread(const std::string& name)
+{
+    auto app_thread = new AppThread(config);
+    // Also names the OS thread
+    app_thread->setObjectName(QString::fromStdString(name));
+    // Direct connection, runs in the started thread
+    QObject::connect(app_thread, &QThread::started, [name] {
+        ThreadPlacement::global().place("apps", name);
+    });
+    app_thread->start();
+
+    thread.push_back(app_thread);
+    thread_name.push_back(name);
+    return thread.size() - 1;
+}
+
+void LoaderImpl::dedicate(const std::string& app, size_t index)
+{
+    if (not dedicated.emplace(app, index).second) {
+        LOG(WARNING) << "Application " << app << " is isolated or grouped "
+                        "twice, it runs in " << thread_name[dedicated[app]];
+    }
+}
+
 Loader::Loader(const Config& config)
     : m(new LoaderImpl(this, config))
 { }
@@ -138,6 +213,7 @@ Application* Loader::app(std::string interface) const {
     if (info_it == m->apps.end())
         return nullptr;
 
+    std::lock_guard<std::mutex> lock(m->mutex);
     if ((info_it->second.state != APP_INITIALIZED) && (info_it->second.state != APP_STARTED))
         return nullptr;
     return info_it->second.app;
@@ -145,6 +221,8 @@ Application* Loader::app(std::string interface) const {
 
 void Loader::startAll()
 {
+    m->epoch = LoaderImpl::clock::now();
+
     for (auto app : *ApplicationRegistry().registry) {
         DLOG(INFO) << "Registering interface " << app->provides();
         if (!m->apps.insert({app->provides(), app}).second) {
@@ -155,31 +233,265 @@ void Loader::startAll()
 
     LOG(INFO) << "Initializing...";
     auto services = m->config.at("services");
-    for (auto& serviceName : services.array_items())
-        m->initialize(serviceName.string_value());
+    std::vector<std::string> order;
+    if (m->parallel) {
+        std::unordered_map<std::string, int> mark;
+        for (auto& serviceName : services.array_items())
+            m->collect(serviceName.string_value(), mark, order);
+        m->schedule(order, false);
+    } else {
+        for (auto& serviceName : services.array_items())
+            m->initialize(serviceName.string_value());
+    }
 
     LOG(INFO) << "Starting...";
     m->state = STARTING;
-    for (auto& servicePair : m->apps) {
-        auto& info = servicePair.second;
-        if (info.state != APP_INITIALIZED)
-            continue;
-        
-        try {
-            LOG(INFO) << "  startUp(" << servicePair.first << ")";
-            AppThread* app_thread = qobject_cast<AppThread*>(info.app->thread());
-            std::mutex start_mutex;
-            start_mutex.lock();
-            emit app_thread->initializer.startApp(m->this_, info.app, &start_mutex);
-            start_mutex.lock();
-            info.state = APP_STARTED;
-        } catch(...) {
-            LOG(FATAL) << "Failed to start " << servicePair.first;
+    if (m->parallel) {
+        m->schedule(order, true);
+    } else {
+        for (auto& servicePair : m->apps) {
+            auto& info = servicePair.second;
+            if (info.state != APP_INITIALIZED)
+                continue;
+
+            try {
+                m->start_app(info);
+            } catch(...) {
+                LOG(FATAL) << "Failed to start " << servicePair.first;
+            }
         }
     }
 
     m->state = RUNNING;
     LOG(INFO) << "Controller is up!";
+    m->report();
+}
+
+std::vector<Loader::Timing> Loader::startupTimeline() const
+{
+    std::vector<Timing> ret;
+    {
+        std::lock_guard<std::mutex> lock(m->mutex);
+        for (auto& pair : m->timing)
+            ret.push_back(pair.second);
+    }
+    std::sort(ret.begin(), ret.end(), [](const Timing& a, const Timing& b) {
+        return a.init_begin < b.init_begin;
+    });
+    return ret;
+}
+
+void LoaderImpl::set_state(AppInfo& info, ApplicationState new_state)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    info.state = new_state;
+}
+
+std::chrono::microseconds LoaderImpl::since_epoch() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        clock::now() - epoch);
+}
+
+AppThread* LoaderImpl::assign_thread(Application* app)
+{
+    AppThread *app_thread;
+    size_t index;
+    int specific_thread = config_get(config_cd(config, app->provides()),
+            "pin-to-thread", -1);
+
+    auto it = dedicated.find(app->provides());
+    if (it != dedicated.end()) {
+        index = it->second;
+        app_thread = thread[index];
+
+        VLOG(2) << "  moveToThread(" << app->provides()
+            << ", " << thread_name[index] << ':' << app_thread << ")";
+    } else if (specific_thread >= 0 &&
+               (size_t) specific_thread < shared_threads) {
+        index = specific_thread;
+        app_thread = thread[index];
+
+        VLOG(2) << "  moveToThread(" << app->provides() 
+            << ", " << specific_thread << ':' << app_thread << ")";
+    } else {
+        index = last_thread;
+        app_thread = thread[last_thread];
+        if (++last_thread == shared_threads)
+            last_thread = 0;
+
+        VLOG(2) << "  moveToThread(" << app->provides() 
+            << ", " << last_thread << ':' << app_thread << ")";
+    }
+
+    app->moveToThread(app_thread);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& t = timing[app->provides()];
+    t.app = app->provides();
+    t.thread = index;
+    return app_thread;
+}
+
+void LoaderImpl::init_app(AppInfo& info)
+{
+    auto begin = since_epoch();
+    info.app->init(this_, config);
+    auto end = since_epoch();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& t = timing[info.app->provides()];
+    t.init_begin = begin;
+    t.init_time = end - begin;
+}
+
+void LoaderImpl::start_app(AppInfo& info)
+{
+    LOG(INFO) << "  startUp(" << info.app->provides() << ")";
+    auto begin = since_epoch();
+    if (parallel) {
+        info.app->startUp(this_);
+    } else {
+        AppThread* app_thread = qobject_cast<AppThread*>(info.app->thread());
+        std::mutex start_mutex;
+        start_mutex.lock();
+        emit app_thread->initializer.startApp(this_, info.app, &start_mutex);
+        start_mutex.lock();
+        set_state(info, APP_STARTED);
+    }
+    auto end = since_epoch();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& t = timing[info.app->provides()];
+    t.start_begin = begin;
+    t.start_time = end - begin;
+}
+
+void LoaderImpl::report() const
+{
+    using std::chrono::duration_cast;
+    using std::chrono::milliseconds;
+
+    auto timeline = this_->startupTimeline();
+    LOG(INFO) << "Startup timeline (ms: init begin +time, startUp begin +time):";
+    for (auto& t : timeline) {
+        LOG(INFO) << "  " << t.app << " [" << thread_name[t.thread] << "]: "
+                  << duration_cast<milliseconds>(t.init_begin).count() << " +"
+                  << duration_cast<milliseconds>(t.init_time).count() << ", "
+                  << duration_cast<milliseconds>(t.start_begin).count() << " +"
+                  << duration_cast<milliseconds>(t.start_time).count();
+    }
+    LOG(INFO) << "Startup took " << duration_cast<milliseconds>(
+        since_epoch()).count() << " ms using " << shared_threads
+        << (parallel ? " parallel" : " sequential") << " loader thread(s)"
+        << " and " << thread.size() - shared_threads << " dedicated";
+}
+
+bool LoaderImpl::collect(const std::string& serviceId,
+                         std::unordered_map<std::string, int>& mark,
+                         std::vector<std::string>& order)
+{
+    enum { VISITING = 1, DONE, FAILED };
+
+    auto app_it = apps.find(serviceId);
+    if (app_it == apps.end()) {
+        LOG(ERROR) << "Can't find application " << serviceId;
+        return false;
+    }
+
+    int& state = mark[serviceId];
+    if (state == VISITING) {
+        LOG(FATAL) << "Cyclic dependencies detected";
+    }
+    if (state != 0)
+        return state == DONE;
+
+    state = VISITING;
+    Application* app = app_it->second.app;
+    for (auto dependsOn = app->dependsOn(config);
+         !dependsOn->empty();
+         ++dependsOn)
+    {
+        if (!collect(*dependsOn, mark, order)) {
+            mark[serviceId] = FAILED;
+            return false;
+        }
+    }
+
+    mark[serviceId] = DONE;
+    order.push_back(serviceId);
+    return true;
+}
+
+void LoaderImpl::schedule(const std::vector<std::string>& order, bool start)
+{
+    std::unordered_map<std::string, size_t> waiting;
+    std::unordered_map<std::string, std::vector<std::string>> dependents;
+
+    for (auto& id : order) {
+        Application* app = apps.at(id).app;
+        size_t& count = waiting[id];
+        for (auto dependsOn = app->dependsOn(config);
+             !dependsOn->empty();
+             ++dependsOn)
+        {
+            ++count;
+            dependents[*dependsOn].push_back(id);
+        }
+    }
+
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    std::deque<std::string> done;
+
+    auto launch = [&](const std::string& id) {
+        AppInfo& info = apps.at(id);
+        QObject* target;
+
+        if (start) {
+            target = &qobject_cast<AppThread*>(info.app->thread())->initializer;
+        } else {
+            LOG(INFO) << "  init(" << id << ")";
+            set_state(info, APP_INITIALIZING);
+            target = &assign_thread(info.app)->initializer;
+        }
+
+        qt_executor(target).submit([&, id, start]() {
+            AppInfo& info = apps.at(id);
+            if (start) {
+                try {
+                    start_app(info);
+                } catch(...) {
+                    LOG(FATAL) << "Failed to start " << id;
+                }
+            } else {
+                init_app(info);
+            }
+            std::lock_guard<std::mutex> lock(done_mutex);
+            done.push_back(id);
+            done_cv.notify_one();
+        });
+    };
+
+    for (auto& id : order) {
+        if (waiting[id] == 0)
+            launch(id);
+    }
+
+    for (size_t finished = 0; finished < order.size(); ++finished) {
+        std::string id;
+        {
+            std::unique_lock<std::mutex> lock(done_mutex);
+            done_cv.wait(lock, [&]{ return not done.empty(); });
+            id = std::move(done.front());
+            done.pop_front();
+        }
+
+        set_state(apps.at(id), start ? APP_STARTED : APP_INITIALIZED);
+        for (auto& next : dependents[id]) {
+            if (--waiting[next] == 0)
+                launch(next);
+        }
+    }
 }
 
 AppInfo* LoaderImpl::initialize(std::string serviceId)
@@ -195,7 +507,7 @@ AppInfo* LoaderImpl::initialize(std::string serviceId)
     if (appInfo.state != APP_REGISTERED)
         return &appInfo;
 
-    appInfo.state = APP_INITIALIZING;
+    set_state(appInfo, APP_INITIALIZING);
 
     for (auto dependsOn = app->dependsOn(config);
          !dependsOn->empty();
@@ -211,34 +523,23 @@ AppInfo* LoaderImpl::initialize(std::string serviceId)
         }
     }
 
-    AppThread *app_thread;
-    int specific_thread = config_get(config_cd(config, app->provides()),
-            "pin-to-thread", -1);
-
-    if (specific_thread >= 0 && (size_t) specific_thread < thread.size()) {
-        app_thread = thread[specific_thread];
-
-        VLOG(2) << "  moveToThread(" << app->provides() 
-            << ", " << specific_thread << ':' << app_thread << ")";
-    } else {
-        app_thread = thread[last_thread];
-        if (++last_thread == thread.size())
-            last_thread = 0;
-
-        VLOG(2) << "  moveToThread(" << app->provides() 
-            << ", " << last_thread << ':' << app_thread << ")";
-    }
-
+    AppThread* app_thread = assign_thread(app);
 
     LOG(INFO) << "  init(" << serviceId << ")";
-    app->moveToThread(app_thread);
-
+    auto begin = since_epoch();
     std::mutex init_mutex;
     init_mutex.lock();
     emit app_thread->initializer.initializeApp(this_, app, &init_mutex);
     init_mutex.lock();
+    auto end = since_epoch();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& t = timing[serviceId];
+        t.init_begin = begin;
+        t.init_time = end - begin;
+    }
 
-    appInfo.state = APP_INITIALIZED;
+    set_state(appInfo, APP_INITIALIZED);
     return &appInfo;
 }
 
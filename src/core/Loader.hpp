@@ -20,6 +20,10 @@
 
 #include <QtCore>
 
+#include <chrono>
+#include <string>
+#include <vector>
+
 namespace runos {
 
 class Application;
@@ -48,6 +52,20 @@ public:
     */
     void startAll();
 
+    /**
+    * Time spent in init() and startUp() of every application, relative
+    * to the beginning of startAll().
+    */
+    struct Timing {
+        std::string app;
+        size_t thread;
+        std::chrono::microseconds init_begin;
+        std::chrono::microseconds init_time;
+        std::chrono::microseconds start_begin;
+        std::chrono::microseconds start_time;
+    };
+    std::vector<Timing> startupTimeline() const;
+
 private:
     struct LoaderImpl *m;
 };
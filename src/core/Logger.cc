@@ -15,9 +15,18 @@
  */
 
 #include "Logger.hpp"
+#include "lib/flight_recorder.hpp"
+
+#include <atomic>
 
 void MessageHandle(const char* data, int size)
 {
+    // glog writes a failure in several calls, the rings are dumped once
+    static std::atomic<bool> dumped {false};
+    if (not dumped.exchange(true)) {
+        runos::flight::dump();
+    }
+
     std::string str = std::string(data, size);
     LOG(ERROR)<<str;
 }
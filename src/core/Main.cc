@@ -17,6 +17,8 @@
 #include "Loader.hpp"
 #include "Config.hpp"
 #include "Logger.hpp"
+#include "lib/flight_recorder.hpp"
+#include "lib/thread_placement.hpp"
 #include "api/OFConnection.hpp"
 #include "api/Port.hpp"
 #include "api/SwitchFwd.hpp"
@@ -25,7 +27,7 @@
 
 #include <runos/core/logging.hpp>
 #include <runos/core/catch_all.hpp>
-//#include <runos/core/crash_reporter.hpp>
+#include <runos/core/crash_reporter.hpp>
 
 #include <cxxopts.hpp>
 
@@ -59,6 +61,20 @@ static void initQtMetaTypes()
     qRegisterMetaType<runos::SwitchPtr>("SwitchPtr");
 }
 
+// Roles of the "threads" section, before any of them is started
+static void configureThreads(const Config& config)
+{
+    auto& placement = ThreadPlacement::global();
+    const auto& threads = config_cd(config, "threads");
+    bool spread = config_get(threads, "spread", true);
+    for (const auto& role : threads) {
+        if (role.second.is_string()) {
+            placement.configure(role.first, role.second.string_value(),
+                                spread);
+        }
+    }
+}
+
 // Singletons
 static Rc<ResourceLocator> resource_locator;
 Rc<ResourceLocator> ResourceLocator::get() { return resource_locator; }
@@ -100,13 +116,17 @@ int main(int argc, char* argv[]) {
     google::InitGoogleLogging(argv[0]);
     google::InstallFailureSignalHandler();
     google::InstallFailureWriter(&MessageHandle);
+    crash_reporter::on_snapshot([]() { flight::dump(); });
     //crash_reporter::setup(options["dumpdir"].as<std::string>().c_str());
 
     RunosApplication app(argc, argv);
 
     Config config = loadConfig(options["conf"].as<std::string>());
+    configureThreads(config);
     Loader loader(config);
     loader.startAll();
 
+    // Pinned last: threads started from here inherit its affinity
+    ThreadPlacement::global().place("main", "qt-main");
     return app.exec();
 }
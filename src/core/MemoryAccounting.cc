@@ -0,0 +1,107 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "MemoryAccounting.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <algorithm>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+namespace runos {
+
+REGISTER_APPLICATION(MemoryAccounting, {""})
+
+namespace {
+
+// `top` largest entries of `usage`, biggest first
+template<class Key>
+std::vector<std::pair<Key, memory::Usage>>
+largest(const std::map<Key, memory::Usage>& usage, size_t top)
+{
+    std::vector<std::pair<Key, memory::Usage>> ret(usage.begin(), usage.end());
+    auto n = std::min(top, ret.size());
+    std::partial_sort(ret.begin(), ret.begin() + n, ret.end(),
+        [](const auto& a, const auto& b) {
+            return a.second.bytes > b.second.bytes;
+        });
+    ret.resize(n);
+    return ret;
+}
+
+} // namespace
+
+void MemoryAccounting::init(Loader*, const Config& rootConfig)
+{
+    auto config = config_cd(rootConfig, "memory-accounting");
+    log_interval_ = std::chrono::seconds(
+        config_get(config, "log-interval-sec", 300));
+    log_top_ = config_get(config, "log-top", 5);
+    CHECK(log_interval_.count() >= 0) << "log-interval-sec must not be negative";
+
+    if (log_interval_.count() > 0) {
+        timer_ = TimerService::global().add(
+            "memory-accounting",
+            std::chrono::duration_cast<std::chrono::milliseconds>(log_interval_),
+            [this]() { log_report(); },
+            TimerService::priority::low);
+    }
+}
+
+void MemoryAccounting::startUp(Loader*)
+{
+    if (timer_) {
+        TimerService::global().start(timer_);
+    }
+}
+
+MemoryAccounting::~MemoryAccounting()
+{
+    if (timer_) {
+        TimerService::global().remove(timer_);
+    }
+}
+
+memory::Report MemoryAccounting::report() const
+{
+    return memory::Registry::global().collect();
+}
+
+void MemoryAccounting::log_report() const
+{
+    auto report = this->report();
+    auto total = report.total();
+
+    std::ostringstream apps;
+    for (const auto& app : largest(report.by_application(), log_top_)) {
+        apps << " " << app.first << "=" << app.second.bytes / 1024 << "kB";
+    }
+    std::ostringstream switches;
+    for (const auto& sw : largest(report.by_switch(), log_top_)) {
+        switches << " " << sw.first << "=" << sw.second.bytes / 1024 << "kB";
+    }
+
+    LOG(INFO) << "[MemoryAccounting] Accounted " << total.bytes / 1024
+              << " kB in " << total.items << " items of resident "
+              << memory::process_status_kb() << " kB;"
+              << " applications:" << apps.str()
+              << "; switches:" << switches.str();
+}
+
+} // namespace runos
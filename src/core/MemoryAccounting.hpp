@@ -0,0 +1,55 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "lib/memory_accounting.hpp"
+#include "lib/timer_service.hpp"
+
+#include <chrono>
+#include <cstddef>
+
+namespace runos {
+
+/**
+ * Reports memory held by applications and switches, as estimated by the
+ * probes applications register in memory::Registry, next to the
+ * resident set size of the process. The largest consumers are logged
+ * periodically, so a slow leak shows up before it exhausts the host.
+ */
+class MemoryAccounting final : public Application {
+    Q_OBJECT
+    SIMPLE_APPLICATION(MemoryAccounting, "memory-accounting")
+
+public:
+    void init(Loader* loader, const Config& config) override;
+    void startUp(Loader* loader) override;
+    ~MemoryAccounting();
+
+    memory::Report report() const;
+
+private:
+    std::chrono::seconds log_interval_ {300}; // 0 disables logging
+    size_t log_top_ {5};
+    TimerService::handle timer_;
+
+    void log_report() const;
+};
+
+} // namespace runos
@@ -0,0 +1,153 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "MemoryAccounting.hpp"
+#include "RestListener.hpp"
+
+#include <boost/lexical_cast.hpp>
+
+namespace runos {
+
+namespace {
+
+rest::ptree usage_tree(const memory::Usage& usage)
+{
+    rest::ptree pt;
+    pt.put("bytes", usage.bytes);
+    pt.put("items", usage.items);
+    return pt;
+}
+
+rest::ptree entries_tree(const memory::Report& report, uint64_t dpid)
+{
+    rest::ptree entries;
+    for (const auto& e : report.entries) {
+        if (dpid != 0 && e.dpid != dpid)
+            continue;
+        auto pt = usage_tree(e.usage);
+        pt.put("application", e.application);
+        pt.put("what", e.what);
+        pt.put("dpid", e.dpid);
+        entries.push_back(std::make_pair("", std::move(pt)));
+    }
+    return entries;
+}
+
+} // namespace
+
+struct MemoryResource : rest::resource
+{
+    MemoryAccounting* app;
+
+    explicit MemoryResource(MemoryAccounting* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override
+    {
+        auto report = app->report();
+
+        rest::ptree root;
+        root.add_child("total", usage_tree(report.total()));
+        root.put("rss_kb", memory::process_status_kb());
+        root.put("rss_peak_kb", memory::process_status_kb("VmHWM:"));
+
+        rest::ptree apps;
+        for (const auto& pair : report.by_application()) {
+            auto pt = usage_tree(pair.second);
+            pt.put("application", pair.first);
+            apps.push_back(std::make_pair("", std::move(pt)));
+        }
+        root.add_child("applications", apps);
+
+        rest::ptree switches;
+        for (const auto& pair : report.by_switch()) {
+            auto pt = usage_tree(pair.second);
+            pt.put("dpid", pair.first);
+            switches.push_back(std::make_pair("", std::move(pt)));
+        }
+        root.add_child("switches", switches);
+
+        root.add_child("array", entries_tree(report, 0));
+        root.put("_size", report.entries.size());
+        return root;
+    }
+};
+
+struct SwitchMemoryResource : rest::resource
+{
+    MemoryAccounting* app;
+    uint64_t dpid;
+
+    SwitchMemoryResource(MemoryAccounting* app, uint64_t dpid)
+        : app(app), dpid(dpid)
+    { }
+
+    rest::ptree Get() const override
+    {
+        auto report = app->report();
+        auto usage = report.by_switch();
+        auto it = usage.find(dpid);
+        if (it == usage.end()) {
+            THROW(rest::http_error(404), "No memory accounted to switch {}",
+                                         dpid);
+        }
+
+        rest::ptree root = usage_tree(it->second);
+        root.put("dpid", dpid);
+        auto entries = entries_tree(report, dpid);
+        root.put("_size", entries.size());
+        root.add_child("array", entries);
+        return root;
+    }
+};
+
+class MemoryAccountingRest : public Application
+{
+    SIMPLE_APPLICATION(MemoryAccountingRest, "memory-accounting-rest")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto rest_ = RestListener::get(loader);
+        auto app = MemoryAccounting::get(loader);
+
+        rest_->mount(path_spec("/memory/"), [=](const path_match&)
+        {
+            return MemoryResource { app };
+        });
+        rest_->mount(path_spec("/memory/switches/(\\d+)/"),
+                     [=](const path_match& m)
+        {
+            try {
+                auto dpid = boost::lexical_cast<uint64_t>(m[1].str());
+                return SwitchMemoryResource { app, dpid };
+            } catch (const boost::bad_lexical_cast&) {
+                THROW(rest::http_error(400), "Bad dpid: {}", m[1].str());
+            }
+        });
+    }
+};
+
+REGISTER_APPLICATION(MemoryAccountingRest,
+                     {"rest-listener", "memory-accounting", ""})
+
+} // namespace runos
@@ -0,0 +1,313 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "MulticastTrees.hpp"
+
+#include "SwitchManager.hpp"
+#include "api/OFAgent.hpp"
+#include "api/Switch.hpp"
+
+#include <runos/core/future.hpp>
+#include <runos/core/logging.hpp>
+
+#include <boost/thread/executors/inline_executor.hpp>
+
+namespace runos {
+
+REGISTER_APPLICATION(MulticastTrees, {"topology", "switch-manager", "switch-ordering", ""})
+
+static boost::inline_executor trees_executor;
+
+void MulticastTrees::init(Loader* loader, const Config& rootConfig)
+{
+    topology_ = Topology::get(loader);
+    switch_manager_ = SwitchManager::get(loader);
+
+    const Config& config = config_cd(rootConfig, "multicast-trees");
+    group_base_ = config_get(config, "group-id-base", 0x78000000);
+
+    connect(topology_, &Topology::linksChanged, this, &MulticastTrees::recompute);
+
+    SwitchOrderingManager::get(loader)->registerHandler(this, 30);
+}
+
+void MulticastTrees::graft(tree& t, Branches& branches, switch_and_port receiver,
+                           Touched* touched)
+{
+    if (receiver.dpid != t.source && not t.spt.count(receiver.dpid))
+        return; // unreachable for now
+
+    for (auto at = receiver; ; at = t.spt.at(at.dpid).first) {
+        bool created = not branches.count(at.dpid);
+        auto& ports = branches[at.dpid];
+        bool on_tree = not ports.empty() || at.dpid == t.source;
+        if (not ports.insert(at.port).second)
+            return;
+        if (touched)
+            touched->emplace_back(at.dpid, created);
+        if (on_tree)
+            return; // the rest of the way is there already
+    }
+}
+
+void MulticastTrees::prune(tree& t, Branches& branches, switch_and_port receiver,
+                           Touched* touched)
+{
+    for (auto at = receiver; ; ) {
+        // emptied switches keep their group, without buckets
+        auto it = branches.find(at.dpid);
+        if (it == branches.end() || it->second.erase(at.port) == 0)
+            return;
+        if (touched)
+            touched->emplace_back(at.dpid, false);
+        if (not it->second.empty() || at.dpid == t.source)
+            return; // serves other receivers
+        auto up = t.spt.find(at.dpid);
+        if (up == t.spt.end())
+            return;
+        at = up->second.first;
+    }
+}
+
+of13::GroupMod MulticastTrees::group_mod(uint16_t command, uint32_t id,
+                                         const std::set<uint32_t>& ports) const
+{
+    if (command == of13::OFPGC_DELETE)
+        return of13::GroupMod(0, command, of13::OFPGT_ALL, group_id(id));
+
+    std::vector<of13::Bucket> buckets;
+    for (auto port : ports) {
+        of13::Bucket bucket(0, of13::OFPP_ANY, of13::OFPG_ANY);
+        bucket.add_action(new of13::OutputAction(port, 0));
+        buckets.push_back(std::move(bucket));
+    }
+    return of13::GroupMod(0, command, of13::OFPGT_ALL, group_id(id), buckets);
+}
+
+void MulticastTrees::send(uint64_t dpid, std::vector<of13::GroupMod> mods)
+{
+    auto sw = switch_manager_->switch_(dpid);
+    auto conn = sw ? sw->connection() : nullptr;
+    if (not conn)
+        return; // installed by switchUp()
+
+    std::vector<fluid_msg::OFMsg*> msgs;
+    for (auto& mod : mods) {
+        msgs.push_back(&mod);
+    }
+    conn->agent()->mods(msgs).then(trees_executor, [dpid](future<void> f) {
+        try {
+            f.get();
+        } catch (OFAgent::error const&) {
+            // ADD of a group surviving a reconnect fails, MODIFY after it doesn't
+            VLOG(1) << "[MulticastTrees] Some group mods rejected by " << dpid;
+        }
+    });
+}
+
+void MulticastTrees::collect(uint32_t id, const Branches& branches,
+                             const Touched& touched,
+                             std::map<uint64_t, std::vector<of13::GroupMod>>& mods) const
+{
+    std::set<uint64_t> done;
+    for (const auto& it : touched) {
+        if (not done.insert(it.first).second)
+            continue;
+        const auto& ports = branches.at(it.first);
+        if (it.second)
+            mods[it.first].push_back(group_mod(of13::OFPGC_ADD, id, ports));
+        mods[it.first].push_back(group_mod(of13::OFPGC_MODIFY, id, ports));
+    }
+}
+
+uint32_t MulticastTrees::create(uint64_t source)
+{
+    if (not switch_manager_->switch_(source)) {
+        LOG(WARNING) << "[MulticastTrees] Unknown source switch " << source;
+        return 0;
+    }
+
+    auto spt = topology_->sourceTree(source);
+    uint32_t id;
+    std::set<uint32_t> none;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        id = ++last_id_;
+        auto& t = trees_[id];
+        t.source = source;
+        t.spt = std::move(spt);
+        // traffic is pointed to the group before anyone joins
+        t.branches[source];
+    }
+    send(source, { group_mod(of13::OFPGC_ADD, id, none),
+                   group_mod(of13::OFPGC_MODIFY, id, none) });
+    VLOG(1) << "[MulticastTrees] Created tree " << id << " from " << source;
+    return id;
+}
+
+void MulticastTrees::remove(uint32_t id)
+{
+    Branches current;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = trees_.find(id);
+        if (it == trees_.end())
+            return;
+        current = std::move(it->second.branches);
+        trees_.erase(it);
+    }
+    for (const auto& it : current) {
+        send(it.first, { group_mod(of13::OFPGC_DELETE, id, {}) });
+    }
+}
+
+bool MulticastTrees::join(uint32_t id, switch_and_port receiver)
+{
+    std::map<uint64_t, std::vector<of13::GroupMod>> mods;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = trees_.find(id);
+        if (it == trees_.end())
+            return false;
+        auto& t = it->second;
+        if (not t.receivers.insert(receiver).second)
+            return true;
+
+        Touched touched;
+        graft(t, t.branches, receiver, &touched);
+        collect(id, t.branches, touched, mods);
+    }
+    for (auto& it : mods) {
+        send(it.first, std::move(it.second));
+    }
+    return true;
+}
+
+bool MulticastTrees::leave(uint32_t id, switch_and_port receiver)
+{
+    std::map<uint64_t, std::vector<of13::GroupMod>> mods;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = trees_.find(id);
+        if (it == trees_.end())
+            return false;
+        auto& t = it->second;
+        if (t.receivers.erase(receiver) == 0)
+            return true;
+
+        Touched touched;
+        prune(t, t.branches, receiver, &touched);
+        collect(id, t.branches, touched, mods);
+    }
+    for (auto& it : mods) {
+        send(it.first, std::move(it.second));
+    }
+    return true;
+}
+
+Topology::Multipath MulticastTrees::installed(uint32_t id) const
+{
+    Topology::Multipath ret;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = trees_.find(id);
+    if (it == trees_.end())
+        return ret;
+    for (const auto& branch : it->second.branches) {
+        ret[branch.first].assign(branch.second.begin(), branch.second.end());
+    }
+    return ret;
+}
+
+void MulticastTrees::recompute()
+{
+    // one dijkstra per source, out of the lock: joins meanwhile are
+    // grafted again below
+    std::map<uint64_t, Topology::SourceTree> spts;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& it : trees_)
+            spts[it.second.source];
+    }
+    for (auto& it : spts) {
+        it.second = topology_->sourceTree(it.first);
+    }
+
+    std::map<uint64_t, std::vector<of13::GroupMod>> mods;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& it : trees_) {
+            auto& t = it.second;
+            auto spt = spts.find(t.source);
+            if (spt == spts.end())
+                continue; // created after the trees were computed
+            if (spt->second == t.spt)
+                continue;
+            t.spt = spt->second;
+
+            Branches next;
+            next[t.source];
+            for (const auto& receiver : t.receivers)
+                graft(t, next, receiver, nullptr);
+            for (const auto& branch : next) {
+                auto was = t.branches.find(branch.first);
+                if (was == t.branches.end()) {
+                    // switch joined the tree
+                    mods[branch.first].push_back(
+                        group_mod(of13::OFPGC_ADD, it.first, branch.second));
+                    mods[branch.first].push_back(
+                        group_mod(of13::OFPGC_MODIFY, it.first, branch.second));
+                } else if (was->second != branch.second) {
+                    mods[branch.first].push_back(
+                        group_mod(of13::OFPGC_MODIFY, it.first, branch.second));
+                }
+            }
+            for (const auto& branch : t.branches) {
+                if (not next.count(branch.first)) {
+                    // no receivers behind the switch anymore
+                    next[branch.first];
+                    if (not branch.second.empty())
+                        mods[branch.first].push_back(
+                            group_mod(of13::OFPGC_MODIFY, it.first, {}));
+                }
+            }
+            t.branches = std::move(next);
+        }
+    }
+
+    for (auto& it : mods) {
+        send(it.first, std::move(it.second));
+    }
+}
+
+void MulticastTrees::switchUp(SwitchPtr sw)
+{
+    std::vector<of13::GroupMod> mods;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& t : trees_) {
+            auto it = t.second.branches.find(sw->dpid());
+            if (it == t.second.branches.end())
+                continue;
+            mods.push_back(group_mod(of13::OFPGC_ADD, t.first, it->second));
+            mods.push_back(group_mod(of13::OFPGC_MODIFY, t.first, it->second));
+        }
+    }
+    if (not mods.empty())
+        send(sw->dpid(), std::move(mods));
+}
+
+} // namespace runos
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "SwitchOrdering.hpp"
+#include "Topology.hpp"
+
+#include <fluid/of13msg.hh>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace runos {
+
+namespace of13 = fluid_msg::of13;
+
+/**
+ * Distribution trees for ServiceFlag::MCast traffic, installed as
+ * OpenFlow ALL groups instead of a Topology route per receiver.
+ *
+ * A tree is the shortest-path tree from the source switch pruned to
+ * the switches leading to its receivers, so a group with hundreds of
+ * receivers costs one dijkstra and replicates packets only at branch
+ * points. Receivers are egress ports (host ports usually); joining one
+ * grafts its path up to the first switch already on the tree, leaving
+ * prunes the branch back to the nearest switch still serving someone.
+ * Only the switches whose buckets changed get a group mod.
+ *
+ * Trees are recomputed when links or maintenance change. Applications
+ * point the traffic of the group to group_id() on the source switch;
+ * every switch of the tree has the group with a bucket per branch.
+ */
+class MulticastTrees final : public Application
+                           , public SwitchEventHandler
+{
+    Q_OBJECT
+    SIMPLE_APPLICATION(MulticastTrees, "multicast-trees")
+
+public:
+    void init(Loader* loader, const Config& config) override;
+
+    // Returns the tree id, or 0 if the source switch is unknown
+    uint32_t create(uint64_t source);
+    // Deletes the groups, together with flows using them
+    void remove(uint32_t id);
+
+    // Receivers unreachable from the source are kept and grafted once
+    // they become reachable. False if there is no such tree.
+    bool join(uint32_t id, switch_and_port receiver);
+    bool leave(uint32_t id, switch_and_port receiver);
+
+    uint32_t group_id(uint32_t id) const { return group_base_ + id; }
+    // Output ports of installed buckets per switch
+    Topology::Multipath installed(uint32_t id) const;
+
+protected:
+    void switchUp(SwitchPtr sw) override;
+
+private:
+    using Branches = std::map<uint64_t, std::set<uint32_t>>;
+
+    struct tree {
+        uint64_t source;
+        Topology::SourceTree spt;
+        std::set<switch_and_port> receivers;
+        Branches branches; // as installed
+    };
+
+    Topology* topology_ {nullptr};
+    class SwitchManager* switch_manager_ {nullptr};
+    uint32_t group_base_ {0};
+
+    mutable std::mutex mutex_;
+    uint32_t last_id_ {0};
+    std::unordered_map<uint32_t, tree> trees_;
+
+    // (switch, group created) per changed bucket list
+    using Touched = std::vector<std::pair<uint64_t, bool>>;
+
+    static void graft(tree& t, Branches& branches, switch_and_port receiver,
+                      Touched* touched);
+    static void prune(tree& t, Branches& branches, switch_and_port receiver,
+                      Touched* touched);
+    of13::GroupMod group_mod(uint16_t command, uint32_t id,
+                             const std::set<uint32_t>& ports) const;
+    void collect(uint32_t id, const Branches& branches, const Touched& touched,
+                 std::map<uint64_t, std::vector<of13::GroupMod>>& mods) const;
+    void send(uint64_t dpid, std::vector<of13::GroupMod> mods);
+    void recompute();
+};
+
+} // namespace runos
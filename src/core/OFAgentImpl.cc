@@ -15,6 +15,14 @@
  */
  
 #include "OFAgentImpl.hpp"
+#include "lib/flow_mod_batch.hpp"
+#include "lib/metrics.hpp"
+#include "lib/timer_wheel.hpp"
+
+#include <runos/core/demangle.hpp>
+
+#include <boost/mpl/for_each.hpp>
+#include <boost/thread/executors/inline_executor.hpp>
 
 #include <utility>
 #include <algorithm>
@@ -22,8 +30,39 @@
 
 namespace runos {
 
+// runs stream_flow_stats() completion right where the session fails
+static boost::inline_executor stream_executor;
+
+std::atomic<int64_t> OFAgentImpl::port_stats_ttl_ms_ {0};
+std::atomic<int64_t> OFAgentImpl::flow_stats_ttl_ms_ {0};
+std::atomic<bool> OFAgentImpl::flow_stats_per_table_ {false};
+latency_tracker::settings OFAgentImpl::latency_settings_;
+
+void OFAgentImpl::set_reply_ttl(std::chrono::milliseconds port_stats,
+                                std::chrono::milliseconds flow_stats)
+{
+    port_stats_ttl_ms_ = port_stats.count();
+    flow_stats_ttl_ms_ = flow_stats.count();
+}
+
+void OFAgentImpl::set_flow_stats_per_table(bool enabled)
+{
+    flow_stats_per_table_ = enabled;
+}
+
+// Requests with a match are not shared: comparing them isn't worth it
+static std::optional<std::string> flow_stats_key(ofp::flow_stats_request const& r)
+{
+    if (r.match.oxm_fields_len() != 0)
+        return std::nullopt;
+    return std::to_string(r.table_id) + ':' + std::to_string(r.out_port)
+         + ':' + std::to_string(r.out_group) + ':' + std::to_string(r.cookie)
+         + ':' + std::to_string(r.cookie_mask);
+}
+
 class OFAgentImpl::SendHandler
     : public OFConnection::SendHookHandler<of13::BarrierRequest>
+    , public OFConnection::SendHookHandler<of13::FlowMod>
 {
 public:
     explicit SendHandler(OFAgentImpl* agent)
@@ -32,7 +71,17 @@ public:
 
     void process(of13::BarrierRequest& br) {
         boost::unique_lock<boost::shared_mutex> wlock(self->tasks_mutex_);
-        self->tasks_.emplace_back(barrier_session(br.xid()));
+        self->push_task(barrier_session(br.xid()));
+    }
+
+    // Flow stats sent before the change must not be shared after it
+    void process(of13::FlowMod& fm) {
+        self->flow_stats_flights_.invalidate();
+        if (fm.table_id() == of13::OFPTT_ALL)
+            self->table_snapshots_.invalidate();
+        else
+            self->table_snapshots_.invalidate(std::to_string(fm.table_id()));
+        self->occupancy_.on_flow_mod(fm.table_id(), fm.command());
     }
 private:
     OFAgentImpl* self;
@@ -45,6 +94,20 @@ void set_value(Session& session, T&& value)
     session.value_set = true;
 }
 
+// Multipart getters hand out a fresh vector per segment, so the
+// records are moved into the session instead of copied once more.
+// Single-segment replies (the common case) adopt the storage as is.
+template<class T>
+void append_segment(std::vector<T>& ret, std::vector<T>&& segment)
+{
+    if (ret.empty()) {
+        ret = std::move(segment);
+        return;
+    }
+    ret.reserve(ret.size() + segment.size());
+    std::move(segment.begin(), segment.end(), std::back_inserter(ret));
+}
+
 class OFAgentImpl::RecvHandler
     : public OFConnection::ReceiveHandler<of13::Error>
     , public OFConnection::ReceiveHandler<of13::RoleReply>
@@ -70,6 +133,15 @@ public:
 
     void process(of13::Error& e) override
     {
+        // data starts with the refused ofp_flow_mod
+        if (e.err_type() == of13::OFPET_FLOW_MOD_FAILED &&
+            e.code() == of13::OFPFMFC_TABLE_FULL && e.data_len() > 24) {
+            self->occupancy_.on_table_full(e.data()[24]);
+        }
+
+        if (self->on_bulk_error(e))
+            return;
+
         auto visitor = OFAgentImpl::make_set_exception_visitor(
                     openflow_error(self->dpid(), e.xid(), e.type(), e.code()));
         try {
@@ -127,8 +199,7 @@ public:
         self->on_response(pd.xid(),
             [&](port_desc_seq_session& session) {
                 auto& ret = session.ret;
-                std::copy(ports.begin(), ports.end(),
-                          std::back_inserter(ret));
+                append_segment(ret, std::move(ports));
                 if (not more) {
                     set_value(session, std::move(ret));
                 }
@@ -153,8 +224,7 @@ public:
             },
             [&](port_stat_seq_session& session) {
                 auto& ret = session.ret;
-                std::copy(stats.begin(), stats.end(),
-                          std::back_inserter(ret));
+                append_segment(ret, std::move(stats));
                 if (not more) {
                     set_value(session, std::move(ret));
                 }
@@ -179,8 +249,7 @@ public:
             },
             [&](queue_stat_seq_session& session) {
                 auto& ret = session.ret;
-                std::copy(stats.begin(), stats.end(),
-                          std::back_inserter(ret));
+                append_segment(ret, std::move(stats));
                 if (not more) {
                     set_value(session, std::move(ret));
                 }
@@ -193,16 +262,43 @@ public:
         bool more = fs.flags() & of13::OFPMPF_REQ_MORE;
         auto stats = fs.flow_stats();
 
+        std::shared_ptr<flow_stat_stream> stream;
         self->on_response(fs.xid(),
             [&](flow_stat_seq_session& session) {
+                if (session.stream) {
+                    stream = session.stream;
+                    if (not more) {
+                        set_value(session, sequence<of13::FlowStats>{});
+                    }
+                    return;
+                }
                 auto& ret = session.ret;
-                std::copy(stats.begin(), stats.end(),
-                          std::back_inserter(ret));
+                append_segment(ret, std::move(stats));
                 if (not more) {
                     set_value(session, std::move(ret));
                 }
             }
         );
+
+        if (not stream)
+            return;
+
+        // receive path of one connection is sequential,
+        // so `stopped` and `count` need no locking
+        if (not stream->stopped) {
+            stream->count += stats.size();
+            try {
+                stream->stopped = not stream->handler(std::move(stats));
+            } catch (...) {
+                stream->stopped = true;
+                if (not stream->finished.exchange(true))
+                    stream->done.set_exception(boost::current_exception());
+                return;
+            }
+        }
+        if (not more && not stream->finished.exchange(true)) {
+            stream->done.set_value(stream->count);
+        }
     }
 
     void process(of13::MultipartReplyAggregate& as) override
@@ -242,8 +338,7 @@ public:
             },
             [&](group_stat_seq_session& session) {
                 auto& ret = session.ret;
-                std::copy(stats.begin(), stats.end(),
-                          std::back_inserter(ret));
+                append_segment(ret, std::move(stats));
                 if (not more) {
                     set_value(session, std::move(ret));
                 }
@@ -260,8 +355,7 @@ public:
         self->on_response(gd.xid(),
             [&](group_desc_seq_session& session) {
                 auto& ret = session.ret;
-                std::copy(desc.begin(), desc.end(),
-                          std::back_inserter(ret));
+                append_segment(ret, std::move(desc));
                 if (not more) {
                     set_value(session, std::move(ret));
                 }
@@ -277,8 +371,7 @@ public:
         self->on_response(ts.xid(),
             [&](table_stat_seq_session& session) {
                 auto& ret = session.ret;
-                std::copy(stats.begin(), stats.end(),
-                          std::back_inserter(ret));
+                append_segment(ret, std::move(stats));
                 if (not more) {
                     set_value(session, std::move(ret));
                 }
@@ -304,8 +397,7 @@ public:
             },
             [&](meter_stat_seq_session& session) {
                 auto& ret = session.ret;
-                std::copy(stats.begin(), stats.end(),
-                          std::back_inserter(ret));
+                append_segment(ret, std::move(stats));
                 if (not more) {
                     set_value(session, std::move(ret));
                 }
@@ -321,8 +413,7 @@ public:
         self->on_response(mc.xid(),
             [&](meter_config_seq_session& session) {
                 auto& ret = session.ret;
-                std::copy(conf.begin(), conf.end(),
-                          std::back_inserter(ret));
+                append_segment(ret, std::move(conf));
                 if (not more) {
                     set_value(session, std::move(ret));
                 }
@@ -356,19 +447,259 @@ OFAgentImpl::OFAgentImpl(OFConnection* conn)
     , send_hook_handler_(new SendHandler(this))
     , recv_handler_(new RecvHandler(this))
 {
+    tasks_index_.reserve(tasks_index_reserve);
     conn_->send_hook(send_hook_handler_);
     conn_->receive(recv_handler_);
 }
 
+auto OFAgentImpl::find_bulk(uint32_t xid)
+    -> session_list::iterator
+{
+    auto it = bulk_index_.upper_bound(xid);
+    if (it == bulk_index_.begin())
+        return tasks_.end();
+    --it;
+    auto& barrier = boost::get<barrier_session>(*it->second);
+    return xid < barrier.xid ? it->second : tasks_.end();
+}
+
+bool OFAgentImpl::on_bulk_error(of13::Error& e)
+{
+    boost::unique_lock<boost::shared_mutex> wlock(tasks_mutex_);
+    if (bulk_index_.empty())
+        return false;
+
+    auto it = find_bulk(e.xid());
+    if (it == tasks_.end())
+        return false;
+
+    auto& barrier = boost::get<barrier_session>(*it);
+    barrier.failures.push_back(bulk_error::failure{
+        e.xid() - barrier.first_xid, e.xid(), e.err_type(), e.code()
+    });
+    return true;
+}
+
 auto OFAgentImpl::find_task(uint32_t xid)
     -> session_list::iterator
 {
     if (xid < minimal_xid) {
         return tasks_.end();
     }
-    return std::find_if(tasks_.begin(), tasks_.end(), [=](session const& s) {
-        return boost::polymorphic_get<session_base>(s).xid == xid;
-    });
+    auto it = tasks_index_.find(xid);
+    return it != tasks_index_.end() ? it->second : tasks_.end();
+}
+
+std::array<std::atomic<int64_t>, OFAgentImpl::session_types>
+    OFAgentImpl::request_timeout_ms_ {};
+
+void OFAgentImpl::set_request_timeouts(
+    std::map<std::string, std::chrono::milliseconds> const& timeouts)
+{
+    auto default_it = timeouts.find("default");
+    auto& names = session_names();
+    for (size_t i = 0; i < session_types; ++i) {
+        auto it = timeouts.find(names[i]);
+        auto ms = it != timeouts.end() ? it->second
+                : default_it != timeouts.end() ? default_it->second
+                : std::chrono::milliseconds(0);
+        request_timeout_ms_[i] = ms.count();
+    }
+}
+
+struct session_timer {
+    std::weak_ptr<OFAgentImpl> agent;
+    uint32_t xid;
+};
+
+// One wheel for all switches, 10ms resolution is plenty for timeouts
+static timer_wheel<session_timer>& session_timeouts()
+{
+    static timer_wheel<session_timer> wheel(std::chrono::milliseconds(10),
+        [](session_timer& t) {
+            if (auto agent = t.agent.lock())
+                agent->expire(t.xid);
+        });
+    return wheel;
+}
+
+// Must be called with tasks_mutex_ held exclusively
+void OFAgentImpl::push_task(session&& s)
+{
+    auto& base = boost::polymorphic_get<session_base>(s);
+    auto xid = base.xid;
+    auto timeout = base.waiting_for_response
+                 ? request_timeout_ms_[s.which()].load() : 0;
+
+    auto it = tasks_.insert(tasks_.end(), std::move(s));
+    // Barrier sent by barrier() is seen twice (request + send hook),
+    // keep the first one to match the old linear search.
+    bool indexed = tasks_index_.emplace(xid, it).second;
+
+    if (indexed && timeout > 0) {
+        if (weak_self_.expired()) {
+            weak_self_ = std::static_pointer_cast<OFAgentImpl>(conn_->agent());
+        }
+        session_timeouts().schedule(std::chrono::milliseconds(timeout),
+                                    session_timer{ weak_self_, xid });
+    }
+}
+
+void OFAgentImpl::expire(uint32_t xid)
+{
+    boost::unique_lock<boost::shared_mutex> wlock(tasks_mutex_);
+
+    auto it = find_task(xid);
+    if (it == tasks_.end())
+        return; // replied in time
+
+    auto& session = boost::polymorphic_get<session_base>(*it);
+    if (session.value_set || not session.waiting_for_response)
+        return;
+
+    auto& name = session_names()[it->which()];
+    metrics::Registry::global().counter(
+        "runos_ofagent_timeouts_total",
+        "OFAgent requests failed because the switch didn't reply",
+        {{"request", name}}).add();
+    VLOG(3) << "[OFAgent] No reply to " << name << " request xid=" << xid
+            << " from switch dpid=" << dpid();
+
+    set_exception(*it, not_responded(dpid(), xid));
+    erase_task(it);
+}
+
+// Must be called with tasks_mutex_ held exclusively
+void OFAgentImpl::erase_task(session_list::iterator it)
+{
+    auto xid = boost::polymorphic_get<session_base>(*it).xid;
+    auto index_it = tasks_index_.find(xid);
+    if (index_it != tasks_index_.end() && index_it->second == it) {
+        tasks_index_.erase(index_it);
+    }
+    if (auto barrier = boost::get<barrier_session>(&*it)) {
+        auto bulk_it = bulk_index_.find(barrier->first_xid);
+        if (barrier->first_xid != 0 && bulk_it != bulk_index_.end() &&
+            bulk_it->second == it) {
+            bulk_index_.erase(bulk_it);
+        }
+    }
+    tasks_.erase(it);
+}
+
+// "runos::OFAgentImpl::port_stat_session" -> "port_stat"
+static std::string session_label(std::string name)
+{
+    auto pos = name.rfind("::");
+    if (pos != std::string::npos)
+        name.erase(0, pos + 2);
+    static const std::string suffix = "_session";
+    if (name.size() > suffix.size() &&
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+        name.erase(name.size() - suffix.size());
+    return name;
+}
+
+auto OFAgentImpl::session_names() -> const std::vector<std::string>&
+{
+    static const std::vector<std::string> ret = []() {
+        std::vector<std::string> names;
+        boost::mpl::for_each<session::types,
+                             boost::mpl::make_identity<boost::mpl::_1>>(
+            [&](auto id) {
+                using Session = typename decltype(id)::type;
+                names.push_back(
+                    session_label(demangle(typeid(Session).name())));
+            });
+        return names;
+    }();
+    return ret;
+}
+
+void OFAgentImpl::set_latency_settings(latency_tracker::settings settings)
+{
+    latency_settings_ = settings;
+}
+
+void OFAgentImpl::record_rtt(session const& s)
+{
+    auto now = std::chrono::steady_clock::now();
+    auto rtt = now - boost::polymorphic_get<session_base>(s).sent_at;
+    size_t i = s.which();
+
+    latency_[i].record(rtt, now, latency_settings_);
+
+    auto histogram = rtt_histograms_[i].load(std::memory_order_acquire);
+    if (not histogram) {
+        histogram = &metrics::Registry::global().histogram(
+            "runos_ofagent_request_seconds",
+            "Time from an OFAgent request to the switch reply",
+            {{"dpid", std::to_string(dpid())},
+             {"request", session_names()[i]}});
+        rtt_histograms_[i].store(histogram, std::memory_order_release);
+    }
+    histogram->record(rtt);
+}
+
+double OFAgentImpl::slowdown() const
+{
+    // A growing table slows down its own dumps, not the switch:
+    // only a slowdown seen by every active request type counts
+    auto now = std::chrono::steady_clock::now();
+    double ret = 0.0;
+    for (auto& tracker : latency_) {
+        if (not tracker.active(now, latency_settings_))
+            continue;
+        double s = tracker.slowdown(now, latency_settings_);
+        ret = ret == 0.0 ? s : std::min(ret, s);
+    }
+    return ret == 0.0 ? 1.0 : ret;
+}
+
+void OFAgentImpl::set_bundle_support(bool supported)
+{
+    bundles_ = supported ? bundles_supported : bundles_unsupported;
+}
+
+size_t OFAgentImpl::pending() const
+{
+    boost::shared_lock<boost::shared_mutex> rlock(tasks_mutex_);
+    return tasks_.size();
+}
+
+memory::Usage OFAgentImpl::memory_usage() const
+{
+    boost::shared_lock<boost::shared_mutex> rlock(tasks_mutex_);
+    auto ret = memory::footprint(tasks_);
+    ret.bytes += memory::footprint(tasks_index_).bytes;
+    ret.bytes += memory::footprint(bulk_index_).bytes;
+    return ret;
+}
+
+auto OFAgentImpl::latency() const -> latency_info
+{
+    latency_info ret;
+    ret.slowdown = slowdown();
+
+    auto& names = session_names();
+    for (size_t i = 0; i < session_types; ++i) {
+        auto& tracker = latency_[i];
+        if (tracker.samples() == 0)
+            continue;
+
+        latency_info::request r;
+        r.name = names[i];
+        r.replies = tracker.samples();
+        r.recent = tracker.recent();
+        r.baseline = tracker.baseline();
+        auto histogram = rtt_histograms_[i].load(std::memory_order_acquire);
+        r.p50 = std::chrono::nanoseconds(histogram ? histogram->quantile(0.5)
+                                                   : 0);
+        r.p99 = std::chrono::nanoseconds(histogram ? histogram->quantile(0.99)
+                                                   : 0);
+        ret.requests.push_back(std::move(r));
+    }
+    return ret;
 }
 
 void OFAgentImpl::pop_tasks_until(uint32_t xid)
@@ -377,12 +708,10 @@ void OFAgentImpl::pop_tasks_until(uint32_t xid)
 
     auto begin = tasks_.begin();
     auto end = tasks_.end();
-    auto barrier_it = std::find_if(begin, end, [=](session const& s) {
-        return boost::polymorphic_get<session_base>(s).xid == xid &&
-               boost::get<barrier_session>(&s) != nullptr;
-    });
+    auto barrier_it = find_task(xid);
 
-    if (barrier_it == end) {
+    if (barrier_it == end or
+        boost::get<barrier_session>(&*barrier_it) == nullptr) {
         return;
     }
 
@@ -395,9 +724,36 @@ void OFAgentImpl::pop_tasks_until(uint32_t xid)
         }
     }
 
-    boost::get<barrier_session>(*barrier_it).promise_.set_value();
+    auto& barrier = boost::get<barrier_session>(*barrier_it);
+    record_rtt(*barrier_it);
+    if (barrier.failures.empty()) {
+        barrier.promise_.set_value();
+    } else {
+        set_exception(barrier,
+            bulk_error(dpid(), barrier.xid, std::move(barrier.failures)));
+    }
     boost::upgrade_to_unique_lock<boost::shared_mutex> wlock(rlock);
-    tasks_.erase(begin, ++barrier_it);
+    for (auto it = begin, last = std::next(barrier_it); it != last; ) {
+        erase_task(it++);
+    }
+}
+
+// Periodic requests with fixed contents, packed once for all switches
+static const OFMessageTemplate& barrier_template()
+{
+    static const OFMessageTemplate ret{ of13::BarrierRequest() };
+    return ret;
+}
+
+static const OFMessageTemplate& port_stats_template()
+{
+    static const OFMessageTemplate ret = [] {
+        of13::MultipartRequestPortStats req;
+        req.flags(0);
+        req.port_no(of13::OFPP_ANY);
+        return OFMessageTemplate(req);
+    }();
+    return ret;
 }
 
 auto OFAgentImpl::request_config()
@@ -416,6 +772,19 @@ auto OFAgentImpl::set_config(ofp::switch_config config)
     return request<no_respond_session>(req);
 }
 
+auto OFAgentImpl::set_async(ofp::async_config config)
+    -> future< void >
+{
+    of13::SetAsync req;
+    req.master_packet_in_mask(config.packet_in_mask[0]);
+    req.slave_packet_in_mask(config.packet_in_mask[1]);
+    req.master_port_status_mask(config.port_status_mask[0]);
+    req.slave_port_status_mask(config.port_status_mask[1]);
+    req.master_flow_removed_mask(config.flow_removed_mask[0]);
+    req.slave_flow_removed_mask(config.flow_removed_mask[1]);
+    return request<no_respond_session>(req);
+}
+
 auto OFAgentImpl::request_switch_desc()
     -> future< fluid_msg::SwitchDesc >
 {
@@ -446,21 +815,23 @@ auto OFAgentImpl::request_port_stats(uint32_t port_no)
 {
     THROW_IF(port_no == of13::OFPP_ANY, invalid_argument());
 
-    of13::MultipartRequestPortStats req;
-    req.flags(0);
-    req.port_no(port_no);
+    std::chrono::milliseconds ttl(port_stats_ttl_ms_.load());
+    return port_stat_flights_.join(std::to_string(port_no), ttl, [&] {
+        of13::MultipartRequestPortStats req;
+        req.flags(0);
+        req.port_no(port_no);
 
-    return request<port_stat_session>(req);
+        return request<port_stat_session>(req);
+    });
 }
 
 auto OFAgentImpl::request_port_stats() 
     -> future< sequence<of13::PortStats> >
 {
-    of13::MultipartRequestPortStats req;
-    req.flags(0);
-    req.port_no(of13::OFPP_ANY);
-
-    return request<port_stat_seq_session>(req);
+    std::chrono::milliseconds ttl(port_stats_ttl_ms_.load());
+    return port_stats_flights_.join("all", ttl, [&] {
+        return request_prepared<port_stat_seq_session>(port_stats_template());
+    });
 }
 
 auto OFAgentImpl::request_queue_stats(uint32_t port_no, uint32_t queue_id)
@@ -504,6 +875,55 @@ auto OFAgentImpl::request_queue_stats()
 auto OFAgentImpl::request_flow_stats(ofp::flow_stats_request r)
     -> future< sequence<of13::FlowStats> >
 {
+    auto issue = [&] {
+        if (r.table_id == of13::OFPTT_ALL && flow_stats_per_table_)
+            return request_flow_stats_per_table(std::move(r));
+
+        of13::MultipartRequestFlow req;
+        req.flags(0);
+        req.table_id(r.table_id);
+        req.out_port(r.out_port);
+        req.out_group(r.out_group);
+        req.cookie(r.cookie);
+        req.cookie_mask(r.cookie_mask);
+        req.match(std::move(r.match));
+
+        return request<flow_stat_seq_session>(req);
+    };
+
+    auto key = flow_stats_key(r);
+    if (not key)
+        return issue();
+
+    std::chrono::milliseconds ttl(flow_stats_ttl_ms_.load());
+    return flow_stats_flights_.join(*key, ttl, issue);
+}
+
+auto OFAgentImpl::stream_flow_stats(ofp::flow_stats_request r,
+                                    flow_stats_handler handler)
+    -> future< size_t >
+{
+    // Replay a shared full reply as one segment instead of asking the
+    // switch again. Streams never start a shared request themselves,
+    // that would buffer the whole table.
+    if (auto key = flow_stats_key(r)) {
+        std::chrono::milliseconds ttl(flow_stats_ttl_ms_.load());
+        if (auto reply = flow_stats_flights_.find(*key, ttl)) {
+            return reply->then(stream_executor,
+                [handler = std::move(handler)]
+                (shared_future< sequence<of13::FlowStats> > f) {
+                    auto stats = f.get();
+                    size_t count = stats.size();
+                    if (count > 0)
+                        handler(std::move(stats));
+                    return count;
+                });
+        }
+    }
+
+    if (r.table_id == of13::OFPTT_ALL && flow_stats_per_table_)
+        return stream_flow_stats_per_table(std::move(r), std::move(handler));
+
     of13::MultipartRequestFlow req;
     req.flags(0);
     req.table_id(r.table_id);
@@ -513,7 +933,153 @@ auto OFAgentImpl::request_flow_stats(ofp::flow_stats_request r)
     req.cookie_mask(r.cookie_mask);
     req.match(std::move(r.match));
 
-    return request<flow_stat_seq_session>(req);
+    auto stream = std::make_shared<flow_stat_stream>();
+    stream->handler = std::move(handler);
+    auto ret = stream->done.get_future();
+
+    auto fut = request<flow_stat_seq_session>(req,
+        [stream](flow_stat_seq_session& session) { session.stream = stream; });
+
+    // session failures (errors, disconnect) are forwarded to the stream,
+    // success is reported by the receive path after the last segment
+    fut.then(stream_executor,
+        [stream](future< sequence<of13::FlowStats> > f) {
+            if (f.has_exception() && not stream->finished.exchange(true)) {
+                stream->done.set_exception(f.get_exception_ptr());
+            }
+        });
+
+    return ret;
+}
+
+auto OFAgentImpl::active_tables()
+    -> future< std::vector<uint8_t> >
+{
+    return request_table_stats().then(stream_executor,
+        [](future< sequence<of13::TableStats> > f) {
+            std::vector<uint8_t> ret;
+            for (auto& table : f.get()) {
+                if (table.active_count() > 0)
+                    ret.push_back(table.table_id());
+            }
+            return ret;
+        });
+}
+
+auto OFAgentImpl::request_flow_stats_per_table(ofp::flow_stats_request r)
+    -> future< sequence<of13::FlowStats> >
+{
+    uint64_t dpid = this->dpid();
+    std::weak_ptr<OFAgentImpl> weak =
+        std::static_pointer_cast<OFAgentImpl>(conn_->agent());
+    return active_tables().then(stream_executor,
+        [weak, dpid, r](future< std::vector<uint8_t> > f) {
+            auto tables = f.get();
+            // Requests can't be sent from here, this continuation runs
+            // under tasks_mutex_
+            return boost::async(boost::launch::async, [weak, dpid, r, tables]() {
+                std::vector< future< sequence<of13::FlowStats> > > parts;
+                {
+                    auto self = weak.lock();
+                    THROW_IF(not self, request_error(dpid, 0),
+                             "Switch has gone before its tables were asked");
+                    for (auto table : tables) {
+                        auto req = r;
+                        req.table_id = table;
+                        parts.push_back(self->request_flow_stats(std::move(req)));
+                    }
+                }
+
+                sequence<of13::FlowStats> ret;
+                for (auto& part : parts) {
+                    auto stats = part.get();
+                    ret.insert(ret.end(),
+                               std::make_move_iterator(stats.begin()),
+                               std::make_move_iterator(stats.end()));
+                }
+                return ret;
+            });
+        }).unwrap();
+}
+
+auto OFAgentImpl::stream_flow_stats_per_table(ofp::flow_stats_request r,
+                                              flow_stats_handler handler)
+    -> future< size_t >
+{
+    // Segments of the tables arrive interleaved, the handler gets them
+    // one at a time and stops all tables once it returns false
+    struct merged_stream {
+        std::mutex mutex;
+        flow_stats_handler handler;
+        std::atomic<bool> stopped {false};
+    };
+    auto merged = std::make_shared<merged_stream>();
+    merged->handler = std::move(handler);
+
+    uint64_t dpid = this->dpid();
+    std::weak_ptr<OFAgentImpl> weak =
+        std::static_pointer_cast<OFAgentImpl>(conn_->agent());
+    return active_tables().then(stream_executor,
+        [weak, dpid, r, merged](future< std::vector<uint8_t> > f) {
+            auto tables = f.get();
+            // Requests can't be sent from here, this continuation runs
+            // under tasks_mutex_
+            return boost::async(boost::launch::async,
+                                [weak, dpid, r, merged, tables]() {
+                auto segment = [merged](sequence<of13::FlowStats>&& stats) {
+                    if (merged->stopped)
+                        return false;
+                    std::lock_guard<std::mutex> lock(merged->mutex);
+                    if (merged->stopped || not merged->handler(std::move(stats))) {
+                        merged->stopped = true;
+                        return false;
+                    }
+                    return true;
+                };
+
+                std::vector< future<size_t> > parts;
+                {
+                    auto self = weak.lock();
+                    THROW_IF(not self, request_error(dpid, 0),
+                             "Switch has gone before its tables were asked");
+                    for (auto table : tables) {
+                        auto req = r;
+                        req.table_id = table;
+                        parts.push_back(
+                            self->stream_flow_stats(std::move(req), segment));
+                    }
+                }
+
+                size_t count = 0;
+                for (auto& part : parts) {
+                    count += part.get();
+                }
+                return count;
+            });
+        }).unwrap();
+}
+
+auto OFAgentImpl::request_table_snapshot(uint8_t table_id,
+                                         std::chrono::milliseconds max_age)
+    -> future< ofp::table_snapshot >
+{
+    return table_snapshots_.join(std::to_string(table_id), max_age, [&] {
+        of13::MultipartRequestFlow req;
+        req.flags(0);
+        req.table_id(table_id);
+        req.out_port(of13::OFPP_ANY);
+        req.out_group(of13::OFPG_ANY);
+        req.cookie(0);
+        req.cookie_mask(0);
+
+        return request<flow_stat_seq_session>(req).then(stream_executor,
+            [](future< sequence<of13::FlowStats> > f) {
+                ofp::table_snapshot ret;
+                ret.entries = f.get();
+                ret.taken = std::chrono::steady_clock::now();
+                return ret;
+            });
+    });
 }
 
 auto OFAgentImpl::request_aggregate(ofp::flow_stats_request r)
@@ -533,6 +1099,29 @@ auto OFAgentImpl::request_aggregate(ofp::flow_stats_request r)
     return request<flow_aggregate_session>(req);
 }
 
+auto OFAgentImpl::prepare_aggregate(ofp::flow_stats_request r) const
+    -> prepared_request
+{
+    of13::MultipartRequestAggregate req{
+        0, // xid
+        0, // flags
+        r.table_id,
+        r.out_port,
+        r.out_group,
+        r.cookie,
+        r.cookie_mask,
+        std::move(r.match)
+    };
+
+    return std::make_shared<const OFMessageTemplate>(req);
+}
+
+auto OFAgentImpl::request_aggregate(prepared_request const& r)
+    -> future< ofp::aggregate_stats >
+{
+    return request_prepared<flow_aggregate_session>(*r);
+}
+
 auto OFAgentImpl::request_group_desc()
     -> future< sequence<of13::GroupDesc> >
 {
@@ -618,6 +1207,293 @@ auto OFAgentImpl::flow_mod(of13::FlowMod &flow_mod)
     return request<no_respond_session>(flow_mod);
 }
 
+auto OFAgentImpl::flow_mods(sequence<of13::FlowMod>& flow_mods)
+    -> future<void>
+{
+    sequence<fluid_msg::OFMsg*> msgs;
+    msgs.reserve(flow_mods.size());
+    for (auto& fm : flow_mods) {
+        msgs.push_back(&fm);
+    }
+    return mods(msgs);
+}
+
+auto OFAgentImpl::mods(const sequence<fluid_msg::OFMsg*>& msgs)
+    -> future<void>
+{
+    if (msgs.empty()) {
+        return barrier();
+    }
+
+    // Batch takes [first_xid, barrier_xid) range, barrier closes it
+    uint32_t n = msgs.size();
+    uint32_t first_xid = next_xid_.fetch_add(n + 1);
+
+    size_t total = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        msgs[i]->xid(first_xid + i);
+        total += msgs[i]->length();
+    }
+
+    std::vector<uint8_t> buf;
+    buf.reserve(total);
+    for (auto msg : msgs) {
+        auto deleter = &fluid_msg::OFMsg::free_buffer;
+        std::unique_ptr<uint8_t[], decltype(deleter)> packed
+            { msg->pack(), deleter };
+        buf.insert(buf.end(), packed.get(), packed.get() + msg->length());
+    }
+    occupancy_.on_sent(buf.data(), buf.size());
+
+    return send_bulk(first_xid, n, buf.data(), buf.size());
+}
+
+auto OFAgentImpl::flow_mods(FlowModBatch& batch)
+    -> future<void>
+{
+    if (batch.empty()) {
+        return barrier();
+    }
+
+    uint32_t n = batch.size();
+    uint32_t first_xid = next_xid_.fetch_add(n + 1);
+    batch.set_xids(first_xid);
+    occupancy_.on_sent(batch.data(), batch.bytes());
+    return send_bulk(first_xid, n, batch.data(), batch.bytes());
+}
+
+auto OFAgentImpl::send_bulk(uint32_t first_xid, uint32_t n,
+                            const uint8_t* data, size_t size)
+    -> future<void>
+{
+    uint32_t barrier_xid = first_xid + n;
+
+    boost::unique_lock< boost::shared_mutex > wlock(tasks_mutex_);
+    barrier_session session{ barrier_xid };
+    session.first_xid = first_xid;
+    auto fut = session.promise_.get_future();
+    push_task(std::move(session));
+    bulk_index_.emplace(first_xid, std::prev(tasks_.end()));
+    wlock.unlock();
+
+    if (not conn_->alive()) {
+        THROW(request_error(dpid(), barrier_xid), "Request to offline switch");
+    }
+    // raw send skips the FlowMod send hook
+    flow_stats_flights_.invalidate();
+    conn_->send(const_cast<uint8_t*>(data), size);
+
+    // session is registered above, send hook would add another one
+    conn_->send(barrier_template(), barrier_xid);
+
+    return std::move(fut);
+}
+
+// Bundles are OFPT_BUNDLE_* since OpenFlow 1.4; 1.3 switches (Open vSwitch
+// among them) implement the same messages as ONF extension EXT-230
+namespace ofbundle {
+static constexpr uint8_t native_version = 5;      // OpenFlow 1.4
+static constexpr uint8_t type_control = 33;       // OFPT_BUNDLE_CONTROL
+static constexpr uint8_t type_add = 34;           // OFPT_BUNDLE_ADD_MESSAGE
+static constexpr uint8_t type_experimenter = 4;   // OFPT_EXPERIMENTER
+static constexpr uint32_t onf_experimenter = 0x4F4E4600;
+static constexpr uint32_t onft_control = 2300;
+static constexpr uint32_t onft_add = 2301;
+static constexpr uint16_t open_request = 0;       // OFPBCT_OPEN_REQUEST
+static constexpr uint16_t commit_request = 4;     // OFPBCT_COMMIT_REQUEST
+static constexpr uint16_t flags = 3;              // OFPBF_ATOMIC | OFPBF_ORDERED
+static constexpr size_t header_len = 8;
+
+class writer {
+public:
+    writer(uint8_t version, uint32_t id, size_t reserve)
+        : version_(version), id_(id)
+    { buf_.reserve(reserve); }
+
+    void control(uint32_t xid, uint16_t type)
+    {
+        start(xid, type_control, onft_control, 8);
+        put32(id_);
+        put16(type);
+        put16(flags);
+    }
+
+    void add(uint32_t xid, const uint8_t* msg, size_t len)
+    {
+        start(xid, type_add, onft_add, 8 + len);
+        put32(id_);
+        put16(0); // pad
+        put16(flags);
+        buf_.insert(buf_.end(), msg, msg + len);
+    }
+
+    std::vector<uint8_t>& data() { return buf_; }
+
+private:
+    uint8_t version_;
+    uint32_t id_;
+    std::vector<uint8_t> buf_;
+
+    bool native() const { return version_ >= native_version; }
+
+    void start(uint32_t xid, uint8_t type, uint32_t exp_type, size_t body)
+    {
+        size_t len = header_len + (native() ? 0 : 8) + body;
+        THROW_IF(len > 0xffff, OFAgent::request_error(0, xid),
+                 "Message is too long to be bundled");
+        buf_.push_back(version_);
+        buf_.push_back(native() ? type : type_experimenter);
+        put16(len);
+        put32(xid);
+        if (not native()) {
+            put32(onf_experimenter);
+            put32(exp_type);
+        }
+    }
+
+    void put16(uint16_t v)
+    {
+        buf_.push_back(v >> 8);
+        buf_.push_back(v);
+    }
+
+    void put32(uint32_t v)
+    {
+        put16(v >> 16);
+        put16(v);
+    }
+};
+
+static uint16_t length_at(const uint8_t* msg)
+{
+    return uint16_t(msg[2]) << 8 | msg[3];
+}
+
+// Numbers back to back messages with consecutive xids
+static void set_xids(std::vector<uint8_t>& buf, uint32_t first)
+{
+    for (size_t off = 0; off + header_len <= buf.size(); off += length_at(&buf[off])) {
+        uint32_t xid = first++;
+        buf[off + 4] = xid >> 24;
+        buf[off + 5] = xid >> 16;
+        buf[off + 6] = xid >> 8;
+        buf[off + 7] = xid;
+    }
+}
+
+// Switch without bundles rejects the open request itself
+static bool unsupported(const OFAgent::bulk_error& e, uint32_t n)
+{
+    for (auto& f : e.failures()) {
+        if (f.index == n && f.type == of13::OFPET_BAD_REQUEST)
+            return true;
+    }
+    return false;
+}
+} // namespace ofbundle
+
+// runs bundle completions right where the commit barrier is replied
+static boost::inline_executor bundle_executor;
+
+auto OFAgentImpl::bundle(const sequence<fluid_msg::OFMsg*>& msgs)
+    -> future<void>
+{
+    if (msgs.empty()) {
+        return barrier();
+    }
+
+    size_t total = 0;
+    for (auto msg : msgs) {
+        total += msg->length();
+    }
+    auto buf = std::make_shared<std::vector<uint8_t>>();
+    buf->reserve(total);
+    for (auto msg : msgs) {
+        auto deleter = &fluid_msg::OFMsg::free_buffer;
+        std::unique_ptr<uint8_t[], decltype(deleter)> packed
+            { msg->pack(), deleter };
+        buf->insert(buf->end(), packed.get(), packed.get() + msg->length());
+    }
+    // counted once, even if the bundle is resent as a batch
+    occupancy_.on_sent(buf->data(), buf->size());
+    return send_bundle(std::move(buf), msgs.size());
+}
+
+auto OFAgentImpl::bundle(FlowModBatch& batch)
+    -> future<void>
+{
+    if (batch.empty()) {
+        return barrier();
+    }
+
+    // kept for the fallback, batch may be reused as soon as we return
+    auto buf = std::make_shared<std::vector<uint8_t>>(
+        batch.data(), batch.data() + batch.bytes());
+    occupancy_.on_sent(buf->data(), buf->size());
+    return send_bundle(std::move(buf), batch.size());
+}
+
+auto OFAgentImpl::send_bundle(std::shared_ptr<std::vector<uint8_t>> buf,
+                              uint32_t n)
+    -> future<void>
+{
+    if (bundles_ == bundles_unsupported) {
+        uint32_t first_xid = next_xid_.fetch_add(n + 1);
+        ofbundle::set_xids(*buf, first_xid);
+        return send_bulk(first_xid, n, buf->data(), buf->size());
+    }
+
+    // Messages take [first_xid, first_xid + n), then go open and commit
+    // requests, so that the barrier of send_bulk() collects their errors
+    uint32_t first_xid = next_xid_.fetch_add(n + 3);
+    uint32_t open_xid = first_xid + n;
+    uint32_t commit_xid = open_xid + 1;
+    ofbundle::set_xids(*buf, first_xid);
+
+    ofbundle::writer w{ conn_->protocol_version(), next_bundle_id_++,
+                      buf->size() + (n + 2) * 24 };
+    w.control(open_xid, ofbundle::open_request);
+    // add message takes the xid of the message it carries
+    uint32_t xid = first_xid;
+    for (size_t off = 0, len; off < buf->size(); off += len) {
+        len = ofbundle::length_at(&(*buf)[off]);
+        w.add(xid++, &(*buf)[off], len);
+    }
+    w.control(commit_xid, ofbundle::commit_request);
+    auto& wire = w.data();
+    auto fut = send_bulk(first_xid, n + 2, wire.data(), wire.size());
+
+    uint64_t dpid = this->dpid();
+    std::weak_ptr<OFAgentImpl> weak =
+        std::static_pointer_cast<OFAgentImpl>(conn_->agent());
+    return fut.then(bundle_executor,
+        [this, weak, buf, n, dpid](future<void> f) -> future<void> {
+            try {
+                f.get();
+            } catch (const bulk_error& e) {
+                if (not ofbundle::unsupported(e, n)) {
+                    int unknown = bundles_unknown;
+                    bundles_.compare_exchange_strong(unknown, bundles_supported);
+                    throw;
+                }
+                // Nothing was applied. Resend outside of the receive path,
+                // this continuation runs under tasks_mutex_.
+                if (bundles_.exchange(bundles_unsupported) != bundles_unsupported)
+                    LOG(INFO) << "[OFAgent] Switch dpid=" << dpid
+                              << " doesn't support bundles, sending batches";
+                return boost::async(boost::launch::async, [weak, buf, n, dpid]() {
+                    auto self = weak.lock();
+                    THROW_IF(not self, request_error(dpid, 0),
+                             "Switch has gone before the batch was resent");
+                    return self->send_bundle(buf, n);
+                }).unwrap();
+            }
+            int unknown = bundles_unknown;
+            bundles_.compare_exchange_strong(unknown, bundles_supported);
+            return make_ready_future();
+        }).unwrap();
+}
+
 auto OFAgentImpl::group_mod(of13::GroupMod &group_mod)
     -> future<void>
 {
@@ -632,8 +1508,7 @@ auto OFAgentImpl::meter_mod(of13::MeterMod &meter_mod)
 
 future<void> OFAgentImpl::barrier()
 {
-    of13::BarrierRequest br;
-    return request<barrier_session>(br);
+    return request_prepared<barrier_session>(barrier_template());
 }
 
 } // namespace runos
@@ -17,23 +17,43 @@
 #pragma once
 
 #include "lib/lambda_visitor.hpp"
+#include "lib/latency_tracker.hpp"
+#include "lib/memory_accounting.hpp"
+#include "lib/table_occupancy.hpp"
 #include "api/OFAgent.hpp"
 #include "api/OFConnection.hpp"
+#include <runos/core/future.hpp>
 #include <runos/core/throw.hpp>
 #include <runos/core/logging.hpp>
 
+#include <boost/mpl/size.hpp>
 #include <boost/variant.hpp>
 #include <boost/variant/polymorphic_get.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/lock_guard.hpp>
+#include <boost/pool/pool_alloc.hpp>
+#include <boost/thread/executors/inline_executor.hpp>
 
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <functional>
 #include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <utility> // declval
 #include <memory>
 
 namespace runos {
 
+namespace metrics {
+class Histogram;
+}
+
 namespace of13 = fluid_msg::of13;
 
 class OFAgentImpl;
@@ -53,6 +73,8 @@ public:
         request_config() override;
     future< void >
         set_config(ofp::switch_config config) override;
+    future< void >
+        set_async(ofp::async_config config) override;
 
     // Switch Description
     future< fluid_msg::SwitchDesc >
@@ -83,8 +105,18 @@ public:
     // Flow stats
     future< sequence<of13::FlowStats> >
         request_flow_stats(ofp::flow_stats_request r) override;
+    future< size_t >
+        stream_flow_stats(ofp::flow_stats_request r,
+                          flow_stats_handler handler) override;
+    future< ofp::table_snapshot >
+        request_table_snapshot(uint8_t table_id,
+                               std::chrono::milliseconds max_age) override;
     future< ofp::aggregate_stats >
         request_aggregate(ofp::flow_stats_request r) override;
+    prepared_request
+        prepare_aggregate(ofp::flow_stats_request r) const override;
+    future< ofp::aggregate_stats >
+        request_aggregate(prepared_request const& r) override;
     
      // Group desc
     future< sequence<of13::GroupDesc> >
@@ -117,6 +149,17 @@ public:
     // Flow mod
     future < void >
         flow_mod(of13::FlowMod& flow_mod) override;
+    future < void >
+        flow_mods(sequence<of13::FlowMod>& flow_mods) override;
+    future < void >
+        flow_mods(FlowModBatch& batch) override;
+    future < void >
+        mods(const sequence<fluid_msg::OFMsg*>& msgs) override;
+    future < void >
+        bundle(const sequence<fluid_msg::OFMsg*>& msgs) override;
+    future < void >
+        bundle(FlowModBatch& batch) override;
+    void set_bundle_support(bool supported) override;
     // Group mod
     future < void >
         group_mod(of13::GroupMod& group_mod) override;
@@ -126,6 +169,36 @@ public:
 
     static uint_fast32_t constexpr get_minimal_xid() { return minimal_xid; }
 
+    // How long a stats reply may be shared with identical requests
+    // issued after it was sent; in-flight replies are always shared
+    static void set_reply_ttl(std::chrono::milliseconds port_stats,
+                              std::chrono::milliseconds flow_stats);
+
+    // Flow stats of all tables are asked table by table: one request
+    // per table with active entries, all in flight together
+    static void set_flow_stats_per_table(bool enabled);
+
+    // Slow switch detection, applies to all agents
+    static void set_latency_settings(latency_tracker::settings settings);
+
+    // Sessions waiting longer than this for the reply fail with
+    // not_responded; keyed by session_names(), "default" for the rest,
+    // zero disables. Applies to requests made afterwards.
+    static void set_request_timeouts(
+        std::map<std::string, std::chrono::milliseconds> const& timeouts);
+
+    table_occupancy& occupancy() override { return occupancy_; }
+
+    latency_info latency() const override;
+    double slowdown() const override;
+    size_t pending() const override;
+
+    // Pending sessions and their indexes, estimated
+    memory::Usage memory_usage() const;
+
+    // Called by the timeout wheel, fails the session if still pending
+    void expire(uint32_t xid);
+
 protected:
     class SendHandler;
     class RecvHandler;
@@ -137,13 +210,15 @@ protected:
         // when next barrier received
         const bool waiting_for_response;
         bool value_set {false};
+        const std::chrono::steady_clock::time_point sent_at
+            {std::chrono::steady_clock::now()};
 
         explicit session_base(uint32_t xid, bool wfr)
             : xid(xid), waiting_for_response(wfr)
         { }
 
         // <concept>
-        // promise<T> promise_;
+        // pooled_promise<T> promise_;
         // </concept>
     };
 
@@ -153,7 +228,7 @@ protected:
             : session_base(xid, false)
         { }
         
-        promise<void> promise_;
+        pooled_promise<void> promise_;
     };
 
     struct get_config_session : session_base {
@@ -161,7 +236,7 @@ protected:
             : session_base(xid, true)
         { }
         
-        promise<ofp::switch_config> promise_;
+        pooled_promise<ofp::switch_config> promise_;
     };
 
     struct switch_desc_session : session_base {
@@ -169,7 +244,7 @@ protected:
             : session_base(xid, true)
         { }
         
-        promise<fluid_msg::SwitchDesc> promise_;
+        pooled_promise<fluid_msg::SwitchDesc> promise_;
     };
 
     struct role_reply_session : session_base {
@@ -177,7 +252,7 @@ protected:
             : session_base(xid, true)
         { }
         
-        promise<ofp::role_config> promise_;
+        pooled_promise<ofp::role_config> promise_;
     };
 
     struct barrier_session : session_base {
@@ -185,7 +260,11 @@ protected:
             : session_base(xid, true)
         { }
 
-        promise<void> promise_;
+        // Set for barriers closing flow_mods() batch:
+        // messages have xids [first_xid, xid)
+        uint32_t first_xid {0};
+        std::vector<bulk_error::failure> failures;
+        pooled_promise<void> promise_;
     };
 
     struct port_desc_seq_session : session_base {
@@ -194,7 +273,7 @@ protected:
         { }
         
         sequence<of13::Port> ret;
-        promise<sequence<of13::Port>> promise_;
+        pooled_promise<sequence<of13::Port>> promise_;
     };
 
     struct port_stat_seq_session : session_base {
@@ -203,7 +282,7 @@ protected:
         { }
         
         sequence<of13::PortStats> ret;
-        promise<sequence<of13::PortStats>> promise_;
+        pooled_promise<sequence<of13::PortStats>> promise_;
     };
 
     struct port_stat_session : session_base {
@@ -211,7 +290,7 @@ protected:
             : session_base(xid, true)
         { }
         
-        promise<of13::PortStats> promise_;
+        pooled_promise<of13::PortStats> promise_;
     };
 
     struct queue_stat_seq_session : session_base {
@@ -220,7 +299,7 @@ protected:
         { }
         
         sequence<of13::QueueStats> ret;
-        promise<sequence<of13::QueueStats>> promise_;
+        pooled_promise<sequence<of13::QueueStats>> promise_;
     };
 
     struct queue_stat_session : session_base {
@@ -228,7 +307,16 @@ protected:
             : session_base(xid, true)
         { }
         
-        promise<of13::QueueStats> promise_;
+        pooled_promise<of13::QueueStats> promise_;
+    };
+
+    // State of stream_flow_stats(), handler is called outside of tasks lock
+    struct flow_stat_stream {
+        flow_stats_handler handler;
+        bool stopped {false};
+        size_t count {0};
+        std::atomic_bool finished {false};
+        promise<size_t> done;
     };
 
     struct flow_stat_seq_session : session_base {
@@ -236,8 +324,10 @@ protected:
             : session_base(xid, true)
         { }
 
+        // if set, segments go to the stream instead of `ret`
+        std::shared_ptr<flow_stat_stream> stream;
         sequence<of13::FlowStats> ret;
-        promise< sequence<of13::FlowStats> > promise_;
+        pooled_promise< sequence<of13::FlowStats> > promise_;
     };
 
     struct flow_aggregate_session : session_base {
@@ -245,7 +335,7 @@ protected:
             : session_base(xid, true)
         { }
 
-        promise< ofp::aggregate_stats > promise_;
+        pooled_promise< ofp::aggregate_stats > promise_;
     };
 
     struct group_desc_seq_session : session_base {
@@ -254,7 +344,7 @@ protected:
         { }
         
         sequence<of13::GroupDesc> ret;
-        promise< sequence<of13::GroupDesc> > promise_;
+        pooled_promise< sequence<of13::GroupDesc> > promise_;
     };
 
     struct group_stat_seq_session : session_base {
@@ -263,7 +353,7 @@ protected:
         { }
         
         sequence<of13::GroupStats> ret;
-        promise<sequence<of13::GroupStats> > promise_;
+        pooled_promise<sequence<of13::GroupStats> > promise_;
     };
 
     struct group_stat_session : session_base {
@@ -271,7 +361,7 @@ protected:
             : session_base(xid, true)
         { }
         
-        promise<of13::GroupStats> promise_;
+        pooled_promise<of13::GroupStats> promise_;
     };
 
     struct table_stat_seq_session : session_base {
@@ -280,7 +370,7 @@ protected:
         { }
         
         sequence<of13::TableStats> ret;
-        promise<sequence<of13::TableStats> > promise_;
+        pooled_promise<sequence<of13::TableStats> > promise_;
     };
     
 
@@ -290,7 +380,7 @@ protected:
         { }
         
         sequence<of13::MeterStats> ret;
-        promise<sequence<of13::MeterStats>> promise_;
+        pooled_promise<sequence<of13::MeterStats>> promise_;
     };
 
     struct meter_stat_session : session_base {
@@ -298,7 +388,7 @@ protected:
             : session_base(xid, true)
         { }
         
-        promise<of13::MeterStats> promise_;
+        pooled_promise<of13::MeterStats> promise_;
     };
 
     struct meter_config_seq_session : session_base {
@@ -307,7 +397,7 @@ protected:
         { }
         
         sequence<of13::MeterConfig> ret;
-        promise<sequence<of13::MeterConfig> > promise_;
+        pooled_promise<sequence<of13::MeterConfig> > promise_;
     };
     
     struct meter_features_session : session_base {
@@ -315,7 +405,7 @@ protected:
             : session_base(xid, true)
         { }
         
-        promise<of13::MeterFeatures> promise_;
+        pooled_promise<of13::MeterFeatures> promise_;
     };
 
     // TODO - boost::variant has a restriction on params count = 20
@@ -347,8 +437,62 @@ protected:
         meter_config_seq_session,
         meter_features_session
     >;
+    static constexpr size_t session_types =
+        boost::mpl::size<session::types>::value;
+    // Short names of session types, by session::which()
+    static const std::vector<std::string>& session_names();
+
+    // List keeps send order (barrier semantics), nodes come from a pool
+    // so that a request doesn't cost a heap allocation.
+    using session_list = std::list<
+        session,
+        boost::fast_pool_allocator<session>
+    >;
 
-    using session_list = std::list<session>;
+    // xid -> task, first session submitted with that xid wins
+    using session_index = std::unordered_map<
+        uint32_t,
+        session_list::iterator,
+        std::hash<uint32_t>,
+        std::equal_to<uint32_t>,
+        boost::fast_pool_allocator<
+            std::pair<const uint32_t, session_list::iterator>
+        >
+    >;
+
+    // Identical requests join the reply of one sent to the switch
+    template<class T>
+    class single_flight {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        // Joins a reply sent less than `ttl` ago (or still in flight),
+        // otherwise sends a new request with `issue()`
+        template<class Issue>
+        future<T> join(const std::string& key, std::chrono::milliseconds ttl,
+                       Issue&& issue);
+        // Only joins, never sends
+        std::optional<shared_future<T>> find(const std::string& key,
+                                             std::chrono::milliseconds ttl);
+        // Following requests won't join replies sent so far
+        void invalidate();
+        void invalidate(const std::string& key);
+
+    private:
+        struct flight {
+            shared_future<T> reply;
+            clock::time_point sent;
+        };
+
+        static constexpr size_t prune_threshold = 64;
+
+        std::mutex mutex_;
+        std::unordered_map<std::string, flight> flights_;
+
+        flight* lookup(const std::string& key, std::chrono::milliseconds ttl,
+                       clock::time_point now);
+        static future<T> copy(shared_future<T> reply);
+    };
 
     struct DefaultOnResponseVisitor {
         template<class T>
@@ -381,23 +525,90 @@ protected:
     auto request(Message& msg)
         -> decltype( std::declval<Session>().promise_.get_future() );
 
+    // `init` is applied to the session before it is registered
+    template<class Session, class Message, class Init>
+    auto request(Message& msg, Init&& init)
+        -> decltype( std::declval<Session>().promise_.get_future() );
+
+    // Same for a message packed beforehand
+    template<class Session>
+    auto request_prepared(OFMessageTemplate const& tmpl)
+        -> decltype( std::declval<Session>().promise_.get_future() );
+
     //
     // Methods
     //
 
     session_list::iterator find_task(uint32_t xid);
+    // barrier of the batch which `xid` belongs to
+    session_list::iterator find_bulk(uint32_t xid);
+    void push_task(session&& s);
+    void erase_task(session_list::iterator it);
     void pop_tasks_until(uint32_t xid);
+    // Accounts the time since the request was made to its type
+    void record_rtt(session const& s);
+    // Writes flow mods [first_xid, first_xid + n) packed into `data`
+    // followed by the barrier closing them
+    future<void> send_bulk(uint32_t first_xid, uint32_t n,
+                           const uint8_t* data, size_t size);
+    // Sends `n` packed messages in a bundle, or as a plain batch if the
+    // switch doesn't support them; renumbers messages in `buf`
+    future<void> send_bundle(std::shared_ptr<std::vector<uint8_t>> buf,
+                             uint32_t n);
+    // Ids of the tables holding entries, by the table stats
+    future< std::vector<uint8_t> > active_tables();
+    // request_flow_stats() and stream_flow_stats() of OFPTT_ALL asked
+    // per table; the tables are merged in table order when buffered
+    future< sequence<of13::FlowStats> >
+        request_flow_stats_per_table(ofp::flow_stats_request r);
+    future< size_t >
+        stream_flow_stats_per_table(ofp::flow_stats_request r,
+                                    flow_stats_handler handler);
+    // true if error belongs to a flow_mods() batch
+    bool on_bulk_error(of13::Error& e);
     uint64_t dpid() const { return conn_->dpid(); }
 
 private:
+    /// leave backdoor for microbenchmarks
+    friend class OFAgentBench;
+
     OFConnection* conn_;
     mutable boost::shared_mutex tasks_mutex_;
     session_list tasks_;
+    session_index tasks_index_;
+    std::map<uint32_t, session_list::iterator> bulk_index_; // by first_xid
+
+    table_occupancy occupancy_;
+
+    single_flight< sequence<of13::PortStats> > port_stats_flights_;
+    single_flight< of13::PortStats > port_stat_flights_;
+    single_flight< sequence<of13::FlowStats> > flow_stats_flights_;
+    single_flight< ofp::table_snapshot > table_snapshots_; // by table id
+
+    static std::atomic<int64_t> port_stats_ttl_ms_;
+    static std::atomic<int64_t> flow_stats_ttl_ms_;
+    static std::atomic<bool> flow_stats_per_table_;
+
+    // By session::which(), written under upgrade lock of tasks_mutex_
+    static std::array<std::atomic<int64_t>, session_types>
+        request_timeout_ms_;
+    // Handed to the timeout wheel, set on the first request
+    std::weak_ptr<OFAgentImpl> weak_self_;
+    static latency_tracker::settings latency_settings_;
+    std::array<latency_tracker, session_types> latency_;
+    std::array<std::atomic<metrics::Histogram*>, session_types>
+        rtt_histograms_ {};
 
     OFConnection::SendHookHandlerPtr send_hook_handler_;
     OFConnection::ReceiveHandlerPtr recv_handler_;
 
+    enum bundle_support : int { bundles_unknown, bundles_supported,
+                                bundles_unsupported };
+    std::atomic<int> bundles_ {bundles_unknown};
+    std::atomic<uint32_t> next_bundle_id_ {1};
+
     static uint_fast32_t constexpr minimal_xid = 0x10000;
+    static size_t constexpr tasks_index_reserve = 1024;
     std::atomic_uint_fast32_t next_xid_ {minimal_xid};
 };
 
@@ -445,14 +656,22 @@ void OFAgentImpl::set_exception(OFAgentImpl::session& session, T&& value)
 template<class Session, class Message>
 auto OFAgentImpl::request(Message& msg)
     -> decltype( std::declval<Session>().promise_.get_future() )
+{
+    return request<Session>(msg, [](Session&) { });
+}
+
+template<class Session, class Message, class Init>
+auto OFAgentImpl::request(Message& msg, Init&& init)
+    -> decltype( std::declval<Session>().promise_.get_future() )
 {
     uint64_t xid = next_xid_++;
     msg.xid(xid);
 
     boost::unique_lock< boost::shared_mutex > wlock(tasks_mutex_);
     Session session{ msg.xid() };
+    init(session);
     auto fut = session.promise_.get_future();
-    tasks_.push_back(std::move(session));
+    push_task(std::move(session));
     wlock.unlock();
 
     if (conn_->alive()) {
@@ -465,6 +684,103 @@ auto OFAgentImpl::request(Message& msg)
     return std::move(fut);
 }
 
+template<class Session>
+auto OFAgentImpl::request_prepared(OFMessageTemplate const& tmpl)
+    -> decltype( std::declval<Session>().promise_.get_future() )
+{
+    uint32_t xid = next_xid_++;
+
+    boost::unique_lock< boost::shared_mutex > wlock(tasks_mutex_);
+    Session session{ xid };
+    auto fut = session.promise_.get_future();
+    push_task(std::move(session));
+    wlock.unlock();
+
+    if (conn_->alive()) {
+        conn_->send(tmpl, xid);
+    } else {
+        THROW(request_error(dpid(), xid), "Request to offline switch");
+    }
+
+    return std::move(fut);
+}
+
+template<class T>
+auto OFAgentImpl::single_flight<T>::lookup(const std::string& key,
+                                           std::chrono::milliseconds ttl,
+                                           clock::time_point now)
+    -> flight*
+{
+    auto it = flights_.find(key);
+    if (it == flights_.end())
+        return nullptr;
+
+    auto& f = it->second;
+    if (not f.reply.is_ready())
+        return &f;
+    if (not f.reply.has_exception() && now - f.sent < ttl)
+        return &f;
+    return nullptr;
+}
+
+template<class T>
+future<T> OFAgentImpl::single_flight<T>::copy(shared_future<T> reply)
+{
+    static boost::inline_executor executor;
+    return reply.then(executor, [](shared_future<T> f) { return f.get(); });
+}
+
+template<class T>
+template<class Issue>
+future<T> OFAgentImpl::single_flight<T>::join(const std::string& key,
+                                              std::chrono::milliseconds ttl,
+                                              Issue&& issue)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = clock::now();
+    if (auto f = lookup(key, ttl, now))
+        return copy(f->reply);
+
+    if (flights_.size() >= prune_threshold) {
+        for (auto it = flights_.begin(); it != flights_.end(); ) {
+            if (it->second.reply.is_ready() && now - it->second.sent >= ttl)
+                it = flights_.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    // Sent under the lock, so concurrent callers can't send twice
+    shared_future<T> reply = issue().share();
+    flights_[key] = flight{ reply, now };
+    return copy(std::move(reply));
+}
+
+template<class T>
+auto OFAgentImpl::single_flight<T>::find(const std::string& key,
+                                         std::chrono::milliseconds ttl)
+    -> std::optional<shared_future<T>>
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (auto f = lookup(key, ttl, clock::now()))
+        return f->reply;
+    return std::nullopt;
+}
+
+template<class T>
+void OFAgentImpl::single_flight<T>::invalidate()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    flights_.clear();
+}
+
+template<class T>
+void OFAgentImpl::single_flight<T>::invalidate(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    flights_.erase(key);
+}
+
 template<class... Visitors>
 void OFAgentImpl::on_response(uint32_t xid, Visitors&&... visitors)
 {
@@ -489,8 +805,9 @@ void OFAgentImpl::on_response(uint32_t xid, Visitors&&... visitors)
     boost::apply_visitor(visitor, *task_it);
 
     if (session.value_set) {
+        record_rtt(*task_it);
         boost::upgrade_to_unique_lock<boost::shared_mutex> wlock(rlock);
-        tasks_.erase(task_it);
+        erase_task(task_it);
     }
 }
 
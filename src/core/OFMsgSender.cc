@@ -19,14 +19,23 @@
 #include "SwitchManager.hpp"
 #include "FlowEntriesVerifier.hpp"
 #include "api/OFAgent.hpp"
+#include "lib/event_trace.hpp"
+#include "lib/metrics.hpp"
 #include "lib/poller.hpp"
+#include "lib/wire_queue.hpp"
+#include "lib/worker_pool.hpp"
 
 #include <runos/core/logging.hpp>
 #include <runos/core/future.hpp>
 
 #include <boost/chrono.hpp>
+#include <boost/thread/executors/inline_executor.hpp>
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <mutex>
-#include <queue>
+#include <sstream>
+#include <string>
 #include <utility>
 
 namespace runos {
@@ -35,75 +44,202 @@ REGISTER_APPLICATION(OFMsgSender, {"switch-ordering", "flow-entries-verifier", "
 
 static constexpr int min_rate = 20; 
 
-namespace barrier_status {
-    template<typename R>
-    bool received(boost::future<R> const& f)
-    {
-        return f.wait_for(boost::chrono::seconds(0)) == boost::future_status::ready;
-    }
+using steady_clock = boost::chrono::steady_clock;
+
+// Runs barrier continuations in the thread which received the reply,
+// so reply timestamp isn't delayed by the sending worker.
+static boost::inline_executor reply_executor;
+
+static metrics::Counter& sent_counter(MsgPriority priority)
+{
+    static const char* names[msg_priority_count] = {"critical", "normal", "bulk"};
+    return metrics::Registry::global().counter(
+        "runos_ofmsg_sender_sent_total",
+        "Messages sent from the queues of rate-limited switches",
+        {{"priority", names[size_t(priority)]}});
 }
 
+static metrics::Counter& skipped_counter = metrics::Registry::global().counter(
+    "runos_ofmsg_sender_skipped_flow_mods_total",
+    "Flow-Mods not sent because the switch already has the same entry");
+
 struct MsgStatus {
-    MsgStatus(OFConnectionPtr conn, uint32_t limit, uint32_t add = 5, uint32_t mult = 2)
+    using Weights = std::array<uint32_t, msg_priority_count>;
+    using Counts = std::array<uint64_t, msg_priority_count>;
+
+    MsgStatus(OFConnectionPtr conn, uint32_t limit, uint32_t add = 5, uint32_t mult = 2,
+              double alpha = 2.0, double beta = 4.0,
+              Weights weights = {8, 4, 1})
         : conn(conn)
         , limit(limit)
         , sent(0)
+        , weights(weights)
         , additive_ratio(add)
         , multiplicative_ratio(mult)
+        , alpha(alpha)
+        , beta(beta)
     {}
 
+    using Queue = wire_queue;
+
     OFConnectionPtr conn;
     uint32_t limit; // limit for sending msgs per pack
+    // Window bounds from the device profile, max_limit 0 is unbounded
+    uint32_t min_limit {min_rate};
+    uint32_t max_limit {0};
     uint32_t sent;  // amount sent msgs without barrier
-    std::queue<std::pair<uint8_t*, size_t>> msgs;
-    boost::future<void> barrier;
-    boost::chrono::time_point<boost::chrono::steady_clock> updated;
-    std::mutex mut;
-
+    uint32_t in_flight {0}; // msgs covered by outstanding barrier
+    std::array<Queue, msg_priority_count> msgs; // by MsgPriority
+    std::vector<uint8_t> pack_buffer; // a pack is written at once
+    Weights weights;
+    Weights credit {}; // left in the current round
+    steady_clock::time_point updated; // last barrier sent
+    bool awaiting {false};   // reply of the last barrier
+    uint64_t barrier_seq {0};
+    // Barrier `seq` came back at the time given, or failed
+    std::function<void(uint64_t seq, bool ok, steady_clock::time_point)> on_reply;
+    bool scheduled {false};  // a drain of the queues is submitted
+    bool closed {false};     // switch is down
+    mutable std::mutex mut;  // guards all but `conn` and `on_reply`
+
+    // Last traced message, marked when it's sent: the position it was
+    // queued at in the count of all messages ever queued to its class
+    Counts queued_total {};
+    Counts sent_total {};
+    trace::id traced {0};
+    size_t traced_class {0};
+    uint64_t traced_at {0};
+
+    // with `mut` held
     void send_barrier();
     void send_pack();
 
-    // AIMD logic for OFMsg congestion control
+    bool empty() const;
+    size_t queued() const;
+    // Class to send from next, msgs_priority_count if all are empty
+    size_t pick();
+
+    // AIMD logic for OFMsg congestion control, used on barrier timeout
     uint32_t additive_ratio;
     uint32_t multiplicative_ratio;
     void add_increase();
     void mult_decrease();
+    void clamp();
+
+    // Delay-based (Vegas-like) window control. Queueing backlog on the
+    // switch is estimated as limit * (1 - min_rtt / rtt) messages:
+    // grow window while backlog < alpha, shrink when it's > beta.
+    double alpha;
+    double beta;
+    steady_clock::duration min_rtt {steady_clock::duration::max()};
+    steady_clock::duration srtt {steady_clock::duration::zero()};
+    steady_clock::duration last_rtt {steady_clock::duration::zero()};
+    void on_barrier_reply(steady_clock::time_point replied);
 };
 
 void MsgStatus::send_barrier()
 {
+    in_flight = sent;
+    updated = steady_clock::now();
+    awaiting = true;
+    uint64_t seq = ++barrier_seq;
     try {
-        barrier = std::move(conn->agent()->barrier());
+        conn->agent()->barrier().then(reply_executor,
+            [seq, reply = on_reply](boost::future<void> f) {
+                bool ok = true;
+                try {
+                    f.get();
+                } catch (const std::exception& e) {
+                    LOG(WARNING) << "[OFMsgSender] Barrier failed: " << e.what();
+                    ok = false;
+                }
+                reply(seq, ok, steady_clock::now());
+            });
     } catch (const OFAgent::request_error& e) {
         LOG(ERROR) << "[MsgStatus] - " << e.what();
+        awaiting = false;
+    }
+}
+
+bool MsgStatus::empty() const
+{
+    return std::all_of(msgs.begin(), msgs.end(),
+                       [](const Queue& q) { return q.empty(); });
+}
+
+size_t MsgStatus::queued() const
+{
+    size_t ret = 0;
+    for (auto& q : msgs)
+        ret += q.size();
+    return ret;
+}
+
+size_t MsgStatus::pick()
+{
+    for (int round = 0; round < 2; ++round) {
+        for (size_t c = 0; c < msgs.size(); ++c) {
+            if (msgs[c].empty())
+                credit[c] = 0; // idle classes don't save up
+            else if (credit[c] > 0)
+                return c;
+        }
+        // round is over, every backlogged class gets its weight again
+        for (size_t c = 0; c < msgs.size(); ++c) {
+            if (not msgs[c].empty())
+                credit[c] = std::max<uint32_t>(weights[c], 1);
+        }
     }
-    updated = boost::chrono::steady_clock::now();
+    return msg_priority_count;
 }
 
 void MsgStatus::send_pack()
 {
     uint32_t sent_in_pack = 0;
 
-    std::lock_guard lock(mut);
-    while (!msgs.empty() && sent_in_pack < limit && sent < limit) {
-        auto elem = msgs.front();
-        conn->send(elem.first, elem.second);
-        fluid_msg::OFMsg::free_buffer(elem.first);
-        msgs.pop();
-        sent_in_pack++;
-        sent++;
+    bool reached_limit = false;
+    pack_buffer.clear();
+    while (!empty() && sent_in_pack < limit && sent < limit) {
+        size_t c = pick();
+        auto span = msgs[c].front(std::min(credit[c], limit - sent));
+        pack_buffer.insert(pack_buffer.end(), span.data, span.data + span.len);
+        msgs[c].pop(span.count);
+        credit[c] -= span.count;
+        sent_counter(MsgPriority(c)).add(span.count);
+        sent_in_pack += span.count;
+        sent += span.count;
+        sent_total[c] += span.count;
 
         if (sent_in_pack == limit || sent == limit) { // reached limit
-            send_barrier();
-            sent = 0;
+            reached_limit = true;
             break;
         }
     }
+
+    if (not pack_buffer.empty()) {
+        conn->send(pack_buffer.data(), pack_buffer.size());
+    }
+    if (traced && sent_total[traced_class] >= traced_at) {
+        trace::mark(traced, "flow-mod-sent", sent_in_pack);
+        traced = 0;
+    }
+    if (reached_limit) {
+        send_barrier();
+        sent = 0;
+    }
+}
+
+void MsgStatus::clamp()
+{
+    if (max_limit && limit > max_limit)
+        limit = max_limit;
+    limit = std::max(limit, min_limit);
 }
 
 void MsgStatus::add_increase()
 {
     limit += additive_ratio;
+    clamp();
 
     VLOG(4) << "Switch " << conn->dpid() << " sent pack successfully";
     VLOG(4) << "Increase limit on " << additive_ratio << " messages. "
@@ -114,15 +250,46 @@ void MsgStatus::mult_decrease()
 {
     LOG(WARNING) << "Switch " << conn->dpid() << " don't reply on barrier";
 
-    if (limit >= multiplicative_ratio * min_rate) {
+    if (limit >= multiplicative_ratio * min_limit) {
         limit /= multiplicative_ratio;
         LOG(WARNING) << "Changed ofmsg limit for switch " << conn->dpid() 
                      << " to " << limit << " messages";
     } else {
-        limit = min_rate;
+        limit = min_limit;
         LOG(WARNING) << "Ofmsg limit for switch " << conn->dpid()
-                     << " is min = " << min_rate << " messages";
+                     << " is min = " << min_limit << " messages";
+    }
+}
+
+void MsgStatus::on_barrier_reply(steady_clock::time_point replied)
+{
+    auto rtt = replied - updated;
+    if (rtt <= steady_clock::duration::zero()) {
+        rtt = steady_clock::duration(1);
+    }
+
+    last_rtt = rtt;
+    min_rtt = std::min(min_rtt, rtt);
+    srtt = srtt == steady_clock::duration::zero() ? rtt : (srtt * 7 + rtt) / 8;
+
+    if (in_flight < limit / 2) {
+        return; // window wasn't filled, rtt tells nothing about capacity
     }
+
+    double ratio = double(min_rtt.count()) / double(rtt.count());
+    double backlog = limit * (1.0 - ratio);
+
+    if (backlog < alpha) {
+        limit += additive_ratio;
+    } else if (backlog > beta) {
+        limit = limit > additive_ratio + min_limit ? limit - additive_ratio
+                                                   : min_limit;
+    }
+    clamp();
+
+    VLOG(4) << "Switch " << conn->dpid() << " barrier rtt="
+            << boost::chrono::duration_cast<boost::chrono::microseconds>(rtt).count()
+            << "us, backlog=" << backlog << ", limit=" << limit;
 }
 
 // ** Application ** //
@@ -134,88 +301,261 @@ void OFMsgSender::init(Loader* loader, const Config& rootConfig)
     auto config = config_cd(rootConfig, "ofmsg-sender");
     poll_interval = config_get(config, "poll-interval", 50);    // ms
     wait_interval = config_get(config, "wait-interval", 5000);  // ms
+    vegas_alpha = config_get(config, "vegas-alpha", 2.0);       // msgs
+    vegas_beta = config_get(config, "vegas-beta", 4.0);         // msgs
+    skip_installed = config_get(config, "skip-installed", false);
+
+    // critical,normal,bulk msgs per round
+    priority_weights = {8, 4, 1};
+    std::istringstream weights(config_get(config, "priority-weights", "8,4,1"));
+    std::string weight;
+    for (size_t c = 0; c < msg_priority_count && std::getline(weights, weight, ','); ++c) {
+        priority_weights[c] = std::max(std::stoi(weight), 1);
+    }
 
+    int threads = config_get(config, "send-threads", 2);
+    workers = std::make_unique<WorkerPool>(std::max(threads, 1));
+    // only switches waiting for a barrier reply or a writable socket
     poller = new Poller(this, poll_interval);
     SwitchOrderingManager::get(loader)->registerHandler(this, 16);
 }
 
+OFMsgSender::~OFMsgSender() = default;
+
 void OFMsgSender::startUp(Loader* loader)
 {
     poller->run();
 }
 
-void OFMsgSender::send(uint64_t dpid, message& msg)
+void OFMsgSender::send(uint64_t dpid, message& msg, MsgPriority priority)
 {
-    send_impl(dpid, msg);
+    send_impl(dpid, msg, priority);
 }
 
-void OFMsgSender::send(uint64_t dpid, message&& msg)
+void OFMsgSender::send(uint64_t dpid, message&& msg, MsgPriority priority)
 {
-    send_impl(dpid, msg);
+    send_impl(dpid, msg, priority);
 }
 
 void OFMsgSender::polling()
 {
-    auto now = boost::chrono::steady_clock::now();
-    for (auto& it : status_map) {
-        auto status_ptr = it.second;
-        {
-            std::lock_guard lock(status_ptr->mut);
-            if (status_ptr->msgs.empty()) {
-                continue;       // no messages for switch
-            }
+    std::vector<msg_status_ptr> due;
+    {
+        std::lock_guard<std::mutex> lock(stalled_mutex);
+        for (auto& it : stalled) {
+            if (auto status = it.second.lock())
+                due.push_back(std::move(status));
         }
+    }
+    for (auto& status : due) {
+        schedule(status);
+    }
+}
 
-        if (status_ptr->barrier.valid()) {                        // we sent barrier (state is valid)
-            if (barrier_status::received(status_ptr->barrier)) {    // and received barrier-reply
-                status_ptr->barrier.get();                            // make state invalid
-                status_ptr->add_increase();                           // and increase limit
-            } else {                                                // or...
-                if (now - status_ptr->updated > boost::chrono::milliseconds(wait_interval)) {
-                    status_ptr->mult_decrease();                      // send new barrier if time was over
-                    status_ptr->send_barrier();
-                }
-                continue;                                           // wait barrier-reply
+void OFMsgSender::schedule(const msg_status_ptr& status)
+{
+    {
+        std::lock_guard lock(status->mut);
+        if (status->scheduled || status->closed)
+            return;
+        status->scheduled = true;
+    }
+    workers->submit(status->conn->dpid(), [this, status]() { drain(status); });
+}
+
+// Sends what the window allows, on the switch's worker
+void OFMsgSender::drain(const msg_status_ptr& status)
+{
+    auto now = steady_clock::now();
+    bool waiting, more;
+    {
+        std::lock_guard lock(status->mut);
+        status->scheduled = false;
+        if (status->closed)
+            return;
+
+        if (status->awaiting) {
+            // send new barrier if time was over
+            if (now - status->updated > boost::chrono::milliseconds(wait_interval)) {
+                status->mult_decrease();
+                status->send_barrier();
             }
+        } else if (not status->empty() && status->conn->writable()) {
+            status->send_pack();
         }
 
-        poller->apply([=](){ status_ptr->send_pack(); });
+        // Socket backlog: the queue waits for the low watermark
+        waiting = not status->empty() &&
+                  (status->awaiting || not status->conn->writable());
+        more = not status->empty() && not waiting;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(stalled_mutex);
+        if (waiting)
+            stalled.emplace(status->conn->dpid(), status);
+        else
+            stalled.erase(status->conn->dpid());
+    }
+    // other switches of the worker get their turn in between
+    if (more)
+        schedule(status);
+}
+
+void OFMsgSender::on_barrier(const msg_status_ptr& status, uint64_t seq,
+                             bool ok, steady_clock::time_point replied)
+{
+    {
+        std::lock_guard lock(status->mut);
+        // a late reply of a barrier sent again after the timeout
+        if (not status->awaiting || seq != status->barrier_seq)
+            return;
+        status->awaiting = false;
+        if (ok)
+            status->on_barrier_reply(replied); // adjust limit by rtt
+        else
+            status->mult_decrease();
     }
+    drain(status);
 }
 
 void OFMsgSender::switchUp(SwitchPtr sw)
 {
+    auto caps = sw->capabilities();
+    uint32_t rate = caps->max_flow_mods_per_sec;
+
+    // A profile with a FlowMod rate limits the switch by itself,
+    // starting with about 100 ms of its work per barrier
+    int64_t limit = std::max<int64_t>(rate / 10, min_rate);
     auto prop = sw->property("ofmsg_limit");
-    if (not prop.has_value()) return; // No limits
+    if (prop.has_value())
+        limit = std::any_cast<int64_t>(prop);
+    else if (rate == 0)
+        return; // No limits
 
-    auto limit = std::any_cast<int64_t>(prop);
     if (limit > 0) {
         auto additive = sw->property("ofmsg_add_ratio", 5);
         auto multiplicative = sw->property("ofmsg_mult_ratio", 2);
-        status_map.emplace(sw->dpid(), 
-                std::make_shared<MsgStatus>(sw->connection(),
-                                            static_cast<uint32_t>(limit),
-                                            additive, multiplicative)
-        );
+        auto status = std::make_shared<MsgStatus>(sw->connection(),
+                                                  static_cast<uint32_t>(limit),
+                                                  additive, multiplicative,
+                                                  vegas_alpha, vegas_beta,
+                                                  priority_weights);
+        if (rate > 0) {
+            // Barriers stay under a tenth of the switch's time, and a
+            // full window is installed well before the barrier timeout
+            auto barrier_cost = std::chrono::duration<double>(caps->barrier_cost);
+            status->min_limit = std::max<uint32_t>(
+                min_rate, uint32_t(10 * rate * barrier_cost.count()));
+            status->max_limit = std::max<uint32_t>(
+                status->min_limit, uint32_t(uint64_t(rate) * wait_interval / 2000));
+            status->clamp();
+        }
+        std::weak_ptr<MsgStatus> weak = status;
+        auto dpid = sw->dpid();
+        status->on_reply = [this, weak, dpid](uint64_t seq, bool ok,
+                                              steady_clock::time_point replied) {
+            if (auto status = weak.lock()) {
+                workers->submit(dpid, [this, status, seq, ok, replied]() {
+                    on_barrier(status, seq, ok, replied);
+                });
+            }
+        };
+        std::lock_guard<std::mutex> map_lock(status_map_mutex);
+        status_map.emplace(dpid, std::move(status));
     }
 }
 
 void OFMsgSender::switchDown(SwitchPtr sw)
 {
-    status_map.erase(sw->dpid());
+    msg_status_ptr status;
+    {
+        std::lock_guard<std::mutex> map_lock(status_map_mutex);
+        auto it = status_map.find(sw->dpid());
+        if (it == status_map.end())
+            return;
+        status = it->second;
+        status_map.erase(it);
+    }
+    {
+        std::lock_guard lock(status->mut);
+        status->closed = true;
+    }
+    std::lock_guard<std::mutex> lock(stalled_mutex);
+    stalled.erase(sw->dpid());
+}
+
+std::vector<OFMsgSender::WindowInfo> OFMsgSender::windows() const
+{
+    using boost::chrono::duration_cast;
+    using boost::chrono::microseconds;
+
+    std::vector<WindowInfo> ret;
+    std::lock_guard<std::mutex> map_lock(status_map_mutex);
+    for (auto& it : status_map) {
+        auto& status = *it.second;
+        std::lock_guard lock(status.mut);
+
+        WindowInfo info;
+        info.dpid = it.first;
+        info.limit = status.limit;
+        info.queued = status.queued();
+        for (size_t c = 0; c < msg_priority_count; ++c)
+            info.queued_by_priority[c] = status.msgs[c].size();
+        info.rtt_us = duration_cast<microseconds>(status.last_rtt).count();
+        info.srtt_us = duration_cast<microseconds>(status.srtt).count();
+        info.min_rtt_us = status.min_rtt == steady_clock::duration::max()
+                        ? 0 : duration_cast<microseconds>(status.min_rtt).count();
+        ret.push_back(info);
+    }
+    return ret;
 }
 
-void OFMsgSender::send_impl(uint64_t dpid, message& msg)
+void OFMsgSender::send_impl(uint64_t dpid, message& msg, MsgPriority priority)
 {
+    // Same ADD again would only rewrite the entry in the switch
+    if (skip_installed && verifier->installed(dpid, msg)) {
+        skipped_counter.add();
+        VLOG(8) << "[OFMsgSender] Flow-Mod to switch dpid=" << dpid
+                << " is already installed, not sent";
+        return;
+    }
+
+    std::unique_lock<std::mutex> map_lock(status_map_mutex);
     auto status_iter = status_map.find(dpid);
     if (status_iter == status_map.end()) { // no limits
+        map_lock.unlock();
         verifier->send(dpid, msg);
+        // the first of a burst to the switch
+        static thread_local std::pair<trace::id, uint64_t> marked;
+        auto id = trace::current();
+        if (id && marked != std::make_pair(id, dpid)) {
+            trace::mark(id, "flow-mod-sent", dpid);
+            marked = {id, dpid};
+        }
         return;
     }
+    auto status_ptr = status_iter->second;
+    map_lock.unlock();
 
     try {
-        std::lock_guard lock(status_iter->second->mut);
-        status_iter->second->msgs.emplace(msg.pack(), msg.length());
+        auto deleter = &fluid_msg::OFMsg::free_buffer;
+        std::unique_ptr<uint8_t[], decltype(deleter)> packed
+            { msg.pack(), deleter };
+        {
+            std::lock_guard lock(status_ptr->mut);
+            auto c = size_t(priority);
+            status_ptr->msgs[c].push(packed.get(), msg.length());
+            status_ptr->queued_total[c]++;
+            if (auto id = trace::current()) {
+                if (id != status_ptr->traced)
+                    trace::mark(id, "flow-mod-queued", dpid);
+                status_ptr->traced = id;
+                status_ptr->traced_class = c;
+                status_ptr->traced_at = status_ptr->queued_total[c];
+            }
+        }
+        schedule(status_ptr);
     } catch (const invalid_argument& e) {
         LOG(WARNING) << e.what();
     }
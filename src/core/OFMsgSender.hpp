@@ -22,9 +22,14 @@
 
 #include <fluid/of13msg.hh>
 #include <fluid/ofcommon/msg.hh>
+#include <boost/chrono.hpp>
 
+#include <array>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 namespace runos {
 
@@ -33,32 +38,76 @@ namespace of13 = fluid_msg::of13;
 using message = fluid_msg::OFMsg;
 using msg_status_ptr = std::shared_ptr<struct MsgStatus>;
 
+// Queue classes of rate-limited switches, drained by weighted round
+// robin: a class sends up to its weight per round, higher ones first
+enum class MsgPriority : uint8_t {
+    critical, // failover, anything latency-critical
+    normal,
+    bulk,     // repairs and resyncs
+};
+static constexpr size_t msg_priority_count = 3;
+
 class OFMsgSender : public Application
                   , public SwitchEventHandler
 {
     Q_OBJECT
     SIMPLE_APPLICATION(OFMsgSender, "ofmsg-sender");
 public:
+    ~OFMsgSender();
+
     void init(Loader* loader, const Config& config) override;
     void startUp(Loader *loader) override;
     
-    void send(uint64_t dpid, message& msg);
-    void send(uint64_t dpid, message&& msg);
+    void send(uint64_t dpid, message& msg,
+              MsgPriority priority = MsgPriority::normal);
+    void send(uint64_t dpid, message&& msg,
+              MsgPriority priority = MsgPriority::normal);
+
+    // Congestion window state of rate-limited switches
+    struct WindowInfo {
+        uint64_t dpid;
+        uint32_t limit;   // msgs per barrier
+        size_t queued;    // msgs waiting to be sent
+        std::array<size_t, msg_priority_count> queued_by_priority;
+        int64_t rtt_us;   // last barrier round-trip time
+        int64_t srtt_us;  // smoothed
+        int64_t min_rtt_us;
+    };
+    std::vector<WindowInfo> windows() const;
 
 protected slots:
+    // Looks again at switches waiting for a barrier reply or for a
+    // writable socket, others are woken by their own events
     void polling();
 
 private:
     void switchUp(SwitchPtr sw) override;
     void switchDown(SwitchPtr sw) override;
 
-    void send_impl(uint64_t dpid, message& msg);
+    void send_impl(uint64_t dpid, message& msg, MsgPriority priority);
+
+    // Queues of a switch are drained on its worker when messages are
+    // queued, a barrier reply comes or polling() finds it waiting
+    void schedule(const msg_status_ptr& status);
+    void drain(const msg_status_ptr& status);
+    void on_barrier(const msg_status_ptr& status, uint64_t seq, bool ok,
+                    boost::chrono::steady_clock::time_point replied);
 
     class Poller* poller;
     class FlowEntriesVerifier* verifier;
+    mutable std::mutex status_map_mutex;
     std::map<uint64_t, msg_status_ptr> status_map;
     uint16_t poll_interval;
     uint16_t wait_interval;
+    double vegas_alpha;
+    double vegas_beta;
+    bool skip_installed;
+    std::array<uint32_t, msg_priority_count> priority_weights;
+
+    std::mutex stalled_mutex;
+    std::unordered_map<uint64_t, std::weak_ptr<MsgStatus>> stalled;
+    // Declared last: its tasks use the members above until it's joined
+    std::unique_ptr<class WorkerPool> workers;
 };
 
 } // namespace runos
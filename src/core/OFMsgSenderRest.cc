@@ -0,0 +1,74 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "OFMsgSender.hpp"
+#include "RestListener.hpp"
+
+namespace runos {
+
+struct OFMsgSenderWindows : rest::resource
+{
+    OFMsgSender* app;
+
+    explicit OFMsgSenderWindows(OFMsgSender* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override {
+        rest::ptree root;
+        rest::ptree windows;
+
+        for (const auto& w : app->windows()) {
+            rest::ptree wpt;
+            wpt.put("dpid", w.dpid);
+            wpt.put("limit", w.limit);
+            wpt.put("queued", w.queued);
+            wpt.put("queued_critical", w.queued_by_priority[size_t(MsgPriority::critical)]);
+            wpt.put("queued_normal", w.queued_by_priority[size_t(MsgPriority::normal)]);
+            wpt.put("queued_bulk", w.queued_by_priority[size_t(MsgPriority::bulk)]);
+            wpt.put("rtt_us", w.rtt_us);
+            wpt.put("srtt_us", w.srtt_us);
+            wpt.put("min_rtt_us", w.min_rtt_us);
+            windows.push_back(std::make_pair("", std::move(wpt)));
+        }
+        root.add_child("array", windows);
+        root.put("_size", windows.size());
+        return root;
+    }
+};
+
+class OFMsgSenderRest : public Application
+{
+    SIMPLE_APPLICATION(OFMsgSenderRest, "ofmsg-sender-rest")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto app = OFMsgSender::get(loader);
+        auto rest_ = RestListener::get(loader);
+
+        rest_->mount(path_spec("/ofmsg-sender/windows/"), [=](const path_match&)
+        {
+            return OFMsgSenderWindows {app};
+        });
+    }
+};
+
+REGISTER_APPLICATION(OFMsgSenderRest, {"rest-listener", "ofmsg-sender", ""})
+
+}
@@ -17,10 +17,22 @@
 #include "OFServer.hpp"
 #include "DpidChecker.hpp"
 
+#include "lib/channel_counters.hpp"
+#include "lib/flight_recorder.hpp"
+#include "lib/memory_accounting.hpp"
+#include "lib/metrics.hpp"
+#include "lib/ofp_transport.hpp"
 #include "lib/qt_executor.hpp"
+#include "lib/receive_arena.hpp"
+#include "lib/thread_placement.hpp"
+#include "lib/worker_pool.hpp"
+#ifdef RUNOS_HAVE_LIBURING
+#include "lib/uring_transport.hpp"
+#endif
 #include "OFMessage.hpp"
 #include "OFAgentImpl.hpp"
 
+#include <runos/core/async_logging.hpp>
 #include <runos/core/logging.hpp>
 #include <runos/core/assert.hpp>
 #include <runos/core/catch_all.hpp>
@@ -38,10 +50,15 @@
 #include <boost/range/adaptors.hpp>
 #include <boost/range/algorithm/copy.hpp>
 #include <boost/endian/arithmetic.hpp>
+#include <boost/lockfree/queue.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <tuple>
 #include <iterator>
@@ -49,10 +66,12 @@
 #include <functional>
 #include <list>
 #include <thread>
+#include <vector>
 
 // for msg_limiter
+#include <array>
+#include <algorithm>
 #include <chrono>
-#include <queue>
 
 namespace runos {
 
@@ -66,77 +85,377 @@ typedef fluid_base::OFConnection FluidConnection;
 namespace of13 = fluid_msg::of13;
 
 namespace limiter {
-    using valid_through_t =
-        std::chrono::time_point<std::chrono::steady_clock>;
-    using t_container =
-        std::queue<valid_through_t>;
+    using clock = std::chrono::steady_clock;
+
+    enum message_class {
+        PACKET_IN,
+        MULTIPART_REPLY,
+        OTHER,
+        CLASS_COUNT
+    };
+
+    inline message_class classify(uint8_t type)
+    {
+        switch (type) {
+        case of13::OFPT_PACKET_IN: return PACKET_IN;
+        case of13::OFPT_MULTIPART_REPLY: return MULTIPART_REPLY;
+        default: return OTHER;
+        }
+    }
+
+    // Refills `rate` tokens per second, holds at most `rate` tokens
+    // (one second burst), so footprint doesn't depend on the rate.
+    struct token_bucket {
+        double tokens {0.0};
+        clock::time_point last {};
+
+        bool consume(unsigned rate, clock::time_point now)
+        {
+            if (last == clock::time_point{}) {
+                tokens = rate;
+            } else {
+                std::chrono::duration<double> dt = now - last;
+                tokens = std::min<double>(rate, tokens + rate * dt.count());
+            }
+            last = now;
+
+            if (tokens < 1.0)
+                return false;
+            tokens -= 1.0;
+            return true;
+        }
+    };
+
+    using bucket_set = std::array<token_bucket, CLASS_COUNT>;
 };
 
 struct message_limiter {
     message_limiter() = delete;
-    message_limiter(bool enabled, int max)
-        : enabled(enabled), max_pps(max)
+    message_limiter(bool enabled, int max, int max_packet_in, int max_multipart)
+        : enabled(enabled)
         {
             if (max <= 0) this->enabled = false;
+            max_pps[limiter::OTHER] = max;
+            max_pps[limiter::PACKET_IN] =
+                max_packet_in > 0 ? max_packet_in : max;
+            max_pps[limiter::MULTIPART_REPLY] =
+                max_multipart > 0 ? max_multipart : max;
         }
 
+    // returns false if message should be dropped
+    bool consume(limiter::bucket_set& buckets, uint8_t type)
+    {
+        auto cls = limiter::classify(type);
+        if (buckets[cls].consume(max_pps[cls], limiter::clock::now()))
+            return true;
+        dropped[cls]++;
+        return false;
+    }
+
     bool enabled;
-    unsigned int max_pps;
-    std::unordered_map<int, limiter::t_container> limits;
+    std::array<unsigned int, limiter::CLASS_COUNT> max_pps;
+    std::array<std::atomic<uint64_t>, limiter::CLASS_COUNT> dropped {};
+};
+
+class OFConnectionImpl;
+
+// Owned by OFServer::implementation, read on every message
+static std::atomic<const OFServer::MessageTap*> message_tap {nullptr};
+
+// Pending output bounds of OFConnection::writable(), 0 high is no limit
+struct output_watermarks {
+    size_t high {0};
+    size_t low {0};
 };
 
-struct fluid_conn_data {
+// Received message waiting to be dispatched with others
+struct received_message {
+    std::shared_ptr<void> data;
+    size_t len;
+};
+using received_burst = std::vector<received_message>;
+
+struct connection_data {
     uint64_t dpid;
+    uint8_t aux_id; // of the features reply, 0 for the main connection
+    // Accessed only from the connection's I/O thread, which may change
+    // between reads when the transport rebalances
+    limiter::bucket_set buckets {};
+    // Bound OFConnection, saves registry lookup on the receive path
+    std::shared_ptr<OFConnectionImpl> conn {};
+    // PacketIns of the current read, from the connection's I/O thread
+    received_burst burst {};
+
+    static connection_data* get(ofp_connection* conn)
+    {
+        return reinterpret_cast<connection_data*>
+            (conn->application_data());
+    }
+};
+
+// libfluid connection behind the transport interface. Lives in the
+// libfluid connection's application data from EVENT_STARTED until
+// EVENT_CLOSED is handled.
+class FluidTransportConnection final : public ofp_connection {
+public:
+    explicit FluidTransportConnection(FluidConnection* conn)
+        : conn_(conn)
+    { }
 
-    static fluid_conn_data* get(FluidConnection* conn)
+    static FluidTransportConnection* get(FluidConnection* conn)
     {
-        return reinterpret_cast<fluid_conn_data*>
+        return reinterpret_cast<FluidTransportConnection*>
             (conn->get_application_data());
     }
+
+    int id() const override { return conn_->get_id(); }
+
+    std::string peer_address() const override
+    {
+        return conn_->get_peer_address();
+    }
+
+    bool running() const override
+    {
+        return //conn_->is_alive() &&
+               conn_->get_state() == FluidConnection::STATE_RUNNING;
+    }
+
+    uint8_t version() const override { return conn_->get_version(); }
+
+    void send(const void* data, size_t len) override
+    {
+        conn_->send(const_cast<void*>(data), len);
+    }
+
+    void close() override { conn_->close(); }
+
+private:
+    FluidConnection* conn_;
+};
+
+// Multi-producer queue of packed messages for one connection.
+// Senders never write to the socket concurrently: whoever wins the
+// `draining_` flag flushes everything queued so far with a single
+// transport send, other producers just enqueue and leave.
+class SendQueue {
+public:
+    static constexpr size_t capacity = 4096;
+
+    SendQueue()
+        : queue_(capacity)
+    { }
+
+    ~SendQueue()
+    {
+        packed_buffer buf;
+        while (queue_.pop(buf)) {
+            buf.release();
+        }
+    }
+
+    // Preallocated ring of the lock-free queue
+    static size_t reserved_bytes() { return capacity * sizeof(packed_buffer); }
+
+    // Takes ownership of `data` allocated by OFMsg::pack().
+    // Returns false if queue is full, ownership stays with the caller.
+    bool push(uint8_t* data, size_t len)
+    {
+        return queue_.bounded_push(packed_buffer{data, len});
+    }
+
+    void flush(ofp_connection* conn)
+    {
+        do {
+            if (draining_.test_and_set(std::memory_order_acquire))
+                return; // someone else is flushing, he'll see our data
+
+            coalesced_.clear();
+            packed_buffer buf;
+            while (queue_.pop(buf)) {
+                coalesced_.insert(coalesced_.end(), buf.data, buf.data + buf.len);
+                buf.release();
+            }
+            if (not coalesced_.empty() && conn) {
+                conn->send(coalesced_.data(), coalesced_.size());
+            }
+
+            draining_.clear(std::memory_order_release);
+            // Recheck: producer may have pushed after our last pop
+            // but before the flag was cleared.
+        } while (not queue_.empty());
+    }
+
+private:
+    struct packed_buffer {
+        uint8_t* data;
+        size_t len;
+
+        void release() { fluid_msg::OFMsg::free_buffer(data); }
+    };
+
+    boost::lockfree::queue<packed_buffer> queue_;
+    std::atomic_flag draining_ = ATOMIC_FLAG_INIT;
+    std::vector<uint8_t> coalesced_; // guarded by draining_
 };
 
+// Handlers are kept in an immutable list swapped on change, so
+// dispatch loads it without locking. Expired handlers are pruned by
+// the next change or by the dispatch that finds them.
 template<class Dispatcher>
 class BroadcastSignal {
     using HandlerBase = typename Dispatcher::HandlerBase;
+    using HandlerList = std::vector< std::weak_ptr<HandlerBase> >;
+    using HandlerListPtr = std::shared_ptr<const HandlerList>;
 public:
     void connect(std::shared_ptr<HandlerBase> handler)
     {
-        boost::unique_lock< boost::shared_mutex > lock(mutex);
-        handlers_.push_back(handler);
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        auto next = live_handlers();
+        next->push_back(handler);
+        publish(std::move(next));
     }
 
-    //template<class Message, class... Args>
-    //void dispatch(Message& msg, Args&&... args)
-    //{
-    //    boost::shared_lock< boost::shared_mutex > lock(mutex);
-
-    //    for (auto& weak_handler : handlers_) {
-    //        if (auto handler = weak_handler.lock()) {
-    //            handler->dispatch(msg, std::forward<Args>(args)...);
-    //        }
-    //    }
-    //}
+    // No handlers: callers may skip building dispatchables at all
+    bool empty() const { return empty_.load(std::memory_order_acquire); }
 
     template<class... Args>
     void dispatch(typename Dispatcher::Dispatchable& dispatchable,
                   Args&&... args)
     {
-        boost::shared_lock< boost::shared_mutex > lock(mutex);
+        if (empty())
+            return;
+        auto handlers = std::atomic_load(&handlers_);
+        bool expired = false;
 
-        for (auto& weak_handler : handlers_) {
+        for (auto& weak_handler : *handlers) {
             if (auto handler = weak_handler.lock()) {
                 catch_all_and_log([&]() {
                     dispatchable.dispatch(*handler,
                                           std::forward<Args>(args)...);
                 });
+            } else {
+                expired = true;
+            }
+        }
+        if (expired)
+            gc();
+    }
+
+    // Handlers being OFConnection::ReceiveBatchHandler take `msgs` in
+    // one call, the others get them one by one
+    template<class Message>
+    void dispatch_batch(
+            span<typename Dispatcher::Dispatchable*> dispatchables,
+            span<Message*> msgs)
+    {
+        if (empty())
+            return;
+        auto handlers = std::atomic_load(&handlers_);
+        bool expired = false;
+
+        for (auto& weak_handler : *handlers) {
+            auto handler = weak_handler.lock();
+            if (not handler) {
+                expired = true;
+                continue;
+            }
+            if (auto batch = dynamic_cast<OFConnection::ReceiveBatchHandler*>
+                                 (handler.get())) {
+                catch_all_and_log([&]() {
+                    batch->process_batch(msgs);
+                });
+                continue;
+            }
+            for (auto dispatchable : dispatchables) {
+                catch_all_and_log([&]() {
+                    dispatchable->dispatch(*handler);
+                });
+            }
+        }
+        if (expired)
+            gc();
+    }
+
+    bool accepts(typename Dispatcher::Dispatchable& dispatchable)
+    {
+        if (empty())
+            return false;
+        auto handlers = std::atomic_load(&handlers_);
+
+        for (auto& weak_handler : *handlers) {
+            if (auto handler = weak_handler.lock()) {
+                if (dispatchable.accepted_by(*handler))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // Drops expired handlers from the list
+    void gc()
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        auto current = std::atomic_load(&handlers_);
+        auto next = live_handlers();
+        if (next->size() != current->size())
+            publish(std::move(next));
+    }
+
+private:
+    std::mutex write_mutex_;
+    HandlerListPtr handlers_ { std::make_shared<const HandlerList>() };
+    std::atomic<bool> empty_ {true};
+
+    // Warning: requires write_mutex_
+    std::shared_ptr<HandlerList> live_handlers() const
+    {
+        auto current = std::atomic_load(&handlers_);
+        auto ret = std::make_shared<HandlerList>();
+        ret->reserve(current->size() + 1);
+        for (auto& weak_handler : *current) {
+            if (not weak_handler.expired())
+                ret->push_back(weak_handler);
+        }
+        return ret;
+    }
+
+    // Warning: requires write_mutex_
+    void publish(std::shared_ptr<HandlerList> next)
+    {
+        empty_.store(next->empty(), std::memory_order_release);
+        std::atomic_store(&handlers_, HandlerListPtr(std::move(next)));
+    }
+};
+
+class ViewSignal {
+public:
+    void connect(OFConnection::ViewHandlerPtr handler)
+    {
+        boost::unique_lock< boost::shared_mutex > lock(mutex);
+        handlers_.push_back(handler);
+        empty_ = false;
+    }
+
+    bool empty() const { return empty_; }
+
+    void dispatch(OFMessageView& view)
+    {
+        boost::shared_lock< boost::shared_mutex > lock(mutex);
+
+        for (auto& weak_handler : handlers_) {
+            if (auto handler = weak_handler.lock()) {
+                catch_all_and_log([&]() {
+                    handler->process(view);
+                });
             }
         }
     }
 
-    void gc(); // TODO: delete invalid weak_ptr's from list
 private:
     boost::shared_mutex mutex;
-    std::list< std::weak_ptr<HandlerBase> > handlers_;
+    std::atomic_bool empty_ {true};
+    std::list< std::weak_ptr<OFConnection::ViewHandler> > handlers_;
 };
 
 class OFConnectionImpl final : public OFConnection
@@ -144,13 +463,15 @@ class OFConnectionImpl final : public OFConnection
 {
 public:
     using OFConnection::ReceiveDispatch;
+    using PacketInMessage =
+        ReceiveDispatch::DispatchableMessage<of13::PacketIn>;
 
-    explicit OFConnectionImpl(FluidConnection* fluid_conn, uint64_t dpid)
-        : fluid_conn_(fluid_conn)
+    OFConnectionImpl(ofp_connection* transport, uint64_t dpid,
+                     bool aux_multipart, output_watermarks watermarks)
+        : transport_(transport)
         , dpid_(dpid)
-        , rx_of_packets_(0)
-        , tx_of_packets_(0)
-        , pkt_in_of_packets_(0)
+        , aux_multipart_(aux_multipart)
+        , watermarks_(watermarks)
     { }
 
     uint64_t dpid() const override
@@ -160,17 +481,89 @@ public:
 
     std::string peer_address() const override
     {
-        return fluid_conn_ ? fluid_conn_->get_peer_address() : std::string();
+        auto conn = transport_.load();
+        return conn ? conn->peer_address() : std::string();
+    }
+
+    void transport(ofp_connection* conn)
+    {
+        transport_ = conn;
+    }
+
+    ofp_connection* transport() const
+    {
+        return transport_;
+    }
+
+    // Unbinds `conn` if it's still bound, nothing is closed
+    void detach(ofp_connection* conn)
+    {
+        transport_.compare_exchange_strong(conn, nullptr);
     }
 
-    void fluid_conn(FluidConnection* fluidconn)
+    // Auxiliary connection of the switch, replaces one with the same id
+    void attach_aux(ofp_connection* conn, uint8_t aux_id)
     {
-        fluid_conn_ = fluidconn;
+        boost::unique_lock< boost::shared_mutex > lock(aux_mutex_);
+        auto it = std::find_if(aux_.begin(), aux_.end(),
+                               [aux_id](auto& aux) { return aux->id == aux_id; });
+        auto channel = std::make_shared<aux_channel>(aux_id, conn);
+        if (it != aux_.end()) {
+            *it = std::move(channel);
+        } else {
+            aux_.push_back(std::move(channel));
+        }
+        aux_count_ = aux_.size();
     }
 
-    FluidConnection* fluid_conn() const
+    void detach_aux(ofp_connection* conn)
     {
-        return fluid_conn_;
+        boost::unique_lock< boost::shared_mutex > lock(aux_mutex_);
+        auto it = std::find_if(aux_.begin(), aux_.end(),
+                               [conn](auto& aux) { return aux->transport == conn; });
+        if (it != aux_.end()) {
+            (*it)->transport = nullptr;
+            aux_.erase(it);
+        }
+        aux_count_ = aux_.size();
+    }
+
+    // Auxiliary connections don't outlive the main one
+    void close_aux()
+    {
+        std::vector<ofp_connection*> transports;
+        {
+            boost::shared_lock< boost::shared_mutex > lock(aux_mutex_);
+            for (auto& aux : aux_) {
+                if (auto conn = aux->transport.load())
+                    transports.push_back(conn);
+            }
+        }
+        // CLOSED may come back synchronously and take the lock
+        for (auto conn : transports) {
+            conn->close();
+        }
+    }
+
+    std::vector<uint8_t> auxiliary_ids() const override
+    {
+        std::vector<uint8_t> ret;
+        boost::shared_lock< boost::shared_mutex > lock(aux_mutex_);
+        for (auto& aux : aux_) {
+            ret.push_back(aux->id);
+        }
+        return ret;
+    }
+
+    // Requests awaiting replies and the send queue
+    void memory_usage(memory::Sheet& sheet) const
+    {
+        sheet.add("of-agent-sessions", agent_.memory_usage(), dpid_);
+        size_t queues = 1 + aux_count_.load(std::memory_order_relaxed);
+        sheet.add("send-queue",
+                  { queues * SendQueue::reserved_bytes(),
+                    queues * SendQueue::capacity },
+                  dpid_);
     }
 
     OFAgentPtr agent() const override
@@ -181,12 +574,8 @@ public:
 
     bool alive() const override
     {
-        if (not fluid_conn_)
-        {
-            return false;
-        }
-        return //fluid_conn_->is_alive() &&
-               fluid_conn_->get_state() == FluidConnection::STATE_RUNNING;
+        auto conn = transport_.load();
+        return conn && conn->running();
     }
 
     void set_start_time() override
@@ -196,9 +585,7 @@ public:
 
     void reset_stats() override
     {
-        rx_of_packets_ = 0;
-        tx_of_packets_ = 0;
-        pkt_in_of_packets_ = 0;
+        counters_.reset();
     }
 
     std::chrono::system_clock::time_point get_start_time() const override
@@ -208,27 +595,62 @@ public:
 
     uint64_t get_rx_packets() const override
     {
-        return rx_of_packets_;
+        return counters_.messages(ChannelCounters::rx);
     }
 
     uint64_t get_tx_packets() const override
     {
-        return tx_of_packets_;
+        return counters_.messages(ChannelCounters::tx);
     }
 
     uint64_t get_pkt_in_packets() const override
     {
-        return pkt_in_of_packets_;
+        return counters_.messages(ChannelCounters::rx, of13::OFPT_PACKET_IN);
     }
 
+    // Received messages count themselves by type, this is for PacketIns
+    // taken from elsewhere
     void packet_in_counter() override
     {
-        pkt_in_of_packets_++;
+        counters_.count_type(ChannelCounters::rx, of13::OFPT_PACKET_IN);
+    }
+
+    const ChannelCounters* counters() const override
+    {
+        return &counters_;
+    }
+
+    // Advances the rates, once a second from one thread
+    void tick_counters(ChannelCounters::clock::time_point now)
+    {
+        counters_.tick(now);
+    }
+
+    size_t pending_output() const override
+    {
+        auto conn = transport_.load();
+        return conn ? conn->pending_bytes() : 0;
+    }
+
+    bool writable() const override
+    {
+        if (watermarks_.high == 0)
+            return true;
+
+        auto pending = pending_output();
+        if (blocked_.load(std::memory_order_relaxed)) {
+            if (pending <= watermarks_.low)
+                blocked_ = false;
+        } else if (pending >= watermarks_.high) {
+            blocked_ = true;
+        }
+        return not blocked_;
     }
 
     uint8_t protocol_version() const override
     {
-        return fluid_conn_ ? fluid_conn_->get_version() : 0;
+        auto conn = transport_.load();
+        return conn ? conn->version() : 0;
     }
 
     void send(const fluid_msg::OFMsg& cmsg) override
@@ -237,43 +659,117 @@ public:
         if (not alive())
             return;
 
-        auto dispatchable = make_dispatchable<SendHookDispatch>(msg);
-        send_hook_sig_.dispatch(*dispatchable);
-
-        auto deleter = &fluid_msg::OFMsg::free_buffer;
-        std::unique_ptr<uint8_t[], decltype(deleter)> buf
-            { msg.pack(), deleter };
+        // hooks are rare, don't wrap the message for nobody
+        if (not send_hook_sig_.empty()) {
+            auto dispatchable = make_dispatchable<SendHookDispatch>(msg);
+            send_hook_sig_.dispatch(*dispatchable);
+        }
 
-        //std::thread([this,len = msg.length(), buf = std::move(buf)] {
-        //LOG(ERROR)<<"-|- OFServer send("<<msg.length()<<")";
-        fluid_conn_->send(buf.get(), msg.length());
-        //LOG(ERROR)<<"--- OFServer OK("<<msg.length()<<")";
-        //}).detach();
-        tx_of_packets_++;
+        auto buf = msg.pack();
+        if (auto tap = message_tap.load(std::memory_order_acquire))
+            (*tap)(dpid_, true, buf, msg.length());
+        enqueue(buf, msg.length());
     }
 
     void send(void* msg, size_t size)
     {
-        fluid_conn_->send(msg, size);
-        tx_of_packets_++;
+        // caller keeps ownership of `msg`, OFMsg::free_buffer wants new[]
+        auto copy = new uint8_t[size];
+        std::memcpy(copy, msg, size);
+        if (auto tap = message_tap.load(std::memory_order_acquire))
+            (*tap)(dpid_, true, copy, size);
+        enqueue(copy, size);
+    }
 
+    void send(OFMessageTemplate const& tmpl, uint32_t xid) override
+    {
+        if (not alive())
+            return;
+        auto buf = new uint8_t[tmpl.size()];
+        tmpl.copy_to(buf, xid);
+        if (auto tap = message_tap.load(std::memory_order_acquire))
+            (*tap)(dpid_, true, buf, tmpl.size());
+        enqueue(buf, tmpl.size());
     }
 
-    void on_receive(typename ReceiveDispatch::Dispatchable& dispatchable)
+    void send(PacketOutBuilder const& po) override
+    {
+        if (not alive())
+            return;
+        // the only copy of the payload, from where the caller keeps it
+        auto buf = new uint8_t[po.size()];
+        po.write_to(buf);
+        if (auto tap = message_tap.load(std::memory_order_acquire))
+            (*tap)(dpid_, true, buf, po.size());
+        enqueue(buf, po.size());
+    }
+
+    // Message consumed by a PacketIn filter before dispatching
+    void on_filtered(size_t len)
+    {
+        counters_.count(ChannelCounters::rx, of13::OFPT_PACKET_IN, len);
+    }
+
+    void on_receive(typename ReceiveDispatch::Dispatchable& dispatchable,
+                    uint8_t type, size_t len)
     {
         receive_sig_.dispatch(dispatchable);
-        rx_of_packets_++;
+        counters_.count(ChannelCounters::rx, type, len);
+    }
+
+    // View handlers go first, typed handlers are dispatched only
+    // if some of them accepts this message type.
+    template<class Unpack>
+    void on_receive(OFMessageView& view,
+                    typename ReceiveDispatch::Dispatchable& dispatchable,
+                    Unpack&& unpack)
+    {
+        if (not view_sig_.empty()) {
+            view_sig_.dispatch(view);
+        }
+        if (receive_sig_.accepts(dispatchable) && unpack()) {
+            receive_sig_.dispatch(dispatchable);
+        }
+        counters_.count(ChannelCounters::rx, view.type(), view.length());
+    }
+
+    // PacketIns of one read, `unpack(i)` unpacks msgs[i]. View handlers
+    // see all of them first, then typed handlers the unpacked ones.
+    template<class Unpack>
+    void on_receive_batch(span<OFMessageView> views,
+                          span<PacketInMessage*> msgs,
+                          Unpack&& unpack)
+    {
+        if (not view_sig_.empty()) {
+            for (auto& view : views)
+                view_sig_.dispatch(view);
+        }
+        if (not msgs.empty() && receive_sig_.accepts(*msgs[0])) {
+            std::vector<ReceiveDispatch::Dispatchable*> dispatchables;
+            std::vector<of13::PacketIn*> unpacked;
+            dispatchables.reserve(msgs.size());
+            unpacked.reserve(msgs.size());
+            for (size_t i = 0; i < msgs.size(); ++i) {
+                if (unpack(i)) {
+                    dispatchables.push_back(msgs[i]);
+                    unpacked.push_back(msgs[i]);
+                }
+            }
+            receive_sig_.dispatch_batch(
+                span<ReceiveDispatch::Dispatchable*>(dispatchables),
+                span<of13::PacketIn*>(unpacked));
+        }
+        for (auto& view : views)
+            counters_.count(ChannelCounters::rx, view.type(), view.length());
     }
 
     void close() override
     {
-        if (fluid_conn_) {
-            fluid_conn_->close();
-            fluid_conn_ = nullptr;
-            tx_of_packets_ = 0;
-            rx_of_packets_ = 0;
-            pkt_in_of_packets_ = 0;
+        if (auto conn = transport_.exchange(nullptr)) {
+            conn->close();
+            counters_.reset();
         }
+        close_aux();
     }
 
     void send_hook(SendHookHandlerPtr handler) override
@@ -286,17 +782,87 @@ public:
         receive_sig_.connect(handler);
     }
 
+    void receive_view(ViewHandlerPtr handler) override
+    {
+        view_sig_.connect(handler);
+    }
+
 private:
-    FluidConnection* fluid_conn_;
+    struct aux_channel {
+        aux_channel(uint8_t id, ofp_connection* transport)
+            : id(id), transport(transport)
+        { }
+
+        const uint8_t id;
+        std::atomic<ofp_connection*> transport; // cleared on CLOSED
+        SendQueue queue;
+    };
+    using aux_channel_ptr = std::shared_ptr<aux_channel>;
+
+    void enqueue(uint8_t* data, size_t len)
+    {
+        // the queue owns `data` once pushed
+        counters_.count(ChannelCounters::tx, data[1], len);
+        if (auto aux = aux_for(data, len)) {
+            push(aux->queue, aux->transport.load(), data, len);
+        } else {
+            push(send_queue_, transport_.load(), data, len);
+        }
+    }
+
+    static void push(SendQueue& queue, ofp_connection* conn,
+                     uint8_t* data, size_t len)
+    {
+        while (not queue.push(data, len)) {
+            // Queue overflow: help draining instead of reordering
+            queue.flush(conn);
+            std::this_thread::yield();
+        }
+        queue.flush(conn);
+    }
+
+    // Multipart requests are spread over the running auxiliary
+    // connections by xid, so stats don't wait behind FlowMods. The rest,
+    // FlowMods and barriers first of all, keeps its order on the main one.
+    aux_channel_ptr aux_for(const uint8_t* data, size_t len) const
+    {
+        if (not aux_multipart_ || aux_count_.load(std::memory_order_relaxed) == 0)
+            return nullptr;
+        // Single messages only, OFMsgSender sends several back to back
+        if (len < 8 || data[1] != of13::OFPT_MULTIPART_REQUEST ||
+                (size_t(data[2]) << 8 | data[3]) != len)
+            return nullptr;
+        uint32_t xid = uint32_t(data[4]) << 24 | uint32_t(data[5]) << 16 |
+                       uint32_t(data[6]) << 8 | data[7];
+
+        boost::shared_lock< boost::shared_mutex > lock(aux_mutex_);
+        for (size_t i = 0; i < aux_.size(); ++i) {
+            auto& aux = aux_[(xid + i) % aux_.size()];
+            auto conn = aux->transport.load();
+            if (conn && conn->running())
+                return aux;
+        }
+        return nullptr;
+    }
+
+    // Cleared by close() and when the transport reports CLOSED
+    std::atomic<ofp_connection*> transport_;
     uint64_t dpid_;
+    SendQueue send_queue_;
+
+    const bool aux_multipart_;
+    const output_watermarks watermarks_;
+    mutable std::atomic_bool blocked_ {false};
+    mutable boost::shared_mutex aux_mutex_;
+    std::vector<aux_channel_ptr> aux_;
+    std::atomic<size_t> aux_count_ {0};
 
     std::chrono::system_clock::time_point conn_start_time_;
-    uint64_t rx_of_packets_;
-    uint64_t tx_of_packets_;
-    uint64_t pkt_in_of_packets_;
+    ChannelCounters counters_;
 
     BroadcastSignal< SendHookDispatch > send_hook_sig_;
     BroadcastSignal< ReceiveDispatch > receive_sig_;
+    ViewSignal view_sig_;
 
     // Keep this field at the end because
     // OFAgentImpl ctor uses OFConnection, so it must
@@ -309,6 +875,80 @@ typedef std::shared_ptr<OFConnectionImpl>
 typedef std::weak_ptr<OFConnectionImpl>
     OFConnectionImplWeakPtr;
 
+// Connections sharded by dpid, so switches reconnecting in parallel
+// don't serialize on a single lock.
+class ConnectionRegistry {
+public:
+    static constexpr size_t shards_count = 16;
+
+    OFConnectionImplPtr find(uint64_t dpid) const
+    {
+        auto& shard = shard_for(dpid);
+        boost::shared_lock< boost::shared_mutex > rlock(shard.mutex);
+        auto it = shard.map.find(dpid);
+        return it != shard.map.end() ? it->second : nullptr;
+    }
+
+    // Returns existing connection or one created by `make`,
+    // second is true if connection was created.
+    template<class Factory>
+    std::pair<OFConnectionImplPtr, bool>
+    find_or_emplace(uint64_t dpid, Factory&& make)
+    {
+        if (auto ret = find(dpid)) {
+            return {ret, false};
+        }
+
+        auto& shard = shard_for(dpid);
+        boost::unique_lock< boost::shared_mutex > wlock(shard.mutex);
+        auto it = shard.map.find(dpid);
+        if (it != shard.map.end()) {
+            return {it->second, false};
+        }
+        auto ret = make();
+        shard.map.emplace(dpid, ret);
+        return {ret, true};
+    }
+
+    std::vector<OFConnectionImplPtr> values() const
+    {
+        std::vector<OFConnectionImplPtr> ret;
+        for (auto& shard : shards_) {
+            boost::shared_lock< boost::shared_mutex > rlock(shard.mutex);
+            boost::copy(shard.map | boost::adaptors::map_values,
+                        std::back_inserter(ret));
+        }
+        return ret;
+    }
+
+private:
+    struct shard_type {
+        mutable boost::shared_mutex mutex;
+        std::unordered_map<uint64_t, OFConnectionImplPtr> map;
+    };
+
+    shard_type& shard_for(uint64_t dpid)
+    {
+        return shards_[shard_index(dpid)];
+    }
+
+    const shard_type& shard_for(uint64_t dpid) const
+    {
+        return shards_[shard_index(dpid)];
+    }
+
+    static size_t shard_index(uint64_t dpid)
+    {
+        // dpids often differ in low or high bytes only, mix them
+        dpid ^= dpid >> 33;
+        dpid *= 0xff51afd7ed558ccdULL;
+        dpid ^= dpid >> 33;
+        return dpid % shards_count;
+    }
+
+    std::array<shard_type, shards_count> shards_;
+};
+
 struct OFServer::implementation : fluid_base::OFServer
 {
     typedef std::unordered_map<uint64_t, shared_future<OFConnectionImplPtr>>
@@ -327,14 +967,37 @@ struct OFServer::implementation : fluid_base::OFServer
     std::unordered_map<uint64_t, shared_future<OFConnectionImplPtr>>
         connection_futures;
 
-    mutable boost::shared_mutex connections_mutex;
-    std::unordered_map<uint64_t, OFConnectionImplPtr>
-        connections;
+    ConnectionRegistry connections;
+    // Multipart requests go to auxiliary connections if there are any
+    bool aux_multipart {true};
+    output_watermarks watermarks;
+
+    // nullptr if messages are dispatched on libfluid threads
+    std::unique_ptr<WorkerPool> workers;
+    // Most PacketIns of one read dispatched together, 0 or 1 if they
+    // go one by one. Only transports reporting read ends batch them.
+    size_t packet_in_batch {0};
+
+    // Rebuilt on every register_packet_in_filter, read lock-free
+    // by process_message
+    using PacketInFilters =
+        std::vector<std::pair<uint16_t, runos::OFServer::PacketInFilter>>;
+    std::shared_ptr<const PacketInFilters> packet_in_filters
+        = std::make_shared<PacketInFilters>();
+    boost::mutex packet_in_filters_mutex;
+    std::unique_ptr<const MessageTap> message_tap;
+
+    // True if some PacketIn filter consumed the message
+    bool filter_packet_in(const OFConnectionImplPtr& conn,
+                          const void* data, size_t len);
 
     QTimer* defer_log_timer;
     std::unordered_map<uint64_t,uint64_t> connection_msgs_before_feature_reply;
     std::chrono::system_clock::time_point ctrl_start_time_;
 
+    // Goes first on destruction, before the connections it walks
+    memory::Registry::Handle memory_probe;
+
     shared_future<OFConnectionImplPtr> get_connection_future(uint64_t dpid);
 
     implementation(runos::OFServer& app,
@@ -345,13 +1008,20 @@ struct OFServer::implementation : fluid_base::OFServer
                    const bool secure = false,
                    const bool limits = false,
                    const int max_pps = 500,
+                   const int max_pps_packet_in = 0,
+                   const int max_pps_multipart = 0,
+                   const int dispatch_threads = 0,
+                   const bool dispatch_pin = false,
                    const class fluid_base::OFServerSettings ofsc
                         = fluid_base::OFServerSettings())
             : fluid_base::OFServer(address, port, nthreads, secure, ofsc)
             , app(app)
             , executor(&app)
-            , limiter(limits, max_pps)
+            , limiter(limits, max_pps, max_pps_packet_in, max_pps_multipart)
             , dpid_checker(checker)
+            , workers(dispatch_threads > 0
+                        ? new WorkerPool(dispatch_threads, dispatch_pin)
+                        : nullptr)
             , defer_log_timer(new QTimer(&app))
     {
         // log attempt connection
@@ -376,10 +1046,9 @@ struct OFServer::implementation : fluid_base::OFServer
 
         auto close_connection_lambda = [this](uint64_t dpid) {
             async(executor, [this, dpid]() {
-                auto conn = connections.find(dpid);
-                if (connections.end() != conn) {
-                    (*conn).second->close();
-                    emit this->app.connectionDown(conn->second);
+                if (auto conn = connections.find(dpid)) {
+                    conn->close();
+                    emit this->app.connectionDown(conn);
                     LOG(WARNING) << "[OFServer] Switch with dpid=" << dpid
                         << " has been removed from registered role list."
                         << " Connection is closed.";
@@ -391,14 +1060,42 @@ struct OFServer::implementation : fluid_base::OFServer
                          close_connection_lambda);
     }
 
-    OFConnectionImplPtr get_connection(FluidConnection *conn);
+#ifdef RUNOS_HAVE_LIBURING
+    // Set if switches are served by io_uring instead of libfluid
+    std::unique_ptr<uring_transport> uring;
+#endif
+    // Transport connection ids of switches, for the I/O thread loads
+    mutable std::mutex dpid_by_id_mutex;
+    std::unordered_map<int, uint64_t> dpid_by_id;
+
+    void start_transport();
 
+    OFConnectionImplPtr get_connection(ofp_connection *conn);
+    // Binds auxiliary connection to the OFConnection of its switch
+    void attach_aux(ofp_connection *conn, uint64_t dpid, uint8_t aux_id);
+
+    // libfluid callbacks, forward to the transport independent ones
     void message_callback(FluidConnection *fluid_conn,
                           uint8_t type, void* data_, size_t len) override;
-
     void connection_callback(FluidConnection *conn,
                              FluidConnection::Event type) override;
 
+    // Takes ownership of `data_`, it's released by `deleter` which
+    // may run on a dispatch worker after the connection is closed
+    template<class Release>
+    void on_message(ofp_connection *transport, Release deleter,
+                    uint8_t type, void* data_, size_t len);
+    void on_event(ofp_connection *conn, ofp_connection::event type);
+
+    // Unpacks and dispatches message, runs on the switch's worker
+    // if dispatch workers are enabled.
+    void process_message(OFConnectionImplPtr conn, int conn_id,
+                         uint8_t type, void* data, size_t len);
+    // PacketIns of the connection are read, dispatches them together
+    void flush_burst(ofp_connection* transport);
+    void process_burst(OFConnectionImplPtr conn, int conn_id,
+                       received_burst& burst);
+
     void print_error(of13::Error &msg, OFConnectionImplPtr conn);
     std::string flow_mod_failed_descr(uint16_t error_code);
     std::string group_mod_failed_descr(uint16_t error_code);
@@ -443,6 +1140,76 @@ uint64_t OFServer::get_pkt_in_openflow_packets() const
     return ret;
 }
 
+void OFServer::register_packet_in_filter(uint16_t eth_type,
+                                         PacketInFilter filter)
+{
+    boost::lock_guard<boost::mutex> lock(impl->packet_in_filters_mutex);
+    auto filters = std::make_shared<implementation::PacketInFilters>(
+                       *std::atomic_load(&impl->packet_in_filters));
+    filters->emplace_back(eth_type, std::move(filter));
+    std::atomic_store(&impl->packet_in_filters,
+                      std::shared_ptr<const implementation::PacketInFilters>(
+                          std::move(filters)));
+}
+
+bool OFServer::has_packet_in_filters() const
+{
+    return not std::atomic_load(&impl->packet_in_filters)->empty();
+}
+
+void OFServer::set_message_tap(MessageTap tap)
+{
+    CHECK(not impl->message_tap) << "Message tap is already set";
+    impl->message_tap.reset(new MessageTap(std::move(tap)));
+    message_tap.store(impl->message_tap.get(), std::memory_order_release);
+}
+
+bool OFServer::limiter_enabled() const
+{
+    return impl->limiter.enabled;
+}
+
+uint64_t OFServer::get_dropped_pkt_in_packets() const
+{
+    return impl->limiter.dropped[limiter::PACKET_IN];
+}
+
+uint64_t OFServer::get_dropped_multipart_packets() const
+{
+    return impl->limiter.dropped[limiter::MULTIPART_REPLY];
+}
+
+uint64_t OFServer::get_dropped_other_packets() const
+{
+    return impl->limiter.dropped[limiter::OTHER];
+}
+
+std::vector<OFServer::IOThreadLoad> OFServer::io_thread_loads() const
+{
+    std::vector<IOThreadLoad> ret;
+#ifdef RUNOS_HAVE_LIBURING
+    if (not impl->uring)
+        return ret;
+
+    std::lock_guard<std::mutex> lock(impl->dpid_by_id_mutex);
+    for (auto& load : impl->uring->loads()) {
+        IOThreadLoad thread;
+        thread.connections = load.connections;
+        thread.load = load.load;
+        thread.migrated_in = load.migrated_in;
+        thread.migrated_out = load.migrated_out;
+        for (auto& conn : load.top) {
+            auto it = impl->dpid_by_id.find(conn.first);
+            thread.switches.push_back({
+                it != impl->dpid_by_id.end() ? it->second : 0, conn.second
+            });
+        }
+        ret.push_back(std::move(thread));
+    }
+#endif
+    return ret;
+}
+
 shared_future<OFConnectionImplPtr>
 OFServer::implementation::get_connection_future(uint64_t dpid)
 {
@@ -463,43 +1230,46 @@ OFServer::implementation::get_connection_future(uint64_t dpid)
 }
 
 OFConnectionImplPtr
-OFServer::implementation::get_connection(FluidConnection *conn)
+OFServer::implementation::get_connection(ofp_connection *conn)
 {
-    if (auto conn_data = fluid_conn_data::get(conn)) {
-        auto dpid = conn_data->dpid;
-
-        boost::upgrade_lock< boost::shared_mutex > rlock{connections_mutex};
-        auto it = connections.find(dpid);
-        auto ret = (it != connections.end()) ? it->second : nullptr;
+    if (auto conn_data = connection_data::get(conn)) {
+        // Fast path: transport connection is bound to its OFConnection
+        if (conn_data->conn && (conn_data->aux_id != 0 ||
+                                conn_data->conn->transport() == conn)) {
+            return conn_data->conn;
+        }
+        if (conn_data->aux_id != 0) {
+            return nullptr; // auxiliary connection wasn't attached
+        }
 
-        if (ret) {
+        auto dpid = conn_data->dpid;
+        auto registered = connections.find_or_emplace(dpid, [&]() {
+            return std::make_shared<OFConnectionImpl>(conn, dpid,
+                                                      aux_multipart,
+                                                      watermarks);
+        });
+        auto ret = registered.first;
+
+        if (not registered.second) {
             // Switch has been seen before
-
-            rlock.unlock();
             CHECK(ret->dpid() == dpid);
 
-            if (ret->fluid_conn() != conn) {
+            auto bound = ret->transport();
+            if (bound != conn) {
                 if (ret->alive()) {
                     LOG(ERROR) << "Duplicate dpid (" << dpid << ")"
                         << " detected between connections "
-                        << ret->fluid_conn()->get_id()
-                        << " and " << conn->get_id();
+                        << bound->id()
+                        << " and " << conn->id();
                     conn->close();
                 } else {
-                    ret->fluid_conn(conn);
+                    ret->transport(conn);
                     ret->set_start_time();
                     emit app.connectionUp(ret);
                 }
             }
         } else {
-            // Create new OFConnection
-            ret = std::make_shared<OFConnectionImpl>(conn, dpid);
-            {
-                boost::upgrade_to_unique_lock< boost::shared_mutex > wlock{rlock};
-                connections.emplace(dpid, ret);
-            }
-            rlock.unlock();
-
+            // New OFConnection has been created
             emit app.switchDiscovered(ret);
             ret->set_start_time();
             emit app.connectionUp(ret);
@@ -516,6 +1286,9 @@ OFServer::implementation::get_connection(FluidConnection *conn)
             });
         }
 
+        if (ret->transport() == conn) {
+            conn_data->conn = ret;
+        }
         return ret;
     } else {
         // feature-reply hasn't been received yet
@@ -524,42 +1297,47 @@ OFServer::implementation::get_connection(FluidConnection *conn)
 }
 
 void
-OFServer::implementation::message_callback(FluidConnection *fluid_conn,
-                                           uint8_t type,
-                                           void* data_,
-                                           size_t len)
-{ catch_all_and_log([&]() {
-    auto deleter = [this](void* ptr){ free_data(ptr); };
-    std::unique_ptr<void, decltype(deleter)> data {data_, deleter};
-
-    struct exthdr {
-        big_uint8_t version;
-        big_uint8_t type;
-        big_uint16_t length;
-        big_uint32_t xid;
-        big_uint16_t mpart_type;
-    };
-
-    uint16_t mpart = 0xffff;
-    if (len >= sizeof(exthdr)) {
-        auto hdr = reinterpret_cast<exthdr*>(data_);
-        mpart = hdr->mpart_type;
-        CHECK(type == hdr->type);
+OFServer::implementation::attach_aux(ofp_connection *transport,
+                                     uint64_t dpid, uint8_t aux_id)
+{
+    auto conn_data = connection_data::get(transport);
+    if (conn_data->conn)
+        return; // features reply has been requested again
+
+    auto conn = connections.find(dpid);
+    if (not conn || not conn->alive()) {
+        LOG(WARNING) << "[OFServer] Auxiliary connection id="
+                     << transport->id() << " (auxiliary_id="
+                     << unsigned(aux_id) << ") of switch dpid=" << dpid
+                     << " has no main connection, closing";
+        transport->close();
+        return;
     }
 
-    auto dispatchable
-        = make_dispatchable<OFConnectionImpl::ReceiveDispatch>(type, mpart);
-    auto& msg
-        = dynamic_cast<fluid_msg::OFMsg&>(*dispatchable);
+    conn->attach_aux(transport, aux_id);
+    conn_data->conn = conn;
+    LOG(INFO) << "[OFServer] Connection id=" << transport->id()
+              << " is auxiliary connection " << unsigned(aux_id)
+              << " of switch dpid=" << dpid;
+}
 
-    if (msg.unpack((uint8_t*) data_) != 0) {
-        LOG(WARNING) << "[OFServer] message_callback - Malformed "
-            "message received from connection " << fluid_conn->get_id();
-        return;
-    }
+template<class Release>
+void
+OFServer::implementation::on_message(ofp_connection *transport,
+                                     Release deleter,
+                                     uint8_t type,
+                                     void* data_,
+                                     size_t len)
+{ catch_all_and_log([&]() {
+    std::unique_ptr<void, decltype(deleter)> data {data_, deleter};
 
     if (type == of13::OFPT_FEATURES_REPLY) {
-        auto& fr = dynamic_cast<of13::FeaturesReply&>(msg);
+        of13::FeaturesReply fr;
+        if (fr.unpack((uint8_t*) data_) != 0) {
+            LOG(WARNING) << "[OFServer] message_callback - Malformed "
+                "message received from connection " << transport->id();
+            return;
+        }
         auto dpid = fr.datapath_id();
 
         if (not dpid_checker->isRegistered(dpid)) {
@@ -568,7 +1346,7 @@ OFServer::implementation::message_callback(FluidConnection *fluid_conn,
                 // print log for dpid for the first time
                 LOG(ERROR) << "[OFServer] message_callback - Role of switch "
                     "with dpid=" << dpid << " is undefined. Connection with id="
-                    << fluid_conn->get_id() << " dropped";
+                    << transport->id() << " dropped";
                 // initialize connection attempts
                 connection_msgs_before_feature_reply.insert(std::make_pair(dpid, 1));
             } else {
@@ -578,26 +1356,200 @@ OFServer::implementation::message_callback(FluidConnection *fluid_conn,
             if (not defer_log_timer->isActive()) {
                 QMetaObject::invokeMethod(defer_log_timer, "start", Qt::QueuedConnection);
             }
-            fluid_conn->close();
+            transport->close();
             return;
         }
 
-        if (auto conn_data = fluid_conn_data::get(fluid_conn)) {
+        if (auto conn_data = connection_data::get(transport)) {
             CHECK(conn_data->dpid == dpid);
         } else {
-            if (limiter.enabled && limiter.limits.count(fluid_conn->get_id()) == 0)
-                limiter.limits.emplace(fluid_conn->get_id(), limiter::t_container());
-            fluid_conn->set_application_data(new fluid_conn_data {dpid});
-            LOG(INFO) << "Connection id=" << fluid_conn->get_id()
+            transport->set_application_data(
+                new connection_data {dpid, fr.auxiliary_id()});
+            {
+                std::lock_guard<std::mutex> lock(dpid_by_id_mutex);
+                dpid_by_id[transport->id()] = dpid;
+            }
+            LOG(INFO) << "Connection id=" << transport->id()
                       << " ends on switch dpid=" << dpid;
         }
+
+        // Switch is brought up by the features reply of the main
+        // connection only
+        if (fr.auxiliary_id() != 0) {
+            attach_aux(transport, dpid, fr.auxiliary_id());
+            return;
+        }
+    }
+
+    if (flight::enabled()) {
+        auto conn_data = connection_data::get(transport);
+        flight::record(flight::kind::message_received, type,
+                       conn_data ? conn_data->dpid : 0, uint32_t(len));
+    }
+
+    if (auto tap = message_tap.load(std::memory_order_acquire)) {
+        auto conn_data = connection_data::get(transport);
+        (*tap)(conn_data ? conn_data->dpid : 0, false,
+               static_cast<const uint8_t*>(data_), len);
+    }
+
+    // Is used for limiting OFMsg/sec from switches
+    if (limiter.enabled) {
+        auto conn_data = connection_data::get(transport);
+        if (conn_data && not limiter.consume(conn_data->buckets, type)) {
+            AVLOG(6, "Drop message ({}) from connection id={}",
+                  unsigned(type), transport->id());
+            return;
+        }
+    }
+
+    auto conn = get_connection(transport);
+    int conn_id = transport->id();
+
+    if (auto conn_data = connection_data::get(transport)) {
+        if (type == of13::OFPT_PACKET_IN && conn && packet_in_batch > 1) {
+            conn_data->burst.push_back(
+                {std::shared_ptr<void>{data.release(), deleter}, len});
+            if (conn_data->burst.size() >= packet_in_batch)
+                flush_burst(transport);
+            return;
+        }
+        // the switch's messages are dispatched in order
+        flush_burst(transport);
+    }
+
+    if (workers && conn) {
+        // Keep all messages of one switch on the same worker (FIFO)
+        std::shared_ptr<void> shared_data {data.release(), deleter};
+        workers->submit(conn->dpid(),
+            [this, conn, conn_id, type, shared_data, len]() {
+                process_message(conn, conn_id, type, shared_data.get(), len);
+            });
+    } else {
+        process_message(conn, conn_id, type, data.get(), len);
+    }
+} ); }
+
+void OFServer::implementation::flush_burst(ofp_connection* transport)
+{
+    auto conn_data = connection_data::get(transport);
+    if (not conn_data || conn_data->burst.empty())
+        return;
+
+    auto burst = std::move(conn_data->burst);
+    conn_data->burst.clear();
+    auto conn = get_connection(transport);
+    if (not conn)
+        return;
+    int conn_id = transport->id();
+
+    if (workers) {
+        auto shared = std::make_shared<received_burst>(std::move(burst));
+        workers->submit(conn->dpid(), [this, conn, conn_id, shared]() {
+            process_burst(conn, conn_id, *shared);
+        });
+    } else {
+        process_burst(conn, conn_id, burst);
+    }
+}
+
+void
+OFServer::implementation::message_callback(FluidConnection *fluid_conn,
+                                           uint8_t type,
+                                           void* data_,
+                                           size_t len)
+{
+    // Any message proves the switch alive, not only libfluid's own
+    // echo replies, which queue behind everything else under load
+    fluid_conn->set_alive(true);
+    on_message(FluidTransportConnection::get(fluid_conn),
+               [this](void* ptr){ free_data(ptr); },
+               type, data_, len);
+}
+
+// Unpacking and dispatching of one received message, per message type
+static metrics::Histogram& dispatch_histogram(uint8_t type)
+{
+    static const std::vector<metrics::Histogram*> histograms = []() {
+        std::vector<metrics::Histogram*> ret;
+        for (unsigned t = 0; t <= 0xff; ++t) {
+            ret.push_back(&metrics::Registry::global().histogram(
+                "runos_openflow_dispatch_seconds",
+                "Time to dispatch a received OpenFlow message",
+                {{"type", ChannelCounters::type_name(uint8_t(t))}}));
+        }
+        return ret;
+    }();
+    return *histograms[type];
+}
+
+void
+OFServer::implementation::process_message(OFConnectionImplPtr conn,
+                                          int conn_id,
+                                          uint8_t type,
+                                          void* data_,
+                                          size_t len)
+{
+    metrics::ScopedTimer timer(dispatch_histogram(type));
+    flight::timed flight_event(flight::kind::message_dispatched, type,
+                               conn ? conn->dpid() : 0);
+    // libfluid objects of the message come from the thread's arena
+    ReceiveArena::Scope arena;
+
+    if (type == of13::OFPT_PACKET_IN && conn &&
+            filter_packet_in(conn, data_, len)) {
+        conn->on_filtered(len);
+        return;
+    }
+
+    struct exthdr {
+        big_uint8_t version;
+        big_uint8_t type;
+        big_uint16_t length;
+        big_uint32_t xid;
+        big_uint16_t mpart_type;
+    };
+
+    uint16_t mpart = 0xffff;
+    if (len >= sizeof(exthdr)) {
+        auto hdr = reinterpret_cast<exthdr*>(data_);
+        mpart = hdr->mpart_type;
+        CHECK(type == hdr->type);
+    }
+
+    auto dispatchable
+        = make_dispatchable<OFConnectionImpl::ReceiveDispatch>(type, mpart);
+    auto& msg
+        = dynamic_cast<fluid_msg::OFMsg&>(*dispatchable);
+
+    // PacketIn's, multipart replies and experimenter messages
+    // are unpacked on demand
+    bool lazy = type == of13::OFPT_PACKET_IN ||
+                type == of13::OFPT_MULTIPART_REPLY ||
+                type == of13::OFPT_EXPERIMENTER;
+    enum { PENDING, UNPACKED, MALFORMED } unpack_state = PENDING;
+    auto unpack = [&]() -> bool {
+        if (unpack_state == PENDING) {
+            if (msg.unpack((uint8_t*) data_) != 0) {
+                LOG(WARNING) << "[OFServer] message_callback - Malformed "
+                    "message received from connection " << conn_id;
+                unpack_state = MALFORMED;
+            } else {
+                unpack_state = UNPACKED;
+            }
+        }
+        return unpack_state == UNPACKED;
+    };
+
+    if (not lazy && not unpack()) {
+        return;
     }
 
     // print verbose message for flow mod error, group mod error and meter mod error
     try {
         if ((of13::OFPT_ERROR == type) && (msg.xid() < OFAgentImpl::get_minimal_xid())) {
             auto& error_msg = dynamic_cast<of13::Error&>(msg);
-            this->print_error(error_msg, get_connection(fluid_conn));
+            this->print_error(error_msg, conn);
         }
     } catch(const std::bad_cast& e) {
         LOG(ERROR) << "[OFServer] Error message received - Bad cast message to of13::Error. What="
@@ -605,68 +1557,216 @@ OFServer::implementation::message_callback(FluidConnection *fluid_conn,
         throw;
     }
 
-    // Is used for limiting OFMsg/sec from switches
-    if (limiter.enabled) {
-        auto& limits = limiter.limits[fluid_conn->get_id()];
-        auto now = std::chrono::steady_clock::now();
-
-        // clear outdated message's timepoints (older than 1 sec)
-        while (not limits.empty() &&
-               now - limits.front() > std::chrono::seconds(1))
-            limits.pop();
-
-        // drop exceeded packet (when timepoint's container is full)
-        if (limits.size() > limiter.max_pps) {
-            VLOG(6) << "Drop message (" << (unsigned) msg.type() << ") "
-                       << "from connection id=" << fluid_conn->get_id();
-            return;
+    if (conn) {
+        // TODO: catch exceptions inside signal
+        if (lazy) {
+            OFMessageView view {
+                type,
+                type == of13::OFPT_MULTIPART_REPLY ? mpart : uint16_t(0xffff),
+                static_cast<const uint8_t*>(data_), len,
+                [&]() { return unpack() ? &msg : nullptr; }
+            };
+            conn->on_receive(view, *dispatchable, unpack);
+        } else {
+            conn->on_receive(*dispatchable, type, len);
         }
+    }
+}
 
-        // add timepoint to container
-        limits.push(now);
+void
+OFServer::implementation::process_burst(OFConnectionImplPtr conn,
+                                        int conn_id,
+                                        received_burst& burst)
+{
+    if (burst.size() == 1) {
+        process_message(conn, conn_id, of13::OFPT_PACKET_IN,
+                        burst[0].data.get(), burst[0].len);
+        return;
     }
 
-    if (auto conn = get_connection(fluid_conn)) {
-        // TODO: catch exceptions inside signal
-        conn->on_receive(*dispatchable);
-        if (type == of13::OFPT_PACKET_IN) {
-            conn->packet_in_counter();
+    static metrics::Histogram& histogram =
+        metrics::Registry::global().histogram(
+            "runos_openflow_packet_in_batch_seconds",
+            "Time to dispatch the PacketIns of one read together");
+    static metrics::Counter& batched = metrics::Registry::global().counter(
+        "runos_openflow_batched_packet_ins_total",
+        "PacketIns dispatched together with others of the same read");
+    metrics::ScopedTimer timer(histogram);
+
+    using PacketInMessage = OFConnectionImpl::PacketInMessage;
+    enum state : uint8_t { PENDING, UNPACKED, MALFORMED };
+    std::vector<std::unique_ptr<PacketInMessage>> owned;
+    std::vector<PacketInMessage*> msgs;
+    std::vector<const uint8_t*> data;
+    std::vector<size_t> lens;
+    std::vector<state> states;
+    std::vector<OFMessageView> views;
+    owned.reserve(burst.size());
+    msgs.reserve(burst.size());
+    data.reserve(burst.size());
+    lens.reserve(burst.size());
+    views.reserve(burst.size());
+
+    auto unpack = [&](size_t i) -> bool {
+        if (states[i] == PENDING) {
+            if (msgs[i]->unpack(const_cast<uint8_t*>(data[i])) != 0) {
+                LOG(WARNING) << "[OFServer] message_callback - Malformed "
+                    "message received from connection " << conn_id;
+                states[i] = MALFORMED;
+            } else {
+                states[i] = UNPACKED;
+            }
         }
+        return states[i] == UNPACKED;
+    };
+
+    for (auto& message : burst) {
+        if (filter_packet_in(conn, message.data.get(), message.len)) {
+            conn->on_filtered(message.len);
+            continue;
+        }
+        owned.push_back(std::make_unique<PacketInMessage>());
+        msgs.push_back(owned.back().get());
+        data.push_back(static_cast<const uint8_t*>(message.data.get()));
+        lens.push_back(message.len);
     }
-} ); }
+    states.assign(msgs.size(), PENDING);
+    for (size_t i = 0; i < msgs.size(); ++i) {
+        views.emplace_back(of13::OFPT_PACKET_IN, uint16_t(0xffff),
+                           data[i], lens[i],
+                           [&unpack, &msgs, i]() -> fluid_msg::OFMsg* {
+                               return unpack(i) ? msgs[i] : nullptr;
+                           });
+    }
+
+    conn->on_receive_batch(span<OFMessageView>(views),
+                           span<PacketInMessage*>(msgs), unpack);
+    batched.add(msgs.size());
+}
+
+bool
+OFServer::implementation::filter_packet_in(const OFConnectionImplPtr& conn,
+                                           const void* data, size_t len)
+{
+    auto filters = std::atomic_load(&packet_in_filters);
+    if (filters->empty())
+        return false;
+
+    PacketInView pi { static_cast<const uint8_t*>(data), len };
+    if (not pi.valid())
+        return false;
+
+    for (const auto& filter : *filters) {
+        if (filter.first != pi.eth_type())
+            continue;
+
+        bool consumed = false;
+        catch_all_and_log([&]() {
+            consumed = filter.second(conn, pi);
+        });
+        if (consumed)
+            return true;
+    }
+    return false;
+}
 
 void
 OFServer::implementation::connection_callback(FluidConnection *conn,
                                               FluidConnection::Event type)
 {
     switch (type) {
-    case FluidConnection::EVENT_STARTED:
-        VLOG(3) << "Connection id=" << conn->get_id() << " from "
-                << conn->get_peer_address() << " started";
-        conn->set_application_data(nullptr);
-    break;
+    case FluidConnection::EVENT_STARTED: {
+        auto transport = new FluidTransportConnection(conn);
+        conn->set_application_data(transport);
+        on_event(transport, ofp_connection::STARTED);
+    } break;
     case FluidConnection::EVENT_ESTABLISHED:
-        VLOG(3) << "Connection id=" << conn->get_id() << " from "
-                << conn->get_peer_address() <<  " established";
+        on_event(FluidTransportConnection::get(conn),
+                 ofp_connection::ESTABLISHED);
     break;
     case FluidConnection::EVENT_FAILED_NEGOTIATION:
-        VLOG(3) << "Connection id=" << conn->get_id() << " from "
-                << conn->get_peer_address() << ": failed version negotiation";
+        on_event(FluidTransportConnection::get(conn),
+                 ofp_connection::FAILED_NEGOTIATION);
     break;
-    case FluidConnection::EVENT_CLOSED:
-        VLOG(3) << "Connection id=" << conn->get_id() << " from "
-                << conn->get_peer_address() << " closed by the user";
-        if (auto ofconn = get_connection(conn)) {
+    case FluidConnection::EVENT_CLOSED: {
+        auto transport = FluidTransportConnection::get(conn);
+        on_event(transport, ofp_connection::CLOSED);
+        conn->set_application_data(nullptr);
+        delete transport;
+    } break;
+    case FluidConnection::EVENT_DEAD:
+        on_event(FluidTransportConnection::get(conn), ofp_connection::DEAD);
+    break;
+    }
+}
+
+void OFServer::implementation::start_transport()
+{
+    // I/O threads start on their cpus, so that whatever they allocate
+    // before the first callback is on their NUMA node too
+    ThreadPlacement::Inherit placement {"io"};
+#ifdef RUNOS_HAVE_LIBURING
+    if (uring) {
+        uring->start();
+        return;
+    }
+#endif
+    start(/* block: */ false);
+}
+
+void
+OFServer::implementation::on_event(ofp_connection *conn,
+                                   ofp_connection::event type)
+{
+    // Called in the connection's I/O thread, before its buffers and
+    // connection_data are allocated there
+    ThreadPlacement::global().place_once("io", "of-server-io");
+
+    switch (type) {
+    case ofp_connection::STARTED:
+        VLOG(3) << "Connection id=" << conn->id() << " from "
+                << conn->peer_address() << " started";
+    break;
+    case ofp_connection::ESTABLISHED:
+        VLOG(3) << "Connection id=" << conn->id() << " from "
+                << conn->peer_address() <<  " established";
+    break;
+    case ofp_connection::FAILED_NEGOTIATION:
+        VLOG(3) << "Connection id=" << conn->id() << " from "
+                << conn->peer_address() << ": failed version negotiation";
+    break;
+    case ofp_connection::CLOSED: {
+        VLOG(3) << "Connection id=" << conn->id() << " from "
+                << conn->peer_address() << " closed by the user";
+        flush_burst(conn);
+        auto conn_data = connection_data::get(conn);
+        if (conn_data && conn_data->aux_id != 0) {
+            // The switch stays up with its main connection
+            if (conn_data->conn)
+                conn_data->conn->detach_aux(conn);
+        } else if (auto ofconn = get_connection(conn)) {
             emit app.connectionDown(ofconn);
+            // Transport connection is released after this callback
+            ofconn->detach(conn);
+            ofconn->close_aux();
         }
-    break;
-    case FluidConnection::EVENT_DEAD:
-        VLOG(3) << "Connection id=" << conn->get_id() << " from "
-                << conn->get_peer_address() << " closed due to inactivity";
+        if (conn_data) {
+            std::lock_guard<std::mutex> lock(dpid_by_id_mutex);
+            dpid_by_id.erase(conn->id());
+        }
+        delete conn_data;
+        conn->set_application_data(nullptr);
+    } break;
+    case ofp_connection::DEAD: {
+        VLOG(3) << "Connection id=" << conn->id() << " from "
+                << conn->peer_address() << " closed due to inactivity";
+        auto conn_data = connection_data::get(conn);
+        if (conn_data && conn_data->aux_id != 0)
+            break;
         if (auto ofconn = get_connection(conn)) {
             emit app.connectionDown(ofconn);
         }
-    break;
+    } break;
     }
 }
 
@@ -692,6 +1792,33 @@ void OFServer::init(Loader* loader, const Config& rootConfig)
                                       config_get(config, "cacert", "").c_str());
     }
 
+    const Config& ttl = config_cd(config, "reply-ttl-ms");
+    OFAgentImpl::set_reply_ttl(
+        std::chrono::milliseconds(config_get(ttl, "port-stats", 0)),
+        std::chrono::milliseconds(config_get(ttl, "flow-stats", 0)));
+    OFAgentImpl::set_flow_stats_per_table(
+        config_get(config, "flow-stats-per-table", false));
+
+    const Config& slow = config_cd(config, "slow-switch");
+    latency_tracker::settings latency;
+    latency.floor = std::chrono::microseconds(
+        config_get(slow, "latency-floor-us", 1000));
+    latency.max_slowdown = config_get(slow, "max-slowdown", 16.0);
+    latency.warmup = config_get(slow, "warmup-replies", 16);
+    latency.stale = std::chrono::seconds(config_get(slow, "stale-sec", 60));
+    OFAgentImpl::set_latency_settings(latency);
+
+    std::map<std::string, std::chrono::milliseconds> timeouts;
+    for (auto& timeout : config_cd(config, "request-timeout-ms")) {
+        timeouts.emplace(timeout.first,
+            std::chrono::milliseconds(timeout.second.int_value()));
+    }
+    OFAgentImpl::set_request_timeouts(timeouts);
+
+    // Before the I/O threads start, see process_message()
+    ReceiveArena::reserve(
+        size_t(std::max(0, config_get(config, "receive-arena-mb", 64))) << 20);
+
     impl.reset(new implementation{
             *this,
             DpidChecker::get(loader),
@@ -701,6 +1828,10 @@ void OFServer::init(Loader* loader, const Config& rootConfig)
             config_get(config, "secure", false),
             config_get(config, "limiter", false),
             config_get(config, "max_pps", 500),
+            config_get(config, "max_pps_packet_in", 0),
+            config_get(config, "max_pps_multipart", 0),
+            config_get(config, "dispatch-threads", 0),
+            config_get(config, "dispatch-pin-threads", false),
             fluid_base::OFServerSettings()
                     .supported_version(of13::OFP_VERSION)
                     .keep_data_ownership(false)
@@ -708,24 +1839,108 @@ void OFServer::init(Loader* loader, const Config& rootConfig)
                     .echo_attempts(config_get(config, "echo-attempts", 3))
                     .liveness_check(config_get(config, "liveness-check", true))
     });
+
+    impl->aux_multipart = config_get(config, "aux-multipart", true);
+    impl->watermarks.high = config_get(config, "send-high-watermark", 4194304);
+    impl->watermarks.low = config_get(config, "send-low-watermark", 1048576);
+    CHECK(impl->watermarks.high == 0 ||
+          impl->watermarks.low <= impl->watermarks.high);
+
+    if (config_get(config, "transport", "libevent") == "io_uring") {
+#ifdef RUNOS_HAVE_LIBURING
+        const Config& uring_config = config_cd(config, "io-uring");
+        uring_transport::settings settings;
+        settings.address = config_get(config, "address", "0.0.0.0");
+        settings.port = config_get(config, "port", 6653);
+        settings.nthreads = config_get(config, "nthreads", 4);
+        settings.version = of13::OFP_VERSION;
+        settings.queue_depth = config_get(uring_config, "queue-depth", 512);
+        settings.buffers = config_get(uring_config, "buffers", 256);
+        settings.buffer_size = config_get(uring_config, "buffer-size", 16384);
+        settings.echo_interval = config_get(config, "echo-interval", 5);
+        settings.echo_attempts = config_get(config, "echo-attempts", 3);
+        settings.liveness_check = config_get(config, "liveness-check", true);
+        settings.balance = config_get(uring_config, "balance", true);
+        settings.balance_interval_ms =
+            config_get(uring_config, "balance-interval-ms", 1000);
+        settings.balance_threshold =
+            config_get(uring_config, "balance-threshold", 0.25);
+        settings.balance_min_load =
+            config_get(uring_config, "balance-min-load", 200.0);
+        settings.balance_cooldown_ms =
+            config_get(uring_config, "balance-cooldown-ms", 10000);
+        settings.bytes_per_message =
+            std::max(config_get(uring_config, "bytes-per-message", 1024), 1);
+
+        const Config& tls_config = config_cd(config, "tls");
+        settings.secure = config_get(config, "secure", false);
+        settings.tls.cert = config_get(config, "ctl-cert", "");
+        settings.tls.key = config_get(config, "ctl-privkey", "");
+        settings.tls.ca = config_get(config, "cacert", "");
+        settings.tls.ticket_key_file =
+            config_get(tls_config, "ticket-key-file", "");
+        settings.tls.handshake_threads =
+            config_get(tls_config, "handshake-threads", 2);
+        settings.tls.handshake_timeout_ms =
+            config_get(tls_config, "handshake-timeout-ms", 10000);
+        settings.tls.ktls = config_get(tls_config, "ktls", true);
+        settings.tls.session_cache_size =
+            config_get(tls_config, "session-cache-size", 20480);
+
+        auto impl_ptr = impl.get();
+        impl->uring.reset(new uring_transport(settings,
+            [impl_ptr](ofp_connection* conn, uint8_t type,
+                       void* data, size_t len) {
+                impl_ptr->on_message(conn, &uring_transport::free_data,
+                                     type, data, len);
+            },
+            [impl_ptr](ofp_connection* conn, ofp_connection::event type) {
+                impl_ptr->on_event(conn, type);
+            },
+            [impl_ptr](ofp_connection* conn) {
+                impl_ptr->flush_burst(conn);
+            }));
+        impl->packet_in_batch =
+            std::max(0, config_get(config, "packet-in-batch", 64));
+        LOG(INFO) << "[OFServer] Using io_uring transport";
+#else
+        LOG(WARNING) << "[OFServer] Built without liburing, "
+                        "using libevent transport";
+#endif
+    }
+
+    impl->memory_probe = memory::Registry::global().probe("of-server",
+        [this](memory::Sheet& sheet) {
+            for (const auto& conn : impl->connections.values()) {
+                conn->memory_usage(sheet);
+            }
+            auto arena = ReceiveArena::stats();
+            uint64_t chunks = arena.chunks - arena.free_chunks;
+            sheet.add("receive-arena",
+                      { chunks * ReceiveArena::chunk_size, chunks });
+        });
 }
 
 void OFServer::startUp(Loader*)
 {
-    impl->start(/* block: */ false);
+    impl->start_transport();
     impl->ctrl_start_time_ = std::chrono::system_clock::now();
+
+    // Rates of the connection counters, read without sampling by REST
+    auto counters_timer = new QTimer(this);
+    connect(counters_timer, &QTimer::timeout, this, [this] {
+        auto now = ChannelCounters::clock::now();
+        for (const auto& conn : impl->connections.values())
+            conn->tick_counters(now);
+    });
+    counters_timer->start(1000);
 }
 
 future<OFConnectionPtr> OFServer::connection(uint64_t dpid) const
 {
-    {
-        boost::shared_lock< boost::shared_mutex > rlock(impl->connections_mutex);
-        auto& connections = impl->connections;
-        auto it = connections.find(dpid);
-        if (it != connections.end()) {
-            auto ofconn = std::static_pointer_cast<OFConnection>(it->second);
-            return make_ready_future(std::move(ofconn));
-        }
+    if (auto conn = impl->connections.find(dpid)) {
+        auto ofconn = std::static_pointer_cast<OFConnection>(conn);
+        return make_ready_future(std::move(ofconn));
     }
 
     return async(impl->executor,
@@ -746,11 +1961,8 @@ future<OFAgentPtr> OFServer::agent(uint64_t dpid) const
 
 std::vector<OFConnectionPtr> OFServer::connections() const
 {
-    boost::shared_lock< boost::shared_mutex > rlock(impl->connections_mutex);
-    std::vector<OFConnectionPtr> ret;
-    boost::copy(impl->connections | boost::adaptors::map_values,
-                std::back_inserter(ret));
-    return ret;
+    auto conns = impl->connections.values();
+    return std::vector<OFConnectionPtr>(conns.begin(), conns.end());
 }
 
 std::string OFServer::implementation::flow_mod_failed_descr(uint16_t error_code)
@@ -906,9 +2118,11 @@ void OFServer::implementation::print_error(of13::Error& error_msg, OFConnectionI
     std::string error_description_str;
     const auto error_type = error_msg.err_type();
     const auto error_code = error_msg.code();
-    std::string switch_description = conn
-            ? "from switch with dpid=" + std::to_string(conn->dpid())
-            : "from undefined switch";
+    // Switches repeat errors for every failed message, don't let one
+    // of them flood the log
+    const uint64_t dpid = conn ? conn->dpid() : 0;
+    const char* switch_description = conn ? "from switch with dpid="
+                                          : "from undefined switch";
 
     switch (error_type) {
         case of13::OFPET_FLOW_MOD_FAILED:
@@ -924,14 +2138,17 @@ void OFServer::implementation::print_error(of13::Error& error_msg, OFConnectionI
             error_description_str = this->meter_mod_failed_descr(error_code);
             break;
         default:
-            LOG(ERROR) << "[OFServer] Error message received "
-                       << switch_description << ". Type=" << error_type
-                       << ", description=" << error_code;
+            LOG_EVERY_N_PER_DPID(ERROR, 100, dpid,
+                "[OFServer] Error message received {}{}. Type={}, "
+                "description={}", switch_description,
+                conn ? std::to_string(dpid) : std::string(),
+                unsigned(error_type), unsigned(error_code));
             return;
     }
-    LOG(ERROR) << "[OFServer] Error message received " << switch_description
-               << ". Type=" << error_type_str
-               << ", description=" << error_description_str;
+    LOG_EVERY_N_PER_DPID(ERROR, 100, dpid,
+        "[OFServer] Error message received {}{}. Type={}, description={}",
+        switch_description, conn ? std::to_string(dpid) : std::string(),
+        error_type_str, error_description_str);
 }
 
 } // namespace runos
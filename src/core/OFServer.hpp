@@ -22,9 +22,13 @@
 #include <runos/core/future-decl.hpp>
 #include "api/OFConnection.hpp"
 #include "api/OFAgentFwd.hpp"
+#include "api/PacketInView.hpp"
 
 #include <memory>
 #include <chrono>
+#include <functional>
+#include <utility>
+#include <vector>
 
 namespace runos {
 
@@ -48,6 +52,40 @@ public:
     uint64_t get_tx_openflow_packets() const;
     uint64_t get_pkt_in_openflow_packets() const;
 
+    // Messages dropped by the per-connection rate limiter
+    bool limiter_enabled() const;
+    uint64_t get_dropped_pkt_in_packets() const;
+    uint64_t get_dropped_multipart_packets() const;
+    uint64_t get_dropped_other_packets() const;
+
+    // Load of the io_uring transport threads as of their last balance
+    // tick, in messages/s. Empty with libfluid's transport.
+    struct IOThreadLoad {
+        size_t connections;
+        double load;
+        uint64_t migrated_in;
+        uint64_t migrated_out;
+        // By dpid (0 for auxiliary connections), hottest first
+        std::vector<std::pair<uint64_t, double>> switches;
+    };
+    std::vector<IOThreadLoad> io_thread_loads() const;
+
+    // Raw PacketIn filter, consulted by ethertype on the receiving thread
+    // before the message is unpacked. Returns true if it consumed the
+    // packet, which is then not dispatched any further.
+    using PacketInFilter =
+        std::function<bool(OFConnectionPtr, const PacketInView&)>;
+    void register_packet_in_filter(uint16_t eth_type, PacketInFilter filter);
+    bool has_packet_in_filters() const;
+
+    // Sees the raw bytes of every message received from or sent to
+    // switches (dpid is 0 before the features reply). Called on I/O
+    // threads, must not block. May be set only once, before switches
+    // connect.
+    using MessageTap = std::function<void(uint64_t dpid, bool outgoing,
+                                          const uint8_t* data, size_t len)>;
+    void set_message_tap(MessageTap tap);
+
 signals:
     void switchDiscovered(OFConnectionPtr conn);
     void connectionUp(OFConnectionPtr conn);
@@ -16,8 +16,14 @@
 
 #include "OFServer.hpp"
 #include "RestListener.hpp"
+#include "api/OFConnection.hpp"
+#include "lib/channel_counters.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace runos {
 
@@ -51,6 +57,118 @@ struct OFServerCollection : rest::resource
         root.put("ctrl_pkt_in_ofpackets", pkt_in);
         root.put("ctrl_tx_ofpackets", tx);
 
+        root.put("limiter_enabled", app->limiter_enabled());
+        root.put("limiter_dropped_pkt_in", app->get_dropped_pkt_in_packets());
+        root.put("limiter_dropped_multipart",
+                 app->get_dropped_multipart_packets());
+        root.put("limiter_dropped_other", app->get_dropped_other_packets());
+
+        return root;
+    }
+};
+
+struct IOThreadsCollection : rest::resource
+{
+    OFServer* app;
+
+    explicit IOThreadsCollection(OFServer* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override {
+        rest::ptree root;
+        rest::ptree threads;
+
+        auto loads = app->io_thread_loads();
+        for (size_t i = 0; i < loads.size(); ++i) {
+            const auto& load = loads[i];
+            rest::ptree tpt;
+            tpt.put("thread", i);
+            tpt.put("connections", load.connections);
+            tpt.put("load", load.load);
+            tpt.put("migrated_in", load.migrated_in);
+            tpt.put("migrated_out", load.migrated_out);
+
+            rest::ptree switches;
+            for (const auto& sw : load.switches) {
+                rest::ptree spt;
+                spt.put("dpid", sw.first);
+                spt.put("load", sw.second);
+                switches.push_back(std::make_pair("", std::move(spt)));
+            }
+            tpt.add_child("switches", switches);
+            threads.push_back(std::make_pair("", std::move(tpt)));
+        }
+        root.add_child("array", threads);
+        root.put("_size", loads.size());
+        return root;
+    }
+};
+
+// Control channel traffic of every connection, busiest in the last
+// second first
+struct ConnectionsCollection : rest::resource
+{
+    OFServer* app;
+
+    explicit ConnectionsCollection(OFServer* app)
+        : app(app)
+    { }
+
+    static rest::ptree side(const ChannelCounters::totals& t)
+    {
+        rest::ptree ret;
+        ret.put("messages", t.messages);
+        ret.put("bytes", t.bytes);
+        for (size_t h = 0; h < ChannelCounters::horizons; ++h) {
+            auto suffix = "_" + std::to_string(
+                int(ChannelCounters::horizon_seconds[h])) + "s";
+            ret.put("messages_per_sec" + suffix, t.rate.messages[h]);
+            ret.put("bytes_per_sec" + suffix, t.rate.bytes[h]);
+        }
+
+        rest::ptree types;
+        for (size_t type = 0; type < ChannelCounters::types; ++type) {
+            if (t.by_type[type] != 0)
+                types.put(ChannelCounters::type_name(uint8_t(type)),
+                          t.by_type[type]);
+        }
+        ret.add_child("types", types);
+        return ret;
+    }
+
+    rest::ptree Get() const override {
+        struct row {
+            OFConnectionPtr conn;
+            ChannelCounters::totals rx, tx;
+            double load;
+        };
+        std::vector<row> rows;
+        for (auto& conn : app->connections()) {
+            auto counters = conn->counters();
+            if (not counters)
+                continue;
+            row r {conn, counters->read(ChannelCounters::rx),
+                   counters->read(ChannelCounters::tx), 0.0};
+            r.load = r.rx.rate.messages[0] + r.tx.rate.messages[0];
+            rows.push_back(std::move(r));
+        }
+        std::sort(rows.begin(), rows.end(),
+                  [](const row& a, const row& b) { return a.load > b.load; });
+
+        rest::ptree root;
+        rest::ptree conns;
+        for (auto& r : rows) {
+            rest::ptree cpt;
+            cpt.put("dpid", r.conn->dpid());
+            cpt.put("peer", r.conn->peer_address());
+            cpt.put("alive", r.conn->alive());
+            cpt.add_child("rx", side(r.rx));
+            cpt.add_child("tx", side(r.tx));
+            conns.push_back(std::make_pair("", std::move(cpt)));
+        }
+        root.add_child("array", conns);
+        root.put("_size", rows.size());
         return root;
     }
 };
@@ -72,6 +190,16 @@ public:
         {
             return OFServerCollection {app};
         });
+        rest_->mount(path_spec("/of-server/io-threads/"),
+                     [=](const path_match&)
+        {
+            return IOThreadsCollection {app};
+        });
+        rest_->mount(path_spec("/of-server/connections/"),
+                     [=](const path_match&)
+        {
+            return ConnectionsCollection {app};
+        });
     }
 };
 
@@ -0,0 +1,216 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "PacketInMeter.hpp"
+
+#include "Controller.hpp"
+#include "GroupMeterSync.hpp"
+#include "LLDP.hpp"
+#include "OFServer.hpp"
+#include "api/OFAgent.hpp"
+#include "api/Switch.hpp"
+
+#include <runos/core/future.hpp>
+#include <runos/core/logging.hpp>
+
+#include <fluid/of13msg.hh>
+#include <boost/thread/executors/inline_executor.hpp>
+
+namespace runos {
+
+REGISTER_APPLICATION(PacketInMeter, {"controller", "of-server", "switch-ordering", ""})
+
+namespace of13 = fluid_msg::of13;
+
+static boost::inline_executor meter_executor;
+
+// Distinguishes the table-miss rule in flow dumps
+static constexpr uint64_t table_miss_cookie = 0x5049'4d00;
+
+class PacketInMeter::MeterHook final
+    : public OFConnection::SendHookHandler<of13::FlowMod>
+{
+public:
+    MeterHook(PacketInMeter* app, uint64_t dpid)
+        : app(app), dpid(dpid)
+    { }
+
+    void process(of13::FlowMod& fm) override
+    {
+        switch (fm.command()) {
+        case of13::OFPFC_ADD:
+        case of13::OFPFC_MODIFY:
+        case of13::OFPFC_MODIFY_STRICT:
+            break;
+        default:
+            return;
+        }
+        if (not app->metered(dpid))
+            return;
+
+        // probes must get through a flood, or links time out
+        auto match = fm.match();
+        if (auto eth_type = match.eth_type()) {
+            if (eth_type->value() == LLDP_ETH_TYPE)
+                return;
+        }
+
+        bool to_controller = false;
+        auto is_controller = [](fluid_msg::Action* action) {
+            return action->type() == of13::OFPAT_OUTPUT &&
+                   static_cast<of13::OutputAction*>(action)->port()
+                       == of13::OFPP_CONTROLLER;
+        };
+        auto instructions = fm.instructions();
+        for (of13::Instruction* instr : instructions.instruction_set()) {
+            switch (instr->type()) {
+            case of13::OFPIT_METER:
+                return; // metered already
+            case of13::OFPIT_APPLY_ACTIONS: {
+                auto actions = static_cast<of13::ApplyActions*>(instr)->actions();
+                for (auto action : actions.action_list())
+                    to_controller |= is_controller(action);
+                break;
+            }
+            case of13::OFPIT_WRITE_ACTIONS: {
+                auto actions = static_cast<of13::WriteActions*>(instr)->actions();
+                for (auto action : actions.action_set())
+                    to_controller |= is_controller(action);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+
+        if (to_controller) {
+            of13::Meter meter(app->meter_id());
+            fm.add_instruction(meter);
+        }
+    }
+
+private:
+    PacketInMeter* app;
+    uint64_t dpid;
+};
+
+void PacketInMeter::init(Loader* loader, const Config& rootConfig)
+{
+    controller_ = Controller::get(loader);
+
+    const Config& config = config_cd(rootConfig, "packet-in-meter");
+    meter_id_ = config_get(config, "meter-id", 1000);
+    rate_ = config_get(config, "rate-pps", 1000);
+    burst_ = config_get(config, "burst-packets", 200);
+    table_miss_ = config_get(config, "table-miss", true);
+    meter_rules_ = config_get(config, "meter-controller-rules", true);
+    CHECK(meter_id_ > 0 && meter_id_ <= of13::OFPM_MAX)
+        << "meter-id must be in 1.." << of13::OFPM_MAX;
+
+    if (meter_rules_) {
+        QObject::connect(OFServer::get(loader), &OFServer::switchDiscovered,
+                         this, &PacketInMeter::onSwitchDiscovered,
+                         Qt::DirectConnection);
+    }
+
+    // before applications installing their rules
+    SwitchOrderingManager::get(loader)->registerHandler(this, 5);
+}
+
+bool PacketInMeter::metered(uint64_t dpid) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return metered_.count(dpid) > 0;
+}
+
+void PacketInMeter::onSwitchDiscovered(OFConnectionPtr conn)
+{
+    conn->send_hook(std::make_shared<MeterHook>(this, conn->dpid()));
+}
+
+void PacketInMeter::switchUp(SwitchPtr sw)
+{
+    uint64_t dpid = sw->dpid();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        metered_.erase(dpid);
+    }
+
+    uint32_t rate = sw->property("packet_in_rate", rate_);
+    if (rate == 0) {
+        if (table_miss_)
+            installTableMiss(sw, false);
+        return;
+    }
+
+    of13::MeterBands bands;
+    bands.add_band(new of13::MeterBandDrop(rate, burst_));
+    of13::MeterConfig meter(of13::OFPMF_PKTPS | of13::OFPMF_BURST,
+                            meter_id_, bands);
+
+    GroupMeterSync::meter(sw->connection()->agent(), std::move(meter))
+        .then(meter_executor, [this, sw, dpid, rate](future<GroupMeterSync::result> f) {
+            bool ok = true;
+            try {
+                f.get();
+                std::lock_guard<std::mutex> lock(mutex_);
+                metered_.insert(dpid);
+            } catch (const std::exception& e) {
+                ok = false;
+                LOG(WARNING) << "[PacketInMeter] Switch " << dpid
+                             << " refused the meter, PacketIns are not throttled: "
+                             << e.what();
+            }
+            if (ok) {
+                VLOG(5) << "[PacketInMeter] PacketIns of " << dpid
+                        << " are limited to " << rate << " pps";
+            }
+            if (table_miss_)
+                installTableMiss(sw, ok);
+        });
+}
+
+void PacketInMeter::switchDown(SwitchPtr sw)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    metered_.erase(sw->dpid());
+}
+
+void PacketInMeter::installTableMiss(SwitchPtr sw, bool metered)
+{
+    of13::FlowMod fm;
+    fm.table_id(sw->tables.admission);
+    fm.command(of13::OFPFC_ADD);
+    fm.priority(0);
+    fm.cookie(table_miss_cookie);
+    fm.idle_timeout(0);
+    fm.hard_timeout(0);
+    fm.flags(0);
+    if (metered) {
+        of13::Meter meter(meter_id_);
+        fm.add_instruction(meter);
+    }
+    of13::ApplyActions actions;
+    uint16_t max_len = controller_->packet_in_bytes()
+                           .value_or(of13::OFPCML_NO_BUFFER);
+    actions.add_action(new of13::OutputAction(of13::OFPP_CONTROLLER, max_len));
+    fm.add_instruction(actions);
+
+    sw->connection()->send(fm);
+}
+
+} // namespace runos
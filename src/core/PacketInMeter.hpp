@@ -0,0 +1,82 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "SwitchOrdering.hpp"
+#include "api/OFConnection.hpp"
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_set>
+
+namespace runos {
+
+/**
+ * Throttles PacketIns on the switches, before they cross the network.
+ *
+ * When a switch comes up it gets a meter with a single drop band of
+ * rate-pps packets per second and, with table-miss, a table-miss rule
+ * sending packets to the controller through the meter. With
+ * meter-controller-rules FlowMods of other applications outputting to
+ * the controller are sent with the meter too, LLDP rules excepted, so
+ * floods of any kind are cut down to the budget of the switch. The
+ * packet_in_rate property of a switch overrides rate-pps for it, 0
+ * leaves it unmetered.
+ *
+ * Rules sent before the meter is confirmed, and those sent in bundles
+ * or prepacked batches, are left as they are.
+ */
+class PacketInMeter final : public Application
+                          , public SwitchEventHandler
+{
+    Q_OBJECT
+    SIMPLE_APPLICATION(PacketInMeter, "packet-in-meter")
+
+public:
+    void init(Loader* loader, const Config& config) override;
+
+    uint32_t meter_id() const { return meter_id_; }
+    // The meter is installed on the switch
+    bool metered(uint64_t dpid) const;
+
+protected:
+    void switchUp(SwitchPtr sw) override;
+    void switchDown(SwitchPtr sw) override;
+
+private slots:
+    void onSwitchDiscovered(OFConnectionPtr conn);
+
+private:
+    class MeterHook;
+
+    class Controller* controller_ {nullptr};
+    uint32_t meter_id_ {1000};
+    uint32_t rate_ {1000};
+    uint32_t burst_ {200};
+    bool table_miss_ {true};
+    bool meter_rules_ {true};
+
+    mutable std::mutex mutex_;
+    std::unordered_set<uint64_t> metered_;
+
+    void installTableMiss(SwitchPtr sw, bool metered);
+};
+
+} // namespace runos
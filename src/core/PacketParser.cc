@@ -18,11 +18,16 @@
 
 #include <cstring>
 #include <algorithm>
+#include <iterator>
+#include <array>
 #include <runos/core/assert.hpp>
 
 #include <boost/endian/arithmetic.hpp>
+#include <boost/functional/hash.hpp>
 #include <fluid/of13msg.hh>
 
+#include "lib/inet_checksum.hpp"
+
 using namespace boost::endian;
 
 namespace runos {
@@ -147,7 +152,7 @@ static_assert(sizeof(dhcp_hdr) >= 34, "");
 
 // TODO: make it more safe
 // add size-checking of passed oxm type against field size
-void PacketParser::bind(binding_list new_bindings)
+void PacketParser::bind(binding_list new_bindings) const
 {
     for (const auto& binding : new_bindings) {
         auto id = static_cast<size_t>(binding.first);
@@ -165,11 +170,69 @@ void PacketParser::rebind(binding_list new_bindings)
     }
 }
 
-void PacketParser::parse_l2(uint8_t* data, size_t data_len)
+PacketParser::layer PacketParser::layer_of(unsigned field)
 {
-    if (sizeof(ethernet_hdr) <= data_len) {
+    switch (static_cast<ofb>(field)) {
+    case ofb::IN_PORT:
+        return layer::none;
+    case ofb::ETH_DST:
+    case ofb::ETH_SRC:
+    case ofb::ETH_TYPE:
+    case ofb::VLAN_VID:
+        return layer::l2;
+    case ofb::IP_PROTO:
+    case ofb::IPV4_SRC:
+    case ofb::IPV4_DST:
+    case ofb::ARP_OP:
+    case ofb::ARP_SPA:
+    case ofb::ARP_TPA:
+    case ofb::ARP_SHA:
+    case ofb::ARP_THA:
+        return layer::l3;
+    case ofb::TCP_SRC:
+    case ofb::TCP_DST:
+    case ofb::UDP_SRC:
+    case ofb::UDP_DST:
+        return layer::l4;
+    default:
+        // DHCP and unsupported fields: everything we can parse
+        return layer::dhcp;
+    }
+}
+
+void PacketParser::parse_up_to(layer l) const
+{
+    while (parsed < l) {
+        switch (parsed) {
+        case layer::none:
+            parsed = layer::l2;
+            parse_l2();
+            break;
+        case layer::l2:
+            parsed = layer::l3;
+            parse_l3();
+            break;
+        case layer::l3:
+            parsed = layer::l4;
+            parse_l4();
+            break;
+        case layer::l4:
+            parsed = layer::dhcp;
+            parse_dhcp();
+            break;
+        case layer::dhcp:
+            return;
+        }
+    }
+}
+
+// Every parse_* consumes next_* and leaves the next layer there,
+// next_data == nullptr when there is nothing to parse further
+
+void PacketParser::parse_l2() const
+{
+    if (data && sizeof(ethernet_hdr) <= data_len) {
         eth = reinterpret_cast<ethernet_hdr*>(data);
-        uint16_t l3_type;
         uint8_t dot1q_tag_size = 0;
 
         if (eth->type == 0x8100) {
@@ -181,28 +244,35 @@ void PacketParser::parse_l2(uint8_t* data, size_t data_len)
                 { ofb::ETH_DST, &dot1q->dst },
                 { ofb::VLAN_VID, &dot1q->tci }
             });
-            l3_type = dot1q->type/*tpid*/;
+            next_type = dot1q->type/*tpid*/;
             dot1q_tag_size = 4;
         } else {
-            vlan_tagged = false;
             bind({
                 { ofb::ETH_TYPE, &eth->type },
                 { ofb::ETH_SRC, &eth->src },
                 { ofb::ETH_DST, &eth->dst },
                 { ofb::VLAN_VID, 0 }
             });
-            l3_type = eth->type;
+            next_type = eth->type;
         }
 
-        parse_l3(l3_type,
-                 static_cast<uint8_t*>(data) + eth->header_length() + dot1q_tag_size,
-                 data_len - eth->header_length());
+        size_t l2_len = eth->header_length() + dot1q_tag_size;
+        if (l2_len <= data_len) {
+            next_data = data + l2_len;
+            next_len = data_len - l2_len;
+        }
     }
 }
 
-void PacketParser::parse_l3(uint16_t eth_type, uint8_t* data, size_t data_len)
+void PacketParser::parse_l3() const
 {
-    switch (eth_type) {
+    uint8_t* data = next_data;
+    size_t data_len = next_len;
+    next_data = nullptr;
+    if (not data)
+        return;
+
+    switch (next_type) {
     case 0x0800: // ipv4
         if (sizeof(ipv4_hdr) <= data_len) {
             ipv4 = reinterpret_cast<ipv4_hdr*>(data);
@@ -213,9 +283,9 @@ void PacketParser::parse_l3(uint16_t eth_type, uint8_t* data, size_t data_len)
             });
 
             if (data_len > ipv4->header_length()) {
-                parse_l4(ipv4->protocol,
-                         data + ipv4->header_length(),
-                         data_len - ipv4->header_length());
+                next_type = ipv4->protocol;
+                next_data = data + ipv4->header_length();
+                next_len = data_len - ipv4->header_length();
             }
         }
         break;
@@ -242,9 +312,15 @@ void PacketParser::parse_l3(uint16_t eth_type, uint8_t* data, size_t data_len)
     }
 }
 
-void PacketParser::parse_l4(uint8_t protocol, uint8_t* data, size_t data_len)
+void PacketParser::parse_l4() const
 {
-    switch (protocol) {
+    uint8_t* data = next_data;
+    size_t data_len = next_len;
+    next_data = nullptr;
+    if (not data)
+        return;
+
+    switch (next_type) {
     case 0x06: // tcp
         if (sizeof(tcp_hdr) <= data_len) {
             tcp = reinterpret_cast<tcp_hdr*>(data);
@@ -264,8 +340,8 @@ void PacketParser::parse_l4(uint8_t protocol, uint8_t* data, size_t data_len)
 
             if (data_len > udp->header_length()) {
                 if ((udp->src == 68) && (udp->dst == 67)) {
-                    parse_dhcp(data + udp->header_length(),
-                               data_len - udp->header_length());
+                    next_data = data + udp->header_length();
+                    next_len = data_len - udp->header_length();
                 }
             }
         }
@@ -275,10 +351,15 @@ void PacketParser::parse_l4(uint8_t protocol, uint8_t* data, size_t data_len)
     }
 }
 
+void PacketParser::parse_dhcp() const
+{
+    uint8_t* data = next_data;
+    size_t data_len = next_len;
+    next_data = nullptr;
 
-void PacketParser::parse_dhcp(uint8_t* data, size_t data_len) {
-    if (sizeof(dhcp_hdr) <= data_len) {
+    if (data && sizeof(dhcp_hdr) <= data_len) {
         dhcp = reinterpret_cast<dhcp_hdr*>(data);
+        dhcp_len = data_len;
         bind({
                      { ofb::DHCP_OP, &dhcp->op },
                      { ofb::DHCP_XID, &dhcp->xid },
@@ -286,55 +367,100 @@ void PacketParser::parse_dhcp(uint8_t* data, size_t data_len) {
                      { ofb::DHCP_YIADDR, &dhcp->yiaddr },
                      { ofb::DHCP_CHADDR, &dhcp->chaddr }
              });
-
-        // options parsing
-        uint8_t* tmp = dhcp->options;
-        bool flag = false;
-        for(size_t i = 0; i <= data_len - 34; ++i) {
-            tmp = dhcp->options + i;
-            if (flag) {
-                if (*tmp == 0xFF) break;
-                this->dhcp_options[*tmp] = dhcp_opt(*tmp, *(tmp + 1), tmp + 2);
-                i += *(tmp + 1) + 1;
-            }
-            if ((!flag) && (*tmp == 0x63))
-                if ((i + 1 <= data_len - 34) &&(*(tmp + 1) == 0x82))
-                    if ((i + 2 <= data_len - 34) &&(*(tmp + 2) == 0x53))
-                        if ((i + 3 <= data_len - 34) &&(*(tmp + 3) == 0x63)) {
-                            flag = true;
-                            i += 3;
-                        }
-        }
     }
 }
 
+// Options are scanned in place on every call: they are rarely asked
+// for more than once, and it saves building a map per packet
 dhcp_opt PacketParser::get_dhcp_option(uint8_t code) {
-    auto T = this->dhcp_options.find(code);
-    if (T == this->dhcp_options.end()) {
+    parse_up_to(layer::dhcp);
+    if (not dhcp) {
+        return dhcp_opt();
+    }
+
+    uint8_t* opt = dhcp->options;
+    uint8_t* end = reinterpret_cast<uint8_t*>(dhcp.get()) + dhcp_len;
+
+    // options follow the magic cookie
+    static constexpr uint8_t cookie[] = { 0x63, 0x82, 0x53, 0x63 };
+    opt = std::search(opt, end, std::begin(cookie), std::end(cookie));
+    if (opt == end) {
         return dhcp_opt();
-    } else {
-        return this->dhcp_options[code];
     }
+    opt += sizeof(cookie);
+
+    // the last occurrence wins
+    dhcp_opt ret;
+    while (opt < end && *opt != 0xFF) {
+        if (*opt == 0x00) { // pad
+            ++opt;
+            continue;
+        }
+        if (opt + 2 > end || opt + 2 + opt[1] > end)
+            break;
+        if (*opt == code) {
+            ret = dhcp_opt(opt[0], opt[1], opt + 2);
+        }
+        opt += 2 + opt[1];
+    }
+    return ret;
+}
+
+uint64_t PacketParser::flow_hash() const
+{
+    parse_up_to(layer::l4);
+
+    size_t ret = 0;
+    boost::hash_combine(ret, uint32_t(in_port));
+    if (dot1q) {
+        boost::hash_combine(ret, uint64_t(dot1q->dst));
+        boost::hash_combine(ret, uint64_t(dot1q->src));
+        boost::hash_combine(ret, uint16_t(dot1q->tci) & 0x0fff);
+        boost::hash_combine(ret, uint16_t(dot1q->type));
+    } else if (eth) {
+        boost::hash_combine(ret, uint64_t(eth->dst));
+        boost::hash_combine(ret, uint64_t(eth->src));
+        boost::hash_combine(ret, uint16_t(eth->type));
+    }
+    if (ipv4) {
+        boost::hash_combine(ret, uint32_t(ipv4->src));
+        boost::hash_combine(ret, uint32_t(ipv4->dst));
+        boost::hash_combine(ret, uint8_t(ipv4->protocol));
+    }
+    if (tcp) {
+        boost::hash_combine(ret, uint16_t(tcp->src));
+        boost::hash_combine(ret, uint16_t(tcp->dst));
+    } else if (udp) {
+        boost::hash_combine(ret, uint16_t(udp->src));
+        boost::hash_combine(ret, uint16_t(udp->dst));
+    }
+    return ret;
 }
 
 PacketParser::PacketParser(fluid_msg::of13::PacketIn& pi)
     : data(static_cast<uint8_t*>(pi.data()))
     , data_len(pi.data_len())
     , in_port(pi.match().in_port()->value())
+    , vlan_tagged(false)
+    , parsed(layer::none)
+    , next_type(0)
+    , next_data(nullptr)
+    , next_len(0)
+    , dhcp_len(0)
+    , checksum_stale(false)
 {
     bindings.fill(nullptr);
     bind({
         { ofb::IN_PORT, &in_port }
     });
-
-    if (data) {
-        parse_l2(data, data_len);
-    }
 }
 
 uint8_t* PacketParser::access(oxm::type t) const
 {
     ASSERT(t.ns() == unsigned(of::oxm::ns::OPENFLOW_BASIC), "Unsupported oxm namespace: {}", t.ns());
+    if (t.id() < bindings.size() && not bindings[t.id()]) {
+        parse_up_to(layer_of(t.id()));
+    }
     ASSERT(t.id() < bindings.size() && bindings[t.id()], "Unsupported oxm field: {}", t.id());
 
     return (uint8_t*) bindings[t.id()];
@@ -348,13 +474,62 @@ oxm::field<> PacketParser::load(oxm::mask<> mask) const
 
 void PacketParser::modify(oxm::field<> patch)
 {
+    uint8_t* at = access(patch.type());
+    size_t len = patch.type().nbytes();
+    std::array<uint8_t, 16> old;
+    CHECK(len <= old.size(), "Too long oxm field: {}", patch.type().id());
+    std::memcpy(old.data(), at, len);
+
     oxm::field<> updated = 
         PacketParser::load(oxm::mask<>(patch.type())) >> patch;
-    updated.value_bits().to_buffer(access(patch.type()));
+    updated.value_bits().to_buffer(at);
+
+    update_checksums(at, old.data(), len);
+}
+
+void PacketParser::update_checksums(const uint8_t* at, const uint8_t* old,
+                                    size_t len)
+{
+    if (parsed < layer::l3 || not ipv4)
+        return;
+    // addresses are in the pseudo header of tcp and udp
+    parse_up_to(layer::l4);
+
+    auto ip = reinterpret_cast<const uint8_t*>(ipv4.get());
+    const uint8_t* l4 = nullptr;
+    big_uint16_t* l4_checksum = nullptr;
+    if (tcp) {
+        l4 = reinterpret_cast<const uint8_t*>(tcp.get());
+        l4_checksum = &tcp->checksum;
+    } else if (udp && udp->checksum != 0) { // zero means no checksum
+        l4 = reinterpret_cast<const uint8_t*>(udp.get());
+        l4_checksum = &udp->checksum;
+    }
+
+    auto adjust = [&](big_uint16_t& checksum, size_t offset) {
+        checksum = inet_checksum::update(checksum, offset, old, at, len);
+        if (checksum == 0 && &checksum == l4_checksum && not tcp)
+            checksum = 0xffff; // udp sends zero as all ones
+    };
+
+    if (at >= ip && at < ip + ipv4->header_length()) {
+        adjust(ipv4->checksum, at - ip);
+
+        // protocol, src and dst have the same offsets in the pseudo header
+        size_t offset = at - ip;
+        if (offset <= 9 && offset + len > 9) {
+            checksum_stale = true;
+        } else if (l4_checksum && offset >= 12 && offset < 20) {
+            adjust(*l4_checksum, offset);
+        }
+    } else if (l4_checksum && at >= l4 && at < data + data_len) {
+        adjust(*l4_checksum, at - l4);
+    }
 }
 
 bool PacketParser::vlanTagged()
 {
+    parse_up_to(layer::l2);
     return vlan_tagged;
 }
 
@@ -362,6 +537,14 @@ size_t PacketParser::serialize_to(size_t buffer_size, void* buffer) const
 {
     size_t copied = std::min(data_len, buffer_size);
     std::memmove(buffer, data, copied);
+
+    if (checksum_stale && ipv4) {
+        size_t ip_offset = reinterpret_cast<uint8_t*>(ipv4.get()) - data;
+        if (ip_offset < copied) {
+            inet_checksum::recompute_ipv4(static_cast<uint8_t*>(buffer) + ip_offset,
+                                          copied - ip_offset);
+        }
+    }
     return copied;
 }
 
@@ -23,7 +23,6 @@
 #include <boost/endian/arithmetic.hpp>
 
 #include <array>
-#include <map>
 #include <initializer_list>
 #include <ostream>
 #include <cstddef>
@@ -47,43 +46,86 @@ public:
     dhcp_opt(uint8_t c = 0, uint8_t n = 0, uint8_t* v = nullptr): code(c), number(n), value(v) {}
 };
 
+// Headers are parsed lazily: a layer is parsed the first time a field
+// of it (or of a layer above) is accessed, nothing is allocated.
 class PacketParser final : public SerializablePacket {
     // buffer
     uint8_t* data;
     size_t data_len;
     boost::endian::big_uint32_t in_port;
-    bool vlan_tagged;
+    mutable bool vlan_tagged;
 
     // bindings
     typedef std::array<void*, 45> bindings_arr;
-    bindings_arr bindings;
+    mutable bindings_arr bindings;
+
+    enum class layer : uint8_t { none, l2, l3, l4, dhcp };
+    mutable layer parsed;
+
+    // where the next layer to parse starts
+    mutable uint16_t next_type;
+    mutable uint8_t* next_data;
+    mutable size_t next_len;
 
     // replace with
-    safe_ptr<struct ethernet_hdr> eth;
-    safe_ptr<struct dot1q_hdr> dot1q;
-    safe_ptr<struct ipv4_hdr> ipv4;
-    safe_ptr<struct tcp_hdr> tcp;
-    safe_ptr<struct udp_hdr> udp;
-    safe_ptr<struct arp_hdr> arp;
-    safe_ptr<struct dhcp_hdr> dhcp;
-    std::map<uint8_t, dhcp_opt> dhcp_options;
-
-    void parse_l2(uint8_t* data, size_t data_len);
-    void parse_l3(uint16_t eth_type, uint8_t* data, size_t data_len);
-    void parse_l4(uint8_t protocol, uint8_t* data, size_t data_len);
-    void parse_dhcp(uint8_t* data, size_t data_len);
+    mutable safe_ptr<struct ethernet_hdr> eth;
+    mutable safe_ptr<struct dot1q_hdr> dot1q;
+    mutable safe_ptr<struct ipv4_hdr> ipv4;
+    mutable safe_ptr<struct tcp_hdr> tcp;
+    mutable safe_ptr<struct udp_hdr> udp;
+    mutable safe_ptr<struct arp_hdr> arp;
+    mutable safe_ptr<struct dhcp_hdr> dhcp;
+    mutable size_t dhcp_len;
+    // IP protocol was rewritten, so its L4 checksum is
+    // recomputed by serialize_to()
+    bool checksum_stale;
+
+    void parse_up_to(layer l) const;
+    void parse_l2() const;
+    void parse_l3() const;
+    void parse_l4() const;
+    void parse_dhcp() const;
+    static layer layer_of(unsigned field);
 
     using binding_list =
         std::initializer_list<std::pair<of::oxm::basic_match_fields, void*>>;
 
-    void bind(binding_list bindings);
+    void bind(binding_list bindings) const;
     void rebind(binding_list bindings);
     uint8_t* access(oxm::type t) const;
+    void update_checksums(const uint8_t* at, const uint8_t* old, size_t len);
 
 public:
     PacketParser(fluid_msg::of13::PacketIn& pi);
 
     oxm::field<> load(oxm::mask<> mask) const override;
+
+    // The value load() of the whole field gives, for hot paths: the
+    // binding slot, width and byte order are known at compile time,
+    // nothing is type-erased or masked.
+    //   uint16_t type = pp.get<oxm::eth_type>();
+    // Same as load(), asserts on a field the packet doesn't have.
+    template<class Field>
+    typename Field::value_type get() const
+    {
+        constexpr Field field {};
+        static_assert(field.ns() == uint16_t(of::oxm::ns::OPENFLOW_BASIC),
+                      "Only OpenFlow basic fields are bound");
+        static_assert(field.id() < std::tuple_size<bindings_arr>::value,
+                      "No binding slot for the field");
+        static_assert(field.nbits() % 8 == 0 && field.nbytes() <= 8,
+                      "Field doesn't fit a native integer");
+
+        auto at = static_cast<const uint8_t*>(bindings[field.id()]);
+        if (not at)
+            at = access(field); // parses up to the field's layer
+        uint64_t raw = 0;
+        for (size_t i = 0; i < field.nbytes(); ++i)
+            raw = (raw << 8) | at[i]; // network byte order
+        return static_cast<typename Field::value_type>(raw);
+    }
+    // Rewrites the field in place, IPv4, TCP and UDP checksums
+    // are updated incrementally (RFC 1624)
     void modify(oxm::field<> patch) override;
     bool vlanTagged() override;
 
@@ -91,6 +133,10 @@ public:
     size_t serialize_to(size_t buffer_size, void* buffer) const override;
 
     dhcp_opt get_dhcp_option(uint8_t code);
+
+    // Hash of the ingress port, L2 header and IPv4 5-tuple, the same
+    // for all packets of a flow
+    uint64_t flow_hash() const;
 };
 
 } // namespace runos
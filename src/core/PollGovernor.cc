@@ -0,0 +1,144 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "PollGovernor.hpp"
+
+#include "EventLoopWatchdog.hpp"
+#include "lib/metrics.hpp"
+#include "lib/poll_tuning.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <algorithm>
+
+namespace runos {
+
+REGISTER_APPLICATION(PollGovernor, {"event-loop-watchdog", ""})
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+
+// Weight of the last check in the smoothed lag
+static constexpr double lag_smoothing = 0.3;
+
+void PollGovernor::init(Loader* loader, const Config& rootConfig)
+{
+    auto config = config_cd(rootConfig, "poll-governor");
+    watchdog_ = EventLoopWatchdog::get(loader);
+    enabled_ = config_get(config, "enabled", true);
+    check_ = milliseconds(config_get(config, "check-interval-ms", 1000));
+    high_ = milliseconds(config_get(config, "lag-high-ms", 50));
+    low_ = milliseconds(config_get(config, "lag-low-ms", 10));
+    max_stretch_ = config_get(config, "max-stretch", 8.0);
+    recover_checks_ = std::max(1, config_get(config, "recover-checks", 5));
+    CHECK(check_.count() > 0) << "check-interval-ms must be positive";
+    CHECK(low_ < high_) << "lag-low-ms must be below lag-high-ms";
+    CHECK(max_stretch_ >= 1.0) << "max-stretch must be at least 1";
+}
+
+void PollGovernor::startUp(Loader*)
+{
+    auto& timers = TimerService::global();
+    timer_ = timers.add("poll-governor", check_, [this]() { check(); },
+                        TimerService::priority::high);
+    timers.start(timer_);
+}
+
+PollGovernor::~PollGovernor()
+{
+    if (timer_)
+        TimerService::global().remove(timer_);
+}
+
+void PollGovernor::check()
+{
+    microseconds worst {0};
+    bool stalled = false;
+    for (const auto& t : watchdog_->threads()) {
+        worst = std::max(worst, t.last_lag);
+        stalled = stalled || t.stalled.count() > 0;
+    }
+
+    double next;
+    bool up;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        lag_us_ = lag_smoothing * worst.count()
+                + (1.0 - lag_smoothing) * lag_us_;
+        if (not enabled_)
+            return;
+
+        next = stretch_;
+        if (stalled || lag_us_ > high_.count()) {
+            calm_ = 0;
+            next = std::min(stretch_ * 2, max_stretch_);
+        } else if (lag_us_ < low_.count() && stretch_ > 1.0) {
+            if (++calm_ >= recover_checks_) {
+                calm_ = 0;
+                next = std::max(stretch_ / 2, 1.0);
+            }
+        } else {
+            calm_ = 0;
+        }
+        if (next == stretch_)
+            return;
+
+        up = next > stretch_;
+        ++(up ? stretched_ : relaxed_);
+        stretch_ = next;
+    }
+
+    LOG(WARNING) << "[PollGovernor] Event loop lag "
+                 << worst.count() / 1000 << " ms"
+                 << (stalled ? " (stalled)" : "")
+                 << ", poll intervals stretched x" << next;
+    metrics::Registry::global().counter(
+        "runos_poll_governor_changes_total",
+        "Changes of the poll interval stretch factor",
+        {{"direction", up ? "up" : "down"}}).add(1);
+    apply(next);
+}
+
+void PollGovernor::apply(double stretch)
+{
+    PollTuning::global().stretch(stretch);
+}
+
+void PollGovernor::setEnabled(bool enabled)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        enabled_ = enabled;
+        if (enabled)
+            return;
+        stretch_ = 1.0;
+        calm_ = 0;
+    }
+    LOG(INFO) << "[PollGovernor] Disabled, poll intervals unstretched";
+    apply(1.0);
+}
+
+auto PollGovernor::status() const -> Status
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Status{ enabled_, stretch_, max_stretch_,
+                   microseconds(int64_t(lag_us_)),
+                   stretched_, relaxed_ };
+}
+
+} // namespace runos
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "lib/timer_service.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace runos {
+
+class EventLoopWatchdog;
+
+/**
+ * Stretches non-critical poll intervals (see PollTuning) while the
+ * controller is overloaded.
+ *
+ * Every `check-interval-ms` the worst lag of the event loops watched by
+ * EventLoopWatchdog is smoothed. Above `lag-high-ms`, or with a loop
+ * stalled, the stretch factor doubles up to `max-stretch`; after
+ * `recover-checks` checks in a row below `lag-low-ms` it halves back
+ * towards 1.
+ */
+class PollGovernor final : public Application {
+    SIMPLE_APPLICATION(PollGovernor, "poll-governor")
+public:
+    struct Status {
+        bool enabled;
+        double stretch;
+        double max_stretch;
+        std::chrono::microseconds lag; // smoothed worst lag
+        uint64_t stretched; // times the factor went up
+        uint64_t relaxed;   // and down
+    };
+
+    void init(Loader* loader, const Config& config) override;
+    void startUp(Loader* loader) override;
+    ~PollGovernor();
+
+    Status status() const;
+    // Disabled governor puts every interval back unstretched
+    void setEnabled(bool enabled);
+
+private:
+    EventLoopWatchdog* watchdog_ {nullptr};
+    std::chrono::milliseconds check_ {1000};
+    std::chrono::microseconds high_ {50000};
+    std::chrono::microseconds low_ {10000};
+    double max_stretch_ {8.0};
+    unsigned recover_checks_ {5};
+
+    mutable std::mutex mutex_; // guards everything below
+    bool enabled_ {true};
+    double stretch_ {1.0};
+    double lag_us_ {0.0};
+    unsigned calm_ {0};
+    uint64_t stretched_ {0};
+    uint64_t relaxed_ {0};
+
+    TimerService::handle timer_;
+
+    void check();
+    void apply(double stretch);
+};
+
+} // namespace runos
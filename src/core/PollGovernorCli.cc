@@ -0,0 +1,85 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <boost/lexical_cast.hpp>
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "PollGovernor.hpp"
+#include "CommandLine.hpp"
+#include "lib/poll_tuning.hpp"
+
+namespace runos {
+
+class PollGovernorCli : public Application
+{
+    SIMPLE_APPLICATION(PollGovernorCli, "poll-governor-cli")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        auto app = PollGovernor::get(loader);
+        auto cli = CommandLine::get(loader);
+
+        cli->register_command(
+            cli_pattern(R"(poll\s+list)"),
+            [=](const cli_match&) {
+                auto status = app->status();
+                cli->print("Governor {}, stretch x{}, lag {} us",
+                           status.enabled ? "enabled" : "disabled",
+                           status.stretch, status.lag.count());
+                cli->print("{:<40} {:>12} {:>12} {:>12}",
+                           "NAME", "CONFIGURED", "INTERVAL", "EFFECTIVE");
+                for (const auto& k : PollTuning::global().knobs()) {
+                    cli->print("{:<40} {:>12} {:>12} {:>12}{}",
+                               k.name, k.configured.count(),
+                               k.interval.count(), k.effective.count(),
+                               k.critical ? " critical" : "");
+                }
+            });
+
+        cli->register_command(
+            cli_pattern(R"(poll\s+set\s+(\S+)\s+([0-9]+))"),
+            [=](const cli_match& match) {
+                auto ms = boost::lexical_cast<int64_t>(match[2]);
+                if (ms == 0) {
+                    cli->error("Interval must be positive");
+                }
+                if (not PollTuning::global().set(
+                        match[1].str(), std::chrono::milliseconds(ms))) {
+                    cli->error("Unknown poll interval {}", match[1].str());
+                }
+            });
+
+        cli->register_command(
+            cli_pattern(R"(poll\s+reset\s+(\S+))"),
+            [=](const cli_match& match) {
+                if (not PollTuning::global().reset(match[1].str())) {
+                    cli->error("Unknown poll interval {}", match[1].str());
+                }
+            });
+
+        cli->register_command(
+            cli_pattern(R"(poll\s+governor\s+(on|off))"),
+            [=](const cli_match& match) {
+                app->setEnabled(match[1] == "on");
+            });
+    }
+};
+
+REGISTER_APPLICATION(PollGovernorCli, {"poll-governor", "command-line", ""})
+
+}
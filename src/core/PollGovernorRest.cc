@@ -0,0 +1,116 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "PollGovernor.hpp"
+#include "RestListener.hpp"
+#include "lib/poll_tuning.hpp"
+
+namespace runos {
+
+struct PollIntervalsResource : rest::resource
+{
+    PollGovernor* app;
+
+    explicit PollIntervalsResource(PollGovernor* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override
+    {
+        rest::ptree root;
+        rest::ptree knobs;
+        auto infos = PollTuning::global().knobs();
+        for (const auto& info : infos) {
+            rest::ptree kpt;
+            kpt.put("name", info.name);
+            kpt.put("configured_ms", info.configured.count());
+            kpt.put("interval_ms", info.interval.count());
+            kpt.put("effective_ms", info.effective.count());
+            kpt.put("critical", info.critical);
+            kpt.put("pollers", info.listeners);
+            knobs.push_back(std::make_pair("", std::move(kpt)));
+        }
+        root.add_child("array", knobs);
+        root.put("_size", infos.size());
+
+        auto status = app->status();
+        rest::ptree governor;
+        governor.put("enabled", status.enabled);
+        governor.put("stretch", status.stretch);
+        governor.put("max_stretch", status.max_stretch);
+        governor.put("lag_us", status.lag.count());
+        governor.put("stretched", status.stretched);
+        governor.put("relaxed", status.relaxed);
+        root.add_child("governor", governor);
+        return root;
+    }
+
+    // {"intervals": {"<name>": <ms>, ...}, "governor": <bool>},
+    // 0 ms puts the configured interval back
+    rest::ptree Put(const rest::ptree& pt) override
+    {
+        auto& tuning = PollTuning::global();
+        rest::ptree ret;
+
+        auto intervals = pt.get_child_optional("intervals");
+        if (intervals) {
+            for (const auto& item : *intervals) {
+                auto ms = item.second.get_value_optional<int64_t>();
+                THROW_IF(not ms || *ms < 0, rest::http_error(400),
+                         "Bad interval of {}", item.first);
+                bool known = *ms == 0
+                    ? tuning.reset(item.first)
+                    : tuning.set(item.first, std::chrono::milliseconds(*ms));
+                THROW_IF(not known, rest::http_error(404),
+                         "Unknown poll interval {}", item.first);
+            }
+            ret.add_child("intervals", *intervals);
+        }
+
+        auto it = pt.find("governor");
+        if (it != pt.not_found()) {
+            app->setEnabled(it->second.get_value<bool>());
+            ret.add_child(it->first, it->second);
+        }
+        return ret;
+    }
+};
+
+class PollGovernorRest : public Application
+{
+    SIMPLE_APPLICATION(PollGovernorRest, "poll-governor-rest")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto rest_ = RestListener::get(loader);
+        auto app = PollGovernor::get(loader);
+
+        rest_->mount(path_spec("/poll-intervals/"), [=](const path_match&)
+        {
+            return PollIntervalsResource { app };
+        });
+    }
+};
+
+REGISTER_APPLICATION(PollGovernorRest, {"rest-listener", "poll-governor", ""})
+
+} // namespace runos
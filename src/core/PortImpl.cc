@@ -17,7 +17,10 @@
 #include "PortImpl.hpp"
 
 #include "SwitchImpl.hpp"
+#include "lib/event_trace.hpp"
+#include "lib/telemetry_export.hpp"
 #include <runos/core/assert.hpp>
+#include <runos/core/logging.hpp>
 
 #include <boost/lexical_cast.hpp>
 #include <range/v3/view/map.hpp>
@@ -28,6 +31,16 @@ namespace runos {
 
 constexpr uint32_t xid = 30561;
 
+// Damping timers announce a settled link outside of the PortStatus trace
+static void trace_link(const PortImpl& port, bool down)
+{
+    auto sw = trace::enabled() ? port.switch_() : nullptr;
+    if (sw) {
+        trace::mark_subject(down ? "link-down" : "link-up",
+                            trace::port_subject(sw->dpid(), port.number()));
+    }
+}
+
 PortImpl::PortImpl(SwitchImplPtr sw, of13::Port& port, QObject* parent)
     : sw_(sw)
     , number_(port.port_no())
@@ -42,10 +55,24 @@ PortImpl::PortImpl(SwitchImplPtr sw, of13::Port& port, QObject* parent)
     , current_speed_(port.curr_speed())
     , max_speed_(port.max_speed())
     , maintenance_(false)
+    , stats_table_(sw->mutable_port_stats())
+    , stats_slot_(stats_table_->acquire(number_))
+    , stats_history_(TimeSeries(PortMeasurement<double>().size()))
+    , link_down_(port.state() & of13::OFPPS_LINK_DOWN)
+    , live_watch_(sw->live_watch())
+    , watched_(live_watch_ && (port.state() & of13::OFPPS_LIVE))
+    , damping_(link_down_, sw->link_damping())
 {
     moveToThread(parent->thread());
     setParent(parent);
 
+    damping_timer_ = new QTimer;
+    damping_timer_->setSingleShot(true);
+    damping_timer_->moveToThread(thread());
+    damping_timer_->setParent(this);
+    QObject::connect(damping_timer_, &QTimer::timeout,
+                     this, &PortImpl::on_damping_timer);
+
     // manual curr_speed from devicedb if speed is unknown
     if (not current_speed_) {
         auto speed = sw->property("current_speed_" + std::to_string(number_), 0);
@@ -67,6 +94,19 @@ PortImpl::PortImpl(SwitchImplPtr sw, of13::Port& port, QObject* parent)
     QObject::connect(this, &PortImpl::maintenanceEnd, sw.get(), &Switch::portMaintenanceEnd);
 }
 
+PortImpl::~PortImpl()
+{
+    stats_table_->release(stats_slot_);
+}
+
+Statistics<PortMeasurement> PortImpl::stats() const
+{
+    Statistics<PortMeasurement> ret;
+    stats_table_->get(stats_slot_, ret.integral.data(),
+                      ret.current_speed.data(), ret.max_speed.data());
+    return ret;
+}
+
 void PortImpl::start()
 {
     auto self = shared_from_this();
@@ -93,13 +133,90 @@ void PortImpl::set_config(uint32_t config)
 
 void PortImpl::set_offline()
 {
-    if (link_down())
-        return;
-
     state_ |= of13::OFPPS_LINK_DOWN;
+    {
+        std::lock_guard<std::mutex> lock(damping_mutex_);
+        damping_.reset(true, flap_damping::clock::now());
+        if (link_down_)
+            return;
+        link_down_ = true;
+    }
+    trace_link(*this, true);
     emit linkDown(shared_from_this());
 }
 
+void PortImpl::update_link(bool down)
+{
+    {
+        std::lock_guard<std::mutex> lock(damping_mutex_);
+        auto now = flap_damping::clock::now();
+        bool was_suppressed = damping_.suppressed();
+
+        if (not damping_.update(down, now)) {
+            if (damping_.suppressed() && not was_suppressed) {
+                LOG(WARNING) << "[PortImpl] Link on port " << number_
+                             << " of switch " << switch_()->dpid()
+                             << " is flapping, suppressing its state changes";
+            }
+            schedule_damping(now);
+            return;
+        }
+        link_down_ = down;
+    }
+
+    auto self = shared_from_this();
+    trace_link(*this, down);
+    if (down) {
+        emit linkDown(self);
+    } else {
+        emit linkUp(self);
+    }
+}
+
+void PortImpl::schedule_damping(flap_damping::clock::time_point now)
+{
+    auto deadline = damping_.deadline();
+    if (not deadline || damping_timer_pending_)
+        return;
+
+    using namespace std::chrono;
+    auto wait = duration_cast<milliseconds>(*deadline - now) + milliseconds(1);
+    damping_timer_pending_ = true;
+    QMetaObject::invokeMethod(damping_timer_, "start", Qt::QueuedConnection,
+                              Q_ARG(int, std::max<int>(wait.count(), 1)));
+}
+
+void PortImpl::on_damping_timer()
+{
+    bool down, was_suppressed;
+    {
+        std::lock_guard<std::mutex> lock(damping_mutex_);
+        auto now = flap_damping::clock::now();
+        damping_timer_pending_ = false;
+        was_suppressed = damping_.suppressed();
+
+        if (not damping_.poll(now)) {
+            schedule_damping(now);
+            return;
+        }
+        down = damping_.announced();
+        link_down_ = down;
+    }
+
+    if (was_suppressed) {
+        LOG(INFO) << "[PortImpl] Link on port " << number_
+                  << " of switch " << switch_()->dpid()
+                  << " settled " << (down ? "down" : "up");
+    }
+    auto self = shared_from_this();
+    trace_link(*this, down);
+    if (down) {
+        emit linkDown(self);
+    } else {
+        emit linkUp(self);
+    }
+}
+
 void PortImpl::process_event(of13::Port& port)
 {
     ASSERT(port.port_no() == number());
@@ -109,11 +226,15 @@ void PortImpl::process_event(of13::Port& port)
 
     set_config(port.config());
 
-    uint32_t mstate;
+    bool was_down, down;
     boost::unique_lock< boost::shared_mutex > wlock(cmutex);
     {
-        mstate = state_ ^ port.state();
+        was_down = down_in(state_);
         state_ = port.state();
+        // switches not setting OFPPS_LIVE keep on LINK_DOWN alone
+        if (live_watch_ && (state_ & of13::OFPPS_LIVE))
+            watched_ = true;
+        down = down_in(state_);
 
         advertised_ = port.advertised();
         supported_ = port.supported();
@@ -124,17 +245,18 @@ void PortImpl::process_event(of13::Port& port)
         max_speed_ = port.max_speed();
     }
 
-    auto self = shared_from_this();
-    if (mstate & of13::OFPPS_LINK_DOWN) {
-        if (link_down()) {
-            emit linkDown(self);
-        } else {
-            emit linkUp(self);
-        }
+    if (down != was_down) {
+        update_link(down);
     }
 }
 
-void PortImpl::process_event(of13::PortStats stats)
+bool PortImpl::down_in(uint32_t state) const
+{
+    return (state & of13::OFPPS_LINK_DOWN) ||
+           (watched_ && not (state & of13::OFPPS_LIVE));
+}
+
+void PortImpl::process_event(of13::PortStats& stats)
 {
     PortMeasurement<uint64_t> m;
 
@@ -156,11 +278,43 @@ void PortImpl::process_event(of13::PortStats stats)
         duration = std::chrono::steady_clock::now().time_since_epoch();
     }
 
-    stats_->append(duration, std::move(m));
+    using fpseconds = std::chrono::duration<double>;
+    process_counters(m, std::chrono::duration_cast<fpseconds>(duration).count());
+}
+
+void PortImpl::process_counters(const PortMeasurement<uint64_t>& m, double time)
+{
+    PortMeasurement<double> speed;
+    bool has_speed = stats_table_->append(stats_slot_, time, m.data(), speed.data());
+    if (has_speed) {
+        stats_history_->append(time, speed.data());
+    }
+
+    auto& telemetry = TelemetryExporter::global();
+    if (telemetry.enabled()) {
+        if (auto sw = switch_()) {
+            TelemetrySample sample {TelemetrySample::port, sw->dpid(), number_};
+            sample.counters = m.data();
+            sample.ncounters = m.size();
+            if (has_speed) {
+                sample.rates = speed.data();
+                sample.nrates = speed.size();
+            }
+            telemetry.publish(sample);
+        }
+    }
+    emit statsUpdated(shared_from_this());
 }
 
-void PortImpl::process_event(std::vector<of13::QueueStats> stats)
+void PortImpl::process_event(index_span<of13::QueueStats> stats)
 {
+    auto& telemetry = TelemetryExporter::global();
+    uint64_t dpid = 0;
+    if (telemetry.enabled()) {
+        if (auto sw = switch_())
+            dpid = sw->dpid();
+    }
+
     auto store = queue_stats_.synchronize();
 
     std::unordered_set<uint32_t> ids;
@@ -176,9 +330,20 @@ void PortImpl::process_event(std::vector<of13::QueueStats> stats)
         using std::chrono::seconds;
         using std::chrono::nanoseconds;
 
-        (*store)[id].append( seconds(s.duration_sec())
-                           + nanoseconds(s.duration_nsec())
-                           , std::move(m) );
+        auto& queue = (*store)[id];
+        queue.append( seconds(s.duration_sec())
+                    + nanoseconds(s.duration_nsec())
+                    , m );
+
+        if (telemetry.enabled() && dpid) {
+            auto speed = queue.get().current_speed;
+            TelemetrySample sample {TelemetrySample::queue, dpid, number_, id};
+            sample.counters = m.data();
+            sample.ncounters = m.size();
+            sample.rates = speed.data();
+            sample.nrates = speed.size();
+            telemetry.publish(sample);
+        }
 
         ids.insert(id);
     }
@@ -192,10 +357,11 @@ void PortImpl::process_event(std::vector<of13::QueueStats> stats)
     }
 }
 
-void PortImpl::process_event(std::vector<of13::FlowStats> traffic_stats)
+void PortImpl::process_event(index_span<of13::FlowStats> traffic_stats)
 {
     auto store = traffic_stats_.synchronize();
-    CHECK(traffic_stats.size() == 3);
+    // uncounted types may be folded into the unicast rule
+    CHECK(traffic_stats.size() <= 3);
 
     auto guess_type = [](of13::FlowStats& fs) -> ForwardingType {
         auto match = fs.match();
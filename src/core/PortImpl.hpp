@@ -15,7 +15,9 @@
  */
 #pragma once
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <cstdint>
 #include <unordered_map>
@@ -27,6 +29,9 @@
 
 #include "api/Port.hpp"
 #include "StatisticsStore.hpp"
+#include "lib/port_stats_table.hpp"
+#include "lib/flap_damping.hpp"
+#include "lib/key_buckets.hpp"
 
 namespace runos {
 
@@ -44,14 +49,14 @@ class PortImpl : public EthernetPort
     Q_OBJECT
 public:
     explicit PortImpl(SwitchImplPtr, of13::Port&, QObject* parent = 0);
+    ~PortImpl();
     void start();
 
     // Associations
     SwitchPtr switch_() const override { return sw_.lock(); }
 
     // Stats
-    Statistics<PortMeasurement> stats() const override
-    { return stats_->get(); }
+    Statistics<PortMeasurement> stats() const override;
 
     Statistics<QueueMeasurement> queue_stats(uint32_t qid) const override
     { return queue_stats_->at(qid).get(); }
@@ -59,6 +64,20 @@ public:
     Statistics<TrafficMeasurement> traffic_stats(ForwardingType type) const override
     { return traffic_stats_->at(type._to_string()).get(); }
 
+    void stats_history(TimeSeries::resolution r,
+                       const TimeSeries::visitor& f) const override
+    {
+        auto history = stats_history_.synchronize();
+        f(history->at(r));
+    }
+
+    void queue_stats_history(uint32_t qid, TimeSeries::resolution r,
+                             const TimeSeries::visitor& f) const override
+    {
+        auto store = queue_stats_.synchronize();
+        f(store->at(qid).history().at(r));
+    }
+
     std::vector<uint32_t> queues() const override;
     
     // Description
@@ -81,9 +100,11 @@ public:
 
     // == State ==
     /* TODO: Make observable [prio: high] */
-    bool link_down() const override { return state_ & of13::OFPPS_LINK_DOWN; }
+    // As announced by linkUp/linkDown, which may lag behind a flapping link
+    bool link_down() const override { return link_down_; }
     bool blocked() const override { return state_ & of13::OFPPS_BLOCKED; }
     bool live() const override { return state_ & of13::OFPPS_LIVE; }
+    bool watched() const override { return watched_; }
     bool maintenance() const override { return maintenance_; }
     void set_maintenance(bool b) override {
         if (maintenance_ != b) {
@@ -93,6 +114,9 @@ public:
         }
     }
 
+    bool core() const override { return core_; }
+    void set_core(bool b) override { core_ = b; }
+
     // == Ethernet ==
     uint32_t advertised() const override { return advertised_; }
     EthernetPortModPtr advertise(uint32_t features) override
@@ -109,9 +133,11 @@ public:
     void set_offline();
 
     void process_event(of13::Port& port);
-    void process_event(of13::PortStats port_stats);
-    void process_event(std::vector<of13::QueueStats> queue_stats);
-    void process_event(std::vector<of13::FlowStats> traffic_stats);
+    void process_event(of13::PortStats& port_stats);
+    // Port counters from elsewhere (sFlow), `time` in seconds
+    void process_counters(const PortMeasurement<uint64_t>& m, double time);
+    void process_event(index_span<of13::QueueStats> queue_stats);
+    void process_event(index_span<of13::FlowStats> traffic_stats);
 
 protected:
     friend class PortModImpl;
@@ -133,10 +159,12 @@ protected:
     unsigned max_speed_;
 
     bool maintenance_;
+    std::atomic<bool> core_ {false};
 
-    boost::synchronized_value<
-        StatisticsStore<PortMeasurement>
-    > stats_;
+    // row of the switch-wide table, only history is kept per port
+    std::shared_ptr<port_stats_table> stats_table_;
+    uint32_t stats_slot_;
+    boost::synchronized_value<TimeSeries> stats_history_;
 
     boost::synchronized_value<
         std::unordered_map<uint32_t, StatisticsStore<QueueMeasurement>>
@@ -145,6 +173,21 @@ protected:
     boost::synchronized_value<
         std::unordered_map<std::string, StatisticsStore<TrafficMeasurement>>
     > traffic_stats_;
+
+    std::atomic<bool> link_down_;
+    const bool live_watch_;
+    std::atomic<bool> watched_;
+    std::mutex damping_mutex_;
+    flap_damping damping_;
+    QTimer* damping_timer_;
+    bool damping_timer_pending_ {false};
+
+    void update_link(bool down);
+    // Warning: requires cmutex
+    bool down_in(uint32_t state) const;
+    void on_damping_timer();
+    // Warning: requires damping_mutex_
+    void schedule_damping(flap_damping::clock::time_point now);
 };
 
 class PortModImpl : public PortMod<mod_reuse_trait> {
@@ -23,8 +23,14 @@
 #include <range/v3/view/transform.hpp>
 #include <range/v3/view/map.hpp>
 
+#include <algorithm>
+#include <cstring>
 #include <functional>
+#include <iterator>
+#include <limits>
 #include <map>
+#include <mutex>
+#include <numeric>
 
 namespace runos {
 
@@ -116,6 +122,24 @@ namespace property_sheet {
         return ExactMatch{ obj.at("value").string_value() };
     }
 
+    // Longest literal text matched at the beginning of an anchored regex
+    static std::optional<std::string> literal_prefix(std::string const& re)
+    {
+        static const std::string_view special = ".[]{}()\\*+?|^$";
+
+        if (re.empty() || re[0] != '^' || re.find('|') != std::string::npos)
+            return std::nullopt;
+
+        size_t end = re.find_first_of(special.data(), 1, special.size());
+        if (end == std::string::npos)
+            end = re.size();
+        std::string ret = re.substr(1, end - 1);
+        // The last literal may be optional or repeated
+        if (end < re.size() && std::strchr("*?{", re[end]) && not ret.empty())
+            ret.pop_back();
+        return ret;
+    }
+
     FuzzyMatch FromJson<FuzzyMatch>::operator()(Json const& jobj) const {
         std::string err;
         auto& obj = jobj.object_items();
@@ -123,28 +147,40 @@ namespace property_sheet {
                                      {"smatch", Json::OBJECT}}, err),
                  JsonLoadError(), err);
 
+        VersionChecks checks;
+        for (auto& p : obj.at("smatch").object_items()) {
+            long grp = std::stol(p.first);
+            auto& j = p.second;
+            THROW_IF(grp < 0, JsonLoadError(), "Bad submatch group {}", grp);
+            THROW_IF(j.object_items().count("check") == 0,
+                     JsonLoadError(), "Bad smatch shape: no type id");
+
+            auto& type = j.object_items().at("check").string_value();
+            if (type == "version") {
+                checks.emplace_back(grp, FromJson<VersionChecker>{}(j));
+            } else {
+                THROW(JsonLoadError(), "Unknown smatch checker: {}", type);
+            }
+        }
+
+        return make_fuzzy(obj.at("regex").string_value(), std::move(checks));
+    }
+
+    FuzzyMatch make_fuzzy(std::string const& re_string, VersionChecks checks)
+    {
         try {
-            std::string re_string = obj.at("regex").string_value();
             std::regex re{ re_string };
 
             FuzzyMatch::CheckerList smatch;
-            for (auto& p : obj.at("smatch").object_items()) {
-                long grp = std::stol(p.first);
-                auto& j = p.second;
-                THROW_IF(grp > re.mark_count(), JsonLoadError(),
-                         "Bad submatch group {} in /{}/", grp, re_string);
-                THROW_IF(j.object_items().count("check") == 0,
-                         JsonLoadError(), "Bad smatch shape: no type id");
-
-                auto& type = j.object_items().at("check").string_value();
-                if (type == "version") {
-                    smatch.emplace_back(grp, FromJson<VersionChecker>{}(j));
-                } else {
-                    THROW(JsonLoadError(), "Unknown smatch checker: {}", type);
-                }
+            for (auto& check : checks) {
+                THROW_IF(check.first > re.mark_count(), JsonLoadError(),
+                         "Bad submatch group {} in /{}/",
+                         check.first, re_string);
+                smatch.emplace_back(check.first, std::move(check.second));
             }
 
-            return FuzzyMatch{ std::move(re), std::move(smatch) };
+            return FuzzyMatch{ std::move(re), std::move(smatch),
+                               literal_prefix(re_string) };
         } catch (std::regex_error const& e) {
             THROW_WITH_NESTED(JsonLoadError(), "Bad regex: {}", e.what());
         }
@@ -170,10 +206,174 @@ namespace property_sheet {
 
 }
 
+using EntryId = uint32_t;
+using EntryList = std::vector<EntryId>;
+
+// Prefix tree over literal prefixes of anchored fuzzy matchers
+struct PrefixTrie {
+    struct Node {
+        std::map<char, uint32_t> next;
+        EntryList entries;
+    };
+
+    std::vector<Node> nodes{ 1 };
+
+    void insert(std::string_view prefix, EntryId id)
+    {
+        uint32_t n = 0;
+        for (char c : prefix) {
+            auto it = nodes[n].next.find(c);
+            if (it != nodes[n].next.end()) {
+                n = it->second;
+                continue;
+            }
+            uint32_t child = nodes.size();
+            nodes[n].next.emplace(c, child);
+            nodes.emplace_back();
+            n = child;
+        }
+        nodes[n].entries.push_back(id);
+    }
+
+    // Appends entries whose prefix is a prefix of `s`
+    void collect(std::string_view s, EntryList& out) const
+    {
+        uint32_t n = 0;
+        for (size_t i = 0; ; ++i) {
+            auto& node = nodes[n];
+            out.insert(out.end(), node.entries.begin(), node.entries.end());
+            if (i == s.size())
+                break;
+            auto it = node.next.find(s[i]);
+            if (it == node.next.end())
+                break;
+            n = it->second;
+        }
+    }
+};
+
+// Entries that may match a value in one column
+struct ColumnIndex {
+    std::unordered_map<std::string_view, EntryList> exact;
+    PrefixTrie prefixed;
+    EntryList rest; // any-matchers and unanchored regexes
+
+    void insert(PropertySheet::Match const& m, EntryId id)
+    {
+        using namespace property_sheet;
+
+        if (auto e = std::get_if<ExactMatch>(&m)) {
+            exact[e->value].push_back(id);
+        } else if (auto f = std::get_if<FuzzyMatch>(&m); f && f->prefix) {
+            prefixed.insert(*f->prefix, id);
+        } else {
+            rest.push_back(id);
+        }
+    }
+
+    // Sorted list of candidates
+    EntryList candidates(std::string_view s) const
+    {
+        EntryList ret;
+        auto it = exact.find(s);
+        if (it != exact.end())
+            ret = it->second;
+        prefixed.collect(s, ret);
+        ret.insert(ret.end(), rest.begin(), rest.end());
+        std::sort(ret.begin(), ret.end());
+        return ret;
+    }
+
+    size_t estimate(std::string_view s) const
+    {
+        auto it = exact.find(s);
+        size_t ret = rest.size() + (it != exact.end() ? it->second.size() : 0);
+        // Prefix lists are short, count them honestly
+        EntryList tmp;
+        prefixed.collect(s, tmp);
+        return ret + tmp.size();
+    }
+};
+
+struct PropertySheet::Index {
+    using Matches = std::vector<std::pair<EntryId, Score>>;
+
+    std::vector<ColumnIndex> columns;
+
+    // Memoization of entries matching anything outside of the key columns
+    std::vector<size_t> key_columns;
+    std::vector<bool> generic;
+    static constexpr size_t cache_limit = 4096;
+    std::mutex cache_mutex;
+    std::unordered_map<std::string, Matches> cache;
+
+    explicit Index(size_t ncolumns)
+        : columns(ncolumns)
+    { }
+
+    bool is_generic(Entry const& e) const
+    {
+        if (key_columns.empty())
+            return false;
+        for (size_t i = 0; i < e.selector.size(); ++i) {
+            if (std::find(key_columns.begin(), key_columns.end(), i)
+                    != key_columns.end())
+                continue;
+            if (not std::holds_alternative<property_sheet::AnyMatch>(e.selector[i]))
+                return false;
+        }
+        return true;
+    }
+
+    void add(Entry const& e, EntryId id)
+    {
+        for (size_t i = 0; i < columns.size(); ++i)
+            columns[i].insert(e.selector[i], id);
+        generic.push_back(is_generic(e));
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        cache.clear();
+    }
+
+    std::string cache_key(const std::string_view* fields) const
+    {
+        std::string ret;
+        for (size_t i : key_columns) {
+            ret.append(fields[i].data(), fields[i].size());
+            ret.push_back('\0');
+        }
+        return ret;
+    }
+
+    // Candidates from the most selective of `cols`
+    template<class Columns>
+    EntryList candidates(Columns const& cols, const std::string_view* fields) const
+    {
+        size_t best = columns.size();
+        size_t best_size = std::numeric_limits<size_t>::max();
+        for (size_t i : cols) {
+            size_t n = columns[i].estimate(fields[i]);
+            if (n < best_size) {
+                best = i;
+                best_size = n;
+            }
+        }
+        return columns[best].candidates(fields[best]);
+    }
+};
+
+PropertySheet::PropertySheet(size_t columns)
+    : columns(columns)
+    , index(new Index(columns))
+{ }
+
+PropertySheet::PropertySheet(PropertySheet&&) noexcept = default;
+PropertySheet::~PropertySheet() = default;
+
 void PropertySheet::append(Entry e)
 {
     RUNOS_ASSERT(e.selector.size() == columns);
     entries.push_back(std::move(e));
+    index->add(entries.back(), entries.size() - 1);
 }
 
 void PropertySheet::append(std::vector<Match> selector,
@@ -182,6 +382,20 @@ void PropertySheet::append(std::vector<Match> selector,
     append(Entry{ std::move(selector), std::move(props) });
 }
 
+void PropertySheet::memoize(std::vector<size_t> key_columns)
+{
+    for (size_t i : key_columns)
+        RUNOS_ASSERT(i < columns);
+
+    index->key_columns = std::move(key_columns);
+    index->generic.clear();
+    for (auto& e : entries)
+        index->generic.push_back(index->is_generic(e));
+
+    std::lock_guard<std::mutex> lock(index->cache_mutex);
+    index->cache.clear();
+}
+
 auto PropertySheet::match(std::vector<Match> const& selector,
                           const std::string_view* fields,
                           const std::string_view* end) const
@@ -225,7 +439,6 @@ static void acceptProps(PropertySheet::Entry const& e,
     }
 }
 
-// Stupid O(N) algo for now..
 PropertySheet::PropSet
 PropertySheet::query(const std::string_view* begin,
                      const std::string_view* end) const
@@ -233,12 +446,53 @@ PropertySheet::query(const std::string_view* begin,
     RUNOS_ASSERT((size_t) std::distance(begin, end) == columns);
 
     using namespace ranges;
+    using Matches = Index::Matches;
+
+    auto collect = [&](EntryList const& ids, bool generic, Matches& out) {
+        for (EntryId id : ids) {
+            if (index->generic[id] != generic)
+                continue;
+            if (auto score = match(entries[id].selector, begin, end))
+                out.emplace_back(id, std::move(*score));
+        }
+    };
+
+    std::vector<size_t> all(columns);
+    std::iota(all.begin(), all.end(), 0);
+
+    Matches generic;
+    if (not index->key_columns.empty()) {
+        std::string key = index->cache_key(begin);
+        std::unique_lock<std::mutex> lock(index->cache_mutex);
+        auto it = index->cache.find(key);
+        if (it != index->cache.end()) {
+            generic = it->second;
+        } else {
+            lock.unlock();
+            collect(index->candidates(index->key_columns, begin), true, generic);
+            lock.lock();
+            if (index->cache.size() >= Index::cache_limit)
+                index->cache.clear();
+            index->cache.emplace(std::move(key), generic);
+        }
+    }
+
+    Matches specific;
+    collect(index->candidates(all, begin), false, specific);
+
+    // Apply in the order of appending, later entries win on equal score
+    Matches matches;
+    matches.reserve(generic.size() + specific.size());
+    std::merge(std::make_move_iterator(generic.begin()),
+               std::make_move_iterator(generic.end()),
+               std::make_move_iterator(specific.begin()),
+               std::make_move_iterator(specific.end()),
+               std::back_inserter(matches),
+               [](auto const& a, auto const& b) { return a.first < b.first; });
 
     MatchedProperties results;
-    for (auto& e: entries) {
-        if (auto score = match(e.selector, begin, end)) {
-            acceptProps(e, *score, results);
-        }
+    for (auto& m : matches) {
+        acceptProps(entries[m.first], m.second, results);
     }
 
     return results | view::values
@@ -19,12 +19,22 @@
 #include "DatabaseConnector.hpp"
 #include "RecoveryModeChecker.hpp"
 #include "DpidChecker.hpp"
+#include "OFServer.hpp"
 #include "api/OFAgent.hpp"
+#include "api/OFConnection.hpp"
+#include "openflow/common.hh"
+#include "hb/shard_heartbeat.hpp"
 
+#include <fluid/of13msg.hh>
 #include <json.hpp>
 #include <runos/core/logging.hpp>
 
+#include <boost/thread/executors/inline_executor.hpp>
+
 #include <QThread>
+#include <algorithm>
+#include <condition_variable>
+#include <sstream>
 #include <stdexcept>
 
 static constexpr int UNICAST_PRIMARY_ID = 1;
@@ -38,8 +48,98 @@ namespace runos
 {
 using lock_t = std::lock_guard<std::mutex>;
 
+// Role replies are handled in the thread they come in
+static boost::inline_executor role_executor;
+
 REGISTER_APPLICATION(RecoveryManager, {"switch-ordering", "database-connector",
-                                       "dpid-checker", ""})
+                                       "dpid-checker", "of-server", ""})
+
+namespace {
+
+// ONF extension 191, role status messages for OpenFlow 1.3
+constexpr uint32_t ONF_EXPERIMENTER_ID = 0x4f4e4600;
+constexpr uint32_t ONFT_ROLE_STATUS = 1911;
+
+struct onf_role_status {
+    of::header header;
+    of::big_uint32_t experimenter;
+    of::big_uint32_t exp_type;
+    of::big_uint32_t role;
+    of::big_uint8_t reason;
+    uint8_t pad[3];
+    of::big_uint64_t generation_id;
+};
+static_assert(sizeof(onf_role_status) == 32, "");
+
+} // namespace
+
+// Ends the measurement of a takeover on the first FlowMod sent
+class FailoverHook final
+    : public OFConnection::SendHookHandler<fluid_msg::of13::FlowMod>
+{
+public:
+    explicit FailoverHook(RecoveryManager* app)
+        : app_(app)
+    { }
+
+    void process(fluid_msg::of13::FlowMod&) override { app_->flowModSent(); }
+
+private:
+    RecoveryManager* app_;
+};
+
+// Tracks the role of one switch from the messages it sends on its own
+class RoleListener final
+    : public OFConnection::ReceiveHandler<fluid_msg::of13::Error>
+    , public OFConnection::ViewHandler
+{
+public:
+    explicit RoleListener(std::weak_ptr<SwitchView> view)
+        : view_(std::move(view))
+    { }
+
+    // Rejected as a slave or a failed role request: the switch and
+    // the view disagree on the role
+    void process(fluid_msg::of13::Error& error) override
+    {
+        namespace of13 = fluid_msg::of13;
+        const bool is_slave = of13::OFPET_BAD_REQUEST == error.err_type() &&
+                              of13::OFPBRC_IS_SLAVE == error.code();
+        if (not is_slave &&
+                of13::OFPET_ROLE_REQUEST_FAILED != error.err_type()) {
+            return;
+        }
+        if (auto view = view_.lock()) {
+            VLOG(10) << "[RecoveryManager] Mastership view - Switch with"
+                     << " dpid=" << view->getDPID() << " returned error"
+                     << " type=" << error.err_type()
+                     << ", code=" << error.code() << ". Role is unknown";
+            view->roleUnknown();
+        }
+    }
+
+    void process(OFMessageView& msg) override
+    {
+        if (fluid_msg::of13::OFPT_EXPERIMENTER != msg.type() ||
+                msg.length() < sizeof(onf_role_status)) {
+            return;
+        }
+        auto status = reinterpret_cast<const onf_role_status*>(msg.data());
+        if (ONF_EXPERIMENTER_ID != status->experimenter ||
+                ONFT_ROLE_STATUS != status->exp_type) {
+            return;
+        }
+        if (auto view = view_.lock()) {
+            view->roleStatus(
+                static_cast<fluid_msg::ofp_controller_role>(
+                    uint32_t(status->role)),
+                status->generation_id);
+        }
+    }
+
+private:
+    std::weak_ptr<SwitchView> view_;
+};
 
 SwitchView::SwitchView(SwitchPtr sw,
                        const RecoveryManager* const rm)
@@ -58,15 +158,22 @@ fluid_msg::ofp_controller_role SwitchView::getRole() const
     return role_;
 }
 
+uint64_t SwitchView::getGenerationId() const
+{
+    return generation_id_;
+}
+
 void SwitchView::changeSwitchRole(fluid_msg::ofp_controller_role sending_role,
                                   bool get_only_generation_id,
                                   int role_request_times)
 {
     CHECK(fluid_msg::OFPCR_ROLE_EQUAL != sending_role);
+    bool ok = false;
     try {
         change_switch_role(sending_role,
                            get_only_generation_id,
                            role_request_times);
+        ok = true;
     } catch (const switch_equal_error& e) {
         LOG(ERROR) << "[RecoveryManager] Mastership view - "
                    << "Switch with dpid=" << getDPID()
@@ -86,6 +193,9 @@ void SwitchView::changeSwitchRole(fluid_msg::ofp_controller_role sending_role,
     } catch (...) {
         LOG(ERROR) << "[RecoveryManager] Undefined error in changeSwitchRole";
     }
+    if (not ok) {
+        roleUnknown();
+    }
 }
 
 void SwitchView::change_switch_role(fluid_msg::ofp_controller_role sending_role,
@@ -124,7 +234,8 @@ SwitchView::send_role_request(fluid_msg::ofp_controller_role sending_role)
 void SwitchView::process_role_reply(fluid_msg::ofp_controller_role sending_role,
                                     ofp::role_config&& role_config,
                                     bool get_only_generation_id,
-                                    int role_request_times)
+                                    int role_request_times,
+                                    const std::function<void(int)>& retry)
 {
     generation_id_ = role_config.generation_id;
     if (get_only_generation_id) {
@@ -148,7 +259,7 @@ void SwitchView::process_role_reply(fluid_msg::ofp_controller_role sending_role,
         if (fluid_msg::OFPCR_ROLE_NOCHANGE == sending_role) {
             THROW(switch_equal_error{}, "Switch cannot be changed from EQUAL");
         } else { // sending MASTER/SLAVE
-            handle_equal_error(sending_role, role_request_times);
+            on_equal_reply(sending_role, role_request_times, retry);
         }
     }
 
@@ -164,7 +275,7 @@ void SwitchView::process_role_reply(fluid_msg::ofp_controller_role sending_role,
             switch (role_) {
             case fluid_msg::OFPCR_ROLE_MASTER:
             case fluid_msg::OFPCR_ROLE_SLAVE:
-                handle_equal_error(sending_role, role_request_times);
+                on_equal_reply(sending_role, role_request_times, retry);
                 break;
             default:
                 break;
@@ -180,11 +291,21 @@ void SwitchView::process_role_reply(fluid_msg::ofp_controller_role sending_role,
                   << " to " << SwitchView::convertRole(returned_role);
         role_ = returned_role;
     }
+    role_known_ = true;
 }
 
-void
-SwitchView::handle_equal_error(fluid_msg::ofp_controller_role sending_role,
-                               int role_request_times)
+void SwitchView::on_equal_reply(fluid_msg::ofp_controller_role sending_role,
+                                int role_request_times,
+                                const std::function<void(int)>& retry)
+{
+    if (retry) {
+        retry(next_equal_attempt(role_request_times));
+    } else {
+        handle_equal_error(sending_role, role_request_times);
+    }
+}
+
+int SwitchView::next_equal_attempt(int role_request_times) const
 {
     // Handler for error if switch set EQUAL role
     // Problem - if controller fails to set role distinct from EQUAL
@@ -193,7 +314,133 @@ SwitchView::handle_equal_error(fluid_msg::ofp_controller_role sending_role,
     if (times >= MAX_TIMES_MEET_EQUAL) {
         THROW(switch_equal_error{}, "Switch cannot be changed from EQUAL");
     }
-    change_switch_role(sending_role, false, times);
+    return times;
+}
+
+void
+SwitchView::handle_equal_error(fluid_msg::ofp_controller_role sending_role,
+                               int role_request_times)
+{
+    change_switch_role(sending_role, false,
+                       next_equal_attempt(role_request_times));
+}
+
+void SwitchView::requestRole(fluid_msg::ofp_controller_role sending_role,
+                             uint64_t generation_id,
+                             std::function<void(bool)> done,
+                             int role_request_times)
+{
+    CHECK(fluid_msg::OFPCR_ROLE_EQUAL != sending_role);
+
+    future<ofp::role_config> f;
+    try {
+        f = sw_->connection()->agent()->request_role(
+                static_cast<uint32_t>(sending_role), generation_id);
+    } catch (const OFAgent::request_error& e) {
+        LOG(ERROR) << "[RecoveryManager] request_error during role request."
+                   << "Switch dpid=" << e.dpid() << ", msg xid=" << e.xid();
+        done(false);
+        return;
+    }
+
+    f.then(role_executor,
+           [self = shared_from_this(), sending_role, generation_id,
+            done = std::move(done), role_request_times]
+           (future<ofp::role_config> f)
+    {
+        bool retried = false;
+        auto retry = [&](int times) {
+            retried = true;
+            self->requestRole(sending_role, generation_id, done, times);
+        };
+
+        try {
+            auto ret = f.get();
+            const auto ret_role =
+                static_cast<fluid_msg::ofp_controller_role>(ret.role);
+            if (fluid_msg::OFPCR_ROLE_NOCHANGE != sending_role &&
+                ret_role != sending_role && role_request_times == -1) {
+                LOG(ERROR) << "[RecoveryManager] Mastership -"
+                           << " New role="
+                           << SwitchView::convertRole(sending_role)
+                           << " wasn't set. Role="
+                           << SwitchView::convertRole(ret_role)
+                           << " was recieved from switch";
+            }
+            self->process_role_reply(sending_role, std::move(ret), false,
+                                     role_request_times, retry);
+        } catch (const switch_equal_error& e) {
+            LOG(ERROR) << "[RecoveryManager] Mastership view - "
+                       << "Switch with dpid=" << self->getDPID()
+                       << " returns EQUAL role. "
+                          "Disconnecting from the bad switch";
+            self->detach_from_invalid_switch(self->getDPID());
+            if (not retried) done(false);
+            return;
+        } catch (const OFAgent::openflow_error& e) {
+            LOG(ERROR) << "[RecoveryManager] openflow_error during role "
+                       << "request. Switch dpid=" << e.dpid()
+                       << ", msg xid=" << e.xid() << ", type=" << e.type()
+                       << ", code=" << e.code();
+            if (not retried) done(false);
+            return;
+        } catch (const OFAgent::request_error& e) {
+            LOG(ERROR) << "[RecoveryManager] request_error during role "
+                       << "request. Switch dpid=" << e.dpid()
+                       << ", msg xid=" << e.xid();
+            if (not retried) done(false);
+            return;
+        } catch (...) {
+            LOG(ERROR) << "[RecoveryManager] Undefined error in requestRole";
+            if (not retried) done(false);
+            return;
+        }
+
+        if (not retried) done(true);
+    });
+}
+
+void SwitchView::listen()
+{
+    role_listener_ = std::make_shared<RoleListener>(weak_from_this());
+    auto conn = sw_->connection();
+    conn->receive(role_listener_);
+    conn->receive_view(role_listener_);
+}
+
+bool SwitchView::roleKnown() const
+{
+    return role_known_;
+}
+
+void SwitchView::roleUnknown()
+{
+    role_known_ = false;
+}
+
+void SwitchView::roleStatus(fluid_msg::ofp_controller_role role,
+                            uint64_t generation_id)
+{
+    generation_id_ = generation_id;
+    if (fluid_msg::OFPCR_ROLE_EQUAL == role) {
+        // let the next role reply go the usual way for EQUAL
+        roleUnknown();
+        return;
+    }
+
+    role_known_ = true;
+    if (role == role_) {
+        return;
+    }
+
+    LOG(INFO) << "[RecoveryManager] Mastership view - "
+              << "Role status from switch with DPID=" << sw_->dpid()
+              << ": role has changed from " << SwitchView::convertRole(role_)
+              << " to " << SwitchView::convertRole(role);
+    role_ = role;
+    if (fluid_msg::OFPCR_ROLE_SLAVE == role) {
+        emit roleMasterToSlaveChanged(sw_->dpid());
+    }
 }
 
 void SwitchView::detach_from_invalid_switch(uint64_t dpid)
@@ -230,9 +477,13 @@ std::string SwitchView::convertRole(fluid_msg::ofp_controller_role role)
 // MastershipView class
 
 MastershipView::MastershipView(std::promise<void> init_promise,
-                               int role_monitoring_interval)
+                               int role_monitoring_interval,
+                               bool passive,
+                               int refresh_polls)
     : init_promise_(std::move(init_promise))
     , role_monitoring_poller_(new Poller(this, role_monitoring_interval))
+    , passive_(passive)
+    , refresh_polls_(refresh_polls)
 {}
 
 ControllerStatus MastershipView::getStatus() const
@@ -254,6 +505,7 @@ SwitchViewPtr MastershipView::addSwitch(SwitchPtr sw,
         }
     }
 
+    switch_view->listen();
     // send role request to get gen_id
     switch_view->changeSwitchRole(fluid_msg::OFPCR_ROLE_NOCHANGE, true);
     return switch_view;
@@ -286,19 +538,191 @@ void MastershipView::setStatus(ControllerStatus status)
     }
 }
 
+namespace {
+
+// Completion of one setupNewRoleForAll round, one bit per switch
+struct RoleRound {
+    using clock = std::chrono::steady_clock;
+
+    explicit RoleRound(size_t size)
+        : done(size, false)
+        , replied(size, false)
+        , latency(size)
+        , remaining(size)
+    { }
+
+    void complete(size_t i, bool ok)
+    {
+        auto now = clock::now();
+        lock_t lock(mutex);
+        if (done[i])
+            return;
+        done[i] = true;
+        replied[i] = ok;
+        latency[i] = std::chrono::duration_cast<std::chrono::microseconds>(
+                         now - start);
+        if (--remaining == 0) {
+            cv.notify_all();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    const clock::time_point start = clock::now();
+    std::vector<bool> done;
+    std::vector<bool> replied;
+    std::vector<std::chrono::microseconds> latency;
+    size_t remaining;
+};
+
+} // namespace
+
 void MastershipView::setupNewRoleForAll(fluid_msg::ofp_controller_role role)
+{
+    role_round(role, view());
+}
+
+void MastershipView::role_round(fluid_msg::ofp_controller_role role,
+                                std::vector<SwitchViewPtr> switches)
 {
     static std::mutex role_request_mutex_;
     lock_t l(role_request_mutex_);
 
-    for (auto& sw_ptr : view()) {
-        sw_ptr->changeSwitchRole(role);
+    if (switches.empty())
+        return;
+
+    // Switches ignore MASTER/SLAVE requests with a generation id older
+    // than the one they have, the next after all of them suits everyone
+    const bool elects = fluid_msg::OFPCR_ROLE_MASTER == role ||
+                        fluid_msg::OFPCR_ROLE_SLAVE == role;
+    uint64_t generation_id = 0;
+    for (auto& sw_ptr : switches) {
+        generation_id = std::max(generation_id, sw_ptr->getGenerationId());
+    }
+    ++generation_id;
+
+    auto round = std::make_shared<RoleRound>(switches.size());
+    for (size_t i = 0; i < switches.size(); ++i) {
+        switches[i]->requestRole(
+            role,
+            elects ? generation_id : switches[i]->getGenerationId(),
+            [round, i](bool ok) { round->complete(i, ok); });
+    }
+
+    std::vector<bool> done, replied;
+    std::vector<std::chrono::microseconds> latency;
+    { // lock
+        std::unique_lock<std::mutex> lock(round->mutex);
+        round->cv.wait_for(lock,
+                           std::chrono::seconds(ROLE_REQUEST_TIMEOUT.count()),
+                           [&round]() { return round->remaining == 0; });
+        done = round->done;
+        replied = round->replied;
+        latency = round->latency;
+    } // unlock
+    auto total = std::chrono::duration_cast<std::chrono::microseconds>(
+                     RoleRound::clock::now() - round->start);
+
+    for (size_t i = 0; i < switches.size(); ++i) {
+        if (not done[i] || not replied[i]) {
+            switches[i]->roleUnknown();
+        }
+    }
+
+    if (not elects) {
+        for (size_t i = 0; i < switches.size(); ++i) {
+            if (not done[i]) {
+                LOG(ERROR) << "[RecoveryManager] Role request time exceeded. "
+                           << "Dpid=" << switches[i]->getDPID() << ", role="
+                           << SwitchView::convertRole(role);
+            }
+        }
+        return;
+    }
+
+    RoleChangeReport report;
+    report.role = role;
+    report.generation_id = generation_id;
+    report.switches = switches.size();
+    report.total = total;
+
+    std::vector<std::chrono::microseconds> replies;
+    for (size_t i = 0; i < switches.size(); ++i) {
+        if (not done[i]) {
+            ++report.timed_out;
+            LOG(ERROR) << "[RecoveryManager] Role request time exceeded. "
+                       << "Dpid=" << switches[i]->getDPID() << ", role="
+                       << SwitchView::convertRole(role);
+        } else if (not replied[i]) {
+            ++report.failed;
+        } else {
+            replies.push_back(latency[i]);
+        }
+    }
+    report.replied = replies.size();
+
+    if (not replies.empty()) {
+        std::sort(replies.begin(), replies.end());
+        // Nearest-rank percentile
+        auto rank = [&replies](size_t percent) {
+            size_t idx = (percent * replies.size() + 99) / 100;
+            return replies[std::max<size_t>(idx, 1) - 1];
+        };
+        report.p50 = rank(50);
+        report.p90 = rank(90);
+        report.p99 = rank(99);
+        report.max = replies.back();
+    }
+
+    LOG(WARNING) << "[RecoveryManager] Mastership view - Role "
+                 << SwitchView::convertRole(role) << " (generation_id="
+                 << generation_id << ") set on " << report.replied << "/"
+                 << report.switches << " switches in "
+                 << report.total.count() / 1000 << " ms; failed="
+                 << report.failed << ", timed out=" << report.timed_out
+                 << "; reply latency us p50=" << report.p50.count()
+                 << " p90=" << report.p90.count()
+                 << " p99=" << report.p99.count()
+                 << " max=" << report.max.count();
+
+    lock_t rl(report_mutex_);
+    last_role_change_ = report;
+}
+
+void MastershipView::setupRoles(const std::function<bool(uint64_t)>& master)
+{
+    std::vector<SwitchViewPtr> masters, slaves;
+    for (auto& sw : view()) {
+        (master(sw->getDPID()) ? masters : slaves).push_back(sw);
     }
+    // MASTER goes first: the switch demotes the previous master by
+    // itself, which also covers an owner that is gone
+    role_round(fluid_msg::OFPCR_ROLE_MASTER, std::move(masters));
+    role_round(fluid_msg::OFPCR_ROLE_SLAVE, std::move(slaves));
+}
+
+MastershipView::RoleChangeReport MastershipView::lastRoleChange() const
+{
+    lock_t l(report_mutex_);
+    return last_role_change_;
 }
 
 void MastershipView::polling()
 {
-    setupNewRoleForAll(fluid_msg::OFPCR_ROLE_NOCHANGE);
+    if (not passive_ || (refresh_polls_ > 0 && ++polls_ >= refresh_polls_)) {
+        polls_ = 0;
+        setupNewRoleForAll(fluid_msg::OFPCR_ROLE_NOCHANGE);
+        return;
+    }
+
+    // Role status messages and errors keep the others up to date
+    auto switches = view();
+    switches.erase(std::remove_if(switches.begin(), switches.end(),
+                                  [](const SwitchViewPtr& sw) {
+                                      return sw->roleKnown();
+                                  }),
+                   switches.end());
+    role_round(fluid_msg::OFPCR_ROLE_NOCHANGE, std::move(switches));
 }
 
 std::vector<SwitchViewPtr> MastershipView::view() const
@@ -498,6 +922,16 @@ void RecoveryManager::parseConfig(const Config& root_config)
                                               "role-monitoring-interval", 1000);
     max_waiting_recovery_interval_ = std::chrono::seconds(config_get(config,
                                               "recovery-waiting-seconds", 0));
+
+    const auto role_monitoring = config_get(config, "role-monitoring", "poll");
+    CHECK("poll" == role_monitoring or "passive" == role_monitoring);
+    passive_role_monitoring_ = "passive" == role_monitoring;
+    role_refresh_polls_ = config_get(config, "role-refresh-polls", 60);
+    state_digest_ = config_get(config, "state-digest", false);
+
+    auto& sharding = config_cd(config, "sharding");
+    sharded_ = config_get(sharding, "enabled", false);
+    shard_ring_ = shard_ring(config_get(sharding, "virtual-nodes", 64));
 }
 
 void RecoveryManager::initCurrentNode(const Config& root_config)
@@ -533,6 +967,8 @@ void RecoveryManager::initHeartbeat(const Config& root_config)
     QObject::connect(this, &RecoveryManager::dbParamsChanged,
                      heartbeat_core_.get(), &HeartbeatCore::dbParamsChanged,
                      Qt::QueuedConnection);
+    QObject::connect(heartbeat_thread, &QThread::started,
+                     heartbeat_core_.get(), &HeartbeatCore::setupThread);
     heartbeat_thread->start();
 
     // signals from heartbeat core to recovery manager
@@ -554,6 +990,27 @@ void RecoveryManager::initHeartbeat(const Config& root_config)
                      Qt::QueuedConnection);
     QObject::connect(heartbeat_core_.get(), &HeartbeatCore::paramsChanged,
                      this, &RecoveryManager::setParams, Qt::QueuedConnection);
+
+    if (state_digest_ and not sharded_) {
+        // called on the heartbeat thread, the digest is locked inside
+        heartbeat_core_->setDigestSource([this](DigestMessage& digest) {
+            if (not db_connector_->digestTracked()) {
+                return false;
+            }
+            auto summary = db_connector_->digest();
+            digest.generation = summary.generation;
+            digest.root = summary.root;
+            digest.buckets.clear();
+            for (auto hash : summary.buckets) {
+                digest.buckets.append(hash);
+            }
+            return true;
+        });
+        QObject::connect(heartbeat_core_.get(),
+                         &HeartbeatCore::stateDigestReceived,
+                         this, &RecoveryManager::stateDigest,
+                         Qt::QueuedConnection);
+    }
 }
 
 void RecoveryManager::initMastership()
@@ -562,7 +1019,8 @@ void RecoveryManager::initMastership()
     init_future_ = std::move(init_promise.get_future());
 
     mastership_view_ = std::make_shared<MastershipView>(
-        std::move(init_promise), master_role_monitoring_interval_);
+        std::move(init_promise), master_role_monitoring_interval_,
+        passive_role_monitoring_, role_refresh_polls_);
 
     CHECK(heartbeat_core_);
     QObject::connect(this, &RecoveryManager::linkBetweenControllersIsDown,
@@ -573,6 +1031,29 @@ void RecoveryManager::initMastership()
     rm_checker_ = std::make_unique<RecoveryModeChecker>(this, db_connector_);
 }
 
+void RecoveryManager::initSharding(const Config& root_config)
+{
+    if (not sharded_) {
+        return;
+    }
+
+    qRegisterMetaType<QVector<int>>("QVector<int>");
+    shard_heartbeat_ = std::make_unique<ShardHeartbeat>(root_config);
+    auto shard_thread = new QThread(this);
+    shard_heartbeat_->moveToThread(shard_thread);
+    QObject::connect(shard_thread, &QThread::started,
+                     shard_heartbeat_.get(), &ShardHeartbeat::start);
+    QObject::connect(shard_heartbeat_.get(), &ShardHeartbeat::membersChanged,
+                     this, &RecoveryManager::setShardMembers,
+                     Qt::QueuedConnection);
+
+    // isPrimary() stays false until the first member set
+    controller_status_ = ControllerStatus::BACKUP;
+    current_node_->setHbStatus(controller_status_);
+    mastership_view_->setStatus(controller_status_);
+    shard_thread->start();
+}
+
 void RecoveryManager::sendStartHeartbeat()
 {
     CHECK(+CommunicationType::UNDEFINED != heartbeat_communication_type_);
@@ -611,6 +1092,7 @@ void RecoveryManager::init(Loader* loader, const Config& root_config)
     qRegisterMetaType<CommunicationType>("CommunicationType");
     qRegisterMetaType<ControllerStatus>("ControllerStatus");
     qRegisterMetaType<ParamsMessage>("ParamsMessage");
+    qRegisterMetaType<DigestMessage>("DigestMessage");
 
     SwitchOrderingManager::get(loader)->registerHandler(this, 0);
     dpid_checker_ = DpidChecker::get(loader);
@@ -620,11 +1102,25 @@ void RecoveryManager::init(Loader* loader, const Config& root_config)
     initCurrentNode(root_config);
     initHeartbeat(root_config);
     initMastership();
+    initSharding(root_config);
+
+    QObject::connect(OFServer::get(loader), &OFServer::switchDiscovered,
+                     this, [this](OFConnectionPtr conn) {
+                         conn->send_hook(std::make_shared<FailoverHook>(this));
+                     }, Qt::DirectConnection);
 }
 
 void RecoveryManager::startUp(Loader *provider)
 {
+    if (sharded_) {
+        LOG(WARNING) << "[RecoveryManager] Sharding - Active-active mode, "
+                        "the primary/backup heartbeat is not started";
+        return;
+    }
     startHeartbeat();
+    if (state_digest_ and isPrimary()) {
+        db_connector_->trackDigest();
+    }
 }
 
 void RecoveryManager::switchUp(SwitchPtr sw)
@@ -632,6 +1128,18 @@ void RecoveryManager::switchUp(SwitchPtr sw)
     auto switch_view_ptr = mastership_view_->addSwitch(
         sw, this, master_role_monitoring_interval_);
 
+    if (sharded_) {
+        int owner = shardOwner(sw->dpid());
+        // before the first member set setShardMembers() assigns it
+        if (shard_ring::none != owner) {
+            switch_view_ptr->changeSwitchRole(id_ == owner
+                                              ? fluid_msg::OFPCR_ROLE_MASTER
+                                              : fluid_msg::OFPCR_ROLE_SLAVE);
+        }
+        rm_checker_->updateSwitch(sw->dpid(), Action::ADD);
+        return;
+    }
+
     init_future_.wait();
     try {
         switch(mastership_view_->getStatus()) {
@@ -694,6 +1202,93 @@ bool RecoveryManager::isBackup() const
     return +ControllerStatus::BACKUP == controller_status_;
 }
 
+bool RecoveryManager::isSharded() const
+{
+    return sharded_;
+}
+
+bool RecoveryManager::isMaster(uint64_t dpid) const
+{
+    if (not sharded_) {
+        return isPrimary();
+    }
+    return shardOwner(dpid) == id_;
+}
+
+int RecoveryManager::shardOwner(uint64_t dpid) const
+{
+    lock_t l(shard_mutex_);
+    return shard_ring_.owner(dpid);
+}
+
+std::vector<int> RecoveryManager::shardMembers() const
+{
+    lock_t l(shard_mutex_);
+    return shard_ring_.members();
+}
+
+void RecoveryManager::setShardMembers(QVector<int> members)
+{
+    int leader;
+    { // lock
+        lock_t l(shard_mutex_);
+        if (not shard_ring_.assign(
+                std::vector<int>(members.begin(), members.end()))) {
+            return;
+        }
+        leader = shard_ring_.leader();
+    } // unlock
+
+    std::ostringstream ids;
+    for (int id : members) {
+        ids << (ids.tellp() > 0 ? "," : "") << id;
+    }
+    LOG(WARNING) << "[RecoveryManager] Sharding - Cluster members are "
+                 << ids.str() << ", leader id=" << leader;
+
+    for (auto& node : cluster_) {
+        if (not members.contains(node->id())) {
+            node->setState(ControllerState::NOT_ACTIVE);
+        }
+    }
+    for (int id : members) {
+        auto it = std::find_if(cluster_.begin(), cluster_.end(),
+                               [id](ClusterNodePtr ptr) {
+                                   return ptr->id() == id;
+                               });
+        if (cluster_.end() == it) {
+            it = cluster_.insert(cluster_.end(),
+                                 std::make_shared<ClusterNode>(
+                                     id, ControllerState::ACTIVE,
+                                     fluid_msg::OFPCR_ROLE_EQUAL));
+        }
+        (*it)->setState(ControllerState::ACTIVE);
+        (*it)->setHbStatus(id == leader ? ControllerStatus::PRIMARY
+                                        : ControllerStatus::BACKUP);
+    }
+
+    mastership_view_->setupRoles([this](uint64_t dpid) {
+        return isMaster(dpid);
+    });
+
+    const ControllerStatus status = id_ == leader ? ControllerStatus::PRIMARY
+                                                  : ControllerStatus::BACKUP;
+    const bool leadership_changed = status != controller_status_;
+    controller_status_ = status;
+    mastership_view_->setStatus(controller_status_);
+
+    emit shardsChanged();
+    if (leadership_changed) {
+        LOG(WARNING) << "[RecoveryManager] Sharding - This node is "
+                     << (isPrimary() ? "now" : "no longer") << " the leader";
+        if (isPrimary()) {
+            emit signalSetupPrimaryMode();
+        } else {
+            emit signalSetupBackupMode();
+        }
+    }
+}
+
 void RecoveryManager::recovery()
 {
     if (+ControllerStatus::PRIMARY == controller_status_) {
@@ -708,11 +1303,31 @@ void RecoveryManager::recovery()
                    << "All switches are connected. Start recovery procedure";
     }
 
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    auto heard = +ControllerStatus::BACKUP == controller_status_
+               ? heartbeat_core_->primaryLastHeard()
+               : steady_clock::time_point();
+    FailoverReport report;
+    if (heard != steady_clock::time_point()) {
+        report.detection = duration_cast<microseconds>(start - heard);
+    }
+    { // lock
+        lock_t lock(failover_mutex_);
+        report.failovers = failover_.failovers + 1;
+        failover_ = report;
+        failover_start_ = start;
+    } // unlock
+    awaiting_flow_mod_ = true;
+
     controller_status_ = ControllerStatus::PRIMARY;
 
     // change role in MastershipView and on switches
     mastership_view_->setupNewRoleForAll(fluid_msg::OFPCR_ROLE_MASTER);
     mastership_view_->setStatus(controller_status_);
+    auto roles_set = steady_clock::now();
+    report.role_change = duration_cast<microseconds>(roles_set - start);
+    report.switches = mastership_view_->view().size();
 
     for (auto node : cluster_) {
         // set failed controller as not_active
@@ -731,10 +1346,58 @@ void RecoveryManager::recovery()
     sendStartHeartbeat();
 
     // recovery datastore
+    auto loading = steady_clock::now();
     db_connector_->setupMasterRole();
+    // Declared prefixes of all apps in one pipelined fetch
+    db_connector_->hydrate();
+    if (state_digest_) {
+        db_connector_->trackDigest();
+    }
     emit signalRecovery();
+    report.state_load = duration_cast<microseconds>(steady_clock::now() -
+                                                    loading);
+    { // lock, the first FlowMod could have gone already
+        lock_t lock(failover_mutex_);
+        report.complete = failover_.complete;
+        report.first_flow_mod = failover_.first_flow_mod;
+        report.total = report.complete
+            ? failover_.total
+            : report.detection + duration_cast<microseconds>(
+                                     steady_clock::now() - start);
+        failover_ = report;
+    } // unlock
     LOG(WARNING) << "[RecoveryManager] Heartbeat - Service restarted"
-                    " in Primary mode. Recovery is completed";
+                    " in Primary mode. Recovery is completed, detection="
+                 << report.detection.count() / 1000 << " ms, role change="
+                 << report.role_change.count() / 1000 << " ms on "
+                 << report.switches << " switches, state load="
+                 << report.state_load.count() / 1000 << " ms";
+}
+
+void RecoveryManager::flowModSent()
+{
+    if (not awaiting_flow_mod_.load(std::memory_order_relaxed) ||
+            not awaiting_flow_mod_.exchange(false))
+        return;
+
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+    lock_t lock(failover_mutex_);
+    failover_.complete = true;
+    failover_.first_flow_mod = duration_cast<microseconds>(now -
+                                                           failover_start_);
+    failover_.total = failover_.detection + failover_.first_flow_mod;
+    LOG(WARNING) << "[RecoveryManager] First FlowMod "
+                 << failover_.first_flow_mod.count() / 1000
+                 << " ms after the takeover, "
+                 << failover_.total.count() / 1000 << " ms since the "
+                    "primary was heard";
+}
+
+RecoveryManager::FailoverReport RecoveryManager::lastFailover() const
+{
+    lock_t lock(failover_mutex_);
+    return failover_;
 }
 
 void RecoveryManager::backupDead(int backup_id)
@@ -855,6 +1518,9 @@ void RecoveryManager::setupPrimaryMode()
         mastership_view_->setStatus(controller_status_);
         current_node_->setHbStatus(controller_status_);
         sendStartHeartbeat();
+        if (state_digest_) {
+            db_connector_->trackDigest();
+        }
         emit signalSetupPrimaryMode();
     }
 }
@@ -864,6 +1530,14 @@ void RecoveryManager::setupBackupMode(uint64_t dpid_switch_slaved)
     if (+ControllerStatus::BACKUP == controller_status_) {
         return;
     }
+    if (sharded_) {
+        // One switch taken over is a shard handover, not a failover.
+        // Reclaiming it could fight a node with another member set,
+        // the next member change settles the roles.
+        VLOG(3) << "[RecoveryManager] Sharding - Switch dpid="
+                << dpid_switch_slaved << " is now SLAVE";
+        return;
+    }
     controller_status_ = ControllerStatus::BACKUP;
     emit linkBetweenControllersIsDown();
 
@@ -949,6 +1623,45 @@ void RecoveryManager::setParams(const ParamsMessage& p)
     }
 }
 
+void RecoveryManager::stateDigest(const DigestMessage& digest)
+{
+    if (isPrimary() or
+            StateDigest::BUCKETS != size_t(digest.buckets.size())) {
+        return;
+    }
+
+    if (not db_connector_->hasReplica()) {
+        // The first digest, hold the whole state from now on
+        auto read = db_connector_->resync({});
+        VLOG(5) << "[RecoveryManager] State digest - " << read
+                << " partitions read into the replica";
+        last_digest_.assign(digest.buckets.begin(), digest.buckets.end());
+        return;
+    }
+
+    auto local = db_connector_->digest();
+    std::vector<size_t> stale;
+    if (local.root != digest.root) {
+        for (size_t b = 0; b < StateDigest::BUCKETS; ++b) {
+            const uint64_t remote = digest.buckets[int(b)];
+            // A bucket still changing on the primary can't be compared,
+            // the store replication may not have caught up yet
+            if (remote != local.buckets[b] and
+                    b < last_digest_.size() and remote == last_digest_[b]) {
+                stale.push_back(b);
+            }
+        }
+    }
+    last_digest_.assign(digest.buckets.begin(), digest.buckets.end());
+
+    if (not stale.empty()) {
+        auto read = db_connector_->resync(stale);
+        LOG(WARNING) << "[RecoveryManager] State digest - " << stale.size()
+                     << " buckets diverged from the primary, " << read
+                     << " partitions resynced";
+    }
+}
+
 void RecoveryManager::connectionToBackupControllerEstablished(int backup_id)
 {
     LOG(WARNING) << "[RecoveryManager] Heartbeat - Connection to backup "
@@ -981,6 +1694,10 @@ std::shared_ptr<MastershipView> RecoveryManager::mastershipView() const {
     return mastership_view_;
 }
 
+HeartbeatJitter RecoveryManager::heartbeatJitter() const {
+    return heartbeat_core_->jitter();
+}
+
 int RecoveryManager::getID() const {
     return id_;
 }
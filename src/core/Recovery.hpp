@@ -22,10 +22,15 @@
 
 #include "hb/heartbeatcore.hpp"
 #include "lib/poller.hpp"
+#include "lib/shard_ring.hpp"
 
 #include <fluid/ofcommon/openflow-common.hh>
 
+#include <QVector>
+
+#include <atomic>
 #include <chrono>
+#include <functional>
 #include <future>
 #include <memory>
 #include <mutex>
@@ -43,6 +48,7 @@ struct switch_equal_error : exception_root { };
 struct switch_timeout_error : exception_root { };
 
 class SwitchView : public QObject
+                 , public std::enable_shared_from_this<SwitchView>
 {
     Q_OBJECT
 public:
@@ -51,11 +57,27 @@ public:
     SwitchPtr getSwitch() const;
     uint64_t getDPID() const;
     fluid_msg::ofp_controller_role getRole() const;
+    uint64_t getGenerationId() const;
     void changeSwitchRole(fluid_msg::ofp_controller_role role,
                           bool get_only_generation_id = false,
                           int role_request_times = -1);
+    // Non-blocking changeSwitchRole. done(true) is called once the
+    // switch has replied, done(false) on errors; from the reply thread.
+    void requestRole(fluid_msg::ofp_controller_role role,
+                     uint64_t generation_id,
+                     std::function<void(bool)> done,
+                     int role_request_times = -1);
     static std::string convertRole(fluid_msg::ofp_controller_role role);
 
+    // Subscribes to role status messages and errors of the switch
+    void listen();
+    // False until a role reply or a role status is received, and again
+    // after a failed request or a message showing the role has changed
+    bool roleKnown() const;
+    void roleUnknown();
+    void roleStatus(fluid_msg::ofp_controller_role role,
+                    uint64_t generation_id);
+
 signals:
     void roleMasterToSlaveChanged(uint64_t dpid);
 
@@ -64,10 +86,15 @@ private:
                           bool get_only_generation_id = false,
                           int role_request_times = -1);
     ofp::role_config send_role_request(fluid_msg::ofp_controller_role role);
+    // retry is called instead of a blocking re-request on EQUAL replies
     void process_role_reply(fluid_msg::ofp_controller_role role,
                             ofp::role_config&& role_config,
                             bool get_only_generation_id,
-                            int role_request_times = -1);
+                            int role_request_times = -1,
+                            const std::function<void(int)>& retry = nullptr);
+    void on_equal_reply(fluid_msg::ofp_controller_role role, int times,
+                        const std::function<void(int)>& retry);
+    int next_equal_attempt(int times) const;
     void handle_equal_error(fluid_msg::ofp_controller_role role, int times);
     void detach_from_invalid_switch(uint64_t dpid);
 
@@ -75,7 +102,9 @@ private:
     SwitchPtr sw_;
     uint64_t generation_id_ = 0;
     fluid_msg::ofp_controller_role role_ = fluid_msg::OFPCR_ROLE_EQUAL;
+    std::atomic_bool role_known_ {false};
     const RecoveryManager* const recovery_manager_ = nullptr;
+    std::shared_ptr<class RoleListener> role_listener_;
 };
 using SwitchViewPtr = std::shared_ptr<SwitchView>;
 
@@ -84,8 +113,28 @@ class MastershipView : public Polling
 {
     Q_OBJECT
 public:
+    // Outcome of the last MASTER or SLAVE round of setupNewRoleForAll
+    struct RoleChangeReport {
+        fluid_msg::ofp_controller_role role = fluid_msg::OFPCR_ROLE_NOCHANGE;
+        uint64_t generation_id = 0;
+        size_t switches = 0;
+        size_t replied = 0;
+        size_t failed = 0;
+        size_t timed_out = 0;
+        // since the requests were sent, per replied switch
+        std::chrono::microseconds total {0};
+        std::chrono::microseconds p50 {0};
+        std::chrono::microseconds p90 {0};
+        std::chrono::microseconds p99 {0};
+        std::chrono::microseconds max {0};
+    };
+
+    // In passive mode polling sends role requests only to the switches
+    // with unknown role, and to all of them every `refresh_polls` polls
     explicit MastershipView(std::promise<void> init_promise,
-                            int role_monitoring_interval);
+                            int role_monitoring_interval,
+                            bool passive = false,
+                            int refresh_polls = 0);
     ~MastershipView() = default;
 
     ControllerStatus getStatus() const;
@@ -95,10 +144,17 @@ public:
                             int role_monitoring_interval);
     void deleteSwitch(SwitchPtr sw);
     std::vector<SwitchViewPtr> view() const;
+    // Sends the role request to all switches at once and waits for
+    // the replies. MASTER/SLAVE use one generation id for all of them.
     void setupNewRoleForAll(fluid_msg::ofp_controller_role role);
+    // MASTER for the switches `master` selects, then SLAVE for the rest
+    void setupRoles(const std::function<bool(uint64_t)>& master);
+    RoleChangeReport lastRoleChange() const;
 
 private:
     void polling() override;
+    void role_round(fluid_msg::ofp_controller_role role,
+                    std::vector<SwitchViewPtr> switches);
 
 private:
     // Be careful - ctrl_status_ can be undefined.
@@ -109,7 +165,12 @@ private:
 
     bool initialised_ = false;
     mutable std::mutex view_mutex_;
+    RoleChangeReport last_role_change_;
+    mutable std::mutex report_mutex_;
     std::unique_ptr<Poller> role_monitoring_poller_;
+    const bool passive_;
+    const int refresh_polls_;
+    int polls_ = 0;
 };
 
 
@@ -188,11 +249,28 @@ private:
 using ClusterNodePtr = std::shared_ptr<ClusterNode>;
 
 class DpidChecker;
+class ShardHeartbeat;
 class RecoveryManager: public Application, public SwitchEventHandler
 {
     Q_OBJECT
     SIMPLE_APPLICATION(RecoveryManager, "recovery-manager")
 public:
+    // Phases of the last takeover by this node
+    struct FailoverReport {
+        uint64_t failovers = 0;
+        size_t switches = 0;
+        // the first FlowMod has been sent since the takeover
+        bool complete = false;
+        // last request of the failed primary to the start of the takeover,
+        // zero when leaving the recovery mode
+        std::chrono::microseconds detection {0};
+        std::chrono::microseconds role_change {0}; // MASTER on all switches
+        std::chrono::microseconds state_load {0}; // signalRecovery handlers
+        // from the start of the takeover
+        std::chrono::microseconds first_flow_mod {0};
+        std::chrono::microseconds total {0};
+    };
+
     void init(Loader* provider, const Config& rootConfig) override;
     void startUp(Loader* provider) override;
 
@@ -201,8 +279,19 @@ public:
     
     bool isPrimary() const;
     bool isBackup() const;
+    // Active-active mode: every alive node is MASTER for its shard of
+    // switches, isPrimary() only holds on the leader (the lowest id)
+    bool isSharded() const;
+    // Whether this node is the switch MASTER, isPrimary() without sharding
+    bool isMaster(uint64_t dpid) const;
+    int shardOwner(uint64_t dpid) const;
+    std::vector<int> shardMembers() const;
     std::vector<ClusterNodePtr> cluster() const;
     std::shared_ptr<MastershipView> mastershipView() const;
+    HeartbeatJitter heartbeatJitter() const;
+    FailoverReport lastFailover() const;
+    // Send hook of the switch connections, ends the takeover measurement
+    void flowModSent();
     int getID() const;
     DpidChecker* dpidChecker() const;
 
@@ -216,12 +305,16 @@ public slots:
     void setupBackupMode(uint64_t dpid_switch_slaved = DEFAULT_DPID);
     void connectionToBackupControllerEstablished(int backup_id);
     void setParams(const ParamsMessage& params);
+    void setShardMembers(QVector<int> members);
+    void stateDigest(const DigestMessage& digest);
 
 signals:
     void signalRecovery();
     void signalSetupPrimaryMode();
     void signalSetupBackupMode();
     void linkBetweenControllersIsDown();
+    // Sharded mode, after the switch roles follow a new member set
+    void shardsChanged();
 
     void toStartHeartbeatService(CommunicationType type,
                                  ControllerStatus status);
@@ -236,6 +329,7 @@ private:
     void initCurrentNode(const Config& root_config);
     void initHeartbeat(const Config& root_config);
     void initMastership();
+    void initSharding(const Config& root_config);
 
     void sendStartHeartbeat();
     void setInitControllerStatus();
@@ -258,13 +352,29 @@ private:
             CommunicationType::UNDEFINED;
     std::unique_ptr<HeartbeatCore> heartbeat_core_;
     int master_role_monitoring_interval_;
+    bool passive_role_monitoring_ = false;
+    int role_refresh_polls_ = 0;
+    bool state_digest_ = false;
+    // Bucket hashes of the previous primary digest, a bucket is resynced
+    // once it differs from ours twice in a row with the same value
+    std::vector<uint64_t> last_digest_;
     std::string heartbeat_address_;
     int heartbeat_port_;
 
+    bool sharded_ = false;
+    shard_ring shard_ring_;
+    mutable std::mutex shard_mutex_;
+    std::unique_ptr<ShardHeartbeat> shard_heartbeat_;
+
     std::unique_ptr<class RecoveryModeChecker> rm_checker_;
     class DatabaseConnector* db_connector_;
     std::chrono::seconds max_waiting_recovery_interval_;
     DpidChecker* dpid_checker_;
+
+    FailoverReport failover_;
+    std::chrono::steady_clock::time_point failover_start_;
+    std::atomic<bool> awaiting_flow_mod_ {false};
+    mutable std::mutex failover_mutex_;
 };
 
 } // namespace runos
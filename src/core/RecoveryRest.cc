@@ -185,6 +185,146 @@ struct SwitchesViewCollection : rest::resource
     }
 };
 
+struct RoleChangeResource : rest::resource
+{
+    RecoveryManager* app;
+
+    explicit RoleChangeResource(RecoveryManager* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override
+    {
+        auto report = app->mastershipView()->lastRoleChange();
+
+        rest::ptree root;
+        root.put("role", SwitchView::convertRole(report.role));
+        root.put("generation_id", report.generation_id);
+        root.put("switches", report.switches);
+        root.put("replied", report.replied);
+        root.put("failed", report.failed);
+        root.put("timed_out", report.timed_out);
+
+        auto ms = [](std::chrono::microseconds us) {
+            return us.count() / 1000.0;
+        };
+        root.put("total_ms", ms(report.total));
+        root.put("p50_ms", ms(report.p50));
+        root.put("p90_ms", ms(report.p90));
+        root.put("p99_ms", ms(report.p99));
+        root.put("max_ms", ms(report.max));
+        return root;
+    }
+};
+
+struct FailoverResource : rest::resource
+{
+    RecoveryManager* app;
+
+    explicit FailoverResource(RecoveryManager* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override
+    {
+        auto report = app->lastFailover();
+
+        rest::ptree root;
+        root.put("failovers", report.failovers);
+        root.put("switches", report.switches);
+        root.put("complete", report.complete);
+
+        auto ms = [](std::chrono::microseconds us) {
+            return us.count() / 1000.0;
+        };
+        root.put("detection_ms", ms(report.detection));
+        root.put("role_change_ms", ms(report.role_change));
+        root.put("state_load_ms", ms(report.state_load));
+        root.put("first_flow_mod_ms", ms(report.first_flow_mod));
+        root.put("total_ms", ms(report.total));
+        return root;
+    }
+};
+
+struct HeartbeatJitterResource : rest::resource
+{
+    RecoveryManager* app;
+
+    explicit HeartbeatJitterResource(RecoveryManager* app)
+        : app(app)
+    { }
+
+    static rest::ptree histogram(const HeartbeatJitter::Histogram& h)
+    {
+        rest::ptree ret;
+        rest::ptree buckets;
+        for (size_t i = 0; i < h.counts.size(); ++i) {
+            rest::ptree bucket;
+            if (i < HeartbeatJitter::BOUNDS.size()) {
+                bucket.put("le_us", HeartbeatJitter::BOUNDS[i]);
+            } else {
+                bucket.put("le_us", "inf");
+            }
+            bucket.put("count", h.counts[i]);
+            buckets.push_back(std::make_pair("", std::move(bucket)));
+        }
+        ret.add_child("buckets", buckets);
+        ret.put("samples", h.samples);
+        ret.put("mean_us", h.samples ? h.sum_us / int64_t(h.samples) : 0);
+        ret.put("max_us", h.max_us);
+        return ret;
+    }
+
+    rest::ptree Get() const override
+    {
+        auto jitter = app->heartbeatJitter();
+
+        rest::ptree root;
+        root.add_child("send", histogram(jitter.send));
+        root.add_child("arrival", histogram(jitter.arrival));
+        root.add_child("reply", histogram(jitter.reply));
+        return root;
+    }
+};
+
+struct ShardsResource : rest::resource
+{
+    RecoveryManager* app;
+
+    explicit ShardsResource(RecoveryManager* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override
+    {
+        rest::ptree root;
+        root.put("sharded", app->isSharded());
+        if (not app->isSharded()) {
+            return root;
+        }
+
+        rest::ptree members;
+        for (int id : app->shardMembers()) {
+            rest::ptree member;
+            member.put("", id);
+            members.push_back(std::make_pair("", std::move(member)));
+        }
+        root.add_child("members", members);
+        root.put("leader", app->isPrimary());
+
+        rest::ptree owners;
+        for (auto sw : app->mastershipView()->view()) {
+            rest::ptree owner;
+            owner.put("owner", app->shardOwner(sw->getDPID()));
+            owner.put("role", SwitchView::convertRole(sw->getRole()));
+            owners.push_back(std::make_pair(std::to_string(sw->getDPID()),
+                                            std::move(owner)));
+        }
+        root.add_child("switches", owners);
+        return root;
+    }
+};
+
 class RecoveryRest: public Application
 {
     SIMPLE_APPLICATION(RecoveryRest, "recovery-manager-rest")
@@ -212,6 +352,26 @@ public:
         {
             return SwitchesViewCollection {app};
         });
+
+        rest_->mount(path_spec("/recovery/role-change/"), [=](const path_match&)
+        {
+            return RoleChangeResource {app};
+        });
+
+        rest_->mount(path_spec("/recovery/failover/"), [=](const path_match&)
+        {
+            return FailoverResource {app};
+        });
+
+        rest_->mount(path_spec("/recovery/heartbeat/"), [=](const path_match&)
+        {
+            return HeartbeatJitterResource {app};
+        });
+
+        rest_->mount(path_spec("/recovery/shards/"), [=](const path_match&)
+        {
+            return ShardsResource {app};
+        });
     }
 };
 
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "RestListener.hpp"
+#include "SwitchManager.hpp"
+#include "LinkDiscovery.hpp"
+#include "Topology.hpp"
+
+#include <string>
+
+namespace runos {
+
+// Forwards switch, port, link and route trigger changes to the
+// GET /events/ stream of the rest listener. Keys name the object
+// an event is about, so a subscriber lagging behind gets only
+// the latest state of every object.
+class RestEvents : public Application
+{
+    SIMPLE_APPLICATION(RestEvents, "rest-events")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        rest_ = RestListener::get(loader);
+        auto sm = SwitchManager::get(loader);
+        auto ld = dynamic_cast<LinkDiscovery*>(ILinkDiscovery::get(loader));
+        auto topo = Topology::get(loader);
+
+        events_ = sm->events().subscribe("rest-events",
+            [this](const SwitchEventBus::Stamped* events, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    publish(events[i].event);
+                }
+            });
+
+        connect(ld, &LinkDiscovery::linkDiscovered,
+                [this](switch_and_port from, switch_and_port to) {
+            publishLink("link-discovered", from, to);
+        });
+        connect(ld, &LinkDiscovery::linkBroken,
+                [this](switch_and_port from, switch_and_port to) {
+            publishLink("link-broken", from, to);
+        });
+
+        connect(topo, &Topology::routeTriggerActive,
+                [this](uint32_t id, uint8_t path_id, TriggerFlag tf) {
+            publishTrigger("route-trigger-active", id, path_id, tf);
+        });
+        connect(topo, &Topology::routeTriggerInactive,
+                [this](uint32_t id, uint8_t path_id, TriggerFlag tf) {
+            publishTrigger("route-trigger-inactive", id, path_id, tf);
+        });
+    }
+
+private:
+    RestListener* rest_;
+    SwitchEventBus::Subscription events_;
+
+    void publish(const SwitchEvent& ev)
+    {
+        switch (ev.type) {
+        case SwitchEvent::SWITCH_UP:
+            return publishSwitch("switch-up", ev.sw);
+        case SwitchEvent::SWITCH_DOWN:
+            return publishSwitch("switch-down", ev.sw);
+        case SwitchEvent::PORT_ADDED:
+            return publishPort("port-added", ev.port);
+        case SwitchEvent::PORT_DELETED:
+            return publishPort("port-deleted", ev.port);
+        case SwitchEvent::LINK_UP:
+            return publishPort("port-up", ev.port);
+        case SwitchEvent::LINK_DOWN:
+            return publishPort("port-down", ev.port);
+        }
+    }
+
+    void publishSwitch(const std::string& event, SwitchPtr sw)
+    {
+        rest::ptree data;
+        data.put("dpid", sw->dpid());
+        rest_->publish(event, "switch:" + std::to_string(sw->dpid()), data);
+    }
+
+    void publishPort(const std::string& event, PortPtr port)
+    {
+        uint64_t dpid = port->switch_()->dpid();
+        rest::ptree data;
+        data.put("dpid", dpid);
+        data.put("port", port->number());
+        rest_->publish(event, "port:" + std::to_string(dpid) + ":"
+                              + std::to_string(port->number()), data);
+    }
+
+    void publishLink(const std::string& event,
+                     switch_and_port from, switch_and_port to)
+    {
+        rest::ptree data;
+        data.put("source_dpid", from.dpid);
+        data.put("source_port", from.port);
+        data.put("target_dpid", to.dpid);
+        data.put("target_port", to.port);
+        rest_->publish(event,
+            "link:" + std::to_string(from.dpid) + ":" + std::to_string(from.port)
+            + "-" + std::to_string(to.dpid) + ":" + std::to_string(to.port),
+            data);
+    }
+
+    void publishTrigger(const std::string& event, uint32_t id,
+                        uint8_t path_id, TriggerFlag tf)
+    {
+        rest::ptree data;
+        data.put("route", id);
+        data.put("path", unsigned(path_id));
+        data.put("trigger", tf._to_string());
+        rest_->publish(event,
+            "route:" + std::to_string(id) + ":" + std::to_string(path_id)
+            + ":" + tf._to_string(), data);
+    }
+};
+
+REGISTER_APPLICATION(RestEvents, {"rest-listener", "switch-manager",
+                                  "link-discovery", "topology", ""})
+
+} // namespace runos
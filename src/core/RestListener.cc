@@ -15,6 +15,11 @@
  */
 
 #include "RestListener.hpp"
+#include "lib/content_coding.hpp"
+#include "lib/json_encoding.hpp"
+#include "lib/metrics.hpp"
+#include "lib/sampling_profiler.hpp"
+#include "lib/thread_placement.hpp"
 
 // Workaround hack to fix incompatibility between BOOST_FOREACH and Qt
 #ifdef foreach
@@ -25,15 +30,28 @@
 #include <runos/core/catch_all.hpp>
 
 #include <boost/network/include/http/server.hpp>
+#include <boost/network/utils/thread_pool.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/network/uri.hpp>
 #include <boost/range/algorithm.hpp>
 #include <boost/algorithm/string/compare.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <sstream>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
 #include <iterator> // back_inseter
+#include <list>
+#include <algorithm>
 #include <functional> // bind
 
 namespace runos {
@@ -48,6 +66,258 @@ namespace rest {
         virtual void dispatch(const std::string& path,
                               resource_continuation c) = 0;
     };
+
+    path_match::path_match(const std::smatch& m)
+    {
+        for (auto& sub : m) {
+            subs_.push_back({sub.matched, sub.str(), std::nullopt});
+        }
+    }
+
+    const path_match::sub_match& path_match::operator[](size_t i) const
+    {
+        static const sub_match unmatched;
+        return i < subs_.size() ? subs_[i] : unmatched;
+    }
+
+    // Routes a path by its '/'-separated segments. Literal segments are
+    // looked up in a hash, (\d+) segments take the numeric edge; specs
+    // with anything else are kept as regexes on the node of their
+    // longest routable prefix and only tried when that node is reached.
+    // The earliest mounted matching spec wins, as with linear matching.
+    class route_trie {
+    public:
+        static constexpr size_t npos = size_t(-1);
+
+        struct result {
+            size_t id = npos;
+            path_match match;
+        };
+
+        void insert(const path_spec& spec, size_t id)
+        {
+            size_t n = 0;
+            std::string_view rest = spec.pattern;
+
+            if (rest.empty() || rest[0] != '/' || top_level_alternation(rest)) {
+                nodes_[0].regexes.push_back({id, &spec.regex});
+                return;
+            }
+            rest.remove_prefix(1);
+
+            while (not rest.empty()) {
+                size_t slash = top_level_slash(rest);
+                if (slash == std::string_view::npos ||
+                    (slash + 1 < rest.size() && is_quantifier(rest[slash + 1])))
+                    break;
+
+                std::string_view segment = rest.substr(0, slash);
+                if (is_literal(segment)) {
+                    n = literal_child(n, segment);
+                } else if (segment == "(\\d+)") {
+                    n = numeric_child(n);
+                } else {
+                    break;
+                }
+                rest.remove_prefix(slash + 1);
+            }
+
+            if (rest.empty()) {
+                nodes_[n].routes.push_back(id);
+            } else {
+                nodes_[n].regexes.push_back({id, &spec.regex});
+            }
+        }
+
+        result find(const std::string& path) const
+        {
+            // Complete segments, each followed by '/', and what is left
+            std::vector<std::string_view> segments;
+            std::string_view tail = path;
+            if (not tail.empty() && tail[0] == '/') {
+                tail.remove_prefix(1);
+                for (size_t slash; (slash = tail.find('/')) != tail.npos; ) {
+                    segments.push_back(tail.substr(0, slash));
+                    tail.remove_prefix(slash + 1);
+                }
+            }
+
+            result ret;
+            std::vector<std::string_view> captures;
+            walk(0, 0, path, segments, tail.empty(), captures, ret);
+            return ret;
+        }
+
+    private:
+        struct regex_route {
+            size_t id;
+            const std::regex* regex;
+        };
+
+        struct node {
+            std::unordered_map<std::string, size_t> literal;
+            size_t numeric = npos;
+            std::vector<size_t> routes;
+            std::vector<regex_route> regexes;
+        };
+
+        std::vector<node> nodes_{ 1 };
+
+        void walk(size_t n, size_t depth, const std::string& path,
+                  const std::vector<std::string_view>& segments,
+                  bool complete,
+                  std::vector<std::string_view>& captures,
+                  result& best) const
+        {
+            auto& node = nodes_[n];
+
+            for (auto& r : node.regexes) {
+                if (r.id >= best.id)
+                    break;
+                std::smatch m;
+                if (std::regex_match(path, m, *r.regex)) {
+                    best.id = r.id;
+                    best.match = path_match(m);
+                    break;
+                }
+            }
+
+            if (depth == segments.size()) {
+                if (complete && not node.routes.empty() &&
+                    node.routes.front() < best.id)
+                {
+                    best.id = node.routes.front();
+                    best.match = path_match();
+                    best.match.push_back({true, path, std::nullopt});
+                    for (auto& capture : captures)
+                        best.match.push_back(numeric_capture(capture));
+                }
+                return;
+            }
+
+            auto segment = segments[depth];
+            auto it = node.literal.find(std::string(segment));
+            if (it != node.literal.end())
+                walk(it->second, depth + 1, path, segments, complete,
+                     captures, best);
+
+            if (node.numeric != npos && is_number(segment)) {
+                captures.push_back(segment);
+                walk(node.numeric, depth + 1, path, segments, complete,
+                     captures, best);
+                captures.pop_back();
+            }
+        }
+
+        static path_match::sub_match numeric_capture(std::string_view s)
+        {
+            path_match::sub_match ret{true, std::string(s), std::nullopt};
+            uint64_t value = 0;
+            for (char c : s) {
+                unsigned digit = c - '0';
+                if (value > (std::numeric_limits<uint64_t>::max() - digit) / 10)
+                    return ret;
+                value = value * 10 + digit;
+            }
+            ret.number = value;
+            return ret;
+        }
+
+        static bool is_number(std::string_view s)
+        {
+            if (s.empty())
+                return false;
+            for (char c : s) {
+                if (c < '0' || c > '9')
+                    return false;
+            }
+            return true;
+        }
+
+        static bool is_quantifier(char c)
+        {
+            return c == '?' || c == '*' || c == '+' || c == '{';
+        }
+
+        static bool is_literal(std::string_view segment)
+        {
+            if (segment.empty())
+                return false;
+            for (char c : segment) {
+                if (not std::isalnum((unsigned char) c) && c != '-' && c != '_')
+                    return false;
+            }
+            return true;
+        }
+
+        // Position of the first '/' outside of groups and brackets
+        static size_t top_level_slash(std::string_view s)
+        {
+            int depth = 0;
+            bool bracket = false;
+            for (size_t i = 0; i < s.size(); ++i) {
+                char c = s[i];
+                if (c == '\\') {
+                    ++i;
+                } else if (bracket) {
+                    bracket = c != ']';
+                } else if (c == '[') {
+                    bracket = true;
+                } else if (c == '(') {
+                    ++depth;
+                } else if (c == ')') {
+                    --depth;
+                } else if (c == '/' && depth == 0) {
+                    return i;
+                }
+            }
+            return std::string_view::npos;
+        }
+
+        static bool top_level_alternation(std::string_view s)
+        {
+            int depth = 0;
+            bool bracket = false;
+            for (size_t i = 0; i < s.size(); ++i) {
+                char c = s[i];
+                if (c == '\\') {
+                    ++i;
+                } else if (bracket) {
+                    bracket = c != ']';
+                } else if (c == '[') {
+                    bracket = true;
+                } else if (c == '(') {
+                    ++depth;
+                } else if (c == ')') {
+                    --depth;
+                } else if (c == '|' && depth == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        size_t literal_child(size_t n, std::string_view segment)
+        {
+            auto it = nodes_[n].literal.find(std::string(segment));
+            if (it != nodes_[n].literal.end())
+                return it->second;
+            size_t child = nodes_.size();
+            nodes_[n].literal.emplace(std::string(segment), child);
+            nodes_.emplace_back();
+            return child;
+        }
+
+        size_t numeric_child(size_t n)
+        {
+            if (nodes_[n].numeric != npos)
+                return nodes_[n].numeric;
+            size_t child = nodes_.size();
+            nodes_[n].numeric = child;
+            nodes_.emplace_back();
+            return child;
+        }
+    };
 }
 
 namespace raw {
@@ -156,9 +426,166 @@ typedef http::server<struct RestHandler>
     rest_server;
 
 using boost::property_tree::json_parser::read_json;
-using boost::property_tree::json_parser::write_json;
 using boost::property_tree::json_parser::json_parser_error;
 
+// Server-sent event subscribers. Every subscriber has its own queue,
+// written out by one outstanding write at a time, so a slow reader only
+// grows its own queue. Queued events with the same key are coalesced,
+// and an overflowing queue is replaced by a single "overflow" event
+// telling the client to reload the state it follows.
+class event_hub {
+public:
+    typedef rest_server::connection connection;
+    typedef rest_server::connection_ptr connection_ptr;
+
+    void set_queue_limit(size_t limit)
+    { limit_ = std::max<size_t>(limit, 1); }
+
+    void subscribe(connection_ptr connection)
+    {
+        auto sub = std::make_shared<subscriber>();
+        sub->connection = connection;
+
+        connection->set_status(connection::ok);
+        connection->set_headers(std::vector<rest_server::response_header>{
+            {"Content-Type", "text/event-stream"},
+            {"Cache-Control", "no-cache"}
+        });
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            subscribers_.push_back(sub);
+        }
+        enqueue(sub, std::string(), ": subscribed\n\n");
+    }
+
+    void publish(const std::string& event, const std::string& key,
+                 const rest::ptree& data)
+    {
+        std::vector<std::shared_ptr<subscriber>> subscribers;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (subscribers_.empty())
+                return;
+            subscribers = subscribers_;
+        }
+
+        json_writer json;
+        json.value(data);
+        std::string text = "event: " + event + "\ndata: ";
+        for (auto& chunk : json.release())
+            text += chunk;
+        text += "\n\n";
+
+        for (auto& sub : subscribers)
+            enqueue(sub, key, text);
+    }
+
+    size_t subscribers() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return subscribers_.size();
+    }
+
+private:
+    struct pending {
+        std::string key;
+        std::string text;
+    };
+
+    struct subscriber {
+        connection_ptr connection;
+        std::mutex mutex;
+        std::list<pending> queue;
+        std::unordered_map<std::string, std::list<pending>::iterator> by_key;
+        bool writing = false;
+        bool closed = false;
+    };
+
+    size_t limit_ = 1024;
+    mutable std::mutex mutex_;
+    std::vector<std::shared_ptr<subscriber>> subscribers_;
+
+    void enqueue(std::shared_ptr<subscriber> sub, const std::string& key,
+                 const std::string& text)
+    {
+        std::unique_lock<std::mutex> lock(sub->mutex);
+        if (sub->closed)
+            return;
+
+        auto it = key.empty() ? sub->by_key.end() : sub->by_key.find(key);
+        if (it != sub->by_key.end()) {
+            it->second->text = text;
+        } else if (sub->queue.size() >= limit_) {
+            sub->queue.clear();
+            sub->by_key.clear();
+            push(*sub, "overflow", "event: overflow\ndata: {}\n\n");
+        } else {
+            push(*sub, key, text);
+        }
+
+        if (not sub->writing)
+            flush(std::move(sub), lock);
+    }
+
+    static void push(subscriber& sub, const std::string& key,
+                     const std::string& text)
+    {
+        sub.queue.push_back({key, text});
+        if (not key.empty())
+            sub.by_key[key] = std::prev(sub.queue.end());
+    }
+
+    // Writes everything queued as one chunk, continues on completion
+    void flush(std::shared_ptr<subscriber> sub,
+               std::unique_lock<std::mutex>& lock)
+    {
+        if (sub->queue.empty()) {
+            sub->writing = false;
+            return;
+        }
+
+        std::string batch;
+        for (auto& p : sub->queue)
+            batch += p.text;
+        sub->queue.clear();
+        sub->by_key.clear();
+        sub->writing = true;
+
+        auto connection = sub->connection;
+        lock.unlock();
+        try {
+            connection->write(batch,
+                [this, sub](boost::system::error_code const& ec) {
+                    std::unique_lock<std::mutex> lock(sub->mutex);
+                    if (ec) {
+                        close(sub, lock);
+                        return;
+                    }
+                    flush(sub, lock);
+                });
+        } catch (...) {
+            lock.lock();
+            close(sub, lock);
+        }
+    }
+
+    void close(const std::shared_ptr<subscriber>& sub,
+               std::unique_lock<std::mutex>& lock)
+    {
+        sub->closed = true;
+        sub->writing = false;
+        sub->queue.clear();
+        sub->by_key.clear();
+        lock.unlock();
+
+        std::lock_guard<std::mutex> hub_lock(mutex_);
+        subscribers_.erase(std::remove(subscribers_.begin(),
+                                       subscribers_.end(), sub),
+                           subscribers_.end());
+    }
+};
+
 struct RestHandler {
     typedef rest_server::request request;
     typedef rest_server::connection connection;
@@ -169,6 +596,48 @@ struct RestHandler {
         : dispatcher_(dispatcher)
     { }
 
+    // Bounds the number of requests served at once on matching paths
+    struct concurrency_limit {
+        std::regex path;
+        size_t max;
+        std::atomic<size_t> active{0};
+
+        concurrency_limit(std::regex path, size_t max)
+            : path(std::move(path)), max(max)
+        { }
+    };
+
+    struct limit_guard {
+        concurrency_limit* limit = nullptr;
+
+        ~limit_guard()
+        {
+            if (limit)
+                --limit->active;
+        }
+    };
+
+    void add_limit(std::regex path, size_t max)
+    {
+        limits_.push_back(
+            std::make_unique<concurrency_limit>(std::move(path), max));
+    }
+
+    void acquire(const std::string& path, limit_guard& guard)
+    {
+        for (auto& limit : limits_) {
+            if (not std::regex_match(path, limit->path))
+                continue;
+
+            if (++limit->active > limit->max) {
+                --limit->active;
+                THROW(rest::http_error(503), "Too many concurrent requests");
+            }
+            guard.limit = limit.get();
+            return;
+        }
+    }
+
     size_t get_content_length(request const& req)
     {
         auto content_len_it = boost::find_if(req.headers,
@@ -201,6 +670,84 @@ struct RestHandler {
         return url.path();
     }
 
+    std::string query(request const& req)
+    {
+        auto url_str = std::string("http://localhost") + req.destination;
+        boost::network::uri::uri url(url_str);
+        return url.query();
+    }
+
+    // Percent-decoded value of `name` in the query string
+    std::optional<std::string> query_value(request const& req,
+                                           const std::string& name)
+    {
+        std::istringstream params(query(req));
+        std::string param;
+        while (std::getline(params, param, '&')) {
+            auto eq = param.find('=');
+            if (param.compare(0, eq, name) != 0 || eq != name.size())
+                continue;
+
+            std::string ret;
+            for (size_t i = eq + 1; i < param.size(); ++i) {
+                if (param[i] == '+') {
+                    ret += ' ';
+                } else if (param[i] == '%' && i + 2 < param.size() &&
+                           std::isxdigit(param[i + 1]) &&
+                           std::isxdigit(param[i + 2])) {
+                    ret += char(std::stoi(param.substr(i + 1, 2), nullptr, 16));
+                    i += 2;
+                } else {
+                    ret += param[i];
+                }
+            }
+            return ret;
+        }
+        return std::nullopt;
+    }
+
+    // Value of `name` in the query string, `def` if absent
+    unsigned query_param(request const& req, const std::string& name,
+                         unsigned def)
+    {
+        auto value = query_value(req, name);
+        if (not value)
+            return def;
+        try {
+            return boost::lexical_cast<unsigned>(*value);
+        } catch (const boost::bad_lexical_cast&) {
+            THROW(rest::http_error(400), "Bad {}: {}", name, *value);
+        }
+    }
+
+    // Blocks this worker for the whole run
+    void profile(request const& req, connection_ptr connection)
+    {
+        THROW_IF(not profiler_enabled, rest::http_error(404),
+                 "Profiler is disabled");
+
+        auto seconds = query_param(req, "seconds", 30);
+        auto hz = query_param(req, "hz", 99);
+        THROW_IF(seconds == 0 || seconds > max_profile_seconds,
+                 rest::http_error(400), "seconds must be in 1..{}",
+                 max_profile_seconds);
+        THROW_IF(hz == 0 || hz > 1000, rest::http_error(400),
+                 "hz must be in 1..1000");
+
+        LOG(INFO) << "Profiling for " << seconds << "s at " << hz << " Hz";
+        SamplingProfiler::Profile result;
+        try {
+            result = SamplingProfiler::run(std::chrono::seconds(seconds), hz);
+        } catch (const SamplingProfiler::busy&) {
+            THROW(rest::http_error(409), "Profile is already running");
+        }
+        LOG(INFO) << "Profile done: " << result.samples << " samples, "
+                  << result.dropped << " dropped, "
+                  << result.stacks.size() << " distinct stacks";
+
+        respond_text(req, connection, result.collapsed(), "text/plain");
+    }
+
     void dispatch(std::string path, rest::resource_continuation c)
     {
         dispatcher_.dispatch(path, c);
@@ -291,9 +838,14 @@ struct RestHandler {
     }
     EXCEPTION_GUARD_END
 
+    // Runs on the worker pool, so handlers may block on futures
+    // without stalling the I/O threads or other clients
     void request_ready(request const& req, connection_ptr connection)
     EXCEPTION_GUARD(req, connection)
     {
+        limit_guard guard;
+        acquire(path(req), guard);
+
         if (req.method == "HEAD") {
             bool found;
             dispatch(path(req), [&](rest::resource& r) {
@@ -303,20 +855,97 @@ struct RestHandler {
             respond( req, connection, rest::ptree(), found ?
                      connection::ok
                    : connection::not_found );
+        } else if (req.method == "GET" && path(req) == events_path) {
+            events.subscribe(connection);
+        } else if (req.method == "GET" && path(req) == profile_path) {
+            profile(req, connection);
+        } else if (req.method == "GET" && path(req) == metrics_path) {
+            respond_text(req, connection,
+                         metrics::Registry::global().prometheus(),
+                         "text/plain; version=0.0.4");
         } else if (req.method == "GET") {
-            rest::ptree resp;
+            // ?fields= is applied while writing, ?limit= and ?cursor=
+            // are up to the paged collections
+            json_writer::projection fields(
+                query_value(req, "fields").value_or(std::string()));
+            rest::page page;
+            page.limit = query_param(req, "limit", 0);
+            page.cursor = query_value(req, "cursor").value_or(std::string());
+
+            auto repr = negotiate(req);
+
+            json_writer resp;
+            resp.project(&fields);
             raw::RawPathExtractor path_parser(path(req));
+            std::optional<reply> cached;
+            std::string etag;
+
+            // Every query is a different body of the same generation
+            std::string variant = path_parser.path();
+            if (not fields.empty() || not page.empty())
+                variant += '?' + query(req);
 
             dispatch(path_parser.path(), [&](rest::resource& r) {
-                resp = r.Get();
-                if (path_parser.isRaw()) {
-                    auto raw_path = path_parser.rawPath();
-                    raw::GetResponseExtractor extractor(resp);
-                    resp = extractor.extract(raw_path);
+                if (not path_parser.isRaw()) {
+                    uint64_t generation = r.Generation();
+                    if (generation == 0) {
+                        r.Page(resp, page);
+                        return;
+                    }
+
+                    etag = '"' + std::to_string(boot_id_) + '-' +
+                           std::to_string(generation);
+                    if (variant != path_parser.path())
+                        etag += '-' + std::to_string(
+                            std::hash<std::string>{}(variant));
+                    etag += repr.suffix() + '"';
+                    if (header(req, "if-none-match") == etag) {
+                        cached = reply{};
+                        return;
+                    }
+                    // The JSON text is kept next to every encoding of it,
+                    // so each one is serialized and compressed only once
+                    cached = lookup(variant + repr.suffix(), generation);
+                    if (cached)
+                        return;
+                    auto text = lookup(variant, generation);
+                    if (not text) {
+                        // Generation is read first, a concurrent change
+                        // makes this entry stale rather than wrong
+                        r.Page(resp, page);
+                        text = store(variant, generation,
+                                     seal(std::move(resp)));
+                    }
+                    cached = repr.plain()
+                           ? *text
+                           : store(variant + repr.suffix(), generation,
+                                   encode(*text, repr));
+                    return;
                 }
+
+                // Raw paths address single values, read the document back
+                json_writer full;
+                r.Page(full, page);
+                std::string text;
+                for (auto& chunk : full.release())
+                    text += chunk;
+                std::istringstream text_stream(text);
+                rest::ptree tree;
+                read_json(text_stream, tree);
+
+                raw::GetResponseExtractor extractor(tree);
+                resp.value(extractor.extract(path_parser.rawPath()));
             });
 
-            respond(req, connection, resp);
+            if (cached && not cached->chunks) {
+                respond(req, connection, std::move(*cached),
+                        connection::not_modified, etag);
+            } else if (cached) {
+                respond(req, connection, std::move(*cached), connection::ok,
+                        etag);
+            } else {
+                respond(req, connection, std::move(resp));
+            }
         } else if (req.method == "PUT" || req.method == "POST") {
             bool post = req.method == "POST";
 
@@ -343,36 +972,187 @@ struct RestHandler {
     }
     EXCEPTION_GUARD_END
 
+    // Serialized body ready to be sent, possibly more than once
+    struct reply {
+        std::shared_ptr<const json_writer::chunk_list> chunks;
+        size_t size = 0;
+        bool collection = false;
+        // Set by encode(), JSON text with the collection-based
+        // Content-Type otherwise
+        bool encoded = false;
+        const char* content_type = nullptr;
+        const char* content_encoding = nullptr;
+    };
+
+    // Body format from Accept, content coding from Accept-Encoding
+    struct representation {
+        json_encoding format = json_encoding::text;
+        content_coding coding = content_coding::identity;
+
+        bool plain() const
+        {
+            return format == json_encoding::text &&
+                   coding == content_coding::identity;
+        }
+
+        // Tells the cache entries and ETags of representations apart
+        std::string suffix() const
+        {
+            std::string ret;
+            if (format == json_encoding::cbor)
+                ret += "-cbor";
+            else if (format == json_encoding::msgpack)
+                ret += "-msgpack";
+            if (coding != content_coding::identity)
+                ret += std::string("-") + coding_name(coding);
+            return ret;
+        }
+    };
+
+    static representation negotiate(request const& req)
+    {
+        representation ret;
+        ret.coding = negotiate_coding(header(req, "accept-encoding"));
+
+        auto accept = header(req, "accept");
+        if (accept.empty())
+            return ret;
+        double json = std::max({
+            accept_quality(accept, "application/json", "*/*"),
+            accept_quality(accept, "application/x-collection+json", ""),
+            accept_quality(accept, "application/x-resource+json", "")
+        });
+        double cbor = accept_quality(accept, "application/cbor", "");
+        double msgpack = std::max({
+            accept_quality(accept, "application/msgpack", ""),
+            accept_quality(accept, "application/x-msgpack", ""),
+            accept_quality(accept, "application/vnd.msgpack", "")
+        });
+        // JSON wins ties, binary formats are only sent when preferred
+        if (cbor > json && cbor >= msgpack)
+            ret.format = json_encoding::cbor;
+        else if (msgpack > json)
+            ret.format = json_encoding::msgpack;
+        return ret;
+    }
+
+    // Same values in another representation; bodies below
+    // compress_min_bytes are not worth compressing
+    reply encode(reply body, const representation& repr) const
+    {
+        body.encoded = true;
+        if (not body.chunks || body.size == 0)
+            return body;
+
+        if (repr.format != json_encoding::text) {
+            std::string text;
+            text.reserve(body.size);
+            for (auto& chunk : *body.chunks)
+                text += chunk;
+            auto binary = encode_json(text, repr.format);
+            body.size = binary.size();
+            body.chunks = std::make_shared<const json_writer::chunk_list>(
+                json_writer::chunk_list{std::move(binary)});
+            body.content_type = repr.format == json_encoding::cbor
+                              ? "application/cbor" : "application/msgpack";
+        }
+
+        if (repr.coding != content_coding::identity &&
+            body.size >= compress_min_bytes) {
+            int level = repr.coding == content_coding::zstd
+                      ? zstd_level : gzip_level;
+            auto packed = compress(repr.coding, *body.chunks, level,
+                                   json_writer::default_chunk_size);
+            body.size = 0;
+            for (auto& chunk : packed)
+                body.size += chunk.size();
+            body.chunks = std::make_shared<const json_writer::chunk_list>(
+                std::move(packed));
+            body.content_encoding = coding_name(repr.coding);
+        }
+        return body;
+    }
+
+    static reply seal(json_writer&& body)
+    {
+        reply ret;
+        ret.size = body.size();
+        ret.collection = body.collection();
+        ret.chunks = std::make_shared<const json_writer::chunk_list>(
+            body.release());
+        return ret;
+    }
+
+    std::optional<reply> lookup(const std::string& path, uint64_t generation)
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        auto it = cache_.find(path);
+        if (it == cache_.end() || it->second.first != generation)
+            return std::nullopt;
+        return it->second.second;
+    }
+
+    reply store(const std::string& path, uint64_t generation, reply body)
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        if (cache_.size() >= cache_limit && cache_.count(path) == 0)
+            cache_.clear();
+        cache_[path] = {generation, body};
+        return body;
+    }
+
+    static std::string header(request const& req, const char* name)
+    {
+        auto it = boost::find_if(req.headers,
+                [name](request::header_type const& h) {
+                    return boost::iequals(h.name, name);
+                });
+        return it != req.headers.end() ? it->value : std::string();
+    }
+
     void respond(
-        request const&
+        request const& req
       , connection_ptr connection
-      , const rest::ptree body
+      , const rest::ptree& body
       , connection::status_t status = connection::ok
-    ) try {
-        std::string resp_str;
+    ) {
+        json_writer out;
+        out.value(body);
+        respond(req, connection, seal(std::move(out)), status);
+    }
 
-        try {
-            std::ostringstream ss;
-            write_json(ss, body);
-            resp_str = ss.str();
-            connection->set_status(status);
-        } catch (json_parser_error& e) {
-            std::ostringstream ss;
-            ss << R"({ "error": {)"
-                  R"(  "type": "write_json_error",)"
-                  R"(  "msg": )" << '"' << e.what() << '"' << "} }";
-            resp_str = ss.str();
-            connection->set_status(connection::internal_server_error);
-        }
+    void respond(
+        request const& req
+      , connection_ptr connection
+      , json_writer&& body
+      , connection::status_t status = connection::ok
+    ) {
+        respond(req, connection, seal(std::move(body)), status);
+    }
+
+    void respond(
+        request const& req
+      , connection_ptr connection
+      , reply body
+      , connection::status_t status
+      , const std::string& etag = std::string()
+    ) try {
+        if (not body.encoded)
+            body = encode(std::move(body), negotiate(req));
 
         std::vector<rest_server::response_header>
             headers;
 
-        headers.push_back({"Content-Length", std::to_string(resp_str.size())});
+        headers.push_back({"Content-Length", std::to_string(body.size)});
+        headers.push_back({"Vary", "Accept, Accept-Encoding"});
 
-        if (body.find("array") != body.not_found() &&
-            body.find("_size") != body.not_found())
-        {
+        if (body.content_encoding) {
+            headers.push_back({"Content-Encoding", body.content_encoding});
+        }
+
+        if (body.content_type) {
+            headers.push_back({"Content-Type", body.content_type});
+        } else if (body.collection) {
             headers.push_back(
                     {"Content-Type", "application/x-collection+json"});
         } else {
@@ -380,8 +1160,17 @@ struct RestHandler {
                     {"Content-Type", "application/x-resource+json"});
         }
 
+        if (not etag.empty()) {
+            headers.push_back({"ETag", etag});
+        }
+
+        if (not body.chunks) {
+            body.chunks = std::make_shared<const json_writer::chunk_list>();
+        }
+
+        connection->set_status(status);
         connection->set_headers(headers);
-        connection->write( std::move(resp_str) );
+        write_chunks(connection, std::move(body.chunks), 0);
 
     } catch (boost::system::system_error const& e) {
         LOG(ERROR) << "Rest handler failed: " << e.what();
@@ -389,13 +1178,94 @@ struct RestHandler {
         LOG(ERROR) << "Rest handler failed";
     }
 
+    // Plain text reply, for clients which don't speak JSON
+    void respond_text(request const& req, connection_ptr connection,
+                      std::string text, const char* content_type)
+    try {
+        std::vector<rest_server::response_header> headers {
+            {"Content-Type", content_type},
+            {"Vary", "Accept-Encoding"}
+        };
+
+        // Scrapes of /metrics are big and frequent
+        auto coding = negotiate_coding(header(req, "accept-encoding"));
+        if (coding != content_coding::identity &&
+            text.size() >= compress_min_bytes) {
+            int level = coding == content_coding::zstd
+                      ? zstd_level : gzip_level;
+            json_writer::chunk_list chunks;
+            chunks.push_back(std::move(text));
+            auto packed = compress(coding, chunks, level,
+                                   json_writer::default_chunk_size);
+            text.clear();
+            for (auto& chunk : packed)
+                text += chunk;
+            headers.push_back({"Content-Encoding", coding_name(coding)});
+        }
+
+        headers.push_back({"Content-Length", std::to_string(text.size())});
+        connection->set_status(connection::ok);
+        connection->set_headers(headers);
+        connection->write(text);
+    } catch (boost::system::system_error const& e) {
+        LOG(ERROR) << "Rest handler failed: " << e.what();
+    }
+
+    // Sends chunks one after another, the next one when the previous
+    // is on the wire, so the reply is never copied into one string
+    static void write_chunks(connection_ptr connection,
+                             std::shared_ptr<const json_writer::chunk_list> chunks,
+                             size_t i)
+    {
+        if (chunks->empty()) {
+            connection->write(std::string());
+            return;
+        }
+        if (i >= chunks->size())
+            return;
+
+        if (i + 1 == chunks->size()) {
+            connection->write((*chunks)[i]);
+            return;
+        }
+
+        connection->write((*chunks)[i],
+            [connection, chunks, i](boost::system::error_code const& ec) {
+                if (ec) {
+                    LOG(ERROR) << "Rest handler failed: " << ec.message();
+                    return;
+                }
+                write_chunks(connection, chunks, i + 1);
+            });
+    }
+
     void error(boost::system::error_code const& ec)
     {
         LOG(ERROR) << "Rest error: " << ec.message();
     }
 
+    static constexpr auto events_path = "/events/";
+    static constexpr auto metrics_path = "/metrics";
+    static constexpr auto profile_path = "/debug/profile";
+    static constexpr unsigned max_profile_seconds = 300;
+    bool profiler_enabled = false;
+    size_t compress_min_bytes = 1024;
+    int gzip_level = 6;
+    int zstd_level = 3;
+    event_hub events;
+
 protected:
     rest::resource_dispatcher& dispatcher_;
+    std::vector<std::unique_ptr<concurrency_limit>> limits_;
+
+    // Bodies of versioned resources by path
+    static constexpr size_t cache_limit = 256;
+    std::mutex cache_mutex_;
+    std::unordered_map<std::string, std::pair<uint64_t, reply>> cache_;
+    // Keeps ETags from matching between controller runs
+    const uint64_t boot_id_ = std::chrono::duration_cast<
+        std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
 
 #undef EXCEPTION_GUARD_END
 #undef EXCEPTION_GUARD
@@ -404,8 +1274,11 @@ protected:
 struct RestListener::implementation final
     : rest::resource_dispatcher
 {
-    std::vector< std::pair<rest::path_spec, rest::resource_mapper> >
+    // Specs are referenced by the trie, so they must not move
+    std::deque< std::pair<rest::path_spec, rest::resource_mapper> >
         mounts;
+    rest::route_trie routes;
+    std::mutex mount_mutex;
 
     void mount(const rest::path_spec& pathspec, rest::resource_mapper mapper)
         override;
@@ -415,6 +1288,7 @@ struct RestListener::implementation final
 
     RestHandler handler{ *this };
     std::unique_ptr< rest_server > server;
+    size_t io_threads;
 };
 
 RestListener::RestListener()
@@ -426,38 +1300,78 @@ RestListener::~RestListener() noexcept = default;
 void RestListener::implementation::mount(
     const rest::path_spec& pathspec, rest::resource_mapper mapper
 ) {
+    // Applications may be initialized concurrently
+    std::lock_guard<std::mutex> lock(mount_mutex);
     mounts.emplace_back(pathspec, mapper);
+    routes.insert(mounts.back().first, mounts.size() - 1);
 }
 
 void RestListener::implementation::dispatch
     (const std::string& path, rest::resource_continuation c)
 {
-    rest::path_match match;
-
-    for (auto& mount : mounts) {
-        if (std::regex_match(path, match, mount.first)) {
-            mount.second(match, c);
-            return;
-        }
-    }
+    auto route = routes.find(path);
 
-    THROW(rest::http_error(404), "No route matched");
+    THROW_IF(route.id == rest::route_trie::npos, rest::http_error(404),
+             "No route matched");
+    mounts[route.id].second(route.match, c);
 }
 
 void RestListener::init(Loader*, const Config& rootConfig)
 {
     auto config = config_cd(rootConfig, "rest-listener");
 
+    impl->io_threads = std::max(config_get(config, "threads", 1), 1);
+    impl->handler.events.set_queue_limit(
+        std::max(config_get(config, "event-queue-limit", 1024), 1));
+    size_t workers = std::max(config_get(config, "workers", 4), 1);
+    impl->handler.profiler_enabled = config_get(config, "profiler", false);
+    impl->handler.compress_min_bytes =
+        std::max(config_get(config, "compress-min-bytes", 1024), 0);
+    impl->handler.gzip_level = config_get(config, "gzip-level", 6);
+    impl->handler.zstd_level = config_get(config, "zstd-level", 3);
+
+    auto limits = config.find("concurrency-limits");
+    if (limits != config.end()) {
+        for (auto& limit : limits->second.object_items()) {
+            try {
+                impl->handler.add_limit(std::regex(limit.first),
+                                        std::max(limit.second.int_value(), 1));
+            } catch (const std::regex_error& e) {
+                LOG(ERROR) << "Bad concurrency limit path " << limit.first
+                           << ": " << e.what();
+            }
+        }
+    }
+
+    // Handler workers are started right away and can't be placed later
+    ThreadPlacement::Inherit placement {"rest"};
     rest_server::options options(impl->handler);
     options.address(config_get(config, "address", "127.0.0.1"))
-           .port(config_get(config, "port", "8000"));
+           .port(config_get(config, "port", "8000"))
+           .thread_pool(std::make_shared<boost::network::utils::thread_pool>(
+                            workers));
 
     impl->server.reset(new rest_server(options));
 }
 
 void RestListener::startUp(Loader*)
 {
-    std::thread{[this]{impl->server->run();}}.detach();
+    for (size_t i = 0; i < impl->io_threads; ++i)
+        std::thread{[this]{
+            ThreadPlacement::global().place("rest", "rest-listener");
+            impl->server->run();
+        }}.detach();
+}
+
+void RestListener::publish(const std::string& event, const std::string& key,
+                           const rest::ptree& data)
+{
+    impl->handler.events.publish(event, key, data);
+}
+
+void RestListener::render(const std::string& path, json_writer& out)
+{
+    impl->dispatch(path, [&](rest::resource& r) { r.Stream(out); });
 }
 
 void RestListener::mount_impl(const rest::path_spec& pathspec,
@@ -22,13 +22,18 @@
 
 #include "Application.hpp"
 #include "Loader.hpp"
+#include "lib/generation.hpp"
+#include "lib/json_writer.hpp"
 
 #undef foreach
 #include <boost/property_tree/ptree.hpp>
 
 #include <memory> // unique_ptr
 #include <functional> // function
+#include <optional>
 #include <regex>
+#include <string>
+#include <vector>
 
 namespace runos {
 
@@ -48,13 +53,40 @@ namespace rest {
         unsigned code_;
     };
 
+    // Paging of a GET, ?limit=N&cursor=C. A paged collection returns
+    // at most `limit` elements following `cursor` and, if more remain,
+    // a "next" cursor to continue from.
+    struct page {
+        size_t limit = 0; // unlimited
+        std::string cursor;
+
+        bool empty() const { return limit == 0 && cursor.empty(); }
+    };
+
     struct resource {
         virtual ptree Get() const
         { THROW(http_error(404), "Unimplemented"); }
 
+        // Generation of the state behind GET, 0 if unversioned.
+        // Versioned replies are cached per generation and carry an ETag,
+        // so an unchanged resource is answered without running Stream().
+        virtual uint64_t Generation() const
+        { return 0; }
+
+        // Writes the GET response straight into the reply buffer.
+        // Big collections override it to skip building a ptree.
+        virtual void Stream(json_writer& out) const
+        { out.value(Get()); }
+
+        // Stream() of one page, collections that can be paged
+        // override it and ignore neither limit nor cursor
+        virtual void Page(json_writer& out, const page&) const
+        { Stream(out); }
+
         virtual bool Head() const
         try {
-            (void) Get();
+            json_writer sink;
+            Stream(sink);
             return true;
         } catch (const http_error& err) {
             if (err.code() == 404)
@@ -74,8 +106,46 @@ namespace rest {
         // TODO: subscribe
     };
 
-    typedef std::regex path_spec;
-    typedef std::smatch path_match;
+    // Regex over the whole path. Patterns made of literal and (\d+)
+    // segments are routed by a segment trie without running the regex.
+    struct path_spec {
+        path_spec(std::string pattern)
+            : pattern(std::move(pattern))
+            , regex(this->pattern)
+        { }
+
+        path_spec(const char* pattern)
+            : path_spec(std::string(pattern))
+        { }
+
+        std::string pattern;
+        std::regex regex;
+    };
+
+    // Captures of a matched path_spec, [0] is the whole path
+    class path_match {
+    public:
+        struct sub_match {
+            bool matched = false;
+            std::string value;
+            // Set for (\d+) segments fitting in 64 bits
+            std::optional<uint64_t> number;
+
+            std::string str() const { return value; }
+            operator std::string() const { return value; }
+        };
+
+        path_match() = default;
+        explicit path_match(const std::smatch& m);
+
+        size_t size() const { return subs_.size(); }
+        const sub_match& operator[](size_t i) const;
+
+        void push_back(sub_match sub) { subs_.push_back(std::move(sub)); }
+
+    private:
+        std::vector<sub_match> subs_;
+    };
 
     typedef std::function<void(resource&)>
         resource_continuation;
@@ -103,6 +173,16 @@ public:
             });
     }
 
+    // Pushes an event to every subscriber of GET /events/ (server-sent
+    // events). Events with the same non-empty key replace each other
+    // while still queued for a subscriber, so only the latest is sent.
+    void publish(const std::string& event, const std::string& key,
+                 const rest::ptree& data);
+
+    // Writes the GET body of a mounted path, as a client would get it,
+    // for resources built out of other resources. Throws http_error.
+    void render(const std::string& path, json_writer& out);
+
 private:
     void mount_impl(const rest::path_spec& pathspec,
                     rest::resource_mapper mapper);
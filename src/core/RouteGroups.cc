@@ -0,0 +1,240 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "RouteGroups.hpp"
+
+#include "SwitchManager.hpp"
+#include "api/OFAgent.hpp"
+#include "api/Switch.hpp"
+
+#include <runos/core/future.hpp>
+#include <runos/core/logging.hpp>
+
+#include <boost/thread/executors/inline_executor.hpp>
+
+#include <map>
+
+namespace runos {
+
+REGISTER_APPLICATION(RouteGroups, {"topology", "switch-manager", "switch-ordering", ""})
+
+static boost::inline_executor groups_executor;
+
+void RouteGroups::init(Loader* loader, const Config& rootConfig)
+{
+    topology_ = Topology::get(loader);
+    switch_manager_ = SwitchManager::get(loader);
+
+    const Config& config = config_cd(rootConfig, "route-groups");
+    group_base_ = config_get(config, "group-id-base", 0x70000000);
+
+    // direct: snapshot is already published, so it is read in place
+    connect(topology_, &Topology::routeUpdated, this,
+            [this](uint32_t id) { update(id); }, Qt::DirectConnection);
+    // comes first, so routeUpdated() of these routes finds nothing to do
+    connect(topology_, &Topology::routesRebalanced, this,
+            [this](std::vector<uint32_t> ids) { rebalance(ids); },
+            Qt::DirectConnection);
+
+    SwitchOrderingManager::get(loader)->registerHandler(this, 30);
+}
+
+Topology::Multipath RouteGroups::desired(uint32_t route_id, uint8_t type) const
+{
+    return type == of13::OFPGT_SELECT ? topology_->multipath(route_id)
+                                      : topology_->failover(route_id);
+}
+
+of13::GroupMod RouteGroups::group_mod(uint16_t command, uint8_t type, uint32_t route_id,
+                                      const std::vector<uint32_t>& ports) const
+{
+    if (command == of13::OFPGC_DELETE)
+        return of13::GroupMod(0, command, type, group_id(route_id));
+
+    std::vector<of13::Bucket> buckets;
+    for (auto port : ports) {
+        // select buckets share load, fast-failover ones watch their port
+        of13::Bucket bucket = type == of13::OFPGT_SELECT
+            ? of13::Bucket(1, of13::OFPP_ANY, of13::OFPG_ANY)
+            : of13::Bucket(0, port, of13::OFPG_ANY);
+        bucket.add_action(new of13::OutputAction(port, 0));
+        buckets.push_back(std::move(bucket));
+    }
+    return of13::GroupMod(0, command, type, group_id(route_id), buckets);
+}
+
+void RouteGroups::send(uint64_t dpid, std::vector<of13::GroupMod> mods, bool atomic)
+{
+    auto sw = switch_manager_->switch_(dpid);
+    auto conn = sw ? sw->connection() : nullptr;
+    if (not conn)
+        return; // installed by switchUp()
+
+    std::vector<fluid_msg::OFMsg*> msgs;
+    for (auto& mod : mods) {
+        msgs.push_back(&mod);
+    }
+    auto agent = conn->agent();
+    auto sent = atomic ? agent->bundle(msgs) : agent->mods(msgs);
+    sent.then(groups_executor, [dpid](future<void> f) {
+        try {
+            f.get();
+        } catch (OFAgent::error const&) {
+            // ADD of a group surviving a reconnect fails, MODIFY after it doesn't
+            VLOG(1) << "[RouteGroups] Some group mods rejected by " << dpid;
+        }
+    });
+}
+
+uint32_t RouteGroups::install(uint32_t route_id)
+{
+    uint8_t type = of13::OFPGT_SELECT;
+    auto buckets = topology_->multipath(route_id);
+    if (buckets.empty()) {
+        type = of13::OFPGT_FF;
+        buckets = topology_->failover(route_id);
+    }
+    if (buckets.empty()) {
+        LOG(WARNING) << "[RouteGroups] Route " << route_id << " has no paths to install";
+        return 0;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        routes_[route_id] = group{type, buckets};
+    }
+    for (const auto& it : buckets) {
+        send(it.first, { group_mod(of13::OFPGC_ADD, type, route_id, it.second),
+                         group_mod(of13::OFPGC_MODIFY, type, route_id, it.second) });
+    }
+    VLOG(1) << "[RouteGroups] Installed "
+            << (type == of13::OFPGT_SELECT ? "select" : "fast-failover")
+            << " group " << group_id(route_id) << " on " << buckets.size() << " switches";
+    return group_id(route_id);
+}
+
+void RouteGroups::uninstall(uint32_t route_id)
+{
+    group current;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = routes_.find(route_id);
+        if (it == routes_.end())
+            return;
+        current = std::move(it->second);
+        routes_.erase(it);
+    }
+    for (const auto& it : current.buckets) {
+        send(it.first, { group_mod(of13::OFPGC_DELETE, current.type, route_id, {}) });
+    }
+}
+
+Topology::Multipath RouteGroups::installed(uint32_t route_id) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = routes_.find(route_id);
+    return it != routes_.end() ? it->second.buckets : Topology::Multipath{};
+}
+
+void RouteGroups::diff(uint32_t route_id, switch_mods& mods)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = routes_.find(route_id);
+    if (found == routes_.end())
+        return; // not installed
+
+    uint8_t type = found->second.type;
+    auto next = desired(route_id, type);
+    auto& current = found->second.buckets;
+    for (const auto& it : next) {
+        auto was = current.find(it.first);
+        if (was == current.end()) {
+            // switch joined the route
+            mods[it.first].push_back(group_mod(of13::OFPGC_ADD, type, route_id, it.second));
+            mods[it.first].push_back(group_mod(of13::OFPGC_MODIFY, type, route_id, it.second));
+        } else if (was->second != it.second) {
+            mods[it.first].push_back(group_mod(of13::OFPGC_MODIFY, type, route_id, it.second));
+        }
+    }
+    for (const auto& it : current) {
+        if (not next.count(it.first)) {
+            // no paths through the switch anymore
+            next[it.first];
+            mods[it.first].push_back(group_mod(of13::OFPGC_MODIFY, type, route_id, {}));
+        }
+    }
+    current = std::move(next);
+}
+
+void RouteGroups::update(uint32_t route_id)
+{
+    if (topology_->getRouteDump(route_id).empty()) {
+        uninstall(route_id); // route deleted
+        return;
+    }
+
+    switch_mods mods;
+    diff(route_id, mods);
+    for (auto& it : mods) {
+        send(it.first, std::move(it.second));
+    }
+}
+
+void RouteGroups::rebalance(const std::vector<uint32_t>& route_ids)
+{
+    switch_mods mods;
+    for (auto id : route_ids) {
+        if (topology_->getRouteDump(id).empty()) {
+            uninstall(id);
+            continue;
+        }
+        diff(id, mods);
+    }
+    for (auto& it : mods) {
+        // a group already on the switch would fail the whole bundle, and
+        // a new one isn't used by flows yet: added on their own first
+        std::vector<of13::GroupMod> added, changed;
+        for (auto& mod : it.second) {
+            (mod.command() == of13::OFPGC_ADD ? added : changed)
+                .push_back(std::move(mod));
+        }
+        if (not added.empty())
+            send(it.first, std::move(added));
+        if (not changed.empty())
+            send(it.first, std::move(changed), true);
+    }
+}
+
+void RouteGroups::switchUp(SwitchPtr sw)
+{
+    std::vector<of13::GroupMod> mods;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& route : routes_) {
+            auto it = route.second.buckets.find(sw->dpid());
+            if (it == route.second.buckets.end())
+                continue;
+            auto type = route.second.type;
+            mods.push_back(group_mod(of13::OFPGC_ADD, type, route.first, it->second));
+            mods.push_back(group_mod(of13::OFPGC_MODIFY, type, route.first, it->second));
+        }
+    }
+    if (not mods.empty())
+        send(sw->dpid(), std::move(mods));
+}
+
+} // namespace runos
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "SwitchOrdering.hpp"
+#include "Topology.hpp"
+
+#include <fluid/of13msg.hh>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace runos {
+
+namespace of13 = fluid_msg::of13;
+
+/**
+ * Installs an OpenFlow group per Topology route on every switch its
+ * paths go through, so the data plane handles path failures itself:
+ *
+ *  - ECMP routes (route_selector::ecmp) get select groups with a bucket
+ *    per output port of the working equal-cost paths;
+ *  - other routes get fast-failover groups: the output port of the used
+ *    path first, then the ports of backup paths, each bucket watching
+ *    its port. A switch fails over locally when the port goes down.
+ *
+ * Applications point flows of the route to group_id() on the switches
+ * of all its paths and leave the rest here. When a route changes (path
+ * triggers, used path, paths added or deleted) only the buckets of the
+ * affected switches are modified, flows are never touched. Groups are
+ * kept even without buckets, as deleting them would remove the flows
+ * pointing to them; they go away with the route. Routes moved together
+ * by a Topology::reoptimize() pass are changed in one bundle per switch.
+ */
+class RouteGroups final : public Application
+                        , public SwitchEventHandler
+{
+    Q_OBJECT
+    SIMPLE_APPLICATION(RouteGroups, "route-groups")
+
+public:
+    void init(Loader* loader, const Config& config) override;
+
+    // Returns the group id, the same on every switch,
+    // or 0 if the route has no paths to install
+    uint32_t install(uint32_t route_id);
+    // Deletes the groups, together with flows using them
+    void uninstall(uint32_t route_id);
+
+    uint32_t group_id(uint32_t route_id) const { return group_base_ + route_id; }
+    // Output ports of installed buckets per switch
+    Topology::Multipath installed(uint32_t route_id) const;
+
+protected:
+    void switchUp(SwitchPtr sw) override;
+
+private:
+    struct group {
+        uint8_t type; // OFPGT_SELECT or OFPGT_FF
+        Topology::Multipath buckets;
+    };
+
+    Topology* topology_ {nullptr};
+    class SwitchManager* switch_manager_ {nullptr};
+    uint32_t group_base_ {0};
+
+    mutable std::mutex mutex_;
+    std::unordered_map<uint32_t, group> routes_; // as installed
+
+    Topology::Multipath desired(uint32_t route_id, uint8_t type) const;
+    of13::GroupMod group_mod(uint16_t command, uint8_t type, uint32_t route_id,
+                             const std::vector<uint32_t>& ports) const;
+    using switch_mods = std::map<uint64_t, std::vector<of13::GroupMod>>;
+
+    // `atomic`: in one bundle, the switch applies all mods or none
+    void send(uint64_t dpid, std::vector<of13::GroupMod> mods, bool atomic = false);
+    // Adds the mods bringing installed groups of the route up to date
+    void diff(uint32_t route_id, switch_mods& mods);
+    void update(uint32_t route_id);
+    void rebalance(const std::vector<uint32_t>& route_ids);
+};
+
+} // namespace runos
@@ -0,0 +1,352 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "StateReplicator.hpp"
+
+#include "DatabaseConnector.hpp"
+#include "Recovery.hpp"
+#include "Config.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <QDataStream>
+#include <QtNetwork/QHostAddress>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
+
+#include <algorithm>
+
+namespace runos {
+
+REGISTER_APPLICATION(StateReplicator, {"database-connector",
+                                       "recovery-manager", ""})
+
+enum class Frame : quint8 {
+    Hello,      // backup: log id, last applied seq
+    Snapshot,   // primary: log id, seq, count, (prefix, key, value)...
+    Changes     // primary: count, (seq, op, prefix, key, value)...
+};
+
+static constexpr int tick_ms = 20;
+static constexpr int reconnect_ticks = 1000 / tick_ms;
+
+static QByteArray bytes(const std::string& str)
+{
+    return QByteArray::fromStdString(str);
+}
+
+template<class Fill>
+static void send_frame(QTcpSocket* socket, Frame type, Fill&& fill)
+{
+    QByteArray payload;
+    QDataStream ps(&payload, QIODevice::WriteOnly);
+    ps.setVersion(QDataStream::Qt_5_9);
+    ps << static_cast<quint8>(type);
+    fill(ps);
+
+    QDataStream out(socket);
+    out.setVersion(QDataStream::Qt_5_9);
+    out << payload;
+}
+
+// Calls f for every complete frame already received
+template<class F>
+static void read_frames(QTcpSocket* socket, F&& f)
+{
+    QDataStream in(socket);
+    in.setVersion(QDataStream::Qt_5_9);
+    for (;;) {
+        in.startTransaction();
+        QByteArray frame;
+        in >> frame;
+        if (not in.commitTransaction())
+            break;
+        if (not f(frame))
+            break;
+    }
+}
+
+void StateReplicator::init(Loader* loader, const Config& root_config)
+{
+    auto config = config_cd(root_config, "state-replicator");
+    port_ = config_get(config, "port", 6654);
+    batch_ = config_get(config, "batch", 1024);
+    max_buffered_ = config_get(config, "max-buffered-kb", 8192) * 1024;
+
+    db_ = DatabaseConnector::get(loader);
+    recovery_ = RecoveryManager::get(loader);
+    db_->changeLog().setCapacity(config_get(config, "log-size", 65536));
+
+    connect(recovery_, &RecoveryManager::signalSetupPrimaryMode,
+            this, &StateReplicator::dropUpstream);
+    connect(recovery_, &RecoveryManager::signalRecovery,
+            this, &StateReplicator::dropUpstream);
+}
+
+void StateReplicator::startUp(Loader*)
+{
+    server_ = new QTcpServer(this);
+    connect(server_, &QTcpServer::newConnection,
+            this, &StateReplicator::accept);
+    if (not server_->listen(QHostAddress::Any, port_)) {
+        LOG(ERROR) << "[StateReplicator] Can't listen on port " << port_
+                   << ": " << server_->errorString().toStdString();
+    }
+
+    startTimer(tick_ms);
+}
+
+void StateReplicator::timerEvent(QTimerEvent*)
+{
+    for (auto& peer : peers_) {
+        if (peer->ready) {
+            sendChanges(peer.get());
+        }
+    }
+
+    if (recovery_->isBackup() && not upstream_ &&
+        --reconnect_ticks_ <= 0) {
+        reconnect_ticks_ = reconnect_ticks;
+        connectUpstream();
+    }
+}
+
+/* Primary side */
+
+void StateReplicator::accept()
+{
+    while (server_->hasPendingConnections()) {
+        auto peer = std::make_unique<Peer>();
+        peer->socket = server_->nextPendingConnection();
+
+        auto raw = peer.get();
+        connect(raw->socket, &QTcpSocket::readyRead,
+                this, [this, raw]() { readPeer(raw); });
+        connect(raw->socket, &QTcpSocket::disconnected,
+                this, [this, raw]() { dropPeer(raw); });
+        peers_.push_back(std::move(peer));
+    }
+}
+
+void StateReplicator::dropPeer(Peer* peer)
+{
+    auto it = std::find_if(peers_.begin(), peers_.end(),
+        [peer](const std::unique_ptr<Peer>& p) { return p.get() == peer; });
+    if (it == peers_.end())
+        return;
+
+    VLOG(5) << "[StateReplicator] Backup "
+            << peer->socket->peerAddress().toString().toStdString()
+            << " disconnected";
+    peer->socket->disconnect(this);
+    peer->socket->deleteLater();
+    peers_.erase(it);
+}
+
+void StateReplicator::readPeer(Peer* peer)
+{
+    quint64 log_id = 0, seq = 0;
+    bool hello = false;
+    read_frames(peer->socket, [&](const QByteArray& frame) {
+        QDataStream in(frame);
+        in.setVersion(QDataStream::Qt_5_9);
+        quint8 type;
+        in >> type;
+        if (type == static_cast<quint8>(Frame::Hello)) {
+            in >> log_id >> seq;
+            hello = true;
+        }
+        return true;
+    });
+
+    if (not hello)
+        return;
+
+    if (not recovery_->isPrimary()) {
+        peer->socket->abort();
+        return;
+    }
+
+    peer->ready = true;
+    std::vector<Change> changes;
+    if (log_id == db_->changeLog().id() &&
+        db_->changeLog().since(seq, changes, 0)) {
+        LOG(INFO) << "[StateReplicator] Backup resumes from change " << seq;
+        peer->next = seq;
+    } else {
+        sendSnapshot(peer);
+    }
+}
+
+void StateReplicator::sendSnapshot(Peer* peer)
+{
+    uint64_t seq;
+    auto changes = db_->snapshot(seq);
+
+    send_frame(peer->socket, Frame::Snapshot, [&](QDataStream& s) {
+        s << quint64(db_->changeLog().id()) << quint64(seq)
+          << quint32(changes.size());
+        for (auto& change : changes) {
+            s << bytes(change.prefix) << bytes(change.key)
+              << bytes(change.value);
+        }
+    });
+    peer->next = seq;
+
+    LOG(INFO) << "[StateReplicator] Sent snapshot of " << changes.size()
+              << " values as of change " << seq << " to "
+              << peer->socket->peerAddress().toString().toStdString();
+}
+
+void StateReplicator::sendChanges(Peer* peer)
+{
+    // Slow backup, let the socket drain
+    if (peer->socket->bytesToWrite() > max_buffered_)
+        return;
+
+    std::vector<Change> changes;
+    if (not db_->changeLog().since(peer->next, changes, batch_)) {
+        // Fell behind the log
+        sendSnapshot(peer);
+        return;
+    }
+    if (changes.empty())
+        return;
+
+    send_frame(peer->socket, Frame::Changes, [&](QDataStream& s) {
+        s << quint32(changes.size());
+        for (auto& change : changes) {
+            s << quint64(change.seq) << static_cast<quint8>(change.op)
+              << bytes(change.prefix) << bytes(change.key)
+              << bytes(change.value);
+        }
+    });
+    peer->next = changes.back().seq;
+}
+
+/* Backup side */
+
+void StateReplicator::connectUpstream()
+{
+    auto cluster = recovery_->cluster();
+    auto primary = std::find_if(cluster.begin(), cluster.end(),
+        [](const ClusterNodePtr& node) {
+            return not node->isThisNodeCurrentController() &&
+                   +ControllerStatus::PRIMARY == node->hbStatus();
+        });
+    if (primary == cluster.end())
+        return;
+
+    upstream_ = new QTcpSocket(this);
+    connect(upstream_, &QTcpSocket::connected, this, [this]() {
+        send_frame(upstream_, Frame::Hello, [this](QDataStream& s) {
+            s << quint64(log_id_) << quint64(seq_);
+        });
+    });
+    connect(upstream_, &QTcpSocket::readyRead,
+            this, &StateReplicator::readUpstream);
+    connect(upstream_, &QTcpSocket::disconnected,
+            this, &StateReplicator::dropUpstream);
+    connect(upstream_,
+            static_cast<void (QTcpSocket::*)(QAbstractSocket::SocketError)>(
+                &QAbstractSocket::error),
+            this, &StateReplicator::dropUpstream);
+
+    VLOG(10) << "[StateReplicator] Connecting to primary "
+             << (*primary)->dbIP() << ":" << port_;
+    upstream_->connectToHost(QString::fromStdString((*primary)->dbIP()),
+                             port_);
+}
+
+void StateReplicator::dropUpstream()
+{
+    if (not upstream_)
+        return;
+
+    upstream_->disconnect(this);
+    upstream_->abort();
+    upstream_->deleteLater();
+    upstream_ = nullptr;
+}
+
+void StateReplicator::readUpstream()
+{
+    read_frames(upstream_, [this](const QByteArray& frame) {
+        processUpstream(frame);
+        // Dropped on a gap in the log
+        return upstream_ != nullptr;
+    });
+}
+
+void StateReplicator::processUpstream(const QByteArray& frame)
+{
+    QDataStream in(frame);
+    in.setVersion(QDataStream::Qt_5_9);
+    quint8 type;
+    in >> type;
+
+    if (type == static_cast<quint8>(Frame::Snapshot)) {
+        quint64 log_id, seq;
+        quint32 count;
+        in >> log_id >> seq >> count;
+
+        StateImage image;
+        for (quint32 i = 0; i < count; ++i) {
+            QByteArray prefix, key, value;
+            in >> prefix >> key >> value;
+            image.apply({ 0, Change::Op::Put, prefix.toStdString(),
+                          key.toStdString(), value.toStdString() });
+        }
+        db_->setReplica(std::move(image));
+        log_id_ = log_id;
+        seq_ = seq;
+
+        LOG(INFO) << "[StateReplicator] Got snapshot of " << count
+                  << " values as of change " << seq;
+
+    } else if (type == static_cast<quint8>(Frame::Changes)) {
+        quint32 count;
+        in >> count;
+
+        std::vector<Change> changes;
+        changes.reserve(count);
+        for (quint32 i = 0; i < count; ++i) {
+            quint64 seq;
+            quint8 op;
+            QByteArray prefix, key, value;
+            in >> seq >> op >> prefix >> key >> value;
+
+            // Already in the snapshot
+            if (seq <= seq_)
+                continue;
+            if (seq != seq_ + 1) {
+                LOG(WARNING) << "[StateReplicator] Missed changes "
+                             << seq_ + 1 << ".." << seq - 1
+                             << ", requesting snapshot";
+                log_id_ = 0;
+                dropUpstream();
+                return;
+            }
+            changes.push_back({ seq, static_cast<Change::Op>(op),
+                                prefix.toStdString(), key.toStdString(),
+                                value.toStdString() });
+            seq_ = seq;
+        }
+        db_->applyReplica(changes);
+    }
+}
+
+} // namespace runos
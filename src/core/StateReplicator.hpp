@@ -0,0 +1,90 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Application.hpp"
+#include "Loader.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class QByteArray;
+class QTcpServer;
+class QTcpSocket;
+
+namespace runos {
+
+class DatabaseConnector;
+class RecoveryManager;
+
+/**
+ * Ships the DatabaseConnector change log from the primary controller
+ * to backups over a dedicated TCP stream.
+ *
+ * A backup connects to the primary, says which log and position it
+ * holds and gets either the tail of the log or a snapshot followed by
+ * the tail. The received state is kept as the connector's in-memory
+ * replica, so a takeover reads nothing from the store.
+ */
+class StateReplicator final : public Application {
+    Q_OBJECT
+    SIMPLE_APPLICATION(StateReplicator, "state-replicator")
+
+public:
+    void init(Loader* loader, const Config& root_config) override;
+    void startUp(Loader* loader) override;
+
+protected:
+    void timerEvent(QTimerEvent*) override;
+
+private:
+    struct Peer {
+        QTcpSocket* socket;
+        bool ready {false};
+        uint64_t next {0}; // last change sent
+    };
+
+    DatabaseConnector* db_;
+    RecoveryManager* recovery_;
+    uint16_t port_;
+    size_t batch_;
+    int64_t max_buffered_;
+
+    // Primary side
+    QTcpServer* server_ {nullptr};
+    std::vector<std::unique_ptr<Peer>> peers_;
+
+    // Backup side, position of the replica in the primary's log
+    QTcpSocket* upstream_ {nullptr};
+    uint64_t log_id_ {0};
+    uint64_t seq_ {0};
+    int reconnect_ticks_ {0};
+
+    void accept();
+    void readPeer(Peer* peer);
+    void dropPeer(Peer* peer);
+    void sendSnapshot(Peer* peer);
+    void sendChanges(Peer* peer);
+
+    void connectUpstream();
+    void dropUpstream();
+    void readUpstream();
+    void processUpstream(const QByteArray& frame);
+};
+
+} // namespace runos
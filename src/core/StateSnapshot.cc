@@ -0,0 +1,248 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "StateSnapshot.hpp"
+
+#include "DatabaseConnector.hpp"
+#include "Recovery.hpp"
+#include "Config.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <QCoreApplication>
+#include <QSocketNotifier>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <random>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace runos {
+
+REGISTER_APPLICATION(StateSnapshot, {"database-connector",
+                                     "recovery-manager", ""})
+
+using lock_t = std::lock_guard<std::mutex>;
+
+static constexpr auto stamp_prefix = "state-snapshot";
+static constexpr auto stamp_key = "stamp";
+
+// SIGTERM and SIGINT are forwarded to the event loop, so the snapshot
+// is written before the previous disposition takes over
+static int signal_pipe[2] = {-1, -1};
+static struct sigaction previous_term, previous_int;
+
+static void on_signal(int sig)
+{
+    unsigned char c = sig;
+    if (::write(signal_pipe[1], &c, 1) < 0) {
+        // the pipe is full, a signal is pending already
+    }
+}
+
+void StateSnapshot::init(Loader* loader, const Config& root_config)
+{
+    auto config = config_cd(root_config, "state-snapshot");
+    active_ = config_get(config, "active", false);
+    path_ = config_get(config, "path", "runos-state.snap");
+    interval_ = std::chrono::milliseconds(
+        std::max(100, config_get(config, "interval-ms", 1000)));
+
+    db_ = DatabaseConnector::get(loader);
+    recovery_ = RecoveryManager::get(loader);
+    if (not active_)
+        return;
+
+    if (::access(path_.c_str(), F_OK) != 0) {
+        VLOG(1) << "[StateSnapshot] No snapshot at " << path_;
+        return;
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    std::string error;
+    file_ = SnapshotFile::open(path_, error);
+    if (file_) {
+        auto took = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - begin);
+        LOG(INFO) << "[StateSnapshot] Mapped " << path_ << ", "
+                  << file_->size() << " bytes in " << took.count() << " us";
+    } else {
+        LOG(WARNING) << "[StateSnapshot] Can't use " << path_ << ": " << error;
+    }
+}
+
+void StateSnapshot::startUp(Loader*)
+{
+    if (not active_)
+        return;
+
+    // Everything mirrored is known: from now on a write to it makes
+    // the snapshot stale
+    std::vector<std::string> watched;
+    {
+        lock_t lock(mutex_);
+        for (const auto& p : producers_) {
+            watched.push_back(p.first);
+        }
+    }
+    db_->armStamp(stamp_prefix, stamp_key, std::move(watched));
+
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit,
+            this, [this]() {
+                if (stale())
+                    write();
+            }, Qt::DirectConnection);
+
+    if (::pipe2(signal_pipe, O_CLOEXEC | O_NONBLOCK) == 0) {
+        auto notifier = new QSocketNotifier(signal_pipe[0],
+                                            QSocketNotifier::Read, this);
+        connect(notifier, &QSocketNotifier::activated, this, [this]() {
+            unsigned char sig;
+            if (::read(signal_pipe[0], &sig, 1) == 1)
+                terminate(sig);
+        });
+
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_signal;
+        sigemptyset(&sa.sa_mask);
+        ::sigaction(SIGTERM, &sa, &previous_term);
+        ::sigaction(SIGINT, &sa, &previous_int);
+    } else {
+        LOG(WARNING) << "[StateSnapshot] No snapshot on termination: "
+                     << std::strerror(errno);
+    }
+
+    startTimer(interval_.count());
+}
+
+void StateSnapshot::provide(const std::string& prefix, Producer produce)
+{
+    if (not active_)
+        return;
+
+    lock_t lock(mutex_);
+    producers_.emplace_back(prefix, std::move(produce));
+}
+
+std::shared_ptr<const SnapshotFile> StateSnapshot::current() const
+{
+    std::shared_ptr<const SnapshotFile> file;
+    {
+        lock_t lock(mutex_);
+        file = file_;
+    }
+    if (not file)
+        return nullptr;
+
+    // The only read from the store
+    auto stamp = db_->getSValue(stamp_prefix, stamp_key);
+    if (stamp != std::to_string(file->stamp())) {
+        VLOG(1) << "[StateSnapshot] Store has moved on since " << path_
+                << " was written";
+        return nullptr;
+    }
+    return file;
+}
+
+bool StateSnapshot::stale() const
+{
+    return failed_ || not db_->stampArmed();
+}
+
+bool StateSnapshot::write()
+{
+    if (not active_ || not recovery_->isPrimary())
+        return false;
+
+    auto begin = std::chrono::steady_clock::now();
+    std::random_device rd;
+    uint64_t stamp = (uint64_t(rd()) << 32) | rd();
+    SnapshotWriter writer(stamp);
+
+    // Producers take locks of their applications, which may be held
+    // while current() is called
+    decltype(producers_) producers;
+    {
+        lock_t lock(mutex_);
+        producers = producers_;
+    }
+
+    // Armed before reading anything, so a write racing with the
+    // copy leaves it unstamped
+    std::vector<std::string> watched;
+    for (const auto& p : producers) {
+        watched.push_back(p.first);
+    }
+    db_->armStamp(stamp_prefix, stamp_key, std::move(watched));
+    for (const auto& p : producers) {
+        writer.section(p.first);
+        p.second(writer);
+    }
+
+    failed_ = not writer.commit(path_);
+    if (failed_) {
+        LOG(ERROR) << "[StateSnapshot] Can't write " << path_ << ": "
+                   << std::strerror(errno);
+        return false;
+    }
+    if (not db_->putStamp(std::to_string(stamp))) {
+        VLOG(1) << "[StateSnapshot] Store changed while writing " << path_;
+        return false;
+    }
+
+    std::string error;
+    std::shared_ptr<const SnapshotFile> file = SnapshotFile::open(path_, error);
+    if (not file) {
+        LOG(ERROR) << "[StateSnapshot] Can't map written " << path_
+                   << ": " << error;
+    }
+    {
+        lock_t lock(mutex_);
+        file_ = std::move(file);
+    }
+
+    auto took = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - begin);
+    VLOG(1) << "[StateSnapshot] " << writer.records() << " records written to "
+            << path_ << " in " << took.count() << " ms";
+    return true;
+}
+
+void StateSnapshot::timerEvent(QTimerEvent*)
+{
+    if (stale() && recovery_->isPrimary()) {
+        write();
+    }
+}
+
+void StateSnapshot::terminate(int sig)
+{
+    LOG(INFO) << "[StateSnapshot] Terminated by signal " << sig;
+    if (stale())
+        write();
+
+    ::sigaction(SIGTERM, &previous_term, nullptr);
+    ::sigaction(SIGINT, &previous_int, nullptr);
+    ::raise(sig);
+}
+
+} // namespace runos
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "lib/state_snapshot.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace runos {
+
+class DatabaseConnector;
+class RecoveryManager;
+
+/**
+ * Local snapshot of the state applications otherwise load from the
+ * store, kept in a file that is used straight from its mapping
+ * (see lib/state_snapshot.hpp).
+ *
+ * The primary writes it when the mirrored prefixes have changed, at
+ * most once per interval, and on shutdown. The store stays the source
+ * of truth: the file is used only while the stamp kept in the store
+ * matches it, and DatabaseConnector clears that stamp with the first
+ * write to a mirrored prefix.
+ */
+class StateSnapshot final : public Application {
+    Q_OBJECT
+    SIMPLE_APPLICATION(StateSnapshot, "state-snapshot")
+
+public:
+    using Producer = std::function<void(SnapshotWriter&)>;
+
+    void init(Loader* loader, const Config& root_config) override;
+    void startUp(Loader* loader) override;
+
+    bool active() const { return active_; }
+
+    // Adds a section to every snapshot. It is named after the store
+    // prefix it mirrors, `produce` runs on the snapshot thread and
+    // locks whatever it reads. Call from init().
+    void provide(const std::string& prefix, Producer produce);
+
+    // The snapshot (found at startup or written since) matching the
+    // store, nullptr if there is none or the store has moved on
+    std::shared_ptr<const SnapshotFile> current() const;
+
+    // Writes a snapshot now, primary only
+    bool write();
+
+protected:
+    void timerEvent(QTimerEvent*) override;
+
+private:
+    DatabaseConnector* db_ {nullptr};
+    RecoveryManager* recovery_ {nullptr};
+    bool active_ {false};
+    std::string path_;
+    std::chrono::milliseconds interval_ {1000};
+
+    std::vector<std::pair<std::string, Producer>> producers_;
+    std::shared_ptr<const SnapshotFile> file_;
+    mutable std::mutex mutex_;
+
+    bool failed_ {false}; // the last write didn't reach the disk
+
+    bool stale() const;
+    void terminate(int sig);
+};
+
+} // namespace runos
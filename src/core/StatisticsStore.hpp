@@ -17,6 +17,7 @@
 #pragma once
 
 #include <chrono>
+#include <limits>
 #include <range/v3/core.hpp>
 #include <range/v3/view/transform.hpp>
 #include <range/v3/view/zip_with.hpp>
@@ -25,6 +26,8 @@
 #include <range/v3/algorithm/copy.hpp>
 
 #include "api/Statistics.hpp"
+#include "api/TimeSeries.hpp"
+#include "lib/rate_kernel.hpp"
 
 namespace runos {
 
@@ -37,13 +40,20 @@ public:
     using statistics_type = Statistics<Measurement>;
 
     StatisticsStore()
+        : history_(measurement_type<double>().size())
     {
         reset();
     }
 
     statistics_type get() const
     {
-        return {curr_, current_speed(), max_};
+        return {curr_, speed_, max_};
+    }
+
+    // speed history, read it under the same lock as the store
+    const TimeSeries& history() const
+    {
+        return history_;
     }
 
     void reset_without_max()
@@ -52,6 +62,8 @@ public:
         curr_time_ = std::chrono::seconds(0);
         ranges::fill(prev_, 0);
         ranges::fill(curr_, 0);
+        // no speed until the next sample, as 0/0 would give
+        ranges::fill(speed_, std::numeric_limits<double>::quiet_NaN());
     }
 
     void reset()
@@ -77,13 +89,16 @@ public:
         if (curr_ < prev_)
             ranges::fill(prev_, 0);
 
-        auto max_fn = [](double a, double b) { return std::max(a, b); };
-        auto speed = current_speed();
+        // speed and max in one pass over the packed counters
+        double delta = (curr_time_ - prev_time_).count();
+        rate_kernel::compute(1, curr_.size(),
+                             curr_.data(), prev_.data(), &delta,
+                             speed_.data(), max_.data());
 
-        ranges::copy(
-            ranges::view::zip_with(max_fn, max_, speed)
-          , max_.begin()
-        );
+        // first sample after reset has no meaningful speed
+        if (prev_time_ != fpseconds::zero()) {
+            history_.append(curr_time_.count(), speed_.data());
+        }
     }
 
 private:
@@ -95,22 +110,9 @@ private:
 
     measurement_type<uint64_t> prev_;
     measurement_type<uint64_t> curr_;
+    measurement_type<double> speed_;
     measurement_type<double> max_;
-
-    measurement_type<double> current_speed() const
-    {
-        using namespace ranges;
-        using std::chrono::seconds;
-        using std::chrono::duration_cast;
-
-        auto delta = (curr_time_ - prev_time_).count();
-
-        measurement_type<double> ret;
-        ranges::copy( view::zip_with(std::minus<uint64_t>{}, curr_, prev_)
-                    | view::transform([=](uint64_t s) { return s / delta; })
-                    , ret.begin());
-        return std::move(ret);
-    }
+    TimeSeries history_;
 };
 
 } // namespace runos
@@ -23,7 +23,12 @@
 #include "StatisticsStore.hpp"
 #include "OFServer.hpp"
 
+#include "lib/ethaddr.hpp"
+#include "lib/poll_backoff.hpp"
+#include "lib/poll_tuning.hpp"
 #include "lib/qt_executor.hpp"
+#include "lib/telemetry_export.hpp"
+#include "lib/work_stealing_executor.hpp"
 #include "api/OFAgent.hpp"
 
 #include <boost/thread/shared_mutex.hpp>
@@ -31,18 +36,199 @@
 #include <range/v3/algorithm/fill.hpp>
 #include <range/v3/to_container.hpp>
 #include <range/v3/view/transform.hpp>
+#include <QTimer>
 
+#include <algorithm>
 #include <unordered_map>
+#include <unordered_set>
 #include <iterator> // begin, end, move
 #include <chrono>
 #include <atomic>
+#include <cmath>
 #include <functional> // mem_fn
+#include <map>
+#include <mutex>
+#include <tuple>
 
 namespace runos {
 
 REGISTER_APPLICATION(StatsBucketManager, {"of-server", ""})
 
+using continuation_pool = std::shared_ptr<work_stealing_executor>;
+
+// Runs the continuation on the pool if one is configured,
+// on the Qt thread of the object otherwise
+template<class Future, class F>
+static auto then(Future&& f, qt_executor& qt,
+                 continuation_pool const& pool, F&& cont)
+{
+    if (pool)
+        return f.then(*pool, std::forward<F>(cont));
+    return f.then(qt, std::forward<F>(cont));
+}
+
+// The OXM match as a packet_filter; false if it has a field
+// sampled headers don't carry
+static bool to_filter(of13::Match& match, packet_filter& filter)
+{
+    using fields = packet_fields;
+    const uint64_t exact = ~uint64_t(0);
+    auto mac = [](fluid_msg::EthAddress addr) {
+        return ethaddr(addr.to_string()).to_number();
+    };
+
+    for (uint8_t field = 0; field < OXM_NUM; ++field) {
+        of13::OXMTLV* tlv = match.oxm_field(field);
+        if (tlv == nullptr)
+            continue;
+        switch (field) {
+        case of13::OFPXMT_OFB_IN_PORT:
+            filter.add(fields::in_port, static_cast<of13::InPort*>(tlv)->value());
+            break;
+        case of13::OFPXMT_OFB_ETH_DST: {
+            auto eth = static_cast<of13::EthDst*>(tlv);
+            filter.add(fields::eth_dst, mac(eth->value()),
+                       eth->has_mask() ? mac(eth->mask()) : exact);
+            break;
+        }
+        case of13::OFPXMT_OFB_ETH_SRC: {
+            auto eth = static_cast<of13::EthSrc*>(tlv);
+            filter.add(fields::eth_src, mac(eth->value()),
+                       eth->has_mask() ? mac(eth->mask()) : exact);
+            break;
+        }
+        case of13::OFPXMT_OFB_ETH_TYPE:
+            filter.add(fields::eth_type, static_cast<of13::EthType*>(tlv)->value());
+            break;
+        case of13::OFPXMT_OFB_VLAN_VID: {
+            auto vlan = static_cast<of13::VLANVid*>(tlv);
+            filter.add(fields::vlan_vid, vlan->value(),
+                       vlan->has_mask() ? vlan->mask() : exact);
+            break;
+        }
+        case of13::OFPXMT_OFB_IP_PROTO:
+            filter.add(fields::ip_proto, static_cast<of13::IPProto*>(tlv)->value());
+            break;
+        case of13::OFPXMT_OFB_IPV4_SRC: {
+            auto ip = static_cast<of13::IPv4Src*>(tlv);
+            filter.add(fields::ipv4_src, ip->value().getIPv4(),
+                       ip->has_mask() ? ip->mask().getIPv4() : exact);
+            break;
+        }
+        case of13::OFPXMT_OFB_IPV4_DST: {
+            auto ip = static_cast<of13::IPv4Dst*>(tlv);
+            filter.add(fields::ipv4_dst, ip->value().getIPv4(),
+                       ip->has_mask() ? ip->mask().getIPv4() : exact);
+            break;
+        }
+        case of13::OFPXMT_OFB_TCP_SRC:
+            filter.add(fields::tp_src, static_cast<of13::TCPSrc*>(tlv)->value());
+            break;
+        case of13::OFPXMT_OFB_TCP_DST:
+            filter.add(fields::tp_dst, static_cast<of13::TCPDst*>(tlv)->value());
+            break;
+        case of13::OFPXMT_OFB_UDP_SRC:
+            filter.add(fields::tp_src, static_cast<of13::UDPSrc*>(tlv)->value());
+            break;
+        case of13::OFPXMT_OFB_UDP_DST:
+            filter.add(fields::tp_dst, static_cast<of13::UDPDst*>(tlv)->value());
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// Exports the sample just appended to `store`
+static void publish_bucket(int id, const std::string& name,
+                           const StatisticsStore<FlowMeasurement>& store,
+                           const FlowMeasurement<uint64_t>& acc)
+{
+    auto& telemetry = TelemetryExporter::global();
+    if (not telemetry.enabled())
+        return;
+    auto speed = store.get().current_speed;
+    TelemetrySample sample {TelemetrySample::bucket, 0, uint32_t(id)};
+    sample.counters = acc.data();
+    sample.ncounters = acc.size();
+    sample.rates = speed.data();
+    sample.nrates = speed.size();
+    sample.name = name;
+    telemetry.publish(sample);
+}
+
+class FlowStatsRollup;
+
+// Ids of the buckets sampled since the last tick of the manager
+struct UpdateBatch
+{
+    void mark(int id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (size_t(id) >= marked.size())
+            marked.resize(size_t(id) + 1, false);
+        if (not marked[id]) {
+            marked[id] = true;
+            ids.push_back(id);
+        }
+    }
+
+    // Ascending, and starts the next batch
+    std::vector<int> take()
+    {
+        std::vector<int> ret;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ret.swap(ids);
+            for (int id : ret)
+                marked[id] = false;
+        }
+        std::sort(ret.begin(), ret.end());
+        return ret;
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<int> ids;
+    std::vector<bool> marked; // by id
+};
+
+// Bucket whose samples are summed up by rollups made of it and
+// announced by the manager once per tick
+class RollupSource
+{
+public:
+    // Before the first sample
+    void notify_to(std::shared_ptr<UpdateBatch> updates, int id)
+    {
+        updates_ = std::move(updates);
+        updates_id_ = id;
+    }
+
+    // Samples go to `parent` as its child number `index`
+    void add_parent(std::weak_ptr<FlowStatsRollup> parent, size_t index)
+    {
+        std::lock_guard<std::mutex> lock(parents_mutex_);
+        parents_.emplace_back(std::move(parent), index);
+    }
+
+    virtual ~RollupSource() { }
+
+protected:
+    // Call with no lock of the bucket held, parents take their own
+    void report(std::chrono::steady_clock::time_point taken,
+                const FlowMeasurement<uint64_t>& acc);
+
+private:
+    std::shared_ptr<UpdateBatch> updates_;
+    int updates_id_ {-1};
+    std::mutex parents_mutex_;
+    std::vector<std::pair<std::weak_ptr<FlowStatsRollup>, size_t>> parents_;
+};
+
 class FlowStatsBucketImpl : public FlowStatsBucket
+                          , public RollupSource
                           , public std::enable_shared_from_this<FlowStatsBucketImpl>
 {
     Q_OBJECT
@@ -50,9 +236,11 @@ class FlowStatsBucketImpl : public FlowStatsBucket
 public:
     explicit FlowStatsBucketImpl(std::string name,
                                  StatsBucketManager::FlowSelector selector,
+                                 continuation_pool pool,
                                  QObject* parent)
-        : id_(next_id++)
+        : id_(take_id())
         , name_(std::move(name))
+        , pool_(std::move(pool))
     {
         using namespace flow_selector;
         moveToThread(parent->thread());
@@ -102,9 +290,53 @@ public:
 
         dpids_ = *selector.get(dpid);
         per_request_stats_.resize( dpids_.size() * requests_.size() );
+
+        // A sample tells the input port and header, not the entry
+        // it hit: cookies and output ports can't be estimated
+        auto& req = requests_.front();
+        estimable_ = requests_.size() == 1 &&
+                     req.out_port == of13::OFPP_ANY &&
+                     req.out_group == of13::OFPG_ANY &&
+                     req.cookie_mask == 0 &&
+                     to_filter(req.match, filter_);
+    }
+
+    void start(OFServer* ofserver, std::chrono::milliseconds period,
+               double scale);
+    // Polls every scale * period from now on
+    void retime(double scale);
+
+    // Bucket can be served by a shared FlowStatsBatch of its switch
+    bool batchable() const
+    {
+        return dpids_.size() == 1 && requests_.size() == 1 &&
+               requests_[0].out_port == of13::OFPP_ANY &&
+               requests_[0].out_group == of13::OFPG_ANY;
     }
 
-    void start(OFServer* ofserver, std::chrono::milliseconds period);
+    uint64_t dpid() const { return dpids_.front(); }
+    const ofp::flow_stats_request& request() const { return requests_.front(); }
+
+    // called by FlowStatsBatch with locally aggregated entries
+    void deliver(ofp::aggregate_stats const& stats,
+                 std::chrono::steady_clock::time_point taken);
+
+    // Flow sampling, see StatsBucketManager::sampled()
+    bool estimable() const { return estimable_; }
+    const std::vector<uint64_t>& dpids() const { return dpids_; }
+    const packet_filter& filter() const { return filter_; }
+    void sampled_poll_every(unsigned n) { sampled_poll_every_ = std::max(n, 1u); }
+
+    void sample(uint64_t packets, uint64_t bytes)
+    {
+        sampled_packets_ += packets;
+        sampled_bytes_ += bytes;
+    }
+    // Appends the estimate and keeps polls off the counters until `until`
+    void flush_samples(std::chrono::steady_clock::time_point now,
+                       std::chrono::steady_clock::time_point until);
+    bool estimated(std::chrono::steady_clock::time_point now) const
+    { return now.time_since_epoch().count() < estimated_until_; }
 
     // observers
     int id() const override { return id_; }
@@ -112,11 +344,22 @@ public:
 
     Statistics<FlowMeasurement> stats() const override
     {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
         return aggregated_stats_.get();
     }
 
+    void history(TimeSeries::resolution r,
+                 const TimeSeries::visitor& f) const override
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        f(aggregated_stats_.history().at(r));
+    }
+
     void update();
 
+    // Ids are shared with rollups
+    static int take_id() { return next_id++; }
+
 protected:
     void timerEvent(QTimerEvent*) override;
 
@@ -130,13 +373,39 @@ private:
 
     std::vector<uint64_t> dpids_;
     std::vector<OFAgentPtr> agents_;
+    std::vector<poll_backoff> backoff_; // per agent
     std::vector<ofp::flow_stats_request> requests_;
+    std::vector<OFAgent::prepared_request> prepared_; // packed requests_
+    std::chrono::milliseconds period_ {0};
+    double scale_ {1.0};
+    int timer_ {0}; // own timer, none while batched
 
     std::chrono::steady_clock clock_;
+    mutable std::mutex stats_mutex_; // readers are REST threads
     stats_store_type aggregated_stats_;
     std::vector< ofp::aggregate_stats > per_request_stats_;
 
+    bool estimable_ {false};
+    packet_filter filter_;
+    unsigned sampled_poll_every_ {1};
+    unsigned skipped_polls_ {0}; // Qt thread
+    std::atomic<uint64_t> sampled_packets_ {0}; // since the last flush
+    std::atomic<uint64_t> sampled_bytes_ {0};
+    std::atomic<int64_t> estimated_until_ {0}; // steady clock ticks
+    FlowMeasurement<uint64_t> last_ {}; // under stats_mutex_
+    FlowMeasurement<uint64_t> estimate_ {}; // under stats_mutex_
+
+    void record(std::chrono::steady_clock::time_point taken,
+                const FlowMeasurement<uint64_t>& acc);
+
+    // Warning: requires stats_mutex_, after aggregated_stats_.append()
+    void publish(const FlowMeasurement<uint64_t>& acc) const
+    {
+        publish_bucket(id_, name_, aggregated_stats_, acc);
+    }
+
     qt_executor executor {this};
+    continuation_pool pool_; // for update() continuations, may be empty
     std::vector<OFAgentPtr> agents;
 };
 
@@ -145,26 +414,56 @@ std::atomic<int> FlowStatsBucketImpl::next_id {0};
 using FlowStatsBucketImplPtr = std::shared_ptr<FlowStatsBucketImpl>;
 using FlowStatsBucketImplWeakPtr = std::weak_ptr<FlowStatsBucketImpl>;
 
-void FlowStatsBucketImpl::start(OFServer* ofserver, std::chrono::milliseconds period)
+// Interval of the timer: the period asked for, stretched at runtime
+static std::chrono::milliseconds scaled(std::chrono::milliseconds period,
+                                        double scale)
 {
+    return std::max(std::chrono::milliseconds(1),
+                    std::chrono::milliseconds(
+                        std::llround(period.count() * scale)));
+}
+
+void FlowStatsBucketImpl::start(OFServer* ofserver, std::chrono::milliseconds period,
+                                double scale)
+{
+    period_ = period;
+    scale_ = scale;
     auto futures = dpids_
         | ranges::view::transform([&](auto id) { return ofserver->agent(id); })
         | ranges::to_<std::vector>();
 
     when_all_fix(futures.begin(), futures.end()).then(executor,
-        [self = shared_from_this(), period](auto ret) {
+        [self = shared_from_this()](auto ret) {
             VLOG(10) << "Activating stats bucket " << self->id()
                 << " (" << self->name() << ')';
 
             for (auto&& agent : ret.get()) {
                 self->agents_.push_back(agent.get());
             }
+            self->backoff_.resize(self->agents_.size());
 
-            self->startTimer(period.count());
+            self->timer_ = self->startTimer(
+                scaled(self->period_, self->scale_).count());
             self->update();
         });
 }
 
+void FlowStatsBucketImpl::retime(double scale)
+{
+    std::weak_ptr<FlowStatsBucketImpl> weak = shared_from_this();
+    async(executor, [weak, scale]() {
+        auto self = weak.lock();
+        if (not self)
+            return;
+        self->scale_ = scale;
+        if (self->timer_) {
+            self->killTimer(self->timer_);
+            self->timer_ = self->startTimer(
+                scaled(self->period_, scale).count());
+        }
+    });
+}
+
 void FlowStatsBucketImpl::timerEvent(QTimerEvent*)
 try {
     update();
@@ -179,13 +478,31 @@ void FlowStatsBucketImpl::update()
     using future_vector =
         std::vector< future<ofp::aggregate_stats> >;
 
+    // Estimated from samples: polls only refresh the flow count
+    if (estimated(clock_.now()) && ++skipped_polls_ % sampled_poll_every_ != 0)
+        return;
+
     future_vector futures;
     futures.reserve( per_request_stats_.size() );
 
+    // Same requests every tick, pack them once
+    if (prepared_.empty() && not agents_.empty()) {
+        for (auto& req : requests_) {
+            prepared_.push_back(agents_.front()->prepare_aggregate(req));
+        }
+    }
+
     int j = 0;
     for (int i = agents_.size()-1; i >= 0; --i) {
         auto agent = agents_[i];
-        for (auto& req : requests_) {
+        // Slow switch: keep its previous numbers this time
+        if (backoff_[i].skip(agent->slowdown())) {
+            for (size_t k = 0; k < requests_.size(); ++k, ++j) {
+                futures.push_back(make_ready_future(per_request_stats_[j]));
+            }
+            continue;
+        }
+        for (auto& req : prepared_) {
             try {
                 auto f = agent->request_aggregate(req);
                 futures.push_back(std::move(f));
@@ -198,7 +515,9 @@ void FlowStatsBucketImpl::update()
         }
     }
 
-    when_all_fix(futures.begin(), futures.end()).then(executor,
+    // Only reads per_request_stats_ and locks stats_mutex_,
+    // so may run off the Qt thread
+    then(when_all_fix(futures.begin(), futures.end()), executor, pool_,
         [self = shared_from_this()](future< future_vector > result) {
             VLOG(10) << "Entering flow stats continuation";
 
@@ -223,12 +542,452 @@ void FlowStatsBucketImpl::update()
             }
 
             VLOG(10) << "Bucket " << self->id() << " (" << self->name() << ") updated";
-            self->aggregated_stats_.append(self->clock_.now().time_since_epoch(), acc);
-            emit self->updated();
+            self->record(self->clock_.now(), acc);
         }
     );
 }
 
+void FlowStatsBucketImpl::deliver(ofp::aggregate_stats const& stats,
+                                  std::chrono::steady_clock::time_point taken)
+{
+    FlowMeasurement<uint64_t> acc;
+    ranges::fill(acc, 0);
+    acc.packets() = stats.packets;
+    acc.bytes() = stats.bytes;
+    acc.flows() = stats.flows;
+
+    per_request_stats_[0] = stats;
+    record(taken, acc);
+}
+
+// While estimated the samples own the counters, polls only
+// bring the flow count
+void FlowStatsBucketImpl::record(std::chrono::steady_clock::time_point taken,
+                                 const FlowMeasurement<uint64_t>& acc)
+{
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        if (estimated(taken)) {
+            estimate_.flows() = acc.flows();
+            return;
+        }
+        aggregated_stats_.append(taken.time_since_epoch(), acc);
+        last_ = acc;
+        publish(acc);
+    }
+    report(taken, acc);
+    emit updated();
+}
+
+void FlowStatsBucketImpl::flush_samples(std::chrono::steady_clock::time_point now,
+                                        std::chrono::steady_clock::time_point until)
+{
+    FlowMeasurement<uint64_t> acc;
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        // go on from the polled counters, so the series stays monotonic
+        if (not estimated(now))
+            estimate_ = last_;
+        estimated_until_ = until.time_since_epoch().count();
+        estimate_.packets() += sampled_packets_.exchange(0);
+        estimate_.bytes() += sampled_bytes_.exchange(0);
+        aggregated_stats_.append(now.time_since_epoch(), estimate_);
+        last_ = estimate_;
+        publish(estimate_);
+        acc = estimate_;
+    }
+    report(now, acc);
+    emit updated();
+}
+
+// Sum of its children's counters. Polls nothing: every child sample
+// moves the sum by its delta from the child's previous one. The sum is
+// sampled once every child has reported since the last sample, or
+// early when a child reports twice (another one missed its poll); the
+// first sample waits for all children, so rates never see a partial sum.
+class FlowStatsRollup : public FlowStatsBucket
+                      , public RollupSource
+                      , public std::enable_shared_from_this<FlowStatsRollup>
+{
+    Q_OBJECT
+
+public:
+    FlowStatsRollup(std::string name,
+                    std::vector<FlowStatsBucketPtr> children,
+                    QObject* parent)
+        : id_(FlowStatsBucketImpl::take_id())
+        , name_(std::move(name))
+        , children_(std::move(children))
+        , last_(children_.size())
+        , reported_(children_.size(), false)
+        , seen_(children_.size(), false)
+        , unseen_(children_.size())
+        , pending_(children_.size())
+    {
+        moveToThread(parent->thread());
+        ranges::fill(sum_, 0);
+        for (auto& acc : last_)
+            ranges::fill(acc, 0);
+    }
+
+    const std::vector<FlowStatsBucketPtr>& children() const
+    { return children_; }
+
+    void child_updated(size_t index, std::chrono::steady_clock::time_point taken,
+                       const FlowMeasurement<uint64_t>& acc);
+
+    int id() const override { return id_; }
+    std::string name() const override { return name_; }
+
+    Statistics<FlowMeasurement> stats() const override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return aggregated_stats_.get();
+    }
+
+    void history(TimeSeries::resolution r,
+                 const TimeSeries::visitor& f) const override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        f(aggregated_stats_.history().at(r));
+    }
+
+private:
+    const int id_;
+    const std::string name_;
+    const std::vector<FlowStatsBucketPtr> children_; // kept polling
+
+    mutable std::mutex mutex_; // guards everything below
+    StatisticsStore<FlowMeasurement> aggregated_stats_;
+    FlowMeasurement<uint64_t> sum_;
+    std::vector< FlowMeasurement<uint64_t> > last_; // per child
+    std::vector<bool> reported_; // since the last sample
+    std::vector<bool> seen_;     // ever
+    size_t unseen_;
+    size_t pending_;
+    std::chrono::steady_clock::time_point round_taken_;
+
+    // With mutex_ held; false if there was nothing to sample
+    bool close_round();
+};
+
+void RollupSource::report(std::chrono::steady_clock::time_point taken,
+                          const FlowMeasurement<uint64_t>& acc)
+{
+    if (updates_)
+        updates_->mark(updates_id_);
+
+    std::vector<std::pair<std::shared_ptr<FlowStatsRollup>, size_t>> parents;
+    {
+        std::lock_guard<std::mutex> lock(parents_mutex_);
+        for (auto& parent : parents_) {
+            if (auto ptr = parent.first.lock())
+                parents.emplace_back(std::move(ptr), parent.second);
+        }
+    }
+    for (auto& parent : parents) {
+        parent.first->child_updated(parent.second, taken, acc);
+    }
+}
+
+void FlowStatsRollup::child_updated(size_t index,
+                                    std::chrono::steady_clock::time_point taken,
+                                    const FlowMeasurement<uint64_t>& acc)
+{
+    FlowMeasurement<uint64_t> sampled;
+    std::chrono::steady_clock::time_point sampled_at;
+    bool closed = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (reported_[index] && close_round()) {
+            closed = true;
+            sampled = sum_;
+            sampled_at = round_taken_;
+        }
+
+        // unsigned wraparound keeps the sum right when a child goes down
+        for (size_t i = 0; i < sum_.size(); ++i)
+            sum_[i] += acc[i] - last_[index][i];
+        last_[index] = acc;
+        if (not seen_[index]) {
+            seen_[index] = true;
+            --unseen_;
+        }
+        reported_[index] = true;
+        --pending_;
+        round_taken_ = std::max(round_taken_, taken);
+
+        if (pending_ == 0 && close_round()) {
+            closed = true;
+            sampled = sum_;
+            sampled_at = round_taken_;
+        }
+    }
+    if (closed) {
+        report(sampled_at, sampled);
+        emit updated();
+    }
+}
+
+bool FlowStatsRollup::close_round()
+{
+    bool ret = unseen_ == 0;
+    if (ret) {
+        aggregated_stats_.append(round_taken_.time_since_epoch(), sum_);
+        publish_bucket(id_, name_, aggregated_stats_, sum_);
+    }
+    std::fill(reported_.begin(), reported_.end(), false);
+    pending_ = children_.size();
+    return ret;
+}
+
+using FlowStatsRollupPtr = std::shared_ptr<FlowStatsRollup>;
+
+// Same selection as OFPMP_AGGREGATE: cookie under mask and
+// non-strict match (entry has every field of the request match)
+static bool covers(ofp::flow_stats_request& req, of13::FlowStats& fs)
+{
+    if ((fs.cookie() & req.cookie_mask) != (req.cookie & req.cookie_mask))
+        return false;
+
+    auto&& entry_match = fs.match();
+    for (uint8_t field = 0; field < OXM_NUM; ++field) {
+        of13::OXMTLV* match_ptr = req.match.oxm_field(field);
+        if (match_ptr == nullptr)
+            continue;
+        of13::OXMTLV* field_ptr = entry_match.oxm_field(field);
+        if (field_ptr == nullptr || !field_ptr->equals(*match_ptr))
+            return false;
+    }
+    return true;
+}
+
+// Polls one flow table of one switch for all buckets sharing a period.
+// A single streamed flow-stats request replaces per-bucket aggregate
+// requests; entries are attributed to buckets locally. With shared
+// snapshots the table dump is also reused by SwitchImpl traffic stats.
+class FlowStatsBatch : public QObject
+                     , public std::enable_shared_from_this<FlowStatsBatch>
+{
+    Q_OBJECT
+
+public:
+    FlowStatsBatch(uint64_t dpid, uint8_t table, bool shared_snapshots,
+                   unsigned sampled_poll_every,
+                   continuation_pool pool, QObject* parent)
+        : dpid_(dpid), table_(table), shared_snapshots_(shared_snapshots)
+        , sampled_poll_every_(std::max(sampled_poll_every, 1u))
+        , pool_(std::move(pool))
+    {
+        moveToThread(parent->thread());
+    }
+
+    void start(OFServer* ofserver, std::chrono::milliseconds period,
+               double scale);
+    void retime(double scale);
+
+    void join(FlowStatsBucketImplPtr bucket)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        members_.push_back(bucket);
+    }
+
+protected:
+    void timerEvent(QTimerEvent*) override;
+
+private:
+    struct poll {
+        std::vector<FlowStatsBucketImplPtr> buckets;
+        std::vector<ofp::flow_stats_request> requests;
+        std::vector<ofp::aggregate_stats> results;
+    };
+
+    const uint64_t dpid_;
+    const uint8_t table_;
+    const bool shared_snapshots_;
+    const unsigned sampled_poll_every_;
+    unsigned skipped_polls_ {0};
+    std::chrono::milliseconds period_ {0};
+    double scale_ {1.0};
+    int timer_ {0};
+    OFAgentPtr agent_;
+    std::atomic<bool> polling_ {false}; // reset by the continuation
+    poll_backoff backoff_;
+
+    std::mutex mutex_;
+    std::vector<FlowStatsBucketImplWeakPtr> members_;
+
+    qt_executor executor {this};
+    continuation_pool pool_;
+
+    void update();
+    void request_snapshot(std::shared_ptr<poll> state);
+    static void attribute(poll& state,
+                          OFAgent::sequence<of13::FlowStats>& entries);
+    static void deliver(poll& state,
+                        std::chrono::steady_clock::time_point taken);
+};
+
+using FlowStatsBatchPtr = std::shared_ptr<FlowStatsBatch>;
+
+void FlowStatsBatch::start(OFServer* ofserver, std::chrono::milliseconds period,
+                           double scale)
+{
+    period_ = period;
+    scale_ = scale;
+    ofserver->agent(dpid_).then(executor,
+        [self = shared_from_this()](future<OFAgentPtr> agent) {
+            VLOG(10) << "Activating stats batch for dpid " << self->dpid_
+                     << ", table " << int(self->table_);
+
+            self->agent_ = agent.get();
+            self->timer_ = self->startTimer(
+                scaled(self->period_, self->scale_).count());
+            self->update();
+        });
+}
+
+void FlowStatsBatch::retime(double scale)
+{
+    std::weak_ptr<FlowStatsBatch> weak = shared_from_this();
+    async(executor, [weak, scale]() {
+        auto self = weak.lock();
+        if (not self)
+            return;
+        self->scale_ = scale;
+        if (self->timer_) {
+            self->killTimer(self->timer_);
+            self->timer_ = self->startTimer(
+                scaled(self->period_, scale).count());
+        }
+    });
+}
+
+void FlowStatsBatch::timerEvent(QTimerEvent*)
+try {
+    update();
+} catch (std::bad_weak_ptr const&) {
+    // see FlowStatsBucketImpl::timerEvent
+}
+
+void FlowStatsBatch::update()
+{
+    if (polling_ || not agent_)
+        return; // previous tick isn't finished yet
+    if (backoff_.skip(agent_->slowdown()))
+        return; // switch answers slower than usual
+
+    auto state = std::make_shared<poll>();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto expired = [](auto& weak) { return weak.expired(); };
+        members_.erase(std::remove_if(members_.begin(), members_.end(), expired),
+                       members_.end());
+        for (auto& weak : members_) {
+            if (auto bucket = weak.lock()) {
+                state->buckets.push_back(bucket);
+                state->requests.push_back(bucket->request());
+            }
+        }
+    }
+    if (state->buckets.empty())
+        return;
+    state->results.resize(state->buckets.size());
+
+    // All members estimated from samples: only flow counts are due
+    auto now = std::chrono::steady_clock::now();
+    auto estimated = [now](auto& bucket) { return bucket->estimated(now); };
+    if (std::all_of(state->buckets.begin(), state->buckets.end(), estimated) &&
+        ++skipped_polls_ % sampled_poll_every_ != 0)
+        return;
+
+    if (shared_snapshots_) {
+        request_snapshot(std::move(state));
+        return;
+    }
+
+    ofp::flow_stats_request req;
+    req.table_id = table_;
+
+    try {
+        polling_ = true;
+        auto f = agent_->stream_flow_stats(req,
+            [state](OFAgent::sequence<of13::FlowStats>&& segment) {
+                attribute(*state, segment);
+                return true;
+            });
+
+        then(f, executor, pool_, [self = shared_from_this(), state](future<size_t> f) {
+            self->polling_ = false;
+            try {
+                f.get();
+            } catch (OFAgent::error const&) {
+                VLOG(10) << "Failed to get flow stats batch for dpid "
+                         << self->dpid_ << ":";
+                diagnostic_information::get().log();
+                return;
+            }
+            deliver(*state, std::chrono::steady_clock::now());
+        });
+    } catch (OFAgent::request_error const&) {
+        polling_ = false;
+        VLOG(10) << "Failed to request flow stats batch for dpid " << dpid_;
+    }
+}
+
+void FlowStatsBatch::request_snapshot(std::shared_ptr<poll> state)
+{
+    // Half the period: a dump taken for SwitchImpl since the last tick
+    // is fresh enough, the one this batch read last time never is
+    try {
+        polling_ = true;
+        auto f = agent_->request_table_snapshot(
+            table_, scaled(period_, scale_) / 2);
+
+        then(f, executor, pool_,
+            [self = shared_from_this(), state](future<ofp::table_snapshot> f) {
+                self->polling_ = false;
+                ofp::table_snapshot snapshot;
+                try {
+                    snapshot = f.get();
+                } catch (OFAgent::error const&) {
+                    VLOG(10) << "Failed to get stats table snapshot for dpid "
+                             << self->dpid_ << ":";
+                    diagnostic_information::get().log();
+                    return;
+                }
+                attribute(*state, snapshot.entries);
+                deliver(*state, snapshot.taken);
+            });
+    } catch (OFAgent::request_error const&) {
+        polling_ = false;
+        VLOG(10) << "Failed to request stats table snapshot for dpid " << dpid_;
+    }
+}
+
+void FlowStatsBatch::attribute(poll& state,
+                               OFAgent::sequence<of13::FlowStats>& entries)
+{
+    for (auto& fs : entries) {
+        for (size_t i = 0; i < state.requests.size(); ++i) {
+            if (not covers(state.requests[i], fs))
+                continue;
+            auto& res = state.results[i];
+            res.packets += fs.packet_count();
+            res.bytes += fs.byte_count();
+            res.flows += 1;
+        }
+    }
+}
+
+void FlowStatsBatch::deliver(poll& state,
+                             std::chrono::steady_clock::time_point taken)
+{
+    for (size_t i = 0; i < state.buckets.size(); ++i) {
+        state.buckets[i]->deliver(state.results[i], taken);
+    }
+}
+
 ///////////////////////////
 //        Manager        //
 ///////////////////////////
@@ -236,26 +995,111 @@ void FlowStatsBucketImpl::update()
 struct StatsBucketManager::implementation
 {
     OFServer* ofserver;
+    bool batch_polling {true};
+    bool shared_snapshots {true};
+    unsigned sampled_poll_every {10};
+    StatsBucketManager::duration poll_interval {1000};
+    continuation_pool pool; // refcounted by buckets deleted on Qt thread
     mutable boost::shared_mutex mutex;
     std::unordered_map<int, FlowStatsBucketImplWeakPtr> bucket;
     std::unordered_map<std::string, FlowStatsBucketImplWeakPtr> bucket_by_name;
+    std::unordered_map<int, std::weak_ptr<FlowStatsRollup>> rollup;
+    std::unordered_map<std::string, std::weak_ptr<FlowStatsRollup>> rollup_by_name;
+
+    // (dpid, table, period in ms) -> shared poller
+    using batch_key = std::tuple<uint64_t, uint8_t, int64_t>;
+    std::map<batch_key, FlowStatsBatchPtr> batches;
+
+    // dpid -> buckets its flow samples are attributed to
+    std::unordered_multimap<uint64_t, FlowStatsBucketImplWeakPtr> estimable;
+    std::mutex sampling_mutex;
+    std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> sampled_at;
+
+    // Tuned poll-interval-ms to the configured one, applied to the
+    // period of every bucket
+    std::atomic<double> scale {1.0};
+    PollTuning::handle tuning;
+
+    // Coalesced notifications, see notifyUpdates()
+    struct subscriber {
+        QObject* context;
+        std::vector<int> interest; // ascending, empty for all
+        StatsBucketManager::UpdatesHandler handler;
+        std::shared_ptr<std::atomic<bool>> active;
+    };
+    std::shared_ptr<UpdateBatch> updates {std::make_shared<UpdateBatch>()};
+    std::mutex subscribers_mutex;
+    std::unordered_map<uint64_t, subscriber> subscribers;
+    uint64_t next_subscriber {0};
+
+    void retime(double new_scale)
+    {
+        scale = new_scale;
+        boost::shared_lock< boost::shared_mutex > lock(mutex);
+        for (auto& b : bucket) {
+            if (auto ptr = b.second.lock())
+                ptr->retime(new_scale);
+        }
+        for (auto& b : batches) {
+            b.second->retime(new_scale);
+        }
+    }
 };
 
 StatsBucketManager::StatsBucketManager()
     : impl(new implementation)
 { }
 
-StatsBucketManager::~StatsBucketManager() noexcept = default;
+StatsBucketManager::~StatsBucketManager() noexcept
+{
+    impl->tuning.reset();
+}
 
-void StatsBucketManager::init(Loader* loader, const Config&)
+void StatsBucketManager::init(Loader* loader, const Config& rootConfig)
 {
     impl->ofserver = OFServer::get(loader);
+
+    const Config& config = config_cd(rootConfig, "stats-bucket-manager");
+    impl->batch_polling = config_get(config, "batch-polling", true);
+    impl->shared_snapshots = config_get(config, "shared-snapshots", true);
+    impl->sampled_poll_every = unsigned(std::max(
+        config_get(config, "sampled-poll-every", 10), 1));
+
+    impl->poll_interval = duration(config_get(config, "poll-interval-ms", 1000));
+    CHECK(impl->poll_interval.count() > 0) << "poll-interval-ms must be positive";
+    impl->tuning = PollTuning::global().add(
+        "stats-bucket-manager.poll-interval-ms", impl->poll_interval,
+        [impl = impl.get()](duration interval) {
+            impl->retime(double(interval.count()) /
+                         impl->poll_interval.count());
+        });
+
+    int notify_interval = config_get(config, "notify-interval-ms", 0);
+    if (notify_interval <= 0)
+        notify_interval = int(impl->poll_interval.count());
+    auto notify_timer = new QTimer(this);
+    connect(notify_timer, &QTimer::timeout, this, [this] { notifyUpdates(); });
+    notify_timer->start(notify_interval);
+
+    int threads = config_get(config, "continuation-threads", 0);
+    if (threads > 0) {
+        impl->pool = std::make_shared<work_stealing_executor>(threads);
+        LOG(INFO) << "Stats continuations run on " << threads << " threads";
+    }
+}
+
+auto StatsBucketManager::pollInterval() const -> duration
+{
+    return impl->poll_interval;
 }
 
 auto StatsBucketManager::bucket(int id) const
     -> FlowStatsBucketPtr
 {
     boost::shared_lock< boost::shared_mutex > lock(impl->mutex);
+    auto rollup_it = impl->rollup.find(id);
+    if (rollup_it != impl->rollup.end())
+        return rollup_it->second.lock();
     return impl->bucket.at(id).lock();
 }
 
@@ -264,9 +1108,12 @@ auto StatsBucketManager::bucket(std::string const& name) const
 {
     boost::shared_lock< boost::shared_mutex > lock(impl->mutex);
     auto bucket_it = impl->bucket_by_name.find(name);
-    if (bucket_it == impl->bucket_by_name.end())
-        return nullptr;
-    return bucket_it->second.lock();
+    if (bucket_it != impl->bucket_by_name.end())
+        return bucket_it->second.lock();
+    auto rollup_it = impl->rollup_by_name.find(name);
+    if (rollup_it != impl->rollup_by_name.end())
+        return rollup_it->second.lock();
+    return nullptr;
 }
 
 auto StatsBucketManager::aggregateFlows(duration poll_interval,
@@ -277,6 +1124,7 @@ auto StatsBucketManager::aggregateFlows(duration poll_interval,
     FlowStatsBucketImplPtr bucket {new FlowStatsBucketImpl(
         std::move(name),
         std::move(selector),
+        impl->pool,
         this
     ), std::mem_fn(&QObject::deleteLater)};
 
@@ -286,12 +1134,207 @@ auto StatsBucketManager::aggregateFlows(duration poll_interval,
         if (not bucket->name().empty()) {
             impl->bucket_by_name[bucket->name()] = bucket;
         }
+        if (bucket->estimable()) {
+            for (auto dpid : bucket->dpids())
+                impl->estimable.emplace(dpid, bucket);
+        }
     }
+    bucket->sampled_poll_every(impl->sampled_poll_every);
+    bucket->notify_to(impl->updates, bucket->id());
 
-    bucket->start(impl->ofserver, poll_interval);
+    if (impl->batch_polling && bucket->batchable()) {
+        FlowStatsBatchPtr batch;
+        bool created = false;
+        {
+            boost::unique_lock< boost::shared_mutex > lock(impl->mutex);
+            auto key = std::make_tuple(bucket->dpid(), bucket->request().table_id,
+                                       int64_t(poll_interval.count()));
+            auto& slot = impl->batches[key];
+            if (not slot) {
+                slot.reset(new FlowStatsBatch(bucket->dpid(),
+                                              bucket->request().table_id,
+                                              impl->shared_snapshots,
+                                              impl->sampled_poll_every,
+                                              impl->pool,
+                                              this),
+                           std::mem_fn(&QObject::deleteLater));
+                created = true;
+            }
+            batch = slot;
+        }
+        batch->join(bucket);
+        if (created) {
+            batch->start(impl->ofserver, poll_interval, impl->scale);
+        }
+    } else {
+        bucket->start(impl->ofserver, poll_interval, impl->scale);
+    }
     return bucket;
 }
 
+auto StatsBucketManager::aggregateBuckets(std::string name,
+                                          std::vector<FlowStatsBucketPtr> children)
+    -> FlowStatsBucketPtr
+{
+    CHECK(not children.empty()) << "Rollup " << name << " has no children";
+    for (size_t i = 0; i < children.size(); ++i) {
+        CHECK(dynamic_cast<RollupSource*>(children[i].get()))
+            << "Rollup " << name << ": bad child " << i;
+        for (size_t j = 0; j < i; ++j) {
+            CHECK(children[i].get() != children[j].get())
+                << "Rollup " << name << ": child " << children[i]->name()
+                << " is given twice";
+        }
+    }
+
+    FlowStatsRollupPtr rollup {new FlowStatsRollup(
+        std::move(name),
+        std::move(children),
+        this
+    ), std::mem_fn(&QObject::deleteLater)};
+
+    rollup->notify_to(impl->updates, rollup->id());
+    const auto& members = rollup->children();
+    for (size_t i = 0; i < members.size(); ++i) {
+        dynamic_cast<RollupSource*>(members[i].get())->add_parent(rollup, i);
+    }
+
+    boost::unique_lock< boost::shared_mutex > lock(impl->mutex);
+    impl->rollup[rollup->id()] = rollup;
+    if (not rollup->name().empty()) {
+        impl->rollup_by_name[rollup->name()] = rollup;
+    }
+    return rollup;
+}
+
+auto StatsBucketManager::subscribeUpdates(QObject* context,
+                                          std::vector<int> interest,
+                                          UpdatesHandler handler)
+    -> UpdatesHandle
+{
+    CHECK(context) << "Updates subscription needs a context";
+    std::sort(interest.begin(), interest.end());
+    interest.erase(std::unique(interest.begin(), interest.end()),
+                   interest.end());
+
+    std::lock_guard<std::mutex> lock(impl->subscribers_mutex);
+    uint64_t id = impl->next_subscriber++;
+    impl->subscribers.emplace(id, implementation::subscriber{
+        context, std::move(interest), std::move(handler),
+        std::make_shared<std::atomic<bool>>(true)
+    });
+    return UpdatesHandle(new updates_subscription(this, id));
+}
+
+void StatsBucketManager::unsubscribeUpdates(uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(impl->subscribers_mutex);
+    auto it = impl->subscribers.find(id);
+    if (it == impl->subscribers.end())
+        return;
+    *it->second.active = false; // drops deliveries still queued
+    impl->subscribers.erase(it);
+}
+
+// One emission per tick for all buckets sampled during it, instead of
+// an updated() per bucket and sample
+void StatsBucketManager::notifyUpdates()
+{
+    auto ids = impl->updates->take();
+    if (ids.empty())
+        return;
+    emit bucketsUpdated(span<const int>(ids));
+
+    std::vector<implementation::subscriber> subscribers;
+    {
+        std::lock_guard<std::mutex> lock(impl->subscribers_mutex);
+        for (auto& s : impl->subscribers)
+            subscribers.push_back(s.second);
+    }
+    for (auto& s : subscribers) {
+        std::vector<int> matched;
+        if (s.interest.empty()) {
+            matched = ids;
+        } else {
+            std::set_intersection(ids.begin(), ids.end(),
+                                  s.interest.begin(), s.interest.end(),
+                                  std::back_inserter(matched));
+        }
+        if (matched.empty())
+            continue;
+
+        if (s.context->thread() == thread()) {
+            if (*s.active)
+                s.handler(span<const int>(matched));
+            continue;
+        }
+        qt_executor(s.context).submit(
+            [handler = std::move(s.handler), active = std::move(s.active),
+             matched = std::move(matched)]
+            {
+                if (*active)
+                    handler(span<const int>(matched));
+            });
+    }
+}
+
+void StatsBucketManager::sampled(uint64_t dpid, const packet_fields& packet,
+                                 uint64_t packets, uint64_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(impl->sampling_mutex);
+        impl->sampled_at[dpid] = std::chrono::steady_clock::now();
+    }
+    boost::shared_lock< boost::shared_mutex > lock(impl->mutex);
+    auto range = impl->estimable.equal_range(dpid);
+    for (auto it = range.first; it != range.second; ++it) {
+        auto bucket = it->second.lock();
+        if (bucket && bucket->filter().matches(packet))
+            bucket->sample(packets, bytes);
+    }
+}
+
+void StatsBucketManager::flushSamples(duration fresh)
+{
+    auto now = std::chrono::steady_clock::now();
+    std::unordered_set<uint64_t> sampling;
+    {
+        std::lock_guard<std::mutex> lock(impl->sampling_mutex);
+        for (auto it = impl->sampled_at.begin(); it != impl->sampled_at.end(); ) {
+            if (now - it->second > fresh) {
+                it = impl->sampled_at.erase(it);
+            } else {
+                sampling.insert(it->first);
+                ++it;
+            }
+        }
+    }
+
+    // A bucket over several switches is estimated only while all of
+    // them send samples, and is flushed once
+    std::vector<FlowStatsBucketImplPtr> due;
+    {
+        boost::unique_lock< boost::shared_mutex > lock(impl->mutex);
+        for (auto it = impl->estimable.begin(); it != impl->estimable.end(); ) {
+            auto bucket = it->second.lock();
+            if (not bucket) {
+                it = impl->estimable.erase(it);
+                continue;
+            }
+            auto& dpids = bucket->dpids();
+            bool all = std::all_of(dpids.begin(), dpids.end(),
+                [&](uint64_t dpid) { return sampling.count(dpid) > 0; });
+            if (all && it->first == dpids.front())
+                due.push_back(std::move(bucket));
+            ++it;
+        }
+    }
+
+    for (auto& bucket : due) {
+        bucket->flush_samples(now, now + fresh);
+    }
+}
+
 } // namespace runos
 
 #include "StatsBucket.moc"
@@ -17,7 +17,10 @@
 #pragma once
 
 #include "api/Statistics.hpp"
+#include "api/TimeSeries.hpp"
+#include "lib/flow_sampling.hpp"
 #include "lib/kwargs.hpp"
+#include "lib/span.hpp"
 #include "Application.hpp"
 #include "Loader.hpp"
 #include <runos/core/safe_ptr.hpp>
@@ -25,9 +28,12 @@
 #include <fluid/of13/of13match.hh>
 
 #include <chrono>
+#include <cstdint>
+#include <functional>
 #include <string>
 #include <utility>
 #include <memory>
+#include <vector>
 
 namespace runos {
 
@@ -49,8 +55,13 @@ public:
     virtual std::string name() const = 0; // key
 
     virtual Statistics<FlowMeasurement> stats() const = 0;
+    // Speed history, `f` reads the samples in place: keep it short
+    virtual void history(TimeSeries::resolution r,
+                         const TimeSeries::visitor& f) const = 0;
     virtual ~FlowStatsBucket() { }
 signals:
+    // Every sample; see StatsBucketManager::bucketsUpdated() for
+    // many buckets
     void updated();
 };
 
@@ -74,6 +85,10 @@ public:
 
     using duration = std::chrono::milliseconds;
 
+    // Default period of buckets, `poll-interval-ms`. Tuning it at
+    // runtime scales the periods of all buckets in proportion.
+    duration pollInterval() const;
+
     template<class ...Args>
     FlowStatsBucketPtr aggregateFlows(duration poll_interval,
                                       std::string name,
@@ -100,9 +115,67 @@ public:
                                       std::string name,
                                       FlowSelector selector);
 
+    // Bucket over `children` (aggregateFlows() buckets or other
+    // rollups), e.g. a switch over its ports and the fabric over the
+    // switches. It polls nothing: each child sample moves its sum by
+    // the child's delta, so every counter is fetched once and a level
+    // costs O(children) per round. Rates are taken once all children
+    // have reported since the last round. Children are kept alive by
+    // the rollup and must not repeat.
+    FlowStatsBucketPtr aggregateBuckets(std::string name,
+                                        std::vector<FlowStatsBucketPtr> children);
+
+    // Flow sampling (sFlow, IPFIX) instead of polling, fed by the
+    // "flow-sampling" collector. `sampled` attributes traffic seen on
+    // the switch, already scaled by the sampling rate, to the buckets
+    // whose match holds for the packet. `flushSamples` appends the
+    // estimates of buckets whose switches sent samples within `fresh`;
+    // such buckets are polled every `sampled-poll-every` ticks, for
+    // the flow count only. Buckets selecting on cookies, output ports
+    // or fields a sampled header lacks are always polled.
+    void sampled(uint64_t dpid, const packet_fields& packet,
+                 uint64_t packets, uint64_t bytes);
+    void flushSamples(duration fresh);
+
+    // Coalesced notifications: the buckets sampled during a tick of
+    // `notify-interval-ms` (the poll interval by default) are announced
+    // together once per tick, ids ascending.
+    using UpdatesHandler = std::function<void(span<const int> ids)>;
+    class updates_subscription;
+    using UpdatesHandle = std::unique_ptr<updates_subscription>;
+    // `handler` runs on the thread of `context` with the sampled ones
+    // of `interest` (all buckets if empty), and not at all for a tick
+    // without any. Release the handle on that thread to stop the calls.
+    UpdatesHandle subscribeUpdates(QObject* context,
+                                   std::vector<int> interest,
+                                   UpdatesHandler handler);
+
+signals:
+    // All buckets sampled during the tick, on the manager's thread.
+    // The span lives for the call only: connect it directly.
+    void bucketsUpdated(span<const int> ids);
+
 private:
     struct implementation;
     std::unique_ptr<implementation> impl;
+
+    void unsubscribeUpdates(uint64_t id);
+    void notifyUpdates();
+};
+
+class StatsBucketManager::updates_subscription {
+public:
+    updates_subscription(StatsBucketManager* owner, uint64_t id)
+        : owner_(owner), id_(id)
+    { }
+    ~updates_subscription() { owner_->unsubscribeUpdates(id_); }
+
+    updates_subscription(const updates_subscription&) = delete;
+    updates_subscription& operator=(const updates_subscription&) = delete;
+
+private:
+    StatsBucketManager* owner_;
+    uint64_t id_;
 };
 
 } // namespace runos
@@ -20,6 +20,7 @@
 #include "Loader.hpp"
 #include "RestListener.hpp"
 #include "StatsBucket.hpp"
+#include "TimeSeriesRest.hpp"
 
 namespace runos {
 
@@ -54,6 +55,29 @@ struct BucketResource : rest::resource {
     }
 };
 
+struct BucketHistoryResource : rest::resource {
+    UnsafeFlowStatsBucketPtr bucket;
+    TimeSeries::resolution resolution;
+    double seconds;
+
+    explicit BucketHistoryResource(FlowStatsBucketPtr bucket,
+                                   TimeSeries::resolution r, double seconds)
+        : bucket(bucket.not_null()), resolution(r), seconds(seconds)
+    { }
+
+    rest::ptree Get() const override {
+        static const std::vector<std::string> fields {
+            "bytes", "packets", "flows"
+        };
+
+        rest::ptree ret;
+        bucket->history(resolution, [&](const TimeSeries::Series& series) {
+            ret = rest::history_to_ptree(series, fields, seconds);
+        });
+        return ret;
+    }
+};
+
 class StatsBucketRest : public Application
 {
     SIMPLE_APPLICATION(StatsBucketRest, "stats-bucket-rest")
@@ -77,6 +101,23 @@ public:
             }
         });
 
+        // e.g. /bucket/3/history/1s/60/ - last minute
+        rest_->mount(path_spec(std::string("/bucket/(\\d+)/history/") +
+                               rest::history_resolution_spec + "/(?:(\\d+)/)?"),
+                     [=](const path_match& m) {
+            try {
+                auto id = boost::lexical_cast<int>(m[1].str());
+                auto res = rest::parse_resolution(m[2].str());
+                double seconds = m[3].matched
+                    ? boost::lexical_cast<double>(m[3].str()) : 0;
+                return BucketHistoryResource { app->bucket(id), res, seconds };
+            } catch (const boost::bad_lexical_cast& e) {
+                THROW( rest::http_error(400), "Bad request: {}", e.what() ); // bad request
+            } catch (const bad_pointer_access& e) {
+                THROW( rest::http_error(404), "Bucket not found" );
+            }
+        });
+
         rest_->mount(path_spec("/bucket/([-_\\w]+)/"), [=](const path_match& m) {
             try {
                 auto name = m[1].str();
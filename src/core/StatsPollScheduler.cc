@@ -0,0 +1,253 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "StatsPollScheduler.hpp"
+
+#include "SwitchImpl.hpp"
+#include "api/OFAgent.hpp"
+#include "api/OFConnection.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace runos {
+
+StatsPollScheduler::StatsPollScheduler(Settings settings, QObject* parent)
+    : settings_(settings)
+    , random_(std::random_device{}())
+    , base_interval_(settings.interval)
+    , interval_(settings.interval)
+{
+    moveToThread(parent->thread());
+    setParent(parent);
+
+    tuning_ = PollTuning::global().add(
+        "switch-manager.stats-interval-ms", settings.interval,
+        [this](milliseconds interval) { set_interval(interval); });
+
+    async(executor, [this]() {
+        startTimer(settings_.tick.count());
+    });
+}
+
+void StatsPollScheduler::add(SwitchImplPtr sw)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // golden-ratio phases stay evenly spread for any number of switches
+    constexpr double golden = 0.6180339887498949;
+    double phase = std::fmod(sequence_++ * golden, 1.0);
+
+    Entry& e = entries_[sw->dpid()];
+    e.sw = sw;
+    e.in_flight = false;
+    e.nominal = clock::now()
+              + std::chrono::duration_cast<clock::duration>(phase * interval_);
+    e.due = jittered(e.nominal);
+    queue_.emplace(e.due, sw->dpid());
+
+    adapt();
+}
+
+void StatsPollScheduler::remove(uint64_t dpid)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    // stale heap items are dropped when popped
+    entries_.erase(dpid);
+    adapt();
+}
+
+void StatsPollScheduler::set_interval(milliseconds interval)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    base_interval_ = interval;
+    adapt();
+}
+
+auto StatsPollScheduler::jittered(clock::time_point nominal)
+    -> clock::time_point
+{
+    if (settings_.jitter <= 0.0)
+        return nominal;
+    std::uniform_real_distribution<double> dist(-settings_.jitter,
+                                                settings_.jitter);
+    return nominal + std::chrono::duration_cast<clock::duration>(
+                         dist(random_) * interval_);
+}
+
+void StatsPollScheduler::adapt()
+{
+    using std::chrono::duration_cast;
+    using fpmilliseconds = std::chrono::duration<double, std::milli>;
+
+    auto by_rate = fpmilliseconds(1000.0 * entries_.size()
+                                  / std::max(1u, settings_.max_polls_per_second));
+    auto by_latency = fpmilliseconds(settings_.latency_factor * latency_ms_);
+
+    auto interval = std::max({ fpmilliseconds(base_interval_),
+                               by_rate, by_latency });
+    interval = std::min(interval, fpmilliseconds(settings_.max_interval));
+
+    auto next = duration_cast<milliseconds>(interval);
+    if (next != interval_) {
+        VLOG(3) << "Stats polling interval is now " << next.count() << "ms"
+                << " for " << entries_.size() << " switches";
+        interval_ = next;
+    }
+}
+
+double StatsPollScheduler::slowdown(SwitchImpl& sw)
+{
+    auto conn = sw.connection();
+    if (not conn || not conn->alive())
+        return 1.0;
+    return conn->agent()->slowdown();
+}
+
+bool StatsPollScheduler::writable(SwitchImpl& sw)
+{
+    auto conn = sw.connection();
+    return not conn || conn->writable();
+}
+
+void StatsPollScheduler::timerEvent(QTimerEvent*)
+{
+    std::vector<SwitchImplPtr> due;
+    auto now = clock::now();
+    milliseconds snapshot_age;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Reuse a stats table dump of the buckets if it's that recent,
+        // but never one seen on the previous poll
+        snapshot_age = interval_ / 2;
+
+        while (not queue_.empty() && queue_.top().first <= now) {
+            auto item = queue_.top();
+            queue_.pop();
+
+            auto it = entries_.find(item.second);
+            if (it == entries_.end() || it->second.due != item.first)
+                continue; // removed or rescheduled
+
+            Entry& e = it->second;
+            auto sw = e.sw.lock();
+            if (not sw) {
+                entries_.erase(it);
+                continue;
+            }
+
+            if (e.in_flight && now - e.sent > settings_.max_interval) {
+                LOG(WARNING) << "Port stats reply from " << item.second
+                             << " is lost";
+                e.in_flight = false;
+                ++lost_;
+            }
+
+            if (e.in_flight || not writable(*sw)) {
+                ++skipped_;
+            } else {
+                e.in_flight = true;
+                e.sent = now;
+                due.push_back(std::move(sw));
+            }
+
+            // catch up without bursting if the timer was late;
+            // switches answering slower than usual are polled less often,
+            // and never more often than their device profile allows
+            double k = slowdown(*sw);
+            if (k > 1.0)
+                ++backed_off_;
+            auto step = std::chrono::duration_cast<clock::duration>(
+                            k * interval_);
+            step = std::max<clock::duration>(step,
+                                             sw->capabilities()->stats_interval);
+            do {
+                e.nominal += step;
+            } while (e.nominal <= now);
+            e.due = jittered(e.nominal);
+            queue_.emplace(e.due, item.second);
+        }
+
+        polls_ += due.size();
+        tick_polls_.push_back(due.size());
+        size_t window = std::max<size_t>(1, interval_ / settings_.tick);
+        while (tick_polls_.size() > window)
+            tick_polls_.pop_front();
+    }
+
+    for (auto& sw : due) {
+        auto dpid = sw->dpid();
+        sw->updateStats(snapshot_age).then(executor,
+                                           [this, dpid, now](future<void> f) {
+            try {
+                f.get();
+            } catch (...) {
+                VLOG(3) << "Port stats poll of " << dpid << " failed";
+            }
+            replied(dpid, now);
+        });
+    }
+}
+
+void StatsPollScheduler::replied(uint64_t dpid, clock::time_point sent)
+{
+    using fpmilliseconds = std::chrono::duration<double, std::milli>;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(dpid);
+    if (it == entries_.end() || not it->second.in_flight
+                             || it->second.sent != sent)
+        return;
+
+    it->second.in_flight = false;
+
+    constexpr double alpha = 0.2;
+    double latency = fpmilliseconds(clock::now() - sent).count();
+    latency_ms_ = latency_ms_ == 0.0
+                ? latency
+                : (1 - alpha) * latency_ms_ + alpha * latency;
+    adapt();
+}
+
+auto StatsPollScheduler::metrics() const -> Metrics
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Metrics ret;
+    ret.switches = entries_.size();
+    ret.interval = interval_;
+    ret.latency_ms = latency_ms_;
+    ret.polls = polls_;
+    ret.skipped = skipped_;
+    ret.lost = lost_;
+    ret.backed_off = backed_off_;
+
+    unsigned peak = 0;
+    double sum = 0;
+    for (auto n : tick_polls_) {
+        peak = std::max(peak, n);
+        sum += n;
+    }
+    ret.peak_per_tick = peak;
+    ret.mean_per_tick = tick_polls_.empty() ? 0.0 : sum / tick_polls_.size();
+    ret.spread = ret.mean_per_tick > 0 ? peak / ret.mean_per_tick : 0.0;
+    return ret;
+}
+
+} // namespace runos
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "lib/poll_tuning.hpp"
+#include "lib/qt_executor.hpp"
+
+#include <QtCore>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+namespace runos {
+
+class SwitchImpl;
+using SwitchImplPtr = std::shared_ptr<SwitchImpl>;
+
+/**
+ * Single timer driving port/queue/traffic stats polling for all switches.
+ *
+ * Every switch gets a phase inside the polling interval taken from the
+ * golden-ratio sequence, so any number of switches - including a mass
+ * reconnect - is spread evenly without reshuffling earlier ones. A small
+ * random jitter is applied around the phase, never accumulated.
+ *
+ * The interval grows with the switch count (max-polls-per-second) and
+ * with the measured reply latency, and a switch whose previous reply is
+ * still outstanding, or whose output is over its watermark (see
+ * OFConnection::writable), is skipped instead of being asked again. A switch
+ * answering k times slower than usual (OFAgent::slowdown) gets k times
+ * the interval, and never less than the stats interval of its device
+ * profile (drivers::Capabilities). The base interval is tunable at
+ * runtime as "switch-manager.stats-interval-ms" (see PollTuning).
+ */
+class StatsPollScheduler : public QObject {
+    Q_OBJECT
+public:
+    using clock = std::chrono::steady_clock;
+    using milliseconds = std::chrono::milliseconds;
+
+    struct Settings {
+        milliseconds interval {2000};
+        milliseconds max_interval {30000};
+        milliseconds tick {10};
+        unsigned max_polls_per_second {500};
+        double jitter {0.05}; // fraction of the interval
+        double latency_factor {4.0}; // interval >= factor * reply latency
+    };
+
+    struct Metrics {
+        size_t switches;
+        milliseconds interval;
+        double latency_ms; // moving average of port stats reply time
+        uint64_t polls;
+        uint64_t skipped; // previous reply outstanding or send backlog
+        uint64_t lost; // no reply within max_interval
+        uint64_t backed_off; // polls stretched for slow switches
+        // polls per tick over the last interval
+        unsigned peak_per_tick;
+        double mean_per_tick;
+        // peak / mean, 1.0 is perfectly even
+        double spread;
+    };
+
+    StatsPollScheduler(Settings settings, QObject* parent);
+
+    void add(SwitchImplPtr sw);
+    void remove(uint64_t dpid);
+    // New base interval, the adapted one follows on the next polls
+    void set_interval(milliseconds interval);
+
+    Metrics metrics() const;
+
+protected:
+    void timerEvent(QTimerEvent*) override;
+
+private:
+    struct Entry {
+        std::weak_ptr<SwitchImpl> sw;
+        clock::time_point nominal; // due time without jitter
+        clock::time_point due;
+        clock::time_point sent;
+        bool in_flight {false};
+    };
+
+    using due_item = std::pair<clock::time_point, uint64_t>;
+
+    const Settings settings_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<uint64_t, Entry> entries_;
+    std::priority_queue<due_item, std::vector<due_item>,
+                        std::greater<due_item>> queue_;
+    uint64_t sequence_ {0};
+    std::mt19937_64 random_;
+
+    milliseconds base_interval_;
+    milliseconds interval_;
+    double latency_ms_ {0.0};
+    uint64_t polls_ {0};
+    uint64_t skipped_ {0};
+    uint64_t lost_ {0};
+    uint64_t backed_off_ {0};
+    std::deque<unsigned> tick_polls_;
+
+    qt_executor executor {this};
+    PollTuning::handle tuning_; // last: released first
+
+    static double slowdown(SwitchImpl& sw);
+    // Polls wait while the switch's output is over its watermark
+    static bool writable(SwitchImpl& sw);
+    void adapt();
+    clock::time_point jittered(clock::time_point nominal);
+    void replied(uint64_t dpid, clock::time_point sent);
+};
+
+} // namespace runos
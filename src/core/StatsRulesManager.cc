@@ -16,10 +16,31 @@
 
 #include "StatsRulesManager.hpp"
 
+#include "api/OFAgent.hpp"
+#include "api/OFConnection.hpp"
+#include "lib/flow_mod_batch.hpp"
+#include "lib/table_occupancy.hpp"
+#include "oxm/openflow_basic.hh"
+#include "oxm/static_match.hh"
+
+#include <runos/core/future.hpp>
+#include <runos/core/logging.hpp>
+
+#include <boost/thread/executors/inline_executor.hpp>
+
+#include <algorithm>
+
 namespace runos {
 
+static const auto local_port_key = devicedb::PropertyKey::intern("local_port");
+// switch can't hold masked entries, or keeps them in a too small TCAM
+static const auto masked_match_key = devicedb::PropertyKey::intern("masked_match");
+
 REGISTER_APPLICATION(StatsRulesManager, {"stats-bucket-manager", ""})
 
+// stats table read back on the receive path
+static boost::inline_executor reconcile_executor;
+
 class RulesCreator {
 public:
     explicit RulesCreator(const PortPtr& port)
@@ -37,6 +58,7 @@ public:
         : dpid_(port->switch_()->dpid())
         , in_port_(port->number())
         , stag_(stag)
+        , endpoint_(true)
         , installation_table_(port->switch_()->tables.ep_statistics)
         , next_table_(port->switch_()->tables.admission)
         , matches_{ make_broadcast_match(),
@@ -54,7 +76,7 @@ public:
         auto names = bucketsNames();
         for (size_t i = 0; i < names.size(); ++i) {
             auto bucket = mgr->aggregateFlows(
-                std::chrono::seconds(1),
+                mgr->pollInterval(),
                 names[i],
                 flow_selector::dpid = {dpid_},
                 flow_selector::table = installation_table_,
@@ -73,28 +95,25 @@ public:
         return names;
     }
 
-    FlowModPtrSequence makeInstallRules() const
+    // Rules of the port, types which aren't read may be folded by the planner
+    std::vector<flow_rule> rules(const std::vector<bool>& counted) const
     {
-        FlowModPtrSequence rules;
         auto go_to_admission_table = of13::GoToTable(next_table_);
+        std::vector<uint8_t> instructions(go_to_admission_table.length());
+        go_to_admission_table.pack(instructions.data());
 
-        for (auto& match: matches_) {
-            auto rule = make_flow_mod(add_command, match);
-            rule->add_instruction(go_to_admission_table);
-            rules.emplace_back(std::move(rule));
-        }
-
-        return rules;
-    }
-
-    FlowModPtrSequence makeClearRules() const
-    {
-        FlowModPtrSequence rules;
-        for (auto& match: matches_) {
-            auto rule = make_flow_mod(delete_command, match);
-            rules.emplace_back(std::move(rule));
+        std::vector<flow_rule> ret;
+        for (size_t i = 0; i < matches_.size(); ++i) {
+            flow_rule rule;
+            rule.table = installation_table_;
+            rule.instructions = instructions;
+            // endpoint rules are always read by their buckets
+            rule.counted = endpoint_ || counted[i];
+            uint8_t oxm[64];
+            rule.set_match(oxm, write_match(oxm, i) - oxm);
+            ret.push_back(std::move(rule));
         }
-        return rules;
+        return ret;
     }
 
     static constexpr uint64_t cookie = 0x1500;
@@ -103,18 +122,38 @@ private:
     uint64_t dpid_;
     uint32_t in_port_;
     uint16_t stag_;
+    bool endpoint_ {false};
     uint8_t installation_table_;
     uint8_t next_table_;
     std::vector<of13::Match> matches_;
 
-    FlowModPtr make_flow_mod(uint8_t command, const of13::Match& match) const
+    // Same fields as matches_[i], encoded without of13::Match
+    uint8_t* write_match(uint8_t* out, size_t i) const
+    {
+        static const ethaddr broadcast(broadcast_mac);
+        static const oxm::field<oxm::eth_dst> multicast(
+            ethaddr(multicast_mac), ethaddr(multicast_mac_mask));
+
+        switch (i) {
+        case 0:
+            return write_fields<oxm::eth_dst>(out, broadcast);
+        case 1:
+            return write_fields<oxm::masked<oxm::eth_dst>>(out, multicast);
+        default:
+            return write_fields<>(out);
+        }
+    }
+
+    template<class... Slots, class... Args>
+    uint8_t* write_fields(uint8_t* out, const Args&... args) const
     {
-        auto fmp = std::make_shared<of13::FlowMod>();
-        fmp->cookie(cookie);
-        fmp->command(command);
-        fmp->table_id(installation_table_);
-        fmp->match(match);
-        return fmp;
+        if (stag_ != 0) {
+            using match = oxm::static_match<oxm::in_port, Slots..., oxm::vlan_vid>;
+            return match::pack(out, in_port_, args..., stag_);
+        } else {
+            using match = oxm::static_match<oxm::in_port, Slots...>;
+            return match::pack(out, in_port_, args...);
+        }
     }
 
     of13::Match make_unicast_match() const
@@ -158,16 +197,155 @@ private:
                std::to_string(stag_);
     }
 
-    static constexpr uint8_t add_command = of13::OFPFC_ADD;
-    static constexpr uint8_t delete_command = of13::OFPFC_DELETE;
     static constexpr auto broadcast_mac = "ff:ff:ff:ff:ff:ff";
     static constexpr auto multicast_mac = "01:00:00:00:00:00";
     static constexpr auto multicast_mac_mask = "ff:00:00:00:00:00";
 };
 
-void StatsRulesManager::init(Loader* loader, const Config&)
+// Rules of a switch change in one atomic bundle, fire-and-forget as
+// before: buckets never see a half of their rules
+static void send_rules(const SwitchPtr& sw, FlowModBatch& batch)
+{
+    try {
+        sw->connection()->agent()->bundle(batch);
+    } catch (const OFAgent::request_error&) {
+        // switch has gone, its rules went with it
+    }
+}
+
+// Flow entry as read back from the switch
+static flow_rule to_rule(of13::FlowStats& fs)
+{
+    flow_rule rule;
+    rule.table = fs.table_id();
+    rule.priority = fs.priority();
+
+    // ofp_match header (type, length) precedes the OXM TLVs,
+    // pack() pads the structure to 8 bytes
+    auto match = fs.match();
+    std::vector<uint8_t> buf((match.length() + 7) / 8 * 8);
+    match.pack(buf.data());
+    rule.set_match(buf.data() + 4, match.length() - 4);
+
+    auto instructions = fs.instructions();
+    rule.instructions.resize(instructions.length());
+    instructions.pack(rule.instructions.data());
+    return rule;
+}
+
+static void send_wipe(const SwitchPtr& sw)
+{
+    of13::FlowMod cl;
+    cl.command(of13::OFPFC_DELETE);
+    cl.cookie(RulesCreator::cookie);
+    cl.table_id(sw->tables.statistics);
+    sw->connection()->send(cl);
+}
+
+static void write_rule(FlowModBatch& batch, const flow_rule& rule, uint8_t command)
+{
+    FlowModBatch::header h;
+    h.cookie = RulesCreator::cookie;
+    h.command = command;
+    h.table_id = rule.table;
+    h.priority = rule.priority;
+    batch.add(h);
+    rule.pack_match(batch.oxm_space(rule.match_length()));
+    if (command != of13::OFPFC_DELETE_STRICT) {
+        std::copy(rule.instructions.begin(), rule.instructions.end(),
+                  batch.instruction_space(rule.instructions.size()));
+    }
+}
+
+void StatsRulesManager::init(Loader* loader, const Config& rootConfig)
 {
     bucket_mgr_ = StatsBucketManager::get(loader);
+
+    // Per port traffic counters which are read, in RulesCreator order
+    const Config& config = config_cd(rootConfig, "stats-rules-manager");
+    std::string types = config_get(config, "counted-traffic",
+                                   "broadcast,multicast,unicast");
+    for (auto type : {"broadcast", "multicast", "unicast"}) {
+        counted_.push_back(types.find(type) != std::string::npos);
+    }
+    warm_restart_ = config_get(config, "warm-restart", false);
+}
+
+bool StatsRulesManager::update(const SwitchPtr& sw, rules_key key,
+                               std::vector<flow_rule> rules)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& state = switches_[sw->dpid()];
+    auto requested = state.requested;
+    if (rules.empty())
+        requested.erase(key);
+    else
+        requested[key] = std::move(rules);
+
+    return apply(sw, state, std::move(requested));
+}
+
+bool StatsRulesManager::apply(const SwitchPtr& sw, switch_rules& state,
+                              std::map<rules_key, std::vector<flow_rule>> requested)
+{
+    if (state.reconciling) {
+        state.requested = std::move(requested);
+        return true;
+    }
+
+    std::vector<flow_rule> all;
+    for (const auto& it : requested) {
+        all.insert(all.end(), it.second.begin(), it.second.end());
+    }
+    auto plan = rule_plan::make(std::move(all), sw->property(masked_match_key, true));
+
+    auto has = [](const std::vector<flow_rule>& rules, const flow_rule& rule) {
+        return std::any_of(rules.begin(), rules.end(), [&](const flow_rule& r) {
+            return r.same_entry(rule) && r.instructions == rule.instructions;
+        });
+    };
+
+    // new entries go first, so that traffic doesn't miss a merged rule
+    FlowModBatch batch;
+    std::map<uint8_t, uint32_t> adds;
+    for (const auto& rule : plan.rules) {
+        if (not has(state.installed, rule)) {
+            write_rule(batch, rule, of13::OFPFC_ADD);
+            ++adds[rule.table];
+        }
+    }
+    for (const auto& rule : state.installed) {
+        if (not has(plan.rules, rule))
+            write_rule(batch, rule, of13::OFPFC_DELETE_STRICT);
+    }
+
+    // ADDs take the reservation as they're sent
+    auto conn = sw->connection();
+    if (conn and not adds.empty()) {
+        auto& occupancy = conn->agent()->occupancy();
+        for (auto it = adds.begin(); it != adds.end(); ++it) {
+            if (occupancy.reserve(it->first, it->second))
+                continue;
+            for (auto r = adds.begin(); r != it; ++r)
+                occupancy.release(r->first, r->second);
+            LOG(WARNING) << "[StatsRulesManager] No room for " << it->second
+                         << " stats rules in table " << unsigned(it->first)
+                         << " of switch " << sw->dpid();
+            if (state.requested.empty())
+                switches_.erase(sw->dpid());
+            return false;
+        }
+    }
+
+    state.requested = std::move(requested);
+    state.installed = std::move(plan.rules);
+    state.requested_count = plan.requested;
+
+    if (not batch.empty())
+        send_rules(sw, batch);
+    if (state.requested.empty())
+        switches_.erase(sw->dpid());
+    return true;
 }
 
 BucketsMap StatsRulesManager::installEndpointRules(PortPtr port,
@@ -178,8 +356,9 @@ BucketsMap StatsRulesManager::installEndpointRules(PortPtr port,
         return BucketsMap();
     }
     RulesCreator creator(port, stag);
-    for (auto& rule: creator.makeInstallRules()) {
-        sw->connection()->send(*rule);
+    if (not update(sw, {sw->tables.ep_statistics, port->number(), stag},
+                   creator.rules(counted_))) {
+        return BucketsMap();
     }
     return creator.makeBuckets(bucket_mgr_);
 }
@@ -192,36 +371,44 @@ BucketsNames StatsRulesManager::deleteEndpointRules(PortPtr port,
         return BucketsNames();
     }
     RulesCreator creator(port, stag);
-    for (auto& rule: creator.makeClearRules()) {
-        sw->connection()->send(*rule);
-    }
+    update(sw, {sw->tables.ep_statistics, port->number(), stag}, {});
     return creator.bucketsNames();
 }
 
 void StatsRulesManager::installRules(PortPtr new_port)
 {
     auto sw = new_port->switch_();
-    if (sw->property("local_port", of13::OFPP_LOCAL) == new_port->number() ||
+    if (sw->property(local_port_key, of13::OFPP_LOCAL) == new_port->number() ||
         sw->tables.statistics == Switch::Tables::no_table) {
         return;
     }
     RulesCreator creator(new_port);
-    for (auto& rule: creator.makeInstallRules()) {
-        sw->connection()->send(*rule);
-    }
+    update(sw, {sw->tables.statistics, new_port->number(), 0},
+           creator.rules(counted_));
 }
 
 void StatsRulesManager::deleteRules(PortPtr down_port)
 {
     auto sw = down_port->switch_();
-    if (sw->property("local_port", of13::OFPP_LOCAL) == down_port->number() ||
+    if (sw->property(local_port_key, of13::OFPP_LOCAL) == down_port->number() ||
         sw->tables.statistics == Switch::Tables::no_table) {
         return;
     }
-    RulesCreator creator(down_port);
-    for (auto& rule: creator.makeClearRules()) {
-        sw->connection()->send(*rule);
+    update(sw, {sw->tables.statistics, down_port->number(), 0}, {});
+}
+
+std::vector<StatsRulesManager::TableUsage> StatsRulesManager::tableUsage() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<TableUsage> ret;
+    for (const auto& it : switches_) {
+        ret.push_back(TableUsage{ it.first, it.second.requested_count,
+                                  it.second.installed.size() });
     }
+    std::sort(ret.begin(), ret.end(), [](const TableUsage& a, const TableUsage& b) {
+        return a.dpid < b.dpid;
+    });
+    return ret;
 }
 
 void StatsRulesManager::clearStatsTable(SwitchPtr sw)
@@ -230,11 +417,87 @@ void StatsRulesManager::clearStatsTable(SwitchPtr sw)
         return;
     }
 
-    of13::FlowMod cl;
-    cl.command(of13::OFPFC_DELETE);
-    cl.cookie(RulesCreator::cookie);
-    cl.table_id(sw->tables.statistics);
-    sw->connection()->send(cl);
+    // Keep what the switch already has, port rules requested before
+    // the reply are planned against it
+    if (warm_restart_) {
+        ofp::flow_stats_request req;
+        req.table_id = sw->tables.statistics;
+        req.cookie = RulesCreator::cookie;
+        req.cookie_mask = 0xFFFFFFFFFFFFFFFFULL;
+
+        forget(sw->dpid(), sw->tables.statistics);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            switches_[sw->dpid()].reconciling = true;
+        }
+        try {
+            sw->connection()->agent()->request_flow_stats(req).then(
+                reconcile_executor,
+                [this, sw](future<std::vector<of13::FlowStats>> f) {
+                    std::vector<of13::FlowStats> entries;
+                    try {
+                        entries = f.get();
+                    } catch (const OFAgent::error&) {
+                        LOG(WARNING) << "[StatsRulesManager] Can't read stats "
+                                     << "table of switch " << sw->dpid()
+                                     << ", reinstalling its rules";
+                        send_wipe(sw);
+                    }
+                    reconcile(sw, std::move(entries));
+                });
+        } catch (const OFAgent::request_error&) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            switches_.erase(sw->dpid());
+        }
+        return;
+    }
+
+    send_wipe(sw);
+
+    // Port rules are gone, endpoint ones live in their own table
+    forget(sw->dpid(), sw->tables.statistics);
+}
+
+void StatsRulesManager::reconcile(const SwitchPtr& sw,
+                                  std::vector<of13::FlowStats> entries)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = switches_.find(sw->dpid());
+    if (it == switches_.end() || not it->second.reconciling)
+        return;
+
+    auto& state = it->second;
+    state.reconciling = false;
+    for (auto& fs : entries) {
+        state.installed.push_back(to_rule(fs));
+    }
+    VLOG(1) << "[StatsRulesManager] Switch " << sw->dpid() << " keeps "
+            << entries.size() << " stats rules";
+
+    auto requested = state.requested;
+    apply(sw, state, std::move(requested));
+}
+
+void StatsRulesManager::forget(uint64_t dpid, uint8_t table)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = switches_.find(dpid);
+    if (it == switches_.end())
+        return;
+    auto& state = it->second;
+    for (auto r = state.requested.begin(); r != state.requested.end(); ) {
+        r = std::get<0>(r->first) == table ? state.requested.erase(r) : std::next(r);
+    }
+    state.installed.erase(
+        std::remove_if(state.installed.begin(), state.installed.end(),
+                       [table](const flow_rule& r) { return r.table == table; }),
+        state.installed.end());
+    state.requested_count = 0;
+    for (const auto& r : state.requested) {
+        state.requested_count += r.second.size();
+    }
+    if (state.requested.empty())
+        switches_.erase(it);
 }
 
 } // namespace runos
@@ -21,9 +21,14 @@
 #include "api/Port.hpp"
 #include "api/Switch.hpp"
 #include "StatsBucket.hpp"
+#include "lib/rule_planner.hpp"
 
 #include <fluid/of13msg.hh>
 
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <tuple>
 #include <vector>
 #include <memory>
 
@@ -40,7 +45,7 @@ class StatsRulesManager : public Application
 {
     SIMPLE_APPLICATION(StatsRulesManager, "stats-rules-manager")
 public:
-    void init(Loader* loader, const Config&) override;
+    void init(Loader* loader, const Config& config) override;
 
     BucketsMap installEndpointRules(PortPtr port, uint16_t stag);
     BucketsNames deleteEndpointRules(PortPtr port, uint16_t stag);
@@ -52,8 +57,42 @@ public slots:
 public:
     void clearStatsTable(SwitchPtr sw);
 
+    // Flow entries the rules of a switch take after planning
+    struct TableUsage {
+        uint64_t dpid;
+        size_t requested;
+        size_t installed;
+    };
+    std::vector<TableUsage> tableUsage() const;
+
 private:
     StatsBucketManager* bucket_mgr_;
+    std::vector<bool> counted_; // by traffic type
+    bool warm_restart_ {false};
+
+    // (table, port, stag)
+    using rules_key = std::tuple<uint8_t, uint32_t, uint16_t>;
+    struct switch_rules {
+        std::map<rules_key, std::vector<flow_rule>> requested;
+        size_t requested_count {0};
+        std::vector<flow_rule> installed;
+        // Stats table is being read back, nothing is sent until then
+        bool reconciling {false};
+    };
+    mutable std::mutex mutex_;
+    std::unordered_map<uint64_t, switch_rules> switches_;
+
+    // Replaces rules of `key` (removes if empty), re-plans the switch
+    // and sends the difference with what is installed. Changes nothing
+    // if new entries don't fit into the tables.
+    bool update(const SwitchPtr& sw, rules_key key, std::vector<flow_rule> rules);
+    bool apply(const SwitchPtr& sw, switch_rules& state,
+               std::map<rules_key, std::vector<flow_rule>> requested);
+    // Drops what is known about the stats table of the switch
+    void forget(uint64_t dpid, uint8_t table);
+    // Warm restart: takes the stats rules read from the switch as
+    // installed and sends only the difference with the requested ones
+    void reconcile(const SwitchPtr& sw, std::vector<of13::FlowStats> entries);
 };
 
 } // namespace runos
@@ -133,6 +133,32 @@ private:
     }
 };
 
+struct StatsRulesTables : rest::resource
+{
+    StatsRulesManager* app;
+
+    explicit StatsRulesTables(StatsRulesManager* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override {
+        rest::ptree root;
+        rest::ptree switches;
+
+        for (const auto& u : app->tableUsage()) {
+            rest::ptree upt;
+            upt.put("dpid", u.dpid);
+            upt.put("requested", u.requested);
+            upt.put("installed", u.installed);
+            upt.put("saved", u.requested - u.installed);
+            switches.push_back(std::make_pair("", std::move(upt)));
+        }
+        root.add_child("array", switches);
+        root.put("_size", switches.size());
+        return root;
+    }
+};
+
 class StatsRulesManagerRest : public Application, public AppInterface
 {
 SIMPLE_APPLICATION(StatsRulesManagerRest, "stats-rules-manager-rest")
@@ -145,6 +171,11 @@ public:
         auto rest_ = RestListener::get(loader);
         auto rules_mgr = StatsRulesManager::get(loader);
 
+        rest_->mount(path_spec("/stats-rules/tables/"), [=](const path_match&)
+        {
+            return StatsRulesTables{rules_mgr};
+        });
+
         rest_->mount(path_spec("/switches/(\\d+)/ports/(\\d+)/"
                                "vlan/(\\d+)/traffic_stats/"
                                "(?:(multicast|broadcast|unicast)/)?"),
@@ -18,22 +18,22 @@
 
 #include "PortImpl.hpp"
 #include "api/OFAgent.hpp"
+#include "lib/key_buckets.hpp"
 
 #include <runos/core/assert.hpp>
 #include <runos/core/throw.hpp>
 #include <runos/core/logging.hpp>
 #include <runos/core/catch_all.hpp>
+#include <runos/core/future.hpp>
 
 //#include <range/v3/all.hpp>
 #include <range/v3/algorithm/find_if.hpp>
 #include <range/v3/view/all.hpp>
-#include <range/v3/view/group_by.hpp>
 #include <range/v3/view/transform.hpp>
 #include <range/v3/view/zip.hpp>
 #include <range/v3/view/map.hpp>
-#include <range/v3/action/sort.hpp>
 
-#include <boost/lexical_cast.hpp>
+#include <algorithm>
 #include <iterator> // back_inserter
 #include <utility> // move
 #include <chrono>
@@ -43,9 +43,13 @@ namespace runos {
 
 SwitchImpl::SwitchImpl(of13::FeaturesReply& fr,
                        Rc<DeviceDb> propdb,
+                       flap_damping::settings link_damping,
+                       bool live_watch,
+                       StatsTiers stats_tiers,
                        OFConnectionPtr conn,
                        QObject* parent)
-    : conn_{conn}, propdb_{propdb},
+    : conn_{conn}, propdb_{propdb}, link_damping_{link_damping},
+      live_watch_{live_watch}, stats_tiers_{std::move(stats_tiers)},
       maintenance_{false}
 {
     dpid_ = fr.datapath_id();
@@ -55,72 +59,76 @@ SwitchImpl::SwitchImpl(of13::FeaturesReply& fr,
 
     moveToThread(parent->thread());
     setParent(parent);
+}
 
-    async(executor, [this]() {
-        constexpr static auto stats_update_interval
-            = std::chrono::seconds(2);
-        startTimer(std::chrono::milliseconds(stats_update_interval).count());
-    });
+SwitchImpl::PropertySlot const*
+SwitchImpl::property_slot(std::string_view name) const
+{
+    auto key = devicedb::PropertyKey::find(name);
+    if (not key || key->id() >= property_.size())
+        return nullptr;
+    auto& slot = property_[key->id()];
+    return slot.value ? &slot : nullptr;
+}
 
-    set_up();
+devicedb::Value const* SwitchImpl::property(devicedb::PropertyKey key) const
+{
+    if (key.id() >= property_.size())
+        return nullptr;
+    auto& value = property_[key.id()].value;
+    return value ? &*value : nullptr;
 }
 
 std::any const& SwitchImpl::property(std::string_view name) const {
     static std::any none;
-    auto it = property_.find(name);
-    return it != property_.end() ? it->second : none;
+    auto slot = property_slot(name);
+    return slot ? slot->any : none;
 }
 
 int64_t SwitchImpl::property(std::string_view name, int64_t def_val) const {
-    auto it = property_.find(name);
-    return it != property_.end() ? std::any_cast<int64_t>(it->second) : def_val;
+    auto slot = property_slot(name);
+    return slot ? std::get<int64_t>(*slot->value) : def_val;
 }
 
 uint64_t SwitchImpl::property(std::string_view name, uint64_t def_val) const {
-    auto it = property_.find(name);
-    return it != property_.end()
-               ? static_cast<uint64_t>(std::any_cast<int64_t>(it->second))
-               : def_val;
+    auto slot = property_slot(name);
+    return slot ? static_cast<uint64_t>(std::get<int64_t>(*slot->value))
+                : def_val;
 }
 
 uint32_t SwitchImpl::property(std::string_view name, uint32_t def_val) const {
-    auto it = property_.find(name);
-    return it != property_.end()
-               ? static_cast<uint32_t>(std::any_cast<int64_t>(it->second))
-               : def_val;
+    auto slot = property_slot(name);
+    return slot ? static_cast<uint32_t>(std::get<int64_t>(*slot->value))
+                : def_val;
 }
 
 uint16_t SwitchImpl::property(std::string_view name, uint16_t def_val) const {
-    auto it = property_.find(name);
-    return it != property_.end()
-               ? static_cast<uint16_t>(std::any_cast<int64_t>(it->second))
-               : def_val;
+    auto slot = property_slot(name);
+    return slot ? static_cast<uint16_t>(std::get<int64_t>(*slot->value))
+                : def_val;
 }
 
 uint8_t SwitchImpl::property(std::string_view name, uint8_t def_val) const {
-    auto it = property_.find(name);
-    return it != property_.end()
-               ? static_cast<uint8_t>(std::any_cast<int64_t>(it->second))
-               : def_val;
+    auto slot = property_slot(name);
+    return slot ? static_cast<uint8_t>(std::get<int64_t>(*slot->value))
+                : def_val;
 }
 
 int SwitchImpl::property(std::string_view name, int def_val) const {
-    auto it = property_.find(name);
-    return it != property_.end()
-               ? static_cast<int>(std::any_cast<int64_t>(it->second))
-               : def_val;
+    auto slot = property_slot(name);
+    return slot ? static_cast<int>(std::get<int64_t>(*slot->value))
+                : def_val;
 }
 
 bool SwitchImpl::property(std::string_view name, bool def_val) const {
-    auto it = property_.find(name);
-    return it != property_.end() ? std::any_cast<bool>(it->second) : def_val;
+    auto slot = property_slot(name);
+    return slot ? std::get<bool>(*slot->value) : def_val;
 }
 
 std::string SwitchImpl::property(std::string_view name, std::string def_val) const {
-    auto it = property_.find(name);
-    return it != property_.end()
-        ? boost::lexical_cast<std::string>(std::any_cast<std::string_view>(it->second))
-        : def_val;
+    auto slot = property_slot(name);
+    return slot ? std::string(std::get<std::string_view>(*slot->value))
+                : def_val;
 }
 
 unsigned SwitchImpl::miss_send_len() const
@@ -156,26 +164,47 @@ safe::shared_ptr<Port> SwitchImpl::port(unsigned port_no) const
 
 safe::shared_ptr<PortImpl> SwitchImpl::port_impl(unsigned port_no) const
 {
-    boost::shared_lock< boost::shared_mutex > rlock(pmutex);
-    auto port_data = ports_.find(port_no);
-    return (port_data != ports_.end()) ? port_data->second : nullptr;
+    auto snapshot = std::atomic_load(&port_snapshot_);
+    auto& impls = snapshot->impls;
+    auto it = std::lower_bound(impls.begin(), impls.end(), port_no,
+                               [](const PortImplPtr& p, unsigned no)
+                               { return p->number() < no; });
+    return (it != impls.end() && (*it)->number() == port_no) ? *it : nullptr;
 }
 
 safe::shared_ptr<Port> SwitchImpl::port(const ethaddr& hw_addr) const
 {
-    boost::shared_lock< boost::shared_mutex > rlock(pmutex);
-    using value_type = std::pair<unsigned, PortImplPtr>;
-    auto hw_addr_equal = [&](const value_type& p)
-                         { return hw_addr == p.second->hw_addr(); };
-    auto it = ranges::find_if( ports_, hw_addr_equal );
+    auto snapshot = std::atomic_load(&port_snapshot_);
+    auto hw_addr_equal = [&](const PortImplPtr& p)
+                         { return hw_addr == p->hw_addr(); };
+    auto it = ranges::find_if( snapshot->impls, hw_addr_equal );
 
-    return (it != ports_.end()) ? it->second : nullptr;
+    return (it != snapshot->impls.end()) ? *it : nullptr;
 }
 
 std::vector<PortPtr> SwitchImpl::ports() const
 {
-    boost::shared_lock< boost::shared_mutex > rlock(pmutex);
-    return ports_ | ranges::view::values;
+    return std::atomic_load(&port_snapshot_)->ports;
+}
+
+auto SwitchImpl::ports_snapshot() const -> std::shared_ptr<const PortList>
+{
+    auto snapshot = std::atomic_load(&port_snapshot_);
+    return { snapshot, &snapshot->ports };
+}
+
+// Warning: requries external locking
+void SwitchImpl::publish_ports()
+{
+    auto next = std::make_shared<PortSnapshot>();
+    next->ports.reserve(ports_.size());
+    next->impls.reserve(ports_.size());
+    for (auto& p : ports_) {
+        next->ports.push_back(p.second);
+        next->impls.push_back(p.second);
+    }
+    std::atomic_store(&port_snapshot_,
+                      std::shared_ptr<const PortSnapshot>(std::move(next)));
 }
 
 // Warning: requries external locking
@@ -186,6 +215,7 @@ std::map<unsigned, PortImplPtr>::iterator SwitchImpl::delete_port(unsigned no)
     CHECK(it != ports_.end());
     port->set_offline();
     auto ret = ports_.erase(it);
+    publish_ports();
     emit portDeleted(port);
     return ret;
 }
@@ -197,6 +227,7 @@ void SwitchImpl::add_port(of13::Port ofport)
     auto port = std::make_shared<PortImpl>(self, ofport, this);
     auto ret = ports_.emplace(ofport.port_no(), port);
     CHECK(ret.second); // inserted
+    publish_ports();
     emit portAdded(port);
     port->start();
 }
@@ -271,11 +302,15 @@ void SwitchImpl::update_props()
                          .description(description_)
                          .execute();
 
-    property_.clear();
+    std::vector<PropertySlot> slots;
     for (auto& prop : props) {
-        property_.insert(std::move(prop));
+        if (prop.key.id() >= slots.size())
+            slots.resize(prop.key.id() + 1);
+        auto& slot = slots[prop.key.id()];
+        slot.value = prop.value;
+        slot.any = std::visit([](auto x) -> std::any { return x; }, prop.value);
     }
-    
+    property_ = std::move(slots);
 }
 
 void SwitchImpl::init_tables()
@@ -294,10 +329,7 @@ void SwitchImpl::init_aux_address()
 {
     std::string peer = conn_->peer_address();
     std::string ip = peer.substr(0, peer.find(":"));
-    auto it = property_.find("aux_address");
-    aux_address_ = it != property_.end()
-                    ? boost::lexical_cast<std::string>(std::any_cast<std::string_view>(it->second))
-                    : ip;
+    aux_address_ = property("aux_address", ip);
 }
 
 void SwitchImpl::set_up()
@@ -350,9 +382,8 @@ void SwitchImpl::set_down()
 {
     is_up = false;
 
-    boost::shared_lock< boost::shared_mutex > rlock(pmutex);
-    for (auto p : ports_) {
-        p.second->set_offline();
+    for (auto& port : std::atomic_load(&port_snapshot_)->impls) {
+        port->set_offline();
     }
     emit switchDown(shared_from_this());
 }
@@ -424,106 +455,173 @@ auto SwitchImpl::modify() -> SwitchModPtr
     return std::make_unique<SwitchModImpl>(shared_from_this());
 }
 
-void SwitchImpl::timerEvent(QTimerEvent*)
+void SwitchImpl::push_counters(unsigned port_no, PortMeasurement<uint64_t> m,
+                               std::chrono::steady_clock::time_point fresh_until)
 {
-    updateStats();
+    pushed_until_ = fresh_until.time_since_epoch().count();
+    // The agent has no port durations: timed like the switches that
+    // leave them zero in port stats
+    using fpseconds = std::chrono::duration<double>;
+    double time = std::chrono::duration_cast<fpseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    async(executor, [self = shared_from_this(), port_no, m, time]() {
+        try {
+            self->port_impl(port_no)->process_counters(m, time);
+        } catch (bad_pointer_access&) {
+            VLOG(5) << "Pushed counters for unknown port " << port_no
+                    << " of dpid " << self->dpid();
+        }
+    });
 }
 
-void SwitchImpl::updateStats()
+future<void> SwitchImpl::updateStats(std::chrono::milliseconds snapshot_age)
 {
     VLOG(10) << "updateStats()";
     auto self = shared_from_this();
 
     if (not connection()->alive()) {
         VLOG(3) << "Request to offline switch";
-        return;
+        return make_ready_future();
     }
 
     try {
         auto agent = connection()->agent();
 
-        agent->request_port_stats().then(executor,
-            [self](future<OFAgent::sequence<of13::PortStats>> stats) {
-                VLOG(10) << "Entering port stats continuation";
+        auto process_ports = [self](OFAgent::sequence<of13::PortStats> stats) {
+            for (auto& ps : stats) try {
+                if (self->property("local_port", of13::OFPP_LOCAL) != ps.port_no())
+                    self->port_impl(ps.port_no())->process_event(ps);
+            } catch (bad_pointer_access& ex) {
+                LOG(WARNING) << "Can't find port " << ps.port_no();
+            }
+        };
+        auto process_queues = [self](OFAgent::sequence<of13::QueueStats> stats) {
+            key_buckets<uint32_t, of13::QueueStats> by_port(stats,
+                [](of13::QueueStats& qs) {
+                    return std::optional<uint32_t>(qs.port_no());
+                });
+
+            for (size_t i = 0; i < by_port.size(); ++i) {
+                self->port_impl(by_port.key(i))->process_event(by_port[i]);
+            }
+        };
+
+        // Edge ports only come with every Nth poll
+        unsigned every = std::max(stats_tiers_.edge_every, 1u);
+        bool all = stats_polls_++ % every == 0;
+        auto snapshot = std::atomic_load(&port_snapshot_);
+        std::vector<PortImplPtr> due;
+        if (not all) {
+            for (auto& port : snapshot->impls) {
+                if (port->core() || stats_tiers_.trunks.count(port->number()))
+                    due.push_back(port);
+            }
+        }
 
-                for (auto& ps : stats.get()) try {
-                    if (self->property("local_port", of13::OFPP_LOCAL) != ps.port_no())
-                        self->port_impl(ps.port_no())->process_event(ps);
-                } catch (bad_pointer_access& ex) {
-                    LOG(WARNING) << "Can't find port " << ps.port_no();
-                }
+        // counters pushed by sFlow are recent enough
+        bool pushed = std::chrono::steady_clock::now().time_since_epoch().count()
+                    < pushed_until_;
+
+        future<void> ret;
+        // A port stats entry is 112 bytes, a request and its reply
+        // header about half of that: one by one is cheaper up to a
+        // quarter of the ports
+        if (pushed) {
+            ret = make_ready_future();
+        } else if (all || due.size() * 4 > snapshot->impls.size()) {
+            ret = agent->request_port_stats().then(executor,
+                [process_ports](future<OFAgent::sequence<of13::PortStats>> stats) {
+                    VLOG(10) << "Entering port stats continuation";
+                    process_ports(stats.get());
+                });
+        } else if (due.empty()) {
+            ret = make_ready_future();
+        } else {
+            std::vector<future<void>> replies;
+            for (auto& port : due) {
+                replies.push_back(agent->request_port_stats(port->number()).then(
+                    executor, [process_ports](future<of13::PortStats> stats) {
+                        process_ports({ stats.get() });
+                    }));
+            }
+            auto done = when_all(replies.begin(), replies.end());
+            ret = done.then([](decltype(done) f) {
+                for (auto& reply : f.get())
+                    reply.get(); // the first error, like a full request
             });
+        }
 
-        agent->request_queue_stats().then(executor,
-            [self](future<OFAgent::sequence<of13::QueueStats>> stats) {
-                VLOG(10) << "Entering queue stats continuation";
-
-                using Stats = of13::QueueStats;
-                using namespace ranges;
-
-                auto port_no_less
-                    = [](Stats a, Stats b) { return a.port_no() < b.port_no(); };
-                auto port_no_equal
-                    = [](Stats a, Stats b) { return a.port_no() == b.port_no(); };
-
-                auto sorted_stats
-                    = stats.get() | action::sort(port_no_less);
-                auto grouped_stats
-                    = sorted_stats | view::group_by(port_no_equal);
-
-                RANGES_FOR(auto stats, grouped_stats) {
-                    auto port_no = (*begin(stats)).port_no();
-                    self->port_impl(port_no)->process_event(stats);
-                }
-            });
+        if (all) {
+            agent->request_queue_stats().then(executor,
+                [process_queues](future<OFAgent::sequence<of13::QueueStats>> stats) {
+                    VLOG(10) << "Entering queue stats continuation";
+                    process_queues(stats.get());
+                });
+        } else {
+            // queues are known from the last full poll
+            for (auto& port : due) {
+                if (port->queues().empty())
+                    continue;
+                agent->request_queue_stats(port->number()).then(executor,
+                    [process_queues](future<OFAgent::sequence<of13::QueueStats>> stats) {
+                        process_queues(stats.get());
+                    });
+            }
+        }
 
         if (tables.statistics == Tables::no_table) {
-            return;
+            return ret;
         }
 
-        ofp::flow_stats_request request;
-        request.table_id = tables.statistics;
-        agent->request_flow_stats(request).then(executor,
-            [self](future<OFAgent::sequence<of13::FlowStats>> flow_stats) {
+        agent->request_table_snapshot(tables.statistics, snapshot_age).then(executor,
+            [self](future<ofp::table_snapshot> snapshot) {
                 VLOG(10) << "Entering traffic stats continuation";
 
-                using Stats = of13::FlowStats;
-                using namespace ranges;
-
-                auto port_no_less = [](Stats a, Stats b)
-                {
-                    uint32_t a_in_port = a.match().in_port()->value();
-                    uint32_t b_in_port = b.match().in_port()->value();
-                    return a_in_port < b_in_port;
-                };
-                auto port_no_equal = [](Stats a, Stats b)
-                {
-                    uint32_t a_in_port = a.match().in_port()->value();
-                    uint32_t b_in_port = b.match().in_port()->value();
-                    return a_in_port == b_in_port;
-                };
-
-                auto sorted_stats
-                    = flow_stats.get() | action::sort(port_no_less);
-                auto grouped_stats
-                    = sorted_stats | view::group_by(port_no_equal);
-
-                RANGES_FOR(auto stats, grouped_stats) {
-                    auto match = (*begin(stats)).match();
-                    auto port_no = match.in_port()->value();
-                    self->port_impl(port_no)->process_event(stats);
+                auto traffic_stats = std::move(snapshot.get().entries);
+                key_buckets<uint32_t, of13::FlowStats> by_port(traffic_stats,
+                    [](of13::FlowStats& fs) -> std::optional<uint32_t> {
+                        auto match = fs.match();
+                        auto in_port = match.in_port();
+                        if (in_port == nullptr)
+                            return std::nullopt;
+                        return in_port->value();
+                    });
+
+                for (size_t i = 0; i < by_port.size(); ++i) {
+                    self->port_impl(by_port.key(i))->process_event(by_port[i]);
                 }
             });
+
+        return ret;
     } catch (OFAgent::request_error const& ex) {
         LOG(WARNING) << "Can't update stats:";
         diagnostic_information::get().log();
     }
+    return make_ready_future();
 }
 
 void SwitchImpl::loadDriver()
 {
     using namespace drivers;
-    m_driver = new DefaultDriver();
+    using std::chrono::microseconds;
+    using std::chrono::milliseconds;
+
+    Capabilities caps;
+    caps.max_flow_mods_per_sec = property("caps.max_flow_mods_per_sec", uint32_t(0));
+    caps.barrier_cost = microseconds(property("caps.barrier_cost_us", int64_t(0)));
+    if (property_slot("caps.bundles"))
+        caps.bundles = property("caps.bundles", false);
+    caps.max_multipart_bytes = property("caps.max_multipart_bytes", uint32_t(0));
+    caps.stats_interval = milliseconds(property("caps.stats_interval_ms", int64_t(0)));
+    caps.verify_interval = milliseconds(property("caps.verify_interval_ms", int64_t(0)));
+
+    if (caps.bundles)
+        conn_->agent()->set_bundle_support(*caps.bundles);
+
+    auto ptr = std::make_shared<const Capabilities>(caps);
+    m_driver = std::make_unique<DefaultDriver>(ptr);
+    std::atomic_store(&caps_, ptr);
 }
 
 } // namespace runos
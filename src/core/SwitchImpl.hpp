@@ -18,6 +18,7 @@
 
 #include <runos/core/future-decl.hpp>
 #include "lib/qt_executor.hpp"
+#include "lib/flap_damping.hpp"
 #include "api/Switch.hpp"
 #include "PortImpl.hpp"
 
@@ -26,8 +27,13 @@
 #include <fluid/of13msg.hh>
 #include <boost/thread/shared_mutex.hpp>
 
+#include <atomic>
+#include <chrono>
 #include <memory>
 #include <map>
+#include <optional>
+#include <set>
+#include <vector>
 
 namespace runos {
 
@@ -36,6 +42,12 @@ namespace of13 = fluid_msg::of13;
 class SwitchImpl;
 using SwitchImplPtr = std::shared_ptr<SwitchImpl>;
 
+// Port stats polling tiers, see SwitchImpl::updateStats()
+struct StatsTiers {
+    unsigned edge_every {5}; // edge ports are polled every Nth poll
+    std::set<uint32_t> trunks; // polled every time, like core ports
+};
+
 class SwitchImpl : public Switch
                  , public std::enable_shared_from_this<SwitchImpl>
 {
@@ -43,6 +55,9 @@ class SwitchImpl : public Switch
 public:
     explicit SwitchImpl(of13::FeaturesReply& fr,
                         Rc<DeviceDb> propdb,
+                        flap_damping::settings link_damping,
+                        bool live_watch,
+                        StatsTiers stats_tiers,
                         OFConnectionPtr conn,
                         QObject* parent = 0);
 
@@ -62,6 +77,8 @@ public:
     int      property(std::string_view name, int def_val) const override;
     bool     property(std::string_view name, bool def_val) const override;
     std::string property(std::string_view name, std::string def_val) const override;
+    devicedb::Value const* property(devicedb::PropertyKey key) const override;
+    using Switch::property;
 
     const std::string& manufacturer() const override { return manufacturer_; }
     const std::string& hardware() const override { return hardware_; }
@@ -90,6 +107,15 @@ public:
     safe::shared_ptr<Port> port(ethaddr const& hw_addr) const override;
 
     std::vector<PortPtr> ports() const override;
+    std::shared_ptr<const PortList> ports_snapshot() const override;
+    std::shared_ptr<const port_stats_table> port_stats() const override
+    { return port_stats_; }
+    // PortImpl takes its row here
+    const std::shared_ptr<port_stats_table>& mutable_port_stats() const
+    { return port_stats_; }
+    const flap_damping::settings& link_damping() const { return link_damping_; }
+    // ports go down with their OFPPS_LIVE, as fast-failover buckets do
+    bool live_watch() const { return live_watch_; }
 
     void process_event(of13::PortStatus ps);
 
@@ -103,7 +129,26 @@ public:
     void set_up();
     void set_down();
 
+    // Requests port, queue and traffic stats; the future is ready
+    // when port stats are processed. Polled by StatsPollScheduler.
+    // Core ports (Port::core) and trunks are polled every time, the
+    // others every `edge_every` polls; queue stats of the fast polls
+    // are asked only for ports that have queues. When few ports are
+    // due they are asked one by one instead of dumping all of them.
+    // Traffic stats come from a statistics table dump younger than
+    // `snapshot_age`, which stats buckets of the table share.
+    future<void> updateStats(std::chrono::milliseconds snapshot_age
+                                 = std::chrono::milliseconds(0));
+
+    // Counters of a port pushed by a flow-sampling agent (sFlow).
+    // Until `fresh_until` updateStats() leaves port stats out. May be
+    // called from any thread.
+    void push_counters(unsigned port_no, PortMeasurement<uint64_t> m,
+                       std::chrono::steady_clock::time_point fresh_until);
+
     void handle(const drivers::Handler& h) const override { m_driver->apply(h); }
+    drivers::CapabilitiesPtr capabilities() const override
+    { return std::atomic_load(&caps_); }
 
 protected:
     void process_event(std::vector<of13::Port> vports);
@@ -111,15 +156,18 @@ protected:
     void update_props();
     void init_tables();
     void init_aux_address();
-    void updateStats();
     void loadDriver();
-    void timerEvent(QTimerEvent*) override;
 
 private:
     friend class SwitchModImpl;
 
     OFConnectionPtr conn_;
     Rc<DeviceDb> propdb_;
+    flap_damping::settings link_damping_;
+    bool live_watch_;
+    const StatsTiers stats_tiers_;
+    std::atomic<unsigned> stats_polls_ {0};
+    std::atomic<int64_t> pushed_until_ {0}; // steady clock ticks
 
     bool is_up {false};
 
@@ -127,7 +175,14 @@ private:
     unsigned nbuffers_;
     unsigned ntables_;
     uint32_t capabilites_;
-    std::map<std::string_view, std::any> property_;
+
+    // Indexed by devicedb::PropertyKey::id()
+    struct PropertySlot {
+        std::optional<devicedb::Value> value;
+        std::any any; // the same value for property(name)
+    };
+    std::vector<PropertySlot> property_;
+    PropertySlot const* property_slot(std::string_view name) const;
 
     mutable boost::shared_mutex cmutex;
     uint16_t miss_send_len_;
@@ -141,11 +196,28 @@ private:
     std::string description_;
     std::string aux_address_;
 
+    // Writers modify ports_ under pmutex and publish a new snapshot,
+    // readers only std::atomic_load the snapshot
     mutable boost::shared_mutex pmutex;
     std::map<unsigned, PortImplPtr> ports_;
 
+    struct PortSnapshot {
+        PortList ports; // sorted by number
+        std::vector<PortImplPtr> impls; // same order
+    };
+    std::shared_ptr<const PortSnapshot> port_snapshot_
+        { std::make_shared<PortSnapshot>() };
+    // Outlives the switch while its ports hold slots
+    std::shared_ptr<port_stats_table> port_stats_
+        { std::make_shared<port_stats_table>(PortMeasurement<uint64_t>().size()) };
+    // Warning: requries external locking
+    void publish_ports();
+
     mutable qt_executor executor{this};
-    drivers::DefaultDriver* m_driver;
+    std::unique_ptr<drivers::DefaultDriver> m_driver;
+    // Readers on other threads std::atomic_load it
+    drivers::CapabilitiesPtr caps_
+        { std::make_shared<const drivers::Capabilities>() };
 };
 
 } // namespace runos
@@ -21,8 +21,14 @@
 #include "SwitchImpl.hpp"
 #include "DpidChecker.hpp"
 #include "StatsRulesManager.hpp"
+#include "StatsPollScheduler.hpp"
+
+#include "api/OFAgent.hpp"
+#include "lib/event_trace.hpp"
+#include "lib/qt_executor.hpp"
 
 #include <runos/DeviceDb.hpp>
+#include <runos/core/future.hpp>
 #include <runos/core/logging.hpp>
 
 #include <fluid/of13msg.hh>
@@ -32,7 +38,10 @@
 
 #include <vector>
 #include <map>
-#include <algorithm> // copy
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <algorithm> // copy, sort, lower_bound
 #include <iterator> // back_inserter
 
 namespace runos {
@@ -55,16 +64,31 @@ struct SwitchManager::implementation final
     StatsRulesManager* stats_rules_mgr;
     Controller* controller;
     OFServer* ofserver;
+    StatsPollScheduler* poller;
+    DpidChecker* dpid_checker;
     Rc<DeviceDb> propdb;
+    flap_damping::settings link_damping;
+    bool live_watch = false;
+    unsigned edge_stats_every = 5;
+    std::map<uint64_t, std::set<uint32_t>> trunk_ports;
 
     std::map<uint64_t, SwitchImplPtr> switches;
     mutable boost::shared_mutex smutex;
+    // rebuilt from the map under the unique lock, read with atomic_load
+    SwitchRegistryPtr registry = std::make_shared<SwitchRegistry>();
+
+    // Holds a switch from its features reply until the barrier sent
+    // after switchUp, so a reconnect storm comes up a slot at a time
+    std::unique_ptr<admission_queue> admission;
+    mutable std::mutex ready_mutex;
+    std::map<uint64_t, std::chrono::milliseconds> time_to_ready;
+    qt_executor executor {&app};
+    SwitchEventBus events;
 
     implementation(SwitchManager& app)
         : app(app)
     {
         propdb = std::make_shared<DeviceDb>();
-        propdb->add_default();
     }
 
     void connect_stats_rules_mgr()
@@ -81,16 +105,90 @@ struct SwitchManager::implementation final
                          stats_rules_mgr, &StatsRulesManager::installRules);
     }
 
+    // Routers (AR) come up before distribution switches (DR)
+    int priority(uint64_t dpid) const
+    {
+        switch (dpid_checker->role(dpid)) {
+        case SwitchRole::AR: return 0;
+        case SwitchRole::DR: return 1;
+        default: return 2;
+        }
+    }
+
+    void admit(const SwitchImplPtr& sw)
+    {
+        std::weak_ptr<SwitchImpl> weak = sw;
+        admission->submit(sw->dpid(), priority(sw->dpid()), [weak] {
+            if (auto sw = weak.lock())
+                sw->set_up();
+        });
+    }
+
+    // Called after the switchUp handlers, which send their rules
+    // synchronously: the barrier reply means the switch has them
+    void ready(SwitchPtr sw)
+    {
+        auto dpid = sw->dpid();
+        auto done = [self = shared_from_this(), dpid](future<void> f) {
+            try {
+                f.get();
+            } catch (...) {
+                VLOG(3) << "Bring-up barrier of " << dpid << " failed";
+            }
+            self->released(dpid);
+        };
+
+        try {
+            // covered by the barrier too
+            auto len = controller->packet_in_bytes();
+            if (len && *len != sw->miss_send_len())
+                sw->miss_send_len(*len);
+            sw->connection()->agent()->barrier().then(executor, done);
+        } catch (OFAgent::request_error const&) {
+            released(dpid);
+        }
+    }
+
+    void released(uint64_t dpid)
+    {
+        auto elapsed = admission->release(dpid);
+        if (not elapsed)
+            return;
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(*elapsed);
+        VLOG(1) << "Switch " << dpid << " ready in " << ms.count() << " ms";
+        std::lock_guard<std::mutex> lock(ready_mutex);
+        time_to_ready[dpid] = ms;
+    }
+
     safe::shared_ptr<SwitchImpl> switch_(uint64_t dpid) const
     {
-        boost::shared_lock< boost::shared_mutex > lock(smutex);
-        auto it = switches.find(dpid);
-        return (it != switches.end()) ? it->second : nullptr;
+        auto sw = std::atomic_load(&registry)->find(dpid);
+        return std::static_pointer_cast<SwitchImpl>(sw);
+    }
+
+    // Called with smutex held uniquely, after every change of the map
+    void publish_registry()
+    {
+        std::vector<SwitchPtr> all;
+        all.reserve(switches.size());
+        boost::copy(switches | boost::adaptors::map_values,
+                    std::back_inserter(all));
+        auto next = std::make_shared<SwitchRegistry>(
+            registry->generation() + 1, std::move(all));
+        std::atomic_store(&registry, SwitchRegistryPtr(std::move(next)));
     }
 
     SwitchImplPtr make_switch(of13::FeaturesReply& fr, OFConnectionPtr conn)
     {
-        auto ret = std::make_shared<SwitchImpl>(fr, propdb, conn, &app);
+        StatsTiers tiers;
+        tiers.edge_every = edge_stats_every;
+        auto trunks = trunk_ports.find(fr.datapath_id());
+        if (trunks != trunk_ports.end())
+            tiers.trunks = trunks->second;
+
+        auto ret = std::make_shared<SwitchImpl>(fr, propdb, link_damping,
+                                                live_watch, std::move(tiers),
+                                                conn, &app);
 
         QObject::connect(ret.get(), &Switch::portAdded,
                          &app, &SwitchManager::portAdded);
@@ -107,6 +205,10 @@ struct SwitchManager::implementation final
         QObject::connect(ret.get(), &Switch::switchUp,
                          &app, &SwitchManager::switchUp);
 
+        // connected after the forward above, so it runs after the cascade
+        QObject::connect(ret.get(), &Switch::switchUp,
+                         &app, [this](SwitchPtr sw) { ready(sw); });
+
         QObject::connect(ret.get(), &Switch::switchDown,
                          &app, &SwitchManager::switchDown);
 
@@ -122,19 +224,57 @@ struct SwitchManager::implementation final
         QObject::connect(ret.get(), &Switch::switchMaintenanceEnd,
                          &app, &SwitchManager::switchMaintenanceEnd);
 
+        publish_events(ret.get());
+
         stats_rules_mgr->clearStatsTable(ret);
+        poller->add(ret);
 
         return ret;
     }
 
+    void publish_events(SwitchImpl* sw)
+    {
+        auto port_event = [this](SwitchEvent::Type type) {
+            return [this, type](PortPtr port) {
+                events.publish(SwitchEvent{ type, port->switch_(), port });
+            };
+        };
+        auto switch_event = [this](SwitchEvent::Type type) {
+            return [this, type](SwitchPtr sw) {
+                events.publish(SwitchEvent{ type, sw, nullptr });
+            };
+        };
+
+        QObject::connect(sw, &Switch::portAdded, &app,
+                         port_event(SwitchEvent::PORT_ADDED),
+                         Qt::DirectConnection);
+        QObject::connect(sw, &Switch::portDeleted, &app,
+                         port_event(SwitchEvent::PORT_DELETED),
+                         Qt::DirectConnection);
+        QObject::connect(sw, &Switch::linkUp, &app,
+                         port_event(SwitchEvent::LINK_UP),
+                         Qt::DirectConnection);
+        QObject::connect(sw, &Switch::linkDown, &app,
+                         port_event(SwitchEvent::LINK_DOWN),
+                         Qt::DirectConnection);
+        QObject::connect(sw, &Switch::switchUp, &app,
+                         switch_event(SwitchEvent::SWITCH_UP),
+                         Qt::DirectConnection);
+        QObject::connect(sw, &Switch::switchDown, &app,
+                         switch_event(SwitchEvent::SWITCH_DOWN),
+                         Qt::DirectConnection);
+    }
+
     void remove_switch(uint64_t dpid)
     {
         boost::upgrade_lock< boost::shared_mutex > rslock(smutex);
         auto it = switches.find(dpid);
         if (switches.end() != it) {
             it->second.get()->disconnect();
+            poller->remove(dpid);
             boost::upgrade_to_unique_lock< boost::shared_mutex > wslock(rslock);
             switches.erase(it);
+            publish_registry();
         }
     }
 
@@ -153,13 +293,20 @@ struct SwitchManager::implementation final
                            << "Assign new dpid or restart controller.";
                 conn->close();
             } else {
-                sw->set_up();
+                admit(sw);
             }
             rslock.unlock();
         } else {
-            boost::upgrade_to_unique_lock< boost::shared_mutex >
-                wslock(rslock);
-            switches.emplace(fr.datapath_id(), make_switch(fr, conn));
+            SwitchImplPtr sw;
+            {
+                boost::upgrade_to_unique_lock< boost::shared_mutex >
+                    wslock(rslock);
+                sw = make_switch(fr, conn);
+                switches.emplace(fr.datapath_id(), sw);
+                publish_registry();
+            }
+            // only once switch_() can find it
+            admit(sw);
         }
         return true;
     }
@@ -167,6 +314,9 @@ struct SwitchManager::implementation final
     bool process(of13::PortStatus& ps, OFConnectionPtr conn) override
     {
         if (auto sw = switch_(conn->dpid())) {
+            trace::scope traced(trace::start("port-status",
+                trace::port_subject(conn->dpid(), ps.desc().port_no()),
+                ps.reason()));
             sw->process_event(ps);
         } else {
             LOG(WARNING) << "Ignoring port status from " << conn->dpid()
@@ -179,7 +329,7 @@ struct SwitchManager::implementation final
 SwitchManager::SwitchManager() = default;
 SwitchManager::~SwitchManager() = default;
 
-void SwitchManager::init(Loader* loader, const Config&)
+void SwitchManager::init(Loader* loader, const Config& rootConfig)
 {
     qRegisterMetaType<runos::SwitchPtr>("SwitchPtr");
     qRegisterMetaType<fluid_msg::of13::Port>("of13::Port");
@@ -189,12 +339,71 @@ void SwitchManager::init(Loader* loader, const Config&)
     impl->controller = Controller::get(loader);
     impl->ofserver = OFServer::get(loader);
     impl->stats_rules_mgr = StatsRulesManager::get(loader);
+    impl->dpid_checker = DpidChecker::get(loader);
+
+    using std::chrono::milliseconds;
+    auto config = config_cd(rootConfig, "switch-manager");
+    impl->propdb->cache_compiled(
+        config_get(config, "devicedb-cache", "devicedb.compiled"));
+    impl->propdb->add_default();
+
+    StatsPollScheduler::Settings poll;
+    poll.interval = milliseconds(
+        config_get(config, "stats-interval-ms", 2000));
+    poll.max_interval = milliseconds(
+        config_get(config, "stats-max-interval-ms", 30000));
+    poll.max_polls_per_second =
+        config_get(config, "stats-max-polls-per-second", 500);
+    poll.jitter = config_get(config, "stats-jitter", 0.05);
+    impl->poller = new StatsPollScheduler(poll, this);
+
+    impl->edge_stats_every = std::max(
+        config_get(config, "edge-stats-every", 5), 1);
+    // "dpid:port,dpid:port", ports polled with the core ones
+    std::istringstream trunks(config_get(config, "trunk-ports", ""));
+    std::string trunk;
+    while (std::getline(trunks, trunk, ',')) {
+        auto colon = trunk.find(':');
+        if (colon == std::string::npos) {
+            LOG(WARNING) << "Bad trunk port " << trunk << ", dpid:port expected";
+            continue;
+        }
+        impl->trunk_ports[std::stoull(trunk.substr(0, colon))]
+            .insert(uint32_t(std::stoul(trunk.substr(colon + 1))));
+    }
+
+    auto damping = config_cd(config, "link-damping");
+    auto& ld = impl->link_damping;
+    ld.window = milliseconds(config_get(damping, "window-ms", 0));
+    ld.half_life = milliseconds(config_get(damping, "half-life-ms", 0));
+    ld.max_suppress = milliseconds(
+        config_get(damping, "max-suppress-ms", 60000));
+    ld.penalty = config_get(damping, "penalty", 1000.0);
+    ld.suppress = config_get(damping, "suppress", 2000.0);
+    ld.reuse = config_get(damping, "reuse", 750.0);
+    impl->live_watch = config_get(config, "live-watch", false);
+
+    auto admission = config_cd(config, "admission");
+    admission_queue::settings slots;
+    slots.max_active = config_get(admission, "max-active", 64);
+    slots.max_hold = milliseconds(config_get(admission, "max-hold-ms", 30000));
+    impl->admission.reset(new admission_queue(slots));
+
+    auto expiry = new QTimer(this);
+    connect(expiry, &QTimer::timeout, [impl = impl.get()] {
+        for (auto dpid : impl->admission->expire()) {
+            LOG(WARNING) << "Switch " << dpid << " didn't come up in time, "
+                            "its bring-up slot is freed";
+        }
+    });
+    expiry->start(1000);
 
     impl->connect_stats_rules_mgr();
     impl->controller->register_handler(impl, -50);
     QObject::connect(impl->ofserver, &OFServer::connectionDown,
         [this, dpid_checker = DpidChecker::get(loader)](OFConnectionPtr conn) {
             conn->reset_stats();
+            impl->admission->release(conn->dpid());
             SwitchImplPtr sw = impl->switch_(conn->dpid());
             if (sw) {
                 sw->set_down();
@@ -211,13 +420,61 @@ safe::shared_ptr<Switch> SwitchManager::switch_(uint64_t dpid) const
     return impl->switch_(dpid);
 }
 
-std::vector<SwitchPtr> SwitchManager::switches() const
+StatsPollScheduler::Metrics SwitchManager::pollingMetrics() const
 {
-    std::vector<SwitchPtr> ret;
-    boost::shared_lock< boost::shared_mutex > lock(impl->smutex);
-    boost::copy(impl->switches | boost::adaptors::map_values,
-                std::back_inserter(ret));
+    return impl->poller->metrics();
+}
+
+SwitchEventBus& SwitchManager::events()
+{
+    return impl->events;
+}
+
+SwitchManager::AdmissionMetrics SwitchManager::admissionMetrics() const
+{
+    AdmissionMetrics ret;
+    ret.queue = impl->admission->stats();
+    std::lock_guard<std::mutex> lock(impl->ready_mutex);
+    ret.time_to_ready = impl->time_to_ready;
     return ret;
 }
 
+std::vector<SwitchPtr> SwitchManager::switches() const
+{
+    return registry()->switches();
+}
+
+SwitchRegistryPtr SwitchManager::registry() const
+{
+    return std::atomic_load(&impl->registry);
+}
+
+SwitchRegistry::SwitchRegistry(uint64_t generation,
+                               std::vector<SwitchPtr> switches)
+    : m_generation(generation)
+    , m_switches(std::move(switches))
+{
+    std::sort(m_switches.begin(), m_switches.end(),
+              [](const SwitchPtr& a, const SwitchPtr& b) {
+                  return a->dpid() < b->dpid();
+              });
+    m_dpids.reserve(m_switches.size());
+    for (const auto& sw : m_switches)
+        m_dpids.push_back(sw->dpid());
+}
+
+std::optional<uint32_t> SwitchRegistry::slot(uint64_t dpid) const
+{
+    auto it = std::lower_bound(m_dpids.begin(), m_dpids.end(), dpid);
+    if (it == m_dpids.end() || *it != dpid)
+        return std::nullopt;
+    return static_cast<uint32_t>(it - m_dpids.begin());
+}
+
+SwitchPtr SwitchRegistry::find(uint64_t dpid) const
+{
+    auto i = slot(dpid);
+    return i ? m_switches[*i] : nullptr;
+}
+
 } // namespace runos
@@ -20,16 +20,66 @@
 #include "api/Switch.hpp"
 #include "Application.hpp"
 #include "Controller.hpp"
+#include "StatsPollScheduler.hpp"
+#include "lib/admission_queue.hpp"
+#include "lib/event_bus.hpp"
 
 #include <runos/core/safe_ptr.hpp>
 
 #include <QtCore>
 
+#include <chrono>
+#include <map>
 #include <memory>
+#include <optional>
+#include <vector>
 #include <cstdint>
 
 namespace runos {
 
+// Switch and port signals of SwitchManager as events of its bus
+struct SwitchEvent {
+    enum Type : uint8_t {
+        PORT_ADDED,
+        PORT_DELETED,
+        LINK_UP,
+        LINK_DOWN,
+        SWITCH_UP,
+        SWITCH_DOWN
+    };
+
+    Type type {SWITCH_UP};
+    SwitchPtr sw;
+    PortPtr port; // null for switch events
+};
+using SwitchEventBus = EventBus<SwitchEvent>;
+
+// Immutable view of the known switches, replaced as a whole when one is
+// added or removed. Readers iterate it without a lock or a copy.
+class SwitchRegistry {
+public:
+    SwitchRegistry() = default;
+    SwitchRegistry(uint64_t generation, std::vector<SwitchPtr> switches);
+
+    // Bumped by every replacement: an unchanged number means the set of
+    // switches and their slots are the same as last time
+    uint64_t generation() const { return m_generation; }
+
+    // Sorted by dpid; a switch's position is its slot
+    const std::vector<SwitchPtr>& switches() const { return m_switches; }
+    size_t size() const { return m_switches.size(); }
+
+    // Dense index into per-switch arrays, valid for this generation
+    std::optional<uint32_t> slot(uint64_t dpid) const;
+    SwitchPtr find(uint64_t dpid) const;
+
+private:
+    uint64_t m_generation {0};
+    std::vector<uint64_t> m_dpids; // parallel to m_switches
+    std::vector<SwitchPtr> m_switches;
+};
+using SwitchRegistryPtr = std::shared_ptr<const SwitchRegistry>;
+
 class SwitchManager: public Application {
 Q_OBJECT
 SIMPLE_APPLICATION(SwitchManager, "switch-manager")
@@ -40,8 +90,29 @@ public:
     void init(Loader* provider, const Config& config) override;
 
     safe::shared_ptr<Switch> switch_(uint64_t dpid) /* noexcept */ const;
+    // Copy of registry()->switches(), sorted by dpid
     std::vector<SwitchPtr> switches() const;
 
+    // Current registry; holding it keeps the snapshot alive
+    SwitchRegistryPtr registry() const;
+    uint64_t generation() const { return registry()->generation(); }
+
+    // Load spreading of the periodic port stats polling
+    StatsPollScheduler::Metrics pollingMetrics() const;
+
+    // Bring-ups waiting for a slot and how long the last one of every
+    // switch took from its features reply to the barrier after switchUp
+    struct AdmissionMetrics {
+        admission_queue::metrics queue;
+        std::map<uint64_t, std::chrono::milliseconds> time_to_ready;
+    };
+    AdmissionMetrics admissionMetrics() const;
+
+    // Published on the thread emitting the signal, before the queued
+    // signal reaches the Qt thread. Subscribers get batches on their
+    // own threads, without a Qt event per signal and receiver.
+    SwitchEventBus& events();
+
 signals:
     void portAdded(PortPtr);
     void portDeleted(PortPtr);
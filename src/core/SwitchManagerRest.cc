@@ -18,8 +18,11 @@
 #include "Loader.hpp"
 #include "SwitchManager.hpp"
 #include "RestListener.hpp"
+#include "TimeSeriesRest.hpp"
 #include "DpidChecker.hpp"
 #include "Recovery.hpp"
+#include "api/OFAgent.hpp"
+#include "api/OFConnection.hpp"
 #include "api/Statistics.hpp"
 #include "json11.hpp"
 #include "runos/core/logging.hpp"
@@ -27,12 +30,15 @@
 #include <boost/lexical_cast.hpp>
 #include <fluid/of13msg.hh>
 
+#include <chrono>
 #include <sstream>
 
 namespace runos {
 
 namespace of13 = fluid_msg::of13;
 
+static const auto local_port_key = devicedb::PropertyKey::intern("local_port");
+
 static std::string speedReadable(double bytes)
 {
     double bits = bytes * 8;
@@ -57,11 +63,17 @@ static std::string speedReadable(double bytes)
 struct SwitchCollection : rest::resource {
     SwitchManager* app;
     DpidChecker* dpid_checker;
+    const generation_counter* generation;
 
-    explicit SwitchCollection(SwitchManager* app, DpidChecker* dpid_checker)
-        : app(app), dpid_checker(dpid_checker)
+    explicit SwitchCollection(SwitchManager* app, DpidChecker* dpid_checker,
+                              const generation_counter* generation)
+        : app(app), dpid_checker(dpid_checker), generation(generation)
     { }
 
+    uint64_t Generation() const override {
+        return generation->get();
+    }
+
     rest::ptree Get() const override {
         rest::ptree root;
         rest::ptree switches;
@@ -269,11 +281,14 @@ struct SwitchResource : rest::resource {
         pt.put("description", sw->description());
         pt.put("connection-status",
                sw->connection()->alive() ?  "up" : "down");
+        pt.put("auxiliary-connections",
+               sw->connection()->auxiliary_ids().size());
         pt.put("miss-send-len", sw->miss_send_len());
 
         rest::ptree ports;
-        for (const auto& port : sw->ports()) {
-            if (sw->property("local_port", of13::OFPP_LOCAL) == port->number())
+        auto sw_ports = sw->ports_snapshot();
+        for (const auto& port : *sw_ports) {
+            if (sw->property(local_port_key, of13::OFPP_LOCAL) == port->number())
                 continue;
             rest::ptree st;
             st.put("", port->number());
@@ -364,6 +379,42 @@ struct SwitchMaintenanceResource : rest::resource {
     }
 };
 
+struct SwitchLatencyResource : rest::resource {
+    UnsafeSwitchPtr sw;
+
+    explicit SwitchLatencyResource(SwitchPtr sw)
+        : sw(sw.not_null())
+    { }
+
+    rest::ptree Get() const override
+    {
+        using ms = std::chrono::duration<double, std::milli>;
+
+        auto conn = sw->connection();
+        THROW_IF(not conn || not conn->alive(), rest::http_error(404),
+                 "Switch is not connected");
+        auto info = conn->agent()->latency();
+
+        rest::ptree ret;
+        ret.put("switch", sw->dpid());
+        ret.put("slowdown", info.slowdown);
+
+        rest::ptree requests;
+        for (auto& r : info.requests) {
+            rest::ptree pt;
+            pt.put("replies", r.replies);
+            pt.put("recent-ms", ms(r.recent).count());
+            pt.put("baseline-ms", ms(r.baseline).count());
+            pt.put("p50-ms", ms(r.p50).count());
+            pt.put("p99-ms", ms(r.p99).count());
+            requests.add_child(r.name, pt);
+        }
+        ret.add_child("requests", requests);
+
+        return ret;
+    }
+};
+
 struct PortResource : rest::resource {
     UnsafePortPtr port;
 
@@ -614,26 +665,68 @@ struct SwitchCollectionStats : rest::resource {
         : app(app)
     { }
 
-    rest::ptree Get() const override {
-        rest::ptree root;
-        rest::ptree stats;
+    // Streamed, a fabric has too many ports to build one ptree
+    void Stream(json_writer& out) const override {
+        Page(out, {});
+    }
 
+    // Ordered by dpid and port number, the cursor is "dpid:port"
+    // of the last port written
+    void Page(json_writer& out, const rest::page& page) const override {
+        uint64_t after_dpid = 0;
+        uint32_t after_port = 0;
+        bool after = not page.cursor.empty();
+        if (after) {
+            auto colon = page.cursor.find(':');
+            THROW_IF(colon == std::string::npos, rest::http_error(400),
+                     "Bad cursor: {}", page.cursor);
+            try {
+                after_dpid = boost::lexical_cast<uint64_t>(
+                    page.cursor.substr(0, colon));
+                after_port = boost::lexical_cast<uint32_t>(
+                    page.cursor.substr(colon + 1));
+            } catch (const boost::bad_lexical_cast&) {
+                THROW(rest::http_error(400), "Bad cursor: {}", page.cursor);
+            }
+        }
+
+        size_t size = 0;
+        uint64_t last_dpid = 0;
+        uint32_t last_port = 0;
+        std::string next;
+
+        out.begin_object().key("array").begin_array();
         for (const auto& sw : app->switches()) {
-            for (const auto& port : sw->ports()) {
+            if (after && sw->dpid() < after_dpid) continue;
+            auto ports = sw->ports_snapshot();
+            for (const auto& port : *ports) {
                 if (port->number() > of13::OFPP_MAX) continue;
                 if (port->link_down()) continue;
+                if (after && sw->dpid() == after_dpid &&
+                    port->number() <= after_port) continue;
+                if (page.limit && size == page.limit) {
+                    next = std::to_string(last_dpid) + ':' +
+                           std::to_string(last_port);
+                    break;
+                }
 
-                rest::ptree spt;
-                spt.put("dpid", sw->dpid());
-                spt.put("port", port->number());
-                spt.add_child("stats", PortStatsResource{port}.Get());
-                stats.push_back(std::make_pair("", std::move(spt)));
+                out.begin_object()
+                   .put("dpid", sw->dpid())
+                   .put("port", port->number());
+                // Counters are only read for pages that show them
+                if (out.wants("stats"))
+                    out.key("stats").value(PortStatsResource{port}.Get());
+                out.end_object();
+                ++size;
+                last_dpid = sw->dpid();
+                last_port = port->number();
             }
+            if (not next.empty()) break;
         }
-
-        root.add_child("array", stats);
-        root.put("_size", stats.size());
-        return root;
+        out.end_array().put("_size", size);
+        if (not next.empty())
+            out.put("next", next);
+        out.end_object();
     }
 };
 
@@ -666,6 +759,15 @@ struct SwitchCollectionControlStats : rest::resource {
             spt.put("rx_ofpackets", sw->connection()->get_rx_packets());
             spt.put("tx_ofpackets", sw->connection()->get_tx_packets());
             spt.put("pkt_in_ofpackets", sw->connection()->get_pkt_in_packets());
+            if (auto counters = sw->connection()->counters()) {
+                auto rx = counters->read(ChannelCounters::rx);
+                auto tx = counters->read(ChannelCounters::tx);
+                spt.put("rx_ofbytes", rx.bytes);
+                spt.put("tx_ofbytes", tx.bytes);
+                // averaged over 10 seconds
+                spt.put("rx_ofpackets_per_sec", rx.rate.messages[1]);
+                spt.put("tx_ofpackets_per_sec", tx.rate.messages[1]);
+            }
 
             switches.push_back(std::make_pair("", std::move(spt)));
         }
@@ -751,6 +853,101 @@ struct QueueStatsResource : rest::resource {
     }
 };
 
+// Speed history of a port, or of one of its queues
+struct PortHistoryResource : rest::resource {
+    UnsafePortPtr port;
+    TimeSeries::resolution resolution;
+    double seconds;
+    bool queue;
+    uint32_t queue_id;
+
+    explicit PortHistoryResource(PortPtr port, TimeSeries::resolution r,
+                                 double seconds, bool queue = false,
+                                 uint32_t queue_id = 0)
+        : port(port.not_null()), resolution(r), seconds(seconds)
+        , queue(queue), queue_id(queue_id)
+    { }
+
+    rest::ptree Get() const override
+    {
+        static const std::vector<std::string> port_fields {
+            "rx-packets", "tx-packets", "rx-bytes", "tx-bytes",
+            "rx-dropped", "tx-dropped", "rx-errors", "tx-errors"
+        };
+        static const std::vector<std::string> queue_fields {
+            "tx-bytes", "tx-packets", "tx-errors"
+        };
+
+        rest::ptree ret;
+        auto fill = [&](const TimeSeries::Series& series) {
+            ret = rest::history_to_ptree(series,
+                                         queue ? queue_fields : port_fields,
+                                         seconds);
+        };
+
+        if (queue) {
+            try {
+                port->queue_stats_history(queue_id, resolution, fill);
+            } catch (const std::out_of_range&) {
+                THROW( rest::http_error(404), "Queue not found" );
+            }
+        } else {
+            port->stats_history(resolution, fill);
+        }
+        return ret;
+    }
+};
+
+struct StatsPollingResource : rest::resource {
+    SwitchManager* app;
+
+    explicit StatsPollingResource(SwitchManager* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override {
+        auto m = app->pollingMetrics();
+
+        rest::ptree ret;
+        ret.put("switches", m.switches);
+        ret.put("interval-ms", m.interval.count());
+        ret.put("latency-ms", m.latency_ms);
+        ret.put("polls", m.polls);
+        ret.put("skipped", m.skipped);
+        ret.put("lost", m.lost);
+        ret.put("backed-off", m.backed_off);
+        ret.put("peak-per-tick", m.peak_per_tick);
+        ret.put("mean-per-tick", m.mean_per_tick);
+        ret.put("spread", m.spread);
+        return ret;
+    }
+};
+
+struct AdmissionResource : rest::resource {
+    SwitchManager* app;
+
+    explicit AdmissionResource(SwitchManager* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override {
+        auto m = app->admissionMetrics();
+
+        rest::ptree ret;
+        ret.put("active", m.queue.active);
+        ret.put("queued", m.queue.queued);
+        ret.put("admitted", m.queue.admitted);
+        ret.put("expired", m.queue.expired);
+
+        rest::ptree ready;
+        for (auto& entry : m.time_to_ready) {
+            ready.put(std::to_string(entry.first), entry.second.count());
+        }
+        ret.add_child("time-to-ready-ms", ready);
+        return ret;
+    }
+};
+
 class SwitchManagerRest : public Application
 {
     SIMPLE_APPLICATION(SwitchManagerRest, "switch-manager-rest")
@@ -765,9 +962,16 @@ public:
         auto checker = DpidChecker::get(loader);
         auto recovery_manager = RecoveryManager::get(loader);
 
+        // Everything /switches/ shows changes along with one of these
+        auto bump = [this] { switches_generation_.bump(); };
+        QObject::connect(app, &SwitchManager::switchUp, bump);
+        QObject::connect(app, &SwitchManager::switchDown, bump);
+        QObject::connect(checker, &DpidChecker::switchListChanged, bump);
+        QObject::connect(checker, &DpidChecker::switchUnregistered, bump);
+
         rest_->mount(path_spec("/switches/"), [=](const path_match&)
         {
-            return SwitchCollection {app, checker};
+            return SwitchCollection {app, checker, &switches_generation_};
         });
 
         rest_->mount(path_spec("/switches/role/"), [=](const path_match&)
@@ -843,6 +1047,31 @@ public:
             }
         });
 
+        rest_->mount(path_spec("/switches/(\\d+)/latency/"),
+                     [=](const path_match& m)
+        {
+            try {
+                auto dpid = boost::lexical_cast<uint64_t>(m[1].str());
+                return SwitchLatencyResource{ app->switch_(dpid) };
+            } catch (const boost::bad_lexical_cast& e) {
+                THROW( rest::http_error(400), "Bad request: {}", e.what() );
+            } catch (const bad_pointer_access& e) {
+                THROW( rest::http_error(404), "Switch not found" );
+            }
+        });
+
+        rest_->mount(path_spec("/switches/stats-polling/"),
+                     [=](const path_match&)
+        {
+            return StatsPollingResource {app};
+        });
+
+        rest_->mount(path_spec("/switches/admission/"),
+                     [=](const path_match&)
+        {
+            return AdmissionResource {app};
+        });
+
         // control stats for switches
         rest_->mount(path_spec("/switches/controlstats/"),
                      [=](const path_match& m)
@@ -923,7 +1152,52 @@ public:
                 THROW( rest::http_error(404), "Not found" );
             }
         });
+
+        // e.g. /switches/1/ports/2/stats/history/10s/600/ - last 10 minutes
+        rest_->mount(path_spec(
+                         std::string("/switches/(\\d+)/ports/(\\d+)/stats/history/") +
+                         rest::history_resolution_spec + "/(?:(\\d+)/)?"),
+        [=](const path_match& m)
+        {
+            try {
+                auto dpid = boost::lexical_cast<uint64_t>(m[1].str());
+                auto port_no = boost::lexical_cast<uint32_t>(m[2].str());
+                auto res = rest::parse_resolution(m[3].str());
+                double seconds = m[4].matched
+                    ? boost::lexical_cast<double>(m[4].str()) : 0;
+                return PortHistoryResource{ app->switch_(dpid)->port(port_no),
+                                            res, seconds };
+            } catch (const boost::bad_lexical_cast& e) {
+                THROW( rest::http_error(400), "Bad request: {}", e.what() );
+            } catch (const bad_pointer_access& e) {
+                THROW( rest::http_error(404), "Port or switch not found" );
+            }
+        });
+
+        rest_->mount(path_spec(
+                         std::string("/switches/(\\d+)/ports/(\\d+)/queues/(\\d+)/stats/history/") +
+                         rest::history_resolution_spec + "/(?:(\\d+)/)?"),
+        [=](const path_match& m)
+        {
+            try {
+                auto dpid = boost::lexical_cast<uint64_t>(m[1].str());
+                auto port_no = boost::lexical_cast<uint32_t>(m[2].str());
+                auto queue_id = boost::lexical_cast<uint32_t>(m[3].str());
+                auto res = rest::parse_resolution(m[4].str());
+                double seconds = m[5].matched
+                    ? boost::lexical_cast<double>(m[5].str()) : 0;
+                return PortHistoryResource{ app->switch_(dpid)->port(port_no),
+                                            res, seconds, true, queue_id };
+            } catch (const boost::bad_lexical_cast& e) {
+                THROW( rest::http_error(400), "Bad request: {}", e.what() );
+            } catch (const bad_pointer_access& e) {
+                THROW( rest::http_error(404), "Not found" );
+            }
+        });
     }
+
+private:
+    generation_counter switches_generation_;
 };
 
 REGISTER_APPLICATION(SwitchManagerRest, {"rest-listener", "switch-manager",
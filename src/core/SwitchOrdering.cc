@@ -23,6 +23,7 @@
 #include <runos/core/catch_all.hpp>
 
 #include <algorithm>
+#include <condition_variable>
 
 namespace runos {
 
@@ -94,6 +95,24 @@ void SwitchOrderingManager::init(Loader* loader, const Config& rootConfig)
     // info barrier_timers
     const Config& config = config_cd(rootConfig, "of-server");
     echo_interval_ = std::chrono::seconds(config_get(config, "echo-interval", 5));
+
+    const Config& ordering_config = config_cd(rootConfig, "switch-ordering");
+    batch_bringup_ = config_get(ordering_config, "batch-bringup", false);
+    if (batch_bringup_) {
+        int tick = config_get(ordering_config, "batch-tick-ms", 50);
+        int threads = config_get(ordering_config, "batch-threads", 8);
+
+        batch_timer_ = new QTimer(this);
+        batch_timer_->setSingleShot(true);
+        batch_timer_->setInterval(std::max(tick, 1));
+        connect(batch_timer_, &QTimer::timeout,
+                this, &SwitchOrderingManager::start_batch);
+
+        // batches run one after another, stages of a batch on the pool
+        batch_runner_ = std::make_unique<WorkerPool>(1);
+        stage_pool_ = std::make_unique<WorkerPool>(std::max(threads, 1));
+    }
+    progress_.batched = batch_bringup_;
 }
 
 void SwitchOrderingManager::registerHandler(SwitchEventHandler* handler,
@@ -122,28 +141,7 @@ void SwitchOrderingManager::run_handling(SwitchPtr sw, EventType type)
         connect(thread, &QThread::started, handler, &MainHandler::onSwitchUp);
         // when switchUp handling finished
         connect(handler, &MainHandler::finished, [this, sw, thread](){
-            std::lock_guard<std::mutex> lock(mut_);
-            connected_.push_back(sw->dpid());
-
-            // if we have cached links which we must handle
-            if (cached_.count(sw->dpid()) > 0) {
-                auto up_links = std::move(cached_.at(sw->dpid()));
-                std::for_each(up_links.begin(), up_links.end(),
-                    [this](auto port) {
-                        for (auto& it: this->handlers_) {
-                            auto& handler = it.second;
-                            if (handler->types & AT_LINK_UP) {
-                                catch_all_and_log([&](){
-                                    handler->linkUp(port);
-                                });
-                            }
-                        }
-                        LOG(WARNING) << "link up - " << port->switch_()->dpid() 
-                                                     << ":" << port->number();
-                    });
-                CHECK(cached_.at(sw->dpid()).size() == 0);
-            }
-
+            switch_up_handled(sw);
             // finish working thread
             thread->quit();
         });
@@ -170,6 +168,144 @@ void SwitchOrderingManager::run_handling(SwitchPtr sw, EventType type)
     thread->start();
 }
 
+void SwitchOrderingManager::switch_up_handled(SwitchPtr sw)
+{
+    std::lock_guard<std::mutex> lock(mut_);
+    connected_.push_back(sw->dpid());
+
+    // if we have cached links which we must handle
+    if (cached_.count(sw->dpid()) > 0) {
+        auto up_links = std::move(cached_.at(sw->dpid()));
+        std::for_each(up_links.begin(), up_links.end(),
+            [this](auto port) {
+                for (auto& it: this->handlers_) {
+                    auto& handler = it.second;
+                    if (handler->types & AT_LINK_UP) {
+                        catch_all_and_log([&](){
+                            handler->linkUp(port);
+                        });
+                    }
+                }
+                LOG(WARNING) << "link up - " << port->switch_()->dpid() 
+                                             << ":" << port->number();
+            });
+        CHECK(cached_.at(sw->dpid()).size() == 0);
+    }
+}
+
+void SwitchOrderingManager::start_batch()
+{
+    auto batch = std::move(pending_up_);
+    pending_up_.clear();
+    if (batch.empty())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(progress_mut_);
+        progress_.pending -= batch.size();
+    }
+
+    batch_runner_->submit(0, [this, batch = std::move(batch)]() mutable {
+        run_batch(std::move(batch));
+    });
+}
+
+void SwitchOrderingManager::run_batch(std::vector<SwitchPtr> batch)
+{
+    using clock = std::chrono::steady_clock;
+    auto batch_start = clock::now();
+
+    // Take the same per-switch locks as MainHandler does, switches
+    // which went down meanwhile or are already up are dropped
+    std::vector<std::unique_ptr<MainHandler>> emitters;
+    std::vector<SwitchPtr> switches;
+    for (auto& sw : batch) {
+        std::unique_ptr<MainHandler> emitter
+            { new MainHandler(locker_.get(), sw, AT_SWITCH_UP) };
+        if (locker_->canHandleAction(SwitchLocker::SwitchAction::UP,
+                                     sw, emitter.get())) {
+            switches.push_back(sw);
+            emitters.push_back(std::move(emitter));
+        }
+    }
+
+    // Handlers of one priority form a stage
+    std::vector<std::vector<SwitchEventHandler*>> stages;
+    std::vector<int> priorities;
+    for (auto& it : handlers_) {
+        if (not (it.second->types & AT_SWITCH_UP))
+            continue;
+        if (priorities.empty() || priorities.back() != it.first) {
+            priorities.push_back(it.first);
+            stages.emplace_back();
+        }
+        stages.back().push_back(it.second);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(progress_mut_);
+        progress_.running = switches.size();
+        progress_.stage = 0;
+        progress_.stages = stages.size();
+    }
+
+    std::vector<BringUpProgress::Stage> report;
+    for (size_t i = 0; i < stages.size() && not switches.empty(); ++i) {
+        auto stage_start = clock::now();
+
+        std::mutex done_mut;
+        std::condition_variable done_cv;
+        size_t left = switches.size();
+
+        for (auto& sw : switches) {
+            stage_pool_->submit(sw->dpid(), [&, sw]() {
+                for (auto handler : stages[i]) {
+                    catch_all_and_log([&]() {
+                        handler->switchUp(sw);
+                    });
+                }
+                std::lock_guard<std::mutex> lock(done_mut);
+                if (--left == 0)
+                    done_cv.notify_one();
+            });
+        }
+
+        std::unique_lock<std::mutex> lock(done_mut);
+        done_cv.wait(lock, [&]() { return left == 0; });
+        lock.unlock();
+
+        report.push_back(BringUpProgress::Stage{
+            priorities[i], switches.size(),
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                clock::now() - stage_start)
+        });
+
+        std::lock_guard<std::mutex> progress_lock(progress_mut_);
+        progress_.stage = i + 1;
+    }
+
+    // Releases the switch locks and marks switches as connected
+    for (auto& emitter : emitters) {
+        LOG(WARNING) << "switch up, dpid: " << emitter->sw->dpid();
+        switch_up_handled(emitter->sw);
+        emit emitter->finished(emitter->sw->dpid());
+    }
+
+    std::lock_guard<std::mutex> lock(progress_mut_);
+    progress_.running = 0;
+    progress_.batches++;
+    progress_.switches_done += switches.size();
+    progress_.last_stages = std::move(report);
+    progress_.last_batch = std::chrono::duration_cast<std::chrono::microseconds>(
+                               clock::now() - batch_start);
+}
+
+BringUpProgress SwitchOrderingManager::bringUpProgress() const
+{
+    std::lock_guard<std::mutex> lock(progress_mut_);
+    return progress_;
+}
+
 bool SwitchOrderingManager::isConnected(uint64_t dpid) const
 {
     std::lock_guard<std::mutex> lock(mut_);
@@ -180,20 +316,33 @@ bool SwitchOrderingManager::isConnected(uint64_t dpid) const
 
 void SwitchOrderingManager::onSwitchUp(SwitchPtr sw)
 {
-    run_handling(sw, AT_SWITCH_UP);
+    if (batch_bringup_) {
+        pending_up_.push_back(sw);
+        {
+            std::lock_guard<std::mutex> lock(progress_mut_);
+            progress_.pending++;
+        }
+        if (not batch_timer_->isActive()) {
+            batch_timer_->start();
+        }
+    } else {
+        run_handling(sw, AT_SWITCH_UP);
+    }
 
     // start barrier timer to send BarrierRequest
-    auto barrier_timer = new QTimer(this);
-    auto interval = duration_cast<milliseconds>(echo_interval_);
-    barrier_timer->setInterval(interval.count());
-    QObject::connect(barrier_timer, &QTimer::timeout, [sw] (){
-        try {
-            sw->connection()->agent()->barrier();
-        } catch (const OFAgent::request_error& e) {
-            LOG(ERROR) << "[SwitchOrderingManager] - " << e.what();
-        }
-    });
-    barrier_timer->start();
+    auto& timers = TimerService::global();
+    auto barrier_timer = timers.add(
+        "switch-barrier-" + std::to_string(sw->dpid()),
+        duration_cast<milliseconds>(echo_interval_),
+        [sw] () {
+            try {
+                sw->connection()->agent()->barrier();
+            } catch (const OFAgent::request_error& e) {
+                LOG(ERROR) << "[SwitchOrderingManager] - " << e.what();
+            }
+        },
+        TimerService::priority::low);
+    timers.start(barrier_timer);
 
     barrier_timers_.insert(std::make_pair(sw->dpid(), barrier_timer));
 }
@@ -205,8 +354,7 @@ void SwitchOrderingManager::onSwitchDown(SwitchPtr sw)
     // stop and remove barrier timer
     auto barrier_timer_it = barrier_timers_.find(sw->dpid());
     CHECK(barrier_timers_.end() != barrier_timer_it);
-    barrier_timer_it->second->disconnect();
-    barrier_timer_it->second->deleteLater();
+    TimerService::global().remove(barrier_timer_it->second);
     barrier_timers_.erase(barrier_timer_it);
 }
 
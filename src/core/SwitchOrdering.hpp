@@ -19,6 +19,8 @@
 #include "Application.hpp"
 #include "Loader.hpp"
 #include "api/Switch.hpp"
+#include "lib/timer_service.hpp"
+#include "lib/worker_pool.hpp"
 
 #include <chrono>
 #include <map>
@@ -55,6 +57,27 @@ private:
     friend class MainHandler;
 };
 
+// Progress of batched switch bring-up
+struct BringUpProgress {
+    struct Stage {
+        int priority;
+        size_t switches;
+        std::chrono::microseconds duration;
+    };
+
+    bool batched {false};
+    uint64_t batches {0};       // finished batches
+    uint64_t switches_done {0}; // switches brought up by them
+    size_t pending {0};         // waiting for the next batch
+    size_t running {0};         // switches of the running batch, 0 if none
+    size_t stage {0};           // stage being run in it
+    size_t stages {0};
+
+    // of the last finished batch
+    std::vector<Stage> last_stages;
+    std::chrono::microseconds last_batch {0};
+};
+
 class SwitchOrderingManager : public Application {
     SIMPLE_APPLICATION(SwitchOrderingManager, "switch-ordering")
     Q_OBJECT
@@ -63,6 +86,7 @@ public:
     void registerHandler(SwitchEventHandler* handler, int prio,
                          uint8_t types = 0xf);
     bool isConnected(uint64_t dpid) const;
+    BringUpProgress bringUpProgress() const;
 
 protected slots:
     void onSwitchUp(SwitchPtr sw);
@@ -71,6 +95,13 @@ protected slots:
     void onLinkDown(PortPtr port);
 private:
     void run_handling(SwitchPtr sw, EventType type);
+    void switch_up_handled(SwitchPtr sw);
+
+    // Batched bring-up: switches coming up within one tick are brought
+    // up together, one handler priority level at a time, every level
+    // running in parallel across the switches.
+    void start_batch();
+    void run_batch(std::vector<SwitchPtr> batch);
 
     HandlersMap handlers_;
     Switches connected_;
@@ -80,7 +111,16 @@ private:
     std::unique_ptr<class SwitchLocker> locker_;
 
     std::chrono::seconds echo_interval_;
-    std::unordered_map<uint64_t, QTimer*> barrier_timers_;
+    std::unordered_map<uint64_t, TimerService::handle> barrier_timers_;
+
+    bool batch_bringup_ {false};
+    QTimer* batch_timer_ {nullptr};
+    std::vector<SwitchPtr> pending_up_; // app thread only
+    std::unique_ptr<WorkerPool> batch_runner_;
+    std::unique_ptr<WorkerPool> stage_pool_;
+
+    mutable std::mutex progress_mut_;
+    BringUpProgress progress_;
 };
 
 } // namespace runos
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SwitchOrdering.hpp"
+#include "RestListener.hpp"
+
+namespace runos {
+
+struct BringUpResource : rest::resource
+{
+    SwitchOrderingManager* app;
+
+    explicit BringUpResource(SwitchOrderingManager* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override
+    {
+        auto progress = app->bringUpProgress();
+
+        auto ms = [](std::chrono::microseconds us) {
+            return us.count() / 1000.0;
+        };
+
+        rest::ptree root;
+        root.put("batched", progress.batched);
+        root.put("batches", progress.batches);
+        root.put("switches_done", progress.switches_done);
+        root.put("pending", progress.pending);
+        root.put("running", progress.running);
+        root.put("stage", progress.stage);
+        root.put("stages", progress.stages);
+        root.put("last_batch_ms", ms(progress.last_batch));
+
+        rest::ptree stages;
+        for (const auto& stage : progress.last_stages) {
+            rest::ptree spt;
+            spt.put("priority", stage.priority);
+            spt.put("switches", stage.switches);
+            spt.put("duration_ms", ms(stage.duration));
+            stages.push_back(std::make_pair("", std::move(spt)));
+        }
+        root.add_child("last_stages.array", stages);
+        root.put("last_stages._size", progress.last_stages.size());
+        return root;
+    }
+};
+
+class SwitchOrderingRest : public Application
+{
+    SIMPLE_APPLICATION(SwitchOrderingRest, "switch-ordering-rest")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto app = SwitchOrderingManager::get(loader);
+        auto rest_ = RestListener::get(loader);
+
+        rest_->mount(path_spec("/switch-ordering/bring-up/"),
+                     [=](const path_match&)
+        {
+            return BringUpResource {app};
+        });
+    }
+};
+
+REGISTER_APPLICATION(SwitchOrderingRest, {"rest-listener", "switch-ordering", ""})
+
+} // namespace runos
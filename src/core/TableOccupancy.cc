@@ -0,0 +1,150 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "TableOccupancy.hpp"
+
+#include "SwitchManager.hpp"
+#include "api/OFAgent.hpp"
+#include "api/OFConnection.hpp"
+#include "api/Switch.hpp"
+
+#include <runos/core/future.hpp>
+#include <runos/core/logging.hpp>
+
+#include <boost/thread/executors/inline_executor.hpp>
+
+#include <string>
+
+namespace runos {
+
+REGISTER_APPLICATION(TableOccupancy, {"switch-manager", ""})
+
+static boost::inline_executor occupancy_executor;
+
+void TableOccupancy::init(Loader* loader, const Config& rootConfig)
+{
+    switch_manager_ = SwitchManager::get(loader);
+
+    const Config& config = config_cd(rootConfig, "table-occupancy");
+    refresh_interval_ = std::chrono::milliseconds(
+        config_get(config, "refresh-interval-ms", 30000));
+    default_capacity_ = config_get(config, "default-capacity", 0);
+
+    connect(switch_manager_, &SwitchManager::switchUp,
+            this, &TableOccupancy::onSwitchUp);
+}
+
+void TableOccupancy::startUp(Loader*)
+{
+    if (refresh_interval_.count() <= 0)
+        return;
+
+    auto& timers = TimerService::global();
+    timer_ = timers.add("table-occupancy", refresh_interval_, [this]() {
+        auto registry = switch_manager_->registry();
+        for (const auto& sw : registry->switches()) {
+            refresh(sw, false);
+        }
+    }, TimerService::priority::low);
+    timers.start(timer_);
+}
+
+TableOccupancy::~TableOccupancy()
+{
+    if (timer_)
+        TimerService::global().remove(timer_);
+}
+
+OFAgentPtr TableOccupancy::agent(uint64_t dpid) const
+{
+    auto sw = switch_manager_->switch_(dpid);
+    auto conn = sw ? sw->connection() : nullptr;
+    return conn ? conn->agent() : nullptr;
+}
+
+void TableOccupancy::onSwitchUp(SwitchPtr sw)
+{
+    auto conn = sw->connection();
+    if (not conn)
+        return;
+    conn->agent()->occupancy().set_default_capacity(
+        sw->property("table_capacity", default_capacity_));
+    refresh(sw, true);
+}
+
+void TableOccupancy::refresh(SwitchPtr sw, bool configure)
+{
+    auto conn = sw->connection();
+    if (not conn or not conn->alive())
+        return;
+    auto agent = conn->agent();
+
+    agent->occupancy().begin_refresh();
+    future<OFAgent::sequence<of13::TableStats>> reply;
+    try {
+        reply = agent->request_table_stats();
+    } catch (const OFAgent::request_error&) {
+        return; // switch has gone
+    }
+
+    // the reply may never come, session mustn't hold the agent
+    std::weak_ptr<OFAgent> weak = agent;
+    uint64_t dpid = sw->dpid();
+    using reply_type = future<OFAgent::sequence<of13::TableStats>>;
+    reply.then(occupancy_executor, [this, weak, dpid, configure](reply_type f) {
+        try {
+            auto stats = f.get();
+            auto agent = weak.lock();
+            auto sw = switch_manager_->switch_(dpid);
+            if (not agent or not sw)
+                return;
+            auto& occupancy = agent->occupancy();
+            for (auto& table : stats) {
+                occupancy.on_table_stats(table.table_id(), table.active_count());
+                if (not configure)
+                    continue;
+                auto capacity = sw->property(
+                    "table_capacity_" + std::to_string(table.table_id()), 0);
+                if (capacity > 0)
+                    occupancy.set_capacity(table.table_id(), capacity);
+            }
+        } catch (const OFAgent::error& e) {
+            VLOG(1) << "[TableOccupancy] No table stats from " << dpid
+                    << ": " << e.what();
+        }
+    });
+}
+
+bool TableOccupancy::reserve(uint64_t dpid, uint8_t table, uint32_t n)
+{
+    auto a = agent(dpid);
+    return a && a->occupancy().reserve(table, n);
+}
+
+void TableOccupancy::release(uint64_t dpid, uint8_t table, uint32_t n)
+{
+    if (auto a = agent(dpid))
+        a->occupancy().release(table, n);
+}
+
+std::vector<table_occupancy::table> TableOccupancy::tables(uint64_t dpid) const
+{
+    auto a = agent(dpid);
+    return a ? a->occupancy().tables() : std::vector<table_occupancy::table>{};
+}
+
+} // namespace runos
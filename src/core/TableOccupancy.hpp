@@ -0,0 +1,71 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "api/OFAgentFwd.hpp"
+#include "api/SwitchFwd.hpp"
+#include "lib/table_occupancy.hpp"
+#include "lib/timer_service.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Keeps flow table occupancy of every switch (see table_occupancy)
+ * close to the truth with periodic table stats, and sets capacities:
+ * `table_capacity_<id>` or `table_capacity` of devicedb, otherwise
+ * "default-capacity" of the config.
+ *
+ * Applications reserve() entries before sending a large change and
+ * give up right away if it doesn't fit, instead of sending it and
+ * getting OFPFMFC_TABLE_FULL for every flow mod.
+ */
+class TableOccupancy : public Application
+{
+    Q_OBJECT
+    SIMPLE_APPLICATION(TableOccupancy, "table-occupancy")
+public:
+    void init(Loader* loader, const Config& config) override;
+    void startUp(Loader* loader) override;
+    ~TableOccupancy();
+
+    // false if the switch is offline or `n` entries don't fit
+    bool reserve(uint64_t dpid, uint8_t table, uint32_t n);
+    void release(uint64_t dpid, uint8_t table, uint32_t n);
+
+    std::vector<table_occupancy::table> tables(uint64_t dpid) const;
+
+protected slots:
+    void onSwitchUp(SwitchPtr sw);
+
+private:
+    class SwitchManager* switch_manager_ {nullptr};
+    std::chrono::milliseconds refresh_interval_;
+    uint32_t default_capacity_ {0};
+    TimerService::handle timer_;
+
+    OFAgentPtr agent(uint64_t dpid) const;
+    void refresh(SwitchPtr sw, bool configure);
+};
+
+} // namespace runos
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "TableOccupancy.hpp"
+#include "RestListener.hpp"
+
+#include <runos/core/throw.hpp>
+
+#include <boost/lexical_cast.hpp>
+
+namespace runos {
+
+struct TableOccupancyCollection : rest::resource
+{
+    TableOccupancy* app;
+    uint64_t dpid;
+
+    explicit TableOccupancyCollection(TableOccupancy* app, uint64_t dpid)
+        : app(app), dpid(dpid)
+    { }
+
+    rest::ptree Get() const override {
+        rest::ptree root;
+        rest::ptree tables;
+
+        for (const auto& t : app->tables(dpid)) {
+            rest::ptree tpt;
+            tpt.put("table_id", t.id);
+            tpt.put("active", t.active);
+            tpt.put("reserved", t.reserved);
+            tpt.put("capacity", t.capacity);
+            tpt.put("free", t.capacity ? t.free() : 0);
+            tpt.put("exact", t.exact);
+            tpt.put("learned", t.learned);
+            tables.push_back(std::make_pair("", std::move(tpt)));
+        }
+        root.add_child("array", tables);
+        root.put("_size", tables.size());
+        return root;
+    }
+};
+
+class TableOccupancyRest : public Application
+{
+    SIMPLE_APPLICATION(TableOccupancyRest, "table-occupancy-rest")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto app = TableOccupancy::get(loader);
+        auto rest_ = RestListener::get(loader);
+
+        rest_->mount(path_spec("/switches/(\\d+)/table-occupancy/"),
+                     [=](const path_match& m) {
+            try {
+                auto dpid = boost::lexical_cast<uint64_t>(m[1].str());
+                return TableOccupancyCollection {app, dpid};
+            } catch (const boost::bad_lexical_cast& e) {
+                THROW( rest::http_error(400), "Bad request: {}", e.what() );
+            }
+        });
+    }
+};
+
+REGISTER_APPLICATION(TableOccupancyRest, {"rest-listener", "table-occupancy", ""})
+
+} // namespace runos
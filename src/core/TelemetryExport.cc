@@ -0,0 +1,79 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "lib/telemetry_export.hpp"
+
+#include <runos/core/logging.hpp>
+
+namespace runos {
+
+// Starts TelemetryExporter::global() with the "telemetry-export"
+// settings; the statistics stores publish to it themselves
+class TelemetryExport : public Application
+{
+    SIMPLE_APPLICATION(TelemetryExport, "telemetry-export")
+public:
+    void init(Loader*, const Config& rootConfig) override
+    {
+        auto config = config_cd(rootConfig, "telemetry-export");
+
+        settings_.flush = std::chrono::milliseconds(
+            config_get(config, "flush-ms", 200));
+        settings_.max_batch_bytes = size_t(std::max(
+            config_get(config, "max-batch-bytes", 1400), 64));
+        settings_.max_queued_batches = size_t(std::max(
+            config_get(config, "max-queued-batches", 256), 1));
+
+        auto it = config.find("destinations");
+        if (it == config.end())
+            return;
+        for (auto& item : it->second.array_items()) {
+            auto& dest = item.object_items();
+            TelemetryExporter::Destination d;
+            d.url = config_get(dest, "url", "");
+            d.max_bytes_per_second =
+                config_get(dest, "max-bytes-per-second", 0.0);
+            if (d.url.empty()) {
+                LOG(WARNING) << "[telemetry-export] Destination without url";
+                continue;
+            }
+            settings_.destinations.push_back(std::move(d));
+        }
+    }
+
+    void startUp(Loader*) override
+    {
+        if (settings_.destinations.empty()) {
+            VLOG(1) << "[telemetry-export] No destinations, export is off";
+            return;
+        }
+        TelemetryExporter::global().start(settings_);
+    }
+
+    ~TelemetryExport()
+    {
+        TelemetryExporter::global().stop();
+    }
+
+private:
+    TelemetryExporter::Settings settings_;
+};
+
+REGISTER_APPLICATION(TelemetryExport, {""})
+
+}
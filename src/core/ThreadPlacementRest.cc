@@ -0,0 +1,108 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "RestListener.hpp"
+#include "lib/thread_placement.hpp"
+
+#include <thread>
+
+namespace runos {
+
+namespace {
+
+rest::ptree cpus_tree(const std::vector<int>& cpus)
+{
+    rest::ptree list;
+    for (int cpu : cpus) {
+        rest::ptree pt;
+        pt.put("", cpu);
+        list.push_back(std::make_pair("", std::move(pt)));
+    }
+    return list;
+}
+
+} // namespace
+
+struct ThreadsResource : rest::resource
+{
+    rest::ptree Get() const override
+    {
+        auto& placement = ThreadPlacement::global();
+
+        rest::ptree root;
+        rest::ptree roles;
+        for (const auto& pair : placement.roles()) {
+            rest::ptree rpt;
+            rpt.put("spec", pair.second.spec);
+            rpt.put("spread", pair.second.spread);
+            rpt.add_child("cpus", cpus_tree(pair.second.cpus));
+            roles.add_child(pair.first, rpt);
+        }
+        root.add_child("roles", roles);
+
+        rest::ptree threads;
+        size_t misplaced = 0;
+        auto infos = placement.threads();
+        for (const auto& info : infos) {
+            rest::ptree tpt;
+            tpt.put("name", info.name);
+            tpt.put("role", info.role);
+            tpt.put("index", info.index);
+            tpt.put("tid", info.tid);
+            tpt.put("cpu", info.cpu);
+            tpt.add_child("requested", cpus_tree(info.requested));
+            tpt.add_child("affinity", cpus_tree(info.affinity));
+            tpt.add_child("numa_nodes", cpus_tree(info.nodes));
+            if (not info.error.empty())
+                tpt.put("error", info.error);
+            // Changed behind our back, e.g. by taskset
+            if (not info.requested.empty() &&
+                info.requested != info.affinity)
+                ++misplaced;
+            threads.push_back(std::make_pair("", std::move(tpt)));
+        }
+        root.add_child("array", threads);
+        root.put("_size", infos.size());
+        root.put("misplaced", misplaced);
+        root.put("cpus", std::thread::hardware_concurrency());
+        return root;
+    }
+};
+
+class ThreadPlacementRest : public Application
+{
+    SIMPLE_APPLICATION(ThreadPlacementRest, "thread-placement-rest")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto rest_ = RestListener::get(loader);
+
+        rest_->mount(path_spec("/threads/"), [=](const path_match&)
+        {
+            return ThreadsResource {};
+        });
+    }
+};
+
+REGISTER_APPLICATION(ThreadPlacementRest, {"rest-listener", ""})
+
+} // namespace runos
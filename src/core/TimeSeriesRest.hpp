@@ -0,0 +1,68 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "RestListener.hpp"
+#include "api/TimeSeries.hpp"
+
+#include <string>
+#include <vector>
+
+namespace runos {
+namespace rest {
+
+// Path fragment matching a history resolution: "1s", "10s" or "1m"
+static constexpr auto history_resolution_spec = "(1s|10s|1m)";
+
+inline TimeSeries::resolution parse_resolution(const std::string& str)
+{
+    if (str == "1s")  return TimeSeries::second;
+    if (str == "10s") return TimeSeries::ten_seconds;
+    if (str == "1m")  return TimeSeries::minute;
+    THROW(http_error(400), "Bad resolution: {}", str);
+}
+
+// Samples not older than `seconds` before the newest one, read in place.
+// "t" is relative to the newest sample; seconds == 0 means everything.
+inline ptree history_to_ptree(const TimeSeries::Series& series,
+                              const std::vector<std::string>& fields,
+                              double seconds)
+{
+    ptree ret;
+    ptree samples;
+
+    if (not series.empty()) {
+        double last = series.time(series.size() - 1);
+        size_t first = seconds > 0 ? series.lower_bound(last - seconds) : 0;
+
+        for (size_t i = first; i < series.size(); ++i) {
+            ptree sample;
+            sample.put("t", series.time(i) - last);
+            for (size_t f = 0; f < fields.size() && f < series.fields(); ++f) {
+                sample.put(fields[f], series.value(f, i));
+            }
+            samples.push_back(std::make_pair("", std::move(sample)));
+        }
+    }
+
+    ret.put("_size", samples.size());
+    ret.add_child("array", samples);
+    return ret;
+}
+
+} // namespace rest
+} // namespace runos
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "RestListener.hpp"
+#include "lib/timer_service.hpp"
+
+namespace runos {
+
+struct TimersResource : rest::resource
+{
+    rest::ptree Get() const override
+    {
+        auto& service = TimerService::global();
+
+        auto prio_name = [](TimerService::priority p) {
+            switch (p) {
+            case TimerService::priority::low: return "low";
+            case TimerService::priority::high: return "high";
+            default: return "normal";
+            }
+        };
+
+        rest::ptree root;
+        rest::ptree timers;
+        size_t overdue = 0;
+        auto infos = service.timers();
+        for (const auto& info : infos) {
+            rest::ptree tpt;
+            tpt.put("name", info.name);
+            tpt.put("interval_ms", info.interval.count());
+            tpt.put("priority", prio_name(info.prio));
+            tpt.put("active", info.active);
+            tpt.put("overdue", info.overdue);
+            tpt.put("runs", info.runs);
+            tpt.put("skipped", info.skipped);
+            tpt.put("lateness_us", info.last_lateness.count());
+            tpt.put("max_lateness_us", info.max_lateness.count());
+            tpt.put("duration_us", info.last_duration.count());
+            timers.push_back(std::make_pair("", std::move(tpt)));
+            overdue += info.overdue;
+        }
+        root.add_child("array", timers);
+        root.put("_size", infos.size());
+        root.put("workers", service.workers());
+        root.put("overdue", overdue);
+        return root;
+    }
+};
+
+class TimerServiceRest : public Application
+{
+    SIMPLE_APPLICATION(TimerServiceRest, "timer-service-rest")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto rest_ = RestListener::get(loader);
+
+        rest_->mount(path_spec("/timers/"), [=](const path_match&)
+        {
+            return TimersResource {};
+        });
+    }
+};
+
+REGISTER_APPLICATION(TimerServiceRest, {"rest-listener", ""})
+
+} // namespace runos
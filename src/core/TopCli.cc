@@ -0,0 +1,240 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "SwitchManager.hpp"
+#include "OFMsgSender.hpp"
+#include "EventLoopWatchdog.hpp"
+#include "CommandLine.hpp"
+#include "api/OFAgent.hpp"
+#include "lib/metrics.hpp"
+
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+
+namespace runos {
+
+// Counters are cumulative, so each frame shows the difference from the
+// previous one divided by the time between them
+class TopView {
+public:
+    TopView(SwitchManager* sm, OFMsgSender* sender,
+            EventLoopWatchdog* watchdog, CommandLine* cli)
+        : sm_(sm), sender_(sender), watchdog_(watchdog), cli_(cli)
+    { sample(); }
+
+    void frame()
+    {
+        auto prev_switches = switches_;
+        auto prev_handlers = handlers_;
+        auto prev_time = time_;
+        sample();
+        double secs = std::chrono::duration<double>(time_ - prev_time).count();
+        if (secs <= 0)
+            secs = 1;
+
+        printLoops();
+        printSwitches(prev_switches, secs);
+        printHandlers(prev_handlers, secs);
+    }
+
+private:
+    struct SwitchSample {
+        uint64_t rx {0};
+        uint64_t tx {0};
+        uint64_t pkt_in {0};
+        size_t pending {0};
+    };
+    struct HandlerSample {
+        uint64_t count {0};
+        uint64_t sum_ns {0};
+    };
+
+    SwitchManager* sm_;
+    OFMsgSender* sender_;
+    EventLoopWatchdog* watchdog_;
+    CommandLine* cli_;
+
+    std::chrono::steady_clock::time_point time_;
+    std::map<uint64_t, SwitchSample> switches_;
+    std::map<std::string, HandlerSample> handlers_;
+
+    void sample()
+    {
+        time_ = std::chrono::steady_clock::now();
+
+        switches_.clear();
+        for (auto& sw : sm_->registry()->switches()) {
+            auto conn = sw->connection();
+            if (not conn)
+                continue;
+            SwitchSample s;
+            s.rx = conn->get_rx_packets();
+            s.tx = conn->get_tx_packets();
+            s.pkt_in = conn->get_pkt_in_packets();
+            if (auto agent = conn->agent())
+                s.pending = agent->pending();
+            switches_[sw->dpid()] = s;
+        }
+
+        handlers_.clear();
+        for (auto& h : metrics::Registry::global().histograms(
+                 "runos_controller_handler_seconds")) {
+            handlers_[h.first] = {h.second->count(), h.second->sum()};
+        }
+    }
+
+    static double rate(uint64_t now, uint64_t before, double secs)
+    { return now > before ? (now - before) / secs : 0.0; }
+
+    void printLoops()
+    {
+        cli_->print("{:<8} {:>10} {:>10} {:>10} {:>10}  {}",
+                    "LOOP", "LAG us", "P99 us", "MAX us", "STALL ms", "APPS");
+        for (auto& t : watchdog_->threads()) {
+            std::string apps;
+            for (auto& app : t.apps)
+                apps += (apps.empty() ? "" : ",") + app;
+            if (apps.size() > 32)
+                apps = apps.substr(0, 29) + "...";
+            cli_->print("{:<8} {:>10} {:>10} {:>10} {:>10}  {}",
+                        t.name, t.last_lag.count(), t.p99_lag.count(),
+                        t.max_lag.count(), t.stalled.count(), apps);
+        }
+        cli_->print("");
+    }
+
+    void printSwitches(const std::map<uint64_t, SwitchSample>& prev,
+                       double secs)
+    {
+        std::unordered_map<uint64_t, OFMsgSender::WindowInfo> windows;
+        for (auto& w : sender_->windows())
+            windows.emplace(w.dpid, w);
+
+        struct Row {
+            uint64_t dpid;
+            double rx, tx, pkt_in;
+            size_t pending;
+        };
+        std::vector<Row> rows;
+        for (auto& s : switches_) {
+            auto it = prev.find(s.first);
+            SwitchSample before = it != prev.end() ? it->second : s.second;
+            rows.push_back({s.first,
+                            rate(s.second.rx, before.rx, secs),
+                            rate(s.second.tx, before.tx, secs),
+                            rate(s.second.pkt_in, before.pkt_in, secs),
+                            s.second.pending});
+        }
+        std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) {
+            return a.rx > b.rx;
+        });
+
+        cli_->print("{:<18} {:>9} {:>9} {:>9} {:>8} {:>8} {:>7} {:>9}",
+                    "DPID", "RX/s", "TX/s", "PKTIN/s",
+                    "PENDING", "QUEUED", "WINDOW", "SRTT us");
+        for (auto& r : rows) {
+            auto w = windows.find(r.dpid);
+            bool known = w != windows.end();
+            cli_->print("{:<#18x} {:>9.1f} {:>9.1f} {:>9.1f} {:>8} {:>8} {:>7} {:>9}",
+                        r.dpid, r.rx, r.tx, r.pkt_in, r.pending,
+                        known ? w->second.queued : 0,
+                        known ? w->second.limit : 0,
+                        known ? w->second.srtt_us : 0);
+        }
+        cli_->print("");
+    }
+
+    void printHandlers(const std::map<std::string, HandlerSample>& prev,
+                       double secs)
+    {
+        static constexpr size_t shown = 10;
+
+        struct Row {
+            std::string name;
+            double calls;
+            double busy; // fraction of a thread spent in the handler
+            double mean_us;
+        };
+        std::vector<Row> rows;
+        for (auto& h : handlers_) {
+            auto it = prev.find(h.first);
+            HandlerSample before = it != prev.end() ? it->second : h.second;
+            uint64_t calls = h.second.count - before.count;
+            uint64_t ns = h.second.sum_ns - before.sum_ns;
+            if (calls == 0)
+                continue;
+            rows.push_back({h.first, calls / secs, ns / secs / 1e9,
+                            ns / 1e3 / calls});
+        }
+        std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) {
+            return a.busy > b.busy;
+        });
+        if (rows.size() > shown)
+            rows.resize(shown);
+
+        cli_->print("{:<50} {:>10} {:>7} {:>10}",
+                    "HANDLER", "CALLS/s", "BUSY %", "MEAN us");
+        for (auto& r : rows) {
+            // labels are exported as handler="...": keep the type name
+            auto name = r.name;
+            auto open = name.find('"');
+            auto close = name.rfind('"');
+            if (open != std::string::npos and close > open)
+                name = name.substr(open + 1, close - open - 1);
+            if (name.size() > 50)
+                name = "..." + name.substr(name.size() - 47);
+            cli_->print("{:<50} {:>10.1f} {:>7.1f} {:>10.1f}",
+                        name, r.calls, r.busy * 100, r.mean_us);
+        }
+    }
+};
+
+class TopCli : public Application
+{
+    SIMPLE_APPLICATION(TopCli, "top-cli")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        auto sm = SwitchManager::get(loader);
+        auto sender = OFMsgSender::get(loader);
+        auto watchdog = EventLoopWatchdog::get(loader);
+        auto cli = CommandLine::get(loader);
+
+        cli->register_command(
+            cli_pattern(R"(top(\s+([0-9]+))?)"),
+            [=](const cli_match& match) {
+                int secs = match[2].matched
+                         ? boost::lexical_cast<int>(match[2]) : 1;
+                if (secs == 0) {
+                    cli->error("Interval must be positive");
+                }
+                TopView view(sm, sender, watchdog, cli);
+                cli->watch(std::chrono::seconds(secs),
+                           [&view] { view.frame(); });
+            });
+    }
+};
+
+REGISTER_APPLICATION(TopCli, {"switch-manager", "ofmsg-sender",
+                              "event-loop-watchdog", "command-line", ""})
+
+}
@@ -15,26 +15,43 @@
  */
 
 #include "Topology.hpp"
+#include "TopologyGraph.hpp"
 
 #include "DatabaseConnector.hpp"
 #include "SwitchManager.hpp"
 #include "Recovery.hpp"
+#include "StateSnapshot.hpp"
 #include "api/Switch.hpp"
 #include "api/Port.hpp"
+#include "lib/bandwidth_ledger.hpp"
+#include "lib/event_trace.hpp"
+#include "lib/hashed_wheel.hpp"
+#include "lib/json_reader.hpp"
+#include "lib/memory_accounting.hpp"
+#include "lib/metrics.hpp"
+#include "lib/telemetry_export.hpp"
+#include "lib/worker_pool.hpp"
 #include <json.hpp>
+#include <runos/core/future.hpp>
 #include <runos/core/logging.hpp>
 
-#include <boost/graph/adjacency_list.hpp>
-#include <boost/graph/dijkstra_shortest_paths_no_color_map.hpp>
-#include <boost/property_map/function_property_map.hpp>
-
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <climits>
+#include <deque>
+#include <functional>
+#include <future>
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <queue>
 #include <sstream>
+#include <tuple>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 
 using json = nlohmann::json;
 
@@ -42,7 +59,7 @@ namespace runos {
 
 REGISTER_APPLICATION(Topology, {"link-discovery", "switch-manager", 
                                 "switch-ordering", "recovery-manager",
-                                "database-connector", ""})
+                                "database-connector", "state-snapshot", ""})
 
 using namespace boost;
 
@@ -54,15 +71,58 @@ class Path;
 using RoutePtr = std::shared_ptr<Route>;
 using PathPtr = std::shared_ptr<Path>;
 
-struct Path {
+// Flap damping deadlines of all paths on one hashed timing wheel, ticked
+// by a single timer of the Topology thread while anything is pending.
+// Paths gone before their deadline are skipped when it expires.
+class FlapDamper {
+public:
+    using clock = std::chrono::steady_clock;
+    static constexpr std::chrono::milliseconds tick {100};
+
+    struct key {
+        const Path* path;
+        uint16_t trigger;
+        bool operator==(const key& other) const
+        { return path == other.path && trigger == other.trigger; }
+    };
+    struct key_hash {
+        size_t operator()(const key& k) const
+        { return std::hash<const Path*>()(k.path) * 31 + k.trigger; }
+    };
+    using wheel = hashed_wheel<key, std::weak_ptr<Path>, key_hash>;
+    using expired = std::vector<wheel::item>;
+
+    // Runs `timer` while deadlines are pending, so arm() and expire()
+    // must be called from its thread
+    void setTicker(QTimer* timer)
+    {
+        ticker = timer;
+        ticker->setInterval(tick.count());
+    }
+
+    // (Re)starts the deadline of `tf` on `path`
+    void arm(const std::shared_ptr<Path>& path, TriggerFlag tf, uint16_t seconds);
+    void disarm(const Path* path, TriggerFlag tf)
+    { flaps.cancel(key{path, tf}); }
+
+    // Collects all deadlines that passed, stops ticking if none left
+    void expire(expired& due);
+
+    size_t size() const { return flaps.size(); }
+
+private:
+    const clock::time_point epoch {clock::now()};
+    wheel flaps {512};
+    QTimer* ticker {nullptr};
+
+    uint64_t elapsed() const
+    { return uint64_t((clock::now() - epoch) / tick); }
+};
+
+struct Path : std::enable_shared_from_this<Path> {
     Path() = delete;
     Path(uint8_t id, uint32_t route_id, data_link_route path) :
         id(id), route_id(route_id), m_path(path) {}
-    ~Path() {
-        for (auto it: flapping_timers) {
-            clearFlapping(it.first);
-        }
-    }
 
     uint8_t id;
     uint32_t route_id;
@@ -70,7 +130,8 @@ struct Path {
     uint8_t triggers {0}; // active triggers
     uint8_t broken_links {0}; //counter of broken links
     uint8_t maintn_links {0}; //counter of maintenance links
-    std::map<TriggerFlag, QTimer*> flapping_timers;
+    uint8_t damped {0}; // triggers waiting for their flap deadline
+    uint64_t bandwidth {0}; // reserved on every port of m_path, bytes/s
 
     // parameters of triggers
     uint16_t flap {0};
@@ -91,11 +152,11 @@ struct Path {
     // if there are many links that should be emitted
     // at first we must update trigger-state for all of them
     // and after that we can emit the signal
-    bool activateTrigger(TriggerFlag tf);
-    bool inactivateTrigger(TriggerFlag tf, Topology* emitter);
+    bool activateTrigger(TriggerFlag tf, FlapDamper& damper);
+    bool inactivateTrigger(TriggerFlag tf, FlapDamper& damper);
 
-    void startFlapping(TriggerFlag tf, Topology* emitter);
-    void clearFlapping(TriggerFlag tf);
+    void startFlapping(TriggerFlag tf, FlapDamper& damper);
+    void clearFlapping(TriggerFlag tf, FlapDamper& damper);
 
     json to_json() const {
         json ret;
@@ -104,6 +165,7 @@ struct Path {
         ret["drop_threshold"] = drop_threshold;
         ret["util_threshold"] = util_threshold;
         ret["metrics"] = metrics._to_string();
+        ret["bandwidth"] = bandwidth;
 
         std::for_each(m_path.begin(), m_path.end(), [&ret](auto sp) {
             ret["m_path"].push_back({sp.dpid, sp.port});
@@ -125,8 +187,13 @@ struct Route {
     uint8_t used_path { 0 };
     std::vector<PathPtr> paths;
     bool allowed_dynamic { false };
+    bool ecmp { false }; // paths are equal-cost and used together
     mutable RouteSelector dynamic;
     mutable std::mutex mut;
+    // last predictPath() result, valid while Topology::generation()
+    // stays at predicted_generation; guarded by mut
+    mutable uint64_t predicted_generation { 0 };
+    mutable data_link_route predicted;
 
     PathPtr attachPath(data_link_route path) {
         std::lock_guard<std::mutex> lock(mut);
@@ -182,6 +249,7 @@ struct Route {
             {"from", from},
             {"to", to},
             {"dynamic", allowed_dynamic},
+            {"ecmp", ecmp},
             {"used_path", used_path},
             {"owner", owner._to_string()}
         };
@@ -249,10 +317,10 @@ void Path::resetTriggers()
     triggers = 0;
 }
 
-bool Path::activateTrigger(TriggerFlag tf)
+bool Path::activateTrigger(TriggerFlag tf, FlapDamper& damper)
 {
-    if (flapping_timers.count(tf)) { // flap timer is working, stop it
-        clearFlapping(tf);
+    if (damped & tf) { // flap timer is working, stop it
+        clearFlapping(tf, damper);
         return false;
     }
 
@@ -264,16 +332,16 @@ bool Path::activateTrigger(TriggerFlag tf)
     return need_emit;
 }
 
-bool Path::inactivateTrigger(TriggerFlag tf, Topology* emitter)
+bool Path::inactivateTrigger(TriggerFlag tf, FlapDamper& damper)
 {
-    if (flapping_timers.count(tf)) { // flap timer is working
-        delTrigger(tf);                // decrease trigger counter
-        flapping_timers[tf]->start();  // restart timer
+    if (damped & tf) { // flap timer is working
+        delTrigger(tf);                               // decrease trigger counter
+        damper.arm(shared_from_this(), tf, flap);     // restart timer
         return false;
     }
 
     if (flap) {
-        startFlapping(tf, emitter);
+        startFlapping(tf, damper);
         return false;
     }
 
@@ -285,41 +353,83 @@ bool Path::inactivateTrigger(TriggerFlag tf, Topology* emitter)
     return need_emit;
 }
 
-void Path::startFlapping(TriggerFlag tf, Topology* emitter)
+void Path::startFlapping(TriggerFlag tf, FlapDamper& damper)
 {
     if (!flap) return;
 
-    QTimer* flapper = new QTimer();
-    flapper->moveToThread(emitter->thread());
-    flapping_timers.emplace(tf, flapper);
+    damped |= tf;
+    damper.arm(shared_from_this(), tf, flap);
+}
 
-    QObject::connect(flapper, &QTimer::timeout, [=]() {
-        delTrigger(tf);
-        if (not getTrigger(tf))
-            emit emitter->routeTriggerInactive(route_id, id, tf);
-        clearFlapping(tf);
-    });
-    flapper->start(flap * 1000);
+void Path::clearFlapping(TriggerFlag tf, FlapDamper& damper)
+{
+    damped &= ~tf;
+    damper.disarm(this, tf);
 }
 
-void Path::clearFlapping(TriggerFlag tf)
+void FlapDamper::arm(const std::shared_ptr<Path>& path, TriggerFlag tf,
+                     uint16_t seconds)
 {
-    try {
-        auto timer = flapping_timers.at(tf);
-        timer->stop();
-        flapping_timers.erase(tf);
-        delete timer;
-    } catch (const std::out_of_range& ex) {
-        // not found, do nothing...
+    if (flaps.empty()) {
+        // the wheel stood still while idle, catch up with the clock
+        expired none;
+        flaps.advance(elapsed() - flaps.now(), none);
+        ticker->start();
     }
+    auto ticks = std::chrono::milliseconds(seconds * 1000ull) / tick;
+    flaps.schedule(key{path.get(), tf}, ticks, path);
 }
 
-using TopologyGraph = adjacency_list< multisetS, vecS, undirectedS, no_property, link_property>;
-using vertex_descriptor = TopologyGraph::vertex_descriptor;
-using edge_descriptor = TopologyGraph::edge_descriptor;
+void FlapDamper::expire(expired& due)
+{
+    flaps.advance(elapsed() - flaps.now(), due);
+    if (flaps.empty())
+        ticker->stop();
+}
+
+// Immutable copy of a route for observers, published by modifiers
+struct RouteSnapshot {
+    struct PathState {
+        data_link_route m_path;
+        uint8_t triggers;
+        uint16_t flap;
+        bool broken_flag;
+        uint8_t drop_threshold;
+        uint8_t util_threshold;
+    };
+
+    explicit RouteSnapshot(const Route& route)
+        : id(route.id), from(route.from), to(route.to), owner(route.owner)
+        , ecmp(route.ecmp)
+    {
+        std::lock_guard<std::mutex> lock(route.mut);
+        used_path = route.used_path;
+        paths.reserve(route.paths.size());
+        for (const auto& path : route.paths) {
+            paths.push_back(PathState{path->m_path, path->triggers, path->flap,
+                                      path->broken_flag, path->drop_threshold,
+                                      path->util_threshold});
+        }
+        dump = route.to_json().dump();
+    }
+
+    uint32_t id;
+    uint64_t from;
+    uint64_t to;
+    ServiceFlag owner;
+    bool ecmp;
+    uint8_t used_path;
+    std::vector<PathState> paths;
+    std::string dump;
+};
+
+using RouteSnapshotPtr = std::shared_ptr<const RouteSnapshot>;
 
 struct TopologyImpl {
-    TopologyImpl(Topology* app): app(app) {};
+    TopologyImpl(Topology* app): app(app) {
+        for (auto& shard : route_snapshots)
+            shard = std::make_shared<const RouteShard>();
+    };
 
     std::mutex graph_mutex;
     Topology* app;
@@ -330,10 +440,38 @@ struct TopologyImpl {
     TopologyGraph graph;
     std::unordered_map<uint64_t, vertex_descriptor>
         vertex_map;
+    // both ports of every link, kept by addLink and linkBroken
+    std::unordered_map<switch_and_port, edge_descriptor> port_edges;
     std::unordered_map<uint32_t, RoutePtr> route_map;
 
+    // Observers read routes from snapshots without locks. Sharded by
+    // route id, so a commit copies only a part of the routes.
+    static constexpr size_t route_shards = 16;
+    using RouteShard = std::unordered_map<uint32_t, RouteSnapshotPtr>;
+    std::array<std::shared_ptr<const RouteShard>, route_shards> route_snapshots;
+    std::array<std::mutex, route_shards> commit_mutex; // serializes writers
+
     std::map<switch_and_port, std::pair<uint8_t, uint8_t> > triggers;
     std::map<switch_and_port, uint64_t> speed_rate; // bytes/s
+    // port -> paths with drop or util threshold over it, ordered by
+    // (route id, path id); rebuilt by reloadStats after route changes
+    std::map<switch_and_port, std::vector<PathPtr> > trigger_index;
+    std::vector<PathPtr> trigger_paths; // everything in the index
+    std::atomic<bool> trigger_index_stale {true};
+    mutable SptCache spt_cache;
+    HopMatrixPtr hops {std::make_shared<HopMatrix>()};
+    mutable std::mutex csr_mutex;
+    mutable CsrGraphPtr csr_snapshot; // null if invalidated
+    // evaluates route triggers in parallel, null in serial mode
+    std::unique_ptr<WorkerPool> workers;
+    size_t ecmp_max_paths {16};
+    uint8_t te_threshold {70}; // percents of port speed
+    size_t te_max_moves {32};
+    FlapDamper flaps; // used from the Topology thread only
+    mutable std::mutex ledger_mutex;
+    bandwidth_ledger ledger; // guarded by ledger_mutex
+    // registered last, so it goes away before what it looks at
+    memory::Registry::Handle memory_probe;
 
     vertex_descriptor vertex(uint64_t dpid) const {
         auto it = vertex_map.find(dpid);
@@ -343,8 +481,74 @@ struct TopologyImpl {
 
     vertex_descriptor new_vertex(uint64_t dpid) {
         auto it = vertex_map.find(dpid);
-        return it != vertex_map.end() ? it->second
-                   : vertex_map[dpid] = add_vertex(graph);
+        if (it != vertex_map.end())
+            return it->second;
+        invalidate_csr();
+        return vertex_map[dpid] = add_vertex(graph);
+    }
+
+    // must be called after any change of graph structure or link metrics
+    void invalidate_csr() {
+        std::lock_guard<std::mutex> lk(csr_mutex);
+        csr_snapshot.reset();
+    }
+
+    // hop matrix maintenance, must be called under graph_mutex
+    // after the graph has been changed
+    void hopsLinkAdded(vertex_descriptor u, vertex_descriptor v) {
+        auto next = std::make_shared<HopMatrix>(*std::atomic_load(&hops),
+                                                num_vertices(graph));
+        next->index = vertex_map;
+        // a new link can only shorten paths going through it
+        size_t n = next->n;
+        auto via = [](uint8_t x, uint8_t y) -> unsigned {
+            return x == HopMatrix::unreachable || y == HopMatrix::unreachable
+                 ? HopMatrix::unreachable : x + 1u + y;
+        };
+        std::vector<uint8_t> to_u(n), to_v(n);
+        for (size_t a = 0; a < n; a++) {
+            to_u[a] = next->at(a, u);
+            to_v[a] = next->at(a, v);
+        }
+        for (size_t a = 0; a < n; a++) {
+            for (size_t b = 0; b < n; b++) {
+                unsigned d = std::min(via(to_u[a], to_v[b]), via(to_v[a], to_u[b]));
+                if (d < next->at(a, b))
+                    next->at(a, b) = std::min<unsigned>(d, HopMatrix::unreachable - 1);
+            }
+        }
+        std::atomic_store(&hops, HopMatrixPtr(std::move(next)));
+    }
+
+    void hopsLinkRemoved(vertex_descriptor u, vertex_descriptor v) {
+        auto next = std::make_shared<HopMatrix>(*std::atomic_load(&hops),
+                                                num_vertices(graph));
+        next->index = vertex_map;
+        if (edge_range(u, v, graph).first == edge_range(u, v, graph).second) {
+            // only sources with the link on some shortest path are affected
+            for (size_t a = 0; a < next->n; a++) {
+                uint8_t du = next->at(a, u), dv = next->at(a, v);
+                if (du == HopMatrix::unreachable || dv == HopMatrix::unreachable)
+                    continue;
+                if (du + 1 == dv || dv + 1 == du)
+                    next->bfs(a, graph);
+            }
+        }
+        std::atomic_store(&hops, HopMatrixPtr(std::move(next)));
+    }
+
+    void hopsReindex() {
+        auto next = std::make_shared<HopMatrix>(*std::atomic_load(&hops),
+                                                num_vertices(graph));
+        next->index = vertex_map;
+        std::atomic_store(&hops, HopMatrixPtr(std::move(next)));
+    }
+
+    CsrGraphPtr csr() const {
+        std::lock_guard<std::mutex> lk(csr_mutex);
+        if (not csr_snapshot)
+            csr_snapshot = std::make_shared<const CsrGraph>(graph);
+        return csr_snapshot;
     }
 
     void delete_vertex(uint64_t dpid) {
@@ -382,20 +586,350 @@ struct TopologyImpl {
     }
 
     void eraseRoute(uint32_t route_id) { // TODO mutex
-        if (route_map.find(route_id) == route_map.end())
+        auto it = route_map.find(route_id);
+        if (it == route_map.end())
+            return;
+
+        for (const auto& path : it->second->paths)
+            release(*path);
+        route_map.erase(it);
+    }
+
+    // Admits a reservation of `rate` over all ports of `path` or none
+    bool reserve(const data_link_route& path, uint64_t rate) {
+        static metrics::Counter& admitted = metrics::Registry::global()
+            .counter("runos_topology_reservations_admitted_total",
+                     "Bandwidth reservations of paths admitted");
+        static metrics::Counter& rejected = metrics::Registry::global()
+            .counter("runos_topology_reservations_rejected_total",
+                     "Bandwidth reservations of paths rejected for lack of capacity");
+
+        std::lock_guard<std::mutex> lk(ledger_mutex);
+        bool ok = ledger.reserve(path, rate);
+        (ok ? admitted : rejected).add();
+        return ok;
+    }
+
+    void release(const Path& path) {
+        if (path.bandwidth == 0)
+            return;
+        std::lock_guard<std::mutex> lk(ledger_mutex);
+        ledger.release(path.m_path, path.bandwidth);
+    }
+
+    // Clears the triggers of all paths whose flap deadline passed at
+    // once, signals are emitted afterwards
+    void expireFlapping() {
+        FlapDamper::expired due;
+        flaps.expire(due);
+        if (due.empty())
+            return;
+
+        std::vector<std::pair<PathPtr, TriggerFlag>> inactive;
+        {
+            std::lock_guard<std::mutex> lk(graph_mutex);
+            for (const auto& it : due) {
+                auto path = it.second.lock();
+                auto tf = TriggerFlag::_from_integral(it.first.trigger);
+                if (not path || not (path->damped & tf))
+                    continue; // path is gone
+
+                path->damped &= ~tf;
+                path->delTrigger(tf);
+                if (not path->getTrigger(tf))
+                    inactive.emplace_back(std::move(path), tf);
+            }
+        }
+
+        for (const auto& it : inactive) {
+            emit app->routeTriggerInactive(it.first->route_id, it.first->id,
+                                           it.second);
+        }
+    }
+
+    // Must be called after every change of a route visible to observers:
+    // its paths, their trigger state and settings. Drops erased routes.
+    void publish(uint32_t route_id) {
+        RouteSnapshotPtr snapshot;
+        auto it = route_map.find(route_id);
+        if (it != route_map.end())
+            snapshot = std::make_shared<const RouteSnapshot>(*it->second);
+
+        size_t i = route_id % route_shards;
+        std::unique_lock<std::mutex> lk(commit_mutex[i]);
+        auto next = std::make_shared<RouteShard>(*std::atomic_load(&route_snapshots[i]));
+        if (snapshot)
+            (*next)[route_id] = std::move(snapshot);
+        else
+            next->erase(route_id);
+        std::atomic_store(&route_snapshots[i],
+                          std::shared_ptr<const RouteShard>(std::move(next)));
+        lk.unlock();
+        emit app->routeUpdated(route_id);
+    }
+
+    void publish(const std::vector<PathPtr>& paths) {
+        std::vector<uint32_t> ids;
+        for (const auto& path : paths)
+            ids.push_back(path->route_id);
+        publish(std::move(ids));
+    }
+
+    // Same as publish() of every id, but every shard is copied once
+    // and snapshots are made on the workers. Without `notify` the
+    // caller emits routeUpdated() on its own.
+    void publish(std::vector<uint32_t> ids, bool notify = true) {
+        auto by_shard = [](uint32_t a, uint32_t b) {
+            return std::make_pair(a % route_shards, a)
+                 < std::make_pair(b % route_shards, b);
+        };
+        std::sort(ids.begin(), ids.end(), by_shard);
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+        std::vector<RoutePtr> routes(ids.size());
+        for (size_t i = 0; i < ids.size(); i++) {
+            auto it = route_map.find(ids[i]);
+            if (it != route_map.end())
+                routes[i] = it->second;
+        }
+        std::vector<RouteSnapshotPtr> snapshots(ids.size());
+        parallel_for(ids.size(), [&](size_t i) {
+            if (routes[i])
+                snapshots[i] = std::make_shared<const RouteSnapshot>(*routes[i]);
+        });
+
+        for (size_t first = 0, last; first < ids.size(); first = last) {
+            size_t shard = ids[first] % route_shards;
+            for (last = first; last < ids.size() &&
+                               ids[last] % route_shards == shard; last++) { }
+
+            std::unique_lock<std::mutex> lk(commit_mutex[shard]);
+            auto next = std::make_shared<RouteShard>(
+                *std::atomic_load(&route_snapshots[shard]));
+            for (size_t i = first; i < last; i++) {
+                if (snapshots[i])
+                    (*next)[ids[i]] = std::move(snapshots[i]);
+                else
+                    next->erase(ids[i]);
+            }
+            std::atomic_store(&route_snapshots[shard],
+                              std::shared_ptr<const RouteShard>(std::move(next)));
+        }
+
+        if (not notify)
+            return;
+        std::sort(ids.begin(), ids.end());
+        for (auto id : ids)
+            emit app->routeUpdated(id);
+    }
+
+    // Stores snapshots of the routes in one request. Sent under
+    // graph_mutex, so it can't overtake later changes.
+    future<void> storeRoutes(std::vector<uint32_t> ids) {
+        auto db = app->db_connector_;
+        if (not db)
+            return make_ready_future();
+
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        DatabaseConnector::SValues values;
+        values.reserve(ids.size());
+        for (auto id : ids) {
+            if (auto route = snapshot(id)) {
+                values.push_back({ "topology:route", std::to_string(id),
+                                   route->dump });
+            }
+        }
+        if (values.empty())
+            return make_ready_future();
+        return db->putSValues(std::move(values));
+    }
+
+    // Traffic engineering of dynamic routes, see Topology::reoptimize()
+    struct TeMove {
+        RoutePtr route;
+        uint8_t path_id; // max_path_id if `path` is a new one
+        data_link_route path;
+    };
+    std::vector<TeMove> planMoves();
+
+    // f(i) for every i below n, in chunks over the workers if any
+    template<class F>
+    void parallel_for(size_t n, F&& f) {
+        if (not workers || n < 2) {
+            for (size_t i = 0; i < n; i++)
+                f(i);
             return;
+        }
+
+        size_t nchunks = std::min(workers->size(), n);
+        size_t chunk = (n + nchunks - 1) / nchunks;
+        std::vector<std::future<void>> done;
+        for (size_t c = 0; c < nchunks; c++) {
+            auto job = std::make_shared<std::packaged_task<void()>>(
+                [&, c]() {
+                    size_t end = std::min(n, (c + 1) * chunk);
+                    for (size_t i = c * chunk; i < end; i++)
+                        f(i);
+                });
+            done.push_back(job->get_future());
+            workers->submit(c, [job]() { (*job)(); });
+        }
+        for (auto& task : done)
+            task.get();
+    }
+
+    RouteSnapshotPtr snapshot(uint32_t route_id) const {
+        auto shard = std::atomic_load(&route_snapshots[route_id % route_shards]);
+        auto it = shard->find(route_id);
+        return it != shard->end() ? it->second : nullptr;
+    }
+
+    // throws std::out_of_range as route_map.at() did
+    RouteSnapshotPtr snapshotAt(uint32_t route_id) const {
+        auto ret = snapshot(route_id);
+        if (not ret)
+            throw std::out_of_range("no route " + std::to_string(route_id));
+        return ret;
+    }
 
-        route_map.erase(route_id);
+    template<class F>
+    void forEachSnapshot(F&& f) const {
+        for (const auto& shard : route_snapshots) {
+            for (const auto& it : *std::atomic_load(&shard))
+                f(*it.second);
+        }
+    }
+
+    // Paths or their thresholds changed: reindex and evaluate
+    // every path on the next stats tick
+    void invalidateTriggers() { trigger_index_stale = true; }
+
+    // Returns true if the index was rebuilt
+    bool refreshTriggerIndex() {
+        // cleared first, a concurrent modifier marks it again
+        if (not trigger_index_stale.exchange(false))
+            return false;
+
+        std::lock_guard<std::mutex> lk(graph_mutex);
+        std::vector<RoutePtr> routes;
+        routes.reserve(route_map.size());
+        for (auto it : route_map)
+            routes.push_back(it.second);
+        std::sort(routes.begin(), routes.end(), [](const auto& a, const auto& b) {
+            return a->id < b->id;
+        });
+
+        trigger_index.clear();
+        trigger_paths.clear();
+        for (const auto& route : routes) {
+            std::lock_guard<std::mutex> lock(route->mut);
+            for (const auto& path : route->paths) {
+                if (not path->drop_threshold && not path->util_threshold)
+                    continue;
+                trigger_paths.push_back(path);
+                for (auto sp : path->m_path)
+                    trigger_index[sp].push_back(path);
+            }
+        }
+
+        // loads of ports off every path are never looked at again
+        for (auto it = triggers.begin(); it != triggers.end(); ) {
+            if (trigger_index.count(it->first))
+                ++it;
+            else
+                it = triggers.erase(it);
+        }
+        return true;
+    }
+
+    // Routes with their paths, the graph and the hop matrix
+    void memoryUsage(memory::Sheet& sheet) {
+        std::lock_guard<std::mutex> lk(graph_mutex);
+
+        auto routes = memory::footprint(route_map);
+        for (const auto& it : route_map) {
+            const auto& route = it.second;
+            std::lock_guard<std::mutex> lock(route->mut);
+            routes.bytes += sizeof(Route) + memory::node_overhead
+                          + memory::footprint(route->paths).bytes;
+            for (const auto& path : route->paths) {
+                routes.bytes += sizeof(Path) + memory::node_overhead
+                              + memory::footprint(path->m_path).bytes;
+            }
+        }
+        routes.bytes += flaps.size() * (sizeof(FlapDamper::wheel::item)
+                                        + sizeof(uint64_t)
+                                        + memory::node_overhead);
+        forEachSnapshot([&routes](const RouteSnapshot& route) {
+            routes.bytes += sizeof(RouteSnapshot) + memory::node_overhead
+                          + memory::heap_bytes(route.dump)
+                          + memory::footprint(route.paths).bytes;
+            for (const auto& path : route.paths)
+                routes.bytes += memory::footprint(path.m_path).bytes;
+        });
+        sheet.add("routes", routes);
+
+        // adjacency_list keeps edge properties in a list and every edge
+        // in the out-edge sets of both endpoints
+        uint64_t n_edges = num_edges(graph);
+        memory::Usage links { n_edges * (sizeof(link_property)
+                                         + 2 * sizeof(void*)
+                                         + memory::node_overhead),
+                              n_edges };
+        links.bytes += memory::tree_footprint<
+            std::pair<vertex_descriptor, void*>>(2 * n_edges).bytes;
+        links.bytes += num_vertices(graph)
+                     * sizeof(std::multiset<std::pair<vertex_descriptor, void*>>);
+        links.bytes += memory::footprint(vertex_map).bytes
+                     + memory::footprint(port_edges).bytes;
+        links.bytes += memory::footprint(triggers).bytes
+                     + memory::footprint(speed_rate).bytes
+                     + memory::footprint(trigger_index).bytes
+                     + memory::footprint(trigger_paths).bytes;
+        for (const auto& it : trigger_index)
+            links.bytes += memory::footprint(it.second).bytes;
+        sheet.add("graph", links);
+
+        {
+            std::lock_guard<std::mutex> lk(ledger_mutex);
+            sheet.add("reservations", {
+                ledger.size() * (2 * sizeof(switch_and_port)
+                                 + 4 * sizeof(uint64_t)
+                                 + 2 * memory::node_overhead),
+                ledger.size() });
+        }
+
+        auto hop_matrix = std::atomic_load(&hops);
+        sheet.add("hop-matrix", {
+            memory::footprint(hop_matrix->dist).bytes
+                + memory::footprint(hop_matrix->index).bytes,
+            hop_matrix->n });
     }
 
     data_link_route findPath(RoutePtr route, RouteSelector selector) const;
+    std::vector<data_link_route> equalCostPaths(uint64_t from, uint64_t to,
+                                                MetricsFlag mf, size_t limit) const;
+    std::vector<data_link_route> disjointPaths(RoutePtr route, RouteSelector selector,
+                                               uint8_t count) const;
+    void prepareOverlay(RoutePtr route, RouteSelector& selector,
+                        GraphOverlay& overlay) const;
     data_link_route exactPath(switch_list exact) const;
     data_link_route inExPath(switch_list include, switch_list exclude,
-                                 MetricsFlag m, RoutePtr route, TopologyGraph& g) const;
-    data_link_route computePath(uint64_t from_dpid, uint64_t to_dpid, 
-                                 MetricsFlag mf, const TopologyGraph& g) const;
-
-    void maxWeight(const data_link_route& route, TopologyGraph& g) const;
+                                 MetricsFlag m, RoutePtr route, GraphOverlay& ov) const;
+    data_link_route computePath(uint64_t from_dpid, uint64_t to_dpid,
+                                 MetricsFlag mf, const GraphOverlay& ov) const;
+    // Predecessors computePath() walks to reach `to`
+    std::vector<vertex_descriptor> pathTree(vertex_descriptor to, MetricsFlag mf,
+                                            const GraphOverlay& ov,
+                                            const CsrGraph& csr) const;
+    // Path from `from_dpid` along a tree of pathTree(to)
+    data_link_route tracePath(uint64_t from_dpid, vertex_descriptor to,
+                              const std::vector<vertex_descriptor>& p,
+                              MetricsFlag mf, const GraphOverlay& ov,
+                              const CsrGraph& csr) const;
+
+    void maxWeight(const data_link_route& route, GraphOverlay& ov) const;
     std::vector<link_property> get_dump() { // TODO: check
         std::vector<link_property> ret;
         auto e = edges(graph);
@@ -409,10 +943,16 @@ struct TopologyImpl {
     }
 };
 
-data_link_route TopologyImpl::computePath(uint64_t from_dpid, uint64_t to_dpid, 
-                                 MetricsFlag mf, const TopologyGraph& g) const
+data_link_route TopologyImpl::computePath(uint64_t from_dpid, uint64_t to_dpid,
+                                 MetricsFlag mf, const GraphOverlay& ov) const
 {
+    static metrics::Histogram& duration = metrics::Registry::global()
+        .histogram("runos_topology_path_seconds",
+                   "Time to compute a path between two switches");
+    metrics::ScopedTimer timer(duration);
+
     data_link_route ret;
+    const TopologyGraph& g = *ov.g;
     if (num_vertices(g) == 0)
         return ret;
 
@@ -421,31 +961,34 @@ data_link_route TopologyImpl::computePath(uint64_t from_dpid, uint64_t to_dpid,
     if (v == TopologyGraph::null_vertex() || e == TopologyGraph::null_vertex())
         return ret;
 
-    std::vector<vertex_descriptor> p(num_vertices(g), TopologyGraph::null_vertex());
-
-    // _constructor_ for weight_map
-    auto select_metrics = [&g, &mf](TopologyGraph::edge_descriptor ed) {
-        switch (mf) {
-        case MetricsFlag::Hop:
-            return g[ed].hop_metrics;
-        case MetricsFlag::PortSpeed:
-            return g[ed].ps_metrics;
-        case MetricsFlag::PortLoading:
-            return g[ed].pl_metrics;
-        default:
-            // FIXME: should throw exception?
-            LOG(ERROR) << "[Topology] Incorrect metrics!";
-            return (uint64_t)0;
-        }
-    };
-    auto metrics_weight_map = 
-         boost::make_function_property_map<TopologyGraph::edge_descriptor, uint64_t>
-         (select_metrics);
+    auto csr = this->csr();
+    if (ov.empty() && SptCache::cacheable(mf) && ov.g == &graph)
+        return tracePath(from_dpid, e, pathTree(e, mf, ov, *csr), mf, ov, *csr);
+    // one-off tree: search only as far as this path needs
+    return tracePath(from_dpid, e, csr->route(v, e, mf, ov), mf, ov, *csr);
+}
+
+std::vector<vertex_descriptor>
+TopologyImpl::pathTree(vertex_descriptor to, MetricsFlag mf,
+                       const GraphOverlay& ov, const CsrGraph& csr) const
+{
+    if (ov.empty() && SptCache::cacheable(mf) && ov.g == &graph) {
+        // plain request on the live graph: reuse the maintained tree
+        return spt_cache.get(to, mf, graph);
+    }
+    return csr.predecessors(to, mf, ov);
+}
 
-    // computing predecessor_map with dijkstra algorithm
-    dijkstra_shortest_paths_no_color_map(g, e, weight_map( metrics_weight_map )
-        .predecessor_map( make_iterator_property_map(p.begin(), boost::get(vertex_index, g)) )
-    );
+data_link_route TopologyImpl::tracePath(uint64_t from_dpid, vertex_descriptor e,
+                                        const std::vector<vertex_descriptor>& p,
+                                        MetricsFlag mf, const GraphOverlay& ov,
+                                        const CsrGraph& csr) const
+{
+    data_link_route ret;
+    auto v = vertex(from_dpid);
+    if (v == TopologyGraph::null_vertex() || v >= p.size() || v >= csr.size())
+        return ret;
+    const auto& weight = csr.metrics(mf);
 
     // computing result path from v to e
     // using predecessor_map
@@ -454,36 +997,16 @@ data_link_route TopologyImpl::computePath(uint64_t from_dpid, uint64_t to_dpid,
     while (v != e) {
         uint64_t min_metrics = 0;
         switch_and_port res1, res2;
-        auto edges = edge_range(v, u, g);
-        for (auto it = edges.first; it != edges.second; it++) {
-            // comparing parallel links using selected metrics
-            auto check_metrics = [&min_metrics](const auto& link, auto mf){
-                uint64_t curr {0};
-                switch (mf) {
-                case MetricsFlag::Hop:
-                    curr = link.hop_metrics;
-                    break;
-                case MetricsFlag::PortSpeed:
-                    curr = link.ps_metrics;
-                    break;
-                case MetricsFlag::PortLoading:
-                    curr = link.pl_metrics;
-                    break;
-                default:
-                    LOG(ERROR) << "[Topology] Incorrect metrics";
-                }
-
-                if (!min_metrics || min_metrics > curr) {
-                    min_metrics = curr;
-                    return true;
-                }
-                return false;
-            };
+        for (uint32_t i = csr.offsets[v]; i < csr.offsets[v + 1]; i++) {
+            if (csr.targets[i] != u || not ov.allows(csr.links[i], v, u))
+                continue;
 
-            const auto& link = g[*it];
-            if (check_metrics(link, mf)) {
-                res1 = link.source;
-                res2 = link.target;
+            // comparing parallel links using selected metrics
+            uint64_t curr = weight[i] + ov.penalty_of(csr.links[i]);
+            if (!min_metrics || min_metrics > curr) {
+                min_metrics = curr;
+                res1 = csr.links[i]->source;
+                res2 = csr.links[i]->target;
             }
         }
 
@@ -510,10 +1033,11 @@ data_link_route TopologyImpl::computePath(uint64_t from_dpid, uint64_t to_dpid,
     return ret;
 }
 
-void TopologyImpl::maxWeight(const data_link_route& path, TopologyGraph& g) const
+void TopologyImpl::maxWeight(const data_link_route& path, GraphOverlay& ov) const
 {
     if (path.size() == 0) return;
 
+    const TopologyGraph& g = *ov.g;
     for (auto it = path.begin(), next = it++; it != path.end(); it++, next++) {
         if (it->dpid == next->dpid)
             continue;
@@ -522,14 +1046,12 @@ void TopologyImpl::maxWeight(const data_link_route& path, TopologyGraph& g) cons
 
         auto edges = edge_range(vertex(it->dpid), vertex(next->dpid), g);
         for (auto par = edges.first; par != edges.second; ++par) {
-            link_property& prop = g[*par];
+            const link_property& prop = g[*par];
             if (prop.source != *it && prop.target != *it) { // if parallel links
                 continue;
             }
 
-            prop.hop_metrics += max_weight;
-            prop.ps_metrics += max_weight;
-            prop.pl_metrics += max_weight;
+            ov.penalize(*par, max_weight);
         }
     }
 }
@@ -541,15 +1063,15 @@ data_link_route TopologyImpl::exactPath(switch_list exact) const
         auto curr = exact.at(i);
         auto sw = app->m_switch_manager->switch_(curr);
         auto next = exact.at(i+1);
-        auto ports = sw->ports();
+        auto ports = sw->ports_snapshot();
 
-        auto found = std::find_if(ports.begin(), ports.end(), 
+        auto found = std::find_if(ports->begin(), ports->end(), 
             [this, curr, next](auto port) {
                 switch_and_port sp { curr, port->number() };
                 return app->other(sp).dpid == next;
         });
 
-        if (found == ports.end()) {
+        if (found == ports->end()) {
             LOG(WARNING) << "[Topology] Creating path - Can't create exact path"
                             "between <" << exact.front() <<
                             "> and <" << exact.back() << ">";
@@ -566,16 +1088,15 @@ data_link_route TopologyImpl::exactPath(switch_list exact) const
 }
 
 data_link_route TopologyImpl::inExPath(switch_list include, switch_list exclude,
-                                       MetricsFlag m, RoutePtr route,  TopologyGraph& g) const
+                                       MetricsFlag m, RoutePtr route, GraphOverlay& ov) const
 {
     data_link_route ret;
     auto from = route->from;
     auto to = route->to;
 
     for (auto dpid : exclude) {
-        if (dpid != from && dpid != to && 
-                vertex(dpid) != TopologyGraph::null_vertex())
-            clear_vertex(vertex(dpid), g);
+        if (dpid != from && dpid != to)
+            ov.mask(vertex(dpid));
     }
 
     switch_list ends {from, to};
@@ -590,7 +1111,7 @@ data_link_route TopologyImpl::inExPath(switch_list include, switch_list exclude,
 
     auto tfrom = from;
     for (auto dpid : include) {
-        auto part = computePath(tfrom, dpid, m, g);
+        auto part = computePath(tfrom, dpid, m, ov);
         if (part.size() == 0) {
             VLOG(2) << "[Topology] Creating path - No path between <" 
                     << from << "> and <" << to
@@ -606,41 +1127,39 @@ data_link_route TopologyImpl::inExPath(switch_list include, switch_list exclude,
     return ret;
 }
 
-data_link_route TopologyImpl::findPath(RoutePtr route, RouteSelector selector) const
+void TopologyImpl::prepareOverlay(RoutePtr route, RouteSelector& selector,
+                                  GraphOverlay& overlay) const
 {
     using namespace route_selector;
 
-    app->updateMetrics();
-
-    data_link_route ret;
-    TopologyGraph tmp_graph(graph);
-
-    std::for_each(route->paths.begin(), route->paths.end(), [&tmp_graph, this](auto path) {
-        this->maxWeight(path->m_path, tmp_graph);
+    std::for_each(route->paths.begin(), route->paths.end(), [&overlay, this](auto path) {
+        this->maxWeight(path->m_path, overlay);
     });
 
-    // erase maintenance switches
-    for (auto sw : app->m_switch_manager->switches()) {
+    // mask maintenance switches
+    auto registry = app->m_switch_manager->registry();
+    for (const auto& sw : registry->switches()) {
         if (sw->maintenance()) {
-            clear_vertex(vertex(sw->dpid()), tmp_graph);
+            overlay.mask(vertex(sw->dpid()));
         }
     }
 
-    // erase maintenance and overloaded links
+    // mask maintenance and overloaded links
     uint8_t util = selector.get(util_trigger) ? *selector.get(util_trigger) : 0;
-    for (auto sw : app->m_switch_manager->switches()) {
+    for (const auto& sw : registry->switches()) {
         if (sw->maintenance()) continue; // already removed
 
-        for (auto port : sw->ports()) {
+        auto ports = sw->ports_snapshot();
+        for (auto port : *ports) {
             auto sp = switch_and_port {sw->dpid(), port->number()};
             auto other = app->other(sp);
             if (other.dpid == 0 || sp.dpid == other.dpid) // not core port or loopback
                 continue;
 
-            if (port->maintenance()) { // erase maintenance port
-                auto e = edge(sp, tmp_graph);
+            if (port->maintenance()) { // mask maintenance port
+                auto e = edge(sp, graph);
                 if (e.second) {
-                    remove_edge(e.first, tmp_graph);
+                    overlay.mask(e.first);
                 }
             }
             else if (util > 0) { // else check overload
@@ -654,15 +1173,36 @@ data_link_route TopologyImpl::findPath(RoutePtr route, RouteSelector selector) c
 
                 if (tx > allowed || rx > allowed) {
                     VLOG(7) << "[Topology] Overloaded link - " << sp;
-                    auto e = edge(sp, tmp_graph);
+                    auto e = edge(sp, graph);
                     if (e.second) {
-                        remove_edge(e.first, tmp_graph);
+                        overlay.mask(e.first);
                     }
                 }
             }
         }
     }
 
+    // mask links which can't carry the demanded bandwidth, only those
+    // are visited
+    if (selector.get(bandwidth) && *selector.get(bandwidth) > 0) {
+        std::lock_guard<std::mutex> lk(ledger_mutex);
+        ledger.for_each_short(*selector.get(bandwidth), [&](switch_and_port sp) {
+            auto e = edge(sp, graph);
+            if (e.second) {
+                overlay.mask(e.first);
+            }
+        });
+    }
+}
+
+data_link_route TopologyImpl::findPath(RoutePtr route, RouteSelector selector) const
+{
+    using namespace route_selector;
+
+    data_link_route ret;
+    GraphOverlay overlay(graph);
+    prepareOverlay(route, selector, overlay);
+
     auto from = route->from;
     auto to = route->to;
     MetricsFlag metr = selector.get(metrics) ? *selector.get(metrics) : +MetricsFlag::Hop;
@@ -685,9 +1225,9 @@ data_link_route TopologyImpl::findPath(RoutePtr route, RouteSelector selector) c
         if (selector.get(exclude_dpid))
             exclude = std::move(*selector.get(exclude_dpid));
         ret = std::move(inExPath(std::move(include), std::move(exclude),
-                                 metr, route, tmp_graph));
+                                 metr, route, overlay));
     } else {
-        ret = std::move(computePath(from, to, metr, tmp_graph));
+        ret = std::move(computePath(from, to, metr, overlay));
     }
 
     if (ret.empty() || route->hasPath(ret))
@@ -696,6 +1236,355 @@ data_link_route TopologyImpl::findPath(RoutePtr route, RouteSelector selector) c
     return ret;
 }
 
+// Computes up to `count` link-disjoint paths with minimal total metrics
+// in one pass (successive shortest paths on the residual graph, the
+// k-path generalization of Suurballe's algorithm).
+// Paths are returned in ascending order of their own metrics.
+// Every least-cost path, links within a path are picked on the shortest
+// path DAG towards `to`. Parallel links give separate paths.
+std::vector<data_link_route> TopologyImpl::equalCostPaths(uint64_t from, uint64_t to,
+                                                          MetricsFlag mf,
+                                                          size_t limit) const
+{
+    std::vector<data_link_route> ret;
+    auto v = vertex(from);
+    auto e = vertex(to);
+    if (v == TopologyGraph::null_vertex() || e == TopologyGraph::null_vertex() || v == e)
+        return ret;
+
+    auto csr = this->csr();
+    const auto& weight = csr->metrics(mf);
+    GraphOverlay ov(graph);
+    std::vector<uint64_t> dist;
+    csr->predecessors(e, mf, ov, &dist);
+    if (v >= dist.size() || dist[v] == CsrGraph::infinity)
+        return ret;
+
+    data_link_route path;
+    std::function<void(uint32_t, uint64_t)> walk = [&](uint32_t x, uint64_t dpid) {
+        if (x == e) {
+            ret.push_back(path);
+            return;
+        }
+        for (uint32_t i = csr->offsets[x]; i < csr->offsets[x + 1]; i++) {
+            if (ret.size() >= limit)
+                return;
+            uint32_t y = csr->targets[i];
+            if (weight[i] == 0 || dist[y] == CsrGraph::infinity ||
+                    dist[y] + weight[i] != dist[x])
+                continue;
+
+            const link_property* link = csr->links[i];
+            bool forward = link->source.dpid == dpid;
+            path.push_back(forward ? link->source : link->target);
+            path.push_back(forward ? link->target : link->source);
+            walk(y, path.back().dpid);
+            path.resize(path.size() - 2);
+        }
+    };
+    walk(v, from);
+    return ret;
+}
+
+std::vector<data_link_route> TopologyImpl::disjointPaths(RoutePtr route,
+                                                         RouteSelector selector,
+                                                         uint8_t count) const
+{
+    using namespace route_selector;
+    static constexpr int64_t infinity = std::numeric_limits<int64_t>::max();
+
+    std::vector<data_link_route> ret;
+    GraphOverlay overlay(graph);
+    prepareOverlay(route, selector, overlay);
+    if (selector.get(exclude_dpid)) {
+        for (auto dpid : *selector.get(exclude_dpid)) {
+            if (dpid != route->from && dpid != route->to)
+                overlay.mask(vertex(dpid));
+        }
+    }
+
+    auto s = vertex(route->from);
+    auto t = vertex(route->to);
+    if (s == TopologyGraph::null_vertex() || t == TopologyGraph::null_vertex() || s == t)
+        return ret;
+
+    MetricsFlag mf = selector.get(metrics) ? *selector.get(metrics) : +MetricsFlag::Hop;
+    auto csr = this->csr();
+    const auto& weight = csr->metrics(mf);
+    size_t n = csr->size();
+    if (s >= n || t >= n)
+        return ret;
+
+    // every undirected link gets an id; flow on link is
+    // 0, +1 (from lower to higher vertex) or -1 (opposite)
+    std::unordered_map<const link_property*, uint32_t> link_ids;
+    std::vector<uint32_t> link_of(csr->targets.size());
+    for (size_t i = 0; i < link_of.size(); i++) {
+        auto res = link_ids.emplace(csr->links[i], link_ids.size());
+        link_of[i] = res.first->second;
+    }
+    std::vector<int8_t> flow(link_ids.size(), 0);
+
+    auto direction = [](uint32_t x, uint32_t y) -> int8_t { return x < y ? 1 : -1; };
+    auto cost = [&](uint32_t i) -> int64_t {
+        return weight[i] + overlay.penalty_of(csr->links[i]);
+    };
+
+    uint8_t found = 0;
+    for (; found < count; found++) {
+        // shortest augmenting path, residual arcs may have negative cost
+        std::vector<int64_t> dist(n, infinity);
+        std::vector<uint32_t> via(n);    // csr entry used to reach vertex
+        std::vector<uint32_t> parent(n); // source vertex of that entry
+        std::vector<bool> queued(n, false);
+        std::deque<uint32_t> queue {static_cast<uint32_t>(s)};
+        dist[s] = 0;
+        queued[s] = true;
+
+        while (not queue.empty()) {
+            uint32_t x = queue.front();
+            queue.pop_front();
+            queued[x] = false;
+
+            for (uint32_t i = csr->offsets[x]; i < csr->offsets[x + 1]; i++) {
+                uint32_t y = csr->targets[i];
+                if (not overlay.allows(csr->links[i], x, y))
+                    continue;
+
+                int8_t dir = direction(x, y);
+                int8_t f = flow[link_of[i]];
+                int64_t c;
+                if (f == 0)
+                    c = cost(i);
+                else if (f == -dir)
+                    c = -cost(i); // cancel flow going backwards
+                else
+                    continue;
+
+                if (dist[x] + c < dist[y]) {
+                    dist[y] = dist[x] + c;
+                    via[y] = i;
+                    parent[y] = x;
+                    if (not queued[y]) {
+                        queued[y] = true;
+                        queue.push_back(y);
+                    }
+                }
+            }
+        }
+
+        if (dist[t] == infinity)
+            break;
+
+        for (uint32_t y = t; y != s; y = parent[y]) {
+            flow[link_of[via[y]]] += direction(parent[y], y);
+        }
+    }
+
+    // decompose flow into paths
+    std::vector<bool> consumed(flow.size(), false);
+    std::vector<std::pair<uint64_t, data_link_route>> paths;
+    for (uint8_t k = 0; k < found; k++) {
+        data_link_route path;
+        uint64_t total = 0;
+        uint32_t x = s;
+        uint64_t from = route->from;
+        size_t steps = 0;
+        while (x != t && steps++ < flow.size()) {
+            bool moved = false;
+            for (uint32_t i = csr->offsets[x]; i < csr->offsets[x + 1]; i++) {
+                uint32_t y = csr->targets[i];
+                uint32_t id = link_of[i];
+                if (consumed[id] || flow[id] != direction(x, y))
+                    continue;
+
+                consumed[id] = true;
+                const link_property* link = csr->links[i];
+                if (link->source.dpid == from) {
+                    path.push_back(link->source);
+                    path.push_back(link->target);
+                    from = link->target.dpid;
+                } else {
+                    path.push_back(link->target);
+                    path.push_back(link->source);
+                    from = link->source.dpid;
+                }
+                total += weight[i];
+                x = y;
+                moved = true;
+                break;
+            }
+            if (not moved) break;
+        }
+
+        if (x == t && not path.empty() && not route->hasPath(path))
+            paths.emplace_back(total, std::move(path));
+    }
+
+    std::stable_sort(paths.begin(), paths.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+    for (auto& p : paths)
+        ret.push_back(std::move(p.second));
+    return ret;
+}
+
+// Greedy min-max utilization over all dynamic routes at once. Routes over
+// the hottest ports go first, each to the alternative lowering the peak
+// utilization of the ports involved the most. The load model follows
+// every planned move, so later routes see the traffic already shifted
+// instead of herding onto the same link. Alternatives are computed on
+// the workers. A route's traffic is its reservation or, without one, its
+// fair share of the busiest port of its used path.
+std::vector<TopologyImpl::TeMove> TopologyImpl::planMoves()
+{
+    // moves must lower the peak by this much, so routes don't oscillate
+    static constexpr double hysteresis = 0.05;
+
+    struct port_state {
+        bool measured {false};
+        double load {0};     // bytes/s, planned moves included
+        double capacity {0}; // bytes/s
+        uint32_t routes {0}; // used paths over the port
+
+        // ports of unknown speed count as full
+        double util(double delta = 0) const {
+            return capacity > 0 ? std::max(load + delta, 0.0) / capacity : 1.0;
+        }
+    };
+    std::unordered_map<switch_and_port, port_state> ports;
+    auto measure = [this, &ports]() {
+        std::lock_guard<std::mutex> lk(ledger_mutex);
+        for (auto& it : ports) {
+            if (it.second.measured)
+                continue;
+            it.second.measured = true;
+            it.second.load = ledger.load(it.first);
+            it.second.capacity = ledger.capacity(it.first);
+        }
+    };
+    auto used_path = [](const Route& route) -> PathPtr {
+        return route.used_path < route.paths.size()
+             ? route.paths[route.used_path] : nullptr;
+    };
+    auto peak = [&ports](const data_link_route& path) {
+        double ret = 0;
+        for (auto sp : path)
+            ret = std::max(ret, ports[sp].util());
+        return ret;
+    };
+
+    for (const auto& it : route_map) {
+        if (auto path = used_path(*it.second)) {
+            for (auto sp : path->m_path)
+                ports[sp].routes++;
+        }
+    }
+    measure();
+
+    struct hot_route {
+        RoutePtr route;
+        PathPtr used;
+        double demand;
+        double peak;
+    };
+    std::vector<hot_route> hot;
+    double threshold = te_threshold / 100.0;
+    for (const auto& it : route_map) {
+        const auto& route = it.second;
+        auto used = used_path(*route);
+        if (not route->allowed_dynamic || route->ecmp || not used ||
+                used->m_path.empty())
+            continue;
+
+        double hottest = peak(used->m_path);
+        if (hottest <= threshold)
+            continue;
+
+        double demand = used->bandwidth;
+        if (demand == 0) {
+            demand = std::numeric_limits<double>::max();
+            for (auto sp : used->m_path) {
+                const auto& port = ports[sp];
+                demand = std::min(demand, port.load / std::max(port.routes, 1u));
+            }
+        }
+        if (demand > 0)
+            hot.push_back({route, used, demand, hottest});
+    }
+    std::sort(hot.begin(), hot.end(), [](const auto& a, const auto& b) {
+        return std::make_pair(-a.peak, a.route->id)
+             < std::make_pair(-b.peak, b.route->id);
+    });
+
+    // working paths of the route and a fresh one of its dynamic settings
+    std::vector<std::vector<TeMove>> options(hot.size());
+    parallel_for(hot.size(), [&](size_t i) {
+        const auto& h = hot[i];
+        for (const auto& path : h.route->paths) {
+            if (path != h.used && path->triggers == 0)
+                options[i].push_back({h.route, path->id, path->m_path});
+        }
+        if (h.route->paths.size() + 1 < max_path_id) {
+            auto fresh = findPath(h.route, h.route->dynamic);
+            if (not fresh.empty())
+                options[i].push_back({h.route, max_path_id, std::move(fresh)});
+        }
+    });
+    for (const auto& list : options) {
+        for (const auto& option : list) {
+            for (auto sp : option.path)
+                ports[sp];
+        }
+    }
+    measure();
+
+    std::vector<TeMove> ret;
+    for (size_t i = 0; i < hot.size() && ret.size() < te_max_moves; i++) {
+        const auto& current = hot[i].used->m_path;
+        double demand = hot[i].demand;
+        double before = peak(current);
+        if (before <= threshold)
+            continue; // relieved by earlier moves
+
+        std::unordered_set<switch_and_port> leaving(current.begin(), current.end());
+        const TeMove* best = nullptr;
+        double best_peak = before - hysteresis;
+        for (const auto& option : options[i]) {
+            std::unordered_set<switch_and_port> joining(option.path.begin(),
+                                                        option.path.end());
+            double after = 0;
+            for (auto sp : current) {
+                if (not joining.count(sp))
+                    after = std::max(after, ports[sp].util(-demand));
+            }
+            for (auto sp : option.path) {
+                after = std::max(after, leaving.count(sp) ? ports[sp].util()
+                                                          : ports[sp].util(demand));
+            }
+            if (after < best_peak) {
+                best = &option;
+                best_peak = after;
+            }
+        }
+        if (not best)
+            continue;
+
+        std::unordered_set<switch_and_port> joining(best->path.begin(),
+                                                    best->path.end());
+        for (auto sp : current) {
+            if (not joining.count(sp))
+                ports[sp].load = std::max(ports[sp].load - demand, 0.0);
+        }
+        for (auto sp : best->path) {
+            if (not leaving.count(sp))
+                ports[sp].load += demand;
+        }
+        ret.push_back(*best);
+    }
+    return ret;
+}
+
 Topology::Topology()
 {
     m = new TopologyImpl(this);
@@ -713,11 +1602,44 @@ void Topology::init(Loader *loader, const Config &rootConfig)
     m_switch_manager = SwitchManager::get(loader);
     recovery = RecoveryManager::get(loader);
     db_connector_ = DatabaseConnector::get(loader);
+    db_connector_->declarePrefixes({ "topology:route" });
+    snapshot_ = StateSnapshot::get(loader);
+    snapshot_->provide("topology", [this](SnapshotWriter& writer) {
+        m->forEachSnapshot([&writer](const RouteSnapshot& route) {
+            writer.add(route.id, std::string_view(route.dump));
+        });
+    });
+
+    const Config& config = config_cd(rootConfig, "topology");
+    int nthreads = config_get(config, "parallel-threads", 0);
+    m->ecmp_max_paths = std::clamp(config_get(config, "ecmp-max-paths", 16),
+                                   1, int(max_path_id) - 1);
+    if (nthreads > 0) {
+        m->workers.reset(new WorkerPool(nthreads));
+        LOG(INFO) << "[Topology] Route triggers are evaluated on "
+                  << nthreads << " threads";
+    }
+
+    m->memory_probe = memory::Registry::global().probe("topology",
+        [this](memory::Sheet& sheet) { m->memoryUsage(sheet); });
 
     stats_timer = new QTimer(this);
     connect(stats_timer, &QTimer::timeout, this, &Topology::reloadStats);
     stats_timer->start(2000);
 
+    auto flap_timer = new QTimer(this);
+    connect(flap_timer, &QTimer::timeout, this, [this] { m->expireFlapping(); });
+    m->flaps.setTicker(flap_timer);
+
+    m->te_threshold = std::clamp(config_get(config, "te-util-threshold", 70), 1, 100);
+    m->te_max_moves = std::max(config_get(config, "te-max-moves", 32), 1);
+    int te_interval = config_get(config, "te-interval-ms", 0);
+    if (te_interval > 0) {
+        auto te_timer = new QTimer(this);
+        connect(te_timer, &QTimer::timeout, this, [this] { reoptimize(); });
+        te_timer->start(te_interval);
+    }
+
     connect(recovery, &RecoveryManager::signalRecovery, this, &Topology::onRecovery);
     connect(recovery, &RecoveryManager::signalSetupPrimaryMode, 
                             this, &Topology::onPrimary);
@@ -736,6 +1658,12 @@ void Topology::init(Loader *loader, const Config &rootConfig)
     connect(m_switch_manager, &SwitchManager::switchMaintenanceEnd,
             this, &Topology::onSMaintenanceOff);
 
+    // Triggers also change when flapping timers fire
+    connect(this, &Topology::routeTriggerActive, [this] { m_generation.bump(); });
+    connect(this, &Topology::routeTriggerInactive, [this] { m_generation.bump(); });
+    // expired flapping timers clear triggers on their own
+    connect(this, &Topology::routeTriggerInactive, [this](uint32_t id) { m->publish(id); });
+
     /* Do logging */
     connect(this, &Topology::routeTriggerActive,
          [](uint32_t id, uint8_t path_id, TriggerFlag tf) {
@@ -753,6 +1681,7 @@ void Topology::init(Loader *loader, const Config &rootConfig)
 
 void Topology::onRecovery()
 {
+    generation_counter::scope changed(m_generation);
     for (const auto& link : ld_app->links()) {
         addLink(link.source, link.target);
     }
@@ -762,6 +1691,7 @@ void Topology::onRecovery()
 
 void Topology::onPrimary()
 {
+    generation_counter::scope changed(m_generation);
     for (const auto& link : ld_app->links()) {
         addLink(link.source, link.target);
     }
@@ -771,88 +1701,104 @@ void Topology::onPrimary()
 
 void Topology::onPMaintenance(PortPtr port)
 {
-    std::vector<PathPtr> need_emit;
+    generation_counter::scope changed(m_generation);
+    std::vector<PathPtr> need_emit, touched;
     switch_and_port mnt { port->switch_()->dpid(), port->number() };
     for (auto it : m->route_map) {
         auto& paths = it.second->paths;
-        std::for_each(paths.begin(), paths.end(), [mnt, &need_emit](auto path) {
+        std::for_each(paths.begin(), paths.end(), [mnt, &need_emit, this, &touched](auto path) {
             if (path->contains(mnt)) {
-                if (path->activateTrigger(TriggerFlag::Maintenance)) {
+                touched.push_back(path);
+                if (path->activateTrigger(TriggerFlag::Maintenance, m->flaps)) {
                     need_emit.push_back(path);
                 }
             }
         });
     }
 
+    m->publish(touched);
     std::for_each(need_emit.begin(), need_emit.end(), [this](auto path) {
         emit this->routeTriggerActive(path->route_id, path->id, TriggerFlag::Maintenance);
     });
+    emit linksChanged();
 }
 
 void Topology::onPMaintenanceOff(PortPtr port)
 {
-    std::vector<PathPtr> need_emit;
+    generation_counter::scope changed(m_generation);
+    std::vector<PathPtr> need_emit, touched;
     switch_and_port mnt { port->switch_()->dpid(), port->number() };
     for (auto it : m->route_map) {
         auto& paths = it.second->paths;
-        std::for_each(paths.begin(), paths.end(), [mnt, &need_emit, this](auto path) {
+        std::for_each(paths.begin(), paths.end(), [mnt, &need_emit, this, &touched](auto path) {
             if (path->contains(mnt)) {
-                if (path->inactivateTrigger(TriggerFlag::Maintenance, this)) {
+                touched.push_back(path);
+                if (path->inactivateTrigger(TriggerFlag::Maintenance, m->flaps)) {
                     need_emit.push_back(path);
                 }
             }
         });
     }
 
+    m->publish(touched);
     std::for_each(need_emit.begin(), need_emit.end(), [this](auto path) {
         if (path->flap)
-            path->startFlapping(TriggerFlag::Maintenance, this);
+            path->startFlapping(TriggerFlag::Maintenance, m->flaps);
         else
             emit this->routeTriggerInactive(path->route_id, path->id, TriggerFlag::Maintenance);
     });
+    emit linksChanged();
 }
 
 void Topology::onSMaintenance(SwitchPtr sw)
 {
+    generation_counter::scope changed(m_generation);
     auto dpid = sw->dpid();
-    std::vector<PathPtr> need_emit;
+    std::vector<PathPtr> need_emit, touched;
     for (auto it : m->route_map) {
         auto& paths = it.second->paths;
-        std::for_each(paths.begin(), paths.end(), [dpid, &need_emit, this](auto path) {
+        std::for_each(paths.begin(), paths.end(), [dpid, &need_emit, this, &touched](auto path) {
             if (path->contains(dpid)) {
-                if (path->activateTrigger(TriggerFlag::Maintenance)) {
+                touched.push_back(path);
+                if (path->activateTrigger(TriggerFlag::Maintenance, m->flaps)) {
                     need_emit.push_back(path);
                 }
             }
         });
     }
 
+    m->publish(touched);
     std::for_each(need_emit.begin(), need_emit.end(), [this](auto path) {
         emit this->routeTriggerActive(path->route_id, path->id, TriggerFlag::Maintenance);
     });
+    emit linksChanged();
 }
 
 void Topology::onSMaintenanceOff(SwitchPtr sw)
 {
+    generation_counter::scope changed(m_generation);
     auto dpid = sw->dpid();
-    std::vector<PathPtr> need_emit;
+    std::vector<PathPtr> need_emit, touched;
     for (auto it : m->route_map) {
         auto& paths = it.second->paths;
-        std::for_each(paths.begin(), paths.end(), [dpid, &need_emit, this](auto path) {
+        std::for_each(paths.begin(), paths.end(), [dpid, &need_emit, this, &touched](auto path) {
             if (path->contains(dpid)) {
-                if (path->inactivateTrigger(TriggerFlag::Maintenance, this)) {
+                touched.push_back(path);
+                if (path->inactivateTrigger(TriggerFlag::Maintenance, m->flaps)) {
                     need_emit.push_back(path);
                 }
             }
         });
     }
 
+    m->publish(touched);
     std::for_each(need_emit.begin(), need_emit.end(), [this](auto path) {
         if (path->flap)
-            path->startFlapping(TriggerFlag::Maintenance, this);
+            path->startFlapping(TriggerFlag::Maintenance, m->flaps);
         else
             emit this->routeTriggerInactive(path->route_id, path->id, TriggerFlag::Maintenance);
     });
+    emit linksChanged();
 }
 
 std::vector<link_property> Topology::dumpWeights()
@@ -863,9 +1809,10 @@ std::vector<link_property> Topology::dumpWeights()
 std::vector<uint32_t> Topology::getRoutes() const
 {
     std::vector<uint32_t> ret;
-    for (auto it : m->route_map) {
-        ret.push_back(it.first);
-    }
+    m->forEachSnapshot([&ret](const RouteSnapshot& route) {
+        ret.push_back(route.id);
+    });
+    std::sort(ret.begin(), ret.end());
 
     return ret;
 }
@@ -873,17 +1820,19 @@ std::vector<uint32_t> Topology::getRoutes() const
 std::vector<uint32_t> Topology::getRoutes(ServiceFlag sf) const
 {
     std::vector<uint32_t> ret;
-    for (auto it : m->route_map) {
-        if (it.second->owner == sf)
-            ret.push_back(it.first);
-    }
+    m->forEachSnapshot([&ret, sf](const RouteSnapshot& route) {
+        if (route.owner == sf)
+            ret.push_back(route.id);
+    });
+    std::sort(ret.begin(), ret.end());
 
     return ret;
 }
 
 void Topology::linkDiscovered(switch_and_port from, switch_and_port to)
 {
-    std::vector<PathPtr> need_emit;
+    generation_counter::scope changed(m_generation);
+    std::vector<PathPtr> need_emit, touched;
 
     { // mutex
     std::lock_guard<std::mutex> lk(m->graph_mutex);
@@ -899,9 +1848,10 @@ void Topology::linkDiscovered(switch_and_port from, switch_and_port to)
 
     for (auto it : m->route_map) {
         auto& paths = it.second->paths;
-        std::for_each(paths.begin(), paths.end(), [from, &need_emit, this](auto path) {
+        std::for_each(paths.begin(), paths.end(), [from, &need_emit, this, &touched](auto path) {
             if (path->broken_flag && path->contains(from)) {
-                if (path->inactivateTrigger(TriggerFlag::Broken, this)) { // if true, need emit
+                touched.push_back(path);
+                if (path->inactivateTrigger(TriggerFlag::Broken, m->flaps)) { // if true, need emit
                     need_emit.push_back(path);
                 }
             }
@@ -910,31 +1860,47 @@ void Topology::linkDiscovered(switch_and_port from, switch_and_port to)
 
     } // mutex
 
+    m->publish(touched);
     std::for_each(need_emit.begin(), need_emit.end(), [this](auto path) {
         if (path->flap)
-            path->startFlapping(TriggerFlag::Broken, this);
+            path->startFlapping(TriggerFlag::Broken, m->flaps);
         else
             this->emit routeTriggerInactive(path->route_id, path->id, TriggerFlag::Broken);
     });
+    emit linksChanged();
 }
 
 void Topology::linkBroken(switch_and_port from, switch_and_port to)
 {
-    std::vector<PathPtr> need_emit;
+    generation_counter::scope changed(m_generation);
+    std::vector<PathPtr> need_emit, touched;
+    trace::scope traced(trace::mark_subject("topology",
+        trace::port_subject(from.dpid, from.port)));
 
     { // mutex
     std::lock_guard<std::mutex> lk(m->graph_mutex);
 
     auto e = m->edge(from, m->graph);
     if (e.second) {
+        auto u = source(e.first, m->graph);
+        auto v = target(e.first, m->graph);
+        const link_property& prop = m->graph[e.first];
+        for (auto sp : {prop.source, prop.target}) {
+            m->port_edges.erase(sp);
+            subscribeStats(sp, false);
+        }
         remove_edge(e.first, m->graph);
+        m->spt_cache.edgeRemoved(u, v, m->graph);
+        m->invalidate_csr();
+        m->hopsLinkRemoved(u, v);
     }
 
     for (auto it : m->route_map) {
         auto& paths = it.second->paths;
-        std::for_each(paths.begin(), paths.end(), [from, &need_emit](auto path) {
+        std::for_each(paths.begin(), paths.end(), [from, &need_emit, this, &touched](auto path) {
             if (path->broken_flag && path->contains(from)) {
-                if (path->activateTrigger(TriggerFlag::Broken)) { // if true, need emit signal
+                touched.push_back(path);
+                if (path->activateTrigger(TriggerFlag::Broken, m->flaps)) { // if true, need emit signal
                     need_emit.push_back(path);
                 }
             }
@@ -943,104 +1909,218 @@ void Topology::linkBroken(switch_and_port from, switch_and_port to)
 
     } // mutex
 
+    m->publish(touched);
+    trace::mark("paths-published", touched.size());
     std::for_each(need_emit.begin(), need_emit.end(), [this](auto path) {
         emit this->routeTriggerActive(path->route_id, path->id, TriggerFlag::Broken);
     });
+    trace::mark("route-triggers", need_emit.size());
+    emit linksChanged();
 }
 
 void Topology::reloadStats()
 {
-    for (auto sw : m_switch_manager->switches()) {
-        for (auto port : sw->ports()) {
-            switch_and_port sp {sw->dpid(), port->number()};
-            uint64_t other_dpid = other(sp).dpid;
-            if (other_dpid == 0 || other_dpid == sp.dpid) // not core port or loopback
-                continue;
+    generation_counter::scope changed(m_generation);
 
-            uint64_t max = getSpeedRate(sp);
-            if (max == 0) {
-                LOG(WARNING) << "[Topology] Incorrect port - "
-                             << sp << " has null current_speed!";
-                continue;
+    // after route changes every indexed path is evaluated, otherwise
+    // only paths over ports whose load crossed one of their thresholds
+    bool full = m->refreshTriggerIndex();
+    std::vector<PathPtr> affected;
+
+    auto core_port = [this](switch_and_port sp) {
+        uint64_t other_dpid = other(sp).dpid;
+        // not core port or loopback
+        return other_dpid != 0 && other_dpid != sp.dpid;
+    };
+
+    auto crossed = [](const PathPtr& path, std::pair<uint8_t, uint8_t> was,
+                      std::pair<uint8_t, uint8_t> now) {
+        auto drop = path->drop_threshold;
+        auto util = path->util_threshold;
+        return (drop && (was.first > drop) != (now.first > drop)) ||
+               (util && (was.second > util) != (now.second > util));
+    };
+
+    auto account = [&, this](switch_and_port sp, const std::vector<PathPtr>& paths,
+                             uint64_t tx, uint64_t rx,
+                             uint64_t tdrop, uint64_t rdrop) {
+        uint64_t max = getSpeedRate(sp);
+        if (max == 0) {
+            LOG(WARNING) << "[Topology] Incorrect port - "
+                         << sp << " has null current_speed!";
+            return;
+        }
+
+        tx = (tx >= LLONG_MAX ? 0 : tx);
+        rx = (rx >= LLONG_MAX ? 0 : rx);
+        tx = (tx >= max ? max : tx);
+        rx = (rx >= max ? max : rx);
+        tdrop = (tdrop >= LLONG_MAX ? 0 : tdrop);
+        rdrop = (rdrop >= LLONG_MAX ? 0 : rdrop);
+
+        uint8_t tx_drops = (tx > 0 ? (100 * tdrop / tx) : 0);
+        uint8_t rx_drops = (rx > 0 ? (100 * rdrop / rx) : 0);
+        uint8_t tx_util  = (100 * tx   / max);
+        uint8_t rx_util  = (100 * rx   / max);
+
+        auto res = std::make_pair(std::max(tx_drops, rx_drops), std::max(tx_util, rx_util));
+
+        auto& telemetry = TelemetryExporter::global();
+        if (telemetry.enabled()) {
+            uint64_t percent[] = {tx_util, rx_util, tx_drops, rx_drops};
+            double bytes[] = {double(tx), double(rx)};
+            TelemetrySample sample {TelemetrySample::link, sp.dpid, sp.port};
+            sample.counters = percent;
+            sample.ncounters = 4;
+            sample.rates = bytes;
+            sample.nrates = 2;
+            telemetry.publish(sample);
+        }
+        auto found = m->triggers.find(sp);
+        if (found == m->triggers.end()) {
+            // port joined its paths: they stop at the first unknown port
+            m->triggers.emplace(sp, res);
+            if (not full)
+                affected.insert(affected.end(), paths.begin(), paths.end());
+            return;
+        }
+
+        auto was = found->second;
+        if (was == res)
+            return;
+        found->second = res;
+        if (full)
+            return;
+        for (const auto& path : paths) {
+            if (crossed(path, was, res))
+                affected.push_back(path);
+        }
+    };
+
+    // one pass over the speed columns of every switch
+    using field = PortMeasurement<double>::field;
+    auto registry = m_switch_manager->registry();
+    for (const auto& sw : registry->switches()) {
+        uint64_t dpid = sw->dpid();
+        sw->port_stats()->read([&](const port_stats_table::columns& c) {
+            const float* tx = c.speed(field::tx_bytes_field);
+            const float* rx = c.speed(field::rx_bytes_field);
+            const float* tdrop = c.speed(field::tx_dropped_field);
+            const float* rdrop = c.speed(field::rx_dropped_field);
+
+            for (uint32_t slot = 0; slot < c.size(); ++slot) {
+                if (c.key(slot) == port_stats_table::npos)
+                    continue;
+                switch_and_port sp {dpid, c.key(slot)};
+                auto indexed = m->trigger_index.find(sp);
+                if (indexed == m->trigger_index.end() || not core_port(sp))
+                    continue;
+
+                account(sp, indexed->second,
+                        (uint64_t)tx[slot], (uint64_t)rx[slot],
+                        (uint64_t)tdrop[slot], (uint64_t)rdrop[slot]);
             }
+        });
+    }
 
-            auto stats = port->stats();
-            auto& speed = stats.current_speed;
-            uint64_t tx = (uint64_t)speed.tx_bytes();
-            uint64_t rx = (uint64_t)speed.rx_bytes();
-            uint64_t tdrop = (uint64_t)speed.tx_dropped();
-            uint64_t rdrop = (uint64_t)speed.rx_dropped();
-            uint64_t terr = (uint64_t)speed.tx_errors();
-            uint64_t rerr = (uint64_t)speed.rx_errors();
-
-            tx = (tx >= LLONG_MAX ? 0 : tx);
-            rx = (rx >= LLONG_MAX ? 0 : rx);
-            tx = (tx >= max ? max : tx);
-            rx = (rx >= max ? max : rx);
-            tdrop = (tdrop >= LLONG_MAX ? 0 : tdrop);
-            rdrop = (rdrop >= LLONG_MAX ? 0 : rdrop);
-            terr = (terr >= LLONG_MAX ? 0 : terr);
-            rerr = (rerr >= LLONG_MAX ? 0 : rerr);
-
-            uint8_t tx_drops = (tx > 0 ? (100 * tdrop / tx) : 0);
-            uint8_t rx_drops = (rx > 0 ? (100 * rdrop / rx) : 0);
-            uint8_t tx_util  = (100 * tx   / max);
-            uint8_t rx_util  = (100 * rx   / max);
-            
-            auto res = std::make_pair(std::max(tx_drops, rx_drops), std::max(tx_util, rx_util));
-            m->triggers[sp] = res;
+    if (auto synthetic = std::atomic_load(&m_synthetic_ports)) {
+        {
+            // not subscribed to port stats, see portStatsUpdated()
+            std::lock_guard<std::mutex> lk(m->ledger_mutex);
+            for (const auto& it : *synthetic) {
+                m->ledger.set_load(it.first, std::max(it.second.tx_bytes,
+                                                      it.second.rx_bytes));
+            }
+        }
+        for (const auto& it : *synthetic) {
+            auto indexed = m->trigger_index.find(it.first);
+            if (indexed == m->trigger_index.end() || not core_port(it.first))
+                continue;
+            const auto& port = it.second;
+            account(it.first, indexed->second, port.tx_bytes, port.rx_bytes,
+                    port.tx_dropped, port.rx_dropped);
         }
     }
 
     std::vector<PathPtr> act_need_emit_drop, inact_need_emit_drop;
     std::vector<PathPtr> act_need_emit_util, inact_need_emit_util;
 
-    auto check_triggers = [&](PathPtr path) {
-        if (!path->drop_threshold && !path->util_threshold) return;
-
-        bool util_overload = false;
-        bool drop_overload = false;
+    struct verdict {
+        PathPtr path;
+        bool drop_overload {false};
+        bool util_overload {false};
+    };
 
-        uint8_t max = 0;
+    // read-only part: only `m->triggers` and path descriptions are used,
+    // so it can run concurrently for independent routes
+    auto evaluate = [this](const PathPtr& path) {
+        verdict ret {path};
         for (size_t i = 0; i < path->m_path.size(); i++) {
-            auto curr = path->m_path.at(i);
-            if (!m->triggers.count(curr)) break;
-            auto triggers = m->triggers.at(curr);
+            auto found = m->triggers.find(path->m_path[i]);
+            if (found == m->triggers.end()) break;
+            const auto& triggers = found->second;
 
             if (path->drop_threshold && triggers.first > path->drop_threshold)
-                drop_overload = true;
+                ret.drop_overload = true;
             if (path->util_threshold && triggers.second > path->util_threshold)
-                util_overload = true;
-
-            max = std::max(triggers.second, max);
+                ret.util_overload = true;
         }
+        return ret;
+    };
 
-        if (drop_overload && path->activateTrigger(TriggerFlag::Drop)) {
-            act_need_emit_drop.push_back(path);
-        }
-        else if (!drop_overload && path->getTrigger(TriggerFlag::Drop) &&
-                 path->flapping_timers.count(TriggerFlag::Drop) == 0) {
+    // in deterministic (route id, path id) order
+    std::vector<PathPtr> snapshot;
+    if (full) {
+        snapshot = m->trigger_paths;
+    } else {
+        auto key = [](const PathPtr& p) {
+            return std::make_tuple(p->route_id, p->id, p.get());
+        };
+        std::sort(affected.begin(), affected.end(), [&](const auto& a, const auto& b) {
+            return key(a) < key(b);
+        });
+        affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+        snapshot = std::move(affected);
+    }
 
-            if (path->inactivateTrigger(TriggerFlag::Drop, this))
-                inact_need_emit_drop.push_back(path);
-        }
+    std::vector<verdict> verdicts(snapshot.size());
+    m->parallel_for(snapshot.size(), [&](size_t i) {
+        verdicts[i] = evaluate(snapshot[i]);
+    });
 
-        if (util_overload && path->activateTrigger(TriggerFlag::Util)) {
-            act_need_emit_util.push_back(path);
-        }
-        else if (!util_overload && path->getTrigger(TriggerFlag::Util) &&
-                 path->flapping_timers.count(TriggerFlag::Util) == 0) {
+    // commit trigger state at once, signals are emitted afterwards
+    std::vector<PathPtr> touched;
+    {
+        std::lock_guard<std::mutex> lk(m->graph_mutex);
+        for (const auto& v : verdicts) {
+            auto& path = v.path;
+            auto before = path->triggers;
 
-            if (path->inactivateTrigger(TriggerFlag::Util, this))
-                inact_need_emit_util.push_back(path);
-        }
-    };
+            if (v.drop_overload && path->activateTrigger(TriggerFlag::Drop, m->flaps)) {
+                act_need_emit_drop.push_back(path);
+            }
+            else if (!v.drop_overload && path->getTrigger(TriggerFlag::Drop) &&
+                     (path->damped & TriggerFlag::Drop) == 0) {
 
-    for (auto it : m->route_map) {
-        auto route = it.second;
-        auto& paths = route->paths;
-        std::for_each(paths.begin(), paths.end(), check_triggers);
+                if (path->inactivateTrigger(TriggerFlag::Drop, m->flaps))
+                    inact_need_emit_drop.push_back(path);
+            }
+
+            if (v.util_overload && path->activateTrigger(TriggerFlag::Util, m->flaps)) {
+                act_need_emit_util.push_back(path);
+            }
+            else if (!v.util_overload && path->getTrigger(TriggerFlag::Util) &&
+                     (path->damped & TriggerFlag::Util) == 0) {
+
+                if (path->inactivateTrigger(TriggerFlag::Util, m->flaps))
+                    inact_need_emit_util.push_back(path);
+            }
+
+            if (path->triggers != before)
+                touched.push_back(path);
+        }
     }
+    m->publish(touched);
 
     auto emitting = [this](const auto& vec, TriggerFlag tf, bool act) {
         std::for_each(vec.begin(), vec.end(), [this, tf, act](auto path) {
@@ -1048,7 +2128,7 @@ void Topology::reloadStats()
                 emit this->routeTriggerActive(path->route_id, path->id, tf);
             else {
                 if (path->flap)
-                    path->startFlapping(tf, this);
+                    path->startFlapping(tf, m->flaps);
                 else
                     emit this->routeTriggerInactive(path->route_id, path->id, tf);
             }
@@ -1061,40 +2141,54 @@ void Topology::reloadStats()
     emitting(inact_need_emit_util, TriggerFlag::Util, false);
 }
 
-void Topology::updateMetrics()
+void Topology::subscribeStats(switch_and_port sp, bool on)
 {
-    for (auto sw : m_switch_manager->switches()) {
-        for (auto port : sw->ports()) {
-            auto neighbor = other(switch_and_port{sw->dpid(), port->number()});
-            if (neighbor.dpid == 0 || neighbor.dpid == sw->dpid()) // not core port or loopback
-                continue;
+    auto sw = m_switch_manager->switch_(sp.dpid);
+    auto port = sw ? sw->port(sp.port) : nullptr;
+    if (not port)
+        return; // synthetic or gone already
 
-            auto vert = m->vertex(sw->dpid());
-            if (vert == TopologyGraph::null_vertex()) {
-                continue;
-            }
+    if (on) {
+        connect(port.get(), &Port::statsUpdated, this, &Topology::portStatsUpdated,
+                Qt::UniqueConnection);
+    } else {
+        disconnect(port.get(), &Port::statsUpdated, this, &Topology::portStatsUpdated);
+    }
+}
+
+void Topology::portStatsUpdated(PortPtr port)
+{
+    auto sw = port->switch_();
+    if (not sw)
+        return;
+    switch_and_port sp {sw->dpid(), port->number()};
 
-            auto edges = out_edges(vert, m->graph);
-            for (auto it = edges.first; it != edges.second; it++) {
-                if (target(*it, m->graph) != m->vertex(neighbor.dpid)) continue;
+    std::lock_guard<std::mutex> lk(m->graph_mutex);
+    auto found = m->port_edges.find(sp);
+    if (found == m->port_edges.end())
+        return; // queued before the link was broken
 
-                link_property& prop = m->graph[*it];
-                if (prop.source != neighbor && prop.target != neighbor) // parallel links
-                    continue;
+    link_property& prop = m->graph[found->second];
+    auto neighbor = (prop.source == sp ? prop.target : prop.source);
 
-                auto eth = std::dynamic_pointer_cast<EthernetPort>(port);
-                auto stats = port->stats();
-                auto& speed = stats.current_speed;
-                uint64_t tx = (uint64_t)speed.tx_bytes();
-                uint64_t rx = (uint64_t)speed.rx_bytes();
-                tx = (tx >= LLONG_MAX ? 0 : tx);
-                rx = (rx >= LLONG_MAX ? 0 : rx);
-                uint64_t max = getSpeedRate(neighbor); // Bps
-                uint64_t cur = std::max(tx, rx);
-                uint64_t weight = max_weight - 8 * (max - cur) / 1000000; // Mbit
-                prop.pl_metrics = (weight > 0 ? weight : 1);
-            }
-        }
+    auto stats = port->stats();
+    auto& speed = stats.current_speed;
+    uint64_t tx = (uint64_t)speed.tx_bytes();
+    uint64_t rx = (uint64_t)speed.rx_bytes();
+    tx = (tx >= LLONG_MAX ? 0 : tx);
+    rx = (rx >= LLONG_MAX ? 0 : rx);
+    uint64_t max = getSpeedRate(neighbor); // Bps
+    uint64_t cur = std::max(tx, rx);
+    {
+        std::lock_guard<std::mutex> lk(m->ledger_mutex);
+        m->ledger.set_load(sp, cur);
+    }
+    uint64_t weight = max_weight - 8 * (max - cur) / 1000000; // Mbit
+    weight = (weight > 0 ? weight : 1);
+    if (prop.pl_metrics != weight) {
+        prop.pl_metrics = weight;
+        m->invalidate_csr();
+        m_generation.bump();
     }
 }
 
@@ -1112,37 +2206,68 @@ void Topology::addLink(switch_and_port from, switch_and_port to)
         return;
     }
 
-    auto sw = m_switch_manager->switch_(from.dpid);
-    if (not sw) return;
-    auto port = sw->port(from.port);
-    if (not port) return;
+    uint64_t speed;
+    if (auto sw = m_switch_manager->switch_(from.dpid)) {
+        auto port = sw->port(from.port);
+        if (not port) return;
 
-    auto eth = std::dynamic_pointer_cast<EthernetPort>(port);
-    uint64_t speed = (eth ? eth->current_speed()/1000 : max_weight);
+        auto eth = std::dynamic_pointer_cast<EthernetPort>(port);
+        speed = (eth ? eth->current_speed()/1000 : max_weight);
+    } else if (auto synthetic = syntheticPort(from)) {
+        speed = synthetic->speed_kbps/1000;
+    } else {
+        return;
+    }
     auto u = m->new_vertex(from.dpid);
     auto v = m->new_vertex(to.dpid);
 
     uint64_t ps_metrics = (speed >= max_weight ? 1 : max_weight - speed + 1);
-    add_edge(u, v, link_property{from, to, 1, ps_metrics, 1}, m->graph);
+    auto e = add_edge(u, v, link_property{from, to, 1, ps_metrics, 1}, m->graph);
+    m->port_edges[from] = e.first;
+    m->port_edges[to] = e.first;
+    {
+        std::lock_guard<std::mutex> lk(m->ledger_mutex);
+        m->ledger.set_capacity(from, getSpeedRate(from));
+        m->ledger.set_capacity(to, getSpeedRate(to));
+    }
+    subscribeStats(from, true);
+    subscribeStats(to, true);
+    m->spt_cache.edgeAdded(u, v, m->graph);
+    m->invalidate_csr();
+    m->hopsLinkAdded(u, v);
 }
 
 void Topology::switchUp(SwitchPtr sw)
 {
+    generation_counter::scope changed(m_generation);
+    std::lock_guard<std::mutex> lk(m->graph_mutex);
     m->new_vertex(sw->dpid());
+    m->hopsReindex();
 }
 
 void Topology::switchDown(SwitchPtr sw)
 {
+    generation_counter::scope changed(m_generation);
+    std::lock_guard<std::mutex> lk(m->graph_mutex);
     m->delete_vertex(sw->dpid());
+    m->hopsReindex();
 }
 
+// Routes changed by newRoutes() on this thread, published and stored
+// together once the batch is created
+static thread_local std::vector<uint32_t>* batch_routes = nullptr;
+
 void Topology::update_database(uint32_t route_id)
 {
+    if (batch_routes) {
+        batch_routes->push_back(route_id);
+        return;
+    }
+    m->publish(route_id);
     if (!db_connector_) return;
 
-    if (m->route_map.count(route_id)) {
-        std::string route_dump = m->route_map.at(route_id)->to_json().dump();
-        db_connector_->putSValue("topology:route", std::to_string(route_id), route_dump);
+    if (auto route = m->snapshot(route_id)) {
+        db_connector_->putSValue("topology:route", std::to_string(route_id), route->dump);
     }
 }
 
@@ -1155,45 +2280,53 @@ void Topology::erase_from_database(uint32_t route_id)
 
 void Topology::load_from_database()
 {
+    generation_counter::scope changed(m_generation);
     if (!db_connector_) return;
 
-    auto keys = db_connector_->getKeys("topology:route");
-    for (const auto& i : keys) {
-        auto tmp = db_connector_->getSValue("topology:route", i);
-        json jr = json::parse(tmp);
-        uint32_t id = jr["id"];
-        uint64_t from = jr["from"];
-        uint64_t to = jr["to"];
-        bool dynamic = jr["dynamic"];
-        if (m->route_map.count(id)) continue;
+    // Parsed on demand: every member is read once, in place
+    auto load_route = [this](const json_value& jr) {
+        auto id = jr["id"].get<uint32_t>();
+        auto from = jr["from"].get<uint64_t>();
+        auto to = jr["to"].get<uint64_t>();
+        auto dynamic = jr["dynamic"].get<bool>();
+        if (m->route_map.count(id)) return;
 
         auto route = m->addRoute(from, to, id);
-        std::string owner = jr["owner"];
+        auto owner = jr["owner"].get<std::string>();
         route->allowed_dynamic = dynamic;
+        route->ecmp = jr["ecmp"].value_or(false);
         route->owner = ServiceFlag::_from_string(owner.c_str());
-        route->used_path =jr["used_path"]; 
+        route->used_path = jr["used_path"].get<uint8_t>();
 
         for (auto& jp : jr["paths"]) {
             data_link_route p;
             for (auto& sp : jp["m_path"]) {
-                p.push_back({sp.at(0), sp.at(1)});
+                p.push_back({sp.at(0).get<uint64_t>(),
+                             sp.at(1).get<uint32_t>()});
             }
             auto path = route->attachPath(p);
 
-            path->flap = jp["flapping"];
-            path->broken_flag = jp["broken_flag"];
-            path->drop_threshold = jp["drop_threshold"];
-            path->util_threshold = jp["util_threshold"];
-            std::string metrics = jp["metrics"];
+            path->flap = jp["flapping"].get<uint16_t>();
+            path->broken_flag = jp["broken_flag"].get<bool>();
+            path->drop_threshold = jp["drop_threshold"].get<uint8_t>();
+            path->util_threshold = jp["util_threshold"].get<uint8_t>();
+            auto metrics = jp["metrics"].get<std::string>();
             path->metrics = MetricsFlag::_from_string(metrics.c_str());
+            path->bandwidth = jp["bandwidth"].value_or(uint64_t(0));
+            if (path->bandwidth) {
+                // admitted before, links may not be known yet
+                std::lock_guard<std::mutex> lk(m->ledger_mutex);
+                m->ledger.hold(path->m_path, path->bandwidth);
+            }
         }
 
         if (dynamic) {
-            std::string mf = jr["dynamic_settings"]["metrics"];
-            uint8_t flap = jr["dynamic_settings"]["flapping"];
-            uint8_t drop = jr["dynamic_settings"]["drop_threshold"];
-            uint8_t util = jr["dynamic_settings"]["util_threshold"];
-            bool broken = jr["dynamic_settings"]["broken_flag"];
+            auto settings = jr["dynamic_settings"];
+            auto mf = settings["metrics"].get<std::string>();
+            auto flap = settings["flapping"].get<uint8_t>();
+            auto drop = settings["drop_threshold"].get<uint8_t>();
+            auto util = settings["util_threshold"].get<uint8_t>();
+            auto broken = settings["broken_flag"].get<bool>();
 
             RouteSelector dyn_sel {
                 route_selector::metrics = MetricsFlag::_from_string(mf.c_str()),
@@ -1205,7 +2338,23 @@ void Topology::load_from_database()
 
             route->dynamic = std::move(dyn_sel);
         }
+        m->publish(id);
+    };
+
+    // Route dumps are parsed straight from the mapped snapshot
+    auto snapshot = snapshot_->current();
+    auto section = snapshot ? snapshot->section("topology") : std::nullopt;
+    if (section) {
+        for (auto record : *section) {
+            load_route(parse_json(record.text()));
+        }
+    } else {
+        auto routes = db_connector_->getSValues("topology:route");
+        for (const auto& kv : routes) {
+            load_route(parse_json(kv.second));
+        }
     }
+    m->invalidateTriggers();
 }
 
 void Topology::clear_database()
@@ -1220,13 +2369,65 @@ switch_and_port Topology::other(switch_and_port sp)
    return ld_app->other(sp);
 }
 
-uint32_t Topology::newRoute(uint64_t from, uint64_t to, RouteSelector selector)
+void Topology::setSyntheticPorts(std::shared_ptr<const SyntheticPorts> ports)
+{
+    std::atomic_store(&m_synthetic_ports, std::move(ports));
+}
+
+std::optional<Topology::SyntheticPort>
+Topology::syntheticPort(switch_and_port sp) const
+{
+    auto synthetic = std::atomic_load(&m_synthetic_ports);
+    if (not synthetic)
+        return std::nullopt;
+    auto it = synthetic->find(sp);
+    if (it == synthetic->end())
+        return std::nullopt;
+    return it->second;
+}
+
+bool Topology::knownSwitch(uint64_t dpid) const
+{
+    if (m_switch_manager->switch_(dpid))
+        return true;
+    auto synthetic = std::atomic_load(&m_synthetic_ports);
+    if (not synthetic)
+        return false;
+    // ports are ordered by dpid first
+    auto it = synthetic->lower_bound(switch_and_port{dpid, 0});
+    return it != synthetic->end() && it->first.dpid == dpid;
+}
+
+// get parameters of triggers
+static void applySelector(PathPtr path, RouteSelector& selector)
 {
     using namespace route_selector;
+
+    if (selector.get(flapping))
+        path->flap = *selector.get(flapping);
+    if (selector.get(broken_trigger))
+        path->broken_flag = *selector.get(broken_trigger);
+    if (selector.get(drop_trigger))
+        path->drop_threshold = *selector.get(drop_trigger);
+    if (selector.get(util_trigger))
+        path->util_threshold = *selector.get(util_trigger);
+
+    path->metrics = selector.get(metrics) ? *selector.get(metrics)
+                                          : +MetricsFlag::Hop;
+}
+
+uint32_t Topology::newRoute(uint64_t from, uint64_t to, RouteSelector selector)
+{
+    generation_counter::scope changed(m_generation);
     std::lock_guard<std::mutex> lk(m->graph_mutex);
+    return createRoute(from, to, std::move(selector));
+}
+
+uint32_t Topology::createRoute(uint64_t from, uint64_t to, RouteSelector selector)
+{
+    using namespace route_selector;
 
-    if (m_switch_manager->switch_(from) == nullptr ||
-            m_switch_manager->switch_(to) == nullptr) {
+    if (not knownSwitch(from) || not knownSwitch(to)) {
         LOG(WARNING) << "[Topology] Creating route - No switch for route";
         return 0;
     }
@@ -1238,30 +2439,68 @@ uint32_t Topology::newRoute(uint64_t from, uint64_t to, RouteSelector selector)
     auto route = m->addRoute(from, to);
     route->owner = owner;
 
-    auto path_id = newPath(route->id, selector);
-    if (path_id == max_path_id) {
+    uint8_t count = 1;
+    if (selector.get(configured_count)) {
+        uint8_t configured = *selector.get(configured_count);
+        if (configured > 0 && configured < 10) // allowed values
+            count = configured;
+    }
+
+    // reservations are admitted path by path in newPath(), so neither
+    // ECMP nor precomputed disjoint paths are used with them
+    bool reserving = selector.get(bandwidth) && *selector.get(bandwidth) > 0;
+
+    if (not reserving && selector.get(ecmp) && *selector.get(ecmp)) {
+        // count is a cap here: as many paths as there are spines
+        size_t limit = selector.get(configured_count) ? count : m->ecmp_max_paths;
+        auto mf = selector.get(metrics) ? *selector.get(metrics) : +MetricsFlag::Hop;
+        route->ecmp = true;
+        for (auto& computed : m->equalCostPaths(from, to, mf, limit)) {
+            auto path = route->attachPath(std::move(computed));
+            applySelector(path, selector);
+        }
+        m->invalidateTriggers();
+        VLOG(2) << "[Topology] Creating route - " << route->paths.size()
+                << " equal-cost paths for route " << route->id;
+        count = std::max<size_t>(1, route->paths.size());
+    }
+
+    // precompute all disjoint paths at once, so failover
+    // only has to switch `used_path`
+    if (not route->ecmp && not reserving && count > 1 &&
+            not selector.get(exact_dpid) && not selector.get(include_dpid)) {
+        for (auto& computed : m->disjointPaths(route, selector, count)) {
+            auto path = route->attachPath(std::move(computed));
+            applySelector(path, selector);
+        }
+        m->invalidateTriggers();
+        VLOG(2) << "[Topology] Creating route - Precomputed "
+                << route->paths.size() << " disjoint paths for route "
+                << route->id;
+    }
+
+    if (route->paths.empty() && newPath(route->id, selector) == max_path_id) {
         VLOG(1) << "[Topology] Creating route - Can't create route: "
                 << from << " -> " << to;
         deleteRoute(route->id);
         return 0;
     }
 
-    auto path = route->paths.at(path_id);
-
-    if (selector.get(configured_count)) {
-        uint8_t count = *selector.get(configured_count);
-        if (count > 0 && count < 10) { // allowed values
-            RouteSelector aux_selector { metrics = path->metrics,
-                                         flapping = path->flap,
-                                         broken_trigger = path->broken_flag,
-                                         drop_trigger = path->drop_threshold,
-                                         util_trigger = path->util_threshold,
-                                         exclude_dpid =
-                                             *selector.get(exclude_dpid)
-                                       };
-            for (auto i = 1; i < count; i++) { // aux paths
-                newPath(route->id, aux_selector);
-            }
+    auto path = route->paths.at(0);
+
+    // not enough disjoint paths: fill up with penalized ones
+    if (route->paths.size() < count) {
+        RouteSelector aux_selector { metrics = path->metrics,
+                                     flapping = path->flap,
+                                     broken_trigger = path->broken_flag,
+                                     drop_trigger = path->drop_threshold,
+                                     util_trigger = path->util_threshold,
+                                     bandwidth = path->bandwidth,
+                                     exclude_dpid =
+                                         *selector.get(exclude_dpid)
+                                   };
+        for (auto i = route->paths.size(); i < count; i++) { // aux paths
+            newPath(route->id, aux_selector);
         }
     }
 
@@ -1269,8 +2508,140 @@ uint32_t Topology::newRoute(uint64_t from, uint64_t to, RouteSelector selector)
     return route->id;
 }
 
+std::vector<uint32_t> Topology::newRoutes(std::vector<RouteRequest> requests)
+{
+    generation_counter::scope changed(m_generation);
+    using namespace route_selector;
+
+    // Requests newRoute() would serve with one shortest path and no
+    // constraints; the rest go through newRoute() itself
+    auto plain = [](RouteSelector& selector) {
+        uint8_t count = selector.get(configured_count)
+                      ? *selector.get(configured_count) : 1;
+        return not selector.get(exact_dpid) && not selector.get(include_dpid)
+            && not selector.get(exclude_dpid)
+            && not (selector.get(ecmp) && *selector.get(ecmp))
+            && not (selector.get(bandwidth) && *selector.get(bandwidth))
+            && (count <= 1 || count >= 10);
+    };
+
+    struct Tree {
+        vertex_descriptor to;
+        MetricsFlag mf;
+        const GraphOverlay* ov;
+        std::vector<vertex_descriptor> pred;
+    };
+    static constexpr size_t no_tree = std::numeric_limits<size_t>::max();
+
+    std::vector<uint32_t> ids(requests.size(), 0);
+    std::vector<uint32_t> created;
+    future<void> stored = make_ready_future();
+
+    { // lock
+        std::lock_guard<std::mutex> lk(m->graph_mutex);
+        struct batch_scope {
+            explicit batch_scope(std::vector<uint32_t>& ids) { batch_routes = &ids; }
+            ~batch_scope() { batch_routes = nullptr; }
+        } batch(created);
+
+        // Overlays depend on the util threshold only, a new route has
+        // no paths to avoid. Requests to one destination under the same
+        // conditions share one shortest-path tree.
+        auto blank = std::make_shared<Route>(0, 0, 0);
+        std::map<uint8_t, GraphOverlay> overlays;
+        std::map<std::tuple<vertex_descriptor, uint16_t, uint8_t>, size_t> tree_of;
+        std::vector<Tree> trees;
+        std::vector<size_t> request_tree(requests.size(), no_tree);
+        std::vector<bool> known(requests.size());
+
+        for (size_t i = 0; i < requests.size(); i++) {
+            auto& req = requests[i];
+            known[i] = knownSwitch(req.from) && knownSwitch(req.to);
+            if (not known[i] || not plain(req.selector))
+                continue;
+
+            auto e = m->vertex(req.to);
+            if (e == TopologyGraph::null_vertex())
+                continue;
+            MetricsFlag mf = req.selector.get(metrics)
+                           ? *req.selector.get(metrics) : +MetricsFlag::Hop;
+            uint8_t util = req.selector.get(util_trigger)
+                         ? *req.selector.get(util_trigger) : 0;
+
+            auto ov = overlays.find(util);
+            if (ov == overlays.end()) {
+                ov = overlays.emplace(util, GraphOverlay(m->graph)).first;
+                m->prepareOverlay(blank, req.selector, ov->second);
+            }
+            auto key = std::make_tuple(e, mf._to_integral(), util);
+            auto it = tree_of.find(key);
+            if (it == tree_of.end()) {
+                it = tree_of.emplace(key, trees.size()).first;
+                trees.push_back({ e, mf, &ov->second, {} });
+            }
+            request_tree[i] = it->second;
+        }
+
+        auto csr = m->csr();
+        m->parallel_for(trees.size(), [&](size_t t) {
+            trees[t].pred = m->pathTree(trees[t].to, trees[t].mf,
+                                        *trees[t].ov, *csr);
+        });
+        std::vector<data_link_route> computed(requests.size());
+        m->parallel_for(requests.size(), [&](size_t i) {
+            if (request_tree[i] == no_tree)
+                return;
+            const auto& tree = trees[request_tree[i]];
+            computed[i] = m->tracePath(requests[i].from, tree.to, tree.pred,
+                                       tree.mf, *tree.ov, *csr);
+        });
+        VLOG(2) << "[Topology] Creating routes - " << trees.size()
+                << " shortest-path trees for " << requests.size()
+                << " requests";
+
+        // in request order, so ids are given out as by newRoute()
+        for (size_t i = 0; i < requests.size(); i++) {
+            auto& req = requests[i];
+            if (not known[i]) {
+                LOG(WARNING) << "[Topology] Creating route - No switch for route";
+                continue;
+            }
+            if (not plain(req.selector)) {
+                ids[i] = createRoute(req.from, req.to, std::move(req.selector));
+                continue;
+            }
+            if (computed[i].empty()) {
+                VLOG(1) << "[Topology] Creating route - Can't create route: "
+                        << req.from << " -> " << req.to;
+                continue;
+            }
+
+            auto route = m->addRoute(req.from, req.to);
+            if (req.selector.get(app))
+                route->owner = *req.selector.get(app);
+            auto path = route->attachPath(std::move(computed[i]));
+            applySelector(path, req.selector);
+            VLOG(2) << "[Topology] Created path - "
+                    << route->id << ":" << (int)path->id;
+            update_database(route->id);
+            ids[i] = route->id;
+        }
+        m->invalidateTriggers();
+        m->publish(created);
+        stored = m->storeRoutes(created);
+    } // unlock
+
+    try {
+        stored.get();
+    } catch (redis_error& e) {
+        LOG(ERROR) << "[Topology] Can't store created routes: " << e.what();
+    }
+    return ids;
+}
+
 uint8_t Topology::newPath(uint32_t route_id, RouteSelector selector)
 {
+    generation_counter::scope changed(m_generation);
     //TODO: mutex
     using namespace route_selector;
     if (m->route_map.count(route_id) == 0)
@@ -1282,20 +2653,18 @@ uint8_t Topology::newPath(uint32_t route_id, RouteSelector selector)
     if (computed.size() == 0)
         return max_path_id;
 
-    auto path = route->attachPath(computed);
-
-    // get parameters of triggers
-    if (selector.get(flapping))
-        path->flap = *selector.get(flapping);
-    if (selector.get(broken_trigger))
-        path->broken_flag = *selector.get(broken_trigger);
-    if (selector.get(drop_trigger))
-        path->drop_threshold = *selector.get(drop_trigger);
-    if (selector.get(util_trigger))
-        path->util_threshold = *selector.get(util_trigger);
+    // links were checked by the search, but not atomically with this
+    uint64_t demand = selector.get(bandwidth) ? *selector.get(bandwidth) : 0;
+    if (demand > 0 && not m->reserve(computed, demand)) {
+        VLOG(1) << "[Topology] Creating path - Not enough bandwidth for "
+                << demand << " B/s on route " << route_id;
+        return max_path_id;
+    }
 
-    path->metrics = selector.get(metrics) ? *selector.get(metrics)
-                                          : +MetricsFlag::Hop;
+    auto path = route->attachPath(computed);
+    applySelector(path, selector);
+    path->bandwidth = demand;
+    m->invalidateTriggers();
 
     VLOG(2) << "[Topology] Created path - "
             << route_id << ":" << (int)path->id;
@@ -1305,9 +2674,10 @@ uint8_t Topology::newPath(uint32_t route_id, RouteSelector selector)
 
 bool Topology::deletePath(uint32_t route_id, uint8_t path_id)
 {
+    generation_counter::scope changed(m_generation);
     // we use async because `deletePath` method can be called
     // from another thread (REST) and
-    // we must stop flapping timers (if exists) from app's thread.
+    // flap deadlines are kept on app's thread.
     return async(executor, [=]() {
         if (m->route_map.count(route_id) == 0) return false;
 
@@ -1315,7 +2685,9 @@ bool Topology::deletePath(uint32_t route_id, uint8_t path_id)
         if (route->paths.size() > 1 &&           // erase if only more than one path
                 route->used_path != path_id &&   // and this path isn't using now
                 route->paths.size() > path_id) { // path_id exists
+            m->release(*route->paths[path_id]);
             route->detachPath(path_id);
+            m->invalidateTriggers();
         } else {
             return false;
         }
@@ -1335,57 +2707,60 @@ data_link_route Topology::predictPath(uint32_t route_id) const
     auto route = m->route_map.at(route_id);
     if (not route->allowed_dynamic) return data_link_route{};
 
+    // taken before computing: a change racing with findPath()
+    // leaves a result which is never returned again
+    uint64_t gen = m_generation.get();
+    {
+        std::lock_guard<std::mutex> lock(route->mut);
+        if (route->predicted_generation == gen)
+            return route->predicted;
+    }
+
     auto computed = std::move(m->findPath(route, route->dynamic));
-    return computed.size() > 0 ? computed : data_link_route{};
+    std::lock_guard<std::mutex> lock(route->mut);
+    route->predicted_generation = gen;
+    route->predicted = computed;
+    return computed;
 }
 
 data_link_route Topology::getPath(uint32_t route_id, uint8_t path_id) const
 {
-    //TODO: mutex
-    if (m->route_map.count(route_id) == 0)
+    auto route = m->snapshot(route_id);
+    if (not route || route->paths.size() <= path_id)
         return data_link_route{};
 
-    auto route = m->route_map.at(route_id);
-    auto path = route->getPath(path_id);
-
-    return path == nullptr ? data_link_route{} : path->m_path;
+    return route->paths[path_id].m_path;
 }
 
 data_link_route Topology::getFirstWorkPath(uint32_t route_id) const
 {
-    if (m->route_map.count(route_id) == 0)
-        return data_link_route{};
-
-    auto route = m->route_map.at(route_id);
-    auto path = route->getFirstWorkPath();
-
-    return (path ? path->m_path : data_link_route{});
+    auto id = getFirstWorkPathId(route_id);
+    return id != max_path_id ? getPath(route_id, id) : data_link_route{};
 }
 
 uint8_t Topology::getFirstWorkPathId(uint32_t route_id) const
 {
-    if (m->route_map.count(route_id) == 0)
+    auto route = m->snapshot(route_id);
+    if (not route)
         return max_path_id;
 
-    auto route = m->route_map.at(route_id);
-    auto path = route->getFirstWorkPath();
-
-    return (path ? path->id : max_path_id);
-
+    for (size_t i = 0; i < route->paths.size(); i++) {
+        if (route->paths[i].triggers == 0) // not activated triggers
+            return i;
+    }
+    return max_path_id;
 }
 
 ServiceFlag Topology::getOwner(uint32_t id) const
 {
-    if (m->route_map.count(id) == 0)
-        return ServiceFlag::None;
-
-    return m->route_map.at(id)->owner;
+    auto route = m->snapshot(id);
+    return route ? route->owner : +ServiceFlag::None;
 }
 
 uint8_t Topology::getFlapping(uint32_t id, uint8_t path_id) const
 {
     try {
-        return m->route_map.at(id)->paths.at(path_id)->flap;
+        return m->snapshotAt(id)->paths.at(path_id).flap;
     } catch (const std::out_of_range& ex) {
         LOG(WARNING) << "[Topology] Get info - Trying to get bad route";
         LOG(WARNING) << ex.what();
@@ -1396,15 +2771,16 @@ uint8_t Topology::getFlapping(uint32_t id, uint8_t path_id) const
 uint8_t Topology::getTriggerThreshold(uint32_t id, uint8_t path_id, TriggerFlag tf) const
 { // TODO: make enum safety!
     try {
-        auto path = m->route_map.at(id)->paths.at(path_id);
+        auto route = m->snapshotAt(id);
+        const auto& path = route->paths.at(path_id);
         if (tf == +TriggerFlag::Broken)
-            return (uint8_t)path->broken_flag;
+            return (uint8_t)path.broken_flag;
 
         else if (tf == +TriggerFlag::Drop)
-            return path->drop_threshold;
+            return path.drop_threshold;
 
         else if (tf == +TriggerFlag::Util)
-            return path->util_threshold;
+            return path.util_threshold;
     } catch (const std::out_of_range& ex) {
         LOG(WARNING) << "[Topology] Get info - Trying to get bad route";
         LOG(WARNING) << ex.what();
@@ -1416,7 +2792,7 @@ uint8_t Topology::getTriggerThreshold(uint32_t id, uint8_t path_id, TriggerFlag
 bool Topology::getStatus(uint32_t id, uint8_t path_id, TriggerFlag tf) const
 {
     try {
-        return m->route_map.at(id)->paths.at(path_id)->getTrigger(tf);
+        return m->snapshotAt(id)->paths.at(path_id).triggers & tf;
     } catch (const std::out_of_range& ex) {
         LOG(WARNING) << "[Topology] Get info - Trying to get bad route or path";
         LOG(WARNING) << ex.what();
@@ -1427,23 +2803,28 @@ bool Topology::getStatus(uint32_t id, uint8_t path_id, TriggerFlag tf) const
 
 uint64_t Topology::getMinRouteRate(uint32_t id, uint8_t path_id) const
 {
-    if (m->route_map.count(id) == 0)
+    auto route = m->snapshot(id);
+    if (not route)
         return 0;
-    auto route = m->route_map.at(id);
-    auto path = route->getPath(path_id);
-    if (!path) {
+    if (route->paths.size() <= path_id) {
         LOG(ERROR) << "[Topology] Get info - Trying to get bad path";
         return 0;
     }
 
+    const auto& m_path = route->paths[path_id].m_path;
     uint64_t min_rate = LLONG_MAX;
-    for (size_t i = 0; i < path->m_path.size(); i += 2) {
-        auto curr = path->m_path.at(i);
-        auto sw = m_switch_manager->switch_(curr.dpid);
-        auto port = sw->port(curr.port);
+    for (size_t i = 0; i < m_path.size(); i += 2) {
+        auto curr = m_path.at(i);
+        uint64_t max; // bytes/s
+        if (auto synthetic = syntheticPort(curr)) {
+            max = synthetic->speed_kbps*125;
+        } else {
+            auto sw = m_switch_manager->switch_(curr.dpid);
+            auto port = sw->port(curr.port);
 
-        auto eth = std::dynamic_pointer_cast<EthernetPort>(port);
-        uint64_t max = eth->current_speed()*125; // bytes/s
+            auto eth = std::dynamic_pointer_cast<EthernetPort>(port);
+            max = eth->current_speed()*125;
+        }
         if (min_rate > max) min_rate = max;
     }
 
@@ -1452,6 +2833,10 @@ uint64_t Topology::getMinRouteRate(uint32_t id, uint8_t path_id) const
 
 std::pair<uint64_t, uint64_t> Topology::getPortUtility(switch_and_port sp) const
 {
+    if (auto synthetic = syntheticPort(sp)) {
+        return {synthetic->tx_bytes, synthetic->rx_bytes};
+    }
+
     auto sw = m_switch_manager->switch_(sp.dpid);
     auto port = sw->port(sp.port);
 
@@ -1467,6 +2852,10 @@ std::pair<uint64_t, uint64_t> Topology::getPortUtility(switch_and_port sp) const
 
 uint64_t Topology::getSpeedRate(switch_and_port sp) const
 {
+    if (auto synthetic = syntheticPort(sp)) {
+        return synthetic->speed_kbps*125; // bytes/s
+    }
+
     if (m->speed_rate.count(sp)) {
         return m->speed_rate[sp];
     }
@@ -1496,24 +2885,117 @@ uint64_t Topology::getSpeedRate(switch_and_port sp) const
     return rate;
 }
 
+uint64_t Topology::getResidualRate(switch_and_port sp) const
+{
+    std::lock_guard<std::mutex> lk(m->ledger_mutex);
+    return m->ledger.residual(sp);
+}
+
 std::string Topology::getRouteDump(uint32_t id) const
 {
-    if (m->route_map.count(id) == 0)
-        return "";
+    auto route = m->snapshot(id);
+    return route ? route->dump : "";
+}
+
+auto Topology::multipath(uint32_t id) const -> Multipath
+{
+    Multipath ret;
+    auto route = m->snapshot(id);
+    if (not route || not route->ecmp)
+        return ret;
 
-    return m->route_map.at(id)->to_json().dump();
+    for (const auto& path : route->paths) {
+        if (path.triggers != 0)
+            continue; // broken, in maintenance or overloaded
+        // (egress, ingress) pairs from `from` to `to`
+        for (size_t i = 0; i < path.m_path.size(); i += 2) {
+            auto& ports = ret[path.m_path[i].dpid];
+            ports.push_back(path.m_path[i].port);
+        }
+    }
+    for (auto& it : ret) {
+        auto& ports = it.second;
+        std::sort(ports.begin(), ports.end());
+        ports.erase(std::unique(ports.begin(), ports.end()), ports.end());
+    }
+    return ret;
 }
 
-uint8_t Topology::getUsedPath(uint32_t id) const
+auto Topology::failover(uint32_t id) const -> Multipath
 {
-    if (m->route_map.count(id) == 0)
-        return max_path_id;
+    Multipath ret;
+    auto route = m->snapshot(id);
+    if (not route || route->ecmp)
+        return ret;
 
-    return m->route_map.at(id)->used_path;
+    auto add = [&ret](const RouteSnapshot::PathState& path) {
+        for (size_t i = 0; i < path.m_path.size(); i += 2) {
+            auto& ports = ret[path.m_path[i].dpid];
+            auto port = path.m_path[i].port;
+            if (std::find(ports.begin(), ports.end(), port) == ports.end())
+                ports.push_back(port);
+        }
+    };
+    if (route->used_path < route->paths.size())
+        add(route->paths[route->used_path]);
+    for (const auto& path : route->paths)
+        add(path);
+    return ret;
+}
+
+auto Topology::sourceTree(uint64_t root, MetricsFlag mf) const -> SourceTree
+{
+    SourceTree ret;
+    std::lock_guard<std::mutex> lk(m->graph_mutex);
+    auto r = m->vertex(root);
+    if (r == TopologyGraph::null_vertex())
+        return ret;
+
+    // a blank route has no paths to avoid, only maintenance is masked
+    GraphOverlay ov(m->graph);
+    RouteSelector selector;
+    m->prepareOverlay(std::make_shared<Route>(0, 0, 0), selector, ov);
+
+    auto csr = m->csr();
+    auto pred = csr->predecessors(r, mf, ov);
+    const auto& weight = csr->metrics(mf);
+    for (uint32_t v = 0; v < pred.size() && v < csr->size(); v++) {
+        auto u = pred[v];
+        if (u == v)
+            continue; // root or unreachable
+
+        // the cheapest of parallel links to the parent
+        const link_property* link = nullptr;
+        uint64_t best = CsrGraph::infinity;
+        for (uint32_t i = csr->offsets[v]; i < csr->offsets[v + 1]; i++) {
+            if (csr->targets[i] != u || not ov.allows(csr->links[i], v, u))
+                continue;
+            uint64_t curr = weight[i] + ov.penalty_of(csr->links[i]);
+            if (curr < best) {
+                best = curr;
+                link = csr->links[i];
+            }
+        }
+        if (not link)
+            continue;
+
+        bool forward = m->vertex(link->target.dpid) == v;
+        auto own = forward ? link->target : link->source;
+        auto parent = forward ? link->source : link->target;
+        ret[own.dpid] = std::make_pair(parent, own);
+    }
+    return ret;
+}
+
+uint8_t Topology::getUsedPath(uint32_t id) const
+{
+    auto route = m->snapshot(id);
+    return route ? route->used_path : max_path_id;
 }
 
 void Topology::setUsedPath(uint32_t id, uint8_t path_id)
 {
+    generation_counter::scope changed(m_generation);
     if (m->route_map.count(id) == 0) return;
 
     auto route = m->route_map.at(id);
@@ -1524,6 +3006,7 @@ void Topology::setUsedPath(uint32_t id, uint8_t path_id)
         // reset triggers on selected path
         auto path = route->paths[path_id];
         path->resetTriggers();
+        m->invalidateTriggers(); // reactivate what is still overloaded
     }
 
     update_database(id);
@@ -1531,6 +3014,7 @@ void Topology::setUsedPath(uint32_t id, uint8_t path_id)
 
 bool Topology::movePath(uint32_t id, uint8_t path_id, uint8_t new_id)
 {
+    generation_counter::scope changed(m_generation);
     if (m->route_map.count(id) == 0 || path_id == new_id) return false;
 
     auto route = m->route_map.at(id);
@@ -1557,6 +3041,7 @@ bool Topology::movePath(uint32_t id, uint8_t path_id, uint8_t new_id)
 
 bool Topology::modifyPath(uint32_t id, uint8_t path_id, RouteSelector selector)
 {
+    generation_counter::scope changed(m_generation);
     using namespace route_selector;
 
     if (m->route_map.count(id) == 0) {
@@ -1577,11 +3062,14 @@ bool Topology::modifyPath(uint32_t id, uint8_t path_id, RouteSelector selector)
                           *selector.get(drop_trigger) : path->drop_threshold;
     path->util_threshold = selector.get(util_trigger) ?
                           *selector.get(util_trigger) : path->util_threshold;
+    m->invalidateTriggers();
+    m->publish(id);
     return true;
 }
 
 bool Topology::addDynamic(uint64_t route_id, RouteSelector selector)
 {
+    generation_counter::scope changed(m_generation);
     if (m->route_map.count(route_id) == 0) return false;
 
     auto route = m->route_map.at(route_id);
@@ -1593,6 +3081,7 @@ bool Topology::addDynamic(uint64_t route_id, RouteSelector selector)
 
 bool Topology::delDynamic(uint64_t route_id)
 {
+    generation_counter::scope changed(m_generation);
     if (m->route_map.count(route_id) == 0) return false;
 
     auto route = m->route_map.at(route_id);
@@ -1614,10 +3103,69 @@ uint8_t Topology::getDynamic(uint64_t route_id)
     return ret;
 }
 
+std::vector<uint32_t> Topology::reoptimize()
+{
+    static metrics::Histogram& duration = metrics::Registry::global()
+        .histogram("runos_topology_te_pass_seconds",
+                   "Time of a traffic engineering pass over dynamic routes");
+    static metrics::Counter& moves = metrics::Registry::global()
+        .counter("runos_topology_te_moves_total",
+                 "Dynamic routes moved by traffic engineering passes");
+    metrics::ScopedTimer timer(duration);
+    generation_counter::scope changed(m_generation);
+
+    std::vector<uint32_t> moved;
+    future<void> stored = make_ready_future();
+    { // lock
+        std::lock_guard<std::mutex> lk(m->graph_mutex);
+        for (auto& move : m->planMoves()) {
+            auto& route = move.route;
+            if (move.path_id == max_path_id) {
+                RouteSelector selector = route->dynamic;
+                uint64_t demand = selector.get(route_selector::bandwidth)
+                                ? *selector.get(route_selector::bandwidth) : 0;
+                if (demand > 0 && not m->reserve(move.path, demand))
+                    continue;
+                auto path = route->attachPath(std::move(move.path));
+                applySelector(path, selector);
+                path->bandwidth = demand;
+                move.path_id = path->id;
+            }
+            route->used_path = move.path_id;
+            route->paths[move.path_id]->resetTriggers();
+            moved.push_back(route->id);
+        }
+        if (moved.empty())
+            return moved;
+
+        m->invalidateTriggers(); // reactivate what is still overloaded
+        m->publish(moved, false);
+        stored = m->storeRoutes(moved);
+    } // unlock
+
+    moves.add(moved.size());
+    VLOG(1) << "[Topology] Traffic engineering - Moved "
+            << moved.size() << " dynamic routes";
+    std::sort(moved.begin(), moved.end());
+    emit routesRebalanced(moved);
+    for (auto id : moved)
+        emit routeUpdated(id);
+
+    try {
+        stored.get();
+    } catch (redis_error& e) {
+        LOG(ERROR) << "[Topology] Can't store moved routes: " << e.what();
+    }
+    return moved;
+}
+
 void Topology::deleteRoute(uint32_t id)
 {
+    generation_counter::scope changed(m_generation);
     //std::lock_guard<std::mutex> lk(m->graph_mutex);
     m->eraseRoute(id);
+    m->invalidateTriggers();
+    m->publish(id);
     erase_from_database(id);
 }
 
@@ -1625,8 +3173,8 @@ uint8_t Topology::minHops(uint64_t from, uint64_t to)
 {
     if (from == to) return 0;
 
-    auto path = std::move(m->computePath(from, to, MetricsFlag::Hop, m->graph));
-    return path.size()/2;
+    auto hops = std::atomic_load(&m->hops)->hops(from, to);
+    return hops == HopMatrix::unreachable ? 0 : hops;
 }
 
 } // namespace runos
@@ -21,8 +21,12 @@
 #include "ILinkDiscovery.hpp"
 #include "lib/kwargs.hpp"
 #include "lib/better_enum.hpp"
+#include "lib/generation.hpp"
 #include "lib/qt_executor.hpp"
 
+#include <map>
+#include <memory>
+#include <optional>
 #include <vector>
 
 #include <QTimer>
@@ -70,6 +74,11 @@ namespace route_selector {
     constexpr kwarg<struct drops_tag, uint8_t> drop_trigger;
     constexpr kwarg<struct util_tag, uint8_t> util_trigger;
     constexpr kwarg<struct conf_tag, uint8_t> configured_count;
+    // all least-cost paths at once, for multipath forwarding
+    constexpr kwarg<struct ecmp_tag, bool> ecmp;
+    // bytes/s reserved over every link of a path: links with less
+    // residual capacity are left out of the search (CSPF)
+    constexpr kwarg<struct bandwidth_tag, uint64_t> bandwidth;
 
     constexpr kwarg<struct include_tag, switch_list> include_dpid;
     constexpr kwarg<struct exclude_tag, switch_list> exclude_dpid;
@@ -84,6 +93,8 @@ using RouteSelector = decltype(kwargs(
     route_selector::drop_trigger,
     route_selector::util_trigger,
     route_selector::configured_count,
+    route_selector::ecmp,
+    route_selector::bandwidth,
 
     route_selector::include_dpid,
     route_selector::exclude_dpid,
@@ -121,6 +132,17 @@ public:
 
     // Modifiers
     uint32_t newRoute(uint64_t from, uint64_t to, RouteSelector selector);
+
+    struct RouteRequest {
+        uint64_t from;
+        uint64_t to;
+        RouteSelector selector;
+    };
+    // Same as newRoute() for every request, with ids in request order
+    // (0 for failed ones). Single-path requests to one destination
+    // share a shortest-path tree, trees and paths are computed on the
+    // parallel-threads workers and all routes are stored in one batch.
+    std::vector<uint32_t> newRoutes(std::vector<RouteRequest> requests);
     uint8_t newPath(uint32_t route_id, RouteSelector selector);
     void deleteRoute(uint32_t id);
     bool deletePath(uint32_t route_id, uint8_t path_id);
@@ -131,8 +153,16 @@ public:
     bool addDynamic(uint64_t route_id, RouteSelector selector);
     bool delDynamic(uint64_t route_id);
     uint8_t getDynamic(uint64_t route_id);
-
-    // Observers
+    // One traffic engineering pass over all dynamic routes together:
+    // routes over ports loaded above `te-util-threshold` move to other
+    // paths, greedily lowering the peak utilization. Moves are applied
+    // at once and announced by routesRebalanced() before routeUpdated()
+    // of each moved route. Also run every `te-interval-ms`.
+    std::vector<uint32_t> reoptimize();
+
+    // Observers. Except predictPath, route observers read published
+    // snapshots without locks and may be called from any thread.
+    // predictPath is computed once per generation() and route.
     data_link_route predictPath(uint32_t route_id) const;
     data_link_route getPath(uint32_t route_id, uint8_t path_id) const;
     data_link_route getFirstWorkPath(uint32_t route_id) const;
@@ -147,10 +177,44 @@ public:
     uint64_t getMinRouteRate(uint32_t id, uint8_t path_id) const;
     std::pair<uint64_t, uint64_t> getPortUtility(switch_and_port sp) const;
     uint64_t getSpeedRate(switch_and_port sp) const;
+    // Bytes/s of the port still free for route_selector::bandwidth
+    uint64_t getResidualRate(switch_and_port sp) const;
     std::string getRouteDump(uint32_t id) const;
 
+    // Output ports per switch over the working paths of an ECMP route,
+    // empty for other routes
+    using Multipath = std::map<uint64_t, std::vector<uint32_t>>;
+    Multipath multipath(uint32_t id) const;
+    // Output ports per switch over all paths of other routes in order
+    // of preference: used path first, then the rest by path id
+    Multipath failover(uint32_t id) const;
+
+    // Shortest-path tree from `root` over links out of maintenance,
+    // one dijkstra for all destinations. Every reachable switch but
+    // the root maps to the link towards its parent, as
+    // {parent's egress port, own ingress port}.
+    using SourceTree = std::map<uint64_t, std::pair<switch_and_port, switch_and_port>>;
+    SourceTree sourceTree(uint64_t root, MetricsFlag mf = MetricsFlag::Hop) const;
+
     uint8_t minHops(uint64_t from, uint64_t to);
 
+    // Bumped after every change of links, metrics or routes
+    uint64_t generation() const { return m_generation.get(); }
+
+    // Ports without a live switch behind them, e.g. fed by
+    // topology-simulator. Their links, routes and stats are accepted
+    // like those of connected switches. Speed in kbps, load in bytes/s.
+    struct SyntheticPort {
+        uint64_t speed_kbps;
+        uint64_t tx_bytes {0};
+        uint64_t rx_bytes {0};
+        uint64_t tx_dropped {0};
+        uint64_t rx_dropped {0};
+    };
+    using SyntheticPorts = std::map<switch_and_port, SyntheticPort>;
+    // nullptr drops them, links already added stay
+    void setSyntheticPorts(std::shared_ptr<const SyntheticPorts> ports);
+
 protected slots:
     void linkDiscovered(switch_and_port from, switch_and_port to);
     void linkBroken(switch_and_port from, switch_and_port to);
@@ -161,6 +225,7 @@ protected slots:
     void onPMaintenanceOff(PortPtr port);
     void onSMaintenance(SwitchPtr port);
     void onSMaintenanceOff(SwitchPtr port);
+    void portStatsUpdated(PortPtr port);
 
 private:
     struct TopologyImpl* m;
@@ -169,15 +234,24 @@ private:
     class SwitchManager* m_switch_manager;
     class RecoveryManager* recovery;
     class DatabaseConnector* db_connector_ = nullptr;
+    class StateSnapshot* snapshot_ = nullptr;
     qt_executor executor {this};
+    generation_counter m_generation;
+    std::shared_ptr<const SyntheticPorts> m_synthetic_ports;
 
-    void updateMetrics();
+    std::optional<SyntheticPort> syntheticPort(switch_and_port sp) const;
+    bool knownSwitch(uint64_t dpid) const;
+    // port stats of core ports update the weight of their link
+    void subscribeStats(switch_and_port sp, bool on);
     void timerEvent(QTimerEvent *event) override;
     void addLink(switch_and_port from, switch_and_port to);
 
     void switchUp(SwitchPtr sw) override;
     void switchDown(SwitchPtr sw) override;
 
+    // newRoute() under graph_mutex
+    uint32_t createRoute(uint64_t from, uint64_t to, RouteSelector selector);
+    // publishes the route snapshot to observers, then stores it
     void update_database(uint32_t route_id);
     void erase_from_database(uint32_t route_id);
     void load_from_database();
@@ -187,6 +261,13 @@ signals:
 
     void routeTriggerActive(uint32_t id, uint8_t path_id, TriggerFlag tf);
     void routeTriggerInactive(uint32_t id, uint8_t path_id, TriggerFlag tf);
+    // new snapshot of the route is published, or it was deleted
+    void routeUpdated(uint32_t id);
+    // routes moved by one reoptimize() pass, snapshots are published
+    void routesRebalanced(std::vector<uint32_t> ids);
+    // a link appeared or vanished, or a switch or port changed
+    // maintenance mode: trees from sourceTree() may be outdated
+    void linksChanged();
 };
 
 } // namespace runos
@@ -0,0 +1,551 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Topology.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <boost/graph/adjacency_list.hpp>
+#include <boost/graph/dijkstra_shortest_paths_no_color_map.hpp>
+#include <boost/property_map/function_property_map.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Graph structures behind Topology path computation.
+// Kept apart from Topology.cc so they can be exercised without
+// a running controller, e.g. by the microbenchmarks.
+
+namespace runos {
+
+using TopologyGraph = boost::adjacency_list< boost::multisetS, boost::vecS,
+                                            boost::undirectedS,
+                                            boost::no_property, link_property>;
+using vertex_descriptor = TopologyGraph::vertex_descriptor;
+using edge_descriptor = TopologyGraph::edge_descriptor;
+
+// Per-computation view of the live graph.
+// Instead of copying the graph and mutating the copy, path computation
+// collects masked switches, masked links and additional link penalties here.
+// Links are identified by address of their bundled property, which is
+// stable while graph_mutex is held.
+struct GraphOverlay {
+    explicit GraphOverlay(const TopologyGraph& g): g(&g) {}
+
+    void mask(vertex_descriptor v) {
+        if (v != TopologyGraph::null_vertex())
+            masked_vertices.insert(v);
+    }
+    void mask(edge_descriptor e) { masked_edges.insert(&(*g)[e]); }
+    void penalize(edge_descriptor e, uint64_t w) { penalty[&(*g)[e]] += w; }
+
+    bool allows(edge_descriptor e) const {
+        return allows(&(*g)[e], source(e, *g), target(e, *g));
+    }
+    bool allows(const link_property* link,
+                vertex_descriptor u, vertex_descriptor v) const {
+        if (masked_edges.count(link))
+            return false;
+        if (masked_vertices.empty())
+            return true;
+        return masked_vertices.count(u) == 0 && masked_vertices.count(v) == 0;
+    }
+
+    bool empty() const {
+        return masked_vertices.empty() && masked_edges.empty() && penalty.empty();
+    }
+
+    uint64_t penalty_of(const link_property* link) const {
+        if (penalty.empty()) return 0;
+        auto it = penalty.find(link);
+        return it != penalty.end() ? it->second : 0;
+    }
+
+    const TopologyGraph* g;
+    std::unordered_set<vertex_descriptor> masked_vertices;
+    std::unordered_set<const link_property*> masked_edges;
+    std::unordered_map<const link_property*, uint64_t> penalty;
+};
+
+inline uint64_t link_metrics(const link_property& link, MetricsFlag mf)
+{
+    switch (mf) {
+    case MetricsFlag::Hop:
+        return link.hop_metrics;
+    case MetricsFlag::PortSpeed:
+        return link.ps_metrics;
+    case MetricsFlag::PortLoading:
+        return link.pl_metrics;
+    default:
+        // FIXME: should throw exception?
+        LOG(ERROR) << "[Topology] Incorrect metrics!";
+        return (uint64_t)0;
+    }
+}
+
+// Cache of shortest-path trees rooted at route destinations.
+// Trees are kept for static metrics only (Hop and PortSpeed) and are
+// repaired in place when a link appears or disappears: an added link
+// propagates only the distances it improves, a removed tree link
+// recomputes only the subtree hanging below it.
+// Unreachable vertices have themselves as predecessor, like boost dijkstra.
+class SptCache {
+public:
+    using predecessors = std::vector<vertex_descriptor>;
+
+    static bool cacheable(MetricsFlag mf) {
+        return mf == +MetricsFlag::Hop || mf == +MetricsFlag::PortSpeed;
+    }
+
+    // Missing trees are built unlocked, so trees of different roots can
+    // be built at once; the graph must not change meanwhile.
+    predecessors get(vertex_descriptor root, MetricsFlag mf,
+                     const TopologyGraph& g) {
+        auto key = std::make_pair(root, mf._to_integral());
+        {
+            std::lock_guard<std::mutex> lk(mut);
+            auto it = trees.find(key);
+            if (it != trees.end()) {
+                fit(it->second, g);
+                return it->second.pred;
+            }
+        }
+        auto tree = build(root, mf, g);
+        std::lock_guard<std::mutex> lk(mut);
+        // a tree built concurrently for the same root is as good
+        return trees.emplace(key, std::move(tree)).first->second.pred;
+    }
+
+    // must be called after edge (u, v) was added to the graph
+    void edgeAdded(vertex_descriptor u, vertex_descriptor v,
+                   const TopologyGraph& g) {
+        std::lock_guard<std::mutex> lk(mut);
+        for (auto& it : trees) {
+            auto& tree = it.second;
+            fit(tree, g);
+            queue_type queue;
+            relax(tree, u, v, g, queue);
+            relax(tree, v, u, g, queue);
+            propagate(tree, g, queue, nullptr);
+        }
+    }
+
+    // must be called after edge (u, v) was removed from the graph
+    void edgeRemoved(vertex_descriptor u, vertex_descriptor v,
+                     const TopologyGraph& g) {
+        std::lock_guard<std::mutex> lk(mut);
+        for (auto& it : trees) {
+            auto& tree = it.second;
+            fit(tree, g);
+            if (tree.pred[v] == u && v != u)
+                repair(tree, v, g);
+            else if (tree.pred[u] == v && u != v)
+                repair(tree, u, g);
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lk(mut);
+        trees.clear();
+    }
+
+private:
+    static constexpr uint64_t infinity = std::numeric_limits<uint64_t>::max();
+    using queue_item = std::pair<uint64_t, vertex_descriptor>;
+    using queue_type = std::priority_queue<queue_item, std::vector<queue_item>,
+                                           std::greater<queue_item>>;
+
+    struct Tree {
+        vertex_descriptor root;
+        MetricsFlag mf;
+        std::vector<uint64_t> dist;
+        predecessors pred;
+    };
+
+    std::mutex mut;
+    std::map<std::pair<vertex_descriptor, uint16_t>, Tree> trees;
+
+    Tree build(vertex_descriptor root, MetricsFlag mf, const TopologyGraph& g) {
+        Tree tree {root, mf, {}, {}};
+        tree.dist.assign(num_vertices(g), infinity);
+        tree.pred.resize(num_vertices(g));
+        for (size_t i = 0; i < tree.pred.size(); i++)
+            tree.pred[i] = i;
+
+        auto weights = boost::make_function_property_map<edge_descriptor, uint64_t>(
+            [&g, mf](edge_descriptor ed) { return link_metrics(g[ed], mf); });
+        boost::dijkstra_shortest_paths_no_color_map(g, root, boost::weight_map( weights )
+            .predecessor_map( boost::make_iterator_property_map(tree.pred.begin(),
+                                                  boost::get(boost::vertex_index, g)) )
+            .distance_map( boost::make_iterator_property_map(tree.dist.begin(),
+                                               boost::get(boost::vertex_index, g)) )
+            .distance_inf( infinity )
+        );
+        return tree;
+    }
+
+    // new vertices are isolated until their first link is added
+    void fit(Tree& tree, const TopologyGraph& g) {
+        for (size_t i = tree.pred.size(); i < num_vertices(g); i++) {
+            tree.dist.push_back(infinity);
+            tree.pred.push_back(i);
+        }
+    }
+
+    void relax(Tree& tree, vertex_descriptor from, vertex_descriptor to,
+               const TopologyGraph& g, queue_type& queue) {
+        if (tree.dist[from] == infinity)
+            return;
+        auto edges = edge_range(from, to, g);
+        for (auto it = edges.first; it != edges.second; ++it) {
+            uint64_t d = tree.dist[from] + link_metrics(g[*it], tree.mf);
+            if (d < tree.dist[to]) {
+                tree.dist[to] = d;
+                tree.pred[to] = from;
+                queue.emplace(d, to);
+            }
+        }
+    }
+
+    // dijkstra continuation from the queued vertices;
+    // if `scope` is set, only vertices inside it are updated
+    void propagate(Tree& tree, const TopologyGraph& g, queue_type& queue,
+                   const std::vector<bool>* scope) {
+        while (not queue.empty()) {
+            auto item = queue.top();
+            queue.pop();
+            auto x = item.second;
+            if (item.first > tree.dist[x])
+                continue; // stale entry
+
+            auto edges = out_edges(x, g);
+            for (auto it = edges.first; it != edges.second; ++it) {
+                auto y = target(*it, g);
+                if (scope && not (*scope)[y])
+                    continue;
+                uint64_t d = tree.dist[x] + link_metrics(g[*it], tree.mf);
+                if (d < tree.dist[y]) {
+                    tree.dist[y] = d;
+                    tree.pred[y] = x;
+                    queue.emplace(d, y);
+                }
+            }
+        }
+    }
+
+    // recompute the subtree rooted at `child` after its tree link vanished
+    void repair(Tree& tree, vertex_descriptor child, const TopologyGraph& g) {
+        size_t n = tree.pred.size();
+        std::vector<std::vector<vertex_descriptor>> children(n);
+        for (size_t i = 0; i < n; i++) {
+            if (tree.pred[i] != i)
+                children[tree.pred[i]].push_back(i);
+        }
+
+        std::vector<bool> affected(n, false);
+        std::vector<vertex_descriptor> subtree {child};
+        affected[child] = true;
+        for (size_t i = 0; i < subtree.size(); i++) {
+            for (auto c : children[subtree[i]]) {
+                affected[c] = true;
+                subtree.push_back(c);
+            }
+        }
+
+        for (auto x : subtree) {
+            tree.dist[x] = infinity;
+            tree.pred[x] = x;
+        }
+
+        // seed the subtree from its unaffected neighbours
+        queue_type queue;
+        for (auto x : subtree) {
+            auto edges = out_edges(x, g);
+            for (auto it = edges.first; it != edges.second; ++it) {
+                auto y = target(*it, g);
+                if (affected[y] || tree.dist[y] == infinity)
+                    continue;
+                uint64_t d = tree.dist[y] + link_metrics(g[*it], tree.mf);
+                if (d < tree.dist[x]) {
+                    tree.dist[x] = d;
+                    tree.pred[x] = y;
+                }
+            }
+            if (tree.dist[x] != infinity)
+                queue.emplace(tree.dist[x], x);
+        }
+
+        propagate(tree, g, queue, &affected);
+    }
+};
+
+// Compressed-sparse-row snapshot of TopologyGraph.
+// Adjacency of vertex v is targets[offsets[v] .. offsets[v+1]), every
+// undirected link appears once per direction. Metrics are stored as
+// separate arrays so dijkstra reads contiguous memory only.
+// Snapshots are immutable; TopologyImpl rebuilds one lazily after
+// the graph or link metrics change.
+struct CsrGraph {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> targets;
+    std::vector<const link_property*> links;
+    std::vector<uint64_t> hop;
+    std::vector<uint64_t> ps;
+    std::vector<uint64_t> pl;
+
+    explicit CsrGraph(const TopologyGraph& g) {
+        size_t n = num_vertices(g);
+        offsets.reserve(n + 1);
+        offsets.push_back(0);
+        for (size_t v = 0; v < n; v++) {
+            auto edges = out_edges(v, g);
+            for (auto it = edges.first; it != edges.second; ++it) {
+                const link_property& link = g[*it];
+                targets.push_back(target(*it, g));
+                links.push_back(&link);
+                hop.push_back(link.hop_metrics);
+                ps.push_back(link.ps_metrics);
+                pl.push_back(link.pl_metrics);
+            }
+            offsets.push_back(targets.size());
+        }
+    }
+
+    size_t size() const { return offsets.size() - 1; }
+
+    const std::vector<uint64_t>& metrics(MetricsFlag mf) const {
+        switch (mf) {
+        case MetricsFlag::PortSpeed:
+            return ps;
+        case MetricsFlag::PortLoading:
+            return pl;
+        default:
+            return hop;
+        }
+    }
+
+    static constexpr uint64_t infinity = std::numeric_limits<uint64_t>::max();
+
+    // single-source dijkstra from `root` honouring the overlay;
+    // unreachable vertices have themselves as predecessor and
+    // `infinity` in `distances`, if requested
+    std::vector<vertex_descriptor> predecessors(vertex_descriptor root,
+                                                MetricsFlag mf,
+                                                const GraphOverlay& ov,
+                                                std::vector<uint64_t>* distances
+                                                    = nullptr) const {
+        using queue_item = std::pair<uint64_t, uint32_t>;
+
+        size_t n = size();
+        std::vector<vertex_descriptor> pred(n);
+        for (size_t i = 0; i < n; i++)
+            pred[i] = i;
+        if (distances)
+            distances->assign(n, infinity);
+        if (root >= n)
+            return pred;
+
+        const auto& weight = metrics(mf);
+        std::vector<uint64_t> dist(n, infinity);
+        std::priority_queue<queue_item, std::vector<queue_item>,
+                            std::greater<queue_item>> queue;
+        dist[root] = 0;
+        queue.emplace(0, root);
+
+        while (not queue.empty()) {
+            auto item = queue.top();
+            queue.pop();
+            uint32_t x = item.second;
+            if (item.first > dist[x])
+                continue; // stale entry
+
+            for (uint32_t i = offsets[x]; i < offsets[x + 1]; i++) {
+                uint32_t y = targets[i];
+                if (not ov.allows(links[i], x, y))
+                    continue;
+                uint64_t d = dist[x] + weight[i] + ov.penalty_of(links[i]);
+                if (d < dist[y]) {
+                    dist[y] = d;
+                    pred[y] = x;
+                    queue.emplace(d, y);
+                }
+            }
+        }
+        if (distances)
+            *distances = std::move(dist);
+        return pred;
+    }
+
+    // point-to-point shortest path honouring the overlay.
+    // Bidirectional dijkstra from both ends, stopped as soon as no
+    // shorter path can meet; only vertices of the path are filled in,
+    // so the result is walked like predecessors(to) from `from` only.
+    // Every other vertex (and `from` if `to` is unreachable) has itself
+    // as successor.
+    std::vector<vertex_descriptor> route(vertex_descriptor from,
+                                         vertex_descriptor to,
+                                         MetricsFlag mf,
+                                         const GraphOverlay& ov) const {
+        using queue_item = std::pair<uint64_t, uint32_t>;
+        using queue_type = std::priority_queue<queue_item,
+                                               std::vector<queue_item>,
+                                               std::greater<queue_item>>;
+
+        size_t n = size();
+        std::vector<vertex_descriptor> next(n);
+        for (size_t i = 0; i < n; i++)
+            next[i] = i;
+        if (from >= n || to >= n || from == to)
+            return next;
+
+        const auto& weight = metrics(mf);
+        // index 0 searches from `from`, index 1 from `to`
+        std::vector<uint64_t> dist[2] { std::vector<uint64_t>(n, infinity),
+                                        std::vector<uint64_t>(n, infinity) };
+        std::vector<uint32_t> pred[2] { std::vector<uint32_t>(n),
+                                        std::vector<uint32_t>(n) };
+        queue_type queue[2];
+        dist[0][from] = 0;
+        dist[1][to] = 0;
+        pred[0][from] = from;
+        pred[1][to] = to;
+        queue[0].emplace(0, from);
+        queue[1].emplace(0, to);
+
+        uint64_t best = infinity;
+        uint32_t meet_from = 0, meet_to = 0; // best path crosses this link
+
+        while (not queue[0].empty() && not queue[1].empty()) {
+            // stale tops only make the bound smaller, never wrong
+            if (queue[0].top().first + queue[1].top().first >= best)
+                break;
+
+            int side = queue[0].top().first <= queue[1].top().first ? 0 : 1;
+            auto item = queue[side].top();
+            queue[side].pop();
+            uint32_t x = item.second;
+            auto& d = dist[side];
+            if (item.first > d[x])
+                continue; // stale entry
+
+            const auto& other = dist[1 - side];
+            for (uint32_t i = offsets[x]; i < offsets[x + 1]; i++) {
+                uint32_t y = targets[i];
+                if (not ov.allows(links[i], x, y))
+                    continue;
+                uint64_t dy = d[x] + weight[i] + ov.penalty_of(links[i]);
+                if (dy < d[y]) {
+                    d[y] = dy;
+                    pred[side][y] = x;
+                    queue[side].emplace(dy, y);
+                }
+                if (other[y] != infinity && dy + other[y] < best) {
+                    best = dy + other[y];
+                    meet_from = side == 0 ? x : y;
+                    meet_to = side == 0 ? y : x;
+                }
+            }
+        }
+        if (best == infinity)
+            return next;
+
+        // from .. meet_from along reversed forward predecessors,
+        // meet_to .. to along backward ones
+        next[meet_from] = meet_to;
+        for (uint32_t v = meet_from; v != from; v = pred[0][v])
+            next[pred[0][v]] = v;
+        for (uint32_t v = meet_to; v != to; v = pred[1][v])
+            next[v] = pred[1][v];
+        return next;
+    }
+};
+
+using CsrGraphPtr = std::shared_ptr<const CsrGraph>;
+
+// Immutable all-pairs hop distance matrix.
+// Readers take the current snapshot with std::atomic_load and never
+// block; writers (under graph_mutex) publish an updated copy.
+struct HopMatrix {
+    static constexpr uint8_t unreachable = 0xff;
+
+    size_t n {0};
+    std::vector<uint8_t> dist; // n * n, row-major
+    std::unordered_map<uint64_t, vertex_descriptor> index;
+
+    uint8_t& at(size_t a, size_t b) { return dist[a * n + b]; }
+    uint8_t at(size_t a, size_t b) const { return dist[a * n + b]; }
+
+    uint8_t hops(uint64_t from, uint64_t to) const {
+        auto a = index.find(from);
+        auto b = index.find(to);
+        if (a == index.end() || b == index.end() ||
+                a->second >= n || b->second >= n)
+            return unreachable;
+        return at(a->second, b->second);
+    }
+
+    // copy of `other` resized to n vertices, new vertices are isolated
+    HopMatrix(const HopMatrix& other, size_t size)
+        : n(std::max(size, other.n)), dist(n * n, unreachable)
+    {
+        for (size_t a = 0; a < other.n; a++) {
+            std::copy(other.dist.begin() + a * other.n,
+                      other.dist.begin() + (a + 1) * other.n,
+                      dist.begin() + a * n);
+        }
+        for (size_t a = 0; a < n; a++)
+            at(a, a) = 0;
+    }
+    HopMatrix() = default;
+
+    void bfs(vertex_descriptor src, const TopologyGraph& g) {
+        std::fill(dist.begin() + src * n, dist.begin() + (src + 1) * n, unreachable);
+        std::deque<vertex_descriptor> queue {src};
+        at(src, src) = 0;
+        while (not queue.empty()) {
+            auto x = queue.front();
+            queue.pop_front();
+            uint8_t next = at(src, x) + 1;
+            if (next == unreachable)
+                continue; // saturated
+
+            auto edges = out_edges(x, g);
+            for (auto it = edges.first; it != edges.second; ++it) {
+                auto y = target(*it, g);
+                if (at(src, y) == unreachable) {
+                    at(src, y) = next;
+                    queue.push_back(y);
+                }
+            }
+        }
+    }
+};
+
+using HopMatrixPtr = std::shared_ptr<const HopMatrix>;
+
+} // namespace runos
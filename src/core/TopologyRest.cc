@@ -23,6 +23,8 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
+#include <algorithm>
+#include <iterator>
 #include <sstream>
 
 namespace runos {
@@ -44,6 +46,10 @@ struct TopologyDump : rest::resource {
     explicit TopologyDump(Topology* app)
         : app(app) {}
 
+    uint64_t Generation() const override {
+        return app->generation();
+    }
+
     rest::ptree Get() const override {
         rest::ptree ret;
 
@@ -80,6 +86,58 @@ struct RouteCollection : rest::resource {
         : app(app), id(0), service(service)
     { }
 
+    uint64_t Generation() const override {
+        return app->generation();
+    }
+
+    void Stream(json_writer& out) const override {
+        Page(out, {});
+    }
+
+    // Service listings go by route id, the cursor is the last one written
+    void Page(json_writer& out, const rest::page& page) const override {
+        if (id > 0 || service == "none") {
+            out.value(Get());
+            return;
+        }
+
+        uint32_t after = 0;
+        if (not page.cursor.empty()) {
+            try {
+                after = boost::lexical_cast<uint32_t>(page.cursor);
+            } catch (const boost::bad_lexical_cast&) {
+                THROW(rest::http_error(400), "Bad cursor: {}", page.cursor);
+            }
+        }
+
+        auto ids = routes();
+        std::sort(ids.begin(), ids.end());
+        auto it = std::upper_bound(ids.begin(), ids.end(), after);
+
+        size_t size = 0;
+        out.begin_object().key("array").begin_array();
+        for (; it != ids.end(); ++it) {
+            if (page.limit && size == page.limit)
+                break;
+            rest::ptree pt;
+            std::istringstream is(app->getRouteDump(*it));
+            read_json(is, pt);
+            out.value(pt);
+            ++size;
+        }
+        out.end_array().put("_size", size);
+        if (it != ids.end())
+            out.put("next", *std::prev(it));
+        out.end_object();
+    }
+
+    std::vector<uint32_t> routes() const {
+        if (service == "all")
+            return app->getRoutes();
+        auto sf = ServiceFlag::_from_string(service.c_str());
+        return app->getRoutes(sf);
+    }
+
     rest::ptree Get() const override {
         rest::ptree ret;
 
@@ -199,6 +257,9 @@ struct RouteResourceMods : rest::resource {
                     "Incorrect drop-threshold: {}", *util);
             sel.set(util_trigger, static_cast<uint8_t>(*util));
         }
+        if (auto bw = pt.get_optional<uint64_t>("bandwidth")) {
+            sel.set(bandwidth, *bw);
+        }
 
         MetricsFlag metr {MetricsFlag::Hop};
         try {
@@ -269,6 +330,48 @@ struct RouteResourceMods : rest::resource {
     }
 };
 
+// Route parameters of a POST body, false if some are missing
+static bool parseRouteRequest(rest::ptree const& pt, Topology::RouteRequest& req)
+{
+    rest::ptree::const_assoc_iterator it;
+
+    auto owner { ServiceFlag::None };
+    auto metrics { MetricsFlag::None };
+    bool fail = false;
+
+    it = pt.find("owner");
+    if (it != pt.not_found())
+        owner = ServiceFlag::_from_string(it->second.get_value<std::string>().c_str());
+    else
+        fail = true;
+    it = pt.find("metrics");
+    if (it != pt.not_found())
+        metrics = MetricsFlag::_from_string(it->second.get_value<std::string>().c_str());
+    else
+        fail = true;
+    it = pt.find("from");
+    if (it != pt.not_found())
+        req.from = it->second.get_value<uint64_t>();
+    else
+        fail = true;
+    it = pt.find("to");
+    if (it != pt.not_found())
+        req.to = it->second.get_value<uint64_t>();
+    else
+        fail = true;
+    // equal-cost paths used together, see RouteGroups
+    bool ecmp = pt.get<bool>("ecmp", false);
+    //TODO: include, exclude, exact
+
+    req.selector = RouteSelector { route_selector::app=owner,
+                                   route_selector::metrics=metrics,
+                                   route_selector::ecmp=ecmp };
+    // bytes/s, see route_selector::bandwidth
+    if (auto bw = pt.get_optional<uint64_t>("bandwidth"))
+        req.selector.set(route_selector::bandwidth, *bw);
+    return not fail;
+}
+
 struct RouteResource : rest::resource {
     Topology* app;
 
@@ -281,51 +384,68 @@ struct RouteResource : rest::resource {
         return col.Get();
     }
 
+    void Page(json_writer& out, const rest::page& page) const override {
+        RouteCollection col{app, "all"};
+        col.Page(out, page);
+    }
+
     rest::ptree Post(rest::ptree const& pt) override {
         //create route
         rest::ptree ret;
-        rest::ptree::const_assoc_iterator it;
-
-        auto owner { ServiceFlag::None };
-        auto metrics { MetricsFlag::None };
-        uint64_t from, to;
-        bool fail = false;
-
-        it = pt.find("owner");
-        if (it != pt.not_found())
-            owner = ServiceFlag::_from_string(it->second.get_value<std::string>().c_str());
-        else
-            fail = true;
-        it = pt.find("metrics");
-        if (it != pt.not_found())
-            metrics = MetricsFlag::_from_string(it->second.get_value<std::string>().c_str());
-        else
-            fail = true;
-        it = pt.find("from");
-        if (it != pt.not_found())
-            from = it->second.get_value<uint64_t>();
-        else
-            fail = true;
-        it = pt.find("to");
-        if (it != pt.not_found())
-            to = it->second.get_value<uint64_t>();
-        else
-            fail = true;
-        //TODO: include, exclude, exact
-
-        if (fail) {
+        Topology::RouteRequest req;
+
+        if (not parseRouteRequest(pt, req)) {
             ret.put("error", "incorrect parameters");
             return ret;
         }
 
-        uint32_t route_id = app->newRoute(from, to, 
-                                          route_selector::app=owner,
-                                          route_selector::metrics=metrics);
+        uint32_t route_id = app->newRoute(req.from, req.to,
+                                          std::move(req.selector));
         RouteCollection col{app, route_id};
         return col.Get();
     }
 };
 
+// Creates {"routes": [...]} of RouteResource bodies at once, replies
+// with the route ids in the same order, 0 for failed ones
+struct RouteBatchResource : rest::resource {
+    Topology* app;
+
+    explicit RouteBatchResource(Topology* app)
+        : app(app)
+    { }
+
+    rest::ptree Post(rest::ptree const& pt) override {
+        rest::ptree ret;
+        std::vector<Topology::RouteRequest> requests;
+
+        auto routes = pt.get_child_optional("routes");
+        THROW_IF(not routes, rest::http_error(400), "No routes");
+        for (auto& item : *routes) {
+            Topology::RouteRequest req;
+            if (not parseRouteRequest(item.second, req)) {
+                ret.put("error", "incorrect parameters");
+                ret.put("index", requests.size());
+                return ret;
+            }
+            requests.push_back(std::move(req));
+        }
+
+        size_t created = 0;
+        rest::ptree arr;
+        for (auto id : app->newRoutes(std::move(requests))) {
+            rest::ptree item;
+            item.put_value(id);
+            arr.push_back(std::make_pair("", item));
+            created += id != 0;
+        }
+        ret.add_child("array", arr);
+        ret.put("_size", arr.size());
+        ret.put("created", created);
+        return ret;
+    }
+};
+
 class TopologyRest : public Application
 {
     SIMPLE_APPLICATION(TopologyRest, "topology-rest")
@@ -416,6 +536,9 @@ public:
         rest_->mount(path_spec("/routes/"), [=](const path_match& m) {
             return RouteResource { app };
         });
+        rest_->mount(path_spec("/routes/batch/"), [=](const path_match& m) {
+            return RouteBatchResource { app };
+        });
         rest_->mount(path_spec("/dump/topology/"), [=](const path_match& m) {
             return TopologyDump { app };
         });
@@ -0,0 +1,468 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "TopologySimulator.hpp"
+
+#include "Topology.hpp"
+#include "LinkDiscovery.hpp"
+#include "lib/memory_accounting.hpp"
+#include <json.hpp>
+#include <runos/core/logging.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <numeric>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace runos {
+
+REGISTER_APPLICATION(TopologySimulator, {"topology", "link-discovery", ""})
+
+using json = nlohmann::json;
+using clock = std::chrono::steady_clock;
+
+namespace {
+
+struct interrupted {};
+
+// boost ptree writes numbers as strings
+uint64_t number(const json& value)
+{
+    return value.is_string() ? std::stoull(value.get<std::string>())
+                             : value.get<uint64_t>();
+}
+
+// {"links": [{"source_dpid", "source_port", "target_dpid", "target_port",
+//             "speed"}]}, speed in kbps is optional. A saved GET /links/
+// reply, where the list is called "array", is accepted as well.
+TopologySimulator::Network parse_json(std::istream& in, uint64_t speed_kbps)
+{
+    TopologySimulator::Network net;
+    auto root = json::parse(in);
+    const auto& links = root.count("links") ? root.at("links") : root.at("array");
+    for (const auto& link : links) {
+        net.links.push_back({
+            {number(link.at("source_dpid")),
+             uint32_t(number(link.at("source_port")))},
+            {number(link.at("target_dpid")),
+             uint32_t(number(link.at("target_port")))},
+            link.count("speed") ? number(link.at("speed")) : speed_kbps
+        });
+    }
+    return net;
+}
+
+// Output of the mininet `links` command, one link per line:
+//   s1-eth2<->s2-eth3 (OK OK)
+// Switch names carry the dpid as mininet assigns it by default,
+// host links are skipped.
+TopologySimulator::Network parse_mininet(std::istream& in, uint64_t speed_kbps)
+{
+    static const std::regex link_re {
+        R"(^\s*s(\d+)-eth(\d+)<->s(\d+)-eth(\d+)(\s.*)?$)"
+    };
+
+    TopologySimulator::Network net;
+    std::string line;
+    std::smatch m;
+    while (std::getline(in, line)) {
+        if (not std::regex_match(line, m, link_re))
+            continue;
+        net.links.push_back({
+            {std::stoull(m[1]), uint32_t(std::stoul(m[2]))},
+            {std::stoull(m[3]), uint32_t(std::stoul(m[4]))},
+            speed_kbps
+        });
+    }
+    return net;
+}
+
+void collect_switches(TopologySimulator::Network& net)
+{
+    std::unordered_set<uint64_t> seen;
+    for (const auto& link : net.links) {
+        for (auto dpid : {link.source.dpid, link.target.dpid}) {
+            if (seen.insert(dpid).second)
+                net.switches.push_back(dpid);
+        }
+    }
+    std::sort(net.switches.begin(), net.switches.end());
+}
+
+// k-ary fat-tree: (k/2)^2 core switches, k pods of k/2 aggregation
+// and k/2 edge switches
+TopologySimulator::Network fat_tree(const TopologySimulator::Settings& s)
+{
+    TopologySimulator::Network net;
+    uint64_t k = std::max(2u, s.size & ~1u);
+    uint64_t half = k / 2;
+    uint64_t cores = half * half;
+    auto core = [&](uint64_t i) { return s.first_dpid + i; };
+    auto agg = [&](uint64_t pod, uint64_t i) {
+        return s.first_dpid + cores + pod * k + i;
+    };
+    auto edge = [&](uint64_t pod, uint64_t i) {
+        return s.first_dpid + cores + pod * k + half + i;
+    };
+
+    for (uint64_t pod = 0; pod < k; pod++) {
+        for (uint64_t a = 0; a < half; a++) {
+            for (uint64_t c = 0; c < half; c++) {
+                // core port is the pod number, aggregation uplinks follow
+                // the downlinks
+                net.links.push_back({{agg(pod, a), uint32_t(half + c + 1)},
+                                     {core(a * half + c), uint32_t(pod + 1)},
+                                     s.link_speed_kbps});
+            }
+            for (uint64_t e = 0; e < half; e++) {
+                net.links.push_back({{agg(pod, a), uint32_t(e + 1)},
+                                     {edge(pod, e), uint32_t(half + a + 1)},
+                                     s.link_speed_kbps});
+            }
+        }
+    }
+    return net;
+}
+
+// Connected random graph: a random spanning tree plus random links
+// up to the requested average degree
+TopologySimulator::Network random_graph(const TopologySimulator::Settings& s)
+{
+    TopologySimulator::Network net;
+    uint64_t n = std::max(2u, s.size);
+    std::mt19937_64 rng(s.seed);
+    std::vector<uint32_t> next_port(n, 1);
+
+    auto link = [&](uint64_t u, uint64_t v) {
+        net.links.push_back({{s.first_dpid + u, next_port[u]++},
+                             {s.first_dpid + v, next_port[v]++},
+                             s.link_speed_kbps});
+    };
+
+    for (uint64_t v = 1; v < n; v++)
+        link(std::uniform_int_distribution<uint64_t>(0, v - 1)(rng), v);
+
+    std::uniform_int_distribution<uint64_t> pick(0, n - 1);
+    uint64_t total = n * std::max(2u, s.degree) / 2;
+    while (net.links.size() < total) {
+        auto u = pick(rng), v = pick(rng);
+        if (u != v)
+            link(u, v);
+    }
+    return net;
+}
+
+// first `share` of the indices [0, n), shuffled
+std::vector<size_t> sample(size_t n, double share, std::mt19937_64& rng)
+{
+    std::vector<size_t> ret(n);
+    std::iota(ret.begin(), ret.end(), 0);
+    std::shuffle(ret.begin(), ret.end(), rng);
+    ret.resize(std::min(n, size_t(std::max(0.0, share) * n + 0.5)));
+    return ret;
+}
+
+} // namespace
+
+TopologySimulator::~TopologySimulator()
+{
+    stop_ = true;
+    if (worker_.joinable())
+        worker_.join();
+}
+
+void TopologySimulator::init(Loader* loader, const Config& root_config)
+{
+    topology_ = Topology::get(loader);
+    link_discovery_ = dynamic_cast<LinkDiscovery*>(ILinkDiscovery::get(loader));
+    CHECK(link_discovery_) << "topology-simulator needs the built-in link-discovery";
+    executor_.reset(new qt_executor(topology_));
+
+    const Config& config = config_cd(root_config, "topology-simulator");
+    settings_.graph = config_get(config, "graph", "");
+    settings_.generate = config_get(config, "generate", "fat-tree");
+    CHECK(settings_.generate == "fat-tree" or settings_.generate == "random")
+        << "Unknown topology-simulator.generate: " << settings_.generate;
+    settings_.size = config_get(config, "size", 16);
+    settings_.degree = config_get(config, "degree", 4);
+    settings_.seed = config_get(config, "seed", 1);
+    settings_.link_speed_kbps = config_get(config, "link-speed-kbps", 10000000.0);
+    settings_.routes = config_get(config, "routes", 1000);
+    settings_.storms = config_get(config, "storms", 5);
+    settings_.storm_share = config_get(config, "storm-share", 0.05);
+    settings_.overload_share = config_get(config, "overload-share", 0.01);
+    settings_.util_threshold = config_get(config, "util-threshold", 80);
+    settings_.timeout = milliseconds(config_get(config, "timeout-ms", 60000));
+    settings_.autostart = config_get(config, "autostart", false);
+
+    // emitted on the Topology thread while it handles our events
+    connect(topology_, &Topology::routeTriggerActive, this,
+            [this] { triggers_active_++; }, Qt::DirectConnection);
+    connect(topology_, &Topology::routeTriggerInactive, this,
+            [this] { triggers_inactive_++; }, Qt::DirectConnection);
+}
+
+void TopologySimulator::startUp(Loader*)
+{
+    if (settings_.autostart)
+        start();
+}
+
+bool TopologySimulator::start()
+{
+    std::lock_guard<std::mutex> lock(report_mutex_);
+    if (report_.state == State::running)
+        return false;
+    if (worker_.joinable())
+        worker_.join(); // previous run is over
+
+    report_ = Report{};
+    report_.state = State::running;
+    worker_ = std::thread([this] { run(); });
+    return true;
+}
+
+auto TopologySimulator::report() const -> Report
+{
+    std::lock_guard<std::mutex> lock(report_mutex_);
+    return report_;
+}
+
+auto TopologySimulator::load(const std::string& path, uint64_t speed_kbps)
+    -> Network
+{
+    std::ifstream in(path);
+    if (not in)
+        throw std::runtime_error("Can't open " + path);
+
+    // JSON starts with a brace, anything else is taken for mininet
+    char first = 0;
+    while (in.get(first) && std::isspace(static_cast<unsigned char>(first)))
+        ;
+    in.clear();
+    in.seekg(0);
+
+    Network net;
+    try {
+        net = first == '{' ? parse_json(in, speed_kbps)
+                           : parse_mininet(in, speed_kbps);
+    } catch (const std::exception& e) {
+        throw std::runtime_error(path + ": " + e.what());
+    }
+    if (net.links.empty())
+        throw std::runtime_error(path + ": no switch links found");
+
+    collect_switches(net);
+    return net;
+}
+
+auto TopologySimulator::generate(const Settings& settings) -> Network
+{
+    auto net = settings.generate == "random" ? random_graph(settings)
+                                             : fat_tree(settings);
+    collect_switches(net);
+    return net;
+}
+
+auto TopologySimulator::settle(clock::time_point since) -> microseconds
+{
+    // queued after every signal sent to Topology so far
+    auto done = async(*executor_, [] { });
+    auto timeout = boost::chrono::milliseconds(settings_.timeout.count());
+    if (done.wait_for(timeout) != boost::future_status::ready)
+        throw std::runtime_error("Topology didn't settle in time");
+    return std::chrono::duration_cast<microseconds>(clock::now() - since);
+}
+
+auto TopologySimulator::recompute(const std::vector<uint32_t>& routes)
+    -> microseconds
+{
+    auto since = clock::now();
+    async(*executor_, [this, &routes] {
+        for (auto id : routes)
+            topology_->predictPath(id);
+    }).get();
+    return std::chrono::duration_cast<microseconds>(clock::now() - since);
+}
+
+void TopologySimulator::record(Phase phase)
+{
+    LOG(INFO) << "[TopologySimulator] " << phase.name << ": "
+              << phase.events << " events, converged in "
+              << phase.converged.count() / 1000.0 << " ms, "
+              << phase.triggers_active << "/" << phase.triggers_inactive
+              << " triggers (in)active, rss " << phase.rss_kb << " kB";
+
+    std::lock_guard<std::mutex> lock(report_mutex_);
+    report_.rss_peak_kb = memory::process_status_kb("VmHWM:");
+    report_.phases.push_back(std::move(phase));
+}
+
+void TopologySimulator::run()
+{
+    std::mt19937_64 rng(settings_.seed);
+    Network net;
+    std::vector<uint32_t> routes;
+    auto ports = std::make_shared<Topology::SyntheticPorts>();
+    size_t injected = 0;
+
+    auto phase = [&](std::string name, size_t events, auto&& apply,
+                     bool with_routes) {
+        if (stop_)
+            throw interrupted{};
+        uint64_t active = triggers_active_;
+        uint64_t inactive = triggers_inactive_;
+        auto since = clock::now();
+        apply();
+
+        Phase p {std::move(name), events, settle(since), {}};
+        p.triggers_active = triggers_active_ - active;
+        p.triggers_inactive = triggers_inactive_ - inactive;
+        if (with_routes and not routes.empty())
+            p.recompute = recompute(routes);
+        p.rss_kb = memory::process_status_kb();
+        record(std::move(p));
+    };
+
+    auto inject = [&](const std::vector<size_t>& which) {
+        for (auto i : which)
+            link_discovery_->injectLink(net.links[i].source, net.links[i].target);
+    };
+    auto withdraw = [&](const std::vector<size_t>& which) {
+        for (auto i : which)
+            link_discovery_->withdrawLink(net.links[i].source, net.links[i].target);
+    };
+
+    State result = State::done;
+    std::string error;
+    try {
+        net = settings_.graph.empty()
+            ? generate(settings_)
+            : load(settings_.graph, settings_.link_speed_kbps);
+
+        {
+            std::lock_guard<std::mutex> lock(report_mutex_);
+            report_.source = settings_.graph.empty()
+                           ? settings_.generate + ":" + std::to_string(settings_.size)
+                           : settings_.graph;
+            report_.switches = net.switches.size();
+            report_.links = net.links.size();
+            report_.rss_before_kb = memory::process_status_kb();
+        }
+        LOG(INFO) << "[TopologySimulator] Simulating " << net.switches.size()
+                  << " switches and " << net.links.size() << " links";
+
+        for (const auto& link : net.links) {
+            ports->emplace(link.source, Topology::SyntheticPort{link.speed_kbps});
+            ports->emplace(link.target, Topology::SyntheticPort{link.speed_kbps});
+        }
+        topology_->setSyntheticPorts(ports);
+
+        std::vector<size_t> all(net.links.size());
+        std::iota(all.begin(), all.end(), 0);
+        injected = all.size();
+        phase("links-up", all.size(), [&] { inject(all); }, false);
+
+        phase("routes", settings_.routes, [&] {
+            using namespace route_selector;
+            std::uniform_int_distribution<size_t> pick(0, net.switches.size() - 1);
+            async(*executor_, [&] {
+                for (unsigned i = 0; i < settings_.routes; i++) {
+                    auto from = net.switches[pick(rng)];
+                    auto to = net.switches[pick(rng)];
+                    if (from == to)
+                        continue;
+                    auto id = topology_->newRoute(from, to,
+                        broken_trigger = true,
+                        util_trigger = uint8_t(settings_.util_threshold));
+                    if (id == 0)
+                        continue;
+                    topology_->addDynamic(id, RouteSelector{
+                        metrics = +MetricsFlag::Hop
+                    });
+                    routes.push_back(id);
+                }
+            }).get();
+        }, true);
+        {
+            std::lock_guard<std::mutex> lock(report_mutex_);
+            report_.routes = routes.size();
+        }
+
+        for (unsigned storm = 1; storm <= settings_.storms; storm++) {
+            auto broken = sample(net.links.size(), settings_.storm_share, rng);
+            auto name = "storm-" + std::to_string(storm);
+            phase(name + "-down", broken.size(), [&] { withdraw(broken); }, true);
+            phase(name + "-up", broken.size(), [&] { inject(broken); }, true);
+        }
+
+        // ports loaded above the threshold, then back to idle
+        std::vector<switch_and_port> all_ports;
+        for (const auto& it : *ports)
+            all_ports.push_back(it.first);
+        auto overloaded = sample(all_ports.size(), settings_.overload_share, rng);
+        auto load_ports = [&](bool loaded) {
+            auto next = std::make_shared<Topology::SyntheticPorts>(*ports);
+            for (auto i : overloaded) {
+                auto& port = next->at(all_ports[i]);
+                port.tx_bytes = loaded ? port.speed_kbps * 125 : 0;
+            }
+            ports = next;
+            topology_->setSyntheticPorts(ports);
+            QMetaObject::invokeMethod(topology_, "reloadStats",
+                                      Qt::QueuedConnection);
+        };
+        phase("overload", overloaded.size(), [&] { load_ports(true); }, false);
+        phase("overload-clear", overloaded.size(), [&] { load_ports(false); }, false);
+    } catch (const interrupted&) {
+        result = State::failed;
+        error = "interrupted";
+    } catch (const std::exception& e) {
+        result = State::failed;
+        error = e.what();
+        LOG(ERROR) << "[TopologySimulator] Run failed - " << error;
+    }
+
+    // leave Topology as it was, except for route ids consumed
+    try {
+        if (not routes.empty()) {
+            async(*executor_, [this, &routes] {
+                for (auto id : routes)
+                    topology_->deleteRoute(id);
+            }).get();
+        }
+        if (injected > 0) {
+            for (const auto& link : net.links)
+                link_discovery_->withdrawLink(link.source, link.target);
+            settle(clock::now());
+        }
+    } catch (const std::exception& e) {
+        LOG(ERROR) << "[TopologySimulator] Cleanup failed - " << e.what();
+    }
+    topology_->setSyntheticPorts(nullptr);
+
+    std::lock_guard<std::mutex> lock(report_mutex_);
+    report_.state = result;
+    report_.error = error;
+}
+
+} // namespace runos
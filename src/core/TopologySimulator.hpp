@@ -0,0 +1,148 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "lib/qt_executor.hpp"
+#include "lib/switch_and_port.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace runos {
+
+class LinkDiscovery;
+class Topology;
+
+/**
+ * Drives Topology and LinkDiscovery from a synthetic network, so they
+ * can be scale tested without switches.
+ *
+ * The network is read from a JSON graph file or a mininet `links` dump,
+ * or generated (fat-tree, random). Links are injected into LinkDiscovery
+ * as if LLDP found them and their ports get synthetic speed and load in
+ * Topology. A run sets up routes watching broken and overloaded links,
+ * then replays failure storms: a share of links goes down at once and
+ * comes back. For every phase it records how long Topology took to
+ * absorb it, how many route triggers fired and the resident memory.
+ *
+ * Nothing is injected until a run is started (autostart or REST), and
+ * the synthetic links and routes are removed when it ends.
+ */
+class TopologySimulator final : public Application {
+    Q_OBJECT
+    SIMPLE_APPLICATION(TopologySimulator, "topology-simulator")
+
+public:
+    using milliseconds = std::chrono::milliseconds;
+    using microseconds = std::chrono::microseconds;
+
+    struct Link {
+        switch_and_port source;
+        switch_and_port target;
+        uint64_t speed_kbps;
+    };
+
+    struct Network {
+        std::vector<uint64_t> switches;
+        std::vector<Link> links;
+    };
+
+    struct Settings {
+        std::string graph; // file to load, empty to generate
+        std::string generate {"fat-tree"}; // fat-tree or random
+        unsigned size {16}; // k for fat-tree, switch count for random
+        unsigned degree {4}; // average degree of random graphs
+        unsigned seed {1};
+        uint64_t first_dpid {uint64_t(1) << 40}; // away from real switches
+        uint64_t link_speed_kbps {10000000};
+        unsigned routes {1000};
+        unsigned storms {5};
+        double storm_share {0.05}; // of links broken by one storm
+        double overload_share {0.01}; // of ports loaded over the threshold
+        unsigned util_threshold {80}; // percent
+        milliseconds timeout {60000}; // per phase
+        bool autostart {false};
+    };
+
+    struct Phase {
+        std::string name;
+        size_t events; // links or ports changed, routes created
+        microseconds converged; // until Topology processed all events
+        microseconds recompute; // dynamic path of every route
+        uint64_t triggers_active;
+        uint64_t triggers_inactive;
+        int64_t rss_kb;
+    };
+
+    enum class State { idle, running, done, failed };
+
+    struct Report {
+        State state {State::idle};
+        std::string error;
+        std::string source;
+        size_t switches {0};
+        size_t links {0};
+        size_t routes {0};
+        int64_t rss_before_kb {0};
+        int64_t rss_peak_kb {0};
+        std::vector<Phase> phases;
+    };
+
+    ~TopologySimulator();
+
+    void init(Loader* loader, const Config& root_config) override;
+    void startUp(Loader* loader) override;
+
+    // Starts a run in the background, false if one is in progress
+    bool start();
+    Report report() const;
+
+    // Throws std::runtime_error on unreadable or malformed input
+    static Network load(const std::string& path, uint64_t speed_kbps);
+    static Network generate(const Settings& settings);
+
+private:
+    Settings settings_;
+    Topology* topology_;
+    LinkDiscovery* link_discovery_;
+    std::unique_ptr<qt_executor> executor_; // runs on the Topology thread
+
+    std::thread worker_;
+    std::atomic_bool stop_ {false};
+    std::atomic<uint64_t> triggers_active_ {0};
+    std::atomic<uint64_t> triggers_inactive_ {0};
+
+    mutable std::mutex report_mutex_;
+    Report report_;
+
+    void run();
+    // Waits until Topology handled everything sent to it so far
+    microseconds settle(std::chrono::steady_clock::time_point since);
+    microseconds recompute(const std::vector<uint32_t>& routes);
+    void record(Phase phase);
+};
+
+} // namespace runos
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Application.hpp"
+#include "Loader.hpp"
+#include "RestListener.hpp"
+#include "TopologySimulator.hpp"
+
+namespace runos {
+
+struct SimulatorReportResource : rest::resource {
+    TopologySimulator* app;
+
+    explicit SimulatorReportResource(TopologySimulator* app)
+        : app(app)
+    { }
+
+    rest::ptree Get() const override
+    {
+        auto report = app->report();
+
+        auto state_name = [](TopologySimulator::State s) {
+            switch (s) {
+            case TopologySimulator::State::running: return "running";
+            case TopologySimulator::State::done: return "done";
+            case TopologySimulator::State::failed: return "failed";
+            default: return "idle";
+            }
+        };
+
+        rest::ptree root;
+        root.put("state", state_name(report.state));
+        root.put("error", report.error);
+        root.put("source", report.source);
+        root.put("switches", report.switches);
+        root.put("links", report.links);
+        root.put("routes", report.routes);
+        root.put("rss_before_kb", report.rss_before_kb);
+        root.put("rss_peak_kb", report.rss_peak_kb);
+
+        rest::ptree phases;
+        for (const auto& phase : report.phases) {
+            rest::ptree ppt;
+            ppt.put("name", phase.name);
+            ppt.put("events", phase.events);
+            ppt.put("converged_us", phase.converged.count());
+            ppt.put("recompute_us", phase.recompute.count());
+            ppt.put("triggers_active", phase.triggers_active);
+            ppt.put("triggers_inactive", phase.triggers_inactive);
+            ppt.put("rss_kb", phase.rss_kb);
+            phases.push_back(std::make_pair("", std::move(ppt)));
+        }
+        root.add_child("phases", phases);
+        return root;
+    }
+
+    // starts a run with the configured settings
+    rest::ptree Post(const rest::ptree&) override
+    {
+        if (not app->start())
+            THROW(rest::http_error(409), "Simulation is already running");
+        return Get();
+    }
+};
+
+class TopologySimulatorRest : public Application
+{
+    SIMPLE_APPLICATION(TopologySimulatorRest, "topology-simulator-rest")
+public:
+    void init(Loader* loader, const Config&) override
+    {
+        using rest::path_spec;
+        using rest::path_match;
+
+        auto app = TopologySimulator::get(loader);
+        auto rest_ = RestListener::get(loader);
+
+        rest_->mount(path_spec("/topology-simulator/"), [=](const path_match&)
+        {
+            return SimulatorReportResource {app};
+        });
+    }
+};
+
+REGISTER_APPLICATION(TopologySimulatorRest, {"rest-listener", "topology-simulator", ""})
+
+} // namespace runos
@@ -16,12 +16,65 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstddef>
 #include <utility>
 #include <tuple>
 #include <optional>
+#include <vector>
 
 namespace runos {
 
+namespace detail {
+
+// Handler<Message> subobjects of a handler by message type id. They are
+// filled in by Handler constructors, so dispatch is an indexed load and
+// a virtual call instead of cross-casts through the virtual base.
+// Read-only once the handler is constructed.
+template<class Tag>
+class handler_table {
+public:
+    // Dense ids of the message types, per dispatcher
+    template<class Message>
+    static size_t id()
+    {
+        static const size_t ret = next_id();
+        return ret;
+    }
+
+    handler_table() = default;
+    // Copies of a handler register their own subobjects
+    handler_table(const handler_table&) { }
+    handler_table& operator=(const handler_table&) { return *this; }
+
+    template<class Message, class Handler>
+    void add(Handler* handler)
+    {
+        auto i = id<Message>();
+        if (i >= slots_.size())
+            slots_.resize(i + 1, nullptr);
+        slots_[i] = handler;
+    }
+
+    template<class Message, class Handler>
+    Handler* find() const
+    {
+        auto i = id<Message>();
+        return i < slots_.size() ? static_cast<Handler*>(slots_[i]) : nullptr;
+    }
+
+private:
+    static size_t next_id()
+    {
+        static std::atomic<size_t> next {0};
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::vector<void*> slots_;
+};
+
+} // namespace detail
+
 template<class Tag, class BaseMessage, class Return, class... Args>
 struct DoubleDispatcher {
     using tag_type = Tag;
@@ -40,16 +93,27 @@ struct DoubleDispatcher {
         {
             static_assert( std::is_base_of<BaseMessage, Message>::value, "" );
 
-            if (auto self = dynamic_cast< Handler<Message>* >(this)) {
+            if (auto self = handlers_.template find<Message, Handler<Message>>()) {
                 return self->process(msg, std::forward<Args>(args)...);
-            } else if (auto self = dynamic_cast< Handler<BaseMessage>* >(this)) {
+            } else if (auto self = handlers_.template find<BaseMessage,
+                                                           Handler<BaseMessage>>()) {
                 return self->process(msg, std::forward<Args>(args)...);
             }
 
             return std::nullopt;
         }
 
+        template<class Message>
+        bool accepts()
+        {
+            return handlers_.template find<Message, Handler<Message>>() ||
+                   handlers_.template find<BaseMessage, Handler<BaseMessage>>();
+        }
+
         virtual ~HandlerBase() = default;
+
+    protected:
+        detail::handler_table<Tag> handlers_;
     };
 
     template<class Message>
@@ -59,12 +123,18 @@ struct DoubleDispatcher {
         static_assert( std::is_base_of< BaseMessage, Message >::value,
                        "Handler message type must derive from domain base type");
 
+        Handler() { this->handlers_.template add<Message>(this); }
+        Handler(const Handler&) : Handler() { }
+        Handler& operator=(const Handler&) = default;
+
         virtual return_type process(Message&, Args...) = 0;
     };
 
     struct Dispatchable
     {
         virtual result_type dispatch(HandlerBase& hbase, Args... args) = 0;
+        // Whether `dispatch` would reach a process() method of hbase
+        virtual bool accepted_by(HandlerBase& hbase) = 0;
         virtual ~Dispatchable() = default;
     };
 
@@ -77,6 +147,11 @@ struct DoubleDispatcher {
         {
             return hbase.dispatch(*this, args...);
         }
+
+        bool accepted_by(HandlerBase& hbase) override
+        {
+            return hbase.template accepts<Message>();
+        }
     };
 
     template<class Message>
@@ -91,6 +166,11 @@ struct DoubleDispatcher {
         {
             return hbase.dispatch(msg, args...);
         }
+
+        bool accepted_by(HandlerBase& hbase) override
+        {
+            return hbase.template accepts<Message>();
+        }
     private:
         Message& msg;
     };
@@ -116,10 +196,11 @@ struct DoubleDispatcher<Tag, BaseMessage, void, Args...> {
         {
             static_assert( std::is_base_of<BaseMessage, Message>::value, "" );
 
-            if (auto self = dynamic_cast< Handler<Message>* >(this)) {
+            if (auto self = handlers_.template find<Message, Handler<Message>>()) {
                 self->process(msg, std::forward<Args>(args)...);
                 return true;
-            } else if (auto self = dynamic_cast< Handler<BaseMessage>* >(this)) {
+            } else if (auto self = handlers_.template find<BaseMessage,
+                                                           Handler<BaseMessage>>()) {
                 self->process(msg, std::forward<Args>(args)...);
                 return true;
             }
@@ -127,7 +208,17 @@ struct DoubleDispatcher<Tag, BaseMessage, void, Args...> {
             return false;
         }
 
+        template<class Message>
+        bool accepts()
+        {
+            return handlers_.template find<Message, Handler<Message>>() ||
+                   handlers_.template find<BaseMessage, Handler<BaseMessage>>();
+        }
+
         virtual ~HandlerBase() = default;
+
+    protected:
+        detail::handler_table<Tag> handlers_;
     };
 
     template<class Message>
@@ -137,12 +228,18 @@ struct DoubleDispatcher<Tag, BaseMessage, void, Args...> {
         static_assert( std::is_base_of< BaseMessage, Message >::value,
                        "Handler message type must derive from domain base type");
 
+        Handler() { this->handlers_.template add<Message>(this); }
+        Handler(const Handler&) : Handler() { }
+        Handler& operator=(const Handler&) = default;
+
         virtual return_type process(Message&, Args...) = 0;
     };
 
     struct Dispatchable
     {
         virtual result_type dispatch(HandlerBase& hbase, Args... args) = 0;
+        // Whether `dispatch` would reach a process() method of hbase
+        virtual bool accepted_by(HandlerBase& hbase) = 0;
         virtual ~Dispatchable() = default;
     };
 
@@ -155,6 +252,11 @@ struct DoubleDispatcher<Tag, BaseMessage, void, Args...> {
         {
             return hbase.dispatch(static_cast<Message&>(*this), args...);
         }
+
+        bool accepted_by(HandlerBase& hbase) override
+        {
+            return hbase.template accepts<Message>();
+        }
     };
 
     template<class Message>
@@ -169,6 +271,11 @@ struct DoubleDispatcher<Tag, BaseMessage, void, Args...> {
         {
             return hbase.dispatch(msg, args...);
         }
+
+        bool accepted_by(HandlerBase& hbase) override
+        {
+            return hbase.template accepts<Message>();
+        }
     private:
         Message& msg;
     };
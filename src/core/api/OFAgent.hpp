@@ -24,12 +24,20 @@
 
 #include "OFAgentFwd.hpp"
 
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 
 namespace runos {
 
 namespace of13 = fluid_msg::of13;
 
+class FlowModBatch;
+class OFMessageTemplate;
+class table_occupancy;
+
 namespace ofp {
 
 struct aggregate_stats {
@@ -48,6 +56,12 @@ struct flow_stats_request {
     of13::Match match;
 };
 
+// Dump of a whole flow table, shared by its periodic pollers
+struct table_snapshot {
+    std::chrono::steady_clock::time_point taken; // when the reply came
+    std::vector<of13::FlowStats> entries;
+};
+
 struct switch_config {
     uint16_t flags;
     uint16_t miss_send_len;
@@ -58,6 +72,14 @@ struct role_config {
     uint64_t generation_id;
 };
 
+// Reasons of the async messages the switch sends to this controller,
+// a bit per reason; [0] applies in master and equal roles, [1] in slave
+struct async_config {
+    uint32_t packet_in_mask[2] {0, 0};
+    uint32_t port_status_mask[2] {0, 0};
+    uint32_t flow_removed_mask[2] {0, 0};
+};
+
 } // namespace ofp
 
 class OFAgent {
@@ -112,6 +134,29 @@ public:
         using error::error;
     };
 
+    // Some messages of flow_mods() batch were rejected by the switch
+    struct bulk_error : error {
+        struct failure {
+            size_t index; // position in the batch
+            uint32_t xid;
+            uint16_t type;
+            uint16_t code;
+        };
+
+        explicit bulk_error(uint64_t dpid, uint32_t xid,
+                            std::vector<failure> failures) noexcept
+            : error(dpid, xid)
+            , failures_(std::move(failures))
+        {
+            with("failed", failures_.size());
+        }
+
+        const std::vector<failure>& failures() const noexcept
+        { return failures_; }
+    protected:
+        std::vector<failure> failures_;
+    };
+
     // Synchronization
     virtual future< void >
         barrier() = 0;
@@ -121,6 +166,9 @@ public:
         request_config() = 0;
     virtual future< void >
         set_config(ofp::switch_config config) = 0;
+    // Kept by the switch for this connection only
+    virtual future< void >
+        set_async(ofp::async_config config) = 0;
 
     // Switch Description
     virtual future< fluid_msg::SwitchDesc >
@@ -151,8 +199,32 @@ public:
     // Flow stats
     virtual future< sequence<of13::FlowStats> >
         request_flow_stats(ofp::flow_stats_request r) = 0;
+    // Called for every multipart reply segment as it arrives, on the
+    // receive path of the switch connection. Return `false` to drop the
+    // remaining segments. A slow handler delays further replies of this
+    // switch (and so throttles it through TCP), nothing is buffered.
+    using flow_stats_handler =
+        std::function<bool(sequence<of13::FlowStats>&& segment)>;
+    // Future holds the number of entries passed to the handler and is
+    // ready after the last segment has been handled.
+    virtual future< size_t >
+        stream_flow_stats(ofp::flow_stats_request r,
+                          flow_stats_handler handler) = 0;
+    // Reuses a dump of the table taken less than `max_age` ago (or still
+    // in flight), sends a new one otherwise. Pollers of one table thus
+    // cost the switch one dump per tick; pass less than your own period
+    // to never see the same dump twice. Flow mods to the table discard it.
+    virtual future< ofp::table_snapshot >
+        request_table_snapshot(uint8_t table_id,
+                               std::chrono::milliseconds max_age) = 0;
     virtual future< ofp::aggregate_stats >
         request_aggregate(ofp::flow_stats_request r) = 0;
+    // Request packed once for periodic polling, valid for any switch
+    using prepared_request = std::shared_ptr<const OFMessageTemplate>;
+    virtual prepared_request
+        prepare_aggregate(ofp::flow_stats_request r) const = 0;
+    virtual future< ofp::aggregate_stats >
+        request_aggregate(prepared_request const& r) = 0;
 
     // Group desc
     virtual future< sequence<of13::GroupDesc> >
@@ -184,6 +256,31 @@ public:
     // Flow mod
     virtual future < void >
         flow_mod(of13::FlowMod& flow_mod) = 0;
+    // Sends all flow mods in one write followed by a single barrier.
+    // Future is ready when the barrier is replied, and holds bulk_error
+    // if switch has rejected any of them. Send hooks aren't called for
+    // the flow mods themselves.
+    virtual future < void >
+        flow_mods(sequence<of13::FlowMod>& flow_mods) = 0;
+    // Same for flow mods already written to the wire format,
+    // assigns xids to them
+    virtual future < void >
+        flow_mods(FlowModBatch& batch) = 0;
+    // Same for any modification messages (group, meter, flow mods),
+    // sent in the given order
+    virtual future < void >
+        mods(const sequence<fluid_msg::OFMsg*>& msgs) = 0;
+    // Same, but the messages go in one ordered atomic bundle (OpenFlow
+    // 1.4 bundles, ONF extension on 1.3): the switch applies all of them
+    // or none. Switches without bundles get a plain mods() batch, which
+    // is remembered after the first attempt. In bulk_error of a bundle
+    // indexes n and n + 1 stand for its open and commit requests.
+    virtual future < void >
+        bundle(const sequence<fluid_msg::OFMsg*>& msgs) = 0;
+    virtual future < void >
+        bundle(FlowModBatch& batch) = 0;
+    // Known bundle support of the device model, skips the first attempt
+    virtual void set_bundle_support(bool supported) = 0;
     // Group mod
     virtual future < void >
         group_mod(of13::GroupMod& group_mod) = 0;
@@ -191,6 +288,32 @@ public:
     virtual future < void >
         meter_mod(of13::MeterMod& meter_mod) = 0;
 
+    // Flow table occupancy, follows flow mods sent to the switch
+    // through the agent and the connection
+    virtual table_occupancy& occupancy() = 0;
+
+    // Reply times of the switch, per request type
+    struct latency_info {
+        struct request {
+            std::string name;
+            uint64_t replies;
+            std::chrono::nanoseconds recent;   // moving average
+            std::chrono::nanoseconds baseline; // usual reply time
+            std::chrono::nanoseconds p50;
+            std::chrono::nanoseconds p99;
+        };
+        double slowdown;
+        std::vector<request> requests;
+    };
+    virtual latency_info latency() const = 0;
+
+    // How many times slower than usual the switch answers, >= 1.0.
+    // Pollers stretch their interval by it. Cheap, doesn't lock.
+    virtual double slowdown() const = 0;
+
+    // Requests still waiting for their reply
+    virtual size_t pending() const = 0;
+
     virtual ~OFAgent() = default;
 
 #if 0
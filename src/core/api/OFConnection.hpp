@@ -18,16 +18,53 @@
 
 #include <memory>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <chrono>
+#include <vector>
 
 #include <fluid/ofcommon/msg.hh>
 
 #include "DoubleDispatcher.hpp"
 #include "OFAgentFwd.hpp"
+#include "OFMessageView.hpp"
+#include "PacketOutBuilder.hpp"
+#include "../lib/channel_counters.hpp"
+#include "../lib/span.hpp"
+
+namespace fluid_msg { namespace of13 { class PacketIn; } }
 
 namespace runos {
 
+// Message packed once and sent many times, each copy with its own xid.
+// Read-only after construction, may be shared by connections.
+class OFMessageTemplate {
+public:
+    explicit OFMessageTemplate(fluid_msg::OFMsg const& cmsg)
+    {
+        auto& msg = const_cast<fluid_msg::OFMsg&>(cmsg);
+        auto buf = msg.pack();
+        data_.assign(buf, buf + msg.length());
+        fluid_msg::OFMsg::free_buffer(buf);
+    }
+
+    const uint8_t* data() const { return data_.data(); }
+    size_t size() const { return data_.size(); }
+
+    // Writes the message with `xid` to `out` of size() bytes
+    void copy_to(uint8_t* out, uint32_t xid) const
+    {
+        std::memcpy(out, data_.data(), data_.size());
+        out[4] = xid >> 24;
+        out[5] = xid >> 16;
+        out[6] = xid >> 8;
+        out[7] = xid;
+    }
+
+private:
+    std::vector<uint8_t> data_;
+};
+
 class OFConnection {
 protected:
     using message = fluid_msg::OFMsg;
@@ -57,6 +94,22 @@ public:
     using ReceiveHandler = ReceiveDispatch::Handler<Message>;
     using ReceiveHandlerPtr = std::shared_ptr<ReceiveDispatch::HandlerBase>;
 
+    // Gets PacketIn, multipart replies and experimenter messages
+    // before they're unpacked
+    struct ViewHandler {
+        virtual void process(OFMessageView& view) = 0;
+        virtual ~ViewHandler() = default;
+    };
+    using ViewHandlerPtr = std::shared_ptr<ViewHandler>;
+
+    // Optional second base of a receive handler: the PacketIns decoded
+    // from one read of the socket come in one call instead of a
+    // process() call each. Other handlers still get them one by one.
+    struct ReceiveBatchHandler {
+        virtual void process_batch(span<fluid_msg::of13::PacketIn*> batch) = 0;
+        virtual ~ReceiveBatchHandler() = default;
+    };
+
     virtual uint64_t dpid() const = 0;
     virtual bool alive() const = 0;
     virtual uint8_t protocol_version() const = 0;
@@ -70,13 +123,31 @@ public:
     virtual uint64_t get_tx_packets() const = 0;
     virtual uint64_t get_pkt_in_packets() const = 0;
     virtual void packet_in_counter() = 0;
+    // Messages and bytes each way, by type, with their recent rates;
+    // lives as long as the connection
+    virtual const ChannelCounters* counters() const { return nullptr; }
+    // auxiliary_id of the auxiliary connections multiplexed under
+    // this one; they carry PacketIns and multipart traffic
+    virtual std::vector<uint8_t> auxiliary_ids() const { return {}; }
+
+    // Output queued for the switch and not yet written to its socket
+    virtual size_t pending_output() const { return 0; }
+    // False once pending output reaches the high watermark, until it
+    // drains to the low one: bulk senders wait instead of piling it up.
+    // Always true if the transport doesn't report its backlog.
+    virtual bool writable() const { return true; }
 
     virtual void send(message const& msg) = 0;
     virtual void send(void* msg, size_t size) = 0;
+    // Send hooks aren't called for templates
+    virtual void send(OFMessageTemplate const& tmpl, uint32_t xid) = 0;
+    // Header and referenced payload are gathered into one message
+    virtual void send(PacketOutBuilder const& po) = 0;
     virtual void close() = 0;
 
     virtual void send_hook(SendHookHandlerPtr handler) = 0;
     virtual void receive(ReceiveHandlerPtr handler) = 0;
+    virtual void receive_view(ViewHandlerPtr handler) = 0;
 };
 
 typedef std::shared_ptr<OFConnection> OFConnectionPtr;
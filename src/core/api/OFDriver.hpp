@@ -18,6 +18,11 @@
 
 #include "../lib/better_enum.hpp"
 
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+
 namespace runos {
 namespace drivers {
 
@@ -25,6 +30,25 @@ BETTER_ENUM(DriverName, uint8_t, Default);
 
 class DefaultDriver;
 
+/**
+ * Performance profile of a device model, read from the `caps.*`
+ * properties of DeviceDb when the switch connects. Zero means the
+ * model has no known limit and the controller-wide settings apply.
+ */
+struct Capabilities {
+    uint32_t max_flow_mods_per_sec {0}; // caps.max_flow_mods_per_sec
+    // Switch time a barrier costs on top of the messages it covers
+    std::chrono::microseconds barrier_cost {0}; // caps.barrier_cost_us
+    // caps.bundles; unset: probed with the first bundle
+    std::optional<bool> bundles;
+    // Largest flow stats reply the switch produces without stalling
+    uint32_t max_multipart_bytes {0}; // caps.max_multipart_bytes
+    // Shortest stats and verification poll intervals the model tolerates
+    std::chrono::milliseconds stats_interval {0}; // caps.stats_interval_ms
+    std::chrono::milliseconds verify_interval {0}; // caps.verify_interval_ms
+};
+using CapabilitiesPtr = std::shared_ptr<const Capabilities>;
+
 class Handler {
 public:
     virtual void handle(DefaultDriver& driver) const = 0;
@@ -32,7 +56,17 @@ public:
 
 class DefaultDriver {
 public:
+    explicit DefaultDriver(CapabilitiesPtr caps
+                               = std::make_shared<const Capabilities>())
+        : m_caps(std::move(caps))
+    { }
+    virtual ~DefaultDriver() = default;
+
     virtual void apply(const Handler& v) { v.handle(*this); }
+    const CapabilitiesPtr& capabilities() const { return m_caps; }
+
+private:
+    CapabilitiesPtr m_caps;
 };
 
 } // namespace drivers
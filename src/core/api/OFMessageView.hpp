@@ -0,0 +1,91 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <runos/core/exception.hpp>
+#include <runos/core/throw.hpp>
+
+#include <fluid/ofcommon/msg.hh>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace runos {
+
+/**
+ * Non-owning view over a raw OpenFlow message received from the switch.
+ * Valid only while the handler which got it is running: the underlying
+ * buffer is released right after dispatching.
+ *
+ * The message is unpacked on the first call to `message()`, so handlers
+ * interested in header fields only don't pay for deserialization.
+ */
+class OFMessageView {
+public:
+    struct malformed_message : exception_root, runtime_error_tag
+    { };
+
+    // Returns nullptr if the message can't be unpacked
+    using Unpacker = std::function<fluid_msg::OFMsg*()>;
+
+    OFMessageView(uint8_t type, uint16_t mpart,
+                  const uint8_t* data, size_t len,
+                  Unpacker unpack)
+        : type_(type)
+        , mpart_(mpart)
+        , data_(data)
+        , len_(len)
+        , unpack_(std::move(unpack))
+    { }
+
+    uint8_t type() const { return type_; }
+    // 0xffff for non-multipart messages
+    uint16_t multipart_type() const { return mpart_; }
+    const uint8_t* data() const { return data_; }
+    size_t length() const { return len_; }
+
+    uint32_t xid() const
+    {
+        if (len_ < 8) return 0;
+        return (uint32_t(data_[4]) << 24) | (uint32_t(data_[5]) << 16) |
+               (uint32_t(data_[6]) << 8)  |  uint32_t(data_[7]);
+    }
+
+    fluid_msg::OFMsg& message() const
+    {
+        auto ret = unpack_();
+        THROW_IF(ret == nullptr, malformed_message(),
+                 "Malformed message of type {}", unsigned(type_));
+        return *ret;
+    }
+
+    template<class Message>
+    Message& as() const
+    {
+        return dynamic_cast<Message&>(message());
+    }
+
+private:
+    uint8_t type_;
+    uint16_t mpart_;
+    const uint8_t* data_;
+    size_t len_;
+    Unpacker unpack_;
+};
+
+} // namespace runos
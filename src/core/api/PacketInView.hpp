@@ -0,0 +1,107 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace runos {
+
+/**
+ * Non-owning view over a raw OpenFlow 1.3 PacketIn, read straight from
+ * the receive buffer without unpacking. Valid only while the filter
+ * which got it is running.
+ */
+class PacketInView {
+public:
+    PacketInView(const uint8_t* msg, size_t len)
+    {
+        // header, buffer_id, total_len, reason, table_id, cookie
+        if (len < 24 + 4)
+            return;
+        msg_ = msg;
+
+        // match is padded to 8 bytes and followed by 2 pad bytes
+        size_t match_len = load16(msg + 26);
+        size_t match_end = 24 + match_len;
+        size_t data_off = 24 + (match_len + 7) / 8 * 8 + 2;
+        if (match_len < 4 || data_off > len)
+            return;
+
+        for (size_t off = 28; off + 4 <= match_end; ) {
+            uint32_t oxm = load32(msg + off);
+            size_t oxm_len = oxm & 0xff;
+            if (off + 4 + oxm_len > match_end)
+                return;
+            // OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_IN_PORT
+            if ((oxm >> 16) == 0x8000 && ((oxm >> 9) & 0x7f) == 0 &&
+                    oxm_len == 4) {
+                in_port_ = load32(msg + off + 4);
+            }
+            off += 4 + oxm_len;
+        }
+
+        data_ = msg + data_off;
+        data_len_ = len - data_off;
+        valid_ = true;
+
+        if (data_len_ >= 14) {
+            eth_type_ = load16(data_ + 12);
+            if (eth_type_ == 0x8100 && data_len_ >= 18) {
+                vlan_tagged_ = true;
+                eth_type_ = load16(data_ + 16);
+            }
+        }
+    }
+
+    bool valid() const { return valid_; }
+
+    uint32_t buffer_id() const { return load32(msg_ + 8); }
+    uint16_t total_len() const { return load16(msg_ + 12); }
+    uint8_t reason() const { return msg_[14]; }
+    uint8_t table_id() const { return msg_[15]; }
+    uint64_t cookie() const
+    { return uint64_t(load32(msg_ + 16)) << 32 | load32(msg_ + 20); }
+    uint32_t in_port() const { return in_port_; }
+
+    const uint8_t* data() const { return data_; }
+    size_t data_len() const { return data_len_; }
+
+    // Ethertype after at most one 802.1Q tag, 0 for runt frames
+    uint16_t eth_type() const { return eth_type_; }
+    bool vlan_tagged() const { return vlan_tagged_; }
+
+private:
+    const uint8_t* msg_ = nullptr;
+    const uint8_t* data_ = nullptr;
+    size_t data_len_ = 0;
+    uint32_t in_port_ = 0;
+    uint16_t eth_type_ = 0;
+    bool vlan_tagged_ = false;
+    bool valid_ = false;
+
+    static uint16_t load16(const uint8_t* p)
+    { return uint16_t(p[0] << 8 | p[1]); }
+
+    static uint32_t load32(const uint8_t* p)
+    {
+        return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 |
+               uint32_t(p[2]) << 8 | p[3];
+    }
+};
+
+} // namespace runos
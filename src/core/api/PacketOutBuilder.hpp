@@ -0,0 +1,171 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <runos/core/assert.hpp>
+
+#include "PacketInView.hpp"
+
+namespace runos {
+
+/**
+ * OpenFlow 1.3 PacketOut written straight into the send buffer, without
+ * an of13::PacketOut holding its own copy of the payload.
+ *
+ * A packet buffered on the switch is sent by buffer_id with no payload.
+ * Otherwise the payload is only referenced and OFConnection::send()
+ * gathers it into the outgoing message, so it must stay valid until then.
+ */
+class PacketOutBuilder {
+public:
+    static constexpr uint32_t no_buffer = 0xffffffff;  // OFP_NO_BUFFER
+    static constexpr uint32_t controller = 0xfffffffd; // OFPP_CONTROLLER
+    static constexpr uint16_t no_max_len = 0xffff;     // OFPCML_NO_BUFFER
+    // header, buffer_id, in_port, actions_len, pad
+    static constexpr size_t header_size = 24;
+    static constexpr size_t max_actions_size = 128;
+
+    PacketOutBuilder& xid(uint32_t xid) { xid_ = xid; return *this; }
+    PacketOutBuilder& in_port(uint32_t port) { in_port_ = port; return *this; }
+
+    // Packet buffered on the switch, the payload isn't sent
+    PacketOutBuilder& buffer_id(uint32_t id) { buffer_id_ = id; return *this; }
+
+    // Payload of an unbuffered packet
+    PacketOutBuilder& data(const void* data, size_t len)
+    {
+        buffer_id_ = no_buffer;
+        data_ = static_cast<const uint8_t*>(data);
+        data_len_ = len;
+        return *this;
+    }
+
+    // Sends back a PacketIn's packet: from the switch buffer if it kept
+    // one, else its bytes. A buffer holds the packet as it came, so after
+    // PacketParser::modify() use data() with the patched PacketIn bytes.
+    PacketOutBuilder& reply_to(uint32_t buffer_id, uint32_t in_port,
+                               const void* data, size_t len)
+    {
+        in_port_ = in_port;
+        if (buffer_id != no_buffer)
+            return this->buffer_id(buffer_id);
+        return this->data(data, len);
+    }
+
+    PacketOutBuilder& reply_to(const PacketInView& pi)
+    {
+        return reply_to(pi.buffer_id(), pi.in_port(), pi.data(), pi.data_len());
+    }
+
+    // OFPAT_OUTPUT
+    PacketOutBuilder& output(uint32_t port, uint16_t max_len = no_max_len)
+    {
+        uint8_t* a = action(0, 16);
+        store32(a + 4, port);
+        store16(a + 8, max_len);
+        return *this;
+    }
+
+    // OFPAT_SET_QUEUE
+    PacketOutBuilder& set_queue(uint32_t queue_id)
+    {
+        uint8_t* a = action(21, 8);
+        store32(a + 4, queue_id);
+        return *this;
+    }
+
+    // OFPAT_GROUP
+    PacketOutBuilder& group(uint32_t group_id)
+    {
+        uint8_t* a = action(22, 8);
+        store32(a + 4, group_id);
+        return *this;
+    }
+
+    bool buffered() const { return buffer_id_ != no_buffer; }
+    const uint8_t* payload() const { return data_; }
+    size_t payload_len() const { return buffered() ? 0 : data_len_; }
+    size_t header_len() const { return header_size + actions_len_; }
+    size_t size() const { return header_len() + payload_len(); }
+
+    // Writes header and actions, header_len() bytes
+    void write_header(uint8_t* out) const
+    {
+        size_t len = size();
+        CHECK(len <= 0xffff, "PacketOut of {} bytes is too long", len);
+
+        out[0] = 0x04; // OFP_VERSION
+        out[1] = 13;   // OFPT_PACKET_OUT
+        store16(out + 2, len);
+        store32(out + 4, xid_);
+        store32(out + 8, buffer_id_);
+        store32(out + 12, in_port_);
+        store16(out + 16, actions_len_);
+        std::memset(out + 18, 0, 6);
+        std::memcpy(out + header_size, actions_, actions_len_);
+    }
+
+    // Writes the whole message, size() bytes
+    void write_to(uint8_t* out) const
+    {
+        write_header(out);
+        if (payload_len() > 0)
+            std::memcpy(out + header_len(), data_, payload_len());
+    }
+
+private:
+    uint32_t xid_ = 0;
+    uint32_t buffer_id_ = no_buffer;
+    uint32_t in_port_ = controller;
+    const uint8_t* data_ = nullptr;
+    size_t data_len_ = 0;
+
+    uint8_t actions_[max_actions_size];
+    uint16_t actions_len_ = 0;
+
+    uint8_t* action(uint16_t type, uint16_t len)
+    {
+        CHECK(actions_len_ + len <= max_actions_size, "Too many actions");
+        uint8_t* a = actions_ + actions_len_;
+        std::memset(a, 0, len);
+        store16(a, type);
+        store16(a + 2, len);
+        actions_len_ += len;
+        return a;
+    }
+
+    static void store16(uint8_t* p, uint16_t v)
+    {
+        p[0] = v >> 8;
+        p[1] = v;
+    }
+
+    static void store32(uint8_t* p, uint32_t v)
+    {
+        p[0] = v >> 24;
+        p[1] = v >> 16;
+        p[2] = v >> 8;
+        p[3] = v;
+    }
+};
+
+} // namespace runos
@@ -18,6 +18,7 @@
 
 #include "SwitchFwd.hpp"
 #include "Statistics.hpp"
+#include "TimeSeries.hpp"
 #include "../lib/mod_trait.hpp"
 #include "../lib/ethaddr.hpp"
 #include "../lib/better_enum.hpp"
@@ -77,6 +78,13 @@ public:
     // Traffic stats
     virtual Statistics<TrafficMeasurement> traffic_stats(ForwardingType type) const = 0;
 
+    // Speed history, `f` reads the samples in place under the
+    // statistics lock: keep it short
+    virtual void stats_history(TimeSeries::resolution r,
+                               const TimeSeries::visitor& f) const = 0;
+    virtual void queue_stats_history(uint32_t qid, TimeSeries::resolution r,
+                                     const TimeSeries::visitor& f) const = 0;
+
     // Description
     virtual unsigned number() const = 0;
     virtual const ethaddr& hw_addr() const = 0;
@@ -100,8 +108,14 @@ public:
     virtual bool link_down() const = 0;
     virtual bool blocked() const = 0;
     virtual bool live() const = 0;
+    // OFPPS_LIVE is reported and its clearing is taken as a link down
+    virtual bool watched() const = 0;
     virtual bool maintenance() const = 0; // getter
     virtual void set_maintenance(bool b) = 0; // setter
+    // End of an inter-switch link: its stats are polled every time,
+    // other ports in the slow tier (see SwitchImpl::updateStats)
+    virtual bool core() const = 0; // getter
+    virtual void set_core(bool b) = 0; // setter
 
 signals:
     void configChanged(PortPtr);
@@ -110,6 +124,8 @@ signals:
     void linkDown(PortPtr);
     void maintenanceStart(PortPtr);
     void maintenanceEnd(PortPtr);
+    // after every port stats reply, `stats()` has the new speed
+    void statsUpdated(PortPtr);
 };
 
 template<class Trait>
@@ -45,6 +45,14 @@ template<class T>
 struct PortMeasurement : std::array<T, 8> {
     using std::array<T, 8>::array;
 
+    // Field indexes, as columns of port_stats_table
+    enum field : size_t {
+        rx_packets_field, tx_packets_field,
+        rx_bytes_field, tx_bytes_field,
+        rx_dropped_field, tx_dropped_field,
+        rx_errors_field, tx_errors_field
+    };
+
     T& rx_packets() { return (*this)[0]; }
     const T& rx_packets() const { return (*this)[0]; }
     T& tx_packets() { return (*this)[1]; }
@@ -18,6 +18,7 @@
 
 #include "../lib/ethaddr.hpp"
 #include "../lib/mod_trait.hpp"
+#include "../lib/port_stats_table.hpp"
 
 #include "SwitchFwd.hpp"
 #include "Port.hpp"
@@ -25,6 +26,7 @@
 #include "OFDriver.hpp"
 
 #include <runos/core/exception.hpp>
+#include <runos/DeviceDb.hpp>
 
 #include <QtCore>
 
@@ -33,6 +35,7 @@
 #include <vector>
 #include <cstdint>
 #include <string_view>
+#include <type_traits>
 
 namespace runos {
 
@@ -80,6 +83,23 @@ public:
     virtual bool     property(std::string_view name, bool def_val) const = 0;
     virtual std::string property(std::string_view name, std::string def_val) const = 0;
 
+    // Lookup by interned name, nullptr if the property isn't set
+    virtual devicedb::Value const* property(devicedb::PropertyKey key) const = 0;
+
+    template<class T>
+    T property(devicedb::PropertyKey key, T def_val) const
+    {
+        auto value = property(key);
+        if (not value)
+            return def_val;
+        if constexpr (std::is_same<T, bool>::value)
+            return std::get<bool>(*value);
+        else if constexpr (std::is_integral<T>::value || std::is_enum<T>::value)
+            return static_cast<T>(std::get<int64_t>(*value));
+        else
+            return T(std::get<std::string_view>(*value));
+    }
+
     // == Description ==
     virtual const std::string& manufacturer() const = 0;
     virtual const std::string& hardware() const = 0;
@@ -104,6 +124,12 @@ public:
     virtual safe::shared_ptr<Port> port(const ethaddr& hw_addr) const = 0;
     // TODO: Make observable [prio: high]
     virtual std::vector<PortPtr> ports() const = 0;
+    // Immutable list sorted by port number, replaced as a whole when
+    // ports are added or deleted. Cheap to take, prefer it over ports().
+    using PortList = std::vector<PortPtr>;
+    virtual std::shared_ptr<const PortList> ports_snapshot() const = 0;
+    // Counters and speeds of all ports, PortMeasurement fields as columns
+    virtual std::shared_ptr<const port_stats_table> port_stats() const = 0;
 
     // == Tables ==
     struct Tables {
@@ -121,6 +147,8 @@ public:
 
     // == Specific handling for different OF pipelines (drivers) ==
     virtual void handle(const drivers::Handler& h) const = 0;
+    // Profile of the device model, defaults until the switch is up
+    virtual drivers::CapabilitiesPtr capabilities() const = 0;
 
 signals:
     void portAdded(PortPtr);
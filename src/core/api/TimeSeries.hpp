@@ -0,0 +1,166 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Fixed-memory history of measurement speeds.
+ *
+ * Every resolution keeps the last `capacity` samples in a columnar ring
+ * buffer: one column of timestamps and one column per measurement field.
+ * Samples are averaged into 1s, 10s and 1m windows incrementally on
+ * append(), nothing is recomputed on read.
+ */
+class TimeSeries {
+public:
+    enum resolution { second, ten_seconds, minute, resolution_count };
+
+    static constexpr size_t default_capacity = 120;
+
+    // Read-only view of one resolution, index 0 is the oldest sample
+    class Series {
+    public:
+        Series(size_t fields, size_t capacity)
+            : fields_(fields)
+            , capacity_(capacity)
+            , time_(capacity)
+            , values_(fields * capacity)
+        { }
+
+        size_t size() const { return size_; }
+        size_t fields() const { return fields_; }
+        bool empty() const { return size_ == 0; }
+
+        double time(size_t i) const { return time_[slot(i)]; }
+        float value(size_t field, size_t i) const
+        { return values_[field * capacity_ + slot(i)]; }
+
+        // first sample with time >= t
+        size_t lower_bound(double t) const
+        {
+            size_t lo = 0, hi = size_;
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (time(mid) < t) lo = mid + 1; else hi = mid;
+            }
+            return lo;
+        }
+
+        void push(double t, const double* values)
+        {
+            size_t pos = (first_ + size_) % capacity_;
+            if (size_ == capacity_)
+                first_ = (first_ + 1) % capacity_;
+            else
+                ++size_;
+
+            time_[pos] = t;
+            for (size_t f = 0; f < fields_; ++f)
+                values_[f * capacity_ + pos] = static_cast<float>(values[f]);
+        }
+
+        void clear() { first_ = size_ = 0; }
+
+    private:
+        size_t fields_;
+        size_t capacity_;
+        size_t first_ {0};
+        size_t size_ {0};
+        std::vector<double> time_;
+        std::vector<float> values_; // column-major: field * capacity + slot
+
+        size_t slot(size_t i) const { return (first_ + i) % capacity_; }
+    };
+
+    using visitor = std::function<void(const Series&)>;
+
+    explicit TimeSeries(size_t fields, size_t capacity = default_capacity)
+        : series_{{ Series(fields, capacity),
+                    Series(fields, capacity),
+                    Series(fields, capacity) }}
+    {
+        for (auto& w : windows_)
+            w.sum.assign(fields, 0.0);
+    }
+
+    const Series& at(resolution r) const { return series_[r]; }
+
+    // `values` holds one speed per field
+    void append(double t, const double* values)
+    {
+        if (not series_[second].empty() && t < last_time_)
+            clear(); // time went backwards, counters were reset
+
+        last_time_ = t;
+        for (size_t r = 0; r < resolution_count; ++r) {
+            auto& w = windows_[r];
+            long index = static_cast<long>(t / period(r));
+            if (w.count > 0 && index != w.index)
+                flush(r);
+            w.index = index;
+            for (size_t f = 0; f < w.sum.size(); ++f)
+                w.sum[f] += values[f];
+            ++w.count;
+        }
+    }
+
+    void clear()
+    {
+        for (size_t r = 0; r < resolution_count; ++r) {
+            series_[r].clear();
+            windows_[r].count = 0;
+            std::fill(windows_[r].sum.begin(), windows_[r].sum.end(), 0.0);
+        }
+    }
+
+    static double period(size_t r)
+    {
+        static constexpr double periods[resolution_count] = {1.0, 10.0, 60.0};
+        return periods[r];
+    }
+
+private:
+    struct window {
+        long index {0};
+        size_t count {0};
+        std::vector<double> sum;
+    };
+
+    std::array<Series, resolution_count> series_;
+    std::array<window, resolution_count> windows_;
+    double last_time_ {0.0};
+
+    // closes the window: sample is stamped with the window end
+    void flush(size_t r)
+    {
+        auto& w = windows_[r];
+        for (auto& s : w.sum)
+            s /= w.count;
+        series_[r].push((w.index + 1) * period(r), w.sum.data());
+        std::fill(w.sum.begin(), w.sum.end(), 0.0);
+        w.count = 0;
+    }
+};
+
+} // namespace runos
@@ -0,0 +1,225 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <runos/core/async_logging.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace runos {
+namespace async_log {
+
+namespace {
+
+constexpr size_t ring_slots = 256;
+constexpr auto flush_interval = std::chrono::milliseconds(20);
+
+// Single producer (the owning thread), single consumer (the flusher)
+struct Ring {
+    Record slots[ring_slots];
+    alignas(64) std::atomic<size_t> head {0};
+    alignas(64) std::atomic<size_t> tail {0};
+    std::atomic<bool> orphaned {false};
+};
+
+struct Pending {
+    int64_t ts_ns;
+    int severity;
+    const char* file;
+    int line;
+    std::string text;
+};
+
+class Flusher {
+public:
+    // Never destroyed: threads may log during static destruction
+    static Flusher& instance()
+    {
+        static Flusher* flusher = new Flusher;
+        return *flusher;
+    }
+
+    void add(Ring* ring)
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        rings_.push_back(ring);
+    }
+
+    void drain();
+    void stop();
+
+    std::atomic<uint64_t> dropped {0};
+
+private:
+    std::mutex rings_mutex_;
+    std::vector<Ring*> rings_;
+
+    std::mutex drain_mutex_;
+    std::vector<Pending> pending_;
+    uint64_t reported_dropped_ {0};
+
+    std::mutex stop_mutex_;
+    std::condition_variable stop_cv_;
+    bool stop_ {false};
+    std::thread thread_;
+
+    Flusher()
+        : thread_([this]() { run(); })
+    {
+        std::atexit([]() { Flusher::instance().stop(); });
+    }
+
+    void run();
+    void emit(Pending const& p);
+};
+
+void Flusher::run()
+{
+    std::unique_lock<std::mutex> lock(stop_mutex_);
+    while (not stop_) {
+        stop_cv_.wait_for(lock, flush_interval);
+        lock.unlock();
+        drain();
+        lock.lock();
+    }
+}
+
+void Flusher::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(stop_mutex_);
+        if (stop_)
+            return;
+        stop_ = true;
+    }
+    stop_cv_.notify_all();
+    thread_.join();
+    drain();
+}
+
+void Flusher::drain()
+{
+    std::lock_guard<std::mutex> drain_lock(drain_mutex_);
+
+    std::vector<Ring*> rings;
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        rings = rings_;
+    }
+
+    for (auto ring : rings) {
+        // Once the owner has exited nothing is added after this drain
+        bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        size_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; ++tail) {
+            auto& r = ring->slots[tail % ring_slots];
+            pending_.push_back(Pending{r.ts_ns, r.severity, r.file, r.line,
+                                       r.format(r.args)});
+        }
+        ring->tail.store(tail, std::memory_order_release);
+
+        if (orphaned) {
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            rings_.erase(std::find(rings_.begin(), rings_.end(), ring));
+            delete ring;
+        }
+    }
+
+    // Interleave threads in the order the records were made
+    std::stable_sort(pending_.begin(), pending_.end(),
+        [](Pending const& a, Pending const& b) { return a.ts_ns < b.ts_ns; });
+    for (auto const& p : pending_)
+        emit(p);
+    pending_.clear();
+
+    uint64_t total_dropped = dropped.load(std::memory_order_relaxed);
+    if (total_dropped != reported_dropped_) {
+        LOG(WARNING) << "[async_log] " << total_dropped - reported_dropped_
+                     << " records dropped, log ring is full";
+        reported_dropped_ = total_dropped;
+    }
+}
+
+void Flusher::emit(Pending const& p)
+{
+    // Aborting on the flusher thread would lose the context anyway
+    int severity = std::min<int>(p.severity, google::GLOG_ERROR);
+#if USE_SYSLOG
+    google::LogMessage(p.file, p.line, severity, 0,
+                       &google::LogMessage::SendToSyslogAndLog).stream()
+        << p.text;
+#else
+    google::LogMessage(p.file, p.line, severity).stream() << p.text;
+#endif
+}
+
+struct LocalRing {
+    Ring* ring {nullptr};
+
+    ~LocalRing()
+    {
+        if (ring)
+            ring->orphaned.store(true, std::memory_order_release);
+    }
+};
+
+thread_local LocalRing local;
+
+} // anonymous
+
+Record* reserve()
+{
+    Ring* ring = local.ring;
+    if (not ring) {
+        ring = new Ring;
+        Flusher::instance().add(ring);
+        local.ring = ring;
+    }
+
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= ring_slots) {
+        Flusher::instance().dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    return &ring->slots[head % ring_slots];
+}
+
+void commit()
+{
+    Ring* ring = local.ring;
+    ring->head.store(ring->head.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_release);
+}
+
+void flush()
+{
+    Flusher::instance().drain();
+}
+
+uint64_t dropped()
+{
+    return Flusher::instance().dropped.load(std::memory_order_relaxed);
+}
+
+} // namespace async_log
+} // namespace runos
@@ -32,6 +32,7 @@ namespace crash_reporter {
 using google_breakpad::ExceptionHandler;
 
 static std::unique_ptr<ExceptionHandler> handler;
+static void (*snapshot_hook)() = nullptr;
 
 bool filterCallback(void * /*context == NULL*/)
 {
@@ -71,9 +72,15 @@ void setup(const char* dump_path)
 
 void snapshot(/*TODO: reason, appdata */)
 {
+    if (snapshot_hook) snapshot_hook();
     if (handler) handler->WriteMinidump();
 }
 
+void on_snapshot(void (*hook)())
+{
+    snapshot_hook = hook;
+}
+
 } // crash_reporter
 
 void precatch_shim_handler(std::type_info* exception_type, void* thrown_object)
@@ -88,6 +95,14 @@ void precatch_shim_handler(std::type_info* exception_type, void* thrown_object)
 #else
 
 namespace runos {
+namespace crash_reporter {
+
+void on_snapshot(void (*)())
+{
+}
+
+} // crash_reporter
+
 void precatch_shim_handler(std::type_info* exception_type, void* thrown_object)
 {
 }
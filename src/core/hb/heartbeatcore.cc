@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 #include "heartbeatcore.hpp"
+#include "phi_accrual.hpp"
+#include "../lib/thread_placement.hpp"
 
 #include "runos/core/logging.hpp"
 #include "runos/core/assert.hpp"
@@ -25,8 +27,16 @@
 #include <QTimer>
 #include <QTime>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
 
 using runos::config_cd;
 using runos::config_get;
@@ -45,6 +55,23 @@ static QHostAddress toHostAddress(const std::string& str)
     return QHostAddress(QString::fromStdString(str));
 }
 
+using steady = std::chrono::steady_clock;
+
+static int64_t to_us(steady::duration d)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+void HeartbeatJitter::Histogram::add(int64_t us)
+{
+    us = std::abs(us);
+    auto it = std::lower_bound(BOUNDS.begin(), BOUNDS.end(), us);
+    ++counts[it - BOUNDS.begin()];
+    ++samples;
+    sum_us += us;
+    max_us = std::max(max_us, us);
+}
+
 enum class TimerType {
     HEARTBEAT,
     PRIMARY_DEAD,
@@ -148,6 +175,27 @@ struct HeartbeatCore::implementation
     CommunicationType communication_type = CommunicationType::UNDEFINED;
     ParamsMessage cached_params_message;
     QTime hb_start_time;
+    HeartbeatCore::DigestSource digest_source;
+
+    // Requests are due on a fixed monotonic grid
+    steady::duration heartbeat_interval;
+    steady::time_point next_request;
+    steady::time_point last_request;
+    std::unordered_map<qint32, steady::time_point> last_reply;
+    steady::time_point primary_last_heard; // under jitter_mutex
+
+    HeartbeatJitter jitter;
+    mutable std::mutex jitter_mutex;
+
+    // hb-failure-detector "phi": peers are declared dead by suspicion
+    // level, the static dead intervals only bound it from above
+    std::unique_ptr<PhiAccrualDetector> detector;
+    QTimer* suspicion_timer = nullptr;
+
+    // hb-realtime
+    bool realtime = false;
+    int realtime_priority = 0;
+    int cpu = -1;
 
     explicit implementation(QObject* parent = nullptr);
 };
@@ -173,6 +221,11 @@ HeartbeatCore::HeartbeatCore(const runos::Config& root_config)
     QObject::connect(impl_->timers.backup_timer_signal_mapper,
                      qOverload<int>(&QSignalMapper::mapped),
                      this, &HeartbeatCore::backup_death);
+
+    if (impl_->detector) {
+        QObject::connect(impl_->suspicion_timer, &QTimer::timeout,
+                         this, &HeartbeatCore::check_suspicion);
+    }
 }
 
 void HeartbeatCore::init_config(const runos::Config &root_config)
@@ -187,6 +240,35 @@ void HeartbeatCore::init_config(const runos::Config &root_config)
     auto heartbeat_interval = config_get(config, "hb-interval", 200);
     impl_->timers.setInterval(TimerType::HEARTBEAT,
                               std::move(ms{heartbeat_interval}));
+    impl_->heartbeat_interval = ms{heartbeat_interval};
+
+    // Run the heartbeat thread with a real-time policy, optionally
+    // pinned to one CPU, so application load can't delay it
+    impl_->realtime = config_get(config, "hb-realtime", false);
+
+    std::string detector = config_get(config, "hb-failure-detector", "static");
+    if ("phi" == detector) {
+        using fms = PhiAccrualDetector::duration;
+        PhiAccrualDetector::Settings phi;
+        phi.threshold = config_get(config, "hb-phi-threshold", 8.0);
+        phi.window = config_get(config, "hb-phi-window", 100);
+        phi.min_stddev = fms(config_get(config, "hb-phi-min-stddev", 5.0));
+        phi.acceptable_pause =
+            fms(config_get(config, "hb-phi-acceptable-pause", 0.0));
+        phi.first_interval = fms(heartbeat_interval);
+        impl_->detector = std::make_unique<PhiAccrualDetector>(phi);
+
+        impl_->suspicion_timer = new QTimer(this);
+        impl_->suspicion_timer->setTimerType(Qt::PreciseTimer);
+        impl_->suspicion_timer->setInterval(
+            config_get(config, "hb-phi-check-interval",
+                       std::max(1, heartbeat_interval / 4)));
+    } else if ("static" != detector) {
+        LOG(ERROR) << "[HeartbeatCore] Unknown hb-failure-detector "
+                   << detector << ", using static dead intervals";
+    }
+    impl_->realtime_priority = config_get(config, "hb-realtime-priority", 50);
+    impl_->cpu = config_get(config, "hb-cpu", -1);
     auto primary_dead_interval =
             config_get(config, "hb-primaryDeadInterval", 800);
     primary_dead_interval *= impl_->unique_node_id;
@@ -247,6 +329,57 @@ void HeartbeatCore::init_config(const runos::Config &root_config)
 
 HeartbeatCore::~HeartbeatCore() {}
 
+HeartbeatJitter HeartbeatCore::jitter() const
+{
+    std::lock_guard<std::mutex> lock(impl_->jitter_mutex);
+    return impl_->jitter;
+}
+
+steady::time_point HeartbeatCore::primaryLastHeard() const
+{
+    std::lock_guard<std::mutex> lock(impl_->jitter_mutex);
+    return impl_->primary_last_heard;
+}
+
+void HeartbeatCore::setDigestSource(DigestSource source)
+{
+    impl_->digest_source = std::move(source);
+}
+
+void HeartbeatCore::setupThread()
+{
+    // hb-cpu of a real-time heartbeat overrides the placement below
+    runos::ThreadPlacement::global().place("heartbeat", "heartbeat");
+    if (not impl_->realtime)
+        return;
+
+    sched_param param;
+    std::memset(&param, 0, sizeof(param));
+    param.sched_priority = impl_->realtime_priority;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0) {
+        LOG(WARNING) << "[HeartbeatCore] Can't set real-time priority "
+                     << impl_->realtime_priority << ": " << std::strerror(err)
+                     << ". Heartbeat runs with the default policy";
+    } else {
+        LOG(INFO) << "[HeartbeatCore] Heartbeat thread runs SCHED_FIFO, "
+                     "priority " << impl_->realtime_priority;
+    }
+
+#ifdef __linux__
+    if (impl_->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(impl_->cpu, &set);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            LOG(WARNING) << "[HeartbeatCore] Can't pin heartbeat thread to cpu "
+                         << impl_->cpu << ": " << std::strerror(err);
+        }
+    }
+#endif
+}
+
 void HeartbeatCore::startService(CommunicationType type,
                                  ControllerStatus controller_status)
 {
@@ -269,12 +402,21 @@ void HeartbeatCore::stopService()
 {
     impl_->timers.stopTimer(TimerType::ALL);
     impl_->is_connection_to_primary_established = false;
+    impl_->last_request = steady::time_point();
+    impl_->last_reply.clear();
+    if (impl_->detector) {
+        impl_->suspicion_timer->stop();
+        impl_->detector->clear();
+    }
     VLOG(5) << "[RecoveryManager] Heartbeat - Heartbeat stopped slot raised";
 }
 
 void HeartbeatCore::start_receiving(CommunicationType communication_type)
 {
     prepare_connection(communication_type, ControllerStatus::BACKUP);
+    if (impl_->detector) {
+        impl_->suspicion_timer->start();
+    }
     if (not impl_->is_connection_to_primary_established and
             not impl_->is_link_between_controllers_down) {
         impl_->timers.startTimer(TimerType::PRIMARY_WAITING_TIMER);
@@ -287,15 +429,44 @@ void HeartbeatCore::start_receiving(CommunicationType communication_type)
 void HeartbeatCore::start_transmitting(CommunicationType communication_type)
 {
     prepare_connection(communication_type, ControllerStatus::PRIMARY);
-    impl_->timers.startTimer(TimerType::HEARTBEAT);
+    if (impl_->detector) {
+        impl_->suspicion_timer->start();
+    }
+    impl_->next_request = steady::now() + impl_->heartbeat_interval;
+    impl_->timers.heartbeat_timer->start(
+        std::chrono::ceil<std::chrono::milliseconds>(
+            impl_->heartbeat_interval).count());
 
     VLOG(5) << "[HeartbeatCore] Start transmitting - heartbeat_timer start";
 }
 
 void HeartbeatCore::send_request()
 {
-    impl_->udp_socket->send(HeartbeatCommand::HEARTBEAT_ECHO_REQUEST,
-        EchoMessage{impl_->unique_node_id, impl_->hb_start_time, ++(impl_->hbcounter)});
+    EchoMessage echo{impl_->unique_node_id, impl_->hb_start_time,
+                     ++(impl_->hbcounter)};
+    DigestMessage digest;
+    if (impl_->digest_source && impl_->digest_source(digest)) {
+        impl_->udp_socket->send(HeartbeatCommand::HEARTBEAT_ECHO_REQUEST,
+                                DigestedEchoMessage{echo, digest});
+    } else {
+        impl_->udp_socket->send(HeartbeatCommand::HEARTBEAT_ECHO_REQUEST,
+                                echo);
+    }
+
+    auto now = steady::now();
+    {
+        std::lock_guard<std::mutex> lock(impl_->jitter_mutex);
+        impl_->jitter.send.add(to_us(now - impl_->next_request));
+    }
+
+    // Keep the grid unless a whole interval was missed
+    impl_->next_request += impl_->heartbeat_interval;
+    if (impl_->next_request <= now) {
+        impl_->next_request = now + impl_->heartbeat_interval;
+    }
+    auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+                    impl_->next_request - now);
+    impl_->timers.heartbeat_timer->start(wait.count());
 }
 
 void HeartbeatCore::bind_socket(CommunicationType communication_type)
@@ -377,6 +548,10 @@ void HeartbeatCore::check_backup_timer(int backup_id)
 
 void HeartbeatCore::primary_death()
 {
+    { // stopService forgets the requests
+        std::lock_guard<std::mutex> lock(impl_->jitter_mutex);
+        impl_->primary_last_heard = impl_->last_request;
+    }
     stopService();
     emit primaryDied();
 
@@ -403,6 +578,9 @@ void HeartbeatCore::backup_death(int backup_id)
             << backup_id;
 
     impl_->timers.stopTimer(TimerType::BACKUP_DEAD, backup_id);
+    if (impl_->detector) {
+        impl_->detector->remove(backup_id);
+    }
     emit backupDied(backup_id);
 
     VLOG(3) << "[HeartbeatCore] backupDeath slot. Signal backupDied emmited";
@@ -446,6 +624,38 @@ void HeartbeatCore::ready_read_handler()
     }
 }
 
+void HeartbeatCore::check_suspicion()
+{
+    auto now = steady::now();
+    std::vector<int> suspected;
+    impl_->detector->forEachPeer([&](int peer) {
+        if (impl_->detector->suspected(peer, now)) {
+            suspected.push_back(peer);
+        }
+    });
+
+    for (int peer : suspected) {
+        LOG(WARNING) << "[HeartbeatCore] Peer id=" << peer << " suspected, phi="
+                     << impl_->detector->phi(peer, now) << ", mean interval="
+                     << impl_->detector->mean(peer) << " ms, stddev="
+                     << impl_->detector->stddev(peer) << " ms";
+
+        if (+ControllerStatus::PRIMARY == impl_->heartbeat_mode) {
+            if (impl_->timers.backup_dead_timers.count(peer)) {
+                backup_death(peer);
+            } else {
+                impl_->detector->remove(peer);
+            }
+        } else if (peer == impl_->primary_node_id &&
+                   impl_->is_connection_to_primary_established) {
+            primary_death(); // stops the service and clears the detector
+            return;
+        } else {
+            impl_->detector->remove(peer);
+        }
+    }
+}
+
 void HeartbeatCore::process_message_request(QDataStream& stream)
 {
     if (+ControllerStatus::BACKUP == impl_->heartbeat_mode) {
@@ -473,6 +683,17 @@ void HeartbeatCore::process_message_request(QDataStream& stream)
         impl_->timers.startTimer(TimerType::PRIMARY_DEAD);
         impl_->is_link_between_controllers_down = false;
 
+        auto now = steady::now();
+        if (impl_->last_request != steady::time_point()) {
+            std::lock_guard<std::mutex> lock(impl_->jitter_mutex);
+            impl_->jitter.arrival.add(to_us(now - impl_->last_request -
+                                            impl_->heartbeat_interval));
+        }
+        impl_->last_request = now;
+        if (impl_->detector) {
+            impl_->detector->heartbeat(msg.unique_node_id, now);
+        }
+
         // set up primaty node id
         if (DEFAULT_ID == impl_->primary_node_id) {
             impl_->primary_node_id = msg.unique_node_id;
@@ -490,6 +711,17 @@ void HeartbeatCore::process_message_request(QDataStream& stream)
             impl_->udp_socket->send(HeartbeatCommand::HEARTBEAT_PARAMETERS_UPDATE,
                                     impl_->cached_params_message);
         }
+
+        if (not stream.atEnd()) {
+            DigestMessage digest;
+            stream >> digest;
+            if (QDataStream::Ok == stream.status()) {
+                emit stateDigestReceived(digest);
+            } else {
+                // a malformed digest must not drop the heartbeat itself
+                stream.resetStatus();
+            }
+        }
     }
 }
 
@@ -507,6 +739,18 @@ void HeartbeatCore::process_message_reply(QDataStream& stream)
         return;
     }
 
+    auto now = steady::now();
+    auto last = impl_->last_reply.find(msg.unique_node_id);
+    if (last != impl_->last_reply.end()) {
+        std::lock_guard<std::mutex> lock(impl_->jitter_mutex);
+        impl_->jitter.reply.add(to_us(now - last->second -
+                                      impl_->heartbeat_interval));
+    }
+    impl_->last_reply[msg.unique_node_id] = now;
+    if (impl_->detector) {
+        impl_->detector->heartbeat(msg.unique_node_id, now);
+    }
+
     // REPLY message has come only from backup timer
     // Add it and start or just restart
     impl_->is_link_between_controllers_down = false;
@@ -558,6 +802,11 @@ Timers::Timers(QObject *parent)
     , primary_dead_timer(new QTimer(parent))
     , primary_waiting_timer(new QTimer(parent))
 {
+    // The default coarse timers may fire 5% of the interval late
+    heartbeat_timer->setTimerType(Qt::PreciseTimer);
+    heartbeat_timer->setSingleShot(true); // rearmed for every deadline
+    primary_dead_timer->setTimerType(Qt::PreciseTimer);
+    primary_waiting_timer->setTimerType(Qt::PreciseTimer);
 }
 
 void Timers::setInterval(TimerType type, std::chrono::milliseconds ms)
@@ -598,6 +847,7 @@ void Timers::startTimer(TimerType type, qint32 backup_node_id)
         if (backup_dead_timers.end() == backup_timer_it) {
             // add new to container
             auto timer = new QTimer();
+            timer->setTimerType(Qt::PreciseTimer);
             std::unique_ptr<QTimer, decltype(deleter)> timer_ptr(timer, deleter);
             auto emplace_pair = backup_dead_timers.emplace(
                 backup_node_id,
@@ -18,8 +18,35 @@
 
 #include "heartbeatprotocol.hpp"
 #include "../Config.hpp"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <memory>
 
+// Deviations of heartbeat events from their schedule
+struct HeartbeatJitter
+{
+    static constexpr size_t BUCKETS = 12;
+    // Upper bounds of the buckets in microseconds, the last is unbounded
+    static constexpr std::array<int64_t, BUCKETS - 1> BOUNDS {{
+        100, 250, 500, 1000, 2000, 5000,
+        10000, 20000, 50000, 100000, 200000 }};
+
+    struct Histogram {
+        std::array<uint64_t, BUCKETS> counts {{}};
+        uint64_t samples = 0;
+        int64_t sum_us = 0;
+        int64_t max_us = 0;
+
+        void add(int64_t us);
+    };
+
+    Histogram send;    // primary: lateness of requests against deadlines
+    Histogram arrival; // backup: request inter-arrival minus hb-interval
+    Histogram reply;   // primary: reply inter-arrival minus hb-interval
+};
+
 class HeartbeatCore : public QObject
 {
     Q_OBJECT
@@ -27,7 +54,19 @@ public:
     explicit HeartbeatCore(const runos::Config& root_config);
     ~HeartbeatCore();
 
+    // Thread safe
+    HeartbeatJitter jitter() const;
+    // Thread safe, the last request of the primary declared dead
+    std::chrono::steady_clock::time_point primaryLastHeard() const;
+
+    // Fills the digest sent with the requests of the primary, false to
+    // send none. Called in the heartbeat thread, set it before start.
+    using DigestSource = std::function<bool(DigestMessage&)>;
+    void setDigestSource(DigestSource source);
+
 public slots:
+    // Applies hb-realtime settings, call in the heartbeat thread
+    void setupThread();
     void startService(CommunicationType type, ControllerStatus status);
     void stopService();
     void linkDown();
@@ -40,6 +79,8 @@ signals:
     void connectionToBackupEstablished(int backup_id);
     void modeChangedToPrimary();
     void paramsChanged(const ParamsMessage& params);
+    // Backup, the digest of the primary's state
+    void stateDigestReceived(const DigestMessage& digest);
 
 private slots:
     void send_request();
@@ -47,6 +88,7 @@ private slots:
     void check_primary();
     void backup_death(int backup_id);
     void ready_read_handler();
+    void check_suspicion();
 
 private:
     void start_receiving(CommunicationType communication_type);
@@ -20,6 +20,7 @@
 
 #include "runos/core/logging.hpp"
 #include <QDataStream>
+#include <QVector>
 #include <QtNetwork/QHostAddress>
 #include <QTime>
 
@@ -69,6 +70,38 @@ struct EchoMessage
     }
 };
 
+// Digest of the replicated state the primary sends after its
+// requests, see StateDigest. Receivers that don't know it read the
+// request only.
+struct DigestMessage
+{
+    quint64 generation;
+    quint64 root;
+    QVector<quint64> buckets;
+
+    friend QDataStream& operator<<(QDataStream& s, const DigestMessage& c)
+    {
+        return s << c.generation << c.root << c.buckets;
+    }
+
+    friend QDataStream& operator>>(QDataStream& s, DigestMessage& c)
+    {
+        return s >> c.generation >> c.root >> c.buckets;
+    }
+};
+
+struct DigestedEchoMessage
+{
+    EchoMessage echo;
+    DigestMessage digest;
+
+    friend QDataStream& operator<<(QDataStream& s,
+                                   const DigestedEchoMessage& c)
+    {
+        return s << c.echo << c.digest;
+    }
+};
+
 struct ParamsMessage
 {
     qint32 unique_node_id;
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phi_accrual.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+PhiAccrualDetector::PhiAccrualDetector(Settings settings)
+    : settings_(settings)
+{
+    settings_.window = std::max<size_t>(settings_.window, 1);
+}
+
+void PhiAccrualDetector::heartbeat(int peer, clock::time_point now)
+{
+    auto it = peers_.find(peer);
+    if (it == peers_.end()) {
+        // Seed with the expected interval: one sample says nothing
+        auto& h = peers_[peer];
+        double first = settings_.first_interval.count();
+        h.last = now;
+        h.intervals.push_back(first);
+        h.sum = first;
+        h.squares = first * first;
+        return;
+    }
+
+    auto& h = it->second;
+    double interval = duration(now - h.last).count();
+    h.last = now;
+
+    h.intervals.push_back(interval);
+    h.sum += interval;
+    h.squares += interval * interval;
+    if (h.intervals.size() > settings_.window) {
+        double old = h.intervals.front();
+        h.intervals.pop_front();
+        h.sum -= old;
+        h.squares -= old * old;
+    }
+}
+
+double PhiAccrualDetector::mean(int peer) const
+{
+    auto it = peers_.find(peer);
+    if (it == peers_.end())
+        return settings_.first_interval.count();
+    return it->second.sum / it->second.intervals.size();
+}
+
+double PhiAccrualDetector::stddev(int peer) const
+{
+    auto it = peers_.find(peer);
+    if (it == peers_.end() || it->second.intervals.size() < 2)
+        return settings_.first_interval.count() / 4;
+
+    auto& h = it->second;
+    double n = h.intervals.size();
+    double m = h.sum / n;
+    double var = std::max(0.0, h.squares / n - m * m);
+    return std::sqrt(var);
+}
+
+double PhiAccrualDetector::phi(int peer, clock::time_point now) const
+{
+    auto it = peers_.find(peer);
+    if (it == peers_.end())
+        return 0.0;
+
+    double elapsed = duration(now - it->second.last).count();
+    double m = mean(peer) + settings_.acceptable_pause.count();
+    double s = std::max(stddev(peer), settings_.min_stddev.count());
+
+    // Logistic approximation of the normal CDF tail, accurate to 1e-4
+    // and free of the cancellation in 1 - cdf for large y
+    double y = (elapsed - m) / s;
+    double e = std::exp(-y * (1.5976 + 0.070566 * y * y));
+    if (elapsed > m) {
+        double p = e / (1.0 + e);
+        return p > 0 ? -std::log10(p) : std::numeric_limits<double>::max();
+    }
+    return -std::log10(1.0 - 1.0 / (1.0 + e));
+}
+
+bool PhiAccrualDetector::suspected(int peer, clock::time_point now) const
+{
+    return phi(peer, now) > settings_.threshold;
+}
+
+void PhiAccrualDetector::remove(int peer)
+{
+    peers_.erase(peer);
+}
+
+void PhiAccrualDetector::clear()
+{
+    peers_.clear();
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <unordered_map>
+
+/**
+ * Phi accrual failure detector (Hayashibara et al.), per peer.
+ *
+ * Keeps a window of heartbeat inter-arrival times and reports
+ * phi = -log10(P(next heartbeat arrives later than now)) under the
+ * normal distribution of the window. A peer is suspected when phi
+ * exceeds the threshold: phi 8 means one false suspicion in 10^8.
+ */
+class PhiAccrualDetector
+{
+public:
+    using clock = std::chrono::steady_clock;
+    using duration = std::chrono::duration<double, std::milli>;
+
+    struct Settings {
+        double threshold = 8.0;
+        size_t window = 100;
+        // floor for the deviation, so a perfectly regular network
+        // doesn't make a single late heartbeat fatal
+        duration min_stddev {5.0};
+        // expected pause added to the mean, e.g. for GC-like stalls
+        duration acceptable_pause {0.0};
+        // assumed interval until the window has samples
+        duration first_interval {200.0};
+    };
+
+    explicit PhiAccrualDetector(Settings settings);
+
+    void heartbeat(int peer, clock::time_point now = clock::now());
+    double phi(int peer, clock::time_point now = clock::now()) const;
+    bool suspected(int peer, clock::time_point now = clock::now()) const;
+
+    // Peers heard at least once
+    template<class F>
+    void forEachPeer(F&& f) const
+    {
+        for (auto& peer : peers_) {
+            f(peer.first);
+        }
+    }
+
+    void remove(int peer);
+    void clear();
+
+    double mean(int peer) const;
+    double stddev(int peer) const;
+
+private:
+    struct History {
+        clock::time_point last;
+        std::deque<double> intervals; // ms
+        double sum = 0;
+        double squares = 0;
+    };
+
+    Settings settings_;
+    std::unordered_map<int, History> peers_;
+};
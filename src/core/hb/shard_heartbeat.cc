@@ -0,0 +1,162 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "shard_heartbeat.hpp"
+
+#include "runos/core/logging.hpp"
+
+#include <QtNetwork/QUdpSocket>
+#include <QDataStream>
+#include <QTimer>
+
+#include <algorithm>
+#include <sstream>
+
+using runos::config_cd;
+using runos::config_get;
+
+// "RNSH", guards against stray datagrams on the port
+static constexpr quint32 SHARD_HEARTBEAT_MAGIC = 0x524e5348;
+
+static PhiAccrualDetector::Settings detectorSettings(const runos::Config& c)
+{
+    using fms = PhiAccrualDetector::duration;
+    PhiAccrualDetector::Settings phi;
+    phi.threshold = config_get(c, "phi-threshold", 8.0);
+    phi.min_stddev = fms(config_get(c, "phi-min-stddev", 5.0));
+    phi.first_interval = fms(config_get(c, "interval-ms", 200));
+    return phi;
+}
+
+ShardHeartbeat::ShardHeartbeat(const runos::Config& root_config)
+    : QObject()
+    , detector_(detectorSettings(config_cd(config_cd(root_config,
+                                                     "recovery-manager"),
+                                           "sharding")))
+{
+    auto& config = config_cd(root_config, "recovery-manager");
+    auto& sharding = config_cd(config, "sharding");
+    id_ = config_get(config, "id", 777);
+    port_ = config_get(sharding, "port", 50100);
+    interval_ = std::max(1, config_get(sharding, "interval-ms", 200));
+    settle_ = config_get(sharding, "settle-ms", 1000);
+
+    // "host:port,host:port"
+    std::istringstream peers(config_get(sharding, "peers", ""));
+    std::string peer;
+    while (std::getline(peers, peer, ',')) {
+        if (peer.empty())
+            continue;
+        auto colon = peer.rfind(':');
+        QHostAddress address(QString::fromStdString(peer.substr(0, colon)));
+        int port = colon == std::string::npos
+                 ? port_ : std::stoi(peer.substr(colon + 1));
+        if (address.isNull() || port <= 0 || port > 0xffff) {
+            LOG(ERROR) << "[ShardHeartbeat] Bad peer " << peer;
+            continue;
+        }
+        peers_.push_back(Peer{address, quint16(port)});
+    }
+}
+
+ShardHeartbeat::~ShardHeartbeat() = default;
+
+void ShardHeartbeat::start()
+{
+    if (socket_)
+        return;
+
+    socket_ = new QUdpSocket(this);
+    if (not socket_->bind(QHostAddress::AnyIPv4, port_,
+                          QUdpSocket::ShareAddress)) {
+        LOG(ERROR) << "[ShardHeartbeat] Can't bind port " << port_ << ": "
+                   << socket_->errorString().toStdString();
+    }
+    QObject::connect(socket_, &QUdpSocket::readyRead,
+                     this, &ShardHeartbeat::receive);
+
+    timer_ = new QTimer(this);
+    timer_->setTimerType(Qt::PreciseTimer);
+    QObject::connect(timer_, &QTimer::timeout, this, &ShardHeartbeat::beat);
+    timer_->start(interval_);
+
+    // Hear the running peers before the first member set, a node
+    // starting alone would take all switches only to give them back
+    QTimer::singleShot(settle_, this, [this]() {
+        settled_ = true;
+        evaluate();
+    });
+
+    LOG(WARNING) << "[ShardHeartbeat] Node " << id_ << " sends heartbeats to "
+                 << peers_.size() << " peers from port " << port_;
+}
+
+void ShardHeartbeat::beat()
+{
+    QByteArray buf;
+    QDataStream s(&buf, QIODevice::WriteOnly);
+    s.setVersion(QDataStream::Qt_5_9);
+    s << SHARD_HEARTBEAT_MAGIC << id_;
+    for (auto& peer : peers_) {
+        socket_->writeDatagram(buf, peer.address, peer.port);
+    }
+    evaluate();
+}
+
+void ShardHeartbeat::receive()
+{
+    while (socket_->hasPendingDatagrams()) {
+        QByteArray datagram;
+        datagram.resize(int(socket_->pendingDatagramSize()));
+        socket_->readDatagram(datagram.data(), datagram.size());
+
+        QDataStream s(datagram);
+        s.setVersion(QDataStream::Qt_5_9);
+        quint32 magic = 0;
+        qint32 id = 0;
+        s >> magic >> id;
+        if (QDataStream::Ok != s.status() || SHARD_HEARTBEAT_MAGIC != magic ||
+                id == id_) {
+            continue;
+        }
+        detector_.heartbeat(id);
+    }
+    evaluate();
+}
+
+void ShardHeartbeat::evaluate()
+{
+    QVector<int> members {id_};
+    std::vector<int> dead;
+    detector_.forEachPeer([&](int peer) {
+        if (detector_.suspected(peer)) {
+            dead.push_back(peer);
+        } else {
+            members.push_back(peer);
+        }
+    });
+    // A suspected peer comes back with a fresh window
+    for (int peer : dead) {
+        detector_.remove(peer);
+    }
+    std::sort(members.begin(), members.end());
+
+    if (not settled_ || members == members_)
+        return;
+    members_ = members;
+    emit membersChanged(members_);
+}
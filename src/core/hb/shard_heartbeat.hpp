@@ -0,0 +1,77 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "phi_accrual.hpp"
+#include "../Config.hpp"
+
+#include <QObject>
+#include <QVector>
+#include <QtNetwork/QHostAddress>
+
+#include <memory>
+#include <vector>
+
+class QTimer;
+class QUdpSocket;
+
+/**
+ * Membership of an active-active cluster.
+ *
+ * Every node sends its id to all configured peers each interval and
+ * keeps the set of nodes it hears, with phi accrual suspicion deciding
+ * when a silent peer is gone. The set always contains this node.
+ */
+class ShardHeartbeat : public QObject
+{
+    Q_OBJECT
+public:
+    struct Peer {
+        QHostAddress address;
+        quint16 port;
+    };
+
+    explicit ShardHeartbeat(const runos::Config& root_config);
+    ~ShardHeartbeat();
+
+public slots:
+    // Call in the heartbeat thread
+    void start();
+
+signals:
+    // Sorted alive members, this node included
+    void membersChanged(QVector<int> members);
+
+private slots:
+    void beat();
+    void receive();
+
+private:
+    void evaluate();
+
+    qint32 id_;
+    quint16 port_;
+    int interval_;
+    int settle_;
+    bool settled_ = false;
+    std::vector<Peer> peers_;
+    PhiAccrualDetector detector_;
+    QUdpSocket* socket_ = nullptr;
+    QTimer* timer_ = nullptr;
+    QVector<int> members_; // empty until settled
+};
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "admission_queue.hpp"
+
+namespace runos {
+
+void admission_queue::submit(uint64_t key, int priority, start_fn start)
+{
+    std::vector<start_fn> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = clock::now();
+
+        auto act = active_.find(key);
+        if (act != active_.end()) {
+            act->second = active{ now, now };
+            ready.push_back(std::move(start));
+        } else {
+            auto it = waiting_.find(key);
+            if (it != waiting_.end()) {
+                it->second.start = std::move(start);
+            } else {
+                auto order = std::make_pair(priority, sequence_++);
+                queue_.emplace(order, key);
+                waiting_.emplace(key, waiting{ order, now, std::move(start) });
+            }
+            ready = admit(now);
+        }
+    }
+    for (auto& start : ready) {
+        start();
+    }
+}
+
+auto admission_queue::release(uint64_t key)
+    -> std::optional<clock::duration>
+{
+    std::optional<clock::duration> ret;
+    std::vector<start_fn> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = clock::now();
+
+        auto act = active_.find(key);
+        if (act != active_.end()) {
+            ret = now - act->second.submitted;
+            active_.erase(act);
+        } else {
+            auto it = waiting_.find(key);
+            if (it == waiting_.end())
+                return std::nullopt;
+            queue_.erase(it->second.order);
+            waiting_.erase(it);
+        }
+        ready = admit(now);
+    }
+    for (auto& start : ready) {
+        start();
+    }
+    return ret;
+}
+
+std::vector<uint64_t> admission_queue::expire()
+{
+    std::vector<uint64_t> ret;
+    std::vector<start_fn> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = clock::now();
+
+        for (auto it = active_.begin(); it != active_.end(); ) {
+            if (now - it->second.started >= settings_.max_hold) {
+                ret.push_back(it->first);
+                it = active_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        expired_ += ret.size();
+        ready = admit(now);
+    }
+    for (auto& start : ready) {
+        start();
+    }
+    return ret;
+}
+
+auto admission_queue::stats() const -> metrics
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return { active_.size(), waiting_.size(), admitted_, expired_ };
+}
+
+auto admission_queue::admit(clock::time_point now) -> std::vector<start_fn>
+{
+    std::vector<start_fn> ret;
+    while (not queue_.empty() && (settings_.max_active == 0 ||
+                                  active_.size() < settings_.max_active)) {
+        auto key = queue_.begin()->second;
+        queue_.erase(queue_.begin());
+
+        auto it = waiting_.find(key);
+        active_.emplace(key, active{ it->second.submitted, now });
+        ret.push_back(std::move(it->second.start));
+        waiting_.erase(it);
+        ++admitted_;
+    }
+    return ret;
+}
+
+} // namespace runos
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Caps how many switches are brought up at once after a connection storm.
+ *
+ * At most `max_active` keys hold a slot; the rest wait by priority (lower
+ * value first, FIFO inside a priority). A key holds its slot from start()
+ * until release(), or for `max_hold` when its bring-up never finishes.
+ * Submitting a queued key again keeps its place, submitting an active one
+ * restarts it in its slot.
+ *
+ * Thread safe. start callbacks run on the calling thread outside the lock.
+ */
+class admission_queue {
+public:
+    using clock = std::chrono::steady_clock;
+    using start_fn = std::function<void()>;
+
+    struct settings {
+        size_t max_active {64}; // 0 admits everything at once
+        std::chrono::milliseconds max_hold {30000};
+    };
+
+    struct metrics {
+        size_t active;
+        size_t queued;
+        uint64_t admitted;
+        uint64_t expired;
+    };
+
+    explicit admission_queue(settings s)
+        : settings_(s)
+    { }
+
+    void submit(uint64_t key, int priority, start_fn start);
+    // Frees the slot of `key` or drops it from the queue. Returns the
+    // time since it was submitted if it held a slot.
+    std::optional<clock::duration> release(uint64_t key);
+    // Frees slots held longer than max_hold, returns their keys
+    std::vector<uint64_t> expire();
+
+    metrics stats() const;
+
+private:
+    struct waiting {
+        std::pair<int, uint64_t> order; // (priority, sequence)
+        clock::time_point submitted;
+        start_fn start;
+    };
+    struct active {
+        clock::time_point submitted;
+        clock::time_point started;
+    };
+
+    settings settings_;
+    mutable std::mutex mutex_;
+    std::map<std::pair<int, uint64_t>, uint64_t> queue_; // order -> key
+    std::unordered_map<uint64_t, waiting> waiting_;
+    std::unordered_map<uint64_t, active> active_;
+    uint64_t sequence_ {0};
+    uint64_t admitted_ {0};
+    uint64_t expired_ {0};
+
+    // Moves waiting keys into free slots, returns what to start
+    std::vector<start_fn> admit(clock::time_point now);
+};
+
+} // namespace runos
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bandwidth_ledger.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace runos {
+
+uint64_t bandwidth_ledger::account::residual() const
+{
+    uint64_t used = std::max(reserved, load);
+    return capacity > used ? capacity - used : 0;
+}
+
+template<class F>
+void bandwidth_ledger::update(switch_and_port sp, F&& change)
+{
+    auto it = m_ports.find(sp);
+    if (it == m_ports.end()) {
+        it = m_ports.emplace(sp, account{}).first;
+    } else {
+        m_by_residual.erase({it->second.residual(), sp});
+    }
+    change(it->second);
+    m_by_residual.emplace(it->second.residual(), sp);
+}
+
+void bandwidth_ledger::set_capacity(switch_and_port sp, uint64_t rate)
+{
+    update(sp, [rate](account& a) { a.capacity = rate; });
+}
+
+void bandwidth_ledger::set_load(switch_and_port sp, uint64_t rate)
+{
+    update(sp, [rate](account& a) { a.load = rate; });
+}
+
+bool bandwidth_ledger::reserve(const ports& over, uint64_t rate)
+{
+    // demand per port, so a port listed twice has to fit both
+    std::unordered_map<switch_and_port, uint64_t> demand;
+    for (auto sp : over)
+        demand[sp] += rate;
+
+    for (const auto& it : demand) {
+        if (residual(it.first) < it.second)
+            return false;
+    }
+    hold(over, rate);
+    return true;
+}
+
+void bandwidth_ledger::hold(const ports& over, uint64_t rate)
+{
+    for (auto sp : over) {
+        update(sp, [rate](account& a) { a.reserved += rate; });
+    }
+}
+
+void bandwidth_ledger::release(const ports& over, uint64_t rate)
+{
+    for (auto sp : over) {
+        if (m_ports.count(sp) == 0)
+            continue;
+        update(sp, [rate](account& a) {
+            a.reserved -= std::min(a.reserved, rate);
+        });
+    }
+}
+
+uint64_t bandwidth_ledger::residual(switch_and_port sp) const
+{
+    auto it = m_ports.find(sp);
+    return it != m_ports.end() ? it->second.residual() : 0;
+}
+
+uint64_t bandwidth_ledger::reserved(switch_and_port sp) const
+{
+    auto it = m_ports.find(sp);
+    return it != m_ports.end() ? it->second.reserved : 0;
+}
+
+uint64_t bandwidth_ledger::capacity(switch_and_port sp) const
+{
+    auto it = m_ports.find(sp);
+    return it != m_ports.end() ? it->second.capacity : 0;
+}
+
+uint64_t bandwidth_ledger::load(switch_and_port sp) const
+{
+    auto it = m_ports.find(sp);
+    return it != m_ports.end() ? it->second.load : 0;
+}
+
+} // namespace runos
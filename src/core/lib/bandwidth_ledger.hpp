@@ -0,0 +1,94 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "switch_and_port.hpp"
+
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Residual capacity index of ports for bandwidth reservations.
+ *
+ * Every port has a capacity, a measured load and a sum of reservations,
+ * all in bytes/s. Its residual is `capacity - max(reserved, load)`:
+ * traffic beyond the reservations is best effort, which new
+ * reservations may not push aside. Ports are also kept ordered by
+ * residual, so the ones short of a demand are listed without looking
+ * at the others.
+ *
+ * Not thread safe.
+ */
+class bandwidth_ledger {
+public:
+    using ports = std::vector<switch_and_port>;
+
+    // What the port can carry, ports never set have none
+    void set_capacity(switch_and_port sp, uint64_t rate);
+    // Measured load of the port, e.g. the larger of tx and rx
+    void set_load(switch_and_port sp, uint64_t rate);
+
+    // Reserves `rate` on every port or, if any of them has less left,
+    // on none and returns false. A port listed twice is reserved twice.
+    bool reserve(const ports& over, uint64_t rate);
+    // Reserves without looking at the residual, e.g. restored routes
+    void hold(const ports& over, uint64_t rate);
+    void release(const ports& over, uint64_t rate);
+
+    uint64_t residual(switch_and_port sp) const;
+    uint64_t reserved(switch_and_port sp) const;
+    uint64_t capacity(switch_and_port sp) const;
+    uint64_t load(switch_and_port sp) const;
+
+    // Calls f(port) for every port with less than `rate` left, in
+    // ascending order of residual
+    template<class F>
+    void for_each_short(uint64_t rate, F&& f) const
+    {
+        for (const auto& it : m_by_residual) {
+            if (it.first >= rate)
+                break;
+            f(it.second);
+        }
+    }
+
+    size_t size() const { return m_ports.size(); }
+
+private:
+    struct account {
+        uint64_t capacity {0};
+        uint64_t load {0};
+        uint64_t reserved {0};
+
+        uint64_t residual() const;
+    };
+
+    std::unordered_map<switch_and_port, account> m_ports;
+    std::set<std::pair<uint64_t, switch_and_port>> m_by_residual;
+
+    // Applies `change` to the account of `sp`, keeping the index
+    template<class F>
+    void update(switch_and_port sp, F&& change);
+};
+
+} // namespace runos
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "blob_pool.hpp"
+
+#include <runos/core/assert.hpp>
+
+#include <functional>
+
+namespace runos {
+
+BlobPool::BlobPool(size_t shards)
+{
+    CHECK(shards > 0);
+    for (size_t i = 0; i < shards; ++i) {
+        shards_.push_back(std::make_shared<Shard>());
+    }
+}
+
+BlobPool::Blob BlobPool::intern(const uint8_t* data, size_t size)
+{
+    return intern(std::string_view(reinterpret_cast<const char*>(data), size));
+}
+
+BlobPool::Blob BlobPool::intern(std::string_view bytes)
+{
+    auto hash = std::hash<std::string_view>()(bytes);
+    auto& shard = shards_[hash % shards_.size()];
+
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    auto it = shard->blobs.find(bytes);
+    if (it != shard->blobs.end()) {
+        if (auto ret = it->second.weak.lock())
+            return ret;
+        // expired, its deleter is waiting for the lock
+        shard->bytes -= it->first.size();
+        shard->blobs.erase(it);
+    }
+
+    // The deleter keeps the shard alive, not the whole pool
+    auto s = new std::string(bytes);
+    Blob ret(s, [shard](const std::string* s) {
+        shard->release(s);
+        delete s;
+    });
+    shard->blobs.emplace(std::string_view(*s), Entry{ s, ret });
+    shard->bytes += s->size();
+    return ret;
+}
+
+void BlobPool::Shard::release(const std::string* s)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = blobs.find(std::string_view(*s));
+    // may be re-interned as another copy meanwhile
+    if (it != blobs.end() && it->second.ptr == s) {
+        bytes -= s->size();
+        blobs.erase(it);
+    }
+}
+
+size_t BlobPool::size() const
+{
+    size_t ret = 0;
+    for (const auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        ret += shard->blobs.size();
+    }
+    return ret;
+}
+
+uint64_t BlobPool::bytes() const
+{
+    uint64_t ret = 0;
+    for (const auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        ret += shard->bytes;
+    }
+    return ret;
+}
+
+} // namespace runos
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Hash-consed immutable byte strings. Equal contents interned through
+ * one pool share a single ref-counted copy, so two blobs of a pool are
+ * equal exactly when their pointers are. A copy is dropped from the
+ * pool with its last reference; blobs may outlive the pool.
+ *
+ * Thread-safe, the table is split into shards by content hash.
+ */
+class BlobPool {
+public:
+    using Blob = std::shared_ptr<const std::string>;
+
+    explicit BlobPool(size_t shards = 16);
+
+    BlobPool(BlobPool const&) = delete;
+    BlobPool& operator=(BlobPool const&) = delete;
+
+    Blob intern(const uint8_t* data, size_t size);
+    Blob intern(std::string_view bytes);
+
+    // Distinct blobs alive and their bytes
+    size_t size() const;
+    uint64_t bytes() const;
+
+private:
+    struct Entry {
+        const std::string* ptr;
+        std::weak_ptr<const std::string> weak;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        // keys view the strings they map to
+        std::unordered_map<std::string_view, Entry> blobs;
+        uint64_t bytes {0};
+
+        void release(const std::string* s);
+    };
+
+    std::vector< std::shared_ptr<Shard> > shards_;
+};
+
+} // namespace runos
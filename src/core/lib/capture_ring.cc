@@ -0,0 +1,293 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "capture_ring.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace runos {
+
+namespace {
+
+// In front of every record in a ring, followed by the message bytes
+struct RecordHeader {
+    uint32_t size; // whole record, aligned; wrap_flag marks padding
+    uint32_t orig_len;
+    uint32_t len;
+    uint32_t outgoing;
+    uint64_t ts_ns;
+    uint64_t dpid;
+};
+
+constexpr uint32_t wrap_flag = 0x80000000u;
+constexpr size_t record_align = 8;
+constexpr uint16_t controller_port = 6653;
+constexpr uint16_t switch_port = 50000;
+
+size_t align_record(size_t n)
+{
+    return (n + record_align - 1) & ~(record_align - 1);
+}
+
+size_t round_up_pow2(size_t n)
+{
+    size_t ret = 1;
+    while (ret < n)
+        ret <<= 1;
+    return ret;
+}
+
+uint8_t* put16(uint8_t* p, uint16_t v)
+{
+    p[0] = v >> 8; p[1] = v;
+    return p + 2;
+}
+
+uint8_t* put32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+    return p + 4;
+}
+
+uint8_t* put_mac(uint8_t* p, uint64_t v)
+{
+    for (int i = 5; i >= 0; --i)
+        *p++ = v >> (8 * i);
+    return p;
+}
+
+struct PcapHeader {
+    uint32_t magic {0xa1b23c4d}; // nanosecond timestamps
+    uint16_t version_major {2};
+    uint16_t version_minor {4};
+    int32_t thiszone {0};
+    uint32_t sigfigs {0};
+    uint32_t snaplen;
+    uint32_t linktype {1}; // Ethernet
+};
+
+struct PcapRecordHeader {
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+std::atomic<uint64_t> next_instance {1};
+uint64_t const controller_mac = 0x020000000001ull;
+
+} // anonymous
+
+CaptureRing::Ring::Ring(size_t size)
+    : buffer(size)
+    , mask(size - 1)
+{ }
+
+CaptureRing::CaptureRing(Settings settings)
+    : settings_(std::move(settings))
+    , instance_(next_instance++)
+{
+    size_t max_record = align_record(sizeof(RecordHeader) + settings_.snaplen);
+    settings_.ring_size = round_up_pow2(
+        std::max(settings_.ring_size, 2 * max_record));
+
+    file_ = std::fopen(settings_.path.c_str(), "wb");
+    if (not file_)
+        throw std::runtime_error("Can't create capture file " + settings_.path);
+
+    PcapHeader header;
+    header.snaplen = settings_.snaplen + frame_header_size;
+    std::fwrite(&header, sizeof(header), 1, file_);
+    std::fflush(file_);
+
+    writer_ = std::thread([this]() { run(); });
+}
+
+CaptureRing::~CaptureRing()
+{
+    {
+        std::lock_guard<std::mutex> lock(stop_mutex_);
+        stop_ = true;
+    }
+    stop_cv_.notify_all();
+    writer_.join();
+
+    drain();
+    std::fclose(file_);
+}
+
+auto CaptureRing::local_ring() -> Ring&
+{
+    // Cached by instance id, not address: a new capture may reuse it
+    thread_local uint64_t owner = 0;
+    thread_local Ring* ring = nullptr;
+
+    if (owner != instance_) {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        auto& slot = rings_[std::this_thread::get_id()];
+        if (not slot)
+            slot.reset(new Ring(settings_.ring_size));
+        ring = slot.get();
+        owner = instance_;
+    }
+    return *ring;
+}
+
+void CaptureRing::record(uint64_t dpid, bool outgoing,
+                         const uint8_t* data, size_t len)
+{
+    using namespace std::chrono;
+    uint64_t ts = duration_cast<nanoseconds>(
+                    system_clock::now().time_since_epoch()).count();
+
+    auto& ring = local_ring();
+    uint32_t caplen = std::min<size_t>(len, settings_.snaplen);
+    size_t need = align_record(sizeof(RecordHeader) + caplen);
+    size_t capacity = ring.buffer.size();
+
+    size_t head = ring.head.load(std::memory_order_relaxed);
+    size_t tail = ring.tail.load(std::memory_order_acquire);
+    size_t pos = head & ring.mask;
+    size_t contiguous = capacity - pos;
+    size_t total = contiguous < need ? contiguous + need : need;
+
+    if (capacity - (head - tail) < total) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    if (contiguous < need) {
+        uint32_t pad = uint32_t(contiguous) | wrap_flag;
+        std::memcpy(&ring.buffer[pos], &pad, sizeof(pad));
+        head += contiguous;
+        pos = 0;
+    }
+
+    RecordHeader hdr { uint32_t(need), uint32_t(len), caplen,
+                       outgoing, ts, dpid };
+    std::memcpy(&ring.buffer[pos], &hdr, sizeof(hdr));
+    std::memcpy(&ring.buffer[pos + sizeof(hdr)], data, caplen);
+    ring.head.store(head + need, std::memory_order_release);
+}
+
+void CaptureRing::run()
+{
+    std::unique_lock<std::mutex> lock(stop_mutex_);
+    while (not stop_) {
+        stop_cv_.wait_for(lock, settings_.flush_interval);
+        lock.unlock();
+        drain();
+        lock.lock();
+    }
+}
+
+void CaptureRing::drain()
+{
+    std::vector<Ring*> rings;
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        for (auto& r : rings_)
+            rings.push_back(r.second.get());
+    }
+
+    for (auto ring : rings)
+        drain(*ring);
+    std::fflush(file_);
+}
+
+void CaptureRing::drain(Ring& ring)
+{
+    size_t tail = ring.tail.load(std::memory_order_relaxed);
+    size_t head = ring.head.load(std::memory_order_acquire);
+
+    while (tail != head) {
+        size_t pos = tail & ring.mask;
+        RecordHeader hdr;
+        std::memcpy(&hdr.size, &ring.buffer[pos], sizeof(hdr.size));
+        if (hdr.size & wrap_flag) {
+            tail += hdr.size & ~wrap_flag;
+            continue;
+        }
+
+        std::memcpy(&hdr, &ring.buffer[pos], sizeof(hdr));
+        write_frame(hdr.ts_ns, hdr.dpid, hdr.outgoing, hdr.orig_len,
+                    &ring.buffer[pos + sizeof(hdr)], hdr.len);
+        tail += hdr.size;
+    }
+
+    ring.tail.store(tail, std::memory_order_release);
+}
+
+void CaptureRing::write_frame(uint64_t ts_ns, uint64_t dpid, bool outgoing,
+                              uint32_t orig_len, const uint8_t* data,
+                              uint32_t len)
+{
+    uint32_t switch_ip = 0x0a000000u | (dpid & 0x00ffffffu); // 10.x.y.z
+    uint32_t controller_ip = 0x0afffffeu; // 10.255.255.254
+    uint64_t switch_mac = 0x020000000000ull | (dpid & 0xffffffffffull);
+
+    frame_.resize(frame_header_size);
+    uint8_t* p = frame_.data();
+
+    // Ethernet
+    p = put_mac(p, outgoing ? switch_mac : controller_mac);
+    p = put_mac(p, outgoing ? controller_mac : switch_mac);
+    p = put16(p, 0x0800);
+
+    // IPv4
+    uint8_t* ip = p;
+    uint16_t ip_len = std::min<uint32_t>(20 + 20 + orig_len, 0xffff);
+    p = put16(p, 0x4500);
+    p = put16(p, ip_len);
+    p = put32(p, 0x00004000); // id 0, don't fragment
+    p = put16(p, 0x4006);     // ttl 64, tcp
+    p = put16(p, 0);          // checksum, set below
+    p = put32(p, outgoing ? controller_ip : switch_ip);
+    p = put32(p, outgoing ? switch_ip : controller_ip);
+    uint32_t sum = 0;
+    for (int i = 0; i < 20; i += 2)
+        sum += (ip[i] << 8) | ip[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    put16(ip + 10, ~sum);
+
+    // TCP, sequence numbers make stream reassembly work
+    auto& seq = seq_[FlowKey{dpid, outgoing}];
+    p = put16(p, outgoing ? controller_port : switch_port);
+    p = put16(p, outgoing ? switch_port : controller_port);
+    p = put32(p, seq);
+    p = put32(p, 0);
+    p = put16(p, 0x5018); // header 20 bytes, PSH|ACK
+    p = put16(p, 0xffff); // window
+    p = put32(p, 0);      // checksum (not computed), urgent pointer
+    seq += orig_len;
+
+    PcapRecordHeader rec {
+        uint32_t(ts_ns / 1000000000u),
+        uint32_t(ts_ns % 1000000000u),
+        uint32_t(frame_header_size + len),
+        uint32_t(frame_header_size + orig_len)
+    };
+    std::fwrite(&rec, sizeof(rec), 1, file_);
+    std::fwrite(frame_.data(), frame_header_size, 1, file_);
+    std::fwrite(data, len, 1, file_);
+    written_.fetch_add(1, std::memory_order_relaxed);
+}
+
+} // namespace runos
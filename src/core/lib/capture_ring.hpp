@@ -0,0 +1,121 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Binary capture of OpenFlow messages into a pcap file.
+ *
+ * record() copies the raw message into a ring owned by the calling
+ * thread; it takes no lock and never blocks, a full ring drops the
+ * record and counts it. A background thread drains all rings
+ * periodically and writes them as TCP segments between the switch and
+ * port 6653, so Wireshark's OpenFlow dissector reads the file as is.
+ * The switch MAC and IP addresses are derived from the dpid.
+ *
+ * Records of one thread keep their order; records of different threads
+ * are ordered only by their timestamps.
+ */
+class CaptureRing {
+public:
+    struct Settings {
+        std::string path;
+        size_t ring_size {1 << 20}; // per thread, bytes
+        uint32_t snaplen {65535};   // payload bytes kept per message
+        std::chrono::milliseconds flush_interval {100};
+    };
+
+    // Throws std::runtime_error if the file can't be created
+    explicit CaptureRing(Settings settings);
+    // Drains what is left and closes the file
+    ~CaptureRing();
+
+    CaptureRing(CaptureRing const&) = delete;
+    CaptureRing& operator=(CaptureRing const&) = delete;
+
+    void record(uint64_t dpid, bool outgoing, const uint8_t* data, size_t len);
+
+    uint64_t written() const { return written_; }
+    uint64_t dropped() const { return dropped_; }
+
+    // Size of the fake Ethernet/IPv4/TCP headers in front of every message
+    static constexpr size_t frame_header_size = 54;
+
+private:
+    // Single producer (the owning thread), single consumer (the writer)
+    struct Ring {
+        explicit Ring(size_t size);
+
+        std::vector<uint8_t> buffer;
+        size_t mask;
+        alignas(64) std::atomic<size_t> head {0}; // written by producer
+        alignas(64) std::atomic<size_t> tail {0}; // written by consumer
+    };
+
+    struct FlowKey {
+        uint64_t dpid;
+        bool outgoing;
+        bool operator==(FlowKey const& other) const
+        { return dpid == other.dpid && outgoing == other.outgoing; }
+    };
+    struct FlowKeyHash {
+        size_t operator()(FlowKey const& k) const
+        { return std::hash<uint64_t>()(k.dpid) ^ size_t(k.outgoing); }
+    };
+
+    Settings settings_;
+    const uint64_t instance_;
+    FILE* file_;
+
+    std::mutex rings_mutex_;
+    std::unordered_map<std::thread::id, std::unique_ptr<Ring>> rings_;
+
+    // writer thread state
+    std::unordered_map<FlowKey, uint32_t, FlowKeyHash> seq_;
+    std::vector<uint8_t> frame_;
+
+    std::atomic<uint64_t> written_ {0};
+    std::atomic<uint64_t> dropped_ {0};
+
+    std::mutex stop_mutex_;
+    std::condition_variable stop_cv_;
+    bool stop_ {false};
+    std::thread writer_;
+
+    Ring& local_ring();
+    void run();
+    void drain();
+    void drain(Ring& ring);
+    void write_frame(uint64_t ts_ns, uint64_t dpid, bool outgoing,
+                     uint32_t orig_len, const uint8_t* data, uint32_t len);
+};
+
+} // namespace runos
@@ -0,0 +1,170 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "change_log.hpp"
+
+#include <random>
+#include <utility>
+
+namespace runos {
+
+using lock_t = std::lock_guard<std::mutex>;
+
+static uint64_t random_id()
+{
+    std::random_device rd;
+    uint64_t ret;
+    do {
+        ret = (uint64_t(rd()) << 32) | rd();
+    } while (ret == 0); // 0 is "no log"
+    return ret;
+}
+
+/* ChangeLog */
+
+ChangeLog::ChangeLog(size_t capacity)
+    : capacity_(capacity)
+    , id_(random_id())
+{ }
+
+uint64_t ChangeLog::seq() const
+{
+    lock_t lock(mutex_);
+    return seq_;
+}
+
+void ChangeLog::setCapacity(size_t capacity)
+{
+    lock_t lock(mutex_);
+    capacity_ = capacity;
+    while (log_.size() > capacity_) {
+        log_.pop_front();
+    }
+}
+
+uint64_t ChangeLog::append(Change::Op op, std::string prefix,
+                           std::string key, std::string value)
+{
+    lock_t lock(mutex_);
+    ++seq_;
+    if (capacity_ == 0)
+        return seq_;
+
+    if (log_.size() == capacity_) {
+        log_.pop_front();
+    }
+    log_.push_back({ seq_, op, std::move(prefix),
+                     std::move(key), std::move(value) });
+    return seq_;
+}
+
+bool ChangeLog::since(uint64_t seq, std::vector<Change>& out,
+                      size_t max) const
+{
+    lock_t lock(mutex_);
+    if (seq > seq_)
+        return false;
+    if (seq == seq_)
+        return true;
+    if (log_.empty() || log_.front().seq > seq + 1)
+        return false;
+
+    auto it = log_.begin() + (seq + 1 - log_.front().seq);
+    for (; it != log_.end() && max > 0; ++it, --max) {
+        out.push_back(*it);
+    }
+    return true;
+}
+
+/* StateImage */
+
+void StateImage::apply(const Change& change)
+{
+    switch (change.op) {
+    case Change::Op::Put:
+        prefixes_[change.prefix][change.key] = change.value;
+        break;
+    case Change::Op::Delete: {
+        auto it = prefixes_.find(change.prefix);
+        if (it != prefixes_.end()) {
+            it->second.erase(change.key);
+            if (it->second.empty()) {
+                prefixes_.erase(it);
+            }
+        }
+        break;
+    }
+    case Change::Op::DeletePrefix: {
+        prefixes_.erase(change.prefix);
+        auto nested = change.prefix + ":";
+        auto it = prefixes_.lower_bound(nested);
+        while (it != prefixes_.end() &&
+               it->first.compare(0, nested.size(), nested) == 0) {
+            it = prefixes_.erase(it);
+        }
+        break;
+    }
+    case Change::Op::Clear:
+        prefixes_.clear();
+        break;
+    }
+}
+
+const std::string* StateImage::find(const std::string& prefix,
+                                    const std::string& key) const
+{
+    auto it = prefixes_.find(prefix);
+    if (it == prefixes_.end())
+        return nullptr;
+    auto value = it->second.find(key);
+    return value != it->second.end() ? &value->second : nullptr;
+}
+
+StateImage::Values StateImage::values(const std::string& prefix) const
+{
+    auto it = prefixes_.find(prefix);
+    return it != prefixes_.end() ? it->second : Values();
+}
+
+void StateImage::assign(const std::string& prefix, Values values)
+{
+    if (values.empty()) {
+        prefixes_.erase(prefix);
+    } else {
+        prefixes_[prefix] = std::move(values);
+    }
+}
+
+std::vector<std::string> StateImage::prefixes() const
+{
+    std::vector<std::string> ret;
+    ret.reserve(prefixes_.size());
+    for (auto& prefix : prefixes_) {
+        ret.push_back(prefix.first);
+    }
+    return ret;
+}
+
+size_t StateImage::size() const
+{
+    size_t ret = 0;
+    for (auto& prefix : prefixes_) {
+        ret += prefix.second.size();
+    }
+    return ret;
+}
+
+} // namespace runos
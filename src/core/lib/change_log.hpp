@@ -0,0 +1,98 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace runos {
+
+/**
+ * One state mutation made through DatabaseConnector.
+ * DeletePrefix removes a prefix with its nested "prefix:*" prefixes,
+ * Clear removes everything; both ignore key and value.
+ */
+struct Change {
+    enum class Op : uint8_t { Put, Delete, DeletePrefix, Clear };
+
+    uint64_t seq;
+    Op op;
+    std::string prefix;
+    std::string key;
+    std::string value;
+};
+
+/**
+ * Bounded append-only log of changes, numbered from 1.
+ *
+ * id() is random per log instance, so a reader holding a position in
+ * an earlier log (of a restarted primary) never takes it for this one.
+ * With zero capacity only the numbering advances.
+ */
+class ChangeLog {
+public:
+    explicit ChangeLog(size_t capacity = 0);
+
+    uint64_t id() const { return id_; }
+    uint64_t seq() const;
+
+    void setCapacity(size_t capacity);
+
+    uint64_t append(Change::Op op, std::string prefix,
+                    std::string key = std::string(),
+                    std::string value = std::string());
+
+    // Appends at most max changes following seq, false when some of
+    // them have already left the log or seq is ahead of it
+    bool since(uint64_t seq, std::vector<Change>& out, size_t max) const;
+
+private:
+    mutable std::mutex mutex_;
+    std::deque<Change> log_;
+    size_t capacity_;
+    uint64_t id_;
+    uint64_t seq_ {0};
+};
+
+/**
+ * In-memory image of the stored state: prefix -> key -> value.
+ * Not synchronized.
+ */
+class StateImage {
+public:
+    using Values = std::map<std::string, std::string>;
+
+    void apply(const Change& change);
+
+    const std::string* find(const std::string& prefix,
+                            const std::string& key) const;
+    Values values(const std::string& prefix) const;
+    // Replaces the values of the prefix, nested prefixes stay
+    void assign(const std::string& prefix, Values values);
+    std::vector<std::string> prefixes() const;
+    size_t size() const;
+
+private:
+    std::map<std::string, Values> prefixes_;
+};
+
+} // namespace runos
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "channel_counters.hpp"
+
+#include <cmath>
+#include <iterator> // size
+
+namespace runos {
+
+constexpr std::array<double, ChannelCounters::horizons>
+    ChannelCounters::horizon_seconds;
+
+void ChannelCounters::reset() noexcept
+{
+    for (auto& s : side_) {
+        s.messages.store(0, std::memory_order_relaxed);
+        s.bytes.store(0, std::memory_order_relaxed);
+        for (auto& t : s.by_type)
+            t.store(0, std::memory_order_relaxed);
+        for (size_t h = 0; h < horizons; ++h) {
+            s.message_rate[h].store(0.0, std::memory_order_relaxed);
+            s.byte_rate[h].store(0.0, std::memory_order_relaxed);
+        }
+    }
+    resets_.fetch_add(1, std::memory_order_release);
+}
+
+void ChannelCounters::tick(clock::time_point now) noexcept
+{
+    if (last_tick_ == clock::time_point{}) {
+        for (auto& s : side_) {
+            s.last_messages = s.messages.load(std::memory_order_relaxed);
+            s.last_bytes = s.bytes.load(std::memory_order_relaxed);
+        }
+        last_tick_ = now;
+        return;
+    }
+
+    double dt = std::chrono::duration<double>(now - last_tick_).count();
+    if (dt <= 0.0)
+        return;
+    last_tick_ = now;
+
+    // After reset() everything counted is new
+    uint64_t resets = resets_.load(std::memory_order_acquire);
+    bool was_reset = resets != seen_resets_;
+    seen_resets_ = resets;
+
+    for (auto& s : side_) {
+        if (was_reset)
+            s.last_messages = s.last_bytes = 0;
+        uint64_t messages = s.messages.load(std::memory_order_relaxed);
+        uint64_t bytes = s.bytes.load(std::memory_order_relaxed);
+        // a reset() racing with this tick
+        double message_rate = messages >= s.last_messages
+                            ? (messages - s.last_messages) / dt : 0.0;
+        double byte_rate = bytes >= s.last_bytes
+                         ? (bytes - s.last_bytes) / dt : 0.0;
+        s.last_messages = messages;
+        s.last_bytes = bytes;
+
+        // Weights by the time elapsed, so a late tick is no error
+        for (size_t h = 0; h < horizons; ++h) {
+            double alpha = 1.0 - std::exp(-dt / horizon_seconds[h]);
+            double m = s.message_rate[h].load(std::memory_order_relaxed);
+            double b = s.byte_rate[h].load(std::memory_order_relaxed);
+            s.message_rate[h].store(m + alpha * (message_rate - m),
+                                    std::memory_order_relaxed);
+            s.byte_rate[h].store(b + alpha * (byte_rate - b),
+                                 std::memory_order_relaxed);
+        }
+    }
+}
+
+auto ChannelCounters::read(direction d) const noexcept -> totals
+{
+    const auto& s = side_[d];
+    totals ret;
+    ret.messages = s.messages.load(std::memory_order_relaxed);
+    ret.bytes = s.bytes.load(std::memory_order_relaxed);
+    for (size_t t = 0; t < types; ++t)
+        ret.by_type[t] = s.by_type[t].load(std::memory_order_relaxed);
+    for (size_t h = 0; h < horizons; ++h) {
+        ret.rate.messages[h] = s.message_rate[h].load(std::memory_order_relaxed);
+        ret.rate.bytes[h] = s.byte_rate[h].load(std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+const char* ChannelCounters::type_name(uint8_t type) noexcept
+{
+    static const char* const names[] = {
+        "hello", "error", "echo_request", "echo_reply", "experimenter",
+        "features_request", "features_reply", "get_config_request",
+        "get_config_reply", "set_config", "packet_in", "flow_removed",
+        "port_status", "packet_out", "flow_mod", "group_mod", "port_mod",
+        "table_mod", "multipart_request", "multipart_reply",
+        "barrier_request", "barrier_reply", "queue_get_config_request",
+        "queue_get_config_reply", "role_request", "role_reply",
+        "get_async_request", "get_async_reply", "set_async", "meter_mod"
+    };
+    static_assert(std::size(names) == other_type, "one name per type");
+    return type < std::size(names) ? names[type] : "other";
+}
+
+} // namespace runos
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace runos {
+
+/**
+ * Traffic of one OpenFlow channel: messages and bytes each way, messages
+ * per type, and their recent rates.
+ *
+ * Counting is a few relaxed adds on the cache line of the direction, so
+ * receiving and sending threads don't share one, and is safe from any
+ * thread. Rates are EWMAs over 1, 10 and 60 seconds advanced by tick(),
+ * which a single thread calls about once a second.
+ */
+class ChannelCounters {
+public:
+    enum direction { rx, tx };
+
+    // OFPT_* of OpenFlow 1.3 and a last slot for unknown types
+    static constexpr size_t types = 31;
+    static constexpr size_t other_type = types - 1;
+
+    static constexpr size_t horizons = 3;
+    static constexpr std::array<double, horizons> horizon_seconds {1, 10, 60};
+
+    using clock = std::chrono::steady_clock;
+
+    void count(direction d, uint8_t type, size_t bytes) noexcept
+    {
+        auto& side = side_[d];
+        side.messages.fetch_add(1, std::memory_order_relaxed);
+        side.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        count_type(d, type);
+    }
+
+    // A message of `type` already counted as a message
+    void count_type(direction d, uint8_t type) noexcept
+    {
+        side_[d].by_type[type < other_type ? type : other_type]
+            .fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Zeroes the counts and rates
+    void reset() noexcept;
+    void tick(clock::time_point now) noexcept;
+
+    struct rates {
+        std::array<double, horizons> messages {}; // per second
+        std::array<double, horizons> bytes {};
+    };
+
+    struct totals {
+        uint64_t messages {0};
+        uint64_t bytes {0};
+        std::array<uint64_t, types> by_type {};
+        rates rate;
+    };
+
+    totals read(direction d) const noexcept;
+    uint64_t messages(direction d) const noexcept
+    { return side_[d].messages.load(std::memory_order_relaxed); }
+    uint64_t messages(direction d, uint8_t type) const noexcept
+    {
+        return side_[d].by_type[type < other_type ? type : other_type]
+            .load(std::memory_order_relaxed);
+    }
+
+    // "packet_in", "flow_mod", ... and "other"
+    static const char* type_name(uint8_t type) noexcept;
+
+private:
+    struct alignas(64) side {
+        std::atomic<uint64_t> messages {0};
+        std::atomic<uint64_t> bytes {0};
+        std::array<std::atomic<uint64_t>, types> by_type {};
+
+        // Written by tick() only
+        uint64_t last_messages {0};
+        uint64_t last_bytes {0};
+        std::array<std::atomic<double>, horizons> message_rate {};
+        std::array<std::atomic<double>, horizons> byte_rate {};
+    };
+    std::array<side, 2> side_;
+    std::atomic<uint64_t> resets_ {0};
+    uint64_t seen_resets_ {0};
+    clock::time_point last_tick_ {};
+};
+
+} // namespace runos
@@ -0,0 +1,231 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "content_coding.hpp"
+
+#include <runos/core/assert.hpp>
+
+#include <zlib.h>
+#ifdef RUNOS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <memory>
+
+namespace runos {
+
+namespace {
+
+std::string_view trim(std::string_view s)
+{
+    while (not s.empty() && std::isspace(uint8_t(s.front())))
+        s.remove_prefix(1);
+    while (not s.empty() && std::isspace(uint8_t(s.back())))
+        s.remove_suffix(1);
+    return s;
+}
+
+bool iequals(std::string_view a, std::string_view b)
+{
+    return a.size() == b.size() &&
+           std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+               return std::tolower(uint8_t(x)) == std::tolower(uint8_t(y));
+           });
+}
+
+// Output chunks filled by a streaming compressor
+class chunk_sink {
+public:
+    explicit chunk_sink(size_t chunk_size)
+        : m_chunk_size(std::max<size_t>(chunk_size, 1))
+    { }
+
+    // Free space at the end of the last chunk, a new one if it's full
+    std::pair<char*, size_t> space()
+    {
+        if (m_chunks.empty() || m_used == m_chunk_size) {
+            m_chunks.emplace_back(m_chunk_size, '\0');
+            m_used = 0;
+        }
+        return {&m_chunks.back()[m_used], m_chunk_size - m_used};
+    }
+
+    void commit(size_t n) { m_used += n; }
+
+    std::vector<std::string> release()
+    {
+        if (not m_chunks.empty())
+            m_chunks.back().resize(m_used);
+        return std::move(m_chunks);
+    }
+
+private:
+    size_t m_chunk_size;
+    size_t m_used = 0;
+    std::vector<std::string> m_chunks;
+};
+
+std::vector<std::string> gzip(const std::vector<std::string>& chunks,
+                              int level, size_t chunk_size)
+{
+    z_stream z {};
+    // 16 over the window bits asks for a gzip wrapper
+    int rc = deflateInit2(&z, std::clamp(level, 1, 9), Z_DEFLATED,
+                          15 + 16, 8, Z_DEFAULT_STRATEGY);
+    ASSERT(rc == Z_OK, "deflateInit2 failed");
+
+    chunk_sink out(chunk_size);
+    auto pump = [&](int flush) {
+        do {
+            auto space = out.space();
+            z.next_out = reinterpret_cast<Bytef*>(space.first);
+            z.avail_out = uInt(space.second);
+            rc = deflate(&z, flush);
+            out.commit(space.second - z.avail_out);
+        } while (z.avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+    };
+
+    for (const auto& chunk : chunks) {
+        z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(chunk.data()));
+        z.avail_in = uInt(chunk.size());
+        pump(Z_NO_FLUSH);
+    }
+    z.next_in = nullptr;
+    z.avail_in = 0;
+    pump(Z_FINISH);
+    deflateEnd(&z);
+    return out.release();
+}
+
+#ifdef RUNOS_HAVE_ZSTD
+std::vector<std::string> zstd(const std::vector<std::string>& chunks,
+                              int level, size_t chunk_size)
+{
+    std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)>
+        ctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+    ZSTD_CCtx_setParameter(ctx.get(), ZSTD_c_compressionLevel,
+                           std::clamp(level, 1, 19));
+
+    chunk_sink out(chunk_size);
+    auto pump = [&](const std::string* chunk, ZSTD_EndDirective mode) {
+        ZSTD_inBuffer in { chunk ? chunk->data() : nullptr,
+                           chunk ? chunk->size() : 0, 0 };
+        size_t remaining;
+        do {
+            auto space = out.space();
+            ZSTD_outBuffer buf { space.first, space.second, 0 };
+            remaining = ZSTD_compressStream2(ctx.get(), &buf, &in, mode);
+            ASSERT(not ZSTD_isError(remaining), ZSTD_getErrorName(remaining));
+            out.commit(buf.pos);
+        } while (in.pos < in.size || (mode == ZSTD_e_end && remaining != 0));
+    };
+
+    for (const auto& chunk : chunks)
+        pump(&chunk, ZSTD_e_continue);
+    pump(nullptr, ZSTD_e_end);
+    return out.release();
+}
+#endif
+
+} // namespace
+
+const char* coding_name(content_coding coding) noexcept
+{
+    switch (coding) {
+    case content_coding::gzip: return "gzip";
+    case content_coding::zstd: return "zstd";
+    default: return "";
+    }
+}
+
+bool coding_available(content_coding coding) noexcept
+{
+#ifdef RUNOS_HAVE_ZSTD
+    constexpr bool have_zstd = true;
+#else
+    constexpr bool have_zstd = false;
+#endif
+    return have_zstd || coding != content_coding::zstd;
+}
+
+double accept_quality(std::string_view header, std::string_view token,
+                      std::string_view wildcard)
+{
+    double wild = 0;
+    while (not header.empty()) {
+        auto comma = header.find(',');
+        auto item = header.substr(0, comma);
+        header.remove_prefix(comma == header.npos ? header.size() : comma + 1);
+
+        auto semi = item.find(';');
+        auto name = trim(item.substr(0, semi));
+        double q = 1;
+        while (semi != item.npos) {
+            item.remove_prefix(semi + 1);
+            semi = item.find(';');
+            auto param = trim(item.substr(0, semi));
+            if (param.size() > 2 && std::tolower(uint8_t(param[0])) == 'q'
+                                 && param[1] == '=')
+                q = std::strtod(std::string(param.substr(2)).c_str(), nullptr);
+        }
+
+        if (iequals(name, token))
+            return q;
+        if (not wildcard.empty() && name == wildcard)
+            wild = q;
+    }
+    return wild;
+}
+
+content_coding negotiate_coding(std::string_view accept_encoding)
+{
+    auto best = content_coding::identity;
+    // identity is acceptable unless refused outright
+    double best_q = accept_encoding.find("identity") == accept_encoding.npos
+                  ? 1e-3
+                  : accept_quality(accept_encoding, "identity", "");
+    for (auto coding : {content_coding::gzip, content_coding::zstd}) {
+        if (not coding_available(coding))
+            continue;
+        double q = accept_quality(accept_encoding, coding_name(coding), "*");
+        if (q > 0 && q >= best_q) {
+            best = coding;
+            best_q = q;
+        }
+    }
+    return best;
+}
+
+std::vector<std::string> compress(content_coding coding,
+                                  const std::vector<std::string>& chunks,
+                                  int level, size_t chunk_size)
+{
+    switch (coding) {
+    case content_coding::gzip:
+        return gzip(chunks, level, chunk_size);
+#ifdef RUNOS_HAVE_ZSTD
+    case content_coding::zstd:
+        return zstd(chunks, level, chunk_size);
+#endif
+    default:
+        return chunks;
+    }
+}
+
+} // namespace runos
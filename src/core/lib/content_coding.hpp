@@ -0,0 +1,56 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace runos {
+
+// HTTP content codings of a reply body
+enum class content_coding { identity, gzip, zstd };
+
+// "gzip", "zstd", empty for identity
+const char* coding_name(content_coding coding) noexcept;
+
+// zstd needs the build to have libzstd
+bool coding_available(content_coding coding) noexcept;
+
+/**
+ * q-value given to `token` by an Accept or Accept-Encoding header,
+ * with `wildcard` (`*`, or the media range of all types) standing for
+ * anything not listed. Tokens are compared case-insensitively; absent
+ * means 0.
+ */
+double accept_quality(std::string_view header, std::string_view token,
+                      std::string_view wildcard);
+
+// Available coding with the highest q-value, zstd winning ties over
+// gzip and both over identity
+content_coding negotiate_coding(std::string_view accept_encoding);
+
+/**
+ * Compresses a body given as chunks into chunks of about chunk_size,
+ * at the coding's own level scale (zlib 1-9, zstd 1-19).
+ * Identity returns a copy.
+ */
+std::vector<std::string> compress(content_coding coding,
+                                  const std::vector<std::string>& chunks,
+                                  int level, size_t chunk_size);
+
+} // namespace runos
@@ -0,0 +1,373 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <runos/core/catch_all.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Bounded queue of many producers and one consumer (D. Vyukov's
+ * design): every cell carries a sequence number, producers claim a
+ * cell with one CAS and the consumer never writes the tail, so neither
+ * side locks. Capacity is rounded up to a power of 2.
+ */
+template<class T>
+class bounded_mpsc {
+public:
+    explicit bounded_mpsc(size_t capacity)
+        : mask_(round_up(capacity) - 1)
+        , cells_(new cell[mask_ + 1])
+    {
+        for (size_t i = 0; i <= mask_; ++i) {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bounded_mpsc(bounded_mpsc const&) = delete;
+    bounded_mpsc& operator=(bounded_mpsc const&) = delete;
+
+    size_t capacity() const { return mask_ + 1; }
+
+    // Moves from `value` unless the queue is full
+    bool push(T& value)
+    {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            cell& c = cells_[pos & mask_];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            auto diff = intptr_t(seq) - intptr_t(pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed)) {
+                    c.value = std::move(value);
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer only
+    bool pop(T& value)
+    {
+        cell& c = cells_[head_ & mask_];
+        if (c.seq.load(std::memory_order_acquire) != head_ + 1)
+            return false;
+        value = std::move(c.value);
+        c.value = T(); // the cell doesn't keep what the value refers to
+        c.seq.store(head_ + mask_ + 1, std::memory_order_release);
+        ++head_;
+        return true;
+    }
+
+    // Consumer only
+    bool empty() const
+    {
+        return cells_[head_ & mask_].seq.load(std::memory_order_acquire)
+            != head_ + 1;
+    }
+
+private:
+    struct cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    static size_t round_up(size_t n)
+    {
+        size_t ret = 2;
+        while (ret < n)
+            ret <<= 1;
+        return ret;
+    }
+
+    const size_t mask_;
+    std::unique_ptr<cell[]> cells_;
+    alignas(64) std::atomic<size_t> tail_ {0};
+    alignas(64) size_t head_ {0};
+};
+
+/**
+ * Typed publish/subscribe of events between threads.
+ *
+ * Every subscriber owns a ring and a thread which hands the handler all
+ * events queued since its last wakeup, up to `batch` at once. publish()
+ * takes no lock: it reads the subscriber list by an atomic snapshot and
+ * pushes to each ring, locking only to wake a sleeping subscriber. A
+ * full ring makes the publisher wait for room, events are never lost.
+ *
+ * Publish order is explicit: every event gets the next sequence number.
+ * Events published by one thread reach every subscriber in that order;
+ * concurrent publishers may interleave differently for different
+ * subscribers, compare the numbers where it matters.
+ */
+template<class Event>
+class EventBus {
+public:
+    struct Stamped {
+        uint64_t seq {0};
+        Event event {};
+    };
+    // `count` events, oldest first; called on the subscriber's thread
+    using Handler = std::function<void(const Stamped* events, size_t count)>;
+
+    struct Stats {
+        std::string name;
+        uint64_t delivered;
+        uint64_t batches;
+        uint64_t stalls; // publishes which waited for room in the ring
+    };
+
+private:
+    class Subscriber;
+    using SubscriberPtr = std::shared_ptr<Subscriber>;
+    using SubscriberList = std::vector<SubscriberPtr>;
+
+    struct State {
+        std::mutex mutex; // writers of `subscribers`
+        std::shared_ptr<const SubscriberList> subscribers
+            = std::make_shared<SubscriberList>();
+        std::atomic<uint64_t> seq {0};
+
+        void remove(const SubscriberPtr& sub)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto list = std::make_shared<SubscriberList>();
+            for (auto& s : *std::atomic_load(&subscribers)) {
+                if (s != sub)
+                    list->push_back(s);
+            }
+            std::atomic_store(&subscribers,
+                              std::shared_ptr<const SubscriberList>(list));
+        }
+    };
+
+public:
+    // Unsubscribes on destruction: the rest of the ring is delivered
+    // and the thread joined. Don't destroy it from its own handler.
+    class Subscription {
+    public:
+        Subscription() = default;
+        Subscription(Subscription&&) noexcept = default;
+        Subscription& operator=(Subscription&& rhs) noexcept
+        {
+            if (this != &rhs) {
+                reset();
+                state_ = std::move(rhs.state_);
+                sub_ = std::move(rhs.sub_);
+            }
+            return *this;
+        }
+        ~Subscription() { reset(); }
+
+        void reset()
+        {
+            if (not sub_)
+                return;
+            if (auto state = state_.lock())
+                state->remove(sub_);
+            sub_->stop();
+            sub_.reset();
+        }
+
+    private:
+        friend class EventBus;
+        Subscription(std::weak_ptr<State> state, SubscriberPtr sub)
+            : state_(std::move(state)), sub_(std::move(sub))
+        { }
+
+        std::weak_ptr<State> state_;
+        SubscriberPtr sub_;
+    };
+
+    EventBus() = default;
+
+    // Stops the subscribers left, their handles become empty shells
+    ~EventBus()
+    {
+        for (auto& sub : *std::atomic_load(&state_->subscribers)) {
+            sub->stop();
+        }
+    }
+
+    EventBus(EventBus const&) = delete;
+    EventBus& operator=(EventBus const&) = delete;
+
+    Subscription subscribe(std::string name, Handler handler,
+                           size_t capacity = 1024, size_t batch = 64)
+    {
+        auto sub = std::make_shared<Subscriber>(std::move(name),
+                                                std::move(handler),
+                                                capacity, batch);
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            auto list = std::make_shared<SubscriberList>(
+                *std::atomic_load(&state_->subscribers));
+            list->push_back(sub);
+            std::atomic_store(&state_->subscribers,
+                              std::shared_ptr<const SubscriberList>(list));
+        }
+        return Subscription(state_, std::move(sub));
+    }
+
+    // Returns the sequence number of the event
+    uint64_t publish(Event event)
+    {
+        auto subscribers = std::atomic_load(&state_->subscribers);
+        uint64_t seq = ++state_->seq;
+        for (auto& sub : *subscribers) {
+            sub->push(Stamped{ seq, event });
+        }
+        return seq;
+    }
+
+    uint64_t published() const { return state_->seq; }
+
+    std::vector<Stats> stats() const
+    {
+        std::vector<Stats> ret;
+        for (auto& sub : *std::atomic_load(&state_->subscribers)) {
+            ret.push_back(Stats{ sub->name, sub->delivered, sub->batches,
+                                 sub->stalls });
+        }
+        return ret;
+    }
+
+private:
+    class Subscriber {
+    public:
+        Subscriber(std::string name, Handler handler,
+                   size_t capacity, size_t batch)
+            : name(std::move(name))
+            , handler_(std::move(handler))
+            , ring_(capacity)
+            , batch_(std::max<size_t>(batch, 1))
+            , thread_([this]() { run(); })
+        { }
+
+        ~Subscriber() { stop(); }
+
+        void push(Stamped event)
+        {
+            bool stalled = false;
+            while (not ring_.push(event)) {
+                if (stopping_)
+                    return;
+                stalled = true;
+                wake();
+                std::this_thread::yield();
+            }
+            if (stalled)
+                ++stalls;
+            // pairs with the fence in run(): either we see it sleeping
+            // or it sees the event
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sleeping_.load(std::memory_order_relaxed))
+                wake();
+        }
+
+        // Delivers what is queued, then joins the thread
+        void stop()
+        {
+            stopping_ = true;
+            wake();
+            std::lock_guard<std::mutex> lock(join_mutex_);
+            if (thread_.joinable())
+                thread_.join();
+        }
+
+        const std::string name;
+        std::atomic<uint64_t> delivered {0};
+        std::atomic<uint64_t> batches {0};
+        std::atomic<uint64_t> stalls {0};
+
+    private:
+        Handler handler_;
+        bounded_mpsc<Stamped> ring_;
+        const size_t batch_;
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::atomic_bool sleeping_ {false};
+        std::atomic_bool stopping_ {false};
+        std::mutex join_mutex_;
+        std::thread thread_; // last, starts running in the constructor
+
+        void wake()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sleeping_ = false;
+            cv_.notify_one();
+        }
+
+        void run()
+        {
+            std::vector<Stamped> events;
+            events.reserve(batch_);
+            for (;;) {
+                Stamped event;
+                while (events.size() < batch_ && ring_.pop(event)) {
+                    events.push_back(std::move(event));
+                }
+                if (not events.empty()) {
+                    catch_all_and_log([&]() {
+                        handler_(events.data(), events.size());
+                    });
+                    delivered += events.size();
+                    ++batches;
+                    events.clear();
+                    continue;
+                }
+                if (stopping_)
+                    return;
+
+                std::unique_lock<std::mutex> lock(mutex_);
+                sleeping_ = true;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (ring_.empty() && not stopping_) {
+                    cv_.wait(lock, [this]() {
+                        return not sleeping_ || stopping_;
+                    });
+                }
+                sleeping_ = false;
+            }
+        }
+    };
+
+    std::shared_ptr<State> state_ = std::make_shared<State>();
+};
+
+} // namespace runos
@@ -0,0 +1,203 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "event_loop_monitor.hpp"
+#include "metrics.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <boost/core/demangle.hpp>
+
+#include <memory>
+#include <mutex>
+
+namespace runos {
+
+namespace {
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+
+// Between warnings about long tasks of one site
+constexpr auto warning_period = std::chrono::seconds(10);
+
+std::atomic<int64_t> long_task_ns {0};
+thread_local std::atomic<EventLoopMonitor::site*>* running_here = nullptr;
+
+struct site_registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<EventLoopMonitor::site>> sites;
+};
+
+site_registry& registry()
+{
+    static site_registry instance;
+    return instance;
+}
+
+metrics::Histogram& run_time()
+{
+    static auto& h = metrics::Registry::global().histogram(
+        "runos_qt_task_seconds",
+        "Run time of closures submitted to application event loops");
+    return h;
+}
+
+metrics::Histogram& queue_delay()
+{
+    static auto& h = metrics::Registry::global().histogram(
+        "runos_qt_queue_delay_seconds",
+        "Time closures wait in the event queue before they run");
+    return h;
+}
+
+void update_max(std::atomic<uint64_t>& max, uint64_t value)
+{
+    auto current = max.load(std::memory_order_relaxed);
+    while (value > current &&
+           not max.compare_exchange_weak(current, value,
+                                         std::memory_order_relaxed))
+    { }
+}
+
+// "...<void, ns::Class::method(args)::{lambda()#1}>" -> the lambda with
+// the function it is defined in
+std::string site_name(std::string type)
+{
+    auto lambda = type.rfind("::{lambda");
+    if (lambda == std::string::npos)
+        return type;
+    auto end = type.find('}', lambda);
+    end = end == std::string::npos ? type.size() : end + 1;
+
+    size_t begin = lambda;
+    int depth = 0;
+    while (begin > 0) {
+        char c = type[begin - 1];
+        if (c == ')' || c == '>') {
+            ++depth;
+        } else if (c == '(' || c == '<') {
+            if (depth == 0)
+                break;
+            --depth;
+        } else if ((c == ',' || c == ' ') && depth == 0) {
+            break;
+        }
+        --begin;
+    }
+    return type.substr(begin, end - begin);
+}
+
+} // namespace
+
+EventLoopMonitor::site*
+EventLoopMonitor::register_site(const std::type_info& closure)
+{
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.sites.push_back(std::make_unique<site>(closure.name()));
+    return r.sites.back().get();
+}
+
+std::string EventLoopMonitor::name(const site* s)
+{
+    return site_name(boost::core::demangle(s->type));
+}
+
+void EventLoopMonitor::enable(milliseconds long_task)
+{
+    long_task_ns.store(duration_cast<nanoseconds>(long_task).count(),
+                       std::memory_order_relaxed);
+    // histograms are created before the first closure records to them
+    run_time();
+    queue_delay();
+    enabled_.store(true, std::memory_order_relaxed);
+}
+
+EventLoopMonitor::task::task(site* s, clock::time_point submitted) noexcept
+    : site_(s), submitted_(submitted)
+{
+    if (submitted_ == clock::time_point())
+        return;
+    started_ = clock::now();
+    if (running_here)
+        outer_ = running_here->exchange(site_, std::memory_order_relaxed);
+}
+
+EventLoopMonitor::task::~task()
+{
+    if (submitted_ == clock::time_point())
+        return;
+
+    auto now = clock::now();
+    if (running_here)
+        running_here->store(outer_, std::memory_order_relaxed);
+
+    auto ran = duration_cast<nanoseconds>(now - started_);
+    run_time().record(ran);
+    queue_delay().record(started_ - submitted_);
+
+    uint64_t ns = ran.count();
+    site_->count.fetch_add(1, std::memory_order_relaxed);
+    site_->total_ns.fetch_add(ns, std::memory_order_relaxed);
+    update_max(site_->max_ns, ns);
+
+    auto threshold = long_task_ns.load(std::memory_order_relaxed);
+    if (threshold <= 0 || int64_t(ns) < threshold)
+        return;
+
+    site_->long_tasks.fetch_add(1, std::memory_order_relaxed);
+    auto last = site_->last_warning.load(std::memory_order_relaxed);
+    auto ticks = now.time_since_epoch().count();
+    if (last != 0 && ticks - last <
+            clock::duration(warning_period).count())
+        return;
+    if (site_->last_warning.compare_exchange_strong(last, ticks,
+                                                    std::memory_order_relaxed)) {
+        LOG(WARNING) << "[EventLoopMonitor] Long task ("
+                     << duration_cast<milliseconds>(ran).count() << " ms, "
+                     << site_->long_tasks.load(std::memory_order_relaxed)
+                     << " so far) submitted from " << name(site_);
+    }
+}
+
+void EventLoopMonitor::watch_thread(std::atomic<site*>* running)
+{
+    running_here = running;
+}
+
+std::vector<EventLoopMonitor::site_info> EventLoopMonitor::sites()
+{
+    std::vector<site_info> ret;
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (const auto& s : r.sites) {
+        auto count = s->count.load(std::memory_order_relaxed);
+        if (count == 0)
+            continue;
+        ret.push_back(site_info{
+            name(s.get()), count,
+            nanoseconds(s->total_ns.load(std::memory_order_relaxed)),
+            nanoseconds(s->max_ns.load(std::memory_order_relaxed)),
+            s->long_tasks.load(std::memory_order_relaxed)
+        });
+    }
+    return ret;
+}
+
+} // namespace runos
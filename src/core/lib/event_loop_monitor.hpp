@@ -0,0 +1,104 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Accounts closures which qt_executor runs on application event loops.
+ *
+ * Every closure type is a call site: it names the function which
+ * submitted it. For each site the monitor keeps the number of runs,
+ * the time spent and the longest run, and exports histograms of run
+ * time and of the wait in the event queue. Runs longer than the long
+ * task threshold are counted and logged with their site.
+ *
+ * Disabled until enable() is called; then a closure costs two clock
+ * reads and a few relaxed atomics.
+ */
+class EventLoopMonitor {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct site {
+        explicit site(const char* type) : type(type) { }
+
+        const char* const type; // mangled closure type
+        std::atomic<uint64_t> count {0};
+        std::atomic<uint64_t> total_ns {0};
+        std::atomic<uint64_t> max_ns {0};
+        std::atomic<uint64_t> long_tasks {0};
+        std::atomic<int64_t> last_warning {0}; // clock ticks
+    };
+
+    struct site_info {
+        std::string name;
+        uint64_t count;
+        std::chrono::nanoseconds total;
+        std::chrono::nanoseconds max;
+        uint64_t long_tasks;
+    };
+
+    // Stable for the lifetime of the process, one per closure type
+    static site* register_site(const std::type_info& closure);
+    // Enclosing function and lambda of the closure type
+    static std::string name(const site* s);
+
+    static void enable(std::chrono::milliseconds long_task);
+    static bool enabled() noexcept
+    { return enabled_.load(std::memory_order_relaxed); }
+
+    // Submission time of a closure, epoch while disabled
+    static clock::time_point submitted() noexcept
+    { return enabled() ? clock::now() : clock::time_point(); }
+
+    // Accounts the closure run in its scope
+    class task {
+    public:
+        task(site* s, clock::time_point submitted) noexcept;
+        ~task();
+
+        task(const task&) = delete;
+        task& operator=(const task&) = delete;
+
+    private:
+        site* site_;
+        clock::time_point submitted_;
+        clock::time_point started_;
+        site* outer_ {nullptr};
+    };
+
+    // Called on an event loop thread: `running` gets the site of the
+    // closure running there, or null, so other threads can tell what
+    // blocks that loop
+    static void watch_thread(std::atomic<site*>* running);
+
+    static std::vector<site_info> sites();
+
+private:
+    static inline std::atomic<bool> enabled_ {false};
+};
+
+} // namespace runos
@@ -0,0 +1,177 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "event_trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+namespace runos {
+namespace trace {
+
+namespace {
+
+struct open_trace {
+    id trace;
+    clock::time_point last;
+};
+
+struct recorder {
+    std::atomic<bool> enabled {true};
+    std::atomic<id> next {1};
+
+    std::mutex mutex;
+    std::vector<record> ring = std::vector<record>(settings{}.capacity);
+    size_t head {0};  // next slot to write
+    size_t size {0};
+    clock::duration linger {settings{}.linger};
+    std::unordered_map<uint64_t, open_trace> subjects;
+
+    // with `mutex` held
+    void push(id trace, const char* stage, uint64_t arg, clock::time_point now)
+    {
+        if (ring.empty())
+            return;
+        ring[head] = record{trace, stage, arg, now};
+        head = (head + 1) % ring.size();
+        size = std::min(size + 1, ring.size());
+    }
+
+    // with `mutex` held, drops subjects whose trace went quiet
+    void expire(clock::time_point now)
+    {
+        for (auto it = subjects.begin(); it != subjects.end(); ) {
+            if (now - it->second.last > linger)
+                it = subjects.erase(it);
+            else
+                ++it;
+        }
+    }
+};
+
+recorder& global()
+{
+    static recorder ret;
+    return ret;
+}
+
+thread_local id current_trace = 0;
+
+} // namespace
+
+void configure(const settings& s)
+{
+    auto& r = global();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.enabled = s.enabled;
+    r.ring.assign(s.capacity, record{});
+    r.head = 0;
+    r.size = 0;
+    r.linger = s.linger;
+    r.subjects.clear();
+}
+
+bool enabled()
+{
+    return global().enabled.load(std::memory_order_relaxed);
+}
+
+id current()
+{
+    return current_trace;
+}
+
+scope::scope(id trace)
+    : saved_(current_trace)
+{
+    current_trace = trace;
+}
+
+scope::~scope()
+{
+    current_trace = saved_;
+}
+
+id start(const char* stage, uint64_t subject, uint64_t arg)
+{
+    auto& r = global();
+    if (not r.enabled.load(std::memory_order_relaxed))
+        return 0;
+
+    id trace = r.next.fetch_add(1, std::memory_order_relaxed);
+    auto now = clock::now();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    if (r.subjects.size() >= 256)
+        r.expire(now);
+    r.subjects[subject] = open_trace{trace, now};
+    r.push(trace, stage, arg, now);
+    return trace;
+}
+
+void mark(const char* stage, uint64_t arg)
+{
+    mark(current_trace, stage, arg);
+}
+
+void mark(id trace, const char* stage, uint64_t arg)
+{
+    if (trace == 0)
+        return;
+    auto& r = global();
+    auto now = clock::now();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.push(trace, stage, arg, now);
+}
+
+id mark_subject(const char* stage, uint64_t subject, uint64_t arg)
+{
+    auto& r = global();
+    if (not r.enabled.load(std::memory_order_relaxed))
+        return 0;
+
+    auto now = clock::now();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    id trace = current_trace;
+    auto it = r.subjects.find(subject);
+    if (trace == 0 && it != r.subjects.end() &&
+            now - it->second.last <= r.linger) {
+        trace = it->second.trace;
+    }
+    if (trace == 0)
+        return 0;
+    if (it != r.subjects.end() && it->second.trace == trace)
+        it->second.last = now;
+    r.push(trace, stage, arg, now);
+    return trace;
+}
+
+std::vector<record> recent()
+{
+    auto& r = global();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    std::vector<record> ret;
+    ret.reserve(r.size);
+    size_t first = (r.head + r.ring.size() - r.size) % std::max<size_t>(r.ring.size(), 1);
+    for (size_t i = 0; i < r.size; ++i)
+        ret.push_back(r.ring[(first + i) % r.ring.size()]);
+    return ret;
+}
+
+} // namespace trace
+} // namespace runos
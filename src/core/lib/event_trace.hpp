@@ -0,0 +1,98 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Causal traces of events that cross threads and signals, like a port
+ * going down until the FlowMods of the failover leave for the switches.
+ *
+ * start() opens a trace where the cause enters and mark() adds its later
+ * stages; every stage is a (trace, stage, arg, time) record in one ring
+ * of the most recent records. The trace id travels in a thread-local
+ * context: a scope sets it for its thread, qt_executor tasks run in the
+ * context of their submitter. Queued Qt signals can't carry it, so the
+ * receiving side finds the trace by its subject instead, a key both
+ * sides know (the port, see port_subject()). A subject refers to its
+ * last trace for `linger` after that trace's last stage.
+ *
+ * Stage names must be string literals. Records are taken under a mutex,
+ * which is fine for the rate of topology events, not for packets.
+ */
+namespace trace {
+
+using clock = std::chrono::steady_clock;
+using id = uint64_t; // 0 means no trace
+
+struct settings {
+    bool enabled {true};
+    size_t capacity {4096}; // records kept
+    std::chrono::milliseconds linger {2000};
+};
+void configure(const settings& s);
+bool enabled();
+
+inline uint64_t port_subject(uint64_t dpid, uint32_t port_no)
+{
+    return (dpid << 32) ^ port_no;
+}
+
+// Trace of the calling thread, 0 if none
+id current();
+
+// Makes `trace` current until the end of the scope
+class scope {
+public:
+    explicit scope(id trace);
+    ~scope();
+
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+private:
+    id saved_;
+};
+
+// New trace of `subject` with `stage` as its first record
+id start(const char* stage, uint64_t subject, uint64_t arg = 0);
+// Adds a stage to the current trace, no-op if there's none
+void mark(const char* stage, uint64_t arg = 0);
+// Adds a stage to `trace`, no-op if 0
+void mark(id trace, const char* stage, uint64_t arg = 0);
+// Adds a stage to the current trace, or to the open trace of `subject`
+// if there's no current one. Returns the trace, 0 if none was found.
+id mark_subject(const char* stage, uint64_t subject, uint64_t arg = 0);
+
+struct record {
+    id trace;
+    const char* stage;
+    uint64_t arg;
+    clock::time_point time;
+};
+
+// Records in the ring, oldest first
+std::vector<record> recent();
+
+} // namespace trace
+
+} // namespace runos
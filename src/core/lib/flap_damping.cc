@@ -0,0 +1,101 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "flap_damping.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace runos {
+
+using std::chrono::duration;
+using std::chrono::duration_cast;
+
+// Penalty which decays to `reuse` in `max_suppress`
+double flap_damping::ceiling() const
+{
+    double periods = duration<double>(m_settings.max_suppress)
+                   / duration<double>(m_settings.half_life);
+    return m_settings.reuse * std::exp2(periods);
+}
+
+void flap_damping::decay(clock::time_point now)
+{
+    if (m_settings.half_life.count() <= 0) {
+        m_penalty = 0;
+    } else if (m_penalty > 0 && now > m_decayed_at) {
+        double periods = duration<double>(now - m_decayed_at)
+                       / duration<double>(m_settings.half_life);
+        m_penalty *= std::exp2(-periods);
+    }
+    m_decayed_at = std::max(m_decayed_at, now);
+
+    if (m_suppressed && m_penalty < m_settings.reuse)
+        m_suppressed = false;
+}
+
+bool flap_damping::update(bool state, clock::time_point now)
+{
+    if (state == m_actual)
+        return false;
+    m_actual = state;
+
+    decay(now);
+    if (m_settings.half_life.count() > 0) {
+        m_penalty = std::min(m_penalty + m_settings.penalty, ceiling());
+        if (m_penalty > m_settings.suppress)
+            m_suppressed = true;
+    }
+    return poll(now);
+}
+
+bool flap_damping::poll(clock::time_point now)
+{
+    decay(now);
+    if (m_suppressed || m_actual == m_announced)
+        return false;
+    if (m_announced_at && now < *m_announced_at + m_settings.window)
+        return false;
+
+    m_announced = m_actual;
+    m_announced_at = now;
+    return true;
+}
+
+void flap_damping::reset(bool state, clock::time_point now)
+{
+    m_actual = m_announced = state;
+    m_announced_at = now;
+}
+
+auto flap_damping::deadline() const -> std::optional<clock::time_point>
+{
+    if (m_actual == m_announced)
+        return std::nullopt;
+
+    auto when = m_decayed_at;
+    if (m_suppressed) {
+        auto periods = std::log2(m_penalty / m_settings.reuse);
+        when += duration_cast<clock::duration>(
+                    m_settings.half_life * std::max(periods, 0.0));
+    }
+    if (m_announced_at)
+        when = std::max(when, *m_announced_at + m_settings.window);
+    return when;
+}
+
+} // namespace runos
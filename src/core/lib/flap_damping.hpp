@@ -0,0 +1,84 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <optional>
+
+namespace runos {
+
+/**
+ * Damping of a flapping boolean state, in the spirit of BGP route flap
+ * damping (RFC 2439).
+ *
+ * Every change of the actual state adds `penalty`, which decays
+ * exponentially with `half_life`. While the penalty stays above
+ * `suppress` the announced state is frozen, until it decays below
+ * `reuse` (but at most `max_suppress` after the last change). Outside
+ * of suppression changes are announced at most once per `window`:
+ * the first one immediately, the rest collapse into one net transition
+ * at the end of the window, or into nothing if the state came back.
+ *
+ * Not thread safe.
+ */
+class flap_damping {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct settings {
+        std::chrono::milliseconds window{0};
+        std::chrono::milliseconds half_life{0}; // zero disables suppression
+        std::chrono::milliseconds max_suppress{60000};
+        double penalty{1000};
+        double suppress{2000};
+        double reuse{750};
+    };
+
+    flap_damping(bool state, settings s)
+        : m_settings(s), m_actual(state), m_announced(state)
+    { }
+
+    // Returns true if the announced state changed right away
+    bool update(bool state, clock::time_point now);
+    // Re-evaluates a pending change, returns true if it was announced
+    bool poll(clock::time_point now);
+    // Sets both states bypassing the damping (e.g. switch disconnect)
+    void reset(bool state, clock::time_point now);
+
+    // When poll() should be called next, if a change is pending
+    std::optional<clock::time_point> deadline() const;
+
+    bool announced() const { return m_announced; }
+    bool actual() const { return m_actual; }
+    bool suppressed() const { return m_suppressed; }
+    double penalty() const { return m_penalty; }
+
+private:
+    settings m_settings;
+    bool m_actual;
+    bool m_announced;
+    bool m_suppressed {false};
+    double m_penalty {0};
+    clock::time_point m_decayed_at {};
+    std::optional<clock::time_point> m_announced_at;
+
+    void decay(clock::time_point now);
+    double ceiling() const;
+};
+
+} // namespace runos
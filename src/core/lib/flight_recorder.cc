@@ -0,0 +1,442 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flight_recorder.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
+
+namespace runos {
+namespace flight {
+
+namespace detail {
+std::atomic<int64_t> lock_wait_ns {
+    std::chrono::nanoseconds(settings{}.lock_wait).count()};
+}
+
+namespace {
+
+constexpr size_t max_rings = 512;
+constexpr size_t max_names = 256;
+constexpr size_t name_size = 32;
+constexpr size_t path_size = 256;
+// Records between refreshes of the thread name
+constexpr uint64_t rename_every = 4096;
+
+// Per-slot seqlock: odd while the slot is written, 2 * (pos + 1) after
+struct slot {
+    std::atomic<uint64_t> seq {0};
+    std::atomic<uint64_t> time {0};
+    std::atomic<uint64_t> subject {0};
+    std::atomic<uint64_t> packed {0}; // arg << 32 | code << 8 | kind
+};
+
+struct ring {
+    explicit ring(size_t capacity)
+        : slots(new slot[capacity])
+        , mask(capacity - 1)
+    { }
+
+    const std::unique_ptr<slot[]> slots;
+    const uint64_t mask;
+
+    alignas(64) std::atomic<uint64_t> head {0}; // written by the owner
+    std::atomic<uint64_t> start {0}; // of the current owner
+    std::atomic<bool> owned {true};
+    std::atomic<int> tid {0};
+    std::atomic<uint64_t> name[2] {{0}, {0}}; // 15 chars and NUL
+
+    size_t capacity() const { return mask + 1; }
+
+    void rename()
+    {
+        char buf[16] = {};
+#ifdef __linux__
+        prctl(PR_GET_NAME, buf, 0, 0, 0);
+#endif
+        uint64_t words[2];
+        memcpy(words, buf, sizeof(words));
+        name[0].store(words[0], std::memory_order_relaxed);
+        name[1].store(words[1], std::memory_order_relaxed);
+    }
+
+    void read_name(char (&buf)[16]) const
+    {
+        uint64_t words[2] = {name[0].load(std::memory_order_relaxed),
+                             name[1].load(std::memory_order_relaxed)};
+        memcpy(buf, words, sizeof(words));
+        buf[15] = '\0';
+    }
+};
+
+void set_path(char (&path)[path_size], const std::string& value)
+{
+    size_t len = std::min(value.size(), path_size - 1);
+    memcpy(path, value.data(), len);
+    path[len] = '\0';
+}
+
+struct recorder {
+    recorder() { set_path(path, settings{}.dump_path); }
+
+    std::atomic<bool> enabled {true};
+    std::atomic<size_t> capacity {settings{}.capacity};
+
+    // Append-only, so crash handlers can walk them without locks
+    std::atomic<ring*> rings[max_rings] {};
+    std::atomic<size_t> nrings {0};
+    std::mutex rings_mutex; // of adding rings
+
+    char names[max_names][name_size] {};
+    std::atomic<size_t> nnames {1}; // 0 is no name
+    std::mutex names_mutex;
+
+    char path[path_size] {};
+};
+
+recorder& global()
+{
+    static recorder ret;
+    return ret;
+}
+
+size_t round_up(size_t n)
+{
+    size_t ret = 16;
+    while (ret < n)
+        ret <<= 1;
+    return ret;
+}
+
+int current_tid()
+{
+#ifdef __linux__
+    return int(syscall(SYS_gettid));
+#else
+    return 0;
+#endif
+}
+
+// Gives the ring up when its thread ends
+struct owner {
+    ring* r {nullptr};
+    ~owner()
+    {
+        if (r)
+            r->owned.store(false, std::memory_order_release);
+    }
+};
+
+thread_local ring* current_ring = nullptr;
+thread_local bool no_ring = false; // every ring is taken
+thread_local owner current_owner;
+
+ring* acquire()
+{
+    auto& g = global();
+    std::lock_guard<std::mutex> lock(g.rings_mutex);
+
+    ring* r = nullptr;
+    size_t n = g.nrings.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < n && not r; ++i) {
+        ring* candidate = g.rings[i].load(std::memory_order_relaxed);
+        bool free = false;
+        if (candidate->owned.compare_exchange_strong(free, true,
+                std::memory_order_acq_rel)) {
+            r = candidate;
+            r->start.store(r->head.load(std::memory_order_relaxed),
+                           std::memory_order_relaxed);
+        }
+    }
+    if (not r) {
+        if (n == max_rings)
+            return nullptr;
+        r = new ring(round_up(g.capacity.load(std::memory_order_relaxed)));
+        g.rings[n].store(r, std::memory_order_release);
+        g.nrings.store(n + 1, std::memory_order_release);
+    }
+    r->tid.store(current_tid(), std::memory_order_relaxed);
+    r->rename();
+    current_owner.r = r;
+    return r;
+}
+
+void unpack(uint64_t packed, kind& what, uint16_t& code, uint32_t& arg)
+{
+    what = kind(packed & 0xff);
+    code = uint16_t(packed >> 8);
+    arg = uint32_t(packed >> 32);
+}
+
+// Copies the events of `r` still in its ring, oldest first
+template <class F>
+void for_each_event(const ring& r, F&& f)
+{
+    uint64_t head = r.head.load(std::memory_order_acquire);
+    uint64_t first = std::max(r.start.load(std::memory_order_relaxed),
+                              head > r.capacity() ? head - r.capacity() : 0);
+    for (uint64_t pos = first; pos < head; ++pos) {
+        const slot& s = r.slots[pos & r.mask];
+        uint64_t seq = s.seq.load(std::memory_order_acquire);
+        uint64_t time = s.time.load(std::memory_order_relaxed);
+        uint64_t subject = s.subject.load(std::memory_order_relaxed);
+        uint64_t packed = s.packed.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq != 2 * (pos + 1) ||
+                s.seq.load(std::memory_order_relaxed) != seq)
+            continue; // overwritten meanwhile
+        f(time, subject, packed);
+    }
+}
+
+// Text output with write(2) only, for crash handlers
+class writer {
+public:
+    explicit writer(int fd) : fd_(fd) { }
+    ~writer() { flush(); }
+
+    writer& operator<<(const char* s)
+    {
+        while (*s)
+            put(*s++);
+        return *this;
+    }
+
+    writer& operator<<(uint64_t n)
+    {
+        char digits[20];
+        size_t len = 0;
+        do {
+            digits[len++] = char('0' + n % 10);
+            n /= 10;
+        } while (n);
+        while (len)
+            put(digits[--len]);
+        return *this;
+    }
+
+    void flush()
+    {
+        size_t done = 0;
+        while (done < size_) {
+            ssize_t ret = ::write(fd_, buf_ + done, size_ - done);
+            if (ret <= 0)
+                break;
+            done += size_t(ret);
+        }
+        size_ = 0;
+    }
+
+private:
+    void put(char c)
+    {
+        if (size_ == sizeof(buf_))
+            flush();
+        buf_[size_++] = c;
+    }
+
+    int fd_;
+    char buf_[4096];
+    size_t size_ {0};
+};
+
+uint64_t to_ns(clock::time_point time)
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        time.time_since_epoch()).count());
+}
+
+bool named(kind what)
+{
+    return what == kind::queue_depth || what == kind::lock_wait ||
+           what == kind::timer_overrun;
+}
+
+} // namespace
+
+const char* kind_name(kind k)
+{
+    switch (k) {
+    case kind::message_received: return "message_received";
+    case kind::message_dispatched: return "message_dispatched";
+    case kind::queue_depth: return "queue_depth";
+    case kind::lock_wait: return "lock_wait";
+    case kind::timer_overrun: return "timer_overrun";
+    case kind::none: break;
+    }
+    return "none";
+}
+
+void configure(const settings& s)
+{
+    auto& g = global();
+    g.enabled = s.enabled;
+    g.capacity = std::max<size_t>(s.capacity, 1);
+    detail::lock_wait_ns = std::chrono::nanoseconds(s.lock_wait).count();
+
+    std::lock_guard<std::mutex> lock(g.rings_mutex);
+    set_path(g.path, s.dump_path);
+}
+
+bool enabled()
+{
+    return global().enabled.load(std::memory_order_relaxed);
+}
+
+uint16_t intern(const char* name)
+{
+    auto& g = global();
+    std::lock_guard<std::mutex> lock(g.names_mutex);
+    size_t n = g.nnames.load(std::memory_order_relaxed);
+    for (size_t i = 1; i < n; ++i) {
+        if (strncmp(g.names[i], name, name_size - 1) == 0)
+            return uint16_t(i);
+    }
+    if (n == max_names)
+        return 0;
+    strncpy(g.names[n], name, name_size - 1);
+    g.nnames.store(n + 1, std::memory_order_release);
+    return uint16_t(n);
+}
+
+const char* name(uint16_t code)
+{
+    auto& g = global();
+    if (code == 0 || code >= g.nnames.load(std::memory_order_acquire))
+        return "";
+    return g.names[code];
+}
+
+void record(kind k, uint16_t code, uint64_t subject, uint32_t arg)
+{
+    auto& g = global();
+    if (not g.enabled.load(std::memory_order_relaxed))
+        return;
+
+    ring* r = current_ring;
+    if (not r) {
+        if (no_ring)
+            return;
+        r = current_ring = acquire();
+        if (not r) {
+            no_ring = true;
+            return;
+        }
+    }
+
+    uint64_t pos = r->head.load(std::memory_order_relaxed);
+    slot& s = r->slots[pos & r->mask];
+    s.seq.store(2 * pos + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s.time.store(to_ns(clock::now()), std::memory_order_relaxed);
+    s.subject.store(subject, std::memory_order_relaxed);
+    s.packed.store(uint64_t(arg) << 32 | uint64_t(code) << 8 | uint8_t(k),
+                   std::memory_order_relaxed);
+    s.seq.store(2 * (pos + 1), std::memory_order_release);
+    r->head.store(pos + 1, std::memory_order_release);
+
+    if ((pos + 1) % rename_every == 0)
+        r->rename();
+}
+
+std::vector<thread_events> recent()
+{
+    auto& g = global();
+    std::vector<thread_events> ret;
+    size_t n = g.nrings.load(std::memory_order_acquire);
+    for (size_t i = 0; i < n; ++i) {
+        const ring& r = *g.rings[i].load(std::memory_order_acquire);
+        char buf[16];
+        r.read_name(buf);
+
+        thread_events t;
+        t.tid = r.tid.load(std::memory_order_relaxed);
+        t.name = buf;
+        t.alive = r.owned.load(std::memory_order_acquire);
+        t.recorded = r.head.load(std::memory_order_relaxed) -
+                     r.start.load(std::memory_order_relaxed);
+        t.events.reserve(std::min<uint64_t>(t.recorded, r.capacity()));
+        for_each_event(r, [&](uint64_t time, uint64_t subject, uint64_t packed) {
+            event e;
+            e.time = clock::time_point(std::chrono::duration_cast<
+                clock::duration>(std::chrono::nanoseconds(time)));
+            e.subject = subject;
+            unpack(packed, e.what, e.code, e.arg);
+            t.events.push_back(e);
+        });
+        ret.push_back(std::move(t));
+    }
+    return ret;
+}
+
+void dump(int fd)
+{
+    auto& g = global();
+    writer out(fd);
+    // clock::now() is a vDSO call here, not a lock
+    const uint64_t now = to_ns(clock::now());
+    out << "flight-recorder pid=" << uint64_t(getpid())
+        << " now_ns=" << now << "\n";
+
+    size_t n = g.nrings.load(std::memory_order_acquire);
+    for (size_t i = 0; i < n; ++i) {
+        const ring& r = *g.rings[i].load(std::memory_order_acquire);
+        char buf[16];
+        r.read_name(buf);
+        out << "thread tid=" << uint64_t(r.tid.load(std::memory_order_relaxed))
+            << " name=" << buf
+            << " alive=" << uint64_t(r.owned.load(std::memory_order_acquire))
+            << " recorded=" << (r.head.load(std::memory_order_relaxed) -
+                                r.start.load(std::memory_order_relaxed))
+            << "\n";
+        for_each_event(r, [&](uint64_t time, uint64_t subject, uint64_t packed) {
+            kind what;
+            uint16_t code;
+            uint32_t arg;
+            unpack(packed, what, code, arg);
+            out << "  -" << (now > time ? (now - time) / 1000 : 0) << "us "
+                << kind_name(what) << " code=" << uint64_t(code);
+            if (named(what))
+                out << " (" << name(code) << ")";
+            out << " subject=" << subject << " arg=" << uint64_t(arg) << "\n";
+        });
+    }
+}
+
+bool dump()
+{
+    auto& g = global();
+    if (g.path[0] == '\0')
+        return false;
+    int fd = ::open(g.path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    dump(fd);
+    ::close(fd);
+    return true;
+}
+
+} // namespace flight
+} // namespace runos
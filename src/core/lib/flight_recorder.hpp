@@ -0,0 +1,156 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Always-on flight recorder: what the controller did just before it
+ * stalled or crashed.
+ *
+ * Every thread records into a ring of its own, created on its first
+ * event; a record is three relaxed stores and a clock read, no locks and
+ * no allocations. A full ring overwrites its oldest records. Rings
+ * outlive their threads and are reused by threads started later, so
+ * the last events of a dead thread stay until then.
+ *
+ * Events carry a 16-bit code (the OpenFlow type of messages, the
+ * intern()ed name of a site for the others), a 64-bit subject and a
+ * 32-bit argument. dump() writes all rings as text using only
+ * async-signal-safe calls, it runs from crash handlers.
+ */
+namespace flight {
+
+using clock = std::chrono::steady_clock;
+
+enum class kind : uint8_t {
+    none = 0,
+    message_received,   // code: type, subject: dpid, arg: length
+    message_dispatched, // code: type, subject: dpid, arg: microseconds
+    queue_depth,        // code: queue, subject: key, arg: tasks taken
+    lock_wait,          // code: lock, arg: microseconds waited
+    timer_overrun       // code: timer, subject: ticks skipped, arg: us late
+};
+const char* kind_name(kind k);
+
+struct settings {
+    bool enabled {true};
+    size_t capacity {4096};  // records per thread, rounded up to 2^n
+    std::chrono::microseconds lock_wait {1000}; // recorded from
+    std::string dump_path {"flight-recorder.txt"};
+};
+void configure(const settings& s);
+bool enabled();
+
+// Stable code of a site name, 0 once the table is full
+uint16_t intern(const char* name);
+const char* name(uint16_t code);
+
+void record(kind k, uint16_t code, uint64_t subject, uint32_t arg);
+
+// Records the event at the end of the scope, its time as the argument
+class timed {
+public:
+    timed(kind what, uint16_t code, uint64_t subject)
+        : what_(what), code_(code), subject_(subject)
+        , begin_(enabled() ? clock::now() : clock::time_point())
+    { }
+    ~timed()
+    {
+        if (begin_ == clock::time_point())
+            return;
+        record(what_, code_, subject_, uint32_t(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                clock::now() - begin_).count()));
+    }
+
+    timed(const timed&) = delete;
+    timed& operator=(const timed&) = delete;
+
+private:
+    kind what_;
+    uint16_t code_;
+    uint64_t subject_;
+    clock::time_point begin_;
+};
+
+namespace detail {
+extern std::atomic<int64_t> lock_wait_ns;
+}
+
+// Locks `mutex`, recording the wait under `code` when it is long.
+// An uncontended lock costs one try_lock more than lock().
+template <class Mutex>
+void lock(Mutex& mutex, uint16_t code)
+{
+    if (mutex.try_lock())
+        return;
+    auto begin = clock::now();
+    mutex.lock();
+    auto waited = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        clock::now() - begin).count();
+    if (waited >= detail::lock_wait_ns.load(std::memory_order_relaxed)) {
+        record(kind::lock_wait, code, 0, uint32_t(waited / 1000));
+    }
+}
+
+// std::lock_guard with the wait recorded
+template <class Mutex>
+class lock_guard {
+public:
+    lock_guard(Mutex& mutex, uint16_t code)
+        : mutex_(mutex)
+    { flight::lock(mutex_, code); }
+    ~lock_guard() { mutex_.unlock(); }
+
+    lock_guard(const lock_guard&) = delete;
+    lock_guard& operator=(const lock_guard&) = delete;
+
+private:
+    Mutex& mutex_;
+};
+
+struct event {
+    clock::time_point time;
+    kind what;
+    uint16_t code;
+    uint64_t subject;
+    uint32_t arg;
+};
+
+struct thread_events {
+    int tid;
+    std::string name;
+    bool alive;
+    uint64_t recorded; // overwritten ones included
+    std::vector<event> events; // oldest first
+};
+std::vector<thread_events> recent();
+
+// Writes all rings to `fd` / to the configured dump path
+void dump(int fd);
+bool dump();
+
+} // namespace flight
+
+} // namespace runos
@@ -0,0 +1,228 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flow_mod_batch.hpp"
+
+#include <runos/core/assert.hpp>
+
+#include <fluid/of13msg.hh>
+#include <boost/endian/arithmetic.hpp>
+
+#include <cstring>
+
+namespace runos {
+
+using namespace boost::endian;
+namespace of13 = fluid_msg::of13;
+
+namespace {
+
+struct ofp_flow_mod {
+    big_uint8_t version;
+    big_uint8_t type;
+    big_uint16_t length;
+    big_uint32_t xid;
+    big_uint64_t cookie;
+    big_uint64_t cookie_mask;
+    big_uint8_t table_id;
+    big_uint8_t command;
+    big_uint16_t idle_timeout;
+    big_uint16_t hard_timeout;
+    big_uint16_t priority;
+    big_uint32_t buffer_id;
+    big_uint32_t out_port;
+    big_uint32_t out_group;
+    big_uint16_t flags;
+    uint8_t pad[2];
+};
+static_assert(sizeof(ofp_flow_mod) == 48, "ofp_flow_mod layout");
+
+struct ofp_match_header {
+    big_uint16_t type;
+    big_uint16_t length;
+};
+
+constexpr size_t padded(size_t len) { return (len + 7) & ~size_t(7); }
+
+// Released buffers of this thread, reused by the next batches
+struct buffer_pool {
+    static constexpr size_t max_cached = 4;
+    std::vector<std::vector<uint8_t>> free;
+
+    std::vector<uint8_t> take()
+    {
+        if (free.empty())
+            return {};
+        auto ret = std::move(free.back());
+        free.pop_back();
+        return ret;
+    }
+
+    void give(std::vector<uint8_t>&& buf)
+    {
+        if (free.size() < max_cached && buf.capacity() > 0) {
+            buf.clear();
+            free.push_back(std::move(buf));
+        }
+    }
+};
+
+buffer_pool& pool()
+{
+    static thread_local buffer_pool ret;
+    return ret;
+}
+
+} // namespace
+
+FlowModBatch::FlowModBatch()
+    : buf_(pool().take())
+{ }
+
+FlowModBatch::~FlowModBatch()
+{
+    pool().give(std::move(buf_));
+}
+
+uint8_t* FlowModBatch::grow(size_t len)
+{
+    size_t pos = buf_.size();
+    buf_.resize(pos + len);
+    return buf_.data() + pos;
+}
+
+FlowModBatch& FlowModBatch::add(const header& h)
+{
+    close();
+    offsets_.push_back(buf_.size());
+
+    auto fm = reinterpret_cast<ofp_flow_mod*>(grow(sizeof(ofp_flow_mod)));
+    fm->version = of13::OFP_VERSION;
+    fm->type = of13::OFPT_FLOW_MOD;
+    fm->length = 0; // set by close()
+    fm->xid = 0;
+    fm->cookie = h.cookie;
+    fm->cookie_mask = h.cookie_mask;
+    fm->table_id = h.table_id;
+    fm->command = h.command;
+    fm->idle_timeout = h.idle_timeout;
+    fm->hard_timeout = h.hard_timeout;
+    fm->priority = h.priority;
+    fm->buffer_id = h.buffer_id;
+    fm->out_port = h.out_port;
+    fm->out_group = h.out_group;
+    fm->flags = h.flags;
+    std::memset(fm->pad, 0, sizeof(fm->pad));
+
+    match_ = buf_.size();
+    auto m = reinterpret_cast<ofp_match_header*>(grow(sizeof(ofp_match_header)));
+    m->type = of13::OFPMT_OXM;
+    m->length = 0; // set by close_match()
+    section_ = section::match;
+    return *this;
+}
+
+FlowModBatch& FlowModBatch::oxm(const of13::OXMTLV& cfield)
+{
+    RUNOS_ASSERT(section_ == section::match, "Match fields go before instructions");
+    auto& field = const_cast<of13::OXMTLV&>(cfield);
+    field.pack(grow(of13::OFP_OXM_HEADER_LEN + field.length()));
+    return *this;
+}
+
+uint8_t* FlowModBatch::oxm_space(size_t len)
+{
+    RUNOS_ASSERT(section_ == section::match, "Match fields go before instructions");
+    return grow(len);
+}
+
+FlowModBatch& FlowModBatch::match(const of13::Match& cm)
+{
+    RUNOS_ASSERT(section_ == section::match &&
+                 buf_.size() == match_ + sizeof(ofp_match_header),
+                 "Prepared match replaces all match fields");
+    auto& m = const_cast<of13::Match&>(cm);
+    buf_.resize(match_);
+    m.pack(grow(padded(m.length()))); // pads by itself
+    section_ = section::instructions;
+    return *this;
+}
+
+FlowModBatch& FlowModBatch::instruction(const of13::Instruction& ci)
+{
+    RUNOS_ASSERT(section_ != section::none, "Instruction before any flow mod");
+    close_match();
+    auto& i = const_cast<of13::Instruction&>(ci);
+    i.pack(grow(i.length()));
+    return *this;
+}
+
+uint8_t* FlowModBatch::instruction_space(size_t len)
+{
+    RUNOS_ASSERT(section_ != section::none, "Instruction before any flow mod");
+    close_match();
+    return grow(len);
+}
+
+void FlowModBatch::close_match()
+{
+    if (section_ != section::match)
+        return;
+    size_t len = buf_.size() - match_;
+    reinterpret_cast<ofp_match_header*>(buf_.data() + match_)->length = len;
+    std::memset(grow(padded(len) - len), 0, padded(len) - len);
+    section_ = section::instructions;
+}
+
+void FlowModBatch::close()
+{
+    if (section_ == section::none)
+        return;
+    close_match();
+    size_t start = offsets_.back();
+    reinterpret_cast<ofp_flow_mod*>(buf_.data() + start)->length =
+        buf_.size() - start;
+    section_ = section::none;
+}
+
+void FlowModBatch::clear()
+{
+    buf_.clear();
+    offsets_.clear();
+    section_ = section::none;
+}
+
+void FlowModBatch::set_xids(uint32_t first)
+{
+    close();
+    for (auto offset : offsets_) {
+        reinterpret_cast<ofp_flow_mod*>(buf_.data() + offset)->xid = first++;
+    }
+}
+
+const uint8_t* FlowModBatch::data()
+{
+    close();
+    return buf_.data();
+}
+
+size_t FlowModBatch::bytes()
+{
+    close();
+    return buf_.size();
+}
+
+} // namespace runos
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace fluid_msg {
+namespace of13 {
+class OXMTLV;
+class Match;
+class Instruction;
+}
+}
+
+namespace runos {
+
+/**
+ * Writes OpenFlow 1.3 flow mods back to back straight into one wire
+ * buffer, without building of13::FlowMod objects and packing each
+ * of them into its own allocation.
+ *
+ *     FlowModBatch::header h;
+ *     h.table_id = 1;
+ *     FlowModBatch batch;
+ *     batch.add(h)
+ *          .oxm(of13::InPort(port))
+ *          .instruction(of13::GoToTable(2));
+ *     agent->flow_mods(batch);
+ *
+ * Match fields must come before instructions of the same flow mod.
+ * Send hooks don't see these flow mods, only the message tap does.
+ * Buffers are taken from a per-thread pool and returned with their
+ * capacity on destruction, so batches built in a loop don't allocate.
+ */
+class FlowModBatch {
+public:
+    struct header {
+        uint64_t cookie = 0;
+        uint64_t cookie_mask = 0;
+        uint8_t table_id = 0;
+        uint8_t command = 0; // OFPFC_ADD
+        uint16_t idle_timeout = 0;
+        uint16_t hard_timeout = 0;
+        uint16_t priority = 0;
+        uint32_t buffer_id = 0xffffffff; // OFP_NO_BUFFER
+        uint32_t out_port = 0xffffffff;  // OFPP_ANY
+        uint32_t out_group = 0xffffffff; // OFPG_ANY
+        uint16_t flags = 0;
+    };
+
+    FlowModBatch();
+    ~FlowModBatch();
+    FlowModBatch(const FlowModBatch&) = delete;
+    FlowModBatch& operator=(const FlowModBatch&) = delete;
+
+    // Starts the next flow mod
+    FlowModBatch& add(const header& h);
+    FlowModBatch& oxm(const fluid_msg::of13::OXMTLV& field);
+    // Room for `len` bytes of OXM TLVs encoded by the caller
+    // (oxm::static_match), valid until the next modification
+    uint8_t* oxm_space(size_t len);
+    // Uses a prepared match instead of oxm() calls
+    FlowModBatch& match(const fluid_msg::of13::Match& m);
+    FlowModBatch& instruction(const fluid_msg::of13::Instruction& i);
+    // Room for `len` bytes of packed instructions
+    uint8_t* instruction_space(size_t len);
+
+    // Number of flow mods
+    size_t size() const { return offsets_.size(); }
+    bool empty() const { return offsets_.empty(); }
+    void clear();
+
+    // Numbers flow mods with consecutive xids starting from `first`
+    void set_xids(uint32_t first);
+
+    // Wire bytes of all flow mods, valid until the next modification
+    const uint8_t* data();
+    size_t bytes();
+
+private:
+    enum class section { none, match, instructions };
+
+    uint8_t* grow(size_t len);
+    void close_match();
+    void close();
+
+    std::vector<uint8_t> buf_;
+    std::vector<size_t> offsets_; // start of each flow mod
+    size_t match_ = 0;            // start of the open ofp_match
+    section section_ = section::none;
+};
+
+} // namespace runos
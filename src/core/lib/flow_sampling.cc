@@ -0,0 +1,425 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flow_sampling.hpp"
+
+#include <cstring>
+
+namespace runos {
+
+namespace {
+
+// Big-endian reader that turns every overrun into ok() == false
+class cursor {
+public:
+    cursor(const uint8_t* data, size_t len)
+        : p_(data), end_(data + len)
+    { }
+
+    bool ok() const { return ok_; }
+    size_t left() const { return ok_ ? size_t(end_ - p_) : 0; }
+    const uint8_t* data() const { return p_; }
+
+    uint64_t uint(size_t n)
+    {
+        if (not take(n))
+            return 0;
+        uint64_t ret = 0;
+        for (const uint8_t* q = p_ - n; q != p_; ++q)
+            ret = (ret << 8) | *q;
+        return ret;
+    }
+    uint32_t u32() { return uint32_t(uint(4)); }
+    uint16_t u16() { return uint16_t(uint(2)); }
+    uint64_t u64() { return uint(8); }
+
+    // four octets in memory order
+    uint32_t ipv4()
+    {
+        uint32_t ret = 0;
+        if (take(4))
+            std::memcpy(&ret, p_ - 4, 4);
+        return ret;
+    }
+
+    void skip(size_t n) { take(n); }
+
+    // The next n bytes as a cursor of their own
+    cursor sub(size_t n)
+    {
+        if (not take(n))
+            return cursor(p_, 0).failed();
+        return cursor(p_ - n, n);
+    }
+
+private:
+    const uint8_t* p_;
+    const uint8_t* end_;
+    bool ok_ {true};
+
+    bool take(size_t n)
+    {
+        if (not ok_ || size_t(end_ - p_) < n) {
+            ok_ = false;
+            return false;
+        }
+        p_ += n;
+        return true;
+    }
+
+    cursor failed() { ok_ = false; return *this; }
+};
+
+constexpr uint16_t OFPVID_PRESENT = 0x1000;
+
+// XDR opaque data is padded to four bytes
+size_t padded(size_t n) { return (n + 3) & ~size_t(3); }
+
+} // namespace
+
+bool parse_sampled_header(const uint8_t* data, size_t len,
+                          packet_fields& out)
+{
+    cursor c(data, len);
+    out.set(packet_fields::eth_dst, c.uint(6));
+    out.set(packet_fields::eth_src, c.uint(6));
+    uint16_t eth_type = c.u16();
+    if (not c.ok())
+        return false;
+
+    uint16_t vlan = 0; // OFPVID_NONE
+    if (eth_type == 0x8100 || eth_type == 0x88a8) {
+        uint16_t tci = c.u16();
+        eth_type = c.u16();
+        if (not c.ok())
+            return true; // a truncated tag says nothing more
+        vlan = OFPVID_PRESENT | (tci & 0x0fff);
+    }
+    out.set(packet_fields::vlan_vid, vlan);
+    out.set(packet_fields::eth_type, eth_type);
+
+    if (eth_type != 0x0800)
+        return true;
+
+    cursor ip = c;
+    uint8_t ihl = uint8_t(ip.uint(1) & 0x0f) * 4;
+    ip.skip(5);
+    uint16_t fragment = ip.u16() & 0x1fff;
+    ip.skip(1);
+    uint8_t proto = uint8_t(ip.uint(1));
+    ip.skip(2);
+    uint32_t src = ip.ipv4();
+    uint32_t dst = ip.ipv4();
+    if (not ip.ok() || ihl < 20)
+        return true;
+    out.set(packet_fields::ip_proto, proto);
+    out.set(packet_fields::ipv4_src, src);
+    out.set(packet_fields::ipv4_dst, dst);
+
+    // only the first fragment has ports
+    if (fragment != 0 || (proto != 6 && proto != 17))
+        return true;
+    cursor l4 = c;
+    l4.skip(ihl);
+    uint16_t sport = l4.u16();
+    uint16_t dport = l4.u16();
+    if (l4.ok()) {
+        out.set(packet_fields::tp_src, sport);
+        out.set(packet_fields::tp_dst, dport);
+    }
+    return true;
+}
+
+/////////////////////
+//      sFlow      //
+/////////////////////
+
+// enterprise 0 formats
+enum : uint32_t {
+    SFLOW_FLOW_SAMPLE = 1,
+    SFLOW_COUNTERS_SAMPLE = 2,
+    SFLOW_FLOW_SAMPLE_EXPANDED = 3,
+    SFLOW_COUNTERS_SAMPLE_EXPANDED = 4,
+
+    SFLOW_RAW_HEADER = 1,
+    SFLOW_GENERIC_INTERFACE = 1,
+    SFLOW_OPENFLOW_PORT = 1004,
+};
+
+static bool decode_flow_sample(cursor& c, bool expanded,
+                               std::vector<flow_sample>& out)
+{
+    flow_sample sample;
+    c.skip(expanded ? 12 : 8); // sequence, source id
+    sample.sampling_rate = c.u32();
+    c.skip(8); // sample pool, drops
+    if (expanded) {
+        uint32_t format = c.u32();
+        uint32_t value = c.u32();
+        sample.input = format == 0 ? value : 0;
+        c.skip(8); // output
+    } else {
+        uint32_t input = c.u32();
+        sample.input = (input >> 30) == 0 ? input & 0x3fffffff : 0;
+        c.skip(4); // output
+    }
+
+    uint32_t nrecords = c.u32();
+    bool has_header = false;
+    for (uint32_t i = 0; i < nrecords && c.ok(); ++i) {
+        uint32_t format = c.u32();
+        cursor record = c.sub(padded(c.u32()));
+        if (format != SFLOW_RAW_HEADER)
+            continue;
+        uint32_t protocol = record.u32();
+        uint32_t frame_length = record.u32();
+        record.skip(4); // stripped
+        uint32_t header_length = record.u32();
+        if (not record.ok() || protocol != 1 /* ethernet */ ||
+            header_length > record.left())
+            continue;
+        sample.bytes = frame_length;
+        has_header = parse_sampled_header(record.data(), header_length,
+                                          sample.fields);
+    }
+
+    if (not c.ok())
+        return false;
+    if (has_header && sample.sampling_rate > 0)
+        out.push_back(sample);
+    return true;
+}
+
+static bool decode_counters_sample(cursor& c, bool expanded,
+                                   std::vector<interface_counters>& out)
+{
+    interface_counters counters;
+    bool has_interface = false;
+    c.skip(expanded ? 12 : 8); // sequence, source id
+
+    uint32_t nrecords = c.u32();
+    for (uint32_t i = 0; i < nrecords && c.ok(); ++i) {
+        uint32_t format = c.u32();
+        cursor record = c.sub(padded(c.u32()));
+        if (format == SFLOW_GENERIC_INTERFACE) {
+            counters.if_index = record.u32();
+            record.skip(20); // type, speed, direction, status
+            counters.in_octets = record.u64();
+            counters.in_packets = record.u32() + record.u32() + record.u32();
+            counters.in_discards = record.u32();
+            counters.in_errors = record.u32();
+            record.skip(4); // unknown protos
+            counters.out_octets = record.u64();
+            counters.out_packets = record.u32() + record.u32() + record.u32();
+            counters.out_discards = record.u32();
+            counters.out_errors = record.u32();
+            has_interface = record.ok();
+        } else if (format == SFLOW_OPENFLOW_PORT) {
+            counters.dpid = record.u64();
+            counters.port_no = record.u32();
+            counters.openflow = record.ok();
+        }
+    }
+
+    if (not c.ok())
+        return false;
+    if (has_interface)
+        out.push_back(counters);
+    return true;
+}
+
+bool decode_sflow(const uint8_t* data, size_t len, sampled_datagram& out)
+{
+    cursor c(data, len);
+    if (c.u32() != 5)
+        return false;
+    uint32_t address_type = c.u32();
+    if (address_type == 1) {
+        out.agent = c.ipv4();
+    } else if (address_type == 2) {
+        out.agent = 0;
+        c.skip(16);
+    } else {
+        return false;
+    }
+    out.sub_agent = c.u32();
+    c.skip(8); // sequence, uptime
+
+    uint32_t nsamples = c.u32();
+    for (uint32_t i = 0; i < nsamples && c.ok(); ++i) {
+        uint32_t format = c.u32();
+        cursor sample = c.sub(c.u32());
+        if (not c.ok())
+            break;
+        bool ok = true;
+        switch (format) {
+        case SFLOW_FLOW_SAMPLE:
+        case SFLOW_FLOW_SAMPLE_EXPANDED:
+            ok = decode_flow_sample(sample,
+                format == SFLOW_FLOW_SAMPLE_EXPANDED, out.flows);
+            break;
+        case SFLOW_COUNTERS_SAMPLE:
+        case SFLOW_COUNTERS_SAMPLE_EXPANDED:
+            ok = decode_counters_sample(sample,
+                format == SFLOW_COUNTERS_SAMPLE_EXPANDED, out.counters);
+            break;
+        }
+        if (not ok)
+            return false;
+    }
+    return c.ok();
+}
+
+/////////////////////
+//      IPFIX      //
+/////////////////////
+
+// Information element ids (IANA registry)
+enum : uint16_t {
+    IE_OCTET_DELTA_COUNT = 1,
+    IE_PACKET_DELTA_COUNT = 2,
+    IE_PROTOCOL = 4,
+    IE_SOURCE_PORT = 7,
+    IE_SOURCE_IPV4 = 8,
+    IE_INGRESS_INTERFACE = 10,
+    IE_DESTINATION_PORT = 11,
+    IE_DESTINATION_IPV4 = 12,
+    IE_SOURCE_MAC = 56,
+    IE_VLAN_ID = 58,
+    IE_DESTINATION_MAC = 80,
+    IE_ETHERNET_TYPE = 256,
+};
+
+bool ipfix_decoder::decode(uint32_t exporter, const uint8_t* data,
+                           size_t len, sampled_datagram& out)
+{
+    cursor c(data, len);
+    uint16_t version = c.u16();
+    uint16_t length = c.u16();
+    c.skip(8); // export time, sequence
+    uint32_t domain = c.u32();
+    if (not c.ok() || version != 10 || length > len)
+        return false;
+    c = cursor(data + 16, length - 16);
+
+    out.agent = exporter;
+    out.sub_agent = domain;
+    uint64_t source = (uint64_t(exporter) << 32) | domain;
+
+    while (c.left() >= 4) {
+        uint16_t set_id = c.u16();
+        uint16_t set_length = c.u16();
+        if (set_length < 4)
+            return false;
+        cursor set = c.sub(set_length - 4);
+        if (not c.ok())
+            return false;
+
+        if (set_id == 2) {
+            while (set.left() >= 4) {
+                uint16_t id = set.u16();
+                uint16_t count = set.u16();
+                std::vector<field_spec> fields;
+                for (uint16_t i = 0; i < count; ++i) {
+                    uint16_t ie = set.u16();
+                    uint16_t flen = set.u16();
+                    if (ie & 0x8000) {
+                        set.skip(4); // enterprise number
+                        ie = 0;
+                    }
+                    fields.push_back(field_spec{ie, flen});
+                }
+                if (not set.ok())
+                    return false;
+                if (count == 0)
+                    templates_.erase({source, id}); // withdrawal
+                else
+                    templates_[{source, id}] = std::move(fields);
+            }
+            continue;
+        }
+        if (set_id < 256)
+            continue; // options templates
+
+        auto it = templates_.find({source, set_id});
+        if (it == templates_.end())
+            continue;
+        auto& fields = it->second;
+
+        // the rest of a set shorter than any record is padding
+        while (set.left() > 0) {
+            cursor record = set;
+            flow_sample sample;
+            sample.sampling_rate = sampling_rate_;
+            sample.packets = 0;
+            for (auto& f : fields) {
+                size_t flen = f.length;
+                if (flen == 65535) {
+                    flen = record.uint(1);
+                    if (flen == 255)
+                        flen = record.u16();
+                }
+                cursor value = record.sub(flen);
+                switch (f.id) {
+                case IE_OCTET_DELTA_COUNT:
+                    sample.bytes = value.uint(flen); break;
+                case IE_PACKET_DELTA_COUNT:
+                    sample.packets = value.uint(flen); break;
+                case IE_INGRESS_INTERFACE:
+                    sample.input = uint32_t(value.uint(flen)); break;
+                case IE_PROTOCOL:
+                    sample.fields.set(packet_fields::ip_proto, value.uint(flen));
+                    break;
+                case IE_SOURCE_PORT:
+                    sample.fields.set(packet_fields::tp_src, value.uint(flen));
+                    break;
+                case IE_DESTINATION_PORT:
+                    sample.fields.set(packet_fields::tp_dst, value.uint(flen));
+                    break;
+                case IE_SOURCE_IPV4:
+                    if (flen == 4)
+                        sample.fields.set(packet_fields::ipv4_src, value.ipv4());
+                    break;
+                case IE_DESTINATION_IPV4:
+                    if (flen == 4)
+                        sample.fields.set(packet_fields::ipv4_dst, value.ipv4());
+                    break;
+                case IE_SOURCE_MAC:
+                    sample.fields.set(packet_fields::eth_src, value.uint(flen));
+                    break;
+                case IE_DESTINATION_MAC:
+                    sample.fields.set(packet_fields::eth_dst, value.uint(flen));
+                    break;
+                case IE_VLAN_ID:
+                    sample.fields.set(packet_fields::vlan_vid,
+                        OFPVID_PRESENT | (value.uint(flen) & 0x0fff));
+                    break;
+                case IE_ETHERNET_TYPE:
+                    sample.fields.set(packet_fields::eth_type, value.uint(flen));
+                    break;
+                }
+            }
+            if (not record.ok() || record.left() == set.left())
+                break; // padding
+            set = record;
+            if (sample.packets > 0)
+                out.flows.push_back(sample);
+        }
+    }
+    return c.ok();
+}
+
+} // namespace runos
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Header fields of a sampled packet, those a flow bucket can select on.
+ *
+ * Values are in the representation fluid uses in OXM fields: MACs as
+ * ethaddr::to_number(), IPv4 addresses as the four octets in memory
+ * order (IPAddress::getIPv4()), VLAN as OFPVID_PRESENT | vid or
+ * OFPVID_NONE. TCP and UDP ports share tp_src/tp_dst.
+ */
+struct packet_fields {
+    enum field : uint8_t {
+        in_port, eth_dst, eth_src, eth_type, vlan_vid,
+        ip_proto, ipv4_src, ipv4_dst, tp_src, tp_dst,
+        field_count
+    };
+
+    std::array<uint64_t, field_count> value {};
+    uint32_t present {0}; // bit per field
+
+    void set(field f, uint64_t v)
+    {
+        value[f] = v;
+        present |= 1u << f;
+    }
+    bool has(field f) const { return present & (1u << f); }
+};
+
+// Conjunction of masked compares, the part of an OXM match
+// a sampled packet can be checked against
+struct packet_filter {
+    struct term {
+        packet_fields::field field;
+        uint64_t value;
+        uint64_t mask;
+    };
+    std::vector<term> terms;
+
+    void add(packet_fields::field f, uint64_t value,
+             uint64_t mask = ~uint64_t(0))
+    { terms.push_back(term{f, value & mask, mask}); }
+
+    bool matches(const packet_fields& p) const
+    {
+        for (auto& t : terms) {
+            if (not p.has(t.field) || (p.value[t.field] & t.mask) != t.value)
+                return false;
+        }
+        return true;
+    }
+};
+
+// Ethernet frame from its first bytes: 802.1Q, IPv4 and TCP/UDP
+// ports when they fit. False if shorter than an Ethernet header.
+bool parse_sampled_header(const uint8_t* data, size_t len,
+                          packet_fields& out);
+
+// Traffic seen by an agent, to scale up by the sampling rate
+struct flow_sample {
+    uint32_t input {0}; // ifIndex or OpenFlow port, 0 if unknown
+    uint32_t sampling_rate {1};
+    uint64_t packets {1};
+    uint64_t bytes {0}; // frame length for sFlow
+    packet_fields fields; // without in_port
+};
+
+// Counters of one interface. Packet counters of sFlow are 32-bit
+// and wrap, octets are 64-bit.
+struct interface_counters {
+    uint32_t if_index {0};
+    bool openflow {false}; // dpid and port_no are known
+    uint64_t dpid {0};
+    uint32_t port_no {0};
+    uint64_t in_octets {0}, out_octets {0};
+    uint32_t in_packets {0}, out_packets {0}; // unicast+multicast+broadcast
+    uint32_t in_discards {0}, out_discards {0};
+    uint32_t in_errors {0}, out_errors {0};
+};
+
+struct sampled_datagram {
+    uint32_t agent {0}; // IPv4 as in packet_fields, 0 for IPv6 agents
+    uint32_t sub_agent {0}; // sFlow sub-agent, IPFIX observation domain
+    std::vector<flow_sample> flows;
+    std::vector<interface_counters> counters;
+};
+
+// sFlow version 5 (sflow.org/sflow_version_5.txt). Flow samples with
+// a raw Ethernet header record and counter samples with generic
+// interface (0:1) and OpenFlow port (0:1004) records are kept, other
+// records are skipped. False if the datagram is malformed; what was
+// decoded up to that point stays in `out`.
+bool decode_sflow(const uint8_t* data, size_t len, sampled_datagram& out);
+
+/**
+ * IPFIX (RFC 7011) data records of the fields packet_fields has, with
+ * octetDeltaCount and packetDeltaCount as the sampled traffic and
+ * ingressInterface as the input.
+ *
+ * Templates are kept per exporter and observation domain; records of
+ * a template not seen yet are skipped. Options templates are ignored
+ * so the sampling rate is the exporter's configured one.
+ */
+class ipfix_decoder {
+public:
+    explicit ipfix_decoder(uint32_t sampling_rate = 1)
+        : sampling_rate_(sampling_rate)
+    { }
+
+    bool decode(uint32_t exporter, const uint8_t* data, size_t len,
+                sampled_datagram& out);
+
+    size_t templates() const { return templates_.size(); }
+
+private:
+    struct field_spec {
+        uint16_t id; // 0 for enterprise-specific, skipped
+        uint16_t length; // 65535 is variable
+    };
+    // (exporter, domain, template id)
+    using template_key = std::pair<uint64_t, uint16_t>;
+
+    uint32_t sampling_rate_;
+    std::map<template_key, std::vector<field_spec>> templates_;
+};
+
+} // namespace runos
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace runos {
+
+/**
+ * Version of some state, bumped after every change.
+ *
+ * Readers remember the value they saw before reading the state; if it is
+ * still the same later, anything derived from that state is still valid.
+ * Writers bump after the change is complete, so a reader racing with the
+ * change sees either the new value or a stale one which is about to be
+ * invalidated.
+ */
+class generation_counter {
+public:
+    uint64_t get() const noexcept
+    { return m_value.load(std::memory_order_acquire); }
+
+    void bump() noexcept
+    { m_value.fetch_add(1, std::memory_order_acq_rel); }
+
+    // Bumps when leaving the scope, whichever way the modifier returns
+    class scope {
+    public:
+        explicit scope(generation_counter& counter) noexcept
+            : m_counter(counter)
+        { }
+
+        ~scope() { m_counter.bump(); }
+
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+
+    private:
+        generation_counter& m_counter;
+    };
+
+private:
+    std::atomic<uint64_t> m_value{1};
+};
+
+} // namespace runos
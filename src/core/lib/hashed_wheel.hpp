@@ -0,0 +1,123 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Hashed timing wheel (Varghese & Lauck, scheme 6) ticked by its owner.
+ *
+ * A deadline goes to slot `expires % slots()`; deadlines further than a
+ * revolution stay in their slot for more rounds. Keys are unique:
+ * scheduling a pending key moves its deadline, cancel() drops it. Due
+ * items are handed out in batches by advance(). Not thread-safe.
+ */
+template<class Key, class T, class Hash = std::hash<Key>>
+class hashed_wheel {
+public:
+    using item = std::pair<Key, T>;
+
+    explicit hashed_wheel(size_t slots = 256)
+        : m_slots(std::max<size_t>(slots, 1))
+    { }
+
+    size_t slots() const noexcept
+    { return m_slots.size(); }
+
+    size_t size() const noexcept
+    { return m_index.size(); }
+
+    bool empty() const noexcept
+    { return m_index.empty(); }
+
+    // Ticks passed since construction
+    uint64_t now() const noexcept
+    { return m_now; }
+
+    bool contains(const Key& key) const
+    { return m_index.count(key) > 0; }
+
+    // Key expires `ticks` ticks from now, but not before the next tick
+    void schedule(const Key& key, uint64_t ticks, T value)
+    {
+        cancel(key);
+        uint64_t expires = m_now + std::max<uint64_t>(ticks, 1);
+        size_t index = expires % m_slots.size();
+        m_slots[index].push_back(entry{ key, expires, std::move(value) });
+        m_index.emplace(key, index);
+    }
+
+    void cancel(const Key& key)
+    {
+        auto it = m_index.find(key);
+        if (it == m_index.end())
+            return;
+
+        auto& slot = m_slots[it->second];
+        auto pos = std::find_if(slot.begin(), slot.end(),
+                                [&](const entry& e) { return e.key == key; });
+        *pos = std::move(slot.back());
+        slot.pop_back();
+        m_index.erase(it);
+    }
+
+    // Moves time `ticks` forward, expired items are appended to `due`
+    void advance(uint64_t ticks, std::vector<item>& due)
+    {
+        for (; ticks > 0; --ticks) {
+            if (empty()) { // nothing to visit, jump
+                m_now += ticks;
+                return;
+            }
+
+            ++m_now;
+            auto& slot = m_slots[m_now % m_slots.size()];
+            for (size_t i = 0; i < slot.size(); ) {
+                if (slot[i].expires > m_now) { // later round
+                    ++i;
+                    continue;
+                }
+                m_index.erase(slot[i].key);
+                due.emplace_back(std::move(slot[i].key),
+                                 std::move(slot[i].value));
+                slot[i] = std::move(slot.back());
+                slot.pop_back();
+            }
+        }
+    }
+
+private:
+    struct entry {
+        Key key;
+        uint64_t expires; // tick
+        T value;
+    };
+
+    std::vector<std::vector<entry>> m_slots;
+    std::unordered_map<Key, size_t, Hash> m_index; // key -> slot
+    uint64_t m_now = 0;
+};
+
+} // namespace runos
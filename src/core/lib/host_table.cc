@@ -0,0 +1,173 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "host_table.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace runos {
+
+// Fibonacci hashing, MACs of one vendor differ in the low bits only
+static size_t spread(uint64_t key, size_t n)
+{
+    return size_t((key * 0x9e3779b97f4a7c15ULL) >> 32) % n;
+}
+
+host_table::host_table(size_t shards)
+    : macs_(std::max<size_t>(1, shards))
+    , ipv4s_(std::max<size_t>(1, shards))
+{ }
+
+auto host_table::shard_of(uint64_t mac) const -> mac_shard&
+{
+    return const_cast<mac_shard&>(macs_[spread(mac, macs_.size())]);
+}
+
+auto host_table::index_of(uint32_t ipv4) const -> ipv4_shard&
+{
+    return const_cast<ipv4_shard&>(ipv4s_[spread(ipv4, ipv4s_.size())]);
+}
+
+bool host_table::learn(uint64_t mac, uint32_t ipv4, switch_and_port where,
+                       clock::time_point now)
+{
+    bool changed;
+    uint32_t old_ipv4;
+    {
+        auto& shard = shard_of(mac);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.hosts.find(mac);
+        if (it == shard.hosts.end()) {
+            it = shard.hosts.emplace(mac, host{mac, 0, where, now}).first;
+            changed = true;
+        } else {
+            changed = it->second.location != where;
+        }
+        auto& h = it->second;
+        old_ipv4 = h.ipv4;
+        h.location = where;
+        h.seen = now;
+        if (ipv4 != 0)
+            h.ipv4 = ipv4;
+    }
+
+    if (ipv4 != 0 && ipv4 != old_ipv4) {
+        if (old_ipv4 != 0)
+            unindex(old_ipv4, mac);
+        auto& index = index_of(ipv4);
+        std::lock_guard<std::mutex> lock(index.mutex);
+        index.macs[ipv4] = mac;
+    }
+    return changed;
+}
+
+auto host_table::by_mac(uint64_t mac) const -> std::optional<host>
+{
+    auto& shard = shard_of(mac);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.hosts.find(mac);
+    if (it == shard.hosts.end())
+        return std::nullopt;
+    return it->second;
+}
+
+auto host_table::by_ipv4(uint32_t ipv4) const -> std::optional<host>
+{
+    uint64_t mac;
+    {
+        auto& index = index_of(ipv4);
+        std::lock_guard<std::mutex> lock(index.mutex);
+        auto it = index.macs.find(ipv4);
+        if (it == index.macs.end())
+            return std::nullopt;
+        mac = it->second;
+    }
+    auto ret = by_mac(mac);
+    if (ret && ret->ipv4 != ipv4)
+        return std::nullopt;
+    return ret;
+}
+
+void host_table::unindex(uint32_t ipv4, uint64_t mac)
+{
+    auto& index = index_of(ipv4);
+    std::lock_guard<std::mutex> lock(index.mutex);
+    auto it = index.macs.find(ipv4);
+    if (it != index.macs.end() && it->second == mac)
+        index.macs.erase(it);
+}
+
+template<class Predicate>
+size_t host_table::remove_if(Predicate pred)
+{
+    std::vector<std::pair<uint32_t, uint64_t>> removed;
+    for (auto& shard : macs_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto it = shard.hosts.begin(); it != shard.hosts.end(); ) {
+            if (pred(it->second)) {
+                removed.emplace_back(it->second.ipv4, it->first);
+                it = shard.hosts.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for (const auto& it : removed) {
+        if (it.first != 0)
+            unindex(it.first, it.second);
+    }
+    return removed.size();
+}
+
+size_t host_table::forget(switch_and_port where)
+{
+    return remove_if([where](const host& h) { return h.location == where; });
+}
+
+size_t host_table::forget(uint64_t dpid)
+{
+    return remove_if([dpid](const host& h) { return h.location.dpid == dpid; });
+}
+
+size_t host_table::expire(clock::time_point before)
+{
+    return remove_if([before](const host& h) { return h.seen < before; });
+}
+
+auto host_table::hosts() const -> std::vector<host>
+{
+    std::vector<host> ret;
+    for (const auto& shard : macs_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (const auto& it : shard.hosts)
+            ret.push_back(it.second);
+    }
+    return ret;
+}
+
+size_t host_table::size() const
+{
+    size_t ret = 0;
+    for (const auto& shard : macs_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        ret += shard.hosts.size();
+    }
+    return ret;
+}
+
+} // namespace runos
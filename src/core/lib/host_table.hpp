@@ -0,0 +1,95 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include "switch_and_port.hpp"
+
+namespace runos {
+
+/**
+ * Attachment points of hosts, by MAC and by IPv4 address.
+ *
+ * Hosts are spread over shards by MAC, each with its own mutex, so
+ * PacketIn threads learning different hosts rarely contend. The IPv4
+ * index is sharded by address and refers to MACs; it is checked against
+ * the host on lookup, so an address taken over by another host or left
+ * behind by a moved one is never returned for the wrong MAC.
+ */
+class host_table {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct host {
+        uint64_t mac;
+        uint32_t ipv4; // 0 if not seen yet
+        switch_and_port location;
+        clock::time_point seen;
+    };
+
+    explicit host_table(size_t shards = 16);
+
+    // Returns true if the host is new or moved to another port.
+    // ipv4 of 0 keeps the known address.
+    bool learn(uint64_t mac, uint32_t ipv4, switch_and_port where,
+               clock::time_point now = clock::now());
+
+    std::optional<host> by_mac(uint64_t mac) const;
+    std::optional<host> by_ipv4(uint32_t ipv4) const;
+
+    // Forgets hosts behind the port or any port of the switch,
+    // returns how many were removed
+    size_t forget(switch_and_port where);
+    size_t forget(uint64_t dpid);
+    // Forgets hosts not seen since `before`
+    size_t expire(clock::time_point before);
+
+    std::vector<host> hosts() const;
+    size_t size() const;
+
+private:
+    struct mac_shard {
+        mutable std::mutex mutex;
+        std::unordered_map<uint64_t, host> hosts;
+    };
+    struct ipv4_shard {
+        mutable std::mutex mutex;
+        std::unordered_map<uint32_t, uint64_t> macs;
+    };
+
+    std::vector<mac_shard> macs_;
+    std::vector<ipv4_shard> ipv4s_;
+
+    mac_shard& shard_of(uint64_t mac) const;
+    ipv4_shard& index_of(uint32_t ipv4) const;
+    void unindex(uint32_t ipv4, uint64_t mac);
+
+    template<class Predicate>
+    size_t remove_if(Predicate pred);
+};
+
+} // namespace runos
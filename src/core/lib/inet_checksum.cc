@@ -0,0 +1,122 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "inet_checksum.hpp"
+
+namespace runos {
+namespace inet_checksum {
+
+static uint16_t fold(uint64_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+static uint32_t load32(const uint8_t* p)
+{
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 |
+           uint32_t(p[2]) << 8 | p[3];
+}
+
+uint16_t sum(const void* data, size_t len, uint32_t initial)
+{
+    auto p = static_cast<const uint8_t*>(data);
+
+    // 32-bit words into independent 64-bit accumulators: the carries
+    // are folded once at the end and the loop vectorizes
+    uint64_t acc[4] = {initial, 0, 0, 0};
+    for (; len >= 16; p += 16, len -= 16) {
+        acc[0] += load32(p);
+        acc[1] += load32(p + 4);
+        acc[2] += load32(p + 8);
+        acc[3] += load32(p + 12);
+    }
+    for (; len >= 4; p += 4, len -= 4)
+        acc[0] += load32(p);
+    for (; len >= 2; p += 2, len -= 2)
+        acc[1] += uint32_t(p[0]) << 8 | p[1];
+    if (len)
+        acc[2] += uint32_t(p[0]) << 8;
+
+    return fold(acc[0] + acc[1] + acc[2] + acc[3]);
+}
+
+uint16_t update(uint16_t checksum, size_t offset,
+                const void* old, const void* now, size_t len)
+{
+    auto o = static_cast<const uint8_t*>(old);
+    auto n = static_cast<const uint8_t*>(now);
+
+    // HC' = ~(~HC + ~m + m'), byte by byte in their word halves
+    uint64_t sum = uint16_t(~checksum);
+    for (size_t i = 0; i < len; ++i) {
+        unsigned shift = ((offset + i) & 1) ? 0 : 8;
+        sum += uint16_t(~(uint32_t(o[i]) << shift));
+        sum += uint32_t(n[i]) << shift;
+    }
+    return ~fold(sum);
+}
+
+bool recompute_ipv4(uint8_t* ip, size_t len)
+{
+    if (len < 20 || (ip[0] >> 4) != 4)
+        return false;
+    size_t ihl = (ip[0] & 0x0f) * 4;
+    if (ihl < 20 || ihl > len)
+        return false;
+
+    auto store16 = [](uint8_t* p, uint16_t v) { p[0] = v >> 8; p[1] = v; };
+
+    store16(ip + 10, 0);
+    store16(ip + 10, compute(ip, ihl));
+
+    size_t total = uint16_t(ip[2] << 8 | ip[3]);
+    bool fragment = (ip[6] & 0x3f) || ip[7]; // MF or offset
+    if (total < ihl || total > len || fragment)
+        return false;
+
+    uint8_t* l4 = ip + ihl;
+    size_t l4_len = total - ihl;
+    uint8_t* field;
+    switch (ip[9]) {
+    case 0x06: // tcp
+        if (l4_len < 20)
+            return false;
+        field = l4 + 16;
+        break;
+    case 0x11: // udp
+        if (l4_len < 8)
+            return false;
+        field = l4 + 6;
+        break;
+    default:
+        return true;
+    }
+
+    // pseudo header: addresses, protocol and length
+    uint32_t pseudo = sum(ip + 12, 8) + ip[9] + l4_len;
+    store16(field, 0);
+    uint16_t checksum = compute(l4, l4_len, pseudo);
+    if (ip[9] == 0x11 && checksum == 0)
+        checksum = 0xffff; // zero means no checksum for udp
+    store16(field, checksum);
+    return true;
+}
+
+} // namespace inet_checksum
+} // namespace runos
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace runos {
+namespace inet_checksum {
+
+/**
+ * Internet checksum (RFC 1071) helpers. Checksums and sums are numeric
+ * values of big-endian 16-bit words, `offset`s are counted from the
+ * start of the checksummed data and only their parity matters.
+ */
+
+// One's complement sum of `len` bytes, not complemented
+uint16_t sum(const void* data, size_t len, uint32_t initial = 0);
+
+// Checksum over `len` bytes
+inline uint16_t compute(const void* data, size_t len, uint32_t initial = 0)
+{
+    return ~sum(data, len, initial);
+}
+
+// RFC 1624 eqn. 3: `checksum` after `len` bytes at `offset` changed
+// from `old` to `now`
+uint16_t update(uint16_t checksum, size_t offset,
+                const void* old, const void* now, size_t len);
+
+// Recomputes the header checksum of the IPv4 packet at `ip` and the
+// TCP or UDP checksum after it. The latter only if all of the packet
+// is within `len` bytes and isn't a fragment. Returns false if it wasn't.
+bool recompute_ipv4(uint8_t* ip, size_t len);
+
+} // namespace inet_checksum
+} // namespace runos
@@ -0,0 +1,241 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "json_encoding.hpp"
+
+#include "json_reader.hpp"
+
+#include <runos/core/throw.hpp>
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+
+namespace runos {
+
+namespace {
+
+class encoder {
+public:
+    explicit encoder(json_encoding encoding)
+        : m_cbor(encoding == json_encoding::cbor)
+    { }
+
+    std::string release() { return std::move(m_out); }
+
+    void value(const json_value& v)
+    {
+        switch (v.type()) {
+        case json_value::kind::missing:
+        case json_value::kind::null:
+            byte(m_cbor ? 0xf6 : 0xc0);
+            break;
+        case json_value::kind::boolean:
+            if (m_cbor)
+                byte(v.get_bool() ? 0xf5 : 0xf4);
+            else
+                byte(v.get_bool() ? 0xc3 : 0xc2);
+            break;
+        case json_value::kind::number:
+            number(v);
+            break;
+        case json_value::kind::string:
+            string(v.get_string());
+            break;
+        case json_value::kind::array:
+            container(v, false);
+            break;
+        case json_value::kind::object:
+            container(v, true);
+            break;
+        }
+    }
+
+private:
+    bool m_cbor;
+    std::string m_out;
+
+    void byte(uint8_t b) { m_out.push_back(char(b)); }
+
+    // Big-endian, as both formats want
+    void big_endian(uint64_t x, size_t bytes)
+    {
+        for (size_t i = bytes; i-- > 0; )
+            byte(uint8_t(x >> (8 * i)));
+    }
+
+    // CBOR initial byte with its argument
+    void head(uint8_t major, uint64_t n)
+    {
+        major <<= 5;
+        if (n < 24) {
+            byte(major | n);
+        } else if (n <= 0xff) {
+            byte(major | 24);
+            big_endian(n, 1);
+        } else if (n <= 0xffff) {
+            byte(major | 25);
+            big_endian(n, 2);
+        } else if (n <= 0xffffffff) {
+            byte(major | 26);
+            big_endian(n, 4);
+        } else {
+            byte(major | 27);
+            big_endian(n, 8);
+        }
+    }
+
+    // MessagePack str/array/map length: fix form, then 8/16/32 bits
+    void length(uint8_t fix, size_t fix_max, const uint8_t* tags, size_t n)
+    {
+        if (n <= fix_max) {
+            byte(fix | n);
+        } else if (tags[0] && n <= 0xff) {
+            byte(tags[0]);
+            big_endian(n, 1);
+        } else if (n <= 0xffff) {
+            byte(tags[1]);
+            big_endian(n, 2);
+        } else {
+            byte(tags[2]);
+            big_endian(n, 4);
+        }
+    }
+
+    void string(std::string_view s)
+    {
+        if (m_cbor) {
+            head(3, s.size());
+        } else {
+            static const uint8_t tags[] = {0xd9, 0xda, 0xdb};
+            length(0xa0, 31, tags, s.size());
+        }
+        m_out.append(s.data(), s.size());
+    }
+
+    void number(const json_value& v)
+    {
+        auto raw = v.raw();
+        const char* first = raw.data();
+        const char* last = first + raw.size();
+
+        uint64_t u;
+        auto res = std::from_chars(first, last, u);
+        if (res.ec == std::errc() && res.ptr == last)
+            return unsigned_integer(u);
+
+        int64_t i;
+        res = std::from_chars(first, last, i);
+        if (res.ec == std::errc() && res.ptr == last)
+            return negative_integer(i);
+
+        double d = v.get_double();
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        byte(m_cbor ? 0xfb : 0xcb);
+        big_endian(bits, 8);
+    }
+
+    void unsigned_integer(uint64_t u)
+    {
+        if (m_cbor)
+            return head(0, u);
+
+        if (u < 0x80) {
+            byte(uint8_t(u));
+        } else if (u <= 0xff) {
+            byte(0xcc);
+            big_endian(u, 1);
+        } else if (u <= 0xffff) {
+            byte(0xcd);
+            big_endian(u, 2);
+        } else if (u <= 0xffffffff) {
+            byte(0xce);
+            big_endian(u, 4);
+        } else {
+            byte(0xcf);
+            big_endian(u, 8);
+        }
+    }
+
+    void negative_integer(int64_t i)
+    {
+        if (m_cbor)
+            return head(1, uint64_t(-(i + 1)));
+
+        if (i >= -32) {
+            byte(uint8_t(i));
+        } else if (i >= INT8_MIN) {
+            byte(0xd0);
+            big_endian(uint64_t(i), 1);
+        } else if (i >= INT16_MIN) {
+            byte(0xd1);
+            big_endian(uint64_t(i), 2);
+        } else if (i >= INT32_MIN) {
+            byte(0xd2);
+            big_endian(uint64_t(i), 4);
+        } else {
+            byte(0xd3);
+            big_endian(uint64_t(i), 8);
+        }
+    }
+
+    // Counting the elements is a scan for their ends only
+    void container(const json_value& v, bool object)
+    {
+        size_t n = size_t(std::distance(v.begin(), v.end()));
+        if (m_cbor) {
+            head(object ? 5 : 4, n);
+        } else if (object) {
+            static const uint8_t tags[] = {0, 0xde, 0xdf};
+            length(0x80, 15, tags, n);
+        } else {
+            static const uint8_t tags[] = {0, 0xdc, 0xdd};
+            length(0x90, 15, tags, n);
+        }
+
+        for (auto it = v.begin(); it != v.end(); ++it) {
+            if (object)
+                key(it.key());
+            value(*it);
+        }
+    }
+
+    void key(std::string_view raw)
+    {
+        if (raw.find('\\') == std::string_view::npos)
+            return string(raw);
+        std::string quoted;
+        quoted.reserve(raw.size() + 2);
+        quoted.append(1, '"').append(raw.data(), raw.size()).append(1, '"');
+        string(parse_json(quoted).get_string());
+    }
+};
+
+} // namespace
+
+std::string encode_json(std::string_view text, json_encoding encoding)
+{
+    if (encoding == json_encoding::text)
+        return std::string(text);
+
+    encoder e(encoding);
+    e.value(parse_json(text));
+    return e.release();
+}
+
+} // namespace runos
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace runos {
+
+// Representations of a JSON document, all carrying the same values
+enum class json_encoding { text, cbor, msgpack };
+
+/**
+ * Re-encodes JSON text as CBOR (RFC 8949) or MessagePack. Integers
+ * fitting in 64 bits stay integers, other numbers become doubles;
+ * containers get definite lengths, counted from the text beforehand.
+ * Throws json_parse_error on malformed text.
+ */
+std::string encode_json(std::string_view text, json_encoding encoding);
+
+} // namespace runos
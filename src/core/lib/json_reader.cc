@@ -0,0 +1,410 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "json_reader.hpp"
+
+#include <runos/core/throw.hpp>
+
+#include <charconv>
+#include <cstring>
+
+namespace runos {
+
+namespace {
+
+constexpr uint64_t ones = 0x0101010101010101ULL;
+constexpr uint64_t highs = 0x8080808080808080ULL;
+
+// High bit set in every byte equal to b, exact up to the first one
+inline uint64_t match_byte(uint64_t word, uint8_t b) noexcept
+{
+    uint64_t v = word ^ (ones * b);
+    return (v - ones) & ~v & highs;
+}
+
+// Index of the first matching byte in memory order
+inline size_t first_byte(uint64_t mask) noexcept
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_ctzll(mask) / 8;
+#else
+    return __builtin_clzll(mask) / 8;
+#endif
+}
+
+inline bool is_ws(char c) noexcept
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+struct cursor {
+    const char* begin;
+    const char* end;
+
+    [[noreturn]] void fail(const char* reason, const char* at) const
+    {
+        THROW(json_parse_error(reason, size_t(at - begin)));
+    }
+
+    const char* skip_ws(const char* p) const noexcept
+    {
+        while (p != end && is_ws(*p))
+            ++p;
+        return p;
+    }
+
+    // p is past the opening quote, returns past the closing one
+    const char* skip_string(const char* p) const
+    {
+        while (end - p >= 8) {
+            uint64_t word;
+            std::memcpy(&word, p, sizeof(word));
+            uint64_t mask = match_byte(word, '"') | match_byte(word, '\\');
+            if (mask == 0) {
+                p += 8;
+                continue;
+            }
+            p += first_byte(mask);
+            if (*p == '"')
+                return p + 1;
+            if (end - p < 2)
+                break;
+            p += 2; // the backslash and the escaped character
+        }
+        while (p != end) {
+            if (*p == '"')
+                return p + 1;
+            if (*p == '\\' && end - p < 2)
+                break;
+            p += *p == '\\' ? 2 : 1;
+        }
+        fail("Unterminated string", p);
+    }
+
+    // p is at the first character of a value, returns past its end
+    const char* skip_value(const char* p) const
+    {
+        if (p == end)
+            fail("Expected a value", p);
+
+        switch (*p) {
+        case '"':
+            return skip_string(p + 1);
+        case '{': case '[':
+            break;
+        case '}': case ']': case ',': case ':':
+            fail("Expected a value", p);
+        default:
+            while (p != end && not is_ws(*p) && *p != ',' && *p != ':'
+                   && *p != ']' && *p != '}')
+                ++p;
+            return p;
+        }
+
+        // Only brackets outside strings matter for finding the end
+        std::string closers;
+        while (p != end) {
+            char c = *p++;
+            switch (c) {
+            case '"':
+                p = skip_string(p);
+                break;
+            case '{':
+                closers.push_back('}');
+                break;
+            case '[':
+                closers.push_back(']');
+                break;
+            case '}': case ']':
+                if (c != closers.back())
+                    fail("Mismatched bracket", p - 1);
+                closers.pop_back();
+                if (closers.empty())
+                    return p;
+                break;
+            }
+        }
+        fail("Unterminated container", p);
+    }
+};
+
+void append_utf8(std::string& out, uint32_t cp)
+{
+    if (cp < 0x80) {
+        out.push_back(char(cp));
+    } else if (cp < 0x800) {
+        out.push_back(char(0xC0 | (cp >> 6)));
+        out.push_back(char(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back(char(0xE0 | (cp >> 12)));
+        out.push_back(char(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(char(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back(char(0xF0 | (cp >> 18)));
+        out.push_back(char(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back(char(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(char(0x80 | (cp & 0x3F)));
+    }
+}
+
+// Contents of a string between the quotes, escapes resolved
+std::string unescape(const cursor& c, const char* p, const char* end)
+{
+    std::string out;
+    out.reserve(size_t(end - p));
+
+    auto hex4 = [&](const char* at) {
+        uint32_t cp = 0;
+        if (end - at < 4)
+            c.fail("Truncated \\u escape", at);
+        auto res = std::from_chars(at, at + 4, cp, 16);
+        if (res.ptr != at + 4)
+            c.fail("Bad \\u escape", at);
+        return cp;
+    };
+
+    while (p != end) {
+        auto bs = static_cast<const char*>(std::memchr(p, '\\', size_t(end - p)));
+        if (not bs) {
+            out.append(p, end);
+            break;
+        }
+        out.append(p, bs);
+        p = bs + 1;
+        if (p == end)
+            c.fail("Bad escape", bs);
+        switch (*p++) {
+        case '"': out.push_back('"'); break;
+        case '\\': out.push_back('\\'); break;
+        case '/': out.push_back('/'); break;
+        case 'b': out.push_back('\b'); break;
+        case 'f': out.push_back('\f'); break;
+        case 'n': out.push_back('\n'); break;
+        case 'r': out.push_back('\r'); break;
+        case 't': out.push_back('\t'); break;
+        case 'u': {
+            uint32_t cp = hex4(p);
+            p += 4;
+            if (cp >= 0xD800 && cp < 0xDC00) {
+                if (end - p < 6 || p[0] != '\\' || p[1] != 'u')
+                    c.fail("Unpaired surrogate", p);
+                uint32_t low = hex4(p + 2);
+                if (low < 0xDC00 || low >= 0xE000)
+                    c.fail("Unpaired surrogate", p);
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                p += 6;
+            }
+            append_utf8(out, cp);
+            break;
+        }
+        default:
+            c.fail("Bad escape", bs);
+        }
+    }
+    return out;
+}
+
+cursor cursor_of(std::string_view text) noexcept
+{
+    return { text.data(), text.data() + text.size() };
+}
+
+} // namespace
+
+json_value::kind json_value::type() const noexcept
+{
+    if (m_text.empty())
+        return kind::missing;
+
+    switch (m_text.front()) {
+    case 'n': return kind::null;
+    case 't': case 'f': return kind::boolean;
+    case '"': return kind::string;
+    case '[': return kind::array;
+    case '{': return kind::object;
+    default: return kind::number;
+    }
+}
+
+json_value json_value::operator[](std::string_view key) const
+{
+    if (type() != kind::object)
+        return {};
+
+    for (auto it = begin(); it != end(); ++it) {
+        auto k = it.key();
+        if (k.find('\\') == std::string_view::npos) {
+            if (k == key)
+                return *it;
+        } else {
+            auto c = cursor_of(m_text);
+            if (unescape(c, k.data(), k.data() + k.size()) == key)
+                return *it;
+        }
+    }
+    return {};
+}
+
+json_value json_value::at(size_t index) const
+{
+    if (type() != kind::array)
+        return {};
+
+    for (auto it = begin(); it != end(); ++it) {
+        if (index-- == 0)
+            return *it;
+    }
+    return {};
+}
+
+bool json_value::get_bool() const
+{
+    if (m_text == "true")
+        return true;
+    if (m_text != "false")
+        THROW(json_parse_error("Not a boolean", 0));
+    return false;
+}
+
+int64_t json_value::get_int64() const
+{
+    const char* first = m_text.data();
+    const char* last = first + m_text.size();
+    int64_t ret = 0;
+    auto res = std::from_chars(first, last, ret);
+    if (res.ec == std::errc() && res.ptr == last)
+        return ret;
+    // Fractions and exponents are truncated, as with nlohmann::json
+    return static_cast<int64_t>(get_double());
+}
+
+uint64_t json_value::get_uint64() const
+{
+    const char* first = m_text.data();
+    const char* last = first + m_text.size();
+    uint64_t ret = 0;
+    auto res = std::from_chars(first, last, ret);
+    if (res.ec == std::errc() && res.ptr == last)
+        return ret;
+    double d = get_double();
+    if (d < 0)
+        THROW(json_parse_error("Negative unsigned value", 0));
+    return static_cast<uint64_t>(d);
+}
+
+double json_value::get_double() const
+{
+    const char* first = m_text.data();
+    const char* last = first + m_text.size();
+    if (type() != kind::number)
+        THROW(json_parse_error("Not a number", 0));
+    double ret = 0;
+    auto res = std::from_chars(first, last, ret);
+    if (res.ec != std::errc() || res.ptr != last)
+        THROW(json_parse_error("Not a number", size_t(res.ptr - first)));
+    return ret;
+}
+
+std::string json_value::get_string() const
+{
+    if (type() != kind::string)
+        THROW(json_parse_error("Not a string", 0));
+    auto c = cursor_of(m_text);
+    return unescape(c, c.begin + 1, c.end - 1);
+}
+
+json_value::iterator json_value::begin() const
+{
+    auto t = type();
+    if (t != kind::array && t != kind::object)
+        return end();
+    return iterator(m_text.data() + 1, m_text.data() + m_text.size(),
+                    t == kind::object);
+}
+
+json_value::iterator::iterator(const char* pos, const char* end, bool object)
+    : m_pos(pos), m_end(end), m_object(object)
+{
+    auto c = cursor { pos, end };
+    pos = c.skip_ws(pos);
+    if (pos != end && *pos == (object ? '}' : ']')) {
+        m_pos = nullptr;
+        return;
+    }
+    m_pos = pos;
+    read();
+}
+
+// Takes the member or element at m_pos
+void json_value::iterator::read()
+{
+    auto c = cursor { m_pos, m_end };
+    const char* p = m_pos;
+
+    if (m_object) {
+        if (p == m_end || *p != '"')
+            c.fail("Expected a member name", p);
+        const char* k = p + 1;
+        p = c.skip_string(k);
+        m_key = std::string_view(k, size_t(p - 1 - k));
+        p = c.skip_ws(p);
+        if (p == m_end || *p != ':')
+            c.fail("Expected ':'", p);
+        p = c.skip_ws(p + 1);
+    }
+
+    const char* v = p;
+    p = c.skip_value(v);
+    m_value = json_value(std::string_view(v, size_t(p - v)));
+    m_next = p;
+}
+
+json_value::iterator& json_value::iterator::operator++()
+{
+    auto c = cursor { m_pos, m_end };
+    const char* p = c.skip_ws(m_next);
+    if (p != m_end && *p == ',') {
+        m_pos = c.skip_ws(p + 1);
+        read();
+    } else if (p != m_end && *p == (m_object ? '}' : ']')) {
+        m_pos = nullptr;
+    } else {
+        c.fail(m_object ? "Expected ',' or '}'" : "Expected ',' or ']'", p);
+    }
+    return *this;
+}
+
+json_value parse_json(std::string_view text)
+{
+    auto c = cursor_of(text);
+    const char* p = c.skip_ws(c.begin);
+    if (p == c.end)
+        return {};
+
+    const char* v = p;
+    p = c.skip_value(v);
+    if (c.skip_ws(p) != c.end)
+        c.fail("Trailing text", p);
+    return json_value(std::string_view(v, size_t(p - v)));
+}
+
+json_document::json_document(std::string text)
+    : m_text(std::make_shared<const std::string>(std::move(text)))
+    , m_root(parse_json(*m_text))
+{ }
+
+} // namespace runos
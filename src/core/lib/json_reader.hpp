@@ -0,0 +1,184 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <runos/core/exception.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace runos {
+
+struct json_parse_error : exception_root, runtime_error_tag
+{
+    json_parse_error(const char* reason, size_t offset)
+    {
+        with("reason", reason);
+        with("offset", offset);
+    }
+};
+
+/**
+ * On-demand view of a JSON value, in the manner of simdjson's on-demand
+ * API: nothing is parsed until a member is looked up or a scalar is
+ * read, and values passed over on the way are only scanned for their
+ * end. Strings are scanned eight bytes at a time for quotes and
+ * backslashes, which is where bulk documents spend almost all the text.
+ *
+ * Values point into the text, it must outlive them. A default-constructed
+ * value is missing: lookups on it yield missing values, iteration yields
+ * nothing and value_or() its default. Reading a scalar of a wrong type
+ * throws json_parse_error.
+ */
+class json_value {
+public:
+    enum class kind { missing, null, boolean, number, string, array, object };
+
+    json_value() = default;
+
+    kind type() const noexcept;
+    bool missing() const noexcept { return m_text.empty(); }
+    bool is_null() const noexcept { return type() == kind::null; }
+
+    // Exact text of the value
+    std::string_view raw() const noexcept { return m_text; }
+
+    // Member of an object, missing if absent; a linear scan per lookup
+    json_value operator[](std::string_view key) const;
+    json_value operator[](const char* key) const
+    { return (*this)[std::string_view(key)]; }
+    // Element of an array, missing if out of range
+    json_value at(size_t index) const;
+
+    bool get_bool() const;
+    int64_t get_int64() const;
+    uint64_t get_uint64() const;
+    double get_double() const;
+    std::string get_string() const;
+
+    template<class T>
+    T get() const
+    {
+        if constexpr (std::is_same<T, bool>::value) {
+            return get_bool();
+        } else if constexpr (std::is_integral<T>::value
+                             && std::is_signed<T>::value) {
+            return static_cast<T>(get_int64());
+        } else if constexpr (std::is_integral<T>::value) {
+            return static_cast<T>(get_uint64());
+        } else if constexpr (std::is_floating_point<T>::value) {
+            return static_cast<T>(get_double());
+        } else {
+            static_assert(std::is_same<T, std::string>::value,
+                          "Unsupported json_value::get type");
+            return get_string();
+        }
+    }
+
+    // Like get(), but null and missing values give `def`
+    template<class T>
+    T value_or(T def) const
+    {
+        auto t = type();
+        return t == kind::missing || t == kind::null ? def : get<T>();
+    }
+
+    /**
+     * Forward iteration over array elements or object members; both
+     * yield values, object iterators also have key(). Iterating a value
+     * of another type yields nothing.
+     */
+    class iterator;
+    iterator begin() const;
+    iterator end() const;
+
+private:
+    friend json_value parse_json(std::string_view text);
+    std::string_view m_text;
+
+    explicit json_value(std::string_view text) noexcept : m_text(text) { }
+};
+
+class json_value::iterator {
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = json_value;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const json_value*;
+    using reference = const json_value&;
+
+    iterator() = default;
+
+    reference operator*() const noexcept { return m_value; }
+    pointer operator->() const noexcept { return &m_value; }
+    iterator& operator++();
+    iterator operator++(int) { auto ret = *this; ++*this; return ret; }
+
+    // Raw key text of an object member, escapes are kept
+    std::string_view key() const noexcept { return m_key; }
+
+    friend bool operator==(const iterator& a, const iterator& b) noexcept
+    { return a.m_pos == b.m_pos; }
+    friend bool operator!=(const iterator& a, const iterator& b) noexcept
+    { return a.m_pos != b.m_pos; }
+
+private:
+    friend class json_value;
+    const char* m_pos = nullptr; // before the element, null at the end
+    const char* m_end = nullptr;
+    const char* m_next = nullptr; // past the value
+    bool m_object = false;
+    std::string_view m_key;
+    json_value m_value;
+
+    iterator(const char* pos, const char* end, bool object);
+    void read();
+};
+
+inline json_value::iterator json_value::end() const { return iterator(); }
+
+// Checks that the text is one balanced value, scalars are checked on access
+json_value parse_json(std::string_view text);
+
+/**
+ * JSON text with its root value. The text is shared, so documents are
+ * cheap to copy and values taken from them stay valid while any copy
+ * lives. Empty text makes a missing root.
+ */
+class json_document {
+public:
+    json_document() = default;
+    explicit json_document(std::string text);
+
+    const json_value& root() const noexcept { return m_root; }
+    json_value operator[](std::string_view key) const { return m_root[key]; }
+    json_value::iterator begin() const { return m_root.begin(); }
+    json_value::iterator end() const { return m_root.end(); }
+
+private:
+    std::shared_ptr<const std::string> m_text;
+    json_value m_root;
+};
+
+} // namespace runos
@@ -0,0 +1,384 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "json_writer.hpp"
+
+#include <runos/core/assert.hpp>
+
+#include <iterator>
+
+namespace runos {
+
+constexpr size_t json_writer::default_chunk_size;
+
+json_writer::json_writer(size_t chunk_size)
+    : m_chunk_size(std::max<size_t>(chunk_size, 1))
+{ }
+
+json_writer::projection::projection(std::string_view list)
+{
+    while (not list.empty()) {
+        auto comma = list.find(',');
+        auto path = list.substr(0, comma);
+        list.remove_prefix(comma == list.npos ? list.size() : comma + 1);
+
+        node* n = &m_root;
+        bool named = false;
+        while (not path.empty() && not (named && n->all)) {
+            auto dot = path.find('.');
+            auto name = path.substr(0, dot);
+            path.remove_prefix(dot == path.npos ? path.size() : dot + 1);
+            while (not name.empty() && name.front() == ' ')
+                name.remove_prefix(1);
+            while (not name.empty() && name.back() == ' ')
+                name.remove_suffix(1);
+            if (name.empty())
+                continue;
+            n = &n->fields[std::string(name)];
+            named = true;
+        }
+        if (named) {
+            // "a" after "a.b" widens it to the whole of "a"
+            n->all = true;
+            n->fields.clear();
+        }
+    }
+}
+
+json_writer& json_writer::raw(std::string_view s)
+{
+    while (not s.empty()) {
+        if (m_chunks.empty() || m_chunks.back().size() >= m_chunk_size) {
+            m_chunks.emplace_back();
+            m_chunks.back().reserve(m_chunk_size);
+        }
+        auto& chunk = m_chunks.back();
+        size_t n = std::min(s.size(), m_chunk_size - chunk.size());
+        chunk.append(s.data(), n);
+        s.remove_prefix(n);
+        m_size += n;
+    }
+    return *this;
+}
+
+// Filter of member `name` under f; sets drop if it is not requested
+json_writer::filter json_writer::narrow(filter f, std::string_view name,
+                                        bool& drop)
+{
+    drop = false;
+    if (not f)
+        return nullptr;
+    auto it = f->fields.find(name);
+    if (it == f->fields.end()) {
+        drop = true;
+        return nullptr;
+    }
+    return it->second.all ? nullptr : &it->second;
+}
+
+// Filter of the value about to be written
+json_writer::filter json_writer::next_filter() const
+{
+    if (m_after_key)
+        return m_member_filter;
+    if (m_levels.empty() || m_levels.back().object)
+        return nullptr;
+    if (m_levels.back().items)
+        return &m_projection->root();
+    return m_levels.back().fields;
+}
+
+// Whether the array about to be written is the collection array
+bool json_writer::next_items() const
+{
+    if (not m_projection)
+        return false;
+    return m_levels.empty() || (m_after_key && m_member_items);
+}
+
+// Swallows a scalar value dropped by the projection
+bool json_writer::skipped()
+{
+    if (m_skip == 0)
+        return false;
+    if (m_skip == 1)
+        m_skip = 0;
+    return true;
+}
+
+bool json_writer::wants(std::string_view name) const
+{
+    if (m_skip)
+        return false;
+    if (m_levels.empty() || not m_levels.back().object)
+        return true;
+    bool drop;
+    narrow(m_levels.back().fields, name, drop);
+    return not drop;
+}
+
+// Emits a comma between siblings
+void json_writer::separate()
+{
+    if (m_after_key) {
+        m_after_key = false;
+        return;
+    }
+    if (m_levels.empty())
+        return;
+
+    auto& top = m_levels.back();
+    ASSERT(not top.object, "Object member without a key");
+    if (not top.empty)
+        raw(",");
+    top.empty = false;
+}
+
+json_writer& json_writer::begin_object()
+{
+    if (m_skip) {
+        ++m_skip;
+        return *this;
+    }
+    level l {true, true, next_filter(), false};
+    separate();
+    m_levels.push_back(l);
+    return raw("{");
+}
+
+json_writer& json_writer::end_object()
+{
+    if (m_skip) {
+        if (--m_skip == 1)
+            m_skip = 0;
+        return *this;
+    }
+    ASSERT(not m_levels.empty());
+    ASSERT(m_levels.back().object);
+    m_levels.pop_back();
+    return raw("}");
+}
+
+json_writer& json_writer::begin_array()
+{
+    if (m_skip) {
+        ++m_skip;
+        return *this;
+    }
+    level l {false, true, next_filter(), next_items()};
+    separate();
+    m_levels.push_back(l);
+    return raw("[");
+}
+
+json_writer& json_writer::end_array()
+{
+    if (m_skip) {
+        if (--m_skip == 1)
+            m_skip = 0;
+        return *this;
+    }
+    ASSERT(not m_levels.empty());
+    ASSERT(not m_levels.back().object);
+    m_levels.pop_back();
+    return raw("]");
+}
+
+json_writer& json_writer::key(std::string_view name)
+{
+    if (m_skip)
+        return *this;
+    ASSERT(not m_levels.empty());
+    ASSERT(m_levels.back().object, "Key outside of an object");
+    ASSERT(not m_after_key, "Key without a value");
+    auto& top = m_levels.back();
+
+    bool drop;
+    m_member_filter = narrow(top.fields, name, drop);
+    if (drop) {
+        m_skip = 1;
+        return *this;
+    }
+
+    if (not top.empty)
+        raw(",");
+    top.empty = false;
+
+    m_member_items = false;
+    if (m_levels.size() == 1) {
+        m_array_key |= name == "array";
+        m_size_key |= name == "_size";
+        m_member_items = name == "array";
+    }
+
+    string(name);
+    raw(":");
+    m_after_key = true;
+    return *this;
+}
+
+json_writer& json_writer::value(std::string_view s)
+{
+    if (skipped())
+        return *this;
+    separate();
+    return string(s);
+}
+
+json_writer& json_writer::value(bool b)
+{
+    if (skipped())
+        return *this;
+    separate();
+    return raw(b ? "true" : "false");
+}
+
+json_writer& json_writer::value(std::nullptr_t)
+{
+    if (skipped())
+        return *this;
+    separate();
+    return raw("null");
+}
+
+json_writer& json_writer::value(json_writer&& fragment)
+{
+    ASSERT(fragment.m_levels.empty(), "Unbalanced fragment");
+    if (skipped()) {
+        fragment.m_chunks.clear();
+        fragment.m_size = 0;
+        return *this;
+    }
+    separate();
+    for (auto& chunk : fragment.m_chunks) {
+        m_size += chunk.size();
+        m_chunks.push_back(std::move(chunk));
+    }
+    fragment.m_chunks.clear();
+    fragment.m_size = 0;
+    return *this;
+}
+
+json_writer& json_writer::json(std::string_view text)
+{
+    if (skipped())
+        return *this;
+    separate();
+    return raw(text);
+}
+
+json_writer& json_writer::value(const ptree& pt)
+{
+    if (skipped())
+        return *this;
+    filter fields = next_filter();
+    bool items = next_items();
+    bool root = m_levels.empty();
+    separate();
+    write_tree(pt, root, fields, items);
+    return *this;
+}
+
+void json_writer::write_tree(const ptree& pt, bool root, filter fields,
+                             bool items)
+{
+    if (not root && pt.empty()) {
+        string(pt.data());
+    } else if (not root && pt.count(std::string()) == pt.size()) {
+        raw("[");
+        bool first = true;
+        for (auto& child : pt) {
+            if (not first)
+                raw(",");
+            first = false;
+            write_tree(child.second, false,
+                       items ? &m_projection->root() : fields, false);
+        }
+        raw("]");
+    } else {
+        raw("{");
+        bool first = true;
+        for (auto& child : pt) {
+            bool drop;
+            filter member = narrow(fields, child.first, drop);
+            if (drop)
+                continue;
+            if (not first)
+                raw(",");
+            first = false;
+            bool member_items = false;
+            if (root) {
+                m_array_key |= child.first == "array";
+                m_size_key |= child.first == "_size";
+                member_items = m_projection && child.first == "array";
+            }
+            string(child.first);
+            raw(":");
+            write_tree(child.second, false, member, member_items);
+        }
+        raw("}");
+    }
+}
+
+// Escapes like write_json() does
+json_writer& json_writer::string(std::string_view s)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    raw("\"");
+    size_t plain = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        unsigned char c = s[i];
+        const char* esc = nullptr;
+        switch (c) {
+        case '"': esc = "\\\""; break;
+        case '\\': esc = "\\\\"; break;
+        case '/': esc = "\\/"; break;
+        case '\b': esc = "\\b"; break;
+        case '\f': esc = "\\f"; break;
+        case '\n': esc = "\\n"; break;
+        case '\r': esc = "\\r"; break;
+        case '\t': esc = "\\t"; break;
+        default:
+            if (c >= 0x20)
+                continue;
+        }
+
+        raw(s.substr(plain, i - plain));
+        plain = i + 1;
+        if (esc) {
+            raw(esc);
+        } else {
+            char u[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+            raw(std::string_view(u, sizeof(u)));
+        }
+    }
+    raw(s.substr(plain));
+    return raw("\"");
+}
+
+json_writer::chunk_list json_writer::release()
+{
+    ASSERT(m_levels.empty(), "Unbalanced document");
+    chunk_list ret;
+    ret.swap(m_chunks);
+    m_size = 0;
+    m_array_key = m_size_key = false;
+    return ret;
+}
+
+} // namespace runos
@@ -0,0 +1,187 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#undef foreach
+#include <boost/property_tree/ptree.hpp>
+
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Writes JSON text straight into a list of fixed-size chunks.
+ *
+ * Nothing is materialized besides the text itself, and the chunks are
+ * never reallocated or concatenated, so they can be handed to the
+ * connection one by one. Commas and nesting are tracked by the writer;
+ * the caller only has to balance begin_*() and end_*() calls.
+ *
+ * A projection limits the elements of a collection array (the "array"
+ * member of the top-level object, or a top-level array) to some of
+ * their fields. Other members are dropped while being written, and
+ * wants() lets the caller skip computing them at all.
+ */
+class json_writer {
+public:
+    using ptree = boost::property_tree::ptree;
+    using chunk_list = std::vector<std::string>;
+
+    // Comma-separated field paths, "dpid,stats.integral.rx-bytes"
+    class projection {
+    public:
+        struct node {
+            bool all = false; // whole value requested
+            std::map<std::string, node, std::less<>> fields;
+        };
+
+        explicit projection(std::string_view list);
+
+        bool empty() const noexcept { return m_root.fields.empty(); }
+        // Whether elements keep this member
+        bool wants(std::string_view name) const
+        { return empty() || m_root.fields.count(name) != 0; }
+        const node& root() const noexcept { return m_root; }
+
+    private:
+        node m_root;
+    };
+
+    static constexpr size_t default_chunk_size = 64 * 1024;
+
+    explicit json_writer(size_t chunk_size = default_chunk_size);
+
+    json_writer& begin_object();
+    json_writer& end_object();
+    json_writer& begin_array();
+    json_writer& end_array();
+    json_writer& key(std::string_view name);
+
+    json_writer& value(std::string_view s);
+    json_writer& value(const char* s) { return value(std::string_view(s)); }
+    json_writer& value(const std::string& s) { return value(std::string_view(s)); }
+    json_writer& value(bool b);
+    json_writer& value(std::nullptr_t);
+
+    template<class T>
+    std::enable_if_t<std::is_arithmetic<T>::value, json_writer&>
+    value(T x)
+    {
+        if (skipped())
+            return *this;
+        separate();
+        return raw(to_text(x));
+    }
+
+    // Complete JSON value produced by another writer
+    json_writer& value(json_writer&& fragment);
+
+    // Complete JSON value given as text, written as is (unprojected)
+    json_writer& json(std::string_view text);
+
+    // Same text as write_json(): nodes with only unnamed children
+    // become arrays and every leaf is a string.
+    json_writer& value(const ptree& pt);
+
+    // Member written the way ptree::put() followed by write_json() would,
+    // so streaming resources keep the format of ptree-based ones.
+    template<class T>
+    json_writer& put(std::string_view name, const T& x)
+    {
+        key(name);
+        if constexpr (std::is_same<T, bool>::value) {
+            return value(x ? "true" : "false");
+        } else if constexpr (std::is_arithmetic<T>::value) {
+            return value(to_text(x));
+        } else if constexpr (std::is_convertible<const T&, std::string_view>::value) {
+            return value(std::string_view(x));
+        } else {
+            std::ostringstream ss;
+            ss << x;
+            return value(ss.str());
+        }
+    }
+
+    // Applies to collection elements written from now on; the
+    // projection must outlive the writer. Fragments meant for a
+    // projected document need the same projection.
+    void project(const projection* p) noexcept
+    { m_projection = p && not p->empty() ? p : nullptr; }
+    const projection* projected() const noexcept { return m_projection; }
+
+    // Whether a member with this name would be written at this point
+    bool wants(std::string_view name) const;
+
+    size_t size() const noexcept { return m_size; }
+
+    // Top-level object has both "array" and "_size" members
+    bool collection() const noexcept { return m_array_key && m_size_key; }
+
+    chunk_list release();
+
+private:
+    using filter = const projection::node*; // nullptr keeps everything
+
+    struct level {
+        bool object;
+        bool empty;
+        filter fields;
+        bool items; // collection array
+    };
+
+    size_t m_chunk_size;
+    chunk_list m_chunks;
+    std::vector<level> m_levels;
+    size_t m_size = 0;
+    const projection* m_projection = nullptr;
+    filter m_member_filter = nullptr; // of the value after key()
+    bool m_member_items = false;
+    size_t m_skip = 0; // nesting of a dropped value, 1 before it starts
+    bool m_after_key = false;
+    bool m_array_key = false;
+    bool m_size_key = false;
+
+    template<class T>
+    static std::string to_text(T x)
+    {
+        if constexpr (std::is_integral<T>::value) {
+            return std::to_string(x);
+        } else {
+            std::ostringstream ss;
+            ss.precision(std::numeric_limits<T>::max_digits10);
+            ss << x;
+            return ss.str();
+        }
+    }
+
+    static filter narrow(filter f, std::string_view name, bool& drop);
+    filter next_filter() const;
+    bool next_items() const;
+    bool skipped();
+    void separate();
+    void write_tree(const ptree& pt, bool root, filter fields, bool items);
+    json_writer& raw(std::string_view s);
+    json_writer& string(std::string_view s);
+};
+
+} // namespace runos
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace runos {
+
+/**
+ * View of some elements of a vector, given by a run of their indices.
+ * Valid while both the vector and the index storage live.
+ */
+template<class T>
+class index_span {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using reference = T&;
+
+        iterator(T* base, const uint32_t* pos)
+            : base_(base), pos_(pos)
+        { }
+
+        T& operator*() const { return base_[*pos_]; }
+        T* operator->() const { return &base_[*pos_]; }
+        iterator& operator++() { ++pos_; return *this; }
+        bool operator==(const iterator& other) const
+        { return pos_ == other.pos_; }
+        bool operator!=(const iterator& other) const
+        { return pos_ != other.pos_; }
+
+    private:
+        T* base_;
+        const uint32_t* pos_;
+    };
+
+    index_span(T* base, const uint32_t* begin, const uint32_t* end)
+        : base_(base), begin_(begin), end_(end)
+    { }
+
+    iterator begin() const { return {base_, begin_}; }
+    iterator end() const { return {base_, end_}; }
+    size_t size() const { return size_t(end_ - begin_); }
+    bool empty() const { return begin_ == end_; }
+    T& front() const { return base_[*begin_]; }
+
+private:
+    T* base_;
+    const uint32_t* begin_;
+    const uint32_t* end_;
+};
+
+/**
+ * Groups elements of a vector by key without moving or copying them.
+ *
+ * The key function runs once per element and returns std::nullopt for
+ * elements that belong to no group. Indices are then counting-sorted into
+ * one span per distinct key; groups keep the order in which their keys
+ * first appear, elements keep their order inside a group.
+ */
+template<class Key, class T>
+class key_buckets {
+public:
+    template<class KeyFn>
+    key_buckets(std::vector<T>& items, KeyFn&& key_of)
+        : items_(items)
+    {
+        constexpr uint32_t none = uint32_t(-1);
+        std::vector<uint32_t> bucket_of(items.size(), none);
+        std::unordered_map<Key, uint32_t> ids;
+
+        offsets_.push_back(0);
+        for (size_t i = 0; i < items.size(); ++i) {
+            std::optional<Key> key = key_of(items[i]);
+            if (not key)
+                continue;
+            auto id = ids.emplace(*key, uint32_t(keys_.size()));
+            if (id.second) {
+                keys_.push_back(*key);
+                offsets_.push_back(0);
+            }
+            bucket_of[i] = id.first->second;
+            ++offsets_[id.first->second + 1];
+        }
+
+        for (size_t b = 1; b < offsets_.size(); ++b) {
+            offsets_[b] += offsets_[b - 1];
+        }
+
+        index_.resize(offsets_.back());
+        std::vector<uint32_t> next(offsets_.begin(), offsets_.end() - 1);
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (bucket_of[i] != none)
+                index_[next[bucket_of[i]]++] = uint32_t(i);
+        }
+    }
+
+    // Number of groups
+    size_t size() const { return keys_.size(); }
+
+    const Key& key(size_t bucket) const { return keys_[bucket]; }
+
+    index_span<T> operator[](size_t bucket) const
+    {
+        return { items_.data(),
+                 index_.data() + offsets_[bucket],
+                 index_.data() + offsets_[bucket + 1] };
+    }
+
+private:
+    std::vector<T>& items_;
+    std::vector<Key> keys_;
+    std::vector<uint32_t> offsets_;
+    std::vector<uint32_t> index_;
+};
+
+} // namespace runos
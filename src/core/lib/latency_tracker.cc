@@ -0,0 +1,72 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "latency_tracker.hpp"
+
+#include <algorithm>
+
+namespace runos {
+
+static constexpr double recent_alpha = 0.2;
+static constexpr double baseline_down_alpha = 0.1;
+static constexpr double baseline_up_alpha = 0.002;
+
+void latency_tracker::record(nanoseconds rtt, clock::time_point now,
+                             settings const& s)
+{
+    double sample = std::max<int64_t>(rtt.count(), 0);
+    uint64_t n = m_samples.load(std::memory_order_relaxed);
+
+    double recent = m_recent.load(std::memory_order_relaxed);
+    double baseline = m_baseline.load(std::memory_order_relaxed);
+    if (n == 0) {
+        recent = baseline = sample;
+    } else {
+        recent += recent_alpha * (sample - recent);
+        // Warming up the baseline follows the recent average as is
+        double alpha = n < s.warmup ? recent_alpha
+                     : recent < baseline ? baseline_down_alpha
+                     : baseline_up_alpha;
+        baseline += alpha * (recent - baseline);
+    }
+
+    m_recent.store(int64_t(recent), std::memory_order_relaxed);
+    m_baseline.store(int64_t(baseline), std::memory_order_relaxed);
+    m_samples.store(n + 1, std::memory_order_relaxed);
+    m_updated.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+}
+
+bool latency_tracker::active(clock::time_point now, settings const& s) const
+{
+    auto updated = clock::time_point(
+        clock::duration(m_updated.load(std::memory_order_relaxed)));
+    return samples() >= s.warmup && now - updated <= s.stale;
+}
+
+double latency_tracker::slowdown(clock::time_point now,
+                                 settings const& s) const
+{
+    if (not active(now, s))
+        return 1.0;
+
+    double floor = std::chrono::duration_cast<nanoseconds>(s.floor).count();
+    double ratio = recent().count() / std::max<double>(baseline().count(),
+                                                       floor);
+    return std::clamp(ratio, 1.0, std::max(1.0, s.max_slowdown));
+}
+
+} // namespace runos
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace runos {
+
+/**
+ * Tells how much slower than usual a peer answers.
+ *
+ * `recent` is a fast moving average of the reply time. `baseline` follows
+ * improvements quickly but degradation only very slowly, so it remembers
+ * how fast the peer used to be. slowdown() is recent / baseline, clamped
+ * to [1, max_slowdown]; baselines below `floor` count as `floor`, so
+ * jitter on a sub-millisecond link doesn't look like a slowdown. Until
+ * `warmup` replies are seen, or if none came for `stale`, slowdown()
+ * is 1.
+ *
+ * record() must not be called concurrently, readers may run any time.
+ */
+class latency_tracker {
+public:
+    using clock = std::chrono::steady_clock;
+    using nanoseconds = std::chrono::nanoseconds;
+
+    struct settings {
+        std::chrono::microseconds floor {1000};
+        double max_slowdown {16.0};
+        unsigned warmup {16};
+        std::chrono::seconds stale {60};
+    };
+
+    void record(nanoseconds rtt, clock::time_point now, settings const& s);
+
+    nanoseconds recent() const
+    { return nanoseconds(m_recent.load(std::memory_order_relaxed)); }
+    nanoseconds baseline() const
+    { return nanoseconds(m_baseline.load(std::memory_order_relaxed)); }
+    uint64_t samples() const
+    { return m_samples.load(std::memory_order_relaxed); }
+
+    // Whether slowdown() says anything: warmed up and not stale
+    bool active(clock::time_point now, settings const& s) const;
+    double slowdown(clock::time_point now, settings const& s) const;
+
+private:
+    std::atomic<int64_t> m_recent {0};
+    std::atomic<int64_t> m_baseline {0};
+    std::atomic<uint64_t> m_samples {0};
+    std::atomic<clock::rep> m_updated {0};
+};
+
+} // namespace runos
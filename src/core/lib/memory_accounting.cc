@@ -0,0 +1,115 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "memory_accounting.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+namespace runos {
+namespace memory {
+
+Usage Report::total() const
+{
+    Usage ret;
+    for (const auto& e : entries) {
+        ret += e.usage;
+    }
+    return ret;
+}
+
+std::map<std::string, Usage> Report::by_application() const
+{
+    std::map<std::string, Usage> ret;
+    for (const auto& e : entries) {
+        ret[e.application] += e.usage;
+    }
+    return ret;
+}
+
+std::map<uint64_t, Usage> Report::by_switch() const
+{
+    std::map<uint64_t, Usage> ret;
+    for (const auto& e : entries) {
+        if (e.dpid != 0) {
+            ret[e.dpid] += e.usage;
+        }
+    }
+    return ret;
+}
+
+void Sheet::add(std::string what, Usage usage, uint64_t dpid)
+{
+    entries_.push_back(Entry{ application_, std::move(what), dpid, usage });
+}
+
+void Registry::Handle::reset()
+{
+    if (registry_) {
+        registry_->remove(id_);
+        registry_ = nullptr;
+    }
+}
+
+Registry& Registry::global()
+{
+    static Registry instance;
+    return instance;
+}
+
+Registry::Handle Registry::probe(std::string application, Probe probe)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto id = ++last_id_;
+    probes_.emplace(id, registration{ std::move(application),
+                                      std::move(probe) });
+    return Handle(this, id);
+}
+
+// Probes run under the registry lock: removing one waits until it is
+// done, so an owner may destroy what the probe looks at right after.
+Report Registry::collect() const
+{
+    Report ret;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& pair : probes_) {
+        Sheet sheet(pair.second.application, ret.entries);
+        pair.second.probe(sheet);
+    }
+    return ret;
+}
+
+void Registry::remove(uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    probes_.erase(id);
+}
+
+int64_t process_status_kb(const char* field)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, std::strlen(field), field) == 0)
+            return std::strtoll(line.c_str() + std::strlen(field), nullptr, 10);
+    }
+    return 0;
+}
+
+} // namespace memory
+} // namespace runos
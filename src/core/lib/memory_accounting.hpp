@@ -0,0 +1,217 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace runos {
+namespace memory {
+
+/**
+ * Memory held by applications, estimated on demand.
+ *
+ * Applications register probes which walk their major containers under
+ * their own locks and add up what they hold, per switch where the data
+ * belongs to one. Nothing is counted on the allocation path, so the
+ * numbers are estimates: element sizes plus the overhead of the
+ * standard containers' nodes and buckets.
+ */
+
+struct Usage {
+    uint64_t bytes {0};
+    uint64_t items {0};
+
+    Usage& operator+=(const Usage& rhs)
+    {
+        bytes += rhs.bytes;
+        items += rhs.items;
+        return *this;
+    }
+};
+
+struct Entry {
+    std::string application;
+    std::string what;   // container or kind of objects
+    uint64_t dpid;      // 0 if not tied to a switch
+    Usage usage;
+};
+
+struct Report {
+    std::vector<Entry> entries;
+
+    Usage total() const;
+    std::map<std::string, Usage> by_application() const;
+    std::map<uint64_t, Usage> by_switch() const;
+};
+
+// Filled by a probe, entries get the probe's application name
+class Sheet {
+public:
+    void add(std::string what, Usage usage, uint64_t dpid = 0);
+
+private:
+    friend class Registry;
+
+    Sheet(std::string application, std::vector<Entry>& entries)
+        : application_(std::move(application)), entries_(entries)
+    { }
+
+    std::string application_;
+    std::vector<Entry>& entries_;
+};
+
+class Registry {
+public:
+    using Probe = std::function<void(Sheet&)>;
+
+    class Handle {
+    public:
+        Handle() = default;
+        Handle(Handle&& rhs) noexcept
+            : registry_(rhs.registry_), id_(rhs.id_)
+        {
+            rhs.registry_ = nullptr;
+        }
+        Handle& operator=(Handle&& rhs) noexcept
+        {
+            if (this != &rhs) {
+                reset();
+                registry_ = rhs.registry_;
+                id_ = rhs.id_;
+                rhs.registry_ = nullptr;
+            }
+            return *this;
+        }
+        ~Handle() { reset(); }
+
+        // Unregisters the probe, waits if it is running
+        void reset();
+
+    private:
+        friend class Registry;
+        Handle(Registry* registry, uint64_t id)
+            : registry_(registry), id_(id)
+        { }
+
+        Registry* registry_ {nullptr};
+        uint64_t id_ {0};
+    };
+
+    static Registry& global();
+
+    // Probe is called on the collecting thread until the handle is gone
+    Handle probe(std::string application, Probe probe);
+
+    Report collect() const;
+
+private:
+    struct registration {
+        std::string application;
+        Probe probe;
+    };
+
+    mutable std::mutex mutex_;
+    uint64_t last_id_ {0};
+    std::map<uint64_t, registration> probes_;
+
+    void remove(uint64_t id);
+};
+
+// Field of /proc/self/status in kB: VmRSS, its peak VmHWM; 0 if missing
+int64_t process_status_kb(const char* field = "VmRSS:");
+
+//
+// Shallow footprint of standard containers: elements are counted by
+// sizeof, memory they own is up to the probe.
+//
+
+constexpr uint64_t node_overhead = 2 * sizeof(void*); // malloc header
+
+template<class T, class A>
+Usage footprint(const std::vector<T, A>& c)
+{
+    return { c.capacity() * sizeof(T), c.size() };
+}
+
+template<class T, class A>
+Usage footprint(const std::list<T, A>& c)
+{
+    return { c.size() * (sizeof(T) + 2 * sizeof(void*) + node_overhead),
+             c.size() };
+}
+
+// red-black tree node: three links and a color
+template<class V>
+Usage tree_footprint(size_t size)
+{
+    return { size * (sizeof(V) + 4 * sizeof(void*) + node_overhead), size };
+}
+
+template<class K, class C, class A>
+Usage footprint(const std::set<K, C, A>& c)
+{
+    return tree_footprint<K>(c.size());
+}
+
+template<class K, class V, class C, class A>
+Usage footprint(const std::map<K, V, C, A>& c)
+{
+    return tree_footprint<typename std::map<K, V, C, A>::value_type>(
+        c.size());
+}
+
+// hash node: a link and the cached hash, plus the bucket array
+template<class V, class C>
+Usage hash_footprint(const C& c)
+{
+    return { c.size() * (sizeof(V) + 2 * sizeof(void*) + node_overhead) +
+                 c.bucket_count() * sizeof(void*),
+             c.size() };
+}
+
+template<class K, class H, class E, class A>
+Usage footprint(const std::unordered_set<K, H, E, A>& c)
+{
+    return hash_footprint<K>(c);
+}
+
+template<class K, class V, class H, class E, class A>
+Usage footprint(const std::unordered_map<K, V, H, E, A>& c)
+{
+    return hash_footprint<
+        typename std::unordered_map<K, V, H, E, A>::value_type>(c);
+}
+
+// Heap part only, short strings live inside the object
+inline uint64_t heap_bytes(const std::string& s)
+{
+    return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+} // namespace memory
+} // namespace runos
@@ -0,0 +1,228 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "metrics.hpp"
+
+#include <runos/core/throw.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace runos {
+namespace metrics {
+
+size_t thread_shard()
+{
+    static std::atomic<size_t> next {0};
+    thread_local size_t shard = next++ % Counter::shards;
+    return shard;
+}
+
+uint64_t Counter::value() const noexcept
+{
+    uint64_t ret = 0;
+    for (auto& s : shard_)
+        ret += s.value.load(std::memory_order_relaxed);
+    return ret;
+}
+
+size_t Histogram::bucket(uint64_t value) noexcept
+{
+    if (value < sub_count)
+        return value;
+    unsigned e = 63 - __builtin_clzll(value);
+    return ((e - sub_bits + 1) << sub_bits)
+         + ((value >> (e - sub_bits)) & (sub_count - 1));
+}
+
+uint64_t Histogram::upper_bound(size_t i) noexcept
+{
+    if (i < sub_count)
+        return i + 1;
+    unsigned e = (i >> sub_bits) + sub_bits - 1;
+    uint64_t m = sub_count + (i & (sub_count - 1)) + 1;
+    if (m == 2 * sub_count && e == 63)
+        return std::numeric_limits<uint64_t>::max();
+    return m << (e - sub_bits);
+}
+
+uint64_t Histogram::quantile(double q) const noexcept
+{
+    uint64_t counts[bucket_count];
+    uint64_t total = 0;
+    for (size_t i = 0; i < bucket_count; ++i)
+        total += counts[i] = bucket_value(i);
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = std::max<uint64_t>(
+        1, uint64_t(std::ceil(std::clamp(q, 0.0, 1.0) * total)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+        seen += counts[i];
+        if (seen >= rank)
+            return upper_bound(i);
+    }
+    return upper_bound(bucket_count - 1);
+}
+
+Registry& Registry::global()
+{
+    static Registry registry;
+    return registry;
+}
+
+static std::string format_labels(Labels const& labels)
+{
+    std::string ret;
+    for (auto& label : labels) {
+        ret += ret.empty() ? "" : ",";
+        ret += label.first;
+        ret += "=\"";
+        for (char c : label.second) {
+            switch (c) {
+            case '\\': ret += "\\\\"; break;
+            case '"':  ret += "\\\""; break;
+            case '\n': ret += "\\n";  break;
+            default:   ret += c;
+            }
+        }
+        ret += '"';
+    }
+    return ret;
+}
+
+auto Registry::family(std::string const& name, std::string const& help)
+    -> Family&
+{
+    auto& ret = families_[name];
+    if (ret.help.empty())
+        ret.help = help;
+    return ret;
+}
+
+Counter& Registry::counter(std::string const& name, std::string const& help,
+                           Labels const& labels)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& f = family(name, help);
+    THROW_IF(not f.histograms.empty(), std::invalid_argument(name),
+             "Metric {} is a histogram", name);
+    auto& ret = f.counters[format_labels(labels)];
+    if (not ret)
+        ret.reset(new Counter);
+    return *ret;
+}
+
+Histogram& Registry::histogram(std::string const& name,
+                               std::string const& help,
+                               Labels const& labels, double scale)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& f = family(name, help);
+    THROW_IF(not f.counters.empty(), std::invalid_argument(name),
+             "Metric {} is a counter", name);
+    f.scale = scale;
+    auto& ret = f.histograms[format_labels(labels)];
+    if (not ret)
+        ret.reset(new Histogram);
+    return *ret;
+}
+
+static std::string format_double(double value)
+{
+    std::ostringstream out;
+    out.precision(9);
+    out << value;
+    return out.str();
+}
+
+static std::string with_label(std::string const& labels,
+                              std::string const& extra)
+{
+    if (labels.empty())
+        return '{' + extra + '}';
+    return '{' + labels + ',' + extra + '}';
+}
+
+auto Registry::histograms(std::string const& name) const
+    -> std::vector<std::pair<std::string, const Histogram*>>
+{
+    std::vector<std::pair<std::string, const Histogram*>> ret;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = families_.find(name);
+    if (it == families_.end())
+        return ret;
+    for (auto& h : it->second.histograms)
+        ret.emplace_back(h.first, h.second.get());
+    return ret;
+}
+
+std::string Registry::prometheus() const
+{
+    std::ostringstream out;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& named : families_) {
+        auto& name = named.first;
+        auto& f = named.second;
+
+        out << "# HELP " << name << ' ' << f.help << '\n';
+        if (not f.counters.empty()) {
+            out << "# TYPE " << name << " counter\n";
+            for (auto& c : f.counters) {
+                out << name << (c.first.empty() ? "" : '{' + c.first + '}')
+                    << ' ' << c.second->value() << '\n';
+            }
+            continue;
+        }
+
+        out << "# TYPE " << name << " histogram\n";
+        for (auto& h : f.histograms) {
+            // Buckets are merged to powers of two, that's plenty for
+            // dashboards; exact quantiles are left to quantile()
+            uint64_t total = 0;
+            uint64_t count = 0;
+            for (size_t i = 0; i < Histogram::bucket_count; ++i)
+                count += h.second->bucket_value(i);
+            for (size_t i = 0; i < Histogram::bucket_count && total < count;
+                 ++i) {
+                total += h.second->bucket_value(i);
+                uint64_t bound = Histogram::upper_bound(i);
+                if (total == 0 || (bound & (bound - 1)) != 0)
+                    continue;
+                out << name << "_bucket"
+                    << with_label(h.first, "le=\"" +
+                           format_double(bound * f.scale) + "\"")
+                    << ' ' << total << '\n';
+            }
+            out << name << "_bucket" << with_label(h.first, "le=\"+Inf\"")
+                << ' ' << count << '\n';
+
+            std::string labels = h.first.empty() ? "" : '{' + h.first + '}';
+            out << name << "_sum" << labels << ' '
+                << format_double(h.second->sum() * f.scale) << '\n';
+            out << name << "_count" << labels << ' ' << count << '\n';
+        }
+    }
+    return out.str();
+}
+
+} // namespace metrics
+} // namespace runos
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace runos {
+namespace metrics {
+
+/**
+ * Controller-wide metrics exported in Prometheus text format.
+ *
+ * Metrics are created through the registry, which takes a lock, so look
+ * them up once and keep the reference. Recording is lock-free.
+ */
+
+// Index of the shard the calling thread writes to
+size_t thread_shard();
+
+/**
+ * Monotonic counter split into cache-line sized shards. Every thread
+ * adds to its own shard, reading sums them up.
+ */
+class Counter {
+public:
+    static constexpr size_t shards = 16;
+
+    void add(uint64_t n = 1) noexcept
+    {
+        shard_[thread_shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const noexcept;
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value {0};
+    };
+    Shard shard_[shards];
+};
+
+/**
+ * Log-linear histogram in the spirit of HdrHistogram: every power of two
+ * is split into 8 sub-buckets, so the relative error of a quantile is
+ * below 12.5% over the whole 64-bit range.
+ */
+class Histogram {
+public:
+    static constexpr unsigned sub_bits = 3;
+    static constexpr uint64_t sub_count = 1u << sub_bits;
+    static constexpr size_t bucket_count = (64 - sub_bits + 1) * sub_count;
+
+    void record(uint64_t value) noexcept
+    {
+        buckets_[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.add();
+        sum_.add(value);
+    }
+
+    void record(std::chrono::nanoseconds d) noexcept
+    { record(uint64_t(std::max<int64_t>(d.count(), 0))); }
+
+    uint64_t count() const noexcept { return count_.value(); }
+    uint64_t sum() const noexcept { return sum_.value(); }
+    uint64_t bucket_value(size_t i) const noexcept
+    { return buckets_[i].load(std::memory_order_relaxed); }
+    // Value at quantile q in [0, 1], upper bound of its bucket
+    uint64_t quantile(double q) const noexcept;
+
+    static size_t bucket(uint64_t value) noexcept;
+    // Exclusive upper bound of bucket `i`, saturated at UINT64_MAX
+    static uint64_t upper_bound(size_t i) noexcept;
+
+private:
+    std::atomic<uint64_t> buckets_[bucket_count] {};
+    Counter count_;
+    Counter sum_;
+};
+
+// Records time spent in the scope, in nanoseconds
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram& histogram) noexcept
+        : histogram_(histogram)
+        , start_(std::chrono::steady_clock::now())
+    { }
+
+    ~ScopedTimer()
+    { histogram_.record(std::chrono::steady_clock::now() - start_); }
+
+    ScopedTimer(ScopedTimer const&) = delete;
+    ScopedTimer& operator=(ScopedTimer const&) = delete;
+
+private:
+    Histogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+using Labels = std::vector<std::pair<std::string, std::string>>;
+
+class Registry {
+public:
+    static Registry& global();
+
+    // References stay valid for the lifetime of the process.
+    // Same name and labels return the same metric.
+    Counter& counter(std::string const& name, std::string const& help,
+                     Labels const& labels = {});
+
+    // Histograms of durations are recorded in nanoseconds,
+    // `scale` converts to the exported unit (seconds by default)
+    Histogram& histogram(std::string const& name, std::string const& help,
+                         Labels const& labels = {}, double scale = 1e-9);
+
+    std::string prometheus() const;
+
+    // Histograms of one family by their labels as exported,
+    // `handler="..."`; empty if there is no such family
+    std::vector<std::pair<std::string, const Histogram*>>
+    histograms(std::string const& name) const;
+
+private:
+    struct Family {
+        std::string help;
+        double scale {1.0};
+        std::map<std::string, std::unique_ptr<Counter>> counters;
+        std::map<std::string, std::unique_ptr<Histogram>> histograms;
+    };
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Family> families_;
+
+    Family& family(std::string const& name, std::string const& help);
+};
+
+} // namespace metrics
+} // namespace runos
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace runos {
+
+/**
+ * One switch connection of an OpenFlow transport: the part of libfluid's
+ * OFConnection OFServer relies on, so connections of different socket
+ * backends are handled by the same code.
+ *
+ * Transports report connections with `event`s and received messages,
+ * both from the connection's own I/O thread. A transport may move a
+ * connection to another I/O thread between two reads, after everything
+ * the old thread did with it. A connection stays valid until the handler
+ * of its CLOSED event returns.
+ */
+class ofp_connection {
+public:
+    enum event {
+        STARTED,            // accepted, HELLO sent
+        ESTABLISHED,        // version negotiated, FEATURES_REPLY received
+        FAILED_NEGOTIATION, // switch doesn't speak the supported version
+        CLOSED,             // closed by either side, last event
+        DEAD                // echo requests left unanswered, CLOSED follows
+    };
+
+    virtual ~ofp_connection() = default;
+
+    virtual int id() const = 0;
+    virtual std::string peer_address() const = 0;
+    // True after the handshake until the connection is closed
+    virtual bool running() const = 0;
+    virtual uint8_t version() const = 0;
+
+    // Thread-safe, `data` is copied or written before return
+    virtual void send(const void* data, size_t len) = 0;
+    // Thread-safe, CLOSED is reported later on the I/O thread
+    virtual void close() = 0;
+    // Bytes accepted by send() and not yet written to the socket, 0 if
+    // the transport can't tell. Thread-safe.
+    virtual size_t pending_bytes() const { return 0; }
+
+    // Opaque slot for the transport user, accessed on the I/O thread
+    void* application_data() const { return application_data_; }
+    void set_application_data(void* data) { application_data_ = data; }
+
+private:
+    void* application_data_ {nullptr};
+};
+
+} // namespace runos
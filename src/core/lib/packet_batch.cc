@@ -0,0 +1,157 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "packet_batch.hpp"
+
+#include <fluid/of13msg.hh>
+
+namespace runos {
+
+// Headers that are absent or truncated are read from here instead of
+// the packet, which keeps the walks free of data-dependent branches
+alignas(64) static const uint8_t zeros[64] = {};
+
+static inline uint16_t load16(const uint8_t* p)
+{
+    return uint16_t(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t load32(const uint8_t* p)
+{
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 |
+           uint32_t(p[2]) << 8 | p[3];
+}
+
+static inline uint64_t load48(const uint8_t* p)
+{
+    return uint64_t(load16(p)) << 32 | load32(p + 2);
+}
+
+void PacketBatch::reserve(size_t n)
+{
+    data_.reserve(n);
+    len_.reserve(n);
+    in_port_.reserve(n);
+}
+
+void PacketBatch::clear()
+{
+    classified_ = 0;
+    data_.clear();
+    len_.clear();
+    in_port_.clear();
+}
+
+size_t PacketBatch::add(const void* data, size_t len, uint32_t in_port)
+{
+    data_.push_back(static_cast<const uint8_t*>(data));
+    // offsets are 16-bit, nothing we look at is further than that
+    len_.push_back(len > UINT16_MAX ? UINT16_MAX : uint32_t(len));
+    in_port_.push_back(in_port);
+    return data_.size() - 1;
+}
+
+size_t PacketBatch::add(fluid_msg::of13::PacketIn& pi)
+{
+    auto port = pi.match().in_port();
+    return add(pi.data(), pi.data_len(), port ? port->value() : 0);
+}
+
+void PacketBatch::classify()
+{
+    size_t from = classified_, to = data_.size();
+    if (from == to)
+        return;
+
+    l3_off_.resize(to);
+    l4_off_.resize(to);
+    flags_.resize(to);
+    eth_dst_.resize(to);
+    eth_src_.resize(to);
+    vlan_vid_.resize(to);
+    eth_type_.resize(to);
+    ip_proto_.resize(to);
+    ipv4_src_.resize(to);
+    ipv4_dst_.resize(to);
+    l4_src_.resize(to);
+    l4_dst_.resize(to);
+
+    walk_l2(from, to);
+    walk_l3(from, to);
+    walk_l4(from, to);
+    classified_ = to;
+}
+
+void PacketBatch::walk_l2(size_t from, size_t to)
+{
+    for (size_t i = from; i < to; ++i) {
+        uint32_t len = len_[i];
+        bool ok = len >= 14;
+        const uint8_t* p = ok ? data_[i] : zeros;
+
+        uint16_t tpid = load16(p + 12);
+        bool tagged = ok & (tpid == 0x8100) & (len >= 18);
+        const uint8_t* tag = tagged ? p + 14 : zeros;
+
+        eth_dst_[i] = load48(p);
+        eth_src_[i] = load48(p + 6);
+        vlan_vid_[i] = load16(tag) & 0x0fff;
+        eth_type_[i] = tagged ? load16(tag + 2) : tpid;
+        flags_[i] = uint8_t(ok * ETH | tagged * VLAN);
+        l3_off_[i] = uint16_t(ok * (14 + 4 * tagged));
+    }
+}
+
+void PacketBatch::walk_l3(size_t from, size_t to)
+{
+    for (size_t i = from; i < to; ++i) {
+        uint32_t len = len_[i];
+        uint32_t off = l3_off_[i];
+        bool ip = (off != 0) & (eth_type_[i] == 0x0800) & (off + 20 <= len);
+        const uint8_t* p = ip ? data_[i] + off : zeros;
+
+        uint32_t ihl = (p[0] & 0x0f) * 4u;
+        bool ok = ip & ((p[0] >> 4) == 4) & (ihl >= 20) & (off + ihl <= len);
+        p = ok ? p : zeros;
+
+        // only the first fragment carries the transport header
+        bool first = (load16(p + 6) & 0x1fff) == 0;
+
+        ip_proto_[i] = p[9];
+        ipv4_src_[i] = load32(p + 12);
+        ipv4_dst_[i] = load32(p + 16);
+        flags_[i] |= uint8_t(ok * IPV4);
+        l4_off_[i] = uint16_t((ok & first) * (off + ihl));
+    }
+}
+
+void PacketBatch::walk_l4(size_t from, size_t to)
+{
+    for (size_t i = from; i < to; ++i) {
+        uint32_t off = l4_off_[i];
+        uint8_t proto = ip_proto_[i];
+        bool tcp = proto == 0x06, udp = proto == 0x11;
+        // ports are all we need, truncated headers are fine
+        bool ok = (off != 0) & (tcp | udp) & (off + 4 <= len_[i]);
+        const uint8_t* p = ok ? data_[i] + off : zeros;
+
+        l4_src_[i] = load16(p);
+        l4_dst_[i] = load16(p + 2);
+        flags_[i] |= uint8_t(ok * (tcp * TCP | udp * UDP));
+    }
+}
+
+} // namespace runos
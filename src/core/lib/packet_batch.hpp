@@ -0,0 +1,104 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace fluid_msg {
+namespace of13 {
+class PacketIn;
+}
+}
+
+namespace runos {
+
+/**
+ * Extracts a fixed tuple of header fields from a burst of packets
+ * into one column per field, so a burst is parsed once and every
+ * consumer reads the columns instead of running its own PacketParser.
+ *
+ * Headers are walked layer by layer over the whole burst (all L2
+ * headers, then all L3, then all L4) in branch-free loops. Fields
+ * absent from a packet are zero; flags() tells which layers were found.
+ * Packet data is referenced, not copied: it must outlive classify().
+ */
+class PacketBatch {
+public:
+    enum flag : uint8_t {
+        ETH = 1 << 0,
+        VLAN = 1 << 1,
+        IPV4 = 1 << 2,
+        TCP = 1 << 3,
+        UDP = 1 << 4,
+    };
+
+    void reserve(size_t n);
+    void clear();
+
+    // Returns the row of the added packet
+    size_t add(const void* data, size_t len, uint32_t in_port);
+    size_t add(fluid_msg::of13::PacketIn& pi);
+
+    // Parses every row added since the last call
+    void classify();
+
+    size_t size() const { return data_.size(); }
+
+    const uint32_t* in_port() const { return in_port_.data(); }
+    const uint8_t* flags() const { return flags_.data(); }
+    const uint64_t* eth_dst() const { return eth_dst_.data(); }
+    const uint64_t* eth_src() const { return eth_src_.data(); }
+    const uint16_t* vlan_vid() const { return vlan_vid_.data(); }
+    const uint16_t* eth_type() const { return eth_type_.data(); }
+    const uint8_t* ip_proto() const { return ip_proto_.data(); }
+    const uint32_t* ipv4_src() const { return ipv4_src_.data(); }
+    const uint32_t* ipv4_dst() const { return ipv4_dst_.data(); }
+    const uint16_t* l4_src() const { return l4_src_.data(); }
+    const uint16_t* l4_dst() const { return l4_dst_.data(); }
+
+private:
+    size_t classified_ = 0;
+
+    // input
+    std::vector<const uint8_t*> data_;
+    std::vector<uint32_t> len_;
+    std::vector<uint32_t> in_port_;
+
+    // header offsets, 0 when the layer is absent
+    std::vector<uint16_t> l3_off_;
+    std::vector<uint16_t> l4_off_;
+
+    // output columns
+    std::vector<uint8_t> flags_;
+    std::vector<uint64_t> eth_dst_;
+    std::vector<uint64_t> eth_src_;
+    std::vector<uint16_t> vlan_vid_;
+    std::vector<uint16_t> eth_type_;
+    std::vector<uint8_t> ip_proto_;
+    std::vector<uint32_t> ipv4_src_;
+    std::vector<uint32_t> ipv4_dst_;
+    std::vector<uint16_t> l4_src_;
+    std::vector<uint16_t> l4_dst_;
+
+    void walk_l2(size_t from, size_t to);
+    void walk_l3(size_t from, size_t to);
+    void walk_l4(size_t from, size_t to);
+};
+
+} // namespace runos
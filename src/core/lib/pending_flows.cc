@@ -0,0 +1,125 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pending_flows.hpp"
+
+#include <algorithm>
+
+namespace runos {
+
+pending_flows::pending_flows(clock::duration ttl, size_t shards)
+    : ttl_(ttl)
+    , shards_(std::max<size_t>(1, shards))
+{ }
+
+auto pending_flows::shard_of(uint64_t dpid) -> shard&
+{
+    return shards_[size_t((dpid * 0x9e3779b97f4a7c15ULL) >> 32) % shards_.size()];
+}
+
+bool pending_flows::admit(uint64_t dpid, uint64_t flow, clock::time_point now)
+{
+    auto& s = shard_of(dpid);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto& sw = s.switches[dpid];
+
+    // flows whose barrier was lost are dropped by ttl only
+    if (now >= sw.next_sweep) {
+        for (auto it = sw.flows.begin(); it != sw.flows.end(); ) {
+            if (it->second.expires <= now)
+                it = sw.flows.erase(it);
+            else
+                ++it;
+        }
+        sw.next_sweep = now + ttl_;
+    }
+
+    auto it = sw.flows.find(flow);
+    if (it != sw.flows.end() && it->second.expires > now &&
+            it->second.seq > sw.acked)
+        return false;
+
+    sw.flows[flow] = entry{now + ttl_, sw.sent + 1};
+    sw.waiting = true;
+    return true;
+}
+
+std::optional<uint64_t> pending_flows::next_barrier(switch_state& sw)
+{
+    if (not sw.waiting || sw.sent != sw.acked)
+        return std::nullopt;
+    sw.waiting = false;
+    return ++sw.sent;
+}
+
+std::optional<uint64_t> pending_flows::barrier(uint64_t dpid)
+{
+    auto& s = shard_of(dpid);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.switches.find(dpid);
+    if (it == s.switches.end())
+        return std::nullopt;
+    return next_barrier(it->second);
+}
+
+std::optional<uint64_t> pending_flows::confirm(uint64_t dpid, uint64_t seq)
+{
+    auto& s = shard_of(dpid);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.switches.find(dpid);
+    if (it == s.switches.end())
+        return std::nullopt;
+    auto& sw = it->second;
+    constexpr uint64_t mask = (uint64_t(1) << seq_bits) - 1;
+    if (((seq ^ sw.sent) & mask) != 0 || sw.sent == sw.acked)
+        return std::nullopt; // stale, from before a reset
+
+    sw.acked = sw.sent;
+    for (auto fit = sw.flows.begin(); fit != sw.flows.end(); ) {
+        if (fit->second.seq <= sw.acked)
+            fit = sw.flows.erase(fit);
+        else
+            ++fit;
+    }
+    return next_barrier(sw);
+}
+
+void pending_flows::reset(uint64_t dpid)
+{
+    auto& s = shard_of(dpid);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.switches.find(dpid);
+    if (it == s.switches.end())
+        return;
+    // barriers in flight will never be answered
+    auto& sw = it->second;
+    sw.flows.clear();
+    sw.acked = sw.sent;
+    sw.waiting = false;
+}
+
+size_t pending_flows::size() const
+{
+    size_t ret = 0;
+    for (const auto& s : shards_) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (const auto& sw : s.switches)
+            ret += sw.second.flows.size();
+    }
+    return ret;
+}
+
+} // namespace runos
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Flows whose setup is in progress on a switch, to tell the PacketIns
+ * queued behind the first one of a flow before its rule lands.
+ *
+ * A flow is admitted once; until its setup is confirmed or `ttl`
+ * passes, further PacketIns of it are duplicates. Setup is confirmed
+ * by a barrier sent after the handlers of the first PacketIn ran: one
+ * barrier per switch is in flight, flows admitted meanwhile wait for
+ * the next one, which barrier() hands out when the reply has come.
+ * Switches are spread over shards, each with its own mutex.
+ */
+class pending_flows {
+public:
+    using clock = std::chrono::steady_clock;
+    static constexpr unsigned seq_bits = 24;
+
+    explicit pending_flows(clock::duration ttl, size_t shards = 16);
+
+    // False if the flow is pending already, i.e. the packet is a duplicate
+    bool admit(uint64_t dpid, uint64_t flow, clock::time_point now = clock::now());
+    // Sequence number of the barrier to send, if admitted flows wait for one
+    std::optional<uint64_t> barrier(uint64_t dpid);
+    // Barrier `seq` has come back: flows admitted before it are set up.
+    // Returns the next barrier to send, like barrier(). Only the low
+    // seq_bits of `seq` are compared, as much as fits in an xid.
+    std::optional<uint64_t> confirm(uint64_t dpid, uint64_t seq);
+    // Connection of the switch is gone, with its barriers in flight
+    void reset(uint64_t dpid);
+
+    size_t size() const;
+
+private:
+    struct entry {
+        clock::time_point expires;
+        uint64_t seq; // barrier confirming it
+    };
+    struct switch_state {
+        std::unordered_map<uint64_t, entry> flows;
+        uint64_t sent {0};
+        uint64_t acked {0};
+        bool waiting {false}; // flows admitted after the last barrier sent
+        clock::time_point next_sweep;
+    };
+    struct shard {
+        mutable std::mutex mutex;
+        std::unordered_map<uint64_t, switch_state> switches;
+    };
+
+    clock::duration ttl_;
+    std::vector<shard> shards_;
+
+    shard& shard_of(uint64_t dpid);
+    static std::optional<uint64_t> next_barrier(switch_state& sw);
+};
+
+} // namespace runos
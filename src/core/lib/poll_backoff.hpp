@@ -0,0 +1,47 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cmath>
+
+namespace runos {
+
+/**
+ * Thins out polls of a peer which answers slower than usual: with
+ * slowdown k only every ceil(k)-th poll goes through.
+ *
+ * Not thread safe.
+ */
+class poll_backoff {
+public:
+    // Returns true if this poll should be skipped
+    bool skip(double slowdown)
+    {
+        unsigned every = slowdown > 1.0 ? unsigned(std::ceil(slowdown)) : 1;
+        if (every <= 1 || ++m_skipped >= every) {
+            m_skipped = 0;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    unsigned m_skipped {0};
+};
+
+} // namespace runos
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "poll_tuning.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace runos {
+
+using std::chrono::milliseconds;
+
+constexpr milliseconds PollTuning::max_interval;
+
+PollTuning& PollTuning::global()
+{
+    static PollTuning instance;
+    return instance;
+}
+
+bool PollTuning::update(knob& k)
+{
+    auto effective = k.interval;
+    if (not k.critical) {
+        effective = milliseconds(std::llround(k.interval.count() * stretch_));
+    }
+    effective = std::clamp(effective, milliseconds(1), max_interval);
+    if (effective == k.effective)
+        return false;
+    k.effective = effective;
+    return true;
+}
+
+void PollTuning::collect(const knob& k, std::vector<notification>& out)
+{
+    for (const auto& l : k.listeners) {
+        out.push_back(notification{ l.second, k.effective });
+    }
+}
+
+void PollTuning::notify(const std::vector<notification>& todo)
+{
+    for (const auto& n : todo) {
+        try {
+            (*n.f)(n.interval);
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "[PollTuning] Can't apply interval of "
+                       << n.interval.count() << " ms: " << e.what();
+        }
+    }
+}
+
+auto PollTuning::add(std::string name, milliseconds configured,
+                     listener f, bool critical)
+    -> handle
+{
+    configured = std::clamp(configured, milliseconds(1), max_interval);
+    auto l = std::make_shared<listener>(std::move(f));
+
+    std::lock_guard<std::mutex> apply(apply_mutex_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = knobs_.find(name);
+    if (it == knobs_.end()) {
+        knob k { configured, configured, configured, critical, {} };
+        update(k);
+        it = knobs_.emplace(name, std::move(k)).first;
+    }
+    uint64_t id = next_id_++;
+    it->second.listeners.emplace(id, l);
+    auto effective = it->second.effective;
+    lock.unlock();
+
+    if (effective != configured) {
+        notify({ notification{ l, effective } });
+    }
+    return handle(new subscription(this, std::move(name), id));
+}
+
+bool PollTuning::set(const std::string& name, milliseconds interval)
+{
+    std::vector<notification> todo;
+    std::lock_guard<std::mutex> apply(apply_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = knobs_.find(name);
+        if (it == knobs_.end())
+            return false;
+        auto& k = it->second;
+        k.interval = std::clamp(interval, milliseconds(1), max_interval);
+        if (update(k)) {
+            collect(k, todo);
+        }
+    }
+    LOG(INFO) << "[PollTuning] " << name << " interval set to "
+              << interval.count() << " ms";
+    notify(todo);
+    return true;
+}
+
+bool PollTuning::reset(const std::string& name)
+{
+    milliseconds configured;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = knobs_.find(name);
+        if (it == knobs_.end())
+            return false;
+        configured = it->second.configured;
+    }
+    return set(name, configured);
+}
+
+void PollTuning::stretch(double factor)
+{
+    factor = std::max(factor, 1.0);
+
+    std::vector<notification> todo;
+    std::lock_guard<std::mutex> apply(apply_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (factor == stretch_)
+            return;
+        stretch_ = factor;
+        for (auto& k : knobs_) {
+            if (update(k.second)) {
+                collect(k.second, todo);
+            }
+        }
+    }
+    notify(todo);
+}
+
+double PollTuning::stretch() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stretch_;
+}
+
+auto PollTuning::knobs() const -> std::vector<knob_info>
+{
+    std::vector<knob_info> ret;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& k : knobs_) {
+        ret.push_back(knob_info{
+            k.first, k.second.configured, k.second.interval,
+            k.second.effective, k.second.critical, k.second.listeners.size()
+        });
+    }
+    return ret;
+}
+
+void PollTuning::remove(const std::string& name, uint64_t id)
+{
+    std::lock_guard<std::mutex> apply(apply_mutex_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = knobs_.find(name);
+    if (it != knobs_.end()) {
+        // the knob stays with its interval for pollers coming later
+        it->second.listeners.erase(id);
+    }
+}
+
+} // namespace runos
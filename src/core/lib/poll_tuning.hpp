@@ -0,0 +1,127 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Poll intervals which can be changed while the controller runs.
+ *
+ * Every poller registers its interval under a name with the value from
+ * its config and a listener which applies a new one to its timer. An
+ * operator may set() another interval, and the overload governor may
+ * stretch() every non-critical one by a common factor; listeners get
+ * the resulting effective interval each time it changes.
+ *
+ * Several pollers may share a name: they all follow the same interval,
+ * the first one's configured value is the default.
+ */
+class PollTuning {
+public:
+    using milliseconds = std::chrono::milliseconds;
+    using listener = std::function<void(milliseconds)>;
+
+    struct knob_info {
+        std::string name;
+        milliseconds configured;
+        milliseconds interval;  // set at runtime, or configured
+        milliseconds effective; // interval stretched by the governor
+        bool critical;          // never stretched
+        size_t listeners;
+    };
+
+    class subscription;
+    using handle = std::unique_ptr<subscription>;
+
+    static PollTuning& global();
+
+    // `f` is called at once if the effective interval differs from
+    // `configured` already. Listeners run one at a time and must not
+    // release handles or call back into PollTuning.
+    handle add(std::string name, milliseconds configured, listener f,
+               bool critical = false);
+
+    // False for unknown names
+    bool set(const std::string& name, milliseconds interval);
+    bool reset(const std::string& name);
+
+    // Factor >= 1 applied to non-critical intervals
+    void stretch(double factor);
+    double stretch() const;
+
+    std::vector<knob_info> knobs() const;
+
+    static constexpr milliseconds max_interval {3600 * 1000};
+
+private:
+    struct knob {
+        milliseconds configured;
+        milliseconds interval;
+        milliseconds effective;
+        bool critical;
+        std::map<uint64_t, std::shared_ptr<listener>> listeners;
+    };
+    struct notification {
+        std::shared_ptr<listener> f;
+        milliseconds interval;
+    };
+
+    std::mutex apply_mutex_; // serializes listener calls
+    mutable std::mutex mutex_; // guards everything below
+    std::map<std::string, knob> knobs_;
+    double stretch_ {1.0};
+    uint64_t next_id_ {0};
+
+    // mutex_ must be held
+    bool update(knob& k);
+    static void collect(const knob& k, std::vector<notification>& out);
+    static void notify(const std::vector<notification>& todo);
+    void remove(const std::string& name, uint64_t id);
+
+    PollTuning() = default;
+};
+
+class PollTuning::subscription {
+public:
+    subscription(PollTuning* owner, std::string name, uint64_t id)
+        : owner_(owner), name_(std::move(name)), id_(id)
+    { }
+    // Waits for the running listener, the owner may go away after
+    ~subscription() { owner_->remove(name_, id_); }
+
+    subscription(const subscription&) = delete;
+    subscription& operator=(const subscription&) = delete;
+
+    const std::string& name() const { return name_; }
+
+private:
+    PollTuning* owner_;
+    std::string name_;
+    uint64_t id_;
+};
+
+} // namespace runos
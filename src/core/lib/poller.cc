@@ -15,8 +15,8 @@
  */
 
 #include "poller.hpp"
-#include "runos/core/logging.hpp"
-#include <thread>
+
+#include <QMetaObject>
 
 namespace runos {
 
@@ -30,65 +30,55 @@ Poller::Poller(Polling* polling_parent, uint16_t poll_interval) :
 
 Poller::Poller(Application* parent, Polling* polling_parent,
                uint16_t poll_interval, PollerType type) :
-    wtimer(new QTimer),
-    wthread(new QThread),
-    executor(new qt_executor(wtimer)),
     parent(parent),
     polling_parent(polling_parent),
     type(type)
 {
-    wtimer->setInterval(poll_interval);
-    wtimer->moveToThread(wthread);
+    QObject* owner = parent ? static_cast<QObject*>(parent) : polling_parent;
+    timer = TimerService::global().add(
+        owner->metaObject()->className(),
+        std::chrono::milliseconds(poll_interval),
+        [this]() {
+            switch (this->type) {
+            case PollerType::Application:
+                QMetaObject::invokeMethod(this->parent, "polling",
+                                          Qt::DirectConnection);
+                break;
+            case PollerType::Polling:
+                this->polling_parent->polling();
+                break;
+            }
+        });
 }
 
-
 Poller::~Poller()
 {
-    delete wtimer;
-    delete wthread;
-    delete executor;
+    TimerService::global().remove(timer);
 }
 
 void Poller::run()
 {
-    if (not wthread->isRunning()) {
-        QObject::connect(wthread, &QThread::started, wtimer, qOverload<>(&QTimer::start));
-        QObject::connect(wthread, &QThread::finished, wtimer, &QTimer::stop);
-        switch(type) {
-        case PollerType::Application:
-            QObject::connect(wtimer, SIGNAL(timeout()),
-                             parent, SLOT(polling()), Qt::DirectConnection);
-            break;
-        case PollerType::Polling:
-            QObject::connect(wtimer, &QTimer::timeout,
-                             polling_parent, &Polling::polling, Qt::DirectConnection);
-            break;
-        }
-        wthread->start();
-    } else {
-        if (not wtimer->isActive()) {
-            async(*executor, [wtimer = wtimer]() {
-                wtimer->start();
-            });
-        }
-    }
+    TimerService::global().start(timer);
 }
 
 void Poller::stop()
 {
-    wthread->quit();
+    TimerService::global().stop(timer);
 }
 
 void Poller::pause()
 {
-    async(*executor, [wtimer = wtimer]() {
-        wtimer->stop();
-    });
+    TimerService::global().stop(timer);
+}
+
+void Poller::set_interval(std::chrono::milliseconds interval)
+{
+    TimerService::global().set_interval(timer, interval);
 }
 
 void Poller::apply(const std::function<void()>& f)
 {
-    async(*executor, f);
+    TimerService::global().post(timer, f);
 }
 
 } // namespace runos
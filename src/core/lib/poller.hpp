@@ -17,10 +17,7 @@
 #pragma once
 
 #include "../Application.hpp"
-#include "qt_executor.hpp"
-
-#include <QTimer>
-#include <QThread>
+#include "timer_service.hpp"
 
 namespace runos {
 
@@ -33,6 +30,7 @@ public:
     virtual void polling() = 0;
 };
 
+// Calls polling() of the parent periodically on a TimerService worker
 class Poller {
 public:
     Poller(Application* parent, uint16_t poll_interval);
@@ -42,6 +40,9 @@ public:
     void run();
     void stop();
     void pause();
+    // Takes effect from the next tick
+    void set_interval(std::chrono::milliseconds interval);
+    // Runs `f` serialized with polling()
     void apply(const std::function<void()>& f);
 
 private:
@@ -49,9 +50,7 @@ private:
            uint16_t poll_interval, PollerType type);
 
 private:
-    QTimer* wtimer;
-    QThread* wthread;
-    qt_executor* executor;
+    TimerService::handle timer;
     Application* parent;
     Polling* polling_parent;
     PollerType type;
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "port_stats_table.hpp"
+
+#include <algorithm>
+#include <mutex>
+
+#include <runos/core/assert.hpp>
+
+#include "rate_kernel.hpp"
+
+namespace runos {
+
+port_stats_table::port_stats_table(size_t width)
+    : width_(width)
+    , prev_(width)
+    , max_(width)
+{
+    columns_.counters_.resize(width);
+    columns_.speed_.resize(width);
+    columns_.max_.resize(width);
+}
+
+uint32_t port_stats_table::acquire(uint32_t key)
+{
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    auto& c = columns_;
+    uint32_t slot;
+
+    if (not free_.empty()) {
+        slot = free_.back();
+        free_.pop_back();
+    } else {
+        slot = c.keys_.size();
+        c.keys_.push_back(npos);
+        c.time_.push_back(0);
+        for (size_t f = 0; f < width_; ++f) {
+            c.counters_[f].push_back(0);
+            c.speed_[f].push_back(0);
+            c.max_[f].push_back(0);
+        }
+    }
+
+    c.keys_[slot] = key;
+    clear(slot);
+    return slot;
+}
+
+void port_stats_table::release(uint32_t slot)
+{
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    CHECK(slot < columns_.keys_.size() && columns_.keys_[slot] != npos);
+    columns_.keys_[slot] = npos;
+    free_.push_back(slot);
+}
+
+void port_stats_table::clear(uint32_t slot)
+{
+    auto& c = columns_;
+    c.time_[slot] = 0;
+    for (size_t f = 0; f < width_; ++f) {
+        c.counters_[f][slot] = 0;
+        // no speed until the next sample, as 0/0 would give
+        c.speed_[f][slot] = std::numeric_limits<float>::quiet_NaN();
+        c.max_[f][slot] = 0;
+    }
+}
+
+bool port_stats_table::append(uint32_t slot, double time,
+                              const uint64_t* counters, double* speed)
+{
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    auto& c = columns_;
+    ASSERT(slot < c.keys_.size());
+
+    auto& prev = prev_;
+    auto& max = max_;
+    std::fill(prev.begin(), prev.end(), 0);
+
+    double prev_time = c.time_[slot];
+    if (prev_time > time) {
+        // counters were reset on the switch, keep only the maxima
+        prev_time = 0;
+    } else {
+        for (size_t f = 0; f < width_; ++f)
+            prev[f] = c.counters_[f][slot];
+    }
+
+    // for example, when the port is recreated with the same number
+    if (std::lexicographical_compare(counters, counters + width_,
+                                     prev.begin(), prev.end()))
+        std::fill(prev.begin(), prev.end(), 0);
+
+    for (size_t f = 0; f < width_; ++f)
+        max[f] = c.max_[f][slot];
+
+    double delta = time - prev_time;
+    rate_kernel::compute(1, width_, counters, prev.data(), &delta,
+                         speed, max.data());
+
+    c.time_[slot] = time;
+    for (size_t f = 0; f < width_; ++f) {
+        c.counters_[f][slot] = counters[f];
+        c.speed_[f][slot] = static_cast<float>(speed[f]);
+        c.max_[f][slot] = static_cast<float>(max[f]);
+    }
+
+    return prev_time != 0;
+}
+
+void port_stats_table::get(uint32_t slot, uint64_t* counters,
+                           double* speed, double* max) const
+{
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto& c = columns_;
+    ASSERT(slot < c.keys_.size());
+
+    for (size_t f = 0; f < width_; ++f) {
+        counters[f] = c.counters_[f][slot];
+        speed[f] = c.speed_[f][slot];
+        max[f] = c.max_[f][slot];
+    }
+}
+
+} // namespace runos
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <shared_mutex>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Counter statistics of all ports of one switch, one row per port slot.
+ *
+ * Fields are stored column by column, so a scan over one field (for
+ * example tx bytes speed) of every port reads contiguous memory. Only
+ * the last counters are kept: speeds are computed on append() and the
+ * counters are overwritten afterwards. Speeds and maxima are stored as
+ * float, like TimeSeries does, which is precise enough for rates and
+ * halves their size.
+ *
+ * Slots are reused after release(), free ones have key() == npos.
+ */
+class port_stats_table {
+public:
+    static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+    class columns {
+    public:
+        size_t size() const { return keys_.size(); }
+        uint32_t key(uint32_t slot) const { return keys_[slot]; }
+        double time(uint32_t slot) const { return time_[slot]; }
+
+        const uint64_t* counter(size_t field) const
+        { return counters_[field].data(); }
+        const float* speed(size_t field) const
+        { return speed_[field].data(); }
+        const float* max(size_t field) const
+        { return max_[field].data(); }
+
+    private:
+        friend class port_stats_table;
+
+        std::vector<uint32_t> keys_;
+        std::vector<double> time_; // seconds, 0 after reset
+        std::vector<std::vector<uint64_t>> counters_;
+        std::vector<std::vector<float>> speed_;
+        std::vector<std::vector<float>> max_;
+    };
+
+    explicit port_stats_table(size_t width);
+
+    size_t width() const { return width_; }
+
+    // Slot for the port with number `key`, zeroed
+    uint32_t acquire(uint32_t key);
+    void release(uint32_t slot);
+
+    // Stores `width` counters taken at `time` (seconds) and writes
+    // their speeds into `speed`. Returns false if the sample follows a
+    // reset, so the speed isn't worth keeping in history.
+    bool append(uint32_t slot, double time,
+                const uint64_t* counters, double* speed);
+
+    void get(uint32_t slot, uint64_t* counters,
+             double* speed, double* max) const;
+
+    // Calls f(const columns&) under the shared lock
+    template<class F>
+    decltype(auto) read(F&& f) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return f(static_cast<const columns&>(columns_));
+    }
+
+private:
+    size_t width_;
+    mutable std::shared_mutex mutex_;
+    columns columns_;
+    std::vector<uint32_t> free_;
+    // scratch rows of append(), used under the unique lock
+    std::vector<uint64_t> prev_;
+    std::vector<double> max_;
+
+    void clear(uint32_t slot);
+};
+
+} // namespace runos
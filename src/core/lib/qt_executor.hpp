@@ -16,6 +16,9 @@
 
 #pragma once
 
+#include "event_loop_monitor.hpp"
+#include "event_trace.hpp"
+
 #include <runos/core/logging.hpp>
 #include <runos/core/future.hpp>
 
@@ -23,6 +26,7 @@
 
 #include <boost/thread/concurrent_queues/queue_op_status.hpp>
 
+#include <type_traits>
 #include <utility>
 #include <mutex>
 
@@ -45,12 +49,22 @@ struct qt_executor
             throw boost::sync_queue_is_closed();
         }*/
 
+        static auto* site = EventLoopMonitor::register_site(
+            typeid(std::decay_t<Closure>));
+
         QObject signalSource;
         QObject::connect(
             &signalSource,
             &QObject::destroyed,
             target,
-            [f = std::forward<Closure>(closure)]() mutable { f(); }
+            [f = std::forward<Closure>(closure),
+             submitted = EventLoopMonitor::submitted(),
+             cause = trace::current()]() mutable
+            {
+                EventLoopMonitor::task task(site, submitted);
+                trace::scope traced(cause);
+                f();
+            }
         );
     }
 
@@ -0,0 +1,122 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "rate_kernel.hpp"
+
+#include <algorithm>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define RUNOS_RATE_KERNEL_AVX2 1
+#include <immintrin.h>
+#endif
+
+namespace runos {
+namespace rate_kernel {
+
+static void compute_scalar(size_t rows, size_t width,
+                           const uint64_t* curr, const uint64_t* prev,
+                           const double* dt, double* speed, double* max)
+{
+    for (size_t r = 0; r < rows; ++r) {
+        double delta = dt[r];
+        for (size_t i = r * width, end = i + width; i < end; ++i) {
+            speed[i] = (curr[i] - prev[i]) / delta;
+            max[i] = std::max(max[i], speed[i]);
+        }
+    }
+}
+
+#ifdef RUNOS_RATE_KERNEL_AVX2
+
+// Exact uint64 -> double conversion (AVX2 has no native instruction):
+// both 32-bit halves are placed into the mantissas of 2^84 and 2^52
+// and the bias is subtracted, leaving a single rounding on the add.
+__attribute__((target("avx2")))
+static inline __m256d u64_to_pd(__m256i x)
+{
+    __m256i hi = _mm256_srli_epi64(x, 32);
+    hi = _mm256_or_si256(hi, _mm256_castpd_si256(
+                                 _mm256_set1_pd(19342813113834066795298816.)));
+    __m256i lo = _mm256_blend_epi32(x, _mm256_castpd_si256(
+                                        _mm256_set1_pd(4503599627370496.)),
+                                    0xaa);
+    __m256d f = _mm256_sub_pd(_mm256_castsi256_pd(hi),
+                              _mm256_set1_pd(19342813118337666422669312.));
+    return _mm256_add_pd(f, _mm256_castsi256_pd(lo));
+}
+
+__attribute__((target("avx2")))
+static void compute_avx2(size_t rows, size_t width,
+                         const uint64_t* curr, const uint64_t* prev,
+                         const double* dt, double* speed, double* max)
+{
+    for (size_t r = 0; r < rows; ++r) {
+        size_t i = r * width, end = i + width;
+        __m256d delta = _mm256_set1_pd(dt[r]);
+
+        for (; i + 4 <= end; i += 4) {
+            __m256i c = _mm256_loadu_si256(
+                            reinterpret_cast<const __m256i*>(curr + i));
+            __m256i p = _mm256_loadu_si256(
+                            reinterpret_cast<const __m256i*>(prev + i));
+            // vdivpd is correctly rounded, same as the scalar path
+            __m256d s = _mm256_div_pd(u64_to_pd(_mm256_sub_epi64(c, p)),
+                                      delta);
+            // operand order keeps the old maximum when speed is NaN,
+            // matching std::max(max, speed)
+            __m256d m = _mm256_max_pd(s, _mm256_loadu_pd(max + i));
+            _mm256_storeu_pd(speed + i, s);
+            _mm256_storeu_pd(max + i, m);
+        }
+
+        for (; i < end; ++i) {
+            speed[i] = (curr[i] - prev[i]) / dt[r];
+            max[i] = std::max(max[i], speed[i]);
+        }
+    }
+}
+
+#endif
+
+using kernel_fn = void (*)(size_t, size_t,
+                           const uint64_t*, const uint64_t*,
+                           const double*, double*, double*);
+
+static kernel_fn select_kernel()
+{
+#ifdef RUNOS_RATE_KERNEL_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return compute_avx2;
+#endif
+    return compute_scalar;
+}
+
+static const kernel_fn kernel = select_kernel();
+
+void compute(size_t rows, size_t width,
+             const uint64_t* curr, const uint64_t* prev,
+             const double* dt, double* speed, double* max)
+{
+    kernel(rows, width, curr, prev, dt, speed, max);
+}
+
+bool vectorized()
+{
+    return kernel != compute_scalar;
+}
+
+} // namespace rate_kernel
+} // namespace runos
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace runos {
+namespace rate_kernel {
+
+/**
+ * Computes counter rates for `rows` packed rows of `width` counters.
+ *
+ * For every row r and field i (index k = r * width + i):
+ *   speed[k] = (curr[k] - prev[k]) / dt[r]
+ *   max[k]   = max(max[k], speed[k])
+ *
+ * Uses AVX2 when the CPU supports it, scalar code otherwise;
+ * both produce identical results.
+ */
+void compute(size_t rows, size_t width,
+             const uint64_t* curr, const uint64_t* prev,
+             const double* dt, double* speed, double* max);
+
+// True if compute() dispatches to the AVX2 implementation
+bool vectorized();
+
+} // namespace rate_kernel
+} // namespace runos
@@ -0,0 +1,267 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "receive_arena.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+#include <sys/mman.h>
+
+namespace runos {
+
+namespace {
+
+constexpr size_t alignment = alignof(std::max_align_t);
+constexpr size_t max_object = ReceiveArena::chunk_size / 8;
+
+struct alignas(64) Chunk {
+    // allocated objects, plus one while a thread allocates from it
+    std::atomic<uint32_t> live;
+    Chunk* next_free;
+};
+
+constexpr size_t header = sizeof(Chunk);
+
+// Constant-initialized: operator new runs before main
+struct Region {
+    std::atomic<uintptr_t> base {0};
+    std::atomic<uintptr_t> end {0};
+    size_t nchunks {0};
+    std::atomic<size_t> cut {0};
+    std::atomic<uint64_t> fallbacks {0};
+    std::atomic<uint64_t> free_chunks {0};
+    std::mutex free_mutex;
+    Chunk* free_list {nullptr};
+};
+
+Region region;
+
+struct ThreadArena {
+    unsigned depth;
+    Chunk* chunk;
+    char* cur;
+    char* limit;
+};
+
+thread_local ThreadArena current {0, nullptr, nullptr, nullptr};
+
+void unref(Chunk* chunk) noexcept
+{
+    if (chunk->live.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    std::lock_guard<std::mutex> lock(region.free_mutex);
+    chunk->next_free = region.free_list;
+    region.free_list = chunk;
+    region.free_chunks.fetch_add(1, std::memory_order_relaxed);
+}
+
+Chunk* grab() noexcept
+{
+    Chunk* chunk = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(region.free_mutex);
+        if (region.free_list) {
+            chunk = region.free_list;
+            region.free_list = chunk->next_free;
+            region.free_chunks.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    if (not chunk) {
+        size_t i = region.cut.fetch_add(1, std::memory_order_relaxed);
+        if (i >= region.nchunks) {
+            region.cut.fetch_sub(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        chunk = reinterpret_cast<Chunk*>(
+            region.base.load(std::memory_order_relaxed) +
+            i * ReceiveArena::chunk_size);
+    }
+    chunk->live.store(1, std::memory_order_relaxed); // the owner
+    return chunk;
+}
+
+void* arena_allocate(size_t n) noexcept
+{
+    auto& t = current;
+    if (t.depth == 0 || n > max_object)
+        return nullptr;
+    n = (n + alignment - 1) & ~(alignment - 1);
+    if (n == 0)
+        n = alignment;
+
+    if (t.chunk == nullptr || size_t(t.limit - t.cur) < n) {
+        if (t.chunk)
+            unref(t.chunk);
+        t.chunk = grab();
+        if (t.chunk == nullptr) {
+            region.fallbacks.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        t.cur = reinterpret_cast<char*>(t.chunk) + header;
+        t.limit = reinterpret_cast<char*>(t.chunk) + ReceiveArena::chunk_size;
+    }
+    t.chunk->live.fetch_add(1, std::memory_order_relaxed);
+    void* ret = t.cur;
+    t.cur += n;
+    return ret;
+}
+
+bool arena_free(void* p) noexcept
+{
+    auto addr = reinterpret_cast<uintptr_t>(p);
+    // end is published last, so an empty range until then
+    if (addr >= region.end.load(std::memory_order_acquire) ||
+        addr < region.base.load(std::memory_order_relaxed))
+        return false;
+    auto offset = addr - region.base.load(std::memory_order_relaxed);
+    unref(reinterpret_cast<Chunk*>(
+        addr - offset % ReceiveArena::chunk_size));
+    return true;
+}
+
+void* heap_allocate(size_t n)
+{
+    if (n == 0)
+        n = 1;
+    for (;;) {
+        if (void* p = std::malloc(n))
+            return p;
+        auto handler = std::get_new_handler();
+        if (not handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+} // namespace
+
+void ReceiveArena::reserve(size_t bytes)
+{
+    if (region.base.load() || bytes < chunk_size)
+        return;
+    size_t nchunks = bytes / chunk_size;
+    size_t length = (nchunks + 1) * chunk_size; // slack for alignment
+    void* map = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+        return;
+    auto base = (reinterpret_cast<uintptr_t>(map) + chunk_size - 1)
+              & ~uintptr_t(chunk_size - 1);
+    region.nchunks = nchunks;
+    region.base.store(base, std::memory_order_relaxed);
+    region.end.store(base + nchunks * chunk_size, std::memory_order_release);
+}
+
+bool ReceiveArena::enabled()
+{
+    return region.end.load(std::memory_order_acquire) != 0;
+}
+
+ReceiveArena::Scope::Scope() noexcept
+{
+    if (enabled())
+        ++current.depth;
+}
+
+ReceiveArena::Scope::~Scope()
+{
+    auto& t = current;
+    if (t.depth == 0 || --t.depth > 0 || t.chunk == nullptr)
+        return;
+    // Nothing of the dispatch is alive: reuse the chunk from its start.
+    // Only this thread adds objects, so the count can't grow meanwhile.
+    if (t.chunk->live.load(std::memory_order_acquire) == 1) {
+        t.cur = reinterpret_cast<char*>(t.chunk) + header;
+    } else {
+        unref(t.chunk);
+        t.chunk = nullptr;
+    }
+}
+
+auto ReceiveArena::stats() -> Stats
+{
+    Stats ret;
+    ret.reserved_bytes = region.nchunks * chunk_size;
+    ret.chunks = region.cut.load(std::memory_order_relaxed);
+    ret.free_chunks = region.free_chunks.load(std::memory_order_relaxed);
+    ret.fallbacks = region.fallbacks.load(std::memory_order_relaxed);
+    return ret;
+}
+
+} // namespace runos
+
+// Replaceable global allocation functions ([new.delete]). The
+// over-aligned forms keep their defaults: they never reach the arena.
+
+void* operator new(std::size_t n)
+{
+    if (void* p = runos::arena_allocate(n))
+        return p;
+    return runos::heap_allocate(n);
+}
+
+void* operator new[](std::size_t n)
+{
+    return ::operator new(n);
+}
+
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept
+{
+    try {
+        return ::operator new(n);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept
+{
+    return ::operator new(n, std::nothrow);
+}
+
+void operator delete(void* p) noexcept
+{
+    if (p && not runos::arena_free(p))
+        std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    ::operator delete(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    ::operator delete(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+    ::operator delete(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    ::operator delete(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    ::operator delete(p);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace runos {
+
+/**
+ * Bump allocation for the objects made while a received message is
+ * unpacked and dispatched.
+ *
+ * libfluid allocates matches, action lists and multipart vectors with
+ * the global operator new, which receive_arena.cc replaces: inside a
+ * Scope it bumps a pointer in a chunk of the calling thread, outside
+ * one it is plain malloc. A chunk counts its live objects. When the
+ * outermost scope ends with none alive the chunk is rewound in place,
+ * which releases the message's objects at once; objects that escape
+ * the dispatch (copied into futures, kept by applications) keep their
+ * chunk until they're deleted, from any thread.
+ *
+ * Chunks are cut from one region reserved up front, so delete knows
+ * arena pointers by address. Allocations over chunk_size / 8, aligned
+ * ones and those made when the region is used up go to malloc.
+ */
+class ReceiveArena {
+public:
+    static constexpr size_t chunk_size = 64 << 10;
+
+    // Reserves `bytes` of address space, once, before any Scope;
+    // never reserved means every allocation goes to malloc
+    static void reserve(size_t bytes);
+    static bool enabled();
+
+    class Scope {
+    public:
+        Scope() noexcept;
+        ~Scope();
+
+        Scope(Scope const&) = delete;
+        Scope& operator=(Scope const&) = delete;
+    };
+
+    struct Stats {
+        uint64_t reserved_bytes {0};
+        uint64_t chunks {0};       // cut from the region so far
+        uint64_t free_chunks {0};  // back in the free list
+        uint64_t fallbacks {0};    // fell to malloc with no chunk left
+    };
+    static Stats stats();
+};
+
+} // namespace runos
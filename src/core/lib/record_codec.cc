@@ -0,0 +1,146 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "record_codec.hpp"
+
+#include <utility>
+
+namespace runos {
+
+static constexpr char tag[] = "RNB1";
+static constexpr size_t tag_size = sizeof(tag) - 1;
+
+static constexpr char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int decode_char(char c)
+{
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+/* RecordWriter */
+
+RecordWriter::RecordWriter()
+    : out_(tag)
+{ }
+
+void RecordWriter::put(uint8_t byte)
+{
+    acc_ = (acc_ << 8) | byte;
+    bits_ += 8;
+    while (bits_ >= 6) {
+        bits_ -= 6;
+        out_.push_back(alphabet[(acc_ >> bits_) & 0x3f]);
+    }
+}
+
+void RecordWriter::add(const uint8_t* data, size_t size)
+{
+    size_t len = size;
+    do {
+        uint8_t byte = len & 0x7f;
+        len >>= 7;
+        put(len ? byte | 0x80 : byte);
+    } while (len);
+
+    for (size_t i = 0; i < size; ++i) {
+        put(data[i]);
+    }
+    ++count_;
+}
+
+std::string RecordWriter::finish()
+{
+    // no padding, the reader ignores trailing partial bits
+    if (bits_ > 0) {
+        out_.push_back(alphabet[(acc_ << (6 - bits_)) & 0x3f]);
+        bits_ = 0;
+    }
+    return std::move(out_);
+}
+
+/* RecordReader */
+
+RecordReader::RecordReader(const std::string& text)
+    : text_(text)
+    , pos_(tag_size)
+{
+    if (not recognizes(text)) {
+        pos_ = text.size();
+        error_ = true;
+    }
+}
+
+bool RecordReader::recognizes(const std::string& text)
+{
+    return text.compare(0, tag_size, tag) == 0;
+}
+
+bool RecordReader::get(uint8_t& byte)
+{
+    while (bits_ < 8) {
+        if (pos_ == text_.size())
+            return false;
+        int v = decode_char(text_[pos_++]);
+        if (v < 0) {
+            error_ = true;
+            pos_ = text_.size();
+            return false;
+        }
+        acc_ = (acc_ << 6) | v;
+        bits_ += 6;
+    }
+    bits_ -= 8;
+    byte = (acc_ >> bits_) & 0xff;
+    return true;
+}
+
+bool RecordReader::next(std::vector<uint8_t>& record)
+{
+    size_t len = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+
+    if (not get(byte))
+        return false; // clean end of data
+
+    for (;;) {
+        len |= size_t(byte & 0x7f) << shift;
+        if (not (byte & 0x80))
+            break;
+        shift += 7;
+        if (shift > 28 || not get(byte)) {
+            error_ = true;
+            return false;
+        }
+    }
+
+    record.resize(len);
+    for (size_t i = 0; i < len; ++i) {
+        if (not get(record[i])) {
+            error_ = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace runos
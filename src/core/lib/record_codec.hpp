@@ -0,0 +1,77 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Compact text-safe container for a sequence of binary records.
+ *
+ * Layout: the "RNB1" tag followed by base64 of
+ *   [varint length][record bytes] [varint length][record bytes] ...
+ * Base64 keeps it storable through string-only backends (redis client
+ * is not binary safe), and the tag tells it apart from JSON dumps.
+ */
+class RecordWriter {
+public:
+    RecordWriter();
+
+    void add(const uint8_t* data, size_t size);
+    size_t count() const { return count_; }
+
+    // Encoded text, the writer must not be used afterwards
+    std::string finish();
+
+private:
+    std::string out_;
+    uint32_t acc_ {0}; // pending bits not yet encoded
+    unsigned bits_ {0};
+    size_t count_ {0};
+
+    void put(uint8_t byte);
+};
+
+/**
+ * Decodes RecordWriter output one record at a time, the base64 text is
+ * decoded lazily so nothing but the current record is materialized.
+ */
+class RecordReader {
+public:
+    explicit RecordReader(const std::string& text);
+
+    static bool recognizes(const std::string& text);
+
+    // False at the end of data or on malformed input, see error()
+    bool next(std::vector<uint8_t>& record);
+    bool error() const { return error_; }
+
+private:
+    const std::string& text_;
+    size_t pos_;
+    uint32_t acc_ {0};
+    unsigned bits_ {0};
+    bool error_ {false};
+
+    bool get(uint8_t& byte);
+};
+
+} // namespace runos
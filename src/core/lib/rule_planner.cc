@@ -0,0 +1,238 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "rule_planner.hpp"
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+namespace runos {
+
+static constexpr uint16_t openflow_basic = 0x8000;
+
+bool flow_rule::field::maskable() const
+{
+    if ((type >> 16) != openflow_basic)
+        return false;
+    switch ((type >> 9) & 0x7f) {
+    case 2:  // METADATA
+    case 3:  // ETH_DST
+    case 4:  // ETH_SRC
+    case 6:  // VLAN_VID
+    case 11: // IPV4_SRC
+    case 12: // IPV4_DST
+    case 22: // ARP_SPA
+    case 23: // ARP_TPA
+    case 24: // ARP_SHA
+    case 25: // ARP_THA
+    case 26: // IPV6_SRC
+    case 27: // IPV6_DST
+    case 28: // IPV6_FLABEL
+    case 37: // TUNNEL_ID
+    case 38: // PBB_ISID
+    case 39: // IPV6_EXTHDR
+        return true;
+    default:
+        return false;
+    }
+}
+
+uint8_t* flow_rule::field::pack(uint8_t* out) const
+{
+    uint32_t header = type | uint32_t(not mask.empty()) << 8 |
+                      uint32_t(value.size() + mask.size());
+    *out++ = header >> 24;
+    *out++ = header >> 16;
+    *out++ = header >> 8;
+    *out++ = header;
+    out = std::copy(value.begin(), value.end(), out);
+    return std::copy(mask.begin(), mask.end(), out);
+}
+
+void flow_rule::set_match(const uint8_t* oxm, size_t len)
+{
+    match.clear();
+    for (size_t off = 0; off + 4 <= len; ) {
+        uint32_t header = uint32_t(oxm[off]) << 24 | uint32_t(oxm[off + 1]) << 16 |
+                          uint32_t(oxm[off + 2]) << 8 | oxm[off + 3];
+        bool hasmask = header & 0x100;
+        size_t payload = header & 0xff;
+        const uint8_t* p = oxm + off + 4;
+        size_t n = hasmask ? payload / 2 : payload;
+
+        field f;
+        f.type = header & 0xfffffe00;
+        f.value.assign(p, p + n);
+        if (hasmask)
+            f.mask.assign(p + n, p + payload);
+        match.push_back(std::move(f));
+        off += 4 + payload;
+    }
+    std::stable_sort(match.begin(), match.end(),
+        [](const field& a, const field& b) { return a.type < b.type; });
+}
+
+size_t flow_rule::match_length() const
+{
+    size_t ret = 0;
+    for (auto& f : match)
+        ret += f.length();
+    return ret;
+}
+
+uint8_t* flow_rule::pack_match(uint8_t* out) const
+{
+    for (auto& f : match)
+        out = f.pack(out);
+    return out;
+}
+
+namespace {
+
+uint8_t mask_byte(const flow_rule::field& f, size_t i)
+{
+    return f.mask.empty() ? 0xff : f.mask[i];
+}
+
+// Every packet matched by `r` is matched by `s`
+bool covers(const flow_rule& s, const flow_rule& r)
+{
+    auto it = r.match.begin();
+    for (auto& fs : s.match) {
+        while (it != r.match.end() && it->type < fs.type)
+            ++it;
+        if (it == r.match.end() || it->type != fs.type ||
+            it->value.size() != fs.value.size())
+            return false;
+        for (size_t i = 0; i < fs.value.size(); ++i) {
+            uint8_t ms = mask_byte(fs, i);
+            uint8_t mr = mask_byte(*it, i);
+            if ((mr & ms) != ms || ((it->value[i] ^ fs.value[i]) & ms) != 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Single bit in which `a` and `b` differ, both matching exactly
+// the union of them with it masked out
+bool mergeable(const flow_rule& a, const flow_rule& b, bool masks,
+               size_t& field, size_t& byte, uint8_t& bit)
+{
+    if (not masks || a.match.size() != b.match.size())
+        return false;
+
+    bool found = false;
+    for (size_t k = 0; k < a.match.size(); ++k) {
+        auto& fa = a.match[k];
+        auto& fb = b.match[k];
+        if (fa.type != fb.type || fa.mask != fb.mask ||
+            fa.value.size() != fb.value.size())
+            return false;
+        for (size_t i = 0; i < fa.value.size(); ++i) {
+            uint8_t diff = fa.value[i] ^ fb.value[i];
+            if (diff == 0)
+                continue;
+            if (found || (diff & (diff - 1)) != 0 ||
+                (diff & mask_byte(fa, i)) != diff || not fa.maskable())
+                return false;
+            found = true;
+            field = k;
+            byte = i;
+            bit = diff;
+        }
+    }
+    return found;
+}
+
+flow_rule merged(const flow_rule& a, size_t k, size_t byte, uint8_t bit)
+{
+    flow_rule ret = a;
+    auto& f = ret.match[k];
+    if (f.mask.empty())
+        f.mask.assign(f.value.size(), 0xff);
+    f.mask[byte] &= ~bit;
+    f.value[byte] &= ~bit;
+    if (std::all_of(f.mask.begin(), f.mask.end(),
+                    [](uint8_t m) { return m == 0; })) {
+        ret.match.erase(ret.match.begin() + k); // wildcard now
+    }
+    return ret;
+}
+
+void shrink(std::vector<flow_rule>& rules, bool masks)
+{
+    for (bool changed = true; changed; ) {
+        changed = false;
+
+        for (size_t i = 0; i < rules.size(); ) {
+            bool covered = false;
+            for (size_t j = 0; j < rules.size() && not covered; ++j) {
+                // of two equal rules the latter goes
+                covered = j != i && covers(rules[j], rules[i]) &&
+                          (j < i || not covers(rules[i], rules[j]));
+            }
+            if (covered) {
+                rules.erase(rules.begin() + i);
+                changed = true;
+            } else {
+                ++i;
+            }
+        }
+
+        for (size_t i = 0; i < rules.size() && not changed; ++i) {
+            for (size_t j = i + 1; j < rules.size(); ++j) {
+                size_t field, byte;
+                uint8_t bit;
+                if (mergeable(rules[i], rules[j], masks, field, byte, bit)) {
+                    rules[i] = merged(rules[i], field, byte, bit);
+                    rules.erase(rules.begin() + j);
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+} // namespace
+
+rule_plan rule_plan::make(std::vector<flow_rule> rules, bool masks)
+{
+    rule_plan ret;
+    ret.requested = rules.size();
+
+    using key = std::tuple<uint8_t, uint16_t, std::vector<uint8_t>>;
+    std::map<key, std::vector<flow_rule>> groups;
+    for (auto& rule : rules) {
+        if (rule.counted) {
+            ret.rules.push_back(std::move(rule));
+        } else {
+            groups[key{rule.table, rule.priority, rule.instructions}]
+                .push_back(std::move(rule));
+        }
+    }
+    for (auto& group : groups) {
+        shrink(group.second, masks);
+        for (auto& rule : group.second)
+            ret.rules.push_back(std::move(rule));
+    }
+    return ret;
+}
+
+} // namespace runos
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Flow table rule in wire form, as the rule planner sees it.
+ *
+ * Match is a list of OXM TLVs sorted by type, instructions are kept
+ * packed and only compared. `counted` rules have their counters read
+ * by someone, so they are never merged or dropped, nor are others
+ * folded into them.
+ */
+struct flow_rule {
+    struct field {
+        uint32_t type; // OXM header without hasmask and length bits
+        std::vector<uint8_t> value;
+        std::vector<uint8_t> mask; // empty for exact match
+
+        // OpenFlow 1.3 allows a mask on this field
+        bool maskable() const;
+        // Wire bytes of the TLV
+        size_t length() const { return 4 + value.size() + mask.size(); }
+        uint8_t* pack(uint8_t* out) const;
+
+        bool operator==(const field& other) const
+        { return type == other.type && value == other.value && mask == other.mask; }
+    };
+
+    uint8_t table {0};
+    uint16_t priority {0};
+    std::vector<field> match;
+    std::vector<uint8_t> instructions;
+    bool counted {true};
+
+    // Parses `len` bytes of OXM TLVs, as written by oxm::static_match
+    void set_match(const uint8_t* oxm, size_t len);
+    size_t match_length() const;
+    uint8_t* pack_match(uint8_t* out) const;
+
+    // Same entry of the flow table: table, priority and match equal
+    bool same_entry(const flow_rule& other) const
+    {
+        return table == other.table && priority == other.priority &&
+               match == other.match;
+    }
+    bool operator==(const flow_rule& other) const
+    {
+        return same_entry(other) && instructions == other.instructions &&
+               counted == other.counted;
+    }
+};
+
+/**
+ * Plans the smallest set of flow entries doing what the given rules do.
+ *
+ * Only exact rewrites are made, so forwarding never changes. Among rules
+ * of one table with the same priority and instructions, uncounted ones
+ *
+ *  - are dropped if another uncounted rule matches all their packets;
+ *  - are merged pairwise if they differ in a single bit of a maskable
+ *    field (a mask with that bit cleared matches exactly both), until
+ *    nothing merges, so aligned blocks of values collapse to one entry.
+ *
+ * Masks are only used if the switch supports them (`masks`), hardware
+ * switches often keep masked entries in a smaller TCAM. Rules which
+ * differ in a field that can't be masked, like in_port, never merge.
+ */
+struct rule_plan {
+    std::vector<flow_rule> rules;
+    size_t requested {0};
+
+    size_t saved() const { return requested - rules.size(); }
+
+    static rule_plan make(std::vector<flow_rule> rules, bool masks = true);
+};
+
+} // namespace runos
@@ -0,0 +1,256 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "sampling_profiler.hpp"
+
+#include <boost/core/demangle.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace runos {
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+constexpr int max_depth = 64;
+constexpr int skip_frames = 2; // the handler and the signal trampoline
+constexpr size_t slot_count = 4096;
+constexpr auto drain_period = std::chrono::milliseconds(10);
+
+enum slot_state : int { free_slot, writing, ready };
+
+struct slot {
+    std::atomic<int> state {free_slot};
+    pid_t tid;
+    int depth;
+    void* frames[max_depth];
+};
+
+struct buffer {
+    slot slots[slot_count];
+    std::atomic<uint64_t> next {0};
+    std::atomic<uint64_t> dropped {0};
+};
+
+// Set while sampling. The buffer itself is never freed and the handler
+// stays installed: a SIGPROF still pending after the timer is disarmed
+// must neither terminate the process nor touch freed memory.
+std::atomic<buffer*> active {nullptr};
+std::mutex running; // one profile at a time
+
+void on_sigprof(int, siginfo_t*, void*)
+{
+    int saved_errno = errno;
+    if (buffer* buf = active.load(std::memory_order_acquire)) {
+        auto i = buf->next.fetch_add(1, std::memory_order_relaxed);
+        auto& s = buf->slots[i % slot_count];
+        int expected = free_slot;
+        if (s.state.compare_exchange_strong(expected, writing,
+                                            std::memory_order_acquire)) {
+            s.tid = static_cast<pid_t>(syscall(SYS_gettid));
+            s.depth = backtrace(s.frames, max_depth);
+            s.state.store(ready, std::memory_order_release);
+        } else {
+            buf->dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    errno = saved_errno;
+}
+
+buffer* install()
+{
+    static buffer* buf = [] {
+        // backtrace() loads the unwinder on its first call, which is
+        // not something to do inside a signal handler
+        void* warmup[1];
+        backtrace(warmup, 1);
+
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = &on_sigprof;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGPROF, &sa, nullptr);
+
+        return new buffer;
+    }();
+    return buf;
+}
+
+void set_timer(unsigned hz)
+{
+    struct itimerval tv;
+    std::memset(&tv, 0, sizeof(tv));
+    if (hz > 0) {
+        tv.it_interval.tv_usec = 1000000 / hz;
+        tv.it_value = tv.it_interval;
+    }
+    setitimer(ITIMER_PROF, &tv, nullptr);
+}
+
+std::string thread_name(pid_t tid)
+{
+    std::ifstream comm("/proc/self/task/" + std::to_string(tid) + "/comm");
+    std::string name;
+    if (std::getline(comm, name) && not name.empty()) {
+        std::replace(name.begin(), name.end(), ';', '_');
+        std::replace(name.begin(), name.end(), ' ', '_');
+        return name;
+    }
+    return "thread-" + std::to_string(tid);
+}
+
+std::string symbol(void* addr)
+{
+    Dl_info info;
+    if (dladdr(addr, &info) && info.dli_sname) {
+        auto name = boost::core::demangle(info.dli_sname);
+        std::replace(name.begin(), name.end(), ';', ',');
+        return name;
+    }
+
+    std::ostringstream out;
+    if (info.dli_fname && info.dli_fname[0]) {
+        const char* base = std::strrchr(info.dli_fname, '/');
+        out << (base ? base + 1 : info.dli_fname) << "+0x" << std::hex
+            << (static_cast<char*>(addr) - static_cast<char*>(info.dli_fbase));
+    } else {
+        out << addr;
+    }
+    return out.str();
+}
+
+struct collector {
+    using stack = std::vector<void*>;
+
+    std::map<std::pair<pid_t, stack>, uint64_t> stacks;
+    std::unordered_map<pid_t, std::string> threads;
+    uint64_t samples {0};
+
+    void drain(buffer& buf)
+    {
+        for (auto& s : buf.slots) {
+            if (s.state.load(std::memory_order_acquire) != ready)
+                continue;
+            int depth = std::max(s.depth - skip_frames, 0);
+            stack frames(s.frames + std::min(skip_frames, s.depth),
+                         s.frames + std::min(skip_frames, s.depth) + depth);
+            pid_t tid = s.tid;
+            s.state.store(free_slot, std::memory_order_release);
+
+            // the thread is alive at least until now, so is its name
+            if (threads.count(tid) == 0)
+                threads.emplace(tid, thread_name(tid));
+            ++stacks[std::make_pair(tid, std::move(frames))];
+            ++samples;
+        }
+    }
+
+    std::map<std::string, uint64_t> collapse() const
+    {
+        std::map<std::string, uint64_t> ret;
+        std::unordered_map<void*, std::string> symbols;
+        for (const auto& pair : stacks) {
+            const auto& frames = pair.first.second;
+            std::string line = threads.at(pair.first.first);
+            for (size_t i = frames.size(); i-- > 0;) {
+                // return addresses point past the call, except the
+                // innermost frame, interrupted where it was
+                void* addr = i == 0 ? frames[i]
+                                    : static_cast<char*>(frames[i]) - 1;
+                auto it = symbols.find(addr);
+                if (it == symbols.end())
+                    it = symbols.emplace(addr, symbol(addr)).first;
+                line += ';';
+                line += it->second;
+            }
+            ret[line] += pair.second;
+        }
+        return ret;
+    }
+};
+
+} // namespace
+
+std::string SamplingProfiler::Profile::collapsed() const
+{
+    std::ostringstream out;
+    for (const auto& pair : stacks) {
+        out << pair.first << ' ' << pair.second << '\n';
+    }
+    return out.str();
+}
+
+SamplingProfiler::Profile
+SamplingProfiler::run(std::chrono::milliseconds duration, unsigned hz)
+{
+    std::unique_lock<std::mutex> lock(running, std::try_to_lock);
+    if (not lock.owns_lock())
+        throw busy();
+
+    hz = std::min(std::max(hz, 1u), 1000u);
+    buffer* buf = install();
+    for (auto& s : buf->slots) {
+        s.state.store(free_slot, std::memory_order_relaxed);
+    }
+    buf->dropped.store(0, std::memory_order_relaxed);
+
+    collector samples;
+    auto start = clock::now();
+    auto deadline = start + duration;
+
+    active.store(buf, std::memory_order_release);
+    set_timer(hz);
+    while (clock::now() < deadline) {
+        std::this_thread::sleep_for(
+            std::min<clock::duration>(drain_period, deadline - clock::now()));
+        samples.drain(*buf);
+    }
+    set_timer(0);
+    active.store(nullptr, std::memory_order_release);
+    // let handlers which already started finish
+    std::this_thread::sleep_for(drain_period);
+    samples.drain(*buf);
+
+    Profile ret;
+    ret.duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        clock::now() - start);
+    ret.hz = hz;
+    ret.samples = samples.samples;
+    ret.dropped = buf->dropped.load(std::memory_order_relaxed);
+    ret.stacks = samples.collapse();
+    return ret;
+}
+
+} // namespace runos
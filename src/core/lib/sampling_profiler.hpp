@@ -0,0 +1,66 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace runos {
+
+/**
+ * In-process CPU profiler which needs no external tools.
+ *
+ * SIGPROF is raised by an ITIMER_PROF interval timer, which counts CPU
+ * time of the whole process, so the kernel delivers it to whichever
+ * thread is burning CPU: libfluid I/O threads, the Qt main thread, timer
+ * workers alike. The handler only copies the stack into a preallocated
+ * slot; a collector thread drains the slots, aggregates identical stacks
+ * and names the threads. Symbols are resolved after the run.
+ *
+ * Symbols are looked up in the dynamic symbol table, so the executable is
+ * linked with exported symbols; static and inlined functions are shown
+ * as module+offset, resolvable offline with addr2line.
+ */
+class SamplingProfiler {
+public:
+    struct busy : std::runtime_error {
+        busy() : std::runtime_error("Profiler is already running") { }
+    };
+
+    struct Profile {
+        std::chrono::milliseconds duration {0};
+        unsigned hz {0};
+        uint64_t samples {0};
+        uint64_t dropped {0}; // slots were full
+        // "thread;outermost;...;innermost" -> samples, flame graph input
+        std::map<std::string, uint64_t> stacks;
+
+        // One line per stack: "<stack> <count>"
+        std::string collapsed() const;
+    };
+
+    // Samples for `duration` at `hz` per CPU-second, blocking the caller.
+    // Throws busy if another profile is in progress.
+    static Profile run(std::chrono::milliseconds duration, unsigned hz = 99);
+};
+
+} // namespace runos
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "shard_ring.hpp"
+
+#include <algorithm>
+
+namespace runos {
+
+namespace {
+
+// splitmix64 finalizer, spreads sequential dpids over the ring
+uint64_t mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+} // namespace
+
+bool shard_ring::assign(std::vector<int> members)
+{
+    std::sort(members.begin(), members.end());
+    members.erase(std::unique(members.begin(), members.end()),
+                  members.end());
+    if (members == m_members)
+        return false;
+
+    m_members = std::move(members);
+    m_points.clear();
+    m_points.reserve(m_members.size() * m_vnodes);
+    for (int member : m_members) {
+        uint64_t seed = mix(uint64_t(uint32_t(member)) << 32);
+        for (unsigned i = 0; i < m_vnodes; ++i) {
+            m_points.emplace_back(mix(seed + i), member);
+        }
+    }
+    std::sort(m_points.begin(), m_points.end());
+    return true;
+}
+
+int shard_ring::owner(uint64_t dpid) const
+{
+    if (m_points.empty())
+        return none;
+
+    auto it = std::lower_bound(m_points.begin(), m_points.end(),
+                               std::make_pair(mix(dpid), none));
+    if (it == m_points.end())
+        it = m_points.begin();
+    return it->second;
+}
+
+int shard_ring::leader() const
+{
+    return m_members.empty() ? none : m_members.front();
+}
+
+} // namespace runos
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Consistent hashing of switch dpids onto controller nodes.
+ *
+ * Every member owns `vnodes` points of a 64-bit ring; a dpid belongs
+ * to the member of the first point at or after its hash. Removing a
+ * member moves only its own dpids, spread over the survivors, and the
+ * assignment depends only on the member set, so every node computes
+ * the same one without talking to the others.
+ *
+ * Not thread safe.
+ */
+class shard_ring {
+public:
+    static constexpr int none = -1;
+
+    explicit shard_ring(unsigned vnodes = 64)
+        : m_vnodes(vnodes ? vnodes : 1)
+    { }
+
+    // Returns true if the member set has changed
+    bool assign(std::vector<int> members);
+
+    // Member owning the dpid, `none` for an empty ring
+    int owner(uint64_t dpid) const;
+    // Lowest member id, `none` for an empty ring
+    int leader() const;
+
+    const std::vector<int>& members() const { return m_members; }
+    bool empty() const { return m_members.empty(); }
+
+private:
+    unsigned m_vnodes;
+    std::vector<int> m_members; // sorted
+    std::vector<std::pair<uint64_t, int>> m_points; // sorted by hash
+};
+
+} // namespace runos
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+
+namespace runos {
+
+/**
+ * View of contiguous elements owned elsewhere, like C++20 std::span
+ * without the static extent. Elements may be modified through it.
+ */
+template<class T>
+class span {
+public:
+    using element_type = T;
+    using iterator = T*;
+
+    span() = default;
+    span(T* data, size_t size) noexcept
+        : data_(data), size_(size)
+    { }
+
+    template<class Container>
+    span(Container& c) noexcept
+        : data_(c.data()), size_(c.size())
+    { }
+
+    T* data() const noexcept { return data_; }
+    size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+
+    T& operator[](size_t i) const noexcept { return data_[i]; }
+    T* begin() const noexcept { return data_; }
+    T* end() const noexcept { return data_ + size_; }
+
+    span subspan(size_t offset, size_t count) const noexcept
+    { return { data_ + offset, count }; }
+
+private:
+    T* data_ {nullptr};
+    size_t size_ {0};
+};
+
+} // namespace runos
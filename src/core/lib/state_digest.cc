@@ -0,0 +1,207 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "state_digest.hpp"
+
+namespace runos {
+
+using lock_t = std::lock_guard<std::mutex>;
+
+static constexpr uint64_t fnv_basis = 0xcbf29ce484222325ULL;
+static constexpr uint64_t fnv_prime = 0x100000001b3ULL;
+
+static uint64_t fnv(const std::string& s, uint64_t h = fnv_basis)
+{
+    for (unsigned char c : s) {
+        h = (h ^ c) * fnv_prime;
+    }
+    // Ends the string, so "a" + "bc" differs from "ab" + "c"
+    return (h ^ 0xff) * fnv_prime;
+}
+
+// splitmix64 finalizer, sums of mixed hashes don't cancel out easily
+static uint64_t mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t value_hash(const std::string& prefix, const std::string& key,
+                           const std::string& value)
+{
+    return mix(fnv(value, fnv(key, fnv(prefix))));
+}
+
+size_t StateDigest::bucket(const std::string& prefix)
+{
+    return mix(fnv(prefix)) % BUCKETS;
+}
+
+void StateDigest::account(const std::string& prefix, const Partition& p,
+                          bool add)
+{
+    if (p.values.empty())
+        return;
+    uint64_t h = mix(fnv(prefix) ^ mix(p.sum + p.values.size()));
+    auto& b = buckets_[bucket(prefix)];
+    b = add ? b + h : b - h;
+}
+
+void StateDigest::erase(std::map<std::string, Partition>::iterator it)
+{
+    account(it->first, it->second, false);
+    partitions_.erase(it);
+}
+
+void StateDigest::put(const std::string& prefix, const std::string& key,
+                      const std::string& value)
+{
+    auto& p = partitions_[prefix];
+    account(prefix, p, false);
+
+    auto h = value_hash(prefix, key, value);
+    auto it = p.values.find(key);
+    if (it != p.values.end()) {
+        p.sum -= it->second;
+        it->second = h;
+    } else {
+        p.values.emplace(key, h);
+    }
+    p.sum += h;
+    p.changed = generation_;
+    account(prefix, p, true);
+}
+
+void StateDigest::apply(const Change& change)
+{
+    lock_t lock(mutex_);
+    ++generation_;
+
+    switch (change.op) {
+    case Change::Op::Put:
+        put(change.prefix, change.key, change.value);
+        break;
+    case Change::Op::Delete: {
+        auto it = partitions_.find(change.prefix);
+        if (it == partitions_.end())
+            break;
+        auto& p = it->second;
+        account(it->first, p, false);
+        auto value = p.values.find(change.key);
+        if (value != p.values.end()) {
+            p.sum -= value->second;
+            p.values.erase(value);
+        }
+        p.changed = generation_;
+        if (p.values.empty()) {
+            partitions_.erase(it);
+        } else {
+            account(it->first, p, true);
+        }
+        break;
+    }
+    case Change::Op::DeletePrefix: {
+        auto it = partitions_.find(change.prefix);
+        if (it != partitions_.end()) {
+            erase(it);
+        }
+        auto nested = change.prefix + ":";
+        it = partitions_.lower_bound(nested);
+        while (it != partitions_.end() &&
+               it->first.compare(0, nested.size(), nested) == 0) {
+            erase(it++);
+        }
+        bulk_changed_ = generation_;
+        break;
+    }
+    case Change::Op::Clear:
+        partitions_.clear();
+        buckets_.fill(0);
+        bulk_changed_ = generation_;
+        break;
+    }
+}
+
+bool StateDigest::assign(const std::string& prefix,
+                         const StateImage::Values& values, uint64_t since)
+{
+    lock_t lock(mutex_);
+    auto it = partitions_.find(prefix);
+    if (bulk_changed_ > since ||
+            (it != partitions_.end() && it->second.changed > since))
+        return false;
+
+    ++generation_;
+    if (it != partitions_.end()) {
+        erase(it);
+    }
+    if (values.empty())
+        return true;
+
+    Partition p;
+    for (auto& value : values) {
+        auto h = value_hash(prefix, value.first, value.second);
+        p.values.emplace(value.first, h);
+        p.sum += h;
+    }
+    p.changed = generation_;
+    account(prefix, p, true);
+    partitions_.emplace(prefix, std::move(p));
+    return true;
+}
+
+void StateDigest::clear()
+{
+    lock_t lock(mutex_);
+    ++generation_;
+    partitions_.clear();
+    buckets_.fill(0);
+    bulk_changed_ = generation_;
+}
+
+StateDigest::Summary StateDigest::summary() const
+{
+    lock_t lock(mutex_);
+    Summary ret;
+    ret.generation = generation_;
+    ret.buckets = buckets_;
+    ret.root = fnv_basis;
+    for (auto b : buckets_) {
+        ret.root = mix(ret.root ^ b);
+    }
+    return ret;
+}
+
+uint64_t StateDigest::generation() const
+{
+    lock_t lock(mutex_);
+    return generation_;
+}
+
+std::vector<std::string> StateDigest::partitions(size_t bucket) const
+{
+    lock_t lock(mutex_);
+    std::vector<std::string> ret;
+    for (auto& p : partitions_) {
+        if (StateDigest::bucket(p.first) == bucket) {
+            ret.push_back(p.first);
+        }
+    }
+    return ret;
+}
+
+} // namespace runos
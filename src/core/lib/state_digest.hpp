@@ -0,0 +1,84 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "change_log.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Order independent digest of a prefix -> key -> value state, kept up
+ * to date change by change.
+ *
+ * A value hashes with its prefix and key, a prefix (a partition) sums
+ * its values and partitions are summed into one of BUCKETS buckets by
+ * the hash of their name; the root hashes the buckets. Nodes holding
+ * the same state have the same buckets, and a differing bucket tells
+ * which partitions to read again.
+ */
+class StateDigest {
+public:
+    static constexpr size_t BUCKETS = 16;
+
+    struct Summary {
+        uint64_t generation {0}; // changes and assignments applied
+        uint64_t root {0};
+        std::array<uint64_t, BUCKETS> buckets {{}};
+    };
+
+    void apply(const Change& change);
+    // Replaces the partition unless it has changed after generation
+    // `since`, true if replaced
+    bool assign(const std::string& prefix, const StateImage::Values& values,
+                uint64_t since);
+    void clear();
+
+    Summary summary() const;
+    uint64_t generation() const;
+    std::vector<std::string> partitions(size_t bucket) const;
+
+    static size_t bucket(const std::string& prefix);
+
+private:
+    struct Partition {
+        std::map<std::string, uint64_t> values; // key -> hash
+        uint64_t sum {0};
+        uint64_t changed {0};
+    };
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Partition> partitions_;
+    std::array<uint64_t, BUCKETS> buckets_ {{}};
+    uint64_t generation_ {0};
+    uint64_t bulk_changed_ {0}; // last DeletePrefix or Clear
+
+    // Under mutex_
+    void put(const std::string& prefix, const std::string& key,
+             const std::string& value);
+    void erase(std::map<std::string, Partition>::iterator it);
+    void account(const std::string& prefix, const Partition& p, bool add);
+};
+
+} // namespace runos
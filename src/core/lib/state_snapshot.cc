@@ -0,0 +1,303 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "state_snapshot.hpp"
+
+#include <runos/core/assert.hpp>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace runos {
+
+static constexpr char magic[8] = {'R', 'N', 'S', 'N', 'A', 'P', '0', '1'};
+static constexpr size_t name_size = 32;
+
+struct file_header {
+    char magic[8];
+    uint64_t stamp;
+    uint64_t sections;
+    uint64_t size;
+    uint64_t checksum;
+    uint64_t reserved[3];
+};
+
+struct section_entry {
+    char name[name_size];
+    uint64_t offset;
+    uint64_t size;
+    uint64_t count;
+    uint64_t reserved;
+};
+
+struct record_header {
+    uint64_t key;
+    uint32_t size;
+    uint32_t zero;
+};
+
+static_assert(sizeof(file_header) == 64, "file header layout");
+static_assert(sizeof(section_entry) == 64, "section entry layout");
+static_assert(sizeof(record_header) == 16, "record header layout");
+
+static size_t padded(size_t size)
+{
+    return (size + 7) / 8 * 8;
+}
+
+// FNV-1a over 64-bit words, every part of the file is word-aligned
+static uint64_t checksum(uint64_t h, const void* data, size_t size)
+{
+    auto words = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, words + i, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+    }
+    return h;
+}
+static constexpr uint64_t checksum_basis = 0xcbf29ce484222325ULL;
+
+static bool write_all(int fd, const void* data, size_t size)
+{
+    auto p = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* SnapshotWriter */
+
+SnapshotWriter::SnapshotWriter(uint64_t stamp)
+    : stamp_(stamp)
+{ }
+
+void SnapshotWriter::section(const std::string& name)
+{
+    CHECK(name.size() < name_size);
+    sections_.push_back(Section{name, {}, 0});
+}
+
+void SnapshotWriter::add(uint64_t key, const void* data, size_t size)
+{
+    CHECK(not sections_.empty());
+    CHECK(size <= UINT32_MAX);
+
+    auto& words = sections_.back().data;
+    size_t pos = words.size();
+    words.resize(pos + (sizeof(record_header) + padded(size)) / 8);
+
+    record_header h {key, uint32_t(size), 0};
+    auto out = reinterpret_cast<uint8_t*>(words.data() + pos);
+    std::memcpy(out, &h, sizeof(h));
+    if (size > 0) {
+        std::memcpy(out + sizeof(h), data, size);
+    }
+    sections_.back().count++;
+}
+
+size_t SnapshotWriter::records() const
+{
+    size_t ret = 0;
+    for (const auto& s : sections_) {
+        ret += s.count;
+    }
+    return ret;
+}
+
+bool SnapshotWriter::commit(const std::string& path)
+{
+    std::vector<section_entry> table(sections_.size());
+    uint64_t offset = sizeof(file_header) + table.size() * sizeof(section_entry);
+    for (size_t i = 0; i < sections_.size(); ++i) {
+        auto& e = table[i];
+        std::memset(&e, 0, sizeof(e));
+        std::memcpy(e.name, sections_[i].name.data(), sections_[i].name.size());
+        e.offset = offset;
+        e.size = sections_[i].data.size() * 8;
+        e.count = sections_[i].count;
+        offset += e.size;
+    }
+
+    file_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.stamp = stamp_;
+    header.sections = table.size();
+    header.size = offset;
+    uint64_t h = checksum(checksum_basis, table.data(),
+                          table.size() * sizeof(section_entry));
+    for (const auto& s : sections_) {
+        h = checksum(h, s.data.data(), s.data.size() * 8);
+    }
+    header.checksum = h;
+
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    bool ok = write_all(fd, &header, sizeof(header)) &&
+              write_all(fd, table.data(), table.size() * sizeof(section_entry));
+    for (size_t i = 0; ok && i < sections_.size(); ++i) {
+        ok = write_all(fd, sections_[i].data.data(), sections_[i].data.size() * 8);
+    }
+    ok = ok && ::fsync(fd) == 0;
+
+    int saved = errno;
+    ::close(fd);
+    if (ok && ::rename(tmp.c_str(), path.c_str()) == 0)
+        return true;
+
+    saved = ok ? errno : saved;
+    ::unlink(tmp.c_str());
+    errno = saved;
+    return false;
+}
+
+/* SnapshotSection */
+
+SnapshotRecord SnapshotSection::iterator::operator*() const
+{
+    record_header h;
+    std::memcpy(&h, pos_, sizeof(h));
+    return SnapshotRecord{h.key, pos_ + sizeof(h), h.size};
+}
+
+SnapshotSection::iterator& SnapshotSection::iterator::operator++()
+{
+    record_header h;
+    std::memcpy(&h, pos_, sizeof(h));
+    pos_ += sizeof(h) + padded(h.size);
+    return *this;
+}
+
+/* SnapshotFile */
+
+// Records must tile the section exactly
+static bool valid_section(const uint8_t* base, const section_entry& e)
+{
+    const uint8_t* pos = base + e.offset;
+    const uint8_t* end = pos + e.size;
+    for (uint64_t i = 0; i < e.count; ++i) {
+        if (size_t(end - pos) < sizeof(record_header))
+            return false;
+        record_header h;
+        std::memcpy(&h, pos, sizeof(h));
+        if (h.zero != 0 || padded(h.size) > size_t(end - pos) - sizeof(h))
+            return false;
+        pos += sizeof(h) + padded(h.size);
+    }
+    return pos == end;
+}
+
+std::unique_ptr<SnapshotFile> SnapshotFile::open(const std::string& path,
+                                                 std::string& error)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error = std::strerror(errno);
+        return nullptr;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) < 0 || st.st_size < off_t(sizeof(file_header))) {
+        error = "truncated file";
+        ::close(fd);
+        return nullptr;
+    }
+
+    size_t size = st.st_size;
+    void* base = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        error = std::strerror(errno);
+        return nullptr;
+    }
+    std::unique_ptr<SnapshotFile> ret{
+        new SnapshotFile(static_cast<const uint8_t*>(base), size)};
+
+    auto bytes = ret->base_;
+    auto header = reinterpret_cast<const file_header*>(bytes);
+    auto table = reinterpret_cast<const section_entry*>(bytes + sizeof(file_header));
+    if (std::memcmp(header->magic, magic, sizeof(magic)) != 0) {
+        error = "not a snapshot";
+        return nullptr;
+    }
+    if (header->size != size || size % 8 != 0 ||
+        header->sections > (size - sizeof(file_header)) / sizeof(section_entry)) {
+        error = "truncated file";
+        return nullptr;
+    }
+    if (checksum(checksum_basis, table, size - sizeof(file_header)) !=
+        header->checksum) {
+        error = "checksum mismatch";
+        return nullptr;
+    }
+
+    uint64_t data_begin = sizeof(file_header) +
+                          header->sections * sizeof(section_entry);
+    for (uint64_t i = 0; i < header->sections; ++i) {
+        const auto& e = table[i];
+        if (e.offset < data_begin || e.offset % 8 != 0 ||
+            e.offset > size || e.size > size - e.offset ||
+            e.name[name_size - 1] != '\0' || not valid_section(bytes, e)) {
+            error = "malformed section";
+            return nullptr;
+        }
+    }
+    return ret;
+}
+
+SnapshotFile::~SnapshotFile()
+{
+    ::munmap(const_cast<uint8_t*>(base_), size_);
+}
+
+uint64_t SnapshotFile::stamp() const
+{
+    return reinterpret_cast<const file_header*>(base_)->stamp;
+}
+
+std::optional<SnapshotSection> SnapshotFile::section(const std::string& name) const
+{
+    auto header = reinterpret_cast<const file_header*>(base_);
+    auto table = reinterpret_cast<const section_entry*>(base_ + sizeof(file_header));
+    for (uint64_t i = 0; i < header->sections; ++i) {
+        const auto& e = table[i];
+        if (name.size() < name_size && name.compare(e.name) == 0) {
+            return SnapshotSection(base_ + e.offset, base_ + e.offset + e.size,
+                                   e.count);
+        }
+    }
+    return std::nullopt;
+}
+
+} // namespace runos
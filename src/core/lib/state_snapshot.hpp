@@ -0,0 +1,155 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Local state snapshot file, laid out to be used straight from a
+ * read-only mapping.
+ *
+ * Layout (host byte order, every part 8-byte aligned):
+ *   header    "RNSNAP01", stamp, section count, file size and FNV-1a
+ *             checksum of everything after the header
+ *   sections  name (32 bytes), offset, size and record count
+ *   records   key (u64), data size (u32), zero (u32), data padded to 8
+ * Record data starts on an 8-byte boundary, so trivially copyable
+ * structs are read in place.
+ */
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(uint64_t stamp);
+
+    // Records added afterwards go to this section
+    void section(const std::string& name);
+
+    void add(uint64_t key, const void* data, size_t size);
+    void add(uint64_t key, std::string_view text)
+    { add(key, text.data(), text.size()); }
+
+    template<class T>
+    void add(uint64_t key, const T& value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "records are read in place");
+        add(key, &value, sizeof(T));
+    }
+
+    size_t records() const;
+
+    // Writes a temporary file next to path, syncs and renames it, so a
+    // reader sees either the old or the new snapshot. False on error,
+    // errno tells which.
+    bool commit(const std::string& path);
+
+private:
+    struct Section {
+        std::string name;
+        std::vector<uint64_t> data; // 8-byte words
+        uint64_t count {0};
+    };
+    uint64_t stamp_;
+    std::vector<Section> sections_;
+};
+
+struct SnapshotRecord {
+    uint64_t key;
+    const uint8_t* data;
+    size_t size;
+
+    std::string_view text() const
+    { return {reinterpret_cast<const char*>(data), size}; }
+
+    // nullptr if the record is not a T
+    template<class T>
+    const T* as() const
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "records are read in place");
+        return size == sizeof(T) ? reinterpret_cast<const T*>(data) : nullptr;
+    }
+};
+
+// Records of one section, valid while the SnapshotFile is
+class SnapshotSection {
+public:
+    class iterator {
+    public:
+        explicit iterator(const uint8_t* pos = nullptr) : pos_(pos) { }
+
+        SnapshotRecord operator*() const;
+        iterator& operator++();
+        bool operator==(const iterator& rhs) const { return pos_ == rhs.pos_; }
+        bool operator!=(const iterator& rhs) const { return pos_ != rhs.pos_; }
+
+    private:
+        const uint8_t* pos_;
+    };
+
+    SnapshotSection() = default;
+    SnapshotSection(const uint8_t* begin, const uint8_t* end, size_t count)
+        : begin_(begin), end_(end), count_(count)
+    { }
+
+    iterator begin() const { return iterator(begin_); }
+    iterator end() const { return iterator(end_); }
+    size_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+
+private:
+    const uint8_t* begin_ {nullptr};
+    const uint8_t* end_ {nullptr};
+    size_t count_ {0};
+};
+
+class SnapshotFile {
+public:
+    // Maps the file and checks its layout, nullptr with the reason in
+    // `error` if there is no file or it is damaged
+    static std::unique_ptr<SnapshotFile> open(const std::string& path,
+                                              std::string& error);
+    ~SnapshotFile();
+
+    SnapshotFile(const SnapshotFile&) = delete;
+    SnapshotFile& operator=(const SnapshotFile&) = delete;
+
+    uint64_t stamp() const;
+    size_t size() const { return size_; }
+
+    // None if the file has no such section
+    std::optional<SnapshotSection> section(const std::string& name) const;
+
+private:
+    SnapshotFile(const uint8_t* base, size_t size)
+        : base_(base), size_(size)
+    { }
+
+    const uint8_t* base_;
+    size_t size_;
+};
+
+} // namespace runos
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "table_occupancy.hpp"
+
+namespace runos {
+
+// OpenFlow 1.3 constants, to keep this free of libfluid
+static constexpr uint8_t of13_version = 4;
+static constexpr uint8_t flow_mod_type = 14;
+static constexpr uint8_t table_all = 0xff;
+enum : uint8_t { ofpfc_add, ofpfc_modify, ofpfc_modify_strict,
+                 ofpfc_delete, ofpfc_delete_strict };
+
+uint32_t table_occupancy::table::free() const
+{
+    if (capacity == 0)
+        return UINT32_MAX;
+    uint64_t used = uint64_t(active) + reserved;
+    return used < capacity ? capacity - used : 0;
+}
+
+void table_occupancy::set_default_capacity(uint32_t capacity)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& it : tables_) {
+        if (it.second.capacity == default_capacity_ && not it.second.learned)
+            it.second.capacity = capacity;
+    }
+    default_capacity_ = capacity;
+}
+
+void table_occupancy::set_capacity(uint8_t table, uint32_t capacity)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& t = at(table);
+    t.capacity = capacity;
+    t.learned = false;
+}
+
+auto table_occupancy::at(uint8_t table) -> state&
+{
+    auto it = tables_.find(table);
+    if (it == tables_.end()) {
+        it = tables_.emplace(table, state{}).first;
+        it->second.id = table;
+        it->second.capacity = default_capacity_;
+    }
+    return it->second;
+}
+
+void table_occupancy::begin_refresh()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& it : tables_) {
+        it.second.since_refresh = 0;
+        it.second.guessed = false;
+    }
+}
+
+void table_occupancy::on_table_stats(uint8_t table, uint32_t active)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& t = at(table);
+    int64_t estimate = int64_t(active) + t.since_refresh;
+    t.active = estimate > 0 ? uint32_t(estimate) : 0;
+    t.exact = not t.guessed;
+}
+
+void table_occupancy::apply(state& t, uint8_t command)
+{
+    switch (command) {
+    case ofpfc_add:
+        if (t.reserved > 0)
+            --t.reserved;
+        ++t.active;
+        ++t.since_refresh;
+        break;
+    case ofpfc_delete_strict:
+        if (t.active > 0)
+            --t.active;
+        --t.since_refresh;
+        break;
+    case ofpfc_delete:
+        t.exact = false;
+        t.guessed = true;
+        break;
+    default:
+        break; // modifications don't take entries
+    }
+}
+
+void table_occupancy::on_flow_mod(uint8_t table, uint8_t command)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (table == table_all) {
+        // only deletes may go to all tables
+        for (auto& it : tables_)
+            apply(it.second, command);
+        return;
+    }
+    apply(at(table), command);
+}
+
+void table_occupancy::on_sent(const uint8_t* data, size_t len)
+{
+    for (size_t off = 0; off + 8 <= len; ) {
+        const uint8_t* msg = data + off;
+        size_t msg_len = size_t(msg[2]) << 8 | msg[3];
+        if (msg_len < 8)
+            break;
+        // ofp_flow_mod: table_id and command go after header and cookies
+        if (msg[0] == of13_version && msg[1] == flow_mod_type && msg_len >= 26)
+            on_flow_mod(msg[24], msg[25]);
+        off += msg_len;
+    }
+}
+
+void table_occupancy::on_table_full(uint8_t table)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& t = at(table);
+    // refused ADD was counted
+    if (t.active > 0)
+        --t.active;
+    --t.since_refresh;
+    // 0 stands for unknown capacity
+    if (t.active > 0 && (t.capacity == 0 || t.learned || t.active < t.capacity)) {
+        t.capacity = t.active;
+        t.learned = true;
+    }
+}
+
+bool table_occupancy::reserve(uint8_t table, uint32_t n)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& t = at(table);
+    if (t.free() < n)
+        return false;
+    t.reserved += n;
+    return true;
+}
+
+void table_occupancy::release(uint8_t table, uint32_t n)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& t = at(table);
+    t.reserved = n < t.reserved ? t.reserved - n : 0;
+}
+
+auto table_occupancy::get(uint8_t id) const -> table
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = tables_.find(id);
+    if (it != tables_.end())
+        return it->second;
+    table ret;
+    ret.id = id;
+    ret.capacity = default_capacity_;
+    return ret;
+}
+
+auto table_occupancy::tables() const -> std::vector<table>
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<table> ret;
+    for (auto& it : tables_)
+        ret.push_back(it.second);
+    return ret;
+}
+
+} // namespace runos
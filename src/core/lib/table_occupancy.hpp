@@ -0,0 +1,92 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Flow table occupancy of one switch as the controller sees it.
+ *
+ * Starts from active counts of table stats and follows flow mods as
+ * they're sent: ADD counts one entry (may overwrite one, so the estimate
+ * errs on the safe side), DELETE_STRICT frees one. Non-strict deletes
+ * free an unknown number, the table stays as it was but isn't exact
+ * until the next table stats. Changes sent after begin_refresh() are
+ * added on top of the reply, the switch handles them after the request.
+ *
+ * reserve() admits `n` entries if they fit into the capacity, known
+ * from configuration or learned from the first OFPFMFC_TABLE_FULL. The
+ * following ADDs to the table take reserved entries first, release()
+ * returns ones which weren't used. Tables of unknown capacity admit
+ * everything.
+ */
+class table_occupancy {
+public:
+    struct table {
+        uint8_t id {0};
+        uint32_t active {0};   // entries, estimated
+        uint32_t reserved {0}; // admitted, not sent yet
+        uint32_t capacity {0}; // 0 if unknown
+        bool exact {false};    // no guesses since table stats
+        bool learned {false};  // capacity is where the switch got full
+
+        uint32_t free() const;
+    };
+
+    // For tables without own capacity, 0 for unknown
+    void set_default_capacity(uint32_t capacity);
+    void set_capacity(uint8_t table, uint32_t capacity);
+
+    // Table stats request is being sent
+    void begin_refresh();
+    void on_table_stats(uint8_t table, uint32_t active);
+
+    void on_flow_mod(uint8_t table, uint8_t command);
+    // Same for OpenFlow 1.3 messages packed back to back,
+    // other messages are skipped
+    void on_sent(const uint8_t* data, size_t len);
+    // Switch has refused an ADD to the table
+    void on_table_full(uint8_t table);
+
+    bool reserve(uint8_t table, uint32_t n);
+    void release(uint8_t table, uint32_t n);
+
+    table get(uint8_t id) const;
+    std::vector<table> tables() const;
+
+private:
+    struct state : table {
+        int64_t since_refresh {0}; // changes after the last request
+        bool guessed {false};      // non-strict deletes after it
+    };
+
+    mutable std::mutex mutex_;
+    std::map<uint8_t, state> tables_;
+    uint32_t default_capacity_ {0};
+
+    state& at(uint8_t table);
+    void apply(state& t, uint8_t command);
+};
+
+} // namespace runos
@@ -0,0 +1,396 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "telemetry_export.hpp"
+#include "metrics.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace runos {
+
+static void put_varint(uint64_t value, std::string& out)
+{
+    while (value >= 0x80) {
+        out.push_back(char(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(char(value));
+}
+
+static void put_fixed64(uint64_t value, std::string& out)
+{
+    for (int i = 0; i < 8; ++i) {
+        out.push_back(char(value & 0xff));
+        value >>= 8;
+    }
+}
+
+// field number and wire type: 0 varint, 1 fixed64, 2 length-delimited
+static void put_tag(uint32_t field, uint32_t wire, std::string& out)
+{
+    put_varint(field << 3 | wire, out);
+}
+
+void TelemetrySample::encode(std::chrono::system_clock::time_point time,
+                             std::string& out) const
+{
+    put_tag(1, 0, out);
+    put_varint(kind, out);
+    if (dpid) {
+        put_tag(2, 0, out);
+        put_varint(dpid, out);
+    }
+    if (id) {
+        put_tag(3, 0, out);
+        put_varint(id, out);
+    }
+    if (sub_id) {
+        put_tag(4, 0, out);
+        put_varint(sub_id, out);
+    }
+    put_tag(5, 1, out);
+    put_fixed64(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    time.time_since_epoch()).count()), out);
+
+    if (ncounters) {
+        std::string packed;
+        for (size_t i = 0; i < ncounters; ++i)
+            put_varint(counters[i], packed);
+        put_tag(6, 2, out);
+        put_varint(packed.size(), out);
+        out += packed;
+    }
+    if (nrates) {
+        put_tag(7, 2, out);
+        put_varint(nrates * 8, out);
+        for (size_t i = 0; i < nrates; ++i) {
+            uint64_t bits;
+            std::memcpy(&bits, &rates[i], sizeof(bits));
+            put_fixed64(bits, out);
+        }
+    }
+    if (not name.empty()) {
+        put_tag(8, 2, out);
+        put_varint(name.size(), out);
+        out.append(name.data(), name.size());
+    }
+}
+
+static metrics::Counter& samples_counter = metrics::Registry::global().counter(
+    "runos_telemetry_samples_total",
+    "Statistics samples published to the telemetry export");
+
+static metrics::Counter& sent_counter = metrics::Registry::global().counter(
+    "runos_telemetry_sent_bytes_total",
+    "Bytes of telemetry batches sent to collectors");
+
+static metrics::Counter& dropped_counter(const char* reason)
+{
+    return metrics::Registry::global().counter(
+        "runos_telemetry_dropped_batches_total",
+        "Telemetry batches not delivered to a collector",
+        {{"reason", reason}});
+}
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+class Endpoint {
+public:
+    explicit Endpoint(TelemetryExporter::Destination dest)
+        : dest_(std::move(dest))
+        , tokens_(dest_.max_bytes_per_second)
+    {
+        auto& url = dest_.url;
+        auto scheme = url.find("://");
+        auto colon = url.rfind(':');
+        if (scheme == std::string::npos || colon <= scheme + 3) {
+            LOG(ERROR) << "[telemetry] Bad destination " << url
+                       << ", udp://host:port or tcp://host:port expected";
+            return;
+        }
+        tcp_ = url.compare(0, scheme, "tcp") == 0;
+        host_ = url.substr(scheme + 3, colon - scheme - 3);
+        port_ = url.substr(colon + 1);
+        // [v6 address]:port
+        if (host_.size() > 2 && host_.front() == '[' && host_.back() == ']')
+            host_ = host_.substr(1, host_.size() - 2);
+        valid_ = true;
+    }
+
+    ~Endpoint() { close(); }
+
+    void send(const std::string& batch)
+    {
+        if (not valid_)
+            return;
+
+        std::string framed;
+        if (tcp_) {
+            put_varint(batch.size(), framed);
+            framed += batch;
+        }
+        const std::string& data = tcp_ ? framed : batch;
+
+        if (not admit(data.size())) {
+            dropped_counter("rate").add();
+            return;
+        }
+        if (fd_ < 0 && not open()) {
+            dropped_counter("send").add();
+            return;
+        }
+
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::send(fd_, data.data() + done, data.size() - done,
+                               MSG_NOSIGNAL | (tcp_ ? 0 : MSG_DONTWAIT));
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                VLOG(3) << "[telemetry] Can't send to " << dest_.url
+                        << ": " << std::strerror(errno);
+                dropped_counter("send").add();
+                // a partial frame desynchronizes the stream
+                if (tcp_ || errno != EAGAIN)
+                    close();
+                return;
+            }
+            done += size_t(n);
+        }
+        sent_counter.add(data.size());
+    }
+
+private:
+    TelemetryExporter::Destination dest_;
+    bool valid_ {false};
+    bool tcp_ {false};
+    std::string host_;
+    std::string port_;
+    int fd_ {-1};
+    clock::time_point retry_at_;
+
+    double tokens_;
+    clock::time_point refilled_ {clock::now()};
+
+    // Token bucket holding up to one second of the byte rate
+    bool admit(size_t bytes)
+    {
+        double rate = dest_.max_bytes_per_second;
+        if (rate <= 0)
+            return true;
+        auto now = clock::now();
+        double elapsed = std::chrono::duration<double>(now - refilled_).count();
+        refilled_ = now;
+        tokens_ = std::min(rate, tokens_ + elapsed * rate);
+        if (tokens_ < double(bytes))
+            return false;
+        tokens_ -= double(bytes);
+        return true;
+    }
+
+    bool open()
+    {
+        auto now = clock::now();
+        if (now < retry_at_)
+            return false;
+        retry_at_ = now + std::chrono::seconds(1);
+
+        addrinfo hints {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = tcp_ ? SOCK_STREAM : SOCK_DGRAM;
+        addrinfo* found = nullptr;
+        int err = ::getaddrinfo(host_.c_str(), port_.c_str(), &hints, &found);
+        if (err != 0) {
+            LOG(WARNING) << "[telemetry] Can't resolve " << dest_.url
+                         << ": " << gai_strerror(err);
+            return false;
+        }
+
+        for (auto ai = found; ai && fd_ < 0; ai = ai->ai_next) {
+            int fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            // a stalled collector holds the sender up to a second a batch
+            timeval timeout {1, 0};
+            ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                fd_ = fd;
+            else
+                ::close(fd);
+        }
+        ::freeaddrinfo(found);
+
+        if (fd_ < 0) {
+            LOG(WARNING) << "[telemetry] Can't connect to " << dest_.url;
+            return false;
+        }
+        VLOG(1) << "[telemetry] Exporting to " << dest_.url;
+        return true;
+    }
+
+    void close()
+    {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+};
+
+} // anonymous
+
+struct TelemetryExporter::implementation {
+    Settings settings;
+    std::vector<std::unique_ptr<Endpoint>> endpoints; // sender thread only
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::string open; // Batch being filled
+    std::deque<std::string> closed;
+    bool stopping {false};
+    std::thread sender;
+
+    // Warning: requires mutex
+    void close_batch()
+    {
+        if (open.empty())
+            return;
+        closed.push_back(std::move(open));
+        open.clear();
+        while (closed.size() > settings.max_queued_batches) {
+            closed.pop_front();
+            dropped_counter("queue").add();
+        }
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            bool ready = wakeup.wait_for(lock, settings.flush, [this] {
+                return stopping || not closed.empty();
+            });
+            // a quiet open batch still leaves every `flush`
+            if (not ready || stopping)
+                close_batch();
+
+            auto batches = std::move(closed);
+            closed.clear();
+            bool last = stopping;
+            lock.unlock();
+
+            for (auto& batch : batches) {
+                for (auto& endpoint : endpoints)
+                    endpoint->send(batch);
+            }
+            if (last)
+                return;
+            lock.lock();
+        }
+    }
+};
+
+TelemetryExporter& TelemetryExporter::global()
+{
+    static TelemetryExporter instance;
+    return instance;
+}
+
+TelemetryExporter::TelemetryExporter()
+    : impl_(new implementation)
+{ }
+
+TelemetryExporter::~TelemetryExporter()
+{
+    stop();
+}
+
+void TelemetryExporter::publish(const TelemetrySample& sample)
+{
+    if (not enabled())
+        return;
+
+    thread_local std::string encoded;
+    encoded.clear();
+    sample.encode(std::chrono::system_clock::now(), encoded);
+
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    if (not impl_->sender.joinable())
+        return; // stopped meanwhile
+    samples_counter.add();
+
+    size_t framed = 1 + 10 + encoded.size(); // tag, length, sample
+    if (impl_->open.size() + framed > impl_->settings.max_batch_bytes) {
+        impl_->close_batch();
+        impl_->wakeup.notify_one();
+    }
+    put_tag(1, 2, impl_->open);
+    put_varint(encoded.size(), impl_->open);
+    impl_->open += encoded;
+}
+
+void TelemetryExporter::start(Settings settings)
+{
+    stop();
+    if (settings.destinations.empty())
+        return;
+
+    settings.flush = std::max(settings.flush, std::chrono::milliseconds(1));
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    impl_->settings = std::move(settings);
+    for (auto& dest : impl_->settings.destinations) {
+        impl_->endpoints.emplace_back(new Endpoint(dest));
+    }
+    impl_->stopping = false;
+    impl_->sender = std::thread([impl = impl_.get()] { impl->run(); });
+    enabled_ = true;
+}
+
+void TelemetryExporter::stop()
+{
+    enabled_ = false;
+    {
+        std::lock_guard<std::mutex> lock(impl_->mutex);
+        if (not impl_->sender.joinable())
+            return;
+        impl_->stopping = true;
+    }
+    impl_->wakeup.notify_one();
+    // the last open batch is sent before the thread ends
+    impl_->sender.join();
+
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    impl_->sender = std::thread();
+    impl_->endpoints.clear();
+    impl_->closed.clear();
+    impl_->open.clear();
+}
+
+} // namespace runos
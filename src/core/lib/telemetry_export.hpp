@@ -0,0 +1,115 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace runos {
+
+/**
+ * One statistics sample, pushed by the stores as it's appended.
+ *
+ * On the wire it's a protobuf Sample, and samples leave in batches:
+ *
+ *   message Sample {
+ *     uint32 kind = 1;     // 1 port, 2 queue, 3 flow bucket, 4 link
+ *     uint64 dpid = 2;     // 0 for buckets
+ *     uint32 id = 3;       // port number or bucket id
+ *     uint32 sub_id = 4;   // queue id
+ *     fixed64 time_ns = 5; // unix time the sample was received
+ *     repeated uint64 counters = 6 [packed = true];
+ *     repeated double rates = 7 [packed = true]; // per second
+ *     string name = 8;     // bucket name
+ *   }
+ *   message Batch { repeated Sample samples = 1; }
+ *
+ * Counters and rates are in the field order of the Measurement types
+ * (api/Statistics.hpp). Link samples count tx and rx utilization, tx
+ * and rx drops in percent of the port speed, with tx and rx bytes/s.
+ */
+struct TelemetrySample {
+    enum Kind : uint32_t { port = 1, queue = 2, bucket = 3, link = 4 };
+
+    Kind kind;
+    uint64_t dpid {0};
+    uint32_t id {0};
+    uint32_t sub_id {0};
+    const uint64_t* counters {nullptr};
+    size_t ncounters {0};
+    const double* rates {nullptr};
+    size_t nrates {0};
+    std::string_view name;
+
+    // Appends the encoded Sample
+    void encode(std::chrono::system_clock::time_point time,
+                std::string& out) const;
+};
+
+/**
+ * Streams samples to collectors instead of them polling the REST API.
+ *
+ * publish() appends the encoded sample to the open batch, which is
+ * closed when it's full or after `flush`. A sender thread delivers
+ * closed batches to every destination: one datagram per batch over UDP,
+ * varint length-delimited batches over TCP (protobuf writeDelimitedTo).
+ * A destination over its byte rate misses the batch, and when the
+ * sender falls behind the oldest batches are dropped; both are counted
+ * in runos_telemetry_dropped_batches_total.
+ */
+class TelemetryExporter {
+public:
+    struct Destination {
+        std::string url; // udp://host:port or tcp://host:port
+        double max_bytes_per_second {0}; // 0 is unlimited, burst is 1 s
+    };
+
+    struct Settings {
+        std::vector<Destination> destinations;
+        std::chrono::milliseconds flush {200};
+        size_t max_batch_bytes {1400}; // a datagram on common MTUs
+        size_t max_queued_batches {256};
+    };
+
+    static TelemetryExporter& global();
+
+    TelemetryExporter();
+    ~TelemetryExporter();
+
+    // Hooks check it before they build a sample
+    bool enabled() const noexcept
+    { return enabled_.load(std::memory_order_relaxed); }
+
+    void publish(const TelemetrySample& sample);
+
+    // Stops a running export first; nothing starts without destinations
+    void start(Settings settings);
+    void stop();
+
+private:
+    struct implementation;
+    std::unique_ptr<implementation> impl_;
+    std::atomic<bool> enabled_ {false};
+};
+
+} // namespace runos
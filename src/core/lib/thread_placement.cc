@@ -0,0 +1,327 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "thread_placement.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace runos {
+
+namespace {
+
+#ifdef __linux__
+std::vector<int> to_cpus(const cpu_set_t& set)
+{
+    std::vector<int> ret;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set))
+            ret.push_back(cpu);
+    }
+    return ret;
+}
+
+cpu_set_t to_set(const std::vector<int>& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    return set;
+}
+
+std::vector<int> affinity_of(pthread_t thread)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (pthread_getaffinity_np(thread, sizeof(set), &set) != 0)
+        return {};
+    return to_cpus(set);
+}
+
+int set_affinity(pthread_t thread, const std::vector<int>& cpus)
+{
+    auto set = to_set(cpus);
+    return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+// Field 39 of /proc/<pid>/task/<tid>/stat
+int last_cpu(long tid)
+{
+    std::ifstream in("/proc/self/task/" + std::to_string(tid) + "/stat");
+    std::string stat;
+    std::getline(in, stat);
+    // Skip the command, which may contain spaces
+    auto pos = stat.rfind(')');
+    if (pos == std::string::npos)
+        return -1;
+    std::istringstream fields(stat.substr(pos + 1));
+    std::string field;
+    for (int i = 3; i <= 39; ++i) {
+        if (not (fields >> field))
+            return -1;
+    }
+    return std::atoi(field.c_str());
+}
+#endif
+
+std::vector<int> nodes_of(const std::vector<int>& cpus)
+{
+    std::vector<int> ret;
+    for (int cpu : cpus) {
+        int node = ThreadPlacement::numa_node(cpu);
+        if (node >= 0 && std::find(ret.begin(), ret.end(), node) == ret.end())
+            ret.push_back(node);
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+} // namespace
+
+ThreadPlacement& ThreadPlacement::global()
+{
+    static ThreadPlacement instance;
+    return instance;
+}
+
+ThreadPlacement::ThreadPlacement()
+{
+#ifdef __linux__
+    initial_ = affinity_of(pthread_self());
+#endif
+}
+
+void ThreadPlacement::configure(const std::string& role,
+                                const std::string& spec, bool spread)
+{
+    auto cpus = parse_cpus(spec);
+    if (cpus.empty() && not spec.empty()) {
+        LOG(WARNING) << "[ThreadPlacement] No cpus in '" << spec
+                     << "' for " << role << " threads, they float";
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Cpus we can't run on are dropped, e.g. outside of a cgroup cpuset
+    if (not initial_.empty()) {
+        cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&](int cpu) {
+            return not std::binary_search(initial_.begin(), initial_.end(),
+                                          cpu);
+        }), cpus.end());
+    }
+    roles_[role] = Role{ spec, std::move(cpus), spread };
+}
+
+std::vector<int> ThreadPlacement::cpus(const std::string& role) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = roles_.find(role);
+    if (it == roles_.end() || it->second.cpus.empty())
+        return initial_;
+    return it->second.cpus;
+}
+
+void ThreadPlacement::place(const std::string& role, const std::string& name)
+{
+    Entry entry;
+    entry.info.name = name;
+    entry.info.role = role;
+    entry.info.tid = -1;
+    entry.info.cpu = -1;
+
+    std::vector<int> target;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entry.info.index = std::count_if(threads_.begin(), threads_.end(),
+            [&](const Entry& e) { return e.info.role == role; });
+
+        auto it = roles_.find(role);
+        if (it != roles_.end() && not it->second.cpus.empty()) {
+            const auto& role_cpus = it->second.cpus;
+            if (it->second.spread) {
+                entry.info.requested = {
+                    role_cpus[entry.info.index % role_cpus.size()]
+                };
+            } else {
+                entry.info.requested = role_cpus;
+            }
+            target = entry.info.requested;
+        } else {
+            target = initial_;
+        }
+    }
+
+#ifdef __linux__
+    entry.handle = pthread_self();
+    entry.info.tid = syscall(SYS_gettid);
+    if (not target.empty()) {
+        int err = set_affinity(entry.handle, target);
+        if (err != 0) {
+            entry.info.error = std::strerror(err);
+            LOG(WARNING) << "[ThreadPlacement] Can't pin " << name
+                         << " to its " << role << " cpus: "
+                         << entry.info.error;
+        }
+    }
+#else
+    entry.handle = {};
+#endif
+
+    if (not entry.info.requested.empty()) {
+        VLOG(1) << "[ThreadPlacement] " << name << " (" << role
+                << " thread " << entry.info.index << ") pinned to "
+                << entry.info.requested.size() << " cpu(s) from cpu "
+                << entry.info.requested.front();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    threads_.push_back(std::move(entry));
+}
+
+void ThreadPlacement::place_once(const std::string& role,
+                                 const std::string& name)
+{
+    thread_local bool placed = false;
+    if (placed)
+        return;
+    placed = true;
+    place(role, name);
+}
+
+auto ThreadPlacement::threads() const -> std::vector<Thread>
+{
+    std::vector<Entry> entries;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries = threads_;
+    }
+
+    std::vector<Thread> ret;
+    ret.reserve(entries.size());
+    for (auto& e : entries) {
+#ifdef __linux__
+        // Placed threads live as long as the controller
+        e.info.affinity = affinity_of(e.handle);
+        e.info.cpu = last_cpu(e.info.tid);
+#endif
+        e.info.nodes = nodes_of(e.info.affinity);
+        ret.push_back(std::move(e.info));
+    }
+    return ret;
+}
+
+auto ThreadPlacement::roles() const -> std::map<std::string, Role>
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return roles_;
+}
+
+ThreadPlacement::Inherit::Inherit(const std::string& role)
+{
+#ifdef __linux__
+    auto cpus = ThreadPlacement::global().cpus(role);
+    if (cpus.empty())
+        return;
+    saved_ = affinity_of(pthread_self());
+    if (set_affinity(pthread_self(), cpus) != 0)
+        saved_.clear();
+#else
+    (void) role;
+#endif
+}
+
+ThreadPlacement::Inherit::~Inherit()
+{
+#ifdef __linux__
+    if (not saved_.empty())
+        set_affinity(pthread_self(), saved_);
+#endif
+}
+
+std::vector<int> ThreadPlacement::parse_cpus(const std::string& spec)
+{
+    static const std::string node_prefix = "node:";
+    if (spec.compare(0, node_prefix.size(), node_prefix) == 0) {
+        std::ifstream in("/sys/devices/system/node/node" +
+                         spec.substr(node_prefix.size()) + "/cpulist");
+        std::string list;
+        std::getline(in, list);
+        return parse_cpus(list);
+    }
+
+    std::vector<int> ret;
+    std::istringstream in(spec);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+        char* end = nullptr;
+        long first = std::strtol(range.c_str(), &end, 10);
+        if (end == range.c_str() || first < 0)
+            continue;
+        long last = first;
+        if (*end == '-') {
+            const char* from = end + 1;
+            last = std::strtol(from, &end, 10);
+            if (end == from || last < first)
+                continue;
+        }
+        for (long cpu = first; cpu <= last; ++cpu)
+            ret.push_back(int(cpu));
+    }
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+
+int ThreadPlacement::numa_node(int cpu)
+{
+#ifdef __linux__
+    auto path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr)
+        return -1;
+    int node = -1;
+    while (auto entry = readdir(dir)) {
+        if (std::strncmp(entry->d_name, "node", 4) == 0 &&
+            entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = std::atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+#else
+    (void) cpu;
+    return -1;
+#endif
+}
+
+} // namespace runos
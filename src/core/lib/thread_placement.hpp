@@ -0,0 +1,112 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace runos {
+
+/**
+ * CPU affinity of controller threads by role.
+ *
+ * Every role ("io", "main", "apps", "timers", "rest", "heartbeat") maps
+ * to a CPU list in the sysfs format ("0-3,8") or to a NUMA node
+ * ("node:1"). A thread calls place() once it runs and is pinned to its
+ * role's CPUs: to one CPU each, round robin, when the role is spread,
+ * or to the whole set otherwise. Threads of roles that aren't configured
+ * get the affinity the process started with, so pinning one thread never
+ * leaks into the threads it creates.
+ *
+ * Memory is not bound explicitly: the kernel allocates pages on the node
+ * of the CPU that touches them first, so buffers allocated by a pinned
+ * thread stay on its node.
+ */
+class ThreadPlacement {
+public:
+    struct Thread {
+        std::string name;
+        std::string role;
+        size_t index; // among threads of the role
+        long tid;
+        std::vector<int> requested; // empty if the role floats
+        std::vector<int> affinity; // as the kernel reports it now
+        std::vector<int> nodes; // NUMA nodes of `affinity`
+        int cpu; // the thread last ran on, -1 if unknown
+        std::string error;
+    };
+
+    struct Role {
+        std::string spec;
+        std::vector<int> cpus;
+        bool spread;
+    };
+
+    static ThreadPlacement& global();
+
+    // Must run before the threads of the role are started
+    void configure(const std::string& role, const std::string& spec,
+                   bool spread);
+    // CPUs a thread placed now under `role` may run on
+    std::vector<int> cpus(const std::string& role) const;
+
+    // Pins the calling thread and records it under `name`
+    void place(const std::string& role, const std::string& name);
+    // Same, at most once per thread. For threads owned by libraries,
+    // called from their first callback.
+    void place_once(const std::string& role, const std::string& name);
+
+    std::vector<Thread> threads() const;
+    std::map<std::string, Role> roles() const;
+
+    // Threads created while it is alive inherit the role's CPUs. For
+    // libraries which start threads we can't place ourselves.
+    class Inherit {
+    public:
+        explicit Inherit(const std::string& role);
+        ~Inherit();
+
+        Inherit(const Inherit&) = delete;
+        Inherit& operator=(const Inherit&) = delete;
+    private:
+        std::vector<int> saved_;
+    };
+
+    // Parses "0-3,8", "node:1" is the cpulist of the NUMA node
+    static std::vector<int> parse_cpus(const std::string& spec);
+    // -1 if unknown
+    static int numa_node(int cpu);
+
+private:
+    ThreadPlacement();
+
+    struct Entry {
+        Thread info;
+        std::thread::native_handle_type handle;
+    };
+
+    mutable std::mutex mutex_;
+    std::vector<int> initial_; // affinity the process started with
+    std::map<std::string, Role> roles_;
+    std::vector<Entry> threads_;
+};
+
+} // namespace runos
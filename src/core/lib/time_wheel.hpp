@@ -0,0 +1,118 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <runos/core/assert.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Spreads keys evenly over a fixed number of slots visited in a cycle.
+ *
+ * Keys are dealt to slots in round-robin order; advance() returns the
+ * keys of the current slot and moves to the next one, so calling it once
+ * per tick visits every key once per `slots()` ticks.
+ */
+template<class Key, class Hash = std::hash<Key>>
+class time_wheel {
+public:
+    explicit time_wheel(size_t slots = 1)
+        : m_slots(std::max<size_t>(slots, 1))
+    { }
+
+    size_t slots() const noexcept
+    { return m_slots.size(); }
+
+    size_t size() const noexcept
+    { return m_index.size(); }
+
+    // Slot advance() returns next, 0 starts a new cycle
+    size_t cursor() const noexcept
+    { return m_cursor; }
+
+    bool contains(const Key& key) const
+    { return m_index.count(key) > 0; }
+
+    void insert(const Key& key)
+    {
+        if (contains(key))
+            return;
+
+        m_slots[m_next].push_back(key);
+        m_index.emplace(key, m_next);
+        m_next = (m_next + 1) % m_slots.size();
+    }
+
+    void erase(const Key& key)
+    {
+        auto it = m_index.find(key);
+        if (it == m_index.end())
+            return;
+
+        auto& slot = m_slots[it->second];
+        auto pos = std::find(slot.begin(), slot.end(), key);
+        ASSERT(pos != slot.end());
+        *pos = std::move(slot.back());
+        slot.pop_back();
+        m_index.erase(it);
+    }
+
+    // Deals the keys over `slots` slots again, a new cycle starts
+    void resize(size_t slots)
+    {
+        std::vector<Key> keys;
+        keys.reserve(size());
+        for (auto& slot : m_slots) {
+            keys.insert(keys.end(), slot.begin(), slot.end());
+        }
+        m_slots.assign(std::max<size_t>(slots, 1), {});
+        m_index.clear();
+        m_cursor = 0;
+        m_next = 0;
+        for (const auto& key : keys) {
+            insert(key);
+        }
+    }
+
+    const std::vector<Key>& advance()
+    {
+        const auto& ret = m_slots[m_cursor];
+        m_cursor = (m_cursor + 1) % m_slots.size();
+        return ret;
+    }
+
+    template<class F>
+    void for_each(F&& f) const
+    {
+        for (const auto& key : m_index) {
+            f(key.first);
+        }
+    }
+
+private:
+    std::vector<std::vector<Key>> m_slots;
+    std::unordered_map<Key, size_t, Hash> m_index;
+    size_t m_cursor = 0;
+    size_t m_next = 0;
+};
+
+} // namespace runos
@@ -0,0 +1,358 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "timer_service.hpp"
+#include "flight_recorder.hpp"
+#include "thread_placement.hpp"
+#include "timer_wheel.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+namespace runos {
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+
+struct TimerService::timer {
+    timer(std::string name, milliseconds interval,
+          std::function<void()> tick, priority prio)
+        : name(std::move(name))
+        , flight_site(flight::intern(this->name.c_str()))
+        , tick(std::move(tick))
+        , prio(prio)
+        , interval(std::max(interval, milliseconds(1)))
+    { }
+
+    const std::string name;
+    const uint16_t flight_site;
+    const std::function<void()> tick;
+    const priority prio;
+
+    std::mutex mutex; // guards everything below
+    milliseconds interval;
+    std::condition_variable idle;
+    std::deque<std::function<void()>> pending;
+    bool queued = false; // pending closures are in the ready queue
+    bool busy = false;   // a closure is running
+    std::thread::id runner;
+
+    bool active = false;
+    uint64_t generation = 0; // ticks of older generations are ignored
+    clock::time_point due;
+    clock::time_point started; // of the running tick
+
+    uint64_t runs = 0;
+    uint64_t skipped = 0;
+    microseconds last_lateness {0};
+    microseconds max_lateness {0};
+    microseconds last_duration {0};
+};
+
+struct TimerService::implementation {
+    struct fire {
+        std::weak_ptr<timer> t;
+        uint64_t generation;
+    };
+
+    struct ready_entry {
+        priority prio;
+        uint64_t seq;
+        handle t;
+
+        // priority_queue gives the largest: higher priority, then older
+        bool operator<(const ready_entry& other) const
+        {
+            if (prio != other.prio)
+                return prio < other.prio;
+            return seq > other.seq;
+        }
+    };
+
+    implementation(size_t nworkers, milliseconds tick)
+        : wheel(tick, [this](fire& f) { on_fire(f); })
+    {
+        for (size_t i = 0; i < nworkers; ++i) {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+
+    ~implementation()
+    {
+        {
+            std::lock_guard<std::mutex> lock(ready_mutex);
+            stopping = true;
+        }
+        ready_cv.notify_all();
+        for (auto& w : workers)
+            w.join();
+    }
+
+    static void invoke(const timer& t, const std::function<void()>& f)
+    {
+        try {
+            f();
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "[TimerService] " << t.name << ": " << e.what();
+        } catch (...) {
+            LOG(ERROR) << "[TimerService] " << t.name << ": unknown exception";
+        }
+    }
+
+    // t->mutex must be held
+    void arm(const handle& t, clock::time_point now)
+    {
+        auto delay = duration_cast<milliseconds>(t->due - now);
+        wheel.schedule(delay, fire{ t, t->generation });
+    }
+
+    void on_fire(fire& f)
+    {
+        auto t = f.t.lock();
+        if (not t)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(t->mutex);
+            if (not t->active || f.generation != t->generation)
+                return;
+        }
+        submit(t, [this, t, generation = f.generation]() { run_tick(t, generation); });
+    }
+
+    void submit(const handle& t, std::function<void()> f)
+    {
+        std::unique_lock<std::mutex> lock(t->mutex);
+        t->pending.push_back(std::move(f));
+        if (t->queued)
+            return;
+        t->queued = true;
+        lock.unlock();
+
+        {
+            std::lock_guard<std::mutex> ready_lock(ready_mutex);
+            ready.push(ready_entry{ t->prio, next_seq++, t });
+        }
+        ready_cv.notify_one();
+    }
+
+    void work()
+    {
+        ThreadPlacement::global().place("timers", "timer-service");
+        for (;;) {
+            handle t;
+            {
+                std::unique_lock<std::mutex> lock(ready_mutex);
+                ready_cv.wait(lock, [this]() { return stopping || not ready.empty(); });
+                if (stopping)
+                    return;
+                t = ready.top().t;
+                ready.pop();
+            }
+            drain(t);
+        }
+    }
+
+    void drain(const handle& t)
+    {
+        std::unique_lock<std::mutex> lock(t->mutex);
+        while (not t->pending.empty()) {
+            auto f = std::move(t->pending.front());
+            t->pending.pop_front();
+            t->busy = true;
+            t->runner = std::this_thread::get_id();
+            lock.unlock();
+
+            invoke(*t, f);
+
+            lock.lock();
+            t->busy = false;
+            t->runner = std::thread::id();
+            t->idle.notify_all();
+        }
+        t->queued = false;
+    }
+
+    void run_tick(const handle& t, uint64_t generation)
+    {
+        {
+            std::lock_guard<std::mutex> lock(t->mutex);
+            if (not t->active || generation != t->generation)
+                return;
+            auto now = clock::now();
+            t->started = now;
+            t->last_lateness = duration_cast<microseconds>(now - t->due);
+            t->max_lateness = std::max(t->max_lateness, t->last_lateness);
+        }
+
+        invoke(*t, t->tick);
+
+        std::lock_guard<std::mutex> lock(t->mutex);
+        auto now = clock::now();
+        t->last_duration = duration_cast<microseconds>(now - t->started);
+        t->started = clock::time_point();
+        ++t->runs;
+        if (not t->active || generation != t->generation)
+            return;
+
+        // Fixed rate; drop the ticks we're already late for
+        auto behind = (now - t->due) / t->interval;
+        t->skipped += behind;
+        if (behind > 0) {
+            flight::record(flight::kind::timer_overrun, t->flight_site,
+                           uint64_t(behind), uint32_t(duration_cast<
+                               microseconds>(now - t->due).count()));
+        }
+        t->due += t->interval * (behind + 1);
+        arm(t, now);
+    }
+
+    mutable std::mutex registry_mutex;
+    std::vector<std::weak_ptr<timer>> registry;
+
+    std::mutex ready_mutex;
+    std::condition_variable ready_cv;
+    std::priority_queue<ready_entry> ready;
+    uint64_t next_seq = 0;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    // Last: stops firing before the rest goes away
+    timer_wheel<fire> wheel;
+};
+
+TimerService& TimerService::global()
+{
+    // Two workers are plenty for pollers that mostly send requests
+    static TimerService instance(2, milliseconds(5));
+    return instance;
+}
+
+TimerService::TimerService(size_t workers, milliseconds tick)
+    : impl(new implementation(workers, tick))
+{ }
+
+TimerService::~TimerService() = default;
+
+auto TimerService::add(std::string name, milliseconds interval,
+                       std::function<void()> tick, priority prio)
+    -> handle
+{
+    auto t = std::make_shared<timer>(std::move(name), interval,
+                                     std::move(tick), prio);
+
+    std::lock_guard<std::mutex> lock(impl->registry_mutex);
+    auto& reg = impl->registry;
+    reg.erase(std::remove_if(reg.begin(), reg.end(),
+                             [](auto& w) { return w.expired(); }),
+              reg.end());
+    reg.push_back(t);
+    return t;
+}
+
+void TimerService::start(const handle& t)
+{
+    std::lock_guard<std::mutex> lock(t->mutex);
+    if (t->active)
+        return;
+    t->active = true;
+    ++t->generation;
+    auto now = clock::now();
+    t->due = now + t->interval;
+    impl->arm(t, now);
+}
+
+void TimerService::stop(const handle& t)
+{
+    std::lock_guard<std::mutex> lock(t->mutex);
+    t->active = false;
+    ++t->generation;
+}
+
+void TimerService::set_interval(const handle& t, milliseconds interval)
+{
+    interval = std::max(interval, milliseconds(1));
+    std::lock_guard<std::mutex> lock(t->mutex);
+    if (interval == t->interval)
+        return;
+    t->interval = interval;
+    if (not t->active)
+        return;
+
+    // Drop the tick armed with the old period
+    ++t->generation;
+    auto now = clock::now();
+    t->due = now + t->interval;
+    impl->arm(t, now);
+}
+
+void TimerService::post(const handle& t, std::function<void()> f)
+{
+    impl->submit(t, std::move(f));
+}
+
+void TimerService::remove(const handle& t)
+{
+    std::unique_lock<std::mutex> lock(t->mutex);
+    t->active = false;
+    ++t->generation;
+    t->pending.clear();
+    if (t->runner != std::this_thread::get_id()) {
+        t->idle.wait(lock, [&]() { return not t->busy; });
+    }
+}
+
+auto TimerService::timers() const -> std::vector<timer_info>
+{
+    std::vector<handle> alive;
+    {
+        std::lock_guard<std::mutex> lock(impl->registry_mutex);
+        for (auto& w : impl->registry) {
+            if (auto t = w.lock())
+                alive.push_back(std::move(t));
+        }
+    }
+
+    std::vector<timer_info> ret;
+    auto now = clock::now();
+    for (auto& t : alive) {
+        std::lock_guard<std::mutex> lock(t->mutex);
+        bool running = t->started != clock::time_point();
+        bool overdue = t->active &&
+            (now - t->due > t->interval ||
+             (running && now - t->started > t->interval));
+        ret.push_back(timer_info{
+            t->name, t->interval, t->prio, t->active, overdue,
+            t->runs, t->skipped,
+            t->last_lateness, t->max_lateness, t->last_duration
+        });
+    }
+    return ret;
+}
+
+size_t TimerService::workers() const
+{
+    return impl->workers.size();
+}
+
+} // namespace runos
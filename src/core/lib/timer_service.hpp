@@ -0,0 +1,93 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Periodic tasks of all applications on one timing wheel and a small
+ * fixed pool of workers, instead of a thread per poller.
+ *
+ * Wakeups are coalesced to the wheel tick: timers due within the same
+ * tick are handed to the workers together, higher priority first.
+ * Ticks of one timer and closures post()ed to it never run
+ * concurrently, as they did on the poller's own thread. Timers are
+ * fixed-rate: lateness of every tick is measured, and a timer which
+ * fell more than a period behind skips the missed ticks.
+ */
+class TimerService {
+public:
+    using clock = std::chrono::steady_clock;
+
+    enum class priority { low, normal, high };
+
+    class timer;
+    using handle = std::shared_ptr<timer>;
+
+    struct timer_info {
+        std::string name;
+        std::chrono::milliseconds interval;
+        priority prio;
+        bool active;
+        bool overdue;     // waits or runs past its period
+        uint64_t runs;
+        uint64_t skipped; // ticks dropped after falling behind
+        std::chrono::microseconds last_lateness;
+        std::chrono::microseconds max_lateness;
+        std::chrono::microseconds last_duration;
+    };
+
+    static TimerService& global();
+
+    // Inactive until start(); forgotten when the handle is released
+    handle add(std::string name, std::chrono::milliseconds interval,
+               std::function<void()> tick,
+               priority prio = priority::normal);
+
+    // First tick one interval later, no-op if active
+    void start(const handle& t);
+    // No more ticks, the running one finishes in background
+    void stop(const handle& t);
+    // Next tick one new interval from now if active
+    void set_interval(const handle& t, std::chrono::milliseconds interval);
+    // Runs `f` on a worker, serialized with ticks of `t`
+    void post(const handle& t, std::function<void()> f);
+    // Stops `t` and drops its posted closures. Unless called from the
+    // timer itself, waits for the running one: owner may go away after.
+    void remove(const handle& t);
+
+    std::vector<timer_info> timers() const;
+    size_t workers() const;
+
+    ~TimerService();
+
+private:
+    struct implementation;
+    std::unique_ptr<implementation> impl;
+
+    TimerService(size_t workers, std::chrono::milliseconds tick);
+};
+
+} // namespace runos
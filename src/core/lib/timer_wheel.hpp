@@ -0,0 +1,170 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Hierarchical timing wheel (Varghese & Lauck) with its own ticking
+ * thread.
+ *
+ * Four levels of 64 slots each cover 2^24 ticks. schedule() puts the
+ * item into the slot of the level matching its delay. Each level is
+ * moved one level down when the lower level wraps, so every item is
+ * touched at most once per level: O(1) per timer. Longer delays are
+ * clamped to the range of the wheel.
+ *
+ * Timers can't be cancelled. `on_expire` is called for every item on
+ * the wheel thread, outside of the wheel lock, and must check by itself
+ * whether the item is still relevant.
+ */
+template<class T>
+class timer_wheel {
+public:
+    using clock = std::chrono::steady_clock;
+    using handler = std::function<void(T&)>;
+
+    timer_wheel(std::chrono::milliseconds tick, handler on_expire)
+        : tick_(std::max(tick, std::chrono::milliseconds(1)))
+        , on_expire_(std::move(on_expire))
+        , start_(clock::now())
+        , thread_([this]() { run(); })
+    { }
+
+    // Pending items are dropped
+    ~timer_wheel()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    timer_wheel(timer_wheel const&) = delete;
+    timer_wheel& operator=(timer_wheel const&) = delete;
+
+    void schedule(std::chrono::milliseconds timeout, T item)
+    {
+        // +1: the current tick is already partially gone
+        uint64_t ticks = uint64_t(std::max<int64_t>(timeout / tick_, 0)) + 1;
+        std::lock_guard<std::mutex> lock(mutex_);
+        place(entry{ now_ + std::min(ticks, max_ticks), std::move(item) });
+        ++size_;
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return size_;
+    }
+
+private:
+    static constexpr unsigned slot_bits = 6;
+    static constexpr uint64_t slot_count = uint64_t(1) << slot_bits;
+    static constexpr unsigned levels = 4;
+    static constexpr uint64_t max_ticks =
+        (uint64_t(1) << (slot_bits * levels)) - 1;
+
+    struct entry {
+        uint64_t expires; // tick
+        T item;
+    };
+    using slot = std::vector<entry>;
+
+    const std::chrono::milliseconds tick_;
+    const handler on_expire_;
+    const clock::time_point start_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ {false};
+    uint64_t now_ {0};
+    size_t size_ {0};
+    std::array<std::array<slot, slot_count>, levels> wheel_;
+
+    std::thread thread_;
+
+    // Warning: requires mutex_ to be held
+    void place(entry&& e)
+    {
+        uint64_t delta = e.expires > now_ ? e.expires - now_ : 0;
+        unsigned level = 0;
+        while (level + 1 < levels &&
+               delta >= (uint64_t(1) << (slot_bits * (level + 1))))
+            ++level;
+        auto index = (e.expires >> (slot_bits * level)) & (slot_count - 1);
+        wheel_[level][index].push_back(std::move(e));
+    }
+
+    // Warning: requires mutex_ to be held
+    void advance(std::vector<entry>& due)
+    {
+        ++now_;
+
+        // Higher levels are spread over the lower ones when those wrap
+        for (unsigned level = 1; level < levels; ++level) {
+            if ((now_ & ((uint64_t(1) << (slot_bits * level)) - 1)) != 0)
+                break;
+            auto index = (now_ >> (slot_bits * level)) & (slot_count - 1);
+            slot cascade;
+            cascade.swap(wheel_[level][index]);
+            for (auto& e : cascade)
+                place(std::move(e));
+        }
+
+        auto& current = wheel_[0][now_ & (slot_count - 1)];
+        for (auto& e : current)
+            due.push_back(std::move(e));
+        size_ -= current.size();
+        current.clear();
+    }
+
+    void run()
+    {
+        std::vector<entry> due;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (not stop_) {
+            cv_.wait_until(lock, start_ + tick_ * (now_ + 1));
+            uint64_t target = (clock::now() - start_) / tick_;
+            while (now_ < target)
+                advance(due);
+            if (due.empty())
+                continue;
+
+            lock.unlock();
+            for (auto& e : due)
+                on_expire_(e.item);
+            due.clear();
+            lock.lock();
+        }
+    }
+};
+
+} // namespace runos
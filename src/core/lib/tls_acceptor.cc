@@ -0,0 +1,223 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "tls_acceptor.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace runos {
+
+namespace {
+
+constexpr size_t ticket_keys_size = 80;
+
+std::string ssl_error()
+{
+    char buf[256] = {0};
+    ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+    ERR_clear_error();
+    return buf;
+}
+
+void set_timeouts(int fd, int timeout_ms)
+{
+    timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+} // namespace
+
+tls_session::tls_session(SSL* ssl)
+    : ssl_(ssl)
+{
+    // Directions the kernel doesn't encrypt go through memory BIOs,
+    // the socket BIO left by the handshake is freed with the last one
+    if (not BIO_get_ktls_recv(SSL_get_rbio(ssl_))) {
+        rbio_ = BIO_new(BIO_s_mem());
+        SSL_set0_rbio(ssl_, rbio_);
+    }
+    if (not BIO_get_ktls_send(SSL_get_wbio(ssl_))) {
+        wbio_ = BIO_new(BIO_s_mem());
+        SSL_set0_wbio(ssl_, wbio_);
+    }
+}
+
+tls_session::~tls_session()
+{
+    SSL_free(ssl_);
+}
+
+bool tls_session::resumed() const
+{
+    return SSL_session_reused(ssl_);
+}
+
+bool tls_session::decrypt(const uint8_t* data, size_t len,
+                          std::vector<uint8_t>& plain,
+                          std::vector<uint8_t>& out)
+{
+    if (BIO_write(rbio_, data, int(len)) != int(len))
+        return false;
+
+    uint8_t buf[16384];
+    for (;;) {
+        size_t n = 0;
+        if (SSL_read_ex(ssl_, buf, sizeof(buf), &n) == 1) {
+            plain.insert(plain.end(), buf, buf + n);
+            continue;
+        }
+        int err = SSL_get_error(ssl_, 0);
+        drain(out);
+        if (err == SSL_ERROR_WANT_READ)
+            return true;
+        ERR_clear_error();
+        return false;
+    }
+}
+
+bool tls_session::encrypt(const uint8_t* data, size_t len,
+                          std::vector<uint8_t>& out)
+{
+    // Memory BIO takes everything, no partial writes
+    size_t written = 0;
+    if (len && SSL_write_ex(ssl_, data, len, &written) != 1) {
+        ERR_clear_error();
+        return false;
+    }
+    drain(out);
+    return true;
+}
+
+void tls_session::drain(std::vector<uint8_t>& out)
+{
+    if (not wbio_)
+        return;
+    char* data = nullptr;
+    long len = BIO_get_mem_data(wbio_, &data);
+    if (len > 0) {
+        out.insert(out.end(), data, data + len);
+        (void) BIO_reset(wbio_);
+    }
+}
+
+tls_acceptor::tls_acceptor(settings s)
+    : settings_(std::move(s))
+    , ctx_(SSL_CTX_new(TLS_server_method()))
+{
+    if (not ctx_)
+        throw std::runtime_error("tls_acceptor: " + ssl_error());
+
+    auto fail = [this](const std::string& what) {
+        auto error = ssl_error();
+        SSL_CTX_free(ctx_);
+        throw std::runtime_error("tls_acceptor: " + what + ": " + error);
+    };
+
+    SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(ctx_, settings_.cert.c_str()) != 1)
+        fail("can't load certificate " + settings_.cert);
+    if (SSL_CTX_use_PrivateKey_file(ctx_, settings_.key.c_str(),
+                                    SSL_FILETYPE_PEM) != 1)
+        fail("can't load private key " + settings_.key);
+    if (SSL_CTX_check_private_key(ctx_) != 1)
+        fail("private key doesn't match the certificate");
+
+    if (not settings_.ca.empty()) {
+        if (SSL_CTX_load_verify_locations(ctx_, settings_.ca.c_str(),
+                                          nullptr) != 1)
+            fail("can't load CA " + settings_.ca);
+        SSL_CTX_set_verify(ctx_, SSL_VERIFY_PEER |
+                                 SSL_VERIFY_FAIL_IF_NO_PEER_CERT, nullptr);
+    }
+
+    // Resumption of verified sessions needs an id context
+    static const unsigned char context[] = "runos-of-server";
+    SSL_CTX_set_session_id_context(ctx_, context, sizeof(context) - 1);
+    SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx_, settings_.session_cache_size);
+
+    if (not settings_.ticket_key_file.empty()) {
+        std::ifstream file(settings_.ticket_key_file, std::ios::binary);
+        std::vector<char> keys{std::istreambuf_iterator<char>(file),
+                               std::istreambuf_iterator<char>()};
+        if (keys.size() < ticket_keys_size) {
+            SSL_CTX_free(ctx_);
+            throw std::runtime_error("tls_acceptor: " +
+                settings_.ticket_key_file + " must hold " +
+                std::to_string(ticket_keys_size) + " bytes");
+        }
+        if (SSL_CTX_set_tlsext_ticket_keys(ctx_, keys.data(),
+                                           ticket_keys_size) != 1)
+            fail("can't set ticket keys");
+    }
+
+    if (settings_.ktls)
+        SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS);
+
+    pool_.reset(new WorkerPool(std::max(1, settings_.handshake_threads)));
+}
+
+tls_acceptor::~tls_acceptor()
+{
+    pool_.reset();
+    SSL_CTX_free(ctx_);
+}
+
+void tls_acceptor::accept(int fd, handler done)
+{
+    pool_->submit(next_++, [this, fd, done = std::move(done)]() {
+        handshake(fd, done);
+    });
+}
+
+void tls_acceptor::handshake(int fd, handler const& done)
+{
+    set_timeouts(fd, settings_.handshake_timeout_ms);
+
+    SSL* ssl = SSL_new(ctx_);
+    if (not ssl || SSL_set_fd(ssl, fd) != 1 || SSL_accept(ssl) != 1) {
+        LOG(WARNING) << "[tls_acceptor] Handshake failed: " << ssl_error();
+        SSL_free(ssl);
+        ::close(fd);
+        return;
+    }
+    set_timeouts(fd, 0);
+
+    std::unique_ptr<tls_session> session {new tls_session(ssl)};
+    VLOG(2) << "[tls_acceptor] " << SSL_get_version(ssl)
+            << (session->resumed() ? " resumed" : " full handshake")
+            << ", kTLS rx=" << session->ktls_rx()
+            << " tx=" << session->ktls_tx();
+    done(fd, std::move(session));
+}
+
+} // namespace runos
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "worker_pool.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct bio_st BIO;
+
+namespace runos {
+
+/**
+ * Established server side TLS connection. Record encryption of each
+ * direction is done by the kernel (kTLS) when it could be enabled,
+ * otherwise by encrypt() and decrypt() on memory BIOs. Not thread-safe.
+ */
+class tls_session {
+public:
+    ~tls_session();
+
+    tls_session(tls_session const&) = delete;
+    tls_session& operator=(tls_session const&) = delete;
+
+    bool resumed() const;
+    // Socket reads and writes plaintext in this direction
+    bool ktls_rx() const { return rbio_ == nullptr; }
+    bool ktls_tx() const { return wbio_ == nullptr; }
+
+    // Appends plaintext of received records to `plain` and records for
+    // the peer (alerts, key updates) to `out`. False on close_notify
+    // and errors. Only without kTLS receive.
+    bool decrypt(const uint8_t* data, size_t len,
+                 std::vector<uint8_t>& plain, std::vector<uint8_t>& out);
+    // Appends records to `out`, only without kTLS send
+    bool encrypt(const uint8_t* data, size_t len, std::vector<uint8_t>& out);
+
+private:
+    friend class tls_acceptor;
+    explicit tls_session(SSL* ssl);
+
+    void drain(std::vector<uint8_t>& out);
+
+    SSL* ssl_;
+    BIO* rbio_ {nullptr};
+    BIO* wbio_ {nullptr};
+};
+
+/**
+ * Runs server TLS handshakes on its own threads, so a storm of
+ * reconnecting switches doesn't stall I/O of connected ones.
+ * Sessions are resumed from the server cache or from stateless
+ * tickets; controllers sharing `ticket_key_file` resume each other's
+ * sessions after a failover.
+ */
+class tls_acceptor {
+public:
+    struct settings {
+        std::string cert;             // PEM certificate chain
+        std::string key;              // PEM private key
+        std::string ca;               // switch CA, empty to skip verification
+        std::string ticket_key_file;  // 80 bytes, random keys if empty
+        int handshake_threads {2};
+        int handshake_timeout_ms {10000};
+        bool ktls {true};
+        long session_cache_size {20480};
+    };
+
+    // Called on a handshake thread with the socket in blocking mode
+    using handler = std::function<void(int fd, std::unique_ptr<tls_session>)>;
+
+    // Throws std::runtime_error on unusable certificates or keys
+    explicit tls_acceptor(settings s);
+    // Waits for handshakes in progress
+    ~tls_acceptor();
+
+    tls_acceptor(tls_acceptor const&) = delete;
+    tls_acceptor& operator=(tls_acceptor const&) = delete;
+
+    // Handshakes on a pool thread, `fd` is closed if it fails
+    void accept(int fd, handler done);
+
+private:
+    void handshake(int fd, handler const& done);
+
+    settings settings_;
+    SSL_CTX* ctx_;
+    std::atomic<uint64_t> next_ {0};
+    std::unique_ptr<WorkerPool> pool_;
+};
+
+} // namespace runos
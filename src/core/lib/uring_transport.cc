@@ -0,0 +1,1302 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "uring_transport.hpp"
+
+#include <runos/core/logging.hpp>
+
+#include <liburing.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace runos {
+
+namespace {
+
+constexpr size_t header_size = 8;
+
+enum : uint8_t {
+    OFPT_HELLO = 0,
+    OFPT_ERROR = 1,
+    OFPT_ECHO_REQUEST = 2,
+    OFPT_ECHO_REPLY = 3,
+    OFPT_FEATURES_REQUEST = 5,
+    OFPT_FEATURES_REPLY = 6
+};
+
+constexpr uint16_t OFPET_HELLO_FAILED = 0;
+constexpr uint16_t OFPHFC_INCOMPATIBLE = 0;
+constexpr uint16_t OFPHET_VERSIONBITMAP = 1;
+
+// SQE user data: connection pointer (or zero) with the operation
+// in the low bits, connections are at least 8-byte aligned.
+enum op : uint64_t {
+    OP_ACCEPT = 0,
+    OP_RECV,
+    OP_SEND,
+    OP_WAKEUP,
+    OP_TICK,
+    OP_BALANCE,
+    OP_CANCEL
+};
+constexpr uint64_t op_mask = 7;
+
+constexpr uint16_t buffer_group = 0;
+
+thread_local const void* current_worker = nullptr;
+
+using clock = std::chrono::steady_clock;
+
+// Weight of the last balance interval in the smoothed load
+constexpr double load_smoothing = 0.3;
+
+void add(std::atomic<double>& value, double delta)
+{
+    double old = value.load();
+    while (not value.compare_exchange_weak(old, old + delta)) { }
+}
+
+std::system_error sys_error(int err, const char* what)
+{
+    return std::system_error(err, std::system_category(), what);
+}
+
+uint16_t load16(const uint8_t* p)
+{
+    return uint16_t(p[0] << 8 | p[1]);
+}
+
+uint32_t load32(const uint8_t* p)
+{
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 |
+           uint32_t(p[2]) << 8 | p[3];
+}
+
+void store16(uint8_t* p, uint16_t v)
+{
+    p[0] = uint8_t(v >> 8);
+    p[1] = uint8_t(v);
+}
+
+void store32(uint8_t* p, uint32_t v)
+{
+    store16(p, uint16_t(v >> 16));
+    store16(p + 2, uint16_t(v));
+}
+
+void store_header(uint8_t* p, uint8_t version, uint8_t type,
+                  uint16_t len, uint32_t xid)
+{
+    p[0] = version;
+    p[1] = type;
+    store16(p + 2, len);
+    store32(p + 4, xid);
+}
+
+// OF1.3 7.5.1: bitmap element wins, otherwise the lower version is used
+bool hello_accepts(const uint8_t* msg, size_t len, uint8_t version)
+{
+    for (size_t off = header_size; off + 4 <= len; ) {
+        uint16_t type = load16(msg + off);
+        uint16_t elen = load16(msg + off + 2);
+        if (elen < 4 || off + elen > len)
+            break;
+        if (type == OFPHET_VERSIONBITMAP) {
+            size_t index = off + 4 + (version / 32) * 4;
+            if (index + 4 > off + elen)
+                return false;
+            return load32(msg + index) & (1u << (version % 32));
+        }
+        off += (elen + 7) / 8 * 8;
+    }
+    return msg[0] >= version;
+}
+
+std::string peer_of(int fd)
+{
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+        return std::string();
+
+    char host[INET6_ADDRSTRLEN] = {0};
+    uint16_t port = 0;
+    if (addr.ss_family == AF_INET) {
+        auto in = reinterpret_cast<sockaddr_in*>(&addr);
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        port = ntohs(in->sin_port);
+    } else if (addr.ss_family == AF_INET6) {
+        auto in6 = reinterpret_cast<sockaddr_in6*>(&addr);
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        port = ntohs(in6->sin6_port);
+    }
+    return std::string(host) + ":" + std::to_string(port);
+}
+
+int listen_on(const std::string& address, int port)
+{
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+
+    addrinfo* res = nullptr;
+    auto service = std::to_string(port);
+    if (getaddrinfo(address.c_str(), service.c_str(), &hints, &res) != 0)
+        throw sys_error(EINVAL, "uring_transport: bad listen address");
+    std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> guard {res, freeaddrinfo};
+
+    int fd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        throw sys_error(errno, "uring_transport: socket");
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // One listener per ring, the kernel balances accepts between them
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+        bind(fd, res->ai_addr, res->ai_addrlen) != 0 ||
+        listen(fd, SOMAXCONN) != 0)
+    {
+        int err = errno;
+        ::close(fd);
+        throw sys_error(err, "uring_transport: bind");
+    }
+    return fd;
+}
+
+} // namespace
+
+class uring_transport::connection final : public ofp_connection {
+public:
+    enum state_type { WAIT_HELLO, WAIT_FEATURES, RUNNING, DOWN };
+
+    connection(worker* owner, int fd, int id)
+        : fd(fd), owner(owner), id_(id), peer_(peer_of(fd))
+    { }
+
+    int id() const override { return id_; }
+    std::string peer_address() const override { return peer_; }
+    bool running() const override { return state == RUNNING; }
+    uint8_t version() const override { return version_; }
+
+    void send(const void* data, size_t len) override;
+    void close() override;
+    size_t pending_bytes() const override { return unsent; }
+
+    const int fd;
+    std::atomic<int> state {WAIT_HELLO};
+    std::atomic<uint8_t> version_ {0};
+    std::atomic_bool closing {false};
+
+    // Producers append to `pending`, the I/O thread moves it
+    // to `inflight` when the previous send has completed.
+    std::mutex tx_mutex;
+    std::vector<uint8_t> pending;
+    worker* owner;
+    bool scheduled {false}; // in the worker's ready list
+    bool migrating {false}; // between two workers, nobody to wake
+    // `pending` and `inflight` before encryption
+    std::atomic<size_t> unsent {0};
+
+    // I/O thread only
+    std::vector<uint8_t> inflight;
+    size_t inflight_plain {0}; // of `unsent`
+    size_t sent {0};
+    bool sending {false};
+    bool receiving {false};
+    bool shut {false};
+    std::vector<uint8_t> rx; // incomplete message
+    std::unique_ptr<tls_session> tls;
+    std::vector<uint8_t> tls_out; // records from decrypt() to send as is
+    bool alive {true};
+    int missed_echoes {0};
+
+    // Load, counted by the I/O thread and taken over with the connection
+    uint64_t messages {0};
+    uint64_t bytes {0};
+    uint64_t last_messages {0};
+    uint64_t last_bytes {0};
+    double load {0};
+    clock::time_point settled {clock::now()};
+    worker* migrate_to {nullptr};
+
+private:
+    const int id_;
+    const std::string peer_;
+};
+
+class uring_transport::worker {
+public:
+    worker(uring_transport& transport, int listener);
+    ~worker();
+
+    void start();
+    void stop();
+
+    // Queues connection for the I/O thread, wakes it if needed
+    void schedule(connection* conn);
+    // Hands over a socket accepted by another thread
+    void adopt(int fd, std::unique_ptr<tls_session> tls);
+    // Hands over a connection moved from another thread, false
+    // if this one has stopped
+    bool adopt(std::unique_ptr<connection>& conn);
+
+    thread_load load() const;
+
+private:
+    void run();
+    io_uring_sqe* sqe();
+    void arm_accept();
+    void arm_recv(connection* conn);
+    void arm_wakeup();
+    void arm_tick();
+    void arm_balance();
+    void flush_ready();
+    void flush(connection* conn);
+
+    void on_cqe(io_uring_cqe* cqe);
+    void on_accept(int res, bool more);
+    void start_connection(int fd, std::unique_ptr<tls_session> tls);
+    void on_recv(connection* conn, io_uring_cqe* cqe);
+    void on_send(connection* conn, int res);
+    void on_tick();
+    void on_balance();
+
+    // Where a new connection goes
+    worker* assign();
+    void rebalance(clock::time_point now);
+    void start_migration(connection* conn, worker* target);
+    // Gives the connection to its migrate_to once no receive or send
+    // is in flight, false if it stays here
+    bool hand_over(connection* conn);
+    void take_over(std::unique_ptr<connection> conn);
+
+    void consume(connection* conn, const uint8_t* data, size_t len);
+    void dispatch(connection* conn, uint8_t* msg, size_t len);
+    void send_local(connection* conn, const uint8_t* data, size_t len);
+    void send_urgent(connection* conn, const uint8_t* data, size_t len);
+    void shutdown_if_drained(connection* conn);
+    void destroy_if_idle(connection* conn);
+
+    uring_transport& transport_;
+    const uring_transport::settings& settings_;
+    int listener_;
+    int wakeup_fd_;
+    io_uring ring_;
+    io_uring_buf_ring* buf_ring_ {nullptr};
+    std::vector<uint8_t> buffers_;
+    unsigned recycled_ {0};
+    uint64_t wakeup_value_ {0};
+    __kernel_timespec tick_ {};
+    __kernel_timespec balance_tick_ {};
+    clock::time_point last_balance_ {};
+
+    std::unordered_map<connection*, std::unique_ptr<connection>> conns_;
+
+    std::mutex ready_mutex_;
+    std::vector<connection*> ready_;
+    std::vector<connection*> ready_local_;
+    std::vector<std::pair<int, std::unique_ptr<tls_session>>> adopted_;
+    std::vector<std::pair<int, std::unique_ptr<tls_session>>> adopted_local_;
+    std::vector<std::unique_ptr<connection>> migrated_;
+    std::vector<std::unique_ptr<connection>> migrated_local_;
+    bool stopped_ {false}; // under ready_mutex_
+
+    // Published every balance tick for the other workers
+    std::atomic<double> load_ {0};
+    std::atomic<uint64_t> migrated_in_ {0};
+    std::atomic<uint64_t> migrated_out_ {0};
+    mutable std::mutex load_mutex_;
+    std::vector<std::pair<int, double>> conn_loads_;
+
+    // TLS without kTLS: plaintext to encrypt and decrypted input
+    std::vector<uint8_t> plain_;
+    std::vector<uint8_t> decrypted_;
+
+    std::atomic_bool stop_ {false};
+    std::thread thread_;
+};
+
+void uring_transport::connection::send(const void* data, size_t len)
+{
+    auto bytes = static_cast<const uint8_t*>(data);
+    worker* wake = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        if (closing)
+            return;
+        pending.insert(pending.end(), bytes, bytes + len);
+        unsent += len;
+        // A migrating connection is flushed by the worker taking it
+        if (not scheduled && not migrating) {
+            scheduled = true;
+            wake = owner;
+        }
+    }
+    if (wake)
+        wake->schedule(this);
+}
+
+void uring_transport::connection::close()
+{
+    if (closing.exchange(true))
+        return;
+    state = DOWN;
+
+    worker* wake = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        if (not scheduled && not migrating) {
+            scheduled = true;
+            wake = owner;
+        }
+    }
+    if (wake)
+        wake->schedule(this);
+}
+
+uring_transport::worker::worker(uring_transport& transport, int listener)
+    : transport_(transport)
+    , settings_(transport.settings_)
+    , listener_(listener)
+{
+    wakeup_fd_ = eventfd(0, EFD_CLOEXEC);
+    if (wakeup_fd_ < 0)
+        throw sys_error(errno, "uring_transport: eventfd");
+
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    // The ring is set up here but driven by the I/O thread,
+    // so no IORING_SETUP_SINGLE_ISSUER
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    int ret = io_uring_queue_init_params(settings_.queue_depth, &ring_, &params);
+    if (ret == -EINVAL) {
+        // Kernels before 5.19 don't know the flag
+        std::memset(&params, 0, sizeof(params));
+        ret = io_uring_queue_init_params(settings_.queue_depth, &ring_, &params);
+    }
+    if (ret < 0) {
+        ::close(wakeup_fd_);
+        throw sys_error(-ret, "uring_transport: io_uring_queue_init");
+    }
+
+    buffers_.resize(size_t(settings_.buffers) * settings_.buffer_size);
+    buf_ring_ = io_uring_setup_buf_ring(&ring_, settings_.buffers,
+                                        buffer_group, 0, &ret);
+    if (not buf_ring_) {
+        io_uring_queue_exit(&ring_);
+        ::close(wakeup_fd_);
+        throw sys_error(-ret, "uring_transport: io_uring_setup_buf_ring");
+    }
+    auto mask = io_uring_buf_ring_mask(settings_.buffers);
+    for (unsigned bid = 0; bid < settings_.buffers; ++bid) {
+        io_uring_buf_ring_add(buf_ring_,
+                              buffers_.data() + size_t(bid) * settings_.buffer_size,
+                              settings_.buffer_size, bid, mask, bid);
+    }
+    io_uring_buf_ring_advance(buf_ring_, settings_.buffers);
+
+    tick_.tv_sec = settings_.echo_interval;
+    int balance_ms = std::max(settings_.balance_interval_ms, 1);
+    balance_tick_.tv_sec = balance_ms / 1000;
+    balance_tick_.tv_nsec = (balance_ms % 1000) * 1000000L;
+}
+
+uring_transport::worker::~worker()
+{
+    stop();
+    // The ring lets go of the listener asynchronously; until then it would
+    // keep queueing connections that a restarted transport should get.
+    ::shutdown(listener_, SHUT_RDWR);
+    for (auto& pending : adopted_) {
+        ::close(pending.first);
+    }
+    io_uring_free_buf_ring(&ring_, buf_ring_, settings_.buffers, buffer_group);
+    io_uring_queue_exit(&ring_);
+    ::close(wakeup_fd_);
+    ::close(listener_);
+}
+
+void uring_transport::worker::start()
+{
+    thread_ = std::thread([this]() { run(); });
+}
+
+void uring_transport::worker::stop()
+{
+    if (not thread_.joinable())
+        return;
+    stop_ = true;
+    uint64_t one = 1;
+    (void) ::write(wakeup_fd_, &one, sizeof(one));
+    thread_.join();
+}
+
+void uring_transport::worker::schedule(connection* conn)
+{
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex_);
+        wake = ready_.empty() && adopted_.empty() && migrated_.empty();
+        ready_.push_back(conn);
+    }
+    // The loop flushes ready connections before every submit
+    if (wake && current_worker != this) {
+        uint64_t one = 1;
+        (void) ::write(wakeup_fd_, &one, sizeof(one));
+    }
+}
+
+void uring_transport::worker::adopt(int fd, std::unique_ptr<tls_session> tls)
+{
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex_);
+        wake = ready_.empty() && adopted_.empty() && migrated_.empty();
+        adopted_.emplace_back(fd, std::move(tls));
+    }
+    if (wake) {
+        uint64_t one = 1;
+        (void) ::write(wakeup_fd_, &one, sizeof(one));
+    }
+}
+
+bool uring_transport::worker::adopt(std::unique_ptr<connection>& conn)
+{
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex_);
+        if (stopped_)
+            return false;
+        wake = ready_.empty() && adopted_.empty() && migrated_.empty();
+        migrated_.push_back(std::move(conn));
+    }
+    if (wake) {
+        uint64_t one = 1;
+        (void) ::write(wakeup_fd_, &one, sizeof(one));
+    }
+    return true;
+}
+
+auto uring_transport::worker::load() const -> thread_load
+{
+    thread_load ret;
+    ret.load = load_;
+    ret.migrated_in = migrated_in_;
+    ret.migrated_out = migrated_out_;
+    std::lock_guard<std::mutex> lock(load_mutex_);
+    ret.connections = conn_loads_.size();
+    ret.top = conn_loads_;
+    return ret;
+}
+
+io_uring_sqe* uring_transport::worker::sqe()
+{
+    io_uring_sqe* ret;
+    while (not (ret = io_uring_get_sqe(&ring_))) {
+        io_uring_submit(&ring_);
+    }
+    return ret;
+}
+
+void uring_transport::worker::arm_accept()
+{
+    auto s = sqe();
+    io_uring_prep_multishot_accept(s, listener_, nullptr, nullptr, SOCK_CLOEXEC);
+    io_uring_sqe_set_data64(s, OP_ACCEPT);
+}
+
+void uring_transport::worker::arm_recv(connection* conn)
+{
+    auto s = sqe();
+    io_uring_prep_recv_multishot(s, conn->fd, nullptr, 0, 0);
+    s->flags |= IOSQE_BUFFER_SELECT;
+    s->buf_group = buffer_group;
+    io_uring_sqe_set_data64(s, reinterpret_cast<uint64_t>(conn) | OP_RECV);
+    conn->receiving = true;
+}
+
+void uring_transport::worker::arm_wakeup()
+{
+    auto s = sqe();
+    io_uring_prep_read(s, wakeup_fd_, &wakeup_value_, sizeof(wakeup_value_), 0);
+    io_uring_sqe_set_data64(s, OP_WAKEUP);
+}
+
+void uring_transport::worker::arm_tick()
+{
+    auto s = sqe();
+    io_uring_prep_timeout(s, &tick_, 0, 0);
+    io_uring_sqe_set_data64(s, OP_TICK);
+}
+
+void uring_transport::worker::arm_balance()
+{
+    auto s = sqe();
+    io_uring_prep_timeout(s, &balance_tick_, 0, 0);
+    io_uring_sqe_set_data64(s, OP_BALANCE);
+}
+
+void uring_transport::worker::run()
+{
+    current_worker = this;
+
+    arm_accept();
+    arm_wakeup();
+    if (settings_.liveness_check && settings_.echo_interval > 0)
+        arm_tick();
+    last_balance_ = clock::now();
+    arm_balance();
+
+    while (not stop_) {
+        flush_ready();
+        int ret = io_uring_submit_and_wait(&ring_, 1);
+        if (ret < 0 && ret != -EINTR && ret != -EBUSY) {
+            LOG(ERROR) << "[uring_transport] io_uring_submit_and_wait failed: "
+                       << std::strerror(-ret);
+            break;
+        }
+
+        unsigned head, count = 0;
+        io_uring_cqe* cqe;
+        io_uring_for_each_cqe(&ring_, head, cqe) {
+            ++count;
+            on_cqe(cqe);
+        }
+        io_uring_cq_advance(&ring_, count);
+
+        if (recycled_) {
+            io_uring_buf_ring_advance(buf_ring_, recycled_);
+            recycled_ = 0;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex_);
+        stopped_ = true;
+        for (auto& conn : migrated_) {
+            conns_.emplace(conn.get(), std::move(conn));
+        }
+        migrated_.clear();
+    }
+    for (auto& pair : conns_) {
+        auto conn = pair.second.get();
+        conn->closing = true;
+        conn->state = connection::DOWN;
+        ::close(conn->fd);
+        transport_.on_event_(conn, ofp_connection::CLOSED);
+    }
+    conns_.clear();
+    current_worker = nullptr;
+}
+
+void uring_transport::worker::flush_ready()
+{
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex_);
+        ready_local_.swap(ready_);
+        adopted_local_.swap(adopted_);
+        migrated_local_.swap(migrated_);
+    }
+    for (auto& pending : adopted_local_) {
+        start_connection(pending.first, std::move(pending.second));
+    }
+    adopted_local_.clear();
+    for (auto& conn : migrated_local_) {
+        take_over(std::move(conn));
+    }
+    migrated_local_.clear();
+
+    for (auto conn : ready_local_) {
+        {
+            std::lock_guard<std::mutex> lock(conn->tx_mutex);
+            conn->scheduled = false;
+        }
+        flush(conn);
+        if (conn->migrate_to && hand_over(conn))
+            continue;
+        shutdown_if_drained(conn);
+        destroy_if_idle(conn);
+    }
+    ready_local_.clear();
+}
+
+// Everything queued since the last send goes in one SQE
+void uring_transport::worker::flush(connection* conn)
+{
+    if (conn->sending || conn->shut)
+        return;
+    // Left for the worker taking the connection
+    if (conn->migrate_to && not conn->closing)
+        return;
+
+    bool encrypt = conn->tls && not conn->tls->ktls_tx();
+    {
+        std::lock_guard<std::mutex> lock(conn->tx_mutex);
+        if (conn->pending.empty() && conn->tls_out.empty())
+            return;
+        (encrypt ? plain_ : conn->inflight).swap(conn->pending);
+    }
+    conn->inflight_plain = encrypt ? plain_.size() : conn->inflight.size();
+    if (encrypt) {
+        conn->inflight.swap(conn->tls_out);
+        bool ok = conn->tls->encrypt(plain_.data(), plain_.size(),
+                                     conn->inflight);
+        plain_.clear();
+        if (not ok) {
+            conn->inflight.clear();
+            conn->close();
+            return;
+        }
+    }
+    conn->sent = 0;
+    conn->sending = true;
+
+    auto s = sqe();
+    io_uring_prep_send(s, conn->fd, conn->inflight.data(),
+                       conn->inflight.size(), MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(s, reinterpret_cast<uint64_t>(conn) | OP_SEND);
+}
+
+void uring_transport::worker::on_cqe(io_uring_cqe* cqe)
+{
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    auto conn = reinterpret_cast<connection*>(data & ~op_mask);
+
+    switch (data & op_mask) {
+    case OP_ACCEPT:
+        on_accept(cqe->res, cqe->flags & IORING_CQE_F_MORE);
+        break;
+    case OP_RECV:
+        on_recv(conn, cqe);
+        break;
+    case OP_SEND:
+        on_send(conn, cqe->res);
+        break;
+    case OP_WAKEUP:
+        if (not stop_)
+            arm_wakeup();
+        break;
+    case OP_TICK:
+        on_tick();
+        arm_tick();
+        break;
+    case OP_BALANCE:
+        on_balance();
+        arm_balance();
+        break;
+    case OP_CANCEL:
+        // The receive reports the cancellation itself
+        break;
+    }
+}
+
+void uring_transport::worker::on_accept(int res, bool more)
+{
+    if (res >= 0) {
+        int one = 1;
+        setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (transport_.tls_) {
+            transport_.tls_->accept(res,
+                [this](int fd, std::unique_ptr<tls_session> tls) {
+                    assign()->adopt(fd, std::move(tls));
+                });
+        } else if (auto target = assign(); target != this) {
+            target->adopt(res, nullptr);
+        } else {
+            start_connection(res, nullptr);
+        }
+    }
+    if (not more)
+        arm_accept();
+}
+
+void uring_transport::worker::start_connection(int fd,
+                                               std::unique_ptr<tls_session> tls)
+{
+    auto conn = new connection(this, fd, ++transport_.next_id_);
+    conns_.emplace(conn, std::unique_ptr<connection>(conn));
+    conn->tls = std::move(tls);
+    transport_.on_event_(conn, ofp_connection::STARTED);
+
+    uint8_t hello[header_size];
+    store_header(hello, settings_.version, OFPT_HELLO, header_size, 0);
+    send_local(conn, hello, sizeof(hello));
+    arm_recv(conn);
+}
+
+void uring_transport::worker::on_recv(connection* conn, io_uring_cqe* cqe)
+{
+    int res = cqe->res;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        auto buf = buffers_.data() + size_t(bid) * settings_.buffer_size;
+        if (conn->closing) {
+            // Shutting down, input is dropped
+        } else if (conn->tls && not conn->tls->ktls_rx()) {
+            decrypted_.clear();
+            if (conn->tls->decrypt(buf, size_t(res), decrypted_, conn->tls_out))
+                consume(conn, decrypted_.data(), decrypted_.size());
+            else
+                conn->close();
+            flush(conn);
+        } else {
+            consume(conn, buf, size_t(res));
+        }
+        if (transport_.on_read_)
+            transport_.on_read_(conn);
+        // Buffer ring is advanced once per loop iteration
+        io_uring_buf_ring_add(buf_ring_, buf, settings_.buffer_size, bid,
+                              io_uring_buf_ring_mask(settings_.buffers),
+                              recycled_++);
+    }
+
+    if (more)
+        return;
+
+    if (conn->migrate_to && not conn->closing &&
+        (res > 0 || res == -ENOBUFS || res == -ECANCELED))
+    {
+        conn->receiving = false;
+        hand_over(conn);
+        return;
+    }
+
+    if ((res > 0 || res == -ENOBUFS) && not conn->closing) {
+        arm_recv(conn);
+        return;
+    }
+
+    // EOF, error or shutdown by close()
+    conn->receiving = false;
+    conn->migrate_to = nullptr;
+    conn->closing = true;
+    conn->state = connection::DOWN;
+    shutdown_if_drained(conn);
+    destroy_if_idle(conn);
+}
+
+void uring_transport::worker::on_send(connection* conn, int res)
+{
+    if (res < 0) {
+        conn->sending = false;
+        conn->migrate_to = nullptr;
+        conn->closing = true;
+        conn->state = connection::DOWN;
+        conn->inflight.clear();
+        conn->unsent -= conn->inflight_plain;
+        conn->inflight_plain = 0;
+    } else {
+        conn->sent += size_t(res);
+        conn->bytes += size_t(res);
+        if (conn->sent < conn->inflight.size()) {
+            // Short write, the rest goes first
+            auto s = sqe();
+            io_uring_prep_send(s, conn->fd,
+                               conn->inflight.data() + conn->sent,
+                               conn->inflight.size() - conn->sent,
+                               MSG_NOSIGNAL);
+            io_uring_sqe_set_data64(s, reinterpret_cast<uint64_t>(conn) | OP_SEND);
+            return;
+        }
+        conn->sending = false;
+        conn->inflight.clear();
+        conn->unsent -= conn->inflight_plain;
+        conn->inflight_plain = 0;
+        flush(conn);
+        if (conn->migrate_to && hand_over(conn))
+            return;
+    }
+    shutdown_if_drained(conn);
+    destroy_if_idle(conn);
+}
+
+void uring_transport::worker::on_tick()
+{
+    uint8_t echo[header_size];
+    store_header(echo, settings_.version, OFPT_ECHO_REQUEST, header_size, 0);
+
+    std::vector<connection*> dead;
+    for (auto& pair : conns_) {
+        auto conn = pair.second.get();
+        if (conn->state != connection::RUNNING)
+            continue;
+        // Traffic since the last tick, no need to ask
+        if (conn->alive) {
+            conn->missed_echoes = 0;
+            conn->alive = false;
+            continue;
+        }
+        if (conn->missed_echoes++ >= settings_.echo_attempts) {
+            dead.push_back(conn);
+            continue;
+        }
+        send_local(conn, echo, sizeof(echo));
+    }
+
+    for (auto conn : dead) {
+        transport_.on_event_(conn, ofp_connection::DEAD);
+        conn->close();
+    }
+}
+
+void uring_transport::worker::on_balance()
+{
+    auto now = clock::now();
+    double dt = std::chrono::duration<double>(now - last_balance_).count();
+    last_balance_ = now;
+    if (dt <= 0)
+        return;
+
+    double bytes_per_message = std::max(settings_.bytes_per_message, 1u);
+    double total = 0;
+    std::vector<std::pair<int, double>> loads;
+    loads.reserve(conns_.size());
+    for (auto& pair : conns_) {
+        auto conn = pair.second.get();
+        double rate = (double(conn->messages - conn->last_messages) +
+                       double(conn->bytes - conn->last_bytes) /
+                           bytes_per_message) / dt;
+        conn->last_messages = conn->messages;
+        conn->last_bytes = conn->bytes;
+        conn->load += load_smoothing * (rate - conn->load);
+        total += conn->load;
+        loads.emplace_back(conn->id(), conn->load);
+    }
+    std::sort(loads.begin(), loads.end(), [](const auto& a, const auto& b) {
+        return a.second > b.second;
+    });
+
+    load_ = total;
+    {
+        std::lock_guard<std::mutex> lock(load_mutex_);
+        conn_loads_.swap(loads);
+    }
+    if (settings_.balance)
+        rebalance(now);
+}
+
+// Here, unless this thread is loaded over the others
+auto uring_transport::worker::assign() -> worker*
+{
+    if (not settings_.balance)
+        return this;
+
+    const auto& workers = transport_.workers_;
+    double mine = load_;
+    double total = 0;
+    worker* coldest = this;
+    double coldest_load = mine;
+    for (const auto& w : workers) {
+        double load = w->load_;
+        total += load;
+        if (load < coldest_load) {
+            coldest = w.get();
+            coldest_load = load;
+        }
+    }
+    double mean = total / workers.size();
+    if (mine < settings_.balance_min_load ||
+        mine <= mean * (1 + settings_.balance_threshold))
+        return this;
+    return coldest;
+}
+
+// The hottest thread moves one connection per tick, to the coldest
+void uring_transport::worker::rebalance(clock::time_point now)
+{
+    const auto& workers = transport_.workers_;
+    if (workers.size() < 2)
+        return;
+
+    double mine = load_;
+    double total = 0;
+    worker* coldest = this;
+    double coldest_load = mine;
+    for (const auto& w : workers) {
+        double load = w->load_;
+        if (load > mine)
+            return;
+        total += load;
+        if (load < coldest_load) {
+            coldest = w.get();
+            coldest_load = load;
+        }
+    }
+    double mean = total / workers.size();
+    if (mine < settings_.balance_min_load ||
+        mine <= mean * (1 + settings_.balance_threshold))
+        return;
+
+    // Moving a load below the gap lowers the maximum,
+    // half of the gap evens the two threads
+    double gap = mine - coldest_load;
+    auto cooldown = std::chrono::milliseconds(settings_.balance_cooldown_ms);
+    connection* best = nullptr;
+    double best_miss = gap / 2;
+    for (auto& pair : conns_) {
+        auto conn = pair.second.get();
+        if (conn->state != connection::RUNNING || conn->closing ||
+            conn->migrate_to || not conn->receiving)
+            continue;
+        if (now - conn->settled < cooldown)
+            continue;
+        if (conn->load <= 0 || conn->load >= gap)
+            continue;
+        double miss = std::abs(conn->load - gap / 2);
+        if (miss < best_miss) {
+            best = conn;
+            best_miss = miss;
+        }
+    }
+    if (not best)
+        return;
+
+    // Until their next ticks, so that other threads don't pile on
+    add(load_, -best->load);
+    add(coldest->load_, best->load);
+    start_migration(best, coldest);
+}
+
+void uring_transport::worker::start_migration(connection* conn,
+                                              worker* target)
+{
+    VLOG(1) << "[uring_transport] Moving connection id=" << conn->id()
+            << " (" << conn->load << " msg/s) to a less loaded thread";
+    conn->migrate_to = target;
+    // Its last CQE comes with -ECANCELED or with data read before
+    auto s = sqe();
+    io_uring_prep_cancel64(s, reinterpret_cast<uint64_t>(conn) | OP_RECV, 0);
+    io_uring_sqe_set_data64(s, OP_CANCEL);
+}
+
+bool uring_transport::worker::hand_over(connection* conn)
+{
+    if (conn->closing) {
+        // Closed meanwhile, shut down here
+        conn->migrate_to = nullptr;
+        return false;
+    }
+    if (conn->receiving || conn->sending)
+        return false; // its CQE comes back here
+    auto target = conn->migrate_to;
+    {
+        std::lock_guard<std::mutex> lock(conn->tx_mutex);
+        if (conn->scheduled)
+            return false; // flush_ready() comes back here
+        conn->migrating = true;
+        conn->owner = target;
+    }
+    conn->migrate_to = nullptr;
+
+    auto it = conns_.find(conn);
+    if (target->adopt(it->second)) {
+        conns_.erase(it);
+        ++migrated_out_;
+        return true;
+    }
+
+    // The other thread has stopped, the connection stays
+    {
+        std::lock_guard<std::mutex> lock(conn->tx_mutex);
+        conn->migrating = false;
+        conn->owner = this;
+    }
+    arm_recv(conn);
+    flush(conn);
+    return false;
+}
+
+void uring_transport::worker::take_over(std::unique_ptr<connection> owned)
+{
+    auto conn = owned.get();
+    conns_.emplace(conn, std::move(owned));
+    conn->settled = clock::now();
+    ++migrated_in_;
+    {
+        std::lock_guard<std::mutex> lock(conn->tx_mutex);
+        conn->migrating = false;
+    }
+
+    // Output queued during the move goes first
+    if (not conn->closing)
+        arm_recv(conn);
+    flush(conn);
+    shutdown_if_drained(conn);
+    destroy_if_idle(conn);
+}
+
+void uring_transport::worker::consume(connection* conn,
+                                      const uint8_t* data, size_t len)
+{
+    // Complete the message left from the previous read
+    if (not conn->rx.empty()) {
+        auto& rx = conn->rx;
+        size_t need = header_size;
+        if (rx.size() >= header_size)
+            need = load16(rx.data() + 2);
+        else if (rx.size() + len >= header_size) {
+            uint8_t hdr[header_size];
+            std::memcpy(hdr, rx.data(), rx.size());
+            std::memcpy(hdr + rx.size(), data, header_size - rx.size());
+            need = load16(hdr + 2);
+        }
+        if (need < header_size) {
+            conn->close();
+            return;
+        }
+        size_t take = std::min(len, need - rx.size());
+        rx.insert(rx.end(), data, data + take);
+        data += take;
+        len -= take;
+        if (rx.size() < need)
+            return;
+
+        auto msg = static_cast<uint8_t*>(std::malloc(need));
+        std::memcpy(msg, rx.data(), need);
+        rx.clear();
+        dispatch(conn, msg, need);
+        if (conn->closing)
+            return;
+    }
+
+    while (len >= header_size) {
+        size_t mlen = load16(data + 2);
+        if (mlen < header_size) {
+            conn->close();
+            return;
+        }
+        if (mlen > len)
+            break;
+
+        auto msg = static_cast<uint8_t*>(std::malloc(mlen));
+        std::memcpy(msg, data, mlen);
+        data += mlen;
+        len -= mlen;
+        dispatch(conn, msg, mlen);
+        if (conn->closing)
+            return;
+    }
+    conn->rx.assign(data, data + len);
+}
+
+void uring_transport::worker::dispatch(connection* conn, uint8_t* msg, size_t len)
+{
+    uint8_t type = msg[1];
+    conn->alive = true;
+    ++conn->messages;
+    conn->bytes += len;
+
+    if (type == OFPT_ECHO_REQUEST) {
+        msg[1] = OFPT_ECHO_REPLY;
+        send_urgent(conn, msg, len);
+        std::free(msg);
+        return;
+    }
+    if (type == OFPT_ECHO_REPLY) {
+        std::free(msg);
+        return;
+    }
+
+    switch (conn->state) {
+    case connection::WAIT_HELLO:
+        if (type == OFPT_HELLO && hello_accepts(msg, len, settings_.version)) {
+            conn->version_ = settings_.version;
+            conn->state = connection::WAIT_FEATURES;
+            uint8_t request[header_size];
+            store_header(request, settings_.version, OFPT_FEATURES_REQUEST,
+                         header_size, 0);
+            send_local(conn, request, sizeof(request));
+        } else if (type == OFPT_HELLO) {
+            uint8_t error[header_size + 4];
+            store_header(error, settings_.version, OFPT_ERROR,
+                         sizeof(error), load32(msg + 4));
+            store16(error + header_size, OFPET_HELLO_FAILED);
+            store16(error + header_size + 2, OFPHFC_INCOMPATIBLE);
+            send_local(conn, error, sizeof(error));
+            transport_.on_event_(conn, ofp_connection::FAILED_NEGOTIATION);
+            conn->close();
+        }
+        std::free(msg);
+        return;
+
+    case connection::WAIT_FEATURES:
+        if (type != OFPT_FEATURES_REPLY) {
+            std::free(msg);
+            return;
+        }
+        conn->state = connection::RUNNING;
+        transport_.on_event_(conn, ofp_connection::ESTABLISHED);
+        break;
+
+    case connection::RUNNING:
+        break;
+
+    default:
+        std::free(msg);
+        return;
+    }
+
+    transport_.on_message_(conn, type, msg, len);
+}
+
+// Appends to the queue, bypassing the close check: the error
+// reply of a failed negotiation is sent after close().
+void uring_transport::worker::send_local(connection* conn,
+                                         const uint8_t* data, size_t len)
+{
+    {
+        std::lock_guard<std::mutex> lock(conn->tx_mutex);
+        conn->pending.insert(conn->pending.end(), data, data + len);
+        conn->unsent += len;
+    }
+    flush(conn);
+}
+
+// `pending` holds whole messages only, so the reply may go first
+void uring_transport::worker::send_urgent(connection* conn,
+                                          const uint8_t* data, size_t len)
+{
+    {
+        std::lock_guard<std::mutex> lock(conn->tx_mutex);
+        conn->pending.insert(conn->pending.begin(), data, data + len);
+        conn->unsent += len;
+    }
+    flush(conn);
+}
+
+// close() and errors let the queued output go before the socket is shut
+void uring_transport::worker::shutdown_if_drained(connection* conn)
+{
+    if (not conn->closing || conn->shut)
+        return;
+    if (conn->sending)
+        return; // on_send() comes back with the rest of the queue
+    conn->shut = true;
+    // Terminates the multishot receive
+    ::shutdown(conn->fd, SHUT_RDWR);
+}
+
+void uring_transport::worker::destroy_if_idle(connection* conn)
+{
+    if (not conn->shut || conn->receiving || conn->sending)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(conn->tx_mutex);
+        // Still in the ready list, flush_ready() will come back
+        if (conn->scheduled)
+            return;
+    }
+
+    transport_.on_event_(conn, ofp_connection::CLOSED);
+    ::close(conn->fd);
+    conns_.erase(conn);
+}
+
+uring_transport::uring_transport(settings s, message_handler on_message,
+                                 event_handler on_event, read_handler on_read)
+    : settings_(std::move(s))
+    , on_message_(std::move(on_message))
+    , on_event_(std::move(on_event))
+    , on_read_(std::move(on_read))
+{
+    if (settings_.secure) {
+        tls_.reset(new tls_acceptor(settings_.tls));
+    }
+
+    // Buffer ring size must be a power of two
+    unsigned buffers = 1;
+    while (buffers < settings_.buffers && buffers < 32768)
+        buffers <<= 1;
+    settings_.buffers = buffers;
+}
+
+uring_transport::~uring_transport()
+{
+    stop();
+}
+
+void uring_transport::start()
+{
+    int nthreads = std::max(1, settings_.nthreads);
+    for (int i = 0; i < nthreads; ++i) {
+        int fd = listen_on(settings_.address, settings_.port);
+        std::unique_ptr<worker> w;
+        try {
+            w.reset(new worker(*this, fd));
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        workers_.push_back(std::move(w));
+    }
+    for (auto& w : workers_) {
+        w->start();
+    }
+}
+
+void uring_transport::free_data(void* data)
+{
+    std::free(data);
+}
+
+auto uring_transport::loads() const -> std::vector<thread_load>
+{
+    std::vector<thread_load> ret;
+    ret.reserve(workers_.size());
+    for (const auto& w : workers_) {
+        ret.push_back(w->load());
+    }
+    return ret;
+}
+
+void uring_transport::stop()
+{
+    // Handshakes in progress still hand sockets to the workers
+    tls_.reset();
+    for (auto& w : workers_) {
+        w->stop();
+    }
+    workers_.clear();
+}
+
+} // namespace runos
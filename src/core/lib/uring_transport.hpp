@@ -0,0 +1,132 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "ofp_transport.hpp"
+#include "tls_acceptor.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace runos {
+
+/**
+ * OpenFlow server on io_uring, an alternative to libfluid's libevent
+ * loop. Every I/O thread owns a ring and a SO_REUSEPORT listener, so the
+ * kernel spreads switches between threads and a connection never leaves
+ * its thread. Sockets are read by multishot receives into a buffer ring
+ * registered with the kernel, messages sent by any thread are coalesced
+ * per connection and all I/O of a loop iteration goes in one submit.
+ *
+ * HELLO/FEATURES handshake, echo replies and liveness checks are done
+ * here like in libfluid, handlers see the same events and messages.
+ * Any received message proves liveness: echo requests go only to
+ * connections silent for a whole echo interval, and echo replies are
+ * queued ahead of output not yet handed to the kernel.
+ *
+ * With `secure` accepted sockets go through tls_acceptor first and
+ * join their ring when the TLS handshake is over.
+ *
+ * With `balance` every thread measures the load of its connections,
+ * messages per second with bytes counted in `bytes_per_message` units.
+ * A thread loaded over the mean by `balance_threshold` hands new
+ * connections to the least loaded one, and once per balance tick moves
+ * the established connection that evens the two the best: its receive
+ * is cancelled, the send in flight completes and the connection with
+ * its queued output continues on the other ring.
+ */
+class uring_transport {
+public:
+    struct settings {
+        std::string address {"0.0.0.0"};
+        int port {6653};
+        int nthreads {4};
+        uint8_t version {4};
+        unsigned queue_depth {512};   // SQ entries per ring
+        unsigned buffers {256};       // receive buffers per ring, power of 2
+        unsigned buffer_size {16384};
+        int echo_interval {5};        // seconds
+        int echo_attempts {3};
+        bool liveness_check {true};
+        bool secure {false};
+        tls_acceptor::settings tls;
+        bool balance {true};
+        int balance_interval_ms {1000};
+        double balance_threshold {0.25}; // of the mean load
+        double balance_min_load {200};   // of the hot thread
+        int balance_cooldown_ms {10000}; // a moved connection stays put
+        unsigned bytes_per_message {1024};
+    };
+
+    struct thread_load {
+        size_t connections;
+        double load; // messages/s
+        uint64_t migrated_in;
+        uint64_t migrated_out;
+        // Connection ids with their load, hottest first
+        std::vector<std::pair<int, double>> top;
+    };
+
+    // Receives ownership of `data`, release with free_data()
+    using message_handler =
+        std::function<void(ofp_connection* conn, uint8_t type,
+                           void* data, size_t len)>;
+    using event_handler =
+        std::function<void(ofp_connection* conn, ofp_connection::event)>;
+    // Messages of one read of the socket have been passed to the
+    // message handler, which may dispatch them together now
+    using read_handler = std::function<void(ofp_connection* conn)>;
+
+    // Throws std::runtime_error if TLS can't be set up
+    uring_transport(settings s, message_handler on_message,
+                    event_handler on_event, read_handler on_read = {});
+    ~uring_transport();
+
+    uring_transport(uring_transport const&) = delete;
+    uring_transport& operator=(uring_transport const&) = delete;
+
+    // Binds listeners and starts I/O threads, throws std::system_error
+    void start();
+    // Closes all connections and joins I/O threads
+    void stop();
+
+    // Releases a message passed to the handler, also after its
+    // connection is closed
+    static void free_data(void* data);
+
+    // As of the last balance tick of every I/O thread. Thread-safe.
+    std::vector<thread_load> loads() const;
+
+private:
+    class connection;
+    class worker;
+
+    settings settings_;
+    message_handler on_message_;
+    event_handler on_event_;
+    read_handler on_read_;
+    std::atomic<int> next_id_ {0};
+    std::unique_ptr<tls_acceptor> tls_;
+    std::vector< std::unique_ptr<worker> > workers_;
+};
+
+} // namespace runos
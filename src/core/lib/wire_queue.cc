@@ -0,0 +1,114 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "wire_queue.hpp"
+
+#include <cstring>
+
+#include <runos/core/assert.hpp>
+
+namespace runos {
+
+wire_queue::wire_queue(size_t slab_size)
+    : slab_size_(slab_size)
+{ }
+
+size_t wire_queue::length(const uint8_t* msg)
+{
+    return size_t(msg[2]) << 8 | msg[3];
+}
+
+auto wire_queue::tail_slab(size_t len) -> slab&
+{
+    if (not slabs_.empty()) {
+        auto& tail = slabs_.back();
+        if (tail.capacity - tail.tail >= len)
+            return tail;
+    }
+
+    slab next;
+    if (len > slab_size_) {
+        next.data.reset(new uint8_t[len]);
+        next.capacity = len;
+    } else {
+        if (spare_.empty()) {
+            next.data.reset(new uint8_t[slab_size_]);
+        } else {
+            next.data = std::move(spare_.back());
+            spare_.pop_back();
+        }
+        next.capacity = slab_size_;
+    }
+    slabs_.push_back(std::move(next));
+    return slabs_.back();
+}
+
+void wire_queue::push(const uint8_t* msg, size_t len)
+{
+    CHECK(len >= 8 && length(msg) == len, "Malformed OpenFlow message");
+
+    auto& tail = tail_slab(len);
+    std::memcpy(tail.data.get() + tail.tail, msg, len);
+    tail.tail += len;
+    ++count_;
+    bytes_ += len;
+}
+
+auto wire_queue::front(size_t max) const -> span
+{
+    span ret {nullptr, 0, 0};
+    if (slabs_.empty())
+        return ret;
+
+    auto& head = slabs_.front();
+    const uint8_t* begin = head.data.get() + head.head;
+    const uint8_t* end = head.data.get() + head.tail;
+    ret.data = begin;
+    for (auto p = begin; p < end && ret.count < max; ++ret.count) {
+        size_t len = length(p);
+        p += len;
+        ret.len += len;
+    }
+    return ret;
+}
+
+void wire_queue::pop(size_t count)
+{
+    while (count > 0) {
+        ASSERT(not slabs_.empty());
+        auto& head = slabs_.front();
+
+        size_t len = length(head.data.get() + head.head);
+        head.head += len;
+        bytes_ -= len;
+        --count_;
+        --count;
+
+        if (head.head == head.tail) {
+            // the tail slab is rewound, not released
+            if (slabs_.size() == 1) {
+                head.head = head.tail = 0;
+                break;
+            }
+            if (head.capacity == slab_size_ && spare_.size() < spare_slabs)
+                spare_.push_back(std::move(head.data));
+            slabs_.pop_front();
+        }
+    }
+}
+
+} // namespace runos
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace runos {
+
+/**
+ * FIFO of packed OpenFlow messages stored back to back in slabs.
+ *
+ * Messages are copied into the tail slab, their boundaries come from
+ * the length in the OpenFlow header, so nothing is allocated per
+ * message. Drained slabs are kept for reuse (up to `spare_slabs`), a
+ * message larger than a slab gets a slab of its own size which is freed
+ * after it. front() returns messages that are contiguous in memory to
+ * be written with a single send.
+ *
+ * Not thread-safe.
+ */
+class wire_queue {
+public:
+    static constexpr size_t default_slab_size = 64 * 1024;
+    static constexpr size_t spare_slabs = 4;
+
+    struct span {
+        const uint8_t* data;
+        size_t len;   // bytes
+        size_t count; // messages
+    };
+
+    explicit wire_queue(size_t slab_size = default_slab_size);
+
+    // `len` must match the length in the message header
+    void push(const uint8_t* msg, size_t len);
+
+    bool empty() const { return count_ == 0; }
+    // Messages queued
+    size_t size() const { return count_; }
+    size_t bytes() const { return bytes_; }
+    // Slabs allocated, in use or spare
+    size_t slabs() const { return slabs_.size() + spare_.size(); }
+
+    // Up to `max` messages from the front, contiguous in memory
+    span front(size_t max) const;
+    // Drops `count` messages from the front
+    void pop(size_t count);
+
+private:
+    struct slab {
+        std::unique_ptr<uint8_t[]> data;
+        size_t capacity;
+        size_t head {0};
+        size_t tail {0};
+    };
+
+    size_t slab_size_;
+    std::deque<slab> slabs_;
+    std::vector<std::unique_ptr<uint8_t[]>> spare_;
+    size_t count_ {0};
+    size_t bytes_ {0};
+
+    slab& tail_slab(size_t len);
+    static size_t length(const uint8_t* msg);
+};
+
+} // namespace runos
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "work_stealing_executor.hpp"
+
+#include <runos/core/catch_all.hpp>
+
+#include <boost/thread/concurrent_queues/sync_queue.hpp>
+
+#include <algorithm>
+
+namespace runos {
+
+namespace {
+
+struct worker_identity {
+    const void* executor {nullptr};
+    size_t index {0};
+};
+
+thread_local worker_identity current;
+
+} // namespace
+
+work_stealing_executor::work_stealing_executor(size_t nthreads)
+{
+    if (nthreads == 0)
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (size_t i = 0; i < nthreads; ++i) {
+        workers_.emplace_back(new worker);
+    }
+    // all deques exist before any worker looks for something to steal
+    for (size_t i = 0; i < nthreads; ++i) {
+        workers_[i]->thread = std::thread([this, i]() { run(i); });
+    }
+}
+
+work_stealing_executor::~work_stealing_executor()
+{
+    close();
+    for (auto& w : workers_) {
+        w->thread.join();
+    }
+}
+
+void work_stealing_executor::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        closed_ = true;
+    }
+    idle_.notify_all();
+}
+
+void work_stealing_executor::push(task t)
+{
+    if (closed_)
+        throw boost::sync_queue_is_closed();
+
+    size_t i = self();
+    if (i == workers_.size())
+        i = next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+
+    {
+        std::lock_guard<std::mutex> lock(workers_[i]->mutex);
+        workers_[i]->tasks.push_back(std::move(t));
+    }
+    // pending_ grows after the closure is visible, and a worker going
+    // to sleep checks pending_ after announcing itself: one of the two
+    // sees the other, so the wakeup is never lost
+    pending_.fetch_add(1);
+    if (sleepers_.load() > 0) {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        idle_.notify_one();
+    }
+}
+
+bool work_stealing_executor::take(size_t self, task& t)
+{
+    size_t n = workers_.size();
+    if (self < n) {
+        auto& own = *workers_[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (not own.tasks.empty()) {
+            t = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            pending_.fetch_sub(1);
+            return true;
+        }
+    }
+
+    size_t start = self < n ? self + 1 : next_.load(std::memory_order_relaxed);
+    for (size_t k = 0; k < n; ++k) {
+        auto& victim = *workers_[(start + k) % n];
+        if (&victim == (self < n ? workers_[self].get() : nullptr))
+            continue;
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (not victim.tasks.empty()) {
+            t = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            pending_.fetch_sub(1);
+            if (self < n)
+                stolen_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void work_stealing_executor::execute(task& t)
+{
+    catch_all_and_log(t);
+    t = task();
+    executed_.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool work_stealing_executor::try_executing_one()
+{
+    task t;
+    if (not take(self(), t))
+        return false;
+    execute(t);
+    return true;
+}
+
+void work_stealing_executor::run(size_t self)
+{
+    current = worker_identity{ this, self };
+
+    task t;
+    for (;;) {
+        if (take(self, t)) {
+            execute(t);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(idle_mutex_);
+        sleepers_.fetch_add(1);
+        idle_.wait(lock, [this]() { return pending_.load() > 0 || closed_; });
+        sleepers_.fetch_sub(1);
+        if (closed_ && pending_.load() == 0)
+            return;
+    }
+}
+
+size_t work_stealing_executor::self() const
+{
+    return current.executor == this ? current.index : workers_.size();
+}
+
+} // namespace runos
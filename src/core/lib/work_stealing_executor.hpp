@@ -0,0 +1,142 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Executor with a deque per worker thread and work stealing, for
+ * future continuations which need no Qt thread affinity.
+ *
+ * Has the interface of qt_executor (submit, close, try_executing_one,
+ * reschedule_until), so `f.then(executor, ...)` and `async(executor,
+ * ...)` work the same. Closures submitted from a worker go to its own
+ * deque and run LIFO there, while they are hot in cache; others are
+ * spread round-robin. An idle worker steals the oldest closure of
+ * another one. Continuations on it run concurrently: state they share
+ * must be locked, and QObjects must not be touched except by queued
+ * signals.
+ */
+class work_stealing_executor {
+public:
+    // 0 threads means one per core
+    explicit work_stealing_executor(size_t nthreads = 0);
+    // Runs the closures already submitted, then joins the workers.
+    // Must not be called from a worker, so owners of the executor
+    // shouldn't be released by its own continuations.
+    ~work_stealing_executor();
+
+    work_stealing_executor(const work_stealing_executor&) = delete;
+    work_stealing_executor& operator=(const work_stealing_executor&) = delete;
+
+    template<class Closure>
+    void submit(Closure&& closure)
+    {
+        push(task(std::forward<Closure>(closure)));
+    }
+
+    // Following submit() throw boost::sync_queue_is_closed
+    void close();
+    bool closed() const { return closed_.load(); }
+
+    // Runs one pending closure on the calling thread
+    bool try_executing_one();
+
+    template<class Pred>
+    bool reschedule_until(Pred const& pred)
+    {
+        do {
+            if (not try_executing_one())
+                return false;
+        } while (not pred());
+        return true;
+    }
+
+    size_t size() const { return workers_.size(); }
+    uint64_t executed() const { return executed_.load(); }
+    uint64_t stolen() const { return stolen_.load(); }
+
+private:
+    // Move-only type erasure: boost continuations can't be copied
+    class task {
+    public:
+        task() = default;
+
+        template<class F, class = std::enable_if_t<
+            not std::is_same<std::decay_t<F>, task>::value>>
+        explicit task(F&& f)
+            : impl_(new model<std::decay_t<F>>(std::forward<F>(f)))
+        { }
+
+        void operator()() { impl_->run(); }
+        explicit operator bool() const { return bool(impl_); }
+
+    private:
+        struct concept_t {
+            virtual ~concept_t() = default;
+            virtual void run() = 0;
+        };
+
+        template<class F>
+        struct model final : concept_t {
+            template<class G>
+            explicit model(G&& g) : f(std::forward<G>(g)) { }
+            void run() override { f(); }
+            F f;
+        };
+
+        std::unique_ptr<concept_t> impl_;
+    };
+
+    struct worker {
+        std::mutex mutex;
+        std::deque<task> tasks;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<worker>> workers_;
+    std::atomic<size_t> next_ {0}; // round-robin for outside submitters
+    std::atomic<size_t> pending_ {0}; // pushed and not taken yet
+    std::atomic<size_t> sleepers_ {0};
+    std::atomic<bool> closed_ {false};
+    std::atomic<uint64_t> executed_ {0};
+    std::atomic<uint64_t> stolen_ {0};
+
+    std::mutex idle_mutex_;
+    std::condition_variable idle_;
+
+    void push(task t);
+    bool take(size_t self, task& t);
+    void execute(task& t);
+    void run(size_t self);
+    // Index of the calling thread among the workers, or size()
+    size_t self() const;
+};
+
+} // namespace runos
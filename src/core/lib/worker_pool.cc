@@ -0,0 +1,123 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "worker_pool.hpp"
+#include "flight_recorder.hpp"
+
+#include <runos/core/assert.hpp>
+#include <runos/core/catch_all.hpp>
+#include <runos/core/logging.hpp>
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace runos {
+
+// Lock waits of submitters and the batches workers take
+static const uint16_t flight_site = flight::intern("worker-pool");
+
+WorkerPool::WorkerPool(size_t nthreads, bool pin)
+{
+    CHECK(nthreads > 0);
+
+    unsigned ncpu = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < nthreads; ++i) {
+        workers_.emplace_back(new Worker);
+        auto& worker = *workers_.back();
+        worker.thread = std::thread([&worker]() { worker.run(); });
+
+#ifdef __linux__
+        if (pin) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(i % ncpu, &cpuset);
+            if (pthread_setaffinity_np(worker.thread.native_handle(),
+                                       sizeof(cpuset), &cpuset) != 0) {
+                LOG(WARNING) << "[WorkerPool] Can't pin worker " << i
+                             << " to cpu " << i % ncpu;
+            }
+        }
+#else
+        (void) pin;
+        (void) ncpu;
+#endif
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    for (auto& worker : workers_) {
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->stop = true;
+        }
+        worker->cv.notify_one();
+    }
+    for (auto& worker : workers_) {
+        worker->thread.join();
+    }
+}
+
+size_t WorkerPool::worker_for(uint64_t key) const
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key % workers_.size();
+}
+
+void WorkerPool::submit(uint64_t key, Task task)
+{
+    auto& worker = *workers_[worker_for(key)];
+    {
+        flight::lock_guard<std::mutex> lock(worker.mutex, flight_site);
+        worker.tasks.push_back(std::move(task));
+    }
+    worker.cv.notify_one();
+}
+
+size_t WorkerPool::queue_size(size_t worker) const
+{
+    std::lock_guard<std::mutex> lock(workers_.at(worker)->mutex);
+    return workers_[worker]->tasks.size();
+}
+
+void WorkerPool::Worker::run()
+{
+    std::deque<Task> batch;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return stop || not tasks.empty(); });
+            if (tasks.empty() && stop)
+                return;
+            batch.swap(tasks);
+        }
+        flight::record(flight::kind::queue_depth, flight_site, 0,
+                       uint32_t(batch.size()));
+
+        for (auto& task : batch) {
+            catch_all_and_log(task);
+        }
+        batch.clear();
+    }
+}
+
+} // namespace runos
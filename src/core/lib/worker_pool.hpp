@@ -0,0 +1,71 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Fixed set of worker threads where every key is served by exactly
+ * one worker. Tasks submitted with the same key run in FIFO order and
+ * never concurrently, so per-key state needs no locking.
+ */
+class WorkerPool {
+public:
+    using Task = std::function<void()>;
+
+    /**
+     * @param nthreads number of workers, must be positive.
+     * @param pin      bind worker i to CPU (i mod hardware_concurrency).
+     */
+    explicit WorkerPool(size_t nthreads, bool pin = false);
+    ~WorkerPool();
+
+    WorkerPool(WorkerPool const&) = delete;
+    WorkerPool& operator=(WorkerPool const&) = delete;
+
+    size_t size() const { return workers_.size(); }
+    size_t worker_for(uint64_t key) const;
+
+    void submit(uint64_t key, Task task);
+
+    // Number of tasks waiting in the worker's queue
+    size_t queue_size(size_t worker) const;
+
+private:
+    struct Worker {
+        mutable std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<Task> tasks;
+        bool stop {false};
+        std::thread thread;
+
+        void run();
+    };
+
+    std::vector< std::unique_ptr<Worker> > workers_;
+};
+
+} // namespace runos
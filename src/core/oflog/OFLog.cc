@@ -17,6 +17,10 @@
 #include <runos/core/logging.hpp>
 
 #include "../OFServer.hpp"
+#include "../lib/capture_ring.hpp"
+
+#include <memory>
+#include <stdexcept>
 
 extern "C"
 #undef OFP_VERSION
@@ -50,9 +54,14 @@ public:
     static void print(fluid_msg::OFMsg& fluid_msg, print_direction d)
     {
         auto buf = fluid_msg.pack();
+        print(buf, fluid_msg.length(), d);
+        fluid_msg::OFMsg::free_buffer(buf);
+    }
 
+    static void print(uint8_t* buf, size_t len, print_direction d)
+    {
         struct ofl_msg_header* msg = nullptr;
-        ofl_msg_unpack(buf, fluid_msg.length(), &msg, NULL, NULL);
+        ofl_msg_unpack(buf, len, &msg, NULL, NULL);
         if (msg) {
             //char* serialized = ofl_msg_to_string(msg, NULL);
             fprintf(stderr, (d == print_in) ? "> " : "< ");
@@ -63,7 +72,6 @@ public:
         }
 
         ofl_msg_free(msg, NULL);
-        fluid_msg::OFMsg::free_buffer(buf);
     }
 
     struct ReceiveHandler
@@ -82,10 +90,45 @@ public:
         }
     };
 
-    void init(Loader* loader, const Config& /*rootConfig*/) override
+    ~OFLog()
+    {
+        if (capture) {
+            LOG(INFO) << "[OFLog] Captured " << capture->written()
+                      << " messages, dropped " << capture->dropped();
+        }
+    }
+
+    void init(Loader* loader, const Config& rootConfig) override
     {
-        //const Config& config = config_cd(rootConfig, "oflog");
+        const Config& config = config_cd(rootConfig, "oflog");
         auto ofserver = OFServer::get(loader);
+
+        // "text" prints every message to stderr on the I/O thread,
+        // "capture" only copies raw bytes and writes a pcap file aside
+        std::string mode = config_get(config, "mode", "text");
+        if (mode == "capture") {
+            CaptureRing::Settings settings;
+            settings.path = config_get(config, "file", "oflog.pcap");
+            settings.ring_size =
+                size_t(config_get(config, "ring-kb", 1024)) * 1024;
+            settings.snaplen = config_get(config, "snaplen", 65535);
+            settings.flush_interval = std::chrono::milliseconds(
+                config_get(config, "flush-interval-ms", 100));
+
+            capture = std::make_unique<CaptureRing>(settings);
+            auto ring = capture.get();
+            ofserver->set_message_tap(
+                [ring](uint64_t dpid, bool outgoing,
+                       const uint8_t* data, size_t len) {
+                    ring->record(dpid, outgoing, data, len);
+                });
+            LOG(INFO) << "[OFLog] Capturing OpenFlow messages to "
+                      << settings.path;
+            return;
+        }
+        THROW_IF(mode != "text", std::invalid_argument("oflog.mode"),
+                 "Unknown mode: {}", mode);
+
         QObject::connect(ofserver, &OFServer::switchDiscovered,
                          this, &OFLog::onSwitchDiscovered,
                          Qt::DirectConnection);
@@ -105,6 +148,7 @@ public slots:
 private:
     std::shared_ptr<ReceiveHandler> recv_handler;
     std::shared_ptr<SendHandler> send_handler;
+    std::unique_ptr<CaptureRing> capture;
 };
 
 REGISTER_APPLICATION(OFLog, {""})
@@ -0,0 +1,291 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+ 
+#pragma once
+
+#include <runos/core/assert.hpp>
+
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "compiled_match.hh"
+
+namespace runos {
+namespace oxm {
+
+/**
+ * Tuple space search classifier.
+ *
+ * Rules are field sets with a priority and a payload. Rules with the
+ * same mask share a hash table (a subtable) keyed by the masked value,
+ * so a lookup costs one hash probe per distinct mask rather than one
+ * compare per rule. Subtables are visited in order of their highest
+ * priority and the search stops once no remaining subtable can beat
+ * the match found so far.
+ *
+ * Lookups are staged: a subtable also keeps hashes of the masked key
+ * prefixes up to each key word, so a packet that already differs in
+ * the first words is rejected without hashing the whole key.
+ */
+template<class T>
+class classifier {
+public:
+    static constexpr size_t max_words = 8;
+    using key_type = std::array<uint64_t, max_words>;
+
+    explicit classifier(match_layout layout)
+        : m_layout(std::move(layout))
+    {
+        ASSERT(m_layout.words() <= max_words, "Match layout is too wide");
+    }
+
+    const match_layout& layout() const noexcept
+    { return m_layout; }
+
+    size_t size() const noexcept
+    { return m_size; }
+
+    size_t subtables() const noexcept
+    { return m_order.size(); }
+
+    // Adds a rule or replaces the payload of one with the same match and
+    // priority. Returns false if the match doesn't fit the layout.
+    bool insert(const field_set& match, int priority, T payload)
+    {
+        key_type value{}, mask{};
+        if (not m_layout.compile(match, value.data(), mask.data()))
+            return false;
+
+        auto& st = m_subtables[mask];
+        if (not st) {
+            st.reset(new subtable(mask, m_layout.words()));
+        }
+
+        auto& rules = st->rules[value];
+        auto it = std::find_if(rules.begin(), rules.end(),
+                               [priority](const rule& r) {
+                                   return r.priority <= priority;
+                               });
+        if (it != rules.end() && it->priority == priority) {
+            it->payload = std::move(payload);
+            return true;
+        }
+
+        if (rules.empty()) {
+            st->add_stages(value, +1);
+        }
+        rules.insert(it, rule{priority, std::move(payload)});
+        ++st->priorities[priority];
+        ++m_size;
+        reorder();
+        return true;
+    }
+
+    // Returns true if the rule was found and removed
+    bool erase(const field_set& match, int priority)
+    {
+        key_type value{}, mask{};
+        if (not m_layout.compile(match, value.data(), mask.data()))
+            return false;
+
+        auto st_it = m_subtables.find(mask);
+        if (st_it == m_subtables.end())
+            return false;
+        auto& st = *st_it->second;
+
+        auto rules_it = st.rules.find(value);
+        if (rules_it == st.rules.end())
+            return false;
+        auto& rules = rules_it->second;
+
+        auto it = std::find_if(rules.begin(), rules.end(),
+                               [priority](const rule& r) {
+                                   return r.priority == priority;
+                               });
+        if (it == rules.end())
+            return false;
+
+        rules.erase(it);
+        if (rules.empty()) {
+            st.add_stages(value, -1);
+            st.rules.erase(rules_it);
+        }
+        if (--st.priorities[priority] == 0) {
+            st.priorities.erase(priority);
+        }
+        if (st.rules.empty()) {
+            m_subtables.erase(st_it);
+        }
+        --m_size;
+        reorder();
+        return true;
+    }
+
+    void clear()
+    {
+        m_subtables.clear();
+        m_order.clear();
+        m_size = 0;
+    }
+
+    // Payload of the highest priority rule matching the key, or nullptr
+    const T* lookup(const uint64_t* key) const
+    {
+        const rule* best = nullptr;
+        size_t words = m_layout.words();
+
+        for (const subtable* st : m_order) {
+            if (best && st->max_priority() <= best->priority)
+                break;
+
+            key_type masked{};
+            for (size_t i = 0; i < words; ++i) {
+                masked[i] = key[i] & st->mask[i];
+            }
+            if (not st->stages_match(masked))
+                continue;
+
+            auto it = st->rules.find(masked);
+            if (it == st->rules.end())
+                continue;
+
+            const rule& top = it->second.front();
+            if (not best || top.priority > best->priority)
+                best = &top;
+        }
+
+        return best ? &best->payload : nullptr;
+    }
+
+    // As with `field_set & packet`, the packet must have every field
+    // of the layout
+    const T* lookup(const Packet& pkt) const
+    {
+        key_type key{};
+        for (const auto& s : m_layout.slots()) {
+            auto f = pkt.load(oxm::mask<>(s.type));
+            match_layout::deposit(key.data(), s.offset, f.value_bits());
+        }
+        return lookup(key.data());
+    }
+
+private:
+    struct rule {
+        int priority;
+        T payload;
+    };
+
+    struct key_hash {
+        size_t operator()(const key_type& key) const noexcept
+        {
+            uint64_t h = 0;
+            for (uint64_t word : key) {
+                h = mix(h, word);
+            }
+            return h;
+        }
+    };
+
+    static uint64_t mix(uint64_t h, uint64_t word) noexcept
+    {
+        h ^= word + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        return h * 0xff51afd7ed558ccdULL;
+    }
+
+    struct subtable {
+        key_type mask;
+        // key words (but the last) ending a stage, with the number of
+        // rule keys having each prefix hash
+        std::vector<size_t> stage_ends;
+        std::vector<std::unordered_map<uint64_t, size_t>> stages;
+        // rules sharing a masked value, highest priority first
+        std::unordered_map<key_type, std::vector<rule>, key_hash> rules;
+        std::map<int, size_t> priorities;
+
+        subtable(const key_type& mask, size_t words)
+            : mask(mask)
+        {
+            size_t last = 0;
+            for (size_t i = 0; i < words; ++i) {
+                if (mask[i]) last = i;
+            }
+            for (size_t i = 0; i < last; ++i) {
+                if (mask[i]) stage_ends.push_back(i);
+            }
+            stages.resize(stage_ends.size());
+        }
+
+        int max_priority() const
+        { return priorities.empty() ? INT_MIN : priorities.rbegin()->first; }
+
+        void add_stages(const key_type& value, int delta)
+        {
+            uint64_t h = 0;
+            for (size_t s = 0, i = 0; s < stage_ends.size(); ++s) {
+                for (; i <= stage_ends[s]; ++i) {
+                    h = mix(h, value[i]);
+                }
+                auto& count = stages[s][h];
+                count += delta;
+                if (count == 0) {
+                    stages[s].erase(h);
+                }
+            }
+        }
+
+        bool stages_match(const key_type& masked) const
+        {
+            uint64_t h = 0;
+            for (size_t s = 0, i = 0; s < stage_ends.size(); ++s) {
+                for (; i <= stage_ends[s]; ++i) {
+                    h = mix(h, masked[i]);
+                }
+                if (not stages[s].count(h))
+                    return false;
+            }
+            return true;
+        }
+    };
+
+    void reorder()
+    {
+        m_order.clear();
+        for (auto& st : m_subtables) {
+            m_order.push_back(st.second.get());
+        }
+        std::sort(m_order.begin(), m_order.end(),
+                  [](const subtable* a, const subtable* b) {
+                      return a->max_priority() > b->max_priority();
+                  });
+    }
+
+    match_layout m_layout;
+    size_t m_size = 0;
+    std::unordered_map<key_type, std::unique_ptr<subtable>, key_hash>
+        m_subtables;
+    // subtables by their highest priority, descending
+    std::vector<const subtable*> m_order;
+};
+
+} // namespace oxm
+} // namespace runos
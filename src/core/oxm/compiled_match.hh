@@ -0,0 +1,214 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+ 
+#pragma once
+
+#include <runos/core/assert.hpp>
+
+#include <boost/dynamic_bitset.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <vector>
+
+#include "field_set.hh"
+
+namespace runos {
+namespace oxm {
+
+// Fixed bit layout for a list of oxm types: every type gets its own
+// range of bits in a key of words() uint64's, in the order given.
+class match_layout {
+public:
+    struct slot {
+        class type type;
+        size_t offset;
+    };
+
+    match_layout(std::initializer_list<class type> types)
+    {
+        size_t offset = 0;
+        for (auto t : types) {
+            ASSERT(not find(t), "Duplicate type in match layout");
+            m_slots.push_back(slot{t, offset});
+            offset += t.nbits();
+        }
+        m_words = (offset + 63) / 64;
+    }
+
+    size_t words() const noexcept
+    { return m_words; }
+
+    const std::vector<slot>& slots() const noexcept
+    { return m_slots; }
+
+    const slot* find(const class type t) const noexcept
+    {
+        auto it = std::find_if(m_slots.begin(), m_slots.end(),
+                               [t](const slot& s) { return s.type == t; });
+        return it == m_slots.end() ? nullptr : &*it;
+    }
+
+    // Packs the field set into value/mask keys of words() uint64's.
+    // Returns false if it has a type that is not in the layout.
+    bool compile(const field_set& fs, uint64_t* value, uint64_t* mask) const
+    {
+        std::fill(value, value + m_words, 0);
+        std::fill(mask, mask + m_words, 0);
+        for (const field<>& f : fs) {
+            auto s = find(f.type());
+            if (not s)
+                return false;
+            deposit(value, s->offset, f.value_bits() & f.mask_bits());
+            deposit(mask, s->offset, f.mask_bits());
+        }
+        return true;
+    }
+
+    // ORs bits of `b` into the key starting at bit `offset`
+    static void deposit(uint64_t* key, size_t offset, const bits<>& b)
+    {
+        // oxm fields are at most 128 bits wide
+        uint8_t blocks[32];
+        CHECK(b.num_blocks() <= sizeof(blocks));
+        boost::to_block_range(b, blocks); // least significant first
+
+        for (size_t i = 0, n = b.num_blocks(); i < n; ++i) {
+            uint64_t block = blocks[i];
+            size_t pos = offset + i * 8;
+            size_t word = pos / 64, shift = pos % 64;
+            key[word] |= block << shift;
+            if (shift > 56 && (block >> (64 - shift)))
+                key[word + 1] |= block >> (64 - shift);
+        }
+    }
+
+private:
+    std::vector<slot> m_slots;
+    size_t m_words;
+};
+
+// Field sets compiled into value/mask keys of one layout, laid out
+// contiguously, so matching a packet against all of them is a linear
+// scan of AND/XOR over a few words per entry instead of a hash lookup
+// and bits compare per field.
+//
+// As with `field_set & packet`, the packet must have every field
+// used by some entry.
+class compiled_match_set {
+public:
+    static constexpr size_t npos = size_t(-1);
+
+    explicit compiled_match_set(match_layout layout)
+        : m_layout(std::move(layout))
+        , m_used(m_layout.slots().size(), false)
+    { }
+
+    const match_layout& layout() const noexcept
+    { return m_layout; }
+
+    size_t size() const noexcept
+    { return m_size; }
+
+    // Returns false and adds nothing if the field set doesn't fit the layout
+    bool add(const field_set& fs)
+    {
+        size_t w = m_layout.words();
+        m_values.resize(m_values.size() + w);
+        m_masks.resize(m_masks.size() + w);
+
+        uint64_t* value = m_values.data() + m_size * w;
+        uint64_t* mask = m_masks.data() + m_size * w;
+        if (not m_layout.compile(fs, value, mask)) {
+            m_values.resize(m_size * w);
+            m_masks.resize(m_size * w);
+            return false;
+        }
+
+        for (const field<>& f : fs) {
+            m_used[m_layout.find(f.type()) - m_layout.slots().data()] = true;
+        }
+        ++m_size;
+        return true;
+    }
+
+    void clear()
+    {
+        m_size = 0;
+        m_values.clear();
+        m_masks.clear();
+        m_used.assign(m_used.size(), false);
+    }
+
+    // Builds the packet key, loading only fields some entry uses
+    void extract(const Packet& pkt, uint64_t* key) const
+    {
+        const auto& slots = m_layout.slots();
+        std::fill(key, key + m_layout.words(), 0);
+        for (size_t i = 0; i < slots.size(); ++i) {
+            if (not m_used[i])
+                continue;
+            auto f = pkt.load(mask<>(slots[i].type));
+            match_layout::deposit(key, slots[i].offset, f.value_bits());
+        }
+    }
+
+    // Index of the first entry matching the key, npos if none
+    size_t find(const uint64_t* key, size_t from = 0) const
+    {
+        size_t w = m_layout.words();
+        const uint64_t* value = m_values.data() + from * w;
+        const uint64_t* mask = m_masks.data() + from * w;
+        for (size_t i = from; i < m_size; ++i, value += w, mask += w) {
+            uint64_t diff = 0;
+            for (size_t j = 0; j < w; ++j) {
+                diff |= (key[j] ^ value[j]) & mask[j];
+            }
+            if (diff == 0)
+                return i;
+        }
+        return npos;
+    }
+
+    size_t find(const Packet& pkt) const
+    {
+        std::vector<uint64_t> key(m_layout.words());
+        extract(pkt, key.data());
+        return find(key.data());
+    }
+
+    // Appends indexes of all entries matching the key
+    template<class OutputIt>
+    OutputIt find_all(const uint64_t* key, OutputIt out) const
+    {
+        for (size_t i = find(key); i != npos; i = find(key, i + 1)) {
+            *out++ = i;
+        }
+        return out;
+    }
+
+private:
+    match_layout m_layout;
+    std::vector<bool> m_used;
+    size_t m_size = 0;
+    std::vector<uint64_t> m_values;
+    std::vector<uint64_t> m_masks;
+};
+
+} // namespace oxm
+} // namespace runos
@@ -14,17 +14,18 @@
  * limitations under the License.
  */
 
-#pragma once
 
 #include "query_impl.hh"
+#include "compiled_match.hh"
+#include "field_set.hh"
+
+#include <cstdint>
+#include <limits>
+#include <vector>
 
 namespace runos {
 namespace oxm {
 
-struct lvalue_grammar
-    : impl::lvalue_grammar
-{ };
-
 struct predicate_grammar
     : impl::predicate_grammar
 { };
@@ -33,9 +34,266 @@ struct query_grammar
     : impl::query_grammar
 { };
 
-BOOST_PROTO_DEFINE_OPERATORS(impl::is_terminal, boost::proto::default_domain);
+// Starts a query: a field<T>, value<T> or field_set combined with
+// others through &&, || and !, e.g.
+//     query(eth_type() == 0x0800) && !query(ip_proto() == 6)
+template<class Predicate>
+auto query(const Predicate& pred)
+{
+    static_assert(impl::is_predicate<Predicate>::value,
+                  "oxm query predicates are fields, values and field sets");
+    return boost::proto::as_expr<impl::query_domain>(pred);
+}
+
+namespace impl {
+
+template<class T>
+bool test(const field<T>& f, const Packet& pkt)
+{ return pkt.test(field<>(f)); }
+
+template<class T>
+bool test(const value<T>& v, const Packet& pkt)
+{ return pkt.test(field<>(v)); }
+
+inline bool test(const field_set& fs, const Packet& pkt)
+{ return fs & pkt; }
+
+template<class Expr>
+bool eval(const Expr& e, const Packet& pkt)
+{ return eval(e, pkt, typename proto::tag_of<Expr>::type()); }
+
+template<class Expr>
+bool eval(const Expr& e, const Packet& pkt, proto::tag::terminal)
+{ return test(proto::value(e), pkt); }
+
+template<class Expr>
+bool eval(const Expr& e, const Packet& pkt, proto::tag::logical_and)
+{ return eval(proto::left(e), pkt) && eval(proto::right(e), pkt); }
+
+template<class Expr>
+bool eval(const Expr& e, const Packet& pkt, proto::tag::logical_or)
+{ return eval(proto::left(e), pkt) || eval(proto::right(e), pkt); }
+
+template<class Expr>
+bool eval(const Expr& e, const Packet& pkt, proto::tag::logical_not)
+{ return not eval(proto::child_c<0>(e), pkt); }
+
+} // namespace impl
+
+// Evaluates the query on a packet or a field set, loading fields
+// as they are reached
+template<class Expr>
+bool evaluate(const Expr& e, const Packet& pkt)
+{
+    static_assert(boost::proto::matches<Expr, query_grammar>::value,
+                  "Not an oxm query");
+    return impl::eval(e, pkt);
+}
+
+// Queries compiled into flat programs over the keys of one match
+// layout. Every predicate becomes a compare of a masked key word per
+// word it spans, and &&, || and ! become the jump targets of those
+// compares, so evaluation is a loop over a plain array: no virtual
+// calls, no field lookups, no allocation. A packet key is built once
+// and then every query runs on it.
+//
+// As with compiled_match_set, the packet must have every field used
+// by some query.
+class compiled_query_set {
+public:
+    static constexpr size_t npos = size_t(-1);
+
+    explicit compiled_query_set(match_layout layout)
+        : m_layout(std::move(layout))
+        , m_used(m_layout.slots().size(), false)
+    { }
+
+    const match_layout& layout() const noexcept
+    { return m_layout; }
+
+    size_t size() const noexcept
+    { return m_entries.size(); }
+
+    // Returns false and adds nothing if the query has a type that is
+    // not in the layout
+    template<class Expr>
+    bool add(const Expr& e)
+    {
+        static_assert(boost::proto::matches<Expr, query_grammar>::value,
+                      "Not an oxm query");
+        builder b { *this, {}, {}, true };
+        uint32_t entry = b.emit(e, accept, reject,
+                                typename boost::proto::tag_of<Expr>::type());
+        if (not b.ok)
+            return false;
+
+        // targets were numbered from the end of the program
+        m_ops.insert(m_ops.end(), b.ops.begin(), b.ops.end());
+        for (auto slot : b.slots)
+            m_used[slot] = true;
+        m_entries.push_back(entry);
+        return true;
+    }
+
+    void clear()
+    {
+        m_ops.clear();
+        m_entries.clear();
+        m_used.assign(m_used.size(), false);
+    }
+
+    // Builds the packet key, loading only fields some query uses
+    void extract(const Packet& pkt, uint64_t* key) const
+    {
+        const auto& slots = m_layout.slots();
+        std::fill(key, key + m_layout.words(), 0);
+        for (size_t i = 0; i < slots.size(); ++i) {
+            if (not m_used[i])
+                continue;
+            auto f = pkt.load(mask<>(slots[i].type));
+            match_layout::deposit(key, slots[i].offset, f.value_bits());
+        }
+    }
+
+    bool test(size_t query, const uint64_t* key) const
+    {
+        const op* ops = m_ops.data();
+        uint32_t pc = m_entries[query];
+        // jumps only go backwards, down to a verdict
+        while (pc < reject) {
+            const op& o = ops[pc];
+            pc = (key[o.word] & o.mask) == o.value ? o.on_match : o.on_mismatch;
+        }
+        return pc == accept;
+    }
+
+    // Index of the first query true on the key, npos if none
+    size_t find(const uint64_t* key, size_t from = 0) const
+    {
+        for (size_t i = from; i < m_entries.size(); ++i) {
+            if (test(i, key))
+                return i;
+        }
+        return npos;
+    }
+
+    size_t find(const Packet& pkt) const
+    {
+        std::vector<uint64_t> key(m_layout.words());
+        extract(pkt, key.data());
+        return find(key.data());
+    }
+
+    // Appends indexes of all queries true on the key
+    template<class OutputIt>
+    OutputIt find_all(const uint64_t* key, OutputIt out) const
+    {
+        for (size_t i = find(key); i != npos; i = find(key, i + 1)) {
+            *out++ = i;
+        }
+        return out;
+    }
+
+private:
+    static constexpr uint32_t accept = std::numeric_limits<uint32_t>::max();
+    static constexpr uint32_t reject = accept - 1;
+
+    struct op {
+        uint32_t word;
+        uint32_t on_match;
+        uint32_t on_mismatch;
+        uint64_t mask;
+        uint64_t value;
+    };
+
+    // Emits a subexpression that continues at `t` when true and at `f`
+    // when false, returns its entry; the continuations are emitted
+    // first, so jumps always go to lower addresses
+    struct builder {
+        const compiled_query_set& set;
+        std::vector<op> ops;
+        std::vector<size_t> slots;
+        bool ok;
+
+        uint32_t next_pc() const
+        { return uint32_t(set.m_ops.size() + ops.size()); }
+
+        uint32_t leaf(const field<>& f, uint32_t t, uint32_t fail)
+        {
+            const auto& layout = set.m_layout;
+            auto s = layout.find(f.type());
+            if (not s) {
+                ok = false;
+                return t;
+            }
+            slots.push_back(size_t(s - layout.slots().data()));
+
+            std::vector<uint64_t> value(layout.words()), mask(layout.words());
+            match_layout::deposit(value.data(), s->offset,
+                                  f.value_bits() & f.mask_bits());
+            match_layout::deposit(mask.data(), s->offset, f.mask_bits());
+            for (size_t w = layout.words(); w-- > 0; ) {
+                if (mask[w] == 0)
+                    continue;
+                uint32_t pc = next_pc();
+                ops.push_back(op{ uint32_t(w), t, fail, mask[w], value[w] });
+                t = pc;
+            }
+            return t;
+        }
+
+        template<class T>
+        uint32_t predicate(const field<T>& f, uint32_t t, uint32_t fail)
+        { return leaf(field<>(f), t, fail); }
+
+        template<class T>
+        uint32_t predicate(const value<T>& v, uint32_t t, uint32_t fail)
+        { return leaf(field<>(v), t, fail); }
+
+        uint32_t predicate(const field_set& fs, uint32_t t, uint32_t fail)
+        {
+            for (const field<>& f : fs) {
+                t = leaf(f, t, fail);
+            }
+            return t;
+        }
+
+        template<class Expr>
+        uint32_t child(const Expr& e, uint32_t t, uint32_t f)
+        { return emit(e, t, f, typename boost::proto::tag_of<Expr>::type()); }
+
+        template<class Expr>
+        uint32_t emit(const Expr& e, uint32_t t, uint32_t f,
+                      boost::proto::tag::terminal)
+        { return predicate(boost::proto::value(e), t, f); }
+
+        template<class Expr>
+        uint32_t emit(const Expr& e, uint32_t t, uint32_t f,
+                      boost::proto::tag::logical_and)
+        {
+            uint32_t rhs = child(boost::proto::right(e), t, f);
+            return child(boost::proto::left(e), rhs, f);
+        }
+
+        template<class Expr>
+        uint32_t emit(const Expr& e, uint32_t t, uint32_t f,
+                      boost::proto::tag::logical_or)
+        {
+            uint32_t rhs = child(boost::proto::right(e), t, f);
+            return child(boost::proto::left(e), t, rhs);
+        }
+
+        template<class Expr>
+        uint32_t emit(const Expr& e, uint32_t t, uint32_t f,
+                      boost::proto::tag::logical_not)
+        { return child(boost::proto::child_c<0>(e), f, t); }
+    };
 
-// TODO: evaluate on oxm set
+    match_layout m_layout;
+    std::vector<bool> m_used;
+    std::vector<op> m_ops;
+    std::vector<uint32_t> m_entries; // entry address per query
+};
 
 } // namespace oxm
 } // namespace runos
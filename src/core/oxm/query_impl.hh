@@ -18,8 +18,8 @@
 #include <type_traits>
 #include <boost/proto/proto.hpp>
 
-#include "lib/ethaddr.hh"
-#include "field_meta.hh"
+#include "field.hh"
+#include "field_set.hh"
 
 namespace runos {
 namespace oxm {
@@ -28,116 +28,73 @@ namespace impl {
 using namespace boost;
 using proto::_;
 
-template<typename T>
-struct is_terminal
-    : boost::mpl::false_
-{};
-
-template<>
-struct is_terminal<ethaddr>
-    : boost::mpl::true_
-{};
-
-// mpl predicates for type checking
-template<typename FieldMeta, typename Mask, typename Enable = void>
-struct check_mask_type
+// Predicates a query is made of: exact or masked fields
+template<typename T, typename Enable = void>
+struct is_predicate
     : mpl::false_
 {};
-template<typename FieldMeta, typename Mask>
-struct check_mask_type<FieldMeta, Mask,
-           typename std::enable_if<
-               std::is_convertible< Mask,
-                   typename FieldMeta::mask_type
-               >::value
-           >::type
-       >
+template<typename T>
+struct is_predicate< field<T> >
     : mpl::true_
 {};
-
-template<typename FieldMeta, typename Value, typename Enable = void>
-struct check_value_type
-    : mpl::false_
+template<typename T>
+struct is_predicate< value<T> >
+    : mpl::true_
 {};
-template<typename FieldMeta, typename Value>
-struct check_value_type<FieldMeta, Value,
+template<typename T>
+struct is_predicate< T,
            typename std::enable_if<
-               std::is_convertible< Value,
-                   typename FieldMeta::value_type
-               >::value
+               std::is_base_of< field_set, T >::value
            >::type
        >
     : mpl::true_
 {};
 
-//template<typename FieldMeta, typename _FieldMeta = FieldMeta>
-//struct is_field_type : mpl::false_
-//{};
-//template<typename FieldMeta>
-//struct is_field_type< FieldMeta,
-//        typename FieldMeta::field_type > 
-//    : mpl::true_
-//{};
-//
-
-struct field_terminal
-    : proto::terminal< proto::convertible_to< const field_meta& > >
-{ };
-
-// A grammar that matches all lvalue oxm queries
-struct lvalue_grammar
-    : proto::or_<
-          field_terminal
-        , proto::and_<
-              proto::bitwise_and<
-                  field_terminal
-                , proto::terminal< _ >
-              >
-            , proto::if_< check_mask_type<
-                  proto::_value(proto::_left),
-                  proto::_value(proto::_right)
-              >() >
-          >
-      >
-{ };
-
-struct extract_field_meta
-    : proto::or_<
-          proto::when<
-              field_terminal
-            , proto::_value
-          >
-        , proto::when<
-              proto::bitwise_and< _, _ >
-            , extract_field_meta(proto::_left)
-          >
+struct predicate_terminal
+    : proto::and_<
+          proto::terminal< _ >
+        , proto::if_< is_predicate< proto::_value >() >
       >
 { };
 
+// A grammar that matches all boolean combinations of predicates
 struct predicate_grammar
     : proto::or_<
           proto::logical_or< predicate_grammar, predicate_grammar >
         , proto::logical_and< predicate_grammar, predicate_grammar >
         , proto::logical_not< predicate_grammar >
-        , proto::and_<
-              proto::or_<
-                  proto::equal_to< lvalue_grammar, proto::terminal<_> >
-                , proto::not_equal_to< lvalue_grammar, proto::terminal<_> >
-              >
-            , proto::if_< check_value_type<
-                  extract_field_meta(proto::_left),
-                  proto::_value(proto::_right)
-              >() >
-          >
-    >
+        , predicate_terminal
+      >
 { };
 
 struct query_grammar
-    : proto::or_<
-          predicate_grammar,
-          lvalue_grammar
-      >
+    : predicate_grammar
 { };
 
+template<class Expr>
+struct query_expr;
+
+// Children are held by value, so a query may outlive the
+// temporaries it was written with
+struct query_domain
+    : proto::domain< proto::generator<query_expr> >
+{
+    template<class T>
+    struct as_child : proto_base_domain::as_expr<T>
+    { };
+};
+
+template<class Expr>
+struct query_expr
+    : proto::extends< Expr, query_expr<Expr>, query_domain >
+{
+    using base = proto::extends< Expr, query_expr<Expr>, query_domain >;
+
+    query_expr(const Expr& expr = Expr())
+        : base(expr)
+    { }
+};
+
 }
 }
 }
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "field.hh"
+
+namespace runos {
+namespace oxm {
+
+// Slot of static_match carrying value and mask of T
+template<class T>
+struct masked { };
+
+namespace detail {
+
+    template<class Slot>
+    struct static_slot {
+        using type = Slot;
+        static constexpr bool has_mask = false;
+        using arg_type = typename Slot::value_type;
+
+        static uint64_t value(const arg_type& v)
+        { return bit_cast<bits<Slot().nbits()>>(v).to_ullong(); }
+        static uint64_t mask(const arg_type&)
+        { return 0; }
+    };
+
+    template<class T>
+    struct static_slot<masked<T>> {
+        using type = T;
+        static constexpr bool has_mask = true;
+        using arg_type = field<T>;
+
+        static uint64_t value(const arg_type& f)
+        { return f.value_bits().to_ullong(); }
+        static uint64_t mask(const arg_type& f)
+        { return f.mask_bits().to_ullong(); }
+    };
+
+    template<class Slot>
+    struct static_tlv : static_slot<Slot> {
+        using base = static_slot<Slot>;
+        using T = typename base::type;
+        static_assert(T().nbits() <= 64, "Only fields up to 64 bits are supported");
+
+        static constexpr size_t nbytes = T().nbytes();
+        static constexpr size_t payload = nbytes * (base::has_mask ? 2 : 1);
+        static constexpr size_t length = 4 + payload;
+        static constexpr uint32_t header =
+            uint32_t(T().ns()) << 16 | uint32_t(T().id()) << 9 |
+            uint32_t(base::has_mask) << 8 | uint32_t(payload);
+
+        static uint8_t* put(uint8_t* p, uint64_t v, size_t n)
+        {
+            for (size_t i = n; i-- > 0; v >>= 8)
+                p[i] = uint8_t(v);
+            return p + n;
+        }
+
+        static uint8_t* pack(uint8_t* p, const typename base::arg_type& arg)
+        {
+            p = put(p, header, 4);
+            p = put(p, base::value(arg), nbytes);
+            if (base::has_mask)
+                p = put(p, base::mask(arg), nbytes);
+            return p;
+        }
+    };
+
+} // namespace detail
+
+/*
+ * OXM TLVs of a match with a fixed list of fields, laid out at compile
+ * time. Every slot is an oxm type matched exactly, taking its value
+ * type, or masked<type>, taking a field<type>:
+ *
+ *     using match = static_match<in_port, masked<eth_dst>>;
+ *     match::pack(buf, port, field<eth_dst>(mac, mask));
+ *
+ * writes exactly match::length bytes, same as FluidOXMAdapter would
+ * for these fields, without the virtual calls and type switches.
+ */
+template<class... Slots>
+struct static_match {
+    static constexpr size_t length = (detail::static_tlv<Slots>::length + ... + 0);
+
+    static uint8_t* pack(uint8_t* buffer,
+                         const typename detail::static_slot<Slots>::arg_type&... args)
+    {
+        ((buffer = detail::static_tlv<Slots>::pack(buffer, args)), ...);
+        return buffer;
+    }
+};
+
+} // namespace oxm
+} // namespace runos
@@ -0,0 +1,413 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "asyncredisclient.hpp"
+
+#include <runos/core/future.hpp>
+#include <runos/core/logging.hpp>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+namespace runos {
+
+using lock_t = std::unique_lock<std::mutex>;
+using Reply = AsyncRedisClient::Reply;
+
+static void encode(const AsyncRedisClient::Command& cmd, std::string& out)
+{
+    out += '*';
+    out += std::to_string(cmd.size());
+    out += "\r\n";
+    for (const auto& arg: cmd) {
+        out += '$';
+        out += std::to_string(arg.size());
+        out += "\r\n";
+        out += arg;
+        out += "\r\n";
+    }
+}
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
+
+AsyncRedisClient::~AsyncRedisClient()
+{
+    close();
+}
+
+bool AsyncRedisClient::connect(const std::string& host, int port,
+                               std::chrono::milliseconds timeout)
+{
+    close();
+
+    struct addrinfo hints, *info = nullptr;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err = getaddrinfo(host.c_str(), std::to_string(port).c_str(),
+                          &hints, &info);
+    if (err) {
+        LOG(ERROR) << "[AsyncRedisClient] getaddrinfo(" << host << "): "
+                   << gai_strerror(err);
+        return false;
+    }
+    std::unique_ptr<struct addrinfo, decltype(&freeaddrinfo)>
+        info_guard(info, &freeaddrinfo);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    if (fd < 0 || not set_nonblocking(fd) ||
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0)
+    {
+        if (fd >= 0) ::close(fd);
+        return false;
+    }
+
+    if (::connect(fd, info->ai_addr, info->ai_addrlen) != 0) {
+        struct pollfd pfd { fd, POLLOUT, 0 };
+        int soerr = 0;
+        socklen_t len = sizeof(soerr);
+        if (errno != EINPROGRESS ||
+            poll(&pfd, 1, timeout.count()) <= 0 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0 || soerr)
+        {
+            LOG(ERROR) << "[AsyncRedisClient] Can't connect to "
+                       << host << ":" << port;
+            ::close(fd);
+            return false;
+        }
+    }
+
+    int wake[2];
+    if (pipe(wake) < 0) {
+        ::close(fd);
+        return false;
+    }
+    set_nonblocking(wake[0]);
+    set_nonblocking(wake[1]);
+
+    lock_t lock(mutex_);
+    fd_ = fd;
+    wake_[0] = wake[0];
+    wake_[1] = wake[1];
+    stop_ = false;
+    loop_ = std::thread([this]() { run(); });
+    return true;
+}
+
+bool AsyncRedisClient::connected() const
+{
+    lock_t lock(mutex_);
+    return fd_ >= 0;
+}
+
+void AsyncRedisClient::close()
+{
+    {
+        lock_t lock(mutex_);
+        stop_ = true;
+    }
+    wakeup();
+    if (loop_.joinable()) {
+        loop_.join();
+    }
+
+    lock_t lock(mutex_);
+    for (int* fd: { &fd_, &wake_[0], &wake_[1] }) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void AsyncRedisClient::wakeup()
+{
+    lock_t lock(mutex_);
+    if (wake_[1] >= 0) {
+        char c = 0;
+        // a full pipe already guarantees a wakeup
+        (void) !write(wake_[1], &c, 1);
+    }
+}
+
+void AsyncRedisClient::submit(const std::vector<Command>& cmds,
+                              completion done)
+{
+    {
+        lock_t lock(mutex_);
+        if (fd_ < 0 || stop_) {
+            lock.unlock();
+            done({}, "not connected");
+            return;
+        }
+
+        for (const auto& cmd: cmds) {
+            encode(cmd, out_);
+        }
+        pending_.push_back(Pending{ cmds.size(), {}, std::move(done) });
+    }
+    wakeup();
+}
+
+future<Reply> AsyncRedisClient::command(Command cmd)
+{
+    auto promise = std::make_shared<boost::promise<Reply>>();
+    auto ret = promise->get_future();
+
+    submit({ std::move(cmd) },
+        [promise](std::vector<Reply>&& replies, const std::string& error) {
+            if (not error.empty()) {
+                promise->set_exception(redis_error(error));
+            } else {
+                promise->set_value(std::move(replies.front()));
+            }
+        });
+    return ret;
+}
+
+future<std::vector<Reply>>
+AsyncRedisClient::pipeline(std::vector<Command> cmds)
+{
+    auto promise = std::make_shared<boost::promise<std::vector<Reply>>>();
+    auto ret = promise->get_future();
+
+    if (cmds.empty()) {
+        promise->set_value({});
+        return ret;
+    }
+
+    submit(cmds,
+        [promise](std::vector<Reply>&& replies, const std::string& error) {
+            if (not error.empty()) {
+                promise->set_exception(redis_error(error));
+            } else {
+                promise->set_value(std::move(replies));
+            }
+        });
+    return ret;
+}
+
+future<std::vector<Reply>>
+AsyncRedisClient::transaction(std::vector<Command> cmds)
+{
+    auto promise = std::make_shared<boost::promise<std::vector<Reply>>>();
+    auto ret = promise->get_future();
+
+    cmds.insert(cmds.begin(), Command{ "MULTI" });
+    cmds.push_back(Command{ "EXEC" });
+
+    submit(cmds,
+        [promise](std::vector<Reply>&& replies, const std::string& error) {
+            if (not error.empty()) {
+                promise->set_exception(redis_error(error));
+                return;
+            }
+
+            auto& exec = replies.back();
+            if (exec.type != Reply::Type::Array) {
+                // EXECABORT error or nil reply of an aborted transaction
+                promise->set_exception(redis_error(
+                    exec.error() ? exec.str : "transaction aborted"));
+            } else {
+                promise->set_value(std::move(exec.elements));
+            }
+        });
+    return ret;
+}
+
+long AsyncRedisClient::parse(const char* data, size_t size, Reply& reply)
+{
+    const char* end = static_cast<const char*>(
+        std::memchr(data, '\n', size));
+    if (size == 0 || end == nullptr)
+        return 0;
+    if (end == data || end[-1] != '\r')
+        return -1;
+
+    long line = end - data + 1;
+    std::string header(data + 1, end - 1);
+
+    switch (data[0]) {
+    case '+':
+    case '-':
+        reply.type = data[0] == '+' ? Reply::Type::Status : Reply::Type::Error;
+        reply.str = std::move(header);
+        return line;
+
+    case ':':
+        reply.type = Reply::Type::Integer;
+        reply.integer = std::strtoll(header.c_str(), nullptr, 10);
+        return line;
+
+    case '$': {
+        long len = std::strtol(header.c_str(), nullptr, 10);
+        if (len < 0) {
+            reply.type = Reply::Type::Nil;
+            return line;
+        }
+        if (size < size_t(line + len + 2))
+            return 0;
+        reply.type = Reply::Type::Bulk;
+        reply.str.assign(data + line, len);
+        return line + len + 2;
+    }
+
+    case '*': {
+        long count = std::strtol(header.c_str(), nullptr, 10);
+        if (count < 0) {
+            reply.type = Reply::Type::Nil;
+            return line;
+        }
+        reply.type = Reply::Type::Array;
+        reply.elements.resize(count);
+
+        long pos = line;
+        for (auto& element: reply.elements) {
+            long n = parse(data + pos, size - pos, element);
+            if (n <= 0)
+                return n;
+            pos += n;
+        }
+        return pos;
+    }
+
+    default:
+        return -1;
+    }
+}
+
+void AsyncRedisClient::fail_all(const std::string& error)
+{
+    std::deque<Pending> failed;
+    {
+        lock_t lock(mutex_);
+        failed.swap(pending_);
+        out_.clear();
+        in_.clear();
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    LOG(ERROR) << "[AsyncRedisClient] " << error << ", "
+               << failed.size() << " requests failed";
+    for (auto& p: failed) {
+        p.done({}, error);
+    }
+}
+
+void AsyncRedisClient::run()
+{
+    char buf[16 * 1024];
+
+    for (;;) {
+        struct pollfd fds[2];
+        {
+            lock_t lock(mutex_);
+            if (stop_ || fd_ < 0)
+                break;
+            fds[0] = { fd_, short(POLLIN | (out_.empty() ? 0 : POLLOUT)), 0 };
+            fds[1] = { wake_[0], POLLIN, 0 };
+        }
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fail_all(std::string("poll: ") + std::strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            while (read(fds[1].fd, buf, sizeof(buf)) > 0) { }
+        }
+
+        if (fds[0].revents & POLLOUT) {
+            lock_t lock(mutex_);
+            ssize_t n = send(fd_, out_.data(), out_.size(), MSG_NOSIGNAL);
+            if (n > 0) {
+                out_.erase(0, n);
+            } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                lock.unlock();
+                fail_all(std::string("send: ") + std::strerror(errno));
+                break;
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(fds[0].fd, buf, sizeof(buf), 0);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                fail_all(n == 0 ? std::string("connection closed")
+                                : std::string("recv: ") + std::strerror(errno));
+                break;
+            }
+            if (n < 0)
+                continue;
+
+            std::vector<Pending> completed;
+            {
+                lock_t lock(mutex_);
+                in_.append(buf, n);
+
+                size_t pos = 0;
+                for (;;) {
+                    Reply reply;
+                    long used = parse(in_.data() + pos, in_.size() - pos, reply);
+                    if (used == 0)
+                        break;
+                    if (used < 0 || pending_.empty()) {
+                        lock.unlock();
+                        fail_all("protocol error");
+                        return;
+                    }
+                    pos += used;
+
+                    auto& front = pending_.front();
+                    front.replies.push_back(std::move(reply));
+                    if (front.replies.size() == front.expected) {
+                        completed.push_back(std::move(front));
+                        pending_.pop_front();
+                    }
+                }
+                in_.erase(0, pos);
+            }
+
+            // continuations must not run under the lock
+            for (auto& p: completed) {
+                p.done(std::move(p.replies), std::string());
+            }
+        }
+    }
+}
+
+} // namespace runos
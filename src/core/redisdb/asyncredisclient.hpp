@@ -0,0 +1,110 @@
+/*
+ * Copyright 2019 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <runos/core/exception.hpp>
+#include <runos/core/future-decl.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace runos {
+
+struct redis_error : exception_root, runtime_error_tag {
+    explicit redis_error(std::string reason) noexcept
+    {
+        with("reason", reason);
+    }
+};
+
+/**
+ * Asynchronous redis client driven by its own poll() event loop.
+ *
+ * Commands are encoded as RESP arrays (binary safe) and appended to a
+ * shared output buffer, so everything submitted before the loop wakes
+ * up goes out in one write and replies are matched to requests in FIFO
+ * order. pipeline() and transaction() submit a whole batch at once:
+ * N commands cost one round trip instead of N.
+ */
+class AsyncRedisClient {
+public:
+    struct Reply {
+        enum class Type { Status, Error, Integer, Bulk, Nil, Array };
+
+        Type type {Type::Nil};
+        std::string str; // status, error or bulk value
+        int64_t integer {0};
+        std::vector<Reply> elements;
+
+        bool error() const { return type == Type::Error; }
+    };
+
+    using Command = std::vector<std::string>;
+
+    AsyncRedisClient() = default;
+    ~AsyncRedisClient();
+
+    AsyncRedisClient(const AsyncRedisClient&) = delete;
+    AsyncRedisClient& operator=(const AsyncRedisClient&) = delete;
+
+    bool connect(const std::string& host, int port,
+                 std::chrono::milliseconds timeout
+                     = std::chrono::milliseconds(1000));
+    bool connected() const;
+    void close();
+
+    future<Reply> command(Command cmd);
+    future<std::vector<Reply>> pipeline(std::vector<Command> cmds);
+    // MULTI ... EXEC, the future holds the replies of the EXEC
+    future<std::vector<Reply>> transaction(std::vector<Command> cmds);
+
+    // Parses one RESP reply: returns consumed bytes, 0 if incomplete,
+    // -1 on protocol error
+    static long parse(const char* data, size_t size, Reply& reply);
+
+private:
+    using completion = std::function<void(std::vector<Reply>&&,
+                                          const std::string& error)>;
+
+    struct Pending {
+        size_t expected;
+        std::vector<Reply> replies;
+        completion done;
+    };
+
+    mutable std::mutex mutex_;
+    int fd_ {-1};
+    int wake_[2] {-1, -1};
+    bool stop_ {false};
+    std::string out_;
+    std::string in_;
+    std::deque<Pending> pending_;
+    std::thread loop_;
+
+    void submit(const std::vector<Command>& cmds, completion done);
+    void run();
+    void fail_all(const std::string& error);
+    void wakeup();
+};
+
+} // namespace runos
@@ -16,27 +16,111 @@
 
 #include "redisdatabase.hpp"
 
+#include <algorithm>
 #include <iostream>
 #include <cstdio>
 #include <string>
+#include <runos/core/future.hpp>
 #include <runos/core/logging.hpp>
+#include <runos/core/throw.hpp>
+
+#include <boost/thread/executors/inline_executor.hpp>
 
 namespace runos {
 
 using lock_t = std::lock_guard<std::mutex>;
+using read_lock_t = std::shared_lock<std::shared_mutex>;
+using write_lock_t = std::unique_lock<std::shared_mutex>;
+
+// Checks transaction replies in the event loop thread
+static boost::inline_executor reply_executor;
+
+namespace {
+
+// CRC16-CCITT (XMODEM), the key hash of redis cluster
+uint16_t crc16(const char* data, size_t size)
+{
+    uint16_t crc = 0;
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= uint16_t(uint8_t(data[i]) << 8);
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x8000) ? uint16_t((crc << 1) ^ 0x1021)
+                                 : uint16_t(crc << 1);
+        }
+    }
+    return crc;
+}
+
+} // namespace
+
+// Completion of the per node requests of one putHashValues
+struct RedisDatabase::Join {
+    std::mutex mutex;
+    size_t remaining {0};
+    std::string error;
+    promise<void> done;
+
+    void add(size_t n)
+    {
+        lock_t lock(mutex);
+        remaining += n;
+    }
 
-RedisDatabase::RedisDatabase() :
+    void finish(const std::string& failure)
+    {
+        std::string first;
+        { // lock
+            lock_t lock(mutex);
+            if (error.empty())
+                error = failure;
+            if (--remaining > 0)
+                return;
+            first = error;
+        } // unlock
+
+        if (first.empty()) {
+            done.set_value();
+        } else {
+            done.set_exception(redis_error(first));
+        }
+    }
+};
+
+RedisDatabase::RedisDatabase(size_t pool_size) :
     rclient(new SimpleRedisClient())
+  , pool_size_(std::max<size_t>(pool_size, 1))
   , connection_state_(-1)
 {
 }
 
+uint16_t RedisDatabase::hashSlot(const std::string& key)
+{
+    // Only a non-empty {hash tag} is hashed, so keys sharing it
+    // share the slot
+    auto open = key.find('{');
+    if (open != std::string::npos) {
+        auto close = key.find('}', open + 1);
+        if (close != std::string::npos && close > open + 1) {
+            return crc16(key.data() + open + 1, close - open - 1) % SLOTS;
+        }
+    }
+    return crc16(key.data(), key.size()) % SLOTS;
+}
+
 int RedisDatabase::connectToStore(const char* address, int port)
 {
     lock_t lock(client_mutex_);
     rclient->setHost(address);
     rclient->setPort(port);
     rclient->setBufferSize(2048*4);
+    address_ = address;
+    port_ = port;
+
+    NodePtr store;
+    { // lock
+        write_lock_t topology(topology_mutex_);
+        store = nodes_[add_node(address_, port_)];
+    } // unlock
 
     connection_state_ = rclient->redis_connect();
     if (connection_state_ < 0) {
@@ -48,14 +132,154 @@ int RedisDatabase::connectToStore(const char* address, int port)
     } else {
         LOG(WARNING) << "[RedisDatabase] REDIS(" << address << ":"
                      << port << ") connection is OK!";
+        for (auto& aclient : store->clients) {
+            aclient->connect(address_, port_);
+        }
     }
     return connection_state_;
 }
 
+int RedisDatabase::addNodes(const std::vector<Endpoint>& nodes, bool cluster)
+{
+    { // lock
+        write_lock_t lock(topology_mutex_);
+        cluster_ = cluster;
+        for (auto& node : nodes) {
+            add_node(node.address, node.port);
+        }
+    } // unlock
+
+    if (cluster) {
+        if (not load_slots()) {
+            LOG(ERROR) << "[RedisDatabase] REDIS CLUSTER SLOTS fail, the "
+                          "slot map is learned from MOVED redirections";
+            write_lock_t lock(topology_mutex_);
+            slots_.assign(SLOTS, 0);
+        }
+    } else {
+        write_lock_t lock(topology_mutex_);
+        slots_.resize(SLOTS);
+        for (size_t slot = 0; slot < SLOTS; ++slot) {
+            slots_[slot] = uint16_t(slot * nodes_.size() / SLOTS);
+        }
+    }
+
+    read_lock_t lock(topology_mutex_);
+    LOG(WARNING) << "[RedisDatabase] REDIS keys are sharded over "
+                 << nodes_.size() << (cluster ? " cluster" : "") << " nodes";
+    return int(nodes_.size());
+}
+
+size_t RedisDatabase::nodes() const
+{
+    read_lock_t lock(topology_mutex_);
+    return nodes_.size();
+}
+
+size_t RedisDatabase::add_node(const std::string& address, int port) const
+{
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+        if (nodes_[i]->address == address && nodes_[i]->port == port)
+            return i;
+    }
+
+    auto node = std::make_shared<Node>();
+    node->address = address;
+    node->port = port;
+    node->clients.resize(pool_size_);
+    for (auto& aclient : node->clients) {
+        aclient.reset(new AsyncRedisClient());
+    }
+    nodes_.push_back(std::move(node));
+    return nodes_.size() - 1;
+}
+
+bool RedisDatabase::load_slots()
+{
+    auto store = all_nodes().front();
+    auto reply = call(*store, { "CLUSTER", "SLOTS" });
+    if (reply.type != Reply::Type::Array)
+        return false;
+
+    write_lock_t lock(topology_mutex_);
+    slots_.assign(SLOTS, 0);
+    // [start, end, [host, port, id], replicas...] per slot range
+    for (auto& range : reply.elements) {
+        if (range.elements.size() < 3 || range.elements[2].elements.size() < 2)
+            continue;
+        auto& master = range.elements[2].elements;
+        auto host = master[0].str.empty() ? store->address : master[0].str;
+        auto node = add_node(host, int(master[1].integer));
+        for (auto slot = range.elements[0].integer;
+             slot <= range.elements[1].integer && slot < int64_t(SLOTS);
+             ++slot) {
+            slots_[slot] = uint16_t(node);
+        }
+    }
+    return true;
+}
+
+bool RedisDatabase::redirected(const Reply& reply) const
+{
+    // "MOVED 3999 127.0.0.1:6381"
+    if (not cluster_ || not reply.error() ||
+            reply.str.compare(0, 6, "MOVED ") != 0) {
+        return false;
+    }
+    auto space = reply.str.find(' ', 6);
+    auto colon = reply.str.rfind(':');
+    if (space == std::string::npos || colon == std::string::npos ||
+            colon < space) {
+        return false;
+    }
+
+    int slot, port;
+    try {
+        slot = std::stoi(reply.str.substr(6, space - 6));
+        port = std::stoi(reply.str.substr(colon + 1));
+    } catch (std::exception&) {
+        return false;
+    }
+    if (slot < 0 || slot >= int(SLOTS))
+        return false;
+
+    write_lock_t lock(topology_mutex_);
+    if (slots_.size() != SLOTS) {
+        slots_.assign(SLOTS, 0);
+    }
+    slots_[slot] = uint16_t(add_node(
+        reply.str.substr(space + 1, colon - space - 1), port));
+    VLOG(10) << "[RedisDatabase] REDIS slot " << slot << " moved to "
+             << reply.str.substr(space + 1);
+    return true;
+}
+
+auto RedisDatabase::node_of(const std::string& key) const -> NodePtr
+{
+    read_lock_t lock(topology_mutex_);
+    if (slots_.empty())
+        return nodes_.front();
+    return nodes_[slots_[hashSlot(key)]];
+}
+
+auto RedisDatabase::all_nodes() const -> std::vector<NodePtr>
+{
+    read_lock_t lock(topology_mutex_);
+    return nodes_;
+}
+
 int RedisDatabase::auth(const char* pswd)
 {
     lock_t lock(client_mutex_);
     int ret = rclient->auth(pswd);
+    password_ = pswd;
+    for (auto& node : all_nodes()) {
+        for (auto& aclient : node->clients) {
+            if (aclient->connected()) {
+                aclient->command({ "AUTH", password_ });
+            }
+        }
+    }
     if (ret < 0) {
         LOG(ERROR) << "[RedisDatabase] REDIS authorization ERROR(" << ret
                    << "): authorization is not passed (Incorrect password).";
@@ -79,64 +303,441 @@ void RedisDatabase::closeConnection()
 {
     lock_t lock(client_mutex_);
 	rclient->redis_close();
+    for (auto& node : all_nodes()) {
+        for (auto& aclient : node->clients) {
+            aclient->close();
+        }
+    }
 }
 
 int RedisDatabase::putValue(const std::string& key, const std::string& value)
 {
+    auto reply = call({ "SET", key, value });
+    return reply.error() ? -1 : 1;
+}
+
+AsyncRedisClient& RedisDatabase::client(Node& node) const
+{
+    // Handed out round robin, once per thread
+    static std::atomic<size_t> threads {0};
+    thread_local size_t ticket = threads++;
+
+    auto& aclient = *node.clients[ticket % node.clients.size()];
+    if (aclient.connected())
+        return aclient;
+
     lock_t lock(client_mutex_);
-    int ret = rclient->set(key.c_str(), value.c_str());
-    if (ret < 0) {
-        LOG(ERROR) << "[RedisDatabase] REDIS SET(" << key
-                   << ") fail: ERROR(" << ret << ").";
-        return -1;
+    if (connection_state_ >= 0 && not aclient.connected()) {
+        if (aclient.connect(node.address, node.port) &&
+                not password_.empty()) {
+            // Replies are ordered, so later commands wait for AUTH
+            aclient.command({ "AUTH", password_ });
+        }
     }
-    return ret;
+    return aclient;
 }
 
-std::string RedisDatabase::getValue(const std::string& key) const
+auto RedisDatabase::request(Node& node, Command cmd) const -> Reply
 {
-    lock_t lock(client_mutex_);
-    std::string str;
-    int ret = rclient->get(key.c_str());
+    try {
+        return client(node).command(std::move(cmd)).get();
+    } catch (redis_error& e) {
+        Reply ret;
+        ret.type = Reply::Type::Error;
+        ret.str = e.what();
+        return ret;
+    }
+}
 
-    if (ret < 0) {
-        LOG(ERROR) << "[RedisDatabase] REDIS GET(" << key
-                   << ") fail: ERROR(" << ret << ").";
+auto RedisDatabase::call(Node& node, Command cmd) const -> Reply
+{
+    std::string name = cmd.front();
+    auto reply = request(node, std::move(cmd));
+    if (reply.error()) {
+        LOG(ERROR) << "[RedisDatabase] REDIS " << name
+                   << " fail: " << reply.str;
+    }
+    return reply;
+}
+
+auto RedisDatabase::call(Command cmd) const -> Reply
+{
+    std::string name = cmd.front();
+    const std::string key = cmd.size() > 1 ? cmd[1] : std::string();
+
+    Reply reply;
+    if (not cluster_) {
+        reply = request(*node_of(key), std::move(cmd));
     } else {
-        char* gr = rclient->getData();
-        if (gr != 0) {
-            str = std::string(gr);
+        // Asked once more of the new owner of a moved slot
+        reply = request(*node_of(key), cmd);
+        if (redirected(reply)) {
+            reply = request(*node_of(key), std::move(cmd));
+        }
+    }
+
+    if (reply.error()) {
+        LOG(ERROR) << "[RedisDatabase] REDIS " << name
+                   << " fail: " << reply.str;
+    }
+    return reply;
+}
+
+void RedisDatabase::put_batch(NodePtr node, std::vector<Command> cmds,
+                              std::shared_ptr<Join> join, bool retry) const
+{
+    if (not cluster_) {
+        client(*node).transaction(std::move(cmds)).then(reply_executor,
+            [join](future<std::vector<Reply>> f) {
+                std::string error;
+                try {
+                    for (auto& reply : f.get()) {
+                        if (reply.error()) {
+                            error = reply.str;
+                            break;
+                        }
+                    }
+                } catch (redis_error& e) {
+                    error = e.what();
+                }
+                join->finish(error);
+            });
+        return;
+    }
+
+    // A cluster refuses transactions across slots: one HSET per key,
+    // kept until the replies for MOVED ones
+    auto sent = std::make_shared<std::vector<Command>>(cmds);
+    client(*node).pipeline(std::move(cmds)).then(reply_executor,
+        [this, sent, join, retry](future<std::vector<Reply>> f) {
+            std::string error;
+            std::map<Node*, std::pair<NodePtr, std::vector<Command>>> moved;
+            try {
+                auto replies = f.get();
+                for (size_t i = 0; i < replies.size(); ++i) {
+                    auto& cmd = (*sent)[i];
+                    if (retry && redirected(replies[i])) {
+                        auto owner = node_of(cmd[1]);
+                        auto& batch = moved[owner.get()];
+                        batch.first = std::move(owner);
+                        batch.second.push_back(std::move(cmd));
+                    } else if (replies[i].error() && error.empty()) {
+                        error = replies[i].str;
+                    }
+                }
+            } catch (redis_error& e) {
+                error = e.what();
+            }
+
+            join->add(moved.size());
+            for (auto& batch : moved) {
+                put_batch(std::move(batch.second.first),
+                          std::move(batch.second.second), join, false);
+            }
+            join->finish(error);
+        });
+}
+
+future<void> RedisDatabase::putHashValues(std::vector<HashValue> values)
+{
+    // One transaction per node, or one HSET per key in a cluster
+    struct Batch {
+        NodePtr node;
+        std::vector<Command> cmds;
+        std::map<std::string, size_t> keys;
+    };
+    std::map<Node*, Batch> batches;
+    for (auto& v : values) {
+        auto node = node_of(v.key);
+        auto& batch = batches[node.get()];
+        batch.node = std::move(node);
+
+        auto it = cluster_ ? batch.keys.find(v.key) : batch.keys.end();
+        if (batch.keys.end() != it) {
+            auto& cmd = batch.cmds[it->second];
+            cmd.push_back(std::move(v.field));
+            cmd.push_back(std::move(v.value));
+            continue;
         }
+        if (cluster_) {
+            batch.keys.emplace(v.key, batch.cmds.size());
+        }
+        batch.cmds.push_back({ "HSET", std::move(v.key),
+                               std::move(v.field), std::move(v.value) });
+    }
+
+    auto join = std::make_shared<Join>();
+    auto ret = join->done.get_future();
+    if (batches.empty()) {
+        join->done.set_value();
+        return ret;
     }
-    return str;
+
+    join->add(batches.size());
+    for (auto& batch : batches) {
+        put_batch(std::move(batch.second.node),
+                  std::move(batch.second.cmds), join, cluster_);
+    }
+    return ret;
 }
 
-int RedisDatabase::delValue(const std::string& key)
+int RedisDatabase::putHashValue(const std::string& key,
+                                const std::string& field,
+                                const std::string& value)
 {
-    lock_t lock(client_mutex_);
-    int ret = rclient->del(key.c_str());
-    if (ret < 0) {
-        LOG(ERROR) << "[RedisDatabase] REDIS DEL(" << key
-                   << ") fail: ERROR(" << ret << ").";
+    auto reply = call({ "HSET", key, field, value });
+    return reply.type == Reply::Type::Integer ? reply.integer : -1;
+}
+
+std::string RedisDatabase::getHashValue(const std::string& key,
+                                        const std::string& field) const
+{
+    auto reply = call({ "HGET", key, field });
+    return reply.type == Reply::Type::Bulk ? reply.str : std::string();
+}
+
+int RedisDatabase::delHashValue(const std::string& key,
+                                const std::string& field)
+{
+    auto reply = call({ "HDEL", key, field });
+    return reply.type == Reply::Type::Integer ? reply.integer : -1;
+}
+
+std::map<std::string, std::string>
+RedisDatabase::getHashValues(const std::string& key) const
+{
+    std::map<std::string, std::string> ret;
+
+    // HSCAN may repeat fields, the map drops duplicates
+    std::string cursor = "0";
+    do {
+        auto reply = call({ "HSCAN", key, cursor, "COUNT", "1000" });
+        if (reply.type != Reply::Type::Array || reply.elements.size() != 2)
+            break;
+
+        cursor = reply.elements[0].str;
+        auto& items = reply.elements[1].elements;
+        for (size_t i = 0; i + 1 < items.size(); i += 2) {
+            ret[items[i].str] = std::move(items[i + 1].str);
+        }
+    } while (cursor != "0");
+
+    return ret;
+}
+
+std::vector<std::map<std::string, std::string>>
+RedisDatabase::getHashesValues(const std::vector<std::string>& keys) const
+{
+    std::vector<std::map<std::string, std::string>> ret(keys.size());
+
+    // Unfinished hashes: index in keys and HSCAN cursor
+    std::vector<std::pair<size_t, std::string>> scans;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        scans.emplace_back(i, "0");
+    }
+
+    auto hscan = [&keys](const std::pair<size_t, std::string>& scan) {
+        return Command { "HSCAN", keys[scan.first], scan.second,
+                         "COUNT", "1000" };
+    };
+
+    while (not scans.empty()) {
+        // One pipeline per node, all of them sent before any is waited
+        struct Batch {
+            NodePtr node;
+            std::vector<size_t> scans;
+            future<std::vector<Reply>> replies;
+        };
+        std::map<Node*, Batch> batches;
+        for (size_t i = 0; i < scans.size(); ++i) {
+            auto node = node_of(keys[scans[i].first]);
+            auto& batch = batches[node.get()];
+            batch.node = std::move(node);
+            batch.scans.push_back(i);
+        }
+        for (auto& pair : batches) {
+            auto& batch = pair.second;
+            std::vector<Command> cmds;
+            for (auto i : batch.scans) {
+                cmds.push_back(hscan(scans[i]));
+            }
+            batch.replies = client(*batch.node).pipeline(std::move(cmds));
+        }
+
+        std::vector<std::pair<size_t, std::string>> next;
+        for (auto& pair : batches) {
+            auto& batch = pair.second;
+            std::vector<Reply> replies;
+            try {
+                replies = batch.replies.get();
+            } catch (redis_error& e) {
+                LOG(ERROR) << "[RedisDatabase] REDIS HSCAN fail: "
+                           << e.what();
+                continue;
+            }
+
+            for (size_t j = 0; j < batch.scans.size(); ++j) {
+                auto& scan = scans[batch.scans[j]];
+                auto reply = j < replies.size() ? std::move(replies[j])
+                                                : Reply();
+                if (cluster_ && redirected(reply)) {
+                    // Asked once more of the new owner of the slot
+                    reply = call(hscan(scan));
+                } else if (reply.error()) {
+                    LOG(ERROR) << "[RedisDatabase] REDIS HSCAN fail: "
+                               << reply.str;
+                }
+                if (reply.type != Reply::Type::Array ||
+                        reply.elements.size() != 2)
+                    continue;
+
+                // HSCAN may repeat fields, the map drops duplicates
+                auto& values = ret[scan.first];
+                auto& items = reply.elements[1].elements;
+                for (size_t i = 0; i + 1 < items.size(); i += 2) {
+                    values[items[i].str] = std::move(items[i + 1].str);
+                }
+                if (reply.elements[0].str != "0") {
+                    next.emplace_back(scan.first,
+                                      std::move(reply.elements[0].str));
+                }
+            }
+        }
+        scans = std::move(next);
+    }
+
+    return ret;
+}
+
+int RedisDatabase::delKeys(const std::vector<std::string>& keys)
+{
+    if (keys.empty())
+        return 0;
+
+    if (nodes() == 1) {
+        Command cmd { "DEL" };
+        cmd.insert(cmd.end(), keys.begin(), keys.end());
+        auto reply = call(std::move(cmd));
+        return reply.type == Reply::Type::Integer ? reply.integer : -1;
+    }
+
+    // Sharded: one pipeline of single-key DELs per node
+    std::map<Node*, std::pair<NodePtr, std::vector<Command>>> batches;
+    for (auto& key : keys) {
+        auto node = node_of(key);
+        auto& batch = batches[node.get()];
+        batch.first = std::move(node);
+        batch.second.push_back({ "DEL", key });
+    }
+
+    int ret = 0;
+    for (auto& batch : batches) {
+        std::vector<Reply> replies;
+        try {
+            replies = client(*batch.second.first)
+                          .pipeline(batch.second.second).get();
+        } catch (redis_error& e) {
+            LOG(ERROR) << "[RedisDatabase] REDIS DEL fail: " << e.what();
+            return -1;
+        }
+        for (size_t i = 0; i < replies.size(); ++i) {
+            auto& reply = replies[i];
+            if (redirected(reply)) {
+                reply = call(std::move(batch.second.second[i]));
+            }
+            if (reply.type != Reply::Type::Integer)
+                return -1;
+            ret += int(reply.integer);
+        }
     }
     return ret;
 }
 
+std::string RedisDatabase::getValue(const std::string& key) const
+{
+    // On the pool: every missed hash field falls back here
+    auto reply = call({ "GET", key });
+    return reply.type == Reply::Type::Bulk ? reply.str : std::string();
+}
+
+int RedisDatabase::delValue(const std::string& key)
+{
+    auto reply = call({ "DEL", key });
+    return reply.type == Reply::Type::Integer ? reply.integer : -1;
+}
+
 std::vector<std::string>
 RedisDatabase::getKeys(const std::string& key_pattern) const
 {
-    lock_t lock(client_mutex_);
     std::vector<std::string> keys;
-    int n = rclient->keys(std::string{key_pattern + "*"}.c_str());
-    if (n > 0) {
-        auto ret = rclient->getMultiBulkVectorData();
-        if (ret > 0) {
-            keys = rclient->getVectorData();
-        }
+
+    // Every node has its own keyspace
+    for (auto& node : all_nodes()) {
+        std::string cursor = "0";
+        do {
+            auto reply = call(*node, { "SCAN", cursor, "MATCH",
+                                       key_pattern + "*", "COUNT", "1000" });
+            if (reply.type != Reply::Type::Array ||
+                    reply.elements.size() != 2)
+                break;
+
+            cursor = reply.elements[0].str;
+            for (auto& key : reply.elements[1].elements) {
+                keys.push_back(std::move(key.str));
+            }
+        } while (cursor != "0");
     }
+
+    // SCAN may repeat keys
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
     return keys;
 }
 
+std::vector<std::string>
+RedisDatabase::getHashKeys(const std::string& key_pattern) const
+{
+    auto keys = getKeys(key_pattern);
+    if (keys.empty())
+        return keys;
+
+    std::map<Node*, std::pair<NodePtr, std::vector<size_t>>> batches;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto node = node_of(keys[i]);
+        auto& batch = batches[node.get()];
+        batch.first = std::move(node);
+        batch.second.push_back(i);
+    }
+
+    std::vector<bool> hash(keys.size(), false);
+    for (auto& batch : batches) {
+        std::vector<Command> cmds;
+        cmds.reserve(batch.second.second.size());
+        for (size_t i : batch.second.second) {
+            cmds.push_back({ "TYPE", keys[i] });
+        }
+
+        std::vector<Reply> types;
+        try {
+            types = client(*batch.second.first).pipeline(std::move(cmds)).get();
+        } catch (redis_error& e) {
+            LOG(ERROR) << "[RedisDatabase] REDIS TYPE fail: " << e.what();
+            return { };
+        }
+        for (size_t j = 0; j < types.size(); ++j) {
+            hash[batch.second.second[j]] = types[j].str == "hash";
+        }
+    }
+
+    std::vector<std::string> ret;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (hash[i]) {
+            ret.push_back(std::move(keys[i]));
+        }
+    }
+    return ret;
+}
+
 Json RedisDatabase::getDoc(const char* key) const
 {
     Json doc = nullptr;
@@ -153,8 +754,20 @@ Json RedisDatabase::getDoc(const char* key) const
 
 int RedisDatabase::clearDB()
 {
-    lock_t lock(client_mutex_);
-    int ret = rclient->flushall();
+    int ret;
+    { // lock
+        lock_t lock(client_mutex_);
+        ret = rclient->flushall();
+    } // unlock
+
+    // The store itself is flushed above
+    auto nodes = all_nodes();
+    for (size_t i = 1; i < nodes.size() && ret >= 0; ++i) {
+        if (call(*nodes[i], { "FLUSHALL" }).error()) {
+            ret = -1;
+        }
+    }
+
     if (ret < 0) {
         LOG(ERROR) << "[RedisDatabase] REDIS FLUSHALL fail.";
     } else {
@@ -164,7 +777,6 @@ int RedisDatabase::clearDB()
 
     return ret;
 }
-
 int RedisDatabase::setupMasterRole()
 {
     lock_t lock(client_mutex_);
@@ -18,20 +18,53 @@
 #define REDISDATABASE_H
 
 #include "redisclient.hpp"
+#include "asyncredisclient.hpp"
 
+#include <atomic>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <utility>
+#include <vector>
 #include <json11.hpp>
 
 namespace runos {
 
+/**
+ * Commands go over a pool of asynchronous connections. A thread keeps
+ * using the one it was given first, so everything a thread sends stays
+ * ordered while threads don't wait behind each other's replies.
+ *
+ * Keys can be sharded over several nodes by redis cluster hash slots
+ * (CRC16 of the key or of its {hash tag}, modulo 16384), each node
+ * with its own pool.
+ */
 class RedisDatabase
 {
 public:
-    RedisDatabase();
+    static constexpr size_t SLOTS = 16384;
+
+    struct Endpoint {
+        std::string address;
+        int port;
+    };
+
+    explicit RedisDatabase(size_t pool_size = 1);
     ~RedisDatabase() = default;
 
     int connectToStore(const char* address, int port);
+    /*!
+     * \brief addNodes shards the keys over the store and `nodes`. With
+     * `cluster` the nodes form a Redis Cluster: the slot map is read
+     * with CLUSTER SLOTS and follows MOVED redirections. Otherwise the
+     * slots are split evenly between the store and `nodes`, in order.
+     * \return if (ret < 0) then ERROR else the number of nodes
+     */
+    int addNodes(const std::vector<Endpoint>& nodes, bool cluster);
+    size_t nodes() const;
+    static uint16_t hashSlot(const std::string& key);
     int auth(const char* pswd);
     bool hasConnection();
     void closeConnection();
@@ -45,6 +78,60 @@ public:
      */
     int putValue(const std::string& key, const std::string& value);
 
+    // Methods for hash values: one redis hash per prefix, so listing
+    // and loading a prefix never needs a KEYS scan of the whole store
+    struct HashValue {
+        std::string key;
+        std::string field;
+        std::string value;
+    };
+
+    /*!
+     * \brief putHashValues writes all values in one MULTI/EXEC
+     * transaction, pipelined on the asynchronous connection (one round trip).
+     * Sharded, there is one transaction per node (per slot in a cluster).
+     * \return future that is ready when the transactions are executed
+     */
+    future<void> putHashValues(std::vector<HashValue> values);
+
+    /*!
+     * \return if (ret < 0) then ERROR else the number of new fields
+     */
+    int putHashValue(const std::string& key, const std::string& field,
+                     const std::string& value);
+
+    /*!
+     * \return the value of the hash field or empty string
+     */
+    std::string getHashValue(const std::string& key,
+                             const std::string& field) const;
+
+    /*!
+     * \return if (ret < 0) then ERROR else the number of deleted fields
+     */
+    int delHashValue(const std::string& key, const std::string& field);
+
+    /*!
+     * \brief getHashValues reads the whole hash with HSCAN cursor
+     * iteration, in bounded steps that don't block the server
+     */
+    std::map<std::string, std::string> getHashValues(const std::string& key) const;
+
+    /*!
+     * \brief getHashesValues reads many hashes at once: every HSCAN
+     * step of all of them is pipelined per node, the nodes are asked
+     * concurrently
+     * \return values of the hashes, in the order of `keys`
+     */
+    std::vector<std::map<std::string, std::string>>
+    getHashesValues(const std::vector<std::string>& keys) const;
+
+    /*!
+     * \brief delKeys deletes keys in one pipelined request
+     * \return if (ret < 0) then ERROR else the number of deleted keys
+     */
+    int delKeys(const std::vector<std::string>& keys);
+
     /*!
      * \brief getValue
      * \param key
@@ -60,12 +147,16 @@ public:
     int delValue(const std::string& key);
 
      /*!
-     * \brief getKeys method to get all keys 
+     * \brief getKeys method to get all keys starting with key_pattern,
+     * iterated with SCAN cursor instead of KEYS
      * \param key_pattern
      * \return vector of keys
      */
     std::vector<std::string> getKeys(const std::string& key_pattern) const;
 
+    // Same as getKeys, but only the keys holding hashes
+    std::vector<std::string> getHashKeys(const std::string& key_pattern) const;
+
     /*!
      * \brief get_doc
      * \param key
@@ -80,6 +171,8 @@ public:
     int clearDB();
 
     // Methods for Redis Database control [Redis version > 3.0]
+    // Replication roles are set on the first node only, sharded nodes
+    // are replicated by their own configuration
     /*!
      * \brief setupMasterRole method to setup Master Role for this data store node in Redis cluster (replication mode)
      * \return if (ret < 0) then ERROR else the number of receiving bytes
@@ -94,7 +187,47 @@ public:
     int setupSlaveOf(const char* address, int port);
 
 private:
+    using Reply = AsyncRedisClient::Reply;
+    using Command = AsyncRedisClient::Command;
+
+    struct Node {
+        std::string address;
+        int port;
+        std::vector<std::unique_ptr<AsyncRedisClient>> clients;
+    };
+    using NodePtr = std::shared_ptr<Node>;
+
+    struct Join;
+
+    NodePtr node_of(const std::string& key) const;
+    std::vector<NodePtr> all_nodes() const;
+    // Index of the node, added if new; under the topology lock
+    size_t add_node(const std::string& address, int port) const;
+    // Follows "MOVED slot host:port", false for other replies
+    bool redirected(const Reply& reply) const;
+    bool load_slots();
+
+    // Connection of the calling thread to the node, connected
+    AsyncRedisClient& client(Node& node) const;
+    // Errors, connection ones included, come back as error replies
+    Reply request(Node& node, Command cmd) const;
+    // Synchronous request on the connection of the calling thread, to
+    // the node of the key in cmd[1]
+    Reply call(Command cmd) const;
+    Reply call(Node& node, Command cmd) const;
+    // Sends a putHashValues batch of one node, `retry` once redirected
+    void put_batch(NodePtr node, std::vector<Command> cmds,
+                   std::shared_ptr<Join> join, bool retry) const;
+
     std::unique_ptr<SimpleRedisClient> rclient;
+    const size_t pool_size_;
+    mutable std::shared_mutex topology_mutex_;
+    mutable std::vector<NodePtr> nodes_; // the store first
+    mutable std::vector<uint16_t> slots_; // node per slot, empty: one node
+    bool cluster_ {false};
+    std::string address_;
+    std::string password_;
+    int port_ {0};
     int connection_state_;
     mutable std::mutex client_mutex_;
 };
@@ -164,11 +164,11 @@ Net = function () {
     }
 
     function updateTopo () {
-        Server.ajax('GET', '/switches/', updateSwitches, ctrlOff);
-        Server.ajax('GET', '/switches/ports/stats/', updateMassPortStats);
+        // switches, port stats and links come in one snapshot
+        // shared with every other open UI
+        Server.ajax('GET', '/dashboard/', updateDashboard, ctrlOff);
         Server.ajax('GET', '/bridge_domains/', updateDomains);
         Server.ajax('GET', '/aux-devices/', updateDevices);
-        Server.ajax('GET', '/links/', updateLinks);
         Server.ajax('GET', '/cisco_links/', updateCiscoLinks);
         if(UI.showMulticastTree !== undefined && UI.showMulticastTree != false)
             Server.ajax('GET', '/multicast_group/' + Net.multicast_tree["group-name"] + '/', updateMulticastTree);
@@ -186,6 +186,18 @@ Net = function () {
                 document.body.querySelector('.ctrl-status').classList.toggle('ctrl-status_down', true);
         }
 
+        function updateDashboard (response) {
+            if (!response["switches"] || !response["switches"]["array"]) {
+                ctrlOff();
+                return;
+            }
+            updateSwitches(response["switches"]);
+            if (response["ports"] && response["ports"]["array"])
+                updateMassPortStats(response["ports"]);
+            if (response["links"] && response["links"]["array"])
+                updateLinks(response["links"]);
+        }
+
         function updateSwitches (response) {
             ctrlOn();
 
@@ -237,9 +237,11 @@ Recovery = function () {
         }
     }
     function getServerData() {
-        Server.ajax('GET', '/recovery/', response);
+        Server.ajax('GET', '/dashboard/', response);
         function response(responseData) {
-            var dataArray = responseData.array;
+            if (!responseData.recovery || !responseData.recovery.array)
+                return;
+            var dataArray = responseData.recovery.array;
             normalizeData(dataArray);
             checkChangedData(dataArray);
             data.lastUpdate = getCurrentTime();